@@ -28,15 +28,21 @@
 #include "kNet/Clock.h"
 #include "kNet/DataDeserializer.h"
 #include "kNet/DataSerializer.h"
+#include "kNet/DeserializeArena.h"
 #include "kNet/EndPoint.h"
 #include "kNet/Event.h"
 #include "kNet/EventArray.h"
 #include "kNet/IMessageHandler.h"
 #include "kNet/INetworkServerListener.h"
+#include "kNet/LatencyHistogram.h"
 #include "kNet/Lockable.h"
 #include "kNet/MaxHeap.h"
 #include "kNet/MessageConnection.h"
 #include "kNet/MessageListParser.h"
+#include "kNet/MessageSchema.h"
+#include "kNet/MessageTracer.h"
+#include "kNet/MessageView.h"
+#include "kNet/MetricsExporter.h"
 #include "kNet/NetException.h"
 #include "kNet/Network.h"
 #include "kNet/NetworkLogging.h"
@@ -32,3 +32,60 @@
 // See http://gcc.gnu.org/onlinedocs/gcc-4.1.2/gcc/Atomic-Builtins.html
 #define CmpXChgPointer(dst, newVal, cmp) __sync_bool_compare_and_swap((dst), (cmp), (newVal))
 #endif
+
+// bool CmpXChg64(volatile u64 *dst, u64 newVal, u64 cmp);
+// Same as CmpXChgPointer, but always operates on a 64-bit value, also on 32-bit platforms.
+
+#ifdef WIN32
+#define CmpXChg64(dst, newVal, cmp) (InterlockedCompareExchange64((volatile LONGLONG*)(dst), (LONGLONG)(newVal), (LONGLONG)(cmp)) == (LONGLONG)(cmp))
+#else
+#define CmpXChg64(dst, newVal, cmp) __sync_bool_compare_and_swap((dst), (cmp), (newVal))
+#endif
+
+// bool CmpXChgLong(volatile long *dst, long newVal, long cmp);
+// Same as CmpXChgPointer, but operates on a long.
+
+#ifdef WIN32
+#define CmpXChgLong(dst, newVal, cmp) (InterlockedCompareExchange((dst), (newVal), (cmp)) == (cmp))
+#else
+#define CmpXChgLong(dst, newVal, cmp) __sync_bool_compare_and_swap((dst), (cmp), (newVal))
+#endif
+
+// long AtomicIncrement(volatile long *dst);
+// long AtomicDecrement(volatile long *dst);
+// Atomically increments or decrements *dst by one, and returns the new value.
+
+#ifdef WIN32
+#define AtomicIncrement(dst) InterlockedIncrement((dst))
+#define AtomicDecrement(dst) InterlockedDecrement((dst))
+#else
+#define AtomicIncrement(dst) __sync_add_and_fetch((dst), 1)
+#define AtomicDecrement(dst) __sync_sub_and_fetch((dst), 1)
+#endif
+
+// void AtomicAdd(volatile long *dst, long value);
+// Atomically adds value to *dst.
+
+#ifdef WIN32
+#define AtomicAdd(dst, value) ((void)InterlockedExchangeAdd((dst), (value)))
+#else
+#define AtomicAdd(dst, value) ((void)__sync_add_and_fetch((dst), (value)))
+#endif
+
+// long AtomicFetchAdd(volatile long *dst, long value);
+// Atomically adds value to *dst, and returns the value *dst had before the addition.
+
+#ifdef WIN32
+#define AtomicFetchAdd(dst, value) InterlockedExchangeAdd((dst), (value))
+#else
+#define AtomicFetchAdd(dst, value) __sync_fetch_and_add((dst), (value))
+#endif
+
+// void FullMemoryBarrier();
+// Prevents the compiler and the processor from reordering memory accesses across this point.
+
+#ifdef WIN32
+#define FullMemoryBarrier() MemoryBarrier()
+#else
+#define FullMemoryBarrier() __sync_synchronize()
+#endif
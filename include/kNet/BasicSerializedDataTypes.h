@@ -87,4 +87,19 @@ template<> struct SerializedDataTypeTraits<char*> { static const BasicSerialized
 template<> struct SerializedDataTypeTraits<const char*> { static const BasicSerializedDataType type = SerialString; static const int bitSize = 0; };
 template<> struct SerializedDataTypeTraits<std::string> { static const BasicSerializedDataType type = SerialString; static const int bitSize = 0; };
 
+/// Tells whether DataSerializer::Add<T>() and DataDeserializer::Read<T>() store the values of type T as their raw bytes,
+/// so that an array of them can be copied as a single block.
+template<typename T> struct IsRawSerializedType { static const bool value = false; };
+template<> struct IsRawSerializedType<char> { static const bool value = true; };
+template<> struct IsRawSerializedType<u8> { static const bool value = true; };
+template<> struct IsRawSerializedType<s8> { static const bool value = true; };
+template<> struct IsRawSerializedType<u16> { static const bool value = true; };
+template<> struct IsRawSerializedType<s16> { static const bool value = true; };
+template<> struct IsRawSerializedType<u32> { static const bool value = true; };
+template<> struct IsRawSerializedType<s32> { static const bool value = true; };
+template<> struct IsRawSerializedType<u64> { static const bool value = true; };
+template<> struct IsRawSerializedType<s64> { static const bool value = true; };
+template<> struct IsRawSerializedType<float> { static const bool value = true; };
+template<> struct IsRawSerializedType<double> { static const bool value = true; };
+
 } // ~kNet
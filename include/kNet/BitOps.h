@@ -38,6 +38,22 @@ inline int CountBitsSet(u32 value)
 	return bits;
 }
 
+/// Returns the zero-based index of the lowest set bit in the given value, or -1 if value == 0.
+inline int LSBIndex64(u64 value)
+{
+	// The isolated LSB multiplied by a de Bruijn sequence maps each bit position to a unique 6-bit pattern.
+	static const int lsbIndex[64] =
+	{
+		 0,  1, 48,  2, 57, 49, 28,  3, 61, 58, 50, 42, 38, 29, 17,  4,
+		62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12,  5,
+		63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+		46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19,  9, 13,  8,  7,  6
+	};
+	if (value == 0)
+		return -1;
+	return lsbIndex[((value & (~value + 1)) * 0x03F79D71B4CB0A89ULL) >> 58];
+}
+
 // Clears the LSB bit and returns the zero-based index of where the bit was set.
 inline int ExtractLSB(unsigned long *value)
 {
@@ -0,0 +1,38 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file CRC32C.h
+	@brief The CRC32C functions, which compute the CRC-32C checksums of the datagrams kNet sends out. */
+
+#include <cstddef>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+/// Computes the CRC-32C (Castagnoli) checksum of the given bytes. Uses the crc32 instruction of SSE4.2 on x86 CPUs that
+/// have it, and the CRC32 instructions of ARMv8 when the build targets them. Otherwise falls back to CRC32CPortable().
+/// [thread-safe]
+/// @param crc The checksum of the bytes that precede these ones, to compute a checksum in parts. 0 for the first part.
+u32 CRC32C(const void *data, size_t numBytes, u32 crc = 0);
+
+/// Computes the same checksum as CRC32C() with lookup tables, eight bytes at a time, without the CPU instructions. [thread-safe]
+u32 CRC32CPortable(const void *data, size_t numBytes, u32 crc = 0);
+
+/// Returns true if CRC32C() uses the CPU instructions. [thread-safe]
+bool CRC32CHardwareAccelerated();
+
+} // ~kNet
@@ -29,7 +29,12 @@ typedef unsigned long long tick_t;
 /** @brief High-resolution timing and system time.
 
 	Gives out timing information in various forms. Use this rather than 
-	any platform-dependent perf-counters or rdtsc or whatever.*/
+	any platform-dependent perf-counters or rdtsc or whatever.
+
+	If kNet is built with KNET_USE_TSC_CLOCK on x86 and the CPU has an invariant time-stamp counter, the ticks are read
+	directly from the counter, and TicksPerSec() is its frequency as calibrated against the system clock at startup.
+	Otherwise the ticks come from the monotonic system clock. Either way, the ticks a single thread reads never decrease.
+	Ticks read during static initialization, before the calibration, are not comparable to the later ones.*/
 class Clock
 {
 public:
@@ -72,6 +77,28 @@ public:
 	/// @return How many ticks make up a second.
 	static tick_t TicksPerSec(); 
 
+	/// Returns true if the ticks are read from the time-stamp counter of the CPU. See KNET_USE_TSC_CLOCK.
+	static bool UsesTSC();
+
+	/// Reads the current tick and caches it for the calling thread as its loop tick. The network worker threads call
+	/// this once per round, after they wake up.
+	/// @return The new loop tick.
+	static tick_t UpdateLoopTick();
+
+	/// Returns the tick the calling thread cached last with UpdateLoopTick(), or the current tick if the thread has not
+	/// cached one. For the timestamps that need millisecond precision at most, this saves reading the clock repeatedly
+	/// while a round of work is processed. Lags Tick() by the time the round has taken so far.
+	static tick_t LoopTick();
+
+	/// Stops the calling thread from using a cached loop tick, so that LoopTick() returns the current tick again.
+	static void ClearLoopTick();
+
+	/// Converts a time in the recent past, read from the realtime (wall) clock of the system, to a tick. This is how the
+	/// kernel timestamps the received datagrams. The tick is the current tick less the age of the time, so a time in
+	/// the future or more than a second old, as when the wall clock has been set in between, gives the current tick.
+	/// Returns the current tick on the platforms where the kernel does not timestamp datagrams.
+	static tick_t TickFromRealTime(unsigned long long seconds, unsigned long nanoseconds);
+
 	static inline tick_t TicksPerMillisecond() { return TicksPerSec() / 1000; }
 
 	/// Returns the number of ticks occurring between the two wallclock times.
@@ -0,0 +1,263 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file CongestionControl.h
+	@brief The CongestionControl interface and the CUBIC-like and BBR-like congestion controllers of UDPMessageConnection. */
+
+#include <cstddef>
+
+#include "Types.h"
+#include "Clock.h"
+
+namespace kNet
+{
+
+/// Specifies the congestion control algorithm of a UDPMessageConnection. See UDPMessageConnection::SetCongestionControl().
+enum CongestionControlAlgorithm
+{
+	CongestionControlCubic, ///< Loss-based: the window grows along a cubic curve and is cut on losses (RFC 8312). The default.
+	CongestionControlBBR    ///< Model-based: paces at the measured bottleneck bandwidth and keeps about one bandwidth-delay product in flight.
+};
+
+/// Returns a human-readable name of the given algorithm.
+const char *CongestionControlAlgorithmToString(CongestionControlAlgorithm algorithm);
+
+/// Describes a reliable datagram that was acked or lost, for the CongestionControl callbacks.
+struct SentDatagramInfo
+{
+	/// The time the datagram was sent out.
+	tick_t sentTick;
+	/// The size of the datagram in bytes.
+	size_t numBytes;
+	/// The total number of bytes that had been acked on the connection when the datagram was sent out.
+	u64 delivered;
+	/// The time the last of those bytes was acked.
+	tick_t deliveredTick;
+	/// If true, the connection had nothing more to send after this datagram, so the datagram does not show the full rate of the path.
+	bool appLimited;
+};
+
+class UDPMessageConnection;
+
+/// Estimates the bandwidth a connection can deliver, and the time its datagrams wait in the queues of the path, from the
+/// timings of the acks. The bandwidth is the max of the delivery rates measured over the last ten round trips, the way BBR
+/// samples them: the bytes acked while a datagram was in flight, over the time it took. The queuing delay is the smoothed
+/// round trip time above the min round trip time of the last ten seconds. Works with any congestion controller.
+class BandwidthEstimator
+{
+public:
+	BandwidthEstimator();
+
+	/// Called when a reliable datagram has been acked. See CongestionControl::OnDatagramAcked().
+	/// @return True if the ack started a new round trip.
+	bool OnDatagramAcked(tick_t now, const SentDatagramInfo &datagram, u64 delivered);
+
+	/// Called with each round trip time measured from an ack, in milliseconds.
+	void OnRttSample(tick_t now, float rttMSecs);
+
+	/// Returns the estimated bandwidth in bytes/second, or 0 until measured.
+	double Bandwidth() const;
+
+	/// Returns the min round trip time of the last ten seconds in milliseconds, or 0 until measured.
+	double MinRtt() const { return minRttMSecs; }
+
+	/// Returns the estimated queuing delay in milliseconds.
+	double QueuingDelay() const { return queuingDelayMSecs; }
+
+	/// Returns the number of round trips so far.
+	u64 RoundCount() const { return roundCount; }
+
+private:
+	static const int cFilterLength = 10;
+
+	/// The max delivery rate of each of the last round trips, in bytes/second.
+	double samples[cFilterLength];
+	u64 roundCount;
+	/// A new round trip starts when a datagram sent after this many bytes were delivered is acked.
+	u64 nextRoundDelivered;
+
+	double minRttMSecs;
+	tick_t minRttStamp;
+	double queuingDelayMSecs;
+};
+
+/// A callback object that is told when the estimates of UDPMessageConnection::AvailableBandwidth() and
+/// UDPMessageConnection::QueuingDelay() change. See UDPMessageConnection::SetBandwidthEstimateHandler().
+class IBandwidthEstimateHandler
+{
+public:
+	virtual ~IBandwidthEstimateHandler() {}
+
+	/// Called from the worker thread of the connection, so the handler must be thread-safe and quick.
+	/// @param bytesPerSec The estimated available bandwidth.
+	/// @param queuingDelayMSecs The estimated queuing delay.
+	virtual void BandwidthEstimateChanged(UDPMessageConnection *connection, float bytesPerSec, float queuingDelayMSecs) = 0;
+};
+
+/// Decides how many bytes of reliable datagrams a UDPMessageConnection may have in flight (the congestion window), and the rate
+/// at which it sends its datagrams out (the pacing rate). The connection calls the callbacks with the timings it tracks for
+/// each reliable datagram. The times are passed in explicitly, so that the controllers can also be driven offline. [worker thread]
+class CongestionControl
+{
+public:
+	virtual ~CongestionControl() {}
+
+	/// Creates a new controller of the given algorithm for a connection that sends datagrams of up to maxDatagramSize bytes.
+	static CongestionControl *Create(CongestionControlAlgorithm algorithm, size_t maxDatagramSize);
+
+	virtual CongestionControlAlgorithm Algorithm() const = 0;
+
+	/// Called when a reliable datagram has been acked.
+	/// @param delivered The total number of bytes acked on the connection, including this datagram.
+	/// @param bytesInFlight The number of bytes still in flight after this datagram.
+	virtual void OnDatagramAcked(tick_t now, const SentDatagramInfo &datagram, u64 delivered, size_t bytesInFlight) = 0;
+
+	/// Called when a reliable datagram has been declared lost.
+	virtual void OnDatagramLost(tick_t now, const SentDatagramInfo &datagram, size_t bytesInFlight) = 0;
+
+	/// Called when the peer reports new datagrams that a router on the path marked Congestion Experienced (ECN, RFC 3168).
+	/// The marks are a signal of the queue building up at the bottleneck, given before it overflows and drops datagrams.
+	/// @param sentTick The send time of the newest datagram the peer has acked. The marked ones were sent no later.
+	virtual void OnCongestionMarked(tick_t now, tick_t sentTick, size_t bytesInFlight) = 0;
+
+	/// Called with each round trip time measured from an ack, in milliseconds.
+	virtual void OnRttSample(tick_t now, float rttMSecs) = 0;
+
+	/// Called when the size of the datagrams the connection sends changes.
+	virtual void SetMaxDatagramSize(size_t maxDatagramSize) = 0;
+
+	/// Starts from the given window instead of the initial one, for a connection that had grown its window in the process
+	/// it was handed over from. See Network::HandOffServer().
+	virtual void ResumeWindow(size_t congestionWindow) = 0;
+
+	/// Returns the number of bytes of reliable datagrams that may be in flight.
+	virtual size_t CongestionWindow() const = 0;
+
+	/// Returns the rate at which the datagrams are sent out, in bytes/second.
+	virtual double PacingRate() const = 0;
+};
+
+/// A CUBIC-like controller (RFC 8312). The window doubles every round trip in slow start. After a loss, the window is cut
+/// to 70%, and grows back along a cubic curve that flattens out around the window size of the loss and then probes beyond.
+/// A Congestion Experienced mark cuts the window only to 80%, since the queue that caused it has not overflowed yet (RFC 8511).
+/// Only one cut is made per round trip. The pacing rate spreads the window over the smoothed round trip time.
+class CubicCongestionControl : public CongestionControl
+{
+public:
+	explicit CubicCongestionControl(size_t maxDatagramSize);
+
+	CongestionControlAlgorithm Algorithm() const { return CongestionControlCubic; }
+	void OnDatagramAcked(tick_t now, const SentDatagramInfo &datagram, u64 delivered, size_t bytesInFlight);
+	void OnDatagramLost(tick_t now, const SentDatagramInfo &datagram, size_t bytesInFlight);
+	void OnCongestionMarked(tick_t now, tick_t sentTick, size_t bytesInFlight);
+	void OnRttSample(tick_t now, float rttMSecs);
+	void SetMaxDatagramSize(size_t maxDatagramSize);
+	void ResumeWindow(size_t congestionWindow);
+	size_t CongestionWindow() const { return (size_t)cwnd; }
+	double PacingRate() const;
+
+	/// Returns true if the window is still in slow start.
+	bool InSlowStart() const { return cwnd < ssthresh; }
+
+private:
+	/// Cuts the window to beta of its size, unless it was already cut for a datagram sent at sentTick.
+	void Cut(tick_t now, tick_t sentTick, double beta);
+
+	/// The size of a segment, the unit of the cubic curve.
+	double mss;
+	/// The congestion window and the slow start threshold, in bytes.
+	double cwnd;
+	double ssthresh;
+	/// The window before the last cut, in bytes.
+	double wMax;
+	/// The time from the start of the epoch at which the curve reaches wMax, in seconds.
+	double k;
+	/// The start of the current congestion avoidance epoch, or 0 if the epoch has not started yet.
+	tick_t epochStart;
+	/// If true, the window was cut at recoveryStart. The losses of the datagrams sent before that belong to the same cut.
+	bool inRecovery;
+	tick_t recoveryStart;
+	/// The smoothed round trip time in milliseconds, or 0 until measured.
+	double smoothedRttMSecs;
+};
+
+/// A BBR-like controller. Estimates the bottleneck bandwidth with a BandwidthEstimator, and the propagation delay as the min
+/// round trip time over the last ten seconds. Paces at a gain of the bandwidth estimate, and caps the bytes in flight at twice
+/// the bandwidth-delay product. Goes through the Startup, Drain, ProbeBW and ProbeRTT phases of BBR, and does not react to
+/// individual losses. A Congestion Experienced mark ends Startup, or the bandwidth probe of the ProbeBW cycle, early, since
+/// it shows that the bottleneck is full.
+class BBRCongestionControl : public CongestionControl
+{
+public:
+	explicit BBRCongestionControl(size_t maxDatagramSize);
+
+	CongestionControlAlgorithm Algorithm() const { return CongestionControlBBR; }
+	void OnDatagramAcked(tick_t now, const SentDatagramInfo &datagram, u64 delivered, size_t bytesInFlight);
+	void OnDatagramLost(tick_t now, const SentDatagramInfo &datagram, size_t bytesInFlight);
+	void OnCongestionMarked(tick_t now, tick_t sentTick, size_t bytesInFlight);
+	void OnRttSample(tick_t now, float rttMSecs);
+	void SetMaxDatagramSize(size_t maxDatagramSize);
+	void ResumeWindow(size_t congestionWindow);
+	size_t CongestionWindow() const;
+	double PacingRate() const;
+
+	enum Mode
+	{
+		Startup,
+		Drain,
+		ProbeBW,
+		ProbeRTT
+	};
+
+	Mode CurrentMode() const { return mode; }
+
+	/// Returns the estimated bottleneck bandwidth in bytes/second, or 0 until measured.
+	double BottleneckBandwidth() const { return bandwidthFilter.Bandwidth(); }
+
+	/// Returns the min round trip time in milliseconds, or 0 until measured.
+	double MinRtt() const { return minRttMSecs; }
+
+private:
+	/// Returns the bandwidth-delay product in bytes, or 0 until both are measured.
+	double BDP() const;
+	void UpdateMode(tick_t now, size_t bytesInFlight);
+
+	size_t maxDatagramSize;
+	Mode mode;
+	double pacingGain;
+	double cwndGain;
+	/// The congestion window in bytes. Grows by the acked bytes up to cwndGain times the bandwidth-delay product.
+	double cwnd;
+
+	BandwidthEstimator bandwidthFilter;
+
+	double minRttMSecs;
+	tick_t minRttStamp;
+	/// Set when the min round trip time was not refreshed in ten seconds, to enter ProbeRTT.
+	bool minRttExpired;
+
+	/// In Startup, the bandwidth estimate at the last check and the number of rounds it has not grown by 25%.
+	double fullBandwidth;
+	int fullBandwidthRounds;
+
+	/// The phase of the ProbeBW gain cycle, and the time the phase started.
+	int cycleIndex;
+	tick_t cycleStart;
+
+	/// The time ProbeRTT ends, or 0 until the bytes in flight have dropped.
+	tick_t probeRttDone;
+};
+
+} // ~kNet
@@ -0,0 +1,180 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file ContentIDHashTable.h
+	@brief The ContentIDHashTable<T> template class. An open-addressing hash table from (messageID, contentID) pairs to object pointers. */
+
+#include <cassert>
+#include <cstddef>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+/// An open-addressing hash table that maps (messageID, contentID) pairs to pointers to objects of type T.
+/** The pair is packed into a single 64-bit key, and the table is probed linearly over a flat array of keys and values.
+	The content ID of a mapped pair may not be zero, since zero means "no content ID" everywhere in kNet. [Not thread-safe] */
+template<typename T>
+class ContentIDHashTable
+{
+public:
+	ContentIDHashTable()
+	:slots(0), mask(0), size(0), numUsedSlots(0)
+	{
+		Allocate(cInitialCapacity);
+	}
+
+	~ContentIDHashTable()
+	{
+		delete[] slots;
+	}
+
+	/// Returns the object mapped to the given pair, or 0 if there is none.
+	T *Find(u32 messageID, u32 contentID) const
+	{
+		const u64 key = Key(messageID, contentID);
+		for(size_t i = Hash(key) & mask; slots[i].key != cEmptyKey; i = (i + 1) & mask)
+			if (slots[i].key == key)
+				return slots[i].value;
+		return 0;
+	}
+
+	/// Maps the given pair to the given object, replacing any previous mapping of the pair.
+	void Insert(u32 messageID, u32 contentID, T *value)
+	{
+		assert(value);
+		const u64 key = Key(messageID, contentID);
+		if ((numUsedSlots + 1) * 4 > (mask + 1) * 3)
+			Rehash();
+
+		size_t tombstone = (size_t)-1;
+		for(size_t i = Hash(key) & mask;; i = (i + 1) & mask)
+		{
+			if (slots[i].key == key)
+			{
+				slots[i].value = value;
+				return;
+			}
+			if (slots[i].key == cTombstoneKey && tombstone == (size_t)-1)
+				tombstone = i;
+			if (slots[i].key == cEmptyKey)
+			{
+				if (tombstone != (size_t)-1)
+					i = tombstone;
+				else
+					++numUsedSlots;
+				slots[i].key = key;
+				slots[i].value = value;
+				++size;
+				return;
+			}
+		}
+	}
+
+	/// Removes the mapping of the given pair, if there is one.
+	void Remove(u32 messageID, u32 contentID)
+	{
+		const u64 key = Key(messageID, contentID);
+		for(size_t i = Hash(key) & mask; slots[i].key != cEmptyKey; i = (i + 1) & mask)
+			if (slots[i].key == key)
+			{
+				slots[i].key = cTombstoneKey;
+				slots[i].value = 0;
+				--size;
+				return;
+			}
+	}
+
+	/// Removes all mappings.
+	void Clear()
+	{
+		for(size_t i = 0; i <= mask; ++i)
+		{
+			slots[i].key = cEmptyKey;
+			slots[i].value = 0;
+		}
+		size = 0;
+		numUsedSlots = 0;
+	}
+
+	/// Returns the number of pairs mapped in the table.
+	size_t Size() const { return size; }
+
+private:
+	struct Slot
+	{
+		u64 key;
+		T *value;
+	};
+
+	static const size_t cInitialCapacity = 64;
+	/// The key of an unused slot. Real keys have a nonzero content ID in their low 32 bits, so they never collide with it.
+	static const u64 cEmptyKey = 0;
+	/// The key of a slot whose mapping has been removed.
+	static const u64 cTombstoneKey = 0xFFFFFFFF00000000ULL;
+
+	Slot *slots;
+	size_t mask;
+	size_t size;
+	/// The number of slots that are either in use or tombstones.
+	size_t numUsedSlots;
+
+	static u64 Key(u32 messageID, u32 contentID)
+	{
+		assert(contentID != 0);
+		return ((u64)messageID << 32) | contentID;
+	}
+
+	static size_t Hash(u64 key)
+	{
+		return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+
+	void Allocate(size_t capacity)
+	{
+		slots = new Slot[capacity];
+		mask = capacity - 1;
+		for(size_t i = 0; i < capacity; ++i)
+		{
+			slots[i].key = cEmptyKey;
+			slots[i].value = 0;
+		}
+		numUsedSlots = 0;
+	}
+
+	/// Moves the mappings to a new array, which is twice as large if the table is more than half full. This also clears out the tombstones.
+	void Rehash()
+	{
+		Slot *oldSlots = slots;
+		const size_t oldCapacity = mask + 1;
+		Allocate((size * 2 > oldCapacity) ? oldCapacity * 2 : oldCapacity);
+		for(size_t i = 0; i < oldCapacity; ++i)
+			if (oldSlots[i].key != cEmptyKey && oldSlots[i].key != cTombstoneKey)
+			{
+				size_t j = Hash(oldSlots[i].key) & mask;
+				while(slots[j].key != cEmptyKey)
+					j = (j + 1) & mask;
+				slots[j] = oldSlots[i];
+				++numUsedSlots;
+			}
+		delete[] oldSlots;
+	}
+
+	ContentIDHashTable(const ContentIDHashTable &); ///< Not implemented.
+	void operator =(const ContentIDHashTable &); ///< Not implemented.
+};
+
+} // ~kNet
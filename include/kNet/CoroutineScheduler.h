@@ -0,0 +1,188 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file CoroutineScheduler.h
+	@brief The CoroutineScheduler class, which completes the network operations that coroutines wait on. See Coroutines.h
+	for the awaitables built on it. */
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+
+#include "Types.h"
+#include "Event.h"
+#include "EventArray.h"
+#include "Lockable.h"
+#include "SharedPtr.h"
+#include "MessageConnection.h"
+#include "IMessageHandler.h"
+
+namespace kNet
+{
+
+class Network;
+class NetworkMessage;
+
+/// Completes the connects, message receives and message acks that coroutines wait on, for any number of connections.
+/** A single thread calls Poll() in a loop. Poll() waits on the InboundMessagesEvent() of the connections that have
+	operations pending, and on an event of its own that is set when operations are started or messages are acked, so no
+	thread blocks for each connection. The operations that complete are handed back through Operation::Completed(),
+	which the awaitables of Coroutines.h use to post their coroutine to the executor of the application.
+
+	The scheduler takes the received messages off the connections it waits on with MessageConnection::ReceiveMessage(),
+	so do not also process those connections with Process() or ReceiveMessage(). The messages that no operation waits for
+	yet are held, in the order they were received, until one does.
+
+	Start() may be called from any thread. The other functions must be called from the thread that calls Poll(), which
+	acts as the main thread of the connections. To wait on more than 64 connections on Windows, build kNet with KNET_USE_IOCP. */
+class CoroutineScheduler
+{
+public:
+	enum OperationType
+	{
+		OperationConnect, ///< Connects to a server. Completes when the connection has left ConnectionPending.
+		OperationReceive, ///< Completes with the next message received on a connection, optionally of a given ID.
+		OperationAck ///< Sends a message reliably, and completes when the peer has received it.
+	};
+
+	/// An operation a coroutine waits on. Fill in the inputs, pass the operation to Start(), and read the results once
+	/// Completed() has been called.
+	class Operation : public IMessageAckHandler
+	{
+	public:
+		explicit Operation(OperationType type);
+		virtual ~Operation() {}
+
+		OperationType type;
+
+		/// The Network, address, port, transport and message handler of OperationConnect.
+		Network *network;
+		std::string address;
+		unsigned short port;
+		SocketTransportLayer transport;
+		IMessageHandler *messageHandler;
+
+		/// The connection of OperationReceive and OperationAck. The result of OperationConnect: the connection in
+		/// ConnectionOK, or null if connecting failed.
+		Ptr(MessageConnection) connection;
+
+		/// The ID of the message OperationReceive waits for, if anyMessageId is false.
+		message_id_t messageId;
+		bool anyMessageId;
+
+		/// The message OperationAck sends, which Start() takes the ownership of. The result of OperationReceive: the
+		/// message received, or null if the connection closed first. Free it with MessageConnection::FreeMessage().
+		NetworkMessage *message;
+
+		/// The result of OperationAck: true if the peer received the message, and what became of the message.
+		bool succeeded;
+		MessageAckResult ackResult;
+
+		/// Called from Poll() once the operation has completed. The scheduler does not touch the operation after this.
+		virtual void Completed() = 0;
+
+	private:
+		friend class CoroutineScheduler;
+
+		/// The scheduler the operation was started on.
+		CoroutineScheduler *owner;
+
+		/// Called by the worker thread of the connection when the message of OperationAck was acked or dropped.
+		void HandleMessageAcked(message_id_t messageId, MessageAckResult result);
+	};
+
+	/// Specifies how often Poll() carries on with the connects that wait for their socket, since those have no event to wait on.
+	static const int cPendingConnectPollMSecs = 10;
+
+	CoroutineScheduler();
+	~CoroutineScheduler();
+
+	/// Starts the given operation. Its Completed() is called from a later Poll(). [thread-safe]
+	void Start(Operation *operation);
+
+	/// Makes the Poll() in progress, or the next one, return without waiting. [thread-safe]
+	void Wake();
+
+	/// Carries on with the pending operations, and calls Completed() for the ones that complete. If none complete, waits at
+	/// most the given number of msecs for something to happen, and then tries again.
+	/// @return The number of operations completed.
+	int Poll(int maxMSecsToWait);
+
+	/// Returns the number of operations started and not completed yet. [thread-safe]
+	int NumPendingOperations() const;
+
+private:
+	/// A connection that operations wait on.
+	struct WatchedConnection
+	{
+		Ptr(MessageConnection) connection;
+		/// The OperationReceive operations of the connection, in the order they were started.
+		std::deque<Operation*> receives;
+		/// The messages taken off the connection that no operation has waited for yet.
+		std::deque<NetworkMessage*> held;
+		/// The number of OperationConnect operations waiting on the connection.
+		int numConnects;
+		/// True while the InboundMessagesEvent() of the connection is in waitEvents.
+		bool waited;
+	};
+
+	/// The operations passed to Start() that Poll() has not taken up yet.
+	struct StartQueue
+	{
+		std::vector<Operation*> operations;
+		/// The number of operations started and not completed yet.
+		int numPending;
+	};
+
+	Lockable<StartQueue> startQueue;
+
+	/// The OperationAck operations whose message has been acked or dropped.
+	Lockable<std::vector<Operation*> > ackedOperations;
+
+	/// Set when operations are started or acked, and by Wake().
+	Event wakeEvent;
+
+	/// The OperationConnect operations whose connection is still in ConnectionPending.
+	std::vector<Operation*> connects;
+
+	std::map<MessageConnection*, WatchedConnection*> watched;
+
+	/// The wake event, followed by the events of the connections that have operations waiting on them.
+	EventArray waitEvents;
+	/// Set when a connection has been added to or removed from the connections waited on.
+	bool waitEventsDirty;
+
+	/// Takes up the started and acked operations, and appends the ones that complete to the given list.
+	void Update(std::vector<Operation*> &completed);
+
+	void StartConnect(Operation *operation, std::vector<Operation*> &completed);
+	void UpdateConnects(std::vector<Operation*> &completed);
+	void UpdateReceives(WatchedConnection &watch, std::vector<Operation*> &completed);
+
+	/// Returns the entry of the given connection, and adds one if it has none.
+	WatchedConnection &Watch(Ptr(MessageConnection) connection);
+
+	/// Waits on the wake event and the events of the connections that have operations waiting on them.
+	void Wait(int maxMSecsToWait);
+
+	/// Called when the message of the given OperationAck has been acked or dropped. [worker thread]
+	void AckReceived(Operation *operation);
+
+	CoroutineScheduler(const CoroutineScheduler &); ///< Noncopyable, N/I.
+	void operator=(const CoroutineScheduler &); ///< Noncopyable, N/I.
+};
+
+} // ~kNet
@@ -0,0 +1,190 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file Coroutines.h
+	@brief Awaitable network operations for C++20 coroutines. Only available when the including code is compiled with
+	coroutine support. kNet itself does not need to be built as C++20. */
+
+#include "CoroutineScheduler.h"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+
+namespace kNet
+{
+
+/// Resumes the coroutines whose network operations have completed. Implemented by the application, for example by
+/// queueing the coroutines to a thread pool.
+class ICoroutineExecutor
+{
+public:
+	virtual ~ICoroutineExecutor() {}
+
+	/// Resumes the given coroutine, on this thread or another one. Called from CoroutineScheduler::Poll().
+	virtual void Post(std::coroutine_handle<> coroutine) = 0;
+};
+
+/// Resumes the coroutines right away, on the thread that calls CoroutineScheduler::Poll().
+class InlineCoroutineExecutor : public ICoroutineExecutor
+{
+public:
+	void Post(std::coroutine_handle<> coroutine) { coroutine.resume(); }
+};
+
+/// The base of the awaitables: suspends the coroutine until the scheduler completes the operation, and then posts the
+/// coroutine to the executor.
+class CoroutineOperation : public CoroutineScheduler::Operation
+{
+public:
+	bool await_ready() const { return false; }
+
+	void await_suspend(std::coroutine_handle<> coroutine_)
+	{
+		coroutine = coroutine_;
+		// The coroutine may be resumed on another thread before Start() returns, so nothing may touch this after it.
+		scheduler->Start(this);
+	}
+
+protected:
+	CoroutineOperation(CoroutineScheduler &scheduler_, ICoroutineExecutor &executor_, CoroutineScheduler::OperationType type)
+	:Operation(type), scheduler(&scheduler_), executor(&executor_)
+	{
+	}
+
+private:
+	CoroutineScheduler *scheduler;
+	ICoroutineExecutor *executor;
+	std::coroutine_handle<> coroutine;
+
+	void Completed() { executor->Post(coroutine); }
+
+	void operator=(const CoroutineOperation &); ///< Noncopyable, N/I.
+	CoroutineOperation(const CoroutineOperation &); ///< Noncopyable, N/I.
+};
+
+/// Awaits a connection to a server. Results in the connection in ConnectionOK, or null if connecting failed.
+class ConnectOperation : public CoroutineOperation
+{
+public:
+	ConnectOperation(CoroutineScheduler &scheduler, ICoroutineExecutor &executor, Network *network_, const char *address_,
+		unsigned short port_, SocketTransportLayer transport_, IMessageHandler *messageHandler_)
+	:CoroutineOperation(scheduler, executor, CoroutineScheduler::OperationConnect)
+	{
+		network = network_;
+		address = address_ ? address_ : "";
+		port = port_;
+		transport = transport_;
+		messageHandler = messageHandler_;
+	}
+
+	Ptr(MessageConnection) await_resume() { return connection; }
+};
+
+/// Awaits the next message received on a connection. Results in the message, or null if the connection closed first.
+/// Free the message with MessageConnection::FreeMessage().
+class ReceiveOperation : public CoroutineOperation
+{
+public:
+	ReceiveOperation(CoroutineScheduler &scheduler, ICoroutineExecutor &executor, const Ptr(MessageConnection) &connection_,
+		bool anyMessageId_, message_id_t messageId_)
+	:CoroutineOperation(scheduler, executor, CoroutineScheduler::OperationReceive)
+	{
+		connection = connection_;
+		anyMessageId = anyMessageId_;
+		messageId = messageId_;
+	}
+
+	NetworkMessage *await_resume() { return message; }
+};
+
+/// Sends a message reliably, and awaits until the peer has received it. Results in true if it did, and false if the
+/// message was dropped first, for example because the connection closed.
+class AckOperation : public CoroutineOperation
+{
+public:
+	AckOperation(CoroutineScheduler &scheduler, ICoroutineExecutor &executor, const Ptr(MessageConnection) &connection_, NetworkMessage *message_)
+	:CoroutineOperation(scheduler, executor, CoroutineScheduler::OperationAck)
+	{
+		connection = connection_;
+		message = message_;
+	}
+
+	bool await_resume() { return succeeded; }
+};
+
+/// Creates the awaitable network operations of the coroutines that share a CoroutineScheduler and an executor.
+/** The operations can be awaited in any coroutine type of the application:
+	\code
+	Task Session(CoroutineContext &context, Network &network)
+	{
+		Ptr(MessageConnection) connection = co_await context.Connect(&network, "example.com", 2345, SocketOverUDP);
+		if (!connection)
+			co_return;
+		NetworkMessage *hello = connection->StartNewMessage(cMsgHello, 0);
+		if (!co_await context.SendAcknowledged(connection, hello))
+			co_return;
+		NetworkMessage *welcome = co_await context.NextMessage(connection, cMsgWelcome);
+		if (welcome)
+			connection->FreeMessage(welcome);
+	}
+	\endcode
+	A thread of the application calls CoroutineScheduler::Poll() in a loop meanwhile. */
+class CoroutineContext
+{
+public:
+	CoroutineContext(CoroutineScheduler &scheduler_, ICoroutineExecutor &executor_)
+	:scheduler(&scheduler_), executor(&executor_)
+	{
+	}
+
+	/// Connects to the given server like Network::ConnectAsync() does, and awaits until the connection is established.
+	ConnectOperation Connect(Network *network, const char *address, unsigned short port, SocketTransportLayer transport,
+		IMessageHandler *messageHandler = 0)
+	{
+		return ConnectOperation(*scheduler, *executor, network, address, port, transport, messageHandler);
+	}
+
+	/// Awaits the next message received on the given connection.
+	ReceiveOperation NextMessage(const Ptr(MessageConnection) &connection)
+	{
+		return ReceiveOperation(*scheduler, *executor, connection, true, 0);
+	}
+
+	/// Awaits the next message of the given ID received on the given connection. The messages of other IDs are kept for
+	/// the other operations that wait on the connection.
+	ReceiveOperation NextMessage(const Ptr(MessageConnection) &connection, message_id_t id)
+	{
+		return ReceiveOperation(*scheduler, *executor, connection, false, id);
+	}
+
+	/// Sends the given message reliably, and awaits until the peer has received it. Takes the ownership of the message,
+	/// which is built like for MessageConnection::EndAndQueueMessage().
+	AckOperation SendAcknowledged(const Ptr(MessageConnection) &connection, NetworkMessage *msg)
+	{
+		return AckOperation(*scheduler, *executor, connection, msg);
+	}
+
+	CoroutineScheduler &Scheduler() { return *scheduler; }
+	ICoroutineExecutor &Executor() { return *executor; }
+
+private:
+	CoroutineScheduler *scheduler;
+	ICoroutineExecutor *executor;
+};
+
+} // ~kNet
+
+#endif
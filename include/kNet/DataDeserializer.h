@@ -16,11 +16,15 @@
 /** @file DataDeserializer.h
 	@brief The class \ref kNet::DataDeserializer DataDeserializer. */
 
+#include <cassert>
+#include <cstring>
+
 #include "kNetBuildConfig.h"
 #include "kNet/Types.h"
 
 #include "BasicSerializedDataTypes.h"
 #include "SerializedDataIterator.h"
+#include "NetException.h"
 
 namespace kNet
 {
@@ -31,6 +35,9 @@ namespace kNet
 /// DataDeserializer never copies the data it is given to read into an internal memory buffer, but instead it reads
 /// the given existing memory buffers. DataDeserializer maintains an internal bit offset position to keep track the position
 /// that is currently being read.
+/// Each read loads the 64-bit word at the current byte position, and shifts the bits it needs out of it. The checked read
+/// functions test the length of the stream on each call. To parse a block of a known size, call RequireBits() or
+/// RequireBytes() once, and read the block with the inlined ReadUnchecked() and ReadBitsUnchecked().
 class DataDeserializer
 {
 public:
@@ -68,6 +75,12 @@ public:
 	template<typename VLEType>
 	u32 ReadVLE();
 
+	/// Reads the given amount of variable-length encoded integers off the stream, as written by DataSerializer::AddVLEArray()
+	/// or by consecutive AddVLE() calls. Each value is decoded from the word at the read position without branching on its
+	/// length. Throws a NetException if the stream ends before all of them were read. Can only be used in nontemplate read mode.
+	template<typename VLEType>
+	void ReadVLEArray(u32 *dst, size_t count);
+
 	/// Deserializes an array of values of type T off the stream and advances the internal read offset.
 	/// @param dst [out] Pointer to an array to receive the read data.
 	/// @param numElems The number of elements to read. The array dst must be able to hold that many elements.
@@ -86,6 +99,32 @@ public:
 	/// @param numBits the number of bits to read, [1, 32].
 	u32 ReadBits(int numBits);
 
+	/// Throws a NetException if there are fewer than the given amount of bits left in the stream. Once this has passed, that
+	/// many bits can be read off the stream with ReadUnchecked() and ReadBitsUnchecked().
+	void RequireBits(size_t numBits) const
+	{
+		if (numBits > BitsLeft())
+			throw NetException("Not enough bits left in DataDeserializer::RequireBits!");
+	}
+
+	/// Throws a NetException if there are fewer than the given amount of bytes left in the stream. See RequireBits().
+	void RequireBytes(size_t numBytes) const { RequireBits(numBytes * 8); }
+
+	/// Deserializes a single value of type T off the stream without checking that the stream has enough data left, which the
+	/// caller must have verified with RequireBits() or RequireBytes() beforehand. T must be one of the types for which
+	/// IsRawSerializedType is true. Can only be used in nontemplate read mode.
+	template<typename T>
+	T ReadUnchecked();
+
+	/// Reads the given amount of bits, [1, 32], without checking that the stream has enough data left. See ReadUnchecked().
+	u32 ReadBitsUnchecked(int numBits)
+	{
+		assert(!iter);
+		assert(numBits >= 1 && numBits <= 32);
+		assert(BitsLeft() >= (u32)numBits);
+		return ExtractBits(numBits);
+	}
+
 	float ReadUnsignedFixedPoint(int numIntegerBits, int numDecimalBits);
 
 	float ReadSignedFixedPoint(int numIntegerBits, int numDecimalBits);
@@ -100,6 +139,22 @@ public:
 	void ReadNormalizedVector3D(int numBitsYaw, int numBitsPitch, float &x, float &y, float &z);
 	void ReadVector3D(int numBitsYaw, int numBitsPitch, int magnitudeIntegerBits, int magnitudeDecimalBits, float &x, float &y, float &z);
 
+	/// Reads the given amount of floats written by DataSerializer::AddQuantizedFloatArray(), or by consecutive calls to
+	/// AddQuantizedFloat(), and returns the same values as calling ReadQuantizedFloat() for each of them. The length of the
+	/// stream is checked once, and the values are dequantized four at a time with SSE2 or NEON, where available.
+	void ReadQuantizedFloatArray(float minRange, float maxRange, int numBits, float *dst, size_t count);
+
+	/// Reads an array of floats written by DataSerializer::AddUnsignedFixedPointArray(). See ReadQuantizedFloatArray().
+	void ReadUnsignedFixedPointArray(int numIntegerBits, int numDecimalBits, float *dst, size_t count);
+
+	/// Reads an array of floats written by DataSerializer::AddSignedFixedPointArray(). See ReadQuantizedFloatArray().
+	void ReadSignedFixedPointArray(int numIntegerBits, int numDecimalBits, float *dst, size_t count);
+
+	/// Reads an array of vectors written by DataSerializer::AddNormalizedVector3DArray(). The angles are dequantized in
+	/// batches, and converted back to vectors with the same scalar trigonometric functions as ReadNormalizedVector3D() uses.
+	/// @param xyz [out] Receives the vectors as consecutive (x,y,z) triplets, and must have room for 3*count floats.
+	void ReadNormalizedVector3DArray(int numBitsYaw, int numBitsPitch, float *xyz, size_t count);
+
 	void ReadArithmeticEncoded(int numBits, int &val1, int max1, int &val2, int max2);
 	void ReadArithmeticEncoded(int numBits, int &val1, int max1, int &val2, int max2, int &val3, int max3);
 	void ReadArithmeticEncoded(int numBits, int &val1, int max1, int &val2, int max2, int &val3, int max3, int &val4, int max4);
@@ -131,6 +186,20 @@ public:
 	/// Advances the read pointer with the given amount of bytes. Can only be used in nontemplate read mode.
 	void SkipBytes(int numBytes) { SkipBits(numBytes * 8); }
 
+	/// Returns a pointer to the next numBytes bytes of the stream for the caller to read directly, and advances the read
+	/// position past them. Returns 0 and leaves the position as is if it is not byte-aligned, or if a message template is used.
+	/// Throws a NetException if there are fewer bytes left.
+	const char *ConsumeAlignedBytes(size_t numBytes)
+	{
+		if (bitOfs != 0 || iter)
+			return 0;
+		if (numBytes > BytesLeft())
+			throw NetException("Not enough bytes left in DataDeserializer::ConsumeAlignedBytes!");
+		const char *block = data + elemOfs;
+		elemOfs += numBytes;
+		return block;
+	}
+
 private:
 	/// The data pointer to read from.
 	const char *data;
@@ -143,7 +212,60 @@ private:
 
 	Ptr(SerializedDataIterator) iter;
 
-	u32 ReadBitsToU32(int count);
+	u32 ReadBitsToU32(int count)
+	{
+		if (BitsLeft() < (u32)count)
+			throw NetException("Not enough bits left in DataDeserializer::ReadBits!");
+		return ExtractBits(count);
+	}
+
+	/// Loads the (up to) eight bytes at the current byte position as a little-endian word.
+	u64 LoadWord() const
+	{
+		const u8 *src = reinterpret_cast<const u8*>(data) + elemOfs;
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+		if (elemOfs + 8 <= size)
+		{
+			u64 word;
+			memcpy(&word, src, 8);
+			return word;
+		}
+#endif
+		const size_t numBytes = (elemOfs + 8 <= size) ? 8 : (size - elemOfs);
+		u64 word = 0;
+		for(size_t i = 0; i < numBytes; ++i)
+			word |= (u64)src[i] << (i * 8);
+		return word;
+	}
+
+	/// Reads the given amount of bits, [0, 32], which the caller has checked are left in the stream.
+	u32 ExtractBits(int count)
+	{
+		// bitOfs + count <= 39, so the bits are all in the word.
+		const u32 value = (u32)((LoadWord() >> bitOfs) & ((((u64)1) << count) - 1));
+		bitOfs += count;
+		elemOfs += (bitOfs >> 3);
+		bitOfs &= 7;
+		return value;
+	}
+
+	/// Reads the given amount of bytes into dst, which the caller has checked are left in the stream.
+	void ExtractBytes(void *dst, size_t numBytes)
+	{
+		if (bitOfs == 0)
+		{
+			memcpy(dst, data + elemOfs, numBytes);
+			elemOfs += numBytes;
+		}
+		else
+			ExtractUnalignedBytes(reinterpret_cast<u8*>(dst), numBytes);
+	}
+
+	/// Reads bytes that start in the middle of a byte of the stream, four at a time.
+	void ExtractUnalignedBytes(u8 *dst, size_t numBytes);
+
+	/// Reads the given amount of bit fields of numBits bits each, checking the length of the stream only once.
+	void ExtractBitsArray(u32 *dst, size_t count, int numBits);
 
 	DataDeserializer(const DataDeserializer &);
 	void operator =(const DataDeserializer &);
@@ -153,11 +275,11 @@ template<typename T>
 T DataDeserializer::Read()
 {
 	assert(!iter || iter->NextElementType() == SerializedDataTypeTraits<T>::type);
-	T value;
-	u8 *data = reinterpret_cast<u8*>(&value);
+	if (BitsLeft() < sizeof(T) * 8)
+		throw NetException("Not enough bits left in DataDeserializer::Read!");
 
-	for(size_t i = 0; i < sizeof(value); ++i)
-		data[i] = (u8)ReadBitsToU32(8);
+	T value;
+	ExtractBytes(&value, sizeof(value));
 
 	if (iter)
 		iter->ProceedToNextVariable();
@@ -165,6 +287,18 @@ T DataDeserializer::Read()
 	return value;
 }
 
+template<typename T>
+T DataDeserializer::ReadUnchecked()
+{
+	assert(!iter);
+	assert(IsRawSerializedType<T>::value);
+	assert(BitsLeft() >= sizeof(T) * 8);
+
+	T value;
+	ExtractBytes(&value, sizeof(value));
+	return value;
+}
+
 template<> std::string DataDeserializer::Read<std::string>();
 
 template<> bool DataDeserializer::Read<bit>();
@@ -198,9 +332,41 @@ u32 DataDeserializer::ReadVLE()
 	return sml | (med << VLEType::numBits1) | (large << (VLEType::numBits1 + VLEType::numBits2));
 }
 
+template<typename VLEType>
+void DataDeserializer::ReadVLEArray(u32 *dst, size_t count)
+{
+	assert(!iter);
+	assert(VLEType::maxBits <= 32);
+
+	size_t i = 0;
+	// While a whole word is left in the stream, it holds all the bits any value can take.
+	for(; i < count && elemOfs + 8 <= size; ++i)
+	{
+		int numBits;
+		dst[i] = VLEType::DecodeBranchFree((u32)(LoadWord() >> bitOfs), numBits);
+		bitOfs += numBits;
+		elemOfs += (bitOfs >> 3);
+		bitOfs &= 7;
+	}
+	for(; i < count; ++i)
+	{
+		dst[i] = ReadVLE<VLEType>();
+		if (dst[i] == VLEReadError)
+			throw NetException("Not enough bits left in DataDeserializer::ReadVLEArray!");
+	}
+}
+
 template<typename T>
 void DataDeserializer::ReadArray(T *dst, size_t numElems)
 {
+	if (!iter && IsRawSerializedType<T>::value)
+	{
+		if (numElems > BitsLeft() / 8 / sizeof(T))
+			throw NetException("Not enough bits left in DataDeserializer::ReadArray!");
+		ExtractBytes(dst, numElems * sizeof(T));
+		return;
+	}
+
 	for(size_t i = 0; i < numElems; ++i)
 		dst[i] = Read<T>();
 
@@ -18,6 +18,7 @@
 
 #include <vector>
 #include <cassert>
+#include <cstring>
 #include <string>
 
 #include "kNetBuildConfig.h"
@@ -76,7 +77,13 @@ public:
 	template<typename VLEType>
 	void AddVLE(u32 value);
 
-	/// Appends the given number of bits to the stream.
+	/// Writes the given values the same way as calling AddVLE() on each of them in turn. The values are encoded without
+	/// branching on their ranges into a buffer, four bytes at a time, and appended to the stream a batch at a time.
+	template<typename VLEType>
+	void AddVLEArray(const u32 *values, size_t count);
+
+	/// Appends the given number of bits to the stream. The bits are merged to the partial byte at the end of the stream
+	/// and written out as a single word.
 	/// @param value The variable where the bits are taken from. The bits are read from the LSB first, towards the MSB end of the value.
 	/// @param numBits The number of bits to write, in the range [1, 32].
 	void AppendBits(u32 value, int numBits);
@@ -196,6 +203,23 @@ public:
 	///	 "map" plane.
 	int AddVector3D(float x, float y, float z, int numBitsYaw, int numBitsPitch, int magnitudeIntegerBits, int magnitudeDecimalBits);
 
+	/// Writes the given floats the same way as calling AddQuantizedFloat() on each of them in turn, and produces the same bits.
+	/// The values are quantized four at a time with SSE2 or NEON, where available, and the bits are packed in with a single
+	/// check of the buffer size. The values may not be NaNs.
+	void AddQuantizedFloatArray(float minRange, float maxRange, int numBits, const float *values, size_t count);
+
+	/// Writes the given floats the same way as calling AddUnsignedFixedPoint() on each of them in turn. See AddQuantizedFloatArray().
+	void AddUnsignedFixedPointArray(int numIntegerBits, int numDecimalBits, const float *values, size_t count);
+
+	/// Writes the given floats the same way as calling AddSignedFixedPoint() on each of them in turn. See AddQuantizedFloatArray().
+	void AddSignedFixedPointArray(int numIntegerBits, int numDecimalBits, const float *values, size_t count);
+
+	/// Writes the given normalized 3D vectors the same way as calling AddNormalizedVector3D() on each of them in turn.
+	/// The spherical angles are computed with the same scalar atan2() and asin() as there, since their SIMD approximations
+	/// would not give the same bits, and the angles are then quantized and packed like in AddQuantizedFloatArray().
+	/// @param xyz The vectors as consecutive (x,y,z) triplets, 3*count floats in total.
+	void AddNormalizedVector3DArray(const float *xyz, size_t count, int numBitsYaw, int numBitsPitch);
+
 	void AddArithmeticEncoded(int numBits, int val1, int max1, int val2, int max2);
 	void AddArithmeticEncoded(int numBits, int val1, int max1, int val2, int max2, int val3, int max3);
 	void AddArithmeticEncoded(int numBits, int val1, int max1, int val2, int max2, int val3, int max3, int val4, int max4);
@@ -212,6 +236,20 @@ public:
 	/// of filling data to the stream.
 	void SkipNumBytes(size_t numBytes);
 
+	/// Returns a pointer to the next numBytes bytes of the stream for the caller to fill in directly, and advances the stream
+	/// past them. Returns 0 and leaves the stream as is if it is not byte-aligned, or if a serialization template is used.
+	/// Throws a NetException if there is not enough room left.
+	char *ReserveAlignedBytes(size_t numBytes)
+	{
+		if (bitOfs != 0 || iter)
+			return 0;
+		if (elemOfs + numBytes > maxBytes)
+			throw NetException("DataSerializer::ReserveAlignedBytes: Attempted to write past the array end buffer!");
+		char *block = data + elemOfs;
+		elemOfs += numBytes;
+		return block;
+	}
+
 	/// @return The number of bytes filled so far. Partial bits at the end are rounded up to constitute a full byte.
 	size_t BytesFilled() const { return elemOfs + ((bitOfs != 0) ? 1 : 0); }
 
@@ -240,9 +278,12 @@ public:
 	/// Returns a string of 0's and 1's corresponding to the given bit indices.
 	std::string DebugReadBits(int startIndex, int endIndex) const;
 private:
-	void AppendByte(u8 byte);
-	void AppendUnalignedByte(u8 byte);
-	void AppendAlignedByte(u8 byte);
+	/// Appends the given bytes to the stream. When the stream is byte-aligned, they are copied in as a block.
+	void AppendBytes(const void *src, size_t numBytes);
+	/// Appends the given bytes to a stream that is not byte-aligned, a word at a time.
+	void AppendUnalignedBytes(const u8 *src, size_t numBytes);
+	/// Appends the given amount of bits, [1, 32], of each of the given values, checking the buffer size only once.
+	void AppendBitsArray(const u32 *values, size_t count, int numBits);
 
 	/// Iterator that iterates a template that specifies the elements that are present in the message.
 	Ptr(SerializedDataIterator) iter;
@@ -272,15 +313,23 @@ void DataSerializer::Add(const T &value)
 		assert(nextExpectedType == currentFilledType);
 	}
 #endif
-	const u8 *data = reinterpret_cast<const u8*>(&value);
-
-	for(size_t i = 0; i < sizeof(value); ++i)
-		AppendByte(data[i]);
+	AppendBytes(&value, sizeof(value));
 
 	if (iter)
 		iter->ProceedToNextVariable();
 }
 
+inline void DataSerializer::AppendBytes(const void *src, size_t numBytes)
+{
+	if (bitOfs == 0 && elemOfs + numBytes <= maxBytes)
+	{
+		memcpy(data + elemOfs, src, numBytes);
+		elemOfs += numBytes;
+	}
+	else
+		AppendUnalignedBytes(reinterpret_cast<const u8*>(src), numBytes);
+}
+
 template<> void DataSerializer::Add<char*>(char * const & value);
 template<> void DataSerializer::Add<const char*>(const char * const & value);
 template<> void DataSerializer::Add<std::string>(const std::string &value);
@@ -304,10 +353,47 @@ void DataSerializer::AddVLE(u32 value)
 	}
 }
 
+template<typename VLEType>
+void DataSerializer::AddVLEArray(const u32 *values, size_t count)
+{
+	assert(!iter); // Can't use with a template.
+	assert(VLEType::bitsValue1 % 8 == 0 && VLEType::maxBits % 8 == 0 && VLEType::maxBits <= 32);
+
+	const size_t cBatchSize = 64;
+	u8 encoded[cBatchSize * 4];
+	for(size_t i = 0; i < count; i += cBatchSize)
+	{
+		const size_t batchSize = (count - i < cBatchSize) ? count - i : cBatchSize;
+		size_t numBytes = 0;
+		for(size_t j = 0; j < batchSize; ++j)
+		{
+			const u32 value = values[i + j];
+			if (value > VLEType::maxValue)
+				throw NetException("DataSerializer::AddVLEArray: Trying to encode too large value!");
+			int numBits;
+			const u32 word = VLEType::EncodeBranchFree(value, numBits);
+			// All four bytes are written, and the ones past the encoded length are overwritten by the next value.
+			encoded[numBytes] = (u8)word;
+			encoded[numBytes + 1] = (u8)(word >> 8);
+			encoded[numBytes + 2] = (u8)(word >> 16);
+			encoded[numBytes + 3] = (u8)(word >> 24);
+			numBytes += numBits >> 3;
+		}
+		AppendBytes(encoded, numBytes);
+	}
+}
+
 /// Appends the given amount of elements from the passed array.
 template<typename T>
 void DataSerializer::AddArray(const T *data, u32 count)
 {
+	// Without a template to step through for each element, an array of raw values is a single block of bytes.
+	if (!iter && IsRawSerializedType<T>::value)
+	{
+		AppendBytes(data, count * sizeof(T));
+		return;
+	}
+
 	for(u32 i = 0; i < count; ++i)
 		Add<T>(data[i]); 
 
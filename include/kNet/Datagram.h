@@ -21,6 +21,9 @@ namespace kNet
 
 static const unsigned long cDatagramBufferSize = 3 * 512;
 
+/// The largest UDP datagram kNet sends or accepts. This fills a 9000-byte jumbo frame together with the IPv4 and UDP headers.
+static const unsigned long cMaxDatagramSize = 9000 - 28;
+
 /// @internal Datagram stores the raw data of a received UDP datagram.
 struct Datagram
 {
@@ -0,0 +1,119 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file DatagramBuffer.h
+	@brief The DatagramBuffer class. A pooled, reference-counted buffer that UDP datagrams are received to, and that
+	broadcast messages are serialized to, or that maps a file to memory, or that refers to the memory of the application. */
+
+#include <cstddef>
+
+namespace kNet
+{
+
+class IBufferReleaseHandler;
+
+/// @internal A reference-counted buffer that a UDP listen socket receives datagrams to.
+/** The datagrams read to a buffer (a single one, or several if the kernel coalesced the reads) are passed on to the
+	connections they belong to without copying. Each queued datagram holds a reference to the buffer, and the buffer is
+	returned to a process-wide pool when the last reference is released. Allocating, referencing and releasing the buffers
+	are all thread-safe, so that a buffer filled in by one worker thread can be released by the worker thread of a connection.
+	NetworkServer also serializes each broadcast message once to a buffer, and the messages queued to each client refer to it.
+	MessageConnection::SendFile and MessageConnection::ReceiveFile use buffers that map a file to memory instead, so that the
+	messages refer to the bytes of the file directly. The file is unmapped and closed when the last reference is released.
+	MessageConnection::SendBuffer wraps the memory of the application the same way, and hands it back to the application
+	when the last reference is released. */
+class DatagramBuffer
+{
+public:
+	/// Returns a buffer of at least the given size from the pool, with a reference count of one.
+	static DatagramBuffer *Allocate(size_t capacity);
+
+	/// Deallocates the unused buffers that are cached in the pool. [thread-safe]
+	static void ClearPool();
+
+	/// Maps the whole contents of the given file to a read-only buffer, whose Capacity() is the size of the file.
+	/// @return A buffer with a reference count of one, or 0 if the file could not be opened or mapped.
+	static DatagramBuffer *MapFileForReading(const char *filename);
+
+	/// Creates or truncates the given file, resizes it to the given size and maps it to a writable buffer.
+	/// @return A buffer with a reference count of one, or 0 if the file could not be created or mapped.
+	static DatagramBuffer *MapFileForWriting(const char *filename, size_t size);
+
+	/// Wraps the given bytes owned by the application to a read-only buffer, without copying them. When the last reference
+	/// is released, releaseHandler->ReleaseBuffer() is called with the bytes instead of returning the buffer to the pool.
+	/// @return A buffer with a reference count of one.
+	static DatagramBuffer *WrapExternal(const char *data, size_t numBytes, IBufferReleaseHandler *releaseHandler);
+
+	/// Returns true if this buffer maps a file instead of being allocated from the pool.
+	bool IsMappedFile() const { return mappedFile; }
+
+	/// Sets the size the file of a writable mapping is truncated to when the buffer is released. Must not exceed Capacity().
+	void SetFileSize(size_t size);
+
+#ifdef WIN32
+	/// Returns the handle of the mapped file, or INVALID_HANDLE_VALUE if this is not a mapped file.
+	void *FileHandle() const { return fileHandle; }
+#else
+	/// Returns the file descriptor of the mapped file, or -1 if this is not a mapped file.
+	int FileDescriptor() const { return fileDescriptor; }
+#endif
+
+	char *Data() { return data; }
+	const char *Data() const { return data; }
+	size_t Capacity() const { return capacity; }
+
+	/// Returns the current number of references to this buffer.
+	int RefCount() const { return (int)refCount; }
+
+	/// Takes a new reference to this buffer. [thread-safe]
+	void AddRef();
+
+	/// Releases a reference to this buffer. When the last reference is released, the buffer is returned to the pool and may
+	/// not be accessed anymore. [thread-safe]
+	void Release();
+
+private:
+	explicit DatagramBuffer(size_t capacity);
+	/// Creates an empty buffer for a file mapping or external bytes.
+	DatagramBuffer();
+	~DatagramBuffer();
+
+	/// Opens the given file and maps mapSize bytes of it, resizing the file first if writable is true.
+	bool MapFile(const char *filename, bool writable, size_t mapSize);
+	/// Unmaps the file, truncates a writable file to fileSize, and closes it.
+	void UnmapFile();
+
+	char *data;
+	size_t capacity;
+	volatile long refCount;
+
+	bool mappedFile;
+	bool writable;
+	/// If not null, data is owned by the application and given back to this handler instead of being freed.
+	IBufferReleaseHandler *releaseHandler;
+	/// The size of the file when it is closed.
+	size_t fileSize;
+#ifdef WIN32
+	void *fileHandle;
+	void *mappingHandle;
+#else
+	int fileDescriptor;
+#endif
+
+	DatagramBuffer(const DatagramBuffer &); ///< Not implemented.
+	void operator =(const DatagramBuffer &); ///< Not implemented.
+};
+
+} // ~kNet
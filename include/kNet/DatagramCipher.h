@@ -0,0 +1,89 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file DatagramCipher.h
+	@brief The DatagramCipher class, which encrypts and authenticates the datagrams of a connection with ChaCha20-Poly1305. */
+
+#include <cstddef>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+/// Encrypts and authenticates datagrams with the ChaCha20-Poly1305 AEAD construction of RFC 8439.
+/** The two ends of a connection share a 32-byte key, and the client picks a random salt for each connection. The key of the
+	connection is derived from the two with HChaCha20, so that the connections never share a key. Each datagram is followed
+	by the 64-bit number that forms its nonce, and by the 16-byte authentication tag. The nonces of a direction start from a
+	random number and count up. The direction is part of the nonce, so the two directions never share a nonce either.
+	[Not thread-safe] */
+class DatagramCipher
+{
+public:
+	static const size_t cKeySize = 32;
+	static const size_t cSaltSize = 16;
+	static const size_t cTagSize = 16;
+	/// The number of bytes Encrypt() adds to a datagram: the nonce and the tag.
+	static const size_t cOverhead = 8 + cTagSize;
+
+	DatagramCipher();
+
+	/// Derives the key of a connection from the shared key and the salt of the connection.
+	/// @param isClient True at the end that opened the connection. The two ends encrypt in different directions.
+	void SetKey(const u8 *sharedKey, const u8 *salt, bool isClient);
+
+	/// Returns true once SetKey() has been called.
+	bool HasKey() const { return hasKey; }
+
+	/// Encrypts the given datagram in place, and appends the nonce and the tag to it.
+	/// @param data The datagram, with room for cOverhead more bytes after it.
+	/// @return The size of the encrypted datagram.
+	size_t Encrypt(char *data, size_t numBytes);
+
+	/// Checks that the given datagram was encrypted by the peer and not modified, and decrypts it to dst, which must have
+	/// room for numBytes - cOverhead bytes. dst may be data.
+	/// @return The size of the decrypted datagram, or -1 if the datagram was not authentic.
+	int Decrypt(const char *data, size_t numBytes, char *dst) const;
+
+	/// Computes the authentication tag of a message with a one-time key derived from the given key and salt, for example
+	/// to show that the sender of a connection attempt knows the shared key.
+	static void ComputeTag(const u8 *sharedKey, const u8 *salt, const char *data, size_t numBytes, u8 *tag);
+
+	/// Computes the same tag as ComputeTag() does with the shared key and the salt that the key of this connection was
+	/// derived from.
+	void ComputeTag(const char *data, size_t numBytes, u8 *tag) const;
+
+	/// Computes the authentication tag of a message that is sent outside of the datagrams of the connection, with a one-time
+	/// key derived from the key of the connection and the given number. Both ends compute the same tag. A number must not be
+	/// used for two different messages.
+	void ComputeConnectionTag(u64 number, const char *data, size_t numBytes, u8 *tag) const;
+
+	/// Compares two tags of cTagSize bytes in constant time.
+	static bool TagsEqual(const u8 *a, const u8 *b);
+
+	/// Fills the given buffer with random bytes from the random number generator of the operating system.
+	static void GenerateRandomBytes(u8 *dst, size_t numBytes);
+
+private:
+	u32 key[8];
+	bool hasKey;
+	/// The direction words of the nonces of the outbound and inbound datagrams.
+	u32 sendDirection;
+	u32 receiveDirection;
+	/// The nonce of the next outbound datagram.
+	u64 sendNonce;
+};
+
+} // ~kNet
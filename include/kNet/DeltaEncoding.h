@@ -0,0 +1,64 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file DeltaEncoding.h
+	@brief The delta encoding of a message against an earlier version of its contents, and the DeltaBaselineHistory class. */
+
+#include <cstddef>
+#include <vector>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+/// Encodes the given contents as a delta against the given baseline, and appends the delta to dst.
+/** The delta is the size of the new contents, followed by runs of a count of the bytes that equal the baseline and a count
+	of the bytes that differ from it, each run followed by the differing bytes. The bytes past the end of the baseline are
+	differing bytes. */
+void EncodeDelta(const char *baseline, size_t baselineSize, const char *data, size_t numBytes, std::vector<char> &dst);
+
+/// Reconstructs the contents that EncodeDelta() encoded against the given baseline, and appends them to dst.
+/// @return False if the delta was malformed, or does not fit the baseline. The contents of dst are then unspecified.
+bool DecodeDelta(const char *baseline, size_t baselineSize, const char *delta, size_t deltaSize, std::vector<char> &dst);
+
+/// The latest versions of the contents of a single (messageID, contentID) pair, which the later versions are delta-encoded
+/// against. Each version is identified by the 8 low bits of a running version number. [Not thread-safe]
+class DeltaBaselineHistory
+{
+public:
+	/// The number of versions kept. A version is replaced by the one that is cNumVersions newer.
+	static const int cNumVersions = 8;
+
+	DeltaBaselineHistory();
+
+	/// Returns the contents of the given version, or 0 if the version is not kept.
+	const std::vector<char> *Find(u8 version) const;
+
+	/// Stores the contents of the given version, unless a newer version already has its place.
+	void Store(u8 version, const char *data, size_t numBytes);
+
+private:
+	struct Version
+	{
+		Version():number(0), valid(false) {}
+		u8 number;
+		bool valid;
+		std::vector<char> data;
+	};
+	Version versions[cNumVersions];
+};
+
+} // ~kNet
@@ -0,0 +1,186 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file DeserializeArena.h
+	@brief The DeserializeArena class, which holds the arrays and strings of deserialized messages until it is reset. */
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <cassert>
+
+#include "Types.h"
+#include "NetException.h"
+#include "DataDeserializer.h"
+#include "DataSerializer.h"
+
+namespace kNet
+{
+
+/// An array of count values of type T stored in a DeserializeArena. Valid until the arena is reset.
+template<typename T>
+class ArenaArray
+{
+public:
+	ArenaArray():data(0), count(0) {}
+	ArenaArray(T *data_, size_t count_):data(data_), count(count_) {}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	/// UDB if index >= size().
+	T &operator [](size_t index) { assert(index < count); return data[index]; }
+	const T &operator [](size_t index) const { assert(index < count); return data[index]; }
+
+	T *begin() { return data; }
+	T *end() { return data + count; }
+	const T *begin() const { return data; }
+	const T *end() const { return data + count; }
+
+private:
+	T *data;
+	size_t count;
+};
+
+/// A string stored in a DeserializeArena. Valid until the arena is reset. The characters are null-terminated.
+class ArenaString
+{
+public:
+	ArenaString():str(""), length_(0) {}
+	ArenaString(const char *str_, size_t length__):str(str_), length_(length__) {}
+
+	size_t length() const { return length_; }
+	size_t size() const { return length_; }
+	bool empty() const { return length_ == 0; }
+	const char *c_str() const { return str; }
+
+	/// UDB if index >= length().
+	char operator [](size_t index) const { assert(index < length_); return str[index]; }
+
+	/// Returns a copy of the string that stays valid after the arena is reset.
+	std::string ToString() const { return std::string(str, length_); }
+
+private:
+	const char *str;
+	size_t length_;
+};
+
+/// Holds the variable-length fields of the messages deserialized by the structs SerializationStructCompiler generates with
+/// SetArenaDeserialization() enabled, so that receiving a message with arrays and strings does not allocate.
+/** The arena hands out memory by bumping an offset through a block. When a block runs out, another one is allocated, and
+	the next Reset() replaces them all with a single block large enough for all of them, so once the arena has grown to fit
+	the messages of a handler, it does not allocate again.
+
+	A handler deserializes the message into a struct with the arena, uses it, and calls Reset() before it returns, which
+	invalidates all the ArenaArrays and ArenaStrings handed out since the previous Reset().
+
+	[Not thread-safe, owned by the thread that deserializes the messages.] */
+class DeserializeArena
+{
+public:
+	/// The default number of bytes in the first block.
+	static const size_t cDefaultCapacity = 4096;
+
+	/// @param capacity The number of bytes in the first block. It is allocated when the arena is first used.
+	explicit DeserializeArena(size_t capacity = cDefaultCapacity);
+	~DeserializeArena();
+
+	/// Returns numBytes of memory aligned to the given power of two, valid until the next Reset().
+	void *Allocate(size_t numBytes, size_t alignment)
+	{
+		const size_t start = (used + alignment - 1) & ~(alignment - 1);
+		if (!blocks.empty() && start <= blocks.back().size && numBytes <= blocks.back().size - start)
+		{
+			used = start + numBytes;
+			return blocks.back().data + start;
+		}
+		return AllocateSlow(numBytes, alignment);
+	}
+
+	/// Releases all the memory handed out since the previous Reset(), and merges the blocks into one.
+	void Reset();
+
+	/// Reads count values of type T from the given stream into the arena.
+	/// Throws a NetException if the stream has fewer values left.
+	template<typename T>
+	ArenaArray<T> ReadArray(DataDeserializer &src, size_t count)
+	{
+		// Check the count before allocating, so that a malformed count cannot make the arena grow.
+		if (count > src.BitsLeft() / 8 / sizeof(T))
+			throw NetException("Not enough bits left in DeserializeArena::ReadArray!");
+		if (count == 0)
+			return ArenaArray<T>();
+		T *dst = static_cast<T*>(Allocate(count * sizeof(T), sizeof(T) < sizeof(u64) ? sizeof(T) : sizeof(u64)));
+		src.ReadArray<T>(dst, count);
+		return ArenaArray<T>(dst, count);
+	}
+
+	/// Reads a string written by DataSerializer::AddString() into the arena. The characters are validated like
+	/// DataDeserializer::ReadString() does. Throws a NetException if the stream does not contain the whole string.
+	ArenaString ReadString(DataDeserializer &src);
+
+	/// Returns the number of bytes handed out since the previous Reset().
+	size_t BytesUsed() const { return usedInFullBlocks + used; }
+
+	/// Returns the total number of bytes in the blocks of the arena.
+	size_t Capacity() const;
+
+	/// Returns the number of blocks the arena has.
+	int NumBlocks() const { return (int)blocks.size(); }
+
+private:
+	struct Block
+	{
+		char *data;
+		size_t size;
+	};
+
+	std::vector<Block> blocks;
+	/// The number of bytes handed out of the last block.
+	size_t used;
+	/// The number of bytes handed out of the blocks before the last one, including the ones left at their ends.
+	size_t usedInFullBlocks;
+	size_t initialCapacity;
+
+	void *AllocateSlow(size_t numBytes, size_t alignment);
+
+	DeserializeArena(const DeserializeArena &); ///< @note Not implemented.
+	void operator =(const DeserializeArena &); ///< @note Not implemented.
+};
+
+/// Serializes an ArenaString the same way as a std::string, so that the structs generated with arena deserialization can
+/// be sent as well.
+template<>
+class TypeSerializer<ArenaString>
+{
+public:
+	static size_t Size(const ArenaString &value)
+	{
+		return VLE8_16_32::GetEncodedBitLength((u32)value.length()) / 8 + value.length();
+	}
+
+	static void SerializeTo(DataSerializer &dst, const ArenaString &src)
+	{
+		dst.AddVLE<VLE8_16_32>((u32)src.length());
+		dst.AddArray<s8>((const s8*)src.c_str(), src.length());
+	}
+
+	static void DeserializeFrom(DataDeserializer &src, ArenaString &dst, DeserializeArena &arena)
+	{
+		dst = arena.ReadString(src);
+	}
+};
+
+} // ~kNet
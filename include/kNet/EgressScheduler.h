@@ -0,0 +1,125 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file EgressScheduler.h
+	@brief The EgressScheduler class, which shares a send bandwidth budget between the connections of a server. */
+
+#include "Types.h"
+#include "Clock.h"
+#include "Lockable.h"
+#include "TokenBucket.h"
+
+namespace kNet
+{
+
+/// Shares a total send rate between many connections by deficit round robin, and lets the critical messages through first.
+/** The total rate is enforced with a token bucket. On top of it, time is divided into rounds of cRoundMSecs. The first
+	time a connection wants to send in a round, it is credited its share of the bytes of the round, in proportion to its
+	weight over the total weight of the connections that sent in the previous round. A connection may send while its
+	credit is positive, and goes into debt by the part of the last datagram that exceeds the credit, which is paid back
+	from its share of the next rounds. The credit that a connection does not use is not carried over, so an idle
+	connection cannot save up for a burst. The shares of the connections that send less than their credit are left in the
+	token bucket, and once the bucket fills over a threshold, the connections that are out of credit may spend them.
+
+	The bytes of a datagram whose most important message has at least CriticalPriority() are charged the same way, but
+	such a datagram does not wait for the credit of its connection, and it may use the part of the token bucket that
+	other datagrams leave unused as a reserve. This way the critical messages of every connection go out first when the
+	total rate is saturated by bulk transfers.
+
+	The state of each connection is kept in a Flow, which the connection owns. The functions are thread-safe, so the
+	connections of many worker threads can share one scheduler. */
+class EgressScheduler
+{
+public:
+	/// The length of a scheduling round.
+	static const int cRoundMSecs = 10;
+	/// The token bucket holds up to this many msecs worth of sends.
+	static const int cBurstMSecs = 20;
+	/// The number of bytes the token bucket holds, at least.
+	static const int cMinBurstBytes = 4096;
+
+	/// The share of a connection. Owned by the connection, and only accessed by the scheduler while it holds its lock.
+	struct Flow
+	{
+		Flow()
+		:weight(1), deficit(0), round(0)
+		{
+		}
+
+		/// The relative share of the bandwidth of this connection. At least 1. [set by main thread, read by the scheduler]
+		volatile int weight;
+		/// The credit left in the current round, in bytes. Negative if the connection is in debt.
+		double deficit;
+		/// The round the connection was last credited in, or 0 if never.
+		u32 round;
+	};
+
+	EgressScheduler();
+
+	/// Sets the total send rate. Pass in 0 to not limit the rate, in which case the scheduler lets everything through.
+	void SetRate(int bytesPerSec, tick_t now);
+
+	/// Returns the total send rate, or 0 if the rate is not limited.
+	int Rate() const { return rate; }
+
+	/// Returns true if a total send rate has been set.
+	bool IsLimited() const { return rate > 0; }
+
+	/// Sets the message priority from which on a datagram is critical. The default is NetworkMessage::cMaxPriority.
+	void SetCriticalPriority(unsigned long priority) { criticalPriority = priority; }
+
+	unsigned long CriticalPriority() const { return criticalPriority; }
+
+	/// Returns the number of msecs until the given connection may send a datagram, rounded up, or 0 if it may send now.
+	/// @param priority The priority of the most important message that would go in the datagram.
+	unsigned long MSecsUntilSend(Flow &flow, unsigned long priority, tick_t now);
+
+	/// Charges the given number of sent bytes to the total rate and to the given connection.
+	void Consume(Flow &flow, size_t numBytes, tick_t now);
+
+	/// Returns the number of bytes charged to this scheduler while it limited the rate.
+	u64 BytesSent() const { return bytesSent; }
+
+private:
+	struct State
+	{
+		TokenBucket bucket;
+		/// The tokens below this are only spent on critical datagrams.
+		double criticalReserve;
+		/// While the bucket holds at least this many tokens, the bandwidth is going unused, and the connections that have
+		/// run out of credit may send too.
+		double spareThreshold;
+		/// The number of the current round. Starts from 1.
+		u32 round;
+		tick_t roundStartTick;
+		/// The total weight of the connections that have been credited in the previous and in the current round.
+		double previousRoundWeight;
+		double roundWeight;
+	};
+
+	Lockable<State> state;
+
+	volatile int rate;
+	volatile unsigned long criticalPriority;
+	volatile u64 bytesSent;
+
+	/// Starts a new round if the current one is over. [state locked]
+	static void AdvanceRound(State &s, tick_t now);
+
+	/// Credits the given connection its share of the current round, if it has not been credited yet. [state locked]
+	void CreditFlow(State &s, Flow &flow) const;
+};
+
+} // ~kNet
@@ -65,6 +65,18 @@ struct EndPoint
 		return false;
 	}
 
+	///\todo Not IPv6-capable.
+	static EndPoint FromIPAndPort(unsigned char a, unsigned char b, unsigned char c, unsigned char d, unsigned short port)
+	{
+		EndPoint endPoint;
+		endPoint.ip[0] = a;
+		endPoint.ip[1] = b;
+		endPoint.ip[2] = c;
+		endPoint.ip[3] = d;
+		endPoint.port = port;
+		return endPoint;
+	}
+
 	///\todo Not IPv6-capable.
 	static EndPoint FromSockAddrIn(const sockaddr_in &addr)
 	{
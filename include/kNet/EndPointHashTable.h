@@ -0,0 +1,276 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file EndPointHashTable.h
+	@brief The EndPointHashTable<T> template class. An open-addressing hash table from EndPoints to object pointers. */
+
+#include <vector>
+#include <cassert>
+
+#include "Types.h"
+#include "EndPoint.h"
+#include "Atomics.h"
+
+namespace kNet
+{
+
+/// An open-addressing hash table that maps EndPoints to pointers to objects of type T.
+/** The address and the port of an EndPoint are packed into a single 64-bit key, and the table is probed linearly over a
+	flat array of keys and values, so a lookup usually touches a single cache line.
+
+	The table has a single writer and any number of readers. Lookups do not lock: the writer increments a sequence counter
+	before and after each modification, and a reader that overlapped a modification probes again. The caller must serialize
+	the modifications. The arrays that the table has grown out of are kept until the table is destroyed, since a reader may
+	still be probing them. As the table grows by doubling, this at most doubles the memory it uses. */
+template<typename T>
+class EndPointHashTable
+{
+public:
+	EndPointHashTable()
+	:sequence(0), size(0), numUsedSlots(0)
+	{
+		table = NewTable(cInitialCapacity);
+	}
+
+	~EndPointHashTable()
+	{
+		for(size_t i = 0; i < retiredTables.size(); ++i)
+			DeleteTable(retiredTables[i]);
+		DeleteTable(table);
+	}
+
+	/// Returns the object mapped to the given endpoint, or 0 if there is none. [thread-safe]
+	T *Find(const EndPoint &endPoint) const
+	{
+		const u64 key = Key(endPoint);
+		for(;;)
+		{
+			const u32 seq = sequence;
+			if ((seq & 1) != 0)
+				continue; // A modification is in progress.
+			FullMemoryBarrier();
+			T *value = Probe(table, key);
+			FullMemoryBarrier();
+			if (sequence == seq)
+				return value;
+		}
+	}
+
+	/// Maps the given endpoint to the given object, replacing any previous mapping of the endpoint. [writer]
+	void Insert(const EndPoint &endPoint, T *value)
+	{
+		assert(value);
+		const u64 key = Key(endPoint);
+		if ((numUsedSlots + 1) * 4 > (table->mask + 1) * 3)
+			Rehash();
+
+		Table *t = table;
+		size_t tombstone = (size_t)-1;
+		for(size_t i = Hash(key) & t->mask;; i = (i + 1) & t->mask)
+		{
+			Slot &slot = t->slots[i];
+			if (slot.key == key)
+			{
+				BeginWrite();
+				slot.value = value;
+				EndWrite();
+				return;
+			}
+			if (slot.key == cTombstoneKey && tombstone == (size_t)-1)
+				tombstone = i;
+			if (slot.key == cEmptyKey)
+			{
+				if (tombstone != (size_t)-1)
+					i = tombstone;
+				else
+					++numUsedSlots;
+				BeginWrite();
+				t->slots[i].value = value;
+				t->slots[i].key = key;
+				EndWrite();
+				++size;
+				return;
+			}
+		}
+	}
+
+	/// Removes the mapping of the given endpoint, if there is one. [writer]
+	void Remove(const EndPoint &endPoint)
+	{
+		const u64 key = Key(endPoint);
+		Table *t = table;
+		for(size_t i = Hash(key) & t->mask; t->slots[i].key != cEmptyKey; i = (i + 1) & t->mask)
+			if (t->slots[i].key == key)
+			{
+				BeginWrite();
+				t->slots[i].key = cTombstoneKey;
+				t->slots[i].value = 0;
+				EndWrite();
+				--size;
+				return;
+			}
+	}
+
+	/// Removes all mappings. [writer]
+	void Clear()
+	{
+		BeginWrite();
+		for(size_t i = 0; i <= table->mask; ++i)
+		{
+			table->slots[i].key = cEmptyKey;
+			table->slots[i].value = 0;
+		}
+		EndWrite();
+		size = 0;
+		numUsedSlots = 0;
+	}
+
+	/// Returns the number of endpoints mapped in the table. [writer]
+	size_t Size() const { return size; }
+
+private:
+	struct Slot
+	{
+		u64 key;
+		T *value;
+	};
+
+	struct Table
+	{
+		Slot *slots;
+		size_t mask;
+	};
+
+	static const size_t cInitialCapacity = 64;
+	/// The key of an unused slot. Real keys are offset by one, so they never collide with it.
+	static const u64 cEmptyKey = 0;
+	/// The key of a slot whose mapping has been removed. Real keys only use the low 49 bits.
+	static const u64 cTombstoneKey = ~(u64)0;
+
+	volatile u32 sequence;
+	Table * volatile table;
+	size_t size;
+	/// The number of slots that are either in use or tombstones.
+	size_t numUsedSlots;
+	std::vector<Table*> retiredTables;
+
+	static u64 Key(const EndPoint &endPoint)
+	{
+		const u64 ip = ((u64)endPoint.ip[0] << 24) | ((u64)endPoint.ip[1] << 16) | ((u64)endPoint.ip[2] << 8) | (u64)endPoint.ip[3];
+		return ((ip << 16) | endPoint.port) + 1;
+	}
+
+	static size_t Hash(u64 key)
+	{
+		return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+
+	static T *Probe(const Table *t, u64 key)
+	{
+		// Bound the probe by the size of the table, since a concurrent modification may leave it without an empty slot to stop at.
+		size_t i = Hash(key) & t->mask;
+		for(size_t n = 0; n <= t->mask; ++n, i = (i + 1) & t->mask)
+		{
+			const u64 slotKey = t->slots[i].key;
+			if (slotKey == key)
+				return t->slots[i].value;
+			if (slotKey == cEmptyKey)
+				return 0;
+		}
+		return 0;
+	}
+
+	static Table *NewTable(size_t capacity)
+	{
+		Table *t = new Table;
+		t->slots = new Slot[capacity];
+		t->mask = capacity - 1;
+		for(size_t i = 0; i < capacity; ++i)
+		{
+			t->slots[i].key = cEmptyKey;
+			t->slots[i].value = 0;
+		}
+		return t;
+	}
+
+	static void DeleteTable(Table *t)
+	{
+		delete[] t->slots;
+		delete t;
+	}
+
+	static void InsertForRehash(Table *t, const Slot &slot)
+	{
+		size_t i = Hash(slot.key) & t->mask;
+		while(t->slots[i].key != cEmptyKey)
+			i = (i + 1) & t->mask;
+		t->slots[i] = slot;
+	}
+
+	/// Moves the mappings to a new array of twice the size if the table is getting full. If the array is mostly filled with
+	/// tombstones instead, rebuilds it in place, which is safe for the readers, since they only need the array to stay allocated.
+	void Rehash()
+	{
+		const size_t capacity = table->mask + 1;
+		if ((size + 1) * 2 > capacity)
+		{
+			Table *t = NewTable(capacity * 2);
+			for(size_t i = 0; i < capacity; ++i)
+				if (table->slots[i].key != cEmptyKey && table->slots[i].key != cTombstoneKey)
+					InsertForRehash(t, table->slots[i]);
+
+			BeginWrite();
+			retiredTables.push_back((Table*)table);
+			table = t;
+			EndWrite();
+		}
+		else
+		{
+			std::vector<Slot> live;
+			live.reserve(size);
+			for(size_t i = 0; i < capacity; ++i)
+				if (table->slots[i].key != cEmptyKey && table->slots[i].key != cTombstoneKey)
+					live.push_back(table->slots[i]);
+
+			BeginWrite();
+			for(size_t i = 0; i < capacity; ++i)
+			{
+				table->slots[i].key = cEmptyKey;
+				table->slots[i].value = 0;
+			}
+			for(size_t i = 0; i < live.size(); ++i)
+				InsertForRehash(table, live[i]);
+			EndWrite();
+		}
+		numUsedSlots = size;
+	}
+
+	void BeginWrite()
+	{
+		++sequence;
+		FullMemoryBarrier();
+	}
+
+	void EndWrite()
+	{
+		FullMemoryBarrier();
+		++sequence;
+	}
+
+	EndPointHashTable(const EndPointHashTable &); ///< Not implemented.
+	void operator =(const EndPointHashTable &); ///< Not implemented.
+};
+
+} // ~kNet
@@ -51,7 +51,9 @@ enum EventWaitType
 	- The default destructor of an Event does NOT delete the event. Before letting the last copy of an Event go out of scope,
 	  manually call \ref kNet::Event::Close "Close()" on that Event.
 
-	This class represents a WSAEVENT on Windows, and socket or a pipe on unix. */
+	This class represents a WSAEVENT on Windows, and socket or a pipe (an eventfd on Linux) on unix. On unix, the state
+	of a signal event is also kept in a flag that all its copies share, so Test() is a memory load, and the descriptor
+	is only written when the event goes from cleared to set. */
 class Event
 {
 public:
@@ -100,7 +102,19 @@ public:
 	explicit Event(WSAEVENT wsaEvent, EventWaitType eventType);
 #elif defined(KNET_UNIX) || defined(ANDROID)
 public:
-	int fd[2]; // fd[0] is used for reading, fd[1] for writing.
+	int fd[2]; // fd[0] is used for reading, fd[1] for writing. If the event is backed by an eventfd, these are the same descriptor.
+
+	/// The set/cleared flag of a signal event, shared by all its copies. Null for the events that wrap a socket.
+	/// One of the EventState values. The descriptor is readable exactly when this is EventRaised, except while a Set()
+	/// or Reset() is in progress.
+	volatile long *state;
+
+	enum EventState
+	{
+		EventCleared = 0,
+		EventRaising = 1, ///< A Set() has raised the flag and is writing the descriptor. Only that Set() moves the flag on.
+		EventRaised = 2 ///< The descriptor has been written. The Reset() that clears the flag reads it back.
+	};
 
 	/// Wraps the given socket file descriptor into this event.
 	explicit Event(int /*SOCKET*/ fd, EventWaitType eventType);
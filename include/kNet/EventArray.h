@@ -22,6 +22,15 @@
 #include <sys/select.h>
 #endif
 
+#ifdef KNET_USE_EPOLL
+#include <sys/epoll.h>
+#include "Types.h"
+#endif
+
+#ifdef KNET_USE_IOCP
+#include "Types.h"
+#endif
+
 #include "Event.h"
 
 namespace kNet
@@ -29,19 +38,27 @@ namespace kNet
 
 /// EventArray stores a list of events and allows the application to simultaneously wait for any of them to
 /// become set. This object never calls Create() or Close() on any Event that is added to it.
+/** The array can be used in two ways: either rebuilt with Clear() and AddEvent() before each Wait(), or built once,
+	after which the individual entries are updated in place with SetEvent() when the interest in them changes. The
+	latter avoids the cost of re-registering every descriptor to the OS at each wait when kNet is built with KNET_USE_EPOLL. */
 class EventArray
 {
 public:
 	/// Constructs an EventArray with an empty list of events.
 	EventArray();
 
+	~EventArray();
+
 	/// Removes all the events added with AddEvent from this EventArray.
 	void Clear();
 
 	/// Adds the given event to the array. There is a limitation of maximum of 64 simultaneous Events that can be added
-	/// to an array.
+	/// to an array. (When kNet is built with KNET_USE_EPOLL or KNET_USE_IOCP, there is no upper limit)
 	void AddEvent(const Event &e);
 
+	/// Replaces the event at the given index with a new one. The index must have been previously added with AddEvent().
+	void SetEvent(int index, const Event &e);
+
 	/// This status code is returned by Wait when none of the added events were triggered during the timeout period.
 	static const int WaitTimedOut = -1;
 	
@@ -53,16 +70,103 @@ public:
 	/// EventArray::WaitFailed if there were invalid event objects added in the array.
 	int Wait(int msecs);
 
+	/// Waits for any of the added events to be triggered, and returns the indices of signalled events in signalledIndices (in no
+	/// particular order). Returns the number of signalled events, or EventArray::WaitTimedOut or EventArray::WaitFailed.
+	/// The implementation may report only a subset of the signalled events, but always at least one if the wait did not time out.
+	int Wait(int msecs, std::vector<int> &signalledIndices);
+
 	/// Returns the number of events added to the array.
 	int Size() const;
 
+	/// Specifies whether the events are waited on in edge-triggered or level-triggered mode. The default is level-triggered.
+	/// In edge-triggered mode, an event is reported only once per state change, so the caller must then consume the
+	/// socket until it would block, or the event will not be reported again. Only has an effect with KNET_USE_EPOLL.
+	void SetEdgeTriggered(bool edgeTriggered);
+
+	/// Forgets all the descriptors registered to the OS from previous Wait calls. Call this when the set of objects
+	/// that the added events refer to has changed, since a closed descriptor may be reused by the OS for a new object.
+	/// Only has an effect with KNET_USE_EPOLL and KNET_USE_IOCP.
+	void ResetRegistrations();
+
 private:
+	EventArray(const EventArray &); ///< Noncopyable, not implemented.
+	void operator =(const EventArray &); ///< Noncopyable, not implemented.
+
 	static const int maxEvents = 64; ///< WSAWaitForMultipleEvents has a built-in limit of 64 items, hence this value.
 	int numAdded;
 
-#ifdef WIN32
+#if defined(WIN32) && defined(KNET_USE_IOCP)
+	/// Tracks the wait of the I/O completion port on the event at a single index.
+	struct WaitSlot
+	{
+		EventArray *owner;
+		int index;
+		WSAEVENT event; ///< The event at this index, or NULL if the index is not waited on (a dummy event).
+		HANDLE waitPacket; ///< The wait completion packet that queues a completion to the port when the event is set.
+		HANDLE registeredWait; ///< The thread pool wait used instead of waitPacket on systems that do not have them.
+		/// Identifies the current wait on this slot. The completions of earlier waits that were cancelled are ignored.
+		u32 generation;
+		bool armed; ///< If true, the port is waiting on the event of this slot.
+		bool dirty; ///< If true, this slot is in the dirtySlots list.
+	};
+
+	HANDLE completionPort;
+	/// Indexed by the event index. The slots are allocated separately, since the thread pool waits refer to them.
+	std::vector<WaitSlot*> slots;
+	/// The slots that need to be armed before the next wait.
+	std::vector<int> dirtySlots;
+	std::vector<OVERLAPPED_ENTRY> completions;
+
+	/// Points the slot at the given index to a new event. Cancels the wait on its previous event.
+	void AssignSlot(int index, const Event &e);
+	/// Starts a one-shot wait of the port on the event of the given slot.
+	void ArmSlot(WaitSlot &slot);
+	/// Stops the wait on the event of the given slot, if any.
+	void DisarmSlot(WaitSlot &slot);
+	void MarkDirty(WaitSlot &slot);
+	/// Called by the thread pool when the event of a slot is set, on the systems that do not have wait completion packets.
+	static VOID CALLBACK RegisteredWaitCallback(PVOID context, BOOLEAN timedOut);
+
+#elif defined(WIN32)
 	WSAEVENT events[maxEvents]; 
 
+#elif defined(KNET_USE_EPOLL)
+	/// Tracks the registration of a single file descriptor in the epoll set.
+	struct DescriptorSlot
+	{
+		int readIndex; ///< The smallest index of the added events waiting for this descriptor to become readable, or -1.
+		int writeIndex; ///< The smallest index of the added events waiting for this descriptor to become writable, or -1.
+		int numReadRefs; ///< The number of added events waiting for this descriptor to become readable.
+		int numWriteRefs; ///< The number of added events waiting for this descriptor to become writable.
+		u32 registeredEvents; ///< The epoll event mask currently registered to the kernel for this descriptor, or 0 if not registered.
+		bool dirty; ///< If true, this descriptor is in the dirtyDescriptors list.
+	};
+
+	int epollFd;
+	bool edgeTriggered;
+	/// The number of added events that refer to an actual descriptor, i.e. are not dummy events.
+	int numDescriptorEvents;
+	/// Cache a list of all added events here, to be able to update the descriptor bookkeeping when an event is replaced.
+	std::vector<Event> cachedEvents;
+	/// Indexed by the file descriptor number.
+	std::vector<DescriptorSlot> descriptors;
+	/// The descriptors whose epoll registration needs to be updated before the next wait.
+	std::vector<int> dirtyDescriptors;
+	/// The descriptors reported ready that have not yet been returned by Wait. (edge-triggered mode only)
+	std::vector<epoll_event> pendingDescriptors;
+	std::vector<epoll_event> readyEvents;
+
+	void AddEventReference(const Event &e, int index);
+	void RemoveEventReference(const Event &e, int index);
+	DescriptorSlot &Descriptor(int fd);
+	/// Registers, updates and unregisters the dirty descriptors in the epoll set to match the currently added events.
+	void SyncRegistrations();
+	/// Returns the smallest event index the given ready descriptor signals, or -1 if the descriptor is not in the array.
+	int EventIndexForDescriptor(int fd, u32 events) const;
+	/// Performs the actual wait. Returns the number of entries filled to readyEvents, 0 on timeout, or -1 on failure.
+	int EpollWait(int msecs);
+	void CloseEpoll();
+
 #elif defined(KNET_UNIX) || defined(ANDROID)
 	fd_set readfds;
 	fd_set writefds;
@@ -71,6 +175,13 @@ private:
 	/// Cache a list of all added events here. This is to remember the order in which the events were added, so that
 	/// we can correctly return the occurred event with the smallest index.
 	std::vector<Event> cachedEvents;
+	/// If true, an event was replaced with SetEvent() and the fd_sets need to be recomputed.
+	bool fdSetsDirty;
+
+	void AddToFdSets(const Event &e);
+	/// Performs the select() call. The result sets are returned in the given fd_sets.
+	int Select(int msecs, fd_set &readResult, fd_set &writeResult);
+	bool IsSignalled(const Event &e, const fd_set &readResult, const fd_set &writeResult) const;
 #endif
 };
 
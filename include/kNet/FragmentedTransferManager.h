@@ -19,17 +19,33 @@
 
 #include <vector>
 #include <list>
+#include <vector>
+#include <map>
+#include <string>
+
+#include "Types.h"
+#include "ContentIDHashTable.h"
+#include "Lockable.h"
+#include "IMessageHandler.h"
 
 namespace kNet
 {
 
 class NetworkMessage;
+class DatagramBuffer;
 
 /// @internal Manages the allocation of transferIDs to fragmented message transfers and tracks which of the fragments have
 /// successfully been sent over to the receiver.
 class FragmentedSendManager
 {
 public:
+	/// The largest transfer ID. Transfer IDs are sent as VLE-1.7/8 numbers.
+	static const int cMaxTransferID = 0x7FFF;
+
+	/// Each transfer keeps at least this many bytes of fragments queued or in flight, so that a single transfer can fill a
+	/// small congestion window. The UDP transport keeps twice the congestion window if that is larger.
+	static const size_t cMinSendWindowBytes = 64 * 1024;
+
 	struct FragmentedTransfer
 	{
 		int id;
@@ -37,6 +53,41 @@ public:
 		/// The total number of fragments in this message.
 		size_t totalNumFragments;
 
+		/// The whole message the fragments are cut from. The fragments are created a send window at a time, as the peer
+		/// acks the previous ones, so that a large message does not flood the outbound queue. The transfer owns the message,
+		/// and frees it once the last fragment has been created, or the transfer is aborted.
+		NetworkMessage *source;
+		/// The number of message bytes in each fragment, except maybe the last one.
+		size_t fragmentSize;
+		/// The number of fragments that have been cut from the source so far.
+		size_t numFragmentsCreated;
+		/// The number of message bytes in the fragments that are queued or waiting for an ack.
+		size_t bytesOutstanding;
+
+		/// The size of the whole message, and how many bytes of it the peer has acked.
+		size_t totalBytes;
+		size_t bytesAcked;
+		/// The value of bytesAcked that was last reported to the application. See IMessageHandler::HandleOutboundTransferProgress().
+		size_t bytesAckedReported;
+
+		/// The ack handler of the whole message, taken over from the source message. Told when bytesAcked reaches totalBytes,
+		/// or when the transfer is aborted or freed before that. See NetworkMessage::ackHandler.
+		IMessageAckHandler *ackHandler;
+
+		/// The message ID and the content ID of the whole message. contentID is 0 if the message has none.
+		u32 messageID;
+		u32 contentID;
+
+		/// If true, a newer message with the same content ID has aborted this transfer, and the peer has not yet acked
+		/// the FragmentedTransferAbort message for it. The transfer ID stays allocated until then.
+		bool abortPending;
+
+		/// The position of the whole message in its ordering channel, shared by all the fragments. See NetworkMessage::orderNumber.
+		u32 orderNumber;
+		bool hasOrderNumber;
+		/// The ordering channel of the whole message, so that an aborted transfer can tell the peer which position to skip.
+		u8 orderingChannel;
+
 		std::list<NetworkMessage*> fragments;
 
 		void AddMessage(NetworkMessage *message);
@@ -48,24 +99,56 @@ public:
 	typedef std::list<FragmentedTransfer> TransferList;
 	TransferList transfers;
 
+	/// The transfers of the messages that have a content ID, and have not been aborted or finished yet.
+	ContentIDHashTable<FragmentedTransfer> contentIDTransfers;
+
 	/// Returns a new FragmentedTransfer. A transferID for this transfer will not have been allocated here.
 	/// When sending the message is finished, call FreeFragmentedTransfer.
 	FragmentedTransfer *AllocateNewFragmentedTransfer();
 	void RemoveMessage(FragmentedTransfer *transfer, NetworkMessage *message);
 
+	/// Allocates the smallest free transfer ID, so that the ID usually fits in one byte on the wire.
 	/// @return True if the allocation succeeded, false otherwise.
 	bool AllocateFragmentedTransferID(FragmentedTransfer &transfer);
 
 	void FreeAllTransfers();
 
+	/// Returns the transfer of the given (messageID, contentID) pair that is in progress, or 0 if there is none.
+	FragmentedTransfer *FindTransferWithContentID(u32 messageID, u32 contentID);
+
+	/// Starts tracking the content ID of the given transfer, so that a newer message with the same content ID can abort it.
+	void AddTransferWithContentID(FragmentedTransfer *transfer);
+
+	/// Marks all the fragments of the given transfer obsolete, so that they are not sent or resent any more.
+	/// @return True if some of the fragments have already been sent out, and the peer needs to be told to abort the
+	///         transfer. In that case the transfer ID stays allocated until AbortAcknowledged() is called.
+	bool AbortTransfer(FragmentedTransfer *transfer);
+
+	/// Frees the transfer ID of an aborted transfer, after the peer has acked the abort.
+	void AbortAcknowledged(int transferID);
+
 private:
+	/// The transfer IDs that are in use, indexed by the ID.
+	std::vector<bool> transferIDsInUse;
+
 	void FreeFragmentedTransfer(FragmentedTransfer *transfer);
+
+	/// Tells the ack handler of the given transfer, if it still has one, that the message did not reach the peer.
+	void ReportNotDelivered(FragmentedTransfer &transfer, MessageAckResult result);
 };
 
 /// @internal Receives message fragments and assembles fragments to complete messages when they are finished.
+/** The fragments are written straight to their offsets in the NetworkMessage that is handed to the application, so
+	the message is not copied again once it is complete. */
 class FragmentedReceiveManager
 {
 public:
+	/// The largest message the peer may start a fragmented transfer of. The message is allocated in full when the
+	/// fragmentStart arrives, so this bounds the memory a single datagram can make the receiver reserve. Does not apply
+	/// to the messages assembled to a file, see SetFileDestination().
+	static const size_t cMaxMessageSize = 256 * 1024 * 1024;
+
+	/// A fragment that was received before the fragmentStart of its transfer, which tells where the fragment goes.
 	struct ReceiveFragment
 	{
 		int fragmentIndex;
@@ -75,19 +158,59 @@ public:
 
 	struct ReceiveTransfer
 	{
-		int transferID;
-
+		/// 0 if the fragmentStart of this transfer has not been received yet.
 		int numTotalFragments;
 
-		std::vector<ReceiveFragment> fragments;
+		/// The number of message bytes in each fragment, except maybe the last one. Known from the fragmentStart on.
+		size_t fragmentSize;
+
+		int numFragmentsReceived;
+
+		/// Bit i of this array is set if fragment i has been written to the message.
+		std::vector<u32> receivedFragments;
+
+		/// The message the fragments are assembled into. Allocated when the fragmentStart is received.
+		NetworkMessage *message;
+
+		/// The fragments that overtook the fragmentStart on the way.
+		std::vector<ReceiveFragment> earlyFragments;
 	};
 
-	std::vector<ReceiveTransfer> transfers;
+	typedef std::map<int, ReceiveTransfer> TransferMap;
+	TransferMap transfers;
 
-	void NewFragmentStartReceived(int transferID, int numTotalFragments, const char *data, size_t numBytes);
+	FragmentedReceiveManager();
+	~FragmentedReceiveManager();
+
+	/// Starts a new fragmented transfer, or adopts the fragments of it that were received before the fragmentStart.
+	/// @return True if all the fragments of the transfer have now been received.
+	bool NewFragmentStartReceived(int transferID, int numTotalFragments, const char *data, size_t numBytes);
 	bool NewFragmentReceived(int transferID, int fragmentNumber, const char *data, size_t numBytes);
-	void AssembleMessage(int transferID, std::vector<char> &assembledData);
+
+	/// Removes the given finished transfer, and returns the message it assembled. The caller takes the ownership of the message.
+	NetworkMessage *DetachMessage(int transferID);
+
+	/// Discards the given transfer and the fragments received of it.
 	void FreeMessage(int transferID);
+
+	void FreeAllTransfers();
+
+	/// Makes the next message with the given ID that is received assemble to the given file. See MessageConnection::ReceiveFile(). [main thread]
+	void SetFileDestination(u32 messageID, const char *filename);
+
+	/// Removes the file destination of the given message ID, if one has been set, and maps the file to a writable buffer of the given size.
+	/// @return The mapped file, whose only reference the caller takes, or 0 if no destination was set or the file could not be mapped.
+	DatagramBuffer *MapFileDestination(u32 messageID, size_t size); // [worker thread]
+
+private:
+	/// The filenames that the next messages of each message ID are assembled to. [main and worker thread]
+	Lockable<std::map<u32, std::string> > fileDestinations;
+	/// The size of fileDestinations, read without locking, so that the common case of no destinations stays cheap for each message.
+	volatile int numFileDestinations;
+
+	/// Writes the given fragment to its place in the message of the transfer, which must have received its fragmentStart.
+	/// @return False if the fragment was a duplicate or malformed, and was discarded.
+	bool WriteFragment(ReceiveTransfer &transfer, int transferID, int fragmentIndex, const char *data, size_t numBytes);
 };
 
 } // ~kNet
@@ -0,0 +1,112 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file HostResolver.h
+	@brief The HostResolver class, which resolves host names on background threads. */
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+
+#include "Types.h"
+#include "Clock.h"
+#include "EndPoint.h"
+#include "Event.h"
+#include "Lockable.h"
+
+namespace kNet
+{
+
+class Thread;
+
+/// Resolves host names to IPv4 addresses on background threads, and caches the results.
+/** getaddrinfo() blocks for as long as the name servers take to answer, which can be seconds. Resolve() returns right
+	away instead, and is called again until the result is in. A numeric address is parsed on the spot. The resolved
+	addresses are cached for TimeToLive(), and the names that failed to resolve for NegativeTimeToLive(), so that a burst
+	of connections to the same host costs a single lookup. getaddrinfo() does not tell the TTLs of the DNS records, so the
+	same time is used for all the names. The threads are started on the first name that is not a numeric address.
+	[thread-safe] */
+class HostResolver
+{
+public:
+	enum Status
+	{
+		Resolving, ///< The name is being resolved. Call Resolve() again later.
+		Resolved, ///< The address of the name is known.
+		ResolveFailed ///< The name did not resolve to an IPv4 address.
+	};
+
+	/// The number of names resolved at the same time, so that one slow name does not hold up the others.
+	static const int cNumResolverThreads = 4;
+
+	HostResolver();
+	~HostResolver();
+
+	/// Returns the status of the given host name, and starts resolving it if it is not in the cache.
+	/// @param address [out] Receives the address of the host, with port 0, if Resolved is returned.
+	Status Resolve(const char *hostName, EndPoint &address);
+
+	/// Sets how long a resolved address is kept in the cache. The default is 60 seconds.
+	void SetTimeToLive(float msecs) { timeToLiveMSecs = msecs; }
+	float TimeToLive() const { return timeToLiveMSecs; }
+
+	/// Sets how long a name that failed to resolve is kept failing before it is tried again. The default is 5 seconds.
+	void SetNegativeTimeToLive(float msecs) { negativeTimeToLiveMSecs = msecs; }
+	float NegativeTimeToLive() const { return negativeTimeToLiveMSecs; }
+
+	/// Forgets the cached results. The names that are being resolved are cached once they finish.
+	void ClearCache();
+
+	/// Resolves the given host name on the calling thread, which blocks until the name servers answer.
+	/// @return False if the name does not resolve to an IPv4 address.
+	static bool ResolveBlocking(const char *hostName, EndPoint &address);
+
+private:
+	HostResolver(const HostResolver &);
+	void operator =(const HostResolver &);
+
+	struct CacheEntry
+	{
+		Status status;
+		EndPoint address;
+		/// The name is resolved again once this time has passed. Not used while the status is Resolving.
+		tick_t expiryTick;
+		/// Set once Resolve() has returned the result. Until then the result is returned even if it has expired, so
+		/// that the caller gets it with a very short time to live too.
+		bool returned;
+	};
+
+	struct State
+	{
+		std::map<std::string, CacheEntry> cache;
+		/// The names waiting for a thread to resolve them.
+		std::deque<std::string> requests;
+	};
+
+	Lockable<State> state;
+
+	/// Set while there are requests waiting. Only changed with the lock of state held.
+	Event requestsQueued;
+
+	std::vector<Thread *> threads; // [guarded by the lock of state]
+
+	volatile float timeToLiveMSecs;
+	volatile float negativeTimeToLiveMSecs;
+
+	void ResolverLoop(Thread *thread);
+};
+
+} // ~kNet
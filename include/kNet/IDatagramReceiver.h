@@ -0,0 +1,45 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file IDatagramReceiver.h
+	@brief The \ref kNet::IDatagramReceiver IDatagramReceiver interface. Implemented by the objects that process datagrams read from a UDP listen socket. */
+
+#include "kNet/Types.h"
+#include "kNet/Clock.h"
+
+namespace kNet
+{
+
+class Socket;
+class DatagramBuffer;
+struct EndPoint;
+
+/// An interface for the objects that process the datagrams read from a UDP server listen socket. This decouples the code that
+/// reads the socket (a plain receive call, or an asynchronous receive backend) from the code that parses the datagrams.
+class IDatagramReceiver
+{
+public:
+	virtual ~IDatagramReceiver() {}
+
+	/// Called for each datagram that was read from the given listen socket. The data is only valid during this call, unless
+	/// buffer is not null. In that case the data lies in the buffer, and the receiver can keep it by taking a reference to
+	/// the buffer with DatagramBuffer::AddRef. The receiveTick is the time the kernel received the datagram, or 0 if the
+	/// socket does not timestamp its datagrams. The ecn is the ECNCodepoint the datagram carried, or ECNNotECT if the
+	/// socket does not read it. [worker thread]
+	virtual void DatagramReceived(Socket *listenSocket, DatagramBuffer *buffer, const char *data, size_t numBytes, const EndPoint &source,
+		tick_t receiveTick, u8 ecn) = 0;
+};
+
+} // ~kNet
@@ -50,6 +50,84 @@ public:
 		// The default behavior is to not have a content ID on any message.
 		return 0;
 	}
+
+	/// Called as the peer acks the fragments of a message that was too large to send in one datagram. Reported in steps
+	/// of about 1/16th of the message, and always when the whole message has been acked. Not called for the transfers
+	/// that a newer message with the same content ID aborted.
+	/// @param source The kNet connection the message is being sent to.
+	/// @param messageId The id of the message.
+	/// @param contentID The content ID of the message, or 0 if it has none.
+	/// @param bytesAcked The number of bytes of the message the peer has received.
+	/// @param totalBytes The size of the message, in bytes.
+	virtual void HandleOutboundTransferProgress(MessageConnection * UNUSED(source), message_id_t UNUSED(messageId), u32 UNUSED(contentID),
+		size_t UNUSED(bytesAcked), size_t UNUSED(totalBytes))
+	{
+	}
+};
+
+/// Tells what became of a message that was queued with an IMessageAckHandler.
+enum MessageAckResult
+{
+	MessageDelivered, ///< Over UDP the peer has acked the whole message, over TCP the message has been written to the socket.
+	MessageObsolete, ///< A newer message with the same content ID replaced the message before it was delivered.
+	MessageUnreliable, ///< The message was not reliable, so it was sent, expired or dropped without an ack.
+	MessageConnectionClosed ///< The connection closed, or the message was freed without being queued, before the message was delivered.
+};
+
+/// Returns a readable name of the given MessageAckResult.
+const char *MessageAckResultToString(MessageAckResult result);
+
+/// A callback object that is told when the peer has received a message. See NetworkMessage::ackHandler.
+class IMessageAckHandler
+{
+public:
+	virtual ~IMessageAckHandler() {}
+
+	/// Called exactly once for each message that was queued with this handler, with MessageDelivered once the message
+	/// reached the peer, or with the reason it was dropped instead. Called from the worker thread of the connection, or
+	/// from the thread that frees a message that was never queued, so the handler must be thread-safe and quick.
+	/// @param messageId The id of the message.
+	/// @param result What became of the message.
+	virtual void HandleMessageAcked(message_id_t messageId, MessageAckResult result) = 0;
+};
+
+/// A callback object that gets back the buffers the application lent to MessageConnection::SendBuffer().
+class IBufferReleaseHandler
+{
+public:
+	virtual ~IBufferReleaseHandler() {}
+
+	/// Called exactly once for each buffer, when the last message that refers to it has been sent out or acked, or dropped.
+	/// Called from the worker thread of the connection, or from the thread that frees the message, so the handler must be
+	/// thread-safe. The buffer may be reused or freed from here on.
+	/// @param data The buffer that was passed to SendBuffer().
+	/// @param numBytes The size of the buffer, in bytes.
+	virtual void ReleaseBuffer(const char *data, size_t numBytes) = 0;
+};
+
+/// A received message, as passed to IMessageBatchHandler::HandleMessageBatch(). See IMessageHandler::HandleMessage() for the fields.
+struct InboundMessage
+{
+	packet_id_t packetId;
+	const char *data;
+	size_t numBytes;
+};
+
+/// A callback object that receives the messages of a single message ID in spans. See MessageConnection::RegisterMessageBatchHandler().
+class IMessageBatchHandler
+{
+public:
+	virtual ~IMessageBatchHandler() {}
+
+	/// Called with a run of consecutively received messages that all have the given ID, in the order they were received.
+	/// The runs are cut where a message of another ID was received in between, and at most as many messages are passed
+	/// at a time as MessageConnection::Process() takes off the inbound queue at once. The data of the messages is valid
+	/// only until this function returns.
+	/// @param source The kNet connection the messages originate from.
+	/// @param messageId The id of the messages.
+	/// @param messages The messages. Never empty.
+	/// @param numMessages The number of messages.
+	virtual void HandleMessageBatch(MessageConnection *source, message_id_t messageId, const InboundMessage *messages, size_t numMessages) = 0;
 };
 
 } // ~kNet
@@ -47,6 +47,22 @@ public:
 	{
 		/// The default action is to not do anything.
 	}
+
+	/// Called to notify the listener that the given UDP client has moved from the given address to a new one, for example
+	/// after a NAT rebinding. The connection keeps all its state, and is known by its new address from now on.
+	virtual void ConnectionMigrated(MessageConnection * UNUSED(connection), const EndPoint & UNUSED(oldEndPoint))
+	{
+		/// The default action is to not do anything.
+	}
+
+	/// Called to notify the listener that a connection handed over from another process has resumed, see
+	/// Network::ResumeServer(). The application is expected to register a message listener for it, and to restore its own
+	/// state of the client.
+	virtual void ConnectionResumed(MessageConnection *connection)
+	{
+		/// The default action is to treat it as a new connection.
+		NewConnectionEstablished(connection);
+	}
 };
 
 } // ~kNet
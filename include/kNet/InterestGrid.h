@@ -0,0 +1,241 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file InterestGrid.h
+	@brief The InterestGrid<T> template class, a uniform grid that finds the items interested in a point of the plane. */
+
+#include <map>
+#include <vector>
+#include <cmath>
+#include <cassert>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+/// A uniform grid over the plane that finds the items whose circle of interest contains a given point.
+/** Each item has a position and an interest radius, and is listed in every cell that the bounding square of its circle
+	overlaps. A query looks up the one cell of the point, and checks the distance to each item listed there, so it costs
+	time in proportion to the number of items near the point, not to all the items in the grid. An item that moves within
+	the same cells only has its position updated.
+
+	Pick a cell size near the typical interest radius: smaller cells list each item in more cells, and larger cells make
+	the queries check more items that are out of range. An item whose circle would cover more than cMaxCellsPerItem cells is
+	kept on a list of its own, which every query checks.
+
+	T is the type of the items, which are referred to by pointers. This class is not thread-safe. */
+template<typename T>
+class InterestGrid
+{
+public:
+	/// Items whose circle of interest covers more cells than this are checked by every query instead.
+	static const int cMaxCellsPerItem = 1024;
+
+	explicit InterestGrid(float cellSize_ = 64.f)
+	:cellSize(cellSize_)
+	{
+		assert(cellSize_ > 0.f);
+	}
+
+	/// Sets the position and the interest radius of the given item, and adds the item to the grid if it is not in it.
+	void Set(T *item, float x, float y, float radius)
+	{
+		assert(item);
+		assert(radius >= 0.f);
+		const CellRange range = RangeOf(x, y, radius);
+		typename EntryMap::iterator iter = entries.find(item);
+		const bool isNew = (iter == entries.end());
+		if (isNew)
+		{
+			iter = entries.insert(std::make_pair(item, Entry())).first;
+			iter->second.item = item;
+		}
+		Entry &entry = iter->second;
+		const bool changesCells = isNew || !(entry.cells == range);
+		if (changesCells && !isNew)
+			RemoveFromCells(entry);
+
+		entry.x = x;
+		entry.y = y;
+		entry.radius = radius;
+		if (changesCells)
+		{
+			entry.cells = range;
+			AddToCells(entry);
+		}
+	}
+
+	/// Removes the given item from the grid. Does nothing if the item is not in the grid.
+	void Remove(T *item)
+	{
+		typename EntryMap::iterator iter = entries.find(item);
+		if (iter == entries.end())
+			return;
+		RemoveFromCells(iter->second);
+		entries.erase(iter);
+	}
+
+	/// Returns true if the given item is in the grid.
+	bool Contains(T *item) const { return entries.find(item) != entries.end(); }
+
+	/// Returns the number of items in the grid.
+	size_t Size() const { return entries.size(); }
+
+	/// Removes all the items.
+	void Clear()
+	{
+		entries.clear();
+		cells.clear();
+		unbounded.clear();
+	}
+
+	float CellSize() const { return cellSize; }
+
+	/// Changes the size of the cells, and lists the items in the new cells.
+	void SetCellSize(float cellSize_)
+	{
+		assert(cellSize_ > 0.f);
+		cellSize = cellSize_;
+		cells.clear();
+		unbounded.clear();
+		for(typename EntryMap::iterator iter = entries.begin(); iter != entries.end(); ++iter)
+		{
+			Entry &entry = iter->second;
+			entry.cells = RangeOf(entry.x, entry.y, entry.radius);
+			AddToCells(entry);
+		}
+	}
+
+	/// Appends the items whose circle of interest contains the given point to out, each of them once.
+	void Query(float x, float y, std::vector<T *> &out) const
+	{
+		typename CellMap::const_iterator cell = cells.find(CellKey(CellCoord(x), CellCoord(y)));
+		if (cell != cells.end())
+			AppendInRange(cell->second, x, y, out);
+		AppendInRange(unbounded, x, y, out);
+	}
+
+private:
+	/// The cells an item is listed in, from (minX, minY) to (maxX, maxY) inclusive.
+	struct CellRange
+	{
+		s32 minX, minY, maxX, maxY;
+		/// False if the range covers more than cMaxCellsPerItem cells, and the item is on the unbounded list instead.
+		bool bounded;
+
+		bool operator ==(const CellRange &rhs) const
+		{
+			return minX == rhs.minX && minY == rhs.minY && maxX == rhs.maxX && maxY == rhs.maxY && bounded == rhs.bounded;
+		}
+	};
+
+	struct Entry
+	{
+		T *item;
+		float x;
+		float y;
+		float radius;
+		CellRange cells;
+	};
+
+	/// The entries are nodes of a std::map, so the cells can point to them.
+	typedef std::map<T *, Entry> EntryMap;
+	typedef std::map<u64, std::vector<const Entry *> > CellMap;
+
+	float cellSize;
+	EntryMap entries;
+	CellMap cells;
+	std::vector<const Entry *> unbounded;
+
+	/// Returns the coordinate of the cell of the given coordinate. Clamped so that the far away points do not overflow.
+	s32 CellCoord(float v) const
+	{
+		const float c = std::floor(v / cellSize);
+		const float cLimit = (float)(1 << 30);
+		return (s32)(c < -cLimit ? -cLimit : (c > cLimit ? cLimit : c));
+	}
+
+	static u64 CellKey(s32 x, s32 y) { return ((u64)(u32)x << 32) | (u64)(u32)y; }
+
+	CellRange RangeOf(float x, float y, float radius) const
+	{
+		CellRange range;
+		range.minX = CellCoord(x - radius);
+		range.minY = CellCoord(y - radius);
+		range.maxX = CellCoord(x + radius);
+		range.maxY = CellCoord(y + radius);
+		const double numCells = ((double)range.maxX - range.minX + 1) * ((double)range.maxY - range.minY + 1);
+		range.bounded = numCells <= cMaxCellsPerItem;
+		return range;
+	}
+
+	void AddToCells(const Entry &entry)
+	{
+		const CellRange &r = entry.cells;
+		if (!r.bounded)
+		{
+			unbounded.push_back(&entry);
+			return;
+		}
+		for(s32 cx = r.minX; cx <= r.maxX; ++cx)
+			for(s32 cy = r.minY; cy <= r.maxY; ++cy)
+				cells[CellKey(cx, cy)].push_back(&entry);
+	}
+
+	static void RemoveFromList(std::vector<const Entry *> &list, const Entry *entry)
+	{
+		for(size_t i = 0; i < list.size(); ++i)
+			if (list[i] == entry)
+			{
+				list[i] = list.back();
+				list.pop_back();
+				return;
+			}
+	}
+
+	void RemoveFromCells(const Entry &entry)
+	{
+		const CellRange &r = entry.cells;
+		if (!r.bounded)
+		{
+			RemoveFromList(unbounded, &entry);
+			return;
+		}
+		for(s32 cx = r.minX; cx <= r.maxX; ++cx)
+			for(s32 cy = r.minY; cy <= r.maxY; ++cy)
+			{
+				typename CellMap::iterator cell = cells.find(CellKey(cx, cy));
+				assert(cell != cells.end());
+				RemoveFromList(cell->second, &entry);
+				if (cell->second.empty())
+					cells.erase(cell);
+			}
+	}
+
+	static void AppendInRange(const std::vector<const Entry *> &list, float x, float y, std::vector<T *> &out)
+	{
+		for(size_t i = 0; i < list.size(); ++i)
+		{
+			const Entry *entry = list[i];
+			const float dx = x - entry->x;
+			const float dy = y - entry->y;
+			if (dx * dx + dy * dy <= entry->radius * entry->radius)
+				out.push_back(entry->item);
+		}
+	}
+};
+
+} // ~kNet
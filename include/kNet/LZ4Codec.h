@@ -0,0 +1,74 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file LZ4Codec.h
+	@brief The LZ4Codec class, which compresses the data kNet sends out to the LZ4 block format. */
+
+#include <cstddef>
+#include <vector>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+/// Compresses and decompresses byte blocks in the LZ4 block format, optionally against a preshared dictionary.
+/** The compressor is a greedy single-pass LZ77 matcher, which is cheap enough to run on each datagram a connection sends out.
+	A dictionary is a sample of typical data, for example a set of representative messages concatenated together. It is
+	treated as if it preceded each block, so that even a short block can refer to the byte sequences it has in common with
+	the sample. Only the last cMaxDictionarySize bytes of a dictionary are used. [Not thread-safe] */
+class LZ4Codec
+{
+public:
+	/// Matches can refer at most this far back, so only this many bytes of a dictionary are kept.
+	static const size_t cMaxDictionarySize = 65535;
+
+	LZ4Codec();
+
+	/// Sets the dictionary that Compress() and Decompress() use when asked to. Pass in an empty dictionary to remove it.
+	void SetDictionary(const char *data, size_t numBytes);
+
+	/// Returns the number of bytes in the dictionary, or 0 if there is none.
+	size_t DictionarySize() const { return dictionary.size(); }
+
+	/// Returns a hash that identifies the contents of the dictionary, so that two peers can check that they use the same one.
+	/// Returns 0 if there is no dictionary, and a nonzero value otherwise.
+	u32 DictionaryID() const { return dictionaryID; }
+
+	/// Returns the number of bytes the compressed form of a block of the given size can take at most.
+	static size_t MaxCompressedSize(size_t numBytes) { return numBytes + numBytes / 255 + 16; }
+
+	/// Compresses the given block.
+	/// @param useDictionary If true, the block may refer to the dictionary, which must then be used for decompressing it too.
+	/// @return The size of the compressed block, or 0 if it does not fit in dstCapacity bytes.
+	size_t Compress(const char *src, size_t srcSize, char *dst, size_t dstCapacity, bool useDictionary);
+
+	/// Decompresses the given block.
+	/// @return The size of the decompressed block, or -1 if the block was malformed or did not fit in dstCapacity bytes.
+	int Decompress(const char *src, size_t srcSize, char *dst, size_t dstCapacity, bool useDictionary) const;
+
+private:
+	/// For each hash of four bytes, the latest position in the current block that starts with a sequence of that hash,
+	/// plus tableBase. The entries that are smaller than tableBase were left by the earlier blocks, and are ignored.
+	std::vector<u32> hashTable;
+	u32 tableBase;
+
+	std::vector<char> dictionary;
+	/// The hash table of the dictionary, with the dictionary positions plus one. Zero marks an empty entry.
+	std::vector<u32> dictionaryHashTable;
+	u32 dictionaryID;
+};
+
+} // ~kNet
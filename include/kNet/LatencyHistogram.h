@@ -0,0 +1,131 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file LatencyHistogram.h
+	@brief The LatencyHistogram class, which counts latency samples into logarithmic buckets for percentile queries. */
+
+#include "Types.h"
+#include "Clock.h"
+
+namespace kNet
+{
+
+/// Identifies the latency measures each MessageConnection keeps a LatencyHistogram of.
+enum LatencyMetric
+{
+	LatencyPingRTT,   ///< The round-trip time of the PingRequest-PingReply exchanges.
+	LatencyAckRTT,    ///< The time from sending a datagram to receiving its ack, for the datagrams that were sent only once. UDP only.
+	LatencyQueueTime, ///< The time from EndAndQueueMessage() to the first send of a message.
+	LatencyReceiveDelay, ///< The time from the kernel receiving a datagram to the worker thread processing it. UDP on Linux only.
+	NumLatencyMetrics
+};
+
+/// Returns a human-readable name of the given latency measure.
+const char *LatencyMetricToString(LatencyMetric metric);
+
+/// A histogram of latency samples in microseconds, with buckets whose widths grow with their values, like the HDR histogram.
+/** Each power of two is split into cSubBuckets linear buckets, so the bucket of a sample is always within 1/cSubBuckets
+	of its value, from a microsecond to over an hour. Recording a sample increments a few counters and does not allocate
+	or branch on the history, so it can run on each packet. The queries scan the buckets.
+	[Recording is not thread-safe. The queries can run concurrently with the recording thread, and then see the samples
+	that were recorded at some recent point.] */
+class LatencyHistogram
+{
+public:
+	/// Each power of two is split to 2^cSubBucketBits buckets.
+	static const int cSubBucketBits = 4;
+	static const int cSubBuckets = 1 << cSubBucketBits;
+	/// The values below cSubBuckets have a bucket each, and each power of two above that has cSubBuckets buckets.
+	static const int cNumBuckets = (32 - cSubBucketBits + 1) * cSubBuckets;
+
+	LatencyHistogram() { Clear(); }
+
+	void Clear();
+
+	/// Adds a sample of the given number of microseconds.
+	void Record(u32 microseconds)
+	{
+		++counts[BucketIndex(microseconds)];
+		++totalCount;
+		sum += microseconds;
+		if (microseconds > maxValue)
+			maxValue = microseconds;
+	}
+
+	/// Adds a sample of the time between the two ticks. The later tick is passed in second.
+	void RecordTimespan(tick_t startTick, tick_t endTick)
+	{
+		const tick_t microseconds = Clock::TicksInBetween(endTick, startTick) * 1000000 / Clock::TicksPerSec();
+		Record(microseconds < 0xFFFFFFFF ? (u32)microseconds : 0xFFFFFFFF);
+	}
+
+	/// Adds the samples of the given histogram to this one.
+	void Merge(const LatencyHistogram &rhs);
+
+	/// Returns the number of samples recorded.
+	u64 Count() const { return totalCount; }
+
+	/// Returns the value which the given percentage of the samples are at or below, in milliseconds. The value is the
+	/// upper bound of the bucket the percentile falls into, so it overestimates by at most 1/cSubBuckets.
+	/// @param percentile The percentage in the range [0, 100], for example 99.9. Returns 0 if there are no samples.
+	float PercentileMSecs(float percentile) const;
+
+	float MedianMSecs() const { return PercentileMSecs(50.f); }
+
+	/// Returns the average of the samples in milliseconds, or 0 if there are no samples.
+	float MeanMSecs() const { return totalCount > 0 ? (float)((double)sum / totalCount / 1000.0) : 0.f; }
+
+	/// Returns the largest sample in milliseconds.
+	float MaxMSecs() const { return maxValue / 1000.f; }
+
+	/// Returns the index of the bucket the given value is counted in.
+	static int BucketIndex(u32 value)
+	{
+		if (value < (u32)cSubBuckets)
+			return (int)value;
+		const int shift = FloorLog2(value) - cSubBucketBits;
+		return (shift + 1) * cSubBuckets + (int)((value >> shift) - cSubBuckets);
+	}
+
+	/// Returns the largest value that is counted in the given bucket.
+	static u32 BucketUpperBound(int index)
+	{
+		if (index < cSubBuckets)
+			return (u32)index;
+		const int shift = index / cSubBuckets - 1;
+		const u64 lowerBound = (u64)(cSubBuckets + index % cSubBuckets) << shift;
+		return (u32)(lowerBound + ((u64)1 << shift) - 1);
+	}
+
+private:
+	u32 counts[cNumBuckets];
+	u64 totalCount;
+	u64 sum;
+	u32 maxValue;
+
+	/// Returns the index of the highest set bit of the given nonzero value.
+	static int FloorLog2(u32 value)
+	{
+		int log = 0;
+		if (value >= 0x10000) { value >>= 16; log += 16; }
+		if (value >= 0x100) { value >>= 8; log += 8; }
+		if (value >= 0x10) { value >>= 4; log += 4; }
+		if (value >= 0x4) { value >>= 2; log += 2; }
+		if (value >= 0x2) ++log;
+		return log;
+	}
+};
+
+} // ~kNet
@@ -14,9 +14,11 @@
 #pragma once
 
 /** @file LockFreePoolAllocator.h
-	@brief The PoolAllocatable<T> and LockFreePoolAllocator<T> template classes. */
+	@brief The PoolAllocatable<T>, LockFreeStack<T> and LockFreePoolAllocator<T> template classes. */
 
 #include <iostream>
+#include <cassert>
+#include "Types.h"
 #include "Atomics.h"
 
 namespace kNet
@@ -31,80 +33,133 @@ struct PoolAllocatable
 	T * volatile next;
 };
 
-/// T must implement PoolAllocatable.
+/// A lock-free intrusive stack of objects of type T. T must implement PoolAllocatable.
+/// To avoid the ABA problem, the top pointer is stored together with a tag that is incremented on every update, and both
+/// are compare-and-swapped as a single 64-bit value. A thread that pops an object may read the next pointer of an object
+/// that another thread has just popped and taken into use, so objects that have been pushed to the stack may not be returned
+/// to the runtime heap while other threads may still be accessing the stack.
 template<typename T>
-class LockFreePoolAllocator
+class LockFreeStack
 {
 public:
-	LockFreePoolAllocator()
-	:root(0)
+	LockFreeStack()
+	:top(0)
 	{
 	}
 
-	~LockFreePoolAllocator()
+	/// Returns true if the given object can be pushed to the stack. Objects at addresses that do not fit in the pointer
+	/// bits of the tagged top value cannot be.
+	static bool CanPush(T *ptr) { return ((u64)(size_t)ptr & ~cPointerMask) == 0; }
+
+	/// Pushes the given object to the top of the stack. The object must satisfy CanPush(). [thread-safe]
+	void Push(T *ptr)
 	{
-		UnsafeClearAll();
+		assert(ptr);
+		assert(CanPush(ptr));
+		for(;;)
+		{
+			u64 oldTop = top;
+			assert(ptr != TopPointer(oldTop));
+			ptr->next = TopPointer(oldTop);
+			if (CmpXChg64(&top, MakeTop(ptr, oldTop), oldTop))
+				return;
+		}
 	}
 
-	/// Allocates a new object of type T. Call Free() to deallocate the object.
-	T *New()
+	/// Takes the top-most object out of the stack, or returns 0 if the stack is empty. [thread-safe]
+	T *Pop()
 	{
-		// Currently the use of lockfree allocation pool is disabled, since it has a known race condition, documented below.
-		return new T();
-
-		/*
 		for(;;)
 		{
-			T *allocated = root;
-			if (!allocated) // If the root is null, there are no objects in the pool, so we must create new from the runtime heap.
-			{
-				allocated = new T();
-				allocated->next = 0;
-				return allocated;
-			}
+			u64 oldTop = top;
+			T *popped = TopPointer(oldTop);
+			if (!popped)
+				return 0;
 
-			///\bug Note that this function is not thread-safe. Accessing allocated->next may already be dangling if another thread has deleted it.
-			T *newRoot = allocated->next;
+			// If another thread pops this object before us, it may already be in use and this read returns garbage, but
+			// the memory of the object is still valid, and the tag of the top will have changed, so the compare-and-swap fails.
+			T *newTop = popped->next;
 
-			if (CmpXChgPointer((void**)&root, newRoot, allocated))
+			if (CmpXChg64(&top, MakeTop(newTop, oldTop), oldTop))
 			{
-				allocated->next = 0;
-				return allocated;
+				popped->next = 0;
+				return popped;
 			}
 		}
-		*/
 	}
 
-	void Free(T *ptr)
-	{
-		delete ptr;
+	/// Returns the top-most object of the stack without removing it. The rest of the objects can be iterated through the
+	/// next pointers. Not thread-safe!
+	T *UnsafeTop() const { return TopPointer(top); }
 
-		// Currently the use of lockfree allocation pool is disabled, since it has a known race condition.
-/*
-		if (!ptr)
-			return;
+	/// Forgets all the objects of the stack. Not thread-safe!
+	void UnsafeReset() { top = 0; }
+
+private:
+	/// The number of low bits of the top value that store the pointer. User-space addresses fit in 48 bits on all
+	/// supported 64-bit platforms. The remaining high bits store the update tag.
+	static const int cPointerBits = sizeof(void*) == 4 ? 32 : 48;
+	static const u64 cPointerMask = (((u64)1) << cPointerBits) - 1;
 
-		assert(ptr != root);
+	/// The top-most object of the stack in the low bits, and the update tag in the high bits.
+	volatile u64 top;
 
-		for(;;)
+	static T *TopPointer(u64 topValue) { return (T*)(size_t)(topValue & cPointerMask); }
+
+	/// Returns a new top value that points to the given object and has the tag of the given old top value incremented.
+	static u64 MakeTop(T *ptr, u64 oldTop)
+	{
+		return (u64)(size_t)ptr | (((oldTop >> cPointerBits) + 1) << cPointerBits);
+	}
+};
+
+/// T must implement PoolAllocatable.
+/// The unused objects are kept in a LockFreeStack. They are only deleted by ClearAll() or UnsafeClearAll(), which do not run
+/// at the same time as New() or another ClearAll(), so a thread that reads the next pointer of an object that was just taken
+/// by another thread never accesses freed memory.
+template<typename T>
+class LockFreePoolAllocator
+{
+public:
+	~LockFreePoolAllocator()
+	{
+		UnsafeClearAll();
+	}
+
+	/// Allocates a new object of type T. Call Free() to deallocate the object.
+	/// If the pool has unused objects, one of them is returned as-is, without its constructor being called again.
+	T *New()
+	{
+		T *allocated = unused.Pop();
+		if (!allocated) // If there are no objects in the pool, we must create new from the runtime heap.
 		{
-			ptr->next = root;
-			if (CmpXChgPointer((void**)&root, ptr, ptr->next))
-				return;
+			allocated = new T();
+			allocated->next = 0;
 		}
-*/
+		return allocated;
+	}
+
+	/// Returns the given object to the pool. The destructor of the object is not called.
+	void Free(T *ptr)
+	{
+		if (!ptr)
+			return;
+
+		if (LockFreeStack<T>::CanPush(ptr))
+			unused.Push(ptr);
+		else
+			delete ptr;
 	}
 
-	/// Deallocates all cached unused nodes in this pool. Thread-safe and lock-free. If you are manually tearing
-	/// down the pool and there are no other threads accessing this, you may call the even faster version
-	/// UnsafeClearAll(), which ignores compare-and-swap updates.
+	/// Deallocates all cached unused nodes in this pool. Thread-safe with respect to Free(), but may not be called while
+	/// other threads are calling New() or ClearAll(), since it deletes the nodes it pops, and a concurrent pop could still
+	/// be reading the next pointer of one of them. If there are no other threads accessing this pool, you may call the even
+	/// faster version UnsafeClearAll(), which ignores compare-and-swap updates.
 	void ClearAll()
 	{
-		while(root)
-		{
-			T *node = New();
+		T *node;
+		while((node = unused.Pop()) != 0)
 			delete node;
-		}
 	}
 
 	/// A fast method to free all items allocated in the pool.
@@ -112,20 +167,20 @@ public:
 	void UnsafeClearAll()
 	{
 		assert(!DebugHasCycle());
-		T *node = root;
+		T *node = unused.UnsafeTop();
 		while(node)
 		{
 			T *next = node->next;
 			delete node;
 			node = next;
 		}
-		root = 0;
+		unused.UnsafeReset();
 	}
 
 	/// A debugging function that checks whether the underlying linked list has a cycle or not. Not thread-safe!
 	bool DebugHasCycle()
 	{
-		T *n1 = root;
+		T *n1 = unused.UnsafeTop();
 		if (!n1)
 			return false;
 		T *n2 = n1->next;
@@ -147,8 +202,8 @@ public:
 	{
 		using namespace std;
 
-		T *node = root;
-		cout << "Root: 0x" << ios::hex << root << ".Next: " << ios::hex << (root ? root->next : 0) << std::endl;
+		T *node = unused.UnsafeTop();
+		cout << "Root: 0x" << ios::hex << node << ".Next: " << ios::hex << (node ? node->next : 0) << std::endl;
 		int size = 0;
 		if (node)
 			node = node->next;
@@ -162,7 +217,7 @@ public:
 	}
 
 private:
-	T * volatile root;
+	LockFreeStack<T> unused;
 };
 
 } // ~kNet
@@ -228,6 +228,23 @@ public:
 		return value;
 	}
 
+	/// Locks the object if no other thread is holding the lock, without waiting.
+	/// @return A pointer to the locked value, which the caller must Unlock() when done, or null if the lock was not acquired.
+	T *TryLockGet()
+	{
+#ifdef KNET_USE_BOOST
+		if (!boostMutex.try_lock())
+			return 0;
+#elif defined(WIN32)
+		if (!TryEnterCriticalSection(&lockObject))
+			return 0;
+#else
+		if (pthread_mutex_trylock(&mutex) != 0)
+			return 0;
+#endif
+		return &value;
+	}
+
 	void Unlock() const
 	{
 #ifdef KNET_USE_BOOST
@@ -0,0 +1,240 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MPSCQueue.h
+	@brief The MPSCQueue<T> template class. A bounded queue from any number of producer threads to a single consumer thread. */
+
+#include <cassert>
+#include <stddef.h>
+
+#include "Alignment.h"
+#include "Atomics.h"
+
+namespace kNet
+{
+
+/// A bounded lockless queue that any number of threads can insert to, and a single thread consumes from.
+/** Each slot of the ring carries a sequence number that tells whether the slot is free for the producer of the current lap,
+	or holds an item for the consumer. A producer claims a slot by advancing the insert position with a compare-and-swap,
+	fills it, and then publishes it by updating its sequence number. The consumer takes the items in the order their slots
+	were claimed. Insert() never blocks: it fails if the queue is full.
+	The items of a single producer come out in the order it inserted them. The items of different producers interleave in
+	the order they claimed their slots.
+	Only POD types are supported. The size of the ring must be a power of 2. */
+template<typename T>
+class MPSCQueue
+{
+public:
+	/// @param maxElements A power-of-2 number, >= 2, that specifies the number of items the queue can hold.
+	explicit MPSCQueue(size_t maxElements)
+	:insertPos(0), removePos(0)
+	{
+		assert(IS_POW2(maxElements));
+		assert(maxElements >= 2);
+		maxElements = (size_t)RoundUpToNextPow2((u32)maxElements);
+
+		slots = new Slot[maxElements];
+		maxElementsMask = (unsigned long)maxElements - 1;
+		for(size_t i = 0; i < maxElements; ++i)
+			slots[i].sequence = (long)i;
+	}
+
+	~MPSCQueue()
+	{
+		delete[] slots;
+	}
+
+	/// Returns the number of items the queue can hold. [thread-safe]
+	int Capacity() const { return (int)maxElementsMask + 1; }
+
+	/// Returns the number of items in the queue. The items that producers are just writing are counted in too, even
+	/// though the consumer can't see them yet. [thread-safe]
+	int Size() const
+	{
+		const unsigned long remove = (unsigned long)removePos;
+		const unsigned long insert = (unsigned long)insertPos;
+		return (int)(insert - remove);
+	}
+
+	/// Returns the number of items that can still be inserted. [thread-safe]
+	int CapacityLeft() const { return Capacity() - Size(); }
+
+	/// Inserts the given value to the back of the queue. [thread-safe]
+	/// @return False if the queue was full.
+	bool Insert(const T &value)
+	{
+		for(;;)
+		{
+			const long pos = insertPos;
+			Slot &slot = slots[(unsigned long)pos & maxElementsMask];
+			const long sequence = slot.sequence;
+			const long diff = (long)((unsigned long)sequence - (unsigned long)pos);
+			if (diff == 0) // The slot is free on this lap. Try to claim it.
+			{
+				if (CmpXChgLong(&insertPos, (long)((unsigned long)pos + 1), pos))
+				{
+					slot.value = value;
+					FullMemoryBarrier(); // The value must be visible before the sequence number that publishes it.
+					slot.sequence = (long)((unsigned long)pos + 1);
+					return true;
+				}
+			}
+			else if (diff < 0) // The slot still holds the item of the previous lap.
+				return false;
+			// Otherwise another producer claimed the slot first. Retry with the new position.
+		}
+	}
+
+	/// Claims the next slot of the queue, so that the caller can fill in the item directly in the slot instead of copying
+	/// it in. The item becomes visible to the consumer when EndInsert() is called with the returned position, and it
+	/// holds up the items claimed after it until then. [thread-safe]
+	/// @param pos [out] The position of the claimed slot, to be passed to EndInsert().
+	/// @return The item to fill in, or 0 if the queue was full.
+	T *BeginInsert(long &pos)
+	{
+		for(;;)
+		{
+			pos = insertPos;
+			Slot &slot = slots[(unsigned long)pos & maxElementsMask];
+			const long diff = (long)((unsigned long)slot.sequence - (unsigned long)pos);
+			if (diff == 0 && CmpXChgLong(&insertPos, (long)((unsigned long)pos + 1), pos))
+				return &slot.value;
+			if (diff < 0)
+				return 0;
+		}
+	}
+
+	/// Publishes the item of the slot claimed by BeginInsert(). [thread-safe]
+	void EndInsert(long pos)
+	{
+		FullMemoryBarrier(); // The value must be visible before the sequence number that publishes it.
+		slots[(unsigned long)pos & maxElementsMask].sequence = (long)((unsigned long)pos + 1);
+	}
+
+	/// Inserts as many of the given values as there is room for, in order, into consecutive slots claimed with a single
+	/// compare-and-swap. The items of other producers don't interleave with them. [thread-safe]
+	/// @return The number of values inserted, which is less than numValues if the queue became full.
+	int InsertBatch(const T *values, int numValues)
+	{
+		for(;;)
+		{
+			const long pos = insertPos;
+			// The consumer frees the slots in order, so the free slots of this lap are the ones up to the first taken one.
+			int numFree = 0;
+			while(numFree < numValues && slots[((unsigned long)pos + numFree) & maxElementsMask].sequence == (long)((unsigned long)pos + numFree))
+				++numFree;
+			if (numFree == 0)
+			{
+				const long diff = (long)((unsigned long)slots[(unsigned long)pos & maxElementsMask].sequence - (unsigned long)pos);
+				if (diff < 0)
+					return 0; // Full.
+				continue; // Another producer claimed the slot first.
+			}
+			if (!CmpXChgLong(&insertPos, (long)((unsigned long)pos + numFree), pos))
+				continue;
+
+			for(int i = 0; i < numFree; ++i)
+				slots[((unsigned long)pos + i) & maxElementsMask].value = values[i];
+			FullMemoryBarrier(); // The values must be visible before the sequence numbers that publish them.
+			for(int i = 0; i < numFree; ++i)
+				slots[((unsigned long)pos + i) & maxElementsMask].sequence = (long)((unsigned long)pos + i + 1);
+			return numFree;
+		}
+	}
+
+	/// Returns the item at the front of the queue, or 0 if the queue is empty, or the next item is still being written
+	/// by its producer. [consumer thread]
+	T *Front()
+	{
+		Slot &slot = slots[(unsigned long)removePos & maxElementsMask];
+		if (slot.sequence != (long)((unsigned long)removePos + 1))
+			return 0;
+		FullMemoryBarrier(); // Don't read the value before the sequence number says it is there.
+		return &slot.value;
+	}
+
+	/// Removes the item returned by Front(). [consumer thread]
+	void PopFront()
+	{
+		assert(Front());
+		Slot &slot = slots[(unsigned long)removePos & maxElementsMask];
+		const unsigned long pos = (unsigned long)removePos;
+		FullMemoryBarrier(); // The value must have been read before the slot is given back to the producers.
+		slot.sequence = (long)(pos + maxElementsMask + 1);
+		removePos = (long)(pos + 1);
+	}
+
+	/// Returns a copy of the front item and pops it off the queue. Requires that Front() is not 0. [consumer thread]
+	T TakeFront()
+	{
+		assert(Front());
+		T value = *Front();
+		PopFront();
+		return value;
+	}
+
+	/// Copies up to maxItems items from the front of the queue to dst, in order, and pops them off the queue.
+	/// Stops at the first item that is still being written. [consumer thread]
+	/// @return The number of items popped.
+	int PopBatch(T *dst, int maxItems)
+	{
+		const unsigned long pos = (unsigned long)removePos;
+		int numItems = 0;
+		while(numItems < maxItems && slots[(pos + numItems) & maxElementsMask].sequence == (long)(pos + numItems + 1))
+			++numItems;
+		if (numItems == 0)
+			return 0;
+
+		FullMemoryBarrier(); // Don't read the values before the sequence numbers say they are there.
+		for(int i = 0; i < numItems; ++i)
+			dst[i] = slots[(pos + i) & maxElementsMask].value;
+		FullMemoryBarrier(); // The values must have been read before the slots are given back to the producers.
+		for(int i = 0; i < numItems; ++i)
+			slots[(pos + i) & maxElementsMask].sequence = (long)(pos + i + maxElementsMask + 1);
+		removePos = (long)(pos + numItems);
+		return numItems;
+	}
+
+private:
+	struct Slot
+	{
+		/// Equals the insert position of the lap the slot is free for, or that position plus one when the slot holds its item.
+		volatile long sequence;
+		T value;
+	};
+
+	/// The size of the cache lines the positions are kept apart by.
+	static const size_t cCacheLineSize = 64;
+
+	Slot *slots;
+	unsigned long maxElementsMask;
+
+	char padding0[cCacheLineSize];
+
+	/// The position the next producer claims. Wraps around the range of long. [written by the producers]
+	volatile long insertPos;
+
+	char padding1[cCacheLineSize];
+
+	/// The position of the front item. [written by the consumer]
+	volatile long removePos;
+
+	char padding2[cCacheLineSize];
+
+	MPSCQueue(const MPSCQueue &); ///< Not implemented.
+	void operator =(const MPSCQueue &); ///< Not implemented.
+};
+
+} // ~kNet
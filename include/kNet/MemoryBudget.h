@@ -0,0 +1,86 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MemoryBudget.h
+	@brief The MemoryBudget class, which counts the memory a set of data structures has allocated against a limit. */
+
+#include <stddef.h>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+/// A thread-safe count of the bytes allocated, and an optional limit on them.
+/** A budget can have a parent budget, which every reservation is counted against as well. The connections count the
+	storage of their queues against a budget of their own, whose parent is Network::ConnectionMemoryBudget(), so that
+	both a per-connection and a process-wide limit apply. A reservation that either limit refuses fails as a whole. */
+class MemoryBudget
+{
+public:
+	/// @param parent If not null, the reservations are counted against this budget too. It must outlive this one.
+	/// @param limit The number of bytes that may be reserved at most, or 0 for no limit.
+	explicit MemoryBudget(MemoryBudget *parent = 0, size_t limit = 0);
+
+	/// Sets the number of bytes that may be reserved at most, or 0 for no limit. The bytes already reserved stay
+	/// reserved even if they exceed the new limit. [thread-safe]
+	void SetLimit(size_t bytes) { limit = (u64)bytes; }
+
+	/// Returns the limit of this budget, or 0 if it has none. [thread-safe]
+	size_t Limit() const { return (size_t)limit; }
+
+	/// Returns true if this budget or one of its parents has a limit. [thread-safe]
+	bool IsLimited() const { return limit != 0 || (parent && parent->IsLimited()); }
+
+	/// Returns the number of bytes reserved. [thread-safe]
+	size_t BytesUsed() const { return (size_t)bytesUsed; }
+
+	/// Returns the largest number of bytes that has been reserved at once. [thread-safe]
+	size_t PeakBytesUsed() const { return (size_t)peakBytesUsed; }
+
+	/// Returns the number of bytes that can still be reserved before this budget or one of its parents refuses. [thread-safe]
+	size_t BytesLeft() const;
+
+	/// Returns the number of reservations this budget has refused. [thread-safe]
+	u32 NumRefusals() const { return (u32)numRefusals; }
+
+	/// Reserves the given number of bytes, if that does not take this budget or its parents over their limits. [thread-safe]
+	/// @return False if the bytes were not reserved.
+	bool TryReserve(size_t bytes);
+
+	/// Reserves the given number of bytes regardless of the limits. For the allocations that an object needs to work at all. [thread-safe]
+	void Reserve(size_t bytes);
+
+	/// Returns the given number of bytes reserved earlier. [thread-safe]
+	void Release(size_t bytes);
+
+private:
+	MemoryBudget *parent;
+	volatile u64 limit;
+	volatile u64 bytesUsed;
+	volatile u64 peakBytesUsed;
+	volatile long numRefusals;
+
+	/// Adds the given number of bytes to bytesUsed, unless that takes bytesUsed over the limit and enforceLimit is set.
+	bool Add(u64 bytes, bool enforceLimit);
+
+	/// Takes the given number of bytes off bytesUsed of this budget only.
+	void Subtract(u64 bytes);
+
+	MemoryBudget(const MemoryBudget &); ///< Not implemented.
+	void operator =(const MemoryBudget &); ///< Not implemented.
+};
+
+} // ~kNet
@@ -23,7 +23,10 @@
 
 #include "kNetBuildConfig.h"
 #include "WaitFreeQueue.h"
+#include "SegmentedQueue.h"
+#include "MemoryBudget.h"
 #include "NetworkSimulator.h"
+#include "PacketCapture.h"
 #include "LockFreePoolAllocator.h"
 #include "Lockable.h"
 #include "Socket.h"
@@ -31,14 +34,26 @@
 #include "BasicSerializedDataTypes.h"
 #include "Datagram.h"
 #include "FragmentedTransferManager.h"
+#include "LZ4Codec.h"
+#include "MessageIDDictionary.h"
 #include "NetworkMessage.h"
 #include "Event.h"
 #include "DataSerializer.h"
 #include "DataDeserializer.h"
 
 #include "MaxHeap.h"
+#include "OutboundMessageQueue.h"
+#include "ContentIDHashTable.h"
+#include "DeltaEncoding.h"
 #include "Clock.h"
 #include "PolledTimer.h"
+#include "TokenBucket.h"
+#include "EgressScheduler.h"
+#include "TrafficStatsRing.h"
+#include "LatencyHistogram.h"
+#include "MessageTracer.h"
+#include "StatsEventRecorder.h"
+#include "SeqLock.h"
 #include "Thread.h"
 #include "Types.h"
 
@@ -52,6 +67,8 @@ class NetworkServer;
 class Network;
 class NetworkWorkerThread;
 class FragmentedSendManager;
+class MulticastChannel;
+class MessageFrameArena;
 
 #ifdef _MSC_VER
 struct FragmentedSendManager::FragmentedTransfer;
@@ -60,6 +77,8 @@ struct FragmentedSendManager::FragmentedTransfer;
 /// Stores information about an established MessageConnection.
 struct ConnectionStatistics
 {
+	ConnectionStatistics():socketReceiveDrops(0) { ClearPings(); }
+
 	/// Remembers a ping request that was sent to the other end.
 	struct PingTrack
 	{
@@ -68,48 +87,29 @@ struct ConnectionStatistics
 		unsigned long pingID;      ///< ID of this ping message.
 		bool replyReceived;        ///< True of PingReply has already been received for this.
 	};
-	/// Contains an entry for each recently performed Ping operation, sorted by age (oldest first).
-	std::vector<PingTrack> ping;
-
-	/// Remembers both in- and outbound traffic events on the socket.
-	struct TrafficTrack
-	{
-		tick_t tick;          ///< Denotes when this event occurred.
-		unsigned long packetsIn;   ///< The number of datagrams in when this event occurred.
-		unsigned long packetsOut;  ///< The number of datagrams out when this event occurred.
-		unsigned long messagesIn;  ///< The total number of messages the received datagrams contained.
-		unsigned long messagesOut; ///< The total number of messages the sent datagrams contained.
-		unsigned long bytesIn;     ///< The total number of bytes the received datagrams contained.
-		unsigned long bytesOut;    ///< The total number of bytes the sent datagrams contained. 
-	};
-	/// Contains an entry for each recent traffic event (data in/out) on the connection, sorted by age (oldest first).
-	std::vector<TrafficTrack> traffic;
-
-	/// Remembers the send/receive time of a datagram with a certain ID.
-	struct DatagramIDTrack
+	/// The number of the latest pings that are remembered. A reply to an older ping is ignored.
+	static const int cNumPingTracks = 32;
+	/// Contains an entry for each recently performed Ping operation, at the index pingID % cNumPingTracks.
+	PingTrack ping[cNumPingTracks];
+	/// The ID of the latest ping that was sent.
+	u8 lastPingID;
+
+	/// Forgets all the pings that were sent.
+	void ClearPings()
 	{
-		tick_t tick;
-		packet_id_t packetID;
-	};
-	/// Contains an entry for each recently received packet, sorted by age (oldest first).
-	std::vector<DatagramIDTrack> recvPacketIDs;
-};
-
-/// Comparison object that sorts the two messages by their priority (higher priority/smaller number first).
-class NetworkMessagePriorityCmp
-{
-public:
-	int operator ()(const NetworkMessage *a, const NetworkMessage *b)
-	{
-		assert(a && b);
-		if (a->priority < b->priority) return -1;
-		if (b->priority < a->priority) return 1;
-
-		if (a->MessageNumber() < b->MessageNumber()) return 1;
-		if (b->MessageNumber() < a->MessageNumber()) return -1;
-
-		return 0;
+		for(int i = 0; i < cNumPingTracks; ++i)
+		{
+			ping[i].pingSentTick = ping[i].pingReplyTick = 0;
+			ping[i].pingID = 0;
+			ping[i].replyReceived = true; // No reply is expected for an unused entry.
+		}
+		lastPingID = 0;
 	}
+
+	/// The number of inbound datagrams the OS has dropped at the socket of this connection, since its receive buffer was
+	/// full. The connections of a UDP server share its sockets, so this is the total of all the sockets of the server.
+	/// See Socket::ReceiveQueueDrops().
+	unsigned long socketReceiveDrops;
 };
 
 /// Represents the current state of the connection.
@@ -130,6 +130,23 @@ std::string ConnectionStateToString(ConnectionState state);
 #undef SendMessage
 #endif
 
+/// A set of outbound messages that MessageConnection::CommitMessageBatch() submits to the worker thread all at once.
+/// See MessageConnection::AddMessageToBatch(). A batch belongs to the thread that fills it. [Not thread-safe]
+class OutboundMessageBatch
+{
+public:
+	/// Frees the messages that were never committed.
+	~OutboundMessageBatch();
+
+	/// Returns the number of messages added to the batch since it was last committed.
+	size_t Size() const { return messages.size(); }
+
+private:
+	friend class MessageConnection;
+
+	std::vector<NetworkMessage*> messages;
+};
+
 /// Represents a single established network connection. MessageConnection maintains its own worker thread that manages
 /// connection control, the scheduling and prioritization of outbound messages, and receiving inbound messages.
 class MessageConnection : public RefCountable
@@ -201,7 +218,13 @@ public:
 	///         EndAndQueueMessage when you have finished building the message to commit the network send and to release the memory.
 	///         Alternatively, if after calling StartNewMessage, you decide to abort the network send, free up the NetworkMessage
 	///         by calling this->FreeMessage().
-	NetworkMessage *StartNewMessage(unsigned long id, size_t numBytes = 0); // [main and worker thread]
+	/// @param arena If not null and in a frame, the message is allocated from the arena instead of the message pool. See
+	///              MessageFrameArena.
+	/// \note StartNewMessage(), EndAndQueueMessage() and SendMessage() can be called from several application threads at
+	///       the same time, without locking. The messages of each thread are sent in the order the thread queued them (as
+	///       far as their priorities allow), and the messages of different threads interleave in the order they were
+	///       queued in. Set up the ordering channels with SetOrderingChannel() before the threads start sending.
+	NetworkMessage *StartNewMessage(unsigned long id, size_t numBytes = 0, MessageFrameArena *arena = 0); // [main and worker thread]
 
 	/// Finishes building the message and submits it to the outbound send queue.
 	/// @param msg The message to send. After calling this function, this pointer should be considered freed and may not be
@@ -214,11 +237,47 @@ public:
 	///                 thread. Pass in the value 'false' here in the client application, or there is a chance of a race condition.
 	void EndAndQueueMessage(NetworkMessage *msg, size_t numBytes = (size_t)(-1), bool internalQueue = false); // [main and worker thread]
 
+	/// Finishes building the message like EndAndQueueMessage() does, but instead of submitting the message right away, adds
+	/// it to the given batch. The message is sent once the batch is committed. A message that has to be fragmented is
+	/// queued right away.
+	/// @param numBytes The number of bytes filled in to msg.data. The default value uses the size given to StartNewMessage().
+	void AddMessageToBatch(OutboundMessageBatch &batch, NetworkMessage *msg, size_t numBytes = (size_t)(-1)); // [main thread]
+
+	/// Submits all the messages of the batch to the outbound queue in one operation, and wakes up the worker thread once.
+	/// Use this instead of EndAndQueueMessage() when queueing many messages at a time, so that the worker thread doesn't
+	/// wake up for each one, and gets to pack them together. Leaves the batch empty.
+	void CommitMessageBatch(OutboundMessageBatch &batch); // [main thread]
+
 	/// This is a conveniency function to access the above StartNewMessage/EndAndQueueMessage pair. The performance of this
 	/// function call is not as good, since a memcpy of the message will need to be made. For performance-critical messages,
-	/// it is better to craft the message directly into the buffer area provided by StartNewMessage.
+	/// it is better to craft the message directly into the buffer area provided by StartNewMessage, or, if the payload is
+	/// already in a buffer of its own, to lend the buffer to SendBuffer().
+	/// @param expiryMSecs If nonzero, and the message is unreliable, the message is dropped unsent if it still waits in the
+	///                    outbound queue this many msecs from now. See NetworkMessage::SetExpiry().
 	void SendMessage(unsigned long id, bool reliable, bool inOrder, unsigned long priority, unsigned long contentID, 
-	                 const char *data, size_t numBytes); // [main thread]
+	                 const char *data, size_t numBytes, unsigned long expiryMSecs = 0); // [main thread]
+
+	/// Sends the given bytes as a message without copying them. The message, and the fragments of it sent over UDP, refer
+	/// to the bytes directly, so the bytes must not be modified or freed until releaseHandler->ReleaseBuffer() is called
+	/// with them. That happens once the message has been sent out, or acked if it is reliable, or dropped. If the message
+	/// cannot be queued, ReleaseBuffer() is called before this function returns. Takes the same parameters as SendMessage().
+	/// @param releaseHandler The handler that gets the bytes back. Must stay alive until it has been called.
+	void SendBuffer(unsigned long id, bool reliable, bool inOrder, unsigned long priority, unsigned long contentID,
+	                const char *data, size_t numBytes, IBufferReleaseHandler *releaseHandler, unsigned long expiryMSecs = 0); // [main thread]
+
+	/// Sends the contents of the given file as a single reliable message with the given ID. The file is mapped to memory, and
+	/// the message is sent straight from the mapping: the fragments of a UDP transfer refer to the mapped bytes, and a TCP
+	/// connection passes large files to the kernel with sendfile() (TransmitFile() on Windows). The file is unmapped once the
+	/// whole message has been sent out or acknowledged. The file must not be modified while it is being sent.
+	/// @return False if the file could not be opened and mapped, in which case nothing is sent.
+	bool SendFile(unsigned long id, const char *filename, unsigned long priority = 0, bool inOrder = false); // [main thread]
+
+	/// Writes the next message with the given ID that is received from this connection to the given file, instead of to memory.
+	/// The fragments, or the TCP stream, of the message are written straight to a memory mapping of the file, which is
+	/// truncated to the size of the message when it is complete. The message is then passed to the application as usual,
+	/// with its data referring to the mapping, and the file is closed when the application has handled the message.
+	/// Applies to a single message. Calling this again for the same ID before the message arrives replaces the filename.
+	void ReceiveFile(unsigned long id, const char *filename); // [main thread]
 
 	/// Sends a message using a serializable structure.
 	template<typename SerializableData>
@@ -239,6 +298,14 @@ public:
 	/// Returns the number of messages that have been received from the network but haven't been handled by the application yet.
 	size_t NumInboundMessagesPending() const { return inboundMessageQueue.Size(); } // [main and worker thread]
 
+	/// Returns an event that is set while there are received messages waiting for Process() or ReceiveMessage(), once a UDP
+	/// connection has been established, and once the peer has closed the connection. An application that runs an event loop
+	/// of its own can wait on it in place of polling: on unix, poll the descriptor Event::fd[0] for readability, and on
+	/// Windows, wait on Event::wsaEvent. The event is reset when Process() or ReceiveMessage() empties the inbound queue,
+	/// so do not read from or reset it yourself.
+	/// The event is created on the first call, and the worker thread signals it only from then on. [main thread]
+	Event InboundMessagesEvent();
+
 	/// Returns the total number of messages pending to be sent out.
 	size_t NumOutboundMessagesPending() const { return outboundQueue.Size() + outboundAcceptQueue.Size(); } // [main and worker thread]
 
@@ -251,6 +318,10 @@ public:
 	/// Returns the underlying raw socket. [main and worker thread]
 	Socket *GetSocket() { return socket; }
 
+	/// Returns the size of the largest datagram or packet this connection currently sends. The messages that do not fit
+	/// are split into fragments when they are queued over UDP. [main and worker thread]
+	virtual size_t MaxDatagramSize() const { return socket ? socket->MaxSendSize() : 0; }
+
 	/// Returns an object that identifies the local endpoint (IP and port) this connection is connected to.
 	EndPoint LocalEndPoint() const; // [main and worker thread]
 
@@ -258,17 +329,161 @@ public:
 	EndPoint RemoteEndPoint() const; // [main and worker thread]
 
 	/// Sets an upper limit to the data send rate for this connection.
-	/// The default is not to have an upper limit at all.
+	/// The default is not to have an upper limit at all. The limits are enforced with token buckets that hold up to
+	/// 50 msecs worth of sends, so a connection that has been idle can send a short burst before it is paced to the limit.
 	/// @param numBytesPerSec The upper limit for the number of bytes to send per second. This limit includes the message header
 	///                       bytes as well and not just the payload. Set to 0 to force no limit.
 	/// @param numDatagramsPerSec The maximum number of datagrams (UDP packets) to send per second. Set to 0 to force no limit.
 	///                       If the connection is operating on top of TCP, this field has no effect.
-	///\todo Implement.
-	void SetMaximumDataSendRate(int numBytesPerSec, int numDatagramsPerSec);
+	void SetMaximumDataSendRate(int numBytesPerSec, int numDatagramsPerSec); // [main thread]
+
+	/// Returns the byte send rate limit set with SetMaximumDataSendRate, or 0 if there is no limit. [main and worker thread]
+	int MaximumBytesSendRate() const { return maxBytesSendRate; }
+
+	/// Returns the datagram send rate limit set with SetMaximumDataSendRate, or 0 if there is no limit. [main and worker thread]
+	int MaximumDatagramsSendRate() const { return maxDatagramsSendRate; }
+
+	/// Returns the number of unreliable messages that were dropped unsent, since they were still in the outbound queue when
+	/// they expired. See NetworkMessage::SetExpiry(). [main and worker thread]
+	unsigned long NumExpiredMessages() const { return numExpiredMessages; }
+
+	/// Sets the number of bytes the queues of this connection may take at most, or 0 for no limit. The queues start small
+	/// and grow with the number of messages in them, and shrink again as they drain. When a queue would grow past the
+	/// limit, or past the limit of Network::ConnectionMemoryBudget(), it counts as full: the unreliable messages sent
+	/// are dropped, and the datagrams or the stream data received are held back until the application catches up. Each
+	/// queue can hold a few messages regardless of the limits. The default is Network::ConnectionMemoryLimit(). [thread-safe]
+	void SetMemoryLimit(size_t bytes) { memoryBudget.SetLimit(bytes); }
+
+	/// Returns the memory limit of this connection, or 0 if it has none. See SetMemoryLimit(). [thread-safe]
+	size_t MemoryLimit() const { return memoryBudget.Limit(); }
+
+	/// Returns the number of bytes the queues of this connection take. [thread-safe]
+	size_t MemoryUsage() const { return memoryBudget.BytesUsed(); }
+
+	/// Returns the largest number of bytes the queues of this connection have taken at once. [thread-safe]
+	size_t PeakMemoryUsage() const { return memoryBudget.PeakBytesUsed(); }
+
+	/// Returns the number of times a queue of this connection could not grow, since the memory limits refused it. [thread-safe]
+	u32 NumMemoryLimitRefusals() const { return memoryBudget.NumRefusals(); }
+
+	/// The interval of the keepalive pings of the idle connections, in msecs. Half of the time after which a peer that
+	/// has not been heard from is declared lost, with some margin.
+	static const int cIdleKeepAliveIntervalMSecs = 7000;
+
+	/// Sets how long the connection must go without application messages in either direction to enter the idle mode, in
+	/// msecs, or 0 to never enter it. An idle connection pings the peer only every cIdleKeepAliveIntervalMSecs, in a sweep
+	/// of its worker thread that sends the keepalives of all its idle connections together, and does not recompute its
+	/// statistics, so that a large number of quiet connections cost little CPU time and traffic. The first message sent or
+	/// received returns the connection to the normal mode. The default is 10 seconds. [main and worker thread]
+	void SetIdleTimeout(float msecs) { idleTimeout = msecs; }
+
+	/// Returns the time without messages after which the connection enters the idle mode, or 0. See SetIdleTimeout(). [main and worker thread]
+	float IdleTimeout() const { return idleTimeout; }
+
+	/// Returns true if the connection is in the idle mode. See SetIdleTimeout(). [main and worker thread]
+	bool IsIdle() const { return idle; }
+
+	/// Sets the share of this client connection in the total send rate of its server, relative to the other clients, see
+	/// NetworkServer::SetEgressBandwidthLimit(). The default weight is 1. Has no effect on a connection without a server. [main thread]
+	void SetEgressWeight(int weight) { egressFlow.weight = (weight > 1) ? weight : 1; }
+
+	/// Returns the weight set with SetEgressWeight(). [main and worker thread]
+	int EgressWeight() const { return egressFlow.weight; }
+
+	/// Holds the outbound messages back for up to maxDelayMicroseconds after the first of them was queued, or until they
+	/// add up to flushBytes bytes, and then writes them to the socket at once, so that they fill as few TCP segments as
+	/// possible. Unlike Nagle's algorithm, which holds a small segment back until the peer acks the previous ones, this
+	/// bounds the latency added to each message, so disable Nagle's algorithm on the socket when using this. The delay is
+	/// timed by the worker thread, which wakes up at a millisecond resolution. Pass in 0 to send each message out as soon
+	/// as possible, which is the default.
+	/// On top of UDP, the messages held back go out in as few datagrams as possible, and flushBytes is capped to what fits
+	/// in a datagram. A message of urgentPriority or higher is not held back, and takes the held messages along with it.
+	/// The default lets the internal messages of kNet, such as acks and pings, through. [main thread]
+	void SetSendCoalescing(int maxDelayMicroseconds, size_t flushBytes = 1400, unsigned long urgentPriority = NetworkMessage::cMaxPriority - 1); // [main thread]
+
+	/// Returns the delay set with SetSendCoalescing(), in microseconds, or 0 if the messages are not held back. [main and worker thread]
+	int SendCoalescingDelay() const { return sendCoalescingDelay; }
+
+	/// Sends the reliable in-order messages of the given ID on the given ordering channel, unless the application has set
+	/// NetworkMessage::orderingChannel of the message to another nonzero channel. Each channel keeps its order independent of
+	/// the others, so that a lost message only delays the messages behind it on its own channel. By default, all messages
+	/// are on channel 0. [main thread]
+	void SetOrderingChannel(message_id_t id, u8 channel); // [main thread]
+
+	/// Returns the ordering channel set for the given message ID with SetOrderingChannel(), or 0. [main thread]
+	u8 OrderingChannel(message_id_t id) const; // [main thread]
+
+	/// Selects the data structure the outbound messages wait in. Use OutboundQueuePriorityBuckets if the messages use only a few
+	/// distinct priority values and the queue can grow long, or OutboundQueueFIFO to skip priorization altogether. The worker
+	/// thread moves the already queued messages over to the new structure. Default: OutboundQueuePriorityHeap.
+	void SetOutboundQueueType(OutboundQueueType type) { outboundQueueType = type; } // [main thread]
+
+	/// Returns the outbound queue type set with SetOutboundQueueType().
+	OutboundQueueType OutboundQueueTypeInUse() const { return outboundQueueType; } // [main and worker thread]
+
+	/// Compresses the data sent to the peer with LZ4. Each UDP datagram, or each batch of messages written to a TCP stream,
+	/// of at least minBytes bytes is compressed, and sent compressed if that makes it smaller. The two ends tell each other
+	/// which codecs they can decompress once the connection is established, and nothing is compressed until the peer has
+	/// done so, so compression can be enabled at either end alone. Off by default. [main thread]
+	void SetCompression(bool enabled, size_t minBytes = 64); // [main thread]
+
+	/// Returns true if SetCompression() has enabled compression. [main and worker thread]
+	bool CompressionEnabled() const { return compressionEnabled; }
+
+	/// Sets a dictionary for the compression: a sample of what the connection carries, for example a set of typical messages
+	/// concatenated together. Small datagrams compress far better against a good dictionary. The dictionary is used only
+	/// while the peer has set the very same dictionary, so both ends need to set it. Set it before connecting, since the
+	/// datagrams that are in flight while it changes are compressed against the old one, and lost. Pass in 0 bytes to remove
+	/// the dictionary. [main thread]
+	void SetCompressionDictionary(const char *data, size_t numBytes); // [main thread]
 
 	/// Registers a new listener object for the events of this connection.
 	void RegisterInboundMessageHandler(IMessageHandler *handler); // [main thread]
 
+	/// The largest message ID that RegisterMessageHandler() and RegisterMessageBatchHandler() accept. The handlers are kept
+	/// in a flat table indexed by the ID.
+	static const message_id_t cMaxDispatchMessageID = 65535;
+
+	/// Makes Process() pass the messages with the given ID to the given handler instead of the handler set with
+	/// RegisterInboundMessageHandler(). Pass in 0 to remove the handler. If the ID has a batch handler, that is used instead.
+	/// \note The messages that have neither a handler of their own nor a RegisterInboundMessageHandler() handler to go to
+	///       are discarded.
+	/// @param id The message ID, at most cMaxDispatchMessageID. Throws NetException otherwise.
+	void RegisterMessageHandler(message_id_t id, IMessageHandler *handler); // [main thread]
+
+	/// Makes Process() pass the messages with the given ID to the given handler in spans of consecutive messages, see
+	/// IMessageBatchHandler. Pass in 0 to remove the handler.
+	/// @param id The message ID, at most cMaxDispatchMessageID. Throws NetException otherwise.
+	void RegisterMessageBatchHandler(message_id_t id, IMessageBatchHandler *handler); // [main thread]
+
+	/// Joins the multicast group that the server of this connection sends to with NetworkServer::MulticastMessage().
+	/// Process() passes the messages from the group to their handlers the same way as the messages of the connection,
+	/// with packet ID 0. Only the datagrams sent from the address of the server are accepted, or from any address if the
+	/// server is on this host, since its multicast datagrams then come from one of the addresses of the host. Joining
+	/// another group leaves the previous one. [main thread]
+	/// @return False if the group could not be joined.
+	bool JoinMulticastGroup(const char *groupAddress, unsigned short port); // [main thread]
+
+	/// Leaves the multicast group joined with JoinMulticastGroup(). [main thread]
+	void LeaveMulticastGroup(); // [main thread]
+
+	/// Returns the multicast group this connection has joined, or 0 if none. [main thread]
+	const MulticastChannel *MulticastGroup() const { return multicastGroup; }
+
+	/// Makes the network worker thread pass the received messages directly to the given handler, as soon as it has read
+	/// them from the socket, instead of queueing them up for Process() and ReceiveMessage(). The data passed to
+	/// IMessageHandler::HandleMessage() points into the receive buffer, and is valid only until the call returns. This
+	/// saves the copy of each message and the latency of waiting for the next Process() call of the main thread.
+	/// Pass in 0 to return to queueing the messages.
+	/// \note The handler is called in the worker thread, which serves the other connections of the thread as well, so it must
+	///       be thread-safe and quick. It may send replies with StartNewMessage() and EndAndQueueMessage(). The messages that
+	///       were queued before the handler was set are still delivered by Process(), and the messages the application has
+	///       asked to receive to a file with a file destination are always queued.
+	void SetWorkerThreadMessageHandler(IMessageHandler *handler) { workerThreadMessageHandler = handler; } // [main thread]
+
+	/// Returns the handler set with SetWorkerThreadMessageHandler(), or 0 if the messages are queued for the main thread.
+	IMessageHandler *WorkerThreadMessageHandler() const { return workerThreadMessageHandler; } // [main and worker thread]
+
 	/// Fetches all newly received messages waiting in the inbound queue, and passes each of these
 	/// to the message handler registered using RegisterInboundMessageHandler.
 	/// Call this function periodically to receive new data from the network if you are using the Observer pattern.
@@ -280,6 +495,11 @@ public:
 	///       otherwise an attacker might affect the performance of the application main loop by sending messages so fast that
 	///       the queue never has time to exhaust, thus giving an infinite loop in practice.
 	void Process(int maxMessagesToProcess = 100); // [main thread]
+
+	/// Like Process(), but limits the time spent instead of the number of messages: returns once the inbound queue is empty
+	/// or maxMicroseconds have passed. The time is checked after each batch of messages passed to the handlers, so a slow
+	/// handler can make the call run over by a batch. See also NetworkServer::ProcessFor().
+	void ProcessFor(int maxMicroseconds); // [main thread]
 	
 	/// Waits for at most the given amount of time until a new message is received for processing.
 	/// @param maxMSecsToWait If 0, the call will wait indefinitely until a message is received or the connection transitions to
@@ -315,15 +535,22 @@ public:
 	/// Returns the estimated RTT of the connection, in milliseconds. RTT is the time taken to communicate a message from client->host->client.
 	float RoundTripTime() const { return rtt; } // [main and worker thread]
 
+	/// Returns the histogram of the given latency measure over the lifetime of this connection. The histograms are updated
+	/// by the worker thread, so the percentiles read from the main thread can lag behind by the latest few samples. [main and worker thread]
+	const LatencyHistogram &GetLatencyHistogram(LatencyMetric metric) const { return samples->latencyHistograms[metric]; }
+
 	/// Returns the number of milliseconds since we last received data from the socket.
 	float LastHeardTime() const { return Clock::TicksToMillisecondsF(Clock::TicksInBetween(Clock::Tick(), lastHeardTime)); } // [main and worker thread]
 
-	float PacketsInPerSec() const { return packetsInPerSec; } // [main and worker thread]
-	float PacketsOutPerSec() const { return packetsOutPerSec; } // [main and worker thread]
-	float MsgsInPerSec() const { return msgsInPerSec; } // [main and worker thread]
-	float MsgsOutPerSec() const { return msgsOutPerSec; } // [main and worker thread]
-	float BytesInPerSec() const { return bytesInPerSec; } // [main and worker thread]
-	float BytesOutPerSec() const { return bytesOutPerSec; } // [main and worker thread]
+	/// Returns all the traffic rates of this connection, as they were computed at the same time. Never blocks the worker thread.
+	ConnectionTrafficRates TrafficRates() const { return trafficRates.Load(); } // [main and worker thread]
+
+	float PacketsInPerSec() const { return TrafficRates().packetsInPerSec; } // [main and worker thread]
+	float PacketsOutPerSec() const { return TrafficRates().packetsOutPerSec; } // [main and worker thread]
+	float MsgsInPerSec() const { return TrafficRates().msgsInPerSec; } // [main and worker thread]
+	float MsgsOutPerSec() const { return TrafficRates().msgsOutPerSec; } // [main and worker thread]
+	float BytesInPerSec() const { return TrafficRates().bytesInPerSec; } // [main and worker thread]
+	float BytesOutPerSec() const { return TrafficRates().bytesOutPerSec; } // [main and worker thread]
 
 	/// Returns the total number of bytes (excluding IP and TCP/UDP headers) that have been received from this connection.
 	u64 BytesInTotal() const { return bytesInTotal; } // [main and worker thread]
@@ -331,21 +558,55 @@ public:
 	/// Returns the total number of bytes (excluding IP and TCP/UDP headers) that have been sent from this connection.
 	u64 BytesOutTotal() const { return bytesOutTotal; } // [main and worker thread]
 
+	/// Returns the total number of datagrams (for TCP, socket reads) that have been received from this connection.
+	u64 PacketsInTotal() const { return packetsInTotal; } // [main and worker thread]
+
+	/// Returns the total number of datagrams (for TCP, socket writes) that have been sent from this connection.
+	u64 PacketsOutTotal() const { return packetsOutTotal; } // [main and worker thread]
+
 	/// Returns the simulator object which can be used to apply network condition simulations to this connection.
 	NetworkSimulator &NetworkSendSimulator() { return networkSendSimulator; }
 
+	/// Returns the simulator object which applies network condition simulations to the datagrams this connection receives.
+	NetworkSimulator &NetworkReceiveSimulator() { return networkReceiveSimulator; }
+
 	/// Stores all the statistics about the current connection. This data is periodically recomputed
 	/// by the network worker thread and shared to the client through a lock.
 	Lockable<ConnectionStatistics> statistics; // [main and worker thread]
 
 protected:
 	friend class NetworkWorkerThread;
+	friend class NetworkSimulator;
 
 	/// The Network object inside which this MessageConnection lives.
 	Network *owner; // [set and read only by the main thread]
 
-	/// If this MessageConnection represents a client connection on the server side, this gives the owner.
-	NetworkServer *ownerServer; // [set and read only by the main thread]
+	/// If this MessageConnection represents a client connection on the server side, this gives the owner. The worker thread
+	/// reads it to find the clients of a broadcast, see NetworkServer::SetWorkerThreadBroadcasts(). Cleared after the
+	/// connection is removed from its worker thread.
+	NetworkServer *ownerServer; // [set by the main thread, read by main and worker thread]
+
+	/// The packet capture of ownerServer, or 0 if this is not a client connection of a server. Cleared with ownerServer,
+	/// after the connection is removed from its worker thread. [set by the main thread, read by the worker thread]
+	PacketCapture *packetCapture;
+
+	/// The egress scheduler of ownerServer, or 0 if this is not a client connection of a server. Cleared with ownerServer,
+	/// after the connection is removed from its worker thread. [set by the main thread, read by the worker thread]
+	EgressScheduler *egressScheduler;
+	/// The share of this connection in egressScheduler. Mutable, since the scheduler credits it when asked whether this
+	/// connection may send. [worker thread, the weight set by the main thread]
+	mutable EgressScheduler::Flow egressFlow;
+
+	/// Records the given raw datagram or stream block to the packet capture of the server, if it is capturing. [worker thread]
+	void CapturePacket(PacketCaptureDirection direction, const char *data, size_t numBytes)
+	{
+		if (packetCapture)
+			packetCapture->Record(direction, socket->TransportLayer(), serverEndPoint, data, numBytes);
+	}
+
+	/// The count of the malformed datagrams of ownerServer, or 0 if this is not a client connection of a server. Cleared with
+	/// ownerServer, after the connection is removed from its worker thread. [set by the main thread, read by the worker thread]
+	volatile long *serverMalformedDatagrams;
 
 	/// Stores the thread that manages the background processing of this connection. The same thread can manage multiple
 	/// connections and servers, and not just this one.
@@ -365,19 +626,32 @@ protected:
 	/// Returns true if this MessageConnection is associated with a NetworkWorkerThread to maintain.
 	bool IsWorkerThreadRunning() const { return workerThread != 0; } // [main and worker thread]
 
-	/// A queue populated by the main thread to give out messages to the MessageConnection work thread to process.
-	WaitFreeQueue<NetworkMessage*> outboundAcceptQueue; // [produced by main thread, consumed by worker thread]
+	/// The storage of the queues of this connection is counted against this budget. Its parent is Network::ConnectionMemoryBudget().
+	MemoryBudget memoryBudget; // [thread-safe]
+
+	/// A queue populated by the application threads to give out messages to the MessageConnection work thread to process.
+	SegmentedQueue<NetworkMessage*> outboundAcceptQueue; // [produced by any application thread, consumed by worker thread]
 
 	/// A queue populated by the networking thread to hold all the incoming messages until the application can process them.	
-	WaitFreeQueue<NetworkMessage*> inboundMessageQueue; // [produced by worker thread, consumed by main thread]
+	SegmentedQueue<NetworkMessage*> inboundMessageQueue; // [produced by worker thread, consumed by main thread]
+
+	/// A report of how much of a fragmented message the peer has acked. See IMessageHandler::HandleOutboundTransferProgress().
+	struct OutboundTransferProgress
+	{
+		message_id_t messageID;
+		u32 contentID;
+		size_t bytesAcked;
+		size_t totalBytes;
+	};
+
+	/// The progress reports of the fragmented transfers, passed on to the inboundMessageHandler in Process().
+	WaitFreeQueue<OutboundTransferProgress> transferProgressQueue; // [produced by worker thread, consumed by main thread]
 
 	/// A priority queue that maintains in order all the messages that are going out the pipe.
-	///\todo Make the choice of which of the following structures to use a runtime option.
-#ifndef KNET_NO_MAXHEAP // If defined, disables message priorization feature to improve client-side CPU performance. By default disabled.
-	MaxHeap<NetworkMessage*, NetworkMessagePriorityCmp> outboundQueue; // [worker thread]
-#else
-	WaitFreeQueue<NetworkMessage*> outboundQueue; // [worker thread]
-#endif
+	OutboundMessageQueue outboundQueue; // [worker thread]
+
+	/// The type of outboundQueue the main thread has asked for. The worker thread switches outboundQueue over to it. See SetOutboundQueueType().
+	volatile OutboundQueueType outboundQueueType; // [main thread writes, worker thread reads]
 
 	/// Tracks all the message sends that are fragmented.
 	Lockable<FragmentedSendManager> fragmentedSends; // [worker thread]
@@ -385,10 +659,6 @@ protected:
 	/// Tracks all the receives of fragmented messages and helps reconstruct the original messages from fragments.
 	FragmentedReceiveManager fragmentedReceives; // [worker thread]
 
-	/// Allocations of NetworkMessage structures go through a pool to avoid dynamic new/delete calls when sending messages.
-	/// This structure is shared between the main and worker thread through a lockfree construct.
-	LockFreePoolAllocator<NetworkMessage> messagePool; // [main and worker thread]
-
 	/// Tracks when it is time to send the next PingRequest to the peer.
 	PolledTimer pingTimer; // [worker thread]
 
@@ -414,12 +684,44 @@ protected:
 	/// Returns how many milliseconds need to be waited before this socket can try sending data the next time.
 	virtual unsigned long TimeUntilCanSendPacket() const = 0; // [worker thread]
 
+	/// Returns true if the connection is holding its queued messages back to send them together, but rather sends out the
+	/// newly queued ones right away if they make the batch large enough. See SetSendCoalescing().
+	virtual bool HoldingOutboundMessages() const { return false; } // [worker thread]
+
 	/// Performs the internal work tick that updates this connection.
 	void UpdateConnection(); // [worker thread]
 
 	/// Overridden by a subclass of MessageConnection to do protocol-specific updates (private implementation -pattern)
 	virtual void DoUpdateConnection() {} // [worker thread]
 
+	/// Returns the number of msecs until the timers of this connection (pings, statistics, and in subclasses e.g. acks
+	/// and retransmissions) need UpdateConnection() to be called again. The worker thread schedules the connection on its
+	/// timer wheel based on this, so that connections without socket activity are not polled. [worker thread]
+	virtual unsigned long TimeUntilNextUpdate() const;
+
+	/// Returns true if the limits set with SetMaximumDataSendRate allow sending out the next packet now. [worker thread]
+	bool SendRateLimitAllowsSend() const;
+
+	/// Returns the number of msecs until the limits set with SetMaximumDataSendRate allow sending out the next packet,
+	/// rounded up so that the worker thread does not wake up before that. [worker thread]
+	unsigned long TimeUntilSendRateLimitAllowsSend() const;
+
+	/// Charges a sent packet against the limits set with SetMaximumDataSendRate, and against the egress scheduler of the
+	/// server. [worker thread]
+	void ConsumeSendRateLimit(size_t numBytes, int numDatagrams);
+
+	/// Returns the number of msecs until the egress scheduler of the server lets this connection send, rounded up, or 0 if
+	/// it can send now. The next datagram is taken to be as important as the message at the front of the outbound queue. [worker thread]
+	unsigned long TimeUntilEgressAllowsSend(tick_t now) const;
+
+	/// Returns the number of bytes that can be sent at most in one go under the byte send rate limit, or 0 if
+	/// there is no limit. [worker thread]
+	size_t SendRateLimitBurstBytes() const { return (size_t)byteSendRateLimit.BurstSize(); }
+
+	/// Returns the number of msecs left on the given timer, rounded up. A timer that is not running counts as elapsed, since
+	/// the update functions restart their timers when TriggeredOrNotRunning().
+	static unsigned long TimerMSecsLeft(const PolledTimer &timer);
+
 	/// Marks that the peer has closed the connection and will not send any more application-level data.
 	void SetPeerClosed(); // [worker thread]
 
@@ -428,6 +730,9 @@ protected:
 	/// Posted when the application has pushed us some messages to handle.
 	Event NewOutboundMessagesEvent() const; // [main and worker thread]
 
+	/// Returns the event that is signalled when there is new inbound data for this connection to read.
+	virtual Event NewInboundDataEvent(); // [worker thread]
+
 	/// Specifies the result of a Socket read activity.
 	enum SocketReadResult
 	{
@@ -445,6 +750,9 @@ protected:
 
 	SocketReadResult ReadSocket(); // [worker thread]
 
+	/// Called by networkReceiveSimulator to pass on a received datagram once its simulated delay has passed.
+	virtual void HandleSimulatedInboundDatagram(char * /*data*/, size_t /*numBytes*/) {} // [worker thread]
+
 	/// Sets the worker thread object that will handle this connection.
 	void SetWorkerThread(NetworkWorkerThread *thread); // [main thread]
 
@@ -452,16 +760,73 @@ protected:
 
 	void HandleInboundMessage(packet_id_t packetID, const char *data, size_t numBytes); // [worker thread]
 
-	/// Allocates a new NetworkMessage struct. [both worker and main thread]
-	NetworkMessage *AllocateNewMessage();
+	/// Handles a message that has already been read into a NetworkMessage, e.g. one assembled from fragments. The
+	/// message is passed on to the application as is, without a copy. Takes the ownership of the message.
+	void HandleInboundMessage(packet_id_t packetID, NetworkMessage *msg); // [worker thread]
+
+	/// Passes a received message to the handler of SetWorkerThreadMessageHandler().
+	void DeliverOnWorkerThread(IMessageHandler *handler, packet_id_t packetID, message_id_t messageID, const char *data, size_t numBytes); // [worker thread]
+
+	/// Allocates a new NetworkMessage struct, from the given arena if it is in a frame. [both worker and main thread]
+	NetworkMessage *AllocateNewMessage(MessageFrameArena *arena = 0);
+
+	/// Same as StartNewMessage(), but the new message refers to the given bytes of a shared buffer instead of a data buffer of
+	/// its own. Used to send the same serialized payload to several connections without copying it. [main and worker thread]
+	NetworkMessage *StartNewSharedMessage(unsigned long id, DatagramBuffer *sharedData, const char *data, size_t numBytes);
 
 	// Ping/RTT management operations:
 	void SendPingRequestMessage(bool internalQueue); // [main or worker thread]
 
+	/// Passes the given message to the TCP/UDP -specific handler, and handles the protocol messages of both.
+	/// @return True if the message was handled, and should not be passed on to the application.
+	bool HandleProtocolMessage(packet_id_t packetID, message_id_t messageID, const char *data, size_t numBytes); // [worker thread]
+
+	/// Called by the message handlers when a received message can not be parsed, after they have logged and discarded it.
+	/// The UDP connections drop the rest of the datagram the message came in, and count the datagram as malformed.
+	virtual void MalformedMessageReceived() {} // [worker thread]
+
+	/// Passes the given message on to the main thread, or frees it if the inbound message queue is full.
+	void QueueInboundMessage(NetworkMessage *msg); // [worker thread]
+
 	void HandlePingRequestMessage(const char *data, size_t numBytes); // [worker thread]
 
 	void HandlePingReplyMessage(const char *data, size_t numBytes); // [worker thread]
 
+	// Compression, see SetCompression():
+	/// The bits of the codec mask of a CompressionOffer message.
+	enum CompressionCodec
+	{
+		CompressionCodecLZ4 = 1
+	};
+
+	/// Applies a new dictionary, and tells the peer what this end can decompress when that has changed.
+	void UpdateCompression(); // [worker thread]
+	void SendCompressionOffer(); // [worker thread]
+	void HandleCompressionOfferMessage(const char *data, size_t numBytes); // [worker thread]
+
+	/// Returns true if compression is enabled, and the peer has offered to decompress the data.
+	bool CompressionNegotiated() const { return compressionEnabled && (peerCompressionCodecs & CompressionCodecLZ4) != 0; } // [worker thread]
+
+	/// Compresses the given block to compressionBuffer, as the content of a CompressedData message without the message ID.
+	/// @return The size of the content, or 0 if it would be larger than maxContentSize bytes.
+	size_t CompressMessageData(const char *data, size_t numBytes, size_t maxContentSize); // [worker thread]
+
+	/// Decompresses the content of a CompressedData message without the message ID to dst, starting at dstOffset.
+	/// @return The size of the decompressed block, or -1 if the content was malformed, larger than maxSize bytes, or
+	///         compressed against another dictionary.
+	int DecompressMessageData(const char *data, size_t numBytes, size_t maxSize, std::vector<char> &dst, size_t dstOffset); // [worker thread]
+
+	// Message ID codes, see Network::SetMessageIDCodes():
+	/// The first byte of a MessageIDCode message, followed by the u8 code and the VLE8_16_32 message ID.
+	enum MessageIDCodeType
+	{
+		MessageIDCodeOffer = 0, ///< The sender will send the code in place of the ID once the peer accepts it.
+		MessageIDCodeAccept = 1 ///< The reply to an accepted offer.
+	};
+
+	void SendMessageIDCodeMessage(MessageIDCodeType type, message_id_t code, message_id_t id); // [worker thread]
+	void HandleMessageIDCodeMessage(const char *data, size_t numBytes); // [worker thread]
+
 	// Frees all internal dynamically allocated message data.
 	void FreeMessageData(); // [main thread]
 
@@ -470,6 +835,22 @@ protected:
 
 	/// Refreshes RTT and other connection related statistics.
 	void ComputeStats(); // [worker thread]
+
+	/// Returns the time the socket layer received the data that is being handled, or the current time if the socket did
+	/// not timestamp it. The RTT samples end at this time, so that they don't include the time the data waited for the
+	/// worker thread. Never returns a time before the given one, the send time of the request that the data answers.
+	tick_t InboundReceiveTick(tick_t notBefore) const; // [worker thread]
+
+	/// Records that an application message was sent or received, and returns the connection to the normal mode if it was idle.
+	void MarkActivity(); // [worker thread]
+
+	/// Moves the connection to the idle mode when it has gone idleTimeout msecs without messages, and back out of it when
+	/// the idle mode no longer applies.
+	void UpdateIdleMode(); // [worker thread]
+
+	/// Sends a keepalive ping and checks the connection for a timeout, in place of the timers an idle connection does not
+	/// run. Called from the keepalive sweep of the worker thread.
+	void SendIdleKeepAlive(); // [worker thread]
 	
 	/// Adds a new entry for outbound data statistics.
 	void AddOutboundStats(unsigned long numBytes, unsigned long numPackets, unsigned long numMessages); // [worker thread]
@@ -486,43 +867,230 @@ protected:
 	/// The object that receives notifications of all received data.
 	IMessageHandler *inboundMessageHandler; // [main thread]
 
+	/// The handler of SetWorkerThreadMessageHandler(), or 0. [written by the main thread, read by the worker thread]
+	IMessageHandler * volatile workerThreadMessageHandler;
+
+	/// The handlers registered for a single message ID.
+	struct MessageDispatchEntry
+	{
+		MessageDispatchEntry():handler(0), batchHandler(0) {}
+
+		IMessageHandler *handler;
+		IMessageBatchHandler *batchHandler;
+	};
+
+	/// The handlers of RegisterMessageHandler() and RegisterMessageBatchHandler(), indexed by the message ID. Only as large
+	/// as the largest ID registered needs. [main thread]
+	std::vector<MessageDispatchEntry> messageDispatchTable;
+
+	/// Returns the dispatch table entry for the given ID, or 0 if none was ever registered.
+	MessageDispatchEntry *DispatchEntry(message_id_t id) { return (id < messageDispatchTable.size()) ? &messageDispatchTable[id] : 0; } // [main thread]
+
+	/// The number of messages Process() takes off the inbound queue at once. Also the largest span passed to an IMessageBatchHandler.
+	static const int cProcessBatchSize = 64;
+
+	/// The number of messages the first segment of outboundAcceptQueue and inboundMessageQueue holds, and the smallest
+	/// number the later segments hold. An idle connection does not need more.
+	static const int cMinQueueSegmentSize = 16;
+
+	/// Passes the messages of the given batch, that Process() has taken off the inbound queue, to their handlers.
+	void DispatchInboundMessages(NetworkMessage **messages, int numMessages); // [main thread]
+
+	/// Closes the connection if its socket has closed, and delivers the transfer progress reports and the multicast messages,
+	/// which Process() handles before the inbound queue.
+	/// @return False if the connection has no inbound messages to deliver, since it is closed or still waits for its socket.
+	bool ProcessConnectionState(); // [main thread]
+
+	/// Passes the messages at the front of the inbound queue to their handlers, while their costs fit in budget, and until
+	/// the deadline passes. A message costs its size, but at least cMinMessageDispatchCost. Subtracts the costs from budget.
+	/// @return True if messages are left in the queue, and there is a handler to pass them to.
+	bool DispatchInboundBudget(size_t &budget, tick_t deadline); // [main thread]
+
+	/// The smallest cost a message is charged by DispatchInboundBudget(), so that a flood of empty messages is metered too.
+	static const size_t cMinMessageDispatchCost = 64;
+
+	/// The bytes this connection may still dispatch in the current round of NetworkServer::ProcessFor(). [main thread]
+	size_t inboundDeficit;
+
+	/// The group of JoinMulticastGroup(), or 0. [main thread]
+	MulticastChannel *multicastGroup;
+
+	/// The number of multicast datagrams Process() reads at most per call.
+	static const int cMaxMulticastDatagramsPerProcess = 64;
+
+	/// Passes the messages of the datagrams waiting in multicastGroup to their handlers. [main thread]
+	void ProcessMulticastGroup(); // [main thread]
+
 	/// The underlying socket on top of which this connection operates.
 	Socket *socket; // [set by main thread before the worker thread is running. Read-only when worker thread is running. Read by main and worker thread]
 
 	/// Specifies the current connection state.
 	ConnectionState connectionState; // [main and worker thread]
 
+	/// The transport of the socket that a connection started with Network::ConnectAsync() waits for, or
+	/// InvalidTransportLayer. The connection is pending without a socket, and is not yet assigned to a worker thread.
+	SocketTransportLayer awaitedTransport; // [main thread]
+
+	bool AwaitingSocket() const { return awaitedTransport != InvalidTransportLayer; }
+
 	/// If true, all sends to the socket are on hold, until ResumeOutboundSends() is called.
 	bool bOutboundSendsPaused; // [set by main thread, read by worker thread]
 
+	/// The settings of SetSendCoalescing(). [set by main thread, read by worker thread]
+	volatile int sendCoalescingDelay;
+	volatile size_t sendCoalescingBytes;
+	volatile unsigned long sendCoalescingUrgentPriority;
+
+	/// The number of content bytes AcceptOutboundMessages() has moved to outboundQueue since the queue was last empty. [worker thread]
+	size_t acceptedOutboundBytes;
+	/// The highest priority of the messages put to outboundQueue since it was last empty, the resent ones counting as
+	/// the highest possible. Compared against sendCoalescingUrgentPriority. [worker thread]
+	unsigned long queuedOutboundPriority;
+
+	/// The ordering channels of the message IDs, see SetOrderingChannel(). Applied when the messages are queued.
+	std::map<message_id_t, u8> messageOrderingChannels; // [main thread]
+
+	/// Compresses the outbound data and decompresses the inbound CompressedData messages. [worker thread]
+	LZ4Codec compressionCodec;
+
+	/// The settings of SetCompression(). [set by main thread, read by worker thread]
+	volatile bool compressionEnabled;
+	volatile size_t compressionThreshold;
+
+	/// The dictionary set with SetCompressionDictionary(), and the number of times it has been set. The worker thread
+	/// applies a new dictionary to compressionCodec when the count changes.
+	Lockable<std::vector<char> > compressionDictionary; // [main and worker thread]
+	volatile int compressionDictionaryVersion; // [set by main thread, read by worker thread]
+	int appliedCompressionDictionaryVersion; // [worker thread]
+
+	/// If true, the peer has been sent a CompressionOffer of the current dictionary. [worker thread]
+	bool compressionOfferSent;
+
+	/// The codecs the peer has offered to decompress, a mask of CompressionCodec bits, and the DictionaryID() of its
+	/// dictionary. Both are 0 until the peer has sent a CompressionOffer. [worker thread]
+	u8 peerCompressionCodecs;
+	u32 peerCompressionDictionaryID;
+
+	/// The output buffers of CompressMessageData() and of decompressing the inbound data. [worker thread]
+	std::vector<char> compressionBuffer;
+	std::vector<char> decompressionBuffer;
+
+	/// The 1-byte codes of the frequent message IDs, negotiated with the peer. Only the UDP connections set a code range.
+	/// [worker thread]
+	MessageIDDictionary messageIDCodes;
+
+	/// The send rate limits requested by the application with SetMaximumDataSendRate. 0 means no limit.
+	volatile int maxBytesSendRate; // [set by main thread, read by worker thread]
+	volatile int maxDatagramsSendRate; // [set by main thread, read by worker thread]
+
+	/// The number of unreliable messages dropped from the outbound queue since they had expired. [worker thread writes]
+	volatile unsigned long numExpiredMessages;
+
+	/// Frees the given message, which was taken out of the outbound queue since it had expired, and counts it. [worker thread]
+	void FreeExpiredMessage(NetworkMessage *msg);
+
+	/// Enforce the send rate limits. The worker thread picks up the new limits in UpdateSendRateLimits().
+	TokenBucket byteSendRateLimit; // [worker thread]
+	TokenBucket datagramSendRateLimit; // [worker thread]
+
+	/// Reconfigures the send rate token buckets if the application has changed the limits.
+	void UpdateSendRateLimits(); // [worker thread]
+
 	friend class NetworkServer;
 	friend class Network;
+	friend class FragmentedReceiveManager;
 
 	/// Posted when the application has pushed us some messages to handle.
 	Event eventMsgsOutAvailable; // [main and worker thread]
 
+	/// The event of InboundMessagesEvent(). Null until the application asks for it. [main and worker thread]
+	Event eventInboundMessagesAvailable;
+	/// Nonzero once eventInboundMessagesAvailable has been created. [written by the main thread]
+	volatile long inboundMessagesEventEnabled;
+	/// Nonzero while eventInboundMessagesAvailable is set, so that the worker thread sets it only once. [main and worker thread]
+	volatile long inboundMessagesEventSignalled;
+	/// Set when messages have been added to inboundMessageQueue since the worker last called SignalMainThreadWork(). [worker thread]
+	bool inboundMessagesQueued;
+	/// Set when progress reports have been added to transferProgressQueue since the worker last called SignalMainThreadWork(). [worker thread]
+	bool transferProgressQueued;
+	/// Set when the connection has left ConnectionPending since the worker last called SignalMainThreadWork(). [worker thread]
+	bool establishedSignalPending;
+
+	/// The slot of this connection in the ready list of ownerServer, or -1 if this is not a client connection of a server.
+	/// [set by the main thread before the worker thread is running]
+	int serverReadySlot;
+	/// Nonzero while this connection waits in the ready list of ownerServer, so that it is added only once. [main and worker thread]
+	volatile long inServerReadyList;
+	/// The key of this connection in the client list of ownerServer. Kept here since the socket may be gone by the time
+	/// the server removes the connection. [main thread]
+	EndPoint serverEndPoint;
+	/// Set once ownerServer has queued this connection to be removed as closed. [main thread]
+	bool queuedForReclamation;
+
+	/// Tells the main thread that Process() has work to do: sets eventInboundMessagesAvailable if new messages were queued
+	/// or if the connection has closed, and adds the connection to the ready list of its server. Called by the worker thread
+	/// once per connection update, so that the memory barrier and the system call are not paid for each message.
+	void SignalMainThreadWork(); // [worker thread]
+	/// Adds this connection to the ready list of ownerServer, unless it is there already.
+	void AddToServerReadyList(); // [main and worker thread]
+	/// Returns true if Process() has messages or progress reports left to deliver.
+	bool HasMainThreadWork() const; // [main thread]
+	/// Resets eventInboundMessagesAvailable if inboundMessageQueue is empty.
+	void ResetInboundMessagesEventIfEmpty(); // [main thread]
+
 	float rtt; ///< The currently estimated round-trip time, in milliseconds. [main and worker thread]
 	tick_t lastHeardTime; ///< The tick since last successful receive from the socket. [main and worker thread]
-	float packetsInPerSec; ///< The average number of datagrams we are receiving/second. [main and worker thread]
-	float packetsOutPerSec; ///< The average number of datagrams we are sending/second. [main and worker thread]
-	float msgsInPerSec; ///< The average number of kNet messages we are receiving/second. [main and worker thread]
-	float msgsOutPerSec; ///< The average number of kNet messages we are sending/second. [main and worker thread]
-	float bytesInPerSec; ///< The average number of bytes we are receiving/second. This includes kNet headers. [main and worker thread]
-	float bytesOutPerSec; ///< The average number of bytes we are sending/second. This includes kNet headers. [main and worker thread]
+	/// The time the socket layer received the datagram that is being handled, or 0 if it is not known. [worker thread]
+	tick_t inboundReceiveTick;
+	volatile float idleTimeout; ///< See SetIdleTimeout(). [main and worker thread]
+	volatile bool idle; ///< True while the connection is in the idle mode. [written by worker, read by main and worker thread]
+	tick_t lastActivityTick; ///< The tick of the last application message sent or received. [worker thread]
+	/// The traffic and latency samples of the connection. They take ten kilobytes, but are only touched when a packet is
+	/// sent or received and when the statistics are computed, so they are kept out of line from the fields that the worker
+	/// thread reads on each update of the connection.
+	struct TrafficSamples : public RefCountable
+	{
+#ifdef KNET_NETWORK_PROFILING
+		TrafficSamples():inboundMessageCounters("messageIn"), outboundMessageCounters("messageOut") {}
+#endif
+
+		/// The traffic of the recent intervals, which ComputeStats() computes the rates from. [worker thread]
+		TrafficStatsRing trafficStats;
+		/// The samples of each LatencyMetric. [written by worker, read by main and worker thread]
+		LatencyHistogram latencyHistograms[NumLatencyMetrics];
+#ifdef KNET_NETWORK_PROFILING
+		/// The profiling counters of the bytes of each message ID received and sent. [worker thread]
+		MessageStatsCounters inboundMessageCounters;
+		MessageStatsCounters outboundMessageCounters;
+#endif
+	};
+	/// Owned by this connection. Never null.
+	Ptr(TrafficSamples) samples;
+	/// The latest rates ComputeStats() has computed, published to the main thread. [written by worker, read by main and worker thread]
+	SeqLock<ConnectionTrafficRates> trafficRates;
 	u64 bytesInTotal;
 	u64 bytesOutTotal;
+	u64 packetsInTotal;
+	u64 packetsOutTotal;
 
 	/// Stores the current settigns related to network conditions testing.
 	/// By default, the simulator is disabled.
 	NetworkSimulator networkSendSimulator;
+	NetworkSimulator networkReceiveSimulator;
 
 	/// A running number attached to each outbound message (not present in network stream) to 
-	/// break ties when deducing which message should come before which.
-	unsigned long outboundMessageNumberCounter; // [worker thread]
+	/// break ties when deducing which message should come before which. See NextMessageNumber().
+	volatile long outboundMessageNumberCounter; // [main and worker thread]
 
 	/// A running number that is assigned to each outbound reliable message. This is used to
-	/// enforce proper ordering of ordered messages.
-	unsigned long outboundReliableMessageNumberCounter; // [worker thread]
+	/// enforce proper ordering of ordered messages. See NextReliableMessageNumber().
+	volatile long outboundReliableMessageNumberCounter; // [main and worker thread]
+
+	/// Returns the next outbound message number. [thread-safe]
+	unsigned long NextMessageNumber();
+
+	/// Returns the next outbound reliable message number. [thread-safe]
+	unsigned long NextReliableMessageNumber();
 
 	/// A (messageID, contentID) pair.
 	typedef std::pair<u32, u32> MsgContentIDPair;
@@ -533,14 +1101,36 @@ protected:
 	/// and decimate out-of-order received obsoleted messages.
 	ContentIDReceiveTrack inboundContentIDStamps; // [worker thread]
 
-	typedef std::map<MsgContentIDPair, NetworkMessage*> ContentIDSendTrack;
+	/// The latest versions received of each delta-encoded (messageID, contentID) pair, the baselines that the peer
+	/// encodes the later versions against.
+	std::map<MsgContentIDPair, DeltaBaselineHistory> inboundDeltaBaselines; // [worker thread]
+	/// The message reconstructed from a DeltaState message.
+	std::vector<char> deltaStateDecodeBuffer; // [worker thread]
 
-	ContentIDSendTrack outboundContentIDMessages; // [worker thread]
+	/// Reconstructs the message carried by a DeltaState message against its baseline, and handles it as if it had been
+	/// received as such. Discards the message if its baseline is no longer kept.
+	void HandleDeltaStateMessage(packet_id_t packetID, const char *data, size_t numBytes); // [worker thread]
 
-	void CheckAndSaveOutboundMessageWithContentID(NetworkMessage *msg); // [worker thread]
+	/// The newest outbound message of each (messageID, contentID) pair, either queued or in flight.
+	ContentIDHashTable<NetworkMessage> outboundContentIDMessages; // [worker thread]
+
+	/// Called for each message the worker thread accepts from the main thread, before the message is queued. If the
+	/// previous message with the same (messageID, contentID) still waits in the outbound queue, and goes out the same way,
+	/// the contents of msg replace the contents of that message in place, and msg is freed. Otherwise, the previous message
+	/// is marked obsolete and msg becomes the newest one.
+	/// @return True if msg was merged into the queued message and freed, false if msg should be queued.
+	bool CheckAndSaveOutboundMessageWithContentID(NetworkMessage *msg); // [worker thread]
 
 	void ClearOutboundMessageWithContentID(NetworkMessage *msg); // [worker thread]
 
+	/// Aborts the fragmented transfer of an older message with the given (messageID, contentID), if one is still in progress.
+	/// If newTransfer is not null, it becomes the transfer that the next message with the same content ID aborts.
+	void AbortOutboundTransferWithContentID(u32 messageID, u32 contentID, FragmentedSendManager::FragmentedTransfer *newTransfer); // [worker thread]
+
+	/// Tells the peer to discard the fragments it has received of the given aborted transfer. Only the UDP transport
+	/// fragments messages, so the base class does nothing.
+	virtual void SendFragmentedTransferAbortMessage(const FragmentedSendManager::FragmentedTransfer & /*transfer*/) {} // [worker thread]
+
 	/// Checks whether the given (messageID, contentID)-pair is already out-of-date and obsoleted
 	/// by a newer packet and should not be processed.
 	/// @return True if the packet should be processed (there was no superceding record), and
@@ -549,13 +1139,58 @@ protected:
 
 	void SplitAndQueueMessage(NetworkMessage *message, bool internalQueue, size_t maxFragmentSize); // [main and worker thread]
 
+	/// Finishes an outbound message for EndAndQueueMessage() and AddMessageToBatch(): numbers it, or splits it to fragments,
+	/// or discards it if the connection can't send.
+	/// @return True if the message is ready to be queued. False if the message was discarded or queued as fragments.
+	bool PrepareOutboundMessage(NetworkMessage *msg, size_t numBytes, bool internalQueue); // [main and worker thread]
+
+	/// Queues a message of a broadcast that the worker thread of this connection fans out to its clients. The message is
+	/// handled like one accepted from the main thread, with its ordering channel and content ID, but goes to the outbound
+	/// queue directly. [worker thread]
+	void QueueBroadcastMessage(NetworkMessage *msg);
+
+	/// Cuts the next fragments of the given transfer from its source message and queues them, until the fragments of the
+	/// transfer that are queued or in flight hold maxBytesOutstanding bytes, or the whole message has been cut.
+	void QueueNextFragments(FragmentedSendManager::FragmentedTransfer *transfer, size_t maxBytesOutstanding, bool internalQueue); // [main and worker thread]
+
+	/// Adds the given amount of acked bytes to the transfer, and reports the progress to the main thread whenever it has
+	/// advanced enough. Call with fragmentedSends locked.
+	void ReportOutboundTransferProgress(FragmentedSendManager::FragmentedTransfer &transfer, size_t numBytesAcked); // [worker thread]
+
 	static const unsigned long MsgIdPingRequest = 1;
 	static const unsigned long MsgIdPingReply = 2;
 	static const unsigned long MsgIdFlowControlRequest = 3;
 	static const unsigned long MsgIdPacketAck = 4;
+	/// The reserved message ID that all the other protocol messages are sent under. On the wire, the ID is followed by
+	/// a u8 extension code that tells which message it is.
+	static const unsigned long MsgIdExtension = 5;
 	static const unsigned long MsgIdDisconnect = 0x3FFFFFFF;
 	static const unsigned long MsgIdDisconnectAck = 0x3FFFFFFE;
 
+	/// The extension messages are identified in the code by cFirstExtensionMsgId + their extension code. These IDs are
+	/// above the range of VLE8_16_32, so they can't be mixed up with the message IDs of the application.
+	static const unsigned long cFirstExtensionMsgId = 0x40000000;
+	static const unsigned long MsgIdPathMTU = cFirstExtensionMsgId + 1;
+	static const unsigned long MsgIdPacketAckRanges = cFirstExtensionMsgId + 2;
+	static const unsigned long MsgIdFECParity = cFirstExtensionMsgId + 3;
+	static const unsigned long MsgIdFragmentedTransferAbort = cFirstExtensionMsgId + 4;
+	static const unsigned long MsgIdCompressionOffer = cFirstExtensionMsgId + 5;
+	static const unsigned long MsgIdCompressedData = cFirstExtensionMsgId + 6;
+	static const unsigned long MsgIdDeltaState = cFirstExtensionMsgId + 7;
+	static const unsigned long MsgIdConnectionID = cFirstExtensionMsgId + 8;
+	static const unsigned long MsgIdAggregate = cFirstExtensionMsgId + 9;
+	static const unsigned long MsgIdMessageIDCode = cFirstExtensionMsgId + 10;
+
+	/// Returns the number of bytes the given message ID takes on the wire.
+	static size_t EncodedMessageIDSize(message_id_t id);
+
+	/// Writes the given message ID, with the extension code of an extension message.
+	static void AddMessageID(DataSerializer &writer, message_id_t id);
+
+	/// Reads a message ID written by AddMessageID().
+	/// @return The message ID, or DataDeserializer::VLEReadError if the data was malformed.
+	static message_id_t ReadMessageID(DataDeserializer &reader);
+
 	/// Private ctor - MessageConnections are instantiated by Network and NetworkServer classes.
 	explicit MessageConnection(Network *owner, NetworkServer *ownerServer, Socket *socket, ConnectionState startingState);
 
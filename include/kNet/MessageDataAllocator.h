@@ -0,0 +1,74 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MessageDataAllocator.h
+	@brief The MessageDataAllocator class. Allocates the data buffers of NetworkMessage structures from size-class slabs. */
+
+#include <cstddef>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+/// A snapshot of the counters of MessageDataAllocator.
+struct MessageDataStatistics
+{
+	/// The number of slabs reserved from the runtime heap, and their total size in bytes.
+	u64 numSlabs;
+	u64 slabBytes;
+	/// The number of slab blocks currently in use, and their total size in bytes.
+	u64 blocksInUse;
+	u64 blockBytesInUse;
+	/// The number of buffers currently allocated directly from the runtime heap because they are too large for the slabs,
+	/// and their total size in bytes.
+	u64 largeBuffersInUse;
+	u64 largeBytesInUse;
+	/// The total number of slab blocks and large buffers allocated so far.
+	u64 numBlockAllocations;
+	u64 numLargeAllocations;
+};
+
+/// @internal Allocates the data buffers of NetworkMessage structures.
+/** Buffers of up to cMaxBlockSize bytes are rounded up to a power-of-two size class, starting at cMinBlockSize, and carved
+	out of cSlabSize byte slabs. Freed blocks are kept in a lock-free list of their size class for reuse, and the slabs are
+	only returned to the runtime heap at process exit, so a long-running process does not fragment the heap with message
+	buffers of varying sizes. Larger buffers are allocated directly from the runtime heap.
+	The allocator is process-wide, since NetworkMessagePool shares the messages and their buffers between all Network objects. */
+class MessageDataAllocator
+{
+public:
+	/// Returns a buffer of at least numBytes bytes, and stores its actual size to capacity. [thread-safe]
+	/// The returned buffer must be freed with Free(), passing in the same capacity.
+	static char *Allocate(size_t numBytes, size_t &capacity);
+
+	/// Frees a buffer returned by Allocate(). Passing in a null buffer does nothing. [thread-safe]
+	static void Free(char *data, size_t capacity);
+
+	/// Returns the current values of the allocation counters. [thread-safe]
+	static MessageDataStatistics Statistics();
+
+	/// The size of the smallest size class.
+	static const size_t cMinBlockSize = 64;
+	/// The size of the largest size class. This covers the fragments of the messages split for UDP, and the common
+	/// message sizes. Larger buffers are allocated from the runtime heap.
+	static const size_t cMaxBlockSize = 4096;
+	/// The number of size classes between cMinBlockSize and cMaxBlockSize.
+	static const int cNumSizeClasses = 7;
+	/// The number of bytes reserved at a time for the blocks of a size class.
+	static const size_t cSlabSize = 64 * 1024;
+};
+
+} // ~kNet
@@ -0,0 +1,112 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MessageFrameArena.h
+	@brief The MessageFrameArena class, which allocates the messages built during a frame from pages recycled in bulk. */
+
+#include <vector>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+class NetworkMessage;
+
+/// @internal A page of NetworkMessage structures of a MessageFrameArena.
+struct MessageFramePage
+{
+	/// The number of messages of the page that have not been freed yet, plus one while the arena owns the page. The slots
+	/// of the page that is being allocated from are counted in advance, so allocating a message does not touch this.
+	volatile long numRefs;
+
+	/// The number of slots handed out since the page was last recycled.
+	int numUsed;
+
+	/// The storage of the messages.
+	NetworkMessage *slots;
+};
+
+/// Allocates the messages built during a frame by bumping a pointer through pages of message structures.
+/** An application thread that builds many messages each tick calls BeginFrame(), passes the arena to
+	MessageConnection::StartNewMessage() for each message, and calls EndFrame() when done. The messages are sent and freed
+	as usual. Each page counts its messages that are still alive, so the worker threads do a single atomic decrement when
+	they free a message, and once all the messages of a page have been serialized, or acked if reliable, BeginFrame()
+	recycles the whole page at once. A page that still has messages in flight, for example ones waiting to be resent, is
+	left alone until they are gone.
+
+	The payloads of up to NetworkMessage::cInlineCapacity bytes are stored inline in the message, so small messages do not
+	allocate at all. Larger ones get their data buffer from MessageDataAllocator as usual.
+
+	[Not thread-safe, owned by the thread that builds the messages. The messages may be freed on any thread.] */
+class MessageFrameArena
+{
+public:
+	/// The default number of messages in a page.
+	static const int cDefaultPageSize = 256;
+
+	/// @param pageSize The number of messages in each page.
+	explicit MessageFrameArena(int pageSize = cDefaultPageSize);
+
+	/// Frees the pages that have no messages alive. The rest are freed when their last message is.
+	~MessageFrameArena();
+
+	/// Starts allocating messages from the arena, and recycles the pages whose messages have all been freed.
+	void BeginFrame();
+
+	/// Stops allocating messages from the arena. The messages allocated so far stay valid until they are freed.
+	void EndFrame();
+
+	/// Returns true between BeginFrame() and EndFrame().
+	bool InFrame() const { return inFrame; }
+
+	/// Returns a new message with all fields at their default values, or 0 if not in a frame.
+	NetworkMessage *New();
+
+	/// Destroys the given message, which was allocated from an arena, and releases its slot. [thread-safe]
+	static void Free(NetworkMessage *msg);
+
+	/// Returns the number of pages the arena owns.
+	int NumPages() const { return (int)pages.size(); }
+
+	/// Returns the number of pages ready to be allocated from, as of the last BeginFrame().
+	int NumFreePages() const { return (int)freePages.size(); }
+
+	/// Returns the number of messages in each page.
+	int PageSize() const { return pageSize; }
+
+private:
+	int pageSize;
+	bool inFrame;
+
+	std::vector<MessageFramePage*> pages;
+	std::vector<MessageFramePage*> freePages;
+
+	/// The page messages are allocated from, or 0 if none has been taken in this frame yet.
+	MessageFramePage *current;
+
+	/// Takes a page to allocate from, recycling a free page if there is one.
+	MessageFramePage *TakePage();
+
+	/// Stops allocating from the current page, and releases the references counted in advance for its unused slots.
+	void RetireCurrentPage();
+
+	static void DeletePage(MessageFramePage *page);
+
+	MessageFrameArena(const MessageFrameArena &); ///< @note Not implemented.
+	void operator =(const MessageFrameArena &); ///< @note Not implemented.
+};
+
+} // ~kNet
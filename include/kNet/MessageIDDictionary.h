@@ -0,0 +1,127 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MessageIDDictionary.h
+	@brief The MessageIDDictionary class, which sends the most frequent long message IDs of a connection as 1-byte codes. */
+
+#include <vector>
+#include <cstddef>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+class DataSerializer;
+class DataDeserializer;
+
+/// Maps the message IDs a connection sends most often to 1-byte codes, and the codes the peer sends back to message IDs.
+/** A message ID of 128 or more takes 2 or 4 bytes in each message sent. The application reserves a range of 1-byte message
+	IDs it does not use itself as codes, see Network::SetMessageIDCodes(). The sender counts the long message IDs it sends,
+	and once an ID has been sent cHotThreshold times, it offers the peer the next free code for it. The peer accepts the
+	offer if the code is in its own range and still free, and from then on decodes the code back to the ID. The sender
+	uses the code only once the peer has accepted it, so no message is ever decoded with a mapping the peer doesn't have.
+	A code is never reassigned during the connection, so the datagrams that are still in flight decode the same way.
+
+	The frequencies are counted in a small direct-mapped table, so an ID that collides with an even more frequent one may
+	not get a code. [Not thread-safe, used by the worker thread of the connection] */
+class MessageIDDictionary
+{
+public:
+	/// The number of times a message ID is sent before it is offered a code.
+	static const u32 cHotThreshold = 32;
+
+	/// The number of slots in the frequency table. A power of two.
+	static const int cNumCounters = 256;
+
+	/// The smallest message ID that can be used as a code. The IDs below it are reserved for the protocol.
+	static const message_id_t cMinCode = 15;
+
+	MessageIDDictionary();
+
+	/// Sets the 1-byte message IDs [firstCode, firstCode + numCodes) that are used as codes, and forgets all the mappings.
+	/// The range is clamped to [cMinCode, 127]. Pass in numCodes 0 to disable the dictionary.
+	void SetCodeRange(message_id_t firstCode, int numCodes);
+
+	/// Returns true if a code range has been set.
+	bool Enabled() const { return numCodes > 0; }
+
+	/// Counts a message of the given ID sent to the peer.
+	/// @param code [out] The code to offer the peer for the ID, if this returns true.
+	/// @return True if the ID has just become frequent enough to get a code. Offer the code to the peer then.
+	bool CountSent(message_id_t id, message_id_t &code);
+
+	/// Returns the code to send in place of the given message ID, or the ID itself if the peer has not accepted a code for it.
+	message_id_t Encode(message_id_t id) const
+	{
+		const Counter &c = counters[Slot(id)];
+		return (c.id == id && c.state == CodeAccepted) ? c.code : id;
+	}
+
+	/// Marks the code the peer has accepted for the given ID usable.
+	/// @return False if no such offer was made.
+	bool Accepted(message_id_t code, message_id_t id);
+
+	/// Records the code the peer has offered for the given ID.
+	/// @return True if the offer was accepted: the code is in the code range, and free or already mapped to the same ID.
+	bool Offered(message_id_t code, message_id_t id);
+
+	/// Returns the message ID of the given code, or the given ID itself if it is not a code accepted from the peer.
+	message_id_t Decode(message_id_t wireId) const
+	{
+		const u32 index = wireId - firstCode;
+		return (index < inboundIDs.size() && inboundIDs[index] != 0) ? inboundIDs[index] : wireId;
+	}
+
+	/// Returns the number of bytes SerializeTo() writes.
+	size_t SerializedSize() const { return 3 * 4 + cNumCounters * 13 + 4 + inboundIDs.size() * 4; }
+
+	/// Writes the code range, the counters and the mappings in both directions, for a connection that is handed over to
+	/// another process. See Network::HandOffServer().
+	void SerializeTo(DataSerializer &dst) const;
+
+	/// Restores the state written by SerializeTo().
+	void DeserializeFrom(DataDeserializer &src);
+
+private:
+	enum CodeState
+	{
+		CodeNone, ///< The ID is being counted.
+		CodeOffered, ///< The code has been offered to the peer, and is not used until the peer accepts it.
+		CodeAccepted ///< The code is sent in place of the ID.
+	};
+
+	struct Counter
+	{
+		message_id_t id;
+		u32 count;
+		message_id_t code;
+		CodeState state;
+	};
+
+	Counter counters[cNumCounters];
+
+	message_id_t firstCode;
+	int numCodes;
+	/// The number of codes offered to the peer so far. The next offer gets firstCode + numCodesOffered.
+	int numCodesOffered;
+
+	/// The message IDs of the codes the peer has offered, indexed by code - firstCode. 0 if the code is free.
+	std::vector<message_id_t> inboundIDs;
+
+	static int Slot(message_id_t id) { return (int)((id * 2654435761u) >> 24) & (cNumCounters - 1); }
+};
+
+} // ~kNet
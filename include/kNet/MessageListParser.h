@@ -77,6 +77,22 @@ public:
 	/// Loads a set of message templates from a protocol .xml file.
 	void LoadMessagesFromFile(const char *filename);
 
+	/// Writes all the structs and message templates of this list to the given buffer in the compact binary schema format,
+	/// which LoadBinary() reads back. The binary form loads much faster than the XML, and does not need TinyXML.
+	void SaveBinary(std::vector<char> &dst) const;
+
+	/// Loads a set of message templates from a buffer in the binary schema format, for example one that has been linked
+	/// into the executable or mapped to memory. The buffer is not referenced after the call returns.
+	/// Throws a NetException if the buffer is not a valid binary schema.
+	void LoadBinary(const char *data, size_t numBytes);
+
+	/// Writes the binary schema of this list to the given file. Returns false if the file could not be written.
+	bool SaveBinaryToFile(const char *filename) const;
+
+	/// Loads a set of message templates from a file in the binary schema format.
+	/// Throws a NetException if the file does not contain a valid binary schema.
+	void LoadBinaryFromFile(const char *filename);
+
 	/// Returns a message template associated with the given id, or 0 if no such message exists.
 	const SerializedMessageDesc *FindMessageByID(u32 id);
 	/// Returns a message template associated with the given name, or 0 if no such message exists.
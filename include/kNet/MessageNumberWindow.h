@@ -0,0 +1,120 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MessageNumberWindow.h
+	@brief The MessageNumberWindow class, which tracks the reliable message numbers a connection has received. */
+
+#include <cstring>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+/// The set of the reliable message numbers received, as a low watermark and a bitmap of the numbers after it.
+/** All the numbers before the low watermark have been received. The window holds a bit for each of the cWindowSize
+	numbers from the low watermark on, at the index (number % cWindowSize). When the number at the low watermark is
+	received, the watermark moves past all the consecutive numbers received after it, and their bits are cleared for
+	the numbers that enter the window. This way the memory used stays constant, and each check is O(1) amortized.
+
+	A number that is cWindowSize or more ahead of the low watermark cannot be recorded until the numbers before it
+	have been received. The message numbers are 32-bit and wrap around. This class is not thread-safe. */
+class MessageNumberWindow
+{
+public:
+	/// The number of message numbers the window covers from the low watermark on. A power of two.
+	static const u32 cWindowSize = 65536;
+
+	enum InsertResult
+	{
+		NewNumber, ///< The number had not been received before, and is now marked received.
+		DuplicateNumber, ///< The number had been received already.
+		NumberAheadOfWindow ///< The number is too far ahead of the low watermark to be recorded, and was not marked received.
+	};
+
+	MessageNumberWindow()
+	{
+		Clear();
+	}
+
+	/// Forgets all the numbers received, and starts from the given number.
+	void Clear(u32 firstNumber = 0)
+	{
+		memset(bits, 0, sizeof(bits));
+		lowWatermark = firstNumber;
+	}
+
+	/// Marks the given number received.
+	InsertResult Insert(u32 number)
+	{
+		const u32 offset = number - lowWatermark;
+		if ((s32)offset < 0)
+			return DuplicateNumber;
+		if (offset >= cWindowSize)
+			return NumberAheadOfWindow;
+		if (TestBit(number))
+			return DuplicateNumber;
+
+		if (offset != 0)
+		{
+			bits[Word(number)] |= Bit(number);
+			return NewNumber;
+		}
+
+		// Move the watermark past the consecutive numbers received after this one, a word at a time when it can.
+		++lowWatermark;
+		for(;;)
+		{
+			u64 &word = bits[Word(lowWatermark)];
+			if ((lowWatermark & 63) == 0 && word == ~(u64)0)
+			{
+				word = 0;
+				lowWatermark += 64;
+			}
+			else if ((word & Bit(lowWatermark)) != 0)
+			{
+				word &= ~Bit(lowWatermark);
+				++lowWatermark;
+			}
+			else
+				break;
+		}
+		return NewNumber;
+	}
+
+	/// Returns true if the given number has been received.
+	bool Contains(u32 number) const
+	{
+		const u32 offset = number - lowWatermark;
+		if ((s32)offset < 0)
+			return true;
+		return offset < cWindowSize && TestBit(number);
+	}
+
+	/// Returns the number before which all the numbers have been received.
+	u32 LowWatermark() const { return lowWatermark; }
+
+private:
+	static const u32 cNumWords = cWindowSize / 64;
+
+	u64 bits[cNumWords];
+	u32 lowWatermark;
+
+	static u32 Word(u32 number) { return (number & (cWindowSize - 1)) / 64; }
+	static u64 Bit(u32 number) { return (u64)1 << (number & 63); }
+	bool TestBit(u32 number) const { return (bits[Word(number)] & Bit(number)) != 0; }
+};
+
+} // ~kNet
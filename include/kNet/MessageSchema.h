@@ -0,0 +1,263 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MessageSchema.h
+	@brief Compile-time message schemas, and the SchemaSerializer and SchemaDeserializer classes, which check the order and
+	       the types of the serialized fields against a schema when the code is compiled. */
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "Types.h"
+#include "BasicSerializedDataTypes.h"
+#include "MessageListParser.h"
+#include "DataSerializer.h"
+#include "DataDeserializer.h"
+
+namespace kNet
+{
+
+/** A schema is a type list of the fields of a message, in the order they are serialized, for example
+
+		typedef SchemaField<u32, SchemaField<SchemaArray<float, 3>, SchemaField<std::string> > > EntitySchema;
+
+	A field is either a basic type (u8, s8, u16, s16, u32, s32, u64, s64, float, double), a std::string, a SchemaArray of a
+	basic type or a SchemaVaryingArray of a basic type. The message compiler emits the schema of each message it can as a
+	Schema typedef inside the generated struct.
+
+	Unlike a DataSerializer or a DataDeserializer that is given a SerializedMessageDesc template, which walks the element
+	tree at runtime for each field, SchemaSerializer and SchemaDeserializer do all of their checking when the code is
+	compiled. Adding a field of the wrong type or in the wrong order is a compile error, and the generated code is the same
+	as calling the template-less DataSerializer or DataDeserializer directly. */
+
+/// Marks the end of a schema.
+struct SchemaEnd {};
+
+/// A node of a schema type list: the field Head, followed by the fields of Tail.
+template<typename Head, typename Tail = SchemaEnd>
+struct SchemaField
+{
+	typedef Head head;
+	typedef Tail tail;
+};
+
+/// A schema field that is an array of exactly count elements of type T.
+template<typename T, u32 count>
+struct SchemaArray {};
+
+/// A schema field that is an array of elements of type T, preceded by the number of elements stored as a CountType.
+template<typename T, typename CountType>
+struct SchemaVaryingArray {};
+
+/// Only defined when the two types are the same, so that SchemaFieldTypeMatches<Expected, Actual>::Check() fails to compile
+/// (with both types named in the error) when a field is serialized as a different type than the schema specifies.
+template<typename Expected, typename Actual>
+struct SchemaFieldTypeMatches;
+
+template<typename T>
+struct SchemaFieldTypeMatches<T, T> { static void Check() {} };
+
+/// Tells whether a schema field matches an element of a SerializedMessageDesc. Specialized for the array and string fields.
+template<typename Field>
+struct SchemaFieldTraits
+{
+	static bool Matches(const SerializedElementDesc &e)
+	{
+		return e.type == SerializedDataTypeTraits<Field>::type && !e.varyingCount && e.count == 1;
+	}
+};
+
+template<>
+struct SchemaFieldTraits<std::string>
+{
+	static bool Matches(const SerializedElementDesc &e)
+	{
+		return e.type == SerialString && !e.varyingCount && e.count == 1;
+	}
+};
+
+template<typename T, u32 count>
+struct SchemaFieldTraits<SchemaArray<T, count> >
+{
+	static bool Matches(const SerializedElementDesc &e)
+	{
+		return e.type == SerializedDataTypeTraits<T>::type && !e.varyingCount && e.count == (int)count;
+	}
+};
+
+template<typename T, typename CountType>
+struct SchemaFieldTraits<SchemaVaryingArray<T, CountType> >
+{
+	static bool Matches(const SerializedElementDesc &e)
+	{
+		return e.type == SerializedDataTypeTraits<T>::type && e.varyingCount && e.count == (int)sizeof(CountType) * 8;
+	}
+};
+
+/// Checks at runtime that a schema describes the same fields as the elements of the given struct, for example to catch
+/// a hand-written schema that has gone out of sync with the message XML. Meant to be called once, e.g. in an assert.
+template<typename Fields>
+struct SchemaMatcher
+{
+	static bool Matches(const SerializedElementDesc &elem, size_t index = 0)
+	{
+		return index < elem.elements.size() && SchemaFieldTraits<typename Fields::head>::Matches(*elem.elements[index])
+			&& SchemaMatcher<typename Fields::tail>::Matches(elem, index + 1);
+	}
+};
+
+template<>
+struct SchemaMatcher<SchemaEnd>
+{
+	static bool Matches(const SerializedElementDesc &elem, size_t index = 0) { return index == elem.elements.size(); }
+};
+
+/// Returns true if the given schema describes the fields of the given message.
+template<typename Fields>
+bool SchemaMatchesMessage(const SerializedMessageDesc &message)
+{
+	return message.data != 0 && SchemaMatcher<Fields>::Matches(*message.data);
+}
+
+/// Writes the fields of the schema Fields to a DataSerializer. Each call serializes the next field and returns a
+/// SchemaSerializer for the rest of the fields, so the calls are chained:
+///		SchemaSerializer<EntitySchema>(ds).Add(entityId).AddArray(pos).AddString(name).End();
+/// Only the SchemaSerializer of an empty schema has End(), so calling it checks that no fields were left out.
+/// The DataSerializer must not have a SerializedMessageDesc template.
+template<typename Fields>
+class SchemaSerializer
+{
+public:
+	typedef typename Fields::head Field;
+	typedef SchemaSerializer<typename Fields::tail> Next;
+
+	explicit SchemaSerializer(DataSerializer &dst_):dst(dst_) {}
+
+	/// Serializes a field of a basic type.
+	template<typename T>
+	Next Add(const T &value) const
+	{
+		SchemaFieldTypeMatches<Field, T>::Check();
+		dst.Add<T>(value);
+		return Next(dst);
+	}
+
+	/// Serializes a std::string field.
+	Next AddString(const std::string &str) const
+	{
+		SchemaFieldTypeMatches<Field, std::string>::Check();
+		dst.AddString(str);
+		return Next(dst);
+	}
+
+	/// Serializes a SchemaArray field from an array of the same size.
+	template<typename T, size_t count>
+	Next AddArray(const T (&data)[count]) const
+	{
+		SchemaFieldTypeMatches<Field, SchemaArray<T, count> >::Check();
+		dst.AddArray<T>(data, (u32)count);
+		return Next(dst);
+	}
+
+	/// Serializes a SchemaVaryingArray field of the given amount of elements.
+	template<typename CountType, typename T>
+	Next AddVaryingArray(const T *data, u32 count) const
+	{
+		SchemaFieldTypeMatches<Field, SchemaVaryingArray<T, CountType> >::Check();
+		assert(count == (CountType)count);
+		dst.Add<CountType>((CountType)count);
+		dst.AddArray<T>(data, count);
+		return Next(dst);
+	}
+
+private:
+	DataSerializer &dst;
+};
+
+template<>
+class SchemaSerializer<SchemaEnd>
+{
+public:
+	explicit SchemaSerializer(DataSerializer &) {}
+
+	/// Marks that all the fields of the schema have been serialized.
+	void End() const {}
+};
+
+/// Reads the fields of the schema Fields from a DataDeserializer, in the same chained manner as SchemaSerializer writes them:
+///		SchemaDeserializer<EntitySchema>(dd).Read(entityId).ReadArray(pos).ReadString(name).End();
+/// Throws a NetException if the data runs out, like DataDeserializer does.
+template<typename Fields>
+class SchemaDeserializer
+{
+public:
+	typedef typename Fields::head Field;
+	typedef SchemaDeserializer<typename Fields::tail> Next;
+
+	explicit SchemaDeserializer(DataDeserializer &src_):src(src_) {}
+
+	/// Reads a field of a basic type.
+	template<typename T>
+	Next Read(T &dst) const
+	{
+		SchemaFieldTypeMatches<Field, T>::Check();
+		dst = src.Read<T>();
+		return Next(src);
+	}
+
+	/// Reads a std::string field.
+	Next ReadString(std::string &dst) const
+	{
+		SchemaFieldTypeMatches<Field, std::string>::Check();
+		dst = src.ReadString();
+		return Next(src);
+	}
+
+	/// Reads a SchemaArray field to an array of the same size.
+	template<typename T, size_t count>
+	Next ReadArray(T (&dst)[count]) const
+	{
+		SchemaFieldTypeMatches<Field, SchemaArray<T, count> >::Check();
+		src.ReadArray<T>(dst, count);
+		return Next(src);
+	}
+
+	/// Reads a SchemaVaryingArray field, and resizes the vector to the number of elements that were stored.
+	template<typename CountType, typename T>
+	Next ReadVaryingArray(std::vector<T> &dst) const
+	{
+		SchemaFieldTypeMatches<Field, SchemaVaryingArray<T, CountType> >::Check();
+		dst.resize(src.Read<CountType>());
+		if (!dst.empty())
+			src.ReadArray<T>(&dst[0], dst.size());
+		return Next(src);
+	}
+
+private:
+	DataDeserializer &src;
+};
+
+template<>
+class SchemaDeserializer<SchemaEnd>
+{
+public:
+	explicit SchemaDeserializer(DataDeserializer &) {}
+
+	/// Marks that all the fields of the schema have been read.
+	void End() const {}
+};
+
+} // ~kNet
@@ -0,0 +1,104 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MessageTracer.h
+	@brief The MessageTracer class, which timestamps the stages a sample of the messages go through into per-thread rings. */
+
+#include <string>
+#include <vector>
+
+#include "Types.h"
+#include "Clock.h"
+
+namespace kNet
+{
+
+/// The points in the life of a message that MessageTracer timestamps, in the order a message passes them.
+enum MessageTraceStage
+{
+	TraceStarted,    ///< MessageConnection::StartNewMessage() allocated the outbound message.
+	TraceQueued,     ///< EndAndQueueMessage() put the message to the queue from the main thread.
+	TraceAccepted,   ///< The worker thread moved the message to the priority queue of the connection.
+	TraceSerialized, ///< The message was written to an outbound datagram or TCP stream block.
+	TraceSent,       ///< The socket accepted the datagram or block that carries the message.
+	TraceAcked,      ///< The peer acknowledged the datagram that carried the message. Reliable UDP messages only.
+	TraceReceived,   ///< The worker thread queued an inbound message for the application.
+	TraceDelivered,  ///< The main thread passed the inbound message to the application.
+	NumMessageTraceStages
+};
+
+/// Returns a human-readable name of the given stage.
+const char *MessageTraceStageToString(MessageTraceStage stage);
+
+/// A single timestamp of a traced message.
+struct MessageTraceEvent
+{
+	tick_t tick;
+	u32 traceID;   ///< Identifies the traced message. The inbound and the outbound messages are traced with separate IDs.
+	u32 messageID;
+	u16 thread;    ///< The index of the recording thread, in the order the threads first recorded an event.
+	u8 stage;      ///< A MessageTraceStage.
+};
+
+/// Traces the lifecycle of every Nth message of the process, to find out where the latency of a connection comes from.
+/** A traced message is given a nonzero trace ID when it is created, and each stage it passes appends a MessageTraceEvent to
+	a fixed-size ring of the calling thread. The ring overwrites its oldest events, and recording takes no locks. A message
+	that is not traced costs a single test of its trace ID at each stage, and tracing is off by default. Each fragment of
+	a fragmented message is sampled as a message of its own. [thread-safe] */
+class MessageTracer
+{
+public:
+	/// The number of events kept for each thread.
+	static const int cRingSize = 8192;
+	/// The maximum number of threads that can record events. The events of any further threads are dropped.
+	static const int cMaxThreads = 64;
+
+	/// Sets tracing to sample every interval'th message the calling thread sees. Pass in 0 to stop tracing new messages.
+	/// The messages already being traced finish their traces.
+	static void SetSamplingInterval(u32 interval);
+	static u32 SamplingInterval() { return samplingInterval; }
+
+	/// Returns a new trace ID if the next message should be traced, or 0 if not.
+	static u32 SampleMessage() { return samplingInterval ? SampleMessageSlow() : 0; }
+
+	/// Records the given stage of the given traced message. Does nothing if the trace ID is 0.
+	static void Record(u32 traceID, u32 messageID, MessageTraceStage stage)
+	{
+		if (traceID)
+			RecordEvent(traceID, messageID, stage);
+	}
+
+	/// Returns the events still in the rings of all threads, recorded after the latest Clear(), sorted by time.
+	static void Collect(std::vector<MessageTraceEvent> &events);
+
+	/// Discards all the recorded events.
+	static void Clear();
+
+	/// Formats the given events as a Chrome trace (chrome://tracing, Perfetto). Each traced message is shown as an async
+	/// slice, with a nested slice for the time spent in each stage before the next one.
+	static std::string ToChromeTrace(const std::vector<MessageTraceEvent> &events);
+
+	/// Writes the events in all the rings to the given file as a Chrome trace.
+	/// @return False if the file could not be written.
+	static bool WriteChromeTrace(const char *filename);
+
+private:
+	static volatile u32 samplingInterval;
+
+	static u32 SampleMessageSlow();
+	static void RecordEvent(u32 traceID, u32 messageID, MessageTraceStage stage);
+};
+
+} // ~kNet
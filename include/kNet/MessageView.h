@@ -0,0 +1,162 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MessageView.h
+	@brief The MessageView and SerializedArrayView<T> classes, which read the fields of a serialized message in place. */
+
+#include <cstddef>
+#include <cstring>
+
+#include "Types.h"
+#include "NetException.h"
+#include "VLEPacker.h"
+#include "DataDeserializer.h"
+
+namespace kNet
+{
+
+/// A read-only view of an array of values of type T that are stored serialized in a byte buffer. The values are decoded
+/// when they are accessed, and nothing is copied or allocated. The buffer must stay alive for the lifetime of the view.
+template<typename T>
+class SerializedArrayView
+{
+public:
+	/// Iterates over the values of the array, decoding each when it is dereferenced.
+	class const_iterator
+	{
+	public:
+		explicit const_iterator(const char *ptr_):ptr(ptr_) {}
+
+		T operator *() const { T value; memcpy(&value, ptr, sizeof(T)); return value; }
+		const_iterator &operator ++() { ptr += sizeof(T); return *this; }
+		const_iterator operator ++(int) { const_iterator old = *this; ptr += sizeof(T); return old; }
+
+		bool operator ==(const const_iterator &rhs) const { return ptr == rhs.ptr; }
+		bool operator !=(const const_iterator &rhs) const { return ptr != rhs.ptr; }
+
+	private:
+		const char *ptr;
+	};
+
+	SerializedArrayView():data(0), count(0) {}
+	SerializedArrayView(const char *data_, size_t count_):data(data_), count(count_) {}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	/// Decodes the value at the given index. UDB if index >= size().
+	T operator [](size_t index) const
+	{
+		assert(index < count);
+		T value;
+		memcpy(&value, data + index * sizeof(T), sizeof(T));
+		return value;
+	}
+
+	const_iterator begin() const { return const_iterator(data); }
+	const_iterator end() const { return const_iterator(data + count * sizeof(T)); }
+
+	/// Returns a pointer to the serialized bytes of the array, e.g. to forward them on as is.
+	const char *Data() const { return data; }
+
+	/// Returns the number of serialized bytes the values take.
+	size_t NumBytes() const { return count * sizeof(T); }
+
+private:
+	const char *data;
+	size_t count;
+};
+
+/// Reads the fields of a serialized message straight from its bytes, at offsets given by the caller. This is the building
+/// block of the view classes SerializationStructCompiler generates, which compute the offset of each field from the ones
+/// before it. Each read checks that the field lies inside the buffer, and throws a NetException if it does not.
+/// The buffer must stay alive for the lifetime of the view.
+class MessageView
+{
+public:
+	MessageView(const char *data_, size_t numBytes_):data(data_), numBytes(numBytes_) {}
+
+	/// Returns a pointer to the serialized message.
+	const char *Data() const { return data; }
+
+	/// Returns the number of bytes in the serialized message.
+	size_t NumBytes() const { return numBytes; }
+
+	/// Throws a NetException if the given range of bytes is not inside the buffer.
+	void CheckRange(size_t offset, size_t size) const
+	{
+		if (offset > numBytes || size > numBytes - offset)
+			throw NetException("MessageView: The message is too short to contain the field that was accessed!");
+	}
+
+	/// Decodes the value of type T at the given offset.
+	template<typename T>
+	T Read(size_t offset) const
+	{
+		CheckRange(offset, sizeof(T));
+		T value;
+		memcpy(&value, data + offset, sizeof(T));
+		return value;
+	}
+
+	/// Returns a view of the array of count values of type T at the given offset.
+	template<typename T>
+	SerializedArrayView<T> ReadArray(size_t offset, size_t count) const
+	{
+		CheckRange(offset, 0);
+		if (count > (numBytes - offset) / sizeof(T))
+			throw NetException("MessageView: The message is too short to contain the array that was accessed!");
+		return SerializedArrayView<T>(data + offset, count);
+	}
+
+	/// Returns a view of the array at the given offset, which is prefixed by its element count of type CountType.
+	template<typename T, typename CountType>
+	SerializedArrayView<T> ReadVaryingArray(size_t offset) const
+	{
+		return ReadArray<T>(offset + sizeof(CountType), Read<CountType>(offset));
+	}
+
+	/// Returns the number of bytes the array at the given offset takes, including its element count of type CountType.
+	template<typename T, typename CountType>
+	size_t VaryingArraySize(size_t offset) const
+	{
+		return sizeof(CountType) + ReadVaryingArray<T, CountType>(offset).NumBytes();
+	}
+
+	/// Returns a view of the characters of the string at the given offset, which is prefixed by its length as a VLE8_16_32,
+	/// like DataSerializer::AddString() writes. Unlike DataDeserializer::ReadString(), the characters are not validated.
+	SerializedArrayView<char> ReadString(size_t offset) const
+	{
+		CheckRange(offset, 0);
+		DataDeserializer lengthReader(data + offset, numBytes - offset);
+		const u32 length = lengthReader.ReadVLE<VLE8_16_32>();
+		if (length == DataDeserializer::VLEReadError)
+			throw NetException("MessageView: The message is too short to contain the string that was accessed!");
+		return ReadArray<char>(offset + lengthReader.BytePos(), length);
+	}
+
+	/// Returns the number of bytes the string at the given offset takes, including its length.
+	size_t StringSize(size_t offset) const
+	{
+		const SerializedArrayView<char> str = ReadString(offset);
+		return (size_t)(str.Data() - (data + offset)) + str.size();
+	}
+
+private:
+	const char *data;
+	size_t numBytes;
+};
+
+} // ~kNet
@@ -0,0 +1,87 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MetricsExporter.h
+	@brief The MetricsExporter class, which publishes the statistics of a Network in the Prometheus text format. */
+
+#include <string>
+
+#include "Socket.h"
+#include "Lockable.h"
+#include "Thread.h"
+
+namespace kNet
+{
+
+class Network;
+
+/// Serves the traffic, RTT, queue and worker thread statistics of a Network over HTTP in the Prometheus text exposition
+/// format, for monitoring headless servers.
+/** The exporter runs a thread of its own that answers the scrapes on a local TCP port. The metrics are formatted on the
+	main thread in Update(), which the application calls on each round of its main loop, next to NetworkServer::Process().
+	Update() does nothing unless a scrape is waiting, so an exporter nobody scrapes costs nothing. The statistics are read
+	from the values the worker threads publish for the main thread, and formatting them never blocks a worker thread.
+	A scrape that arrives while the main thread is busy is answered with the previous snapshot after a short wait. */
+class MetricsExporter
+{
+public:
+	explicit MetricsExporter(Network *owner);
+	~MetricsExporter();
+
+	/// Starts serving the metrics at http://bindAddress:port/metrics. The default bind address only accepts scrapes from
+	/// the local host. [main thread]
+	/// @return False if the port could not be opened.
+	bool Start(unsigned short port, const char *bindAddress = "127.0.0.1");
+
+	/// Stops the exporter thread and closes the port. [main thread]
+	void Stop();
+
+	bool IsRunning() const { return listenSocket != INVALID_SOCKET; }
+
+	/// Refreshes the metrics snapshot if a scrape is waiting for it. [main thread]
+	void Update();
+
+	/// Writes the current metrics to the given file, for example for the textfile collector of the node exporter. The
+	/// file is written under a temporary name first and then renamed, so a reader never sees a half-written file. [main thread]
+	/// @return False if the file could not be written.
+	bool WriteToFile(const char *filename);
+
+	/// Returns the current metrics of the given Network in the Prometheus text format. [main thread]
+	static std::string FormatMetrics(Network &network);
+
+	/// The longest time a scrape waits for the main thread to call Update(), before it is answered with the previous snapshot.
+	static const int cMaxScrapeWaitMSecs = 500;
+
+private:
+	Network *owner;
+
+	SOCKET listenSocket;
+	Thread serveThread;
+
+	/// The latest metrics formatted by Update(). [written by main thread, read by the exporter thread]
+	Lockable<std::string> snapshot;
+	/// Incremented each time Update() refreshes the snapshot. [written by main thread, read by the exporter thread]
+	volatile unsigned long snapshotVersion;
+	/// Set by the exporter thread when a scrape is waiting for a new snapshot. [main and exporter thread]
+	volatile bool scrapeRequested;
+
+	void ServeLoop(); // [exporter thread]
+	void ServeClient(SOCKET client); // [exporter thread]
+
+	MetricsExporter(const MetricsExporter &); ///< Not implemented.
+	void operator =(const MetricsExporter &); ///< Not implemented.
+};
+
+} // ~kNet
@@ -0,0 +1,145 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file MulticastChannel.h
+	@brief The MulticastChannel class, which carries unreliable messages from a server to an IP multicast group. */
+
+#include <vector>
+
+#include "Types.h"
+#include "Socket.h"
+#include "EndPoint.h"
+
+namespace kNet
+{
+
+/// One side of an IPv4 multicast group that carries unreliable messages from a single sender to any number of receivers.
+/** The sender packs the messages queued with QueueMessage() into as few datagrams as they fit in, and sends each datagram
+	once to the group, so the cost of a message does not grow with the number of receivers. The network does the fan-out.
+
+	A datagram starts with cDatagramMagic and a 32-bit sequence number, followed by the messages, each as a VLE8_16_32 message
+	ID, a VLE8_16_32 byte count and the bytes. There are no acks, no resends and no fragmentation, so a message has to fit
+	in a single datagram. A receiver drops the datagrams that arrive after a newer one, since the multicast messages are
+	meant for the streams of state where only the latest copy counts. The datagrams are not encrypted.
+
+	A channel is used only by one thread at a time. */
+class MulticastChannel
+{
+public:
+	/// The first bytes of each multicast datagram.
+	static const char cDatagramMagic[4];
+
+	/// The bytes of the magic and the sequence number that start each datagram.
+	static const size_t cHeaderSize = 8;
+
+	MulticastChannel();
+	~MulticastChannel();
+
+	/// Returns true if the given address is an IPv4 multicast address, 224.0.0.0 to 239.255.255.255.
+	static bool IsMulticastAddress(const EndPoint &address);
+
+	/// Opens a socket that sends to the given group. [sender]
+	/// @param timeToLive The number of routers the datagrams may cross. 1 keeps them on the local network.
+	/// @param maxDatagramSize The largest datagram sent. The messages queued are packed into datagrams of up to this size.
+	/// @return False if the address is not a multicast address or the socket could not be opened.
+	bool OpenSender(const EndPoint &group, int timeToLive, size_t maxDatagramSize);
+
+	/// Opens a socket that joins the given group and receives from the port of the group. The port is opened with
+	/// SO_REUSEADDR, so that several receivers of the same host can join the group. [receiver]
+	/// @param sender The address whose datagrams are accepted. The port is not checked. If the IP is 0.0.0.0, the
+	///        datagrams from any address are accepted.
+	/// @return False if the address is not a multicast address or the group could not be joined.
+	bool Join(const EndPoint &group, const EndPoint &sender);
+
+	/// Closes the socket, which leaves the group. The messages queued and not yet sent are dropped.
+	void Close();
+
+	/// Returns true if the channel has an open socket.
+	bool IsOpen() const { return socket != INVALID_SOCKET; }
+
+	/// Returns true if the channel was opened with OpenSender().
+	bool IsSender() const { return IsOpen() && sender; }
+
+	/// Returns the group this channel sends to or receives from.
+	const EndPoint &Group() const { return group; }
+
+	/// Adds the given message to the datagram being built. If the message does not fit in the datagram, the datagram is
+	/// sent first. [sender]
+	/// @return False if the channel is not open for sending, or the message is too large to fit in a datagram.
+	bool QueueMessage(u32 id, const char *data, size_t numBytes);
+
+	/// Sends the datagram being built, if any messages have been queued since the last datagram. [sender]
+	void Flush();
+
+	/// A message of a datagram received.
+	struct ReceivedMessage
+	{
+		u32 id;
+		const char *data;
+		u32 numBytes;
+	};
+
+	/// Reads the next datagram waiting at the socket. The datagrams from other senders than the accepted one, the malformed
+	/// datagrams, and the ones that arrive after a newer datagram are skipped. [receiver]
+	/// @return False if no more datagrams are waiting.
+	bool ReceiveDatagram();
+
+	/// Returns the messages of the datagram received last. The data is valid until the next call to ReceiveDatagram().
+	const std::vector<ReceivedMessage> &ReceivedMessages() const { return receivedMessages; }
+
+	/// Returns the number of datagrams sent. [sender]
+	u32 NumDatagramsSent() const { return numDatagramsSent; }
+
+	/// Returns the number of datagrams received and passed on. [receiver]
+	u32 NumDatagramsReceived() const { return numDatagramsReceived; }
+
+	/// Returns the number of datagrams that the sequence numbers show were not received, or were received after a newer
+	/// one and dropped. [receiver]
+	u32 NumDatagramsLost() const { return numDatagramsLost; }
+
+private:
+	MulticastChannel(const MulticastChannel &);
+	void operator =(const MulticastChannel &);
+
+	SOCKET socket;
+	bool sender;
+	EndPoint group;
+	/// The address the receiver accepts datagrams from, or 0.0.0.0 for any.
+	EndPoint acceptedSender;
+
+	/// The datagram being built by the sender, or the buffer the receiver reads into.
+	std::vector<char> datagram;
+	/// The bytes of datagram filled by the sender, or 0 if no message has been queued since the last datagram was sent.
+	size_t datagramBytes;
+	size_t maxDatagramSize;
+
+	/// The sequence number of the next datagram sent.
+	u32 nextSequenceNumber;
+	/// The sequence number of the newest datagram received, if receivedAny is set.
+	u32 newestSequenceNumber;
+	bool receivedAny;
+
+	u32 numDatagramsSent;
+	u32 numDatagramsReceived;
+	u32 numDatagramsLost;
+
+	std::vector<ReceivedMessage> receivedMessages;
+
+	/// Parses the messages of the given datagram into receivedMessages.
+	/// @return False if the datagram is malformed or late.
+	bool ParseDatagram(const char *data, size_t numBytes);
+};
+
+} // ~kNet
@@ -27,7 +27,9 @@
 #include "Socket.h"
 #include "NetworkServer.h"
 #include "MessageConnection.h"
-#include "StatsEventHierarchy.h"
+#include "StatsEventRecorder.h"
+#include "DatagramCipher.h"
+#include "HostResolver.h"
 
 namespace kNet
 {
@@ -51,7 +53,14 @@ public:
 	/// @param allowAddressReuse If true, kNet passes the SO_REUSEADDR parameter to the server listen socket before binding 
 	///        the socket to a local port (== before starting the server). This allows the same port to be forcibly reused
 	///        when restarting the server if a crash occurs, without having to wait for the operating system to free up the port.
-	NetworkServer *StartServer(unsigned short port, SocketTransportLayer transport, INetworkServerListener *serverListener, bool allowAddressReuse);
+	/// @param numUDPListenSockets For a UDP server, the number of SO_REUSEPORT sockets to open on the port, each read by
+	///        a different worker thread, so that the operating system spreads the clients over several threads. Pass 0 to
+	///        open one socket for each allowed worker thread (see MaxWorkerThreads()). If the platform does not support
+	///        SO_REUSEPORT, a single socket is used. Ignored for TCP.
+	/// With SocketOverSharedMemory, the server accepts the connections of the processes of this host to the port, which is
+	/// a namespace of its own and does not take up the TCP or UDP port. Anyone on the host can connect to it.
+	NetworkServer *StartServer(unsigned short port, SocketTransportLayer transport, INetworkServerListener *serverListener, bool allowAddressReuse,
+		int numUDPListenSockets = 1);
 
 	/// Starts a network server that listens to multiple local ports.
 	/// This version of the function is given a list of pairs (port, UDP|TCP) values
@@ -59,10 +68,30 @@ public:
 	/// @param allowAddressReuse If true, kNet passes the SO_REUSEADDR parameter to the server listen socket before binding 
 	///        the socket to a local port (== before starting the server). This allows the same port to be forcibly reused
 	///        when restarting the server if a crash occurs, without having to wait for the operating system to free up the port.
-	NetworkServer *StartServer(const std::vector<std::pair<unsigned short, SocketTransportLayer> > &listenPorts, INetworkServerListener *serverListener, bool allowAddressReuse);
+	/// @param numUDPListenSockets The number of sockets to open on each UDP port. See the other overload of StartServer().
+	NetworkServer *StartServer(const std::vector<std::pair<unsigned short, SocketTransportLayer> > &listenPorts, INetworkServerListener *serverListener, bool allowAddressReuse,
+		int numUDPListenSockets = 1);
 
 	void StopServer();
 
+	/** Hands the running server over to a new process of the same application, for a restart without downtime. Waits for
+		the new process to call ResumeServer() with the same path, and passes it the listen sockets of the server and the
+		state of each UDP connection, which resumes from where it was: the clients see a pause in the traffic, but keep
+		their connections, and the messages that were queued or not yet acked are sent by the new process. After a
+		successful handover, the server of this Network is stopped without disconnecting the handed-off clients.
+
+		The UDP connections that are not in ConnectionOK, or have fragmented transfers or delta-encoded messages in
+		progress, and the TCP connections are disconnected instead. Shared memory listen sockets are not handed over. The
+		application should not queue messages while this runs. Not supported on Windows. [main thread]
+		@param path The path of the AF_UNIX socket the two processes meet at.
+		@return True if the new process took over. If it did not, the server keeps running as before. */
+	bool HandOffServer(const char *path, int maxMSecsToWait);
+
+	/** Takes over the server handed off by another process with HandOffServer(). Each resumed connection is passed to
+		INetworkServerListener::ConnectionResumed() of the given listener. [main thread]
+		@return The server, or 0 if no server was handed over in time. */
+	NetworkServer *ResumeServer(const char *path, INetworkServerListener *serverListener, int maxMSecsToWait);
+
 	/// Connects a raw socket (low-level, no MessageConnection abstraction) to the given destination.
 	Socket *ConnectSocket(const char *address, unsigned short port, SocketTransportLayer transport);
 
@@ -74,8 +103,42 @@ public:
 	void CloseConnection(MessageConnection *connection);
 
 	/** Connects to the given address:port using kNet over UDP or TCP. When you are done with the connection,
-		free it by letting the refcount go to 0. */
-	Ptr(MessageConnection) Connect(const char *address, unsigned short port, SocketTransportLayer transport, IMessageHandler *messageHandler, Datagram *connectMessage = 0);
+		free it by letting the refcount go to 0. With SocketOverSharedMemory, connects to a server of this host that is
+		listening to the port with SocketOverSharedMemory, and the address is ignored.
+
+		If earlyData is set on a UDP connection, the connection starts with its outbound sends paused, see
+		MessageConnection::PauseOutboundSends(). The messages that the application sends before calling
+		MessageConnection::ResumeOutboundSends() go out in the connect datagram, so that the server has them as soon as the
+		connection is open (0-RTT), and its reply is the first datagram the client gets. The datagrams after the first wait
+		until the connection leaves ConnectionPending.
+
+		The early data could be replayed to the server by anyone who captures the connect datagram. The server refuses the
+		early data of a replayed connect datagram for as long as the connection cookie in it is valid. If the server does not
+		require the cookies, see NetworkServer::SetConnectionCookiesRequired(), an older replay is not caught, so only send
+		early data whose effects can be repeated safely. A server that requires the cookies asks for one first, which costs
+		a round trip more. */
+	Ptr(MessageConnection) Connect(const char *address, unsigned short port, SocketTransportLayer transport, IMessageHandler *messageHandler,
+		Datagram *connectMessage = 0, bool earlyData = false);
+
+	/** Starts connecting to the given address:port like Connect() does, but returns right away, with a connection in
+		ConnectionPending. The host name is resolved on the threads of HostNameResolver(), and a TCP socket connects
+		without blocking. The connection goes on once ProcessPendingConnects() finds its socket connected, which
+		MessageConnection::Process() and MessageConnection::WaitToEstablishConnection() do, so a connection can be
+		processed as usual from the start. The messages sent before that are queued. If the name does not resolve or the
+		connect fails, the connection moves to ConnectionClosed. With SocketOverSharedMemory, this is the same as Connect().
+		@return The new connection, or null if it could not be started. */
+	Ptr(MessageConnection) ConnectAsync(const char *address, unsigned short port, SocketTransportLayer transport, IMessageHandler *messageHandler,
+		Datagram *connectMessage = 0, bool earlyData = false);
+
+	/// Carries on with the connections started with ConnectAsync() that wait for their host name to resolve or for
+	/// their TCP socket to connect. [main thread]
+	void ProcessPendingConnects();
+
+	/// Returns the number of the connections started with ConnectAsync() that do not have their socket yet.
+	int NumPendingConnects() const { return (int)pendingConnects.size(); }
+
+	/// Returns the resolver and the cache of the host names of ConnectAsync().
+	HostResolver &HostNameResolver() { return hostResolver; }
 
 	/// Returns the local host name of the system (the local machine name or the local IP, whatever is specified by the system).
 	const char *LocalAddress() const { return localHostName.c_str(); }
@@ -92,14 +155,156 @@ public:
 	/// Returns the amount of currently executing background network worker threads.
 	int NumWorkerThreads() const { return (int)workerThreads.size(); }
 
+	/// Returns the currently running background network worker threads. [main thread]
+	const std::vector<NetworkWorkerThread *> &WorkerThreads() const { return workerThreads; }
+
+	/// Sets the maximum number of background network worker threads. New worker threads are started until this many
+	/// are running, and after that new connections and servers are assigned to the least loaded thread. Lowering the
+	/// limit does not stop the threads already running. By default, the limit is the number of hardware threads in the system.
+	void SetMaxWorkerThreads(int maxThreads);
+
+	/// Returns the maximum number of background network worker threads. See SetMaxWorkerThreads().
+	int MaxWorkerThreads() const { return maxWorkerThreads; }
+
+	/// Turns the busy-polling mode on or off in the running worker threads and in the ones started after this call, see
+	/// NetworkWorkerThread::SetBusyPolling(). Each busy-polling thread keeps a core busy while it has traffic, so combine
+	/// this with SetMaxWorkerThreads() to dedicate only some of the cores to the network. Off by default.
+	void SetWorkerBusyPolling(bool enabled, float idleFallbackMSecs = 1000.f);
+
+	/// Returns true if the worker threads run in the busy-polling mode. See SetWorkerBusyPolling().
+	bool WorkerBusyPolling() const { return workerBusyPolling; }
+
+	/// Places the worker threads on the given logical processors, the worker i on cpus[i % cpus.size()], and sets their
+	/// scheduling priority, see NetworkWorkerThread::SetPlacement(). Applies to the running worker threads and the ones
+	/// started after this call. List the cores of the NUMA node that the network card is attached to, so that the workers and
+	/// the memory they allocate stay next to the card, and set alignListenSockets to have each worker read the datagrams that
+	/// the card steers to its core. An empty list lets the workers run on any processor.
+	void SetWorkerThreadPlacement(const std::vector<int> &cpus, ThreadPriority priority = ThreadPriorityNormal, bool alignListenSockets = false);
+
+	/// Sets the largest datagram the UDP sockets opened after this call send, up to cMaxDatagramSize. Raise this to use jumbo
+	/// frames. Each connection starts from a smaller size that every path is assumed to carry, and probes its way up to this
+	/// and to the limit of the peer, see UDPMessageConnection::MaxDatagramSize(). The default is 1400 bytes.
+	void SetMaxDatagramSize(size_t bytes);
+
+	/// Returns the largest datagram the new UDP sockets send. See SetMaxDatagramSize().
+	size_t MaxDatagramSize() const { return maxDatagramSize; }
+
+	/// Sets the memory limit of the connections opened or accepted after this call, see MessageConnection::SetMemoryLimit().
+	/// 0 (the default) sets no limit.
+	void SetConnectionMemoryLimit(size_t bytes) { connectionMemoryLimit = bytes; }
+
+	/// Returns the memory limit of the new connections. See SetConnectionMemoryLimit().
+	size_t ConnectionMemoryLimit() const { return connectionMemoryLimit; }
+
+	/// Returns the budget that the queue storage of all the connections of the process is counted against. Set a limit on
+	/// it to bound the memory of all the connections together. By default, it has no limit. [thread-safe]
+	static MemoryBudget &ConnectionMemoryBudget();
+
+	/// Sets the key of DatagramCipher::cKeySize bytes that the UDP connections opened or accepted after this call encrypt
+	/// and authenticate their datagrams with. Both ends need to use the same key. A server with a key set ignores the
+	/// connection attempts of clients that don't know it. Pass in null to stop encrypting the new connections. By default,
+	/// the connections are not encrypted. [main thread]
+	void SetEncryptionKey(const u8 *key);
+
+	/// Returns true if a key has been set with SetEncryptionKey().
+	bool EncryptionEnabled() const { return encryptionEnabled; }
+
+	/// If enabled, the UDP connections opened after this call append a CRC-32C checksum to each datagram, and ask the
+	/// server to do the same. The datagrams that arrive with a wrong checksum are dropped before they are parsed, and the
+	/// reliable messages in them get resent like those of a lost datagram. A server checksums the connections of the
+	/// clients that ask for it, whatever this setting. Encrypted connections have no checksums, since the authentication
+	/// tag already detects corruption. By default, the datagrams have no checksums. [main thread]
+	void SetDatagramChecksums(bool enabled) { datagramChecksums = enabled; }
+
+	/// Returns true if the new UDP connections checksum their datagrams. See SetDatagramChecksums().
+	bool DatagramChecksums() const { return datagramChecksums; }
+
+	/// If enabled, the TCP listen sockets opened after this call take data in the SYN of a connecting client, and the TCP
+	/// client sockets opened after this call send their first queued messages in the SYN, once the server has given them
+	/// a Fast Open cookie on an earlier connection. This takes the round trip of the TCP handshake off the reconnects of
+	/// returning clients. A client connection is then ConnectionOK before the server has answered, and a server that
+	/// can't be reached shows up as a failed send or receive. Needs Linux, and the net.ipv4.tcp_fastopen sysctl allowing
+	/// the client (1) and the server (2) side. Elsewhere, the sockets use a normal handshake. By default, disabled.
+	/// [main thread]
+	void SetTCPFastOpen(bool enabled) { tcpFastOpen = enabled; }
+
+	/// Returns true if the new TCP sockets use TCP Fast Open. See SetTCPFastOpen().
+	bool TCPFastOpen() const { return tcpFastOpen; }
+
+	/// Lets the UDP client connections opened after this call share up to the given number of local UDP sockets, instead of
+	/// each opening a socket of its own. The datagrams of a shared socket are read once by a worker thread and handed to
+	/// the connection of their source address, so a client with many connections to different servers waits on a few
+	/// sockets only. The servers tell their clients apart by the client address, so a socket only carries one connection
+	/// to each remote endpoint, and a connection to an endpoint that all the shared sockets already talk to gets a socket
+	/// of its own. 0 (the default) gives each connection a socket of its own. [main thread]
+	void SetSharedUDPClientSockets(int maxSockets) { maxSharedUDPClientSockets = maxSockets; }
+
+	/// Returns the maximum number of local UDP sockets shared by the client connections. See SetSharedUDPClientSockets().
+	int SharedUDPClientSockets() const { return maxSharedUDPClientSockets; }
+
+	/// If enabled, the UDP servers started after this call give each client they accept a UDP socket of its own, bound to
+	/// the server port with SO_REUSEPORT and connected to the client. The kernel then delivers the datagrams of each client
+	/// straight to its socket and the worker thread of its connection, instead of the listen socket reading them for all
+	/// the clients and queuing them to their connections. Costs a socket and its buffers for each client. Needs
+	/// SO_REUSEPORT, and a kernel that prefers a connected socket in a reuseport group (Linux 5.4 or newer). Where a socket
+	/// can't be opened, the client is served through the listen socket as usual. By default, disabled. [main thread]
+	void SetConnectedUDPServerSockets(bool enabled) { connectedUDPServerSockets = enabled; }
+
+	/// Returns true if the new UDP servers give each client a connected socket. See SetConnectedUDPServerSockets().
+	bool ConnectedUDPServerSockets() const { return connectedUDPServerSockets; }
+
+	/// Sets the number of malformed datagrams after which the UDP connections opened or accepted after this call are closed,
+	/// see UDPMessageConnection::SetMalformedDatagramLimit(). The malformed datagrams are dropped and counted either way.
+	/// 0 (the default) never closes a connection for them. [main thread]
+	void SetMalformedDatagramLimit(u32 limit) { malformedDatagramLimit = limit; }
+
+	/// Returns the malformed datagram limit of the new UDP connections. See SetMalformedDatagramLimit().
+	u32 MalformedDatagramLimit() const { return malformedDatagramLimit; }
+
+	/// Reserves the 1-byte message IDs [firstCode, firstCode + numCodes) as codes for the frequent long message IDs of the
+	/// UDP connections opened or accepted after this call, see MessageIDDictionary. Each connection offers the peer a code for
+	/// the IDs of 128 or more it sends most, and sends the code in place of the 2 or 4-byte ID once the peer has accepted it.
+	/// The application must not send messages with these IDs itself, and both ends must reserve the same range. The range is
+	/// clamped to [15, 127]. numCodes 0 (the default) sends all the IDs as they are. [main thread]
+	void SetMessageIDCodes(message_id_t firstCode, int numCodes) { firstMessageIDCode = firstCode; numMessageIDCodes = numCodes; }
+
+	/// Returns the first message ID reserved as a code. See SetMessageIDCodes().
+	message_id_t FirstMessageIDCode() const { return firstMessageIDCode; }
+
+	/// Returns the number of message IDs reserved as codes. See SetMessageIDCodes().
+	int NumMessageIDCodes() const { return numMessageIDCodes; }
+
+	/// Has the UDP servers started after this call read their listen sockets from the given network interface through
+	/// AF_XDP, bypassing the network stack of the kernel, see XdpSocket. The UDP listen socket i of each port is read from
+	/// the receive queue i of the card, so give StartServer() as many UDP listen sockets as the card has queues. Needs a
+	/// build with USE_AF_XDP and the CAP_NET_ADMIN and CAP_BPF capabilities, and otherwise the listen sockets are read as
+	/// usual. Pass null to read the new servers through the kernel again. By default, no interface is set. [main thread]
+	void SetXdpInterface(const char *interfaceName) { xdpInterface = interfaceName ? interfaceName : ""; }
+
+	/// Returns the network interface of the new UDP servers, or an empty string. See SetXdpInterface().
+	const std::string &XdpInterface() const { return xdpInterface; }
+
+	/// Compares the loads of the worker threads, and if they are imbalanced enough, moves a connection from the most
+	/// loaded thread to the least loaded one. NetworkServer::Process() calls this periodically. [main thread]
+	/// @return True if a connection was moved.
+	bool RebalanceWorkerThreads();
+
 	/// Returns the NetworkServer object, or null if no server has been started.
 	Ptr(NetworkServer) GetServer() { return server; }
 
-	/// Returns all current connections in the system.
-	std::set<MessageConnection *> Connections() const { return connections; }
+	/// Returns all current connections in the system. The set is only modified by the main thread, so it is returned
+	/// without copying. [main thread]
+	const std::set<MessageConnection *> &Connections() const { return connections; }
+
+	/// Returns the data structure that collects statistics about the whole Network. The events recorded since the previous
+	/// call are moved into the hierarchy first, so this takes time proportional to their number.
+	Lock<StatsEventHierarchyNode> Statistics() { return statsRecorder.AcquireHierarchy(); }
+
+	/// Records a profiling event. Use the ADDEVENT macro instead of calling this directly. [worker and main thread]
+	void AddStatsEvent(stats_counter_t counter, float value) { statsRecorder.AddEvent(counter, value); }
 
-	/// Returns the data structure that collects statistics about the whole Network.
-	Lock<StatsEventHierarchyNode> Statistics() { return statistics.Acquire(); }
+	/// Returns the number of profiling events that have been dropped because their queues were full.
+	u32 NumDroppedStatsEvents() const { return statsRecorder.NumDroppedEvents(); }
 
 private:
 	/// Specifies the local network address of the system. This name is cached here on initialization
@@ -116,35 +321,157 @@ private:
 	/// Tracks all existing connections in the system.
 	std::set<MessageConnection *> connections;
 
-	Lockable<StatsEventHierarchyNode> statistics;
+	StatsEventRecorder statsRecorder;
+
+	/// A connection started with ConnectAsync() that does not have its socket yet.
+	struct PendingConnect
+	{
+		MessageConnection *connection;
+		std::string hostName;
+		unsigned short port;
+		SocketTransportLayer transport;
+		/// The socket that is connecting, or INVALID_SOCKET while the host name is being resolved.
+		SOCKET socket;
+		/// The address the socket is connecting to.
+		EndPoint address;
+	};
+
+	std::list<PendingConnect> pendingConnects; // [main thread]
+
+	/// The last time ProcessPendingConnects() went through pendingConnects.
+	tick_t lastPendingConnectsTick; // [main thread]
+
+	HostResolver hostResolver;
+
+	/// Returns a new client connection on the given socket, which is 0 for a connection started with ConnectAsync().
+	MessageConnection *NewClientConnection(Socket *socket, SocketTransportLayer transport, IMessageHandler *messageHandler,
+		Datagram *connectMessage, bool earlyData);
+
+	/// Sends the UDP connect datagram of the given connection, unless it waits for its early data, and hands the
+	/// connection to a worker thread.
+	void StartClientConnection(MessageConnection *connection);
+
+	/// Wraps the given connected socket handle into a Socket of this Network.
+	/// @param peer The address the socket was connected to. A TCP Fast Open socket has no peer name until it has sent its SYN.
+	Socket *StoreConnectedSocket(SOCKET connectSocket, SocketTransportLayer transport, const EndPoint &peer);
+
+	/// Sets the TCP Fast Open option of a client socket before it connects, if SetTCPFastOpen() is enabled.
+	void EnableTCPFastOpenConnect(SOCKET connectSocket, SocketTransportLayer transport);
+
+	/// Opens a non-blocking socket and starts connecting it to the given address.
+	/// @param connected [out] Set if the connect finished at once, which a UDP socket always does.
+	/// @return INVALID_SOCKET if the socket could not be opened or the connect failed at once.
+	SOCKET BeginConnect(const EndPoint &address, SocketTransportLayer transport, bool &connected);
+
+	/// Takes the given pending connect as far as it goes without blocking.
+	/// @return True if the connection has its socket now, or has failed, and the pending connect is done.
+	bool AdvancePendingConnect(PendingConnect &pending);
 
 	/// Takes the ownership of the given socket, and returns a pointer to the owned one.
 	Socket *StoreSocket(const Socket &cp);
 
-	friend class NetworkServer;
+	/// Returns a slave socket to the given endpoint on one of the shared UDP client sockets, opening a new shared socket if
+	/// the limit allows, or null if none of them is free for the endpoint. See SetSharedUDPClientSockets().
+	Socket *ConnectSharedUDPSocket(const EndPoint &peer);
+
+	/// Returns the server of the shared UDP client socket the given slave socket sends from, or null.
+	NetworkServer *SharedUDPClientSocketOwner(Socket *socket);
 
-	void SendUDPConnectDatagram(Socket &socket, Datagram *connectMessage);
+	friend class NetworkServer;
 
 	/// Returns a new UDP socket that is bound to communicating with the given endpoint, under
 	/// the given UDP master server socket.
 	/// The returned pointer is owned by this class.
 	Socket *CreateUDPSlaveSocket(Socket *serverListenSocket, const EndPoint &remoteEndPoint, const char *remoteHostName);
 
+	/// Returns a new UDP socket of its own that is bound to the port of the given UDP master server socket and connected to
+	/// the given endpoint, or null if it could not be opened. See SetConnectedUDPServerSockets().
+	/// The returned pointer is owned by this class.
+	Socket *CreateConnectedUDPSocket(Socket *serverListenSocket, const EndPoint &remoteEndPoint, const char *remoteHostName);
+
 	/// Opens a new socket that listens on the given port using the given transport.
 	/// @param allowAddressReuse If true, kNet passes the SO_REUSEADDR parameter to the server listen socket before binding 
 	///        the socket to a local port (== before starting the server). This allows the same port to be forcibly reused
 	///        when restarting the server if a crash occurs, without having to wait for the operating system to free up the port.
-	Socket *OpenListenSocket(unsigned short port, SocketTransportLayer transport, bool allowAddressReuse);
+	/// @param allowPortSharing If true, the socket is opened with SO_REUSEPORT, so that several sockets can be bound to the same port.
+	Socket *OpenListenSocket(unsigned short port, SocketTransportLayer transport, bool allowAddressReuse, bool allowPortSharing = false);
+
+	/// Opens a new socket that listens for the SocketOverSharedMemory connections to the given port.
+	Socket *OpenSharedMemoryListenSocket(unsigned short port);
+
+	/// Connects a new SocketOverSharedMemory socket to the server of this host that listens to the given port.
+	Socket *ConnectSharedMemorySocket(unsigned short port);
+
+	/// Opens the listen sockets for the given port and appends them to listenSockets. For UDP, opens numUDPListenSockets
+	/// SO_REUSEPORT sockets if supported, see StartServer(). Returns the number of sockets opened.
+	int OpenListenSockets(unsigned short port, SocketTransportLayer transport, bool allowAddressReuse, int numUDPListenSockets, std::vector<Socket *> &listenSockets);
 
 	/// Stores all the currently running network worker threads. Each thread is assigned
 	/// a list of MessageConnections and NetworkServers to oversee. The worker threads
 	/// then manage the socket reads and writes on these connections.
 	std::vector<NetworkWorkerThread*> workerThreads;
 
-	/// Examines each currently running worker thread and returns one that has sufficiently low load,
-	/// or creates a new thread and returns it if no such thread exists. The thread is added and maintained
-	/// in the workerThreads list.
-	NetworkWorkerThread *GetOrCreateWorkerThread();
+	/// The maximum number of threads in workerThreads.
+	int maxWorkerThreads;
+
+	/// The number of worker threads started so far. Each thread gets a new number as its id, see NetworkWorkerThread::Id().
+	int numWorkerThreadsCreated;
+
+	/// The busy-polling mode of the worker threads. See SetWorkerBusyPolling().
+	bool workerBusyPolling;
+	float workerBusyPollIdleMSecs;
+
+	/// The placement of the worker threads. See SetWorkerThreadPlacement().
+	std::vector<int> workerCpus;
+	ThreadPriority workerPriority;
+	bool workerAlignListenSockets;
+
+	/// The max send size of the new UDP sockets.
+	size_t maxDatagramSize;
+
+	/// The memory limit of the new connections. See SetConnectionMemoryLimit().
+	size_t connectionMemoryLimit;
+
+	/// The key of the new UDP connections, if encryptionEnabled is set. See SetEncryptionKey().
+	u8 encryptionKey[DatagramCipher::cKeySize];
+	bool encryptionEnabled;
+
+	/// If true, the new UDP connections checksum their datagrams. See SetDatagramChecksums().
+	bool datagramChecksums;
+
+	/// If true, the new TCP sockets use TCP Fast Open. See SetTCPFastOpen().
+	bool tcpFastOpen;
+
+	/// The maximum number of sharedUDPClientSockets. See SetSharedUDPClientSockets().
+	int maxSharedUDPClientSockets;
+
+	/// If true, the new UDP servers give each client a connected socket. See SetConnectedUDPServerSockets().
+	bool connectedUDPServerSockets;
+
+	/// The local UDP sockets shared by the client connections. Each is the listen socket of a server that does not accept
+	/// connections, and routes the datagrams of each remote endpoint to the client connection to it. [main thread]
+	std::vector<Ptr(NetworkServer)> sharedUDPClientSockets;
+
+	/// The malformed datagram limit of the new UDP connections. See SetMalformedDatagramLimit().
+	u32 malformedDatagramLimit;
+
+	/// The message IDs the new UDP connections use as codes. See SetMessageIDCodes().
+	message_id_t firstMessageIDCode;
+	int numMessageIDCodes;
+
+	/// The network interface the new UDP servers read through AF_XDP. See SetXdpInterface().
+	std::string xdpInterface;
+
+	/// Creates a new worker thread if there are less than maxWorkerThreads of them running, or otherwise
+	/// returns the running thread that has the lowest load. The thread is added and maintained in the workerThreads list.
+	/// @param exclude If not null, the threads in this list are only returned if all the running threads are in it.
+	NetworkWorkerThread *GetOrCreateWorkerThread(const std::vector<NetworkWorkerThread *> *exclude = 0);
+
+	/// Applies the placement of SetWorkerThreadPlacement() to the worker thread at the given index of workerThreads.
+	void PlaceWorkerThread(size_t index);
+
+	/// Moves the given connection from its current worker thread to the given thread.
+	void MoveConnectionToWorkerThread(MessageConnection *connection, NetworkWorkerThread *workerThread);
 
 	/// A notification function that is called by NetworkServer whenever it creates a new MessageConnection object.
 	/// The Network subsystem will store this new connection for tracking purposes.
@@ -153,7 +480,8 @@ private:
 	/// Takes the given MessageConnection and associates a NetworkWorkerThread for it.
 	void AssignConnectionToWorkerThread(MessageConnection *connection);
 
-	/// Takes the given server and associates a NetworkWorkerThread for it.
+	/// Takes the given server and associates a NetworkWorkerThread for each of its listen sockets. The UDP listen sockets
+	/// are given to different threads when possible.
 	void AssignServerToWorkerThread(NetworkServer *server);
 
 	/// Closes the given workerThread and deletes it (do not reference the passed pointer afterwards). 
@@ -164,7 +492,7 @@ private:
 	/// have any servers or connections to work on any more.
 	void RemoveConnectionFromItsWorkerThread(MessageConnection *connection);
 
-	/// Dissociates the given server from its worker thread, and closes the worker thread if it does not
+	/// Dissociates the given server from its worker threads, and closes the worker threads that do not
 	/// have any servers or connections to work on any more.
 	void RemoveServerFromItsWorkerThread(NetworkServer *server);
 
@@ -58,6 +58,13 @@ const LogChannel LogWaits = 64;      ///< Logs all long performance-related wait
 /// @param msg The printf-style message format specifier for the text to print.
 void TimeOutputDebugStringVariadic(LogChannel logChannel, const char *filename, int lineNumber, const char *msg, ...);
 
+/// Records a variadic line to the log. If asynchronous logging is enabled, the arguments are copied to a queue of the
+/// calling thread, and the line is formatted and written later by a background thread. Otherwise the same as
+/// kNet::TimeOutputDebugStringVariadic. Called by the KNET_LOG macro.
+/// @param msg The printf-style message format specifier. Must point to a string literal, since the line is formatted
+///            after the call returns. The %n conversion is not supported.
+void TimeOutputDebugStringAsync(LogChannel logChannel, const char *filename, int lineNumber, const char *msg, ...);
+
 /// Prints a message to the log. Same as kNet::TimeOutputDebugStringVariadic, but does not use printf formatting.
 void TimeOutputDebugString(LogChannel logChannel, const char *filename, int lineNumber, const char *msg);
 
@@ -76,6 +83,23 @@ bool IsLogChannelActive(LogChannel channel);
 /// logging to target std::cout.
 void SetLogFile(const char *filename);
 
+/// Enables or disables asynchronous logging, which moves the formatting and the writing of the KNET_LOG lines from the
+/// logging threads to a background thread. The lines of each thread keep their order, and the lines of different threads
+/// are written in the order of their timestamps as far as they are flushed together. If the queue of a thread fills up,
+/// its new lines are dropped and counted until the background thread catches up. Disabling writes out all queued lines.
+/// Lines that are too long to queue, the KNET_LOGUSER lines, and the lines of threads past the 64 first are written
+/// synchronously, and can appear ahead of queued lines that were logged before them. By default, logging is synchronous.
+void SetAsyncLogging(bool enabled);
+
+/// Returns true if asynchronous logging is enabled.
+bool IsAsyncLoggingEnabled();
+
+/// Writes out all the lines queued so far. Does nothing if asynchronous logging is disabled. [thread-safe]
+void FlushLog();
+
+/// Returns the number of lines dropped since the queue of their thread was full. [thread-safe]
+unsigned long NumDroppedLogLines();
+
 /// When called, sets the runtime to print out all memory leaks at program exit time. Win32-only. On
 /// linux, this is a no-op.
 void EnableMemoryLeakLoggingAtExit();
@@ -91,11 +115,11 @@ void EnableMemoryLeakLoggingAtExit();
 
 #ifdef KNET_LOGGING_SUPPORT_ENABLED
 
-/// Prints out a variadic message to the given log channel.
+/// Prints out a variadic message to the given log channel. The message must be a string literal, see TimeOutputDebugStringAsync().
 #define KNET_LOG(channel, msg, ...) \
 	MULTI_LINE_MACRO_BEGIN \
 		if (kNet::IsLogChannelActive(channel)) \
-			kNet::TimeOutputDebugStringVariadic(channel, __FILE__, __LINE__, msg, ##__VA_ARGS__); \
+			kNet::TimeOutputDebugStringAsync(channel, __FILE__, __LINE__, "" msg, ##__VA_ARGS__); \
 	MULTI_LINE_MACRO_END
 
 #else
@@ -19,11 +19,22 @@
 #include "kNetBuildConfig.h"
 #include "LockFreePoolAllocator.h"
 #include "FragmentedTransferManager.h"
+#include "Clock.h"
 #include "Types.h"
 
 namespace kNet
 {
 
+class DatagramBuffer;
+class IMessageAckHandler;
+struct MessageFramePage;
+
+#ifndef KNET_MESSAGE_INLINE_CAPACITY
+/// The number of payload bytes a NetworkMessage stores inline, without a separate data buffer. Set by the
+/// MESSAGE_INLINE_CAPACITY build option.
+#define KNET_MESSAGE_INLINE_CAPACITY 64
+#endif
+
 /// Performs modular arithmetic comparison to see if newID refers to a PacketID that is *strictly* newer than oldID.
 /// @return True if newID is *strictly* newer than oldID, false otherwise.
 inline bool PacketIDIsNewerThan(packet_id_t newID, packet_id_t oldID)
@@ -54,8 +65,8 @@ class NetworkMessage : public PoolAllocatable<NetworkMessage>
 {
 public:
 	/// To create a NetworkMessage, call MessageConnection::StartNewMessage() instead of directly instantiating
-	/// a message structure. This is because each MessageConnection implements an internal pool of NetworkMessage
-	/// structures which are reused between messages, to avoid excessive dynamic memory allocation.
+	/// a message structure. This is because the messages are allocated from NetworkMessagePool, which reuses the
+	/// structures and their data buffers between messages, to avoid excessive dynamic memory allocation.
 	NetworkMessage();
 
 	NetworkMessage &operator=(const NetworkMessage &rhs);
@@ -66,9 +77,14 @@ public:
 	/// Stores the actual data of the message. 
 	/// When writing a new message, fill in the data bytes here. This buffer can hold Capacity() amount of bytes. If you need more,
 	/// call Reallocate() with the desired amount of bytes.
-	/// This field is read-only, do not change this pointer value.
+	/// This field is read-only, do not change this pointer value. Points into the message itself for payloads of up to
+	/// cInlineCapacity bytes, so the pointer does not stay valid when the contents are swapped to another message.
 	char *data;
 
+	/// The number of bytes the message holds without allocating a data buffer. Most messages are small, so they are
+	/// serialized from the same memory as the fields of the message.
+	static const size_t cInlineCapacity = KNET_MESSAGE_INLINE_CAPACITY;
+
 	size_t Capacity() const { return dataCapacity; }
 
 	size_t Size() const { return dataSize; }
@@ -86,7 +102,8 @@ public:
 	unsigned long priority;
 
 	/// The ID of this message. IDs 0 - 5 are reserved for the protocol and may not be used.
-	/// Valid user range is [6, 1073741821 == 0x3FFFFFFD].
+	/// Valid user range is [6, 1073741821 == 0x3FFFFFFD]. The IDs from MessageConnection::cFirstExtensionMsgId
+	/// (0x40000000) up identify the internal protocol messages that are sent under the reserved ID 5.
 	message_id_t id;
 
 	/// When sending out a message, the application can attach a content ID to the message,
@@ -103,11 +120,41 @@ public:
 	/// is not specified and can vary.
 	bool inOrder;
 
+	/// The ordering channel of this message, used if the message is both reliable and inOrder. Over UDP, the in-order
+	/// messages of each channel are delivered in the order they were first sent out, independent of the other channels,
+	/// so that a lost datagram stalls only the channels it carried messages of. Default: 0. Not used over TCP, which
+	/// delivers all messages in order. See MessageConnection::SetOrderingChannel().
+	u8 orderingChannel;
+
+	/// If true, and this message is unreliable, the datagram that carries this message is protected by forward error
+	/// correction over UDP. The receiver can then rebuild the datagram if it alone of its group was lost, without waiting
+	/// for a round trip. See UDPMessageConnection::SetForwardErrorCorrectionGroupSize(). Not used over TCP.
+	bool forwardErrorCorrection;
+
+	/// If true, and this message is unreliable and has a content ID, the message is sent over UDP as a delta against the
+	/// latest version of the same (messageID, contentID) that the peer has acknowledged, when that makes it smaller. The
+	/// datagrams that carry such messages are acknowledged, but not resent. Not used over TCP.
+	bool deltaEncoding;
+
 	/// If this flag is set, the message will not be sent and will be deleted as soon
 	/// as possible. It has been superceded by another message before it had the time
 	/// to leave the outbound send queue.
 	bool obsolete;
 
+	/// If nonzero, the tick after which this message is stale. An unreliable message that still waits in the outbound queue
+	/// by then is dropped instead of sent, see SetExpiry(). Reliable messages ignore this and are always delivered.
+	tick_t expiryTick;
+
+	/// Makes this message stale the given number of msecs from now. Pass in 0 to keep the message until it is sent.
+	void SetExpiry(unsigned long msecs) { expiryTick = (msecs > 0) ? Clock::Tick() + Clock::TicksPerMillisecond() * msecs : 0; }
+
+	/// Returns true if this message is unreliable and its expiry time has passed by the given time.
+	bool IsExpiredAt(tick_t now) const { return expiryTick != 0 && !reliable && Clock::IsNewer(now, expiryTick); }
+
+	/// If not null, this handler is told once the peer has received this message, or when the message is dropped without
+	/// reaching the peer. Only reliable messages are acked. The handler must stay alive until it has been called. Default: null.
+	IMessageAckHandler *ackHandler;
+
 #ifdef KNET_NETWORK_PROFILING
 	std::string profilerName;
 #endif
@@ -131,7 +178,32 @@ private:
 	friend class UDPMessageConnection;
 	friend class TCPMessageConnection;
 	friend class FragmentedSendManager;
+	friend class FragmentedReceiveManager;
 	friend struct FragmentedSendManager::FragmentedTransfer;
+	friend class NetworkMessagePool;
+	friend class OutboundMessageQueue;
+	friend class MessageFrameArena;
+
+	/// Restores the fields of this message to their default values before the message is returned to the pool. Keeps
+	/// the data buffer, unless it is larger than NetworkMessagePool::cMaxPooledDataCapacity or shared.
+	void ResetForReuse();
+
+	/// Tells the ackHandler, if it is still set, why this message is being freed before it was delivered.
+	void ReportNotDelivered();
+
+	/// Makes this message refer to the given bytes of a shared buffer instead of a data buffer of its own. Takes a new
+	/// reference to the buffer. [thread-safe with respect to the other messages sharing the buffer]
+	void AttachSharedData(DatagramBuffer *buffer, const char *sharedBytes, size_t numBytes);
+
+	/// Exchanges the contents of this message with the contents of the given message. The data buffers are swapped, not
+	/// copied, except for inline contents.
+	void SwapData(NetworkMessage &rhs);
+
+	/// Returns true if data points to inlineData.
+	bool IsInline() const { return data == inlineData; }
+
+	/// Frees the data buffer of this message, if it has one of its own, and points data back to inlineData.
+	void FreeData();
 
 	/// A temporary storage area to remember the UDP packet ID this messages was received in.
 	/// For TCP messages, this field is always zero.
@@ -144,6 +216,13 @@ private:
 	/// that have the same priority.
 	unsigned long messageNumber;
 
+	/// The tick at which the message was admitted to the outbound queue, for timing how long it waited there. Zero for
+	/// the internal messages the worker thread creates at send time, which do not wait.
+	tick_t queuedTick;
+
+	/// If nonzero, the stages of this message are recorded to the MessageTracer under this ID.
+	u32 traceID;
+
 	/// A running number that is assigned to each reliable message. This is used in the
 	/// network byte stream to implement ordering of messages.
 	unsigned long reliableMessageNumber;
@@ -151,6 +230,14 @@ private:
 	/// The number of times this message has been sent and not been acked (reliable messages only).
 	unsigned long sendCount;
 
+	/// The position of this message in its ordering channel. Assigned when the message is first serialized to a datagram,
+	/// and kept for the resends. For fragments, the number of the whole message is stored in the transfer instead.
+	u32 orderNumber;
+	bool hasOrderNumber;
+
+	/// True while this message waits in the outbound queue of a connection, as opposed to being in flight. Maintained by OutboundMessageQueue.
+	bool inOutboundQueue;
+
 	/// The index of this fragment, or not used (undefined) if totalNumFragments==0.
 	unsigned long fragmentIndex;
 
@@ -160,9 +247,55 @@ private:
 	/// Specifies the number of bytes actually used in the data array.
 	size_t dataSize;
 
+	/// If not null, data points into this reference-counted buffer, which is shared with other messages, for example the
+	/// copies of a broadcast message sent to each client. The shared bytes are immutable: Resize() gives the message a
+	/// data buffer of its own before the contents can be modified.
+	DatagramBuffer *sharedData;
+
+	/// The storage of the payloads of up to cInlineCapacity bytes. Larger payloads are allocated from MessageDataAllocator.
+	char inlineData[cInlineCapacity];
+
 	/// If 0, this message is being sent unfragmented. Otherwise, this NetworkMessage is a fragment of the whole
 	/// message and transfer points to the data structure that tracks the transfer of a fragmented message.
 	FragmentedSendManager::FragmentedTransfer *transfer;
+
+	/// If true, data holds the content of a DeltaState message that carries this message, and deltaVersion is the version
+	/// of the contents it carries. Set when the message is first serialized to a datagram.
+	bool deltaEncoded;
+	u32 deltaVersion;
+
+	/// The next message in the reliable datagram in flight that carries this message, or 0 if this is the last one.
+	/// Maintained by UDPMessageConnection.
+	NetworkMessage *nextInDatagram;
+
+	/// If not null, this message was allocated from a page of a MessageFrameArena, and is freed back to the page.
+	MessageFramePage *framePage;
+};
+
+/// A process-wide pool of NetworkMessage structures, shared by all connections and Network objects. Each thread keeps
+/// a small cache of unused messages in front of the shared lock-free pool, so that allocating and freeing messages does
+/// not touch the runtime heap nor any shared state in the common case. [thread-safe]
+class NetworkMessagePool
+{
+public:
+	/// Returns an unused message with all fields at their default values and a size of zero. The data buffer of a
+	/// reused message is kept, so Resize() does not reallocate if the new message is not larger than the old one.
+	static NetworkMessage *New();
+
+	/// Returns the given message to the pool of the calling thread. The message may not be in use by any connection.
+	/// A message allocated from a MessageFrameArena is released to its page instead.
+	static void Free(NetworkMessage *msg);
+
+	/// Returns all the messages cached by the calling thread to the shared pool. This is also done when a thread that has
+	/// cached messages exits, but a long-lived thread that stops using the messages can call this to pass them on.
+	static void FlushThreadCache();
+
+	/// The maximum number of unused messages each thread caches before returning them to the shared pool.
+	static const int cThreadCacheSize = 32;
+
+	/// Messages that have a data buffer larger than this many bytes have the buffer freed before being pooled, so
+	/// that a burst of large messages does not keep memory reserved indefinitely.
+	static const size_t cMaxPooledDataCapacity = 16 * 1024;
 };
 
 } // ~kNet
@@ -17,6 +17,8 @@
 	@brief The NetworkServer class. The main class for hosting a kNet server. */
 
 #include <list>
+#include <deque>
+#include <map>
 
 #include "kNetBuildConfig.h"
 #include "SharedPtr.h"
@@ -24,17 +26,54 @@
 #include "MessageConnection.h"
 #include "Datagram.h"
 #include "INetworkServerListener.h"
+#include "IDatagramReceiver.h"
 #include "Lockable.h"
+#include "EndPointHashTable.h"
+#include "DatagramBuffer.h"
+#include "VersionedSnapshot.h"
+#include "MPSCQueue.h"
+#include "DatagramCipher.h"
+#include "SourceAddressFilter.h"
+#include "PacketCapture.h"
+#include "StrikeRegister.h"
+#include "MulticastChannel.h"
+#include "InterestGrid.h"
+#include "EgressScheduler.h"
 
 namespace kNet
 {
 
 class Network;
+class NetworkServer;
+class UDPMessageConnection;
+
+/// @internal A broadcast that NetworkServer hands over to a worker thread, which queues it to the client connections of the
+/// server that it runs. See NetworkServer::SetWorkerThreadBroadcasts().
+struct WorkerBroadcast
+{
+	NetworkServer *server;
+	/// The client that does not get the message, or 0.
+	MessageConnection *exclude;
+	/// The serialized message. Each worker thread holds a reference to it until it has queued the message.
+	DatagramBuffer *payload;
+	size_t numBytes;
+
+	// The fields of the messages, see NetworkMessage.
+	unsigned long id;
+	bool reliable;
+	bool inOrder;
+	u8 orderingChannel;
+	bool forwardErrorCorrection;
+	bool deltaEncoding;
+	unsigned long priority;
+	unsigned long contentID;
+	tick_t expiryTick;
+};
 
 /// Manages all low-level networking required in maintaining a network server and keeps
 /// track of all currently established connections.
 /// NetworkServer has the 
-class NetworkServer : public RefCountable
+class NetworkServer : public RefCountable, public IDatagramReceiver
 {
 public:
 	/// When destroyed, the NetworkServer closes all the server connections it has.
@@ -49,6 +88,16 @@ public:
 	// Returns whether this server is handling new connection attempts.
 	bool AcceptsNewConnections() const { return acceptNewConnections; }
 
+	/// Enables or disables the stateless cookie handshake of new UDP connections. When enabled, which is the default, the
+	/// server answers a connection attempt with a cookie computed from the address of the peer, and only allocates the
+	/// connection once the peer sends its connection attempt again with the cookie. A flood of attempts from spoofed
+	/// addresses then costs the server only a hash and a short reply per datagram. Disable this to accept clients that
+	/// do not answer the cookie. [main thread]
+	/// The cookies also check that a UDP client that has moved to a new address, for example after a NAT rebinding, receives
+	/// the datagrams sent there, before its connection is moved over. Without the cookies, the server does not notice that
+	/// a client has moved, and the client has to connect again.
+	void SetConnectionCookiesRequired(bool required) { connectionCookiesRequired = required; }
+
 	/// Enables or disables whether rejected connection attempts are messaged back to the client (UDP only).
 	/// i.e. whether to message "Connection rejected" back to the peer.
 	void SetStealthMode(bool stealthModeEnabled);
@@ -57,8 +106,26 @@ public:
 	/// Periodically call this function to update the NetworkServer object.
 	void Process();
 
+	/// Like Process(), but passes the messages of the connections to their handlers for at most maxMicroseconds, and shares
+	/// the time fairly between the connections (deficit round robin). The connections that have messages take turns, and
+	/// each turn a connection passes on up to InboundQuantum() bytes of messages. A message larger than that waits until
+	/// its connection has saved up enough turns. The connections left with messages when the time runs out go on in the
+	/// next call, starting with the first one that did not get its turn, so a connection flooding the server with large
+	/// messages only gets its share of the frame. The time is checked after each turn, so a slow handler can make the call
+	/// run over by a turn.
+	void ProcessFor(int maxMicroseconds);
+
+	/// Sets the bytes of messages a connection passes on per turn in ProcessFor(). The default is cDefaultInboundQuantum.
+	void SetInboundQuantum(size_t bytes) { inboundQuantum = (bytes > 0) ? bytes : 1; }
+
+	/// Returns the bytes of messages a connection passes on per turn in ProcessFor().
+	size_t InboundQuantum() const { return inboundQuantum; }
+
+	static const size_t cDefaultInboundQuantum = 4096;
+
 	/// Broadcasts the given message to all currently active connections, except for the single 'exclude' connection.
-	/// If exclude is 0, all clients will receive the message.
+	/// If exclude is 0, all clients will receive the message. The message data is copied once to a buffer that the
+	/// messages queued to each client share.
 	/// @param msg The message to send.
 	/// @param exclude The network connection to exclude from the recipient list. All other clients connected to this
 	/// server will get the message. This parameter is useful when you are implementing a server that relays messages
@@ -66,11 +133,36 @@ public:
 	void BroadcastMessage(const NetworkMessage &msg, MessageConnection *exclude = 0);
 
 	/// Creates a NetworkMessage structure with the given data and broadcasts it to all currently active connections,
-	/// except to the given excluded connection.
+	/// except to the given excluded connection. The data is copied once to a buffer that the messages queued to each client share.
 	void BroadcastMessage(unsigned long id, bool reliable, bool inOrder, unsigned long priority, 
 	                      unsigned long contentID, const char *data, size_t numBytes,
 	                      MessageConnection *exclude = 0);
 
+	/// Sends the message to the clients whose area of interest contains the given point, except to the given excluded
+	/// connection. See SetInterest(). The recipients are looked up from a grid of the client positions, so the cost grows
+	/// with the number of clients near the point, not with all the clients of the server. The data is copied once to a
+	/// buffer that the messages queued to each recipient share. [main thread]
+	void BroadcastMessageAt(float x, float y, unsigned long id, bool reliable, bool inOrder, unsigned long priority,
+	                        unsigned long contentID, const char *data, size_t numBytes, MessageConnection *exclude = 0);
+
+	/// Sends the message to each of the given connections, for the applications that keep their own interest sets. The
+	/// data is copied once to a buffer that the messages queued to each recipient share. [main thread]
+	void BroadcastMessageTo(const std::vector<MessageConnection *> &recipients, unsigned long id, bool reliable, bool inOrder,
+	                        unsigned long priority, unsigned long contentID, const char *data, size_t numBytes);
+
+	/// Sets the position of the given client, and the radius around it within which the client gets the messages of
+	/// BroadcastMessageAt(). A client that has no position set gets none of those messages. The client is taken off the
+	/// grid when its connection is removed. [main thread]
+	void SetInterest(MessageConnection *connection, float x, float y, float radius) { interestGrid.Set(connection, x, y, radius); }
+
+	/// Takes the given client off the grid of BroadcastMessageAt(). [main thread]
+	void ClearInterest(MessageConnection *connection) { interestGrid.Remove(connection); }
+
+	/// Returns the grid of the client positions that BroadcastMessageAt() finds the recipients from. The cell size can be
+	/// tuned to the typical interest radius with InterestGrid::SetCellSize(). [main thread]
+	InterestGrid<MessageConnection> &Interest() { return interestGrid; }
+
+	/// Serializes the given data once and broadcasts it to all currently active connections, except to the given excluded connection.
 	template<typename SerializableData>
 	void BroadcastStruct(const SerializableData &data, unsigned long id, bool inOrder, 
 		bool reliable, unsigned long priority, unsigned long contentID = 0, MessageConnection *exclude = 0);
@@ -78,9 +170,42 @@ public:
 	template<typename SerializableMessage>
 	void Broadcast(const SerializableMessage &data, unsigned long contentID = 0, MessageConnection *exclude = 0);
 
+	/// If enabled, BroadcastMessage(), BroadcastStruct() and Broadcast() hand each broadcast over to the worker threads as a
+	/// single command per thread, and each thread queues the message to the clients it runs. The calling thread then does
+	/// not have to queue the message to every client in turn, which takes long with thousands of clients. The messages reach
+	/// the outbound queues only when the worker threads get to them, so a message sent to a client right after a broadcast
+	/// may go out before the broadcast does. Disabled by default. [main thread]
+	void SetWorkerThreadBroadcasts(bool enabled) { workerThreadBroadcasts = enabled; }
+
+	/// Returns true if the broadcasts are queued by the worker threads. See SetWorkerThreadBroadcasts(). [main thread]
+	bool WorkerThreadBroadcasts() const { return workerThreadBroadcasts; }
+
 	/// Sends the given message to the given destination.
 	void SendMessage(const NetworkMessage &msg, MessageConnection &destination);
 
+	/// Opens an IPv4 multicast group for the unreliable messages that go the same to many clients, see MulticastMessage().
+	/// Each datagram is sent to the group once, however many receivers have joined it, see
+	/// MessageConnection::JoinMulticastGroup(). The reliable traffic of each client stays on its own connection. The
+	/// multicast datagrams are not encrypted, even if the connections are. [main thread]
+	/// @param timeToLive The number of routers the datagrams may cross. 1 keeps them on the local network.
+	/// @return False if the address is not a multicast address, or the socket could not be opened.
+	bool EnableMulticast(const char *groupAddress, unsigned short port, int timeToLive = 1);
+
+	/// Closes the multicast group opened with EnableMulticast(). [main thread]
+	void DisableMulticast() { multicastChannel.Close(); }
+
+	/// Returns the multicast group of this server, which is not open unless EnableMulticast() has been called.
+	const MulticastChannel &Multicast() const { return multicastChannel; }
+
+	/// Queues an unreliable message to the multicast group. The messages are packed into as few datagrams as they fit in,
+	/// which go out at the next Process(), or FlushMulticast(). A message has to fit in a datagram, see
+	/// Network::MaxDatagramSize(). [main thread]
+	/// @return False if multicast is not enabled, or the message is too large.
+	bool MulticastMessage(unsigned long id, const char *data, size_t numBytes) { return multicastChannel.QueueMessage((u32)id, data, numBytes); }
+
+	/// Sends the multicast messages queued so far. [main thread]
+	void FlushMulticast() { multicastChannel.Flush(); }
+
 	/// Starts a benign disconnection procedure for all clients (write-closes each connection).
 	/// Also calls SetAcceptNewConnections(false), since this function is intended to be used when the server is going down.
 	/// It can take an indefinite time for the connections to bidirectionally close, since it is up to the individual
@@ -101,14 +226,80 @@ public:
 	/// Returns all the sockets this server is listening on.
 	std::vector<Socket *> &ListenSockets();
 
+	/// Returns the network interface whose AF_XDP sockets read the UDP listen sockets of this server, or an empty string if
+	/// they are read through the kernel. Set from Network::SetXdpInterface() when the server starts.
+	const std::string &XdpInterface() const { return xdpInterface; }
+
+	/// Returns the total number of datagrams the OS has dropped at the UDP sockets of this server, since they came in while
+	/// the receive buffer of the socket was full. See Socket::ReceiveQueueDrops(). [main and worker thread]
+	unsigned long ReceiveQueueDrops() const;
+
+	/// Returns the number of datagrams this server has dropped since they could not be parsed: the malformed connection
+	/// attempts, and the malformed datagrams of its client connections, see UDPMessageConnection::NumMalformedDatagrams().
+	/// [main and worker thread]
+	unsigned long NumMalformedDatagrams() const { return (unsigned long)numMalformedDatagrams; }
+
+	/// Returns the number of times Process() has found the accept queue of a TCP listen socket full, in which case the OS
+	/// refuses or drops the connections that come in until the queue has room again. Only detected on Linux. [main thread]
+	unsigned long NumAcceptQueueOverflows() const { return numAcceptQueueOverflows; }
+
+	/// Returns the number of times Process() has left TCP connections waiting in the accept queue of a listen socket, since
+	/// it had already accepted as many as it accepts in one call. [main thread]
+	unsigned long NumAcceptBacklogs() const { return numAcceptBacklogs; }
+
+	/// Returns the filter that bans and rate-limits the source addresses of the traffic of this server. Each datagram and
+	/// each accepted TCP connection passes the filter before the server looks it up or allocates anything for it. The
+	/// filter starts out letting everything in. [main thread, Admit() also from the worker threads]
+	SourceAddressFilter &SourceFilter() { return sourceFilter; }
+
+	/// Returns the capture that records the raw datagrams and TCP stream blocks of this server and its connections to a
+	/// file, to be replayed with knet_replay later. The capture is not running until PacketCapture::Start() is called.
+	/// [main thread, Record() also from the worker threads]
+	PacketCapture &Capture() { return packetCapture; }
+
+	/// Limits the total send rate of the client connections of this server, and shares it between them in proportion to
+	/// their MessageConnection::SetEgressWeight(). The datagrams that carry a message of at least
+	/// EgressScheduler::CriticalPriority() go out first when the limit is reached. The limits set on each connection still
+	/// apply. Pass in 0 to remove the limit, which is the default. [main thread]
+	void SetEgressBandwidthLimit(int bytesPerSec) { egressScheduler.SetRate(bytesPerSec, Clock::Tick()); }
+
+	/// Returns the limit set with SetEgressBandwidthLimit(), or 0 if there is none. [main and worker thread]
+	int EgressBandwidthLimit() const { return egressScheduler.Rate(); }
+
+	/// Returns the scheduler that shares the send rate of this server between its client connections. [main and worker thread]
+	EgressScheduler &Egress() { return egressScheduler; }
+
 	typedef std::map<EndPoint, Ptr(MessageConnection)> ConnectionMap;
 
-	/// Returns all the currently tracked connections.
+	/// Returns a copy of all the currently tracked connections. To iterate over the connections without copying them,
+	/// call AcquireConnections() instead.
 	ConnectionMap GetConnections();
 
+	/// An entry of a ConnectionSnapshot. The connection is mutable so that the non-const functions of the connection can
+	/// be called through a snapshot, but do not copy the pointer outside the main thread, as its reference count is not atomic.
+	struct ConnectionSnapshotEntry
+	{
+		EndPoint endPoint;
+		mutable Ptr(MessageConnection) connection;
+	};
+
+	typedef std::vector<ConnectionSnapshotEntry> ConnectionList;
+
+	/// A reference to the list of connections of the server at one point of time. The list does not change while it is
+	/// referenced, and it keeps the connections in it alive.
+	typedef VersionedSnapshot<ConnectionList>::Ref ConnectionSnapshot;
+
+	/// Returns the current list of connections, without locking nor copying the list. The server publishes a new version
+	/// of the list each time a connection is added or removed. [thread-safe, lock-free]
+	ConnectionSnapshot AcquireConnections() const { return connectionSnapshot.Acquire(); }
+
 	/// Returns the number of currently active connections. A connection is active if it is at least read- or write-open.
 	int NumConnections() const;
 
+	/// Returns the samples of the given latency measure of all the current connections merged into one histogram.
+	/// Iterates the connections without locking, so this can be called at any time. [main and worker thread]
+	LatencyHistogram AggregateLatencyHistogram(LatencyMetric metric) const;
+
 	/// Returns a one-liner textual summary of this server.
 	std::string ToString() const;
 
@@ -121,34 +312,197 @@ private:
 	/// possible for clients to bypass firewalls and/or mix UDP and TCP use.
 	std::vector<Socket *> listenSockets;
 
-	/// The list of active client connections.
+	/// The list of active client connections. The lock serializes the modifications of the list, and readers use the
+	/// connectionSnapshot instead.
 	Lockable<ConnectionMap> clients;
 
+	/// The latest version of the clients list, for reading without locking. Published while holding the lock to clients.
+	VersionedSnapshot<ConnectionList> connectionSnapshot;
+
+	/// Publishes the given contents of the clients list as the new connectionSnapshot. [main thread, clients locked]
+	void PublishConnections(const ConnectionMap &connections);
+
+	/// Maps the endpoints of the UDP connections in clients to the connections, so that the worker threads can find the
+	/// receiver of each inbound datagram without taking the lock to clients. Only modified while holding the lock to clients.
+	EndPointHashTable<UDPMessageConnection> udpConnections;
+
+	/// Maps the connection IDs of the UDP connections in clients to the connections, for finding the connection of a
+	/// migration request. Only modified while holding the lock to clients. [main thread]
+	std::map<u64, UDPMessageConnection *> udpConnectionIDs;
+
+	/// Adds a UDP connection handed over from another process to the clients, under the connection ID it had there.
+	/// Call before the connection is assigned to a worker thread. See Network::ResumeServer(). [main thread]
+	void AddResumedConnection(UDPMessageConnection *connection, const EndPoint &endPoint);
+
+	/// Removes the UDP connection of the given endpoint from udpConnections and udpConnectionIDs. [main thread, clients locked]
+	void RemoveUDPConnection(const EndPoint &endPoint);
+
+	/// Routes the datagrams from the given endpoint to the given client connection, which sends from a slave socket of the
+	/// listen socket of this server. Used by the servers Network opens to share a UDP socket between client connections,
+	/// see Network::SetSharedUDPClientSockets(). The connection is not added to the clients of this server. [main thread]
+	/// @return False if the endpoint already has a connection on this server.
+	bool AttachOutboundConnection(const EndPoint &peer, UDPMessageConnection *connection);
+
+	/// Stops routing the datagrams from the given endpoint to the given client connection, if they are routed to it. [main thread]
+	void DetachOutboundConnection(const EndPoint &peer, UDPMessageConnection *connection);
+
 	/// The Network object this NetworkServer was spawned from.
 	Network *owner;
 
-	/// Stores the thread that manages the background processing of this server. The same thread can manage multiple
-	/// connections and servers, and not just this one.
-	NetworkWorkerThread *workerThread; // [set and read only by worker thread]
-
-#ifdef KNET_THREAD_CHECKING_ENABLED
-	/// In debug mode, we track and enforce thread safety constraints through this ID. 
-	ThreadId workerThreadId; // [set by worker thread on thread startup, read by both main and worker thread]
-#endif
+	/// For each socket in listenSockets, stores the thread that reads that socket. The same thread can manage multiple
+	/// connections and servers, and not just this one. A UDP server that listens on several SO_REUSEPORT sockets of the
+	/// same port has each of them read by a different thread.
+	std::vector<NetworkWorkerThread *> listenSocketWorkerThreads; // [set by main thread while the worker threads are held, read by both]
 
 	/// If true, new connection attempts are processed. Otherwise, just discard all connection packets.
 	bool acceptNewConnections;
 
-	INetworkServerListener *networkServerListener;
+	SourceAddressFilter sourceFilter;
+
+	PacketCapture packetCapture;
+
+	EgressScheduler egressScheduler;
+
+	/// The multicast group that MulticastMessage() sends to. [main thread]
+	MulticastChannel multicastChannel;
+
+	/// The positions and interest radii of the clients, for BroadcastMessageAt(). [main thread]
+	InterestGrid<MessageConnection> interestGrid;
+	/// The recipients found by BroadcastMessageAt(), kept to not allocate at each call. [main thread]
+	std::vector<MessageConnection *> interestedConnections;
+
+	/// If true, the broadcasts are handed over to the worker threads. See SetWorkerThreadBroadcasts(). [main thread]
+	bool workerThreadBroadcasts;
 
-	/// Sets the worker thread object that will handle this server.
-	void SetWorkerThread(NetworkWorkerThread *thread); // [main thread]
+	/// Hands the given broadcast over to the worker threads that run connections, each of which takes its own reference to
+	/// the payload. [main thread]
+	/// @return False if worker thread broadcasts are disabled, or a worker thread is not running. The caller queues the
+	///         messages itself then.
+	bool BroadcastOnWorkerThreads(const WorkerBroadcast &broadcast);
 
-	NetworkWorkerThread *WorkerThread() const { return workerThread; }
+	/// Queues a message of the given shared payload to the given connection, if the connection is write-open.
+	static void QueueSharedMessage(MessageConnection *connection, DatagramBuffer *payload, unsigned long id, bool reliable,
+		bool inOrder, unsigned long priority, unsigned long contentID, size_t numBytes);
+
+	/// If true, a new UDP connection is only allocated once its peer has echoed back a cookie. [written by the main thread]
+	volatile bool connectionCookiesRequired;
+
+	/// The network interface the UDP listen sockets are read from through AF_XDP. See XdpInterface().
+	std::string xdpInterface;
+	/// The secret the connection cookies are computed with, generated when the server starts.
+	u8 connectionCookieKey[DatagramCipher::cKeySize];
+	/// The cookies are made for the current epoch of this many seconds, and accepted until the end of the next epoch.
+	static const int cConnectionCookieEpochSecs = 16;
+
+	/// The nonces of the early data that the new connections have brought in the recent cookie epochs, to refuse the early
+	/// data of a replayed connect datagram. [main thread]
+	StrikeRegister earlyDataNonces;
+
+	INetworkServerListener *networkServerListener;
+
+	/// Triggers the periodic rebalancing of the connections between the worker threads of the owner Network. [main thread]
+	PolledTimer workerRebalanceTimer;
+
+	/// Triggers the periodic tuning of the buffer sizes of the UDP listen sockets. [main thread]
+	PolledTimer bufferTuningTimer;
+
+	// The ready list: Process() only visits the connections that have messages to deliver or have closed. The worker threads
+	// add a connection to the list when they queue something for it, see MessageConnection::SignalMainThreadWork(). The list
+	// refers to the connections by their slots in readySlots, so that an entry left behind by a removed connection is harmless.
+	/// The slots of the connections that have work for Process(). [produced by the worker threads and the main thread, consumed by the main thread]
+	MPSCQueue<int> readyConnections;
+	/// Set if a connection did not fit in readyConnections. Process() then visits all the connections. [main and worker thread]
+	volatile long readyListOverflowed;
+
+	/// See NumMalformedDatagrams(). Incremented atomically by the worker threads of the client connections. [main and worker thread]
+	volatile long numMalformedDatagrams;
+	/// See NumAcceptQueueOverflows() and NumAcceptBacklogs(). [main thread]
+	unsigned long numAcceptQueueOverflows;
+	unsigned long numAcceptBacklogs;
+	/// The connection in each slot, or 0 if the slot is free. [main thread]
+	std::vector<MessageConnection *> readySlots;
+	std::vector<int> freeReadySlots;
+	/// The slots taken off readyConnections by TakeReadyConnections(). [main thread]
+	std::vector<int> readyBatch;
+	/// See SetInboundQuantum(). [main thread]
+	size_t inboundQuantum;
+	/// The connections taken off the ready list by TakeReadyConnections(), and the ones of them that still have messages
+	/// to pass on in the current round of ProcessReadyConnectionsFor(). [main thread]
+	std::vector<MessageConnection *> takenConnections;
+	std::vector<MessageConnection *> fairRound;
+	/// The closed connections that wait to be removed from the server, oldest first. [main thread]
+	std::deque<Ptr(MessageConnection)> deadConnections;
+	/// Process() removes at most this many closed connections per call, so that a mass disconnect is spread over several frames.
+	static const int cMaxConnectionsReclaimedPerProcess = 64;
+	/// Triggers the periodic sweep of all the connections for the closed ones, in case some were missed. [main thread]
+	PolledTimer deadConnectionSweepTimer;
+
+	/// Gives the connection a slot in readySlots, and remembers the key of the connection in the client list.
+	/// Call before the connection is assigned to a worker thread. [main thread]
+	void AssignReadySlot(MessageConnection *connection, const EndPoint &endPoint);
+	/// Frees the slot of a connection that is removed from the server. [main thread, clients locked]
+	void ReleaseReadySlot(MessageConnection *connection);
+	/// Adds the connection in the given slot to readyConnections. [main and worker thread]
+	void AddReadyConnection(int slot);
+	/// Calls Process() on the connections in readyConnections, or on all the connections if the list has overflowed. [main thread]
+	void ProcessReadyConnections();
+	/// Passes the messages of the connections in readyConnections to their handlers in turns until the deadline, see
+	/// ProcessFor(). [main thread]
+	void ProcessReadyConnectionsFor(tick_t deadline);
+	/// Takes the connections that have work for Process() off readyConnections to takenConnections, or all the connections
+	/// if the list has overflowed. [main thread]
+	void TakeReadyConnections();
+	/// The work Process() does before and after it visits the connections: flushing the multicast messages, reclaiming the
+	/// closed connections and accepting the new ones, and the periodic balancing and tuning. [main thread]
+	void ProcessBeforeConnections();
+	void ProcessAfterConnections();
+	/// Calls Process() on the given connection, and puts it back to the ready list if it has work left. [main thread]
+	void ProcessReadyConnection(MessageConnection *connection);
+
+	/// Sizes the buffers of the UDP listen sockets for the traffic of all the UDP connections of this server. [main thread]
+	void TuneUDPSocketBuffers();
+
+	/// Sets the worker thread object that will read the listen socket at the given index. [main thread]
+	void SetListenSocketWorkerThread(int listenSocketIndex, NetworkWorkerThread *thread);
+
+	/// Returns the worker thread that reads the listen socket at the given index, or null if none.
+	NetworkWorkerThread *ListenSocketWorkerThread(int listenSocketIndex) const;
+
+	/// Returns the distinct worker threads that handle the listen sockets of this server. [main thread]
+	std::vector<NetworkWorkerThread *> WorkerThreads() const;
+
+	/// Forgets the given worker thread from all the listen sockets it was assigned to. [main thread]
+	void DetachWorkerThread(NetworkWorkerThread *thread);
+
+	/// Returns the number of UDP listen sockets of this server that are read by the given thread.
+	int NumUDPListenSockets(const NetworkWorkerThread *thread) const;
+
+	/// Returns the number of UDP listen sockets of this server.
+	int NumUDPListenSockets() const;
 
 	/// If the server is running in UDP mode, the listenSocket is the socket that receives all application data.
-	/// This function pulls all new data from the socket and sends it to MessageConnection instances for deserialization and processing.
-	void ReadUDPSocketData(Socket *listenSocket); // [worker thread]
+	/// This function pulls up to cMaxDatagramsPerRead new datagrams from the socket and sends them to MessageConnection instances
+	/// for deserialization and processing.
+	/// @return The number of datagrams read.
+	int ReadUDPSocketData(Socket *listenSocket); // [worker thread]
+
+	/// The maximum number of datagrams ReadUDPSocketData reads from a listen socket at a time.
+	static const int cMaxDatagramsPerRead = 32;
+
+	/// Passes a datagram read from the given listen socket to the MessageConnection of its source, or queues it as a new
+	/// connection attempt if the source is not known. [worker thread]
+	void DatagramReceived(Socket *listenSocket, DatagramBuffer *buffer, const char *data, size_t numBytes, const EndPoint &source,
+		tick_t receiveTick, u8 ecn);
+
+	/// Returns the current epoch of the connection cookies. [main and worker thread]
+	static u32 ConnectionCookieEpoch();
+
+	/// Computes the connection cookie of the given peer for the given epoch. [main and worker thread]
+	void ComputeConnectionCookie(const EndPoint &peer, u32 epoch, u8 *cookie) const;
+
+	/// Returns true if the given connection attempt ends in a valid cookie, and leaves the cookie out of numBytes. Otherwise
+	/// sends the peer a connect challenge with a fresh cookie, and returns false. [worker thread]
+	bool CheckConnectionCookie(Socket *listenSocket, const EndPoint &peer, const char *data, size_t &numBytes) const;
 
 	void RegisterServerListener(INetworkServerListener *listener);
 
@@ -156,57 +510,109 @@ private:
 	/// This function is to be called only at destruction time when no network communication is being performed anymore.
 	void CloseSockets();
 
-	void CleanupDeadConnections();
+	/// Adds the given closed connection to deadConnections, unless it is there already. [main thread]
+	void QueueDeadConnection(MessageConnection *connection);
+
+	/// Queues all the closed connections that have not been queued yet. Only needed as a fallback, since the connections
+	/// are normally queued as soon as ProcessReadyConnection() sees them closed. [main thread]
+	void SweepDeadConnections();
+
+	/// Removes the oldest closed connections in deadConnections from the server, at most cMaxConnectionsReclaimedPerProcess
+	/// of them, and tells the server listener that they have disconnected. [main thread]
+	void ReclaimDeadConnections();
+
+	/// Process() accepts at most this many connections per stream listen socket per call, so that a mass reconnect is spread
+	/// over several frames instead of stalling one.
+	static const int cMaxConnectionsAcceptedPerProcess = 256;
+
+	/// Accepts the connections waiting on the given stream listen socket, at most cMaxConnectionsAcceptedPerProcess of them,
+	/// and adds them to the server. [main thread]
+	void AcceptConnections(Socket *listenSocket);
 
-	Socket *AcceptConnections(Socket *listenSocket);
+	/// Accepts the next connection waiting on the given stream listen socket.
+	/// @param client [out] The socket of the accepted connection, or 0 if the connection was refused.
+	/// @return False if no connection was waiting, or the listen socket failed. [main thread]
+	bool AcceptConnection(Socket *listenSocket, Socket *&client);
+
+	/// Builds a connection on top of the socket of an accepted stream connection, and adds it to the server. [main thread]
+	void AddAcceptedConnection(Socket *client);
+
+	/// Counts an overflow if the accept queue of the given TCP listen socket is full. [main thread]
+	void CheckAcceptQueue(Socket *listenSocket);
+
+	/// Accepts the next connection to the given SocketOverSharedMemory listen socket. [main thread]
+	Socket *AcceptSharedMemoryConnection(Socket *listenSocket);
+
+	/// The number of SocketOverSharedMemory connections accepted. Gives each of them an address of its own in the client
+	/// list, since they all come from the same host. [main thread]
+	u32 numSharedMemoryConnections;
 
 	struct ConnectionAttemptDescriptor
 	{
 		Socket *listenSocket;
 		EndPoint peer;
 		Datagram data;
+		/// True if the datagram is a migration request of an existing connection, instead of a new connection attempt.
+		bool migration;
 	};
 
 	WaitFreeQueue<ConnectionAttemptDescriptor> udpConnectionAttempts;
 
+	/// The queue above only allows a single producer. When the UDP listen sockets are read by several worker threads,
+	/// they take turns through this lock. Connection attempts are rare, so contention is not an issue.
+	Lockable<int> udpConnectionAttemptsLock; // [worker thread]
+
 	/// Called from the network worker thread.
-	void EnqueueNewUDPConnectionAttempt(Socket *listenSocket, const EndPoint &endPoint, const char *data, size_t numBytes);
+	void EnqueueNewUDPConnectionAttempt(Socket *listenSocket, const EndPoint &endPoint, const char *data, size_t numBytes, bool migration = false);
 
 	bool ProcessNewUDPConnectionAttempt(Socket *listenSocket, const EndPoint &endPoint, const char *data, size_t numBytes);
 
+	/// Moves the UDP connection of the given migration request to the address the request came from, keeping all the state
+	/// of the connection. The cookie of the request has been checked already, so the client receives at the new address.
+	/// The connection ID in the request tells which connection moved, and if the connection is encrypted, the tag shows
+	/// that the request comes from the client. [main thread]
+	bool ProcessUDPConnectionMigration(const EndPoint &endPoint, const char *data, size_t numBytes);
+
 	friend class Network;
 	friend class NetworkWorkerThread;
+	friend class MessageConnection;
 };
 
 template<typename SerializableData>
 void NetworkServer::BroadcastStruct(const SerializableData &data, unsigned long id, bool inOrder, 
 	bool reliable, unsigned long priority, unsigned long contentID, MessageConnection *exclude)
 {
-	PolledTimer timer;
-	Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
-	if (timer.MSecsElapsed() >= 50.f)
+	// Serialize the data once. Each client gets a message that refers to the same bytes.
+	const size_t dataSize = data.Size();
+	DatagramBuffer *payload = DatagramBuffer::Allocate(dataSize);
+	if (dataSize > 0)
 	{
-		KNET_LOG(LogWaits, "NetworkServer::BroadcastMessage: Accessing the connection list took %f msecs.",
-			timer.MSecsElapsed());
+		DataSerializer mb(payload->Data(), dataSize);
+		data.SerializeTo(mb);
+		assert(mb.BytesFilled() == dataSize); // The SerializableData::Size() estimate must be exact!
 	}
 
-	const size_t dataSize = data.Size();
+	WorkerBroadcast broadcast = { this, exclude, payload, dataSize, id, reliable, inOrder, 0, false, false, priority, contentID, 0 };
+	if (BroadcastOnWorkerThreads(broadcast))
+	{
+		payload->Release();
+		return;
+	}
 
-	for(ConnectionMap::iterator iter = clientsLock->begin(); iter != clientsLock->end(); ++iter)
+#ifdef KNET_NETWORK_PROFILING
+	char str[512];
+	sprintf(str, "%s (%u)", SerializableData::Name(), (unsigned int)id);
+#endif
+
+	ConnectionSnapshot snapshot = AcquireConnections();
+	for(ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
 	{
-		MessageConnection *connection = iter->second;
+		MessageConnection *connection = iter->connection;
 		assert(connection);
 		if (connection == exclude || !connection->IsWriteOpen())
 			continue;
 
-		NetworkMessage *msg = connection->StartNewMessage(id, dataSize);
-
-		if (dataSize > 0)
-		{
-			DataSerializer mb(msg->data, dataSize);
-			data.SerializeTo(mb);
-			assert(mb.BytesFilled() == dataSize); // The SerializableData::Size() estimate must be exact!
-		}
+		NetworkMessage *msg = connection->StartNewSharedMessage(id, payload, payload->Data(), dataSize);
 
 		msg->id = id;
 		msg->reliable = reliable;
@@ -215,13 +621,13 @@ void NetworkServer::BroadcastStruct(const SerializableData &data, unsigned long
 		msg->contentID = contentID;
 
 #ifdef KNET_NETWORK_PROFILING
-		char str[512];
-		sprintf(str, "%s (%u)", SerializableData::Name(), (unsigned int)id);
 		msg->profilerName = str;
 #endif
 
 		connection->EndAndQueueMessage(msg);
 	}
+
+	payload->Release();
 }
 
 template<typename SerializableMessage>
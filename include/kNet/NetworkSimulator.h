@@ -17,7 +17,7 @@
 	@brief The NetworkSimulator class, which enables different network conditions testing. */
 
 #include "kNetFwd.h"
-#include "PolledTimer.h"
+#include "TimerWheel.h"
 #include "Types.h"
 #include <vector>
 
@@ -26,8 +26,21 @@
 namespace kNet
 {
 
+class DatagramBuffer;
+
 /// A NetworkSimulator is attached to MessageConnections to add in an intermediate layer for
 /// network conditions testing.
+/** Each MessageConnection has two simulators: one for the datagrams it sends, and one for the datagrams it receives, so
+	that an asymmetric path can be simulated from one end only. A packet submitted to a simulator goes through the
+	following stages:
+	- The bottleneck link. If bandwidthBytesPerSec is set, the packets are sent onto the link one after another, and wait
+	  in the queue of the link while it is busy. A packet that does not fit in queueLimitBytes is dropped.
+	- Loss. Packets are dropped at packetLossRate, or in bursts by a two-state Gilbert-Elliott model if burstLossEnterRate
+	  is set.
+	- Delay. Each packet is delayed by constantPacketSendDelay, plus uniform random and normal or Pareto distributed jitter,
+	  and packets picked by packetReorderRate are held back for an extra packetReorderDelay.
+	The queued packets are kept on a TimerWheel, so that Process() and MSecsUntilNextTransfer() only cost anything when
+	packets are due. Each simulator has its own random number generator, see Seed(). [worker thread] */
 class NetworkSimulator
 {
 public:
@@ -39,14 +52,52 @@ public:
 	bool enabled;
 
 	/// Specifies the percentage of messages to drop. This is in the range [0.0, 1.0]. Default: 0 (disabled).
+	/// With burst loss enabled, this is the loss rate of the good state.
 	float packetLossRate;
 
+	/// The probability that the Gilbert-Elliott model moves from the good state to the bad state on each packet, in the
+	/// range [0.0, 1.0]. Default: 0 (burst loss disabled).
+	float burstLossEnterRate;
+
+	/// The probability that the Gilbert-Elliott model moves from the bad state back to the good state on each packet, in
+	/// the range [0.0, 1.0]. The mean length of a loss burst is 1 / burstLossExitRate packets. Default: 0.5.
+	float burstLossExitRate;
+
+	/// The percentage of packets to drop in the bad state of the Gilbert-Elliott model, in the range [0.0, 1.0]. Default: 1.
+	float burstPacketLossRate;
+
+	/// The bandwidth of the bottleneck link in bytes per second. Default: 0 (unlimited).
+	float bandwidthBytesPerSec;
+
+	/// The maximum number of bytes that wait for the bottleneck link. The packets that do not fit are dropped, like
+	/// in the tail-drop queue of a router. Only used if bandwidthBytesPerSec is set. Default: 0 (unlimited).
+	size_t queueLimitBytes;
+
 	/// Specifies a constant delay to add to each packet (msecs). Default: 0.
 	float constantPacketSendDelay;
 
 	/// Specifies an amount of uniformly random delay to add to each packet (msecs), [0, uniformRandomPacketSendDelay].  Default: 0.
 	float uniformRandomPacketSendDelay;
 
+	/// The distributions of packetDelayJitter.
+	enum JitterDistribution
+	{
+		JitterNormal, ///< The delay varies by a normal distribution whose standard deviation is packetDelayJitter. This is the default.
+		JitterPareto ///< The delay is increased by a heavy-tailed Pareto distribution (of shape 3) whose mean is packetDelayJitter.
+	};
+	JitterDistribution jitterDistribution;
+
+	/// Specifies the amount of jitter to add to the delay of each packet (msecs), see jitterDistribution. The delay of a
+	/// packet does not go below zero. Default: 0.
+	float packetDelayJitter;
+
+	/// Specifies the percentage of packets to hold back for packetReorderDelay, so that the packets after it overtake it.
+	/// This is in the range [0.0, 1.0]. Default: 0 (disabled).
+	float packetReorderRate;
+
+	/// The extra delay of the reordered packets (msecs). Default: 10.
+	float packetReorderDelay;
+
 	/// Specifies the percentage of messages to duplicate. This is in the range [0.0, 1.0]. Default: 0 (disabled). 
 	float packetDuplicationRate;
 
@@ -71,14 +122,34 @@ public:
 	/// The maximum number of bits to corrupt when a datagram is decided to be tampered. Default: 0.
 	int corruptMaxBits;
 
+	/// Queues the given send buffer of the owner's socket, which Process() then passes to Socket::EndSend() once it is due.
 	void SubmitSendBuffer(OverlappedTransferBuffer *buffer, Socket *socket);
 
+	/// Queues a copy of the given received datagram, which Process() then passes back to the owner once it is due.
+	void SubmitReceivedDatagram(const char *data, size_t numBytes);
+
 	/// Runs a polled update tick on the network simulator. Transfers all expired data.
 	void Process();
 
 	/// Discards and frees all currently queued messages.
 	void Free();
 
+	/// Returns the number of msecs until the next queued buffer is due to be sent out by Process(), or -1.f if no buffers are queued.
+	float MSecsUntilNextTransfer() const;
+
+	/// Returns the number of packets currently queued.
+	int NumQueuedPackets() const { return wheel.NumScheduled(); }
+
+	/// Returns the number of packets dropped by packetLossRate or the burst loss model so far.
+	u64 NumLostPackets() const { return numLostPackets; }
+
+	/// Returns the number of packets dropped so far because they did not fit in queueLimitBytes.
+	u64 NumQueueDrops() const { return numQueueDrops; }
+
+	/// Restarts the random number generator of this simulator from the given seed, and the burst loss model from the
+	/// good state, so that a simulation can be repeated.
+	void Seed(u32 seed);
+
 	/// Performs a random roll against the corruptToggleBitsRate counter, and perhaps corrupts some bits
 	/// of the given buffer.
 	/// Alters the raw byte buffer contents by flipping some bits according to the currently specified
@@ -86,14 +157,58 @@ public:
 	void MaybeCorruptBufferToggleBits(void *buffer, size_t numBytes) const;
 
 private:
-	struct QueuedBuffer
+	struct QueuedPacket
 	{
+		/// The send buffer to pass to the socket, or 0 if this is a received datagram.
 		OverlappedTransferBuffer *buffer;
-
-		/// Stores how long to delay this buffer until transfer.
-		PolledTimer timeUntilTransfer;
+		/// The copy of a received datagram, or 0 if this is a send buffer.
+		DatagramBuffer *datagram;
+		size_t size;
+		/// The msec the packet is due at, and its position in the order of submission, which breaks ties between the
+		/// packets due at the same msec.
+		u64 deadline;
+		u64 sequence;
 	};
-	std::vector<QueuedBuffer> queuedBuffers;
+	/// The queued packets, indexed by their timer id in wheel.
+	std::vector<QueuedPacket> packets;
+	/// The unused indices of packets.
+	std::vector<int> freeIds;
+	TimerWheel wheel;
+	/// The ids of the packets Process() is delivering.
+	std::vector<int> expired;
+	u64 nextSequence;
+
+	/// The time (msecs) the bottleneck link has sent out all the packets queued to it.
+	double linkFreeTime;
+	/// The state of the Gilbert-Elliott model.
+	bool burstLossState;
+
+	mutable u32 randomState;
+
+	u64 numLostPackets;
+	u64 numQueueDrops;
+
+	/// Returns a random number in the range [0, 2^32[.
+	u32 Random() const;
+	/// Returns a random float in the half-open interval [0, 1[.
+	float Random01() const;
+	/// Returns a random float in the closed interval [0, 1].
+	float Random01Incl() const;
+
+	/// Runs the link and loss stages of a packet of the given size that is submitted at the given msec, and returns the
+	/// time the packet leaves the link, or a negative value if the packet was dropped.
+	double AdmitPacket(size_t numBytes, double nowMSecs);
+
+	/// Returns the delay of a packet (msecs).
+	double PacketDelay();
+
+	/// Schedules the given packet to be delivered at the given time.
+	void Enqueue(QueuedPacket packet, double deliverMSecs);
+
+	/// Frees the buffer of a packet that is not going to be delivered.
+	void Discard(const QueuedPacket &packet);
+
+	struct DeliveryOrder;
 
 	MessageConnection *owner;
 
@@ -17,43 +17,408 @@
 	@brief The NetworkWorkerThread class. Implements a background thread for responsive
 	processing of server and client connections. */
 
+#include <vector>
+#include <utility>
+
 #include "SharedPtr.h"
 
 #include "Lockable.h"
+#include "EventArray.h"
+#include "TimerWheel.h"
 #include "MessageConnection.h"
 #include "NetworkServer.h"
 #include "Thread.h"
+#include "LatencyHistogram.h"
+#include "MPSCQueue.h"
+#include "SeqLock.h"
+
+#ifdef KNET_USE_IO_URING
+#include "unix/IoUring.h"
+#endif
+
+#ifdef KNET_USE_RIO
+#include "win32/RegisteredIO.h"
+#endif
+
+#ifdef KNET_USE_AF_XDP
+#include "unix/XdpSocket.h"
+#endif
 
 namespace kNet
 {
 
+class Network;
+
+/// The parts of the main loop of a worker thread that its time is accounted to, see NetworkWorkerThread::Profile().
+enum WorkerPhase
+{
+	WorkerPhaseRebuild, ///< Applying the added and removed connections and servers, and rebuilding the wait events.
+	WorkerPhaseUpdate, ///< MessageConnection::UpdateConnection(): the timers, acks, pings and statistics. Includes the idle sweeps.
+	WorkerPhaseRead, ///< MessageConnection::ReadSocket(), and reaping the io_uring completions.
+	WorkerPhaseSend, ///< MessageConnection::SendOutPackets(), and submitting the io_uring sends.
+	WorkerPhaseServerRead, ///< NetworkServer::ReadUDPSocketData() on the UDP listen sockets.
+	WorkerPhaseOther, ///< The rest of the loop: the timer wheel, the signalled events and the scheduling of the connections.
+	WorkerPhaseWait, ///< Sleeping in, or busy polling, EventArray::Wait(). The thread is idle only in this phase.
+	NumWorkerPhases
+};
+
+/// The running totals of where a worker thread has spent its time, and how much work its wakeups have brought.
+/** Take the difference of two profiles to get the figures of the time between them. */
+struct WorkerProfile
+{
+	WorkerProfile();
+
+	/// The time spent in each WorkerPhase, in Clock ticks.
+	u64 phaseTicks[NumWorkerPhases];
+	/// The number of times the thread has returned from EventArray::Wait().
+	u64 numWakeups;
+	/// The number of events signalled over all the wakeups.
+	u64 numEvents;
+	/// The datagrams the connections of the thread have received and sent, and that the thread has read from UDP listen sockets.
+	u64 numDatagramsIn;
+	u64 numDatagramsOut;
+
+	/// Returns the time spent in all the phases together, in ticks.
+	u64 TotalTicks() const;
+
+	/// Returns the time the thread has been doing something else than waiting for events, in ticks.
+	u64 BusyTicks() const { return TotalTicks() - phaseTicks[WorkerPhaseWait]; }
+
+	/// Returns the short name of the given phase, e.g. "update".
+	static const char *PhaseName(WorkerPhase phase);
+};
+
+/// The state a worker thread reads of each of its connections on every round, kept in a contiguous array apart from the
+/// connection objects. A UDPMessageConnection spans tens of kilobytes, so a pass over the connections through their objects
+/// misses the cache at least once for each, while the slots of a thousand connections take a few kilobytes in all.
+struct WorkerConnectionSlot
+{
+	WorkerConnectionSlot():connection(0), activity(0), idle(false) {}
+	explicit WorkerConnectionSlot(MessageConnection *connection_):connection(connection_), activity(0), idle(false) {}
+
+	/// The connection, or a null pointer once it has closed.
+	MessageConnection *connection;
+	/// A bit mask of the NetworkWorkerThread::ConnectionActivity flags.
+	u8 activity;
+	/// The MessageConnection::IsIdle() of the connection as of the last time it was processed. A connection only enters the
+	/// idle mode while it is processed, so this is never false for an idle connection. It can be true for a connection that
+	/// has received a message since, which MessageConnection::SendIdleKeepAlive() checks for.
+	bool idle;
+};
+
 class NetworkWorkerThread
 {
 public:
-	NetworkWorkerThread();
+	/// @param owner The Network that the profiling events of this thread are recorded to, or 0.
+	/// @param id The number that identifies this thread in the profiling events.
+	explicit NetworkWorkerThread(Network *owner = 0, int id = 0);
 
+	/// Hands the given connection over to this thread. Returns without waiting for the thread. [main thread]
 	void AddConnection(MessageConnection *connection);
+	/// Takes the given connection away from this thread. Returns when the thread no longer accesses the connection, which
+	/// is at the start of its next round. The other connections of the thread are not paused meanwhile. [main thread]
 	void RemoveConnection(MessageConnection *connection);
 
+	/// Hands the given server over to this thread. Returns without waiting for the thread. [main thread]
 	void AddServer(NetworkServer *server);
+	/// Takes the given server away from this thread. Returns when the thread no longer accesses the server or its
+	/// listen sockets. [main thread]
 	void RemoveServer(NetworkServer *server);
 
+	/// Has this thread queue the given broadcast to the client connections of broadcast.server that it runs. Takes a
+	/// reference to the payload, and returns without waiting for the thread. See NetworkServer::SetWorkerThreadBroadcasts().
+	/// [main thread]
+	void Broadcast(const WorkerBroadcast &broadcast);
+
 	void StartThread();
 	void StopThread();
 
 	int NumConnections() const;
 	int NumServers() const;
 
+	/// Returns a copy of the list of connections this thread manages. [main thread]
+	std::vector<MessageConnection *> Connections() const;
+
+	/// Returns an estimate of the amount of work this thread does, as the sum of ConnectionLoad() of its connections, and
+	/// for UDP servers, the datagrams received through their listen sockets. [main thread]
+	float Load() const;
+
+	/// Returns an estimate of the amount of work the given connection causes to its worker thread, based on its current
+	/// traffic statistics. The unit is roughly "datagrams per second". [main and worker thread]
+	static float ConnectionLoad(const MessageConnection &connection);
+
 	Thread &ThreadObject() { return workThread; }
 
+	/// Returns the histogram of the busy time of each round of the main loop, from waking up to waiting for the events
+	/// again. [main and worker thread]
+	const LatencyHistogram &RoundTimes() const { return roundTimes; }
+
+	/// Returns the totals of where this thread has spent its time, as of the end of its latest round of the main loop,
+	/// or its latest wakeup at most 10 msecs ago. [main and worker thread]
+	WorkerProfile Profile() const { return publishedProfile.Load(); }
+
+	/// Returns the number that identifies this thread in the profiling events. [main and worker thread]
+	int Id() const { return id; }
+
+	/// The time the sockets of a busy-polling thread have the kernel busy-poll the network device for, see Socket::SetBusyPoll().
+	static const int cBusyPollSocketUSecs = 50;
+
+	/// Makes this thread poll its sockets and the outbound message queues of its connections in a loop instead of sleeping
+	/// until they are signalled, which takes the wakeup latency of the thread off each message at the cost of keeping a core
+	/// busy. The sockets of the thread are set to busy-poll the network device as well. Once nothing has been signalled for
+	/// idleFallbackMSecs, the thread goes back to sleeping until the next event, and starts polling again after it. [main thread]
+	void SetBusyPolling(bool enabled, float idleFallbackMSecs = 1000.f);
+
+	/// Returns true if this thread is in the busy-polling mode. See SetBusyPolling(). [main and worker thread]
+	bool BusyPolling() const { return busyPolling; }
+
+	/// Pins this thread to the given logical processor, or lets it run on all of them if cpu is -1, and sets its scheduling
+	/// priority. If alignListenSockets is true, the UDP listen sockets that this thread reads are marked to be read on that
+	/// processor, see Socket::SetIncomingCPU(). When set before StartThread(), the thread applies the settings before it
+	/// allocates its data, so that the data lands on the NUMA node of the processor. [main thread]
+	void SetPlacement(int cpu, ThreadPriority priority = ThreadPriorityNormal, bool alignListenSockets = false);
+
+	/// Returns the processor this thread is pinned to, or -1. See SetPlacement(). [main and worker thread]
+	int Cpu() const { return cpu; }
+
+	/// Returns the scheduling priority of this thread. See SetPlacement(). [main and worker thread]
+	ThreadPriority Priority() const { return priority; }
+
 private:
+	/// The connections and the servers of this thread, as the main thread sees them. The worker thread has its own copies,
+	/// which it updates from the commands. [main thread]
 	Lockable<std::vector<MessageConnection *> > connections;
 	Lockable<std::vector<NetworkServer *> > servers;
 
+	enum CommandType
+	{
+		CommandAddConnection,
+		CommandRemoveConnection,
+		CommandAddServer,
+		CommandRemoveServer,
+		CommandBroadcast
+	};
+
+	/// A change to the connections or the servers of this thread, passed from the main thread to the worker thread.
+	struct Command
+	{
+		CommandType type;
+		MessageConnection *connection;
+		NetworkServer *server;
+		/// If not null, the worker thread sets this to true once it no longer accesses the removed object.
+		volatile bool *done;
+		/// The broadcast of a CommandBroadcast. Allocated by the main thread and deleted by the worker thread.
+		WorkerBroadcast *broadcast;
+	};
+
+	/// The size of the command queue. The worker drains it on every round, so it fills up only from a burst of connects.
+	static const int cCommandQueueSize = 1024;
+
+	/// The changes to the connections and the servers that the worker thread has yet to apply. [main and worker thread]
+	MPSCQueue<Command> commands;
+
 	Thread workThread;
 
+	/// Set to true by the main thread whenever a connection or a server is added or removed. [main and worker thread]
+	volatile bool listsChanged;
+
+	/// If true, MainLoop() polls the events in a loop instead of sleeping on them. See SetBusyPolling(). [written by main thread, read by worker thread]
+	volatile bool busyPolling;
+	/// The number of milliseconds without any events after which a busy-polling thread sleeps again. [written by main thread, read by worker thread]
+	volatile float busyPollIdleMSecs;
+
+	/// The placement of this thread. See SetPlacement(). [written by main thread, read by worker thread]
+	volatile int cpu;
+	volatile ThreadPriority priority;
+	volatile bool alignListenSockets;
+	/// Set to true by the main thread when the placement changes. [main and worker thread]
+	volatile bool placementChanged;
+
+	// The following are accessed only by the worker thread.
+
+	/// The connections and the servers of this thread as of the last command applied. [worker thread]
+	std::vector<MessageConnection *> ownConnections;
+	std::vector<NetworkServer *> ownServers;
+
+	/// The commands that wait for the wait events to be rebuilt before they are acknowledged. [worker thread]
+	std::vector<volatile bool *> pendingCommandAcks;
+
+	/// The hot state of each connection in the connections list. A connection that has closed is replaced with a null
+	/// pointer, so that the indices into waitEvents stay intact until the next rebuild. [worker thread]
+	std::vector<WorkerConnectionSlot> connectionSlots;
+	/// A copy of the servers list. [worker thread]
+	std::vector<NetworkServer *> serverList;
+	/// The UDP listen sockets this thread reads, in the order they appear in waitEvents after the connection events.
+	/// A server can have its listen sockets spread over several threads, so these are not all the sockets of serverList. [worker thread]
+	std::vector<std::pair<NetworkServer *, Socket *> > listenSocketList;
+
+	/// The events for each connection are registered once when the connection list changes, and after that only
+	/// updated when the connection is processed. At index 2*i is the read event of connection i, and at index 2*i+1 the
+	/// write event. After the events for each connection, we will have the UDP listen sockets in listenSocketList, and
+	/// last the interrupt event of the worker thread.
+	EventArray waitEvents; // [worker thread]
+
+	/// The index of the interrupt event of workThread in waitEvents. [worker thread]
+	int interruptEventIndex;
+
+#ifdef KNET_USE_IO_URING
+	/// Batches the datagram sends of the connections of this thread, and reads its UDP listen sockets. [worker thread]
+	IoUring ioUring;
+
+	/// The index of the completion event of ioUring in waitEvents, or -1 if the ring is not in use. [worker thread]
+	int ioUringEventIndex;
+
+	/// True if some of the sockets in listenSocketList are read through ioUring. [worker thread]
+	bool listenSocketsOnRing;
+
+	/// The listen sockets of the servers removed from this thread, whose receives on ioUring need to be stopped on the
+	/// next rebuild of the wait events. [worker thread]
+	std::vector<Socket *> removedListenSockets;
+#endif
+
+#ifdef KNET_USE_RIO
+	/// Sends the datagrams of the connections of this thread, and reads its UDP listen sockets and client sockets. [worker thread]
+	RegisteredIO registeredIO;
+
+	/// The index of the completion event of registeredIO in waitEvents, or -1 if it is not in use. [worker thread]
+	int registeredIOEventIndex;
+
+	/// The sockets of the connections and the servers removed from this thread, whose receives on registeredIO need to
+	/// be stopped on the next rebuild of the wait events. [worker thread]
+	std::vector<Socket *> removedRegisteredSockets;
+
+	/// The indices of the connections whose client sockets received datagrams through registeredIO. [worker thread]
+	std::vector<int> registeredIOReadyConnections;
+#endif
+
+#ifdef KNET_USE_AF_XDP
+	/// Reads the UDP listen sockets of the servers that use AF_XDP from a queue of the network card, and sends the datagrams
+	/// of the connections of this thread to their clients. [worker thread]
+	XdpSocket xdpSocket;
+
+	/// The index of the receive event of xdpSocket in waitEvents, or -1 if it is not in use. [worker thread]
+	int xdpEventIndex;
+
+	/// The listen sockets of the servers removed from this thread, whose receives on xdpSocket need to be stopped on the
+	/// next rebuild of the wait events. [worker thread]
+	std::vector<Socket *> removedXdpSockets;
+#endif
+
+	/// The busy times of the rounds of MainLoop(). [written by worker, read by main and worker thread]
+	LatencyHistogram roundTimes;
+
+	Network *owner;
+	int id;
+
+	/// The profile that the thread accumulates. [worker thread]
+	WorkerProfile profile;
+	/// A copy of profile, published every few milliseconds. [written by worker, read by main and worker thread]
+	SeqLock<WorkerProfile> publishedProfile;
+	/// The phase the thread is currently in, and the time it entered it. [worker thread]
+	WorkerPhase currentPhase;
+	tick_t phaseStartTick;
+	/// The time publishedProfile was last updated. [worker thread]
+	tick_t profilePublishTick;
+#ifdef KNET_NETWORK_PROFILING
+	/// The profile as of the last profiling events recorded to the owner, and the time they were recorded. [worker thread]
+	WorkerProfile sampledProfile;
+	tick_t profileSampleTick;
+#endif
+
+	/// An event that is always false and will never be set. Used to fill in the event slots that are not waited on.
+	Event falseEvent; // [worker thread]
+
+	/// The indices of the connections that need to be updated on the next round: those that had their events
+	/// signalled, or whose timers expired. [worker thread]
+	std::vector<int> activeConnections;
+
+	/// Holds the time of the next timer-driven update (pings, statistics, acks, retransmissions, send throttle) of each
+	/// connection, keyed by the connection index. [worker thread]
+	TimerWheel timerWheel;
+
+	/// A temporary list for the connection indices whose timers expired on this round. [worker thread]
+	std::vector<int> expiredTimers;
+
+	/// The time of the next keepalive sweep of the idle connections, in the milliseconds of timerWheel. [worker thread]
+	u64 nextIdleSweepTime;
+
+	/// The time an event was last signalled while busy polling. [worker thread]
+	tick_t lastBusyPollEventTick;
+
+	/// True if the sockets of this thread have been set to busy-poll the network device. [worker thread]
+	bool socketsBusyPolled;
+
+	/// The placement this thread has applied to itself. [worker thread]
+	int appliedCpu;
+	ThreadPriority appliedPriority;
+
+	/// True if the listen sockets of this thread have been marked with the processor of the thread. [worker thread]
+	bool listenSocketsAligned;
+
+	enum ConnectionActivity
+	{
+		ActivityActive = 1, ///< The connection is in the activeConnections list.
+		ActivityRead = 2, ///< The read event of the connection was signalled.
+		ActivityThrottled = 4 ///< The connection has data to send and is only waiting for its send throttle timer.
+	};
+
 	/// The entry point for the work thread, which runs a loop that manages network connections.
 	void MainLoop();
+
+	/// Copies the connection and server lists and registers all their events to waitEvents. [worker thread]
+	void RebuildWaitEvents();
+
+	/// Passes the given command to the worker thread, and if wait is true, returns only after the thread has applied it. [main thread]
+	void PostCommand(CommandType type, MessageConnection *connection, NetworkServer *server, bool wait, WorkerBroadcast *broadcast = 0);
+
+	/// Applies the commands in the queue to ownConnections and ownServers. [worker thread, or main thread if the worker is not running]
+	void ProcessCommands();
+
+	/// Queues the given broadcast to the connections in ownConnections that are clients of its server. [worker thread]
+	void QueueBroadcast(const WorkerBroadcast &broadcast);
+
+	/// Tells the waiting callers that their commands have been applied. [worker thread, or main thread if the worker is not running]
+	void AcknowledgeCommands();
+
+	/// Adds the given connection to the list of connections to update on this round. [worker thread]
+	void ActivateConnection(int index, u8 activity);
+
+	/// Runs the update and the socket reads and writes of the given connection. [worker thread]
+	void ProcessConnection(int index);
+
+	/// Calls UpdateConnection on the given connection and removes it from the wait list if it has closed.
+	/// @return True if the connection is still alive. [worker thread]
+	bool UpdateConnection(int index);
+
+	/// Updates the events waitEvents waits on for the given connection. [worker thread]
+	void UpdateConnectionWaitEvents(int index);
+
+	/// Schedules the next timer-driven update of the given connection on timerWheel. An idle connection that has nothing
+	/// to do before the next keepalive sweep is left for the sweep instead. [worker thread]
+	void ScheduleConnectionUpdate(int index);
+
+	/// Sends the keepalives of all the idle connections, and activates them to be processed on this round. [worker thread]
+	void SweepIdleConnections();
+
+	/// Returns the number of milliseconds the worker thread can sleep before the next timer expires. [worker thread]
+	int ComputeWaitTime() const;
+
+	/// Polls waitEvents without sleeping until some of them are signalled or the next timer expires, or sleeps on them if the
+	/// thread has been without events for longer than busyPollIdleMSecs. Returns like EventArray::Wait(). [worker thread]
+	int BusyPollWait(std::vector<int> &signalledIndices);
+
+	/// Sets the busy polling of the sockets of the connections and the listen sockets of this thread on or off. [worker thread]
+	void SetSocketsBusyPolled(bool enabled);
+
+	/// Applies the affinity and the priority of SetPlacement() to the calling thread, if they have changed. [worker thread]
+	void ApplyPlacement();
+
+	/// Accounts the time since the previous call to the current phase, and moves on to the given phase. [worker thread]
+	void EnterPhase(WorkerPhase phase);
+
+	/// Publishes the profile to Profile() if enough time has passed since the last time, and once a second, records the
+	/// busy time, the phase shares and the work per wakeup of the last second as profiling events to the owner. [worker thread]
+	void PublishProfile();
 };
 
 #ifdef WIN32
@@ -26,7 +26,7 @@ public:
 	struct Node
 	{
 		Node()
-		:next(0), prev(0), hashChain(0), used(false)
+		:used(false), next(0), prev(0), hashChain(0)
 		{
 		}
 
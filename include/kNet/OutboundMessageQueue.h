@@ -0,0 +1,119 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file OutboundMessageQueue.h
+	@brief The OutboundMessageQueue class, which holds the messages of a connection that are waiting to be sent out. */
+
+#include <deque>
+#include <vector>
+
+#include "MaxHeap.h"
+#include "WaitFreeQueue.h"
+#include "NetworkMessage.h"
+
+namespace kNet
+{
+
+/// Comparison object that sorts the two messages by their priority (higher priority/smaller number first).
+class NetworkMessagePriorityCmp
+{
+public:
+	int operator ()(const NetworkMessage *a, const NetworkMessage *b)
+	{
+		assert(a && b);
+		if (a->priority < b->priority) return -1;
+		if (b->priority < a->priority) return 1;
+
+		if (a->MessageNumber() < b->MessageNumber()) return 1;
+		if (b->MessageNumber() < a->MessageNumber()) return -1;
+
+		return 0;
+	}
+};
+
+/// Specifies the data structure a connection keeps its outbound messages in. See MessageConnection::SetOutboundQueueType().
+enum OutboundQueueType
+{
+	OutboundQueuePriorityHeap,    ///< A binary max-heap. O(log n) insertion and removal for any mix of priorities. The default.
+	OutboundQueuePriorityBuckets, ///< A FIFO bucket for each distinct priority. O(1) insertion and removal when the messages use a handful of priority values.
+	OutboundQueueFIFO             ///< Sends the messages in the order they were queued, disregarding their priorities. The cheapest, for peers that don't need priorization.
+};
+
+/// Returns a human-readable name of the given queue type.
+const char *OutboundQueueTypeToString(OutboundQueueType type);
+
+/// A priority queue of the outbound messages of a connection. The underlying data structure can be changed at runtime,
+/// which keeps the messages that are already queued. Except for the FIFO type, Front() is the message with the highest
+/// priority, and of the messages with that priority, the one that was admitted first (has the smallest MessageNumber()).
+/// [worker thread]
+class OutboundMessageQueue
+{
+public:
+	explicit OutboundMessageQueue(OutboundQueueType type = OutboundQueuePriorityHeap);
+	~OutboundMessageQueue();
+
+	OutboundQueueType Type() const { return type; }
+
+	/// Moves all the queued messages to a data structure of the given type.
+	void SetType(OutboundQueueType newType);
+
+	void Insert(NetworkMessage *msg);
+
+	/// Returns the message that should be sent out next. UDB if the queue is empty.
+	NetworkMessage *Front() const;
+
+	/// Removes the message returned by Front(). UDB if the queue is empty.
+	void PopFront();
+
+	/// Returns the number of messages in the queue. [main and worker thread]
+	size_t Size() const { return numMessages; }
+
+	/// Removes all messages from the queue. Does not free the messages.
+	void Clear();
+
+private:
+	/// The messages of a single priority value, in the order of their MessageNumbers.
+	struct PriorityBucket
+	{
+		unsigned long priority;
+		std::deque<NetworkMessage*> messages;
+	};
+
+	/// Returns the index of the bucket for the given priority, and creates the bucket if it doesn't exist yet.
+	size_t FindOrCreateBucket(unsigned long priority);
+
+	/// Deletes the buckets that are empty, once there are so many buckets that looking one up could slow down.
+	/// @return False if all the buckets were in use, and none were deleted.
+	bool PruneEmptyBuckets();
+
+	OutboundQueueType type;
+	size_t numMessages;
+
+	MaxHeap<NetworkMessage*, NetworkMessagePriorityCmp> heap;
+
+	WaitFreeQueue<NetworkMessage*> fifo;
+
+	/// The buckets of OutboundQueuePriorityBuckets, in the order of decreasing priority.
+	std::vector<PriorityBucket*> buckets;
+	/// The index of the first nonempty bucket, or buckets.size() if the queue is empty.
+	size_t frontBucket;
+	/// The index of the bucket the latest message was inserted to. Most consecutive messages share a priority.
+	size_t lastInsertBucket;
+
+	OutboundMessageQueue(const OutboundMessageQueue &); ///< Not implemented.
+	void operator =(const OutboundMessageQueue &); ///< Not implemented.
+};
+
+} // ~kNet
@@ -0,0 +1,140 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file PacketCapture.h
+	@brief The PacketCapture class, which records the raw datagrams and stream blocks of a NetworkServer to a file. */
+
+#include <vector>
+#include <cstdio>
+
+#include "Types.h"
+#include "Clock.h"
+#include "EndPoint.h"
+#include "Socket.h"
+#include "MPSCQueue.h"
+#include "Thread.h"
+
+namespace kNet
+{
+
+/// Tells whether a captured packet was received or sent by the capturing end.
+enum PacketCaptureDirection
+{
+	CaptureInbound,
+	CaptureOutbound
+};
+
+/// A packet read back from a capture file.
+struct CapturedPacket
+{
+	/// The time the packet was captured at, in microseconds since the capture was started.
+	u64 timeMicros;
+	/// The address of the other end of the connection.
+	EndPoint peer;
+	PacketCaptureDirection direction;
+	SocketTransportLayer transport;
+	/// The size of the packet. Larger than data.size() if the packet was longer than PacketCapture::cSnapLength.
+	u32 originalBytes;
+	std::vector<char> data;
+};
+
+/// Records the datagrams and TCP stream blocks a NetworkServer receives and sends to a capture file, with timestamps.
+/** The worker threads copy each packet straight into a slot of a lock-free MPSCQueue, and a writer thread of the capture
+	appends the slots to the file, so the capture can be left on in production. When the writer falls behind and the ring
+	is full, the packets are dropped from the capture and counted in NumDroppedPackets(). A capture that is not running
+	costs a single test per packet.
+	
+	The packets are captured as they are on the wire, encrypted if the connection is. A datagram longer than cSnapLength
+	is cut short, while a stream block is split into as many packets as it takes, so that a captured TCP stream is
+	complete. The sendfile() data of file messages is captured from the mapped file.
+
+	The capture file starts with the 8 bytes "kNetCap1", followed by the packets. Each packet has a 22-byte little-endian
+	header: u64 timeMicros, u32 originalBytes, u16 capturedBytes, u8 direction, u8 transport, the 4 bytes of the IPv4
+	address and the u16 port of the peer. The capturedBytes of the packet follow the header. */
+class PacketCapture
+{
+public:
+	/// The most bytes of a packet that are captured.
+	static const int cSnapLength = 2048;
+	/// The number of packets the ring between the worker threads and the writer thread holds.
+	static const int cRingSize = 4096;
+
+	PacketCapture();
+	~PacketCapture();
+
+	/// Starts capturing to the given file, which is overwritten. Stops the capture that was running, if any. [main thread]
+	/// @return False if the file could not be created.
+	bool Start(const char *filename);
+
+	/// Stops capturing, writes out the packets left in the ring and closes the file. [main thread]
+	void Stop();
+
+	/// Returns true if a capture is running. [thread-safe]
+	bool IsCapturing() const { return capturing; }
+
+	/// Captures the given packet if a capture is running. [thread-safe]
+	void Record(PacketCaptureDirection direction, SocketTransportLayer transport, const EndPoint &peer, const char *data, size_t numBytes)
+	{
+		if (capturing)
+			RecordPacket(direction, transport, peer, data, numBytes);
+	}
+
+	/// Returns the number of packets captured since Start(). [thread-safe]
+	u32 NumCapturedPackets() const { return (u32)numCapturedPackets; }
+
+	/// Returns the number of packets left out of the capture since Start(), since the ring was full. [thread-safe]
+	u32 NumDroppedPackets() const { return (u32)numDroppedPackets; }
+
+	/// Reads all the packets of the given capture file.
+	/// @return False if the file could not be opened or is not a capture file. The packets up to a truncated end of the
+	/// file are returned.
+	static bool ReadFile(const char *filename, std::vector<CapturedPacket> &packets);
+
+private:
+	struct Slot
+	{
+		tick_t tick;
+		u32 originalBytes;
+		u16 capturedBytes;
+		u8 direction;
+		u8 transport;
+		EndPoint peer;
+		char data[cSnapLength];
+	};
+
+	/// Allocated on the first Start(), and kept until the capture is destroyed, so that a worker thread that sees the
+	/// capture running just before it is stopped still has a ring to write to.
+	MPSCQueue<Slot> *ring;
+	volatile bool capturing;
+	FILE *file;
+	tick_t startTick;
+	volatile long numCapturedPackets;
+	volatile long numDroppedPackets;
+	Thread writerThread;
+
+	void RecordPacket(PacketCaptureDirection direction, SocketTransportLayer transport, const EndPoint &peer, const char *data, size_t numBytes);
+
+	/// Writes the packets in the ring to the file until the capture is stopped. [writer thread]
+	void WriterLoop();
+
+	/// Writes the packets in the ring to the file, if there is one, and frees their slots.
+	/// @return The number of packets written.
+	int WriteQueuedPackets();
+
+	PacketCapture(const PacketCapture &); ///< Not implemented.
+	void operator =(const PacketCapture &); ///< Not implemented.
+};
+
+} // ~kNet
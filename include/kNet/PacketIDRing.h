@@ -0,0 +1,180 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file PacketIDRing.h
+	@brief The PacketIDRing class, which tracks the datagrams in flight by their PacketIDs. */
+
+#include <vector>
+#include <cassert>
+
+#include "Types.h"
+#include "Alignment.h"
+
+namespace kNet
+{
+
+/// A ring of items indexed directly by (PacketID % capacity), and threaded on an intrusive list in the order they were inserted.
+/** Used for the reliable datagrams in flight, which are inserted in the order of their PacketIDs as they are sent out.
+	Inserting an item, finding the item of a PacketID and erasing an item are all O(1), and the items can be walked from
+	the oldest to the newest without visiting the slots of the PacketIDs that are not in the ring.
+
+	If the slot of a new PacketID is still taken by an older item, the ring doubles its capacity, so that it can hold as
+	many datagrams in flight as needed. The pointers to the items are valid until the next call to Insert() or Clear().
+
+	T must have the member 'packet_id_t packetID', and be default-constructible and copyable. This class is not thread-safe. */
+template<typename T>
+class PacketIDRing
+{
+public:
+	/// @param initialCapacity The number of slots to start with. A power of two.
+	explicit PacketIDRing(int initialCapacity = 1024)
+	:capacity(initialCapacity), numItems(0), oldest(-1), newest(-1)
+	{
+		assert(IS_POW2(initialCapacity));
+		items.resize(capacity);
+		Links unused = { -1, -1, false };
+		links.resize(capacity, unused);
+	}
+
+	/// Returns the number of items in the ring.
+	int Size() const { return numItems; }
+
+	/// Returns the number of slots in the ring.
+	int Capacity() const { return capacity; }
+
+	/// Removes all items.
+	void Clear()
+	{
+		for(int i = 0; i < capacity; ++i)
+			if (links[i].used)
+			{
+				items[i] = T();
+				links[i].used = false;
+			}
+		numItems = 0;
+		oldest = newest = -1;
+	}
+
+	/// Adds a copy of the given item to the ring. Its PacketID must be newer than the PacketIDs of all the items in the ring.
+	/// @return The copy in the ring.
+	T *Insert(const T &item)
+	{
+		int index = Slot(item.packetID);
+		while(links[index].used)
+		{
+			Grow();
+			index = Slot(item.packetID);
+		}
+		items[index] = item;
+		Links &l = links[index];
+		l.used = true;
+		l.prev = newest;
+		l.next = -1;
+		if (newest != -1)
+			links[newest].next = index;
+		else
+			oldest = index;
+		newest = index;
+		++numItems;
+		return &items[index];
+	}
+
+	/// Returns the item of the given PacketID, or 0 if there is none.
+	T *Find(packet_id_t packetID)
+	{
+		const int index = Slot(packetID);
+		return (links[index].used && items[index].packetID == packetID) ? &items[index] : 0;
+	}
+
+	/// Removes the given item from the ring.
+	void Erase(T *item)
+	{
+		const int index = IndexOf(item);
+		Links &l = links[index];
+		assert(l.used);
+		if (l.prev != -1)
+			links[l.prev].next = l.next;
+		else
+			oldest = l.next;
+		if (l.next != -1)
+			links[l.next].prev = l.prev;
+		else
+			newest = l.prev;
+		l.used = false;
+		--numItems;
+	}
+
+	/// Returns the item that was inserted first, or 0 if the ring is empty.
+	T *Oldest() { return ItemOrNull(oldest); }
+
+	/// Returns the item that was inserted last, or 0 if the ring is empty.
+	T *Newest() { return ItemOrNull(newest); }
+
+	/// Returns the item that was inserted after the given one, or 0 if there is none.
+	T *Next(T *item) { return ItemOrNull(links[IndexOf(item)].next); }
+
+private:
+	struct Links
+	{
+		int prev;
+		int next;
+		bool used;
+	};
+
+	std::vector<T> items;
+	std::vector<Links> links;
+	int capacity;
+	int numItems;
+	/// The ends of the list of items in the insertion order. -1 if the ring is empty.
+	int oldest;
+	int newest;
+
+	int Slot(packet_id_t packetID) const { return (int)(packetID & (capacity - 1)); }
+	int IndexOf(const T *item) const { return (int)(item - &items[0]); }
+	T *ItemOrNull(int index) { return (index != -1) ? &items[index] : 0; }
+
+	/// Moves the items to a ring of twice the capacity. The items that had different slots still do, since the slot is
+	/// taken modulo the capacity.
+	void Grow()
+	{
+		const int newCapacity = capacity * 2;
+		std::vector<T> newItems(newCapacity);
+		Links unused = { -1, -1, false };
+		std::vector<Links> newLinks(newCapacity, unused);
+		for(int i = 0; i < capacity; ++i)
+			if (links[i].used)
+			{
+				const int index = NewSlot(i, newCapacity);
+				assert(!newLinks[index].used);
+				newItems[index] = items[i];
+				newLinks[index].prev = NewSlot(links[i].prev, newCapacity);
+				newLinks[index].next = NewSlot(links[i].next, newCapacity);
+				newLinks[index].used = true;
+			}
+		oldest = NewSlot(oldest, newCapacity);
+		newest = NewSlot(newest, newCapacity);
+		items.swap(newItems);
+		links.swap(newLinks);
+		capacity = newCapacity;
+	}
+
+	/// Returns the slot the item at the given index moves to in a ring of the given capacity.
+	int NewSlot(int index, int newCapacity) const
+	{
+		return (index != -1) ? (int)(items[index].packetID & (newCapacity - 1)) : -1;
+	}
+};
+
+} // ~kNet
@@ -0,0 +1,213 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file PacketIDWindow.h
+	@brief The PacketIDWindow class, which tracks the PacketIDs a UDP connection has received and has yet to ack. */
+
+#include <cstring>
+
+#include "Types.h"
+#include "Clock.h"
+#include "BitOps.h"
+
+namespace kNet
+{
+
+/// A sliding window of bits over the most recent PacketIDs a connection has received.
+/** The window covers the cWindowSize PacketIDs up to the newest one received, and holds two bits for each: whether the
+	datagram has been received, and whether it still needs to be acked. A PacketID maps to the bit (id % cWindowSize), so
+	marking a datagram received, checking for a duplicate and queueing an ack are a few bit operations, and the window
+	never allocates after construction. When a newer PacketID is received, the window slides forward and the bits of the
+	PacketIDs that fall off its far end are cleared.
+
+	A PacketID older than the window is reported as received. Such a datagram is either a duplicate, or so late that its
+	reliable messages have been resent in a newer datagram already, so it is dropped without an ack.
+
+	PacketIDs are 22-bit numbers that wrap around. A PacketID less than half of the range ahead of the newest one is
+	taken to be newer. This class is not thread-safe. */
+class PacketIDWindow
+{
+public:
+	/// The number of PacketIDs the window covers. A power of two.
+	static const u32 cWindowSize = 8192;
+
+	PacketIDWindow()
+	{
+		Clear();
+	}
+
+	/// Forgets all the PacketIDs received.
+	void Clear()
+	{
+		memset(received, 0, sizeof(received));
+		memset(pendingAcks, 0, sizeof(pendingAcks));
+		newest = 0;
+		empty = true;
+		numPendingAcks = 0;
+		firstPendingAckTick = 0;
+	}
+
+	/// Returns true if the given PacketID has been marked received, or is older than the window.
+	bool HasReceived(packet_id_t id) const
+	{
+		if (empty)
+			return false;
+		const u32 age = Age(id);
+		if (age >= cAheadAge)
+			return false;
+		return age >= cWindowSize || TestBit(received, id);
+	}
+
+	/// Marks the given PacketID received, sliding the window forward if it is newer than any received before.
+	void MarkReceived(packet_id_t id)
+	{
+		if (!Slide(id))
+			return;
+		received[Word(id)] |= Bit(id);
+	}
+
+	/// Queues an ack for the given PacketID. Does nothing if the PacketID is older than the window.
+	void AddPendingAck(packet_id_t id, tick_t now)
+	{
+		if (!Slide(id) || TestBit(pendingAcks, id))
+			return;
+		pendingAcks[Word(id)] |= Bit(id);
+		if (numPendingAcks++ == 0)
+			firstPendingAckTick = now;
+	}
+
+	/// Removes the given PacketID from the acks to send.
+	void ClearPendingAck(packet_id_t id)
+	{
+		if (empty || Age(id) >= cWindowSize || !TestBit(pendingAcks, id))
+			return;
+		pendingAcks[Word(id)] &= ~Bit(id);
+		--numPendingAcks;
+	}
+
+	/// Returns the number of PacketIDs that have an ack pending.
+	int NumPendingAcks() const { return numPendingAcks; }
+
+	/// Returns the time when the oldest of the currently pending acks was queued.
+	tick_t FirstPendingAckTick() const { return firstPendingAckTick; }
+
+	/// Finds the oldest PacketID at or after the given one that has an ack pending.
+	/// @param id [out] Receives the PacketID found.
+	/// @return False if no PacketID from the given one to the newest one has an ack pending.
+	bool NextPendingAck(packet_id_t from, packet_id_t &id) const
+	{
+		if (numPendingAcks == 0)
+			return false;
+		u32 age = Age(from);
+		if (age >= cAheadAge)
+			return false;
+		if (age >= cWindowSize)
+			age = cWindowSize - 1;
+
+		// Scan the bits from the given PacketID to the newest one, a word at a time.
+		u32 numLeft = age + 1;
+		u32 slot = (newest - age) & (cWindowSize - 1);
+		while(numLeft > 0)
+		{
+			const u32 shift = slot & 63;
+			const u32 numBits = (numLeft < 64 - shift) ? numLeft : 64 - shift;
+			u64 bits = pendingAcks[slot / 64] >> shift;
+			if (numBits < 64)
+				bits &= ((u64)1 << numBits) - 1;
+			if (bits != 0)
+			{
+				const u32 offset = (age + 1 - numLeft) + (u32)LSBIndex64(bits);
+				id = (newest - age + offset) & cPacketIDMask;
+				return true;
+			}
+			numLeft -= numBits;
+			slot = (slot + numBits) & (cWindowSize - 1);
+		}
+		return false;
+	}
+
+	/// Returns the oldest PacketID that has an ack pending. Call only when NumPendingAcks() > 0.
+	packet_id_t FirstPendingAck() const
+	{
+		packet_id_t id = newest;
+		NextPendingAck((newest - (cWindowSize - 1)) & cPacketIDMask, id);
+		return id;
+	}
+
+private:
+	static const u32 cPacketIDMask = (1 << 22) - 1;
+	/// A PacketID at least this far behind the newest one is taken to be ahead of it instead.
+	static const u32 cAheadAge = 1 << 21;
+	static const u32 cNumWords = cWindowSize / 64;
+
+	u64 received[cNumWords];
+	u64 pendingAcks[cNumWords];
+	/// The newest PacketID received, the front end of the window.
+	packet_id_t newest;
+	/// True until the first PacketID is received.
+	bool empty;
+	int numPendingAcks;
+	tick_t firstPendingAckTick;
+
+	/// Returns how many PacketIDs behind the newest one the given PacketID is, modulo the 22-bit range.
+	u32 Age(packet_id_t id) const { return (u32)((newest - id) & cPacketIDMask); }
+
+	static u32 Word(packet_id_t id) { return (u32)(id & (cWindowSize - 1)) / 64; }
+	static u64 Bit(packet_id_t id) { return (u64)1 << (id & 63); }
+	static bool TestBit(const u64 *bits, packet_id_t id) { return (bits[Word(id)] & Bit(id)) != 0; }
+
+	/// Slides the window forward so that it covers the given PacketID, and clears the bits of the PacketIDs it passes.
+	/// @return False if the PacketID is older than the window.
+	bool Slide(packet_id_t id)
+	{
+		id &= cPacketIDMask;
+		if (empty)
+		{
+			empty = false;
+			newest = id;
+			return true;
+		}
+		const u32 age = Age(id);
+		if (age < cWindowSize)
+			return true;
+		if (age < cAheadAge)
+			return false;
+
+		// The slots of the new PacketIDs held the PacketIDs that fall off the far end of the window. Their pending acks are
+		// lost, but the peer will resend their reliable messages.
+		const u32 advance = (u32)((id - newest) & cPacketIDMask);
+		if (advance >= cWindowSize)
+		{
+			memset(received, 0, sizeof(received));
+			memset(pendingAcks, 0, sizeof(pendingAcks));
+			numPendingAcks = 0;
+		}
+		else
+			for(u32 i = 1; i <= advance; ++i)
+			{
+				const packet_id_t slotID = newest + i;
+				received[Word(slotID)] &= ~Bit(slotID);
+				if (TestBit(pendingAcks, slotID))
+				{
+					pendingAcks[Word(slotID)] &= ~Bit(slotID);
+					--numPendingAcks;
+				}
+			}
+		newest = id;
+		return true;
+	}
+};
+
+} // ~kNet
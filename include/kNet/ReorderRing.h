@@ -0,0 +1,169 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file ReorderRing.h
+	@brief The ReorderRing class, which holds the items received ahead of their turn until the items before them arrive. */
+
+#include <vector>
+#include <cassert>
+
+#include "Types.h"
+#include "Alignment.h"
+
+namespace kNet
+{
+
+/// A ring of items indexed directly by (sequence number % capacity), relative to the sequence number to release next.
+/** Used for the in-order messages that arrive before the ones ahead of them on their channel. Holding an item and
+	checking for one are O(1), and once the gap is filled, PopNext() releases the run of items that follow it in order.
+
+	If a sequence number is a capacity or more ahead of the next one, the ring doubles its capacity, so the ring only
+	allocates when the reorder distance reaches a new maximum, not for each item held. The references to the items are
+	valid until the next call to Hold().
+
+	T must be default-constructible and copyable. This class is not thread-safe. */
+template<typename T>
+class ReorderRing
+{
+public:
+	/// @param initialCapacity The number of slots to start with. A power of two.
+	explicit ReorderRing(int initialCapacity = 64)
+	:capacity(initialCapacity), numItems(0), next(0)
+	{
+		assert(IS_POW2(initialCapacity));
+	}
+
+	/// Returns the number of items held.
+	int Size() const { return numItems; }
+
+	/// Returns the number of slots in the ring. Zero until the first item is held.
+	int Capacity() const { return (int)used.size(); }
+
+	/// Returns the sequence number to release next.
+	u32 Next() const { return next; }
+
+	/// Returns true if an item is held for the given sequence number.
+	bool Contains(u32 sequence) const
+	{
+		return sequence - next < (u32)used.size() && used[Slot(sequence)];
+	}
+
+	/// Returns the slot of the given sequence number, which must be ahead of Next(), and marks it held. If the slot already
+	/// held an item, returns that item.
+	T &Hold(u32 sequence)
+	{
+		assert(sequence != next);
+		const u32 ahead = sequence - next;
+		if (used.empty())
+		{
+			items.resize(capacity);
+			used.resize(capacity, false);
+		}
+		while(ahead >= (u32)used.size())
+			Grow();
+		const int index = Slot(sequence);
+		if (!used[index])
+		{
+			used[index] = true;
+			++numItems;
+		}
+		return items[index];
+	}
+
+	/// Moves the ring to start from the given sequence number. The ring must not hold any items.
+	void SetNext(u32 sequence)
+	{
+		assert(numItems == 0);
+		next = sequence;
+	}
+
+	/// Moves on to the next sequence number without an item, after the item of Next() was handled as it arrived.
+	void SkipNext()
+	{
+		assert(!Contains(next));
+		++next;
+	}
+
+	/// If an item is held for Next(), moves it to the given item, and moves on to the next sequence number.
+	/// @return True if an item was released.
+	bool PopNext(T &item)
+	{
+		if (numItems == 0)
+			return false;
+		const int index = Slot(next);
+		if (!used[index])
+			return false;
+		item = items[index];
+		items[index] = T();
+		used[index] = false;
+		--numItems;
+		++next;
+		return true;
+	}
+
+	/// Calls func(sequence, item) for each item held, in no particular order.
+	template<typename Func>
+	void ForEach(Func func) const
+	{
+		for(int i = 0; i < Capacity(); ++i)
+			if (used[i])
+				func(next + ((i - next) & ((u32)used.size() - 1)), items[i]);
+	}
+
+	/// Calls func(item) for each item held, in no particular order, and removes all items. Next() stays as it is.
+	template<typename Func>
+	void Clear(Func func)
+	{
+		for(int i = 0; i < Capacity(); ++i)
+			if (used[i])
+			{
+				func(items[i]);
+				items[i] = T();
+				used[i] = false;
+			}
+		numItems = 0;
+	}
+
+private:
+	std::vector<T> items;
+	std::vector<bool> used;
+	/// The number of slots allocated by the first Hold().
+	int capacity;
+	int numItems;
+	u32 next;
+
+	int Slot(u32 sequence) const { return (int)(sequence & ((u32)used.size() - 1)); }
+
+	/// Moves the items to a ring of twice the capacity.
+	void Grow()
+	{
+		const u32 oldCapacity = (u32)used.size();
+		std::vector<T> newItems(oldCapacity * 2);
+		std::vector<bool> newUsed(oldCapacity * 2, false);
+		for(u32 i = 0; i < oldCapacity; ++i)
+			if (used[i])
+			{
+				// The item at slot i is the one of the sequence number that many slots ahead of the slot of next.
+				const u32 sequence = next + ((i - next) & (oldCapacity - 1));
+				const u32 index = sequence & (oldCapacity * 2 - 1);
+				newItems[index] = items[i];
+				newUsed[index] = true;
+			}
+		items.swap(newItems);
+		used.swap(newUsed);
+	}
+};
+
+} // ~kNet
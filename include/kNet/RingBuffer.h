@@ -16,65 +16,50 @@
 /** @file RingBuffer.h
 	@brief The RingBuffer class stores a fast raw byte buffer queue storage. */
 
+#include <cassert>
 #include <vector>
 
 namespace kNet
 {
 
-/// Implements a byte-based ring buffer (of sorts) of raw bytes.
+/// Implements a byte-based ring buffer of raw bytes.
+/** Where the operating system allows it, the memory of the buffer is mapped twice in a row in the address space, so that
+	the bytes that wrap around past the end of the buffer also appear right after it. The filled bytes and the free space
+	are then always contiguous, wherever in the buffer they are, and the buffer never needs to be compacted. Otherwise the
+	buffer is a plain array, and Compact() moves the filled bytes to its beginning. */
 class RingBuffer
 {
 public:
-	explicit RingBuffer(int capacity)
-	{
-		data.resize(capacity);
-		start = 0;
-		end = 0;
-	}
+	explicit RingBuffer(int capacity);
+	~RingBuffer();
 
-	/// Returns the total number of bytes that this RingBuffer can contain.
-	int Capacity() const { return (int)data.size(); }
+	/// Returns the total number of bytes that this RingBuffer can contain. A mirrored buffer rounds the capacity up to
+	/// a multiple of the page size.
+	int Capacity() const { return capacity; }
 
 	/// Returns the number of bytes filled in the ring buffer.
 	int Size() const { return end - start; }
 
-	/// Compacts the ring buffer, i.e. moves all bytes to the beginning of the array.
-	void Compact()
-	{
-		// If already compacted, do nothing.
-		if (start == 0)
-			return;
+	/// Returns true if the memory of the buffer is mirrored, and the buffer never needs to be compacted.
+	bool IsMirrored() const { return mirrored; }
 
-		const int numBytes = Size();
-		for(int i = 0; i < numBytes; ++i)
-			data[i] = data[start+i];
-
-		start = 0;
-		end = numBytes;
-	}
+	/// Compacts the ring buffer, i.e. moves all bytes to the beginning of the array. Does nothing if the buffer is mirrored.
+	void Compact();
 
 	/// Enlarges the RingBuffer capacity so that it can fit at least the given number of bytes total.
 	/// If the capacity of the RingBuffer was greater than this, does nothing.
-	void Resize(int newSize)
-	{
-		assert(newSize > 0);
-
-		if ((size_t)newSize <= data.size())
-			return; // No need to resize.
-		Compact();
-		data.resize(newSize);
-	}
+	void Resize(int newSize);
 
 	void Clear()
 	{
 		start = end = 0;
 	}
 
-	/// Returns a pointer to the first byte of actual data.
-	char *Begin() { return &data[start]; }
+	/// Returns a pointer to the first byte of actual data. The Size() bytes from here on are contiguous.
+	char *Begin() { return base + start; }
 
-	/// Returns a pointer to one past the last byte of actual data.
-	char *End() { return &data[end]; }
+	/// Returns a pointer to one past the last byte of actual data. The ContiguousFreeBytesLeft() bytes from here on are free.
+	char *End() { return base + end; }
 
 	int StartIndex() const { return start; }
 
@@ -82,7 +67,8 @@ public:
 	void Inserted(int numBytes)
 	{ 
 		end += numBytes; 
-		assert(end <= (int)data.size());
+		assert(end - start <= capacity);
+		assert(mirrored || end <= capacity);
 	}
 
 	/// Call after having processed the given number of bytes from the buffer.
@@ -92,19 +78,46 @@ public:
 		assert(start <= end); 
 		if (start == end) // Free compact?
 			start = end = 0;
+		else if (start >= capacity) // Only a mirrored buffer gets here. Continue from the first copy of the memory.
+		{
+			start -= capacity;
+			end -= capacity;
+		}
 	}
 
 	/// Returns the total number of bytes that can be filled in this structure after compacting.
-	int TotalFreeBytesLeft() const { return (int)data.size() - Size(); }
+	int TotalFreeBytesLeft() const { return capacity - Size(); }
 
 	/// Returns the number of bytes that can be added to this structure contiguously, without having to compact.
-	int ContiguousFreeBytesLeft() const { return (int)data.size() - end; }
+	int ContiguousFreeBytesLeft() const { return mirrored ? capacity - Size() : capacity - end; }
 
 private:
-	std::vector<char> data;
+	/// The memory of the buffer. If mirrored, the capacity bytes after these are the same memory again.
+	char *base;
+	int capacity;
 	int start; ///< Points to the first used byte.
-	int end; ///< Points to the first unused byte.
+	int end; ///< Points to the first unused byte. In a mirrored buffer, can be up to start + capacity.
+
+	/// The storage of a buffer that is not mirrored.
+	std::vector<char> data;
+
+	/// If true, base points to memory that is mapped twice in a row.
+	bool mirrored;
+
+	/// Sets up a buffer of at least the given capacity, mirrored if possible.
+	void Allocate(int newCapacity);
+	/// Frees the memory of the buffer.
+	void Free();
+
+	/// Maps new memory of the given size twice in a row, and returns its address.
+	/// @return False if the operating system doesn't support this.
+	static bool MapMirrored(size_t numBytes, char *&address);
+	static void UnmapMirrored(char *address, size_t numBytes);
+	/// Returns the granularity of the mappings, to which the capacity of a mirrored buffer is rounded up.
+	static size_t MirrorGranularity();
 
+	RingBuffer(const RingBuffer &); ///< Not implemented.
+	void operator =(const RingBuffer &); ///< Not implemented.
 };
 
 } // ~kNet
@@ -0,0 +1,405 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file SegmentedQueue.h
+	@brief The SegmentedQueue<T> template class. A lockless queue from any number of producer threads to a single consumer
+	thread, whose storage grows and shrinks with the number of items in it. */
+
+#include <cassert>
+#include <cstring>
+#include <new>
+#include <stddef.h>
+
+#include "Alignment.h"
+#include "Atomics.h"
+#include "MemoryBudget.h"
+
+namespace kNet
+{
+
+/// A lockless queue that any number of threads can insert to, and a single thread consumes from, stored in a list of segments.
+/** The items are stored in a singly linked list of segments, each an array that is filled once from the front to the back.
+	A producer claims a slot of the last segment by incrementing its claim counter, fills it and then publishes it by
+	setting its ready flag. When the claims run past the end of the segment, the producer that gets there first links a
+	new segment after it. The consumer takes the items in the order their slots were claimed, and retires each segment it
+	has emptied.
+
+	A new segment has room for about as many items as the queue holds when it is allocated, so the storage grows
+	geometrically under a burst, and as the queue drains, the new segments become small again. An idle queue only holds a
+	segment of minSegmentSize items. The consumer keeps one retired segment of the smallest size as a spare for the
+	producers, so that a steady trickle of items does not allocate.
+
+	A retired segment is only freed at a moment when no producer is inside Insert() or InsertBatch(), since a producer may
+	still be looking at the segment it read as the last one. While producers keep the queue busy, the retired segments wait.
+
+	The segments are counted against the MemoryBudget given to the constructor. A segment can always be allocated while the
+	queue holds less than minSegmentSize items, so that a queue keeps working when its budget is spent; beyond that, the
+	inserts fail when the budget refuses a new segment, as they do when the queue holds maxElements items.
+	The items of a single producer come out in the order it inserted them. Only POD types are supported. */
+template<typename T>
+class SegmentedQueue
+{
+public:
+	/// @param maxElements The number of items the queue can hold at most.
+	/// @param minSegmentSize The number of items of the first segment, and of the smallest segments after it. A power of 2.
+	/// @param budget If not null, the storage of the queue is counted against this budget. It must outlive the queue.
+	SegmentedQueue(int maxElements_, int minSegmentSize_, MemoryBudget *budget_ = 0)
+	:maxElements(maxElements_), minSegmentSize(minSegmentSize_), maxSegmentSize((int)RoundUpToNextPow2((u32)maxElements_)),
+	budget(budget_), bytesAllocated(0), spare(0), numItems(0), numProducers(0), headIndex(0), retired(0)
+	{
+		assert(IS_POW2(minSegmentSize_));
+		assert(minSegmentSize_ >= 1 && minSegmentSize_ <= maxSegmentSize);
+		if (budget)
+			budget->Reserve(SegmentBytes(minSegmentSize));
+		head = tail = AllocateSegment(minSegmentSize);
+	}
+
+	~SegmentedQueue()
+	{
+		Segment *segment = head;
+		while(segment)
+		{
+			Segment *next = segment->next;
+			FreeSegment(segment);
+			segment = next;
+		}
+		while(retired)
+		{
+			Segment *next = retired->retiredNext;
+			FreeSegment(retired);
+			retired = next;
+		}
+		if (spare)
+			FreeSegment(spare);
+		assert(bytesAllocated == 0);
+	}
+
+	/// Returns the number of items the queue can hold at most. [thread-safe]
+	int Capacity() const { return maxElements; }
+
+	/// Returns the number of items in the queue. The items that producers are just writing are counted in too, even
+	/// though the consumer can't see them yet. [thread-safe]
+	int Size() const { return (int)numItems; }
+
+	/// Returns the number of items that can still be inserted, as limited by Capacity() and by the memory that the budget
+	/// still allows for new segments. [thread-safe]
+	int CapacityLeft() const
+	{
+		const int size = Size();
+		int left = maxElements - size;
+		if (budget && budget->IsLimited())
+		{
+			const size_t budgetItems = budget->BytesLeft() / sizeof(Slot);
+			const int budgeted = (budgetItems < (size_t)maxElements) ? (int)budgetItems : maxElements;
+			const int guaranteed = minSegmentSize - size;
+			const int allowed = (budgeted > guaranteed) ? budgeted : guaranteed;
+			if (allowed < left)
+				left = allowed;
+		}
+		return (left > 0) ? left : 0;
+	}
+
+	/// Returns the number of bytes of the segments allocated, including the retired ones and the spare one. [thread-safe]
+	size_t MemoryUsage() const { return (size_t)bytesAllocated; }
+
+	/// Inserts the given value to the back of the queue. [thread-safe]
+	/// @return False if the queue was full, or a new segment was needed but the budget refused it.
+	bool Insert(const T &value) { return InsertBatch(&value, 1) == 1; }
+
+	/// Inserts as many of the given values as there is room for, in order. [thread-safe]
+	/// @return The number of values inserted, which is less than numValues if the queue became full.
+	int InsertBatch(const T *values, int numValues)
+	{
+		const int numReserved = ReserveItems(numValues);
+		if (numReserved == 0)
+			return 0;
+
+		AtomicIncrement(&numProducers);
+		int numInserted = 0;
+		while(numInserted < numReserved)
+		{
+			Segment *segment = tail;
+			const long first = AtomicFetchAdd(&segment->claimed, (long)(numReserved - numInserted));
+			long end = first + (numReserved - numInserted);
+			if (end > segment->size)
+				end = segment->size;
+			if (first < end)
+			{
+				for(long i = first; i < end; ++i)
+					segment->slots[i].value = values[numInserted + (i - first)];
+				FullMemoryBarrier(); // The values must be visible before the flags that publish them.
+				for(long i = first; i < end; ++i)
+					segment->slots[i].ready = 1;
+				numInserted += (int)(end - first);
+			}
+			// The claims past the end of the segment are not used. Move on to the next one.
+			if (numInserted < numReserved && !AdvanceTail(segment))
+				break;
+		}
+		AtomicDecrement(&numProducers);
+
+		if (numInserted < numReserved)
+			AtomicAdd(&numItems, -(long)(numReserved - numInserted));
+		return numInserted;
+	}
+
+	/// Returns the item at the front of the queue, or 0 if the queue is empty, or the next item is still being written
+	/// by its producer. [consumer thread]
+	T *Front()
+	{
+		if (retired)
+			FreeRetiredSegments();
+		for(;;)
+		{
+			if (headIndex < head->size)
+			{
+				Slot &slot = head->slots[headIndex];
+				if (!slot.ready)
+					return 0;
+				FullMemoryBarrier(); // Don't read the value before the flag says it is there.
+				return &slot.value;
+			}
+			Segment *next = head->next;
+			if (!next)
+				return 0;
+			Segment *emptied = head;
+			head = next;
+			headIndex = 0;
+			emptied->retiredNext = retired;
+			retired = emptied;
+			FreeRetiredSegments();
+		}
+	}
+
+	/// Removes the item returned by Front(). [consumer thread]
+	void PopFront()
+	{
+		assert(Front());
+		head->slots[headIndex].ready = 0; // Left clear for the segment to be reused as the spare one.
+		++headIndex;
+		AtomicDecrement(&numItems);
+	}
+
+	/// Returns a copy of the front item and pops it off the queue. Requires that Front() is not 0. [consumer thread]
+	T TakeFront()
+	{
+		assert(Front());
+		T value = *Front();
+		PopFront();
+		return value;
+	}
+
+	/// Copies up to maxItems items from the front of the queue to dst, in order, and pops them off the queue.
+	/// Stops at the first item that is still being written. [consumer thread]
+	/// @return The number of items popped.
+	int PopBatch(T *dst, int maxItems)
+	{
+		int numItemsPopped = 0;
+		while(numItemsPopped < maxItems)
+		{
+			T *item = Front();
+			if (!item)
+				break;
+			dst[numItemsPopped++] = *item;
+			head->slots[headIndex].ready = 0;
+			++headIndex;
+		}
+		if (numItemsPopped > 0)
+			AtomicAdd(&numItems, -(long)numItemsPopped);
+		return numItemsPopped;
+	}
+
+	/// Like PopBatch(), but also stops at the first item for which take(item) returns false, and leaves it in the queue.
+	/// [consumer thread]
+	template<typename Pred>
+	int PopBatchWhile(T *dst, int maxItems, Pred take)
+	{
+		int numItemsPopped = 0;
+		while(numItemsPopped < maxItems)
+		{
+			T *item = Front();
+			if (!item || !take(*item))
+				break;
+			dst[numItemsPopped++] = *item;
+			head->slots[headIndex].ready = 0;
+			++headIndex;
+		}
+		if (numItemsPopped > 0)
+			AtomicAdd(&numItems, -(long)numItemsPopped);
+		return numItemsPopped;
+	}
+
+private:
+	struct Slot
+	{
+		/// Nonzero when the slot holds its item.
+		volatile long ready;
+		T value;
+	};
+
+	struct Segment
+	{
+		/// The segment after this one, or 0 if this is the last one. [set by a producer]
+		Segment *volatile next;
+		/// Links the retired segments. [consumer thread]
+		Segment *retiredNext;
+		/// The number of slots claimed by the producers. Runs past size when the segment is full.
+		volatile long claimed;
+		/// The number of slots of the segment.
+		long size;
+		/// The first slot. The rest follow it in the same allocation.
+		Slot slots[1];
+	};
+
+	const int maxElements;
+	const int minSegmentSize;
+	const int maxSegmentSize;
+	MemoryBudget *budget;
+
+	/// The bytes of all the segments allocated. [thread-safe]
+	volatile long bytesAllocated;
+	/// An emptied segment of minSegmentSize slots, for the producers to use as the next one, or 0. [set by the consumer, taken by a producer]
+	Segment *volatile spare;
+	/// The number of items inserted and not yet popped, including those being written. [thread-safe]
+	volatile long numItems;
+	/// The number of producers inside InsertBatch(). [thread-safe]
+	volatile long numProducers;
+
+	/// The last segment. [written by the producers]
+	Segment *volatile tail;
+
+	/// The segment of the front item. [consumer thread]
+	Segment *head;
+	/// The index of the front item in head. [consumer thread]
+	long headIndex;
+	/// The segments emptied by the consumer, waiting for a moment when no producer is active to be freed. [consumer thread]
+	Segment *retired;
+
+	static size_t SegmentBytes(int size) { return sizeof(Segment) + (size - 1) * sizeof(Slot); }
+
+	/// Counts up to the given number of new items in numItems, as many as Capacity() allows.
+	int ReserveItems(int numWanted)
+	{
+		for(;;)
+		{
+			const long size = numItems;
+			long numFree = (long)maxElements - size;
+			if (numFree <= 0)
+				return 0;
+			if (numFree > numWanted)
+				numFree = numWanted;
+			if (CmpXChgLong(&numItems, size + numFree, size))
+				return (int)numFree;
+		}
+	}
+
+	Segment *AllocateSegment(int size)
+	{
+		const size_t bytes = SegmentBytes(size);
+		Segment *segment = static_cast<Segment *>(::operator new(bytes));
+		segment->next = 0;
+		segment->retiredNext = 0;
+		segment->claimed = 0;
+		segment->size = size;
+		memset(segment->slots, 0, size * sizeof(Slot));
+		AtomicAdd(&bytesAllocated, (long)bytes);
+		return segment;
+	}
+
+	void FreeSegment(Segment *segment)
+	{
+		const size_t bytes = SegmentBytes((int)segment->size);
+		AtomicAdd(&bytesAllocated, -(long)bytes);
+		if (budget)
+			budget->Release(bytes);
+		::operator delete(segment);
+	}
+
+	/// Returns a segment for the producers to continue in, sized after the number of items in the queue, or 0 if the
+	/// budget refuses it.
+	Segment *NewSegment()
+	{
+		int size = minSegmentSize;
+		const int numQueued = Size();
+		while(size < numQueued && size < maxSegmentSize)
+			size *= 2;
+
+		if (size == minSegmentSize)
+		{
+			Segment *reused = spare;
+			if (reused && CmpXChgPointer(&spare, (Segment *)0, reused))
+				return reused;
+		}
+
+		if (budget && !budget->TryReserve(SegmentBytes(size)))
+		{
+			if (numQueued >= minSegmentSize)
+				return 0;
+			// The queue holds less than a segment's worth of items, so it is kept working over the budget.
+			size = minSegmentSize;
+			budget->Reserve(SegmentBytes(size));
+		}
+		return AllocateSegment(size);
+	}
+
+	/// Makes sure that a segment follows the given full one, and moves the tail to it.
+	/// @return False if a new segment was needed, but could not be allocated.
+	bool AdvanceTail(Segment *full)
+	{
+		Segment *next = full->next;
+		if (!next)
+		{
+			next = NewSegment();
+			if (!next)
+				return false;
+			if (!CmpXChgPointer(&full->next, next, (Segment *)0))
+			{
+				// Another producer linked a segment first.
+				FreeSegment(next);
+				next = full->next;
+			}
+		}
+		CmpXChgPointer(&tail, next, full);
+		return true;
+	}
+
+	/// Frees the retired segments, or keeps one as the spare, if no producer is active. [consumer thread]
+	void FreeRetiredSegments()
+	{
+		FullMemoryBarrier(); // The segments were retired before the producers are looked at.
+		if (numProducers != 0)
+			return;
+		while(retired)
+		{
+			Segment *segment = retired;
+			retired = segment->retiredNext;
+			if (segment->size == minSegmentSize && !spare)
+			{
+				segment->next = 0;
+				segment->retiredNext = 0;
+				segment->claimed = 0;
+				FullMemoryBarrier(); // The segment must be reset before a producer can take it.
+				spare = segment;
+			}
+			else
+				FreeSegment(segment);
+		}
+	}
+
+	SegmentedQueue(const SegmentedQueue &); ///< Not implemented.
+	void operator =(const SegmentedQueue &); ///< Not implemented.
+};
+
+} // ~kNet
@@ -0,0 +1,68 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file SeqLock.h
+	@brief The SeqLock<T> template class, which publishes a value from one thread to others without blocking either side. */
+
+#include <cstring>
+
+#include "Types.h"
+#include "Atomics.h"
+
+namespace kNet
+{
+
+/// Stores a small POD value that a single writer thread updates and any number of reader threads read.
+/** The writer never waits. A reader copies the value and retries if the writer changed it during the copy, so the readers
+	always see a consistent value, and never block the writer. Suitable for values that are read much more often than
+	they are written, like the statistics of a connection. Only one thread may call Store(). */
+template<typename T>
+class SeqLock
+{
+public:
+	SeqLock():sequence(0) { memset(&value, 0, sizeof(value)); }
+	explicit SeqLock(const T &initialValue):sequence(0), value(initialValue) {}
+
+	/// Replaces the stored value. [writer thread]
+	void Store(const T &newValue)
+	{
+		sequence = sequence + 1; // Odd: a write is in progress.
+		FullMemoryBarrier();
+		memcpy((void*)&value, &newValue, sizeof(T));
+		FullMemoryBarrier();
+		sequence = sequence + 1;
+	}
+
+	/// Returns a copy of the stored value. [any thread]
+	T Load() const
+	{
+		T copy;
+		for(;;)
+		{
+			const u32 before = sequence;
+			FullMemoryBarrier();
+			memcpy(&copy, (const void*)&value, sizeof(T));
+			FullMemoryBarrier();
+			if ((before & 1) == 0 && sequence == before)
+				return copy;
+		}
+	}
+
+private:
+	volatile u32 sequence;
+	T value;
+};
+
+} // ~kNet
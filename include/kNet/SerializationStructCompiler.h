@@ -28,6 +28,19 @@ namespace kNet
 class SerializationStructCompiler
 {
 public:
+	SerializationStructCompiler():generateViews(false), arenaDeserialization(false) {}
+
+	/// If enabled, CompileMessage() also generates a MsgxxxView class for each message, which reads the fields straight
+	/// from the serialized bytes when they are accessed, without deserializing the whole message. The view is only generated
+	/// for messages that consist of whole-byte basic types, arrays of them and strings. Disabled by default.
+	void SetGenerateViews(bool enabled) { generateViews = enabled; }
+
+	/// If enabled, the arrays of varying length of basic types and the strings are generated as kNet::ArenaArray and
+	/// kNet::ArenaString members, and DeserializeFrom() takes a kNet::DeserializeArena that holds them, so deserializing a
+	/// message does not allocate. The members stay valid until the arena is reset. Arrays of structs are still generated as
+	/// std::vectors. Disabled by default.
+	void SetArenaDeserialization(bool enabled) { arenaDeserialization = enabled; }
+
 	void CompileStruct(const SerializedElementDesc &structure, const char *outfile);
 	void CompileMessage(const SerializedMessageDesc &message, const char *outfile);
 
@@ -45,7 +58,29 @@ private:
 	void WriteSerializeMemberFunction(/*const std::string &className, */const SerializedElementDesc &elem, int level, std::ofstream &out);
 	void WriteDeserializeMemberFunction(/*const std::string &className, */const SerializedElementDesc &elem, int level, std::ofstream &out);
 
+	/// Returns the number of bytes the given struct always takes when serialized, or 0 if its size varies or it contains
+	/// members that are not whole bytes.
+	static size_t FixedSerializedSize(const SerializedElementDesc &elem);
+
+	/// Writes the memcpy() calls that copy the members of a fixed-size struct between the struct and the byte block named
+	/// 'block', at the offsets the members have in the serialized form. Consecutive members that have no padding between
+	/// them in the struct are copied with a single call.
+	void WriteFixedLayoutCopies(const SerializedElementDesc &elem, bool serialize, int level, std::ofstream &out);
+
+	/// Returns true if each field of the given struct starts at a whole byte, so that a view class and a compile-time
+	/// schema can be generated for it.
+	static bool HasByteAlignedFields(const SerializedElementDesc &elem);
+	/// Writes the Schema typedef (see MessageSchema.h) of the given struct, if it has one.
+	void WriteSchemaTypedef(const SerializedElementDesc &elem, int level, std::ofstream &out);
+	void WriteMessageView(const SerializedMessageDesc &message, std::ofstream &out);
+
+	/// Returns true if the given member is deserialized into a DeserializeArena.
+	bool IsArenaMember(const SerializedElementDesc &elem) const;
+
 	static std::string Indent(int level);
+
+	bool generateViews;
+	bool arenaDeserialization;
 };
 
 } // ~kNet
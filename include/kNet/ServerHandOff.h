@@ -0,0 +1,57 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file ServerHandOff.h
+	@brief The ServerHandOff class, which passes the sockets and the session state of a server to a new process. */
+
+#include <vector>
+
+#include "Types.h"
+#include "Socket.h"
+
+namespace kNet
+{
+
+/// Carries the handover of a server from a process that is being restarted to the process that replaces it.
+/** The old process listens on an AF_UNIX stream socket at a path both processes agree on, and the new process connects to
+	it. The old process then passes the handles of its sockets with SCM_RIGHTS, followed by the serialized state of the
+	server. The new process answers with a single byte once it has taken over, and only then does the old process let go of
+	the sockets, so a new process that fails to start leaves the old one serving.
+
+	Used by Network::HandOffServer() and Network::ResumeServer(). The functions block, and are called by the main thread.
+	Not supported on Windows. */
+class ServerHandOff
+{
+public:
+	/// Listens at the given path, and waits for the new process to connect.
+	/// @return The socket connected to the new process, or INVALID_SOCKET if none connected in time.
+	static SOCKET WaitForSuccessor(const char *path, int maxMSecsToWait);
+
+	/// Passes the given socket handles and state to the new process, and waits for it to answer. Closes the socket. The
+	/// handles stay open in this process too.
+	/// @return True if the new process has taken over the sockets.
+	static bool Send(SOCKET successor, const std::vector<SOCKET> &handles, const std::vector<char> &state, int maxMSecsToWait);
+
+	/// Connects to the old process at the given path, retrying until it listens, and receives the socket handles and the
+	/// state it passes.
+	/// @return The socket to pass to Acknowledge(), or INVALID_SOCKET on failure, in which case no handles are returned.
+	static SOCKET Receive(const char *path, std::vector<SOCKET> &handles, std::vector<char> &state, int maxMSecsToWait);
+
+	/// Tells the old process whether this process takes over the sockets, and closes the socket.
+	/// @return False if the old process could not be told, in which case it has given up waiting and keeps serving.
+	static bool Acknowledge(SOCKET predecessor, bool tookOver);
+};
+
+} // ~kNet
@@ -0,0 +1,102 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file SharedMemoryChannel.h
+	@brief The SharedMemoryChannel class, which carries the byte stream of a SocketOverSharedMemory connection. */
+
+#include "Types.h"
+#include "SharedPtr.h"
+#include "Socket.h"
+
+namespace kNet
+{
+
+/// A pair of single-producer single-consumer byte rings in a memory segment that two processes of the same host share.
+/** A SocketOverSharedMemory connection is set up over an AF_UNIX stream socket: the client creates the segment and passes
+	its file descriptor to the server through the socket. After that, the bytes of the connection go through the rings and
+	are copied only once on each side, without entering the kernel.
+
+	The same AF_UNIX socket serves as the doorbell of the rings. A side that finds its inbound ring empty, or its outbound
+	ring full, raises a flag in the ring, and the other side sends a single byte through the socket when it clears the flag.
+	This way the worker threads wait for the rings in the same EventArray as for the other sockets, and a peer that exits
+	is seen as the end of the socket stream. While both sides keep up, no doorbell is rung at all.
+
+	The functions may be called only by the worker thread of the connection. The channel is shared by the copies of its
+	Socket, and the segment is unmapped when the last of them is gone. Not supported on Windows. */
+class SharedMemoryChannel : public RefCountable
+{
+public:
+	/// The number of bytes of each of the two rings. A power of two.
+	static const u32 cRingSize = 1024 * 1024;
+
+	/// Opens a socket that listens for the SocketOverSharedMemory connections to the given port. On Linux, the socket is
+	/// bound to the name "kNet.shm.<port>" in the abstract namespace, elsewhere to the path "/tmp/kNet.shm.<port>".
+	/// @return The new nonblocking socket, or INVALID_SOCKET on failure.
+	static SOCKET OpenListenSocket(unsigned short port);
+
+	/// Connects to the server listening on the given port of this host, and creates a new channel to it. [client side]
+	/// @param socket [out] The connected socket, which the channel rings as its doorbell.
+	/// @return The new channel, or 0 on failure.
+	static SharedMemoryChannel *Connect(unsigned short port, SOCKET &socket);
+
+	/// Accepts the next connection from the given listen socket, and maps the channel the client created. [server side]
+	/// @param socket [out] The accepted socket, or INVALID_SOCKET if there was nothing to accept.
+	/// @param listenFailed [out] Set to true if the listen socket failed and had to be closed.
+	/// @return The channel, or 0 if nothing was accepted or the client did not pass a valid channel.
+	static SharedMemoryChannel *Accept(SOCKET listenSocket, SOCKET &socket, bool &listenFailed);
+
+	~SharedMemoryChannel();
+
+	/// Copies up to maxBytes of the bytes received to dst. If the inbound ring turns out empty, asks the peer to ring the
+	/// doorbell when it writes to the ring next time.
+	/// @return The number of bytes read.
+	size_t Read(char *dst, size_t maxBytes);
+
+	/// Copies as many of the given bytes to the outbound ring as fit, and rings the doorbell if the peer is waiting for them.
+	/// @return The number of bytes written.
+	size_t Write(const char *data, size_t numBytes);
+
+	/// Returns the number of bytes waiting in the inbound ring.
+	size_t BytesAvailable() const;
+
+	/// Returns true if the outbound ring has room for the given number of bytes. Otherwise asks the peer to ring the
+	/// doorbell once it frees room in the ring.
+	bool HasRoomFor(size_t numBytes);
+
+	/// The layout of the shared segment.
+	struct Ring;
+	struct Segment;
+
+private:
+	SharedMemoryChannel(Segment *segment, SOCKET doorbell, bool isClient);
+
+	/// The mapped segment.
+	Segment *segment;
+	/// The socket that the doorbell is rung through. Owned by the Socket of the connection.
+	SOCKET doorbell;
+	/// The ring this side reads from, and the ring this side writes to.
+	Ring *inbound;
+	Ring *outbound;
+	char *inboundData;
+	char *outboundData;
+
+	/// Sends a byte through the doorbell socket to wake up the peer.
+	void RingDoorbell();
+
+	SharedMemoryChannel(const SharedMemoryChannel &); ///< Not implemented.
+	void operator =(const SharedMemoryChannel &); ///< Not implemented.
+};
+
+} // ~kNet
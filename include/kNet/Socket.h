@@ -21,6 +21,7 @@
 #include "kNetBuildConfig.h"
 #include "win32/WS2Include.h"
 #define KNET_EWOULDBLOCK WSAEWOULDBLOCK
+#define KNET_EMSGSIZE WSAEMSGSIZE
 #define KNET_SOCKET_ERROR SOCKET_ERROR
 #define KNET_ACCEPT_FAILURE SOCKET_ERROR
 
@@ -41,6 +42,7 @@ typedef int socklen_t;
 #define KNET_SOCKET_ERROR ((SOCKET)-1)
 #define KNET_ACCEPT_FAILURE ((SOCKET)-1)
 #define KNET_EWOULDBLOCK EWOULDBLOCK
+#define KNET_EMSGSIZE EMSGSIZE
 #define closesocket close
 #define TIMEVAL timeval
 #define SD_SEND SHUT_WR
@@ -56,6 +58,8 @@ typedef int SOCKET;
 #include <vector>
 #include <list>
 
+#include "Types.h"
+#include "Clock.h"
 #include "SharedPtr.h"
 #include "EndPoint.h"
 #include "WaitFreeQueue.h"
@@ -64,12 +68,19 @@ typedef int SOCKET;
 namespace kNet
 {
 
+class IDatagramReceiver;
+class DatagramBuffer;
+class SharedMemoryChannel;
+class RegisteredIO;
+class XdpSocket;
+
 /// Identifiers for the possible bottom-level tranport layers.
 enum SocketTransportLayer
 {
 	InvalidTransportLayer = 0, ///< A default invalid value for uninitialized sockets.
 	SocketOverUDP,
-	SocketOverTCP
+	SocketOverTCP,
+	SocketOverSharedMemory ///< A byte stream between two processes of the same host, see SharedMemoryChannel.
 };
 
 std::string SocketTransportLayerToString(SocketTransportLayer transport);
@@ -77,9 +88,13 @@ std::string SocketTransportLayerToString(SocketTransportLayer transport);
 /// Converts the given string (case-insensitive parsing) to the corresponding SocketTransportLayer enum.
 /// "tcp" & "socketovertcp" -> SocketOverTCP.
 /// "udp" & "socketoverudp" -> SocketOverUDP.
+/// "shm" & "socketoversharedmemory" -> SocketOverSharedMemory.
 /// Other strings -> InvalidTransportLayer.
 SocketTransportLayer StringToSocketTransportLayer(const char *str);
 
+/// Returns true if the given transport carries a byte stream, which the connections frame the same way as TCP.
+inline bool IsStreamTransportLayer(SocketTransportLayer transport) { return transport == SocketOverTCP || transport == SocketOverSharedMemory; }
+
 enum SocketType
 {
 	InvalidSocketType = 0, ///< A default invalid value for uninitialized sockets.
@@ -92,6 +107,15 @@ std::string SocketTypeToString(SocketType type);
 
 typedef int OverlappedTransferTag;
 
+/// The ECN codepoints (RFC 3168), the low two bits of the TOS byte of an IPv4 header.
+enum ECNCodepoint
+{
+	ECNNotECT = 0, ///< The sender does not support ECN.
+	ECNECT1 = 1, ///< ECN-capable transport, ECT(1).
+	ECNECT0 = 2, ///< ECN-capable transport, ECT(0). kNet sends its UDP datagrams with this codepoint.
+	ECNCongestionExperienced = 3 ///< A router on the path was congested, and marked the datagram instead of dropping it.
+};
+
 #ifdef WIN32
 typedef WSABUF kNetBuffer;
 #else
@@ -112,6 +136,24 @@ struct OverlappedTransferBuffer
 #ifdef WIN32
 	WSAOVERLAPPED overlapped;
 #endif
+#ifdef KNET_USE_IO_URING
+	/// The message header and the destination of an asynchronous datagram send that is in progress in an IoUring.
+	msghdr msg;
+	iovec iov;
+	sockaddr_in to;
+#endif
+#ifdef KNET_USE_RIO
+	/// The RegisteredIO whose registered buffer pool this buffer belongs to, or null if the buffer was allocated from the heap.
+	RegisteredIO *registeredIO;
+	/// The index of this buffer in the pool of registeredIO.
+	u32 registeredSlot;
+#endif
+#ifdef KNET_USE_AF_XDP
+	/// The XdpSocket whose UMEM this buffer is a frame of, or null if the buffer was allocated from the heap.
+	XdpSocket *xdpSocket;
+	/// The address of the frame in the UMEM of xdpSocket.
+	u64 xdpFrame;
+#endif
 
 	/// Stores the number of bytes actually in use in buffer.buf. When sending out a message,
 	/// specify the actual number of bytes filled to buffer.buf here.
@@ -122,6 +164,11 @@ struct OverlappedTransferBuffer
 
 	sockaddr_in from;
 	socklen_t fromLen;
+
+	/// The tick at which the kernel received the data, or 0 if the socket does not timestamp its datagrams.
+	tick_t receiveTick;
+	/// The ECNCodepoint the received datagram carried, or ECNNotECT if the socket does not read it.
+	u8 ecn;
 };
 
 /// Represents a low-level network socket.
@@ -139,11 +186,40 @@ public:
 
 	Socket &operator=(const Socket &);
 
-	/// Sets the underlying socket send buffer (SO_SNDBUF) size.
+	/// Sets the underlying socket send buffer (SO_SNDBUF) size. This turns off the tuning of the send buffer, see TuneBufferSizes().
 	void SetSendBufferSize(int bytes);
-	/// Sets the underlying socket receive buffer (SO_RCVBUF) size.
+	/// Sets the underlying socket receive buffer (SO_RCVBUF) size. This turns off the tuning of the receive buffer, see TuneBufferSizes().
 	void SetReceiveBufferSize(int bytes);
 
+	/// The range of the buffer sizes TuneBufferSizes() sets.
+	static const int cMinTunedBufferSize = 64 * 1024;
+	static const int cMaxTunedBufferSize = 8 * 1024 * 1024;
+
+	/// Resizes the send and receive buffers to fit the given traffic, so that they hold enough for a burst without
+	/// reserving memory for an idle connection. A buffer is grown right away, but shrunk only once it is four times
+	/// larger than needed, so that it does not flap with the measurements. The buffers sized with SetSendBufferSize() or
+	/// SetReceiveBufferSize() are left as they are. The OS can cap the sizes further (net.core.wmem_max/rmem_max on Linux).
+	/// Does nothing for a UDP slave socket, since the sockets of a UDP server are tuned for all their connections at once.
+	/// @param rttMSecs The round-trip time of the traffic in milliseconds.
+	void TuneBufferSizes(float bytesInPerSec, float bytesOutPerSec, float rttMSecs);
+
+	/// Returns the buffer size TuneBufferSizes() uses for the given traffic: twice its bandwidth-delay product, rounded up
+	/// to a power of two and clamped to [cMinTunedBufferSize, cMaxTunedBufferSize]. The round-trip times shorter than 50
+	/// msecs are counted as 50 msecs, since the worker thread can be late by about that much to read or fill the socket.
+	static int TunedBufferSize(float bytesPerSec, float rttMSecs);
+
+	/// Returns the number of datagrams the OS has dropped at this socket, since they came in while its receive buffer was
+	/// full. The count is refreshed whenever a datagram is read. Only counted on Linux (SO_RXQ_OVFL). [main and worker thread]
+	unsigned long ReceiveQueueDrops() const { return receiveQueueDrops; }
+
+	/// Stores the drop count that a datagram read from this socket carried. Called by the readers that bypass Receive()
+	/// and ReceiveDatagrams(). [worker thread]
+	void SetReceiveQueueDrops(u32 drops) { receiveQueueDrops = drops; }
+
+	/// Returns true if the datagrams sent from this socket are marked ECN-capable, and the ECN codepoints of the datagrams
+	/// read from it are passed on to the receivers. Only on Linux (IP_TOS, IP_RECVTOS).
+	bool ECNEnabled() const { return ecnEnabled; }
+
 	/// Returns the current value for the send buffer of this socket.
 	int SendBufferSize() const;
 	/// Returns the current value for the receive buffer of this socket.
@@ -175,6 +251,9 @@ public:
 	void Disconnect();
 	/// Performs an immediate write and read close on the socket, without waiting for the connection to gracefully shut down.
 	void Close();
+	/// Closes the handle of this socket without shutting the socket down, for a socket that another process has been
+	/// passed a handle of and keeps using. See Network::HandOffServer().
+	void Abandon();
 
 	/// Sends the given data through the socket. This function may only be called if Socket::IsWriteOpen() returns true. If
 	/// the socket is not write-open, calls to this function will fail.
@@ -182,12 +261,32 @@ public:
 	/// networking, but instead choose one preferred method and consistently use it.
 	bool Send(const char *data, size_t numBytes);
 
+	/// Sends a single datagram from this UDP server socket to the given endpoint, which need not have a connection.
+	/// Unlike Send(), a failure does not close the socket. [main and worker thread]
+	bool SendTo(const char *data, size_t numBytes, const EndPoint &destination);
+
+	/// The maximum number of buffers SendGather() takes at a time.
+	static const int cMaxGatherBuffers = 64;
+
+	/// Sends the contents of the given buffers through this TCP socket one after another, with a single writev() or WSASend()
+	/// call, without copying them together first. Like Send(), either sends all of the data or fails, and may only be called
+	/// if IsWriteOpen() returns true. The bytes are sent after the data of the overlapped sends that have been queued before the call.
+	/// @param numBuffers The number of buffers, at most cMaxGatherBuffers.
+	bool SendGather(const kNetBuffer *buffers, int numBuffers);
+
 	/// Waits until the Socket is ready for sending. Returns true if the socket transitioned to write-ready state in the given
 	/// time period, or false if the wait timed out or if some other error occurred.
 	/// This function is an orthogonal API to the overlapped IO Send routines. Do not mix these API calls when doing
 	/// networking, but instead choose one preferred method and consistently use it.
 	bool WaitForSendReady(int msecs);
 
+	/// Sends the given range of a file mapped by DatagramBuffer::MapFileForReading through this TCP socket, without copying it
+	/// to a send buffer first: with sendfile() on Linux and TransmitFile() on Windows, and from the mapping with send() elsewhere.
+	/// The bytes are sent after the data of the overlapped sends that have been queued before the call. [worker thread]
+	/// @return The number of bytes sent, which can be less than numBytes, and is 0 if the socket send buffer is full.
+	///         -1 if the send failed and the socket was closed.
+	int SendFileData(const DatagramBuffer &file, size_t offset, size_t numBytes);
+
 	/// Starts the sending of new data. After having filled the data to send to the OverlappedTransferBuffer that is
 	/// returned here, commit the send by calling EndSend. If you have called BeginSend, but decide not to send any data,
 	/// call AbortSend instead (otherwise memory will leak).
@@ -205,6 +304,37 @@ public:
 	/// This frees the given buffer, do not dereference it after calling this function.
 	void AbortSend(OverlappedTransferBuffer *send);
 
+	/// Starts collecting the datagrams passed to EndSend into a batch, instead of sending each of them out immediately.
+	/// The batch is sent out by EndDatagramBatch, on Linux with a single sendmmsg() call per cMaxDatagramsPerSendBatch datagrams.
+	/// Since the sends are deferred, a datagram that fails to send at the end of the batch is dropped like a lost datagram.
+	/// Has no effect on TCP sockets and on Windows, where the sends are already asynchronous. [worker thread]
+	void BeginDatagramBatch();
+	/// Sends out all the datagrams collected since BeginDatagramBatch and returns to sending each datagram immediately. [worker thread]
+	void EndDatagramBatch();
+
+	/// Enables or disables the use of UDP segmentation and receive offload (UDP_SEGMENT and UDP_GRO) on Linux. When enabled, a
+	/// datagram batch sends each run of equal-sized datagrams to the kernel as one message, and ReceiveDatagrams accepts reads
+	/// that the kernel has coalesced from several datagrams and splits them back. The datagrams on the wire stay the same.
+	/// Enabled by default. Disables itself if the kernel or the network device rejects segmented sends.
+	void SetUDPOffloadEnabled(bool enabled);
+
+	/// Sets the Don't Fragment flag on the datagrams sent through this UDP socket, and stops the operating system from lowering
+	/// their size on ICMP messages, so that a datagram too large for the path is dropped instead of split into IP fragments.
+	/// The connections find out the datagram size the path carries by probing, see UDPMessageConnection::MaxDatagramSize().
+	/// @return True if the flag was changed. Supported on Linux, Windows and OSX.
+	bool SetDontFragment(bool enabled);
+
+	/// Sets how long the kernel busy-polls the network device for new data when a read or a poll on this socket finds
+	/// nothing to read (SO_BUSY_POLL), instead of waiting for the device interrupt. 0 turns the busy polling off. Used by
+	/// the busy-polling worker threads, see NetworkWorkerThread::SetBusyPolling().
+	/// @return True if the option was set. Supported on Linux only, and raising the time may need CAP_NET_ADMIN.
+	bool SetBusyPoll(int usecs);
+
+	/// Tells the kernel which processor reads this socket (SO_INCOMING_CPU), so that among the SO_REUSEPORT sockets of a
+	/// port it prefers this one for the datagrams that the network card steers to that processor. -1 clears the setting.
+	/// @return True if the option was set. Supported on Linux only.
+	bool SetIncomingCPU(int cpu);
+
 #ifdef WIN32
 	/// Returns the number of sends in the send queue.
 	int NumOverlappedSendsInProgress() const { return queuedSendBuffers.Size(); }
@@ -225,8 +355,11 @@ public:
 	/// This function issues an immediate recv() call to the socket and is not compatible with the Overlapped Transfer API
 	/// above. Do not mix the use of these two APIs, but pick one method to use and stay with it.
 	/// @param endPoint [out] If the socket is an UDP socket that is not bound to an address, this will contain the source address.
+	/// @param receiveTick [out] If not null, receives the tick at which the kernel received the datagram, or 0 if the
+	///        socket does not timestamp its datagrams (SO_TIMESTAMPNS).
+	/// @param ecn [out] If not null, receives the ECNCodepoint of the datagram, or ECNNotECT if ECNEnabled() is false.
 	/// @return The number of bytes that were successfully read.
-	size_t Receive(char *dst, size_t maxBytes, EndPoint *endPoint = 0);
+	size_t Receive(char *dst, size_t maxBytes, EndPoint *endPoint = 0, tick_t *receiveTick = 0, u8 *ecn = 0);
 
 	/// Call to receive new data from the socket.
 	/// @return A buffer that contains the data, or 0 if no new data was available. When you are finished reading the buffer, call
@@ -234,6 +367,11 @@ public:
 	OverlappedTransferBuffer *BeginReceive();
 	/// Finishes a read operation on the socket. Frees the given buffer to be re-queued for a future socket read operation.
 	void EndReceive(OverlappedTransferBuffer *buffer);
+
+	/// Reads in up to maxDatagrams datagrams that are waiting in this UDP server socket, and passes each of them to the
+	/// given receiver. On Linux, the datagrams are read with a single recvmmsg() call, on other platforms this repeats BeginReceive.
+	/// @return The number of datagrams that were read from the socket. [worker thread]
+	int ReceiveDatagrams(IDatagramReceiver *receiver, int maxDatagrams);
 #ifdef WIN32
 	/// Returns the number of receive buffers that have been queued for the socket.
 	int NumOverlappedReceivesInProgress() const { return queuedReceiveBuffers.Size(); }
@@ -245,9 +383,12 @@ public:
 	/// Returns the event object that will be notified whenever data is available to be read from the socket.
 	Event GetOverlappedReceiveEvent(); // [worker thread]
 
-	/// Returns which transport layer the connection is using. This value is either SocketOverUDP or SocketOverTCP.
+	/// Returns which transport layer the connection is using.
 	SocketTransportLayer TransportLayer() const { return transport; }
 
+	/// Makes this SocketOverSharedMemory socket carry its bytes through the given channel. [main thread]
+	void SetSharedMemoryChannel(SharedMemoryChannel *channel);
+
 	/// Returns the type of this socket object.
 	SocketType Type() const { return type; }
 
@@ -273,6 +414,10 @@ public:
 	/// If SocketType == ServerListenSocket, returns 0.
 	unsigned short DestinationPort() const { return remoteEndPoint.port; }
 
+	/// Points this UDP slave socket, or the connected UDP socket of a server client, to the new address of its peer, after
+	/// the peer has moved to it. The thread that sends through this socket must be held while this is called.
+	void SetUDPPeerEndPoint(const EndPoint &endPoint);
+
 	/// Returns a human-readable representation of this socket, specifying the peer address and port this socket is
 	/// connected to.
 	std::string ToString() const;
@@ -289,6 +434,11 @@ public:
 	/// Read more about Nagle's algorithm here: http://msdn.microsoft.com/en-us/library/ms817942.aspx
 	void SetNaglesAlgorithmEnabled(bool enabled);
 
+	/// Corks or uncorks this TCP socket. While corked, the TCP driver sends out only full segments, and when the socket is
+	/// uncorked, the rest of the data goes out right away. This is TCP_CORK on Linux and TCP_NOPUSH on BSD and OSX. On other
+	/// platforms, does nothing and returns false.
+	bool SetTCPCorked(bool corked);
+
 private:
 	/// Stores the handle to the underlying BSD socket object. Has the value INVALID_SOCKET if uninitialized.
 	SOCKET connectSocket;
@@ -345,6 +495,85 @@ private:
 
 	void EnqueueNewReceiveBuffer(OverlappedTransferBuffer *buffer = 0);
 #endif
+
+	/// If true, EndSend collects the datagrams to datagramBatch instead of sending them out immediately.
+	bool batchingDatagrams;
+
+	/// The datagrams that EndSend has collected since BeginDatagramBatch. These are owned by this Socket.
+	std::vector<OverlappedTransferBuffer*> datagramBatch;
+
+	/// The maximum number of transfer buffers kept in freeTransferBuffers. Each connection of a server has a Socket, so the
+	/// pool only keeps as many buffers as a batch of sends typically has in flight.
+	static const int cMaxFreeTransferBuffers = 8;
+
+	/// The transfer buffers that are not in use. BeginSend and BeginReceive take their buffers from here, and EndSend,
+	/// EndReceive and AbortSend give them back, so once the pool has warmed up, sending and receiving don't allocate. Not
+	/// copied with the Socket. [worker thread]
+	std::vector<OverlappedTransferBuffer*> freeTransferBuffers;
+
+	/// Returns the size of the pooled transfer buffers, which fits the largest datagram of the socket.
+	int TransferBufferSize() const;
+
+	/// Takes a transfer buffer of at least the given size from freeTransferBuffers, or allocates one if none fits.
+	OverlappedTransferBuffer *AllocateTransferBuffer(int bytes);
+
+	/// Returns the given transfer buffer to freeTransferBuffers, or frees it if the pool is full or the socket is closed.
+	/// The registered I/O and AF_XDP buffers go back to their own pools. buffer may be null.
+	void ReleaseTransferBuffer(OverlappedTransferBuffer *buffer);
+
+	/// Frees the buffers in freeTransferBuffers.
+	void FreeTransferBuffers();
+
+	/// The buffers recvmmsg() reads the datagrams to in ReceiveDatagrams. A buffer is replaced with a new one when a receiver
+	/// keeps a reference to it. Allocated when the socket is first read from.
+	std::vector<DatagramBuffer*> receiveBuffers;
+
+	/// If true, datagram batches are sent with UDP segmentation offload and the socket is read with UDP receive offload.
+	bool udpOffloadEnabled;
+
+	/// If true, UDP receive offload is enabled in this socket, and ReceiveDatagrams splits the coalesced reads.
+	bool receiveOffloadActive;
+
+	/// Sets the UDP_GRO socket option. Returns true on success.
+	bool SetReceiveOffload(bool enabled);
+
+	/// If false, the send or receive buffer has been sized by the application, and TuneBufferSizes() leaves it as is.
+	bool tuneSendBuffer;
+	bool tuneReceiveBuffer;
+	/// The most recent sizes set to the buffers of the socket by kNet.
+	int tunedSendBufferSize;
+	int tunedReceiveBufferSize;
+
+	/// If true, the datagrams read from this socket carry the drop count of the socket (SO_RXQ_OVFL).
+	bool receiveQueueDropsEnabled;
+	/// The latest drop count of the socket, see ReceiveQueueDrops().
+	volatile u32 receiveQueueDrops;
+	/// If true, the kernel timestamps the datagrams read from this socket when they arrive (SO_TIMESTAMPNS).
+	bool receiveTimestampsEnabled;
+	/// If true, this socket sends ECT(0) datagrams, and reads the ECN codepoints of the datagrams it receives.
+	bool ecnEnabled;
+
+	/// Sets the given buffer size option (SO_SNDBUF or SO_RCVBUF) of the socket. Returns true on success.
+	bool SetBufferSizeOption(int option, int bytes);
+
+	/// The rings that carry the bytes of a SocketOverSharedMemory socket. The socket handle is then the doorbell of the channel.
+	Ptr(SharedMemoryChannel) sharedMemoryChannel;
+
+	/// Writes all of the given bytes to the shared memory channel, waiting for room in the ring like a TCP send waits for the
+	/// socket. Closes the socket if the peer does not make room in time.
+	bool WriteSharedMemoryChannel(const char *data, size_t numBytes);
+
+	/// Reads the doorbell bytes of the shared memory channel out of the socket.
+	/// @return False if the peer has closed the connection.
+	bool ClearDoorbell();
+
+	/// Sends out the datagrams in datagramBatch and frees them.
+	void SendDatagramBatch();
+	/// Frees the datagrams in datagramBatch without sending them.
+	void FreeDatagramBatch();
+
+	/// Closes the socket, and shuts it down first if shutdownSocket is true. See Close() and Abandon().
+	void CloseSocket(bool shutdownSocket);
 };
 
 } // ~kNet
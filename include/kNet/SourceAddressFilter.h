@@ -0,0 +1,114 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file SourceAddressFilter.h
+	@brief The SourceAddressFilter class, which bans and rate-limits the source IP addresses of the traffic a server receives. */
+
+#include <vector>
+
+#include "Types.h"
+#include "EndPoint.h"
+#include "Clock.h"
+#include "VersionedSnapshot.h"
+
+namespace kNet
+{
+
+/// Decides whether the traffic from a source IP address is let in, before the server spends any work on it.
+/** Each datagram and each accepted TCP connection from an address takes a token from the token bucket of the address.
+	The buckets are kept in a fixed-size table of cNumSets sets of cNumWays buckets, so that a lookup touches a single
+	cache line and no memory is ever allocated. When an address that is not in its set comes in, it takes over the bucket
+	that has the most tokens, i.e. the one that has been the least active. An abusive source keeps its bucket empty, so it
+	cannot be pushed out of the table by a flood from other addresses.
+
+	The banned addresses are dropped regardless of the rate. They are read through a VersionedSnapshot, so that changing
+	them at runtime does not stop the receive threads.
+
+	Any number of threads may call Admit() at the same time. Two threads may then update the same bucket at once, which
+	can lose a few of the tokens taken, so the rate limit is approximate. The other functions are for the main thread. */
+class SourceAddressFilter
+{
+public:
+	static const int cNumSets = 1024;
+	static const int cNumWays = 4;
+
+	/// The filter starts with no rate limit and no bans, so it admits everything.
+	SourceAddressFilter();
+
+	/// Limits each source address to the given number of datagrams and accepted connections per second, with bursts of up
+	/// to burstSize. Pass in 0 to remove the limit. [main thread]
+	void SetRateLimit(float unitsPerSec, float burstSize);
+
+	/// Returns the rate set with SetRateLimit(), or 0 if there is no limit.
+	float RateLimit() const { return rate; }
+
+	/// Drops all the traffic from the IP address of the given endpoint from now on. The port is ignored. [main thread]
+	void Ban(const EndPoint &address);
+
+	/// Lifts the ban of the IP address of the given endpoint. [main thread]
+	void Unban(const EndPoint &address);
+
+	/// Lifts all the bans. [main thread]
+	void ClearBans();
+
+	/// Returns true if the IP address of the given endpoint is banned. [main and worker thread]
+	bool IsBanned(const EndPoint &address) const;
+
+	/// Returns true if a unit of traffic from the given source is let in at the given time, and takes a token for it.
+	/// Otherwise counts the unit as dropped. [main and worker thread]
+	bool Admit(const EndPoint &source, tick_t now);
+
+	/// Returns the number of units dropped since the source was banned. [main and worker thread]
+	unsigned long NumBannedDrops() const { return (unsigned long)numBannedDrops; }
+
+	/// Returns the number of units dropped since the source was over the rate limit. [main and worker thread]
+	unsigned long NumRateLimitedDrops() const { return (unsigned long)numRateLimitedDrops; }
+
+private:
+	struct Bucket
+	{
+		/// The IPv4 address of the source, in network byte order, or 0 if the bucket is free.
+		u32 address;
+		/// The number of tokens at lastRefillMSecs.
+		float tokens;
+		u32 lastRefillMSecs;
+		u32 padding; ///< Keeps the buckets of a set in a single cache line.
+	};
+
+	std::vector<Bucket> buckets;
+	volatile float rate;
+	volatile float burstSize;
+
+	/// The banned addresses, sorted. [written by the main thread]
+	VersionedSnapshot<std::vector<u32> > bans;
+	/// The number of banned addresses, so that Admit() looks at bans only if there are any.
+	volatile long numBans;
+
+	volatile long numBannedDrops;
+	volatile long numRateLimitedDrops;
+
+	static u32 Address(const EndPoint &endPoint);
+
+	/// Returns the number of tokens in the given bucket at the given time.
+	float TokensAt(const Bucket &bucket, u32 nowMSecs) const;
+
+	/// Publishes the given list as the new list of bans. [main thread]
+	void PublishBans(const std::vector<u32> &newBans);
+
+	SourceAddressFilter(const SourceAddressFilter &); ///< Not implemented.
+	void operator =(const SourceAddressFilter &); ///< Not implemented.
+};
+
+} // ~kNet
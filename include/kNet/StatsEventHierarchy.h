@@ -22,15 +22,9 @@
 #include "kNet/WaitFreeQueue.h"
 #include "kNet/Clock.h"
 
-// This macro is used inside MessageConnection and NetworkServer objects, which have the 'owner' member.
+/// The events older than this are pruned from the hierarchy. See the ADDEVENT macro in StatsEventRecorder.h.
 static const int cEventOldAgeMSecs = 30 * 1000;
 
-#ifdef KNET_NETWORK_PROFILING
-#define ADDEVENT(name, value, valueType) (owner ? owner->Statistics()->AddEventToHierarchy((name), (value), (valueType), cEventOldAgeMSecs) : ((void)0))
-#else
-#define ADDEVENT(name, value, valueType) ((void)0)
-#endif
-
 namespace kNet
 {
 
@@ -72,7 +66,11 @@ public:
 	void PruneOldEventsThisLevel(int ageMSecs)
 	{
 		assert(ageMSecs >= 0);
-		tick_t tooOldMessageTime = Clock::Tick() - (tick_t)ageMSecs * Clock::TicksPerSec() / 1000;
+		PruneEventsOlderThan(Clock::Tick() - (tick_t)ageMSecs * Clock::TicksPerSec() / 1000);
+	}
+
+	void PruneEventsOlderThan(tick_t tooOldMessageTime)
+	{
 		while(events.Size() > 0)
 		{
 			StatsEvent *front = events.Front();
@@ -97,10 +95,37 @@ public:
 		e.value = value;
 		e.time = Clock::Tick();
 		PruneOldEventsThisLevel(oldAgeMSecs);
+		AddEventToThisLevel(e);
+	}
+
+	/// Adds an event that was recorded earlier, with its original time stamp. Does not prune the old events.
+	void AddEventToThisLevel(const StatsEvent &e)
+	{
 		if (events.Size() < 16384)
 			events.InsertWithResize(e);
 	}
 
+	/// Returns the node at the given dotted path below this node, and creates the nodes along the path that don't exist yet.
+	/// The new nodes get the given valueType.
+	StatsEventHierarchyNode *FindOrCreateChild(const char *name, const char *valueType)
+	{
+		int nextTokenStart = 0;
+		std::string childName = FirstToken(name, '.', nextTokenStart);
+		if (childName.empty())
+			return this;
+
+		NodeMap::iterator iter = children.find(childName);
+		if (iter == children.end())
+		{
+			iter = children.insert(std::make_pair(childName, StatsEventHierarchyNode())).first;
+			iter->second.valueType = valueType;
+		}
+		if (nextTokenStart == -1)
+			return &iter->second;
+		else
+			return iter->second.FindOrCreateChild(name + nextTokenStart, valueType);
+	}
+
 	///\ @param name The event track in the profiler hierachy to add the event to, e.g. "connection.messageIn.myMessageName". This
 	///              string may not contain two consecutive periods, e.g. "a..b".
 	void AddEventToHierarchy(const char *name, float value, const char *valueType, int oldAgeMSecs)
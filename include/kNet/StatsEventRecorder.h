@@ -0,0 +1,196 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file StatsEventRecorder.h
+	@brief The StatsEventRecorder class and the ADDEVENT macros, which record profiling events into per-thread queues
+	       that are assembled into a StatsEventHierarchyNode only when the statistics are read. */
+
+#include <string>
+#include <vector>
+
+#include "kNet/Types.h"
+#include "kNet/Clock.h"
+#include "kNet/Lockable.h"
+#include "kNet/Thread.h"
+#include "kNet/WaitFreeQueue.h"
+#include "kNet/StatsEventHierarchy.h"
+
+namespace kNet
+{
+
+/// The handle of an interned profiling counter name. Zero is never a valid handle.
+typedef u32 stats_counter_t;
+
+/// Interns the dotted counter names, e.g. "messageOut.PingRequest", into integer handles. A name is registered once, and
+/// gets the same handle in every Network of the process. [thread-safe]
+class StatsCounterRegistry
+{
+public:
+	/// Returns the handle of the given counter name, and registers the name if this is the first time it is seen.
+	/// Takes a lock, so cache the handle if the name is used repeatedly. The valueType of the first registration is kept.
+	static stats_counter_t Register(const char *name, const char *valueType);
+
+	/// Returns the number of registered counters. The handles are in the range [1, NumCounters()].
+	static size_t NumCounters();
+
+	/// Returns the name and the value type the given counter was registered with.
+	static void GetCounter(stats_counter_t counter, std::string &name, std::string &valueType);
+};
+
+/// The handle of a counter name at a single ADDEVENT call site, registered on the first event. A static instance is zero-
+/// initialized before any code runs, and two threads racing to fill it in both store the same handle.
+struct StatsCounterCache
+{
+	volatile stats_counter_t handle;
+
+	stats_counter_t Get(const char *name, const char *valueType)
+	{
+		if (!handle)
+			handle = StatsCounterRegistry::Register(name, valueType);
+		return handle;
+	}
+};
+
+/// The counters of the messages one way through a connection, e.g. "messageOut.PingRequest (1)", cached by message ID. The
+/// counter of a message ID is registered on its first message, so that counting the later ones takes no locks and does no
+/// string operations. The cache is direct-mapped, and a message ID that evicts another one is looked up again. [single thread]
+class MessageStatsCounters
+{
+public:
+	/// @param prefix The start of the counter names, e.g. "messageIn". Must stay alive as long as this object.
+	explicit MessageStatsCounters(const char *prefix);
+
+	/// Returns the counter of the given message ID, named "<prefix>.<name>", or "<prefix>.<id>" if the name is empty. The
+	/// name of a message ID is taken from its first message, and the fragments of a message have counters of their own.
+	stats_counter_t Get(message_id_t id, bool fragment, const char *name)
+	{
+		const u32 key = (u32)id ^ (fragment ? cFragmentKeyBit : 0);
+		Entry &entry = entries[(key * 2654435761u) >> (32 - cNumEntriesLog2)];
+		if (entry.handle == 0 || entry.key != key)
+		{
+			entry.key = key;
+			entry.handle = Register(id, name);
+		}
+		return entry.handle;
+	}
+
+private:
+	/// The message IDs fit in 31 bits, so the top bit tells the fragments apart.
+	static const u32 cFragmentKeyBit = 0x80000000;
+	static const int cNumEntriesLog2 = 6;
+
+	struct Entry
+	{
+		u32 key;
+		stats_counter_t handle;
+	};
+
+	const char *prefix;
+	Entry entries[1 << cNumEntriesLog2];
+
+	stats_counter_t Register(message_id_t id, const char *name) const;
+};
+
+/// Collects the profiling events of a Network. Each thread that adds events gets a wait-free queue of its own, so adding an
+/// event takes no locks and does no string operations. The queued events are moved into the StatsEventHierarchyNode when
+/// the hierarchy is acquired, or by the adding thread when its queue fills up and the hierarchy happens to be unlocked.
+class StatsEventRecorder
+{
+public:
+	StatsEventRecorder();
+	~StatsEventRecorder();
+
+	/// Records an event of the given counter with the current time. Drops the event if the queue of this thread is full
+	/// and another thread is reading the hierarchy. [worker and main thread]
+	void AddEvent(stats_counter_t counter, float value);
+
+	/// Moves the queued events into the hierarchy and returns it locked. [any thread]
+	Lock<StatsEventHierarchyNode> AcquireHierarchy();
+
+	/// Returns the number of events that were dropped because a queue was full.
+	u32 NumDroppedEvents() const { return (u32)numDroppedEvents; }
+
+	/// At most this many threads can add events. The events of the further threads are dropped.
+	static const int cMaxThreadSlots = 64;
+
+private:
+	struct PendingEvent
+	{
+		stats_counter_t counter;
+		float value;
+		tick_t time;
+	};
+
+	struct ThreadSlot
+	{
+		ThreadSlot(const ThreadId &thread_):thread(thread_), events(cSlotQueueSize) {}
+
+		ThreadId thread;
+		/// Filled only by the thread above, and emptied only by the holder of the hierarchy lock.
+		WaitFreeQueue<PendingEvent> events;
+	};
+
+	/// The size of the event queue of each thread.
+	static const int cSlotQueueSize = 4096;
+
+	Lockable<StatsEventHierarchyNode> hierarchy;
+
+	/// The slots are only added, and only while holding slotMutex. Each slot is written in full before it is published
+	/// by incrementing numSlots, so the lookup in AddEvent() can scan the first numSlots slots without locking.
+	ThreadSlot *slots[cMaxThreadSlots];
+	volatile long numSlots;
+	Lockable<int> slotMutex;
+
+	volatile long numDroppedEvents;
+
+	/// The events of all threads sorted to time order, reused between the flushes. [guarded by the hierarchy lock]
+	std::vector<PendingEvent> flushBuffer;
+	/// The node of each counter, looked up once per flush. [guarded by the hierarchy lock]
+	std::vector<StatsEventHierarchyNode*> counterNodes;
+
+	ThreadSlot *FindOrCreateSlot();
+
+	/// Moves the queued events of all threads into the given hierarchy, which the caller has locked.
+	void Flush(StatsEventHierarchyNode &root);
+
+	static bool EventTimeLess(const PendingEvent &a, const PendingEvent &b);
+
+	StatsEventRecorder(const StatsEventRecorder &); ///< Not implemented.
+	void operator =(const StatsEventRecorder &); ///< Not implemented.
+};
+
+} // ~kNet
+
+// These macros are used inside MessageConnection and NetworkServer objects, which have the 'owner' member.
+// ADDEVENT takes a constant name, whose handle is registered once and cached at the call site. ADDEVENT_DYNAMIC takes
+// a name that can change between the calls, and looks up its handle each time.
+#ifdef KNET_NETWORK_PROFILING
+#define ADDEVENT(name, value, valueType) \
+	do { \
+		if (owner) \
+		{ \
+			static kNet::StatsCounterCache counterCache_; \
+			owner->AddStatsEvent(counterCache_.Get((name), (valueType)), (float)(value)); \
+		} \
+	} while(0)
+#define ADDEVENT_DYNAMIC(name, value, valueType) \
+	do { \
+		if (owner) \
+			owner->AddStatsEvent(kNet::StatsCounterRegistry::Register((name), (valueType)), (float)(value)); \
+	} while(0)
+#else
+#define ADDEVENT(name, value, valueType) ((void)0)
+#define ADDEVENT_DYNAMIC(name, value, valueType) ((void)0)
+#endif
@@ -0,0 +1,76 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file StrikeRegister.h
+	@brief The StrikeRegister class, which tells the nonces seen recently from the new ones. */
+
+#include <cstddef>
+#include <set>
+
+#include "Types.h"
+
+namespace kNet
+{
+
+/// The nonces seen in the current epoch and in the one before it.
+/** The server uses this to reject a replayed connect datagram that carries early data, see Network::Connect(). The epochs
+	are those of the connection cookies, so a replay is caught for as long as the cookie in it is accepted. The epochs must
+	be passed in a non-decreasing order. At most maxNoncesPerEpoch nonces are recorded in an epoch, and once that many have
+	been, the rest are refused, so that a flood of connection attempts can't grow the register without bound.
+	This class is not thread-safe. */
+class StrikeRegister
+{
+public:
+	explicit StrikeRegister(size_t maxNoncesPerEpoch_ = 65536)
+	:maxNoncesPerEpoch(maxNoncesPerEpoch_), currentEpoch(0)
+	{
+	}
+
+	/// Records the given nonce, seen in the given epoch.
+	/// @return False if the nonce was seen in this or the previous epoch already, or if this epoch is full.
+	bool Insert(u64 nonce, u32 epoch)
+	{
+		if (epoch != currentEpoch)
+		{
+			if (epoch == currentEpoch + 1)
+				previous.swap(current);
+			else
+				previous.clear();
+			current.clear();
+			currentEpoch = epoch;
+		}
+		if (current.size() >= maxNoncesPerEpoch || previous.find(nonce) != previous.end())
+			return false;
+		return current.insert(nonce).second;
+	}
+
+	/// Forgets all the nonces seen.
+	void Clear()
+	{
+		current.clear();
+		previous.clear();
+	}
+
+	/// Returns the number of nonces recorded in the current and the previous epoch.
+	size_t Size() const { return current.size() + previous.size(); }
+
+private:
+	size_t maxNoncesPerEpoch;
+	u32 currentEpoch;
+	std::set<u64> current;
+	std::set<u64> previous;
+};
+
+} // ~kNet
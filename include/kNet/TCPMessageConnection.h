@@ -46,6 +46,33 @@ private:
 	/// Maintains a byte buffer that contains partial messages. [worker thread]
 	RingBuffer tcpInboundSocketData;
 
+	/// The message read from a file (see MessageConnection::SendFile) whose header has been sent, and whose content is now being
+	/// passed to the socket straight from the file, or 0. No other data may be sent before all of it. [worker thread]
+	NetworkMessage *outboundFileMessage;
+	/// The number of content bytes of outboundFileMessage that have been sent.
+	size_t outboundFileBytesSent;
+
+	/// The message being received straight to a file (see MessageConnection::ReceiveFile), or 0. [worker thread]
+	NetworkMessage *inboundFileMessage;
+	/// The number of content bytes of inboundFileMessage that have been received.
+	size_t inboundFileBytesReceived;
+
+	/// If true, the queued messages are held back, see MessageConnection::SetSendCoalescing(). [worker thread]
+	bool holdingOutboundMessages;
+	/// The time the messages started to be held back.
+	tick_t holdStartTime;
+	/// If true, the messages that were held back are being sent out, and the messages queued meanwhile follow them without
+	/// a delay of their own, until the queue is empty again.
+	bool flushingHeldMessages;
+
+	/// Returns true if the messages in outboundQueue should be held back for now, and starts holding them if needed.
+	bool HoldOutboundMessages(); // [worker thread]
+
+	bool HoldingOutboundMessages() const { return holdingOutboundMessages; } // [worker thread]
+
+	/// Passes the next chunk of outboundFileMessage to the socket, and frees the message when all of it has been sent.
+	PacketSendResult SendOutFileData(); // [worker thread]
+
 	/// Reads all available bytes from a stream socket.
 	SocketReadResult ReadSocket(size_t &bytesRead); // [worker thread]
 
@@ -54,13 +81,20 @@ private:
 
 	void DoUpdateConnection(); // [worker thread]
 
+	unsigned long TimeUntilNextUpdate() const; // [worker thread]
+
 	unsigned long TimeUntilCanSendPacket() const;
 
 	/// Parses the raw inbound byte stream into messages. [used internally by worker thread]
 	void ExtractMessages();
 
+	/// Decompresses the content of a CompressedData message, and handles the messages it contains.
+	/// @return The number of messages handled.
+	size_t ExtractCompressedMessages(const char *data, size_t numBytes); // [worker thread]
+
 	// The following are temporary data structures used by various internal routines for processing.
 	std::vector<NetworkMessage*> serializedMessages; // MessageConnection::TCPSendOutPacket()
+	std::vector<kNetBuffer> sendGatherBuffers; // MessageConnection::TCPSendOutPacket()
 
 	void PerformDisconnection();
 
@@ -17,6 +17,7 @@
 	@brief The Thread class. Implements threading either using Boost, native Win32 or pthreads constructs. */
 
 #include <string>
+#include <vector>
 
 #ifdef KNET_USE_BOOST
 #include <boost/thread.hpp>
@@ -56,6 +57,15 @@ typedef pthread_t ThreadId;
 
 std::string ThreadIdToString(const ThreadId &id);
 
+/// The scheduling priorities of Thread::SetCurrentThreadPriority().
+enum ThreadPriority
+{
+	ThreadPriorityLow, ///< Runs after the normal threads when the processors are contended.
+	ThreadPriorityNormal, ///< The default priority of the OS.
+	ThreadPriorityHigh, ///< Runs before the normal threads. On Linux, this needs CAP_SYS_NICE.
+	ThreadPriorityRealtime ///< Preempts all the normal threads (SCHED_FIFO on Linux, which needs CAP_SYS_NICE). A thread that busy-polls at this priority owns its core.
+};
+
 class Thread : public RefCountable
 {
 public:
@@ -83,6 +93,15 @@ public:
 	/// it didn't respond in that time. \todo Allow specifying the timeout period.
 	void Stop();
 
+	/// Sets the interrupt event of this thread, which wakes up the thread if it is waiting on that event.
+	/// Hold() and Stop() call this automatically. Callable from any thread.
+	void Interrupt();
+
+	/// Returns the event that is set when this thread is interrupted. A thread that blocks in an EventArray should include
+	/// this event in the wait set, so that it reacts immediately to Hold(), Stop() and other requests from the owner.
+	/// The running thread is responsible for resetting the event after it has woken up.
+	Event InterruptEvent() const { return threadInterruptEvent; }
+
 	/// Sets the name of this thread. This method is implemented for debugging purposes only, and does not do anything
 	/// if running outside Visual Studio debugger.
 	void SetName(const char *name);
@@ -106,6 +125,22 @@ public:
 	/// to quit in between.
 	static void Sleep(int msecs);
 
+	/// Gives the rest of the time slice of the calling thread to the other threads that are ready to run, if there are any.
+	static void YieldTimeSlice();
+
+	/// Returns the number of hardware threads (cores, or logical processors) in the system, or 1 if it cannot be determined.
+	static int NumHardwareThreads();
+
+	/// Restricts the calling thread to run on the given logical processors, numbered from 0. An empty list lets it run on
+	/// all of them. The OS allocates the memory that a thread touches first on the NUMA node it runs on, so setting this
+	/// before the thread allocates its data keeps the data on the node of its processors.
+	/// @return True on success. Supported on Linux and Windows.
+	static bool SetCurrentThreadAffinity(const std::vector<int> &cpus);
+
+	/// Sets the scheduling priority of the calling thread.
+	/// @return True on success. Supported on Linux and Windows.
+	static bool SetCurrentThreadPriority(ThreadPriority priority);
+
 	ThreadId Id();
 
 	static ThreadId CurrentThreadId();
@@ -194,6 +229,9 @@ private:
 	Event threadHoldEventAcked;
 	Event threadResumeEvent;
 
+	/// Used to wake up the thread from its wait. See InterruptEvent().
+	Event threadInterruptEvent;
+
 	void StartThread();
 
 #ifdef KNET_USE_BOOST
@@ -0,0 +1,317 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file TimerWheel.h
+	@brief The TimerWheel class. A hierarchical timing wheel for scheduling a large number of timers. */
+
+#include <vector>
+#include <cassert>
+#include <cstddef>
+
+#include "Types.h"
+#include "BitOps.h"
+
+namespace kNet
+{
+
+/// A hierarchical timing wheel, see http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf .
+/** Schedules at most one timer per integer id in the range [0, N[. Scheduling, rescheduling and canceling a timer, and
+	finding out when the next timer expires are all O(1). Advancing the wheel only visits the timers that expire, and the
+	ones that are moved down from a coarser level to a finer level.
+
+	The wheel has a resolution of one millisecond. The finest level has 256 slots of 1 msec, the second level 64 slots of
+	256 msecs and the third level 64 slots of 16384 msecs, which covers timers up to about 17 minutes into the future.
+	Timers further away are parked at the far end of the wheel and rescheduled when they get there.
+
+	Time is passed in as an absolute millisecond count of any monotonic clock. This class is not thread-safe. */
+class TimerWheel
+{
+public:
+	TimerWheel()
+	:currentTime(0), numScheduled(0)
+	{
+		Reset(0);
+	}
+
+	/// Removes all timers and sets the current time of the wheel.
+	void Reset(u64 nowMSecs)
+	{
+		for(int i = 0; i < cNumSlots; ++i)
+			slotHeads[i] = -1;
+		for(int i = 0; i < cNumOccupancyWords; ++i)
+			occupied[i] = 0;
+		for(size_t i = 0; i < timers.size(); ++i)
+			timers[i].slot = -1;
+		currentTime = nowMSecs;
+		numScheduled = 0;
+	}
+
+	/// Schedules the timer of the given id to expire at the given time. If the timer was already scheduled, it is moved
+	/// to the new time. A deadline that is not in the future of the wheel expires on the next millisecond.
+	void Schedule(int id, u64 deadlineMSecs)
+	{
+		assert(id >= 0);
+		if ((size_t)id >= timers.size())
+		{
+			Timer unscheduled = { -1, -1, -1, 0 };
+			timers.resize(id + 1, unscheduled);
+		}
+		if (timers[id].slot != -1)
+			Unlink(id);
+		else
+			++numScheduled;
+
+		timers[id].deadline = (deadlineMSecs > currentTime) ? deadlineMSecs : currentTime + 1;
+		Place(id);
+	}
+
+	/// Cancels the timer of the given id. Does nothing if the timer is not scheduled.
+	void Cancel(int id)
+	{
+		if (!IsScheduled(id))
+			return;
+		Unlink(id);
+		timers[id].slot = -1;
+		--numScheduled;
+	}
+
+	/// Returns true if the timer of the given id is scheduled.
+	bool IsScheduled(int id) const
+	{
+		return id >= 0 && (size_t)id < timers.size() && timers[id].slot != -1;
+	}
+
+	/// Returns the time the given timer is scheduled to expire at. Only valid if IsScheduled(id).
+	u64 Deadline(int id) const
+	{
+		assert(IsScheduled(id));
+		return timers[id].deadline;
+	}
+
+	/// Returns the number of timers currently scheduled.
+	int NumScheduled() const { return numScheduled; }
+
+	/// Returns the time the wheel has been advanced to.
+	u64 CurrentTime() const { return currentTime; }
+
+	/// Returns how many msecs there are from nowMSecs to the next time Advance() needs to be called, or -1 if no timers
+	/// are scheduled. The returned time can be earlier than any actual deadline, when timers need to be moved from a
+	/// coarser level to a finer one, but it is never later than the earliest deadline.
+	int MSecsUntilNextExpiry(u64 nowMSecs) const
+	{
+		if (numScheduled == 0)
+			return -1;
+
+		u64 next = (u64)-1;
+		const int slot0 = FindOccupiedSlot(0, cLevel0Slots, (int)((currentTime + 1) & cLevel0Mask));
+		if (slot0 != -1)
+			next = currentTime + 1 + (((u64)slot0 - (currentTime + 1)) & cLevel0Mask);
+		for(int level = 1; level < cNumLevels; ++level)
+		{
+			const int shift = LevelShift(level);
+			const u64 block = currentTime >> shift;
+			const int slot = FindOccupiedSlot(level, cLevelNSlots, (int)((block + 1) & cLevelNMask));
+			if (slot == -1)
+				continue;
+			// The timers in this slot are moved down at the start of the block the slot represents.
+			const u64 cascadeTime = (block + 1 + (((u64)slot - (block + 1)) & cLevelNMask)) << shift;
+			if (cascadeTime < next)
+				next = cascadeTime;
+		}
+		assert(next != (u64)-1);
+		if (next <= nowMSecs)
+			return 0;
+		const u64 msecs = next - nowMSecs;
+		return (msecs > 0x7FFFFFFF) ? 0x7FFFFFFF : (int)msecs;
+	}
+
+	/// Advances the wheel to the given time, and appends the ids of the timers that expired on the way to the given
+	/// list. The expired timers are no longer scheduled.
+	void Advance(u64 nowMSecs, std::vector<int> &expired)
+	{
+		if (numScheduled == 0 && nowMSecs > currentTime)
+			currentTime = nowMSecs;
+
+		while(currentTime < nowMSecs)
+		{
+			// Jump directly to the next time something needs to be done: either a slot on the finest level has timers
+			// to expire, or the timers of a coarser level need to be moved down when a new block starts.
+			u64 next;
+			if (occupied[0] == 0 && occupied[1] == 0 && occupied[2] == 0 && occupied[3] == 0)
+				next = (occupied[4] == 0) ? (currentTime | cLevel1Span) + 1 : (currentTime | cLevel0Mask) + 1;
+			else
+			{
+				const int slot0 = FindOccupiedSlot(0, cLevel0Slots, (int)((currentTime + 1) & cLevel0Mask));
+				next = currentTime + 1 + (((u64)slot0 - (currentTime + 1)) & cLevel0Mask);
+				const u64 blockEnd = (currentTime | cLevel0Mask) + 1;
+				if (blockEnd < next)
+					next = blockEnd;
+			}
+			if (next > nowMSecs)
+			{
+				currentTime = nowMSecs;
+				break;
+			}
+			currentTime = next;
+
+			if ((currentTime & cLevel0Mask) == 0)
+			{
+				if (((currentTime >> LevelShift(1)) & cLevelNMask) == 0)
+					Cascade(SlotIndex(2, (int)((currentTime >> LevelShift(2)) & cLevelNMask)));
+				Cascade(SlotIndex(1, (int)((currentTime >> LevelShift(1)) & cLevelNMask)));
+			}
+			Expire((int)(currentTime & cLevel0Mask), expired);
+		}
+	}
+
+private:
+	enum
+	{
+		cNumLevels = 3,
+		cLevel0Bits = 8,
+		cLevelNBits = 6,
+		cLevel0Slots = 1 << cLevel0Bits,
+		cLevelNSlots = 1 << cLevelNBits,
+		cLevel0Mask = cLevel0Slots - 1,
+		cLevelNMask = cLevelNSlots - 1,
+		cLevel1Span = (1 << (cLevel0Bits + cLevelNBits)) - 1, ///< A mask of the msecs covered by one revolution of level 1.
+		cNumSlots = cLevel0Slots + (cNumLevels - 1) * cLevelNSlots,
+		cNumOccupancyWords = cNumSlots / 64
+	};
+
+	/// The span of msecs the wheel can hold without parking timers at its far end.
+	static u64 MaxSpan() { return (u64)1 << (cLevel0Bits + (cNumLevels - 1) * cLevelNBits); }
+
+	static int LevelShift(int level) { return (level == 0) ? 0 : cLevel0Bits + (level - 1) * cLevelNBits; }
+
+	static int SlotIndex(int level, int slot) { return (level == 0) ? slot : cLevel0Slots + (level - 1) * cLevelNSlots + slot; }
+
+	struct Timer
+	{
+		int next; ///< The next timer in the same slot, or -1.
+		int prev; ///< The previous timer in the same slot, or -1.
+		int slot; ///< The slot this timer is in, or -1 if the timer is not scheduled.
+		u64 deadline;
+	};
+
+	std::vector<Timer> timers;
+	/// The first timer in each slot, or -1 if the slot is empty.
+	int slotHeads[cNumSlots];
+	/// A bit for each slot that has timers in it. Words 0-3 are for level 0, word 4 for level 1 and word 5 for level 2.
+	u64 occupied[cNumOccupancyWords];
+	u64 currentTime;
+	int numScheduled;
+
+	/// Returns the index of the first occupied slot of the given level, searching circularly from the given slot.
+	int FindOccupiedSlot(int level, int numSlots, int startSlot) const
+	{
+		const int firstWord = SlotIndex(level, 0) / 64;
+		const int numWords = numSlots / 64;
+		int word = startSlot / 64;
+		u64 bits = occupied[firstWord + word] & ((u64)-1 << (startSlot & 63));
+		// The starting word is visited twice: first for the bits at and after startSlot, and last for the ones before it.
+		for(int i = 0; i <= numWords; ++i)
+		{
+			if (bits != 0)
+				return word * 64 + LSBIndex64(bits);
+			word = (word + 1) % numWords;
+			bits = occupied[firstWord + word];
+		}
+		return -1;
+	}
+
+	/// Inserts the given timer into the slot that corresponds to its deadline.
+	void Place(int id)
+	{
+		Timer &t = timers[id];
+		assert(t.deadline >= currentTime);
+		u64 when = t.deadline;
+		u64 delta = when - currentTime;
+		if (delta >= MaxSpan())
+		{
+			when = currentTime + MaxSpan() - 1;
+			delta = MaxSpan() - 1;
+		}
+		int slot;
+		if (delta < cLevel0Slots)
+			slot = SlotIndex(0, (int)(when & cLevel0Mask));
+		else if (delta <= cLevel1Span)
+			slot = SlotIndex(1, (int)((when >> LevelShift(1)) & cLevelNMask));
+		else
+			slot = SlotIndex(2, (int)((when >> LevelShift(2)) & cLevelNMask));
+
+		t.slot = slot;
+		t.prev = -1;
+		t.next = slotHeads[slot];
+		if (t.next != -1)
+			timers[t.next].prev = id;
+		slotHeads[slot] = id;
+		occupied[slot / 64] |= (u64)1 << (slot & 63);
+	}
+
+	/// Removes the given timer from its slot. Leaves the slot field of the timer pointing to the old slot.
+	void Unlink(int id)
+	{
+		Timer &t = timers[id];
+		if (t.prev != -1)
+			timers[t.prev].next = t.next;
+		else
+		{
+			slotHeads[t.slot] = t.next;
+			if (t.next == -1)
+				occupied[t.slot / 64] &= ~((u64)1 << (t.slot & 63));
+		}
+		if (t.next != -1)
+			timers[t.next].prev = t.prev;
+	}
+
+	/// Moves all timers of the given slot of a coarser level down to the slots that now correspond to their deadlines.
+	void Cascade(int slot)
+	{
+		int id = slotHeads[slot];
+		slotHeads[slot] = -1;
+		occupied[slot / 64] &= ~((u64)1 << (slot & 63));
+		while(id != -1)
+		{
+			const int next = timers[id].next;
+			Place(id);
+			id = next;
+		}
+	}
+
+	/// Unschedules all timers in the given slot of the finest level and adds them to the expired list.
+	void Expire(int slot, std::vector<int> &expired)
+	{
+		int id = slotHeads[slot];
+		slotHeads[slot] = -1;
+		occupied[slot / 64] &= ~((u64)1 << (slot & 63));
+		while(id != -1)
+		{
+			Timer &t = timers[id];
+			const int next = t.next;
+			if (t.deadline > currentTime) // This timer was parked at the end of the wheel, and still has time left.
+				Place(id);
+			else
+			{
+				t.slot = -1;
+				--numScheduled;
+				expired.push_back(id);
+			}
+			id = next;
+		}
+	}
+};
+
+} // ~kNet
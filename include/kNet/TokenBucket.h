@@ -0,0 +1,101 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file TokenBucket.h
+	@brief The TokenBucket class, which limits the rate of an activity to a given number of units per second. */
+
+#include <cmath>
+
+#include "Clock.h"
+
+namespace kNet
+{
+
+/// A token bucket that is refilled at a constant rate, and drained by the units of work that were done.
+/// The bucket is allowed to go into debt by one send, since the size of a packet is only known after it has been
+/// composed. The next send then waits until the debt has been paid back. The bucket can hold up to BurstSize() tokens,
+/// which limits how much an idle period can be made up for. [Not thread-safe]
+class TokenBucket
+{
+public:
+	/// The default ctor creates a bucket that doesn't limit anything.
+	TokenBucket()
+	:rate(0), burstSize(0), tokens(0), lastRefillTick(0)
+	{
+	}
+
+	/// Sets the refill rate of this bucket.
+	/// @param tokensPerSec The number of tokens added to the bucket per second. Pass in 0 to disable the limit.
+	/// @param burstSize_ The maximum number of tokens the bucket can hold.
+	/// @param now The current time, which is where the bucket starts to refill from.
+	void SetRate(double tokensPerSec, double burstSize_, tick_t now)
+	{
+		rate = (tokensPerSec > 0) ? tokensPerSec : 0;
+		burstSize = (burstSize_ > 0) ? burstSize_ : 0;
+		tokens = (tokens < burstSize && IsLimited()) ? tokens : burstSize;
+		lastRefillTick = now;
+	}
+
+	/// Returns true if this bucket limits the rate, i.e. has a nonzero rate.
+	bool IsLimited() const { return rate > 0; }
+
+	/// Returns the number of tokens added to the bucket per second, or 0 if the bucket doesn't limit anything.
+	double Rate() const { return rate; }
+
+	double BurstSize() const { return burstSize; }
+
+	/// Returns the number of tokens in the bucket at the given time. This is negative if the bucket is in debt.
+	double TokensAt(tick_t now) const
+	{
+		const double refilled = tokens + rate * Clock::TimespanToSecondsD(lastRefillTick, now);
+		return (refilled < burstSize) ? refilled : burstSize;
+	}
+
+	/// Takes the given number of tokens out of the bucket.
+	void Consume(double numTokens, tick_t now)
+	{
+		if (!IsLimited())
+			return;
+		tokens = TokensAt(now) - numTokens;
+		lastRefillTick = now;
+	}
+
+	/// Returns the number of ticks until the bucket is out of debt, or 0 if it can be drained right now.
+	tick_t TicksUntilAvailable(tick_t now) const
+	{
+		if (!IsLimited())
+			return 0;
+		const double available = TokensAt(now);
+		if (available >= 0)
+			return 0;
+		return (tick_t)std::ceil(-available / rate * (double)Clock::TicksPerSec());
+	}
+
+	/// Returns the number of milliseconds until the bucket is out of debt, rounded up, or 0 if it can be drained right now.
+	unsigned long MSecsUntilAvailable(tick_t now) const
+	{
+		const tick_t ticks = TicksUntilAvailable(now);
+		return (ticks == 0) ? 0 : (unsigned long)std::ceil(Clock::TicksToMillisecondsD(ticks));
+	}
+
+private:
+	double rate;
+	double burstSize;
+	/// The number of tokens at lastRefillTick.
+	double tokens;
+	tick_t lastRefillTick;
+};
+
+} // ~kNet
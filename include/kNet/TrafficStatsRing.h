@@ -0,0 +1,162 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file TrafficStatsRing.h
+	@brief The TrafficStatsRing class, which sums up the traffic of a connection into fixed-length time intervals. */
+
+#include <cstring>
+
+#include "Types.h"
+#include "Clock.h"
+
+namespace kNet
+{
+
+/// The average traffic rates of a connection over a recent time window.
+struct ConnectionTrafficRates
+{
+	float packetsInPerSec;  ///< The average number of datagrams received/second.
+	float packetsOutPerSec; ///< The average number of datagrams sent/second.
+	float msgsInPerSec;     ///< The average number of kNet messages received/second.
+	float msgsOutPerSec;    ///< The average number of kNet messages sent/second.
+	float bytesInPerSec;    ///< The average number of bytes received/second. This includes kNet headers.
+	float bytesOutPerSec;   ///< The average number of bytes sent/second. This includes kNet headers.
+};
+
+/// A ring of per-interval traffic buckets. Adding traffic only updates the counters of the bucket of the current interval,
+/// and computing the rates sums up a fixed number of buckets, so neither allocates memory or depends on the number of
+/// packets. [Not thread-safe]
+class TrafficStatsRing
+{
+public:
+	/// The length of the time interval of each bucket.
+	static const int cBucketMSecs = 100;
+	/// The number of buckets, which limits the longest window ComputeRates() can use.
+	static const int cNumBuckets = 64;
+
+	TrafficStatsRing()
+	:ticksPerBucket(Clock::TicksPerSec() * cBucketMSecs / 1000)
+	{
+		if (ticksPerBucket == 0)
+			ticksPerBucket = 1;
+		Clear();
+	}
+
+	void Clear()
+	{
+		memset(buckets, 0, sizeof(buckets));
+	}
+
+	void AddInbound(tick_t now, u32 numBytes, u32 numPackets, u32 numMessages)
+	{
+		Bucket &b = BucketAt(now);
+		b.bytesIn += numBytes;
+		b.packetsIn += numPackets;
+		b.messagesIn += numMessages;
+		++b.numEvents;
+	}
+
+	void AddOutbound(tick_t now, u32 numBytes, u32 numPackets, u32 numMessages)
+	{
+		Bucket &b = BucketAt(now);
+		b.bytesOut += numBytes;
+		b.packetsOut += numPackets;
+		b.messagesOut += numMessages;
+		++b.numEvents;
+	}
+
+	/// Returns the average rates over the traffic of the given window that ends at now. The time span is measured from the
+	/// first to the last interval that had traffic, but is at least a second. If there has been only a single traffic
+	/// event in the window, the rates are zero.
+	ConnectionTrafficRates ComputeRates(tick_t now, int windowMSecs) const
+	{
+		ConnectionTrafficRates rates;
+		memset(&rates, 0, sizeof(rates));
+
+		const u64 newest = Interval(now);
+		u64 numIntervals = (u64)windowMSecs / cBucketMSecs;
+		if (numIntervals > (u64)cNumBuckets)
+			numIntervals = cNumBuckets;
+		if (numIntervals > newest + 1)
+			numIntervals = newest + 1;
+
+		u64 bytesIn = 0, bytesOut = 0, packetsIn = 0, packetsOut = 0, messagesIn = 0, messagesOut = 0;
+		u32 numEvents = 0;
+		u64 firstActive = 0, lastActive = 0;
+		for(u64 interval = newest + 1 - numIntervals; interval <= newest; ++interval)
+		{
+			const Bucket &b = buckets[interval % cNumBuckets];
+			if (b.interval != interval || b.numEvents == 0)
+				continue;
+			if (numEvents == 0)
+				firstActive = interval;
+			lastActive = interval;
+			numEvents += b.numEvents;
+			bytesIn += b.bytesIn;
+			bytesOut += b.bytesOut;
+			packetsIn += b.packetsIn;
+			packetsOut += b.packetsOut;
+			messagesIn += b.messagesIn;
+			messagesOut += b.messagesOut;
+		}
+		if (numEvents <= 1)
+			return rates;
+
+		float secs = (float)(lastActive - firstActive + 1) * cBucketMSecs / 1000.f;
+		if (secs < 1.f)
+			secs = 1.f;
+		rates.bytesInPerSec = (float)bytesIn / secs;
+		rates.bytesOutPerSec = (float)bytesOut / secs;
+		rates.packetsInPerSec = (float)packetsIn / secs;
+		rates.packetsOutPerSec = (float)packetsOut / secs;
+		rates.msgsInPerSec = (float)messagesIn / secs;
+		rates.msgsOutPerSec = (float)messagesOut / secs;
+		return rates;
+	}
+
+private:
+	struct Bucket
+	{
+		/// The number of the time interval this bucket holds the traffic of. A bucket is reused for a later interval
+		/// once the ring has wrapped around.
+		u64 interval;
+		u32 numEvents;
+		u32 bytesIn;
+		u32 bytesOut;
+		u32 packetsIn;
+		u32 packetsOut;
+		u32 messagesIn;
+		u32 messagesOut;
+	};
+
+	tick_t ticksPerBucket;
+	Bucket buckets[cNumBuckets];
+
+	u64 Interval(tick_t tick) const { return (u64)(tick / ticksPerBucket); }
+
+	Bucket &BucketAt(tick_t now)
+	{
+		const u64 interval = Interval(now);
+		Bucket &b = buckets[interval % cNumBuckets];
+		if (b.interval != interval)
+		{
+			memset(&b, 0, sizeof(b));
+			b.interval = interval;
+		}
+		return b;
+	}
+};
+
+} // ~kNet
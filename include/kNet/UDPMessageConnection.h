@@ -17,9 +17,16 @@
 	@brief The UDPMessageConnection class. */
 
 #include "MessageConnection.h"
-#include "SequentialIntegerSet.h"
+#include "PacketIDWindow.h"
+#include "PacketIDRing.h"
+#include "ReorderRing.h"
+#include "MessageNumberWindow.h"
 #include "Array.h"
 #include "OrderedHashTable.h"
+#include "DatagramBuffer.h"
+#include "CongestionControl.h"
+#include "DatagramCipher.h"
+#include "CRC32C.h"
 
 /*
 UDP packet format: 3 bytes if InOrder=false. 5-6 bytes if InOrder=true.
@@ -70,9 +77,49 @@ public:
 
 	float RetransmissionTimeout() const { return retransmissionTimeout; }
 
+	/// Returns the rate the datagrams are currently paced out at, in datagrams of MaxDatagramSize() bytes per second.
 	float DatagramSendRate() const { return datagramSendRate; }
 
-	void SetDatagramSendRate(float newRateDgramsPerSecond) { datagramSendRate = newRateDgramsPerSecond; }
+	/// @deprecated The send rate is now paced by the congestion controller, see SetCongestionControl(). This sets an upper
+	/// limit of the given number of datagrams per second with SetMaximumDataSendRate(), and keeps the byte rate limit as is.
+	/// Pass 0 to remove the limit. [main thread]
+	void SetDatagramSendRate(float newRateDgramsPerSecond)
+	{
+		int numDatagramsPerSec = (int)newRateDgramsPerSecond;
+		if (newRateDgramsPerSecond > 0.f && numDatagramsPerSec < 1)
+			numDatagramsPerSec = 1;
+		SetMaximumDataSendRate(MaximumBytesSendRate(), numDatagramsPerSec);
+	}
+
+	/// Selects the congestion control algorithm of this connection. The worker thread switches over to a new controller
+	/// before it sends out the next datagrams, starting again from the initial window. The default is CongestionControlCubic. [main thread]
+	void SetCongestionControl(CongestionControlAlgorithm algorithm) { congestionControlAlgorithm = algorithm; }
+
+	/// Returns the congestion control algorithm of this connection. [main and worker thread]
+	CongestionControlAlgorithm CongestionControlInUse() const { return congestionControlAlgorithm; }
+
+	/// Returns the number of bytes of reliable datagrams the congestion controller allows in flight. [main and worker thread]
+	size_t CongestionWindow() const { return congestionWindow; }
+
+	/// Returns the number of bytes of reliable datagrams sent and neither acked nor lost yet. [main and worker thread]
+	size_t BytesInFlight() const { return bytesInFlight; }
+
+	/// Returns the estimated bandwidth the path to the peer delivers, in bytes/second, or 0 until measured. Unlike
+	/// BytesOutPerSec(), this tells how much the connection could send. Measured from the delivery rates of the reliable
+	/// datagrams, so a connection that sends less than the path carries sees a lower bound. See BandwidthEstimator.
+	/// [main and worker thread]
+	float AvailableBandwidth() const { return availableBandwidth; }
+
+	/// Returns the estimated time the datagrams wait in the queues of the path, in milliseconds: the smoothed round trip
+	/// time above the min round trip time. A growing delay shows that the connection sends more than the path carries.
+	/// [main and worker thread]
+	float QueuingDelay() const { return queuingDelay; }
+
+	/// Registers a handler that is told when AvailableBandwidth() or QueuingDelay() have changed, so that the application
+	/// can adapt its sending rate before the outbound queue builds up. Pass null to stop the calls.
+	/// @param relativeChange The handler is called when the bandwidth has changed by this fraction of the value last
+	///        reported, or the queuing delay by this fraction of the min round trip time, at least a millisecond. [main thread]
+	void SetBandwidthEstimateHandler(IBandwidthEstimateHandler *handler, float relativeChange = 0.1f);
 
 	float SmoothedRtt() const { return smoothedRTT; }
 
@@ -80,32 +127,296 @@ public:
 
 	size_t NumOutboundUnackedDatagrams() const { return outboundPacketAckTrack.Size(); }
 
-	size_t NumReceivedUnackedDatagrams() const { return inboundPacketAckTrack.size(); }
+	size_t NumReceivedUnackedDatagrams() const { return (size_t)receivedPacketIDs.NumPendingAcks(); }
 
 	float PacketLossCount() const { return packetLossCount; }
 
+	/// Returns the estimated fraction of the datagrams sent to the peer that are lost, [0, 1]. Measured from the acks
+	/// and the detected losses of the reliable datagrams. [main and worker thread]
 	float PacketLossRate() const { return packetLossRate; }
 
+	/// Returns the number of datagrams received from the peer that a router on the path had marked Congestion Experienced
+	/// instead of dropping them (ECN, RFC 3168). The count is echoed back to the peer in the acks. [main and worker thread]
+	u32 NumCongestionMarksReceived() const { return numCEMarksReceived; }
+
+	/// Returns the number of datagrams sent to the peer that it has reported as marked Congestion Experienced. Each
+	/// increase is handled by the congestion controller like a loss, see CongestionControl::OnCongestionMarked().
+	/// [main and worker thread]
+	u32 NumCongestionMarksReported() const { return peerCEMarks; }
+
+	/// Returns the number of received datagrams that were dropped since they could not be parsed. The messages of a
+	/// malformed datagram before the first malformed one are still handled. [main and worker thread]
+	u32 NumMalformedDatagrams() const { return numMalformedDatagrams; }
+
+	/// Sets the number of malformed datagrams after which this connection is closed, or 0 to never close it for them.
+	/// The default is Network::MalformedDatagramLimit(). See NumMalformedDatagrams(). [main and worker thread]
+	void SetMalformedDatagramLimit(u32 limit) { malformedDatagramLimit = limit; }
+
+	/// Returns the number of malformed datagrams after which this connection is closed. See SetMalformedDatagramLimit().
+	u32 MalformedDatagramLimit() const { return malformedDatagramLimit; }
+
+	/// Sets the number of datagrams that one forward error correction parity datagram covers. The datagrams that carry
+	/// unreliable messages with NetworkMessage::forwardErrorCorrection set, or of at least the priority given to
+	/// SetForwardErrorCorrectionPriority(), are protected in groups of this many. The receiver can rebuild a single lost
+	/// datagram of each group. If 0 (the default), the group size adapts to PacketLossRate(), which trades bandwidth
+	/// overhead for more protection on lossy links. [main thread]
+	void SetForwardErrorCorrectionGroupSize(int numDatagrams);
+
+	/// Returns the number of datagrams one parity datagram currently covers. [main and worker thread]
+	int ForwardErrorCorrectionGroupSize() const { return fecGroupSize; }
+
+	/// Protects all the unreliable messages of at least the given priority with forward error correction. Pass
+	/// NetworkMessage::cPriorityDontSend (the default) to only protect the messages that have
+	/// NetworkMessage::forwardErrorCorrection set. [main thread]
+	void SetForwardErrorCorrectionPriority(unsigned long minPriority) { fecMinPriority = minPriority; }
+
+	/// Returns the priority from which on unreliable messages are protected by forward error correction. [main and worker thread]
+	unsigned long ForwardErrorCorrectionPriority() const { return fecMinPriority; }
+
+	/// Returns the size of the largest datagram currently sent to the peer. The connection starts from a size that every path
+	/// is assumed to carry, and probes its way up to MaxDatagramSizeLimit() and to the limit the peer has advertised
+	/// (packetization layer path MTU discovery, RFC 8899). Falls back to the starting size if large datagrams stop getting
+	/// through. [main and worker thread]
+	size_t MaxDatagramSize() const { return maxDatagramSize; }
+
+	/// Sets the largest datagram this connection sends, and asks the peer not to send larger ones either. The limit is
+	/// clamped to the max send size of the socket, see Network::SetMaxDatagramSize(), which is also the default. [main thread]
+	void SetMaxDatagramSizeLimit(size_t bytes);
+
+	/// Returns the largest datagram this connection is allowed to send. See SetMaxDatagramSizeLimit(). [main and worker thread]
+	size_t MaxDatagramSizeLimit() const { return maxDatagramSizeLimit; }
+
+	/// Enables or disables the aggregation of messages in the datagrams sent. When enabled (the default), a run of messages
+	/// with the same ID and flags in a datagram is written as a single Aggregate record, which carries the message header,
+	/// the ID and the reliable and order numbers once, followed by the length-prefixed contents of the messages. This cuts
+	/// the overhead of streams of small messages, such as entity updates. [main thread]
+	void SetMessageAggregation(bool enabled) { messageAggregation = enabled; }
+
+	/// Returns true if the runs of similar messages are aggregated in the datagrams sent. [main and worker thread]
+	bool MessageAggregation() const { return messageAggregation; }
+
+	/// Returns the number of new reliable messages the peer has room to buffer, or -1 if the peer does not grant receive credits.
+	/// Each end of a connection grants the other credits for as many reliable messages as its inbound queue has room for, and
+	/// advertises them in FlowControlRequest messages. Once the credits are used up, new reliable messages wait in the outbound
+	/// queue until the application at the other end has processed some of the messages it has received, so that a slow
+	/// receiver slows down the sender instead of dropping the datagrams. [main and worker thread]
+	int ReceiveCreditsLeft() const;
+
+	/// Returns true if the datagrams of this connection are encrypted and authenticated, see Network::SetEncryptionKey().
+	/// [main and worker thread]
+	bool IsEncrypted() const { return cipher.HasKey(); }
+
+	/// Returns true if the datagrams of this connection end in a CRC-32C checksum, see Network::SetDatagramChecksums().
+	/// [main and worker thread]
+	bool DatagramChecksumsEnabled() const { return datagramChecksums; }
+
+	/// The number of bytes the checksum adds to the end of each datagram of a connection that has checksums enabled.
+	static const size_t cChecksumSize = 4;
+
+	/// A server answers a connection attempt that does not end in a valid cookie with a challenge: these four bytes followed
+	/// by the cookie, cConnectChallengeSize bytes in all. The client then sends its connect datagram again with the cookie
+	/// appended to it. The server only allocates the connection once it gets the cookie back, see NetworkServer::DatagramReceived().
+	static const char cConnectChallengeMagic[4];
+	static const size_t cConnectCookieSize = 8;
+	static const size_t cConnectChallengeSize = 4 + cConnectCookieSize;
+
+	/// The connect datagram ends in the size of the early data in it as a u16, with cConnectChecksumsFlag set if the client
+	/// asks for datagram checksums, followed by the salt of the connection and a tag over everything before the tag if the
+	/// connection is encrypted. The early data is the first datagram of the
+	/// connection, placed between the connect message of the application and the trailer, and followed by a random nonce
+	/// that lets the server refuse a replay of it. See Network::Connect().
+	static const size_t cConnectTrailerSize = 2;
+	static const size_t cEarlyDataNonceSize = 8;
+	static const u16 cConnectChecksumsFlag = 0x8000;
+
+	/// Once the connection is open, a connect challenge means that the server got a datagram of the connection from an
+	/// address it does not know, for example after a NAT rebinding. The client then answers with a migration request: these
+	/// four bytes, the connection ID the server gave it, the tag of the request if the connection is encrypted, and the
+	/// cookie of the challenge. The server moves the connection to the new address once it gets the request, see
+	/// NetworkServer::ProcessUDPConnectionMigration().
+	static const char cMigrationRequestMagic[4];
+	static const size_t cMigrationRequestSize = 4 + 8 + cConnectCookieSize;
+
+	/// Returns true if the given datagram is shaped like a migration request. [main and worker thread]
+	static bool IsMigrationRequest(const char *data, size_t numBytes);
+
+	/// Returns the random ID the server gave this connection, or 0 if the client has not received it yet. [main thread at
+	/// the server, worker thread at the client]
+	u64 ConnectionID() const { return connectionID; }
+
 private:
+	/// If the given datagram is a connect challenge from the server, sends the connect datagram again with the cookie of
+	/// the challenge appended to it, or a migration request if the connection is open, and returns true. [worker thread]
+	bool HandleConnectChallenge(const char *data, size_t numBytes);
+
+	/// Sends the server a migration request that ends in the given cookie. [worker thread]
+	void SendMigrationRequest(const u8 *cookie);
+
+	/// Computes the tag of the migration request that starts with the given magic and connection ID, and ends in the given
+	/// cookie. [main and worker thread]
+	void ComputeMigrationRequestTag(const char *request, const u8 *cookie, u8 *tag) const;
+
+	/// Returns true if the given migration request carries the ID of this connection, and the right tag if the connection
+	/// is encrypted. [main thread]
+	bool IsValidMigrationRequest(const char *data, size_t numBytes) const;
+
+	/// Sends the connection ID to the client, so that the client can prove it owns the connection when it moves to a new
+	/// address. [main thread, server only]
+	void SendConnectionIDMessage();
+
+	void HandleConnectionIDMessage(const char *data, size_t numBytes); // [worker thread]
+
+	// Handing the connection over to another process, see Network::HandOffServer(). Called on the main thread while the
+	// connection is detached from its worker thread.
+	/// Returns true if the state of this connection can be handed over. The connections that are not open, or that have
+	/// fragmented transfers or delta-encoded messages in progress, are not.
+	bool CanHandOffSession() const;
+	/// Writes the state of the session to dst: the counters, the receive windows, the round trip time and congestion
+	/// state, the keys, and the messages that are queued, unacked or received and not yet handled. The connection is left
+	/// as it was, so that it can carry on if the handoff fails.
+	void SerializeSession(std::vector<char> &dst);
+	/// Restores the state written by SerializeSession() to this new connection.
+	void DeserializeSession(DataDeserializer &src);
+	/// Writes an outbound message with its reliable and order numbers to a serialized session.
+	static void SerializeOutboundMessage(DataSerializer &dst, const NetworkMessage *msg);
+
+	/// Sends the connect datagram without early data. [main thread before the worker thread is running, or worker thread]
+	void SendConnectDatagram();
+
+	/// Writes the connect datagram to dst, and keeps a copy of it in connectDatagram. If earlyDataSize is not zero, dst
+	/// starts with the datagram of early data, which is moved after the connect message. dst must have room for
+	/// ConnectDatagramOverhead() more bytes.
+	/// @return The size of the connect datagram.
+	size_t WriteConnectDatagram(char *dst, size_t earlyDataSize);
+
+	/// Returns the number of bytes the connect datagram adds to a datagram of early data, including the cookie that the
+	/// server may ask it to be sent again with.
+	size_t ConnectDatagramOverhead() const;
+
+	/// The connect message of the application, kept until the connect datagram has gone out. [set by the main thread
+	/// before the worker thread is running]
+	std::vector<char> connectMessage;
+
+	/// The salt of the connection, sent in the connect datagram if the connection is encrypted.
+	u8 connectSalt[DatagramCipher::cSaltSize];
+
+	/// True while the connect datagram waits for the application to resume the sends, so that it can carry the first
+	/// datagram of the connection as early data. [set by the main thread before the worker thread is running, then worker thread]
+	bool connectDatagramDeferred;
+
+	/// True if the connect datagram carried early data. The datagrams after it wait for the server to reply, so that none
+	/// gets to the server before the connection exists there. [worker thread]
+	bool sentEarlyData;
+
+	/// The datagram that the client sent to open this connection, kept for answering a connect challenge. Empty at the
+	/// server end, and once the connection is open. [set by the main thread before the worker thread is running]
+	std::vector<char> connectDatagram;
+
+	/// The random ID the server picked for this connection, or 0 if there is none yet. [set by the main thread before the
+	/// worker thread is running at the server, and by the worker thread at the client]
+	u64 connectionID;
+
 	/// Reads all the new bytes available in the socket.
 	/// @return The number of bytes successfully read.
 	virtual SocketReadResult ReadSocket(size_t &bytesRead); // [worker thread]
 
-	/// Parses bytes with have previously been read from the socket to actual application-level messages.
+	/// Passes the given datagram through networkReceiveSimulator if it is enabled, and otherwise on to DecryptAndExtractMessages().
+	/// @param receiveTick The time the kernel received the datagram, or 0 if it is not known.
+	/// @param ecn The ECNCodepoint the datagram carried.
+	void HandleInboundDatagram(char *data, size_t numBytes, tick_t receiveTick, u8 ecn); // [worker thread]
+
+	virtual void HandleSimulatedInboundDatagram(char *data, size_t numBytes); // [worker thread]
+
+	/// Decrypts the given datagram in place if the connection is encrypted, or checks and strips its checksum if the
+	/// connection has checksums, and passes it on to ExtractMessages().
+	/// Datagrams that fail the authentication or the checksum are dropped.
+	void DecryptAndExtractMessages(char *data, size_t numBytes); // [worker thread]
+
+	/// Parses bytes with have previously been read from the socket to actual application-level messages. A malformed
+	/// datagram is dropped from the first malformed message on, and counted with CountMalformedDatagram().
 	void ExtractMessages(const char *data, size_t numBytes); // [worker thread]
 
+	/// Marks the datagram that ExtractMessages() is parsing as malformed, so that it stops parsing it.
+	virtual void MalformedMessageReceived() { inboundDatagramMalformed = true; } // [worker thread]
+
+	/// Counts a dropped malformed datagram for this connection and its server, and closes the connection once
+	/// MalformedDatagramLimit() of them have been received.
+	void CountMalformedDatagram(size_t numBytes); // [worker thread]
+
+	/// Set when a message of the datagram being parsed turns out to be malformed. [worker thread]
+	bool inboundDatagramMalformed;
+
+	/// The number of malformed datagrams dropped. See NumMalformedDatagrams(). [worker thread writes]
+	volatile u32 numMalformedDatagrams;
+
+	/// The ECNCodepoint of the datagram being parsed. [worker thread]
+	u8 inboundECN;
+	/// See NumCongestionMarksReceived() and NumCongestionMarksReported(). [worker thread writes]
+	volatile u32 numCEMarksReceived;
+	volatile u32 peerCEMarks;
+
+	/// See SetMalformedDatagramLimit().
+	volatile u32 malformedDatagramLimit;
+
+	/// Passes a received reliable in-order message on to the application if all the messages before it on its ordering
+	/// channel have been delivered, and otherwise buffers it until they have. Then delivers the buffered messages that were
+	/// waiting for this one.
+	/// @param orderNumberBits The order number of the message, modulo cOrderNumberMask + 1.
+	/// @param data If null, the message was aborted, and only its position in the channel is skipped.
+	/// @param message If not null, the message was assembled from fragments, and is passed on instead of data. Ownership is taken.
+	void HandleInOrderMessage(u8 channel, u32 orderNumberBits, packet_id_t packetID, const char *data, size_t numBytes, NetworkMessage *message = 0); // [worker thread]
+
+	/// Records the given reliable message number received.
+	/// @param refuseAck [out] Set to true if the number is too far ahead of the ones received to be recorded.
+	/// @return True if the message is to be discarded, since it has been received before or could not be recorded.
+	bool IsDuplicateReliableMessage(u32 reliableMessageNumber, packet_id_t packetID, bool &refuseAck); // [worker thread]
+
+	/// Passes the messages of a received Aggregate record on, as if each had come in a message block of its own. The
+	/// reliable and order numbers of the messages follow the ones of the first message, which are read from the record header.
+	/// @param data The content of the record, after its message ID.
+	/// @param firstDuplicate True if the reliable message number of the first message had already been received.
+	/// @return The number of messages passed on.
+	size_t ExtractAggregatedMessages(packet_id_t packetID, const char *data, size_t numBytes, bool reliable, u32 firstReliableMessageNumber,
+		bool firstDuplicate, bool ordered, u8 orderingChannel, u32 firstOrderNumber, bool &refuseAck); // [worker thread]
+
+	/// Returns the order number of the given reliable in-order message on its channel. The message takes the next number of
+	/// its channel when it first goes out. All the fragments of a transfer share one.
+	u32 TakeOrderNumber(NetworkMessage *msg); // [worker thread]
+
+	/// Returns the number of messages from datagramSerializedMessages[first] on that can be written as one Aggregate record,
+	/// or 1 if the record would not be smaller than the messages written one by one.
+	/// @param contentSize [out] Receives the content length of the record, including its message ID.
+	size_t AggregatableRunLength(size_t first, size_t &contentSize); // [worker thread]
+
 	/// Reads all available bytes from a datagram socket. This function will read in multiple datagrams
 	/// as long as there are available ones to process.
 	/// @param bytesRead [out] Returns the total number of bytes containes in the datagrams that were read.
 	SocketReadResult UDPReadSocket(size_t &bytesRead); // [worker thread]
 
 	// Congestion control and data rate management:
+	/// Creates the controller of congestionControlAlgorithm if it is not in use yet, and refreshes the values that are
+	/// shared to the main thread.
+	void UpdateCongestionControl(); // [worker thread]
 	void PerformFlowControl(); // [worker thread]
 	void HandleFlowControlRequestMessage(const char *data, size_t numBytes); // [worker thread]
+	/// Advertises new receive credits to the peer when enough have been granted, and refreshes the advertisement periodically.
+	void UpdateReceiveCredits(); // [worker thread]
+	void SendReceiveCreditAdvertisement(u32 limit); // [worker thread]
 
 	void UpdateRTOCounterOnPacketAck(float rtt); // [worker thread]
 	void UpdateRTOCounterOnPacketLoss(); // [worker thread]
 
+	// Path MTU discovery, see MaxDatagramSize():
+	/// Advertises the datagram size limit to the peer when it has changed, and sends out the next probe of the search when it is due.
+	void UpdatePathMTUDiscovery(); // [worker thread]
+	void SendPathMTUAdvertisement(size_t limit); // [worker thread]
+	/// Sends out a probe datagram of pathMTUProbeSize bytes directly to the socket.
+	void SendPathMTUProbe(); // [worker thread]
+	void HandlePathMTUMessage(const char *data, size_t numBytes); // [worker thread]
+	/// Called when a reliable datagram of the given size, sent at the given time, has timed out. Detects paths that have stopped
+	/// carrying large datagrams.
+	void PathMTUDatagramLost(size_t datagramSize, tick_t sentTick); // [worker thread]
+
 	// Closing down the connection:
 	void SendDisconnectMessage(bool isInternal); // [main thread]
 	void HandleDisconnectMessage(); // [worker thread]
@@ -115,29 +426,82 @@ private:
 	// Acknowledging reliable datagrams:
 	void PerformPacketAckSends(); // [worker thread]
 	void SendPacketAckMessage(); // [worker thread]
+	/// Builds a PacketAckRanges message of the pending acks in receivedPacketIDs, as many as fit in one message, and
+	/// removes them from the pending acks. The caller takes the ownership of the message.
+	NetworkMessage *CreatePacketAckMessage(); // [worker thread]
+	/// Handles the fixed-size PacketAck message of a base PacketID and a 32-bit sequence of the following PacketIDs.
 	void HandlePacketAckMessage(const char *data, size_t numBytes); // [worker thread]
-	
-	bool HandleMessage(packet_id_t packetID, message_id_t messageID, const char *data, size_t numBytes); // [worker thread]
+	/// Handles the variable-length PacketAckRanges message, which acks a list of PacketID ranges.
+	void HandlePacketAckRangesMessage(const char *data, size_t numBytes); // [worker thread]
+
+	// Forward error correction, see SetForwardErrorCorrectionGroupSize():
+	/// Returns true if the given message is to be sent in a datagram protected by forward error correction.
+	bool IsForwardErrorCorrected(const NetworkMessage &msg) const; // [worker thread]
+	/// Adds the given datagram to the current group and to its parity.
+	void XorDatagramToFECGroup(packet_id_t packetID, const char *data, size_t numBytes); // [worker thread]
+	/// Sends out the parity datagram of the current group, and starts a new group.
+	void SendFECParityDatagram(); // [worker thread]
+	/// Refreshes the group size from PacketLossRate(), and flushes a group that has waited for too long to fill up.
+	void UpdateForwardErrorCorrection(); // [worker thread]
+	/// Rebuilds the only datagram of the group that has not been received, if the others are in fecReceiveHistory.
+	void HandleFECParityMessage(const char *data, size_t numBytes); // [worker thread]
+
+	/// Cuts more fragments of the fragmented transfers whose fragments in flight no longer fill the congestion window.
+	void RefillFragmentedTransferWindows(); // [worker thread]
+
+	void SendFragmentedTransferAbortMessage(const FragmentedSendManager::FragmentedTransfer &transfer); // [worker thread]
+	/// Discards the partially received message of the transfer the peer has aborted, and skips its position in its ordering channel.
+	void HandleFragmentedTransferAbortMessage(const char *data, size_t numBytes); // [worker thread]
+
+	// Delta encoding, see NetworkMessage::deltaEncoding:
+	/// Replaces the contents of the given message with a DeltaState message that carries them, as a delta against the
+	/// latest version the peer has acknowledged if there is one, and saves the contents as the next version.
+	void EncodeDeltaState(NetworkMessage *msg); // [worker thread]
+	/// Makes the given version the baseline of the later deltas of its (messageID, contentID), now that the peer has acked it.
+	void DeltaStateAcked(u32 messageID, u32 contentID, u32 version); // [worker thread]
 
-	/// Refreshes Packet Loss related statistics.
-	void ComputePacketLoss(); // [worker thread]
+	bool HandleMessage(packet_id_t packetID, message_id_t messageID, const char *data, size_t numBytes); // [worker thread]
 
 	/// Marks that we have received a datagram with the given ID.
 	void AddReceivedPacketIDStats(packet_id_t packetID); // [worker thread]
 	/// @return True if we have received a packet with the given packetID already.
 	bool HaveReceivedPacketID(packet_id_t packetID) const; // [worker thread]
 
-	/// Copies the given message to an internal queue to wait to be processed by the worker thread that owns this connection.
-	void QueueInboundDatagram(const char *data, size_t numBytes); // [thread-safe].
+	/// Queues the given datagram to wait to be processed by the worker thread that owns this connection. If buffer is not null,
+	/// the data lies in it and is queued in place by taking a reference to the buffer. Otherwise the data is copied.
+	/// The receiveTick is the time the kernel received the datagram, or 0 if it is not known, and ecn its ECNCodepoint.
+	void QueueInboundDatagram(const char *data, size_t numBytes, DatagramBuffer *buffer = 0, tick_t receiveTick = 0, u8 ecn = 0); // [thread-safe].
 
-	/// Handles all the previously queued datagrams this connection has received.
-	void ProcessQueuedDatagrams(); // [worker thread]
+	/// Handles all the previously queued datagrams this connection has received, and moves a pending client connection to
+	/// ConnectionOK if they answer it.
+	/// @return The number of bytes handled, not counting the connect challenges.
+	size_t ProcessQueuedDatagrams(); // [worker thread]
 
-	/// Specifies the PacketID of the last received datagram with InOrder flag set.
-	packet_id_t lastReceivedInOrderPacketID;
+	/// The order number to give to the next reliable in-order message sent on each ordering channel, indexed by the channel.
+	/// Grows to the largest channel used. [worker thread]
+	std::vector<u32> outboundOrderNumbers;
 
-	/// Specifies the PacketID of the last sent datagram with InOrder flag set.
-	packet_id_t lastSentInOrderPacketID;
+	/// A reliable in-order message that was received before all the messages ahead of it on its channel.
+	struct PendingInOrderMessage
+	{
+		PendingInOrderMessage():packetID(0), message(0), serialized(false) {}
+
+		packet_id_t packetID;
+		/// The message, or null if its transfer was aborted and the channel just skips over its order number.
+		NetworkMessage *message;
+		/// If true, the message was copied from a datagram as is, and its data still starts with the message ID.
+		bool serialized;
+	};
+
+	/// The receive state of an ordering channel: the messages that wait for the ones before them, indexed by their
+	/// order numbers. Next() of the ring is the order number of the message to deliver next on the channel.
+	struct InOrderChannel
+	{
+		ReorderRing<PendingInOrderMessage> pendingMessages;
+	};
+
+	/// The receive state of each ordering channel, indexed by the channel. Grows to the largest channel used. [worker thread]
+	std::vector<InOrderChannel> inboundOrderingChannels;
 
 	/// A running index to identify packet datagrams as they are send out to the stream.
 	packet_id_t datagramPacketIDCounter;
@@ -145,16 +509,65 @@ private:
 	/// Specifies in milliseconds the currently recommended datagram timeout value for any packet that is sent out at the present time.
 	float retransmissionTimeout;
 
-	/// The flow control operates on fixed time window intervals called 'frames'. This variable remembers
-	/// when the previous frame ended, and the currently elapsed frame starts.
-	tick_t lastFrameTime;
-	int numAcksLastFrame;
-	int numLossesLastFrame;
-
-	/// The flow control algorithm:
-	float datagramSendRate; ///< The number of datagrams/second to send.
-
-	float lowestDatagramSendRateOnPacketLoss;
+	/// Decides the congestion window and the pacing rate. Owned by this connection. [worker thread]
+	CongestionControl *congestionControl;
+	/// The algorithm that congestionControl is to be of. [written by the main thread]
+	volatile CongestionControlAlgorithm congestionControlAlgorithm;
+
+	/// The pacing rate of congestionControl in datagrams/second, and its congestion window. Refreshed by the worker thread.
+	float datagramSendRate;
+	volatile size_t congestionWindow;
+
+	/// Estimates the available bandwidth and the queuing delay, whichever the congestion control algorithm. [worker thread]
+	BandwidthEstimator bandwidthEstimator;
+	/// The estimates of bandwidthEstimator, refreshed by the worker thread on each ack.
+	float availableBandwidth;
+	float queuingDelay;
+	/// See SetBandwidthEstimateHandler(). [written by the main thread]
+	IBandwidthEstimateHandler * volatile bandwidthEstimateHandler;
+	float bandwidthReportThreshold;
+	/// The estimates last passed to bandwidthEstimateHandler. [worker thread]
+	float reportedBandwidth;
+	float reportedQueuingDelay;
+
+	/// Refreshes availableBandwidth and queuingDelay, and tells bandwidthEstimateHandler if they have changed enough.
+	void UpdateBandwidthEstimate(); // [worker thread]
+
+	/// The number of bytes of reliable datagrams in outboundPacketAckTrack.
+	volatile size_t bytesInFlight;
+	/// Set when SendOutPacket had only reliable messages to send, but the congestion window was full. Cleared when the window opens.
+	bool sendWindowFull;
+
+	/// If true, the queued messages are held back, see MessageConnection::SetSendCoalescing(). [worker thread]
+	bool holdingOutboundMessages;
+	/// The time the messages started to be held back.
+	tick_t holdStartTime;
+	/// If true, the messages that were held back are being sent out, and the messages queued meanwhile follow them without
+	/// a delay of their own, until the queue is empty again.
+	bool flushingHeldMessages;
+
+	/// Returns true if the messages in outboundQueue should be held back for now, and starts holding them if needed.
+	bool HoldOutboundMessages(); // [worker thread]
+
+	bool HoldingOutboundMessages() const { return holdingOutboundMessages; } // [worker thread]
+	/// The total number of bytes of reliable datagrams acked, and the time of the last ack. For the delivery rate samples.
+	u64 bytesDelivered;
+	tick_t lastDeliveredTick;
+
+	/// The PacketID and the send time of the most recently sent datagram that the peer has acked. The loss detection compares
+	/// the datagrams in flight against this. [worker thread]
+	packet_id_t largestAckedPacketID;
+	tick_t largestAckedSentTick;
+	bool haveAckedDatagrams;
+	/// The round trip time of the most recent ack, in milliseconds. [worker thread]
+	float latestRtt;
+	/// The time when the newest reliable datagram in flight is resent to elicit an ack from the peer (the PTO of RFC 9002,
+	/// section 6.2). A lost datagram at the tail of a burst is then detected without waiting for the retransmission timeout.
+	tick_t lossProbeTick;
+	/// The number of loss probes sent since the previous ack. Each probe doubles the probe timeout. [worker thread]
+	int numLossProbes;
+	/// If true, the next reliable datagram is a loss probe, and may be sent even if the congestion window is full. [worker thread]
+	bool lossProbePending;
 
 	// These variables correspond to RFC2988, http://tools.ietf.org/html/rfc2988 , section 2.
 	bool rttCleared; ///< If true, smoothedRTT and rttVariation do not contain meaningful values, but "are clear".
@@ -166,11 +579,109 @@ private:
 	float packetLossRate; ///< The currently estimated datagram packet loss rate, [0, 1].	
 	float packetLossCount; ///< The current packet loss in absolute packets/sec.
 
+	/// The size of the datagrams sent out now. [written by the worker thread]
+	volatile size_t maxDatagramSize;
+	/// The largest datagram this connection is allowed to send. [written by the main thread]
+	volatile size_t maxDatagramSizeLimit;
+	/// The value of maxDatagramSizeLimit that was last advertised to the peer, or 0 if none.
+	size_t advertisedDatagramSizeLimit;
+	/// The largest datagram the peer has advertised to take, or 0 until the peer has advertised its limit. Probing starts after that.
+	size_t peerDatagramSizeLimit;
+	/// The size of the probe in flight, or 0 if no size is being probed.
+	size_t pathMTUProbeSize;
+	/// The smallest size that the path did not carry, or 0 if none has failed. The search continues between this and maxDatagramSize.
+	size_t smallestFailedProbeSize;
+	/// The number of probes sent of pathMTUProbeSize bytes.
+	int numPathMTUProbesSent;
+	/// The ID of the most recent probe. The acks of older probes are ignored.
+	u32 pathMTUProbeID;
+	/// Times out the probe in flight.
+	PolledTimer pathMTUProbeTimer;
+	/// Restarts a search that has stopped below the limits of the connection.
+	PolledTimer pathMTURaiseTimer;
+	/// The number of large datagrams lost in a row that were sent after a large datagram was last acked.
+	int numLargeDatagramsLost;
+	/// The time a datagram larger than cBaseDatagramSize was last acked.
+	tick_t lastLargeDatagramAckTime;
+	/// The buffer the probe datagrams are crafted in.
+	std::vector<char> pathMTUProbeData;
+
+	/// The group size the application has asked for, or 0 to adapt it to the loss rate. [written by the main thread]
+	volatile int fecRequestedGroupSize;
+	/// The number of protected datagrams the parity of a group covers. [written by the worker thread]
+	volatile int fecGroupSize;
+	/// The smallest priority of unreliable messages that are protected regardless of their forwardErrorCorrection flag. [written by the main thread]
+	volatile unsigned long fecMinPriority;
+	/// If true, SendOutPacket() writes the runs of similar messages as Aggregate records. [written by the main thread]
+	volatile bool messageAggregation;
+	/// The XOR of the protected datagrams sent in the current group, each padded with zeroes to the length of the longest one.
+	std::vector<char> fecParity;
+	/// The XOR of the lengths of the datagrams in the current group.
+	u16 fecParityLength;
+	/// The PacketIDs of the datagrams in the current group, in the order they were sent.
+	std::vector<packet_id_t> fecGroupPacketIDs;
+	/// The time the first datagram of the current group was sent.
+	tick_t fecGroupStartTick;
+
+	/// A copy of a received datagram, kept for rebuilding a lost datagram of the same group.
+	struct FECReceivedDatagram
+	{
+		FECReceivedDatagram():packetID(0), valid(false) {}
+		packet_id_t packetID;
+		bool valid;
+		std::vector<char> data;
+	};
+	/// The most recently received datagrams, indexed by their PacketID modulo the history size. Filled only after the peer
+	/// has sent a parity datagram, so that the connections that don't use forward error correction don't copy their datagrams.
+	std::vector<FECReceivedDatagram> fecReceiveHistory;
+	/// A datagram rebuilt from a parity datagram, processed after the datagram that carried the parity.
+	std::vector<char> fecRecoveredDatagram;
+
+	// Receive credits, see ReceiveCreditsLeft(). The credits count the distinct reliable messages since the start of the
+	// connection, and run on 32 bits with wrap-around.
+	/// The number of distinct reliable messages received from the peer.
+	u32 numReliableMessagesReceived;
+	/// The number of reliable messages the peer was last told it may have sent in total, and the time it was told.
+	u32 advertisedReceiveCreditLimit;
+	tick_t receiveCreditAdvertiseTick;
+	/// The number of reliable messages sent to the peer for the first time. [written by the worker thread]
+	volatile u32 numNewReliableMessagesSent;
+	/// The number of reliable messages the peer has advertised to take in total, valid if peerGrantsReceiveCredits is set.
+	/// The peers that don't advertise credits are sent to without limits. [written by the worker thread]
+	volatile u32 peerReceiveCreditLimit;
+	volatile bool peerGrantsReceiveCredits;
+
+	/// The versions sent of a delta-encoded (messageID, contentID). The version numbers run on 32 bits here, and only the
+	/// 8 low bits go on the wire.
+	struct OutboundDeltaState
+	{
+		OutboundDeltaState():nextVersion(0), ackedVersion(0), hasAckedVersion(false) {}
+		u32 nextVersion;
+		/// The newest version the peer has acknowledged, if hasAckedVersion is set.
+		u32 ackedVersion;
+		bool hasAckedVersion;
+		DeltaBaselineHistory history;
+	};
+	std::map<MsgContentIDPair, OutboundDeltaState> outboundDeltaStates;
+	/// The DeltaState message being built by EncodeDeltaState().
+	std::vector<char> deltaStateEncodeBuffer;
+
+	/// A version of a delta-encoded (messageID, contentID) sent in a datagram.
+	struct SentDeltaState
+	{
+		u32 messageID;
+		u32 contentID;
+		u32 version;
+		/// The index of the next SentDeltaState of the same datagram in sentDeltaStates, or -1.
+		int next;
+	};
+
 	/// Info struct used to track acks of reliable packets.
 	struct PacketAckTrack
 	{
 		PacketAckTrack()
-		:sendCount(0)
+		:sentTick(0), timeoutTick(0), packetID(0), datagramSize(0), delivered(0), deliveredTick(0), appLimited(false),
+		sendCount(0), messages(0), numMessages(0), deltaStates(-1)
 		{
 		}
 
@@ -183,65 +694,116 @@ private:
 		/// The packet ID of the packet that was sent out.
 		packet_id_t packetID;
 
-		/// The packet send rate we had when this packet was sent out.
-		float datagramSendRate;
+		/// The size of the datagram in bytes.
+		size_t datagramSize;
 
-		/// The number of times this packet has been sent. 1 denotes no resends. 2 - this packet's been resent once, and so on.
-		int sendCount;
+		/// The values of bytesDelivered and lastDeliveredTick when this packet was sent out.
+		u64 delivered;
+		tick_t deliveredTick;
 
-		/// If true, the packet with this ID was an inOrder packet.
-		bool inOrder;
+		/// If true, the outbound queue was empty after this packet was sent out.
+		bool appLimited;
 
-		/// if inOrder==true, this tells the packetID of the previous in-order packet that was transmitted.
-		packet_id_t previousInOrderPacketID;
+		/// Returns the description of this packet for the congestion controller.
+		SentDatagramInfo ToSentDatagramInfo() const
+		{
+			SentDatagramInfo info;
+			info.sentTick = sentTick;
+			info.numBytes = datagramSize;
+			info.delivered = delivered;
+			info.deliveredTick = deliveredTick;
+			info.appLimited = appLimited;
+			return info;
+		}
 
-		Array<NetworkMessage*> messages;
+		/// The number of times this packet has been sent. 1 denotes no resends. 2 - this packet's been resent once, and so on.
+		int sendCount;
+
+		/// The reliable messages of this packet, linked through NetworkMessage::nextInDatagram. Owned by this struct.
+		NetworkMessage *messages;
+		int numMessages;
 
-		static int Hash(const PacketAckTrack &item, int maxElemsMask) { return item.packetID & maxElemsMask; }
-		static int Hash(int key, int maxElemsMask) { return key & maxElemsMask; }
+		/// The index of the first of the delta-encoded versions sent in this packet in sentDeltaStates, or -1. They become
+		/// the baselines of the later deltas once the packet is acked.
+		int deltaStates;
 	};
 
 	void ProcessPacketTimeouts(); // [worker thread]
-	void HandleFlowControl(); // [worker thread]
+
+	/// Declares lost the reliable datagrams in flight that were sent before the newest acked datagram, and that are either
+	/// cPacketReorderThreshold datagrams behind it or older than the reordering window (RFC 9002, section 6.1). [worker thread]
+	void DetectLostDatagrams();
+
+	/// Removes the given datagram from outboundPacketAckTrack as lost, and puts its messages back to the outbound queue
+	/// to be resent in a new datagram. [worker thread]
+	/// @param lossProbe If true, the datagram is only resent to elicit an ack, and it is not reported to the congestion controller
+	///        and the path MTU discovery as lost.
+	void RequeueLostDatagram(PacketAckTrack *track, tick_t now, bool lossProbe);
+
+	/// Restarts the timer after which the newest reliable datagram in flight is resent as a loss probe, if no acks have
+	/// arrived in the meanwhile. [worker thread]
+	void ArmLossProbeTimer(tick_t now);
 
 	void DoUpdateConnection(); // [worker thread]
 
+	unsigned long TimeUntilNextUpdate() const; // [worker thread]
+
+	/// For connections that share the listen socket of a server, returns the event signalled when datagrams are
+	/// queued with QueueInboundDatagram. Otherwise returns the read event of the socket. [worker thread]
+	Event NewInboundDataEvent();
+
 	PacketSendResult SendOutPacket(); // [worker thread]
 	void SendOutPackets(); // [worker thread]
 	unsigned long TimeUntilCanSendPacket() const; // [worker thread]
 
 	void PerformDisconnection(); // [main thread]
 
-	/// Returns OK if it is acceptable by the flow control timer to send out a new datagram.
+	/// Returns OK if it is acceptable by the pacing timer to send out a new datagram.
 	bool CanSendOutNewDatagram() const; // [worker thread]
 
-	/// Called whenever we have sent a new datagram to recompute the datagram send throttle timer.
-	void NewDatagramSent(); // [worker thread]
+	/// Called whenever we have sent a new datagram of the given size to advance the pacing timer by the time it takes at the pacing rate.
+	void NewDatagramSent(size_t numBytes); // [worker thread]
 
-	/// Used to perform flow control on outbound UDP messages.
-	mutable tick_t lastDatagramSendTime; ///\todo. No mutable. Rename to nextDatagramSendTime.
+	/// The time at which the pacing allows the next datagram to be sent out.
+	tick_t nextDatagramSendTime;
 
 	/// Connection control update timer.
 	PolledTimer udpUpdateTimer;
 
-	PolledTimer statsUpdateTimer;
+	/// Contains the reliable datagrams we have sent out that we are waiting for the other party to Ack, by their PacketIDs.
+	/// Starts small and doubles as the datagrams in flight need.
+	PacketIDRing<PacketAckTrack> outboundPacketAckTrack;
+
+	/// The storage of PacketAckTrack::deltaStates. The unused entries are linked from freeSentDeltaState on.
+	std::vector<SentDeltaState> sentDeltaStates;
+	int freeSentDeltaState;
 
-	typedef std::map<packet_id_t, PacketAckTrack> PacketAckTrackMap;
-	/// Contains the messages we have sent out that we are waiting for the other party to Ack.
-//	PacketAckTrackMap outboundPacketAckTrack;
-	typedef WaitFreeQueue<PacketAckTrack> PacketAckTrackQueue;
-	PacketAckTrackQueue outboundPacketAckTrack;
-//	typedef OrderedHashTable<PacketAckTrack, PacketAckTrack> PacketAckTrackTable;
-//	PacketAckTrackTable outboundPacketAckTrack;
+	/// Returns the given list of delta-encoded versions to the unused entries of sentDeltaStates.
+	void FreeSentDeltaStates(int first); // [worker thread]
 
-	static int BiasedBinarySearchFindPacketIndex(UDPMessageConnection::PacketAckTrackQueue &queue, packet_id_t packetID);
+	/// A datagram that was received to a DatagramBuffer and waits in queuedInboundDatagrams. The datagram holds a reference to its buffer.
+	struct QueuedDatagram
+	{
+		DatagramBuffer *buffer;
+		const char *data;
+		size_t size;
+		tick_t receiveTick;
+		u8 ecn;
+	};
 
-	WaitFreeQueue<Datagram> queuedInboundDatagrams;
+	SegmentedQueue<QueuedDatagram> queuedInboundDatagrams; // [produced by the thread that reads the server socket, consumed by worker thread]
+
+	/// Set when queuedInboundDatagrams becomes non-empty, to wake up the worker thread of this connection.
+	/// Only created for connections that use a UDP slave socket. [main and worker thread]
+	Event eventDatagramsQueued;
 
 	void FreeOutboundPacketAckTrack(packet_id_t packetID); // [worker thread]
 
-	// Contains a list of all messages we've received that we need to Ack at some point.
-	PacketAckTrackMap inboundPacketAckTrack;
+	/// Frees the given outbound datagram of outboundPacketAckTrack, now that the peer has acked it.
+	void FreeOutboundPacketAckTrack(PacketAckTrack &track); // [worker thread]
+
+	/// Frees all the outbound datagrams with PacketIDs in the range [firstPacketID, lastPacketID].
+	void FreeOutboundPacketAckTrackRange(packet_id_t firstPacketID, packet_id_t lastPacketID); // [worker thread]
 
 	/// The number of UDP packets to send out per second.
 	int datagramOutRatePerSecond;
@@ -251,11 +813,13 @@ private:
 	/// packet to send it to the other party.
 	int datagramInRatePerSecond;
 
-	/// Contains the reliable message numbers of all reliable messages we've received.
+	/// The reliable message numbers of the reliable messages we've received, as a low watermark and a window after it.
 	/// Used to detect and discard duplicate messages we've received.
-	std::set<unsigned long> receivedReliableMessages;
+	MessageNumberWindow receivedReliableMessages;
 
-	SequentialIntegerSet receivedPacketIDs;
+	/// The PacketIDs of the datagrams received recently, and the ones of them that we need to ack at some point.
+	/// Used to detect and discard duplicate datagrams.
+	PacketIDWindow receivedPacketIDs;
 	/// Specifies the packet ID of the most recent datagram we sent. Used currently only
 	/// for statistics purposes.
 	packet_id_t previousReceivedPacketID;
@@ -265,16 +829,45 @@ private:
 	// time-sensitive functions.
 	std::vector<NetworkMessage *> datagramSerializedMessages; // MessageConnection::UDPSendOutPacket()
 	std::vector<NetworkMessage *> skippedMessages; // MessageConnection::UDPSendOutPacket()
-	std::vector<char> assembledData; // MessageConnection::DatagramExtractMessages
+
+	/// The number of messages SendOutPacket() looks at past a message that does not fit in the datagram, for smaller ones
+	/// that fill the rest of it.
+	static const int cPackingLookahead = 8;
+	/// SendOutPacket() does not look further once the datagram has less room left than this.
+	static const size_t cMinPackingSpace = 8;
 
 	/// Returns the average number of inbound packet loss, packets/sec.
 	float GetPacketLossCount() const { return packetLossCount; }
 
-	/// Returns the percentage of inbound packets that are being lost, [0, 1].
+	/// Returns the percentage of outbound packets that are being lost, [0, 1].
 	float GetPacketLossRate() const { return packetLossRate; }
 
 	void DumpConnectionStatus() const;
 
+	/// Encrypts the datagrams of this connection from now on. Called by Network and NetworkServer before the connection
+	/// is given to a worker thread. [main thread]
+	void EnableEncryption(const u8 *sharedKey, const u8 *salt, bool isClient);
+
+	/// Encrypts and authenticates the datagrams of the connection once EnableEncryption() has been called.
+	DatagramCipher cipher;
+
+	/// Appends a checksum to the datagrams of this connection from now on, and drops the received datagrams that do not
+	/// end in a valid one. Called by Network and NetworkServer before the connection is given to a worker thread. [main thread]
+	void EnableDatagramChecksums() { datagramChecksums = true; }
+
+	/// True if the datagrams of the connection end in a CRC-32C checksum. An encrypted connection has no checksums, since
+	/// the authentication tag already detects any corrupted bytes.
+	bool datagramChecksums;
+
+	/// Returns the number of bytes that SealDatagram() adds to a datagram.
+	size_t DatagramSealOverhead() const;
+
+	/// Encrypts the given datagram in place if the connection is encrypted, or appends its checksum if the connection has
+	/// checksums. The buffer must have room for DatagramSealOverhead() more bytes.
+	/// @return The size of the datagram on the wire.
+	size_t SealDatagram(char *data, size_t numBytes);
+
+	friend class Network;
 	friend class NetworkServer;
 };
 
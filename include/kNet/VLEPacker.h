@@ -84,6 +84,26 @@ public:
 			return lowPart | (medPart >> 1);
 		}
 	}
+
+	/// Returns the same as Encode(), and the number of bits of it, without branching on the value range. The value may
+	/// not be larger than maxValue.
+	static u32 EncodeBranchFree(u32 value, int &numBits)
+	{
+		assert(value <= maxValue);
+		const u32 isLong = (value > maxValue1) ? 1 : 0;
+		numBits = bitsValue1 + isLong * numBits2;
+		// Shifting the medium part up by one to make room for the flag bit is the same as adding it to the value once more.
+		return value + (value & BitMaskT<numBits1, numBits2>::val) + (isLong << numBits1);
+	}
+
+	/// Decodes the value at the LSB end of the given bits, and returns it and the number of bits it took, without branching
+	/// on the value range. The bits must hold at least maxBits bits of the stream.
+	static u32 DecodeBranchFree(u32 bits, int &numBits)
+	{
+		const u32 isLong = (bits >> numBits1) & 1;
+		numBits = bitsValue1 + isLong * numBits2;
+		return (bits & bitMask1) | (((bits & bitMask2) >> 1) * isLong);
+	}
 };
 
 /// VLEPacker performs variable-length encoding of unsigned integer values by omitting leading
@@ -167,6 +187,30 @@ public:
 			return lowPart | (medPart >> 1) | (highPart >> 2);
 		}
 	}
+
+	/// Returns the same as Encode(), and the number of bits of it, without branching on the value range. The value may
+	/// not be larger than maxValue.
+	static u32 EncodeBranchFree(u32 value, int &numBits)
+	{
+		assert(value <= maxValue);
+		const u32 isMedium = (value > maxValue1) ? 1 : 0;
+		const u32 isLong = (value > maxValue2) ? 1 : 0;
+		numBits = bitsValue1 + isMedium * (numBits2 + 1) + isLong * numBits3;
+		// Shifting the medium part up by one and the high part by two to make room for the flag bits is the same as
+		// adding them to the value once and three times more.
+		return value + (value & BitMaskT<numBits1, numBits2>::val) + (value & BitMaskT<numBits1+numBits2, numBits3>::val) * 3
+			+ (isMedium << numBits1) + (isLong << (bitsValue1 + numBits2));
+	}
+
+	/// Decodes the value at the LSB end of the given bits, and returns it and the number of bits it took, without branching
+	/// on the value range. The bits must hold at least maxBits bits of the stream.
+	static u32 DecodeBranchFree(u32 bits, int &numBits)
+	{
+		const u32 isMedium = (bits >> numBits1) & 1;
+		const u32 isLong = isMedium & (bits >> (bitsValue1 + numBits2)) & 1;
+		numBits = bitsValue1 + isMedium * (numBits2 + 1) + isLong * numBits3;
+		return (bits & bitMask1) | (((bits & bitMask2) >> 1) * isMedium) | (((bits & bitMask3) >> 2) * isLong);
+	}
 };
 
 typedef VLEType3<7, 7, 16> VLE8_16_32;
@@ -0,0 +1,175 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file VersionedSnapshot.h
+	@brief The VersionedSnapshot<T> template class. Publishes immutable versions of a value to lock-free readers. */
+
+#include <vector>
+#include <cassert>
+#include <cstddef>
+
+#include "Types.h"
+#include "Atomics.h"
+
+namespace kNet
+{
+
+/// Holds the latest published version of a value of type T, for example a container, so that readers can access it without
+/// locking or copying.
+/** A writer publishes a new version by copying the value, and each reader acquires a reference to the version that was
+	current at that time. The version stays unchanged and alive for as long as the reader holds on to the reference, even if
+	newer versions are published meanwhile.
+
+	The versions that have been replaced keep a reference of their own, and they are deleted by the writer once no reader
+	references them. A reader takes its reference in two steps, reading the current version and incrementing its reference
+	count, so to not delete a version between those steps, readers also announce that they are acquiring a version, and the
+	writer only deletes when no reader is doing that. Deleting happens on the writer thread also after the last reader
+	releases its reference, so the destructor of T does not need to be thread-safe.
+
+	There may be any number of readers, but the caller must serialize the calls to Publish() and ReleaseRetired(). */
+template<typename T>
+class VersionedSnapshot
+{
+	struct Version
+	{
+		T value;
+		u32 number;
+		volatile long refCount;
+	};
+
+public:
+	/// A reference to a single published version. Copying the reference is thread-safe, as long as the reference that is
+	/// copied stays alive.
+	class Ref
+	{
+	public:
+		Ref():version(0) {}
+		Ref(const Ref &rhs):version(rhs.version) { if (version) AtomicIncrement(&version->refCount); }
+		~Ref() { Reset(); }
+
+		Ref &operator =(const Ref &rhs)
+		{
+			if (rhs.version)
+				AtomicIncrement(&rhs.version->refCount);
+			Reset();
+			version = rhs.version;
+			return *this;
+		}
+
+		const T &operator *() const { assert(version); return version->value; }
+		const T *operator ->() const { assert(version); return &version->value; }
+
+		/// Returns the number of this version. The number is incremented each time a new version is published.
+		u32 Number() const { assert(version); return version->number; }
+
+		/// Releases the reference. The version is deleted later by the writer, if this was the last reference.
+		void Reset()
+		{
+			if (version)
+				AtomicDecrement(&version->refCount);
+			version = 0;
+		}
+
+	private:
+		explicit Ref(Version *version_):version(version_) {}
+
+		Version *version;
+
+		friend class VersionedSnapshot<T>;
+	};
+
+	VersionedSnapshot()
+	:acquiring(0)
+	{
+		current = new Version();
+		current->number = 0;
+		current->refCount = 1;
+	}
+
+	/// All references to the versions must have been released before destroying the snapshot.
+	~VersionedSnapshot()
+	{
+		assert(acquiring == 0);
+		for(size_t i = 0; i < retired.size(); ++i)
+		{
+			assert(retired[i]->refCount == 1);
+			delete retired[i];
+		}
+		assert(current->refCount == 1);
+		delete current;
+	}
+
+	/// Returns a reference to the current version. [thread-safe, lock-free]
+	Ref Acquire() const
+	{
+		AtomicIncrement(&acquiring);
+		Version *version = current;
+		AtomicIncrement(&version->refCount);
+		AtomicDecrement(&acquiring);
+		return Ref(version);
+	}
+
+	/// Publishes a copy of the given value as the new current version. Readers that acquire a reference after this call
+	/// get the new version. Also deletes the older versions that are no longer referenced. [writer]
+	void Publish(const T &value)
+	{
+		Version *version = new Version();
+		version->value = value;
+		version->number = current->number + 1;
+		version->refCount = 1;
+
+		retired.push_back((Version*)current);
+		FullMemoryBarrier(); // The contents of the new version must be visible before the version itself.
+		current = version;
+		ReleaseRetired();
+	}
+
+	/// Deletes the older versions that no reader references anymore. Publish() calls this, but call this periodically if
+	/// new versions are published rarely, so that the older versions do not linger. [writer]
+	void ReleaseRetired()
+	{
+		if (retired.empty())
+			return;
+
+		// A reader that is acquiring may have read an older version and not yet incremented its reference count.
+		// If no reader is acquiring after the new version is visible, all the readers that read an older version
+		// have incremented its reference count.
+		FullMemoryBarrier();
+		if (acquiring != 0)
+			return;
+		FullMemoryBarrier();
+
+		size_t numKept = 0;
+		for(size_t i = 0; i < retired.size(); ++i)
+			if (retired[i]->refCount == 1)
+				delete retired[i];
+			else
+				retired[numKept++] = retired[i];
+		retired.resize(numKept);
+	}
+
+	/// Returns the number of older versions that are waiting for their readers to release. [writer]
+	size_t NumRetired() const { return retired.size(); }
+
+private:
+	Version * volatile current;
+	mutable volatile long acquiring;
+	std::vector<Version*> retired; // [writer]
+
+	VersionedSnapshot(const VersionedSnapshot &); ///< Not implemented.
+	void operator =(const VersionedSnapshot &); ///< Not implemented.
+};
+
+} // ~kNet
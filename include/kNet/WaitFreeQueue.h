@@ -30,14 +30,18 @@ namespace kNet
 	 - Does not use locks or spin-waits, and is hence wait-free.
 	 - Does not perform any memory allocation after initialization.
 	 - Only POD types are supported. If you need non-POD objects, store pointers to objects instead.
-	 - The queue has a fixed upper size that must be a power-of-2 and must be speficied in the constructor. */
+	 - The queue has a fixed upper size that must be a power-of-2 and must be speficied in the constructor.
+	The head index, which the consumer writes, and the tail index, which the producer writes, lie on cache lines of their
+	own. Each side also keeps a copy of the index of the other side, and reloads it only when the copy shows less room
+	(for the producer) or fewer items (for the consumer) than the operation asks for, so in a steady stream the two cores
+	rarely touch each other's cache lines. InsertBatch() and PopBatch() move several items with a single update of the index. */
 template<typename T>
 class WaitFreeQueue
 {
 public:
 	/// @param maxElements A power-of-2 number, > 2,  that specifies the size of the ring buffer to construct. The number of elements the queue can store is maxElements-1.
 	explicit WaitFreeQueue(size_t maxElements)
-	:head(0), tail(0)
+	:head(0), cachedTail(0), tail(0), cachedHead(0)
 	{
 		assert(IS_POW2(maxElements)); // The caller really needs to round to correct pow2,
 		assert(maxElements > 2);
@@ -49,7 +53,7 @@ public:
 
 	/// Warning: This is not thread-safe.
 	WaitFreeQueue(const WaitFreeQueue &rhs)
-	:maxElementsMask(rhs.maxElementsMask), head(rhs.head), tail(rhs.tail)
+	:maxElementsMask(rhs.maxElementsMask), head(rhs.head), cachedTail(rhs.tail), tail(rhs.tail), cachedHead(rhs.head)
 	{
 		size_t maxElements = rhs.maxElementsMask+1;
 		data = new T[maxElements];
@@ -65,6 +69,7 @@ public:
 
 		head = rhs.head;
 		tail = rhs.tail;
+		SyncCachedIndices();
 		size_t maxElements = rhs.maxElementsMask+1;
 		maxElementsMask = rhs.maxElementsMask;
 
@@ -103,9 +108,7 @@ public:
 	///  This function can be called only by a single producer thread.
 	T *BeginInsert()
 	{
-		unsigned long tail_ = tail;
-		unsigned long nextTail = (tail_ + 1) & maxElementsMask;
-		if (nextTail == head)
+		if (FreeSlotsForProducer() == 0)
 			return 0;
 		return &data[tail];
 	}
@@ -124,16 +127,30 @@ public:
 	bool Insert(const T &value)
 	{
 		// Inserts are made to the 'tail' of the queue, incrementing the tail index.
-		unsigned long tail_ = tail;
-		unsigned long nextTail = (tail_ + 1) & maxElementsMask;
-		if (nextTail == head)
+		if (FreeSlotsForProducer() == 0)
 			return false;
+		unsigned long tail_ = tail;
 		data[tail_] = value;
-		tail = nextTail;
+		tail = (tail_ + 1) & maxElementsMask;
 
 		return true;
 	}
 
+	/// Inserts as many of the given values into the queue as there is room for, in order, and publishes them to the
+	/// consumer all at once. Can be called only by a single producer thread.
+	/// @return The number of values inserted, which is less than numValues if the queue became full.
+	int InsertBatch(const T *values, int numValues)
+	{
+		unsigned long numFree = FreeSlotsForProducer(numValues);
+		if ((unsigned long)numValues > numFree)
+			numValues = (int)numFree;
+		unsigned long tail_ = tail;
+		for(int i = 0; i < numValues; ++i)
+			data[(tail_ + i) & maxElementsMask] = values[i];
+		tail = (tail_ + numValues) & maxElementsMask;
+		return numValues;
+	}
+
 	/// Inserts the new value into the queue. If there is not enough free space in the queue, the capacity
 	/// of the queue is doubled.
 	/// \note This function is not thread-safe. Do not call this if you cannot guarantee that the other
@@ -170,6 +187,7 @@ public:
 		data = newData;
 		head = 0;
 		tail = newTail;
+		SyncCachedIndices();
 		maxElementsMask = (unsigned long)newSize - 1;
 	}
 
@@ -183,7 +201,7 @@ public:
 	/// This function can safely be called even if the queue is empty, in which case 0 is returned.
 	T *Front()
 	{
-		if (head == tail)
+		if (ItemsForConsumer() == 0)
 			return 0;
 		return &data[head];
 	}
@@ -193,7 +211,7 @@ public:
 	/// This function can safely be called even if the queue is empty, in which case 0 is returned.
 	const T *Front() const
 	{
-		if (head == tail)
+		if (ItemsForConsumer() == 0)
 			return 0;
 		return &data[head];
 	}
@@ -267,6 +285,7 @@ public:
 	void Clear()
 	{
 		tail = head;
+		cachedTail = head;
 	}
 
 	/// Returns the number of elements currently filled in the queue. Can be called from either the consumer or producer thread.
@@ -283,22 +302,87 @@ public:
 	/// Removes the first item in the queue. Can be called only from a single consumer thread.
 	void PopFront()
 	{
-		assert(head != tail);
-		if (head == tail)
+		const unsigned long numItems = ItemsForConsumer();
+		assert(numItems > 0);
+		if (numItems == 0)
 			return;
 		size_t head_ = (head + 1) & maxElementsMask;
 		head = (unsigned long)head_;
 	}
 
+	/// Copies up to maxItems items from the front of the queue to dst, in order, and pops them off the queue all at once.
+	/// Can be called only from a single consumer thread.
+	/// @return The number of items popped, which is less than maxItems if the queue became empty.
+	int PopBatch(T *dst, int maxItems)
+	{
+		unsigned long numItems = ItemsForConsumer(maxItems);
+		if ((unsigned long)maxItems < numItems)
+			numItems = (unsigned long)maxItems;
+		unsigned long head_ = head;
+		for(unsigned long i = 0; i < numItems; ++i)
+			dst[i] = data[(head_ + i) & maxElementsMask];
+		head = (head_ + numItems) & maxElementsMask;
+		return (int)numItems;
+	}
+
 private:
+	/// The size of the cache lines the indices are kept apart by.
+	static const size_t cCacheLineSize = 64;
+
 	T *data;
 	/// Stores the AND mask (2^Size-1) used to perform the modulo check.
 	unsigned long maxElementsMask;
+
+	char padding0[cCacheLineSize];
+
 	/// Stores the index of the first element in the queue. The next item to come off the queue is at this position,
 	/// unless head==tail, and the queue is empty. \todo Convert to C++0x atomic<unsigned long> head;
 	volatile unsigned long head;
+	/// The consumer's copy of tail. Never ahead of tail. [consumer thread]
+	mutable unsigned long cachedTail;
+
+	char padding1[cCacheLineSize];
+
 	/// Stores the index of one past the last element in the queue. \todo Convert to C++0x atomic<unsigned long> head;
 	volatile unsigned long tail; 
+	/// The producer's copy of head. Never ahead of head. [producer thread]
+	unsigned long cachedHead;
+
+	char padding2[cCacheLineSize];
+
+	/// Returns the number of items the producer can insert, reloading its copy of head if that one says there is room
+	/// for fewer than numWanted items.
+	unsigned long FreeSlotsForProducer(int numWanted = 1)
+	{
+		unsigned long numFree = (cachedHead - tail - 1) & maxElementsMask;
+		if (numFree < (unsigned long)numWanted)
+		{
+			cachedHead = head;
+			numFree = (cachedHead - tail - 1) & maxElementsMask;
+		}
+		return numFree;
+	}
+
+	/// Returns the number of items the consumer can take, reloading its copy of tail if that one says there are fewer
+	/// than numWanted items.
+	unsigned long ItemsForConsumer(int numWanted = 1) const
+	{
+		unsigned long numItems = (cachedTail - head) & maxElementsMask;
+		if (numItems < (unsigned long)numWanted)
+		{
+			cachedTail = tail;
+			numItems = (cachedTail - head) & maxElementsMask;
+		}
+		return numItems;
+	}
+
+	/// Refreshes the copies of the indices after an operation that moves them in ways the other side does not expect.
+	///\note Not thread-safe.
+	void SyncCachedIndices()
+	{
+		cachedHead = head;
+		cachedTail = tail;
+	}
 
 	/// Removes the element at the given index, but instead of filling the contiguous gap that forms by moving elements to the
 	/// right, this function will instead move items at the front of the queue.
@@ -310,6 +394,7 @@ private:
 		for(int i = 0; i < numItemsToMove; ++i)
 			data[(head+index + maxElementsMask+1 -i)&maxElementsMask] = data[(head+index + maxElementsMask+1 -i-1) &maxElementsMask];
 		head = (head+1) & maxElementsMask;
+		SyncCachedIndices();
 	}
 
 	/// Removes the element at the given index, and fills the contiguous gap that forms by shuffling each item after index one space down.
@@ -321,6 +406,7 @@ private:
 		for(int i = 0; i < numItemsToMove; ++i)
 			data[(head+index+i)&maxElementsMask] = data[(head+index+i+1)&maxElementsMask];
 		tail = (tail + maxElementsMask+1 - 1) & maxElementsMask;
+		SyncCachedIndices();
 	}
 };
 
@@ -28,7 +28,10 @@ class QTimer;
 class QTreeWidgetItem;
 class Ui_NetworkDialog;
 
+#include <map>
+
 #include "kNet/Network.h"
+#include "kNet/NetworkWorkerThread.h"
 
 namespace kNet
 {
@@ -56,6 +59,9 @@ private:
 
 	typedef std::map<std::string, QPointer<GraphDialog> > GraphMap;
 	GraphMap graphs;
+
+	/// The profile of each worker thread as of the previous update, to show how busy the threads have been since.
+	std::map<NetworkWorkerThread *, WorkerProfile> workerProfiles;
 };
 
 } // ~kNet
@@ -0,0 +1,180 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file IoUring.h
+	@brief The IoUring class. Batches the socket transfers of a worker thread through a Linux io_uring.
+	Only available when KNET_USE_IO_URING is defined. */
+
+#ifdef KNET_USE_IO_URING
+
+#include <vector>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "kNet/Types.h"
+#include "kNet/Event.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+namespace kNet
+{
+
+class Socket;
+class IDatagramReceiver;
+struct OverlappedTransferBuffer;
+
+/// Performs asynchronous datagram sends and multishot datagram receives on top of a Linux io_uring.
+/** Each network worker thread owns one ring. Send() only queues the operation, and all the sends of one round of the
+	worker thread are passed to the kernel with a single io_uring_enter call in Submit(). The completions are reaped
+	from shared memory without system calls, and CompletionEvent() is set when there are new ones.
+
+	The UDP listen sockets are read with multishot receives that keep running until they are stopped. The kernel picks the
+	receive buffers from a pool registered to the ring once at startup, so the receives do not need to be resubmitted
+	or have buffers attached to them per datagram.
+
+	The ring talks to the kernel through the raw system calls, so liburing is not needed. All the functions
+	must be called from the thread that owns the ring. */
+class IoUring
+{
+public:
+	IoUring();
+	~IoUring();
+
+	/// Creates the ring. If this fails, the ring stays invalid and the sockets are read and written synchronously.
+	bool Init();
+
+	/// Cancels all the operations in progress, waits for them to finish and frees the ring.
+	void Close();
+
+	/// Returns true if Init() has succeeded.
+	bool IsValid() const { return ringFd != -1; }
+
+	/// Returns true if datagram sockets can be read through StartReceive().
+	bool SupportsMultishotReceive() const { return bufferRing != 0 && !receivesFailed; }
+
+	/// Returns the event that is set when the kernel posts new completions. Call ResetCompletionEvent() before calling ProcessCompletions().
+	Event CompletionEvent() const { return completionEvent; }
+
+	/// Clears the completion eventfd. The kernel writes the eventfd directly, so it is not a signal Event that could be Reset().
+	void ResetCompletionEvent();
+
+	/// Queues the given datagram to be sent to the given socket. If peer is not null, the datagram is sent to that address,
+	/// otherwise the socket must be connected. Takes the ownership of the buffer, which is freed when the send completes.
+	/// @return False if the operation could not be queued. The caller then still owns the buffer, and should send it synchronously.
+	bool Send(int fd, OverlappedTransferBuffer *buffer, const sockaddr_in *peer);
+
+	/// Starts a multishot receive on the given UDP listen socket. The received datagrams are passed to the given receiver
+	/// from ProcessCompletions() until StopReceive() is called.
+	bool StartReceive(Socket *socket, IDatagramReceiver *receiver);
+
+	/// Stops the receive started on the given socket. The receiver is not called for that socket after this returns.
+	void StopReceive(Socket *socket);
+
+	/// Returns true if a receive has been started on the given socket and not stopped.
+	bool IsReceiving(const Socket *socket) const;
+
+	/// Passes all the queued operations to the kernel.
+	void Submit();
+
+	/// Handles all the completions posted by the kernel: frees the buffers of the sends that finished, and passes the
+	/// received datagrams to their receivers.
+	/// @return The number of completions handled.
+	int ProcessCompletions();
+
+	/// Returns the ring that the sockets should use on the calling thread, or null if the thread does not have one.
+	static IoUring *ThreadRing();
+
+	/// Sets the ring the sockets use on the calling thread. Pass null to go back to synchronous transfers.
+	static void SetThreadRing(IoUring *ring);
+
+private:
+	/// A multishot receive of a single socket.
+	struct Receive
+	{
+		Socket *socket;
+		int fd;
+		IDatagramReceiver *receiver;
+		/// The template the kernel uses to lay out each received datagram into a pool buffer.
+		msghdr msg;
+		/// Set when StopReceive() has been called. The Receive is freed when its final completion arrives.
+		bool stopped;
+	};
+
+	int ringFd;
+
+	/// The submission queue ring. Points into the memory shared with the kernel.
+	void *sqRing;
+	size_t sqRingSize;
+	u32 *sqHead;
+	u32 *sqTail;
+	u32 sqMask;
+	u32 *sqArray;
+	io_uring_sqe *sqes;
+	size_t sqesSize;
+
+	/// The completion queue ring. Shares the mapping of sqRing if the kernel supports it.
+	void *cqRing;
+	size_t cqRingSize;
+	u32 *cqHead;
+	u32 *cqTail;
+	u32 cqMask;
+	io_uring_cqe *cqes;
+
+	/// The number of submission queue entries filled in but not yet passed to the kernel.
+	u32 numPending;
+
+	/// The number of operations passed to the kernel whose final completion has not yet been seen.
+	int numInFlight;
+
+	/// The pool of receive buffers registered to the kernel, and the ring through which they are handed back to it.
+	io_uring_buf_ring *bufferRing;
+	char *receiveBuffers;
+	u16 bufferRingTail;
+
+	/// Set if a multishot receive fails in a way that suggests the kernel does not support them. After this, the
+	/// listen sockets are read synchronously again.
+	bool receivesFailed;
+
+	std::vector<Receive*> receives;
+
+	/// Set by the kernel through the eventfd registered to the ring. Wraps the eventfd as a read event.
+	Event completionEvent;
+
+	/// Returns a free submission queue entry, or null if the queue is full even after submitting the pending entries.
+	io_uring_sqe *GetSqe();
+
+	/// Queues a multishot receive for the given Receive.
+	bool ArmReceive(Receive *receive);
+
+	/// Passes the receive buffer with the given id back to the kernel.
+	void RecycleBuffer(u16 bufferId);
+
+	/// Handles a completion of a multishot receive.
+	void ReceiveCompleted(Receive *receive, const io_uring_cqe &cqe);
+
+	/// Registers the pool of receive buffers. If this fails, the listen sockets are read synchronously.
+	/// @param features The IORING_FEAT_* flags the kernel reported when the ring was created.
+	bool SetupBufferRing(u32 features);
+
+	void operator=(const IoUring &); ///< Noncopyable, N/I.
+	IoUring(const IoUring &); ///< Noncopyable, N/I.
+};
+
+} // ~kNet
+
+#endif
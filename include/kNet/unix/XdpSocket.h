@@ -0,0 +1,210 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file XdpSocket.h
+	@brief The XdpSocket class. Reads and writes the UDP datagrams of the servers of a worker thread through an AF_XDP socket,
+	bypassing the network stack of the kernel. Only available when KNET_USE_AF_XDP is defined. */
+
+#ifdef KNET_USE_AF_XDP
+
+#include <vector>
+#include <map>
+
+#include <netinet/in.h>
+
+#include "kNet/Types.h"
+#include "kNet/Event.h"
+
+struct xdp_ring_offset;
+
+namespace kNet
+{
+
+class Socket;
+class IDatagramReceiver;
+struct OverlappedTransferBuffer;
+struct XdpDevice;
+
+/// Receives and sends the datagrams of the UDP listen sockets of a worker thread through an AF_XDP socket.
+/** Each network worker thread owns one XdpSocket, which is bound to a single receive queue of the network card. A small XDP
+	program attached to the interface passes the IPv4 UDP datagrams that arrive on that queue to the ports of the listen sockets
+	read by the thread straight to the XdpSocket. All other traffic, and the datagrams on the queues that no thread reads,
+	go through the kernel as usual and are read from the listen sockets themselves. Give the server as many UDP listen
+	sockets as the card has queues, so that the listen socket i is read from the queue i.
+
+	The frames are received to, and sent from, a memory area (UMEM) that is shared with the kernel and registered once at
+	startup. The received datagrams are passed to the IDatagramReceiver of their listen socket right from the frame they
+	arrived in. The datagrams sent to the clients of the servers are written by the connections directly to a frame, behind
+	room for the Ethernet, IP and UDP headers, which Send() fills in. The Ethernet address of each client is learnt from
+	the datagrams it sends, so the datagrams to a client that has not sent anything through the XdpSocket yet are sent
+	through the kernel.
+
+	Attaching the XDP program needs the CAP_NET_ADMIN and CAP_BPF capabilities (or root). If the program cannot be attached,
+	or the kernel lacks AF_XDP support (Linux 5.9 or newer is needed), the listen sockets are read as usual. On the loopback
+	interface, the kernel drops the sent frames unless the route_localnet and accept_local settings of lo are enabled.
+	All the functions must be called from the thread that owns the XdpSocket. */
+class XdpSocket
+{
+public:
+	XdpSocket();
+	~XdpSocket();
+
+	/// Stops all the receives, detaches from the interface and frees the frame memory.
+	void Close();
+
+	/// Returns true if the socket has been bound to a queue of an interface.
+	bool IsValid() const { return fd != -1; }
+
+	/// Returns the event that is set when the socket has received frames. Call ProcessReceives() when it is set.
+	Event ReceiveEvent() const { return Event(fd, EventWaitRead); }
+
+	/// Starts reading the datagrams to the port of the given UDP listen socket from the given receive queue of the given
+	/// interface. The first call binds the XdpSocket to the interface and the queue. After that, the ports of other listen
+	/// sockets are read from the same queue, whatever queue is asked for.
+	/// @return False if the listen socket cannot be read through AF_XDP. It should then be read as usual.
+	bool StartReceive(Socket *socket, IDatagramReceiver *receiver, const char *interfaceName, u32 queueId);
+
+	/// Stops reading the datagrams of the given listen socket. After this, its datagrams go to the listen socket again.
+	void StopReceive(Socket *socket);
+
+	/// Returns true if a receive has been started on the given socket and not stopped.
+	bool IsReceiving(const Socket *socket) const;
+
+	/// Returns true if the datagrams to the given peer can be sent through this XdpSocket.
+	bool CanSend(const sockaddr_in &peer);
+
+	/// Returns a frame of the UMEM for a datagram of at most the given size, or null if there is no free frame or the datagram
+	/// does not fit in one. The buffer is returned by DeleteOverlappedTransferBuffer.
+	OverlappedTransferBuffer *AllocateBuffer(int bytes);
+
+	/// Returns the frame of the given buffer back to the pool. Called by DeleteOverlappedTransferBuffer.
+	void FreeBuffer(OverlappedTransferBuffer *buffer);
+
+	/// Fills in the headers of the given datagram, and queues it to be sent to the given peer from the given local port.
+	/// The buffer must come from AllocateBuffer(). Takes the ownership of the buffer, which is returned to the pool when
+	/// the card has sent the frame.
+	/// @return False if the datagram could not be queued. The caller then still owns the buffer, and should send it through the kernel.
+	bool Send(OverlappedTransferBuffer *buffer, const sockaddr_in &peer, u16 localPort);
+
+	/// Passes the frames queued on this round to the card, and returns the frames that have been sent to the pool.
+	void Submit();
+
+	/// Passes all the received datagrams to their receivers and hands the frames back to the kernel.
+	/// @return The number of datagrams processed.
+	int ProcessReceives();
+
+	/// Returns the number of frames that were dropped since they did not hold a datagram to a port being read.
+	u64 NumFramesDropped() const { return numFramesDropped; }
+
+	/// Returns the XdpSocket that the sockets should use on the calling thread, or null if the thread does not have one.
+	static XdpSocket *ThreadXdp();
+
+	/// Sets the XdpSocket the sockets use on the calling thread. Pass null to go back to sending through the kernel.
+	static void SetThreadXdp(XdpSocket *xdp);
+
+private:
+	/// A producer or a consumer ring shared with the kernel.
+	struct Ring
+	{
+		u32 *producer;
+		u32 *consumer;
+		u32 *flags;
+		void *descs;
+		u32 mask;
+		void *map;
+		size_t mapSize;
+	};
+
+	/// A listen socket whose port is read through this XdpSocket.
+	struct Receive
+	{
+		Socket *socket;
+		IDatagramReceiver *receiver;
+		u16 port;
+	};
+
+	/// The addresses to reply to a client with, learnt from the frames it has sent.
+	struct Neighbor
+	{
+		u8 mac[6];
+		/// The address of the server the client sent to.
+		u32 localAddress;
+	};
+
+	int fd;
+	u32 queueId;
+
+	/// The interface the socket is bound to, with the XDP program and maps shared by all the XdpSockets on it.
+	XdpDevice *device;
+
+	/// Set if the socket could not be bound. It is not tried again.
+	bool openFailed;
+
+	/// Set if the kernel only processes the rings when it is woken up after setting XDP_RING_NEED_WAKEUP.
+	bool useNeedWakeup;
+
+	char *umem;
+	Ring fillRing;
+	Ring completionRing;
+	Ring rxRing;
+	Ring txRing;
+
+	/// The UMEM addresses of the send frames that are not in use. The receive frames are always owned by the kernel, except
+	/// while ProcessReceives() passes their datagrams on.
+	std::vector<u64> freeFrames;
+
+	/// The OverlappedTransferBuffer of each frame, so that sending a datagram allocates nothing.
+	OverlappedTransferBuffer *frameBuffers;
+
+	/// The number of frames added to the TX ring on this round, which Submit() tells the kernel about.
+	u32 numTxQueued;
+	/// The number of frames in the TX ring that the card has not completed yet.
+	u32 numTxInFlight;
+
+	/// The id of the next IPv4 datagram sent.
+	u16 nextIpId;
+
+	u64 numFramesDropped;
+
+	std::vector<Receive> receives;
+
+	/// The addresses learnt on this thread, by the IPv4 address of the client. Misses are looked up in the table of the interface.
+	std::map<u32, Neighbor> neighbors;
+
+	bool Open(const char *interfaceName, u32 queueId);
+	bool MapRing(Ring &ring, const xdp_ring_offset &offsets, size_t descSize, u32 numDescs, off_t pageOffset);
+	void UnmapRing(Ring &ring);
+
+	/// Returns the frames of the completed sends to the pool.
+	void ReapCompletions();
+
+	/// Parses the given received frame and passes the datagram in it to its receiver. Returns true if it held a datagram to a port being read.
+	bool FrameReceived(const u8 *frame, u32 length);
+
+	/// Looks up the addresses to reply to the given client with. Returns null if the client has not sent any frames.
+	const Neighbor *FindNeighbor(u32 address);
+
+	/// Adds or removes the given port in the ports the XDP program passes to this socket.
+	void SetPortRedirected(u16 port, bool redirected);
+
+	friend struct XdpDevice;
+
+	void operator=(const XdpSocket &); ///< Noncopyable, N/I.
+	XdpSocket(const XdpSocket &); ///< Noncopyable, N/I.
+};
+
+} // ~kNet
+
+#endif
@@ -0,0 +1,200 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+#pragma once
+
+/** @file RegisteredIO.h
+	@brief The RegisteredIO class. Passes the UDP socket transfers of a worker thread through the Winsock Registered I/O extensions.
+	Only available when KNET_USE_RIO is defined. */
+
+#ifdef KNET_USE_RIO
+
+#include <vector>
+#include <deque>
+
+#include "WS2Include.h"
+#include <mswsock.h>
+
+#include "kNet/Types.h"
+#include "kNet/Event.h"
+
+namespace kNet
+{
+
+class Socket;
+class IDatagramReceiver;
+struct OverlappedTransferBuffer;
+
+/// Performs the datagram sends and receives of a network worker thread through Registered I/O (RIO, Windows 8 and newer).
+/** Each network worker thread owns one RegisteredIO. The datagrams are sent and received from a pool of buffers that is
+	registered to the kernel once at startup, so the transfers do not lock the pages of their buffers one by one, and
+	they do not need a WSAEVENT each. All the sends of one round of the worker thread are passed to the kernel at once in
+	Submit(). The completions of all the sockets of the thread are posted to a single completion queue, which is read
+	without system calls, and CompletionEvent() is set when there are new ones.
+
+	A socket is given a request queue when a receive is started on it. The datagrams of UDP listen sockets are passed
+	to their IDatagramReceiver from ProcessCompletions(). The datagrams of client sockets are held until the connection
+	takes them with Socket::BeginReceive(). The sends to sockets that have a request queue on this thread are taken from
+	the pool by Socket::BeginSend(), and the sends to other sockets keep using overlapped WSASendTo calls.
+
+	Winsock allows only one request queue per socket, and the sockets must be created with WSA_FLAG_REGISTERED_IO. A socket
+	that already has a request queue on another thread is read with overlapped receives instead. All the functions must be
+	called from the thread that owns the RegisteredIO. */
+class RegisteredIO
+{
+public:
+	RegisteredIO();
+	~RegisteredIO();
+
+	/// Loads the RIO functions, and creates the completion queue and the buffer pool. If this fails, RegisteredIO stays
+	/// invalid and the sockets keep using overlapped transfers.
+	bool Init();
+
+	/// Waits for the sends in progress to finish and frees the completion queue and the buffer pool.
+	void Close();
+
+	/// Returns true if Init() has succeeded.
+	bool IsValid() const { return completionQueue != RIO_INVALID_CQ; }
+
+	/// Returns the event that is set when the kernel posts new completions. Reset it before calling ProcessCompletions().
+	Event CompletionEvent() const { return completionEvent; }
+
+	/// Returns a buffer from the registered pool for a datagram of at most the given size, or null if the pool is empty
+	/// or the datagram does not fit in a pool buffer. The buffer is returned to the pool by DeleteOverlappedTransferBuffer.
+	OverlappedTransferBuffer *AllocateBuffer(int bytes);
+
+	/// Returns the given buffer back to the pool. Called by DeleteOverlappedTransferBuffer.
+	void FreeBuffer(OverlappedTransferBuffer *buffer);
+
+	/// Returns true if sends to the given socket handle can be passed to Send().
+	bool HasRequestQueue(SOCKET s) const;
+
+	/// Queues the given datagram to be sent to the given socket. If peer is not null, the datagram is sent to that address,
+	/// otherwise the socket must be connected. The buffer must come from AllocateBuffer(). Takes the ownership of the buffer,
+	/// which is returned to the pool when the send completes.
+	/// @return False if the operation could not be queued. The caller then still owns the buffer, and should send it synchronously.
+	bool Send(SOCKET s, OverlappedTransferBuffer *buffer, const sockaddr_in *peer);
+
+	/// Creates a request queue for the given UDP listen socket and starts reading it. The received datagrams are passed to
+	/// the given receiver from ProcessCompletions() until StopReceive() is called.
+	bool StartReceive(Socket *socket, IDatagramReceiver *receiver);
+
+	/// Creates a request queue for the given UDP client socket and starts reading it. The received datagrams are held until
+	/// they are taken with TakeReceived(), and ProcessCompletions() reports the given connection index when some arrive.
+	/// If the socket is already being read, only updates the connection index.
+	bool StartClientReceive(Socket *socket, int connectionIndex);
+
+	/// Stops reading the given socket, and frees the datagrams held for it. Winsock has no way to cancel the receives in
+	/// progress, so their buffers are returned to the pool when the socket is closed.
+	void StopReceive(Socket *socket);
+
+	/// Returns true if a receive has been started on the given socket and not stopped.
+	bool IsReceiving(const Socket *socket) const;
+
+	/// Returns true if datagrams have been received for the given client socket.
+	bool HasReceived(const Socket *socket) const;
+
+	/// Returns the oldest datagram received for the given client socket, or null if there are none. Pass the buffer to
+	/// Socket::EndReceive when done with it.
+	OverlappedTransferBuffer *TakeReceived(Socket *socket);
+
+	/// Commits the sends queued on this round, keeps the receives of each socket primed, and asks the kernel to set
+	/// CompletionEvent() when the next completion arrives.
+	void Submit();
+
+	/// Handles all the completions posted by the kernel: returns the buffers of the sends that finished to the pool, and
+	/// passes the datagrams received on the listen sockets to their receivers.
+	/// @param readyConnections [out] The indices of the connections whose client sockets received datagrams are appended here.
+	/// @return The number of completions handled.
+	int ProcessCompletions(std::vector<int> &readyConnections);
+
+	/// Returns the RegisteredIO that the sockets should use on the calling thread, or null if the thread does not have one.
+	static RegisteredIO *ThreadRIO();
+
+	/// Sets the RegisteredIO the sockets use on the calling thread. Pass null to go back to overlapped transfers.
+	static void SetThreadRIO(RegisteredIO *rio);
+
+private:
+	/// The request queue of a single socket.
+	struct RequestQueue
+	{
+		Socket *socket;
+		SOCKET s;
+		RIO_RQ queue;
+		/// The receiver of the datagrams of a listen socket, or null for a client socket.
+		IDatagramReceiver *receiver;
+		/// The index of the connection of a client socket in the worker thread.
+		int connectionIndex;
+		/// The number of receives and sends passed to the kernel that have not completed yet.
+		int numReceivesPosted;
+		int numSendsPosted;
+		/// The number of receives this socket keeps primed, and the number of sends it can have in progress.
+		int receiveDepth;
+		int sendDepth;
+		/// Set when sends have been queued with RIO_MSG_DEFER, and need to be committed in Submit().
+		bool sendsDeferred;
+		/// Set when StopReceive() has been called. The RequestQueue is freed when its last operation completes.
+		bool stopped;
+		/// The datagrams received for a client socket that the connection has not taken yet.
+		std::deque<OverlappedTransferBuffer*> received;
+	};
+
+	/// The RIO functions, which are loaded at runtime through WSAIoctl.
+	RIO_EXTENSION_FUNCTION_TABLE rio;
+
+	RIO_CQ completionQueue;
+
+	/// The number of completion queue entries reserved by the request queues created so far.
+	u32 completionQueueReserved;
+
+	/// The memory of the buffer pool, its registration id, and the OverlappedTransferBuffer of each buffer in it.
+	char *poolMemory;
+	RIO_BUFFERID poolId;
+	OverlappedTransferBuffer *poolBuffers;
+
+	/// The indices of the pool buffers that are not in use.
+	std::vector<u32> freeBuffers;
+
+	/// Set when the kernel has been asked to signal completionEvent, until the event is reset.
+	bool notifyArmed;
+
+	std::vector<RequestQueue*> queues;
+
+	/// Set by the kernel when completions arrive, after RIONotify.
+	Event completionEvent;
+
+	/// Creates a request queue for the given socket. Returns null if the socket cannot be read through this RegisteredIO.
+	RequestQueue *CreateRequestQueue(Socket *socket, int receiveDepth, int sendDepth);
+
+	/// Returns the request queue of the given socket that has not been stopped, or null.
+	RequestQueue *FindQueue(const Socket *socket) const;
+
+	/// Posts receives to the given request queue until it has receiveDepth of them primed or held.
+	void PrimeReceives(RequestQueue *queue);
+
+	/// Handles a completion of a receive.
+	void ReceiveCompleted(RequestQueue *queue, OverlappedTransferBuffer *buffer, const RIORESULT &result, std::vector<int> &readyConnections);
+
+	/// Frees the given request queue if it has been stopped and none of its operations are in progress.
+	void ReleaseQueueIfDone(RequestQueue *queue);
+
+	/// Returns the registered buffer slice that holds the address of the given pool buffer.
+	RIO_BUF AddressBuffer(const OverlappedTransferBuffer *buffer) const;
+
+	void operator=(const RegisteredIO &); ///< Noncopyable, N/I.
+	RegisteredIO(const RegisteredIO &); ///< Noncopyable, N/I.
+};
+
+} // ~kNet
+
+#endif
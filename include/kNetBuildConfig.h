@@ -0,0 +1,37 @@
+// This file is programmatically generated using CMake.
+// This file shows the compilation settings that were used to build kNet.
+// These need to match for the client code using kNet.
+#pragma once
+
+#ifndef KNET_ENABLE_WINXP_SUPPORT
+#define KNET_ENABLE_WINXP_SUPPORT
+#endif
+
+#ifndef KNET_THREAD_CHECKING_ENABLED
+#define KNET_THREAD_CHECKING_ENABLED
+#endif
+
+#ifndef KNET_LOGGING_SUPPORT_ENABLED
+#define KNET_LOGGING_SUPPORT_ENABLED
+#endif
+
+#ifndef KNET_NETWORK_PROFILING
+#define KNET_NETWORK_PROFILING
+#endif
+
+#ifndef KNET_MESSAGE_INLINE_CAPACITY
+#define KNET_MESSAGE_INLINE_CAPACITY 64
+#endif
+
+#ifndef KNET_USE_TINYXML
+#define KNET_USE_TINYXML
+#endif
+
+#ifndef KNET_UNIX
+#define KNET_UNIX
+#endif
+
+#ifndef KNET_USE_EPOLL
+#define KNET_USE_EPOLL
+#endif
+
@@ -0,0 +1,449 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file Bench.cpp
+	@brief Runs scripted throughput and latency scenarios over the loopback interface and reports the results as JSON,
+		so that the numbers of two builds of kNet can be compared. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+#ifndef WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "kNet.h"
+#include "kNet/LatencyHistogram.h"
+
+using namespace std;
+using namespace kNet;
+
+const message_id_t cBenchMessageId = 100;
+/// The client index, the sequence number and the send tick lead each message, so no message is smaller than this.
+const int cMinMessageSize = 16;
+/// The number of messages a client keeps queued at most, so that the outbound queues stay short.
+const size_t cSendWindow = 256;
+
+/// One benchmark run: each of numClients clients sends numMessages messages of messageSize bytes to a server.
+struct Scenario
+{
+	string name;
+	SocketTransportLayer transport;
+	int numClients;
+	int numMessages;
+	int messageSize;
+	bool reliable;
+	bool inOrder;
+	/// The NetworkSimulator settings of both ends. UDP only.
+	float lossRate;
+	float latencyMSecs;
+	float jitterMSecs;
+	float bandwidthBytesPerSec;
+	float timeoutSecs;
+
+	Scenario()
+	:transport(SocketOverUDP), numClients(1), numMessages(100000), messageSize(64), reliable(true), inOrder(false),
+	lossRate(0.f), latencyMSecs(0.f), jitterMSecs(0.f), bandwidthBytesPerSec(0.f), timeoutSecs(60.f)
+	{
+	}
+};
+
+struct Result
+{
+	bool started;
+	bool timedOut;
+	u64 numSent;
+	u64 numReceived;
+	u64 numOutOfOrder;
+	double seconds;
+	double cpuSeconds;
+	LatencyHistogram latency;
+};
+
+/// Returns the CPU time the process has used so far, on all its threads.
+double ProcessCPUSeconds()
+{
+#ifdef WIN32
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+		return 0.0;
+	ULARGE_INTEGER kernel, user;
+	kernel.LowPart = kernelTime.dwLowDateTime;
+	kernel.HighPart = kernelTime.dwHighDateTime;
+	user.LowPart = userTime.dwLowDateTime;
+	user.HighPart = userTime.dwHighDateTime;
+	return (double)(kernel.QuadPart + user.QuadPart) * 1e-7;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0.0;
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+#endif
+}
+
+/// Receives the messages of the clients at the server, and keeps the statistics of the run.
+class BenchServer : public IMessageHandler, public INetworkServerListener
+{
+public:
+	BenchServer(const Scenario &scenario_, Result &result_)
+	:scenario(scenario_), result(result_), numConnections(0), nextSequence(scenario_.numClients, 0)
+	{
+	}
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		connection->RegisterInboundMessageHandler(this);
+		SetupSimulator(connection->NetworkSendSimulator(), scenario);
+		++numConnections;
+	}
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t id, const char *data, size_t numBytes)
+	{
+		if (id != cBenchMessageId || numBytes < (size_t)cMinMessageSize)
+			return;
+		DataDeserializer dd(data, numBytes);
+		const u32 client = dd.Read<u32>();
+		const u32 sequence = dd.Read<u32>();
+		const tick_t sendTick = (tick_t)dd.Read<u64>();
+		lastReceiveTick = Clock::Tick();
+		result.latency.RecordTimespan(sendTick, lastReceiveTick);
+		++result.numReceived;
+		if (client < nextSequence.size())
+		{
+			if (sequence < nextSequence[client])
+				++result.numOutOfOrder;
+			else
+				nextSequence[client] = sequence + 1;
+		}
+	}
+
+	static void SetupSimulator(NetworkSimulator &simulator, const Scenario &scenario)
+	{
+		if (scenario.transport != SocketOverUDP || (scenario.lossRate <= 0.f && scenario.latencyMSecs <= 0.f &&
+			scenario.jitterMSecs <= 0.f && scenario.bandwidthBytesPerSec <= 0.f))
+			return;
+		simulator.enabled = true;
+		simulator.packetLossRate = scenario.lossRate;
+		simulator.constantPacketSendDelay = scenario.latencyMSecs;
+		simulator.packetDelayJitter = scenario.jitterMSecs;
+		simulator.bandwidthBytesPerSec = scenario.bandwidthBytesPerSec;
+		// Like a router, hold about a hundred msecs worth of packets in the queue of the link.
+		simulator.queueLimitBytes = (size_t)(scenario.bandwidthBytesPerSec / 10.f);
+	}
+
+	const Scenario &scenario;
+	Result &result;
+	int numConnections;
+	tick_t lastReceiveTick;
+	/// The next sequence number expected from each client.
+	std::vector<u32> nextSequence;
+};
+
+void QueueBenchMessage(MessageConnection *connection, const Scenario &scenario, u32 client, u32 sequence)
+{
+	const size_t size = (size_t)std::max(scenario.messageSize, cMinMessageSize);
+	NetworkMessage *msg = connection->StartNewMessage(cBenchMessageId, size);
+	msg->reliable = scenario.reliable;
+	msg->inOrder = scenario.inOrder;
+	msg->priority = 100;
+	DataSerializer ds(msg->data, size);
+	ds.Add<u32>(client);
+	ds.Add<u32>(sequence);
+	ds.Add<u64>((u64)Clock::Tick());
+	memset(msg->data + ds.BytesFilled(), 0, size - ds.BytesFilled());
+	connection->EndAndQueueMessage(msg, size);
+}
+
+Result RunScenario(const Scenario &scenario, unsigned short port)
+{
+	Result result;
+	result.started = false;
+	result.timedOut = false;
+	result.numSent = result.numReceived = result.numOutOfOrder = 0;
+	result.seconds = result.cpuSeconds = 0.0;
+
+	Network serverNetwork;
+	Network clientNetwork;
+	BenchServer benchServer(scenario, result);
+	NetworkServer *server = serverNetwork.StartServer(port, scenario.transport, &benchServer, true);
+	if (!server)
+	{
+		fprintf(stderr, "Scenario %s: Unable to start the server in port %d!\n", scenario.name.c_str(), (int)port);
+		return result;
+	}
+
+	std::vector<Ptr(MessageConnection) > clients;
+	for(int i = 0; i < scenario.numClients; ++i)
+	{
+		Ptr(MessageConnection) client = clientNetwork.Connect("127.0.0.1", port, scenario.transport, 0);
+		if (!client)
+		{
+			fprintf(stderr, "Scenario %s: Unable to connect client %d!\n", scenario.name.c_str(), i);
+			return result;
+		}
+		BenchServer::SetupSimulator(client->NetworkSendSimulator(), scenario);
+		clients.push_back(client);
+		server->Process();
+	}
+
+	// Wait until the server has taken in all the clients.
+	PolledTimer connectTimer(10000.f);
+	for(;;)
+	{
+		server->Process();
+		int numConnected = 0;
+		for(size_t i = 0; i < clients.size(); ++i)
+			if (clients[i]->GetConnectionState() == ConnectionOK)
+				++numConnected;
+		if (numConnected == scenario.numClients && benchServer.numConnections == scenario.numClients)
+			break;
+		if (connectTimer.Test())
+		{
+			fprintf(stderr, "Scenario %s: Only %d of %d clients connected!\n", scenario.name.c_str(), numConnected, scenario.numClients);
+			return result;
+		}
+		Clock::Sleep(1);
+	}
+	result.started = true;
+
+	const u64 numExpected = (u64)scenario.numClients * scenario.numMessages;
+	std::vector<int> numSent(clients.size(), 0);
+	const double startCPU = ProcessCPUSeconds();
+	const tick_t startTick = Clock::Tick();
+	const tick_t timeoutTick = startTick + (tick_t)(scenario.timeoutSecs * Clock::TicksPerSec());
+	benchServer.lastReceiveTick = startTick;
+	// Without retransmissions, the lost messages never arrive, so the run ends once nothing has come in for a while.
+	const tick_t idleTicks = Clock::TicksPerSec() / 2 + (tick_t)((scenario.latencyMSecs + 3 * scenario.jitterMSecs) * 2 * Clock::TicksPerMillisecond());
+
+	while(result.numReceived < numExpected)
+	{
+		bool queuedAny = false;
+		for(size_t i = 0; i < clients.size(); ++i)
+			while(numSent[i] < scenario.numMessages && clients[i]->NumOutboundMessagesPending() < cSendWindow)
+			{
+				QueueBenchMessage(clients[i], scenario, (u32)i, (u32)numSent[i]++);
+				++result.numSent;
+				queuedAny = true;
+			}
+
+		const u64 numReceivedBefore = result.numReceived;
+		server->Process();
+		for(size_t i = 0; i < clients.size(); ++i)
+			clients[i]->Process();
+
+		const tick_t now = Clock::Tick();
+		if (Clock::IsNewer(now, timeoutTick))
+		{
+			result.timedOut = true;
+			break;
+		}
+		if (result.numSent == numExpected && !scenario.reliable && Clock::TicksInBetween(now, benchServer.lastReceiveTick) > idleTicks)
+			break;
+		// Give the worker threads the CPU when there is nothing to do here.
+		if (!queuedAny && result.numReceived == numReceivedBefore)
+			Clock::Sleep(1);
+	}
+
+	result.seconds = Clock::TimespanToSecondsD(startTick, benchServer.lastReceiveTick);
+	result.cpuSeconds = ProcessCPUSeconds() - startCPU;
+
+	for(size_t i = 0; i < clients.size(); ++i)
+		clients[i]->Close(0);
+	return result;
+}
+
+void PrintJSON(FILE *out, const Scenario &s, const Result &r, bool last)
+{
+	const double seconds = (r.seconds > 0.0) ? r.seconds : 1e-9;
+	const double bytes = (double)r.numReceived * std::max(s.messageSize, cMinMessageSize);
+	fprintf(out, "  {\"name\": \"%s\", \"transport\": \"%s\", \"clients\": %d, \"messagesPerClient\": %d, \"messageSize\": %d, "
+		"\"reliable\": %s, \"inOrder\": %s, \"simulatedLossRate\": %g, \"simulatedLatencyMSecs\": %g, \"simulatedJitterMSecs\": %g, "
+		"\"simulatedBandwidthBytesPerSec\": %g,\n",
+		s.name.c_str(), SocketTransportLayerToString(s.transport).c_str(), s.numClients, s.numMessages, s.messageSize,
+		s.reliable ? "true" : "false", s.inOrder ? "true" : "false", s.lossRate, s.latencyMSecs, s.jitterMSecs, s.bandwidthBytesPerSec);
+	fprintf(out, "   \"completed\": %s, \"timedOut\": %s, \"sent\": %llu, \"received\": %llu, \"outOfOrder\": %llu, \"seconds\": %.4f, "
+		"\"messagesPerSec\": %.1f, \"megabytesPerSec\": %.3f, \"cpuMicrosecondsPerMessage\": %.3f,\n",
+		(r.started && r.numReceived == r.numSent) ? "true" : "false", r.timedOut ? "true" : "false",
+		(unsigned long long)r.numSent, (unsigned long long)r.numReceived, (unsigned long long)r.numOutOfOrder, r.seconds,
+		r.numReceived / seconds, bytes / seconds / 1e6, (r.numReceived > 0) ? r.cpuSeconds * 1e6 / r.numReceived : 0.0);
+	fprintf(out, "   \"latencyMSecs\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p99.9\": %.3f, \"max\": %.3f}}%s\n",
+		r.latency.MeanMSecs(), r.latency.PercentileMSecs(50.f), r.latency.PercentileMSecs(90.f), r.latency.PercentileMSecs(99.f),
+		r.latency.PercentileMSecs(99.9f), r.latency.MaxMSecs(), last ? "" : ",");
+}
+
+/// Reads the key=value settings of a scenario. Returns false and prints the offending token if one is not recognized.
+bool ParseScenarioToken(const string &token, Scenario &s)
+{
+	const size_t eq = token.find('=');
+	if (eq == string::npos)
+	{
+		fprintf(stderr, "Expected key=value, got \"%s\"!\n", token.c_str());
+		return false;
+	}
+	const string key = token.substr(0, eq);
+	const string value = token.substr(eq + 1);
+	if (key == "name") s.name = value;
+	else if (key == "transport")
+	{
+		s.transport = StringToSocketTransportLayer(value.c_str());
+		if (s.transport == InvalidTransportLayer)
+		{
+			fprintf(stderr, "Unknown transport \"%s\"!\n", value.c_str());
+			return false;
+		}
+	}
+	else if (key == "clients") s.numClients = std::max(1, atoi(value.c_str()));
+	else if (key == "messages") s.numMessages = std::max(1, atoi(value.c_str()));
+	else if (key == "size") s.messageSize = std::max(cMinMessageSize, atoi(value.c_str()));
+	else if (key == "reliable") s.reliable = atoi(value.c_str()) != 0;
+	else if (key == "inorder") s.inOrder = atoi(value.c_str()) != 0;
+	else if (key == "loss") s.lossRate = (float)atof(value.c_str());
+	else if (key == "latency") s.latencyMSecs = (float)atof(value.c_str());
+	else if (key == "jitter") s.jitterMSecs = (float)atof(value.c_str());
+	else if (key == "bandwidth") s.bandwidthBytesPerSec = (float)atof(value.c_str());
+	else if (key == "timeout") s.timeoutSecs = (float)atof(value.c_str());
+	else
+	{
+		fprintf(stderr, "Unknown scenario setting \"%s\"!\n", key.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool ParseScenarioLine(const string &line, std::vector<Scenario> &scenarios)
+{
+	istringstream tokens(line);
+	string token;
+	Scenario s;
+	bool empty = true;
+	while(tokens >> token)
+	{
+		if (token[0] == '#')
+			break;
+		if (!ParseScenarioToken(token, s))
+			return false;
+		empty = false;
+	}
+	if (empty)
+		return true;
+	if (s.name.empty())
+	{
+		ostringstream name;
+		name << "scenario" << scenarios.size() + 1;
+		s.name = name.str();
+	}
+	scenarios.push_back(s);
+	return true;
+}
+
+/// The scenarios that are run when none are given on the command line.
+void AddDefaultScenarios(std::vector<Scenario> &scenarios)
+{
+	const char *lines[] =
+	{
+		"name=udp_reliable_small transport=udp clients=1 messages=200000 size=32 reliable=1",
+		"name=udp_reliable_inorder transport=udp clients=1 messages=100000 size=64 reliable=1 inorder=1",
+		"name=udp_unreliable_small transport=udp clients=1 messages=200000 size=32 reliable=0",
+		"name=udp_reliable_large transport=udp clients=1 messages=20000 size=1000 reliable=1",
+		"name=udp_many_clients transport=udp clients=32 messages=5000 size=64 reliable=1",
+		"name=udp_lossy_wan transport=udp clients=4 messages=5000 size=64 reliable=1 loss=0.02 latency=25",
+		"name=tcp_small transport=tcp clients=1 messages=200000 size=32",
+		"name=tcp_large transport=tcp clients=1 messages=20000 size=1000",
+	};
+	for(size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i)
+		ParseScenarioLine(lines[i], scenarios);
+}
+
+void PrintUsage()
+{
+	printf("Usage: knet_bench [--port <port>] [--out <file.json>] [--file <scenarios.txt>] [<key=value> ...]\n");
+	printf("  Each line of a scenario file, and the key=value settings on the command line, form a scenario:\n");
+	printf("    name=<id> transport=udp|tcp|shm clients=<N> messages=<M per client> size=<bytes> reliable=0|1 inorder=0|1\n");
+	printf("    loss=<0..1> latency=<msecs> jitter=<msecs> bandwidth=<bytes/sec> timeout=<secs>\n");
+	printf("  Without any scenarios, a default suite is run. The results are written as a JSON array.\n");
+}
+
+BottomMemoryAllocator bma;
+
+int main(int argc, char **argv)
+{
+	kNet::SetLogChannels(LogError);
+
+	unsigned short port = 2400;
+	const char *outFile = 0;
+	std::vector<Scenario> scenarios;
+	string commandLineScenario;
+	for(int i = 1; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		if (arg == "--help" || arg == "-h")
+		{
+			PrintUsage();
+			return 0;
+		}
+		else if (arg == "--port" && i + 1 < argc)
+			port = (unsigned short)atoi(argv[++i]);
+		else if (arg == "--out" && i + 1 < argc)
+			outFile = argv[++i];
+		else if (arg == "--file" && i + 1 < argc)
+		{
+			ifstream file(argv[++i]);
+			if (!file)
+			{
+				fprintf(stderr, "Unable to open the scenario file %s!\n", argv[i]);
+				return 1;
+			}
+			string line;
+			while(getline(file, line))
+				if (!ParseScenarioLine(line, scenarios))
+					return 1;
+		}
+		else
+			commandLineScenario += arg + " ";
+	}
+	if (!commandLineScenario.empty() && !ParseScenarioLine(commandLineScenario, scenarios))
+		return 1;
+	if (scenarios.empty())
+		AddDefaultScenarios(scenarios);
+
+	FILE *out = outFile ? fopen(outFile, "w") : stdout;
+	if (!out)
+	{
+		fprintf(stderr, "Unable to open %s for writing!\n", outFile);
+		return 1;
+	}
+
+	bool allCompleted = true;
+	fprintf(out, "[\n");
+	for(size_t i = 0; i < scenarios.size(); ++i)
+	{
+		fprintf(stderr, "Running %s...\n", scenarios[i].name.c_str());
+		// Each scenario gets a port of its own, so that the datagrams of the previous one do not get in the way.
+		const Result result = RunScenario(scenarios[i], (unsigned short)(port + i));
+		PrintJSON(out, scenarios[i], result, i + 1 == scenarios.size());
+		fflush(out);
+		allCompleted = allCompleted && result.started && !result.timedOut;
+	}
+	fprintf(out, "]\n");
+	if (out != stdout)
+		fclose(out);
+
+	return allCompleted ? 0 : 2;
+}
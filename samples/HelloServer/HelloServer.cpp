@@ -21,7 +21,7 @@
 using namespace kNet;
 
 // Define a MessageID for our a custom message.
-const message_id_t cHelloMessageID = 10;
+const message_id_t cHelloMessageID = 20;
 
 // This object gets called for notifications on new network connection events.
 class ServerListener : public INetworkServerListener
@@ -0,0 +1,530 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file LoadGen.cpp
+	@brief Drives tens of thousands of simulated clients with game-like traffic against a server from a single process,
+		and reports once a second how the clients and the server keep up. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+#include "kNet.h"
+#include "kNet/Atomics.h"
+#include "kNet/LatencyHistogram.h"
+
+using namespace std;
+using namespace kNet;
+
+/// The input messages the clients send to the server.
+const message_id_t cInputMessageId = 200;
+/// The state updates the server sends to each client.
+const message_id_t cStateMessageId = 201;
+/// A client stops sending while it has this many messages queued, so that a stalled connection does not grow without bound.
+const size_t cMaxPendingPerClient = 64;
+/// Opening a connection takes a while, so only this many are opened on each round, to let the rest of the loop run too.
+const int cMaxConnectsPerRound = 16;
+
+struct Settings
+{
+	int numClients;
+	/// The number of new connections opened per second while ramping up.
+	float connectRate;
+	float seconds;
+	/// The size of the worker thread pool of each Network.
+	int numThreads;
+	/// The number of UDP listen sockets of the server.
+	int numListenSockets;
+	/// The mean number of input messages each client sends per second. The sends are spaced randomly.
+	float sendRate;
+	int messageSize;
+	/// The share of the input messages that are sent reliably.
+	float reliableFraction;
+	/// The number of state updates the server sends to each client per second.
+	float updateRate;
+	/// A connection that has not been established in this time counts as failed.
+	float connectTimeoutSecs;
+	/// If not empty, the server captures its traffic to this file, for knet_replay.
+	string captureFile;
+
+	Settings()
+	:numClients(10000), connectRate(1000.f), seconds(60.f), numThreads(2), numListenSockets(1), sendRate(10.f),
+	messageSize(32), reliableFraction(0.1f), updateRate(10.f), connectTimeoutSecs(10.f)
+	{
+	}
+};
+
+/// The random numbers of the main thread.
+u32 randomState = 0x9E3779B9;
+
+u32 Random()
+{
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	return randomState;
+}
+
+/// Returns a random number in ]0, 1].
+float RandomUnit()
+{
+	return ((Random() >> 8) + 1) / (float)(1 << 24);
+}
+
+/// Returns a message size around the given mean. Every twentieth message is a larger one, such as a chat line or a
+/// command with arguments.
+int RandomMessageSize(int meanSize)
+{
+	const int size = meanSize / 2 + (int)(Random() % (u32)(meanSize + 1));
+	return (Random() % 20 == 0) ? size * 8 : std::max(size, 1);
+}
+
+/// Raises the limit of open files of the process, since each simulated client opens a socket of its own.
+void RaiseFileLimit(int numNeeded)
+{
+#ifndef WIN32
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+		return;
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < (rlim_t)numNeeded)
+		fprintf(stderr, "Warning: The process may open only %d files, which is not enough for %d sockets!\n",
+			(int)limit.rlim_cur, numNeeded);
+#else
+	MARK_UNUSED(numNeeded);
+#endif
+}
+
+void QueueMessage(MessageConnection *connection, message_id_t id, int size, bool reliable)
+{
+	NetworkMessage *msg = connection->StartNewMessage(id, size);
+	msg->reliable = reliable;
+	msg->priority = 100;
+	memset(msg->data, 0, size);
+	connection->EndAndQueueMessage(msg, size);
+}
+
+/// Counts the inbound messages on the worker threads, so that the main thread never has to visit a connection for them.
+class MessageCounter : public IMessageHandler
+{
+public:
+	MessageCounter()
+	:numMessages(0)
+	{
+	}
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t, const char *, size_t)
+	{
+		AtomicIncrement(&numMessages);
+	}
+
+	/// Returns the number of messages counted since the previous call. [main thread]
+	long TakeCount()
+	{
+		const long count = numMessages;
+		AtomicAdd(&numMessages, -count);
+		return count;
+	}
+
+	volatile long numMessages;
+};
+
+/// Accepts the simulated clients and sends them state updates.
+class LoadServer : public INetworkServerListener
+{
+public:
+	explicit LoadServer(const Settings &settings_)
+	:settings(settings_), server(0), numAccepted(0), numDisconnected(0), numSent(0), numProcessCalls(0),
+	processSeconds(0.0), maxProcessSeconds(0.0)
+	{
+	}
+
+	virtual ~LoadServer() {}
+
+	bool Start(unsigned short port)
+	{
+		network.SetMaxWorkerThreads(settings.numThreads);
+		server = network.StartServer(port, SocketOverUDP, this, true, settings.numListenSockets);
+		if (!server)
+		{
+			fprintf(stderr, "Unable to start the server in port %d!\n", (int)port);
+			return false;
+		}
+		if (!settings.captureFile.empty() && !server->Capture().Start(settings.captureFile.c_str()))
+		{
+			fprintf(stderr, "Unable to create the capture file \"%s\"!\n", settings.captureFile.c_str());
+			return false;
+		}
+		lastUpdateTick = Clock::Tick();
+		return true;
+	}
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		connection->SetWorkerThreadMessageHandler(&inbound);
+		connection->RegisterInboundMessageHandler(&inbound);
+		++numAccepted;
+	}
+
+	void ClientDisconnected(MessageConnection *)
+	{
+		++numDisconnected;
+	}
+
+	/// Runs a round of the main loop of the server. [main thread]
+	void Process()
+	{
+		const tick_t start = Clock::Tick();
+		server->Process();
+		const double seconds = Clock::SecondsSinceD(start);
+		processSeconds += seconds;
+		maxProcessSeconds = std::max(maxProcessSeconds, seconds);
+		++numProcessCalls;
+
+		if (settings.updateRate <= 0.f || Clock::TimespanToSecondsD(lastUpdateTick, start) < 1.0 / settings.updateRate)
+			return;
+		lastUpdateTick = start;
+		NetworkServer::ConnectionSnapshot snapshot = server->AcquireConnections();
+		for(NetworkServer::ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
+		{
+			MessageConnection *connection = iter->connection;
+			if (connection->GetConnectionState() != ConnectionOK || connection->NumOutboundMessagesPending() >= cMaxPendingPerClient)
+				continue;
+			QueueMessage(connection, cStateMessageId, RandomMessageSize(settings.messageSize), false);
+			++numSent;
+		}
+	}
+
+	/// Prints the statistics since the previous report, and resets them.
+	void Report(double elapsedSecs, double intervalSecs)
+	{
+		printf("{\"role\": \"server\", \"seconds\": %.1f, \"connections\": %d, \"accepted\": %d, \"disconnected\": %d, "
+			"\"messagesInPerSec\": %.0f, \"messagesOutPerSec\": %.0f, \"processMeanMSecs\": %.3f, \"processMaxMSecs\": %.3f, "
+			"\"rateLimitedDrops\": %lu}\n",
+			elapsedSecs, server->NumConnections(), numAccepted, numDisconnected, inbound.TakeCount() / intervalSecs,
+			numSent / intervalSecs, (numProcessCalls > 0) ? processSeconds * 1e3 / numProcessCalls : 0.0,
+			maxProcessSeconds * 1e3, server->SourceFilter().NumRateLimitedDrops());
+		fflush(stdout);
+		numSent = 0;
+		numProcessCalls = 0;
+		processSeconds = maxProcessSeconds = 0.0;
+	}
+
+	const Settings &settings;
+	Network network;
+	NetworkServer *server;
+	MessageCounter inbound;
+	tick_t lastUpdateTick;
+	int numAccepted;
+	int numDisconnected;
+	int numSent;
+	int numProcessCalls;
+	double processSeconds;
+	double maxProcessSeconds;
+};
+
+/// Opens the simulated clients and sends their input messages.
+class LoadClients
+{
+public:
+	enum ClientState
+	{
+		ClientPending,
+		ClientConnected,
+		ClientFailed, ///< The connection could not be established.
+		ClientDropped ///< The connection was established, but then closed.
+	};
+
+	struct SimulatedClient
+	{
+		Ptr(MessageConnection) connection;
+		ClientState state;
+		tick_t connectTick;
+		tick_t nextSendTick;
+	};
+
+	explicit LoadClients(const Settings &settings_)
+	:settings(settings_), numConnected(0), numFailed(0), numDropped(0), numSent(0), numBacklogged(0), nextProcessed(0)
+	{
+		network.SetMaxWorkerThreads(settings.numThreads);
+		clients.reserve(settings.numClients);
+	}
+
+	/// Returns the wait until the next input message of a client, so that the sends of a client form a Poisson process.
+	tick_t NextSendDelay() const
+	{
+		if (settings.sendRate <= 0.f)
+			return Clock::TicksPerSec() * 3600;
+		return (tick_t)(-log(RandomUnit()) / settings.sendRate * Clock::TicksPerSec());
+	}
+
+	/// Opens the connections that are due by now, at settings.connectRate per second.
+	void Connect(const char *address, unsigned short port, double elapsedSecs)
+	{
+		const int numDue = std::min(settings.numClients, (int)(elapsedSecs * settings.connectRate) + 1);
+		for(int i = 0; i < cMaxConnectsPerRound && (int)clients.size() < numDue; ++i)
+		{
+			SimulatedClient client;
+			client.connection = network.Connect(address, port, SocketOverUDP, &inbound);
+			client.connectTick = Clock::Tick();
+			client.nextSendTick = client.connectTick;
+			client.state = client.connection ? ClientPending : ClientFailed;
+			if (client.connection)
+			{
+				client.connection->SetWorkerThreadMessageHandler(&inbound);
+				pending.push_back((int)clients.size());
+			}
+			else
+				++numFailed;
+			clients.push_back(client);
+		}
+	}
+
+	/// Runs a round of the main loop of the clients. [main thread]
+	void Process()
+	{
+		const tick_t now = Clock::Tick();
+		const tick_t connectTimeout = (tick_t)(settings.connectTimeoutSecs * Clock::TicksPerSec());
+
+		for(size_t i = 0; i < pending.size(); ++i)
+		{
+			SimulatedClient &client = clients[pending[i]];
+			const ConnectionState state = client.connection->GetConnectionState();
+			if (state == ConnectionPending && Clock::TicksInBetween(now, client.connectTick) < connectTimeout)
+				continue;
+			if (state == ConnectionOK)
+			{
+				client.state = ClientConnected;
+				client.nextSendTick = now + NextSendDelay();
+				connectTime.RecordTimespan(client.connectTick, now);
+				++numConnected;
+			}
+			else
+			{
+				client.connection->Close(0);
+				client.state = ClientFailed;
+				++numFailed;
+			}
+			pending[i] = pending.back();
+			pending.pop_back();
+			--i;
+		}
+
+		for(size_t i = 0; i < clients.size(); ++i)
+		{
+			SimulatedClient &client = clients[i];
+			if (client.state != ClientConnected || Clock::IsNewer(client.nextSendTick, now))
+				continue;
+			client.nextSendTick += NextSendDelay();
+			if (client.connection->NumOutboundMessagesPending() >= cMaxPendingPerClient)
+			{
+				++numBacklogged;
+				continue;
+			}
+			QueueMessage(client.connection, cInputMessageId, RandomMessageSize(settings.messageSize), RandomUnit() <= settings.reliableFraction);
+			++numSent;
+		}
+
+		// The messages are counted on the worker threads, so the connections are visited here only to notice the closed
+		// ones, a slice of them at a time.
+		const size_t numToProcess = std::min(clients.size(), clients.size() / 100 + 1);
+		for(size_t i = 0; i < numToProcess; ++i)
+		{
+			if (nextProcessed >= clients.size())
+				nextProcessed = 0;
+			SimulatedClient &client = clients[nextProcessed++];
+			if (client.state != ClientConnected)
+				continue;
+			client.connection->Process();
+			if (client.connection->GetConnectionState() == ConnectionClosed)
+			{
+				client.state = ClientDropped;
+				--numConnected;
+				++numDropped;
+			}
+		}
+	}
+
+	void Report(double elapsedSecs, double intervalSecs)
+	{
+		printf("{\"role\": \"clients\", \"seconds\": %.1f, \"opened\": %d, \"pending\": %d, \"connected\": %d, \"failed\": %d, "
+			"\"dropped\": %d, \"messagesOutPerSec\": %.0f, \"messagesInPerSec\": %.0f, \"backloggedSends\": %d, "
+			"\"connectMSecs\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}}\n",
+			elapsedSecs, (int)clients.size(), (int)pending.size(), numConnected, numFailed, numDropped, numSent / intervalSecs,
+			inbound.TakeCount() / intervalSecs, numBacklogged, connectTime.PercentileMSecs(50.f), connectTime.PercentileMSecs(99.f),
+			connectTime.MaxMSecs());
+		fflush(stdout);
+		numSent = 0;
+		numBacklogged = 0;
+	}
+
+	void CloseAll()
+	{
+		for(size_t i = 0; i < clients.size(); ++i)
+			if (clients[i].connection)
+				clients[i].connection->Close(0);
+	}
+
+	const Settings &settings;
+	Network network;
+	MessageCounter inbound;
+	std::vector<SimulatedClient> clients;
+	/// The indices of the clients that are waiting for their connection to be established.
+	std::vector<int> pending;
+	LatencyHistogram connectTime;
+	int numConnected;
+	int numFailed;
+	int numDropped;
+	int numSent;
+	int numBacklogged;
+	/// The index of the next client that Process() visits.
+	size_t nextProcessed;
+};
+
+/// Reads a key=value setting. Returns false and prints the offending token if it is not recognized.
+bool ParseSetting(const char *token, Settings &s)
+{
+	const char *eq = strchr(token, '=');
+	if (!eq)
+	{
+		fprintf(stderr, "Expected key=value, got \"%s\"!\n", token);
+		return false;
+	}
+	const string key(token, eq);
+	const char *value = eq + 1;
+	if (key == "clients") s.numClients = std::max(1, atoi(value));
+	else if (key == "connectrate") s.connectRate = std::max(1.f, (float)atof(value));
+	else if (key == "seconds") s.seconds = (float)atof(value);
+	else if (key == "threads") s.numThreads = std::max(1, atoi(value));
+	else if (key == "sockets") s.numListenSockets = std::max(1, atoi(value));
+	else if (key == "rate") s.sendRate = (float)atof(value);
+	else if (key == "size") s.messageSize = std::max(1, atoi(value));
+	else if (key == "reliable") s.reliableFraction = (float)atof(value);
+	else if (key == "updaterate") s.updateRate = (float)atof(value);
+	else if (key == "connecttimeout") s.connectTimeoutSecs = (float)atof(value);
+	else if (key == "capture") s.captureFile = value;
+	else
+	{
+		fprintf(stderr, "Unknown setting \"%s\"!\n", key.c_str());
+		return false;
+	}
+	return true;
+}
+
+void PrintUsage(const char *program)
+{
+	printf("Usage:\n");
+	printf("   %s server <port> [key=value ...]\n", program);
+	printf("   %s clients <hostname> <port> [key=value ...]\n", program);
+	printf("   %s local <port> [key=value ...]\n", program);
+	printf("\n'local' runs both the server and the clients in this process.\n");
+	printf("Settings, with their defaults:\n");
+	printf("   clients=10000      The number of simulated clients.\n");
+	printf("   connectrate=1000   The number of connections opened per second while ramping up.\n");
+	printf("   seconds=60         The length of the run. 0 runs until the process is killed.\n");
+	printf("   threads=2          The number of network worker threads of each side.\n");
+	printf("   sockets=1          The number of UDP listen sockets of the server.\n");
+	printf("   rate=10            The mean number of input messages each client sends per second.\n");
+	printf("   size=32            The mean message size in bytes.\n");
+	printf("   reliable=0.1       The share of the input messages sent reliably.\n");
+	printf("   updaterate=10      The number of state updates the server sends to each client per second.\n");
+	printf("   connecttimeout=10  The seconds after which a pending connection counts as failed.\n");
+	printf("   capture=<file>     Captures the traffic of the server to the file, to be replayed with knet_replay.\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		PrintUsage(argv[0]);
+		return 0;
+	}
+
+	const string mode = argv[1];
+	const bool runServer = (mode == "server" || mode == "local");
+	const bool runClients = (mode == "clients" || mode == "local");
+	if (!runServer && !runClients)
+	{
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	const int firstSetting = (mode == "clients") ? 4 : 3;
+	if (argc < firstSetting)
+	{
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	const char *address = (mode == "clients") ? argv[2] : "127.0.0.1";
+	const unsigned short port = (unsigned short)atoi(argv[firstSetting - 1]);
+	Settings settings;
+	for(int i = firstSetting; i < argc; ++i)
+		if (!ParseSetting(argv[i], settings))
+			return 1;
+
+	kNet::SetLogChannels(LogError);
+	RaiseFileLimit((runClients ? settings.numClients : 0) + (runServer ? settings.numClients : 0) + 64);
+
+	LoadServer *server = 0;
+	if (runServer)
+	{
+		server = new LoadServer(settings);
+		if (!server->Start(port))
+		{
+			delete server;
+			return 1;
+		}
+	}
+	LoadClients *clients = runClients ? new LoadClients(settings) : 0;
+
+	const tick_t startTick = Clock::Tick();
+	tick_t reportTick = startTick;
+	for(;;)
+	{
+		const double elapsedSecs = Clock::SecondsSinceD(startTick);
+		if (settings.seconds > 0.f && elapsedSecs >= settings.seconds)
+			break;
+		if (clients)
+		{
+			clients->Connect(address, port, elapsedSecs);
+			clients->Process();
+		}
+		if (server)
+			server->Process();
+
+		const double intervalSecs = Clock::SecondsSinceD(reportTick);
+		if (intervalSecs >= 1.0)
+		{
+			reportTick = Clock::Tick();
+			if (server)
+				server->Report(elapsedSecs, intervalSecs);
+			if (clients)
+				clients->Report(elapsedSecs, intervalSecs);
+		}
+		Clock::Sleep(1);
+	}
+
+	if (clients)
+		clients->CloseAll();
+	delete clients;
+	delete server;
+	return 0;
+}
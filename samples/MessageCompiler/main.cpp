@@ -17,6 +17,7 @@
 	       C++ code. */
 
 #include <string>
+#include <cstring>
 #include <iostream>
 
 #include "kNet.h"
@@ -34,13 +35,30 @@ int main(int argc, char **argv)
 	    if (argc < 2)
 	    {
 		    cout << "No parameters given." << endl;
+		    cout << "Usage: " << argv[0] << " messages.xml [--views] [--arena] [--binary schema.bin]" << endl;
 		    return 0;
 	    }
+	    // With --views, a zero-copy MsgxxxView class is generated for each message as well.
+	    // With --arena, the arrays and strings of the messages are deserialized into a kNet::DeserializeArena.
+	    // With --binary, the messages are also written to the given file in the binary schema format, which
+	    // SerializedMessageList::LoadBinaryFromFile() loads without parsing the XML.
+	    bool generateViews = false;
+	    bool arenaDeserialization = false;
+	    const char *binaryFilename = 0;
+	    for(int i = 2; i < argc; ++i)
+		    if (!strcmp(argv[i], "--views"))
+			    generateViews = true;
+		    else if (!strcmp(argv[i], "--arena"))
+			    arenaDeserialization = true;
+		    else if (!strcmp(argv[i], "--binary") && i + 1 < argc)
+			    binaryFilename = argv[++i];
 
 	    EnableMemoryLeakLoggingAtExit();
 
 	    SerializedMessageList msg;
 	    msg.LoadMessagesFromFile(argv[1]);
+	    if (binaryFilename && msg.SaveBinaryToFile(binaryFilename))
+		    cout << "Wrote the binary schema to " << binaryFilename << "." << endl;
 
 	    cout << "File " << argv[1] << " contains the following structs:" << endl;
 
@@ -65,6 +83,8 @@ int main(int argc, char **argv)
 	    {
 		    const SerializedMessageDesc &msg = *iter;
 		    SerializationStructCompiler compiler;	
+		    compiler.SetGenerateViews(generateViews);
+		    compiler.SetArenaDeserialization(arenaDeserialization);
 		    string messageName = compiler.ParseToValidCSymbolName(msg.name.c_str()) + ".h";
 		if (!!strncmp(messageName.c_str(), "Msg", 3))
 			messageName = "Msg" + messageName; // Adjust the form of each generated message header file to be of the form Msgxxx.h
@@ -0,0 +1,505 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MicroBench.cpp
+	@brief Times the hot data structures and code paths of kNet in isolation, and reports the cost of each operation as
+		JSON lines, so that a change to one of them can be measured before and after. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <queue>
+
+#include "kNet.h"
+#include "kNet/MaxHeap.h"
+#include "kNet/WaitFreeQueue.h"
+#include "kNet/LockFreePoolAllocator.h"
+#include "kNet/OrderedHashTable.h"
+#include "kNet/VLEPacker.h"
+#include "kNet/UDPMessageConnection.h"
+#include "kNet/NetworkWorkerThread.h"
+
+using namespace std;
+using namespace kNet;
+
+/// Each case runs for at least this long, so that the timer resolution and the warm-up do not show in the result.
+const double cMinCaseSeconds = 0.2;
+
+/// The results are summed into this, so that the compiler cannot drop the work being timed.
+volatile u32 sink = 0;
+
+/// Runs the operation being timed the given number of times.
+typedef void (*BenchFunc)(u32 numIterations);
+
+struct BenchCase
+{
+	const char *name;
+	BenchFunc func;
+};
+
+const int cBufferSize = 64 * 1024;
+char buffer[cBufferSize];
+
+/// Pseudo-random values with a mix of small and large magnitudes, so that the VLE cases take all their code paths.
+vector<u32> values;
+
+void GenerateValues()
+{
+	u32 x = 0x12345678;
+	values.resize(4096);
+	for(size_t i = 0; i < values.size(); ++i)
+	{
+		x = x * 1664525 + 1013904223;
+		values[i] = (x >> 8) >> ((x & 3) * 7);
+	}
+}
+
+void SerializeBytes(u32 numIterations)
+{
+	for(u32 i = 0; i < numIterations; i += 256)
+	{
+		DataSerializer ds(buffer, cBufferSize);
+		for(u32 j = 0; j < 256; ++j)
+		{
+			ds.Add<u8>((u8)j);
+			ds.Add<u16>((u16)j);
+			ds.Add<u32>(values[j]);
+		}
+		sink += (u32)ds.BytesFilled();
+	}
+}
+
+void DeserializeBytes(u32 numIterations)
+{
+	SerializeBytes(256);
+	for(u32 i = 0; i < numIterations; i += 256)
+	{
+		DataDeserializer dd(buffer, cBufferSize);
+		u32 sum = 0;
+		for(u32 j = 0; j < 256; ++j)
+		{
+			sum += dd.Read<u8>();
+			sum += dd.Read<u16>();
+			sum += dd.Read<u32>();
+		}
+		sink += sum;
+	}
+}
+
+void SerializeBits(u32 numIterations)
+{
+	for(u32 i = 0; i < numIterations; i += 1024)
+	{
+		DataSerializer ds(buffer, cBufferSize);
+		for(u32 j = 0; j < 1024; ++j)
+			ds.AppendBits(values[j], (int)(j % 31) + 1);
+		sink += (u32)ds.BitsFilled();
+	}
+}
+
+void DeserializeBits(u32 numIterations)
+{
+	SerializeBits(1024);
+	for(u32 i = 0; i < numIterations; i += 1024)
+	{
+		DataDeserializer dd(buffer, cBufferSize);
+		u32 sum = 0;
+		for(u32 j = 0; j < 1024; ++j)
+			sum += dd.ReadBits((int)(j % 31) + 1);
+		sink += sum;
+	}
+}
+
+template<typename VLEType>
+void SerializeVLE(u32 numIterations)
+{
+	for(u32 i = 0; i < numIterations; i += 1024)
+	{
+		DataSerializer ds(buffer, cBufferSize);
+		for(u32 j = 0; j < 1024; ++j)
+			ds.AddVLE<VLEType>(values[j] & VLEType::maxValue);
+		sink += (u32)ds.BytesFilled();
+	}
+}
+
+template<typename VLEType>
+void DeserializeVLE(u32 numIterations)
+{
+	SerializeVLE<VLEType>(1024);
+	for(u32 i = 0; i < numIterations; i += 1024)
+	{
+		DataDeserializer dd(buffer, cBufferSize);
+		u32 sum = 0;
+		for(u32 j = 0; j < 1024; ++j)
+			sum += dd.ReadVLE<VLEType>();
+		sink += sum;
+	}
+}
+
+/// Fills a heap of 1024 items and drains it, the way the outbound queue of a connection is used.
+void MaxHeapInsertPop(u32 numIterations)
+{
+	MaxHeap<u32> heap;
+	for(u32 i = 0; i < numIterations; i += 1024)
+	{
+		for(u32 j = 0; j < 1024; ++j)
+			heap.Insert(values[j]);
+		u32 sum = 0;
+		while(heap.Size() > 0)
+		{
+			sum += heap.Front();
+			heap.PopFront();
+		}
+		sink += sum;
+	}
+}
+
+void PriorityQueueInsertPop(u32 numIterations)
+{
+	priority_queue<u32> heap;
+	for(u32 i = 0; i < numIterations; i += 1024)
+	{
+		for(u32 j = 0; j < 1024; ++j)
+			heap.push(values[j]);
+		u32 sum = 0;
+		while(!heap.empty())
+		{
+			sum += heap.top();
+			heap.pop();
+		}
+		sink += sum;
+	}
+}
+
+WaitFreeQueue<u32> *spscQueue = 0;
+volatile u32 numToConsume = 0;
+volatile u32 consumedSum = 0;
+volatile bool consumerDone = false;
+
+void ConsumeSPSC()
+{
+	u32 sum = 0;
+	u32 numConsumed = 0;
+	while(numConsumed < numToConsume)
+	{
+		u32 items[64];
+		const int numItems = spscQueue->PopBatch(items, 64);
+		if (numItems == 0)
+			Clock::Sleep(0); // Lets the producer run, if the two threads share a core.
+		for(int i = 0; i < numItems; ++i)
+			sum += items[i];
+		numConsumed += numItems;
+	}
+	consumedSum = sum;
+	consumerDone = true;
+}
+
+/// Streams items from this thread to a consumer thread, which has its own core if the machine has more than one.
+void WaitFreeQueueSPSC(u32 numIterations)
+{
+	WaitFreeQueue<u32> queue(1024);
+	spscQueue = &queue;
+	numToConsume = numIterations;
+	consumerDone = false;
+	Thread consumer;
+	consumer.RunFunc(ConsumeSPSC);
+	for(u32 i = 0; i < numIterations; ++i)
+		while(!queue.Insert(i))
+			Clock::Sleep(0);
+	while(!consumerDone)
+		Clock::Sleep(0);
+	consumer.Stop();
+	sink += consumedSum;
+}
+
+struct PoolItem : public PoolAllocatable<PoolItem>
+{
+	u32 payload[8];
+};
+
+void PoolAllocatorNewFree(u32 numIterations)
+{
+	LockFreePoolAllocator<PoolItem> pool;
+	PoolItem *items[64];
+	for(u32 i = 0; i < numIterations; i += 64)
+	{
+		for(int j = 0; j < 64; ++j)
+			items[j] = pool.New();
+		for(int j = 0; j < 64; ++j)
+			pool.Free(items[j]);
+	}
+	sink += (u32)(size_t)items[0];
+}
+
+void NewDelete(u32 numIterations)
+{
+	PoolItem *items[64];
+	for(u32 i = 0; i < numIterations; i += 64)
+	{
+		for(int j = 0; j < 64; ++j)
+			items[j] = new PoolItem;
+		for(int j = 0; j < 64; ++j)
+			delete items[j];
+	}
+	sink += (u32)(size_t)items[0];
+}
+
+struct U32Hash
+{
+	static int Hash(u32 value, size_t mask) { return (int)((value * 2654435761U) & mask); }
+};
+
+void OrderedHashTableInsertFindRemove(u32 numIterations)
+{
+	OrderedHashTable<u32, U32Hash> table(4096);
+	for(u32 i = 0; i < numIterations; i += 1024)
+	{
+		for(u32 j = 0; j < 1024; ++j)
+			table.Insert(i + j);
+		u32 numFound = 0;
+		for(u32 j = 0; j < 1024; ++j)
+			numFound += table.Find(i + j) ? 1 : 0;
+		table.Clear();
+		sink += numFound;
+	}
+}
+
+/// The number of connections the idle sweep cases pass over. Each connection has an event, so this stays well below the
+/// default limit of open file descriptors.
+const int cNumSweepConnections = 512;
+
+/// Connections that are not attached to a Network, only read by the idle sweep cases, and the worker slots of them. The
+/// cases are synthetic: the connections have no sockets, and nothing runs between the sweeps to evict them from the
+/// caches, so they measure the sweep alone and not the worker thread of a loaded server.
+vector<Ptr(MessageConnection)> sweepConnections;
+vector<WorkerConnectionSlot> sweepSlots;
+
+void CreateSweepConnections()
+{
+	if (!sweepConnections.empty())
+		return;
+	for(int i = 0; i < cNumSweepConnections; ++i)
+	{
+		sweepConnections.push_back(new UDPMessageConnection(0, 0, 0, ConnectionOK));
+		sweepSlots.push_back(WorkerConnectionSlot(sweepConnections.back()));
+	}
+}
+
+/// Reads the idle flag of each connection from its object, which is how NetworkWorkerThread::SweepIdleConnections()
+/// went over the connections before it had the slots.
+void IdleSweepConnections(u32 numIterations)
+{
+	CreateSweepConnections();
+	u32 numIdle = 0;
+	for(u32 i = 0; i < numIterations; i += cNumSweepConnections)
+		for(int j = 0; j < cNumSweepConnections; ++j)
+			numIdle += sweepConnections[j]->IsIdle() ? 1 : 0;
+	sink += numIdle;
+}
+
+/// Reads the idle flag of each connection from its WorkerConnectionSlot.
+void IdleSweepSlots(u32 numIterations)
+{
+	CreateSweepConnections();
+	u32 numIdle = 0;
+	for(u32 i = 0; i < numIterations; i += cNumSweepConnections)
+		for(int j = 0; j < cNumSweepConnections; ++j)
+			numIdle += sweepSlots[j].idle ? 1 : 0;
+	sink += numIdle;
+}
+
+const message_id_t cLoopbackMessageId = 100;
+const unsigned short cLoopbackPort = 2352;
+const u32 cWarmupMessages = 16384;
+
+/// A server and a client connected to it over UDP in this process. SendOutPacket() and ExtractMessages() are internal to
+/// the worker thread of a connection, so the loopback cases time them as the cost of moving a message from the outbound
+/// queue of the client to the inbound handler at the server.
+class LoopbackPair : public IMessageHandler, public INetworkServerListener
+{
+public:
+	LoopbackPair()
+	:server(0), numReceived(0)
+	{
+	}
+
+	bool Connect()
+	{
+		server = serverNetwork.StartServer(cLoopbackPort, SocketOverUDP, this, true);
+		if (!server)
+			return false;
+		client = clientNetwork.Connect("127.0.0.1", cLoopbackPort, SocketOverUDP, 0);
+		if (!client)
+			return false;
+		PolledTimer timer(5000.f);
+		while(client->GetConnectionState() != ConnectionOK || server->NumConnections() == 0)
+		{
+			server->Process();
+			if (timer.Test())
+				return false;
+			Clock::Sleep(1);
+		}
+		// The send rate of a new connection starts low, so it is ramped up before the timed runs.
+		return Transfer(cWarmupMessages, true);
+	}
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		connection->RegisterInboundMessageHandler(this);
+	}
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t id, const char *, size_t)
+	{
+		if (id == cLoopbackMessageId)
+			++numReceived;
+	}
+
+	/// Sends the given number of messages and waits for them to arrive. Returns false if they did not arrive in time.
+	bool Transfer(u32 numMessages, bool reliable)
+	{
+		const u32 numExpected = numReceived + numMessages;
+		u32 numSent = 0;
+		PolledTimer timer(10000.f);
+		while(numReceived < numExpected)
+		{
+			const u32 numReceivedBefore = numReceived;
+			bool queuedAny = false;
+			while(numSent < numMessages && client->NumOutboundMessagesPending() < 256)
+			{
+				NetworkMessage *msg = client->StartNewMessage(cLoopbackMessageId, 64);
+				msg->reliable = reliable;
+				memset(msg->data, 0, 64);
+				client->EndAndQueueMessage(msg, 64);
+				++numSent;
+				queuedAny = true;
+			}
+			server->Process();
+			client->Process();
+			if (timer.Test())
+				return false;
+			// Gives the worker threads the CPU when there is nothing to do here.
+			if (!queuedAny && numReceived == numReceivedBefore)
+				Clock::Sleep(0);
+		}
+		return true;
+	}
+
+	Network serverNetwork;
+	Network clientNetwork;
+	NetworkServer *server;
+	Ptr(MessageConnection) client;
+	u32 numReceived;
+};
+
+LoopbackPair *loopback = 0;
+bool loopbackFailed = false;
+
+void RunLoopback(u32 numIterations, bool reliable)
+{
+	if (!loopback && !loopbackFailed)
+	{
+		loopback = new LoopbackPair;
+		loopbackFailed = !loopback->Connect();
+	}
+	if (loopbackFailed || !loopback->Transfer(numIterations, reliable))
+	{
+		loopbackFailed = true;
+		fprintf(stderr, "The loopback connection failed!\n");
+	}
+}
+
+void LoopbackUnreliable(u32 numIterations) { RunLoopback(numIterations, false); }
+void LoopbackReliable(u32 numIterations) { RunLoopback(numIterations, true); }
+
+const BenchCase cases[] =
+{
+	{ "DataSerializer/Add", SerializeBytes },
+	{ "DataDeserializer/Read", DeserializeBytes },
+	{ "DataSerializer/AppendBits", SerializeBits },
+	{ "DataDeserializer/ReadBits", DeserializeBits },
+	{ "VLE8_16/Add", SerializeVLE<VLE8_16> },
+	{ "VLE8_16/Read", DeserializeVLE<VLE8_16> },
+	{ "VLE8_32/Add", SerializeVLE<VLE8_32> },
+	{ "VLE8_32/Read", DeserializeVLE<VLE8_32> },
+	{ "VLE16_32/Add", SerializeVLE<VLE16_32> },
+	{ "VLE16_32/Read", DeserializeVLE<VLE16_32> },
+	{ "VLE8_16_32/Add", SerializeVLE<VLE8_16_32> },
+	{ "VLE8_16_32/Read", DeserializeVLE<VLE8_16_32> },
+	{ "MaxHeap/InsertPop", MaxHeapInsertPop },
+	{ "std::priority_queue/InsertPop", PriorityQueueInsertPop },
+	{ "WaitFreeQueue/SPSC", WaitFreeQueueSPSC },
+	{ "LockFreePoolAllocator/NewFree", PoolAllocatorNewFree },
+	{ "new/delete", NewDelete },
+	{ "OrderedHashTable/InsertFindRemove", OrderedHashTableInsertFindRemove },
+	{ "NetworkWorkerThread/IdleSweepConnections", IdleSweepConnections },
+	{ "NetworkWorkerThread/IdleSweepSlots", IdleSweepSlots },
+	{ "UDPMessageConnection/UnreliableLoopback", LoopbackUnreliable },
+	{ "UDPMessageConnection/ReliableLoopback", LoopbackReliable },
+};
+
+/// Doubles the number of iterations until a run takes cMinCaseSeconds, and returns the time of the last run per iteration.
+double TimeCase(const BenchCase &c, u32 &numIterations)
+{
+	// A run of no iterations does the one-time setup of the case, such as opening the loopback connection, outside the timing.
+	c.func(0);
+	numIterations = 1024;
+	for(;;)
+	{
+		const tick_t start = Clock::Tick();
+		c.func(numIterations);
+		const double seconds = Clock::TimespanToSecondsD(start, Clock::Tick());
+		if (seconds >= cMinCaseSeconds || numIterations >= 0x40000000)
+			return seconds * 1e9 / numIterations;
+		numIterations *= 2;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")))
+	{
+		printf("Usage: %s [filter]\n", argv[0]);
+		printf("   Runs the cases whose name contains the filter string, or all of them, and prints one JSON object per case.\n");
+		return 0;
+	}
+	const char *filter = (argc > 1) ? argv[1] : "";
+
+	kNet::SetLogChannels(LogUser | LogError);
+	GenerateValues();
+
+	int numRun = 0;
+	for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+	{
+		if (!strstr(cases[i].name, filter))
+			continue;
+		u32 numIterations;
+		const double nsPerOp = TimeCase(cases[i], numIterations);
+		printf("{\"name\": \"%s\", \"iterations\": %u, \"nsPerOp\": %.3f, \"opsPerSec\": %.0f}\n",
+			cases[i].name, numIterations, nsPerOp, (nsPerOp > 0.0) ? 1e9 / nsPerOp : 0.0);
+		fflush(stdout);
+		++numRun;
+	}
+	delete loopback;
+	sweepSlots.clear();
+	sweepConnections.clear();
+
+	if (numRun == 0)
+	{
+		fprintf(stderr, "No case matches \"%s\"!\n", filter);
+		return 1;
+	}
+	return loopbackFailed ? 2 : 0;
+}
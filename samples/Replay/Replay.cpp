@@ -0,0 +1,257 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file Replay.cpp
+	@brief Sends the inbound traffic of a PacketCapture file to a server again, at the original or an accelerated speed,
+		and optionally runs the server in this process and reports how fast it received the messages. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "kNet.h"
+#include "kNet/PacketCapture.h"
+
+using namespace std;
+using namespace kNet;
+
+/// Counts the messages the local server receives.
+class ReplayServer : public IMessageHandler, public INetworkServerListener
+{
+public:
+	ReplayServer()
+	:numConnections(0), numMessages(0), numBytes(0), lastReceiveTick(Clock::Tick())
+	{
+	}
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		connection->RegisterInboundMessageHandler(this);
+		++numConnections;
+	}
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t, const char *, size_t messageBytes)
+	{
+		++numMessages;
+		numBytes += messageBytes;
+		lastReceiveTick = Clock::Tick();
+	}
+
+	int numConnections;
+	u64 numMessages;
+	u64 numBytes;
+	tick_t lastReceiveTick;
+};
+
+/// The ordering of the captured peers, so that each of them gets a socket of its own.
+struct PeerKey
+{
+	EndPoint peer;
+	SocketTransportLayer transport;
+
+	bool operator <(const PeerKey &rhs) const
+	{
+		if (transport != rhs.transport)
+			return transport < rhs.transport;
+		return peer < rhs.peer;
+	}
+};
+
+void PrintUsage()
+{
+	printf("Usage: knet_replay <capture.kcap> [--host <address>] [--port <port>] [--speed <factor>] [--local] [--dump]\n");
+	printf("  Sends the datagrams and TCP streams the capturing server received to <address>:<port> (default 127.0.0.1:2345),\n");
+	printf("  from a socket of its own for each captured peer, in the captured order.\n");
+	printf("  --speed    Replays at the given multiple of the captured speed (default 1). 0 sends as fast as possible.\n");
+	printf("  --local    Runs the server in this process and reports the rate it received the messages at.\n");
+	printf("  --dump     Only lists the packets of the capture.\n");
+	printf("  Captures of encrypted connections cannot be replayed, since the new connections do not have the old keys.\n");
+}
+
+/// Lists the packets of the capture.
+void DumpCapture(const vector<CapturedPacket> &packets)
+{
+	for(size_t i = 0; i < packets.size(); ++i)
+	{
+		const CapturedPacket &p = packets[i];
+		printf("%10.6f %s %s %s %u bytes%s\n", p.timeMicros / 1e6, (p.direction == CaptureInbound) ? "in " : "out",
+			SocketTransportLayerToString(p.transport).c_str(), p.peer.ToString().c_str(), (unsigned int)p.originalBytes,
+			(p.data.size() < p.originalBytes) ? " (truncated)" : "");
+	}
+}
+
+BottomMemoryAllocator bma;
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		PrintUsage();
+		return 0;
+	}
+	const char *filename = argv[1];
+	string host = "127.0.0.1";
+	unsigned short port = 2345;
+	double speed = 1.0;
+	bool runLocalServer = false;
+	bool dump = false;
+	for(int i = 2; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		if (arg == "--host" && i + 1 < argc) host = argv[++i];
+		else if (arg == "--port" && i + 1 < argc) port = (unsigned short)atoi(argv[++i]);
+		else if (arg == "--speed" && i + 1 < argc) speed = atof(argv[++i]);
+		else if (arg == "--local") runLocalServer = true;
+		else if (arg == "--dump") dump = true;
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	vector<CapturedPacket> packets;
+	if (!PacketCapture::ReadFile(filename, packets))
+	{
+		fprintf(stderr, "Unable to read the capture file \"%s\"!\n", filename);
+		return 1;
+	}
+	if (dump)
+	{
+		DumpCapture(packets);
+		return 0;
+	}
+
+	kNet::SetLogChannels(LogError);
+
+	// Each captured peer gets a socket of its own, so that the server sees as many clients as it did when capturing.
+	vector<const CapturedPacket *> inbound;
+	map<PeerKey, Socket *> sockets;
+	SocketTransportLayer serverTransport = InvalidTransportLayer;
+	for(size_t i = 0; i < packets.size(); ++i)
+		if (packets[i].direction == CaptureInbound)
+		{
+			inbound.push_back(&packets[i]);
+			PeerKey key = { packets[i].peer, packets[i].transport };
+			sockets[key] = 0;
+			if (serverTransport == InvalidTransportLayer)
+				serverTransport = packets[i].transport;
+		}
+	if (inbound.empty())
+	{
+		fprintf(stderr, "The capture has no inbound packets to replay.\n");
+		return 1;
+	}
+
+	Network serverNetwork;
+	ReplayServer replayServer;
+	NetworkServer *server = 0;
+	if (runLocalServer)
+	{
+		server = serverNetwork.StartServer(port, serverTransport, &replayServer, true);
+		if (!server)
+		{
+			fprintf(stderr, "Unable to start the server in port %d!\n", (int)port);
+			return 1;
+		}
+		// The captured connection attempts carry the cookies of the capturing server.
+		server->SetConnectionCookiesRequired(false);
+	}
+
+	Network clientNetwork;
+	for(map<PeerKey, Socket *>::iterator iter = sockets.begin(); iter != sockets.end(); ++iter)
+	{
+		iter->second = clientNetwork.ConnectSocket(host.c_str(), port, iter->first.transport);
+		if (!iter->second)
+		{
+			fprintf(stderr, "Unable to connect to %s:%d over %s!\n", host.c_str(), (int)port,
+				SocketTransportLayerToString(iter->first.transport).c_str());
+			return 1;
+		}
+	}
+
+	printf("Replaying %d inbound packets of %d peers from \"%s\" to %s:%d.\n", (int)inbound.size(), (int)sockets.size(),
+		filename, host.c_str(), (int)port);
+	u64 numSent = 0;
+	u64 numBytesSent = 0;
+	u64 numTruncated = 0;
+	u64 numFailed = 0;
+	const tick_t startTick = Clock::Tick();
+	for(size_t i = 0; i < inbound.size(); ++i)
+	{
+		const CapturedPacket &p = *inbound[i];
+		if (p.data.size() < p.originalBytes)
+		{
+			++numTruncated; // A datagram that is cut short would only test the error handling of the server.
+			continue;
+		}
+		// Sleep until the packet is due, and spin the last millisecond.
+		if (speed > 0.0)
+			for(;;)
+			{
+				const double msecsLeft = p.timeMicros / (speed * 1000.0) - Clock::MillisecondsSinceD(startTick);
+				if (msecsLeft <= 0.0)
+					break;
+				if (server)
+					server->Process();
+				if (msecsLeft > 2.0)
+					Clock::Sleep(1);
+			}
+
+		PeerKey key = { p.peer, p.transport };
+		Socket *socket = sockets[key];
+		bool sent = socket->Send(&p.data[0], p.data.size());
+		// The sockets push back when the server does not keep up. Let it catch up. A datagram is given a single retry,
+		// since it may also have been refused for good.
+		for(int retry = 0; !sent && socket->IsWriteOpen() && (retry == 0 || IsStreamTransportLayer(p.transport)); ++retry)
+		{
+			if (server)
+				server->Process();
+			socket->WaitForSendReady(10);
+			sent = socket->Send(&p.data[0], p.data.size());
+		}
+		if (!sent)
+		{
+			++numFailed;
+			continue;
+		}
+		++numSent;
+		numBytesSent += p.data.size();
+		if (server && (numSent & 63) == 0)
+			server->Process();
+	}
+	const double sendSeconds = Clock::SecondsSinceD(startTick);
+	printf("Sent %llu packets, %llu bytes in %.3f seconds (%.1f packets/sec). Skipped %llu truncated datagrams, failed to send %llu.\n",
+		(unsigned long long)numSent, (unsigned long long)numBytesSent, sendSeconds, numSent / max(sendSeconds, 1e-9),
+		(unsigned long long)numTruncated, (unsigned long long)numFailed);
+
+	if (server)
+	{
+		// Wait until the server has gone quiet.
+		while(Clock::SecondsSinceD(replayServer.lastReceiveTick) < 1.0)
+		{
+			server->Process();
+			Clock::Sleep(1);
+		}
+		const double seconds = max(Clock::TimespanToSecondsD(startTick, replayServer.lastReceiveTick), 1e-9);
+		printf("The server received %llu messages, %llu bytes from %d connections in %.3f seconds (%.1f messages/sec).\n",
+			(unsigned long long)replayServer.numMessages, (unsigned long long)replayServer.numBytes,
+			replayServer.numConnections, seconds, replayServer.numMessages / seconds);
+		server->Close(0);
+	}
+	return 0;
+}
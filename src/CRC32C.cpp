@@ -0,0 +1,190 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file CRC32C.cpp
+	@brief */
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define KNET_CRC32C_SSE42
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <nmmintrin.h>
+#else
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+#elif defined(__ARM_FEATURE_CRC32)
+#define KNET_CRC32C_ARMV8
+#include <arm_acle.h>
+#endif
+
+#include "kNet/CRC32C.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+namespace
+{
+/// The CRC-32C polynomial, bit-reversed.
+const u32 cPolynomial = 0x82F63B78;
+
+/// The tables of the slicing-by-8 algorithm. tables[k][b] is the checksum of the byte b followed by k zero bytes.
+struct CRC32CTables
+{
+	u32 tables[8][256];
+
+	CRC32CTables()
+	{
+		for(u32 b = 0; b < 256; ++b)
+		{
+			u32 crc = b;
+			for(int i = 0; i < 8; ++i)
+				crc = (crc >> 1) ^ ((crc & 1) ? cPolynomial : 0);
+			tables[0][b] = crc;
+		}
+		for(u32 b = 0; b < 256; ++b)
+			for(int k = 1; k < 8; ++k)
+				tables[k][b] = (tables[k-1][b] >> 8) ^ tables[0][tables[k-1][b] & 0xFF];
+	}
+};
+
+const CRC32CTables crcTables;
+
+u32 UpdatePortable(u32 crc, const u8 *data, size_t numBytes)
+{
+	const u32 (*t)[256] = crcTables.tables;
+	while(numBytes >= 8)
+	{
+		u32 low, high;
+		memcpy(&low, data, 4);
+		memcpy(&high, data + 4, 4);
+		// The tables are laid out for the bytes in little-endian order.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		low = __builtin_bswap32(low);
+		high = __builtin_bswap32(high);
+#endif
+		low ^= crc;
+		crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+			t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+		data += 8;
+		numBytes -= 8;
+	}
+	while(numBytes-- > 0)
+		crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+	return crc;
+}
+
+#ifdef KNET_CRC32C_SSE42
+bool DetectSSE42()
+{
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 1);
+	return (regs[2] & (1 << 20)) != 0;
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ecx & (1 << 20)) != 0;
+#endif
+}
+
+/// The CPU is checked once, so that the checksum of each datagram does not run cpuid.
+const bool hasSSE42 = DetectSSE42();
+
+// GCC and Clang only emit the SSE4.2 instructions in the functions that ask for them, so that the rest of the library
+// still runs on the CPUs that lack them.
+#ifndef _MSC_VER
+__attribute__((target("sse4.2")))
+#endif
+u32 UpdateSSE42(u32 crc, const u8 *data, size_t numBytes)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	u64 crc64 = crc;
+	while(numBytes >= 8)
+	{
+		u64 word;
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		data += 8;
+		numBytes -= 8;
+	}
+	crc = (u32)crc64;
+#else
+	while(numBytes >= 4)
+	{
+		u32 word;
+		memcpy(&word, data, 4);
+		crc = _mm_crc32_u32(crc, word);
+		data += 4;
+		numBytes -= 4;
+	}
+#endif
+	while(numBytes-- > 0)
+		crc = _mm_crc32_u8(crc, *data++);
+	return crc;
+}
+#endif
+
+#ifdef KNET_CRC32C_ARMV8
+u32 UpdateARMv8(u32 crc, const u8 *data, size_t numBytes)
+{
+	while(numBytes >= 8)
+	{
+		u64 word;
+		memcpy(&word, data, 8);
+		crc = __crc32cd(crc, word);
+		data += 8;
+		numBytes -= 8;
+	}
+	while(numBytes-- > 0)
+		crc = __crc32cb(crc, *data++);
+	return crc;
+}
+#endif
+
+} // ~unnamed namespace
+
+u32 CRC32C(const void *data, size_t numBytes, u32 crc)
+{
+#if defined(KNET_CRC32C_SSE42)
+	if (hasSSE42)
+		return ~UpdateSSE42(~crc, (const u8 *)data, numBytes);
+#elif defined(KNET_CRC32C_ARMV8)
+	return ~UpdateARMv8(~crc, (const u8 *)data, numBytes);
+#endif
+	return ~UpdatePortable(~crc, (const u8 *)data, numBytes);
+}
+
+u32 CRC32CPortable(const void *data, size_t numBytes, u32 crc)
+{
+	return ~UpdatePortable(~crc, (const u8 *)data, numBytes);
+}
+
+bool CRC32CHardwareAccelerated()
+{
+#if defined(KNET_CRC32C_SSE42)
+	return hasSSE42;
+#elif defined(KNET_CRC32C_ARMV8)
+	return true;
+#else
+	return false;
+#endif
+}
+
+} // ~kNet
@@ -31,12 +31,129 @@
 #include <emscripten.h>
 #endif
 
+#if defined(KNET_USE_TSC_CLOCK) && (defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64))
+#define KNET_TSC_CLOCK_AVAILABLE
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#endif
+
 #include "kNet/Clock.h"
 #include "kNet/NetworkLogging.h"
 
+#ifdef _MSC_VER
+#define KNET_THREAD_LOCAL __declspec(thread)
+#else
+#define KNET_THREAD_LOCAL __thread
+#endif
+
 namespace kNet
 {
 
+namespace
+{
+/// Reads the current tick of the system clock, in the units of SystemTicksPerSec().
+tick_t SystemTick()
+{
+#if defined(ANDROID)
+	struct timespec res;
+	clock_gettime(CLOCK_MONOTONIC, &res);
+	return 1000000000ULL*res.tv_sec + (tick_t)res.tv_nsec;
+#elif defined(EMSCRIPTEN)
+	// emscripten_get_now() returns a wallclock time as a float in milliseconds (1e-3).
+	// scale it to microseconds (1e-6) and return as a tick.
+	return (tick_t)(((double)emscripten_get_now()) * 1e3);
+//	return (tick_t)clock();
+#elif defined(WIN32)
+	LARGE_INTEGER ddwTimer;
+	QueryPerformanceCounter(&ddwTimer);
+	return ddwTimer.QuadPart;
+#elif defined(_POSIX_MONOTONIC_CLOCK)
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (tick_t)t.tv_sec * 1000 * 1000 * 1000 + (tick_t)t.tv_nsec;
+#elif defined(_POSIX_C_SOURCE) || defined(__APPLE__)
+	timeval t;
+	gettimeofday(&t, NULL);
+	return (tick_t)t.tv_sec * 1000 * 1000 + (tick_t)t.tv_usec;
+#else
+	return (tick_t)clock();
+#endif
+}
+
+/// The tick the calling thread cached with Clock::UpdateLoopTick(), or 0 if none.
+KNET_THREAD_LOCAL tick_t threadLoopTick;
+
+#ifdef KNET_TSC_CLOCK_AVAILABLE
+/// The calibrated frequency of the time-stamp counter, or 0 if the counter is not used.
+tick_t tscTicksPerSec = 0;
+
+/// The latest tick the calling thread has read from the counter. The counters of the different cores of a CPU with an
+/// invariant TSC run in sync, but a thread that migrates between sockets could still see a slightly smaller value.
+KNET_THREAD_LOCAL tick_t threadLastTscTick;
+
+/// Returns true if the CPU reports that its time-stamp counter runs at a constant rate in all power states.
+bool HasInvariantTSC()
+{
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if ((unsigned int)regs[0] < 0x80000007)
+		return false;
+	__cpuid(regs, 0x80000007);
+	return (regs[3] & (1 << 8)) != 0;
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+		return false;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (edx & (1 << 8)) != 0;
+#endif
+}
+
+/// Measures the frequency of the time-stamp counter against the system clock.
+/// @return The frequency, or 0 if the counter does not have a usable rate.
+tick_t CalibrateTSC(tick_t systemTicksPerSec)
+{
+	const int cCalibrationMSecs = 10;
+
+	// Each endpoint reads the counter between two reads of the system clock, so that the pairs line up to within the
+	// time a clock read takes.
+	const tick_t systemStart = SystemTick();
+	const tick_t tscStart = __rdtsc();
+	const tick_t systemStart2 = SystemTick();
+	Clock::Sleep(cCalibrationMSecs);
+	const tick_t systemEnd = SystemTick();
+	const tick_t tscEnd = __rdtsc();
+	const tick_t systemEnd2 = SystemTick();
+
+	const double systemSecs = ((systemEnd + systemEnd2) / 2.0 - (systemStart + systemStart2) / 2.0) / systemTicksPerSec;
+	if (systemSecs <= 0.0 || tscEnd <= tscStart)
+		return 0;
+	const double frequency = (tscEnd - tscStart) / systemSecs;
+	if (frequency < 1e8) // Any invariant TSC runs faster than 100 MHz.
+		return 0;
+	// Round to whole kilohertz, which is finer than the calibration can resolve anyway. This way a millisecond is a
+	// whole number of ticks.
+	return (tick_t)(frequency / 1000.0 + 0.5) * 1000;
+}
+
+tick_t TscTick()
+{
+	tick_t tick = __rdtsc();
+	if (tick < threadLastTscTick)
+		tick = threadLastTscTick;
+	threadLastTscTick = tick;
+	return tick;
+}
+#endif
+
+} // ~unnamed namespace
+
 #ifdef WIN32
 LARGE_INTEGER Clock::ddwTimerFrequency;
 #endif
@@ -72,6 +189,17 @@ void Clock::InitClockData()
 
 	///\todo Test here that the return values of QueryPerformanceCounter is nondecreasing.
 #endif
+
+#ifdef KNET_TSC_CLOCK_AVAILABLE
+	if (tscTicksPerSec == 0 && HasInvariantTSC())
+	{
+		tscTicksPerSec = CalibrateTSC(TicksPerSec());
+		if (tscTicksPerSec != 0)
+			appStartTime = Tick(); // Measure the application time in the units of the new clock source.
+		else
+			KNET_LOG(LogError, "Clock: Failed to calibrate the time-stamp counter. Using the system clock instead.");
+	}
+#endif
 }
 
 Clock::Clock()
@@ -195,34 +323,59 @@ unsigned long Clock::Time()
 
 tick_t Clock::Tick()
 {
-#if defined(ANDROID)
-	struct timespec res;
-	clock_gettime(CLOCK_REALTIME, &res);
-	return 1000000000ULL*res.tv_sec + (tick_t)res.tv_nsec;
-#elif defined(EMSCRIPTEN)
-	// emscripten_get_now() returns a wallclock time as a float in milliseconds (1e-3).
-	// scale it to microseconds (1e-6) and return as a tick.
-	return (tick_t)(((double)emscripten_get_now()) * 1e3);
-//	return (tick_t)clock();
-#elif defined(WIN32)
-	LARGE_INTEGER ddwTimer;
-	QueryPerformanceCounter(&ddwTimer);
-	return ddwTimer.QuadPart;
-#elif defined(_POSIX_MONOTONIC_CLOCK)
-	timespec t;
-	clock_gettime(CLOCK_MONOTONIC, &t);
-	return (tick_t)t.tv_sec * 1000 * 1000 * 1000 + (tick_t)t.tv_nsec;
-#elif defined(_POSIX_C_SOURCE) || defined(__APPLE__)
-	timeval t;
-	gettimeofday(&t, NULL);
-	return (tick_t)t.tv_sec * 1000 * 1000 + (tick_t)t.tv_usec;
+#ifdef KNET_TSC_CLOCK_AVAILABLE
+	if (tscTicksPerSec != 0)
+		return TscTick();
+#endif
+	return SystemTick();
+}
+
+bool Clock::UsesTSC()
+{
+#ifdef KNET_TSC_CLOCK_AVAILABLE
+	return tscTicksPerSec != 0;
 #else
-	return (tick_t)clock();
+	return false;
+#endif
+}
+
+tick_t Clock::UpdateLoopTick()
+{
+	threadLoopTick = Tick();
+	return threadLoopTick;
+}
+
+tick_t Clock::LoopTick()
+{
+	return threadLoopTick != 0 ? threadLoopTick : Tick();
+}
+
+void Clock::ClearLoopTick()
+{
+	threadLoopTick = 0;
+}
+
+tick_t Clock::TickFromRealTime(unsigned long long seconds, unsigned long nanoseconds)
+{
+	const tick_t now = Tick();
+#ifdef __linux__
+	timespec realNow;
+	clock_gettime(CLOCK_REALTIME, &realNow);
+	const long long ageNSecs = ((long long)realNow.tv_sec - (long long)seconds) * 1000000000LL + ((long long)realNow.tv_nsec - (long long)nanoseconds);
+	if (ageNSecs <= 0 || ageNSecs >= 1000000000LL)
+		return now;
+	return now - (tick_t)((double)ageNSecs * (double)TicksPerSec() / 1e9);
+#else
+	return now;
 #endif
 }
 
 unsigned long Clock::TickU32()
 {
+#ifdef KNET_TSC_CLOCK_AVAILABLE
+	if (tscTicksPerSec != 0)
+		return (unsigned long)Tick();
+#endif
 #ifdef WIN32
 	LARGE_INTEGER ddwTimer;
 	QueryPerformanceCounter(&ddwTimer);
@@ -234,6 +387,10 @@ unsigned long Clock::TickU32()
 
 tick_t Clock::TicksPerSec()
 {
+#ifdef KNET_TSC_CLOCK_AVAILABLE
+	if (tscTicksPerSec != 0)
+		return tscTicksPerSec;
+#endif
 #if defined(ANDROID)
 	return 1000000000ULL; // 1e9 == nanoseconds.
 #elif defined(EMSCRIPTEN)
@@ -0,0 +1,410 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file CongestionControl.cpp
+	@brief */
+
+#include <cmath>
+#include <algorithm>
+
+#include "kNet/CongestionControl.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+namespace
+{
+/// The window that a connection starts with, in datagrams (RFC 6928).
+const double cInitialWindowDatagrams = 10.0;
+/// The smallest window the controllers go down to, in datagrams.
+const double cMinWindowDatagrams = 2.0;
+/// The round trip time that the pacing rate is computed with until the first one is measured.
+const double cInitialRttMSecs = 1.0;
+
+/// The CUBIC constants of RFC 8312: the window is cut to cCubicBeta on a loss, and cCubicC scales the cubic curve.
+const double cCubicBeta = 0.7;
+const double cCubicC = 0.4;
+/// The window is cut to cCubicBetaECN on a Congestion Experienced mark (Alternative Backoff with ECN, RFC 8511).
+const double cCubicBetaECN = 0.8;
+
+/// The pacing and window gain of BBR Startup, 2/ln(2), which doubles the sending rate every round trip.
+const double cBBRHighGain = 2.885;
+/// The pacing gains of the eight phases of the ProbeBW cycle. The first phase probes for more bandwidth, and the second drains the queue it caused.
+const double cBBRPacingGainCycle[] = { 1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0 };
+const int cBBRGainCycleLength = sizeof(cBBRPacingGainCycle) / sizeof(cBBRPacingGainCycle[0]);
+/// The min round trip time is remeasured in ProbeRTT if it has not been refreshed in this time.
+const double cBBRMinRttWindowSecs = 10.0;
+/// The time ProbeRTT keeps the bytes in flight down to cBBRProbeRttWindowDatagrams.
+const double cBBRProbeRttMSecs = 200.0;
+const double cBBRProbeRttWindowDatagrams = 4.0;
+/// Startup ends when the bandwidth estimate has not grown by this factor in cBBRFullBandwidthRounds round trips.
+const double cBBRFullBandwidthGrowth = 1.25;
+const int cBBRFullBandwidthRounds = 3;
+
+/// The min round trip time of BandwidthEstimator is the min of this window.
+const double cMinRttWindowSecs = 10.0;
+/// The gain of the smoothed queuing delay of BandwidthEstimator.
+const double cQueuingDelayGain = 0.125;
+}
+
+BandwidthEstimator::BandwidthEstimator()
+:roundCount(0),
+nextRoundDelivered(0),
+minRttMSecs(0),
+minRttStamp(0),
+queuingDelayMSecs(0)
+{
+	for(int i = 0; i < cFilterLength; ++i)
+		samples[i] = 0;
+}
+
+bool BandwidthEstimator::OnDatagramAcked(tick_t now, const SentDatagramInfo &datagram, u64 delivered)
+{
+	// A round trip ends when a datagram that was sent after the previous round trip ended is acked.
+	const bool roundStart = (datagram.delivered >= nextRoundDelivered);
+	if (roundStart)
+	{
+		nextRoundDelivered = delivered;
+		++roundCount;
+		samples[roundCount % cFilterLength] = 0;
+	}
+
+	// The delivery rate is the number of bytes acked while this datagram was in flight, over the time it took.
+	const double intervalSecs = Clock::TimespanToSecondsD(datagram.deliveredTick, now);
+	if (intervalSecs > 0)
+	{
+		const double rate = (double)(delivered - datagram.delivered) / intervalSecs;
+		// When the application is not filling the pipe, a sample only tells that the path carries at least that much.
+		if (!datagram.appLimited || rate > Bandwidth())
+		{
+			double &sample = samples[roundCount % cFilterLength];
+			sample = std::max(sample, rate);
+		}
+	}
+	return roundStart;
+}
+
+void BandwidthEstimator::OnRttSample(tick_t now, float rttMSecs)
+{
+	if (minRttMSecs == 0 || rttMSecs <= minRttMSecs || Clock::TimespanToSecondsD(minRttStamp, now) > cMinRttWindowSecs)
+	{
+		minRttMSecs = rttMSecs;
+		minRttStamp = now;
+	}
+	queuingDelayMSecs += cQueuingDelayGain * ((rttMSecs - minRttMSecs) - queuingDelayMSecs);
+}
+
+double BandwidthEstimator::Bandwidth() const
+{
+	double bandwidth = 0;
+	for(int i = 0; i < cFilterLength; ++i)
+		bandwidth = std::max(bandwidth, samples[i]);
+	return bandwidth;
+}
+
+const char *CongestionControlAlgorithmToString(CongestionControlAlgorithm algorithm)
+{
+	switch(algorithm)
+	{
+	case CongestionControlCubic: return "CUBIC";
+	case CongestionControlBBR: return "BBR";
+	default: return "(unknown)";
+	}
+}
+
+CongestionControl *CongestionControl::Create(CongestionControlAlgorithm algorithm, size_t maxDatagramSize)
+{
+	if (algorithm == CongestionControlBBR)
+		return new BBRCongestionControl(maxDatagramSize);
+	return new CubicCongestionControl(maxDatagramSize);
+}
+
+CubicCongestionControl::CubicCongestionControl(size_t maxDatagramSize)
+:mss((double)maxDatagramSize),
+cwnd(cInitialWindowDatagrams * maxDatagramSize),
+ssthresh(1e18),
+wMax(0),
+k(0),
+epochStart(0),
+inRecovery(false),
+recoveryStart(0),
+smoothedRttMSecs(0)
+{
+}
+
+void CubicCongestionControl::OnDatagramAcked(tick_t now, const SentDatagramInfo &datagram, u64 /*delivered*/, size_t /*bytesInFlight*/)
+{
+	// The window is not grown in the round trip that follows a cut.
+	if (inRecovery)
+	{
+		if (Clock::IsNewer(recoveryStart, datagram.sentTick))
+			return;
+		inRecovery = false;
+	}
+	// If the application did not fill the window, the acks do not show that the path would carry a larger one.
+	if (datagram.appLimited)
+		return;
+
+	if (cwnd < ssthresh)
+	{
+		cwnd += datagram.numBytes;
+		return;
+	}
+
+	if (epochStart == 0)
+	{
+		epochStart = now;
+		if (cwnd < wMax)
+			k = std::pow((wMax - cwnd) / mss / cCubicC, 1.0 / 3.0);
+		else
+		{
+			k = 0;
+			wMax = cwnd;
+		}
+	}
+
+	// Aim for the size of the curve one round trip from now, but grow at least as fast as Reno would.
+	const double rttSecs = ((smoothedRttMSecs > 0) ? smoothedRttMSecs : cInitialRttMSecs) / 1000.0;
+	const double t = Clock::TimespanToSecondsD(epochStart, now) + rttSecs;
+	double target = cCubicC * (t - k) * (t - k) * (t - k) * mss + wMax;
+	const double renoWindow = wMax * cCubicBeta + 3.0 * (1.0 - cCubicBeta) / (1.0 + cCubicBeta) * (t / rttSecs) * mss;
+	target = std::max(target, renoWindow);
+	if (target > cwnd)
+		cwnd += (target - cwnd) * datagram.numBytes / cwnd;
+	else
+		cwnd += 0.01 * mss * datagram.numBytes / cwnd;
+}
+
+void CubicCongestionControl::OnDatagramLost(tick_t now, const SentDatagramInfo &datagram, size_t /*bytesInFlight*/)
+{
+	Cut(now, datagram.sentTick, cCubicBeta);
+}
+
+void CubicCongestionControl::OnCongestionMarked(tick_t now, tick_t sentTick, size_t /*bytesInFlight*/)
+{
+	Cut(now, sentTick, cCubicBetaECN);
+}
+
+void CubicCongestionControl::Cut(tick_t now, tick_t sentTick, double beta)
+{
+	// Cut the window only once for all the datagrams that were in flight at the previous cut.
+	if (inRecovery && Clock::IsNewer(recoveryStart, sentTick))
+		return;
+	inRecovery = true;
+	recoveryStart = now;
+	epochStart = 0;
+
+	// If the window did not get back to its previous peak, let go of bandwidth for the other flows on the path (fast convergence).
+	wMax = (cwnd < wMax) ? cwnd * (1.0 + beta) / 2.0 : cwnd;
+	cwnd = std::max(cwnd * beta, cMinWindowDatagrams * mss);
+	ssthresh = cwnd;
+}
+
+void CubicCongestionControl::OnRttSample(tick_t /*now*/, float rttMSecs)
+{
+	smoothedRttMSecs = (smoothedRttMSecs == 0) ? rttMSecs : 0.875 * smoothedRttMSecs + 0.125 * rttMSecs;
+}
+
+void CubicCongestionControl::SetMaxDatagramSize(size_t maxDatagramSize)
+{
+	mss = (double)maxDatagramSize;
+	cwnd = std::max(cwnd, cMinWindowDatagrams * mss);
+}
+
+void CubicCongestionControl::ResumeWindow(size_t congestionWindow)
+{
+	// Continue in congestion avoidance from the window, as the window had left slow start if it grew past the initial one.
+	cwnd = std::max((double)congestionWindow, cMinWindowDatagrams * mss);
+	if (cwnd > cInitialWindowDatagrams * mss)
+		ssthresh = cwnd;
+}
+
+double CubicCongestionControl::PacingRate() const
+{
+	// Spread the window over the round trip, and a little faster so that pacing itself does not limit the window.
+	const double rttSecs = ((smoothedRttMSecs > 0) ? smoothedRttMSecs : cInitialRttMSecs) / 1000.0;
+	const double gain = InSlowStart() ? 2.0 : 1.25;
+	return gain * cwnd / rttSecs;
+}
+
+BBRCongestionControl::BBRCongestionControl(size_t maxDatagramSize_)
+:maxDatagramSize(maxDatagramSize_),
+mode(Startup),
+pacingGain(cBBRHighGain),
+cwndGain(cBBRHighGain),
+cwnd(cInitialWindowDatagrams * maxDatagramSize_),
+minRttMSecs(0),
+minRttStamp(0),
+minRttExpired(false),
+fullBandwidth(0),
+fullBandwidthRounds(0),
+cycleIndex(0),
+cycleStart(0),
+probeRttDone(0)
+{
+}
+
+double BBRCongestionControl::BDP() const
+{
+	return BottleneckBandwidth() * minRttMSecs / 1000.0;
+}
+
+void BBRCongestionControl::OnDatagramAcked(tick_t now, const SentDatagramInfo &datagram, u64 delivered, size_t bytesInFlight)
+{
+	const bool roundStart = bandwidthFilter.OnDatagramAcked(now, datagram, delivered);
+
+	if (roundStart && mode == Startup)
+	{
+		const double bandwidth = BottleneckBandwidth();
+		if (bandwidth >= fullBandwidth * cBBRFullBandwidthGrowth)
+		{
+			fullBandwidth = bandwidth;
+			fullBandwidthRounds = 0;
+		}
+		else if (!datagram.appLimited)
+			++fullBandwidthRounds;
+	}
+
+	// Grow the window by the acked bytes up to the target. In Startup, the window keeps growing until the bandwidth is measured.
+	const double target = cwndGain * BDP();
+	if (mode == Startup || cwnd < target)
+		cwnd += datagram.numBytes;
+	if (mode != Startup && target > 0)
+		cwnd = std::min(cwnd, target);
+	cwnd = std::max(cwnd, cBBRProbeRttWindowDatagrams * maxDatagramSize);
+
+	UpdateMode(now, bytesInFlight);
+}
+
+void BBRCongestionControl::OnDatagramLost(tick_t /*now*/, const SentDatagramInfo & /*datagram*/, size_t /*bytesInFlight*/)
+{
+	// The model is built from the delivery rate and the round trip time, so losses do not change it.
+}
+
+void BBRCongestionControl::OnCongestionMarked(tick_t now, tick_t /*sentTick*/, size_t bytesInFlight)
+{
+	// The queue at the bottleneck has started to build up, so the bandwidth will not grow any further. Drain the queue now
+	// instead of waiting for the bandwidth estimate to stop growing.
+	if (mode == Startup)
+		fullBandwidthRounds = cBBRFullBandwidthRounds;
+	else if (mode == ProbeBW && pacingGain > 1.0)
+	{
+		cycleIndex = 1;
+		pacingGain = cBBRPacingGainCycle[cycleIndex];
+		cycleStart = now;
+	}
+	UpdateMode(now, bytesInFlight);
+}
+
+void BBRCongestionControl::OnRttSample(tick_t now, float rttMSecs)
+{
+	const bool expired = (minRttMSecs > 0 && Clock::TimespanToSecondsD(minRttStamp, now) > cBBRMinRttWindowSecs);
+	if (minRttMSecs == 0 || rttMSecs <= minRttMSecs || expired)
+	{
+		minRttMSecs = rttMSecs;
+		minRttStamp = now;
+	}
+	if (expired && mode != ProbeRTT)
+		minRttExpired = true;
+}
+
+void BBRCongestionControl::UpdateMode(tick_t now, size_t bytesInFlight)
+{
+	if (mode == Startup && fullBandwidthRounds >= cBBRFullBandwidthRounds)
+	{
+		// The pipe is full. Drain the queue that Startup built up.
+		mode = Drain;
+		pacingGain = 1.0 / cBBRHighGain;
+		cwndGain = cBBRHighGain;
+	}
+	if (mode == Drain && bytesInFlight <= BDP())
+	{
+		mode = ProbeBW;
+		pacingGain = 1.0;
+		cwndGain = 2.0;
+		cycleIndex = 2 + (int)(bandwidthFilter.RoundCount() % (cBBRGainCycleLength - 2));
+		cycleStart = now;
+	}
+	if (mode == ProbeBW && Clock::TimespanToMillisecondsD(cycleStart, now) > minRttMSecs)
+	{
+		cycleIndex = (cycleIndex + 1) % cBBRGainCycleLength;
+		pacingGain = cBBRPacingGainCycle[cycleIndex];
+		cycleStart = now;
+	}
+
+	if (minRttExpired && mode != ProbeRTT)
+	{
+		minRttExpired = false;
+		mode = ProbeRTT;
+		pacingGain = 1.0;
+		probeRttDone = 0;
+	}
+	if (mode == ProbeRTT)
+	{
+		// Hold the bytes in flight down for a while, so that the round trip time is measured without a queue.
+		if (probeRttDone == 0 && bytesInFlight <= cBBRProbeRttWindowDatagrams * maxDatagramSize)
+			probeRttDone = now + (tick_t)(cBBRProbeRttMSecs * Clock::TicksPerMillisecond());
+		else if (probeRttDone != 0 && Clock::IsNewer(now, probeRttDone))
+		{
+			minRttStamp = now;
+			if (fullBandwidthRounds >= cBBRFullBandwidthRounds)
+			{
+				mode = ProbeBW;
+				pacingGain = 1.0;
+				cwndGain = 2.0;
+				cycleIndex = 2;
+				cycleStart = now;
+			}
+			else
+			{
+				mode = Startup;
+				pacingGain = cBBRHighGain;
+				cwndGain = cBBRHighGain;
+			}
+		}
+	}
+}
+
+void BBRCongestionControl::SetMaxDatagramSize(size_t maxDatagramSize_)
+{
+	maxDatagramSize = maxDatagramSize_;
+	cwnd = std::max(cwnd, cBBRProbeRttWindowDatagrams * maxDatagramSize);
+}
+
+void BBRCongestionControl::ResumeWindow(size_t congestionWindow)
+{
+	// The bandwidth and the min round trip time are measured anew in Startup, which starts from the window.
+	cwnd = std::max((double)congestionWindow, cBBRProbeRttWindowDatagrams * maxDatagramSize);
+}
+
+size_t BBRCongestionControl::CongestionWindow() const
+{
+	if (mode == ProbeRTT)
+		return (size_t)(cBBRProbeRttWindowDatagrams * maxDatagramSize);
+	return (size_t)cwnd;
+}
+
+double BBRCongestionControl::PacingRate() const
+{
+	const double bandwidth = BottleneckBandwidth();
+	if (bandwidth > 0)
+		return pacingGain * bandwidth;
+	// Until the bandwidth is measured, send the initial window over the round trip.
+	const double rttSecs = ((minRttMSecs > 0) ? minRttMSecs : cInitialRttMSecs) / 1000.0;
+	return pacingGain * cInitialWindowDatagrams * maxDatagramSize / rttSecs;
+}
+
+} // ~kNet
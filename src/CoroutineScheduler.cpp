@@ -0,0 +1,320 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file CoroutineScheduler.cpp
+	@brief */
+
+#include <algorithm>
+#include <cassert>
+
+#include "kNet/CoroutineScheduler.h"
+#include "kNet/Network.h"
+#include "kNet/NetworkMessage.h"
+#include "kNet/NetworkLogging.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+CoroutineScheduler::Operation::Operation(OperationType type_)
+:type(type_),
+network(0),
+port(0),
+transport(SocketOverUDP),
+messageHandler(0),
+messageId(0),
+anyMessageId(true),
+message(0),
+succeeded(false),
+ackResult(MessageConnectionClosed),
+owner(0)
+{
+}
+
+void CoroutineScheduler::Operation::HandleMessageAcked(message_id_t UNUSED(messageId), MessageAckResult result)
+{
+	succeeded = (result == MessageDelivered);
+	ackResult = result;
+	owner->AckReceived(this);
+}
+
+CoroutineScheduler::CoroutineScheduler()
+:waitEventsDirty(true)
+{
+	startQueue.Acquire()->numPending = 0;
+	wakeEvent = CreateNewEvent(EventWaitSignal);
+}
+
+CoroutineScheduler::~CoroutineScheduler()
+{
+	if (NumPendingOperations() > 0)
+		KNET_LOG(LogError, "CoroutineScheduler::~CoroutineScheduler: Destroyed with %d operations pending! Their coroutines are never resumed.",
+			NumPendingOperations());
+
+	for(std::map<MessageConnection*, WatchedConnection*>::iterator iter = watched.begin(); iter != watched.end(); ++iter)
+	{
+		WatchedConnection *watch = iter->second;
+		for(size_t i = 0; i < watch->held.size(); ++i)
+			watch->connection->FreeMessage(watch->held[i]);
+		delete watch;
+	}
+	wakeEvent.Close();
+}
+
+void CoroutineScheduler::Start(Operation *operation)
+{
+	assert(operation);
+	operation->owner = this;
+	{
+		Lockable<StartQueue>::LockType lock = startQueue.Acquire();
+		lock->operations.push_back(operation);
+		++lock->numPending;
+	}
+
+	// The message is queued right away, since EndAndQueueMessage() may be called from any thread. The operation completes
+	// once the worker thread reports the message acked or dropped, which may happen before this function returns.
+	if (operation->type == OperationAck)
+	{
+		NetworkMessage *msg = operation->message;
+		operation->message = 0;
+		if (!msg || !operation->connection)
+		{
+			NetworkMessagePool::Free(msg);
+			operation->succeeded = false;
+			operation->ackResult = MessageConnectionClosed;
+			AckReceived(operation);
+			return;
+		}
+		msg->reliable = true;
+		msg->ackHandler = operation;
+		operation->connection->EndAndQueueMessage(msg);
+	}
+	wakeEvent.Set();
+}
+
+void CoroutineScheduler::Wake()
+{
+	wakeEvent.Set();
+}
+
+int CoroutineScheduler::NumPendingOperations() const
+{
+	return startQueue.Acquire()->numPending;
+}
+
+void CoroutineScheduler::AckReceived(Operation *operation)
+{
+	ackedOperations.Acquire()->push_back(operation);
+	wakeEvent.Set();
+}
+
+int CoroutineScheduler::Poll(int maxMSecsToWait)
+{
+	std::vector<Operation*> completed;
+	Update(completed);
+	if (completed.empty() && maxMSecsToWait > 0)
+	{
+		Wait(maxMSecsToWait);
+		Update(completed);
+	}
+
+	if (!completed.empty())
+		startQueue.Acquire()->numPending -= (int)completed.size();
+	// The operation may be resumed and gone as soon as it is told, so nothing refers to it after this.
+	for(size_t i = 0; i < completed.size(); ++i)
+		completed[i]->Completed();
+	return (int)completed.size();
+}
+
+void CoroutineScheduler::Update(std::vector<Operation*> &completed)
+{
+	// Reset before taking the queues, so that an operation started after this sets the event again.
+	wakeEvent.Reset();
+
+	std::vector<Operation*> started;
+	started.swap(startQueue.Acquire()->operations);
+	{
+		Lockable<std::vector<Operation*> >::LockType acked = ackedOperations.Acquire();
+		completed.insert(completed.end(), acked->begin(), acked->end());
+		acked->clear();
+	}
+
+	for(size_t i = 0; i < started.size(); ++i)
+	{
+		Operation *operation = started[i];
+		switch(operation->type)
+		{
+		case OperationConnect:
+			StartConnect(operation, completed);
+			break;
+		case OperationReceive:
+			if (!operation->connection)
+				completed.push_back(operation);
+			else
+				Watch(operation->connection).receives.push_back(operation);
+			break;
+		case OperationAck:
+			break; // Queued by Start(), and completed through AckReceived().
+		}
+	}
+
+	UpdateConnects(completed);
+
+	for(std::map<MessageConnection*, WatchedConnection*>::iterator iter = watched.begin(); iter != watched.end();)
+	{
+		WatchedConnection *watch = iter->second;
+		UpdateReceives(*watch, completed);
+
+		const bool waited = !watch->receives.empty() || watch->numConnects > 0;
+		if (waited != watch->waited)
+		{
+			watch->waited = waited;
+			waitEventsDirty = true;
+		}
+		if (!waited && watch->held.empty())
+		{
+			delete watch;
+			watched.erase(iter++);
+		}
+		else
+			++iter;
+	}
+}
+
+void CoroutineScheduler::StartConnect(Operation *operation, std::vector<Operation*> &completed)
+{
+	operation->connection = operation->network ? operation->network->ConnectAsync(operation->address.c_str(), operation->port,
+		operation->transport, operation->messageHandler) : Ptr(MessageConnection)();
+	if (!operation->connection)
+	{
+		KNET_LOG(LogError, "CoroutineScheduler::StartConnect: Could not start connecting to %s:%d!", operation->address.c_str(), (int)operation->port);
+		completed.push_back(operation);
+		return;
+	}
+	connects.push_back(operation);
+	// Wait on the connection, which signals its InboundMessagesEvent() when it is established or fails.
+	++Watch(operation->connection).numConnects;
+}
+
+void CoroutineScheduler::UpdateConnects(std::vector<Operation*> &completed)
+{
+	// Carry on with the connects that wait for their socket, once for each Network.
+	std::vector<Network*> networks;
+	for(size_t i = 0; i < connects.size(); ++i)
+		if (connects[i]->network->NumPendingConnects() > 0 && std::find(networks.begin(), networks.end(), connects[i]->network) == networks.end())
+		{
+			networks.push_back(connects[i]->network);
+			connects[i]->network->ProcessPendingConnects();
+		}
+
+	for(size_t i = 0; i < connects.size();)
+	{
+		Operation *operation = connects[i];
+		const ConnectionState state = operation->connection->GetConnectionState();
+		if (state == ConnectionPending)
+		{
+			++i;
+			continue;
+		}
+
+		--Watch(operation->connection).numConnects;
+		if (state != ConnectionOK)
+		{
+			KNET_LOG(LogVerbose, "CoroutineScheduler::UpdateConnects: Connecting to %s:%d failed, the connection is in state %s.",
+				operation->address.c_str(), (int)operation->port, ConnectionStateToString(state).c_str());
+			operation->connection = 0;
+		}
+		completed.push_back(operation);
+		connects.erase(connects.begin() + i);
+	}
+}
+
+void CoroutineScheduler::UpdateReceives(WatchedConnection &watch, std::vector<Operation*> &completed)
+{
+	if (watch.receives.empty() && watch.numConnects == 0)
+		return;
+
+	// Take all the received messages off the connection, which also resets its InboundMessagesEvent().
+	MessageConnection *connection = watch.connection.ptr();
+	while(NetworkMessage *msg = connection->ReceiveMessage(-1))
+		watch.held.push_back(msg);
+
+	for(size_t i = 0; i < watch.receives.size();)
+	{
+		Operation *operation = watch.receives[i];
+		std::deque<NetworkMessage*>::iterator iter = watch.held.begin();
+		if (!operation->anyMessageId)
+			while(iter != watch.held.end() && (*iter)->id != operation->messageId)
+				++iter;
+		if (iter == watch.held.end())
+		{
+			++i;
+			continue;
+		}
+		operation->message = *iter;
+		watch.held.erase(iter);
+		completed.push_back(operation);
+		watch.receives.erase(watch.receives.begin() + i);
+	}
+
+	// No more messages arrive once the peer has closed the connection, so the operations left never complete otherwise. A
+	// UDP connection the peer has disconnected stays in ConnectionDisconnecting, with its socket read-closed.
+	const ConnectionState state = connection->GetConnectionState();
+	const Socket *socket = connection->GetSocket();
+	if (state == ConnectionPeerClosed || state == ConnectionClosed || (socket && !socket->IsReadOpen()))
+	{
+		for(size_t i = 0; i < watch.receives.size(); ++i)
+			completed.push_back(watch.receives[i]);
+		watch.receives.clear();
+	}
+}
+
+CoroutineScheduler::WatchedConnection &CoroutineScheduler::Watch(Ptr(MessageConnection) connection)
+{
+	WatchedConnection *&watch = watched[connection.ptr()];
+	if (!watch)
+	{
+		watch = new WatchedConnection;
+		watch->connection = connection;
+		watch->numConnects = 0;
+		watch->waited = false;
+	}
+	return *watch;
+}
+
+void CoroutineScheduler::Wait(int maxMSecsToWait)
+{
+	if (waitEventsDirty)
+	{
+		// A connection that was freed may have had its event descriptor reused by now, so register the events anew.
+		waitEvents.Clear();
+		waitEvents.ResetRegistrations();
+		waitEvents.AddEvent(wakeEvent);
+		for(std::map<MessageConnection*, WatchedConnection*>::iterator iter = watched.begin(); iter != watched.end(); ++iter)
+			if (iter->second->waited)
+				waitEvents.AddEvent(iter->second->connection->InboundMessagesEvent());
+		waitEventsDirty = false;
+	}
+
+	for(size_t i = 0; i < connects.size(); ++i)
+		if (connects[i]->network->NumPendingConnects() > 0 && maxMSecsToWait > cPendingConnectPollMSecs)
+		{
+			maxMSecsToWait = cPendingConnectPollMSecs;
+			break;
+		}
+	waitEvents.Wait(maxMSecsToWait);
+}
+
+} // ~kNet
@@ -15,16 +15,27 @@
 /** @file DataDeserializer.cpp
 	@brief */
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <cmath>
 
 #include "kNet/DebugMemoryLeakCheck.h"
 
+#include "kNet/BitOps.h"
 #include "kNet/VLEPacker.h"
 #include "kNet/DataDeserializer.h"
 #include "kNet/NetException.h"
 
+// See DataSerializer.cpp: the SIMD kernels are only used where they round exactly like the scalar code.
+#if defined(__x86_64__) || defined(_M_X64)
+#include <emmintrin.h>
+#define KNET_QUANTIZE_SSE2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KNET_QUANTIZE_NEON
+#endif
+
 using namespace std;
 
 namespace kNet
@@ -58,31 +69,27 @@ void DataDeserializer::ResetTraversal()
 		iter->ResetTraversal();
 }
 
-u32 DataDeserializer::ReadBitsToU32(int count)
+void DataDeserializer::ExtractUnalignedBytes(u8 *dst, size_t numBytes)
 {
-	if (BitsLeft() < (u32)count)
-		throw NetException("Not enough bits left in DataDeserializer::ReadBits!");
-
-	u32 var = 0;
-	int bitsFilled = 0;
-	while(count > 0)
+	for(; numBytes >= 4; numBytes -= 4, dst += 4)
 	{
-		int bitsToRead = std::min(std::min(8, count), 8 - bitOfs);
-		u32 readMask = ((1 << bitsToRead) - 1) << bitOfs;
-		assert(elemOfs < size); // We already counted above we should have enough bits to read.
-
-		var |= (((u32)data[elemOfs] & readMask) >> bitOfs) << bitsFilled;
-		bitsFilled += bitsToRead;
-		bitOfs += bitsToRead;
-		assert(bitOfs <= 8);
-
-		// If bitOfs has accumulated a full byte, move elemOfs ahead by one.
-		elemOfs += (bitOfs >> 3);
-		bitOfs &= 7;
-
-		count -= bitsToRead;
+		const u32 value = ExtractBits(32);
+		dst[0] = (u8)value;
+		dst[1] = (u8)(value >> 8);
+		dst[2] = (u8)(value >> 16);
+		dst[3] = (u8)(value >> 24);
 	}
-	return var;
+	for(; numBytes > 0; --numBytes)
+		*dst++ = (u8)ExtractBits(8);
+}
+
+void DataDeserializer::ExtractBitsArray(u32 *dst, size_t count, int numBits)
+{
+	assert(numBits >= 1 && numBits <= 32);
+	if ((u64)count * numBits > BitsLeft())
+		throw NetException("Not enough bits left in DataDeserializer::ExtractBitsArray!");
+	for(size_t i = 0; i < count; ++i)
+		dst[i] = ExtractBits(numBits);
 }
 
 /// Need to have a message template to use this function.
@@ -241,6 +248,169 @@ void DataDeserializer::ReadVector3D(int numBitsYaw, int numBitsPitch, int magnit
 	}
 }
 
+/// Computes the values that ReadQuantizedFloat() returns for the given bit patterns, which must be smaller than 2^31.
+static void DequantizeFloats(float minRange, float maxRange, int numBits, const u32 *values, size_t count, float *dst)
+{
+	const float range = maxRange - minRange;
+	const float scale = (float)((1 << numBits) - 1);
+	size_t i = 0;
+#if defined(KNET_QUANTIZE_SSE2)
+	const __m128 minV = _mm_set1_ps(minRange);
+	const __m128 rangeV = _mm_set1_ps(range);
+	const __m128 scaleV = _mm_set1_ps(scale);
+	for(; i + 4 <= count; i += 4)
+	{
+		const __m128 v = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i)));
+		_mm_storeu_ps(dst + i, _mm_add_ps(minV, _mm_div_ps(_mm_mul_ps(v, rangeV), scaleV)));
+	}
+#elif defined(KNET_QUANTIZE_NEON)
+	const float32x4_t minV = vdupq_n_f32(minRange);
+	const float32x4_t rangeV = vdupq_n_f32(range);
+	const float32x4_t scaleV = vdupq_n_f32(scale);
+	for(; i + 4 <= count; i += 4)
+	{
+		const float32x4_t v = vcvtq_f32_u32(vld1q_u32(values + i));
+		vst1q_f32(dst + i, vaddq_f32(minV, vdivq_f32(vmulq_f32(v, rangeV), scaleV)));
+	}
+#endif
+	for(; i < count; ++i)
+		dst[i] = minRange + values[i] * range / scale;
+}
+
+/// Computes the values that ReadUnsignedFixedPoint() returns for the given bit patterns, which must be smaller than 2^31,
+/// minus the given offset.
+static void DequantizeFixedPoint(int numDecimalBits, float offset, const u32 *values, size_t count, float *dst)
+{
+	const float scale = (float)(1 << numDecimalBits);
+	size_t i = 0;
+#if defined(KNET_QUANTIZE_SSE2)
+	const __m128 scaleV = _mm_set1_ps(scale);
+	const __m128 offsetV = _mm_set1_ps(offset);
+	for(; i + 4 <= count; i += 4)
+	{
+		const __m128 v = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i)));
+		_mm_storeu_ps(dst + i, _mm_sub_ps(_mm_div_ps(v, scaleV), offsetV));
+	}
+#elif defined(KNET_QUANTIZE_NEON)
+	const float32x4_t scaleV = vdupq_n_f32(scale);
+	const float32x4_t offsetV = vdupq_n_f32(offset);
+	for(; i + 4 <= count; i += 4)
+	{
+		const float32x4_t v = vcvtq_f32_u32(vld1q_u32(values + i));
+		vst1q_f32(dst + i, vsubq_f32(vdivq_f32(v, scaleV), offsetV));
+	}
+#endif
+	for(; i < count; ++i)
+		dst[i] = values[i] / scale - offset;
+}
+
+/// The number of values the array variants unpack into a buffer on the stack before dequantizing them.
+static const size_t cDequantizeBatchSize = 256;
+
+void DataDeserializer::ReadQuantizedFloatArray(float minRange, float maxRange, int numBits, float *dst, size_t count)
+{
+	if (iter || numBits > 30)
+	{
+		for(size_t i = 0; i < count; ++i)
+			dst[i] = ReadQuantizedFloat(minRange, maxRange, numBits);
+		return;
+	}
+	if ((u64)count * numBits > BitsLeft())
+		throw NetException("Not enough bits left in DataDeserializer::ReadQuantizedFloatArray!");
+
+	u32 bitPatterns[cDequantizeBatchSize];
+	for(size_t i = 0; i < count; i += cDequantizeBatchSize)
+	{
+		const size_t batchSize = std::min(cDequantizeBatchSize, count - i);
+		ExtractBitsArray(bitPatterns, batchSize, numBits);
+		DequantizeFloats(minRange, maxRange, numBits, bitPatterns, batchSize, dst + i);
+	}
+}
+
+void DataDeserializer::ReadUnsignedFixedPointArray(int numIntegerBits, int numDecimalBits, float *dst, size_t count)
+{
+	const int numBits = numIntegerBits + numDecimalBits;
+	if (iter || numBits > 31)
+	{
+		for(size_t i = 0; i < count; ++i)
+			dst[i] = ReadUnsignedFixedPoint(numIntegerBits, numDecimalBits);
+		return;
+	}
+	if ((u64)count * numBits > BitsLeft())
+		throw NetException("Not enough bits left in DataDeserializer::ReadUnsignedFixedPointArray!");
+
+	u32 bitPatterns[cDequantizeBatchSize];
+	for(size_t i = 0; i < count; i += cDequantizeBatchSize)
+	{
+		const size_t batchSize = std::min(cDequantizeBatchSize, count - i);
+		ExtractBitsArray(bitPatterns, batchSize, numBits);
+		DequantizeFixedPoint(numDecimalBits, 0.f, bitPatterns, batchSize, dst + i);
+	}
+}
+
+void DataDeserializer::ReadSignedFixedPointArray(int numIntegerBits, int numDecimalBits, float *dst, size_t count)
+{
+	const int numBits = numIntegerBits + numDecimalBits;
+	if (iter || numBits > 31)
+	{
+		for(size_t i = 0; i < count; ++i)
+			dst[i] = ReadSignedFixedPoint(numIntegerBits, numDecimalBits);
+		return;
+	}
+	if ((u64)count * numBits > BitsLeft())
+		throw NetException("Not enough bits left in DataDeserializer::ReadSignedFixedPointArray!");
+
+	u32 bitPatterns[cDequantizeBatchSize];
+	for(size_t i = 0; i < count; i += cDequantizeBatchSize)
+	{
+		const size_t batchSize = std::min(cDequantizeBatchSize, count - i);
+		ExtractBitsArray(bitPatterns, batchSize, numBits);
+		DequantizeFixedPoint(numDecimalBits, (float)(1 << (numIntegerBits-1)), bitPatterns, batchSize, dst + i);
+	}
+}
+
+void DataDeserializer::ReadNormalizedVector3DArray(int numBitsYaw, int numBitsPitch, float *xyz, size_t count)
+{
+	const int numBits = numBitsYaw + numBitsPitch;
+	if (iter || numBitsYaw > 30 || numBitsPitch > 30 || numBits > 32)
+	{
+		for(size_t i = 0; i < count; ++i, xyz += 3)
+			ReadNormalizedVector3D(numBitsYaw, numBitsPitch, xyz[0], xyz[1], xyz[2]);
+		return;
+	}
+	if ((u64)count * numBits > BitsLeft())
+		throw NetException("Not enough bits left in DataDeserializer::ReadNormalizedVector3DArray!");
+
+	u32 yaws[cDequantizeBatchSize];
+	u32 pitches[cDequantizeBatchSize];
+	float azimuths[cDequantizeBatchSize];
+	float inclinations[cDequantizeBatchSize];
+	for(size_t i = 0; i < count; i += cDequantizeBatchSize)
+	{
+		const size_t batchSize = std::min(cDequantizeBatchSize, count - i);
+		// The yaw and pitch of each vector were written one after the other, so they can be read as a single field.
+		ExtractBitsArray(yaws, batchSize, numBits);
+		for(size_t j = 0; j < batchSize; ++j)
+		{
+			pitches[j] = yaws[j] >> numBitsYaw;
+			yaws[j] &= LSB(numBitsYaw);
+		}
+		DequantizeFloats(-PI, PI, numBitsYaw, yaws, batchSize, azimuths);
+		DequantizeFloats(-PI/2, PI/2, numBitsPitch, pitches, batchSize, inclinations);
+		for(size_t j = 0; j < batchSize; ++j)
+		{
+			float azimuth = azimuths[j];
+			float inclination = inclinations[j];
+			float *v = xyz + (i + j) * 3;
+
+			float cx = cos(inclination);
+			v[0] = cx * sin(azimuth);
+			v[1] = -sin(inclination);
+			v[2] = cx * cos(azimuth);
+		}
+	}
+}
+
 void DataDeserializer::ReadArithmeticEncoded(int numBits, int &val1, int max1, int &val2, int max2)
 {
 	assert(max1 * max2 < (1 << numBits));
@@ -15,6 +15,7 @@
 /** @file DataSerializer.cpp
 	@brief */
 
+#include <algorithm>
 #include <cstring>
 #include <sstream>
 #include <cmath>
@@ -24,6 +25,16 @@
 #include "kNet/DataSerializer.h"
 #include "kNet/BitOps.h"
 
+// The SIMD quantization kernels must round exactly like the scalar code, so they are only used where the scalar
+// float math is done in the same SIMD registers, i.e. not on 32-bit x86, which may use the x87 FPU.
+#if defined(__x86_64__) || defined(_M_X64)
+#include <emmintrin.h>
+#define KNET_QUANTIZE_SSE2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KNET_QUANTIZE_NEON
+#endif
+
 namespace kNet
 {
 
@@ -97,47 +108,73 @@ DataSerializer::DataSerializer(std::vector<char> &data_, size_t maxBytes_, const
 	ResetFill();
 }
 
-void DataSerializer::AppendByte(u8 byte)
+void DataSerializer::AppendUnalignedBytes(const u8 *src, size_t numBytes)
 {
-	if (bitOfs == 0)
-		AppendAlignedByte(byte);
-	else
-		AppendUnalignedByte(byte);
-}
+	if (BitsFilled() + numBytes * 8 > maxBytes * 8)
+		throw NetException("DataSerializer::AppendBytes: Attempted to write past the array end buffer!");
 
-void DataSerializer::AppendUnalignedByte(u8 byte)
-{
-	// The current partial byte can hold (8-bitOfs) bits.
-	data[elemOfs] = (data[elemOfs] & LSB(bitOfs)) | ((byte & LSB(8-bitOfs)) << bitOfs);
-	// The next byte can hold full 8 bits, but we only need to add bitOfs bits.
-	data[++elemOfs] = byte >> (8-bitOfs);
+	for(; numBytes >= 4; numBytes -= 4, src += 4)
+		AppendBits((u32)src[0] | ((u32)src[1] << 8) | ((u32)src[2] << 16) | ((u32)src[3] << 24), 32);
+	for(; numBytes > 0; --numBytes, ++src)
+		AppendBits(*src, 8);
 }
 
-void DataSerializer::AppendAlignedByte(u8 byte)
+void DataSerializer::AppendBits(u32 value, int amount)
 {
-	assert(bitOfs == 0);
+	assert(amount >= 0 && amount <= 32);
+
+	// The bits go right after the bitOfs bits already in the partial byte, and end in the last of these bytes.
+	const size_t numBytes = (bitOfs + amount + 7) >> 3;
+	if (elemOfs + numBytes > maxBytes)
+		throw NetException("DataSerializer::AppendBits: Attempted to write past the array end buffer!");
+
+	u64 word = (u64)(value & LSB(amount)) << bitOfs;
+	if (bitOfs != 0)
+		word |= (u8)data[elemOfs] & LSB(bitOfs);
 
-	assert(elemOfs < maxBytes);
-	data[elemOfs++] = byte;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for(size_t i = 0; i < numBytes; ++i)
+		data[elemOfs + i] = (char)(word >> (i * 8));
+#else
+	memcpy(data + elemOfs, &word, numBytes);
+#endif
+
+	elemOfs += (bitOfs + amount) >> 3;
+	bitOfs = (bitOfs + amount) & 7;
 }
 
-void DataSerializer::AppendBits(u32 value, int amount)
+void DataSerializer::AppendBitsArray(const u32 *values, size_t count, int numBits)
 {
-	const u8 *bytes = reinterpret_cast<const u8*>(&value);
-	while(amount >= 8)
+	assert(numBits >= 1 && numBits <= 32);
+	if (BitsFilled() + (u64)count * numBits > (u64)maxBytes * 8)
+		throw NetException("DataSerializer::AppendBitsArray: Attempted to write past the array end buffer!");
+
+	// Collect the bits into a word, starting with the bits already in the partial byte, and store them 32 at a time.
+	const u32 mask = LSB(numBits);
+	u64 word = (bitOfs != 0) ? ((u8)data[elemOfs] & LSB(bitOfs)) : 0;
+	int wordBits = bitOfs;
+	for(size_t i = 0; i < count; ++i)
 	{
-		AppendByte(*bytes);
-		++bytes;
-		amount -= 8;
+		word |= (u64)(values[i] & mask) << wordBits;
+		wordBits += numBits;
+		if (wordBits >= 32)
+		{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			for(int j = 0; j < 4; ++j)
+				data[elemOfs + j] = (char)(word >> (j * 8));
+#else
+			const u32 low = (u32)word;
+			memcpy(data + elemOfs, &low, 4);
+#endif
+			elemOfs += 4;
+			word >>= 32;
+			wordBits -= 32;
+		}
 	}
-
-	u8 remainder = *bytes & LSB(amount);
-
-	data[elemOfs] = (data[elemOfs] & LSB(bitOfs)) | ((remainder & LSB(8-bitOfs)) << bitOfs);
-	if (bitOfs + amount >= 8)
-		data[++elemOfs] = remainder >> (8-bitOfs);
-
-	bitOfs = (bitOfs + amount) & 7;
+	for(int i = 0; i < (wordBits + 7) >> 3; ++i)
+		data[elemOfs + i] = (char)(word >> (i * 8));
+	elemOfs += wordBits >> 3;
+	bitOfs = wordBits & 7;
 }
 
 void DataSerializer::ResetFill()
@@ -187,6 +224,136 @@ u32 DataSerializer::AddQuantizedFloat(float minRange, float maxRange, int numBit
 	return outVal;
 }
 
+/// Computes the bit patterns that AddQuantizedFloat() writes for the given values.
+static void QuantizeFloats(float minRange, float maxRange, int numBits, const float *values, size_t count, u32 *dst)
+{
+	assert(numBits >= 1 && numBits <= 30);
+	const float scale = (float)((1 << numBits)-1);
+	const float range = maxRange - minRange;
+	size_t i = 0;
+#if defined(KNET_QUANTIZE_SSE2)
+	const __m128 minV = _mm_set1_ps(minRange);
+	const __m128 maxV = _mm_set1_ps(maxRange);
+	const __m128 scaleV = _mm_set1_ps(scale);
+	const __m128 rangeV = _mm_set1_ps(range);
+	for(; i + 4 <= count; i += 4)
+	{
+		__m128 v = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(values + i), maxV), minV);
+		v = _mm_div_ps(_mm_mul_ps(_mm_sub_ps(v, minV), scaleV), rangeV);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_cvttps_epi32(v));
+	}
+#elif defined(KNET_QUANTIZE_NEON)
+	const float32x4_t minV = vdupq_n_f32(minRange);
+	const float32x4_t maxV = vdupq_n_f32(maxRange);
+	const float32x4_t scaleV = vdupq_n_f32(scale);
+	const float32x4_t rangeV = vdupq_n_f32(range);
+	for(; i + 4 <= count; i += 4)
+	{
+		float32x4_t v = vmaxq_f32(vminq_f32(vld1q_f32(values + i), maxV), minV);
+		v = vdivq_f32(vmulq_f32(vsubq_f32(v, minV), scaleV), rangeV);
+		vst1q_u32(dst + i, vcvtq_u32_f32(v));
+	}
+#endif
+	for(; i < count; ++i)
+		dst[i] = (u32)((ClampF(values[i], minRange, maxRange) - minRange) * scale / range);
+}
+
+/// Computes the bit patterns that AddUnsignedFixedPoint() writes for the given values, after adding the given offset to them.
+static void QuantizeFixedPoint(int numIntegerBits, int numDecimalBits, float offset, const float *values, size_t count, u32 *dst)
+{
+	const float maxVal = (float)(1 << numIntegerBits);
+	const u32 maxBitPattern = (1 << (numIntegerBits + numDecimalBits)) - 1;
+	const float scale = (float)(1 << numDecimalBits);
+	size_t i = 0;
+#if defined(KNET_QUANTIZE_SSE2)
+	const __m128 offsetV = _mm_set1_ps(offset);
+	const __m128 maxValV = _mm_set1_ps(maxVal);
+	const __m128 scaleV = _mm_set1_ps(scale);
+	const __m128i maxBitPatternV = _mm_set1_epi32((int)maxBitPattern);
+	for(; i + 4 <= count; i += 4)
+	{
+		const __m128 v = _mm_add_ps(_mm_loadu_ps(values + i), offsetV);
+		const __m128i overMax = _mm_castps_si128(_mm_cmpge_ps(v, maxValV));
+		const __m128i underZero = _mm_castps_si128(_mm_cmple_ps(v, _mm_setzero_ps()));
+		__m128i r = _mm_cvttps_epi32(_mm_mul_ps(v, scaleV));
+		r = _mm_or_si128(_mm_andnot_si128(overMax, r), _mm_and_si128(overMax, maxBitPatternV));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_andnot_si128(underZero, r));
+	}
+#elif defined(KNET_QUANTIZE_NEON)
+	const float32x4_t offsetV = vdupq_n_f32(offset);
+	const float32x4_t maxValV = vdupq_n_f32(maxVal);
+	const float32x4_t scaleV = vdupq_n_f32(scale);
+	const uint32x4_t maxBitPatternV = vdupq_n_u32(maxBitPattern);
+	for(; i + 4 <= count; i += 4)
+	{
+		const float32x4_t v = vaddq_f32(vld1q_f32(values + i), offsetV);
+		uint32x4_t r = vcvtq_u32_f32(vmulq_f32(v, scaleV));
+		r = vbslq_u32(vcgeq_f32(v, maxValV), maxBitPatternV, r);
+		vst1q_u32(dst + i, vbslq_u32(vcleq_f32(v, vdupq_n_f32(0.f)), vdupq_n_u32(0), r));
+	}
+#endif
+	for(; i < count; ++i)
+	{
+		const float value = values[i] + offset;
+		dst[i] = value <= 0 ? 0 : (value >= maxVal ? maxBitPattern : (u32)(value * scale));
+	}
+}
+
+/// The number of values the array variants quantize into a buffer on the stack before packing them.
+static const size_t cQuantizeBatchSize = 256;
+
+void DataSerializer::AddQuantizedFloatArray(float minRange, float maxRange, int numBits, const float *values, size_t count)
+{
+	u32 bitPatterns[cQuantizeBatchSize];
+	for(size_t i = 0; i < count; i += cQuantizeBatchSize)
+	{
+		const size_t batchSize = std::min(cQuantizeBatchSize, count - i);
+		QuantizeFloats(minRange, maxRange, numBits, values + i, batchSize, bitPatterns);
+		AppendBitsArray(bitPatterns, batchSize, numBits);
+	}
+}
+
+void DataSerializer::AddUnsignedFixedPointArray(int numIntegerBits, int numDecimalBits, const float *values, size_t count)
+{
+	assert(numIntegerBits >= 0);
+	assert(numDecimalBits > 0);
+	assert(numIntegerBits + numDecimalBits <= 32);
+	// With more bits, value * 2^numDecimalBits could round up to a bit pattern that doesn't fit in the SIMD registers' signed ints.
+	if (numIntegerBits + numDecimalBits > 30)
+	{
+		for(size_t i = 0; i < count; ++i)
+			AddUnsignedFixedPoint(numIntegerBits, numDecimalBits, values[i]);
+		return;
+	}
+	u32 bitPatterns[cQuantizeBatchSize];
+	for(size_t i = 0; i < count; i += cQuantizeBatchSize)
+	{
+		const size_t batchSize = std::min(cQuantizeBatchSize, count - i);
+		QuantizeFixedPoint(numIntegerBits, numDecimalBits, 0.f, values + i, batchSize, bitPatterns);
+		AppendBitsArray(bitPatterns, batchSize, numIntegerBits + numDecimalBits);
+	}
+}
+
+void DataSerializer::AddSignedFixedPointArray(int numIntegerBits, int numDecimalBits, const float *values, size_t count)
+{
+	assert(numIntegerBits > 0);
+	assert(numDecimalBits > 0);
+	assert(numIntegerBits + numDecimalBits <= 32);
+	if (numIntegerBits + numDecimalBits > 30)
+	{
+		for(size_t i = 0; i < count; ++i)
+			AddSignedFixedPoint(numIntegerBits, numDecimalBits, values[i]);
+		return;
+	}
+	u32 bitPatterns[cQuantizeBatchSize];
+	for(size_t i = 0; i < count; i += cQuantizeBatchSize)
+	{
+		const size_t batchSize = std::min(cQuantizeBatchSize, count - i);
+		QuantizeFixedPoint(numIntegerBits, numDecimalBits, (float)(1 << (numIntegerBits-1)), values + i, batchSize, bitPatterns);
+		AppendBitsArray(bitPatterns, batchSize, numIntegerBits + numDecimalBits);
+	}
+}
+
 void DataSerializer::AddMiniFloat(bool signBit, int exponentBits, int mantissaBits, int exponentBias, float value)
 {
 	// Float structure:
@@ -307,6 +474,39 @@ void DataSerializer::AddNormalizedVector3D(float x, float y, float z, int numBit
 	AddQuantizedFloat(-PI/2, PI/2, numBitsPitch, inclination);
 }
 
+void DataSerializer::AddNormalizedVector3DArray(const float *xyz, size_t count, int numBitsYaw, int numBitsPitch)
+{
+	// The yaw and pitch of each vector are packed as a single field, which must fit in a u32.
+	if (numBitsYaw + numBitsPitch > 32)
+	{
+		for(size_t i = 0; i < count; ++i, xyz += 3)
+			AddNormalizedVector3D(xyz[0], xyz[1], xyz[2], numBitsYaw, numBitsPitch);
+		return;
+	}
+
+	float azimuths[cQuantizeBatchSize];
+	float inclinations[cQuantizeBatchSize];
+	u32 yaws[cQuantizeBatchSize];
+	u32 pitches[cQuantizeBatchSize];
+	for(size_t i = 0; i < count; i += cQuantizeBatchSize)
+	{
+		const size_t batchSize = std::min(cQuantizeBatchSize, count - i);
+		for(size_t j = 0; j < batchSize; ++j)
+		{
+			const float *v = xyz + (i + j) * 3;
+			float azimuth = atan2(v[0], v[2]);
+			float inclination = asin(-v[1]);
+			azimuths[j] = azimuth;
+			inclinations[j] = inclination;
+		}
+		QuantizeFloats(-PI, PI, numBitsYaw, azimuths, batchSize, yaws);
+		QuantizeFloats(-PI/2, PI/2, numBitsPitch, inclinations, batchSize, pitches);
+		for(size_t j = 0; j < batchSize; ++j)
+			yaws[j] |= pitches[j] << numBitsYaw;
+		AppendBitsArray(yaws, batchSize, numBitsYaw + numBitsPitch);
+	}
+}
+
 int DataSerializer::AddVector3D(float x, float y, float z, int numBitsYaw, int numBitsPitch, int magnitudeIntegerBits, int magnitudeDecimalBits)
 {
 	float length = sqrt(x*x + y*y + z*z);
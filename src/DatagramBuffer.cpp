@@ -0,0 +1,326 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file DatagramBuffer.cpp
+	@brief */
+
+#include <vector>
+#include <cassert>
+
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "kNet/DatagramBuffer.h"
+#include "kNet/IMessageHandler.h"
+#include "kNet/Atomics.h"
+#include "kNet/Lockable.h"
+#include "kNet/NetworkLogging.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+namespace
+{
+/// The buffers are pooled in two size classes: buffers for a single datagram, and buffers for reads coalesced from many.
+const size_t cSmallBufferSize = 2048;
+const size_t cLargeBufferSize = 65536;
+/// The number of released buffers the pool keeps around in each size class. The rest are freed.
+const size_t cMaxFreeSmallBuffers = 512;
+const size_t cMaxFreeLargeBuffers = 32;
+
+Lockable<std::vector<DatagramBuffer*> > freeSmallBuffers;
+Lockable<std::vector<DatagramBuffer*> > freeLargeBuffers;
+}
+
+DatagramBuffer::DatagramBuffer(size_t capacity_)
+:data(new char[capacity_]), capacity(capacity_), refCount(1),
+mappedFile(false), writable(false), releaseHandler(0), fileSize(0),
+#ifdef WIN32
+fileHandle(INVALID_HANDLE_VALUE), mappingHandle(0)
+#else
+fileDescriptor(-1)
+#endif
+{
+}
+
+DatagramBuffer::DatagramBuffer()
+:data(0), capacity(0), refCount(1),
+mappedFile(true), writable(false), releaseHandler(0), fileSize(0),
+#ifdef WIN32
+fileHandle(INVALID_HANDLE_VALUE), mappingHandle(0)
+#else
+fileDescriptor(-1)
+#endif
+{
+}
+
+DatagramBuffer::~DatagramBuffer()
+{
+	if (releaseHandler)
+		releaseHandler->ReleaseBuffer(data, capacity);
+	else if (mappedFile)
+		UnmapFile();
+	else
+		delete[] data;
+}
+
+DatagramBuffer *DatagramBuffer::MapFileForReading(const char *filename)
+{
+	DatagramBuffer *buffer = new DatagramBuffer();
+	if (!buffer->MapFile(filename, false, 0))
+	{
+		delete buffer;
+		return 0;
+	}
+	return buffer;
+}
+
+DatagramBuffer *DatagramBuffer::MapFileForWriting(const char *filename, size_t size)
+{
+	DatagramBuffer *buffer = new DatagramBuffer();
+	if (!buffer->MapFile(filename, true, size))
+	{
+		delete buffer;
+		return 0;
+	}
+	return buffer;
+}
+
+DatagramBuffer *DatagramBuffer::WrapExternal(const char *data, size_t numBytes, IBufferReleaseHandler *releaseHandler)
+{
+	assert(releaseHandler);
+	DatagramBuffer *buffer = new DatagramBuffer();
+	buffer->mappedFile = false;
+	buffer->data = const_cast<char*>(data);
+	buffer->capacity = numBytes;
+	buffer->releaseHandler = releaseHandler;
+	return buffer;
+}
+
+void DatagramBuffer::SetFileSize(size_t size)
+{
+	assert(mappedFile && writable);
+	assert(size <= capacity);
+	fileSize = size;
+}
+
+bool DatagramBuffer::MapFile(const char *filename, bool writable_, size_t mapSize)
+{
+	assert(mappedFile && !data);
+	writable = writable_;
+#ifdef WIN32
+	fileHandle = CreateFileA(filename, writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, writable ? 0 : FILE_SHARE_READ,
+		NULL, writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+	{
+		KNET_LOG(LogError, "DatagramBuffer::MapFile: Failed to open file \"%s\"! Error %d.", filename, (int)GetLastError());
+		return false;
+	}
+	if (!writable)
+	{
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(fileHandle, &size))
+		{
+			KNET_LOG(LogError, "DatagramBuffer::MapFile: Failed to query the size of file \"%s\"! Error %d.", filename, (int)GetLastError());
+			return false;
+		}
+		mapSize = (size_t)size.QuadPart;
+	}
+	capacity = mapSize;
+	fileSize = mapSize;
+	if (mapSize == 0)
+		return true; // An empty file cannot be mapped, and there is nothing to map.
+
+	const unsigned long long size64 = mapSize;
+	mappingHandle = CreateFileMappingA(fileHandle, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)(size64 >> 32), (DWORD)size64, NULL);
+	if (mappingHandle)
+		data = (char*)MapViewOfFile(mappingHandle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, mapSize);
+	if (!data)
+	{
+		KNET_LOG(LogError, "DatagramBuffer::MapFile: Failed to map %d bytes of file \"%s\"! Error %d.", (int)mapSize, filename, (int)GetLastError());
+		return false;
+	}
+#else
+	fileDescriptor = writable ? open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(filename, O_RDONLY);
+	if (fileDescriptor == -1)
+	{
+		KNET_LOG(LogError, "DatagramBuffer::MapFile: Failed to open file \"%s\"!", filename);
+		return false;
+	}
+	if (writable)
+	{
+		if (ftruncate(fileDescriptor, (off_t)mapSize) != 0)
+		{
+			KNET_LOG(LogError, "DatagramBuffer::MapFile: Failed to resize file \"%s\" to %d bytes!", filename, (int)mapSize);
+			return false;
+		}
+	}
+	else
+	{
+		struct stat fileStat;
+		if (fstat(fileDescriptor, &fileStat) != 0)
+		{
+			KNET_LOG(LogError, "DatagramBuffer::MapFile: Failed to query the size of file \"%s\"!", filename);
+			return false;
+		}
+		mapSize = (size_t)fileStat.st_size;
+	}
+	capacity = mapSize;
+	fileSize = mapSize;
+	if (mapSize == 0)
+		return true; // An empty file cannot be mapped, and there is nothing to map.
+
+	void *mapping = mmap(0, mapSize, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fileDescriptor, 0);
+	if (mapping == MAP_FAILED)
+	{
+		KNET_LOG(LogError, "DatagramBuffer::MapFile: Failed to map %d bytes of file \"%s\"!", (int)mapSize, filename);
+		return false;
+	}
+	data = (char*)mapping;
+	// The file is streamed through from the start to the end, so ask the kernel to read ahead aggressively.
+	madvise(data, mapSize, MADV_SEQUENTIAL);
+#endif
+	return true;
+}
+
+void DatagramBuffer::UnmapFile()
+{
+#ifdef WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mappingHandle)
+		CloseHandle(mappingHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE)
+	{
+		if (writable && fileSize != capacity)
+		{
+			LARGE_INTEGER size;
+			size.QuadPart = (LONGLONG)fileSize;
+			if (!SetFilePointerEx(fileHandle, size, NULL, FILE_BEGIN) || !SetEndOfFile(fileHandle))
+				KNET_LOG(LogError, "DatagramBuffer::UnmapFile: Failed to truncate the file to %d bytes! Error %d.", (int)fileSize, (int)GetLastError());
+		}
+		CloseHandle(fileHandle);
+	}
+	fileHandle = INVALID_HANDLE_VALUE;
+	mappingHandle = 0;
+#else
+	if (data)
+		munmap(data, capacity);
+	if (fileDescriptor != -1)
+	{
+		if (writable && fileSize != capacity && ftruncate(fileDescriptor, (off_t)fileSize) != 0)
+			KNET_LOG(LogError, "DatagramBuffer::UnmapFile: Failed to truncate the file to %d bytes!", (int)fileSize);
+		close(fileDescriptor);
+	}
+	fileDescriptor = -1;
+#endif
+	data = 0;
+	capacity = 0;
+}
+
+DatagramBuffer *DatagramBuffer::Allocate(size_t capacity)
+{
+	Lockable<std::vector<DatagramBuffer*> > *freeList = 0;
+	if (capacity <= cSmallBufferSize)
+	{
+		freeList = &freeSmallBuffers;
+		capacity = cSmallBufferSize;
+	}
+	else if (capacity <= cLargeBufferSize)
+	{
+		freeList = &freeLargeBuffers;
+		capacity = cLargeBufferSize;
+	}
+
+	if (freeList)
+	{
+		Lockable<std::vector<DatagramBuffer*> >::LockType lock = freeList->Acquire();
+		if (!lock->empty())
+		{
+			DatagramBuffer *buffer = lock->back();
+			lock->pop_back();
+			buffer->refCount = 1;
+			return buffer;
+		}
+	}
+	return new DatagramBuffer(capacity);
+}
+
+void DatagramBuffer::ClearPool()
+{
+	Lockable<std::vector<DatagramBuffer*> > *freeLists[] = { &freeSmallBuffers, &freeLargeBuffers };
+	for(int i = 0; i < 2; ++i)
+	{
+		Lockable<std::vector<DatagramBuffer*> >::LockType lock = freeLists[i]->Acquire();
+		for(size_t j = 0; j < lock->size(); ++j)
+			delete (*lock)[j];
+		lock->clear();
+	}
+}
+
+void DatagramBuffer::AddRef()
+{
+	assert(refCount > 0);
+	AtomicIncrement(&refCount);
+}
+
+void DatagramBuffer::Release()
+{
+	assert(refCount > 0);
+	if (AtomicDecrement(&refCount) > 0)
+		return;
+
+	// File mappings and external bytes are not pooled.
+	if (mappedFile || releaseHandler)
+	{
+		delete this;
+		return;
+	}
+
+	Lockable<std::vector<DatagramBuffer*> > *freeList = 0;
+	size_t maxFreeBuffers = 0;
+	if (capacity == cSmallBufferSize)
+	{
+		freeList = &freeSmallBuffers;
+		maxFreeBuffers = cMaxFreeSmallBuffers;
+	}
+	else if (capacity == cLargeBufferSize)
+	{
+		freeList = &freeLargeBuffers;
+		maxFreeBuffers = cMaxFreeLargeBuffers;
+	}
+
+	if (freeList)
+	{
+		Lockable<std::vector<DatagramBuffer*> >::LockType lock = freeList->Acquire();
+		if (lock->size() < maxFreeBuffers)
+		{
+			lock->push_back(this);
+			return;
+		}
+	}
+	delete this;
+}
+
+} // ~kNet
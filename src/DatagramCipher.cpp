@@ -0,0 +1,354 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file DatagramCipher.cpp
+	@brief */
+
+#ifdef WIN32
+#define _CRT_RAND_S // For rand_s().
+#endif
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "kNet/DatagramCipher.h"
+#include "kNet/Clock.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+namespace
+{
+/// The constant words "expand 32-byte k" of the ChaCha20 state.
+const u32 cSigma[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+
+/// The direction word of the nonce of ComputeTag(). The datagrams use the directions 0 and 1.
+const u32 cTagDirection = 0xFFFFFFFF;
+/// The direction word of the nonce of ComputeConnectionTag().
+const u32 cConnectionTagDirection = 0xFFFFFFFE;
+
+u32 Load32(const u8 *p)
+{
+	return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+}
+
+void Store32(u8 *p, u32 value)
+{
+	p[0] = (u8)value;
+	p[1] = (u8)(value >> 8);
+	p[2] = (u8)(value >> 16);
+	p[3] = (u8)(value >> 24);
+}
+
+u64 Load64(const u8 *p)
+{
+	return (u64)Load32(p) | ((u64)Load32(p + 4) << 32);
+}
+
+void Store64(u8 *p, u64 value)
+{
+	Store32(p, (u32)value);
+	Store32(p + 4, (u32)(value >> 32));
+}
+
+u32 Rotl(u32 value, int numBits)
+{
+	return (value << numBits) | (value >> (32 - numBits));
+}
+
+void QuarterRound(u32 &a, u32 &b, u32 &c, u32 &d)
+{
+	a += b; d ^= a; d = Rotl(d, 16);
+	c += d; b ^= c; b = Rotl(b, 12);
+	a += b; d ^= a; d = Rotl(d, 8);
+	c += d; b ^= c; b = Rotl(b, 7);
+}
+
+/// Applies the 20 rounds of ChaCha20 to the given state.
+void ChaChaRounds(u32 *x)
+{
+	for(int i = 0; i < 10; ++i)
+	{
+		QuarterRound(x[0], x[4], x[8], x[12]);
+		QuarterRound(x[1], x[5], x[9], x[13]);
+		QuarterRound(x[2], x[6], x[10], x[14]);
+		QuarterRound(x[3], x[7], x[11], x[15]);
+		QuarterRound(x[0], x[5], x[10], x[15]);
+		QuarterRound(x[1], x[6], x[11], x[12]);
+		QuarterRound(x[2], x[7], x[8], x[13]);
+		QuarterRound(x[3], x[4], x[9], x[14]);
+	}
+}
+
+/// Computes the 64-byte ChaCha20 keystream block of the given key, block counter and 96-bit nonce.
+void ChaChaBlock(const u32 *key, u32 counter, const u32 *nonce, u8 *out)
+{
+	u32 state[16] = { cSigma[0], cSigma[1], cSigma[2], cSigma[3], key[0], key[1], key[2], key[3],
+		key[4], key[5], key[6], key[7], counter, nonce[0], nonce[1], nonce[2] };
+	u32 x[16];
+	memcpy(x, state, sizeof(x));
+	ChaChaRounds(x);
+	for(int i = 0; i < 16; ++i)
+		Store32(out + 4 * i, x[i] + state[i]);
+}
+
+/// XORs the given bytes with the ChaCha20 keystream that starts from the given block. dst may be src.
+void ChaChaXor(const u32 *key, const u32 *nonce, u32 counter, const char *src, char *dst, size_t numBytes)
+{
+	u8 block[64];
+	while(numBytes > 0)
+	{
+		ChaChaBlock(key, counter++, nonce, block);
+		const size_t n = std::min<size_t>(numBytes, 64);
+		for(size_t i = 0; i < n; ++i)
+			dst[i] = (char)(src[i] ^ block[i]);
+		src += n;
+		dst += n;
+		numBytes -= n;
+	}
+}
+
+/// Derives a new key from the given 32-byte key and 16-byte nonce.
+void HChaCha20(const u8 *key, const u8 *nonce, u32 *subkey)
+{
+	u32 x[16] = { cSigma[0], cSigma[1], cSigma[2], cSigma[3] };
+	for(int i = 0; i < 8; ++i)
+		x[4 + i] = Load32(key + 4 * i);
+	for(int i = 0; i < 4; ++i)
+		x[12 + i] = Load32(nonce + 4 * i);
+	ChaChaRounds(x);
+	for(int i = 0; i < 4; ++i)
+	{
+		subkey[i] = x[i];
+		subkey[4 + i] = x[12 + i];
+	}
+}
+
+/// The Poly1305 one-time authenticator, in 26-bit limbs.
+class Poly1305
+{
+public:
+	explicit Poly1305(const u8 *key)
+	{
+		r[0] = Load32(key) & 0x3ffffff;
+		r[1] = (Load32(key + 3) >> 2) & 0x3ffff03;
+		r[2] = (Load32(key + 6) >> 4) & 0x3ffc0ff;
+		r[3] = (Load32(key + 9) >> 6) & 0x3f03fff;
+		r[4] = (Load32(key + 12) >> 8) & 0x00fffff;
+		for(int i = 0; i < 5; ++i)
+			h[i] = 0;
+		for(int i = 0; i < 4; ++i)
+			pad[i] = Load32(key + 16 + 4 * i);
+	}
+
+	/// Authenticates the given bytes, padded with zeroes to a multiple of 16 bytes.
+	void AddPadded(const u8 *data, size_t numBytes)
+	{
+		for(; numBytes >= 16; data += 16, numBytes -= 16)
+			Block(data);
+		if (numBytes > 0)
+		{
+			u8 last[16] = {};
+			memcpy(last, data, numBytes);
+			Block(last);
+		}
+	}
+
+	/// Authenticates the lengths of the AEAD data, and writes out the tag.
+	void Finish(u64 lengthA, u64 lengthB, u8 *tag)
+	{
+		u8 lengths[16];
+		Store64(lengths, lengthA);
+		Store64(lengths + 8, lengthB);
+		Block(lengths);
+
+		// Fully carry h, and reduce it modulo 2^130 - 5.
+		u32 c = h[1] >> 26; h[1] &= 0x3ffffff;
+		h[2] += c; c = h[2] >> 26; h[2] &= 0x3ffffff;
+		h[3] += c; c = h[3] >> 26; h[3] &= 0x3ffffff;
+		h[4] += c; c = h[4] >> 26; h[4] &= 0x3ffffff;
+		h[0] += c * 5; c = h[0] >> 26; h[0] &= 0x3ffffff;
+		h[1] += c;
+
+		u32 g[5];
+		g[0] = h[0] + 5; c = g[0] >> 26; g[0] &= 0x3ffffff;
+		g[1] = h[1] + c; c = g[1] >> 26; g[1] &= 0x3ffffff;
+		g[2] = h[2] + c; c = g[2] >> 26; g[2] &= 0x3ffffff;
+		g[3] = h[3] + c; c = g[3] >> 26; g[3] &= 0x3ffffff;
+		g[4] = h[4] + c - (1 << 26);
+
+		// Take h - p if it did not underflow, without branching on the secret value.
+		const u32 mask = (g[4] >> 31) - 1;
+		for(int i = 0; i < 5; ++i)
+			h[i] = (h[i] & ~mask) | (g[i] & mask);
+
+		const u32 h0 = h[0] | (h[1] << 26);
+		const u32 h1 = (h[1] >> 6) | (h[2] << 20);
+		const u32 h2 = (h[2] >> 12) | (h[3] << 14);
+		const u32 h3 = (h[3] >> 18) | (h[4] << 8);
+
+		u64 f = (u64)h0 + pad[0]; Store32(tag, (u32)f);
+		f = (u64)h1 + pad[1] + (f >> 32); Store32(tag + 4, (u32)f);
+		f = (u64)h2 + pad[2] + (f >> 32); Store32(tag + 8, (u32)f);
+		f = (u64)h3 + pad[3] + (f >> 32); Store32(tag + 12, (u32)f);
+	}
+
+private:
+	u32 r[5];
+	u32 h[5];
+	u32 pad[4];
+
+	void Block(const u8 *m)
+	{
+		const u32 s1 = r[1] * 5, s2 = r[2] * 5, s3 = r[3] * 5, s4 = r[4] * 5;
+
+		h[0] += Load32(m) & 0x3ffffff;
+		h[1] += (Load32(m + 3) >> 2) & 0x3ffffff;
+		h[2] += (Load32(m + 6) >> 4) & 0x3ffffff;
+		h[3] += (Load32(m + 9) >> 6) & 0x3ffffff;
+		h[4] += (Load32(m + 12) >> 8) | (1 << 24);
+
+		u64 d0 = (u64)h[0] * r[0] + (u64)h[1] * s4 + (u64)h[2] * s3 + (u64)h[3] * s2 + (u64)h[4] * s1;
+		u64 d1 = (u64)h[0] * r[1] + (u64)h[1] * r[0] + (u64)h[2] * s4 + (u64)h[3] * s3 + (u64)h[4] * s2;
+		u64 d2 = (u64)h[0] * r[2] + (u64)h[1] * r[1] + (u64)h[2] * r[0] + (u64)h[3] * s4 + (u64)h[4] * s3;
+		u64 d3 = (u64)h[0] * r[3] + (u64)h[1] * r[2] + (u64)h[2] * r[1] + (u64)h[3] * r[0] + (u64)h[4] * s4;
+		u64 d4 = (u64)h[0] * r[4] + (u64)h[1] * r[3] + (u64)h[2] * r[2] + (u64)h[3] * r[1] + (u64)h[4] * r[0];
+
+		u32 c = (u32)(d0 >> 26); h[0] = (u32)d0 & 0x3ffffff;
+		d1 += c; c = (u32)(d1 >> 26); h[1] = (u32)d1 & 0x3ffffff;
+		d2 += c; c = (u32)(d2 >> 26); h[2] = (u32)d2 & 0x3ffffff;
+		d3 += c; c = (u32)(d3 >> 26); h[3] = (u32)d3 & 0x3ffffff;
+		d4 += c; c = (u32)(d4 >> 26); h[4] = (u32)d4 & 0x3ffffff;
+		h[0] += c * 5; c = h[0] >> 26; h[0] &= 0x3ffffff;
+		h[1] += c;
+	}
+};
+
+/// Computes the AEAD tag of the given ciphertext, with the one-time key of the given nonce.
+void ComputeAEADTag(const u32 *key, const u32 *nonce, const char *ciphertext, size_t numBytes, u8 *tag)
+{
+	u8 oneTimeKey[64];
+	ChaChaBlock(key, 0, nonce, oneTimeKey);
+	Poly1305 mac(oneTimeKey);
+	mac.AddPadded(reinterpret_cast<const u8*>(ciphertext), numBytes);
+	mac.Finish(0, numBytes, tag);
+}
+}
+
+DatagramCipher::DatagramCipher()
+:hasKey(false), sendDirection(0), receiveDirection(0), sendNonce(0)
+{
+	memset(key, 0, sizeof(key));
+}
+
+void DatagramCipher::SetKey(const u8 *sharedKey, const u8 *salt, bool isClient)
+{
+	HChaCha20(sharedKey, salt, key);
+	sendDirection = isClient ? 0 : 1;
+	receiveDirection = isClient ? 1 : 0;
+	// Starting from a random nonce keeps the nonces unique even if a captured connection attempt is replayed to the server,
+	// which then derives the same key again.
+	u8 nonce[8];
+	GenerateRandomBytes(nonce, sizeof(nonce));
+	sendNonce = Load64(nonce);
+	hasKey = true;
+}
+
+size_t DatagramCipher::Encrypt(char *data, size_t numBytes)
+{
+	const u64 nonce = sendNonce++;
+	const u32 nonceWords[3] = { sendDirection, (u32)nonce, (u32)(nonce >> 32) };
+	ChaChaXor(key, nonceWords, 1, data, data, numBytes);
+
+	u8 *trailer = reinterpret_cast<u8*>(data + numBytes);
+	Store64(trailer, nonce);
+	ComputeAEADTag(key, nonceWords, data, numBytes, trailer + 8);
+	return numBytes + cOverhead;
+}
+
+int DatagramCipher::Decrypt(const char *data, size_t numBytes, char *dst) const
+{
+	if (numBytes < cOverhead)
+		return -1;
+	const size_t ciphertextSize = numBytes - cOverhead;
+	const u8 *trailer = reinterpret_cast<const u8*>(data + ciphertextSize);
+	const u64 nonce = Load64(trailer);
+	const u32 nonceWords[3] = { receiveDirection, (u32)nonce, (u32)(nonce >> 32) };
+
+	u8 tag[cTagSize];
+	ComputeAEADTag(key, nonceWords, data, ciphertextSize, tag);
+	if (!TagsEqual(tag, trailer + 8))
+		return -1;
+
+	ChaChaXor(key, nonceWords, 1, data, dst, ciphertextSize);
+	return (int)ciphertextSize;
+}
+
+void DatagramCipher::ComputeTag(const u8 *sharedKey, const u8 *salt, const char *data, size_t numBytes, u8 *tag)
+{
+	u32 subkey[8];
+	HChaCha20(sharedKey, salt, subkey);
+	const u32 nonceWords[3] = { cTagDirection, 0, 0 };
+	ComputeAEADTag(subkey, nonceWords, data, numBytes, tag);
+}
+
+void DatagramCipher::ComputeTag(const char *data, size_t numBytes, u8 *tag) const
+{
+	const u32 nonceWords[3] = { cTagDirection, 0, 0 };
+	ComputeAEADTag(key, nonceWords, data, numBytes, tag);
+}
+
+void DatagramCipher::ComputeConnectionTag(u64 number, const char *data, size_t numBytes, u8 *tag) const
+{
+	const u32 nonceWords[3] = { cConnectionTagDirection, (u32)number, (u32)(number >> 32) };
+	ComputeAEADTag(key, nonceWords, data, numBytes, tag);
+}
+
+bool DatagramCipher::TagsEqual(const u8 *a, const u8 *b)
+{
+	u8 difference = 0; // Compare in constant time, so that the timing does not tell how much of a forged tag was right.
+	for(size_t i = 0; i < cTagSize; ++i)
+		difference |= (u8)(a[i] ^ b[i]);
+	return difference == 0;
+}
+
+void DatagramCipher::GenerateRandomBytes(u8 *dst, size_t numBytes)
+{
+#ifdef WIN32
+	for(size_t i = 0; i < numBytes; i += 4)
+	{
+		unsigned int value = 0;
+		rand_s(&value);
+		u8 bytes[4];
+		Store32(bytes, value);
+		memcpy(dst + i, bytes, std::min<size_t>(4, numBytes - i));
+	}
+#else
+	size_t numRead = 0;
+	FILE *handle = fopen("/dev/urandom", "rb");
+	if (handle)
+	{
+		numRead = fread(dst, 1, numBytes, handle);
+		fclose(handle);
+	}
+	// Without the system generator, fall back to the clock, which at least varies between the connections.
+	for(size_t i = numRead; i < numBytes; ++i)
+		dst[i] = (u8)(Clock::Tick() >> (8 * (i % 4)));
+#endif
+}
+
+} // ~kNet
@@ -0,0 +1,129 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file DeltaEncoding.cpp
+	@brief */
+
+#include <cstring>
+
+#include "kNet/DeltaEncoding.h"
+#include "kNet/DataSerializer.h"
+#include "kNet/DataDeserializer.h"
+#include "kNet/VLEPacker.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+namespace
+{
+/// A run of differing bytes ends only at this many equal bytes, since a shorter equal run costs more to encode than to copy.
+const size_t cMinEqualRun = 3;
+
+/// Returns the number of bytes, starting at pos and at most maxBytes, that equal the baseline.
+size_t CountEqualBytes(const char *baseline, size_t baselineSize, const char *data, size_t numBytes, size_t pos, size_t maxBytes)
+{
+	size_t count = 0;
+	while(count < maxBytes && pos + count < numBytes && pos + count < baselineSize && data[pos + count] == baseline[pos + count])
+		++count;
+	return count;
+}
+}
+
+void EncodeDelta(const char *baseline, size_t baselineSize, const char *data, size_t numBytes, std::vector<char> &dst)
+{
+	// Each run takes at most 8 bytes of counts and covers at least one byte, so this is an upper bound of the delta size.
+	const size_t oldSize = dst.size();
+	dst.resize(oldSize + 4 + numBytes * 9);
+	DataSerializer writer(&dst[oldSize], dst.size() - oldSize);
+	writer.AddVLE<VLE8_16_32>((u32)numBytes);
+
+	size_t pos = 0;
+	while(pos < numBytes)
+	{
+		const size_t numEqual = CountEqualBytes(baseline, baselineSize, data, numBytes, pos, numBytes);
+		size_t end = pos + numEqual;
+		while(end < numBytes)
+		{
+			const size_t numEqualAhead = CountEqualBytes(baseline, baselineSize, data, numBytes, end, cMinEqualRun);
+			if (numEqualAhead == cMinEqualRun || end + numEqualAhead == numBytes)
+				break;
+			end += numEqualAhead + 1; // The equal bytes before the next differing byte are cheaper to copy along.
+		}
+		const size_t numDiffering = end - pos - numEqual;
+		writer.AddVLE<VLE8_16_32>((u32)numEqual);
+		writer.AddVLE<VLE8_16_32>((u32)numDiffering);
+		if (numDiffering > 0)
+			writer.AddAlignedByteArray(data + pos + numEqual, (u32)numDiffering);
+		pos = end;
+	}
+	dst.resize(oldSize + writer.BytesFilled());
+}
+
+bool DecodeDelta(const char *baseline, size_t baselineSize, const char *delta, size_t deltaSize, std::vector<char> &dst)
+{
+	DataDeserializer reader(delta, deltaSize);
+	const u32 numBytes = reader.ReadVLE<VLE8_16_32>();
+	// Each byte comes either from the baseline or from the delta.
+	if (numBytes == DataDeserializer::VLEReadError || numBytes > baselineSize + deltaSize)
+		return false;
+	const size_t oldSize = dst.size();
+	dst.resize(oldSize + numBytes);
+
+	size_t pos = 0;
+	while(pos < numBytes)
+	{
+		const u32 numEqual = reader.ReadVLE<VLE8_16_32>();
+		if (numEqual == DataDeserializer::VLEReadError || numEqual > numBytes - pos || pos + numEqual > baselineSize)
+			return false;
+		if (numEqual > 0)
+			memcpy(&dst[oldSize + pos], baseline + pos, numEqual);
+		pos += numEqual;
+
+		const u32 numDiffering = reader.ReadVLE<VLE8_16_32>();
+		if (numDiffering == DataDeserializer::VLEReadError || numDiffering > numBytes - pos || numDiffering > reader.BytesLeft())
+			return false;
+		if (numEqual == 0 && numDiffering == 0)
+			return false; // An empty run would never end the delta.
+		if (numDiffering > 0)
+			memcpy(&dst[oldSize + pos], delta + reader.BytePos(), numDiffering);
+		reader.SkipBytes((int)numDiffering);
+		pos += numDiffering;
+	}
+	return reader.BytesLeft() == 0;
+}
+
+DeltaBaselineHistory::DeltaBaselineHistory()
+{
+}
+
+const std::vector<char> *DeltaBaselineHistory::Find(u8 version) const
+{
+	const Version &v = versions[version % cNumVersions];
+	return (v.valid && v.number == version) ? &v.data : 0;
+}
+
+void DeltaBaselineHistory::Store(u8 version, const char *data, size_t numBytes)
+{
+	// The version numbers wrap around, so a version is older than the stored one if it is less than half the range behind it.
+	Version &v = versions[version % cNumVersions];
+	if (v.valid && (u8)(version - v.number) >= 0x80)
+		return;
+	v.number = version;
+	v.valid = true;
+	v.data.assign(data, data + numBytes);
+}
+
+} // ~kNet
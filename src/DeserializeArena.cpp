@@ -0,0 +1,102 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file DeserializeArena.cpp
+	@brief */
+
+#include <cstring>
+
+#include "kNet/DeserializeArena.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+DeserializeArena::DeserializeArena(size_t capacity)
+:used(0),
+usedInFullBlocks(0),
+initialCapacity(capacity > 0 ? capacity : cDefaultCapacity)
+{
+}
+
+DeserializeArena::~DeserializeArena()
+{
+	for(size_t i = 0; i < blocks.size(); ++i)
+		delete[] blocks[i].data;
+}
+
+void *DeserializeArena::AllocateSlow(size_t numBytes, size_t /*alignment*/)
+{
+	// Each block is at least twice as large as the previous one, so a handler that needs a lot of memory only adds a few.
+	size_t size = blocks.empty() ? initialCapacity : blocks.back().size * 2;
+	if (size < numBytes)
+		size = numBytes;
+
+	if (!blocks.empty())
+		usedInFullBlocks += blocks.back().size;
+	Block block;
+	block.data = new char[size];
+	block.size = size;
+	blocks.push_back(block);
+
+	// new[] aligns the block for any basic type, so the first allocation needs no padding.
+	used = numBytes;
+	return block.data;
+}
+
+void DeserializeArena::Reset()
+{
+	if (blocks.size() > 1)
+	{
+		const size_t capacity = Capacity();
+		for(size_t i = 0; i < blocks.size(); ++i)
+			delete[] blocks[i].data;
+		blocks.clear();
+		Block block;
+		block.data = new char[capacity];
+		block.size = capacity;
+		blocks.push_back(block);
+	}
+	used = 0;
+	usedInFullBlocks = 0;
+}
+
+size_t DeserializeArena::Capacity() const
+{
+	size_t capacity = 0;
+	for(size_t i = 0; i < blocks.size(); ++i)
+		capacity += blocks[i].size;
+	return capacity;
+}
+
+ArenaString DeserializeArena::ReadString(DataDeserializer &src)
+{
+	const u32 length = src.ReadVLE<VLE8_16_32>();
+	if (length == DataDeserializer::VLEReadError || src.BitsLeft() / 8 < length)
+		throw NetException("Not enough bytes left in DeserializeArena::ReadString!");
+
+	char *str = static_cast<char*>(Allocate(length + 1, 1));
+	src.ReadArray<u8>((u8*)str, length);
+	str[length] = 0;
+
+	// Replace the same characters with a space as DataDeserializer::ReadString().
+	for(u32 i = 0; i < length; ++i)
+		if ((unsigned char)str[i] >= 254 || ((unsigned char)str[i] < 32 && str[i] != 0x0D && str[i] != 0x0A && str[i] != 0x09))
+			str[i] = 0x20;
+
+	return ArenaString(str, length);
+}
+
+} // ~kNet
@@ -0,0 +1,126 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file EgressScheduler.cpp
+	@brief */
+
+#include <cmath>
+#include <algorithm>
+
+#include "kNet/EgressScheduler.h"
+#include "kNet/NetworkMessage.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+EgressScheduler::EgressScheduler()
+:rate(0), criticalPriority(NetworkMessage::cMaxPriority), bytesSent(0)
+{
+	Lockable<State>::LockType s = state.Acquire();
+	s->criticalReserve = 0;
+	s->spareThreshold = 0;
+	s->round = 1;
+	s->roundStartTick = Clock::Tick();
+	s->previousRoundWeight = 0;
+	s->roundWeight = 0;
+}
+
+void EgressScheduler::SetRate(int bytesPerSec, tick_t now)
+{
+	Lockable<State>::LockType s = state.Acquire();
+	bytesPerSec = std::max(bytesPerSec, 0);
+	const double burstBytes = std::max(bytesPerSec * cBurstMSecs / 1000.0, (double)cMinBurstBytes);
+	s->bucket.SetRate(bytesPerSec, burstBytes, now);
+	s->criticalReserve = burstBytes / 4.0;
+	s->spareThreshold = burstBytes / 2.0;
+	rate = bytesPerSec;
+}
+
+void EgressScheduler::AdvanceRound(State &s, tick_t now)
+{
+	const tick_t roundTicks = Clock::TicksPerMillisecond() * cRoundMSecs;
+	if (!Clock::IsNewer(now, s.roundStartTick) || Clock::TicksInBetween(now, s.roundStartTick) < roundTicks)
+		return;
+
+	// If no connection sent in the round that just ended, the new round starts over without knowing who will share it.
+	const bool skippedRounds = Clock::TicksInBetween(now, s.roundStartTick) >= 2 * roundTicks;
+	s.previousRoundWeight = skippedRounds ? 0 : s.roundWeight;
+	s.roundWeight = 0;
+	s.roundStartTick = now;
+	if (++s.round == 0)
+		s.round = 1;
+}
+
+void EgressScheduler::CreditFlow(State &s, Flow &flow) const
+{
+	if (flow.round == s.round)
+		return;
+
+	// The debt of a connection that sent in the previous round carries over, but an idle connection starts from zero.
+	if (flow.round + 1 != s.round)
+		flow.deficit = 0;
+	flow.deficit = std::min(flow.deficit, 0.0);
+	flow.round = s.round;
+
+	const double weight = std::max((int)flow.weight, 1);
+	s.roundWeight += weight;
+	const double totalWeight = std::max(s.previousRoundWeight, s.roundWeight);
+	flow.deficit += rate * (cRoundMSecs / 1000.0) * weight / totalWeight;
+}
+
+unsigned long EgressScheduler::MSecsUntilSend(Flow &flow, unsigned long priority, tick_t now)
+{
+	if (!IsLimited())
+		return 0;
+
+	Lockable<State>::LockType s = state.Acquire();
+	AdvanceRound(*s, now);
+	CreditFlow(*s, flow);
+
+	const bool critical = priority >= criticalPriority;
+	const double tokens = s->bucket.TokensAt(now);
+	unsigned long msecs = 0;
+	if (!critical && flow.deficit <= 0 && tokens < s->spareThreshold)
+	{
+		// Wait for the next round to bring more credit.
+		const double msecsLeft = cRoundMSecs - Clock::TimespanToMillisecondsD(s->roundStartTick, now);
+		msecs = (msecsLeft > 1.0) ? (unsigned long)std::ceil(msecsLeft) : 1;
+	}
+
+	const double needed = critical ? 0.0 : s->criticalReserve;
+	if (tokens < needed)
+	{
+		const double msecsLeft = (needed - tokens) * 1000.0 / rate;
+		msecs = std::max(msecs, (msecsLeft > 1.0) ? (unsigned long)std::ceil(msecsLeft) : 1UL);
+	}
+	return msecs;
+}
+
+void EgressScheduler::Consume(Flow &flow, size_t numBytes, tick_t now)
+{
+	if (!IsLimited())
+		return;
+
+	Lockable<State>::LockType s = state.Acquire();
+	AdvanceRound(*s, now);
+	CreditFlow(*s, flow);
+
+	bytesSent = bytesSent + numBytes;
+	flow.deficit -= (double)numBytes;
+	s->bucket.Consume((double)numBytes, now);
+}
+
+} // ~kNet
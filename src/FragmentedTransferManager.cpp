@@ -16,6 +16,7 @@
 	@brief */
 
 #include <cstring>
+#include <algorithm>
 
 #ifdef KNET_USE_BOOST
 #include <boost/thread/thread.hpp>
@@ -25,7 +26,9 @@
 
 #include "kNet/MessageConnection.h"
 #include "kNet/FragmentedTransferManager.h"
+#include "kNet/DatagramBuffer.h"
 #include "kNet/NetworkLogging.h"
+#include "kNet/IMessageHandler.h"
 
 
 using namespace std;
@@ -37,6 +40,7 @@ void FragmentedSendManager::FragmentedTransfer::AddMessage(NetworkMessage *messa
 {
 	fragments.push_back(message);
 	message->transfer = this;
+	bytesOutstanding += message->Size();
 }
 
 bool FragmentedSendManager::FragmentedTransfer::RemoveMessage(NetworkMessage *message)
@@ -46,6 +50,7 @@ bool FragmentedSendManager::FragmentedTransfer::RemoveMessage(NetworkMessage *me
 		{
 			message->transfer = 0;
 			fragments.erase(iter);
+			bytesOutstanding -= message->Size();
 			KNET_LOG(LogVerbose, "Removing message with seqnum %d (fragnum %d) from transfer ID %d (%p).", (int)message->messageNumber, (int)message->fragmentIndex, id, this);
 			return true;
 		}
@@ -58,6 +63,20 @@ FragmentedSendManager::FragmentedTransfer *FragmentedSendManager::AllocateNewFra
 	FragmentedTransfer *transfer = &transfers.back();
 	transfer->id = -1;
 	transfer->totalNumFragments = 0;
+	transfer->source = 0;
+	transfer->fragmentSize = 0;
+	transfer->numFragmentsCreated = 0;
+	transfer->bytesOutstanding = 0;
+	transfer->totalBytes = 0;
+	transfer->bytesAcked = 0;
+	transfer->bytesAckedReported = 0;
+	transfer->ackHandler = 0;
+	transfer->messageID = 0;
+	transfer->contentID = 0;
+	transfer->abortPending = false;
+	transfer->orderNumber = 0;
+	transfer->hasOrderNumber = false;
+	transfer->orderingChannel = 0;
 
 	KNET_LOG(LogObjectAlloc, "Allocated new fragmented transfer %p.", transfer);
 
@@ -70,6 +89,16 @@ void FragmentedSendManager::FreeFragmentedTransfer(FragmentedTransfer *transfer)
 	for(std::list<NetworkMessage*>::iterator iter = transfer->fragments.begin(); iter != transfer->fragments.end(); ++iter)
 		(*iter)->transfer = 0;
 
+	if (transfer->contentID != 0 && contentIDTransfers.Find(transfer->messageID, transfer->contentID) == transfer)
+		contentIDTransfers.Remove(transfer->messageID, transfer->contentID);
+
+	NetworkMessagePool::Free(transfer->source);
+	transfer->source = 0;
+	ReportNotDelivered(*transfer, MessageConnectionClosed);
+
+	if (transfer->id != -1)
+		transferIDsInUse[transfer->id] = false;
+
 	for(TransferList::iterator iter = transfers.begin(); iter != transfers.end(); ++iter)
 		if (&*iter == transfer)
 		{
@@ -80,6 +109,15 @@ void FragmentedSendManager::FreeFragmentedTransfer(FragmentedTransfer *transfer)
 	KNET_LOG(LogError, "Tried to free a fragmented send struct that didn't exist!");
 }
 
+void FragmentedSendManager::ReportNotDelivered(FragmentedTransfer &transfer, MessageAckResult result)
+{
+	if (!transfer.ackHandler)
+		return;
+	IMessageAckHandler *handler = transfer.ackHandler;
+	transfer.ackHandler = 0;
+	handler->HandleMessageAcked(transfer.messageID, result);
+}
+
 void FragmentedSendManager::RemoveMessage(FragmentedTransfer *transfer, NetworkMessage *message)
 {
 	bool success = transfer->RemoveMessage(message);
@@ -89,7 +127,8 @@ void FragmentedSendManager::RemoveMessage(FragmentedTransfer *transfer, NetworkM
 		return;
 	}
 
-	if (transfer->fragments.size() == 0)
+	// The transfer is done when the peer has acked all of its fragments, and there are no more to create.
+	if (transfer->fragments.size() == 0 && !transfer->abortPending && !transfer->source)
 		FreeFragmentedTransfer(transfer);
 }
 
@@ -100,23 +139,13 @@ bool FragmentedSendManager::AllocateFragmentedTransferID(FragmentedTransfer &tra
 	// We start allocating the ID's from number 1, and the number 0 is never used, so that we get some redundancy in the protocol
 	// and are able to detect badly formed input.
 	int transferID = 1;
-
-	///\todo Maintain a sorted order in Insert() instead of doing a search here - better for performance.
-	bool used = true;
-	while(used)
-	{
-		used = false;
-		for(TransferList::iterator iter = transfers.begin(); iter != transfers.end(); ++iter)
-		{
-			if (iter->id == transferID)
-			{
-				++transferID;
-				used = true;
-			}
-		}
-	}
-	if (transferID >= 256)
+	while(transferID < (int)transferIDsInUse.size() && transferIDsInUse[transferID])
+		++transferID;
+	if (transferID > cMaxTransferID)
 		return false;
+	if (transferID >= (int)transferIDsInUse.size())
+		transferIDsInUse.resize(transferID + 1, false);
+	transferIDsInUse[transferID] = true;
 	transfer.id = transferID;
 
 	KNET_LOG(LogObjectAlloc, "Allocated a transferID %d to a transfer of %d fragments.", transfer.id, (int)transfer.totalNumFragments);
@@ -130,7 +159,64 @@ void FragmentedSendManager::FreeAllTransfers()
 		FreeFragmentedTransfer(&transfers.front());
 }
 
-void FragmentedReceiveManager::NewFragmentStartReceived(int transferID, int numTotalFragments, const char *data, size_t numBytes)
+FragmentedSendManager::FragmentedTransfer *FragmentedSendManager::FindTransferWithContentID(u32 messageID, u32 contentID)
+{
+	return contentIDTransfers.Find(messageID, contentID);
+}
+
+void FragmentedSendManager::AddTransferWithContentID(FragmentedTransfer *transfer)
+{
+	assert(transfer && transfer->contentID != 0);
+	contentIDTransfers.Insert(transfer->messageID, transfer->contentID, transfer);
+}
+
+bool FragmentedSendManager::AbortTransfer(FragmentedTransfer *transfer)
+{
+	assert(transfer);
+	for(std::list<NetworkMessage*>::iterator iter = transfer->fragments.begin(); iter != transfer->fragments.end(); ++iter)
+		(*iter)->obsolete = true;
+
+	// No more fragments will be created.
+	NetworkMessagePool::Free(transfer->source);
+	transfer->source = 0;
+	ReportNotDelivered(*transfer, MessageObsolete);
+
+	if (transfer->contentID != 0 && contentIDTransfers.Find(transfer->messageID, transfer->contentID) == transfer)
+		contentIDTransfers.Remove(transfer->messageID, transfer->contentID);
+
+	KNET_LOG(LogVerbose, "Aborting fragmented transfer ID=%d of message ID %d, content ID %d, with %d fragments left (%p).",
+		transfer->id, (int)transfer->messageID, (int)transfer->contentID, (int)transfer->fragments.size(), transfer);
+
+	// If no fragment has gone out yet, the transfer has no ID, and the peer doesn't know about it.
+	if (transfer->id == -1)
+		return false;
+	transfer->abortPending = true;
+	return true;
+}
+
+void FragmentedSendManager::AbortAcknowledged(int transferID)
+{
+	for(TransferList::iterator iter = transfers.begin(); iter != transfers.end(); ++iter)
+		if (iter->id == transferID && iter->abortPending)
+		{
+			iter->abortPending = false;
+			if (iter->fragments.empty() && !iter->source)
+				FreeFragmentedTransfer(&*iter);
+			return;
+		}
+}
+
+FragmentedReceiveManager::FragmentedReceiveManager()
+:numFileDestinations(0)
+{
+}
+
+FragmentedReceiveManager::~FragmentedReceiveManager()
+{
+	FreeAllTransfers();
+}
+
+bool FragmentedReceiveManager::NewFragmentStartReceived(int transferID, int numTotalFragments, const char *data, size_t numBytes)
 {
 	assert(data);
 	KNET_LOG(LogVerbose, "Received a fragmentStart of size %db (#total fragments %d) for a transfer with ID %d.", (int)numBytes, numTotalFragments, transferID);
@@ -138,24 +224,63 @@ void FragmentedReceiveManager::NewFragmentStartReceived(int transferID, int numT
 	if (numBytes == 0 || numTotalFragments <= 1)
 	{
 		KNET_LOG(LogError, "Discarding degenerate fragmentStart of size %db and numTotalFragments=%db!", (int)numBytes, numTotalFragments);
-		return;
+		return false;
 	}
 
-	for(size_t i = 0; i < transfers.size(); ++i)
-		if (transfers[i].transferID == transferID)
-		{
-			KNET_LOG(LogError, "An existing transfer with ID %d existed! Deleting it.", transferID);
-			transfers.erase(transfers.begin() + i);
-			--i;
-		}
+	// The first fragment starts with the ID of the message, and the rest of it is a full-sized fragment of the message.
+	DataDeserializer reader(data, numBytes);
+	const u32 messageID = MessageConnection::ReadMessageID(reader);
+	const size_t fragmentSize = reader.BytesLeft();
+	if (messageID == DataDeserializer::VLEReadError || fragmentSize == 0)
+	{
+		KNET_LOG(LogError, "Discarding a fragmentStart of transfer %d with a malformed message ID!", transferID);
+		return false;
+	}
+	// A message that the application has asked to be written to a file is assembled in a mapping of the file instead of in memory.
+	const u64 messageSize = (u64)numTotalFragments * fragmentSize;
+	DatagramBuffer *file = (messageSize <= (size_t)-1) ? MapFileDestination(messageID, (size_t)messageSize) : 0;
+	if (!file && messageSize > cMaxMessageSize)
+	{
+		KNET_LOG(LogError, "Discarding a fragmentStart of transfer %d: %d fragments of %db exceed the maximum message size of %db!",
+			transferID, numTotalFragments, (int)fragmentSize, (int)cMaxMessageSize);
+		return false;
+	}
+
+	TransferMap::iterator iter = transfers.find(transferID);
+	if (iter != transfers.end() && iter->second.message)
+	{
+		KNET_LOG(LogError, "An existing transfer with ID %d existed! Deleting it.", transferID);
+		FreeMessage(transferID);
+		iter = transfers.end();
+	}
+	// The fragments that overtook the fragmentStart are waiting in a transfer that has not been started yet.
+	ReceiveTransfer &transfer = (iter != transfers.end()) ? iter->second : transfers[transferID];
+	if (iter == transfers.end())
+		transfer.message = 0;
 
-	transfers.push_back(ReceiveTransfer());
-	ReceiveTransfer &transfer = transfers.back();
-	transfer.transferID = transferID;
 	transfer.numTotalFragments = numTotalFragments;
+	transfer.fragmentSize = fragmentSize;
+	transfer.numFragmentsReceived = 0;
+	transfer.receivedFragments.assign((numTotalFragments + 31) / 32, 0);
+	transfer.message = NetworkMessagePool::New();
+	if (file)
+	{
+		transfer.message->AttachSharedData(file, file->Data(), file->Capacity());
+		file->Release();
+	}
+	else
+		transfer.message->Resize(numTotalFragments * fragmentSize, true);
+	transfer.message->id = messageID;
 
-	///\todo Can optimize by passing the pre-searched transfer struct.
-	NewFragmentReceived(transferID, 0, data, numBytes);
+	WriteFragment(transfer, transferID, 0, data + reader.BytePos(), fragmentSize);
+	for(size_t i = 0; i < transfer.earlyFragments.size(); ++i)
+	{
+		const ReceiveFragment &fragment = transfer.earlyFragments[i];
+		WriteFragment(transfer, transferID, fragment.fragmentIndex, &fragment.data[0], fragment.data.size());
+	}
+	transfer.earlyFragments.clear();
+
+	return transfer.numFragmentsReceived == transfer.numTotalFragments;
 }
 
 bool FragmentedReceiveManager::NewFragmentReceived(int transferID, int fragmentNumber, const char *data, size_t numBytes)
@@ -168,72 +293,145 @@ bool FragmentedReceiveManager::NewFragmentReceived(int transferID, int fragmentN
 		return false;
 	}
 
-	for(size_t i = 0; i < transfers.size(); ++i)
-		if (transfers[i].transferID == transferID)
+	TransferMap::iterator iter = transfers.find(transferID);
+	if (iter != transfers.end() && iter->second.message)
+	{
+		ReceiveTransfer &transfer = iter->second;
+		if (!WriteFragment(transfer, transferID, fragmentNumber, data, numBytes))
+			return false;
+		if (transfer.numFragmentsReceived == transfer.numTotalFragments)
 		{
-			ReceiveTransfer &transfer = transfers[i];
-
-			for(size_t j = 0; j < transfer.fragments.size(); ++j)
-				if (transfer.fragments[j].fragmentIndex == fragmentNumber)
-				{
-					KNET_LOG(LogError, "A fragment with fragmentNumber %d already exists for transferID %d. Discarding the new fragment! Old size: %db, discarded size: %db",
-						fragmentNumber, transferID, (int)transfer.fragments[j].data.size(), (int)numBytes);
-					return false;
-				}
-
-			transfer.fragments.push_back(ReceiveFragment());
-			ReceiveFragment &fragment = transfer.fragments.back();
-			fragment.fragmentIndex = fragmentNumber;
-			fragment.data.insert(fragment.data.end(), data, data + numBytes);
-
-			if (transfer.fragments.size() >= (size_t)transfer.numTotalFragments)
-			{
-				KNET_LOG(LogData, "Finished receiving a fragmented transfer that consisted of %d fragments (transferID=%d).",
-					(int)transfer.fragments.size(), transfer.transferID);
-				return true;
-			}
-			else
-				return false;
+			KNET_LOG(LogData, "Finished receiving a fragmented transfer that consisted of %d fragments (transferID=%d).",
+				transfer.numTotalFragments, transferID);
+			return true;
 		}
-	KNET_LOG(LogError, "Received a fragment of size %db (index %d) for a transfer with ID %d, but that transfer had not been initiated!",
+		return false;
+	}
+
+	// The datagram that carries the fragmentStart can be lost or reordered, and arrive after the following fragments. Keep the
+	// fragment in a transfer that is still waiting for its fragmentStart.
+	KNET_LOG(LogVerbose, "Received a fragment of size %db (index %d) for a transfer with ID %d that has not been initiated yet.",
 		(int)numBytes, fragmentNumber, transferID);
+	if (iter == transfers.end())
+	{
+		ReceiveTransfer &transfer = transfers[transferID];
+		transfer.numTotalFragments = 0;
+		transfer.fragmentSize = 0;
+		transfer.numFragmentsReceived = 0;
+		transfer.message = 0;
+		iter = transfers.find(transferID);
+	}
+	std::vector<ReceiveFragment> &earlyFragments = iter->second.earlyFragments;
+	for(size_t i = 0; i < earlyFragments.size(); ++i)
+		if (earlyFragments[i].fragmentIndex == fragmentNumber)
+			return false; // A duplicate.
+	earlyFragments.push_back(ReceiveFragment());
+	earlyFragments.back().fragmentIndex = fragmentNumber;
+	earlyFragments.back().data.assign(data, data + numBytes);
 	return false;
 }
 
-void FragmentedReceiveManager::AssembleMessage(int transferID, std::vector<char> &assembledData)
+bool FragmentedReceiveManager::WriteFragment(ReceiveTransfer &transfer, int transferID, int fragmentIndex, const char *data, size_t numBytes)
 {
-	for(size_t i = 0; i < transfers.size(); ++i)
-		if (transfers[i].transferID == transferID)
+	assert(transfer.message);
+
+	// All the fragments but the last one are full-sized, so each fragment has a fixed place in the message.
+	const bool lastFragment = (fragmentIndex == transfer.numTotalFragments - 1);
+	if (fragmentIndex < 0 || fragmentIndex >= transfer.numTotalFragments || numBytes == 0 || numBytes > transfer.fragmentSize ||
+		(!lastFragment && numBytes != transfer.fragmentSize))
+	{
+		KNET_LOG(LogError, "Discarding a malformed fragment of %db (index %d) of transfer ID %d of %d fragments of %db!",
+			(int)numBytes, fragmentIndex, transferID, transfer.numTotalFragments, (int)transfer.fragmentSize);
+		return false;
+	}
+
+	u32 &bits = transfer.receivedFragments[fragmentIndex / 32];
+	const u32 bit = 1u << (fragmentIndex % 32);
+	if ((bits & bit) != 0)
+	{
+		KNET_LOG(LogError, "A fragment with fragmentNumber %d already exists for transferID %d. Discarding the new fragment!", fragmentIndex, transferID);
+		return false;
+	}
+	bits |= bit;
+	++transfer.numFragmentsReceived;
+
+	const size_t offset = (size_t)fragmentIndex * transfer.fragmentSize;
+	memcpy(transfer.message->data + offset, data, numBytes);
+	if (lastFragment) // The last fragment may be shorter than the others. This only shrinks the size.
+	{
+		DatagramBuffer *file = transfer.message->sharedData;
+		if (file)
 		{
-			ReceiveTransfer &transfer = transfers[i];
-			size_t totalSize = 0;
-
-			for(size_t j = 0; j < transfer.fragments.size(); ++j)
-				totalSize += transfer.fragments[j].data.size();
-
-			assembledData.resize(totalSize);
-
-			///\todo Sort by fragmentIndex.
-			
-			size_t offset = 0;
-			for(size_t j = 0; j < transfer.fragments.size(); ++j)
-			{
-				assert(transfer.fragments[j].data.size() > 0);
-				memcpy(&assembledData[offset], &transfer.fragments[j].data[0], transfer.fragments[j].data.size());
-				offset += transfer.fragments[j].data.size();
-				assert(offset <= assembledData.size());
-			}
+			// Resizing would move the message off the mapping, so refer to the shorter range instead, and truncate the file to it.
+			file->SetFileSize(offset + numBytes);
+			transfer.message->AttachSharedData(file, file->Data(), offset + numBytes);
 		}
+		else
+			transfer.message->Resize(offset + numBytes);
+	}
+	return true;
+}
+
+NetworkMessage *FragmentedReceiveManager::DetachMessage(int transferID)
+{
+	TransferMap::iterator iter = transfers.find(transferID);
+	if (iter == transfers.end())
+		return 0;
+
+	NetworkMessage *message = iter->second.message;
+	assert(!message || iter->second.numFragmentsReceived == iter->second.numTotalFragments);
+	transfers.erase(iter);
+	return message;
 }
 
 void FragmentedReceiveManager::FreeMessage(int transferID)
 {
-	for(size_t i = 0; i < transfers.size(); ++i)
-		if (transfers[i].transferID == transferID)
-		{
-			transfers.erase(transfers.begin() + i);
-			return;
-		}
+	TransferMap::iterator iter = transfers.find(transferID);
+	if (iter == transfers.end())
+		return;
+
+	NetworkMessagePool::Free(iter->second.message);
+	transfers.erase(iter);
+}
+
+void FragmentedReceiveManager::FreeAllTransfers()
+{
+	for(TransferMap::iterator iter = transfers.begin(); iter != transfers.end(); ++iter)
+		NetworkMessagePool::Free(iter->second.message);
+	transfers.clear();
+}
+
+void FragmentedReceiveManager::SetFileDestination(u32 messageID, const char *filename)
+{
+	assert(filename);
+	Lockable<std::map<u32, std::string> >::LockType destinations = fileDestinations.Acquire();
+	(*destinations)[messageID] = filename;
+	numFileDestinations = (int)destinations->size();
+}
+
+DatagramBuffer *FragmentedReceiveManager::MapFileDestination(u32 messageID, size_t size)
+{
+	if (numFileDestinations == 0)
+		return 0;
+
+	std::string filename;
+	{
+		Lockable<std::map<u32, std::string> >::LockType destinations = fileDestinations.Acquire();
+		std::map<u32, std::string>::iterator iter = destinations->find(messageID);
+		if (iter == destinations->end())
+			return 0;
+		filename.swap(iter->second);
+		destinations->erase(iter);
+		numFileDestinations = (int)destinations->size();
+	}
+
+	DatagramBuffer *file = DatagramBuffer::MapFileForWriting(filename.c_str(), size);
+	if (!file)
+		KNET_LOG(LogError, "Failed to map file \"%s\" for a received message with ID %d of %db! Receiving the message to memory instead.",
+			filename.c_str(), (int)messageID, (int)size);
+	else
+		KNET_LOG(LogVerbose, "Receiving a message with ID %d of %db to file \"%s\".", (int)messageID, (int)size, filename.c_str());
+	return file;
 }
 
 } // ~kNet
@@ -0,0 +1,158 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file HostResolver.cpp
+	@brief */
+
+#include <cstring>
+
+#include "kNet/HostResolver.h"
+#include "kNet/Socket.h"
+#include "kNet/Thread.h"
+#include "kNet/NetworkLogging.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+HostResolver::HostResolver()
+:timeToLiveMSecs(60000.f), negativeTimeToLiveMSecs(5000.f)
+{
+	requestsQueued = CreateNewEvent(EventWaitSignal);
+}
+
+HostResolver::~HostResolver()
+{
+	std::vector<Thread *> stopped;
+	{
+		Lockable<State>::LockType lock = state.Acquire();
+		stopped.swap(threads);
+	}
+	for(size_t i = 0; i < stopped.size(); ++i)
+	{
+		stopped[i]->Stop();
+		delete stopped[i];
+	}
+	requestsQueued.Close();
+}
+
+/// Looks the given name up with getaddrinfo(). With numericOnly set, only a numeric address is parsed, which never blocks.
+static bool GetAddress(const char *hostName, bool numericOnly, EndPoint &address)
+{
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_flags = numericOnly ? AI_NUMERICHOST : 0;
+	addrinfo *result = 0;
+	if (getaddrinfo(hostName, 0, &hints, &result) != 0 || !result)
+		return false;
+	address = EndPoint::FromSockAddrIn(*(const sockaddr_in *)result->ai_addr);
+	address.port = 0;
+	freeaddrinfo(result);
+	return true;
+}
+
+bool HostResolver::ResolveBlocking(const char *hostName, EndPoint &address)
+{
+	return GetAddress(hostName, false, address);
+}
+
+HostResolver::Status HostResolver::Resolve(const char *hostName, EndPoint &address)
+{
+	if (!hostName || !*hostName)
+		return ResolveFailed;
+	if (GetAddress(hostName, true, address))
+		return Resolved;
+
+	Lockable<State>::LockType lock = state.Acquire();
+	const tick_t now = Clock::Tick();
+	std::map<std::string, CacheEntry>::iterator iter = lock->cache.find(hostName);
+	if (iter != lock->cache.end())
+	{
+		CacheEntry &entry = iter->second;
+		if (entry.status == Resolving)
+			return Resolving;
+		if (!entry.returned || Clock::IsNewer(entry.expiryTick, now))
+		{
+			entry.returned = true;
+			address = entry.address;
+			return entry.status;
+		}
+	}
+
+	CacheEntry &entry = lock->cache[hostName];
+	entry.status = Resolving;
+	lock->requests.push_back(hostName);
+	requestsQueued.Set();
+
+	// Each thread resolves one name at a time, so start them all at once.
+	if (threads.empty())
+		for(int i = 0; i < cNumResolverThreads; ++i)
+		{
+			Thread *thread = new Thread();
+			threads.push_back(thread);
+			thread->Run(this, &HostResolver::ResolverLoop, thread);
+			thread->SetName("kNet HostResolver");
+		}
+	return Resolving;
+}
+
+void HostResolver::ClearCache()
+{
+	Lockable<State>::LockType lock = state.Acquire();
+	for(std::map<std::string, CacheEntry>::iterator iter = lock->cache.begin(); iter != lock->cache.end();)
+		if (iter->second.status != Resolving)
+			lock->cache.erase(iter++);
+		else
+			++iter;
+}
+
+void HostResolver::ResolverLoop(Thread *thread)
+{
+	while(!thread->ShouldQuit())
+	{
+		std::string hostName;
+		{
+			Lockable<State>::LockType lock = state.Acquire();
+			if (lock->requests.empty())
+				requestsQueued.Reset();
+			else
+			{
+				hostName = lock->requests.front();
+				lock->requests.pop_front();
+			}
+		}
+		if (hostName.empty())
+		{
+			// The wait times out now and then to see if the thread is asked to quit.
+			requestsQueued.Wait(100);
+			continue;
+		}
+
+		EndPoint address;
+		const bool success = GetAddress(hostName.c_str(), false, address);
+		if (!success)
+			KNET_LOG(LogError, "HostResolver: Could not resolve the host name %s.", hostName.c_str());
+
+		Lockable<State>::LockType lock = state.Acquire();
+		CacheEntry &entry = lock->cache[hostName];
+		entry.status = success ? Resolved : ResolveFailed;
+		entry.address = address;
+		entry.returned = false;
+		entry.expiryTick = Clock::Tick() + (tick_t)((success ? timeToLiveMSecs : negativeTimeToLiveMSecs) * Clock::TicksPerMillisecond());
+	}
+}
+
+} // ~kNet
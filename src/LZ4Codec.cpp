@@ -0,0 +1,285 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file LZ4Codec.cpp
+	@brief */
+
+#include <cstring>
+#include <algorithm>
+
+#include "kNet/LZ4Codec.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+namespace
+{
+/// The hash tables have 2^cHashLog entries.
+const int cHashLog = 12;
+const size_t cMinMatch = 4;
+/// The last five bytes of a block are always literals, and the last match starts at least twelve bytes before the end.
+const size_t cLastLiterals = 5;
+const size_t cMatchFindLimit = 12;
+const size_t cMaxOffset = 65535;
+
+u32 Read32(const char *data)
+{
+	u32 value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+u32 Hash(u32 sequence)
+{
+	return (sequence * 2654435761u) >> (32 - cHashLog);
+}
+
+/// Returns the number of bytes that are equal at a and b, comparing up to aEnd.
+size_t CountMatch(const char *a, const char *b, const char *aEnd)
+{
+	const char *start = a;
+	while(a < aEnd && *a == *b)
+	{
+		++a;
+		++b;
+	}
+	return (size_t)(a - start);
+}
+
+/// Writes the part of a length that did not fit in its four bits of the token.
+char *WriteLength(char *dst, size_t length)
+{
+	for(; length >= 255; length -= 255)
+		*dst++ = (char)255;
+	*dst++ = (char)length;
+	return dst;
+}
+
+/// Adds the bytes of a length that did not fit in its four bits of the token to the given length.
+bool ReadLength(const unsigned char *&src, const unsigned char *srcEnd, size_t &length)
+{
+	for(;;)
+	{
+		if (src >= srcEnd || length > 0x7FFFFFFF)
+			return false;
+		const unsigned char byte = *src++;
+		length += byte;
+		if (byte != 255)
+			return true;
+	}
+}
+
+/// Writes a sequence of literals followed by a match, or only the literals if matchLength is zero.
+/// @return False if the sequence did not fit in the output.
+bool WriteSequence(char *&dst, char *dstEnd, const char *literals, size_t numLiterals, size_t offset, size_t matchLength)
+{
+	const size_t maxSize = 1 + numLiterals / 255 + 1 + numLiterals + 2 + matchLength / 255 + 1;
+	if ((size_t)(dstEnd - dst) < maxSize)
+		return false;
+
+	char *token = dst++;
+	unsigned char tokenValue = (unsigned char)(std::min<size_t>(numLiterals, 15) << 4);
+	if (numLiterals >= 15)
+		dst = WriteLength(dst, numLiterals - 15);
+	if (numLiterals > 0)
+		memcpy(dst, literals, numLiterals);
+	dst += numLiterals;
+
+	if (matchLength > 0)
+	{
+		*dst++ = (char)(offset & 0xFF);
+		*dst++ = (char)(offset >> 8);
+		const size_t encodedLength = matchLength - cMinMatch;
+		tokenValue |= (unsigned char)std::min<size_t>(encodedLength, 15);
+		if (encodedLength >= 15)
+			dst = WriteLength(dst, encodedLength - 15);
+	}
+	*token = (char)tokenValue;
+	return true;
+}
+}
+
+LZ4Codec::LZ4Codec()
+:tableBase(1), dictionaryID(0)
+{
+}
+
+void LZ4Codec::SetDictionary(const char *data, size_t numBytes)
+{
+	if (numBytes > cMaxDictionarySize)
+	{
+		data += numBytes - cMaxDictionarySize;
+		numBytes = cMaxDictionarySize;
+	}
+	dictionary.assign(data, data + numBytes);
+	dictionaryHashTable.assign((numBytes >= cMinMatch) ? (1 << cHashLog) : 0, 0);
+	for(size_t i = 0; i + cMinMatch <= numBytes; ++i)
+		dictionaryHashTable[Hash(Read32(data + i))] = (u32)(i + 1);
+
+	// FNV-1a.
+	dictionaryID = 0;
+	if (numBytes > 0)
+	{
+		u32 hash = 2166136261u;
+		for(size_t i = 0; i < numBytes; ++i)
+			hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+		dictionaryID = (hash != 0) ? hash : 1;
+	}
+}
+
+size_t LZ4Codec::Compress(const char *src, size_t srcSize, char *dst, size_t dstCapacity, bool useDictionary)
+{
+	useDictionary = useDictionary && !dictionaryHashTable.empty();
+	if (hashTable.empty())
+		hashTable.resize(1 << cHashLog, 0);
+	// The positions are stored relative to tableBase, so that the table doesn't need to be cleared for each block. Only
+	// clear it when the base would wrap around.
+	if (tableBase >= 0x80000000u - srcSize)
+	{
+		std::fill(hashTable.begin(), hashTable.end(), 0);
+		tableBase = 1;
+	}
+	const u32 base = tableBase;
+	tableBase += (u32)srcSize + 1;
+
+	char *dstPos = dst;
+	char *const dstEnd = dst + dstCapacity;
+	const char *const dict = useDictionary ? &dictionary[0] : 0;
+	const size_t dictSize = useDictionary ? dictionary.size() : 0;
+
+	size_t anchor = 0; // The start of the literals that have not been written yet.
+	if (srcSize > cMatchFindLimit)
+	{
+		const size_t matchFindLimit = srcSize - cMatchFindLimit;
+		const char *const matchEnd = src + srcSize - cLastLiterals;
+		size_t pos = 0;
+		while(pos < matchFindLimit)
+		{
+			const u32 sequence = Read32(src + pos);
+			const u32 hash = Hash(sequence);
+			const u32 candidate = hashTable[hash];
+			hashTable[hash] = base + (u32)pos;
+
+			size_t offset = 0;
+			size_t matchLength = 0;
+			if (candidate >= base && pos - (candidate - base) <= cMaxOffset && Read32(src + (candidate - base)) == sequence)
+			{
+				// Extend the match backwards over the literals, then forwards.
+				size_t matchPos = candidate - base;
+				while(pos > anchor && matchPos > 0 && src[pos - 1] == src[matchPos - 1])
+				{
+					--pos;
+					--matchPos;
+				}
+				offset = pos - matchPos;
+				matchLength = CountMatch(src + pos, src + matchPos, matchEnd);
+			}
+			else if (useDictionary && dictionaryHashTable[hash] != 0)
+			{
+				const size_t dictPos = dictionaryHashTable[hash] - 1;
+				offset = pos + dictSize - dictPos;
+				if (offset <= cMaxOffset && Read32(dict + dictPos) == sequence)
+				{
+					// A match that runs to the end of the dictionary continues from the start of the block.
+					const size_t dictBytesLeft = dictSize - dictPos;
+					const char *dictMatchEnd = std::min(src + pos + dictBytesLeft, matchEnd);
+					matchLength = CountMatch(src + pos, dict + dictPos, dictMatchEnd);
+					if (matchLength == dictBytesLeft)
+						matchLength += CountMatch(src + pos + matchLength, src, matchEnd);
+				}
+			}
+
+			if (matchLength < cMinMatch)
+			{
+				// Skip ahead faster through data that doesn't compress.
+				pos += 1 + ((pos - anchor) >> 6);
+				continue;
+			}
+
+			if (!WriteSequence(dstPos, dstEnd, src + anchor, pos - anchor, offset, matchLength))
+				return 0;
+			pos += matchLength;
+			anchor = pos;
+			if (pos < matchFindLimit)
+				hashTable[Hash(Read32(src + pos - 2))] = base + (u32)(pos - 2);
+		}
+	}
+
+	if (!WriteSequence(dstPos, dstEnd, src + anchor, srcSize - anchor, 0, 0))
+		return 0;
+	return (size_t)(dstPos - dst);
+}
+
+int LZ4Codec::Decompress(const char *src, size_t srcSize, char *dst, size_t dstCapacity, bool useDictionary) const
+{
+	if (useDictionary && dictionary.empty())
+		return -1;
+	const size_t dictSize = useDictionary ? dictionary.size() : 0;
+
+	const unsigned char *srcPos = (const unsigned char *)src;
+	const unsigned char *const srcEnd = srcPos + srcSize;
+	size_t dstPos = 0;
+	for(;;)
+	{
+		if (srcPos >= srcEnd)
+			return -1;
+		const unsigned char token = *srcPos++;
+
+		size_t numLiterals = token >> 4;
+		if (numLiterals == 15 && !ReadLength(srcPos, srcEnd, numLiterals))
+			return -1;
+		if ((size_t)(srcEnd - srcPos) < numLiterals || dstCapacity - dstPos < numLiterals)
+			return -1;
+		memcpy(dst + dstPos, srcPos, numLiterals);
+		srcPos += numLiterals;
+		dstPos += numLiterals;
+
+		if (srcPos == srcEnd) // The last sequence has only literals.
+			return (int)dstPos;
+
+		if (srcEnd - srcPos < 2)
+			return -1;
+		const size_t offset = srcPos[0] | (srcPos[1] << 8);
+		srcPos += 2;
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && !ReadLength(srcPos, srcEnd, matchLength))
+			return -1;
+		matchLength += cMinMatch;
+		if (offset == 0 || offset > dstPos + dictSize || dstCapacity - dstPos < matchLength)
+			return -1;
+
+		if (offset > dstPos)
+		{
+			// The match starts in the dictionary, and may continue from the start of the block.
+			const size_t numDictBytes = std::min(offset - dstPos, matchLength);
+			memcpy(dst + dstPos, &dictionary[dictSize - (offset - dstPos)], numDictBytes);
+			dstPos += numDictBytes;
+			matchLength -= numDictBytes;
+		}
+		if (matchLength > 0)
+		{
+			const char *match = dst + dstPos - offset;
+			if (offset >= matchLength)
+				memcpy(dst + dstPos, match, matchLength);
+			else // The match overlaps the bytes it produces, so copy it a byte at a time.
+				for(size_t i = 0; i < matchLength; ++i)
+					dst[dstPos + i] = match[i];
+			dstPos += matchLength;
+		}
+	}
+}
+
+} // ~kNet
@@ -0,0 +1,88 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file LatencyHistogram.cpp
+	@brief Implements the queries of LatencyHistogram. */
+
+#include <cstring>
+
+#include "kNet/LatencyHistogram.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+const char *LatencyMetricToString(LatencyMetric metric)
+{
+	switch(metric)
+	{
+	case LatencyPingRTT: return "PingRTT";
+	case LatencyAckRTT: return "AckRTT";
+	case LatencyQueueTime: return "QueueTime";
+	case LatencyReceiveDelay: return "ReceiveDelay";
+	default: return "(invalid LatencyMetric)";
+	}
+}
+
+void LatencyHistogram::Clear()
+{
+	memset(counts, 0, sizeof(counts));
+	totalCount = 0;
+	sum = 0;
+	maxValue = 0;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &rhs)
+{
+	for(int i = 0; i < cNumBuckets; ++i)
+		counts[i] += rhs.counts[i];
+	totalCount += rhs.totalCount;
+	sum += rhs.sum;
+	if (rhs.maxValue > maxValue)
+		maxValue = rhs.maxValue;
+}
+
+float LatencyHistogram::PercentileMSecs(float percentile) const
+{
+	// Sum up the buckets instead of using totalCount, since the recording thread may have updated one but not the other yet.
+	u64 numSamples = 0;
+	for(int i = 0; i < cNumBuckets; ++i)
+		numSamples += counts[i];
+	if (numSamples == 0)
+		return 0.f;
+
+	if (percentile < 0.f)
+		percentile = 0.f;
+	if (percentile > 100.f)
+		percentile = 100.f;
+	u64 rank = (u64)((double)percentile / 100.0 * (double)numSamples + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	u64 numBelow = 0;
+	for(int i = 0; i < cNumBuckets; ++i)
+	{
+		numBelow += counts[i];
+		if (numBelow >= rank)
+		{
+			// The bucket can extend above the largest sample.
+			const u32 value = BucketUpperBound(i);
+			return (value < maxValue ? value : maxValue) / 1000.f;
+		}
+	}
+	return maxValue / 1000.f;
+}
+
+} // ~kNet
@@ -0,0 +1,108 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MemoryBudget.cpp
+	@brief */
+
+#include <cassert>
+
+#include "kNet/MemoryBudget.h"
+#include "kNet/Atomics.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+MemoryBudget::MemoryBudget(MemoryBudget *parent_, size_t limit_)
+:parent(parent_), limit((u64)limit_), bytesUsed(0), peakBytesUsed(0), numRefusals(0)
+{
+}
+
+size_t MemoryBudget::BytesLeft() const
+{
+	u64 left = (u64)-1;
+	const u64 used = bytesUsed;
+	const u64 max = limit;
+	if (max != 0)
+		left = (used < max) ? max - used : 0;
+	if (parent)
+	{
+		const u64 parentLeft = (u64)parent->BytesLeft();
+		if (parentLeft < left)
+			left = parentLeft;
+	}
+	return (size_t)((left < (u64)(size_t)-1) ? left : (u64)(size_t)-1);
+}
+
+bool MemoryBudget::Add(u64 bytes, bool enforceLimit)
+{
+	for(;;)
+	{
+		const u64 used = bytesUsed;
+		const u64 max = limit;
+		if (enforceLimit && max != 0 && used + bytes > max)
+			return false;
+		if (CmpXChg64(&bytesUsed, used + bytes, used))
+		{
+			u64 peak = peakBytesUsed;
+			while(used + bytes > peak && !CmpXChg64(&peakBytesUsed, used + bytes, peak))
+				peak = peakBytesUsed;
+			return true;
+		}
+	}
+}
+
+bool MemoryBudget::TryReserve(size_t bytes)
+{
+	if (!Add((u64)bytes, true))
+	{
+		AtomicIncrement(&numRefusals);
+		return false;
+	}
+	if (parent && !parent->TryReserve(bytes))
+	{
+		Subtract((u64)bytes);
+		AtomicIncrement(&numRefusals);
+		return false;
+	}
+	return true;
+}
+
+void MemoryBudget::Reserve(size_t bytes)
+{
+	Add((u64)bytes, false);
+	if (parent)
+		parent->Reserve(bytes);
+}
+
+void MemoryBudget::Subtract(u64 bytes)
+{
+	for(;;)
+	{
+		const u64 used = bytesUsed;
+		assert(used >= bytes);
+		if (CmpXChg64(&bytesUsed, used - bytes, used))
+			return;
+	}
+}
+
+void MemoryBudget::Release(size_t bytes)
+{
+	Subtract((u64)bytes);
+	if (parent)
+		parent->Release(bytes);
+}
+
+} // ~kNet
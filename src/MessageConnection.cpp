@@ -18,6 +18,7 @@
 #include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <cmath>
 
 #ifdef KNET_USE_BOOST
 #include <boost/thread/thread.hpp>
@@ -36,9 +37,14 @@
 #include "kNet/DataDeserializer.h"
 #include "kNet/VLEPacker.h"
 #include "kNet/FragmentedTransferManager.h"
+#include "kNet/MessageDataAllocator.h"
+#include "kNet/DatagramBuffer.h"
 #include "kNet/NetworkServer.h"
 #include "kNet/Clock.h"
 #include "kNet/NetworkWorkerThread.h"
+#include "kNet/Atomics.h"
+#include "kNet/MulticastChannel.h"
+#include "kNet/MessageFrameArena.h"
 
 using namespace std;
 
@@ -53,15 +59,33 @@ namespace
 	/// The time interval after which, if we don't get a response to a PingRequest message, the connection is declared lost.
 	///\todo Make this user-defineable.
 	const float connectionLostTimeout = 15.f * 1000.f;
+	/// The time without messages after which a connection enters the idle mode by default.
+	const float defaultIdleTimeout = 10.f * 1000.f;
 
 	const float cConnectTimeOutMSecs = 15 * 1000.f; ///< \todo Actually use this time limit.
 
 	const float cDisconnectTimeOutMSecs = 5 * 1000.f; ///< \todo Actually use this time limit.
+
+	/// The largest message fragment a UDP datagram can carry, since the content length field of a message is 11 bits
+	/// and includes the up to 4 bytes of the message ID.
+	const size_t cMaxUDPMessageFragmentSize = (1 << 11) - 1 - 4;
+
+	/// The send rate limit buckets hold this many msecs worth of sends, but at least cMinSendRateLimitBurstBytes bytes.
+	const double cSendRateLimitBurstMSecs = 50.0;
+	const double cMinSendRateLimitBurstBytes = 1400.0;
+
+	/// The smallest block that SetCompression() lets the connection compress. Compressing less would not pay for the
+	/// CompressedData message header.
+	const size_t cMinCompressionThreshold = 16;
 }
 
 namespace kNet
 {
 
+const int MessageConnection::cProcessBatchSize;
+const int MessageConnection::cMinQueueSegmentSize;
+const message_id_t MessageConnection::cMaxDispatchMessageID;
+
 void AppendU8ToVector(std::vector<char> &data, unsigned long value)
 {
 	data.insert(data.end(), (const char *)&value, (const char *)&value + 1);
@@ -86,27 +110,38 @@ std::string ConnectionStateToString(ConnectionState state)
 }
 
 MessageConnection::MessageConnection(Network *owner_, NetworkServer *ownerServer_, Socket *socket_, ConnectionState startingState)
-:owner(owner_), ownerServer(ownerServer_), workerThread(0), 
+:owner(owner_), ownerServer(ownerServer_), packetCapture(ownerServer_ ? &ownerServer_->Capture() : 0),
+egressScheduler(ownerServer_ ? &ownerServer_->Egress() : 0),
+serverMalformedDatagrams(ownerServer_ ? &ownerServer_->numMalformedDatagrams : 0), workerThread(0), 
 #ifdef KNET_THREAD_CHECKING_ENABLED
 workerThreadId(Thread::NullThreadId()),
 #endif
-outboundAcceptQueue(16*1024), inboundMessageQueue(16*1024), 
-#ifdef KNET_NO_MAXHEAP
-outboundQueue(16 * 1024), 
-#endif
-inboundMessageHandler(0), socket(socket_), 
+memoryBudget(&Network::ConnectionMemoryBudget(), owner_ ? owner_->ConnectionMemoryLimit() : 0),
+outboundAcceptQueue(16*1024, cMinQueueSegmentSize, &memoryBudget), inboundMessageQueue(16*1024, cMinQueueSegmentSize, &memoryBudget),
+transferProgressQueue(64),
+outboundQueueType(OutboundQueuePriorityHeap),
+inboundMessageHandler(0), workerThreadMessageHandler(0), inboundDeficit(0), multicastGroup(0), socket(socket_), awaitedTransport(InvalidTransportLayer),
 bOutboundSendsPaused(false), 
+sendCoalescingDelay(0), sendCoalescingBytes(1400), sendCoalescingUrgentPriority(NetworkMessage::cMaxPriority - 1),
+acceptedOutboundBytes(0), queuedOutboundPriority(0),
+compressionEnabled(false), compressionThreshold(64),
+compressionDictionaryVersion(0), appliedCompressionDictionaryVersion(0), compressionOfferSent(false),
+peerCompressionCodecs(0), peerCompressionDictionaryID(0),
+maxBytesSendRate(0), maxDatagramsSendRate(0), numExpiredMessages(0),
+inboundMessagesEventEnabled(0), inboundMessagesEventSignalled(0), inboundMessagesQueued(false), transferProgressQueued(false), establishedSignalPending(false),
+serverReadySlot(-1), inServerReadyList(0), queuedForReclamation(false),
 rtt(0.f), 
 lastHeardTime(Clock::Tick()), 
-packetsInPerSec(0), packetsOutPerSec(0), 
-msgsInPerSec(0), msgsOutPerSec(0),
-bytesInPerSec(0), bytesOutPerSec(0), 
-bytesInTotal(0), bytesOutTotal(0),
+inboundReceiveTick(0),
+idleTimeout(defaultIdleTimeout), idle(false), lastActivityTick(Clock::Tick()),
+samples(new TrafficSamples),
+bytesInTotal(0), bytesOutTotal(0), packetsInTotal(0), packetsOutTotal(0),
 outboundMessageNumberCounter(0),
 outboundReliableMessageNumberCounter(0)
 {
 	connectionState = startingState;
 	networkSendSimulator.owner = this;
+	networkReceiveSimulator.owner = this;
 
 	eventMsgsOutAvailable = CreateNewEvent(EventWaitSignal);
 	assert(eventMsgsOutAvailable.IsValid());
@@ -124,15 +159,18 @@ MessageConnection::~MessageConnection()
 	assert(ownerServer == 0);
 	assert(workerThread == 0);
 
+	LeaveMulticastGroup();
 	FreeMessageData();
 	eventMsgsOutAvailable.Close();
+	if (inboundMessagesEventEnabled)
+		eventInboundMessagesAvailable.Close();
 }
 
 ConnectionState MessageConnection::GetConnectionState() const
 {
-	// If we have now low-level socket at all, we have been already deinitialized.
+	// If we have now low-level socket at all, we have been already deinitialized, unless the socket is still being connected.
 	if (!socket)
-		return ConnectionClosed;
+		return AwaitingSocket() ? ConnectionPending : ConnectionClosed;
 	// If the connection is still pending, socket is not read or write open, but we should not think
 	// the connection is closed though.
 	if (connectionState == ConnectionPending)
@@ -167,7 +205,7 @@ bool MessageConnection::IsWriteOpen() const
 bool MessageConnection::IsPending() const
 {
 	if (!socket)
-		return false;
+		return AwaitingSocket();
 	return GetConnectionState() == ConnectionPending;
 }
 
@@ -195,7 +233,11 @@ bool MessageConnection::WaitToEstablishConnection(int maxMSecsToWait)
 
 	PolledTimer timer((float)maxMSecsToWait);
 	while(GetConnectionState() == ConnectionPending && !timer.Test())
+	{
+		if (AwaitingSocket() && owner)
+			owner->ProcessPendingConnects();
 		Clock::Sleep(1); ///\todo Instead of waiting multiple 1msec slices, should wait for proper event.
+	}
 
 	KNET_LOG(LogWaits, "MessageConnection::WaitToEstablishConnection: Waited %f msecs for connection. Result: %s.",
 		timer.MSecsElapsed(), ConnectionStateToString(GetConnectionState()).c_str());
@@ -250,11 +292,16 @@ void MessageConnection::Close(int maxMSecsToWait) // [main thread]
 
 	if (owner)
 	{
+		// Let the server notice that the connection is gone without waiting for its sweep of all the connections.
+		AddToServerReadyList();
 		KNET_LOG(LogInfo, "MessageConnection::Close: Closed connection to %s.", ToString().c_str());
 		owner->CloseConnection(this); // This will cause this connection to be disconnected of its worker thread, so that we can safely proceed to tear down the socket.
 		assert(!IsWorkerThreadRunning());
 		owner = 0;
 		ownerServer = 0;
+		packetCapture = 0;
+		egressScheduler = 0;
+		serverMalformedDatagrams = 0;
 	}
 
 	if (socket)
@@ -297,8 +344,9 @@ void MessageConnection::ResumeOutboundSends()
 	AssertInMainThreadContext();
 
 	bOutboundSendsPaused = false;
-	if (NumOutboundMessagesPending() > 0)
-		eventMsgsOutAvailable.Set();
+	// Wake up the worker thread even if no messages are queued, since a UDP connection opened with early data sends its
+	// connect datagram now.
+	eventMsgsOutAvailable.Set();
 }
 
 void MessageConnection::SetPeerClosed()
@@ -334,40 +382,36 @@ void MessageConnection::FreeMessageData() // [main thread]
 	Lockable<FragmentedSendManager>::LockType sends = fragmentedSends.Acquire();
 	sends->FreeAllTransfers();
 
-	fragmentedReceives.transfers.clear();
+	fragmentedReceives.FreeAllTransfers();
 
-	while(outboundAcceptQueue.Size() > 0)
+	while(outboundAcceptQueue.Front())
 	{
 		NetworkMessage *msg = outboundAcceptQueue.TakeFront();
-		delete msg;
+		NetworkMessagePool::Free(msg);
 	}
 
 	while(inboundMessageQueue.Size() > 0)
 	{
 		NetworkMessage *msg = inboundMessageQueue.TakeFront();
-		delete msg;
+		NetworkMessagePool::Free(msg);
 	}
 
-#ifdef KNET_NO_MAXHEAP
-	for(unsigned long i = 0; i < outboundQueue.Size(); ++i)
-		delete *outboundQueue.ItemAt(i);
-#else
-	for(int i = 0; i < outboundQueue.Size(); ++i)
-		delete outboundQueue.data[i];
-#endif
-
-	outboundQueue.Clear();
+	while(outboundQueue.Size() > 0)
+	{
+		NetworkMessagePool::Free(outboundQueue.Front());
+		outboundQueue.PopFront();
+	}
 
 	inboundContentIDStamps.clear();
 
-	outboundContentIDMessages.clear();
+	outboundContentIDMessages.Clear();
 
 	Lockable<ConnectionStatistics>::LockType stats_ = statistics.Acquire();
-	stats_->ping.clear();
-	stats_->recvPacketIDs.clear();
-	stats_->traffic.clear();
+	stats_->ClearPings();
+	samples->trafficStats.Clear();
 
 	networkSendSimulator.Free();
+	networkReceiveSimulator.Free();
 }
 
 void MessageConnection::DetectConnectionTimeOut()
@@ -386,6 +430,70 @@ void MessageConnection::DetectConnectionTimeOut()
 	}
 }
 
+tick_t MessageConnection::InboundReceiveTick(tick_t notBefore) const
+{
+	const tick_t now = Clock::Tick();
+	if (inboundReceiveTick == 0 || !Clock::IsNewer(inboundReceiveTick, notBefore) || !Clock::IsNewer(now, inboundReceiveTick))
+		return now;
+	return inboundReceiveTick;
+}
+
+void MessageConnection::MarkActivity()
+{
+	lastActivityTick = Clock::LoopTick();
+	if (!idle)
+		return;
+	idle = false;
+	// Ping and recompute the statistics right away, since they have not been kept up while idle.
+	pingTimer.Stop();
+	statsRefreshTimer.Stop();
+	KNET_LOG(LogVerbose, "Connection %s left the idle mode.", ToString().c_str());
+}
+
+void MessageConnection::UpdateIdleMode()
+{
+	AssertInWorkerThreadContext();
+
+	if (idleTimeout <= 0.f || connectionState != ConnectionOK)
+	{
+		if (idle)
+			MarkActivity();
+		return;
+	}
+	if (!idle && outboundQueue.Size() == 0 &&
+		Clock::TicksToMillisecondsF(Clock::TicksInBetween(Clock::LoopTick(), lastActivityTick)) >= idleTimeout)
+	{
+		idle = true;
+		KNET_LOG(LogVerbose, "Connection %s entered the idle mode.", ToString().c_str());
+	}
+}
+
+void MessageConnection::SendIdleKeepAlive()
+{
+	AssertInWorkerThreadContext();
+
+	if (!idle)
+		return;
+	if (!bOutboundSendsPaused)
+		SendPingRequestMessage(true);
+	DetectConnectionTimeOut();
+	if (connectionState == ConnectionOK && (!socket || !socket->IsReadOpen()))
+	{
+		KNET_LOG(LogInfo, "Peer closed connection.");
+		SetPeerClosed();
+	}
+}
+
+unsigned long MessageConnection::NextMessageNumber()
+{
+	return (unsigned long)AtomicIncrement(&outboundMessageNumberCounter) - 1;
+}
+
+unsigned long MessageConnection::NextReliableMessageNumber()
+{
+	return (unsigned long)AtomicIncrement(&outboundReliableMessageNumberCounter) - 1;
+}
+
 void MessageConnection::AcceptOutboundMessages() // [worker thread]
 {
 	AssertInWorkerThreadContext();
@@ -393,10 +501,9 @@ void MessageConnection::AcceptOutboundMessages() // [worker thread]
 	// If we are write-closed, discard all outbound messages from the client code, since we can't send them to the peer.
 	if (connectionState == ConnectionDisconnecting || connectionState == ConnectionClosed)
 	{
-		while(outboundAcceptQueue.Size() > 0)
+		while(outboundAcceptQueue.Front())
 		{
-			NetworkMessage *msg = *outboundAcceptQueue.Front();
-			outboundAcceptQueue.PopFront();
+			NetworkMessage *msg = outboundAcceptQueue.TakeFront();
 			KNET_LOG(LogVerbose, "Warning: Discarding outbound network message with ID %d, since the connection is write-closed.", 
 				msg->id);
 			// assert(!HaveOutboundMessageWithContentID(msg));
@@ -406,28 +513,70 @@ void MessageConnection::AcceptOutboundMessages() // [worker thread]
 
 //	assert(ContainerUniqueAndNoNullElements(outboundAcceptQueue));
 
+	// Switch over to the outbound queue structure the main thread has asked for.
+	if (outboundQueue.Type() != outboundQueueType)
+		outboundQueue.SetType(outboundQueueType);
+
+	if (outboundQueue.Size() == 0)
+	{
+		acceptedOutboundBytes = 0;
+		queuedOutboundPriority = 0;
+	}
+
 	// To throttle an over-eager main application, only accept this many messages from the main thread
 	// at each execution frame.
 	int numMessagesToAcceptPerFrame = 500;
 
-	// Empty the queue from messages that the main thread has submitted for sending.
-	while(outboundAcceptQueue.Size() > 0 && --numMessagesToAcceptPerFrame > 0)
+	// Empty the queue from messages that the main thread has submitted for sending. The messages are taken in batches,
+	// so that the main thread sees the queue head move only once per batch.
+	const int cAcceptBatchSize = 64;
+	NetworkMessage *batch[cAcceptBatchSize];
+	while(numMessagesToAcceptPerFrame > 0)
 	{
-		assert(outboundAcceptQueue.Front() != 0);
-		NetworkMessage *msg = *outboundAcceptQueue.Front();
-		outboundAcceptQueue.PopFront();
+		const int numMessages = outboundAcceptQueue.PopBatch(batch, std::min(cAcceptBatchSize, numMessagesToAcceptPerFrame));
+		if (numMessages == 0)
+			break;
+		numMessagesToAcceptPerFrame -= numMessages;
+		MarkActivity();
 
-#ifdef KNET_NO_MAXHEAP
-		outboundQueue.InsertWithResize(msg);
-#else
-		outboundQueue.Insert(msg);
-#endif
-		CheckAndSaveOutboundMessageWithContentID(msg);
+		for(int i = 0; i < numMessages; ++i)
+		{
+			NetworkMessage *msg = batch[i];
+			assert(msg);
+			acceptedOutboundBytes += msg->dataSize;
+			queuedOutboundPriority = std::max(queuedOutboundPriority, msg->priority);
+			if (!CheckAndSaveOutboundMessageWithContentID(msg))
+			{
+				MessageTracer::Record(msg->traceID, msg->id, TraceAccepted);
+				outboundQueue.Insert(msg);
+			}
+		}
 	}
 //	assert(ContainerUniqueAndNoNullElements(outboundQueue));
 //	assert(ContainerUniqueAndNoNullElements(outboundAcceptQueue));
 }
 
+unsigned long MessageConnection::TimerMSecsLeft(const PolledTimer &timer)
+{
+	return timer.Enabled() ? (unsigned long)ceil(timer.MSecsLeft()) : 0;
+}
+
+unsigned long MessageConnection::TimeUntilNextUpdate() const
+{
+	// An idle connection has no timers of its own. Its keepalives are sent by the sweep of the worker thread.
+	unsigned long msecs = idle ? (unsigned long)cIdleKeepAliveIntervalMSecs : TimerMSecsLeft(statsRefreshTimer);
+	if (connectionState == ConnectionOK && !idle)
+		msecs = min(msecs, TimerMSecsLeft(pingTimer));
+
+	float simulatorMSecs = networkSendSimulator.MSecsUntilNextTransfer();
+	if (simulatorMSecs >= 0.f)
+		msecs = min(msecs, (unsigned long)ceil(simulatorMSecs));
+	simulatorMSecs = networkReceiveSimulator.MSecsUntilNextTransfer();
+	if (simulatorMSecs >= 0.f)
+		msecs = min(msecs, (unsigned long)ceil(simulatorMSecs));
+	return msecs;
+}
+
 void MessageConnection::UpdateConnection() // [Called from the worker thread]
 {
 	AssertInWorkerThreadContext();
@@ -436,11 +585,16 @@ void MessageConnection::UpdateConnection() // [Called from the worker thread]
 		return;
 
 	AcceptOutboundMessages();
+	UpdateSendRateLimits();
+	UpdateCompression();
 
 	networkSendSimulator.Process();
+	networkReceiveSimulator.Process();
+
+	UpdateIdleMode();
 
 	// MessageConnection needs to automatically manage the sending of ping messages in an unreliable channel.
-	if (connectionState == ConnectionOK && pingTimer.TriggeredOrNotRunning())
+	if (connectionState == ConnectionOK && !idle && pingTimer.TriggeredOrNotRunning())
 	{
 		if (!bOutboundSendsPaused)
 			SendPingRequestMessage(true);
@@ -449,10 +603,14 @@ void MessageConnection::UpdateConnection() // [Called from the worker thread]
 	}
 
 	// Produce statistics back to the application about the current connection state.
-	if (statsRefreshTimer.TriggeredOrNotRunning())
+	if (!idle && statsRefreshTimer.TriggeredOrNotRunning())
 	{
 		ComputeStats();
 
+		// The sockets of a UDP server are shared by its connections, so the server tunes them instead.
+		if (socket && !socket->IsUDPSlaveSocket())
+			socket->TuneBufferSizes(BytesInPerSec(), BytesOutPerSec(), rtt);
+
 		// Check if the socket is dead and mark it read-closed.
 		if (connectionState == ConnectionOK || connectionState == ConnectionDisconnecting)
 			if (!socket || !socket->IsReadOpen())
@@ -472,6 +630,13 @@ void MessageConnection::UpdateConnection() // [Called from the worker thread]
 		ADDEVENT("bytesInTotal", (float)BytesInTotal(), "bytes");
 		ADDEVENT("bytesOutTotal", (float)BytesOutTotal(), "bytes");
 
+#ifdef KNET_NETWORK_PROFILING
+		MessageDataStatistics messageData = MessageDataAllocator::Statistics();
+		ADDEVENT("messageDataSlabBytes", (float)messageData.slabBytes, "bytes");
+		ADDEVENT("messageDataBlockBytesInUse", (float)messageData.blockBytesInUse, "bytes");
+		ADDEVENT("messageDataLargeBytesInUse", (float)messageData.largeBytesInUse, "bytes");
+#endif
+
 		statsRefreshTimer.StartMSecs(statsRefreshIntervalMSecs);
 	}
 
@@ -479,9 +644,11 @@ void MessageConnection::UpdateConnection() // [Called from the worker thread]
 	DoUpdateConnection();
 }
 
-NetworkMessage *MessageConnection::AllocateNewMessage()
+NetworkMessage *MessageConnection::AllocateNewMessage(MessageFrameArena *arena)
 {
-	NetworkMessage *msg = messagePool.New();
+	NetworkMessage *msg = arena ? arena->New() : 0;
+	if (!msg)
+		msg = NetworkMessagePool::New();
 	KNET_LOG(LogObjectAlloc, "MessageConnection::AllocateMessage %p!", msg);
 	return msg;
 }
@@ -493,17 +660,27 @@ void MessageConnection::FreeMessage(NetworkMessage *msg) // [main and worker thr
 
 	if (msg->transfer)
 	{
-		msg->transfer->RemoveMessage(msg);
+		// Let the manager free the transfer once its last fragment is gone.
+		Lock<FragmentedSendManager> sends = fragmentedSends.Acquire();
+		sends->RemoveMessage(msg->transfer, msg);
 		msg->transfer = 0;
 	}
 
 	KNET_LOG(LogObjectAlloc, "MessageConnection::FreeMessage %p!", msg);
-	messagePool.Free(msg);
+	NetworkMessagePool::Free(msg);
 }
 
-NetworkMessage *MessageConnection::StartNewMessage(unsigned long id, size_t numBytes)
+NetworkMessage *MessageConnection::StartNewSharedMessage(unsigned long id, DatagramBuffer *sharedData, const char *data, size_t numBytes)
 {
-	NetworkMessage *msg = AllocateNewMessage();
+	NetworkMessage *msg = StartNewMessage(id);
+	if (msg)
+		msg->AttachSharedData(sharedData, data, numBytes);
+	return msg;
+}
+
+NetworkMessage *MessageConnection::StartNewMessage(unsigned long id, size_t numBytes, MessageFrameArena *arena)
+{
+	NetworkMessage *msg = AllocateNewMessage(arena);
 	if (!msg)
 	{
 		KNET_LOG(LogError, "MessageConnection::SendMessage: StartNewMessage failed! Discarding message send.");
@@ -514,6 +691,8 @@ NetworkMessage *MessageConnection::StartNewMessage(unsigned long id, size_t numB
 	msg->reliable = false;
 	msg->contentID = 0;
 	msg->obsolete = false;
+	msg->traceID = MessageTracer::SampleMessage();
+	MessageTracer::Record(msg->traceID, id, TraceStarted);
 
 	// Give the new message the lowest priority by default.
 	msg->priority = 0;
@@ -533,8 +712,6 @@ NetworkMessage *MessageConnection::StartNewMessage(unsigned long id, size_t numB
 
 void MessageConnection::SplitAndQueueMessage(NetworkMessage *message, bool internalQueue, size_t maxFragmentSize)
 {
-	using namespace std;
-
 #ifdef KNET_THREAD_CHECKING_ENABLED
 	if (internalQueue)
 		AssertInWorkerThreadContext();
@@ -552,69 +729,82 @@ void MessageConnection::SplitAndQueueMessage(NetworkMessage *message, bool inter
 	KNET_LOG(LogVerbose, "Splitting a message of %db into %d fragments of %db size at most.",
 		(int)message->dataSize, (int)totalNumFragments, (int)maxFragmentSize);
 
-/** \todo Would like to do this:
-	FragmentedSendManager::FragmentedTransfer *transfer;
-	{
-		Lock<FragmentedSendManager> sends = fragmentedSends.Acquire();
-		transfer = sends->AllocateNewFragmentedTransfer();
-	}
-*/
-	// But instead, have to resort to function-wide lock.
 	Lock<FragmentedSendManager> sends = fragmentedSends.Acquire();
 	FragmentedSendManager::FragmentedTransfer *transfer = sends->AllocateNewFragmentedTransfer();
-
-	size_t currentFragmentIndex = 0;
-	size_t byteOffset = 0;
-
 	assert(transfer != 0);
 	transfer->totalNumFragments = totalNumFragments;
+	transfer->fragmentSize = maxFragmentSize;
+	transfer->totalBytes = message->dataSize;
 
 	if (!message->reliable)
 	{
 		KNET_LOG(LogVerbose, "Upgraded a nonreliable message with ID %d and size %d to a reliable message since it had to be fragmented!", (int)message->id, (int)message->dataSize);
 	}
 
-	if (message->contentID != 0)
-	{
-		KNET_LOG(LogVerbose, "Warning: Content IDs are not supported with fragmented transfers. Removing the content ID %d of message %d of size %d.",
-			(int)message->contentID, (int)message->id, (int)message->Size());
-		message->contentID = 0;
-	}
+	// The transfer carries the content ID of the message. The fragments don't have one of their own, since they never replace each other.
+	transfer->messageID = message->id;
+	transfer->contentID = message->contentID;
+	transfer->orderingChannel = message->orderingChannel;
+
+	// The transfer keeps the message, and cuts the rest of the fragments from it as the peer acks the first ones.
+	transfer->source = message;
+	transfer->ackHandler = message->ackHandler;
+	message->ackHandler = 0;
+	QueueNextFragments(transfer, FragmentedSendManager::cMinSendWindowBytes, internalQueue);
+
+	// Signal the worker thread that there are new outbound events available.
+	if (!bOutboundSendsPaused)
+		eventMsgsOutAvailable.Set();
+}
+
+void MessageConnection::QueueNextFragments(FragmentedSendManager::FragmentedTransfer *transfer, size_t maxBytesOutstanding, bool internalQueue)
+{
+	using namespace std;
+
+	Lock<FragmentedSendManager> sends = fragmentedSends.Acquire();
+	assert(transfer);
+
+	NetworkMessage *message = transfer->source;
+	if (!message)
+		return;
 
-	// Split the message into fragments.
-	while(byteOffset < message->dataSize)
+	// Always create at least one fragment, so that a transfer makes progress even if it doesn't get to fill the window.
+	do
 	{
-		const size_t thisFragmentSize = min(maxFragmentSize, message->dataSize - byteOffset);
+		const size_t byteOffset = transfer->numFragmentsCreated * transfer->fragmentSize;
+		const size_t thisFragmentSize = min(transfer->fragmentSize, message->dataSize - byteOffset);
+
+		// The fragments of a shared message refer to the same shared bytes. Otherwise, copy the data from the old message
+		// that's supposed to go into this fragment.
+		NetworkMessage *fragment;
+		if (message->sharedData)
+			fragment = StartNewSharedMessage(message->id, message->sharedData, message->data + byteOffset, thisFragmentSize);
+		else
+		{
+			fragment = StartNewMessage(message->id, thisFragmentSize);
+			memcpy(fragment->data, message->data + byteOffset, thisFragmentSize);
+		}
 
-		NetworkMessage *fragment = StartNewMessage(message->id, thisFragmentSize);
-		fragment->contentID = message->contentID;
 		fragment->inOrder = message->inOrder;
+		fragment->orderingChannel = message->orderingChannel;
 		fragment->reliable = true; // We don't send fragmented messages as unreliable messages - the risk of a fragment getting lost wastes bandwidth.
-		fragment->messageNumber = outboundMessageNumberCounter++; ///\todo Convert to atomic increment, or this is a race condition.
+		fragment->messageNumber = NextMessageNumber();
+		fragment->queuedTick = Clock::Tick(); // The fragments are cut as the window opens up, and wait in the queue only from then on.
 		fragment->priority = message->priority;
 		fragment->sendCount = 0;
 
-		fragment->transfer = transfer;
-		fragment->fragmentIndex = currentFragmentIndex++;
-		fragment->reliableMessageNumber = outboundReliableMessageNumberCounter++; ///\todo Convert to atomic increment, or this is a race condition.
+		fragment->fragmentIndex = transfer->numFragmentsCreated++;
+		fragment->reliableMessageNumber = NextReliableMessageNumber();
 #ifdef KNET_NETWORK_PROFILING
 		fragment->profilerName = message->profilerName + "_Fragment";
 #endif
 
-		// Copy the data from the old message that's supposed to go into this fragment.
-		memcpy(fragment->data, message->data + byteOffset, thisFragmentSize);
-		byteOffset += thisFragmentSize;
-
 		transfer->AddMessage(fragment);
 
 		if (internalQueue) // if true, we are accessing from the worker thread, and can directly access the outboundQueue member.
 		{
 //			assert(ContainerUniqueAndNoNullElements(outboundQueue));
-#ifdef KNET_NO_MAXHEAP
-			outboundQueue.InsertWithResize(fragment);
-#else
 			outboundQueue.Insert(fragment);
-#endif
 //			assert(ContainerUniqueAndNoNullElements(outboundQueue));
 		}
 		else
@@ -626,33 +816,56 @@ void MessageConnection::SplitAndQueueMessage(NetworkMessage *message, bool inter
 				assert(false);
 			}
 		}
-	}
-
-	// Signal the worker thread that there are new outbound events available.
-	if (!bOutboundSendsPaused)
-		eventMsgsOutAvailable.Set();
+	} while(transfer->numFragmentsCreated < transfer->totalNumFragments && transfer->bytesOutstanding < maxBytesOutstanding);
 
-	// The original message that was split into fragments is no longer needed - it is represented by the newly created fragments
+	// The original message that was split into fragments is no longer needed once all of it is represented by the fragments
 	// that have now been queued.
-	FreeMessage(message);
+	if (transfer->numFragmentsCreated == transfer->totalNumFragments)
+	{
+		NetworkMessagePool::Free(message);
+		transfer->source = 0;
+	}
 }
 
-void MessageConnection::EndAndQueueMessage(NetworkMessage *msg, size_t numBytes, bool internalQueue)
+void MessageConnection::ReportOutboundTransferProgress(FragmentedSendManager::FragmentedTransfer &transfer, size_t numBytesAcked)
 {
-#ifdef KNET_THREAD_CHECKING_ENABLED
-	if (internalQueue)
-		AssertInWorkerThreadContext();
-	else
-		AssertInMainThreadContext();
-#endif
+	AssertInWorkerThreadContext();
+
+	transfer.bytesAcked += numBytesAcked;
+	if (transfer.bytesAcked == transfer.totalBytes && transfer.ackHandler)
+	{
+		IMessageAckHandler *handler = transfer.ackHandler;
+		transfer.ackHandler = 0;
+		handler->HandleMessageAcked(transfer.messageID, MessageDelivered);
+	}
+
+	// Report in steps of 1/16th of the message, so that a large transfer doesn't post a report for each of its fragments.
+	if (transfer.bytesAcked != transfer.totalBytes && (transfer.bytesAcked - transfer.bytesAckedReported) * 16 < transfer.totalBytes)
+		return;
+
+	OutboundTransferProgress progress;
+	progress.messageID = transfer.messageID;
+	progress.contentID = transfer.contentID;
+	progress.bytesAcked = transfer.bytesAcked;
+	progress.totalBytes = transfer.totalBytes;
+	// If the main thread falls behind, the report is skipped. The next one will carry a larger bytesAcked.
+	if (transferProgressQueue.Insert(progress))
+	{
+		transfer.bytesAckedReported = transfer.bytesAcked;
+		transferProgressQueued = true;
+	}
+}
 
+bool MessageConnection::PrepareOutboundMessage(NetworkMessage *msg, size_t numBytes, bool internalQueue)
+{
 	assert(msg);
 	if (!msg)
-		return;
+		return false;
 
-	// If the message was marked obsolete to start with, discard it.
-	if (msg->obsolete || !socket || GetConnectionState() == ConnectionClosed || !socket->IsWriteOpen() || 
-		(internalQueue == false && !IsWriteOpen()))
+	// If the message was marked obsolete to start with, discard it. A connection that waits for its socket keeps the
+	// messages queued until it has one.
+	const bool writeOpen = socket ? (socket->IsWriteOpen() && (internalQueue || IsWriteOpen())) : AwaitingSocket();
+	if (msg->obsolete || GetConnectionState() == ConnectionClosed || !writeOpen)
 	{
 		KNET_LOG(LogVerbose, "MessageConnection::EndAndQueueMessage: Discarded message with ID 0x%X and size %d bytes. "
 			"msg->obsolete: %d. socket ptr: %p. ConnectionState: %s. socket->IsWriteOpen(): %s. msgconn->IsWriteOpen: %s. "
@@ -660,7 +873,7 @@ void MessageConnection::EndAndQueueMessage(NetworkMessage *msg, size_t numBytes,
 			(int)msg->id, (int)numBytes, (int)msg->obsolete, socket, ConnectionStateToString(GetConnectionState()).c_str(), (socket && socket->IsWriteOpen()) ? "true" : "false",
 			IsWriteOpen() ? "true" : "false", internalQueue ? "true" : "false");
 		FreeMessage(msg);
-		return;
+		return false;
 	}
 
 	// Remember the amount of bytes the client said to be using for later.
@@ -675,31 +888,55 @@ void MessageConnection::EndAndQueueMessage(NetworkMessage *msg, size_t numBytes,
 			(int)msg->dataSize, (int)msg->Capacity());
 	}
 
+	// Put the message on the ordering channel of its ID, unless the application picked one already.
+	if (!internalQueue && msg->orderingChannel == 0 && !messageOrderingChannels.empty())
+	{
+		std::map<message_id_t, u8>::const_iterator iter = messageOrderingChannels.find(msg->id);
+		if (iter != messageOrderingChannels.end())
+			msg->orderingChannel = iter->second;
+	}
+
 	// Check if the message is too big - in that case we split it into fixed size fragments and add them into the queue.
 	///\todo We can optimize here by doing the splitting at datagram creation time to create optimally sized datagrams, but
 	/// it is quite more complicated, so left for later. 
 	const size_t sendHeaderUpperBound = 32; // Reserve some bytes for the packet and message headers. (an approximate upper bound)
-	if (msg->dataSize + sendHeaderUpperBound > socket->MaxSendSize() && socket->TransportLayer() == SocketOverUDP)
+	const size_t maxDatagramSize = MaxDatagramSize();
+	const SocketTransportLayer transport = socket ? socket->TransportLayer() : awaitedTransport;
+	if (transport == SocketOverUDP && 
+		(msg->dataSize + sendHeaderUpperBound > maxDatagramSize || msg->dataSize > cMaxUDPMessageFragmentSize))
 	{
-		const size_t maxFragmentSize = socket->MaxSendSize() / 4 - sendHeaderUpperBound; ///\todo Check this is ok.
-		assert(maxFragmentSize > 0 && maxFragmentSize < socket->MaxSendSize());
+		const size_t maxFragmentSize = min(maxDatagramSize / 4 - sendHeaderUpperBound, cMaxUDPMessageFragmentSize); ///\todo Check this is ok.
+		assert(maxFragmentSize > 0 && maxFragmentSize < maxDatagramSize);
 		SplitAndQueueMessage(msg, internalQueue, maxFragmentSize);
-		return;
+		return false;
 	}
 
-	msg->messageNumber = outboundMessageNumberCounter++; ///\todo Convert to atomic increment, or this is a race condition.
-	msg->reliableMessageNumber = (msg->reliable ? outboundReliableMessageNumberCounter++ : 0); ///\todo Convert to atomic increment, or this is a race condition.
+	msg->messageNumber = NextMessageNumber();
+	msg->reliableMessageNumber = (msg->reliable ? NextReliableMessageNumber() : 0);
 	msg->sendCount = 0;
+	msg->queuedTick = Clock::Tick();
+	MessageTracer::Record(msg->traceID, msg->id, TraceQueued);
+	return true;
+}
+
+void MessageConnection::EndAndQueueMessage(NetworkMessage *msg, size_t numBytes, bool internalQueue)
+{
+#ifdef KNET_THREAD_CHECKING_ENABLED
+	if (internalQueue)
+		AssertInWorkerThreadContext();
+	else
+		AssertInMainThreadContext();
+#endif
+
+	if (!PrepareOutboundMessage(msg, numBytes, internalQueue))
+		return;
 
 	if (internalQueue) // if true, we are accessing from the worker thread, and can directly access the outboundQueue member.
 	{
 		KNET_LOG(LogVerbose, "MessageConnection::EndAndQueueMessage: Internal-queued message of size %d bytes and ID 0x%X.", (int)msg->Size(), (int)msg->id);
 //		assert(ContainerUniqueAndNoNullElements(outboundQueue));
-#ifdef KNET_NO_MAXHEAP
-		outboundQueue.InsertWithResize(msg);
-#else
 		outboundQueue.Insert(msg);
-#endif
+		queuedOutboundPriority = std::max(queuedOutboundPriority, msg->priority);
 //		assert(ContainerUniqueAndNoNullElements(outboundQueue));
 	}
 	else
@@ -723,8 +960,83 @@ void MessageConnection::EndAndQueueMessage(NetworkMessage *msg, size_t numBytes,
 		eventMsgsOutAvailable.Set();
 }
 
+void MessageConnection::QueueBroadcastMessage(NetworkMessage *msg)
+{
+	AssertInWorkerThreadContext();
+
+	if (msg->orderingChannel == 0 && !messageOrderingChannels.empty())
+	{
+		std::map<message_id_t, u8>::const_iterator iter = messageOrderingChannels.find(msg->id);
+		if (iter != messageOrderingChannels.end())
+			msg->orderingChannel = iter->second;
+	}
+
+	if (!PrepareOutboundMessage(msg, (size_t)(-1), true))
+		return;
+
+	acceptedOutboundBytes += msg->dataSize;
+	queuedOutboundPriority = std::max(queuedOutboundPriority, msg->priority);
+	if (!CheckAndSaveOutboundMessageWithContentID(msg))
+	{
+		MessageTracer::Record(msg->traceID, msg->id, TraceAccepted);
+		outboundQueue.Insert(msg);
+	}
+
+	if (!bOutboundSendsPaused)
+		eventMsgsOutAvailable.Set();
+}
+
+OutboundMessageBatch::~OutboundMessageBatch()
+{
+	for(size_t i = 0; i < messages.size(); ++i)
+		NetworkMessagePool::Free(messages[i]);
+}
+
+void MessageConnection::AddMessageToBatch(OutboundMessageBatch &batch, NetworkMessage *msg, size_t numBytes)
+{
+	AssertInMainThreadContext();
+
+	if (PrepareOutboundMessage(msg, numBytes, false))
+		batch.messages.push_back(msg);
+}
+
+void MessageConnection::CommitMessageBatch(OutboundMessageBatch &batch)
+{
+	AssertInMainThreadContext();
+
+	if (batch.messages.empty())
+		return;
+
+	size_t numQueued = 0;
+	while(numQueued < batch.messages.size())
+	{
+		const int numInserted = outboundAcceptQueue.InsertBatch(&batch.messages[numQueued], (int)(batch.messages.size() - numQueued));
+		if (numInserted == 0)
+			break;
+		numQueued += numInserted;
+	}
+
+	// The messages that didn't fit are handled like EndAndQueueMessage() handles a full queue.
+	for(size_t i = numQueued; i < batch.messages.size(); ++i)
+	{
+		NetworkMessage *msg = batch.messages[i];
+		if (msg->reliable)
+		{
+			KNET_LOG(LogVerbose, "Critical: Failed to add new reliable message to outboundAcceptQueue! Queue was full. Discarding the message!");
+			assert(false);
+		}
+		FreeMessage(msg);
+	}
+	KNET_LOG(LogData, "MessageConnection::CommitMessageBatch: Queued %d messages.", (int)numQueued);
+	batch.messages.clear();
+
+	// Wake up the worker thread once for the whole batch.
+	if (numQueued > 0 && !bOutboundSendsPaused)
+		eventMsgsOutAvailable.Set();
+}
+
 void MessageConnection::SendMessage(unsigned long id, bool reliable, bool inOrder, unsigned long priority, 
-                                    unsigned long contentID, const char *data, size_t numBytes)
+                                    unsigned long contentID, const char *data, size_t numBytes, unsigned long expiryMSecs)
 {
 	AssertInMainThreadContext();
 
@@ -738,12 +1050,64 @@ void MessageConnection::SendMessage(unsigned long id, bool reliable, bool inOrde
 	msg->inOrder = inOrder;
 	msg->priority = priority;
 	msg->contentID = contentID;
+	msg->SetExpiry(expiryMSecs);
 	assert(msg->data);
 	assert(msg->Size() == numBytes);
 	memcpy(msg->data, data, numBytes);
 	EndAndQueueMessage(msg);
 }
 
+void MessageConnection::SendBuffer(unsigned long id, bool reliable, bool inOrder, unsigned long priority,
+                                   unsigned long contentID, const char *data, size_t numBytes, IBufferReleaseHandler *releaseHandler,
+                                   unsigned long expiryMSecs)
+{
+	AssertInMainThreadContext();
+	assert(releaseHandler);
+
+	DatagramBuffer *buffer = DatagramBuffer::WrapExternal(data, numBytes, releaseHandler);
+	NetworkMessage *msg = StartNewSharedMessage(id, buffer, data, numBytes);
+	buffer->Release(); // The message holds the only reference now, so the buffer is handed back once the message is done with.
+	if (!msg)
+		return;
+
+	msg->reliable = reliable;
+	msg->inOrder = inOrder;
+	msg->priority = priority;
+	msg->contentID = contentID;
+	msg->SetExpiry(expiryMSecs);
+	EndAndQueueMessage(msg);
+}
+
+bool MessageConnection::SendFile(unsigned long id, const char *filename, unsigned long priority, bool inOrder)
+{
+	AssertInMainThreadContext();
+
+	DatagramBuffer *file = DatagramBuffer::MapFileForReading(filename);
+	if (!file)
+	{
+		KNET_LOG(LogError, "MessageConnection::SendFile: Failed to map file \"%s\"! Discarding message send.", filename);
+		return false;
+	}
+	NetworkMessage *msg = StartNewSharedMessage(id, file, file->Data(), file->Capacity());
+	file->Release(); // The message holds the only reference now, and the fragments cut from it take their own.
+	if (!msg)
+		return false;
+
+	KNET_LOG(LogVerbose, "MessageConnection::SendFile: Sending file \"%s\" of %d bytes as a message with ID %d.", filename, (int)msg->Size(), (int)id);
+	msg->reliable = true;
+	msg->inOrder = inOrder;
+	msg->priority = priority;
+	EndAndQueueMessage(msg);
+	return true;
+}
+
+void MessageConnection::ReceiveFile(unsigned long id, const char *filename)
+{
+	AssertInMainThreadContext();
+
+	fragmentedReceives.SetFileDestination(id, filename);
+}
+
 /// Called from the main thread to fetch & handle all new inbound messages.
 void MessageConnection::Process(int maxMessagesToProcess)
 {
@@ -751,57 +1115,255 @@ void MessageConnection::Process(int maxMessagesToProcess)
 
 	assert(maxMessagesToProcess >= 0);
 
-	// Check the status of the connection worker thread.
-	if (connectionState == ConnectionClosed || !socket || !socket->Connected())
-	{
-		if (socket)
-			Close(); ///\todo This will block, since it is called with the default time period.
-		connectionState = ConnectionClosed;
+	if (!ProcessConnectionState())
 		return;
-	}
 
 	// The number of messages we are willing to process this cycle. If there are fewer messages than this 
 	// to process, we will return immediately (won't wait for this many messages to actually be received, it is just an upper limit).
 	int numMessagesLeftToProcess = maxMessagesToProcess;
 
-	while(inboundMessageQueue.Size() > 0 && (numMessagesLeftToProcess-- > 0 || maxMessagesToProcess == 0))
+	// The messages are taken off the queue in batches, so that the worker thread sees the queue head move only once per batch.
+	NetworkMessage *batch[cProcessBatchSize];
+	while(numMessagesLeftToProcess > 0 || maxMessagesToProcess == 0)
 	{
-		if (!inboundMessageHandler)
+		if (!inboundMessageHandler && messageDispatchTable.empty())
 		{
-			KNET_LOG(LogVerbose, "Warning! Cannot process messages since no message handler registered to connection %s!",
-				ToString().c_str());
+			if (inboundMessageQueue.Size() > 0)
+				KNET_LOG(LogVerbose, "Warning! Cannot process messages since no message handler registered to connection %s!",
+					ToString().c_str());
 			return;
 		}
 
-		NetworkMessage **message = inboundMessageQueue.Front();
-		assert(message);
-		NetworkMessage *msg = *message;
-		inboundMessageQueue.PopFront();
-		assert(msg);
-
-		inboundMessageHandler->HandleMessage(this, msg->receivedPacketID, msg->id, (msg->dataSize > 0) ? msg->data : 0, msg->dataSize);
+		const int maxBatchSize = (maxMessagesToProcess == 0) ? cProcessBatchSize : std::min(cProcessBatchSize, numMessagesLeftToProcess);
+		const int numMessages = inboundMessageQueue.PopBatch(batch, maxBatchSize);
+		if (numMessages == 0)
+			break;
+		numMessagesLeftToProcess -= numMessages;
 
-		FreeMessage(msg);
+		DispatchInboundMessages(batch, numMessages);
 	}
+
+	ResetInboundMessagesEventIfEmpty();
 }
 
-void MessageConnection::WaitForMessage(int maxMSecsToWait) // [main thread]
+void MessageConnection::ProcessFor(int maxMicroseconds)
 {
 	AssertInMainThreadContext();
 
-	// If we have a message to process, no need to wait.
-	if (inboundMessageQueue.Size() > 0)
+	assert(maxMicroseconds >= 0);
+	const tick_t deadline = Clock::Tick() + Clock::TicksPerSec() * (tick_t)maxMicroseconds / 1000000;
+
+	if (!ProcessConnectionState())
 		return;
 
-	// Check the status of the connection worker thread.
-	if (connectionState == ConnectionClosed)
+	size_t budget = (size_t)-1;
+	DispatchInboundBudget(budget, deadline);
+
+	ResetInboundMessagesEventIfEmpty();
+}
+
+bool MessageConnection::ProcessConnectionState()
+{
+	// A connection started with Network::ConnectAsync() has nothing to process until its socket is connected.
+	if (AwaitingSocket() && owner)
 	{
-		if (socket)
-			Close();
-		return;
+		owner->ProcessPendingConnects();
+		if (AwaitingSocket())
+			return false;
 	}
 
-	// Wait indefinitely until we get a new message, or the connection is torn down.
+	// Check the status of the connection worker thread.
+	if (connectionState == ConnectionClosed || !socket || !socket->Connected())
+	{
+		if (socket)
+			Close(); ///\todo This will block, since it is called with the default time period.
+		connectionState = ConnectionClosed;
+		return false;
+	}
+
+	while(transferProgressQueue.Size() > 0)
+	{
+		const OutboundTransferProgress progress = *transferProgressQueue.Front();
+		transferProgressQueue.PopFront();
+		if (inboundMessageHandler)
+			inboundMessageHandler->HandleOutboundTransferProgress(this, progress.messageID, progress.contentID, progress.bytesAcked, progress.totalBytes);
+	}
+
+	ProcessMulticastGroup();
+	return true;
+}
+
+/// Takes the inbound messages off the queue while their costs fit in the budget. See MessageConnection::DispatchInboundBudget().
+struct TakeWithinBudget
+{
+	TakeWithinBudget(size_t &budget_, size_t minCost_):budget(budget_), minCost(minCost_) {}
+
+	size_t &budget;
+	size_t minCost;
+
+	bool operator()(NetworkMessage *msg) const
+	{
+		const size_t cost = std::max(msg->Size(), minCost);
+		if (cost > budget)
+			return false;
+		budget -= cost;
+		return true;
+	}
+};
+
+bool MessageConnection::DispatchInboundBudget(size_t &budget, tick_t deadline)
+{
+	NetworkMessage *batch[cProcessBatchSize];
+	for(;;)
+	{
+		if (!inboundMessageHandler && messageDispatchTable.empty())
+			return false;
+
+		const int numMessages = inboundMessageQueue.PopBatchWhile(batch, cProcessBatchSize, TakeWithinBudget(budget, cMinMessageDispatchCost));
+		if (numMessages > 0)
+			DispatchInboundMessages(batch, numMessages);
+		if (numMessages == 0 || Clock::IsNewer(Clock::Tick(), deadline))
+			return inboundMessageQueue.Size() > 0;
+	}
+}
+
+void MessageConnection::DispatchInboundMessages(NetworkMessage **messages, int numMessages)
+{
+	InboundMessage span[cProcessBatchSize];
+	assert(numMessages <= cProcessBatchSize);
+
+	// The handlers are looked up for each message, since a handler can change the registrations while it is called.
+	for(int i = 0; i < numMessages;)
+	{
+		NetworkMessage *msg = messages[i];
+		assert(msg);
+		const MessageDispatchEntry *entry = DispatchEntry(msg->id);
+
+		if (entry && entry->batchHandler)
+		{
+			IMessageBatchHandler *batchHandler = entry->batchHandler;
+			int numInSpan = 0;
+			while(i + numInSpan < numMessages && messages[i + numInSpan]->id == msg->id)
+			{
+				NetworkMessage *spanMsg = messages[i + numInSpan];
+				span[numInSpan].packetId = spanMsg->receivedPacketID;
+				span[numInSpan].data = (spanMsg->dataSize > 0) ? spanMsg->data : 0;
+				span[numInSpan].numBytes = spanMsg->dataSize;
+				MessageTracer::Record(spanMsg->traceID, spanMsg->id, TraceDelivered);
+				++numInSpan;
+			}
+			batchHandler->HandleMessageBatch(this, msg->id, span, numInSpan);
+			for(int j = 0; j < numInSpan; ++j)
+				FreeMessage(messages[i + j]);
+			i += numInSpan;
+			continue;
+		}
+
+		IMessageHandler *handler = (entry && entry->handler) ? entry->handler : inboundMessageHandler;
+		// The handler can unregister itself while the batch is delivered. The rest of the batch has no one to go to then.
+		if (handler)
+		{
+			MessageTracer::Record(msg->traceID, msg->id, TraceDelivered);
+			handler->HandleMessage(this, msg->receivedPacketID, msg->id, (msg->dataSize > 0) ? msg->data : 0, msg->dataSize);
+		}
+		else
+			KNET_LOG(LogVerbose, "Warning! Discarding message with ID %d, since connection %p has no message handler for it.", (int)msg->id, this);
+
+		FreeMessage(msg);
+		++i;
+	}
+}
+
+bool MessageConnection::JoinMulticastGroup(const char *groupAddress, unsigned short port)
+{
+	AssertInMainThreadContext();
+
+	LeaveMulticastGroup();
+	if (!socket)
+	{
+		KNET_LOG(LogError, "MessageConnection::JoinMulticastGroup: The connection has no socket, so the address of the server is not known!");
+		return false;
+	}
+	EndPoint group;
+	if (!groupAddress || !HostResolver::ResolveBlocking(groupAddress, group))
+	{
+		KNET_LOG(LogError, "MessageConnection::JoinMulticastGroup: Could not resolve the group address %s!", groupAddress ? groupAddress : "(null)");
+		return false;
+	}
+	group.port = port;
+
+	// A server on this host sends its multicast datagrams from the address of the interface they go out of.
+	EndPoint sender = RemoteEndPoint();
+	if (sender.ip[0] == 127)
+		sender = EndPoint();
+	sender.port = 0;
+
+	MulticastChannel *channel = new MulticastChannel();
+	if (!channel->Join(group, sender))
+	{
+		delete channel;
+		return false;
+	}
+	multicastGroup = channel;
+	return true;
+}
+
+void MessageConnection::LeaveMulticastGroup()
+{
+	delete multicastGroup;
+	multicastGroup = 0;
+}
+
+void MessageConnection::ProcessMulticastGroup()
+{
+	MulticastChannel *group = multicastGroup;
+	for(int i = 0; i < cMaxMulticastDatagramsPerProcess && group && group->ReceiveDatagram(); ++i)
+	{
+		const std::vector<MulticastChannel::ReceivedMessage> &messages = group->ReceivedMessages();
+		for(size_t j = 0; j < messages.size(); ++j)
+		{
+			const MulticastChannel::ReceivedMessage &msg = messages[j];
+			const char *data = (msg.numBytes > 0) ? msg.data : 0;
+			const MessageDispatchEntry *entry = DispatchEntry(msg.id);
+			if (entry && entry->batchHandler)
+			{
+				InboundMessage span;
+				span.packetId = 0;
+				span.data = data;
+				span.numBytes = msg.numBytes;
+				entry->batchHandler->HandleMessageBatch(this, msg.id, &span, 1);
+			}
+			else
+			{
+				IMessageHandler *handler = (entry && entry->handler) ? entry->handler : inboundMessageHandler;
+				if (handler)
+					handler->HandleMessage(this, 0, msg.id, data, msg.numBytes);
+			}
+
+			// The handler can leave the group, which frees the datagram.
+			if (multicastGroup != group)
+				return;
+		}
+	}
+}
+
+void MessageConnection::WaitForMessage(int maxMSecsToWait) // [main thread]
+{
+	AssertInMainThreadContext();
+
+	// If we have a message to process, no need to wait.
+	if (inboundMessageQueue.Size() > 0)
+		return;
+
+	// Check the status of the connection worker thread.
+	if (connectionState == ConnectionClosed)
+	{
+		if (socket)
+			Close();
+		return;
+	}
+
+	// Wait indefinitely until we get a new message, or the connection is torn down.
 	if (maxMSecsToWait == 0)
 	{
 		///\todo Log out warning if this takes AGES. Or rather, perhaps remove support for this altogether
@@ -842,15 +1404,92 @@ NetworkMessage *MessageConnection::ReceiveMessage(int maxMSecsToWait) // [main t
 
 	// Did we get a message even after the max timeout?
 	if (inboundMessageQueue.Size() == 0)
+	{
+		ResetInboundMessagesEventIfEmpty(); // The event may have been set for the connection being established.
 		return 0;
+	}
 
 	NetworkMessage *message = *inboundMessageQueue.Front();
 	inboundMessageQueue.PopFront();
 	assert(message);
+	MessageTracer::Record(message->traceID, message->id, TraceDelivered);
+	ResetInboundMessagesEventIfEmpty();
 
 	return message;
 }
 
+/// Returns true if no more messages will be received in the given state, which InboundMessagesEvent() is kept set in. A
+/// UDP connection the peer has sent a Disconnect on stays in ConnectionDisconnecting, but has its socket read-closed.
+static bool IsPeerClosedOrClosed(ConnectionState state, const Socket *socket)
+{
+	return state == ConnectionPeerClosed || state == ConnectionClosed || (socket && !socket->IsReadOpen());
+}
+
+Event MessageConnection::InboundMessagesEvent()
+{
+	AssertInMainThreadContext();
+
+	if (!inboundMessagesEventEnabled)
+	{
+		eventInboundMessagesAvailable = CreateNewEvent(EventWaitSignal);
+		inboundMessagesEventSignalled = 1;
+		eventInboundMessagesAvailable.Set(); // The messages received so far may have been missed. If there are none, the next Process() resets this.
+		FullMemoryBarrier();
+		inboundMessagesEventEnabled = 1;
+	}
+	return eventInboundMessagesAvailable;
+}
+
+void MessageConnection::SignalMainThreadWork()
+{
+	AssertInWorkerThreadContext();
+
+	const bool closed = IsPeerClosedOrClosed(GetConnectionState(), socket);
+	if (!inboundMessagesQueued && !transferProgressQueued && !establishedSignalPending && !closed)
+		return;
+	const bool signalEvent = inboundMessagesQueued || establishedSignalPending || closed;
+	inboundMessagesQueued = false;
+	transferProgressQueued = false;
+	establishedSignalPending = false;
+
+	// Orders the inserts to the queues before the reads of the flags. Pairs with the barriers in ResetInboundMessagesEventIfEmpty()
+	// and NetworkServer::ProcessReadyConnections().
+	FullMemoryBarrier();
+	if (signalEvent && inboundMessagesEventEnabled && inboundMessagesEventSignalled == 0 && CmpXChgLong(&inboundMessagesEventSignalled, 1, 0))
+		eventInboundMessagesAvailable.Set();
+	AddToServerReadyList();
+}
+
+void MessageConnection::AddToServerReadyList()
+{
+	if (ownerServer && serverReadySlot >= 0 && inServerReadyList == 0 && CmpXChgLong(&inServerReadyList, 1, 0))
+		ownerServer->AddReadyConnection(serverReadySlot);
+}
+
+bool MessageConnection::HasMainThreadWork() const
+{
+	return inboundMessageQueue.Size() > 0 || transferProgressQueue.Size() > 0;
+}
+
+void MessageConnection::ResetInboundMessagesEventIfEmpty()
+{
+	AssertInMainThreadContext();
+
+	if (!inboundMessagesEventEnabled || inboundMessagesEventSignalled == 0 || inboundMessageQueue.Size() > 0 || IsPeerClosedOrClosed(GetConnectionState(), socket))
+		return;
+
+	inboundMessagesEventSignalled = 0;
+	FullMemoryBarrier();
+	eventInboundMessagesAvailable.Reset();
+	// The worker may have queued a message after the check above, and seen the flag still set. Its Set() may also have
+	// been undone by the Reset() above. Either way the message is in the queue now, so check again.
+	if (inboundMessageQueue.Size() > 0)
+	{
+		inboundMessagesEventSignalled = 1;
+		eventInboundMessagesAvailable.Set();
+	}
+}
+
 bool EraseReliableIfObsoleteOrNotInOrderCmp(const NetworkMessage *msg)
 {
 	assert(msg->reliable);
@@ -884,16 +1523,9 @@ void MessageConnection::AddOutboundStats(unsigned long numBytes, unsigned long n
 	if (numBytes == 0 && numMessages == 0 && numPackets == 0)
 		return;
 
-	ConnectionStatistics &cs = statistics.LockGet();
-	cs.traffic.push_back(ConnectionStatistics::TrafficTrack());
-	ConnectionStatistics::TrafficTrack &t = cs.traffic.back();
-	t.bytesIn = t.messagesIn = t.packetsIn = 0;
-	t.bytesOut = numBytes;
-	t.packetsOut = numPackets;
-	t.messagesOut = numMessages;
-	t.tick = Clock::Tick();
-	statistics.Unlock();
+	samples->trafficStats.AddOutbound(Clock::LoopTick(), (u32)numBytes, (u32)numPackets, (u32)numMessages);
 	bytesOutTotal += numBytes;
+	packetsOutTotal += numPackets;
 }
 
 void MessageConnection::AddInboundStats(unsigned long numBytes, unsigned long numPackets, unsigned long numMessages)
@@ -903,105 +1535,118 @@ void MessageConnection::AddInboundStats(unsigned long numBytes, unsigned long nu
 	if (numBytes == 0 && numMessages == 0 && numPackets == 0)
 		return;
 
-	ConnectionStatistics &cs = statistics.LockGet();
-	cs.traffic.push_back(ConnectionStatistics::TrafficTrack());
-	ConnectionStatistics::TrafficTrack &t = cs.traffic.back();
-	t.bytesOut = t.messagesOut = t.packetsOut = 0;
-	t.bytesIn = numBytes;
-	t.packetsIn = numPackets;
-	t.messagesIn = numMessages;
-	t.tick = Clock::Tick();
-	statistics.Unlock();
+	samples->trafficStats.AddInbound(Clock::LoopTick(), (u32)numBytes, (u32)numPackets, (u32)numMessages);
 	bytesInTotal += numBytes;
+	packetsInTotal += numPackets;
 }
 
 void MessageConnection::ComputeStats()
 {
 	AssertInWorkerThreadContext();
 
-	ConnectionStatistics &cs = statistics.LockGet();
+	if (socket)
+	{
+		const unsigned long drops = (socket->IsUDPSlaveSocket() && ownerServer) ? ownerServer->ReceiveQueueDrops() : socket->ReceiveQueueDrops();
+		statistics.LockGet().socketReceiveDrops = drops;
+		statistics.Unlock();
+	}
+
+	// The rates are averaged over the traffic of the last five seconds.
+	trafficRates.Store(samples->trafficStats.ComputeRates(Clock::LoopTick(), 5 * 1000));
+}
+
+bool MessageConnection::CheckAndSaveOutboundMessageWithContentID(NetworkMessage *msg)
+{
+	AssertInWorkerThreadContext();
+	assert(msg);
 
-	const tick_t maxEntryAge = Clock::TicksPerSec() * 5;
-	const tick_t timeNow = Clock::Tick();
-	const tick_t maxTickAge = timeNow - maxEntryAge;
+	// The first fragment of a transfer stands for the whole message. It supersedes the older messages with the same content ID.
+	if (msg->transfer)
+	{
+		const u32 contentID = msg->transfer->contentID;
+		if (contentID == 0 || msg->fragmentIndex != 0)
+			return false;
 
-	for(size_t i = 0; i < cs.traffic.size(); ++i)
-		if (Clock::IsNewer(cs.traffic[i].tick, maxTickAge))
+		AbortOutboundTransferWithContentID(msg->id, contentID, msg->transfer);
+		NetworkMessage *existing = outboundContentIDMessages.Find(msg->id, contentID);
+		if (existing)
 		{
-			cs.traffic.erase(cs.traffic.begin(), cs.traffic.begin() + i);
-			break;
+			existing->obsolete = true;
+			outboundContentIDMessages.Remove(msg->id, contentID);
 		}
+		return false;
+	}
+
+	if (msg->contentID == 0)
+		return false;
 
-	if (cs.traffic.size() <= 1)
+	AbortOutboundTransferWithContentID(msg->id, msg->contentID, 0);
+
+	NetworkMessage *existing = outboundContentIDMessages.Find(msg->id, msg->contentID);
+	if (!existing)
 	{
-		bytesInPerSec = bytesOutPerSec = msgsInPerSec = msgsOutPerSec = packetsInPerSec = packetsOutPerSec = 0.f;
-		statistics.Unlock();
-		return;
+		outboundContentIDMessages.Insert(msg->id, msg->contentID, msg);
+		return false;
 	}
 
-	unsigned long totalBytesIn = 0;
-	unsigned long totalBytesOut = 0;
-	unsigned long totalMsgsIn = 0;
-	unsigned long totalMsgsOut = 0;
-	unsigned long totalPacketsIn = 0;
-	unsigned long totalPacketsOut = 0;
+	assert(existing != msg);
+	assert(existing->id == msg->id && existing->contentID == msg->contentID);
 
-	for(size_t i = 0; i < cs.traffic.size(); ++i)
+	// Sanity check: The message numbers must be in the proper order. msg must have been admitted later to send queue than the existing message.
+	if (!msg->IsNewerThan(*existing)) // This shouldn't happen, but gracefully handle that situation if it does!
 	{
-		totalBytesIn += cs.traffic[i].bytesIn;
-		totalBytesOut += cs.traffic[i].bytesOut;
-		totalPacketsIn += cs.traffic[i].packetsIn;
-		totalPacketsOut += cs.traffic[i].packetsOut;
-		totalMsgsIn += cs.traffic[i].messagesIn;
-		totalMsgsOut += cs.traffic[i].messagesOut;
+		KNET_LOG(LogError, "Warning! Adding new message ID %d, number %d, content ID %d, priority %d, but it was obsoleted by an already existing message number %d.", 
+			(int)msg->id, (int)msg->messageNumber, (int)msg->contentID, (int)existing->priority, (int)existing->messageNumber);
+		msg->obsolete = true;
+		return false;
 	}
-	tick_t ticks = cs.traffic.back().tick - cs.traffic.front().tick;
-	float secs = max(1.f, (float)Clock::TicksToMillisecondsD(ticks) / 1000.f);
-	bytesInPerSec = (float)totalBytesIn / secs;
-	bytesOutPerSec = (float)totalBytesOut / secs;
-	packetsInPerSec = (float)totalPacketsIn / secs;
-	packetsOutPerSec = (float)totalPacketsOut / secs;
-	msgsInPerSec = (float)totalMsgsIn / secs;
-	msgsOutPerSec = (float)totalMsgsOut / secs;
 
-	statistics.Unlock();
+	// If the previous message hasn't left the queue yet, let it carry the new contents. It keeps its place in the queue,
+	// so a peer that falls behind still gets each content ID in turn, and the queue holds at most one message per content ID.
+	// The priority and the delivery flags decide where and how the message goes, so a message that changes them is queued anew.
+	if (existing->inOutboundQueue && !existing->transfer && existing->priority == msg->priority &&
+		existing->reliable == msg->reliable && existing->inOrder == msg->inOrder && existing->orderingChannel == msg->orderingChannel)
+	{
+		existing->SwapData(*msg);
+		existing->expiryTick = msg->expiryTick;
+		ADDEVENT("contentIDMessageReplaced", (float)existing->Size(), "bytes");
+		FreeMessage(msg);
+		return true;
+	}
+
+	// The previous message is in flight, or waits to go out differently. It will be dropped instead of resent.
+	existing->obsolete = true;
+	outboundContentIDMessages.Insert(msg->id, msg->contentID, msg);
+	return false;
 }
 
-void MessageConnection::CheckAndSaveOutboundMessageWithContentID(NetworkMessage *msg)
+void MessageConnection::AbortOutboundTransferWithContentID(u32 messageID, u32 contentID, FragmentedSendManager::FragmentedTransfer *newTransfer)
 {
 	AssertInWorkerThreadContext();
-	assert(msg);
 
-	if (msg->contentID == 0)
-		return;
-
-	MsgContentIDPair key = std::make_pair(msg->id, msg->contentID);
-	ContentIDSendTrack::iterator iter = outboundContentIDMessages.find(key);
-	if (iter != outboundContentIDMessages.end()) // We have a previous message in the queue which is now obsoleted by this message.
-	{
-		// Sanity check: The message numbers must be in the proper order. msg must have been admitted later to send queue than the existing message.
-		if (msg->IsNewerThan(*iter->second))
-		{
-			iter->second->obsolete = true;
-
-			assert(iter->second != msg);
-			assert(iter->first.first == iter->second->id);
-			assert(iter->first.second == iter->second->contentID);
-			assert(iter->first.first == msg->id);
-			assert(iter->first.second == msg->contentID);
-			iter->second = msg;
-		}
-		else // This shouldn't happen, but gracefully handle that situation if it does!
-		{
-			KNET_LOG(LogError, "Warning! Adding new message ID %d, number %d, content ID %d, priority %d, but it was obsoleted by an already existing message number %d.", 
-				(int)msg->id, (int)msg->messageNumber, (int)msg->contentID, (int)iter->second->priority, (int)iter->second->messageNumber);
-			msg->obsolete = true;
-		}
-	}
-	else
+	Lock<FragmentedSendManager> sends = fragmentedSends.Acquire();
+	FragmentedSendManager::FragmentedTransfer *existing = sends->FindTransferWithContentID(messageID, contentID);
+	if (existing && existing != newTransfer)
 	{
-		outboundContentIDMessages[key] = msg;
+		// The fragments that are still waiting to be sent or resent are dropped. If the peer has received some of them,
+		// it has to be told to drop them too, and to not wait for the message in its ordering channel.
+		if (sends->AbortTransfer(existing))
+			SendFragmentedTransferAbortMessage(*existing);
+		ADDEVENT("contentIDTransferAborted", 1, "");
 	}
+
+	if (newTransfer)
+		sends->AddTransferWithContentID(newTransfer);
+}
+
+void MessageConnection::FreeExpiredMessage(NetworkMessage *msg)
+{
+	AssertInWorkerThreadContext();
+
+	ClearOutboundMessageWithContentID(msg);
+	FreeMessage(msg);
+	numExpiredMessages = numExpiredMessages + 1;
+	ADDEVENT("messagesExpired", 1, "");
 }
 
 void MessageConnection::ClearOutboundMessageWithContentID(NetworkMessage *msg)
@@ -1014,11 +1659,8 @@ void MessageConnection::ClearOutboundMessageWithContentID(NetworkMessage *msg)
 	assert(msg);
 	if (msg->contentID == 0)
 		return;
-	MsgContentIDPair key = std::make_pair(msg->id, msg->contentID);
-	ContentIDSendTrack::iterator iter = outboundContentIDMessages.find(key);
-	if (iter != outboundContentIDMessages.end())
-		if (msg == iter->second)
-			outboundContentIDMessages.erase(iter);
+	if (outboundContentIDMessages.Find(msg->id, msg->contentID) == msg)
+		outboundContentIDMessages.Remove(msg->id, msg->contentID);
 }
 
 bool MessageConnection::CheckAndSaveContentIDStamp(message_id_t messageID, u32 contentID, packet_id_t packetID)
@@ -1048,6 +1690,36 @@ bool MessageConnection::CheckAndSaveContentIDStamp(message_id_t messageID, u32 c
 	}
 }
 
+size_t MessageConnection::EncodedMessageIDSize(message_id_t id)
+{
+	if (id > cFirstExtensionMsgId)
+		return VLE8_16_32::GetEncodedBitLength(MsgIdExtension)/8 + 1;
+	return VLE8_16_32::GetEncodedBitLength(id)/8;
+}
+
+void MessageConnection::AddMessageID(DataSerializer &writer, message_id_t id)
+{
+	if (id > cFirstExtensionMsgId)
+	{
+		assert(id - cFirstExtensionMsgId <= 0xFF);
+		writer.AddVLE<VLE8_16_32>(MsgIdExtension);
+		writer.Add<u8>((u8)(id - cFirstExtensionMsgId));
+	}
+	else
+		writer.AddVLE<VLE8_16_32>(id);
+}
+
+message_id_t MessageConnection::ReadMessageID(DataDeserializer &reader)
+{
+	const u32 id = reader.ReadVLE<VLE8_16_32>();
+	if (id != MsgIdExtension)
+		return id;
+	if (reader.BytesLeft() == 0)
+		return DataDeserializer::VLEReadError;
+	const u8 extensionCode = reader.Read<u8>();
+	return (extensionCode != 0) ? cFirstExtensionMsgId + extensionCode : DataDeserializer::VLEReadError;
+}
+
 void MessageConnection::HandleInboundMessage(packet_id_t packetID, const char *data, size_t numBytes)
 {
 	AssertInWorkerThreadContext();
@@ -1059,55 +1731,294 @@ void MessageConnection::HandleInboundMessage(packet_id_t packetID, const char *d
 
 	// Read the message ID.
 	DataDeserializer reader(data, numBytes);
-	message_id_t messageID = reader.ReadVLE<VLE8_16_32>(); ///\todo Check that there actually is enough space to read.
+	message_id_t messageID = ReadMessageID(reader);
 	if (messageID == DataDeserializer::VLEReadError)
 	{
-		KNET_LOG(LogError, "Error parsing messageID of a message in socket %s. Data size: %d bytes.", socket->ToString().c_str(), (int)numBytes);
-		throw NetException("MessageConnection::HandleInboundMessage: Network error occurred when deserializing message ID VLE field!");
+		KNET_LOG(LogError, "Error parsing messageID of a message in socket %s. Data size: %d bytes. Discarding it.", socket->ToString().c_str(), (int)numBytes);
+		MalformedMessageReceived();
+		return;
 	}
+	if (messageID < cFirstExtensionMsgId)
+		messageID = messageIDCodes.Decode(messageID);
 	KNET_LOG(LogData, "Received message with ID %d and size %d from peer %s.", (int)packetID, (int)numBytes, socket->ToString().c_str());
 
-	char str[256];
-	sprintf(str, "messageIn.%u", (unsigned int)messageID);
-	ADDEVENT(str, (float)reader.BytesLeft(), "bytes");
+	if (HandleProtocolMessage(packetID, messageID, data + reader.BytePos(), reader.BytesLeft()))
+		return;
+	MarkActivity();
+
+	assert(reader.BitPos() == 0);
+	DatagramBuffer *file = fragmentedReceives.MapFileDestination(messageID, reader.BytesLeft());
+	IMessageHandler *workerHandler = workerThreadMessageHandler;
+	if (!file && workerHandler)
+	{
+		DeliverOnWorkerThread(workerHandler, packetID, messageID, data + reader.BytePos(), reader.BytesLeft());
+		return;
+	}
+
+	NetworkMessage *msg = AllocateNewMessage();
+	if (file)
+	{
+		msg->AttachSharedData(file, file->Data(), reader.BytesLeft());
+		file->Release();
+	}
+	else
+		msg->Resize(reader.BytesLeft());
+	memcpy(msg->data, data + reader.BytePos(), reader.BytesLeft());
+	msg->id = messageID;
+	msg->contentID = 0;
+	msg->receivedPacketID = packetID;
+	QueueInboundMessage(msg);
+}
+
+void MessageConnection::HandleInboundMessage(packet_id_t packetID, NetworkMessage *msg)
+{
+	AssertInWorkerThreadContext();
+	assert(msg);
+
+	if (!socket || HandleProtocolMessage(packetID, msg->id, msg->data, msg->Size()))
+	{
+		FreeMessage(msg);
+		return;
+	}
+	MarkActivity();
+
+	IMessageHandler *workerHandler = workerThreadMessageHandler;
+	if (workerHandler && !msg->sharedData)
+	{
+		DeliverOnWorkerThread(workerHandler, packetID, msg->id, msg->data, msg->Size());
+		FreeMessage(msg);
+		return;
+	}
+
+	msg->contentID = 0;
+	msg->receivedPacketID = packetID;
+	QueueInboundMessage(msg);
+}
+
+bool MessageConnection::HandleProtocolMessage(packet_id_t packetID, message_id_t messageID, const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+#ifdef KNET_NETWORK_PROFILING
+	if (owner)
+		owner->AddStatsEvent(samples->inboundMessageCounters.Get(messageID, false, 0), (float)numBytes);
+#endif
 
 	// Pass the message to TCP/UDP -specific message handler.
-	bool childHandledMessage = HandleMessage(packetID, messageID, data + reader.BytePos(), reader.BytesLeft());
+	bool childHandledMessage = HandleMessage(packetID, messageID, data, numBytes);
 	if (childHandledMessage)
-		return; // If the derived class handled the message, no need to propagate it further.
+		return true; // If the derived class handled the message, no need to propagate it further.
 
 	switch(messageID)
 	{
 	case MsgIdPingRequest:
-		HandlePingRequestMessage(data + reader.BytePos(), reader.BytesLeft());
-		break;
+		HandlePingRequestMessage(data, numBytes);
+		return true;
 	case MsgIdPingReply:
-		HandlePingReplyMessage(data + reader.BytePos(), reader.BytesLeft());
-		break;
+		HandlePingReplyMessage(data, numBytes);
+		return true;
+	case MsgIdCompressionOffer:
+		HandleCompressionOfferMessage(data, numBytes);
+		return true;
+	case MsgIdCompressedData:
+		// The transports unpack the CompressedData messages before they pass the messages on, so this one was misplaced.
+		KNET_LOG(LogError, "Received a CompressedData message of %d bytes that was not the whole content of its datagram or stream block! Discarding it.", (int)numBytes);
+		return true;
+	case MsgIdDeltaState:
+		HandleDeltaStateMessage(packetID, data, numBytes);
+		return true;
+	case MsgIdAggregate:
+		// The UDP transport unpacks the Aggregate records in the datagrams, so this one came in a fragmented transfer or a stream.
+		KNET_LOG(LogError, "Received an Aggregate record of %d bytes outside of a datagram message block! Discarding it.", (int)numBytes);
+		return true;
+	case MsgIdMessageIDCode:
+		HandleMessageIDCodeMessage(data, numBytes);
+		return true;
 	default:
+		// An extension message of a newer version of the protocol. The application never sees these.
+		if (messageID > cFirstExtensionMsgId)
 		{
-			NetworkMessage *msg = AllocateNewMessage();
-			msg->Resize(numBytes);
-			assert(reader.BitPos() == 0);
-			memcpy(msg->data, data + reader.BytePos(), reader.BytesLeft());
-			msg->dataSize = reader.BytesLeft();
-			msg->id = messageID;
-			msg->contentID = 0;
-			msg->receivedPacketID = packetID;
-			bool success = inboundMessageQueue.Insert(msg);
-			if (!success)
-			{
-				KNET_LOG(LogError, "Failed to add a new message of ID %d and size %dB to inbound queue! Queue was full.",
-					(int)messageID, (int)msg->dataSize);
-				FreeMessage(msg);
-			}
+			KNET_LOG(LogVerbose, "Ignoring a protocol message with the unknown extension code %d.", (int)(messageID - cFirstExtensionMsgId));
+			return true;
 		}
-		break;
+		return false;
+	}
+}
+
+void MessageConnection::HandleDeltaStateMessage(packet_id_t packetID, const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	DataDeserializer reader(data, numBytes);
+	const u32 messageID = reader.ReadVLE<VLE8_16_32>();
+	if (messageID == DataDeserializer::VLEReadError || messageID == MsgIdExtension || reader.BytesLeft() < 6)
+	{
+		KNET_LOG(LogError, "Received a malformed DeltaState message of %d bytes! Discarding it.", (int)numBytes);
+		return;
+	}
+	const u32 contentID = reader.Read<u32>();
+	const u8 version = reader.Read<u8>();
+	const u8 baselineDistance = reader.Read<u8>();
+	const char *contents = data + reader.BytePos();
+	const size_t contentsSize = reader.BytesLeft();
+
+	// Rebuild the message as it would have been received without the delta encoding, behind its message ID.
+	deltaStateDecodeBuffer.resize(4);
+	DataSerializer idWriter(&deltaStateDecodeBuffer[0], deltaStateDecodeBuffer.size());
+	idWriter.AddVLE<VLE8_16_32>(messageID);
+	const size_t idLength = idWriter.BytesFilled();
+	deltaStateDecodeBuffer.resize(idLength);
+
+	DeltaBaselineHistory &history = inboundDeltaBaselines[std::make_pair(messageID, contentID)];
+	if (baselineDistance == 0)
+		deltaStateDecodeBuffer.insert(deltaStateDecodeBuffer.end(), contents, contents + contentsSize);
+	else
+	{
+		const std::vector<char> *baseline = history.Find((u8)(version - baselineDistance));
+		if (!baseline)
+		{
+			// The baseline was superseded by a newer version before this message arrived, and a newer version follows this one.
+			KNET_LOG(LogVerbose, "The baseline of DeltaState version %d of message ID %d and content ID %d is no longer kept! Discarding it.",
+				(int)version, (int)messageID, (int)contentID);
+			ADDEVENT("deltaStateBaselineMissing", 1, "");
+			return;
+		}
+		if (!DecodeDelta(baseline->empty() ? 0 : &(*baseline)[0], baseline->size(), contents, contentsSize, deltaStateDecodeBuffer))
+		{
+			KNET_LOG(LogError, "Received a malformed delta in DeltaState message of message ID %d and content ID %d! Discarding it.", (int)messageID, (int)contentID);
+			return;
+		}
+	}
+	history.Store(version, &deltaStateDecodeBuffer[0] + idLength, deltaStateDecodeBuffer.size() - idLength);
+	ADDEVENT("deltaStateSavedBytes", (float)deltaStateDecodeBuffer.size() - (float)numBytes, "bytes");
+
+	HandleInboundMessage(packetID, &deltaStateDecodeBuffer[0], deltaStateDecodeBuffer.size());
+}
+
+void MessageConnection::DeliverOnWorkerThread(IMessageHandler *handler, packet_id_t packetID, message_id_t messageID, const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	const u32 traceID = MessageTracer::SampleMessage();
+	MessageTracer::Record(traceID, messageID, TraceReceived);
+	handler->HandleMessage(this, packetID, messageID, (numBytes > 0) ? data : 0, numBytes);
+	MessageTracer::Record(traceID, messageID, TraceDelivered);
+}
+
+void MessageConnection::QueueInboundMessage(NetworkMessage *msg)
+{
+	AssertInWorkerThreadContext();
+
+	msg->traceID = MessageTracer::SampleMessage();
+	MessageTracer::Record(msg->traceID, msg->id, TraceReceived);
+	bool success = inboundMessageQueue.Insert(msg);
+	if (!success)
+	{
+		KNET_LOG(LogError, "Failed to add a new message of ID %d and size %dB to inbound queue! Queue was full.",
+			(int)msg->id, (int)msg->Size());
+		FreeMessage(msg);
 	}
+	else
+		inboundMessagesQueued = true;
+}
+
+void MessageConnection::SetMaximumDataSendRate(int numBytesPerSec, int numDatagramsPerSec)
+{
+	AssertInMainThreadContext();
+
+	maxBytesSendRate = std::max(0, numBytesPerSec);
+	maxDatagramsSendRate = std::max(0, numDatagramsPerSec);
+}
+
+void MessageConnection::SetOrderingChannel(message_id_t id, u8 channel)
+{
+	AssertInMainThreadContext();
+
+	if (channel == 0)
+		messageOrderingChannels.erase(id);
+	else
+		messageOrderingChannels[id] = channel;
+}
+
+void MessageConnection::SetCompression(bool enabled, size_t minBytes)
+{
+	AssertInMainThreadContext();
+
+	compressionThreshold = std::max(minBytes, cMinCompressionThreshold);
+	compressionEnabled = enabled;
 }
 
-void MessageConnection::SetMaximumDataSendRate(int /*numBytesPerSec*/, int /*numDatagramsPerSec*/)
+void MessageConnection::SetSendCoalescing(int maxDelayMicroseconds, size_t flushBytes, unsigned long urgentPriority)
 {
+	AssertInMainThreadContext();
+
+	sendCoalescingBytes = flushBytes;
+	sendCoalescingUrgentPriority = urgentPriority;
+	sendCoalescingDelay = std::max(maxDelayMicroseconds, 0);
+}
+
+void MessageConnection::SetCompressionDictionary(const char *data, size_t numBytes)
+{
+	AssertInMainThreadContext();
+
+	Lockable<std::vector<char> >::LockType dictionary = compressionDictionary.Acquire();
+	dictionary->assign(data, data + numBytes);
+	++compressionDictionaryVersion;
+}
+
+u8 MessageConnection::OrderingChannel(message_id_t id) const
+{
+	AssertInMainThreadContext();
+
+	std::map<message_id_t, u8>::const_iterator iter = messageOrderingChannels.find(id);
+	return (iter != messageOrderingChannels.end()) ? iter->second : 0;
+}
+
+void MessageConnection::UpdateSendRateLimits()
+{
+	AssertInWorkerThreadContext();
+
+	const int bytesPerSec = maxBytesSendRate;
+	const int datagramsPerSec = maxDatagramsSendRate;
+	const tick_t now = Clock::Tick();
+
+	if (bytesPerSec != (int)byteSendRateLimit.Rate())
+		byteSendRateLimit.SetRate(bytesPerSec, std::max(bytesPerSec * cSendRateLimitBurstMSecs / 1000.0, cMinSendRateLimitBurstBytes), now);
+	if (datagramsPerSec != (int)datagramSendRateLimit.Rate())
+		datagramSendRateLimit.SetRate(datagramsPerSec, std::max(datagramsPerSec * cSendRateLimitBurstMSecs / 1000.0, 1.0), now);
+}
+
+bool MessageConnection::SendRateLimitAllowsSend() const
+{
+	const tick_t now = Clock::Tick();
+	return byteSendRateLimit.TicksUntilAvailable(now) == 0 && datagramSendRateLimit.TicksUntilAvailable(now) == 0 &&
+		TimeUntilEgressAllowsSend(now) == 0;
+}
+
+unsigned long MessageConnection::TimeUntilSendRateLimitAllowsSend() const
+{
+	const tick_t now = Clock::Tick();
+	return std::max(std::max(byteSendRateLimit.MSecsUntilAvailable(now), datagramSendRateLimit.MSecsUntilAvailable(now)),
+		TimeUntilEgressAllowsSend(now));
+}
+
+unsigned long MessageConnection::TimeUntilEgressAllowsSend(tick_t now) const
+{
+	if (!egressScheduler || !egressScheduler->IsLimited())
+		return 0;
+
+	// Acks and resends go out without new messages, and are let through as critical.
+	const unsigned long priority = (outboundQueue.Size() > 0) ? outboundQueue.Front()->priority : NetworkMessage::cMaxPriority;
+	return egressScheduler->MSecsUntilSend(egressFlow, priority, now);
+}
+
+void MessageConnection::ConsumeSendRateLimit(size_t numBytes, int numDatagrams)
+{
+	const tick_t now = Clock::Tick();
+	byteSendRateLimit.Consume((double)numBytes, now);
+	datagramSendRateLimit.Consume((double)numDatagrams, now);
+	if (egressScheduler)
+		egressScheduler->Consume(egressFlow, numBytes, now);
 }
 
 void MessageConnection::RegisterInboundMessageHandler(IMessageHandler *handler)
@@ -1117,6 +2028,36 @@ void MessageConnection::RegisterInboundMessageHandler(IMessageHandler *handler)
 	inboundMessageHandler = handler;
 }
 
+void MessageConnection::RegisterMessageHandler(message_id_t id, IMessageHandler *handler)
+{
+	AssertInMainThreadContext();
+
+	if (id > cMaxDispatchMessageID)
+		throw NetException("MessageConnection::RegisterMessageHandler: The message ID is too large for the dispatch table!");
+	if (id >= messageDispatchTable.size())
+	{
+		if (!handler)
+			return;
+		messageDispatchTable.resize(id + 1);
+	}
+	messageDispatchTable[id].handler = handler;
+}
+
+void MessageConnection::RegisterMessageBatchHandler(message_id_t id, IMessageBatchHandler *handler)
+{
+	AssertInMainThreadContext();
+
+	if (id > cMaxDispatchMessageID)
+		throw NetException("MessageConnection::RegisterMessageBatchHandler: The message ID is too large for the dispatch table!");
+	if (id >= messageDispatchTable.size())
+	{
+		if (!handler)
+			return;
+		messageDispatchTable.resize(id + 1);
+	}
+	messageDispatchTable[id].batchHandler = handler;
+}
+
 void MessageConnection::SendPingRequestMessage(bool internalQueue)
 {
 #ifdef KNET_THREAD_CHECKING_ENABLED
@@ -1128,9 +2069,9 @@ void MessageConnection::SendPingRequestMessage(bool internalQueue)
 
 	ConnectionStatistics &cs = statistics.LockGet();
 	
-	u8 pingID = (u8)((cs.ping.empty()) ? 1 : (cs.ping.back().pingID + 1));
-	cs.ping.push_back(ConnectionStatistics::PingTrack());
-	ConnectionStatistics::PingTrack &pingTrack = cs.ping.back();
+	u8 pingID = (u8)(cs.lastPingID + 1);
+	cs.lastPingID = pingID;
+	ConnectionStatistics::PingTrack &pingTrack = cs.ping[pingID % ConnectionStatistics::cNumPingTracks];
 	pingTrack.replyReceived = false;
 	pingTrack.pingSentTick = Clock::Tick();
 	pingTrack.pingID = pingID;
@@ -1184,23 +2125,190 @@ void MessageConnection::HandlePingReplyMessage(const char *data, size_t numBytes
 	const float rttPredictBias = 0.5f;
 
 	u8 pingID = *(u8*)data;
-	for(size_t i = 0; i < cs.ping.size(); ++i)
-		if (cs.ping[i].pingID == pingID && cs.ping[i].replyReceived == false)
-		{
-			cs.ping[i].pingReplyTick = Clock::Tick();
-			float newRtt = (float)Clock::TicksToMillisecondsD(Clock::TicksInBetween(cs.ping[i].pingReplyTick, cs.ping[i].pingSentTick));
-			cs.ping[i].replyReceived = true;
-			statistics.Unlock();
-			rtt = rttPredictBias * newRtt + (1.f * rttPredictBias) * rtt;
+	ConnectionStatistics::PingTrack &pingTrack = cs.ping[pingID % ConnectionStatistics::cNumPingTracks];
+	if (pingTrack.pingID == pingID && pingTrack.replyReceived == false)
+	{
+		pingTrack.pingReplyTick = InboundReceiveTick(pingTrack.pingSentTick);
+		float newRtt = (float)Clock::TicksToMillisecondsD(Clock::TicksInBetween(pingTrack.pingReplyTick, pingTrack.pingSentTick));
+		pingTrack.replyReceived = true;
+		samples->latencyHistograms[LatencyPingRTT].RecordTimespan(pingTrack.pingSentTick, pingTrack.pingReplyTick);
+		statistics.Unlock();
+		rtt = rttPredictBias * newRtt + (1.f * rttPredictBias) * rtt;
 
-			KNET_LOG(LogVerbose, "HandlePingReplyMessage: %d.", (int)pingID);
-			return;
-		}
+		KNET_LOG(LogVerbose, "HandlePingReplyMessage: %d.", (int)pingID);
+		return;
+	}
 
 	statistics.Unlock();
 	KNET_LOG(LogError, "Received PingReply with ID %d in socket %s, but no matching PingRequest was ever sent!", (int)pingID, socket->ToString().c_str());
 }
 
+void MessageConnection::UpdateCompression()
+{
+	AssertInWorkerThreadContext();
+
+	if (connectionState != ConnectionOK)
+		return;
+
+	if (appliedCompressionDictionaryVersion != compressionDictionaryVersion)
+	{
+		Lockable<std::vector<char> >::LockType dictionary = compressionDictionary.Acquire();
+		appliedCompressionDictionaryVersion = compressionDictionaryVersion;
+		compressionCodec.SetDictionary(dictionary->empty() ? 0 : &(*dictionary)[0], dictionary->size());
+		compressionOfferSent = false;
+	}
+
+	// The connections that use no compression at either end don't need to exchange the offers.
+	if (!compressionOfferSent && (compressionEnabled || compressionCodec.DictionaryID() != 0 || peerCompressionCodecs != 0))
+	{
+		SendCompressionOffer();
+		compressionOfferSent = true;
+	}
+}
+
+void MessageConnection::SendCompressionOffer()
+{
+	AssertInWorkerThreadContext();
+
+	NetworkMessage *msg = StartNewMessage(MsgIdCompressionOffer, 5);
+	DataSerializer mb(msg->data, 5);
+	mb.Add<u8>(CompressionCodecLZ4);
+	mb.Add<u32>(compressionCodec.DictionaryID());
+	msg->priority = NetworkMessage::cMaxPriority - 1;
+	msg->reliable = true;
+#ifdef KNET_NETWORK_PROFILING
+	msg->profilerName = "CompressionOffer (5:5)";
+#endif
+	EndAndQueueMessage(msg, mb.BytesFilled(), true);
+	KNET_LOG(LogVerbose, "Offered compression with dictionary ID 0x%X to %s.", (unsigned int)compressionCodec.DictionaryID(), ToString().c_str());
+}
+
+void MessageConnection::HandleCompressionOfferMessage(const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	if (numBytes < 5)
+	{
+		KNET_LOG(LogError, "Malformed CompressionOffer message received! Size was %d bytes, expected 5 bytes!", (int)numBytes);
+		return;
+	}
+
+	DataDeserializer reader(data, numBytes);
+	peerCompressionCodecs = reader.Read<u8>();
+	peerCompressionDictionaryID = reader.Read<u32>();
+	KNET_LOG(LogVerbose, "The peer %s offered compression codecs 0x%X with dictionary ID 0x%X.", ToString().c_str(),
+		(unsigned int)peerCompressionCodecs, (unsigned int)peerCompressionDictionaryID);
+}
+
+void MessageConnection::SendMessageIDCodeMessage(MessageIDCodeType type, message_id_t code, message_id_t id)
+{
+	AssertInWorkerThreadContext();
+
+	const size_t maxSize = 2 + 4;
+	NetworkMessage *msg = StartNewMessage(MsgIdMessageIDCode, maxSize);
+	DataSerializer mb(msg->data, maxSize);
+	mb.Add<u8>((u8)type);
+	mb.Add<u8>((u8)code);
+	mb.AddVLE<VLE8_16_32>(id);
+	msg->priority = NetworkMessage::cMaxPriority - 1;
+	msg->reliable = true;
+	msg->inOrder = false; // Handled as soon as it arrives, so that the code is known before the accept goes out.
+#ifdef KNET_NETWORK_PROFILING
+	msg->profilerName = "MessageIDCode (5:10)";
+#endif
+	EndAndQueueMessage(msg, mb.BytesFilled(), true);
+	KNET_LOG(LogVerbose, "%s code %d for message ID %d to %s.", (type == MessageIDCodeOffer) ? "Offered" : "Accepted", (int)code, (int)id,
+		ToString().c_str());
+}
+
+void MessageConnection::HandleMessageIDCodeMessage(const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	DataDeserializer reader(data, numBytes);
+	if (numBytes < 3)
+	{
+		KNET_LOG(LogError, "Malformed MessageIDCode message received! Size was %d bytes, expected at least 3 bytes!", (int)numBytes);
+		return;
+	}
+	const u8 type = reader.Read<u8>();
+	const message_id_t code = reader.Read<u8>();
+	const u32 id = reader.ReadVLE<VLE8_16_32>();
+	if (id == DataDeserializer::VLEReadError)
+	{
+		KNET_LOG(LogError, "Malformed MessageIDCode message received! Failed to read the message ID.");
+		return;
+	}
+
+	if (type == MessageIDCodeOffer)
+	{
+		// A rejected offer is not answered, so the peer keeps sending the full ID.
+		if (messageIDCodes.Offered(code, id))
+			SendMessageIDCodeMessage(MessageIDCodeAccept, code, id);
+		else
+			KNET_LOG(LogVerbose, "Rejected the code %d the peer %s offered for message ID %d.", (int)code, ToString().c_str(), (int)id);
+	}
+	else if (type == MessageIDCodeAccept)
+	{
+		if (!messageIDCodes.Accepted(code, id))
+			KNET_LOG(LogError, "The peer %s accepted the code %d for message ID %d, which was not offered!", ToString().c_str(), (int)code, (int)id);
+	}
+	else
+		KNET_LOG(LogError, "Received a MessageIDCode message of unknown type %d!", (int)type);
+}
+
+size_t MessageConnection::CompressMessageData(const char *data, size_t numBytes, size_t maxContentSize)
+{
+	AssertInWorkerThreadContext();
+
+	const u32 dictionaryID = compressionCodec.DictionaryID();
+	const bool useDictionary = dictionaryID != 0 && dictionaryID == peerCompressionDictionaryID;
+	const size_t headerSize = 1 + VLE8_16_32::GetEncodedBitLength((u32)numBytes) / 8;
+	if (maxContentSize <= headerSize)
+		return 0;
+
+	if (compressionBuffer.size() < maxContentSize)
+		compressionBuffer.resize(maxContentSize);
+	DataSerializer writer(&compressionBuffer[0], headerSize);
+	writer.Add<u8>(useDictionary ? (u8)(1 | ((dictionaryID & 0x7F) << 1)) : 0);
+	writer.AddVLE<VLE8_16_32>((u32)numBytes);
+
+	const size_t compressedSize = compressionCodec.Compress(data, numBytes, &compressionBuffer[headerSize], maxContentSize - headerSize, useDictionary);
+	return (compressedSize > 0) ? headerSize + compressedSize : 0;
+}
+
+int MessageConnection::DecompressMessageData(const char *data, size_t numBytes, size_t maxSize, std::vector<char> &dst, size_t dstOffset)
+{
+	AssertInWorkerThreadContext();
+
+	if (numBytes < 3)
+		return -1;
+	DataDeserializer reader(data, numBytes);
+	const u8 flags = reader.Read<u8>();
+	const u32 size = reader.ReadVLE<VLE8_16_32>();
+	if (size == DataDeserializer::VLEReadError || size == 0 || size > maxSize)
+	{
+		KNET_LOG(LogError, "Malformed CompressedData message received! The decompressed size %d is not within [1, %d]!", (int)size, (int)maxSize);
+		return -1;
+	}
+
+	const bool useDictionary = (flags & 1) != 0;
+	if (useDictionary && (u32)(flags >> 1) != (compressionCodec.DictionaryID() & 0x7F))
+	{
+		KNET_LOG(LogError, "Received a CompressedData message that was compressed against another dictionary than the one of %s!", ToString().c_str());
+		return -1;
+	}
+
+	dst.resize(dstOffset + size);
+	const int decompressedSize = compressionCodec.Decompress(reader.CurrentData(), reader.BytesLeft(), &dst[dstOffset], size, useDictionary);
+	if (decompressedSize != (int)size)
+	{
+		KNET_LOG(LogError, "Malformed CompressedData message received! Decompressing %d bytes failed!", (int)numBytes);
+		return -1;
+	}
+	return decompressedSize;
+}
+
 std::string MessageConnection::ToString() const
 {
 	if (socket)
@@ -1215,7 +2323,9 @@ void MessageConnection::DumpStatus() const
 
 	char str[4096];
 
-	sprintf(str, "Connection Status: %s.\n"
+	MessageDataStatistics messageData = MessageDataAllocator::Statistics();
+
+	sprintf(str, "Connection Status: %s%s.\n"
 		"\tInboundMessagesPending: %d.\n"
 		"\tOutboundMessagesPending: %d.\n"
 		"\tMessageConnection: %s %s %s.\n"
@@ -1232,8 +2342,10 @@ void MessageConnection::DumpStatus() const
 		"\tOverlapped in: %d (event: %s)\n"
 		"\tOverlapped out: %d (event: %s)\n"
 		"\tTime until next send: %d\n"
-		"\toutboundQueue.Size(): %d\n",
-		ConnectionStateToString(GetConnectionState()).c_str(),
+		"\toutboundQueue.Size(): %d (%s)\n"
+		"\tMessage data: %s in %d blocks, %s in %d large buffers, %s in %d slabs.\n"
+		"\tQueue memory: %s (peak %s, limit %s, %d refusals).\n",
+		ConnectionStateToString(GetConnectionState()).c_str(), IsIdle() ? " (idle)" : "",
 		(int)NumInboundMessagesPending(),
 		(int)NumOutboundMessagesPending(),
 		Connected() ? "connected" : "",
@@ -1260,10 +2372,23 @@ void MessageConnection::DumpStatus() const
 #endif
 		(socket && socket->GetOverlappedSendEvent().Test()) ? "true" : "false",
 		(int)TimeUntilCanSendPacket(),
-		(int)outboundQueue.Size());
+		(int)outboundQueue.Size(), OutboundQueueTypeToString(outboundQueue.Type()),
+		FormatBytes(messageData.blockBytesInUse).c_str(), (int)messageData.blocksInUse,
+		FormatBytes(messageData.largeBytesInUse).c_str(), (int)messageData.largeBuffersInUse,
+		FormatBytes(messageData.slabBytes).c_str(), (int)messageData.numSlabs,
+		FormatBytes((double)MemoryUsage()).c_str(), FormatBytes((double)PeakMemoryUsage()).c_str(),
+		MemoryLimit() > 0 ? FormatBytes((double)MemoryLimit()).c_str() : "none", (int)NumMemoryLimitRefusals());
 
 	KNET_LOGUSER(str);
 
+	for(int i = 0; i < NumLatencyMetrics; ++i)
+	{
+		const LatencyHistogram &h = samples->latencyHistograms[i];
+		if (h.Count() > 0)
+			KNET_LOGUSER("\t%s: %d samples, p50 %.2fms, p99 %.2fms, p99.9 %.2fms, max %.2fms.", LatencyMetricToString((LatencyMetric)i),
+				(int)h.Count(), h.PercentileMSecs(50.f), h.PercentileMSecs(99.f), h.PercentileMSecs(99.9f), h.MaxMSecs());
+	}
+
 	DumpConnectionStatus();
 }
 
@@ -1274,6 +2399,13 @@ Event MessageConnection::NewOutboundMessagesEvent() const
 	return eventMsgsOutAvailable;
 }
 
+Event MessageConnection::NewInboundDataEvent()
+{
+	if (!socket)
+		return Event();
+	return socket->GetOverlappedReceiveEvent();
+}
+
 MessageConnection::SocketReadResult MessageConnection::ReadSocket()
 { 
 	AssertInWorkerThreadContext();
@@ -0,0 +1,179 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MessageDataAllocator.cpp
+	@brief */
+
+#include <vector>
+#include <cassert>
+
+#include "kNet/MessageDataAllocator.h"
+#include "kNet/LockFreePoolAllocator.h"
+#include "kNet/Atomics.h"
+#include "kNet/Lockable.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+namespace
+{
+/// An unused block of a size class. The link is stored in the first bytes of the block itself.
+struct FreeBlock : public PoolAllocatable<FreeBlock>
+{
+};
+
+/// The unused blocks of each size class. LockFreeStack has no destructor, so the lists remain usable during process
+/// exit, when other static objects may still free their messages.
+LockFreeStack<FreeBlock> freeBlocks[MessageDataAllocator::cNumSizeClasses];
+
+/// Owns all the slabs, and frees them at process exit.
+struct SlabList
+{
+	Lockable<std::vector<char*> > slabs;
+
+	~SlabList()
+	{
+		Lockable<std::vector<char*> >::LockType lock = slabs.Acquire();
+		for(size_t i = 0; i < lock->size(); ++i)
+			delete[] (*lock)[i];
+		lock->clear();
+		slabsFreed = true;
+	}
+
+	/// Set when the slabs have been freed at process exit. After that, freeing the blocks does nothing.
+	static bool slabsFreed;
+};
+
+bool SlabList::slabsFreed = false;
+
+SlabList slabList;
+
+volatile long numSlabs = 0;
+volatile long blocksInUse = 0;
+volatile long blockBytesInUse = 0;
+volatile long largeBuffersInUse = 0;
+volatile long largeBytesInUse = 0;
+volatile long numBlockAllocations = 0;
+volatile long numLargeAllocations = 0;
+
+/// Returns the index of the smallest size class that fits the given number of bytes. The size must not exceed cMaxBlockSize.
+int SizeClassIndex(size_t numBytes)
+{
+	assert(numBytes <= MessageDataAllocator::cMaxBlockSize);
+	int sizeClass = 0;
+	size_t blockSize = MessageDataAllocator::cMinBlockSize;
+	while(blockSize < numBytes)
+	{
+		blockSize <<= 1;
+		++sizeClass;
+	}
+	return sizeClass;
+}
+
+size_t SizeClassBlockSize(int sizeClass)
+{
+	return MessageDataAllocator::cMinBlockSize << sizeClass;
+}
+
+/// Reserves a new slab for the given size class, adds all but one of its blocks to the free list of the class, and returns
+/// the remaining block.
+char *AllocateSlab(int sizeClass)
+{
+	const size_t blockSize = SizeClassBlockSize(sizeClass);
+	char *slab = new char[MessageDataAllocator::cSlabSize];
+	if (!LockFreeStack<FreeBlock>::CanPush((FreeBlock*)slab))
+	{
+		// The blocks of this slab cannot be linked to the free list. Leave the slab for the large buffer path instead.
+		delete[] slab;
+		return 0;
+	}
+
+	{
+		Lockable<std::vector<char*> >::LockType lock = slabList.slabs.Acquire();
+		lock->push_back(slab);
+	}
+	AtomicIncrement(&numSlabs);
+
+	for(size_t offset = blockSize; offset + blockSize <= MessageDataAllocator::cSlabSize; offset += blockSize)
+		freeBlocks[sizeClass].Push((FreeBlock*)(slab + offset));
+	return slab;
+}
+}
+
+char *MessageDataAllocator::Allocate(size_t numBytes, size_t &capacity)
+{
+	if (numBytes <= cMaxBlockSize)
+	{
+		const int sizeClass = SizeClassIndex(numBytes);
+		char *block = (char*)freeBlocks[sizeClass].Pop();
+		if (!block)
+			block = AllocateSlab(sizeClass);
+		if (block)
+		{
+			capacity = SizeClassBlockSize(sizeClass);
+			AtomicIncrement(&blocksInUse);
+			AtomicAdd(&blockBytesInUse, (long)capacity);
+			AtomicIncrement(&numBlockAllocations);
+			return block;
+		}
+	}
+
+	// Note that a buffer that did not fit a slab is always larger than cMaxBlockSize, so that Free() will not confuse it with a block.
+	capacity = (numBytes > cMaxBlockSize) ? numBytes : cMaxBlockSize + 1;
+	AtomicIncrement(&largeBuffersInUse);
+	AtomicAdd(&largeBytesInUse, (long)capacity);
+	AtomicIncrement(&numLargeAllocations);
+	return new char[capacity];
+}
+
+void MessageDataAllocator::Free(char *data, size_t capacity)
+{
+	if (!data)
+		return;
+
+	if (capacity > cMaxBlockSize)
+	{
+		AtomicDecrement(&largeBuffersInUse);
+		AtomicAdd(&largeBytesInUse, -(long)capacity);
+		delete[] data;
+		return;
+	}
+
+	if (SlabList::slabsFreed)
+		return;
+
+	const int sizeClass = SizeClassIndex(capacity);
+	assert(SizeClassBlockSize(sizeClass) == capacity);
+	AtomicDecrement(&blocksInUse);
+	AtomicAdd(&blockBytesInUse, -(long)capacity);
+	freeBlocks[sizeClass].Push((FreeBlock*)data);
+}
+
+MessageDataStatistics MessageDataAllocator::Statistics()
+{
+	MessageDataStatistics stats;
+	stats.numSlabs = (u64)numSlabs;
+	stats.slabBytes = (u64)numSlabs * cSlabSize;
+	stats.blocksInUse = (u64)blocksInUse;
+	stats.blockBytesInUse = (u64)blockBytesInUse;
+	stats.largeBuffersInUse = (u64)largeBuffersInUse;
+	stats.largeBytesInUse = (u64)largeBytesInUse;
+	stats.numBlockAllocations = (u64)numBlockAllocations;
+	stats.numLargeAllocations = (u64)numLargeAllocations;
+	return stats;
+}
+
+} // ~kNet
@@ -0,0 +1,129 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MessageFrameArena.cpp
+	@brief */
+
+#include <new>
+#include <cassert>
+
+#include "kNet/MessageFrameArena.h"
+#include "kNet/NetworkMessage.h"
+#include "kNet/Atomics.h"
+
+// DebugMemoryLeakCheck.h is not included, since its redefinition of new does not allow placement new.
+
+namespace kNet
+{
+
+MessageFrameArena::MessageFrameArena(int pageSize_)
+:pageSize(pageSize_ > 0 ? pageSize_ : cDefaultPageSize),
+inFrame(false),
+current(0)
+{
+}
+
+MessageFrameArena::~MessageFrameArena()
+{
+	if (inFrame)
+		EndFrame();
+
+	for(size_t i = 0; i < pages.size(); ++i)
+		if (AtomicDecrement(&pages[i]->numRefs) == 0)
+			DeletePage(pages[i]);
+}
+
+void MessageFrameArena::BeginFrame()
+{
+	assert(!inFrame);
+	inFrame = true;
+
+	// A page is only referenced by the arena once all its messages are gone, and nothing else touches it after that.
+	freePages.clear();
+	for(size_t i = 0; i < pages.size(); ++i)
+		if (pages[i]->numRefs == 1)
+			freePages.push_back(pages[i]);
+	FullMemoryBarrier();
+}
+
+void MessageFrameArena::EndFrame()
+{
+	assert(inFrame);
+	RetireCurrentPage();
+	inFrame = false;
+}
+
+NetworkMessage *MessageFrameArena::New()
+{
+	if (!inFrame)
+		return 0;
+
+	if (!current || current->numUsed == pageSize)
+	{
+		RetireCurrentPage();
+		current = TakePage();
+	}
+
+	NetworkMessage *msg = new (&current->slots[current->numUsed++]) NetworkMessage();
+	msg->framePage = current;
+	return msg;
+}
+
+void MessageFrameArena::Free(NetworkMessage *msg)
+{
+	assert(msg && msg->framePage);
+	MessageFramePage *page = msg->framePage;
+	msg->~NetworkMessage();
+	// The arena has gone away if this was the last reference.
+	if (AtomicDecrement(&page->numRefs) == 0)
+		DeletePage(page);
+}
+
+MessageFramePage *MessageFrameArena::TakePage()
+{
+	MessageFramePage *page;
+	if (!freePages.empty())
+	{
+		page = freePages.back();
+		freePages.pop_back();
+	}
+	else
+	{
+		page = new MessageFramePage;
+		page->slots = static_cast<NetworkMessage*>(::operator new(sizeof(NetworkMessage) * pageSize));
+		pages.push_back(page);
+	}
+	// No other thread refers to the page, so the slots can be counted in advance without an atomic operation.
+	page->numUsed = 0;
+	page->numRefs = 1 + pageSize;
+	return page;
+}
+
+void MessageFrameArena::RetireCurrentPage()
+{
+	if (!current)
+		return;
+	const long numUnused = pageSize - current->numUsed;
+	if (numUnused > 0)
+		AtomicAdd(&current->numRefs, -numUnused);
+	current = 0;
+}
+
+void MessageFrameArena::DeletePage(MessageFramePage *page)
+{
+	::operator delete(page->slots);
+	delete page;
+}
+
+} // ~kNet
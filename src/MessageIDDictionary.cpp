@@ -0,0 +1,141 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MessageIDDictionary.cpp
+	@brief */
+
+#include "kNet/MessageIDDictionary.h"
+#include "kNet/DataSerializer.h"
+#include "kNet/DataDeserializer.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+MessageIDDictionary::MessageIDDictionary()
+:firstCode(0), numCodes(0), numCodesOffered(0)
+{
+	SetCodeRange(0, 0);
+}
+
+void MessageIDDictionary::SetCodeRange(message_id_t firstCode_, int numCodes_)
+{
+	if (firstCode_ < cMinCode)
+	{
+		numCodes_ -= (int)(cMinCode - firstCode_);
+		firstCode_ = cMinCode;
+	}
+	if (numCodes_ < 0 || firstCode_ > 127)
+		numCodes_ = 0;
+	else if (numCodes_ > (int)(128 - firstCode_))
+		numCodes_ = (int)(128 - firstCode_);
+
+	firstCode = firstCode_;
+	numCodes = numCodes_;
+	numCodesOffered = 0;
+	inboundIDs.assign(numCodes, 0);
+	for(int i = 0; i < cNumCounters; ++i)
+	{
+		counters[i].id = 0;
+		counters[i].count = 0;
+		counters[i].code = 0;
+		counters[i].state = CodeNone;
+	}
+}
+
+bool MessageIDDictionary::CountSent(message_id_t id, message_id_t &code)
+{
+	// The IDs that fit in one byte gain nothing from a code.
+	if (numCodesOffered >= numCodes || id < 128)
+		return false;
+
+	Counter &c = counters[Slot(id)];
+	if (c.id != id)
+	{
+		// Another ID has the slot. It keeps the slot while it is sent more often than the IDs that collide with it, or
+		// for good once it has a code.
+		if (c.state != CodeNone || c.count > 1)
+		{
+			if (c.state == CodeNone)
+				--c.count;
+			return false;
+		}
+		c.id = id;
+		c.count = 0;
+	}
+	if (c.state != CodeNone || ++c.count < cHotThreshold)
+		return false;
+
+	c.code = firstCode + numCodesOffered++;
+	c.state = CodeOffered;
+	code = c.code;
+	return true;
+}
+
+bool MessageIDDictionary::Accepted(message_id_t code, message_id_t id)
+{
+	Counter &c = counters[Slot(id)];
+	if (c.id != id || c.code != code || c.state == CodeNone)
+		return false;
+	c.state = CodeAccepted;
+	return true;
+}
+
+bool MessageIDDictionary::Offered(message_id_t code, message_id_t id)
+{
+	const u32 index = code - firstCode;
+	if (index >= inboundIDs.size() || id < 128)
+		return false;
+	if (inboundIDs[index] != 0 && inboundIDs[index] != id)
+		return false;
+	inboundIDs[index] = id;
+	return true;
+}
+
+void MessageIDDictionary::SerializeTo(DataSerializer &dst) const
+{
+	dst.Add<u32>((u32)firstCode);
+	dst.Add<u32>((u32)numCodes);
+	dst.Add<u32>((u32)numCodesOffered);
+	for(int i = 0; i < cNumCounters; ++i)
+	{
+		dst.Add<u32>((u32)counters[i].id);
+		dst.Add<u32>(counters[i].count);
+		dst.Add<u32>((u32)counters[i].code);
+		dst.Add<u8>((u8)counters[i].state);
+	}
+	dst.Add<u32>((u32)inboundIDs.size());
+	for(size_t i = 0; i < inboundIDs.size(); ++i)
+		dst.Add<u32>((u32)inboundIDs[i]);
+}
+
+void MessageIDDictionary::DeserializeFrom(DataDeserializer &src)
+{
+	firstCode = src.Read<u32>();
+	numCodes = (int)src.Read<u32>();
+	numCodesOffered = (int)src.Read<u32>();
+	for(int i = 0; i < cNumCounters; ++i)
+	{
+		counters[i].id = src.Read<u32>();
+		counters[i].count = src.Read<u32>();
+		counters[i].code = src.Read<u32>();
+		counters[i].state = (CodeState)src.Read<u8>();
+	}
+	inboundIDs.resize(src.Read<u32>());
+	for(size_t i = 0; i < inboundIDs.size(); ++i)
+		inboundIDs[i] = src.Read<u32>();
+}
+
+} // ~kNet
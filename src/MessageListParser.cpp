@@ -20,12 +20,16 @@
 #endif
 
 #include <cassert>
+#include <cstdio>
 #include <cstring>
+#include <map>
 
 #include "kNet/DebugMemoryLeakCheck.h"
 
 #include "kNet/NetworkLogging.h"
 #include "kNet/MessageListParser.h"
+#include "kNet/DataSerializer.h"
+#include "kNet/DataDeserializer.h"
 #include "kNet/NetException.h"
 #include "kNet/Socket.h"
 
@@ -36,6 +40,11 @@ namespace
 	///\note See BasicSerializedDataTypes.h:31: The order of these elements matches that of the BasicSerializedDataType enum.
 	const char *data[] = { "", "bit", "u8", "s8", "u16", "s16", "u32", "s32", "u64", "s64", "float", "double", "string", "struct" };
 	const size_t typeSizes[] = { 0xFFFFFFFF, 0xFFFFFFFF, 1, 1, 2, 2, 4, 4, 8, 8, 4, 8, 0xFFFFFFFF, 0xFFFFFFFF }; // 0xFFFFFFFF here denotes 'does not apply'.
+
+	/// The first four bytes of a binary schema, "kNMS".
+	const u32 cBinarySchemaMagic = 0x534D4E6B;
+	/// Increment this when the binary schema format changes.
+	const u8 cBinarySchemaVersion = 1;
 }
 
 namespace kNet
@@ -225,6 +234,173 @@ void SerializedMessageList::LoadMessagesFromFile(const char *filename)
 }
 
 
+/* The binary schema format is the following, with each count and index stored as a VLE8_16_32 and each string in the
+	DataSerializer::AddString form:
+		u32 magic, u8 version,
+		count numElements, then for each element in the order of the elements list:
+			u8 type, u8 varyingCount, count count, string name, string typeString,
+			count numChildren, then the index of each child element,
+		count numMessages, then for each message:
+			string name, u32 id, u32 priority, u8 reliable, u8 inOrder, index of the root element.
+	A child always comes after its parent in the elements list, which LoadBinary() checks, so that a malformed schema
+	cannot form a cycle. */
+
+void SerializedMessageList::SaveBinary(std::vector<char> &dst) const
+{
+	std::map<const SerializedElementDesc*, u32> indices;
+	size_t maxBytes = 16;
+	for(std::list<SerializedElementDesc>::const_iterator iter = elements.begin(); iter != elements.end(); ++iter)
+	{
+		const u32 index = (u32)indices.size();
+		indices[&*iter] = index;
+		maxBytes += 16 + iter->name.length() + iter->typeString.length() + 4 * iter->elements.size();
+	}
+	for(std::list<SerializedMessageDesc>::const_iterator iter = messages.begin(); iter != messages.end(); ++iter)
+		maxBytes += 20 + iter->name.length();
+
+	std::vector<char> buffer;
+	DataSerializer ds(buffer, maxBytes);
+	ds.Add<u32>(cBinarySchemaMagic);
+	ds.Add<u8>(cBinarySchemaVersion);
+
+	ds.AddVLE<VLE8_16_32>((u32)elements.size());
+	for(std::list<SerializedElementDesc>::const_iterator iter = elements.begin(); iter != elements.end(); ++iter)
+	{
+		ds.Add<u8>((u8)iter->type);
+		ds.Add<u8>(iter->varyingCount ? 1 : 0);
+		ds.AddVLE<VLE8_16_32>((u32)iter->count);
+		ds.AddString(iter->name);
+		ds.AddString(iter->typeString);
+		ds.AddVLE<VLE8_16_32>((u32)iter->elements.size());
+		for(size_t i = 0; i < iter->elements.size(); ++i)
+			ds.AddVLE<VLE8_16_32>(indices[iter->elements[i]]);
+	}
+
+	ds.AddVLE<VLE8_16_32>((u32)messages.size());
+	for(std::list<SerializedMessageDesc>::const_iterator iter = messages.begin(); iter != messages.end(); ++iter)
+	{
+		ds.AddString(iter->name);
+		ds.Add<u32>(iter->id);
+		ds.Add<u32>(iter->priority);
+		ds.Add<u8>(iter->reliable ? 1 : 0);
+		ds.Add<u8>(iter->inOrder ? 1 : 0);
+		ds.AddVLE<VLE8_16_32>(indices[iter->data]);
+	}
+
+	dst.assign(buffer.begin(), buffer.begin() + ds.BytesFilled());
+}
+
+void SerializedMessageList::LoadBinary(const char *data, size_t numBytes)
+{
+	DataDeserializer dd(data, numBytes);
+	if (numBytes < 5 || dd.Read<u32>() != cBinarySchemaMagic)
+		throw NetException("SerializedMessageList::LoadBinary: The data is not a binary message schema!");
+	if (dd.Read<u8>() != cBinarySchemaVersion)
+		throw NetException("SerializedMessageList::LoadBinary: Unsupported binary message schema version!");
+
+	// Parse everything before touching the lists, so that a malformed schema leaves this list as it was.
+	const u32 numElements = dd.ReadVLE<VLE8_16_32>();
+	if (numElements > dd.BytesLeft())
+		throw NetException("SerializedMessageList::LoadBinary: The binary message schema is truncated!");
+	std::list<SerializedElementDesc> newElements;
+	std::vector<SerializedElementDesc*> elemPtrs(numElements);
+	std::vector<std::vector<u32> > children(numElements);
+	for(u32 i = 0; i < numElements; ++i)
+	{
+		newElements.push_back(SerializedElementDesc());
+		SerializedElementDesc &elem = newElements.back();
+		elemPtrs[i] = &elem;
+		elem.parent = 0;
+		const u8 type = dd.Read<u8>();
+		if (type >= NumSerialTypes)
+			throw NetException("SerializedMessageList::LoadBinary: The binary message schema has an element of an unknown type!");
+		elem.type = (BasicSerializedDataType)type;
+		elem.varyingCount = (dd.Read<u8>() != 0);
+		elem.count = (int)dd.ReadVLE<VLE8_16_32>();
+		elem.name = dd.ReadString();
+		elem.typeString = dd.ReadString();
+		const u32 numChildren = dd.ReadVLE<VLE8_16_32>();
+		if (numChildren > dd.BytesLeft())
+			throw NetException("SerializedMessageList::LoadBinary: The binary message schema is truncated!");
+		children[i].resize(numChildren);
+		for(u32 j = 0; j < numChildren; ++j)
+		{
+			children[i][j] = dd.ReadVLE<VLE8_16_32>();
+			if (children[i][j] <= i || children[i][j] >= numElements)
+				throw NetException("SerializedMessageList::LoadBinary: The binary message schema has an invalid child element index!");
+		}
+	}
+
+	for(u32 i = 0; i < numElements; ++i)
+		for(size_t j = 0; j < children[i].size(); ++j)
+		{
+			SerializedElementDesc *child = elemPtrs[children[i][j]];
+			if (child->parent)
+				throw NetException("SerializedMessageList::LoadBinary: The binary message schema has an element with two parents!");
+			child->parent = elemPtrs[i];
+			elemPtrs[i]->elements.push_back(child);
+		}
+
+	const u32 numMessages = dd.ReadVLE<VLE8_16_32>();
+	if (numMessages > dd.BytesLeft())
+		throw NetException("SerializedMessageList::LoadBinary: The binary message schema is truncated!");
+	std::list<SerializedMessageDesc> newMessages;
+	for(u32 i = 0; i < numMessages; ++i)
+	{
+		SerializedMessageDesc desc;
+		desc.name = dd.ReadString();
+		desc.id = dd.Read<u32>();
+		desc.priority = dd.Read<u32>();
+		desc.reliable = (dd.Read<u8>() != 0);
+		desc.inOrder = (dd.Read<u8>() != 0);
+		const u32 root = dd.ReadVLE<VLE8_16_32>();
+		if (root >= numElements || elemPtrs[root]->type != SerialStruct)
+			throw NetException("SerializedMessageList::LoadBinary: The binary message schema has an invalid message root element!");
+		desc.data = elemPtrs[root];
+		newMessages.push_back(desc);
+	}
+
+	// std::list::splice keeps the addresses of the elements, which the element and message descs point to.
+	elements.splice(elements.end(), newElements);
+	messages.splice(messages.end(), newMessages);
+}
+
+bool SerializedMessageList::SaveBinaryToFile(const char *filename) const
+{
+	std::vector<char> data;
+	SaveBinary(data);
+
+	FILE *handle = fopen(filename, "wb");
+	if (!handle)
+	{
+		KNET_LOG(LogError, "SerializedMessageList::SaveBinaryToFile: Failed to open file %s for writing!", filename);
+		return false;
+	}
+	const bool success = (fwrite(&data[0], 1, data.size(), handle) == data.size());
+	fclose(handle);
+	if (!success)
+		KNET_LOG(LogError, "SerializedMessageList::SaveBinaryToFile: Failed to write to file %s!", filename);
+	return success;
+}
+
+void SerializedMessageList::LoadBinaryFromFile(const char *filename)
+{
+	FILE *handle = fopen(filename, "rb");
+	if (!handle)
+		throw NetException((std::string("SerializedMessageList::LoadBinaryFromFile: Failed to open file ") + filename + "!").c_str());
+
+	std::vector<char> data;
+	char buffer[4096];
+	size_t numRead;
+	while((numRead = fread(buffer, 1, sizeof(buffer), handle)) > 0)
+		data.insert(data.end(), buffer, buffer + numRead);
+	fclose(handle);
+
+	if (data.empty())
+		throw NetException((std::string("SerializedMessageList::LoadBinaryFromFile: The file ") + filename + " is empty!").c_str());
+	LoadBinary(&data[0], data.size());
+}
+
 const SerializedMessageDesc *SerializedMessageList::FindMessageByID(u32 id)
 {
 	for(std::list<SerializedMessageDesc>::iterator iter = messages.begin();
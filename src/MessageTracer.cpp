@@ -0,0 +1,280 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MessageTracer.cpp
+	@brief Implements the per-thread event rings of MessageTracer and the Chrome trace output. */
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+
+#include "kNet/MessageTracer.h"
+#include "kNet/Atomics.h"
+#include "kNet/Lockable.h"
+#include "kNet/NetworkLogging.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+#ifdef _MSC_VER
+#define KNET_THREAD_LOCAL __declspec(thread)
+#else
+#define KNET_THREAD_LOCAL __thread
+#endif
+
+namespace kNet
+{
+
+namespace
+{
+/// The events of a single thread. Only that thread writes to the ring.
+struct TraceRing
+{
+	MessageTraceEvent events[MessageTracer::cRingSize];
+	/// The number of events ever written. The event i is at events[i % cRingSize]. [written by the owner thread, read by any thread]
+	volatile u32 head;
+};
+
+/// The rings of all threads. A ring is added once, and published by incrementing numRings, so the readers can scan the
+/// first numRings rings without locking. The rings are kept until process exit, so the events of the threads that have
+/// exited can still be collected.
+struct TraceRings
+{
+	TraceRing *rings[MessageTracer::cMaxThreads];
+	volatile long numRings;
+	Lockable<int> addMutex;
+
+	~TraceRings()
+	{
+		for(long i = 0; i < numRings; ++i)
+			delete rings[i];
+	}
+};
+
+TraceRings traceRings;
+
+/// The events recorded before this tick are hidden by Clear().
+volatile tick_t clearTick = 0;
+volatile long traceIDCounter = 0;
+
+/// The ring of the calling thread, or 0 if the thread has not recorded anything yet. Zero-initialized for each new thread.
+KNET_THREAD_LOCAL TraceRing *threadRing;
+KNET_THREAD_LOCAL u16 threadRingIndex;
+/// The number of messages the calling thread has seen since it last sampled one.
+KNET_THREAD_LOCAL u32 threadSampleCounter;
+
+/// Returns the stage a traced message spends its time in after reaching the given stage.
+const char *WaitNameAfterStage(int stage)
+{
+	switch(stage)
+	{
+	case TraceStarted: return "Build";
+	case TraceQueued: return "AcceptQueue";
+	case TraceAccepted: return "OutboundQueue";
+	case TraceSerialized: return "SocketSend";
+	case TraceSent: return "InFlight";
+	case TraceReceived: return "InboundQueue";
+	default: return MessageTraceStageToString((MessageTraceStage)stage);
+	}
+}
+
+bool EventTickLess(const MessageTraceEvent &a, const MessageTraceEvent &b)
+{
+	return a.tick < b.tick;
+}
+
+bool EventTraceLess(const MessageTraceEvent &a, const MessageTraceEvent &b)
+{
+	if (a.traceID != b.traceID)
+		return a.traceID < b.traceID;
+	return a.tick < b.tick;
+}
+}
+
+volatile u32 MessageTracer::samplingInterval = 0;
+
+const char *MessageTraceStageToString(MessageTraceStage stage)
+{
+	switch(stage)
+	{
+	case TraceStarted: return "Started";
+	case TraceQueued: return "Queued";
+	case TraceAccepted: return "Accepted";
+	case TraceSerialized: return "Serialized";
+	case TraceSent: return "Sent";
+	case TraceAcked: return "Acked";
+	case TraceReceived: return "Received";
+	case TraceDelivered: return "Delivered";
+	default: return "(invalid MessageTraceStage)";
+	}
+}
+
+void MessageTracer::SetSamplingInterval(u32 interval)
+{
+	samplingInterval = interval;
+}
+
+u32 MessageTracer::SampleMessageSlow()
+{
+	const u32 interval = samplingInterval;
+	if (interval == 0 || ++threadSampleCounter < interval)
+		return 0;
+	threadSampleCounter = 0;
+
+	u32 traceID;
+	do
+	{
+		traceID = (u32)AtomicIncrement(&traceIDCounter);
+	} while(traceID == 0);
+	return traceID;
+}
+
+void MessageTracer::RecordEvent(u32 traceID, u32 messageID, MessageTraceStage stage)
+{
+	TraceRing *ring = threadRing;
+	if (!ring)
+	{
+		Lock<int> lock = traceRings.addMutex.Acquire();
+		if (traceRings.numRings >= cMaxThreads)
+			return;
+		ring = new TraceRing;
+		ring->head = 0;
+		threadRingIndex = (u16)traceRings.numRings;
+		traceRings.rings[traceRings.numRings] = ring;
+		FullMemoryBarrier(); // The ring must be visible before the count that publishes it.
+		AtomicIncrement(&traceRings.numRings);
+		threadRing = ring;
+	}
+
+	const u32 head = ring->head;
+	MessageTraceEvent &e = ring->events[head % cRingSize];
+	e.tick = Clock::Tick();
+	e.traceID = traceID;
+	e.messageID = messageID;
+	e.thread = threadRingIndex;
+	e.stage = (u8)stage;
+	FullMemoryBarrier(); // The event must be written before the head that publishes it.
+	ring->head = head + 1;
+}
+
+void MessageTracer::Collect(std::vector<MessageTraceEvent> &events)
+{
+	events.clear();
+	const tick_t oldestTick = clearTick;
+	const long numRings = traceRings.numRings;
+	for(long i = 0; i < numRings; ++i)
+	{
+		const TraceRing &ring = *traceRings.rings[i];
+		const u32 head = ring.head;
+		FullMemoryBarrier();
+		const u32 first = (head > (u32)cRingSize) ? head - cRingSize : 0;
+		const size_t numOld = events.size();
+		for(u32 j = first; j < head; ++j)
+			events.push_back(ring.events[j % cRingSize]);
+		FullMemoryBarrier();
+
+		// The owner thread may have overwritten the oldest events while they were copied.
+		const u32 newHead = ring.head;
+		const u32 firstValid = (newHead > (u32)cRingSize) ? newHead - cRingSize : 0;
+		if (firstValid > first)
+			events.erase(events.begin() + numOld, events.begin() + numOld + std::min<size_t>(firstValid - first, events.size() - numOld));
+	}
+
+	size_t numKept = 0;
+	for(size_t i = 0; i < events.size(); ++i)
+		if (Clock::IsNewer(events[i].tick, oldestTick))
+			events[numKept++] = events[i];
+	events.resize(numKept);
+	std::stable_sort(events.begin(), events.end(), EventTickLess);
+}
+
+void MessageTracer::Clear()
+{
+	clearTick = Clock::Tick();
+}
+
+std::string MessageTracer::ToChromeTrace(const std::vector<MessageTraceEvent> &events)
+{
+	std::string out = "{\"traceEvents\":[";
+	if (events.empty())
+		return out + "]}\n";
+
+	std::vector<MessageTraceEvent> sorted(events);
+	std::stable_sort(sorted.begin(), sorted.end(), EventTraceLess);
+
+	tick_t baseTick = sorted[0].tick;
+	for(size_t i = 1; i < sorted.size(); ++i)
+		if (Clock::IsNewer(baseTick, sorted[i].tick))
+			baseTick = sorted[i].tick;
+
+	bool first = true;
+	char str[256];
+	for(size_t begin = 0; begin < sorted.size();)
+	{
+		size_t end = begin + 1;
+		while(end < sorted.size() && sorted[end].traceID == sorted[begin].traceID)
+			++end;
+
+		const MessageTraceEvent &head = sorted[begin];
+		const bool inbound = head.stage >= TraceReceived;
+		const double startTs = Clock::TicksToMillisecondsD(head.tick - baseTick) * 1000.0;
+		const double endTs = Clock::TicksToMillisecondsD(sorted[end-1].tick - baseTick) * 1000.0;
+
+		sprintf(str, "%s{\"name\":\"Message %u (%s)\",\"cat\":\"kNet\",\"ph\":\"b\",\"id\":%u,\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+			first ? "" : ",", (unsigned int)head.messageID, inbound ? "in" : "out", (unsigned int)head.traceID, startTs, (int)head.thread);
+		out += str;
+		first = false;
+
+		// A slice for the time from each stage to the next.
+		for(size_t i = begin; i + 1 < end; ++i)
+		{
+			const double ts = Clock::TicksToMillisecondsD(sorted[i].tick - baseTick) * 1000.0;
+			const double nextTs = Clock::TicksToMillisecondsD(sorted[i+1].tick - baseTick) * 1000.0;
+			sprintf(str, ",{\"name\":\"%s\",\"cat\":\"kNet\",\"ph\":\"b\",\"id\":%u,\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+				WaitNameAfterStage(sorted[i].stage), (unsigned int)head.traceID, ts, (int)sorted[i].thread);
+			out += str;
+			sprintf(str, ",{\"name\":\"%s\",\"cat\":\"kNet\",\"ph\":\"e\",\"id\":%u,\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+				WaitNameAfterStage(sorted[i].stage), (unsigned int)head.traceID, nextTs, (int)sorted[i+1].thread);
+			out += str;
+		}
+
+		sprintf(str, ",{\"name\":\"%s\",\"cat\":\"kNet\",\"ph\":\"n\",\"id\":%u,\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+			MessageTraceStageToString((MessageTraceStage)sorted[end-1].stage), (unsigned int)head.traceID, endTs, (int)sorted[end-1].thread);
+		out += str;
+		sprintf(str, ",{\"name\":\"Message %u (%s)\",\"cat\":\"kNet\",\"ph\":\"e\",\"id\":%u,\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+			(unsigned int)head.messageID, inbound ? "in" : "out", (unsigned int)head.traceID, endTs, (int)sorted[end-1].thread);
+		out += str;
+
+		begin = end;
+	}
+	return out + "]}\n";
+}
+
+bool MessageTracer::WriteChromeTrace(const char *filename)
+{
+	std::vector<MessageTraceEvent> events;
+	Collect(events);
+	const std::string trace = ToChromeTrace(events);
+
+	FILE *handle = fopen(filename, "wb");
+	if (!handle)
+	{
+		KNET_LOG(LogError, "MessageTracer::WriteChromeTrace: Could not open %s for writing!", filename);
+		return false;
+	}
+	const bool written = fwrite(trace.data(), 1, trace.size(), handle) == trace.size();
+	fclose(handle);
+	return written;
+}
+
+} // ~kNet
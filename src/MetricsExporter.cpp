@@ -0,0 +1,422 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MetricsExporter.cpp
+	@brief Implements the MetricsExporter class. */
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(KNET_UNIX) || defined(ANDROID)
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+#include "kNet/MetricsExporter.h"
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/NetworkWorkerThread.h"
+#include "kNet/UDPMessageConnection.h"
+#include "kNet/NetworkLogging.h"
+#include "kNet/Clock.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+/// The names the latency histograms are exported under, indexed by LatencyMetric.
+static const char * const latencyMetricNames[NumLatencyMetrics] = { "ping_rtt", "ack_rtt", "queue_time", "receive_delay" };
+
+static void AppendHeader(std::string &out, const std::string &name, const char *type, const char *help)
+{
+	out += "# HELP " + name + " " + help + "\n";
+	out += "# TYPE " + name + " " + type + "\n";
+}
+
+static void AppendSample(std::string &out, const std::string &name, const std::string &labels, double value)
+{
+	char str[64];
+	sprintf(str, " %.9g\n", value);
+	out += name;
+	if (!labels.empty())
+		out += "{" + labels + "}";
+	out += str;
+}
+
+/// Appends the samples of a summary metric, of which a HELP and TYPE header has already been written.
+static void AppendSummary(std::string &out, const std::string &name, const std::string &labels, const LatencyHistogram &histogram)
+{
+	const std::string separator = labels.empty() ? "" : ",";
+	AppendSample(out, name, labels + separator + "quantile=\"0.5\"", histogram.PercentileMSecs(50.f));
+	AppendSample(out, name, labels + separator + "quantile=\"0.99\"", histogram.PercentileMSecs(99.f));
+	AppendSample(out, name, labels + separator + "quantile=\"0.999\"", histogram.PercentileMSecs(99.9f));
+	AppendSample(out, name + "_sum", labels, (double)histogram.MeanMSecs() * (double)histogram.Count());
+	AppendSample(out, name + "_count", labels, (double)histogram.Count());
+}
+
+static double ConnectionBytesIn(MessageConnection &c) { return (double)c.BytesInTotal(); }
+static double ConnectionBytesOut(MessageConnection &c) { return (double)c.BytesOutTotal(); }
+static double ConnectionBytesInRate(MessageConnection &c) { return c.BytesInPerSec(); }
+static double ConnectionBytesOutRate(MessageConnection &c) { return c.BytesOutPerSec(); }
+static double ConnectionPacketsInRate(MessageConnection &c) { return c.PacketsInPerSec(); }
+static double ConnectionPacketsOutRate(MessageConnection &c) { return c.PacketsOutPerSec(); }
+static double ConnectionMsgsInRate(MessageConnection &c) { return c.MsgsInPerSec(); }
+static double ConnectionMsgsOutRate(MessageConnection &c) { return c.MsgsOutPerSec(); }
+static double ConnectionRtt(MessageConnection &c) { return c.RoundTripTime(); }
+static double ConnectionLastHeard(MessageConnection &c) { return c.LastHeardTime(); }
+static double ConnectionInboundQueue(MessageConnection &c) { return (double)c.NumInboundMessagesPending(); }
+static double ConnectionOutboundQueue(MessageConnection &c) { return (double)c.NumOutboundMessagesPending(); }
+static double ConnectionMemory(MessageConnection &c) { return (double)c.MemoryUsage(); }
+static double ConnectionMemoryRefusals(MessageConnection &c) { return (double)c.NumMemoryLimitRefusals(); }
+
+static double ConnectionPacketLoss(MessageConnection &c)
+{
+	Socket *socket = c.GetSocket();
+	if (!socket || socket->TransportLayer() != SocketOverUDP)
+		return 0.0;
+	return static_cast<UDPMessageConnection &>(c).PacketLossRate();
+}
+
+static double ConnectionMalformedDatagrams(MessageConnection &c)
+{
+	Socket *socket = c.GetSocket();
+	if (!socket || socket->TransportLayer() != SocketOverUDP)
+		return 0.0;
+	return (double)static_cast<UDPMessageConnection &>(c).NumMalformedDatagrams();
+}
+
+/// A metric that has a single value for each connection.
+struct ConnectionMetric
+{
+	const char *name;
+	const char *type;
+	const char *help;
+	double (*value)(MessageConnection &connection);
+};
+
+static const ConnectionMetric connectionMetrics[] =
+{
+	{ "knet_connection_received_bytes_total", "counter", "Bytes received from the peer, excluding IP and UDP/TCP headers.", ConnectionBytesIn },
+	{ "knet_connection_sent_bytes_total", "counter", "Bytes sent to the peer, excluding IP and UDP/TCP headers.", ConnectionBytesOut },
+	{ "knet_connection_received_bytes_per_second", "gauge", "Recent average rate of received bytes.", ConnectionBytesInRate },
+	{ "knet_connection_sent_bytes_per_second", "gauge", "Recent average rate of sent bytes.", ConnectionBytesOutRate },
+	{ "knet_connection_received_packets_per_second", "gauge", "Recent average rate of received datagrams.", ConnectionPacketsInRate },
+	{ "knet_connection_sent_packets_per_second", "gauge", "Recent average rate of sent datagrams.", ConnectionPacketsOutRate },
+	{ "knet_connection_received_messages_per_second", "gauge", "Recent average rate of received messages.", ConnectionMsgsInRate },
+	{ "knet_connection_sent_messages_per_second", "gauge", "Recent average rate of sent messages.", ConnectionMsgsOutRate },
+	{ "knet_connection_rtt_milliseconds", "gauge", "Smoothed round-trip time estimate.", ConnectionRtt },
+	{ "knet_connection_last_heard_milliseconds", "gauge", "Time since data was last received from the peer.", ConnectionLastHeard },
+	{ "knet_connection_packet_loss_ratio", "gauge", "Estimated fraction of datagrams lost. UDP only.", ConnectionPacketLoss },
+	{ "knet_connection_malformed_datagrams_total", "counter", "Received datagrams dropped since they could not be parsed. UDP only.", ConnectionMalformedDatagrams },
+	{ "knet_connection_inbound_queue_messages", "gauge", "Received messages waiting for the application.", ConnectionInboundQueue },
+	{ "knet_connection_outbound_queue_messages", "gauge", "Messages waiting to be sent.", ConnectionOutboundQueue },
+	{ "knet_connection_queue_memory_bytes", "gauge", "Memory held by the message and datagram queues of the connection.", ConnectionMemory },
+	{ "knet_connection_memory_limit_refusals_total", "counter", "Queue growths refused by the memory limits.", ConnectionMemoryRefusals }
+};
+
+std::string MetricsExporter::FormatMetrics(Network &network)
+{
+	std::string out;
+
+	std::vector<std::pair<std::string, MessageConnection *> > connections;
+	const std::set<MessageConnection *> &networkConnections = network.Connections();
+	for(std::set<MessageConnection *>::const_iterator iter = networkConnections.begin(); iter != networkConnections.end(); ++iter)
+	{
+		MessageConnection *connection = *iter;
+		Socket *socket = connection->GetSocket();
+		if (!socket)
+			continue;
+		std::string labels = "peer=\"" + connection->RemoteEndPoint().ToString() + "\",transport=\"" +
+			(socket->TransportLayer() == SocketOverUDP ? "udp" : (socket->TransportLayer() == SocketOverSharedMemory ? "shm" : "tcp")) + "\"";
+		connections.push_back(std::make_pair(labels, connection));
+	}
+
+	for(size_t i = 0; i < sizeof(connectionMetrics) / sizeof(connectionMetrics[0]); ++i)
+	{
+		const ConnectionMetric &metric = connectionMetrics[i];
+		AppendHeader(out, metric.name, metric.type, metric.help);
+		for(size_t j = 0; j < connections.size(); ++j)
+			AppendSample(out, metric.name, connections[j].first, metric.value(*connections[j].second));
+	}
+
+	for(int i = 0; i < NumLatencyMetrics; ++i)
+	{
+		const std::string name = std::string("knet_connection_") + latencyMetricNames[i] + "_milliseconds";
+		AppendHeader(out, name, "summary", LatencyMetricToString((LatencyMetric)i));
+		for(size_t j = 0; j < connections.size(); ++j)
+			AppendSummary(out, name, connections[j].first, connections[j].second->GetLatencyHistogram((LatencyMetric)i));
+	}
+
+	Ptr(NetworkServer) server = network.GetServer();
+	if (server)
+	{
+		AppendHeader(out, "knet_server_connections", "gauge", "Active connections of the server.");
+		AppendSample(out, "knet_server_connections", "", server->NumConnections());
+		AppendHeader(out, "knet_server_receive_queue_drops_total", "counter", "Datagrams the OS dropped at the full receive buffers of the server sockets.");
+		AppendSample(out, "knet_server_receive_queue_drops_total", "", (double)server->ReceiveQueueDrops());
+		AppendHeader(out, "knet_server_malformed_datagrams_total", "counter", "Datagrams of the server and its connections dropped since they could not be parsed.");
+		AppendSample(out, "knet_server_malformed_datagrams_total", "", (double)server->NumMalformedDatagrams());
+		for(int i = 0; i < NumLatencyMetrics; ++i)
+		{
+			const std::string name = std::string("knet_server_") + latencyMetricNames[i] + "_milliseconds";
+			AppendHeader(out, name, "summary", LatencyMetricToString((LatencyMetric)i));
+			AppendSummary(out, name, "", server->AggregateLatencyHistogram((LatencyMetric)i));
+		}
+	}
+
+	const std::vector<NetworkWorkerThread *> &workerThreads = network.WorkerThreads();
+	AppendHeader(out, "knet_worker_connections", "gauge", "Connections processed by the worker thread.");
+	for(size_t i = 0; i < workerThreads.size(); ++i)
+	{
+		char labels[32];
+		sprintf(labels, "worker=\"%d\"", (int)i);
+		AppendSample(out, "knet_worker_connections", labels, workerThreads[i]->NumConnections());
+	}
+	AppendHeader(out, "knet_worker_round_milliseconds", "summary", "Busy time of each round of the worker thread, from waking up to waiting again.");
+	for(size_t i = 0; i < workerThreads.size(); ++i)
+	{
+		char labels[32];
+		sprintf(labels, "worker=\"%d\"", (int)i);
+		AppendSummary(out, "knet_worker_round_milliseconds", labels, workerThreads[i]->RoundTimes());
+	}
+
+	std::vector<WorkerProfile> profiles;
+	for(size_t i = 0; i < workerThreads.size(); ++i)
+		profiles.push_back(workerThreads[i]->Profile());
+	AppendHeader(out, "knet_worker_phase_seconds_total", "counter", "Time the worker thread has spent in each phase of its main loop. The phase \"wait\" is the idle time.");
+	for(size_t i = 0; i < profiles.size(); ++i)
+		for(int phase = 0; phase < NumWorkerPhases; ++phase)
+		{
+			char labels[64];
+			sprintf(labels, "worker=\"%d\",phase=\"%s\"", (int)i, WorkerProfile::PhaseName((WorkerPhase)phase));
+			AppendSample(out, "knet_worker_phase_seconds_total", labels, (double)profiles[i].phaseTicks[phase] / Clock::TicksPerSec());
+		}
+	AppendHeader(out, "knet_worker_wakeups_total", "counter", "Times the worker thread has woken up from waiting for events.");
+	for(size_t i = 0; i < profiles.size(); ++i)
+	{
+		char labels[32];
+		sprintf(labels, "worker=\"%d\"", (int)i);
+		AppendSample(out, "knet_worker_wakeups_total", labels, (double)profiles[i].numWakeups);
+	}
+	AppendHeader(out, "knet_worker_events_total", "counter", "Events signalled to the worker thread over all its wakeups.");
+	for(size_t i = 0; i < profiles.size(); ++i)
+	{
+		char labels[32];
+		sprintf(labels, "worker=\"%d\"", (int)i);
+		AppendSample(out, "knet_worker_events_total", labels, (double)profiles[i].numEvents);
+	}
+	AppendHeader(out, "knet_worker_datagrams_total", "counter", "Datagrams the worker thread has received and sent.");
+	for(size_t i = 0; i < profiles.size(); ++i)
+	{
+		char labels[48];
+		sprintf(labels, "worker=\"%d\",direction=\"in\"", (int)i);
+		AppendSample(out, "knet_worker_datagrams_total", labels, (double)profiles[i].numDatagramsIn);
+		sprintf(labels, "worker=\"%d\",direction=\"out\"", (int)i);
+		AppendSample(out, "knet_worker_datagrams_total", labels, (double)profiles[i].numDatagramsOut);
+	}
+
+	AppendHeader(out, "knet_connection_queue_memory_total_bytes", "gauge", "Memory held by the queues of all the connections.");
+	AppendSample(out, "knet_connection_queue_memory_total_bytes", "", (double)Network::ConnectionMemoryBudget().BytesUsed());
+
+	AppendHeader(out, "knet_stats_dropped_events_total", "counter", "Profiling events dropped because a thread's event queue was full.");
+	AppendSample(out, "knet_stats_dropped_events_total", "", network.NumDroppedStatsEvents());
+
+	return out;
+}
+
+MetricsExporter::MetricsExporter(Network *owner_)
+:owner(owner_), listenSocket(INVALID_SOCKET), snapshotVersion(0), scrapeRequested(false)
+{
+	assert(owner);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+	Stop();
+}
+
+bool MetricsExporter::Start(unsigned short port, const char *bindAddress)
+{
+	Stop();
+
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = inet_addr(bindAddress);
+
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == INVALID_SOCKET || s == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "MetricsExporter::Start: socket() failed: %s", Network::GetLastErrorString().c_str());
+		return false;
+	}
+
+	// A restarted server can reclaim the port right away.
+#ifdef WIN32
+	BOOL val = TRUE;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&val, sizeof(val));
+#else
+	int val = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+#endif
+
+	if (bind(s, (sockaddr *)&address, sizeof(address)) == KNET_SOCKET_ERROR || listen(s, 16) == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "MetricsExporter::Start: Could not listen on %s:%d: %s", bindAddress, (int)port, Network::GetLastErrorString().c_str());
+		closesocket(s);
+		return false;
+	}
+
+	listenSocket = s;
+	scrapeRequested = false;
+	serveThread.Run(this, &MetricsExporter::ServeLoop);
+	KNET_LOG(LogInfo, "MetricsExporter serving metrics at http://%s:%d/metrics.", bindAddress, (int)port);
+	return true;
+}
+
+void MetricsExporter::Stop()
+{
+	if (listenSocket == INVALID_SOCKET)
+		return;
+
+	serveThread.Stop();
+	closesocket(listenSocket);
+	listenSocket = INVALID_SOCKET;
+}
+
+void MetricsExporter::Update()
+{
+	if (!scrapeRequested)
+		return;
+
+	std::string metrics = FormatMetrics(*owner);
+	snapshot.Acquire()->swap(metrics);
+	scrapeRequested = false;
+	++snapshotVersion;
+}
+
+bool MetricsExporter::WriteToFile(const char *filename)
+{
+	const std::string metrics = FormatMetrics(*owner);
+	const std::string tempFilename = std::string(filename) + ".tmp";
+
+	FILE *handle = fopen(tempFilename.c_str(), "wb");
+	if (!handle)
+	{
+		KNET_LOG(LogError, "MetricsExporter::WriteToFile: Could not open %s for writing!", tempFilename.c_str());
+		return false;
+	}
+	const bool written = fwrite(metrics.data(), 1, metrics.size(), handle) == metrics.size();
+	fclose(handle);
+
+#ifdef WIN32
+	remove(filename); // rename() does not replace an existing file on Windows.
+#endif
+	if (!written || rename(tempFilename.c_str(), filename) != 0)
+	{
+		KNET_LOG(LogError, "MetricsExporter::WriteToFile: Could not write %s!", filename);
+		remove(tempFilename.c_str());
+		return false;
+	}
+	return true;
+}
+
+/// Waits until the given socket is readable, or the given number of milliseconds have passed.
+static bool WaitReadable(SOCKET s, int msecs)
+{
+	fd_set readSet;
+	FD_ZERO(&readSet);
+	FD_SET(s, &readSet);
+	TIMEVAL timeout;
+	timeout.tv_sec = msecs / 1000;
+	timeout.tv_usec = (msecs % 1000) * 1000;
+	return select((int)s + 1, &readSet, 0, 0, &timeout) > 0;
+}
+
+void MetricsExporter::ServeLoop()
+{
+	while(!serveThread.ShouldQuit())
+	{
+		// Wake up regularly to check whether the exporter is being stopped.
+		if (!WaitReadable(listenSocket, 100))
+			continue;
+
+		SOCKET client = accept(listenSocket, 0, 0);
+		if (client == INVALID_SOCKET || client == KNET_ACCEPT_FAILURE)
+			continue;
+		ServeClient(client);
+		closesocket(client);
+	}
+}
+
+void MetricsExporter::ServeClient(SOCKET client)
+{
+	// Read the request line and the headers. The body of a GET request is empty, so the request ends with an empty line.
+	const int cMaxRequestSize = 4096;
+	char request[cMaxRequestSize + 1];
+	int requestSize = 0;
+	while(requestSize < cMaxRequestSize && WaitReadable(client, 1000))
+	{
+		int numBytes = recv(client, request + requestSize, cMaxRequestSize - requestSize, 0);
+		if (numBytes <= 0)
+			break;
+		requestSize += numBytes;
+		request[requestSize] = 0;
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+			break;
+	}
+	request[requestSize] = 0;
+
+	std::string response;
+	if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0)
+	{
+		// Ask the main thread for a fresh snapshot, and fall back to the previous one if it doesn't respond in time.
+		const unsigned long version = snapshotVersion;
+		scrapeRequested = true;
+		const tick_t deadline = Clock::Tick() + Clock::TicksPerMillisecond() * cMaxScrapeWaitMSecs;
+		while(snapshotVersion == version && Clock::IsNewer(deadline, Clock::Tick()) && !serveThread.ShouldQuit())
+			Clock::Sleep(1);
+
+		std::string body = *snapshot.Acquire();
+		char header[256];
+		sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", (int)body.size());
+		response = header + body;
+	}
+	else
+		response = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot Found\n";
+
+	// A scraper that hangs up early must not raise SIGPIPE on the application.
+#ifdef MSG_NOSIGNAL
+	const int sendFlags = MSG_NOSIGNAL;
+#else
+	const int sendFlags = 0;
+#endif
+	size_t numSent = 0;
+	while(numSent < response.size())
+	{
+		int ret = send(client, response.data() + numSent, (int)(response.size() - numSent), sendFlags);
+		if (ret <= 0)
+			break;
+		numSent += ret;
+	}
+}
+
+} // ~kNet
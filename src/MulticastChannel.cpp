@@ -0,0 +1,295 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MulticastChannel.cpp
+	@brief */
+
+#include <cstring>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "kNet/MulticastChannel.h"
+#include "kNet/DataSerializer.h"
+#include "kNet/DataDeserializer.h"
+#include "kNet/VLEPacker.h"
+#include "kNet/NetException.h"
+#include "kNet/Network.h"
+#include "kNet/NetworkLogging.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+const char MulticastChannel::cDatagramMagic[4] = { 'k', 'N', 'M', 'c' };
+
+/// The largest datagram a receiver reads.
+static const size_t cMaxReceivedDatagramSize = 65536;
+
+MulticastChannel::MulticastChannel()
+:socket(INVALID_SOCKET), sender(false), datagramBytes(0), maxDatagramSize(0),
+nextSequenceNumber(0), newestSequenceNumber(0), receivedAny(false),
+numDatagramsSent(0), numDatagramsReceived(0), numDatagramsLost(0)
+{
+}
+
+MulticastChannel::~MulticastChannel()
+{
+	Close();
+}
+
+bool MulticastChannel::IsMulticastAddress(const EndPoint &address)
+{
+	return address.ip[0] >= 224 && address.ip[0] <= 239;
+}
+
+/// Opens a nonblocking UDP socket, or returns INVALID_SOCKET on failure.
+static SOCKET OpenNonblockingUDPSocket()
+{
+	SOCKET udpSocket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (udpSocket == INVALID_SOCKET || udpSocket == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "MulticastChannel: Error at socket(): %s", Network::GetLastErrorString().c_str());
+		return INVALID_SOCKET;
+	}
+#ifdef WIN32
+	u_long nonBlocking = 1;
+	const int ret = ioctlsocket(udpSocket, FIONBIO, &nonBlocking);
+#else
+	const int ret = fcntl(udpSocket, F_SETFL, fcntl(udpSocket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+	if (ret == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "MulticastChannel: Could not make the socket nonblocking: %s", Network::GetLastErrorString().c_str());
+		closesocket(udpSocket);
+		return INVALID_SOCKET;
+	}
+	return udpSocket;
+}
+
+bool MulticastChannel::OpenSender(const EndPoint &group_, int timeToLive, size_t maxDatagramSize_)
+{
+	Close();
+	if (!IsMulticastAddress(group_) || maxDatagramSize_ <= cHeaderSize)
+	{
+		KNET_LOG(LogError, "MulticastChannel::OpenSender: %s is not a multicast address!", group_.ToString().c_str());
+		return false;
+	}
+
+	SOCKET udpSocket = OpenNonblockingUDPSocket();
+	if (udpSocket == INVALID_SOCKET)
+		return false;
+
+	// With the loopback on, the receivers of this host get the datagrams as well.
+	int loop = 1;
+	if (setsockopt(udpSocket, IPPROTO_IP, IP_MULTICAST_TTL, (const char *)&timeToLive, sizeof(timeToLive)) == KNET_SOCKET_ERROR ||
+		setsockopt(udpSocket, IPPROTO_IP, IP_MULTICAST_LOOP, (const char *)&loop, sizeof(loop)) == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "MulticastChannel::OpenSender: Could not set the multicast options: %s", Network::GetLastErrorString().c_str());
+		closesocket(udpSocket);
+		return false;
+	}
+
+	socket = udpSocket;
+	sender = true;
+	group = group_;
+	maxDatagramSize = maxDatagramSize_;
+	datagram.resize(maxDatagramSize);
+	datagramBytes = 0;
+	KNET_LOG(LogInfo, "MulticastChannel::OpenSender: Sending to the multicast group %s.", group.ToString().c_str());
+	return true;
+}
+
+bool MulticastChannel::Join(const EndPoint &group_, const EndPoint &sender_)
+{
+	Close();
+	if (!IsMulticastAddress(group_))
+	{
+		KNET_LOG(LogError, "MulticastChannel::Join: %s is not a multicast address!", group_.ToString().c_str());
+		return false;
+	}
+
+	SOCKET udpSocket = OpenNonblockingUDPSocket();
+	if (udpSocket == INVALID_SOCKET)
+		return false;
+
+	int reuse = 1;
+	if (setsockopt(udpSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) == KNET_SOCKET_ERROR)
+		KNET_LOG(LogError, "MulticastChannel::Join: setsockopt SO_REUSEADDR failed: %s", Network::GetLastErrorString().c_str());
+
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(group_.port);
+	if (bind(udpSocket, (const sockaddr *)&address, sizeof(address)) == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "MulticastChannel::Join: Could not bind to port %d: %s", (int)group_.port, Network::GetLastErrorString().c_str());
+		closesocket(udpSocket);
+		return false;
+	}
+
+	ip_mreq membership;
+	memset(&membership, 0, sizeof(membership));
+	membership.imr_multiaddr = group_.ToSockAddrIn().sin_addr;
+	membership.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (setsockopt(udpSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char *)&membership, sizeof(membership)) == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "MulticastChannel::Join: Could not join the group %s: %s", group_.ToString().c_str(), Network::GetLastErrorString().c_str());
+		closesocket(udpSocket);
+		return false;
+	}
+
+	socket = udpSocket;
+	sender = false;
+	group = group_;
+	acceptedSender = sender_;
+	datagram.resize(cMaxReceivedDatagramSize);
+	receivedAny = false;
+	KNET_LOG(LogInfo, "MulticastChannel::Join: Joined the multicast group %s.", group.ToString().c_str());
+	return true;
+}
+
+void MulticastChannel::Close()
+{
+	if (socket != INVALID_SOCKET)
+		closesocket(socket);
+	socket = INVALID_SOCKET;
+	datagramBytes = 0;
+}
+
+bool MulticastChannel::QueueMessage(u32 id, const char *data, size_t numBytes)
+{
+	if (!IsSender())
+		return false;
+
+	const size_t numBytesNeeded = (VLE8_16_32::GetEncodedBitLength(id) + VLE8_16_32::GetEncodedBitLength((u32)numBytes)) / 8 + numBytes;
+	if (cHeaderSize + numBytesNeeded > maxDatagramSize)
+	{
+		KNET_LOG(LogError, "MulticastChannel::QueueMessage: A message of %d bytes does not fit in a %d-byte datagram! Discarding the message.",
+			(int)numBytes, (int)maxDatagramSize);
+		return false;
+	}
+
+	if (datagramBytes + numBytesNeeded > maxDatagramSize)
+		Flush();
+	if (datagramBytes == 0)
+		datagramBytes = cHeaderSize;
+
+	DataSerializer ds(&datagram[datagramBytes], maxDatagramSize - datagramBytes);
+	ds.AddVLE<VLE8_16_32>(id);
+	ds.AddVLE<VLE8_16_32>((u32)numBytes);
+	if (numBytes > 0)
+		ds.AddAlignedByteArray(data, (u32)numBytes);
+	datagramBytes += ds.BytesFilled();
+	return true;
+}
+
+void MulticastChannel::Flush()
+{
+	if (!IsSender() || datagramBytes == 0)
+		return;
+
+	DataSerializer ds(&datagram[0], cHeaderSize);
+	ds.AddAlignedByteArray(cDatagramMagic, sizeof(cDatagramMagic));
+	ds.Add<u32>(nextSequenceNumber++);
+
+	sockaddr_in address = group.ToSockAddrIn();
+	const int ret = sendto(socket, &datagram[0], (int)datagramBytes, 0, (const sockaddr *)&address, sizeof(address));
+	if (ret == KNET_SOCKET_ERROR)
+		KNET_LOG(LogVerbose, "MulticastChannel::Flush: sendto failed: %s. The datagram is lost.", Network::GetLastErrorString().c_str());
+	else
+		++numDatagramsSent;
+	datagramBytes = 0;
+}
+
+bool MulticastChannel::ReceiveDatagram()
+{
+	receivedMessages.clear();
+	if (!IsOpen() || sender)
+		return false;
+
+	for(;;)
+	{
+		sockaddr_in from;
+		socklen_t fromLength = sizeof(from);
+		const int numBytes = recvfrom(socket, &datagram[0], (int)datagram.size(), 0, (sockaddr *)&from, &fromLength);
+		if (numBytes == KNET_SOCKET_ERROR || numBytes <= 0)
+			return false;
+
+		const EndPoint fromEndPoint = EndPoint::FromSockAddrIn(from);
+		const bool anySender = (acceptedSender.ip[0] | acceptedSender.ip[1] | acceptedSender.ip[2] | acceptedSender.ip[3]) == 0;
+		if (!anySender && memcmp(fromEndPoint.ip, acceptedSender.ip, sizeof(fromEndPoint.ip)) != 0)
+		{
+			KNET_LOG(LogVerbose, "MulticastChannel::ReceiveDatagram: Dropped a datagram from %s, which is not the sender of the group.", fromEndPoint.ToString().c_str());
+			continue;
+		}
+		if (ParseDatagram(&datagram[0], (size_t)numBytes))
+			return true;
+	}
+}
+
+bool MulticastChannel::ParseDatagram(const char *data, size_t numBytes)
+{
+	receivedMessages.clear();
+	if (numBytes < cHeaderSize || memcmp(data, cDatagramMagic, sizeof(cDatagramMagic)) != 0)
+		return false;
+
+	// Check the whole datagram before passing on any of it, so that a malformed datagram is dropped as a whole.
+	u32 sequenceNumber = 0;
+	try
+	{
+		DataDeserializer dd(data, numBytes);
+		dd.SkipBytes(sizeof(cDatagramMagic));
+		sequenceNumber = dd.Read<u32>();
+		while(dd.BytesLeft() > 0)
+		{
+			ReceivedMessage msg;
+			msg.id = dd.ReadVLE<VLE8_16_32>();
+			msg.numBytes = dd.ReadVLE<VLE8_16_32>();
+			if (msg.numBytes > dd.BytesLeft())
+				throw NetException("The message is longer than the datagram!");
+			msg.data = dd.CurrentData();
+			dd.SkipBytes((int)msg.numBytes);
+			receivedMessages.push_back(msg);
+		}
+	}
+	catch(const NetException &e)
+	{
+		KNET_LOG(LogError, "MulticastChannel::ReceiveDatagram: Dropped a malformed datagram of %d bytes: %s", (int)numBytes, e.what());
+		receivedMessages.clear();
+		return false;
+	}
+
+	if (receivedAny)
+	{
+		const s32 advance = (s32)(sequenceNumber - newestSequenceNumber);
+		if (advance <= 0)
+		{
+			// A late or duplicated datagram. It was counted lost when the newer one arrived.
+			receivedMessages.clear();
+			return false;
+		}
+		numDatagramsLost += (u32)advance - 1;
+	}
+	receivedAny = true;
+	newestSequenceNumber = sequenceNumber;
+	++numDatagramsReceived;
+	return true;
+}
+
+} // ~kNet
@@ -17,6 +17,7 @@
 
 #include <string>
 #include <sstream>
+#include <algorithm>
 
 #include <cassert>
 
@@ -26,6 +27,8 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #endif
 
 #ifdef KNET_USE_BOOST
@@ -37,15 +40,31 @@
 #include "kNet/Network.h"
 
 #include "kNet/TCPMessageConnection.h"
+#include "kNet/SharedMemoryChannel.h"
 #include "kNet/UDPMessageConnection.h"
+#include "kNet/DatagramBuffer.h"
 #include "kNet/NetworkWorkerThread.h"
 #include "kNet/NetworkLogging.h"
+#include "kNet/ServerHandOff.h"
+#include "kNet/DataSerializer.h"
+#include "kNet/DataDeserializer.h"
 
 namespace kNet
 {
 
 const int cMaxTCPSendSize = 25 * 1024 * 1024; // For TCP sockets, there is no specific limit to send(), specify something.
-const int cMaxUDPSendSize = 1400;
+const int cMaxUDPSendSize = 1400; // The default, see Network::SetMaxDatagramSize.
+/// The smallest datagram size limit accepted, a little above the 576 byte IPv4 minimum reassembly size.
+const int cMinUDPSendSize = 512;
+
+#ifdef WIN32
+#ifdef KNET_USE_RIO
+/// The sockets are created for Registered I/O, so that the worker threads can pass their transfers through RegisteredIO.
+const DWORD cSocketFlags = WSA_FLAG_OVERLAPPED | WSA_FLAG_REGISTERED_IO;
+#else
+const DWORD cSocketFlags = WSA_FLAG_OVERLAPPED;
+#endif
+#endif
 
 std::string Network::GetErrorString(int error)
 {
@@ -104,7 +123,25 @@ std::string FormatBytes(double numBytes)
 }
 
 Network::Network()
+:lastPendingConnectsTick(0),
+maxWorkerThreads(Thread::NumHardwareThreads()),
+numWorkerThreadsCreated(0),
+workerBusyPolling(false),
+workerBusyPollIdleMSecs(1000.f),
+workerPriority(ThreadPriorityNormal),
+workerAlignListenSockets(false),
+maxDatagramSize(cMaxUDPSendSize),
+connectionMemoryLimit(0),
+encryptionEnabled(false),
+datagramChecksums(false),
+tcpFastOpen(false),
+maxSharedUDPClientSockets(0),
+connectedUDPServerSockets(false),
+malformedDatagramLimit(0),
+firstMessageIDCode(0),
+numMessageIDCodes(0)
 {
+	memset(encryptionKey, 0, sizeof(encryptionKey));
 #ifdef WIN32
 	memset(&wsaData, 0, sizeof(wsaData));
 #endif
@@ -293,19 +330,87 @@ void Network::Init()
 	}
 }
 
-NetworkWorkerThread *Network::GetOrCreateWorkerThread()
+void Network::SetMaxWorkerThreads(int maxThreads)
 {
-	static const int maxConnectionsPerThread = 8;
+	maxWorkerThreads = std::max(maxThreads, 1);
+}
 
-	// Find an existing thread with sufficiently low load.
+void Network::SetWorkerBusyPolling(bool enabled, float idleFallbackMSecs)
+{
+	workerBusyPolling = enabled;
+	workerBusyPollIdleMSecs = idleFallbackMSecs;
+	if (enabled && maxWorkerThreads >= Thread::NumHardwareThreads())
+		KNET_LOG(LogInfo, "Network::SetWorkerBusyPolling: Up to %d busy-polling worker threads on %d hardware threads leave no core for the application. Consider lowering SetMaxWorkerThreads().",
+			maxWorkerThreads, Thread::NumHardwareThreads());
 	for(size_t i = 0; i < workerThreads.size(); ++i)
-		if (workerThreads[i]->NumConnections() + workerThreads[i]->NumServers() < maxConnectionsPerThread)
-			return workerThreads[i];
+		workerThreads[i]->SetBusyPolling(enabled, idleFallbackMSecs);
+}
 
-	// No appropriate thread found. Create a new one.
-	NetworkWorkerThread *workerThread = new NetworkWorkerThread();
-	workerThread->StartThread();
+void Network::SetWorkerThreadPlacement(const std::vector<int> &cpus, ThreadPriority priority, bool alignListenSockets)
+{
+	workerCpus = cpus;
+	workerPriority = priority;
+	workerAlignListenSockets = alignListenSockets;
+	for(size_t i = 0; i < workerThreads.size(); ++i)
+		PlaceWorkerThread(i);
+}
+
+void Network::PlaceWorkerThread(size_t index)
+{
+	const int cpu = workerCpus.empty() ? -1 : workerCpus[index % workerCpus.size()];
+	workerThreads[index]->SetPlacement(cpu, workerPriority, workerAlignListenSockets);
+}
+
+void Network::SetMaxDatagramSize(size_t bytes)
+{
+	maxDatagramSize = std::min<size_t>(std::max<size_t>(bytes, cMinUDPSendSize), cMaxDatagramSize);
+}
+
+MemoryBudget &Network::ConnectionMemoryBudget()
+{
+	static MemoryBudget budget;
+	return budget;
+}
+
+void Network::SetEncryptionKey(const u8 *key)
+{
+	encryptionEnabled = (key != 0);
+	if (key)
+		memcpy(encryptionKey, key, sizeof(encryptionKey));
+	else
+		memset(encryptionKey, 0, sizeof(encryptionKey));
+}
+
+NetworkWorkerThread *Network::GetOrCreateWorkerThread(const std::vector<NetworkWorkerThread *> *exclude)
+{
+	// Spread the work over as many threads as we are allowed to. Once the pool is full, pick the least loaded thread.
+	if ((int)workerThreads.size() >= maxWorkerThreads && !workerThreads.empty())
+	{
+		NetworkWorkerThread *leastLoaded = 0;
+		float leastLoad = 0.f;
+		for(size_t i = 0; i < workerThreads.size(); ++i)
+		{
+			if (exclude && std::find(exclude->begin(), exclude->end(), workerThreads[i]) != exclude->end())
+				continue;
+			float load = workerThreads[i]->Load();
+			if (!leastLoaded || load < leastLoad)
+			{
+				leastLoaded = workerThreads[i];
+				leastLoad = load;
+			}
+		}
+		if (leastLoaded)
+			return leastLoaded;
+		if (exclude) // All the threads are excluded, so ignore the exclude list.
+			return GetOrCreateWorkerThread(0);
+	}
+
+	NetworkWorkerThread *workerThread = new NetworkWorkerThread(this, numWorkerThreadsCreated++);
+	if (workerBusyPolling)
+		workerThread->SetBusyPolling(true, workerBusyPollIdleMSecs);
 	workerThreads.push_back(workerThread);
+	PlaceWorkerThread(workerThreads.size() - 1);
+	workerThread->StartThread();
 	KNET_LOG(LogInfo, "Created a new NetworkWorkerThread. There are now %d worker threads.", (int)workerThreads.size());
 	return workerThread;
 }
@@ -317,11 +422,97 @@ void Network::AssignConnectionToWorkerThread(MessageConnection *connection)
 	workerThread->AddConnection(connection);
 }
 
+void Network::MoveConnectionToWorkerThread(MessageConnection *connection, NetworkWorkerThread *workerThread)
+{
+	NetworkWorkerThread *oldThread = connection->WorkerThread();
+	if (oldThread == workerThread)
+		return;
+
+	// While neither of the threads has the connection, no thread accesses its worker-side data, so the ownership can be
+	// handed over safely. Remove waits until the old thread has let go of the connection, and the command queue of the new
+	// thread publishes the connection to it, which orders the memory accesses of the two threads.
+	if (oldThread)
+		oldThread->RemoveConnection(connection);
+	connection->SetWorkerThread(workerThread);
+	workerThread->AddConnection(connection);
+}
+
+bool Network::RebalanceWorkerThreads()
+{
+	// The most loaded thread needs to have at least this many times the load of the least loaded one before a connection is moved.
+	static const float imbalanceRatio = 1.5f;
+	// The loads also need to differ at least by this much. Prevents shuffling connections around at low traffic.
+	static const float minImbalance = 200.f;
+
+	if (workerThreads.size() < 2)
+		return false;
+
+	NetworkWorkerThread *hot = 0;
+	NetworkWorkerThread *cold = 0;
+	float hotLoad = 0.f;
+	float coldLoad = 0.f;
+	for(size_t i = 0; i < workerThreads.size(); ++i)
+	{
+		float load = workerThreads[i]->Load();
+		if (!hot || load > hotLoad)
+		{
+			hot = workerThreads[i];
+			hotLoad = load;
+		}
+		if (!cold || load < coldLoad)
+		{
+			cold = workerThreads[i];
+			coldLoad = load;
+		}
+	}
+	if (hot == cold || hotLoad < coldLoad * imbalanceRatio || hotLoad - coldLoad < minImbalance)
+		return false;
+
+	// Move the connection that brings the two loads closest to each other. A connection that has more than half of the
+	// difference would only make the cold thread the hot one, so it is left in place.
+	const float target = (hotLoad - coldLoad) / 2.f;
+	std::vector<MessageConnection *> hotConnections = hot->Connections();
+	MessageConnection *best = 0;
+	float bestLoad = 0.f;
+	for(size_t i = 0; i < hotConnections.size(); ++i)
+	{
+		float load = NetworkWorkerThread::ConnectionLoad(*hotConnections[i]);
+		if (load <= target && load > bestLoad && hotConnections[i]->IsReadOpen())
+		{
+			best = hotConnections[i];
+			bestLoad = load;
+		}
+	}
+	if (!best)
+		return false;
+
+	KNET_LOG(LogInfo, "Network::RebalanceWorkerThreads: Moving connection %s (load %.1f) from worker thread %p (load %.1f) to worker thread %p (load %.1f).",
+		best->ToString().c_str(), bestLoad, hot, hotLoad, cold, coldLoad);
+	MoveConnectionToWorkerThread(best, cold);
+	return true;
+}
+
 void Network::AssignServerToWorkerThread(NetworkServer *server)
 {
-	NetworkWorkerThread *workerThread = GetOrCreateWorkerThread();
-	server->SetWorkerThread(workerThread);
-	workerThread->AddServer(server);
+	// The first thread is given all the TCP listen sockets (which are only polled by the main thread) and the first UDP
+	// listen socket. The rest of the UDP listen sockets are each given to a thread that does not yet handle this server.
+	std::vector<NetworkWorkerThread *> serverThreads;
+	std::vector<Socket *> &listenSockets = server->ListenSockets();
+	for(size_t i = 0; i < listenSockets.size(); ++i)
+	{
+		NetworkWorkerThread *workerThread;
+		if (serverThreads.empty() || (listenSockets[i]->TransportLayer() == SocketOverUDP && server->NumUDPListenSockets(serverThreads[0]) > 0))
+			workerThread = GetOrCreateWorkerThread(&serverThreads);
+		else
+			workerThread = serverThreads[0];
+		server->SetListenSocketWorkerThread((int)i, workerThread);
+		if (std::find(serverThreads.begin(), serverThreads.end(), workerThread) == serverThreads.end())
+			serverThreads.push_back(workerThread);
+	}
+
+	// Only now let the threads see the server, so that each sees its final set of listen sockets.
+	for(size_t i = 0; i < serverThreads.size(); ++i)
+		serverThreads[i]->AddServer(server);
 }
 
 void Network::RemoveConnectionFromItsWorkerThread(MessageConnection *connection)
@@ -345,11 +536,12 @@ void Network::RemoveServerFromItsWorkerThread(NetworkServer *server)
 	if (!server)
 		return;
 
-	NetworkWorkerThread *workerThread = server->WorkerThread();
-	if (workerThread)
+	std::vector<NetworkWorkerThread *> serverThreads = server->WorkerThreads();
+	for(size_t i = 0; i < serverThreads.size(); ++i)
 	{
+		NetworkWorkerThread *workerThread = serverThreads[i];
 		workerThread->RemoveServer(server);
-		server->SetWorkerThread(0);
+		server->DetachWorkerThread(workerThread);
 
 		if (workerThread->NumConnections() + workerThread->NumServers() == 0)
 			CloseWorkerThread(workerThread);
@@ -381,31 +573,62 @@ void Network::CloseWorkerThread(NetworkWorkerThread *workerThread)
 	KNET_LOG(LogError, "Network::CloseWorkerThread: Asked to close worker thread %p, but no such thread is tracked by this Network object! Ignoring the request.", workerThread);
 }
 
-NetworkServer *Network::StartServer(unsigned short port, SocketTransportLayer transport, INetworkServerListener *serverListener, bool allowAddressReuse)
+int Network::OpenListenSockets(unsigned short port, SocketTransportLayer transport, bool allowAddressReuse, int numUDPListenSockets,
+	std::vector<Socket *> &listenSockets)
 {
-	Socket *listenSock = OpenListenSocket(port, transport, allowAddressReuse);
-	if (listenSock == 0)
+	int numSockets = 1;
+	if (transport == SocketOverUDP)
 	{
-		KNET_LOG(LogError, "Failed to start server. Could not open listen port to %d using %s.", (int)port, 
-			transport == SocketOverTCP ? "TCP" : "UDP");
-		return 0;
+		numSockets = (numUDPListenSockets <= 0) ? maxWorkerThreads : std::min(numUDPListenSockets, maxWorkerThreads);
+#ifndef SO_REUSEPORT
+		if (numSockets > 1)
+			KNET_LOG(LogError, "Network::OpenListenSockets: SO_REUSEPORT is not supported on this platform. Using a single listen socket for UDP port %d.", (int)port);
+		numSockets = 1;
+#endif
 	}
 
+	int numOpened = 0;
+	for(int i = 0; i < numSockets; ++i)
+	{
+		// The connected sockets of the clients join the SO_REUSEPORT group of the port.
+		const bool allowPortSharing = numSockets > 1 || (transport == SocketOverUDP && connectedUDPServerSockets);
+		Socket *listenSock = OpenListenSocket(port, transport, allowAddressReuse, allowPortSharing);
+		if (!listenSock)
+		{
+			// If the first socket got opened, the port is not shared with us, but work with what we have.
+			if (numOpened > 0)
+				KNET_LOG(LogError, "Network::OpenListenSockets: Could only open %d of the %d requested listen sockets for UDP port %d.", numOpened, numSockets, (int)port);
+			break;
+		}
+		listenSockets.push_back(listenSock);
+		++numOpened;
+	}
+	return numOpened;
+}
+
+NetworkServer *Network::StartServer(unsigned short port, SocketTransportLayer transport, INetworkServerListener *serverListener, bool allowAddressReuse,
+	int numUDPListenSockets)
+{
 	std::vector<Socket *> listenSockets;
-	listenSockets.push_back(listenSock);
+	if (OpenListenSockets(port, transport, allowAddressReuse, numUDPListenSockets, listenSockets) == 0)
+	{
+		KNET_LOG(LogError, "Failed to start server. Could not open listen port to %d using %s.", (int)port, 
+			SocketTransportLayerToString(transport).c_str());
+		return 0;
+	}
 
 	server = new NetworkServer(this, listenSockets);
 	server->RegisterServerListener(serverListener);
 
 	AssignServerToWorkerThread(server);
 
-	KNET_LOG(LogInfo, "Server up (%s). Waiting for client to connect.", listenSock->ToString().c_str());
+	KNET_LOG(LogInfo, "Server up (%s, %d listen sockets). Waiting for client to connect.", listenSockets[0]->ToString().c_str(), (int)listenSockets.size());
 
 	return server;
 }
 
 NetworkServer *Network::StartServer(const std::vector<std::pair<unsigned short, SocketTransportLayer> > &listenPorts, 
-	INetworkServerListener *serverListener, bool allowAddressReuse)
+	INetworkServerListener *serverListener, bool allowAddressReuse, int numUDPListenSockets)
 {
 	if (listenPorts.empty())
 	{
@@ -416,11 +639,7 @@ NetworkServer *Network::StartServer(const std::vector<std::pair<unsigned short,
 	std::vector<Socket *> listenSockets;
 
 	for(size_t i = 0; i < listenPorts.size(); ++i)
-	{
-		Socket *listenSock = OpenListenSocket(listenPorts[i].first, listenPorts[i].second, allowAddressReuse);
-		if (listenSock)
-			listenSockets.push_back(listenSock);
-	}
+		OpenListenSockets(listenPorts[i].first, listenPorts[i].second, allowAddressReuse, numUDPListenSockets, listenSockets);
 
 	if (listenSockets.empty())
 	{
@@ -440,7 +659,7 @@ NetworkServer *Network::StartServer(const std::vector<std::pair<unsigned short,
 		for(size_t i = 0; i < listenSockets.size(); ++i)
 			if (listenSockets[i]->TransportLayer() == SocketOverUDP)
 				ss << listenSockets[i]->LocalPort() << " ";
-		KNET_LOG(LogInfo, ss.str().c_str());
+		KNET_LOG(LogInfo, "%s", ss.str().c_str());
 	}
 	{
 		std::stringstream ss;
@@ -448,7 +667,15 @@ NetworkServer *Network::StartServer(const std::vector<std::pair<unsigned short,
 		for(size_t i = 0; i < listenSockets.size(); ++i)
 			if (listenSockets[i]->TransportLayer() == SocketOverTCP)
 				ss << listenSockets[i]->LocalPort() << " ";
-		KNET_LOG(LogInfo, ss.str().c_str());
+		KNET_LOG(LogInfo, "%s", ss.str().c_str());
+	}
+	{
+		std::stringstream ss;
+		ss << "SHM ";
+		for(size_t i = 0; i < listenSockets.size(); ++i)
+			if (listenSockets[i]->TransportLayer() == SocketOverSharedMemory)
+				ss << listenSockets[i]->LocalPort() << " ";
+		KNET_LOG(LogInfo, "%s", ss.str().c_str());
 	}
 
 	return server;
@@ -466,6 +693,282 @@ void Network::StopServer()
 	KNET_LOG(LogVerbose, "Network::StopServer: Deinitialized NetworkServer.");
 }
 
+/// The start of the state Network::HandOffServer() passes to the new process.
+const u32 cServerHandOffMagic = 0x7672536B; // "kSrv"
+/// How long HandOffServer() waits for the connections that are not handed off to disconnect.
+const int cHandOffDisconnectMSecs = 200;
+
+static void AddEndPoint(DataSerializer &dst, const EndPoint &endPoint)
+{
+	dst.AddArray<u8>(endPoint.ip, 4);
+	dst.Add<u16>(endPoint.port);
+}
+
+static EndPoint ReadEndPoint(DataDeserializer &src)
+{
+	EndPoint endPoint;
+	src.ReadArray<u8>(endPoint.ip, 4);
+	endPoint.port = src.Read<u16>();
+	return endPoint;
+}
+
+bool Network::HandOffServer(const char *path, int maxMSecsToWait)
+{
+	if (!server)
+	{
+		KNET_LOG(LogError, "Network::HandOffServer: No server is running!");
+		return false;
+	}
+
+	SOCKET successor = ServerHandOff::WaitForSuccessor(path, maxMSecsToWait);
+	if (successor == INVALID_SOCKET)
+		return false;
+
+	// Stop the worker threads from reading the sockets, so that the datagrams that arrive from now on wait in the socket
+	// buffers for the new process.
+	RemoveServerFromItsWorkerThread(server);
+
+	std::vector<SOCKET> handles;
+	std::vector<Socket *> listenSockets;
+	for(size_t i = 0; i < server->ListenSockets().size(); ++i)
+	{
+		Socket *listenSocket = server->ListenSockets()[i];
+		if (listenSocket->TransportLayer() == SocketOverSharedMemory)
+			continue;
+		handles.push_back(listenSocket->GetSocketHandle());
+		listenSockets.push_back(listenSocket);
+	}
+
+	std::vector<NetworkServer::ConnectionMap::value_type> handedOff;
+	std::vector<std::vector<char> > sessions;
+	size_t stateSize = 64 + sizeof(server->connectionCookieKey) + listenSockets.size() * 64;
+	NetworkServer::ConnectionMap connections = server->GetConnections();
+	for(NetworkServer::ConnectionMap::iterator iter = connections.begin(); iter != connections.end(); ++iter)
+	{
+		MessageConnection *connection = iter->second;
+		Socket *socket = connection->GetSocket();
+		if (!socket || socket->TransportLayer() != SocketOverUDP)
+			continue;
+		const bool fromListenSocket = socket->IsUDPSlaveSocket();
+		if (fromListenSocket && std::find(handles.begin(), handles.end(), socket->GetSocketHandle()) == handles.end())
+			continue;
+
+		UDPMessageConnection *udpConnection = static_cast<UDPMessageConnection*>(connection);
+		RemoveConnectionFromItsWorkerThread(connection);
+		if (!udpConnection->CanHandOffSession())
+		{
+			AssignConnectionToWorkerThread(connection);
+			continue;
+		}
+		handedOff.push_back(*iter);
+		sessions.push_back(std::vector<char>());
+		udpConnection->SerializeSession(sessions.back());
+		stateSize += 64 + strlen(socket->LocalAddress()) + sessions.back().size();
+	}
+
+	// The sessions hold raw copies of the state of the connections, so the new process must run the same build.
+	std::vector<char> state;
+	DataSerializer ds(state, stateSize);
+	ds.Add<u32>(cServerHandOffMagic);
+	ds.Add<u32>((u32)sizeof(UDPMessageConnection));
+	ds.AddArray<u8>(server->connectionCookieKey, sizeof(server->connectionCookieKey));
+	// The handles of the listen sockets are passed first, in this order.
+	ds.Add<u32>((u32)listenSockets.size());
+	for(size_t i = 0; i < listenSockets.size(); ++i)
+	{
+		ds.Add<u8>((u8)listenSockets[i]->TransportLayer());
+		AddEndPoint(ds, listenSockets[i]->LocalEndPoint());
+		ds.AddString(listenSockets[i]->LocalAddress());
+		ds.Add<u32>((u32)listenSockets[i]->MaxSendSize());
+	}
+	ds.Add<u32>((u32)handedOff.size());
+	for(size_t i = 0; i < handedOff.size(); ++i)
+	{
+		Socket *socket = handedOff[i].second->GetSocket();
+		AddEndPoint(ds, handedOff[i].first);
+		if (socket->IsUDPSlaveSocket())
+		{
+			// A connection that sends from a listen socket refers to it.
+			ds.Add<u8>(0);
+			ds.Add<u32>((u32)(std::find(handles.begin(), handles.end(), socket->GetSocketHandle()) - handles.begin()));
+		}
+		else
+		{
+			ds.Add<u8>(1);
+			ds.Add<u32>((u32)handles.size());
+			handles.push_back(socket->GetSocketHandle());
+			AddEndPoint(ds, socket->LocalEndPoint());
+			ds.AddString(socket->LocalAddress());
+			ds.Add<u32>((u32)socket->MaxSendSize());
+		}
+		ds.Add<u32>((u32)sessions[i].size());
+		if (!sessions[i].empty())
+			ds.AddArray<u8>((const u8*)&sessions[i][0], (u32)sessions[i].size());
+	}
+	state.resize(ds.BytesFilled());
+
+	if (!ServerHandOff::Send(successor, handles, state, maxMSecsToWait))
+	{
+		for(size_t i = 0; i < handedOff.size(); ++i)
+			AssignConnectionToWorkerThread(handedOff[i].second);
+		AssignServerToWorkerThread(server);
+		return false;
+	}
+
+	// The new process carries on with the sessions, so nothing is sent to their clients, and their sockets are left open.
+	for(size_t i = 0; i < handedOff.size(); ++i)
+	{
+		MessageConnection *connection = handedOff[i].second;
+		server->ConnectionClosed(connection);
+		if (!connection->socket->IsUDPSlaveSocket())
+			connection->socket->Abandon();
+		CloseConnection(connection);
+		connection->connectionState = ConnectionClosed;
+	}
+	KNET_LOG(LogInfo, "Network::HandOffServer: Handed off %d listen sockets and %d connections at %s.", (int)listenSockets.size(),
+		(int)handedOff.size(), path);
+
+	// The connections left still send from the listen sockets, so they are closed before the listen sockets are let go of.
+	server->Close(cHandOffDisconnectMSecs);
+	for(size_t i = 0; i < listenSockets.size(); ++i)
+		listenSockets[i]->Abandon();
+	StopServer();
+	return true;
+}
+
+NetworkServer *Network::ResumeServer(const char *path, INetworkServerListener *serverListener, int maxMSecsToWait)
+{
+	if (server)
+	{
+		KNET_LOG(LogError, "Network::ResumeServer: A server is already running!");
+		return 0;
+	}
+
+	std::vector<SOCKET> handles;
+	std::vector<char> state;
+	SOCKET predecessor = ServerHandOff::Receive(path, handles, state, maxMSecsToWait);
+	if (predecessor == INVALID_SOCKET)
+		return 0;
+
+	struct ListenSocketState
+	{
+		SocketTransportLayer transport;
+		EndPoint localEndPoint;
+		std::string localAddress;
+		size_t maxSendSize;
+	};
+	struct SessionState
+	{
+		EndPoint remoteEndPoint;
+		bool ownSocket;
+		u32 handleIndex;
+		ListenSocketState socket;
+		size_t offset;
+		size_t size;
+	};
+	u8 cookieKey[DatagramCipher::cKeySize];
+	std::vector<ListenSocketState> listenSocketStates;
+	std::vector<SessionState> sessions;
+	bool valid = false;
+	try
+	{
+		DataDeserializer dd(state.empty() ? 0 : &state[0], state.size());
+		valid = dd.Read<u32>() == cServerHandOffMagic && dd.Read<u32>() == sizeof(UDPMessageConnection);
+		if (valid)
+		{
+			dd.ReadArray<u8>(cookieKey, sizeof(cookieKey));
+			listenSocketStates.resize(dd.Read<u32>());
+			for(size_t i = 0; i < listenSocketStates.size(); ++i)
+			{
+				listenSocketStates[i].transport = (SocketTransportLayer)dd.Read<u8>();
+				listenSocketStates[i].localEndPoint = ReadEndPoint(dd);
+				listenSocketStates[i].localAddress = dd.ReadString();
+				listenSocketStates[i].maxSendSize = dd.Read<u32>();
+			}
+			sessions.resize(dd.Read<u32>());
+			for(size_t i = 0; i < sessions.size() && valid; ++i)
+			{
+				SessionState &session = sessions[i];
+				session.remoteEndPoint = ReadEndPoint(dd);
+				session.ownSocket = (dd.Read<u8>() != 0);
+				session.handleIndex = dd.Read<u32>();
+				if (session.ownSocket)
+				{
+					session.socket.transport = SocketOverUDP;
+					session.socket.localEndPoint = ReadEndPoint(dd);
+					session.socket.localAddress = dd.ReadString();
+					session.socket.maxSendSize = dd.Read<u32>();
+				}
+				session.size = dd.Read<u32>();
+				session.offset = dd.BytePos();
+				valid = session.size <= dd.BytesLeft() &&
+					(session.ownSocket ? (session.handleIndex < handles.size()) : (session.handleIndex < listenSocketStates.size()));
+				if (valid)
+					dd.SkipBytes((int)session.size);
+			}
+			valid = valid && !listenSocketStates.empty() && listenSocketStates.size() <= handles.size();
+		}
+	} catch(const NetException &e)
+	{
+		KNET_LOG(LogError, "Network::ResumeServer: %s", e.what());
+		valid = false;
+	}
+
+	if (!valid || !ServerHandOff::Acknowledge(predecessor, valid))
+	{
+		KNET_LOG(LogError, "Network::ResumeServer: Could not take over the server handed off at %s.", path);
+		for(size_t i = 0; i < handles.size(); ++i)
+			closesocket(handles[i]);
+		return 0;
+	}
+
+	std::vector<Socket *> listenSockets;
+	for(size_t i = 0; i < listenSocketStates.size(); ++i)
+	{
+		const ListenSocketState &s = listenSocketStates[i];
+		listenSockets.push_back(StoreSocket(Socket(handles[i], s.localEndPoint, s.localAddress.c_str(), EndPoint(), "", s.transport,
+			ServerListenSocket, s.maxSendSize)));
+	}
+	server = new NetworkServer(this, listenSockets);
+	server->RegisterServerListener(serverListener);
+	// The clients that were asked for a connection cookie by the old process can answer with the cookie they got.
+	memcpy(server->connectionCookieKey, cookieKey, sizeof(cookieKey));
+
+	for(size_t i = 0; i < sessions.size(); ++i)
+	{
+		const SessionState &session = sessions[i];
+		const std::string remoteHostName = session.remoteEndPoint.IPToString();
+		Socket *socket;
+		if (session.ownSocket)
+		{
+			socket = StoreSocket(Socket(handles[session.handleIndex], session.socket.localEndPoint, session.socket.localAddress.c_str(),
+				session.remoteEndPoint, remoteHostName.c_str(), SocketOverUDP, ClientSocket, session.socket.maxSendSize));
+			socket->SetBlocking(false);
+		}
+		else
+			socket = CreateUDPSlaveSocket(listenSockets[session.handleIndex], session.remoteEndPoint, remoteHostName.c_str());
+
+		UDPMessageConnection *udpConnection = new UDPMessageConnection(this, server, socket, ConnectionOK);
+		Ptr(MessageConnection) connection(udpConnection);
+		DataDeserializer dd(&state[session.offset], session.size);
+		udpConnection->DeserializeSession(dd);
+		server->AddResumedConnection(udpConnection, session.remoteEndPoint);
+
+		if (serverListener)
+			serverListener->ConnectionResumed(connection);
+
+		AssignConnectionToWorkerThread(connection);
+		NewMessageConnectionCreated(connection);
+	}
+
+	// The listen sockets are read only now, so that each datagram that waited in them finds its connection.
+	AssignServerToWorkerThread(server);
+
+	KNET_LOG(LogInfo, "Network::ResumeServer: Resumed %d listen sockets and %d connections handed off at %s.", (int)listenSockets.size(),
+		(int)sessions.size(), path);
+	return server;
+}
+
 void Network::DeleteSocket(Socket *socket)
 {
 	if (!socket)
@@ -493,11 +996,30 @@ void Network::CloseConnection(MessageConnection *connection)
 	if (!connection)
 		return;
 
+	for(std::list<PendingConnect>::iterator iter = pendingConnects.begin(); iter != pendingConnects.end(); ++iter)
+		if (iter->connection == connection)
+		{
+			if (iter->socket != INVALID_SOCKET)
+				closesocket(iter->socket);
+			pendingConnects.erase(iter);
+			break;
+		}
+	connection->awaitedTransport = InvalidTransportLayer;
+
 	RemoveConnectionFromItsWorkerThread(connection);
-	DeleteSocket(connection->socket);
+	if (connection->socket)
+	{
+		NetworkServer *sharedSocketOwner = SharedUDPClientSocketOwner(connection->socket);
+		if (sharedSocketOwner)
+			sharedSocketOwner->DetachOutboundConnection(connection->socket->RemoteEndPoint(), static_cast<UDPMessageConnection*>(connection));
+		DeleteSocket(connection->socket);
+	}
 	connection->socket = 0;
 	connection->owner = 0;
 	connection->ownerServer = 0;
+	connection->packetCapture = 0;
+	connection->egressScheduler = 0;
+	connection->serverMalformedDatagrams = 0;
 	connections.erase(connection);
 }
 
@@ -516,6 +1038,11 @@ void Network::DeInit()
 	// Kill the server, if it's running.
 	StopServer();
 
+	// Kill the servers of the shared UDP client sockets. Their connections are closed by now.
+	for(size_t i = 0; i < sharedUDPClientSockets.size(); ++i)
+		RemoveServerFromItsWorkerThread(sharedUDPClientSockets[i]);
+	sharedUDPClientSockets.clear();
+
 	// Kill all worker threads.
 	while(!workerThreads.empty())
 		CloseWorkerThread(workerThreads.front()); // Erases the item from workerThreads, so this loop terminates.
@@ -527,6 +1054,13 @@ void Network::DeInit()
 		sockets.pop_front();
 	}
 
+	// Free the receive buffers that the sockets and connections of this Network have returned to the pool.
+	DatagramBuffer::ClearPool();
+
+	// The messages of the pool are shared with other Network objects and are only freed at exit, but return the ones
+	// cached by this thread, so that they are not lost if this thread exits.
+	NetworkMessagePool::FlushThreadCache();
+
 	// Deinitialize network subsystem.
 #ifdef WIN32
 	WSACleanup();
@@ -540,8 +1074,11 @@ void Network::NewMessageConnectionCreated(MessageConnection *connection)
 	connections.insert(connection);
 }
 
-Socket *Network::OpenListenSocket(unsigned short port, SocketTransportLayer transport, bool allowAddressReuse)
+Socket *Network::OpenListenSocket(unsigned short port, SocketTransportLayer transport, bool allowAddressReuse, bool allowPortSharing)
 {
+	if (transport == SocketOverSharedMemory)
+		return OpenSharedMemoryListenSocket(port);
+
 	addrinfo *result = NULL;
 	addrinfo hints;
 	memset(&hints, 0, sizeof(hints));
@@ -560,7 +1097,11 @@ Socket *Network::OpenListenSocket(unsigned short port, SocketTransportLayer tran
 		return 0;
 	}
 
+#ifdef WIN32
+	SOCKET listenSocket = WSASocket(result->ai_family, result->ai_socktype, result->ai_protocol, NULL, 0, cSocketFlags);
+#else
 	SOCKET listenSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+#endif
 	KNET_LOG(LogInfo, "Network::OpenListenSocket: Created listenSocket 0x%8X.", (unsigned int)listenSocket);
 
 	if (listenSocket == INVALID_SOCKET)
@@ -586,8 +1127,21 @@ Socket *Network::OpenListenSocket(unsigned short port, SocketTransportLayer tran
 			KNET_LOG(LogError, "setsockopt to SO_REUSEADDR failed: %s", GetLastErrorString().c_str());
 	}
 
+	if (allowPortSharing)
+	{
+#ifdef SO_REUSEPORT
+		// Let several sockets bind to this same port. The kernel distributes the clients between them by their address.
+		int val = 1;
+		ret = setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+		if (ret != 0)
+			KNET_LOG(LogError, "setsockopt to SO_REUSEPORT failed: %s", GetLastErrorString().c_str());
+#else
+		KNET_LOG(LogError, "Network::OpenListenSocket: SO_REUSEPORT is not supported on this platform!");
+#endif
+	}
+
 	// It is safe to cast to a sockaddr_in, since we've specifically queried for AF_INET addresses.
-	sockaddr_in localAddress = *(sockaddr_in*)&result->ai_addr;
+	sockaddr_in localAddress = *(sockaddr_in*)result->ai_addr;
 
 	// Setup the listening socket - bind it to a local port.
 	// If we are setting up a TCP socket, the socket will be only for listening and accepting incoming connections.
@@ -607,6 +1161,18 @@ Socket *Network::OpenListenSocket(unsigned short port, SocketTransportLayer tran
 	// For a reliable TCP socket, start the server with a call to listen().
 	if (transport == SocketOverTCP)
 	{
+		if (tcpFastOpen)
+		{
+#ifdef TCP_FASTOPEN
+			// The number of connections that may wait in the handshake after their SYN data has been taken.
+			int fastOpenQueueLength = SOMAXCONN;
+			if (setsockopt(listenSocket, IPPROTO_TCP, TCP_FASTOPEN, (const char *)&fastOpenQueueLength, sizeof(fastOpenQueueLength)) != 0)
+				KNET_LOG(LogError, "setsockopt to TCP_FASTOPEN failed: %s", GetLastErrorString().c_str());
+#else
+			KNET_LOG(LogError, "Network::OpenListenSocket: TCP Fast Open is not supported on this platform!");
+#endif
+		}
+
 		// Transition the bound socket to a listening state.
 		ret = listen(listenSocket, SOMAXCONN);
 		if (ret == KNET_SOCKET_ERROR)
@@ -617,22 +1183,67 @@ Socket *Network::OpenListenSocket(unsigned short port, SocketTransportLayer tran
 		}
 	}
 
+	// The system picks the port if 0 was asked for.
+	socklen_t localAddressLength = sizeof(localAddress);
+	if (port == 0 && getsockname(listenSocket, (sockaddr*)&localAddress, &localAddressLength) != 0)
+		KNET_LOG(LogError, "Network::OpenListenSocket: getsockname failed: %s!", GetLastErrorString().c_str());
 	EndPoint localEndPoint = EndPoint::FromSockAddrIn(localAddress);
 
 	// We are starting up a server listen socket, which is not bound to an address. Use null address for the remote endpoint.
 	EndPoint remoteEndPoint;
 	remoteEndPoint.Reset();
 
-	const size_t maxSendSize = (transport == SocketOverTCP ? cMaxTCPSendSize : cMaxUDPSendSize);
+	const size_t maxSendSize = (transport == SocketOverTCP ? cMaxTCPSendSize : maxDatagramSize);
 	sockets.push_back(Socket(listenSocket, localEndPoint, localHostName.c_str(), remoteEndPoint, "", transport, ServerListenSocket, maxSendSize));
 	Socket *listenSock = &sockets.back();
 	listenSock->SetBlocking(false);
+	if (transport == SocketOverUDP)
+		listenSock->SetDontFragment(true);
 
 	return listenSock;
 }
 
+Socket *Network::OpenSharedMemoryListenSocket(unsigned short port)
+{
+	SOCKET listenSocket = SharedMemoryChannel::OpenListenSocket(port);
+	if (listenSocket == INVALID_SOCKET)
+		return 0;
+	KNET_LOG(LogInfo, "Network::OpenSharedMemoryListenSocket: Created listenSocket 0x%8X.", (unsigned int)listenSocket);
+
+	// The port is not an IP port, but the connections are addressed as if it was one on the loopback interface.
+	EndPoint localEndPoint = EndPoint::FromIPAndPort(127, 0, 0, 1, port);
+	EndPoint remoteEndPoint;
+	remoteEndPoint.Reset();
+
+	sockets.push_back(Socket(listenSocket, localEndPoint, localHostName.c_str(), remoteEndPoint, "", SocketOverSharedMemory, ServerListenSocket, cMaxTCPSendSize));
+	return &sockets.back();
+}
+
+Socket *Network::ConnectSharedMemorySocket(unsigned short port)
+{
+	SOCKET connectSocket = INVALID_SOCKET;
+	SharedMemoryChannel *channel = SharedMemoryChannel::Connect(port, connectSocket);
+	if (!channel)
+	{
+		KNET_LOG(LogError, "Unable to connect to server!");
+		return 0;
+	}
+
+	EndPoint localEndPoint = EndPoint::FromIPAndPort(127, 0, 0, 1, 0);
+	EndPoint remoteEndPoint = EndPoint::FromIPAndPort(127, 0, 0, 1, port);
+	Socket socket(connectSocket, localEndPoint, localHostName.c_str(), remoteEndPoint, remoteEndPoint.IPToString().c_str(), SocketOverSharedMemory,
+		ClientSocket, cMaxTCPSendSize);
+	socket.SetSharedMemoryChannel(channel);
+	socket.SetBlocking(false);
+	sockets.push_back(socket);
+	return &sockets.back();
+}
+
 Socket *Network::ConnectSocket(const char *address, unsigned short port, SocketTransportLayer transport)
 {
+	if (transport == SocketOverSharedMemory)
+		return ConnectSharedMemorySocket(port);
+
 	addrinfo *result = NULL;
 	addrinfo hints;
 	memset(&hints, 0, sizeof(hints));
@@ -651,7 +1262,7 @@ Socket *Network::ConnectSocket(const char *address, unsigned short port, SocketT
 
 #ifdef WIN32
 	SOCKET connectSocket = WSASocket(result->ai_family, result->ai_socktype, result->ai_protocol,
-		NULL, 0, WSA_FLAG_OVERLAPPED);
+		NULL, 0, cSocketFlags);
 #else
 	SOCKET connectSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
 	KNET_LOG(LogInfo, "A call to socket() returned a new socket 0x%8X.", (unsigned int)connectSocket);
@@ -663,6 +1274,9 @@ Socket *Network::ConnectSocket(const char *address, unsigned short port, SocketT
 		return 0;
 	}
 
+	EnableTCPFastOpenConnect(connectSocket, transport);
+	const EndPoint peer = EndPoint::FromSockAddrIn(*(sockaddr_in*)result->ai_addr);
+
 	// Connect to server.
 #ifdef WIN32
 	ret = WSAConnect(connectSocket, result->ai_addr, (int)result->ai_addrlen, 0, 0, 0, 0);
@@ -684,6 +1298,27 @@ Socket *Network::ConnectSocket(const char *address, unsigned short port, SocketT
 		return 0;
 	}
 
+	return StoreConnectedSocket(connectSocket, transport, peer);
+}
+
+void Network::EnableTCPFastOpenConnect(SOCKET connectSocket, SocketTransportLayer transport)
+{
+	if (!tcpFastOpen || transport != SocketOverTCP)
+		return;
+#ifdef TCP_FASTOPEN_CONNECT
+	// connect() returns at once, and the first send goes out in the SYN if the kernel has a cookie of the server. Without a
+	// cookie, the SYN asks for one, and the sends wait for the handshake.
+	int val = 1;
+	if (setsockopt(connectSocket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &val, sizeof(val)) != 0)
+		KNET_LOG(LogError, "setsockopt to TCP_FASTOPEN_CONNECT failed: %s", GetLastErrorString().c_str());
+#else
+	KNET_LOG(LogVerbose, "Network::EnableTCPFastOpenConnect: TCP Fast Open is not supported on this platform. Connecting with a normal handshake.");
+#endif
+}
+
+Socket *Network::StoreConnectedSocket(SOCKET connectSocket, SocketTransportLayer transport, const EndPoint &peer)
+{
+	int ret;
 	EndPoint localEndPoint;
 	sockaddr_in sockname;
 	socklen_t socknamelen = sizeof(sockname);
@@ -700,49 +1335,312 @@ Socket *Network::ConnectSocket(const char *address, unsigned short port, SocketT
 	if (ret == 0)
 		remoteEndPoint = EndPoint::FromSockAddrIn(peername);
 	else
-		KNET_LOG(LogError, "Network::ConnectSocket: getpeername failed: %s!", Network::GetLastErrorString().c_str());
+	{
+		if (!tcpFastOpen || transport != SocketOverTCP)
+			KNET_LOG(LogError, "Network::ConnectSocket: getpeername failed: %s!", Network::GetLastErrorString().c_str());
+		remoteEndPoint = peer;
+	}
 
 	std::string remoteHostName = remoteEndPoint.IPToString();
 
-	const size_t maxSendSize = (transport == SocketOverTCP) ? cMaxTCPSendSize : cMaxUDPSendSize;
+	const size_t maxSendSize = (transport == SocketOverTCP) ? cMaxTCPSendSize : maxDatagramSize;
 	Socket socket(connectSocket, localEndPoint, localHostName.c_str(), remoteEndPoint, remoteHostName.c_str(), transport, ClientSocket, maxSendSize);
 
 	socket.SetBlocking(false);
 	sockets.push_back(socket);
 
 	Socket *sock = &sockets.back();
+	if (transport == SocketOverUDP)
+		sock->SetDontFragment(true);
 
 	return sock;
 }
 
 Ptr(MessageConnection) Network::Connect(const char *address, unsigned short port, 
-	SocketTransportLayer transport, IMessageHandler *messageHandler, Datagram *connectMessage)
+	SocketTransportLayer transport, IMessageHandler *messageHandler, Datagram *connectMessage, bool earlyData)
 {
-	Socket *socket = ConnectSocket(address, port, transport);
+	Socket *socket = 0;
+	if (transport == SocketOverUDP && maxSharedUDPClientSockets > 0)
+	{
+		EndPoint peer;
+		if (address && HostResolver::ResolveBlocking(address, peer))
+		{
+			peer.port = port;
+			socket = ConnectSharedUDPSocket(peer);
+		}
+	}
+	if (!socket)
+		socket = ConnectSocket(address, port, transport);
 	if (!socket)
 		return 0;
 
-	if (transport == SocketOverUDP)
-	{
-		SendUDPConnectDatagram(*socket, connectMessage);
-		KNET_LOG(LogInfo, "Network::Connect: Sent a UDP Connection Start datagram to to %s.", socket->ToString().c_str());
-	}
-	else
-		KNET_LOG(LogInfo, "Network::Connect: Connected a TCP socket to %s.", socket->ToString().c_str());
+	Ptr(MessageConnection) connection = NewClientConnection(socket, transport, messageHandler, connectMessage, earlyData);
+	if (IsStreamTransportLayer(transport))
+		KNET_LOG(LogInfo, "Network::Connect: Connected a %s socket to %s.", SocketTransportLayerToString(transport).c_str(), socket->ToString().c_str());
+	StartClientConnection(connection);
+	return connection;
+}
 
-	Ptr(MessageConnection) connection;
-	if (transport == SocketOverTCP)
-		connection = new TCPMessageConnection(this, 0, socket, ConnectionOK);
+MessageConnection *Network::NewClientConnection(Socket *socket, SocketTransportLayer transport, IMessageHandler *messageHandler,
+	Datagram *connectMessage, bool earlyData)
+{
+	// Each encrypted connection has a salt of its own, so that its key differs from the keys of the other connections.
+	u8 salt[DatagramCipher::cSaltSize];
+	const bool encrypted = (transport == SocketOverUDP && encryptionEnabled);
+	if (encrypted)
+		DatagramCipher::GenerateRandomBytes(salt, sizeof(salt));
+
+	MessageConnection *connection;
+	if (IsStreamTransportLayer(transport))
+		connection = new TCPMessageConnection(this, 0, socket, socket ? ConnectionOK : ConnectionPending);
 	else
-		connection = new UDPMessageConnection(this, 0, socket, ConnectionPending);
+	{
+		UDPMessageConnection *udpConnection = new UDPMessageConnection(this, 0, socket, ConnectionPending);
+		if (encrypted)
+		{
+			udpConnection->EnableEncryption(encryptionKey, salt, true);
+			memcpy(udpConnection->connectSalt, salt, sizeof(salt));
+		}
+		else if (datagramChecksums)
+			udpConnection->EnableDatagramChecksums();
+		///\todo Craft the proper connection attempt datagram.
+		if (connectMessage)
+			udpConnection->connectMessage.assign(connectMessage->data, connectMessage->data + connectMessage->size);
+		else
+			udpConnection->connectMessage.assign(8, 0);
+
+		if (earlyData)
+		{
+			udpConnection->PauseOutboundSends();
+			udpConnection->connectDatagramDeferred = true;
+		}
+		connection = udpConnection;
+	}
 
 	connection->RegisterInboundMessageHandler(messageHandler);
+	connections.insert(connection);
+	return connection;
+}
+
+void Network::StartClientConnection(MessageConnection *connection)
+{
+	UDPMessageConnection *udpConnection = dynamic_cast<UDPMessageConnection*>(connection);
+
+	// The connection has a free endpoint on its shared socket, see ConnectSharedUDPSocket(). Route the endpoint to it before
+	// the connect datagram goes out, so that the answer of the server is not dropped.
+	NetworkServer *sharedSocketOwner = SharedUDPClientSocketOwner(connection->GetSocket());
+	if (sharedSocketOwner)
+	{
+		if (!udpConnection->eventDatagramsQueued.IsValid())
+			udpConnection->eventDatagramsQueued = CreateNewEvent(EventWaitSignal);
+		sharedSocketOwner->AttachOutboundConnection(connection->GetSocket()->RemoteEndPoint(), udpConnection);
+	}
+
+	if (udpConnection && !udpConnection->connectDatagramDeferred)
+	{
+		udpConnection->SendConnectDatagram();
+		KNET_LOG(LogInfo, "Network::Connect: Sent a UDP Connection Start datagram to to %s.", connection->GetSocket()->ToString().c_str());
+	}
+
+	if (sharedSocketOwner)
+	{
+		// Run the connection on the thread that reads the socket, so that its datagrams are handed over without waking
+		// another thread.
+		NetworkWorkerThread *workerThread = sharedSocketOwner->ListenSocketWorkerThread(0);
+		if (workerThread)
+		{
+			connection->SetWorkerThread(workerThread);
+			workerThread->AddConnection(connection);
+			return;
+		}
+	}
 	AssignConnectionToWorkerThread(connection);
+}
 
-	connections.insert(connection);
+Ptr(MessageConnection) Network::ConnectAsync(const char *address, unsigned short port, 
+	SocketTransportLayer transport, IMessageHandler *messageHandler, Datagram *connectMessage, bool earlyData)
+{
+	if (transport == SocketOverSharedMemory)
+		return Connect(address, port, transport, messageHandler, connectMessage, earlyData);
+	if (!address)
+	{
+		KNET_LOG(LogError, "Network::ConnectAsync called with a null address!");
+		return 0;
+	}
+
+	Ptr(MessageConnection) connection = NewClientConnection(0, transport, messageHandler, connectMessage, earlyData);
+	connection->awaitedTransport = transport;
+
+	PendingConnect pending;
+	pending.connection = connection;
+	pending.hostName = address;
+	pending.port = port;
+	pending.transport = transport;
+	pending.socket = INVALID_SOCKET;
+	pendingConnects.push_back(pending);
+
+	// Start the lookup now, and connect at once if the address is numeric or cached.
+	if (AdvancePendingConnect(pendingConnects.back()))
+		pendingConnects.pop_back();
 	return connection;
 }
 
+SOCKET Network::BeginConnect(const EndPoint &address, SocketTransportLayer transport, bool &connected)
+{
+	const int type = (transport == SocketOverTCP) ? SOCK_STREAM : SOCK_DGRAM;
+	const int protocol = (transport == SocketOverTCP) ? IPPROTO_TCP : IPPROTO_UDP;
+#ifdef WIN32
+	SOCKET connectSocket = WSASocket(AF_INET, type, protocol, NULL, 0, cSocketFlags);
+#else
+	SOCKET connectSocket = socket(AF_INET, type, protocol);
+#endif
+	if (connectSocket == INVALID_SOCKET || connectSocket == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "Network::BeginConnect: Error at socket(): %s", GetLastErrorString().c_str());
+		return INVALID_SOCKET;
+	}
+
+#ifdef WIN32
+	u_long nonBlocking = 1;
+	int ret = ioctlsocket(connectSocket, FIONBIO, &nonBlocking);
+#else
+	int ret = fcntl(connectSocket, F_SETFL, fcntl(connectSocket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+	if (ret == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "Network::BeginConnect: Could not make the socket non-blocking: %s", GetLastErrorString().c_str());
+		closesocket(connectSocket);
+		return INVALID_SOCKET;
+	}
+
+	EnableTCPFastOpenConnect(connectSocket, transport);
+
+	sockaddr_in addr = address.ToSockAddrIn();
+#ifdef WIN32
+	ret = WSAConnect(connectSocket, (sockaddr*)&addr, sizeof(addr), 0, 0, 0, 0);
+	const bool inProgress = (ret == KNET_SOCKET_ERROR && GetLastError() == WSAEWOULDBLOCK);
+#else
+	ret = connect(connectSocket, (sockaddr*)&addr, sizeof(addr));
+	const bool inProgress = (ret == KNET_SOCKET_ERROR && GetLastError() == EINPROGRESS);
+#endif
+	if (ret == KNET_SOCKET_ERROR && !inProgress)
+	{
+		KNET_LOG(LogError, "Network::BeginConnect: connect() to %s failed: %s", address.ToString().c_str(), GetLastErrorString().c_str());
+		closesocket(connectSocket);
+		return INVALID_SOCKET;
+	}
+	connected = !inProgress;
+	return connectSocket;
+}
+
+/// Returns true once the non-blocking connect of the given TCP socket has finished, and sets failed if it did not succeed.
+static bool ConnectFinished(SOCKET connectSocket, bool &failed)
+{
+#ifdef WIN32
+	fd_set writeSet;
+	fd_set errorSet;
+	FD_ZERO(&writeSet);
+	FD_ZERO(&errorSet);
+	FD_SET(connectSocket, &writeSet);
+	FD_SET(connectSocket, &errorSet);
+	TIMEVAL timeout = { 0, 0 };
+	if (select(0, 0, &writeSet, &errorSet, &timeout) <= 0)
+		return false;
+#else
+	if (!Event(connectSocket, EventWaitWrite).Test())
+		return false;
+#endif
+	int error = 0;
+	socklen_t errorLength = sizeof(error);
+	if (getsockopt(connectSocket, SOL_SOCKET, SO_ERROR, (char*)&error, &errorLength) == KNET_SOCKET_ERROR || error != 0)
+	{
+		KNET_LOG(LogError, "Network::ProcessPendingConnects: The TCP connect failed: %s", Network::GetErrorString(error).c_str());
+		failed = true;
+	}
+	return true;
+}
+
+void Network::ProcessPendingConnects()
+{
+	// Each connection that waits for its socket calls this from its Process(), so go through them at most once a millisecond.
+	const tick_t now = Clock::Tick();
+	if (pendingConnects.empty() || Clock::TimespanToMillisecondsD(lastPendingConnectsTick, now) < 1.0)
+		return;
+	lastPendingConnectsTick = now;
+
+	std::list<PendingConnect>::iterator iter = pendingConnects.begin();
+	while(iter != pendingConnects.end())
+		if (AdvancePendingConnect(*iter))
+			iter = pendingConnects.erase(iter);
+		else
+			++iter;
+}
+
+bool Network::AdvancePendingConnect(PendingConnect &pending)
+{
+	bool connected = false;
+	bool failed = false;
+	if (pending.socket == INVALID_SOCKET)
+	{
+		EndPoint address;
+		const HostResolver::Status status = hostResolver.Resolve(pending.hostName.c_str(), address);
+		if (status == HostResolver::Resolving)
+			return false;
+		if (status == HostResolver::Resolved)
+		{
+			address.port = pending.port;
+			pending.address = address;
+			if (pending.transport == SocketOverUDP && maxSharedUDPClientSockets > 0)
+			{
+				Socket *socket = ConnectSharedUDPSocket(address);
+				if (socket)
+				{
+					UDPMessageConnection *udpConnection = static_cast<UDPMessageConnection*>(pending.connection);
+					udpConnection->awaitedTransport = InvalidTransportLayer;
+					udpConnection->socket = socket;
+					udpConnection->maxDatagramSizeLimit = socket->MaxSendSize();
+					udpConnection->maxDatagramSize = std::min(udpConnection->maxDatagramSize, udpConnection->maxDatagramSizeLimit);
+					KNET_LOG(LogInfo, "Network::ProcessPendingConnects: Connected a shared UDP socket to %s.", socket->ToString().c_str());
+					StartClientConnection(udpConnection);
+					return true;
+				}
+			}
+			pending.socket = BeginConnect(address, pending.transport, connected);
+		}
+		failed = (pending.socket == INVALID_SOCKET);
+	}
+	else
+		connected = ConnectFinished(pending.socket, failed);
+
+	if (!connected && !failed)
+		return false;
+
+	MessageConnection *connection = pending.connection;
+	connection->awaitedTransport = InvalidTransportLayer;
+	if (failed)
+	{
+		if (pending.socket != INVALID_SOCKET)
+			closesocket(pending.socket);
+		KNET_LOG(LogError, "Network::ProcessPendingConnects: Unable to connect to %s:%d!", pending.hostName.c_str(), (int)pending.port);
+		connection->connectionState = ConnectionClosed;
+		return true;
+	}
+
+	Socket *socket = StoreConnectedSocket(pending.socket, pending.transport, pending.address);
+	connection->socket = socket;
+	if (pending.transport == SocketOverUDP)
+	{
+		UDPMessageConnection *udpConnection = static_cast<UDPMessageConnection*>(connection);
+		udpConnection->maxDatagramSizeLimit = socket->MaxSendSize();
+		udpConnection->maxDatagramSize = std::min(udpConnection->maxDatagramSize, udpConnection->maxDatagramSizeLimit);
+	}
+	else
+		connection->connectionState = ConnectionOK;
+	KNET_LOG(LogInfo, "Network::ProcessPendingConnects: Connected a %s socket to %s.", SocketTransportLayerToString(pending.transport).c_str(), socket->ToString().c_str());
+	StartClientConnection(connection);
+	return true;
+}
+
 Socket *Network::CreateUDPSlaveSocket(Socket *serverListenSocket, const EndPoint &remoteEndPoint, const char *remoteHostName)
 {
 	if (!serverListenSocket)
@@ -759,7 +1657,7 @@ Socket *Network::CreateUDPSlaveSocket(Socket *serverListenSocket, const EndPoint
 	}
 
 	sockets.push_back(Socket(udpSocket, serverListenSocket->LocalEndPoint(),
-		serverListenSocket->LocalAddress(), remoteEndPoint, remoteHostName, SocketOverUDP, ServerClientSocket, cMaxUDPSendSize));
+		serverListenSocket->LocalAddress(), remoteEndPoint, remoteHostName, SocketOverUDP, ServerClientSocket, serverListenSocket->MaxSendSize()));
 	Socket *socket = &sockets.back();
 	socket->SetBlocking(false);
 
@@ -767,35 +1665,114 @@ Socket *Network::CreateUDPSlaveSocket(Socket *serverListenSocket, const EndPoint
 	return socket;
 }
 
+Socket *Network::CreateConnectedUDPSocket(Socket *serverListenSocket, const EndPoint &remoteEndPoint, const char *remoteHostName)
+{
+#ifdef SO_REUSEPORT
+	if (!serverListenSocket)
+	{
+		KNET_LOG(LogError, "Network::CreateConnectedUDPSocket called with null serverListenSocket handle!");
+		return 0;
+	}
+
+	SOCKET udpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (udpSocket == INVALID_SOCKET)
+	{
+		KNET_LOG(LogError, "Network::CreateConnectedUDPSocket: Error at socket(): %s", GetLastErrorString().c_str());
+		return 0;
+	}
+
+	// The kernel prefers the socket connected to the address of a datagram over the listen sockets of the port.
+	int val = 1;
+	sockaddr_in localAddress = serverListenSocket->LocalEndPoint().ToSockAddrIn();
+	sockaddr_in peerAddress = remoteEndPoint.ToSockAddrIn();
+	if (setsockopt(udpSocket, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) != 0 ||
+		bind(udpSocket, (sockaddr*)&localAddress, sizeof(localAddress)) == KNET_SOCKET_ERROR ||
+		connect(udpSocket, (sockaddr*)&peerAddress, sizeof(peerAddress)) == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "Network::CreateConnectedUDPSocket: Could not connect a socket of port %d to %s: %s", (int)serverListenSocket->LocalPort(),
+			remoteEndPoint.ToString().c_str(), GetLastErrorString().c_str());
+		closesocket(udpSocket);
+		return 0;
+	}
+
+	// Until it was connected, the socket took its share of the datagrams of the other clients of the port. Drop the
+	// datagrams it got, which are lost like any datagram. A datagram longer than the buffer is discarded whole.
+	char discard[64];
+	int numDiscarded = 0;
+	while(recv(udpSocket, discard, sizeof(discard), MSG_DONTWAIT) >= 0)
+		++numDiscarded;
+	if (numDiscarded > 0)
+		KNET_LOG(LogVerbose, "Network::CreateConnectedUDPSocket: Dropped %d datagrams received before the socket was connected to %s.",
+			numDiscarded, remoteEndPoint.ToString().c_str());
+
+	sockets.push_back(Socket(udpSocket, serverListenSocket->LocalEndPoint(),
+		serverListenSocket->LocalAddress(), remoteEndPoint, remoteHostName, SocketOverUDP, ClientSocket, serverListenSocket->MaxSendSize()));
+	Socket *socket = &sockets.back();
+	socket->SetBlocking(false);
+	socket->SetDontFragment(true);
+
+	KNET_LOG(LogInfo, "Network::CreateConnectedUDPSocket: Connected an UDP socket to %s.", socket->ToString().c_str());
+	return socket;
+#else
+	KNET_LOG(LogError, "Network::CreateConnectedUDPSocket: SO_REUSEPORT is not supported on this platform!");
+	return 0;
+#endif
+}
+
 Socket *Network::StoreSocket(const Socket &cp)
 {
 	sockets.push_back(cp);
 	return &sockets.back();
 }
 
-void Network::SendUDPConnectDatagram(Socket &socket, Datagram *connectMessage)
+Socket *Network::ConnectSharedUDPSocket(const EndPoint &peer)
 {
-    const int connectMessageSize = connectMessage ? connectMessage->size : 8;
-	OverlappedTransferBuffer *sendData = socket.BeginSend(connectMessageSize);
-	if (!sendData)
+	// Fill the sockets one connection at a time while new ones may be opened, and then spread the connections over them.
+	NetworkServer *hub = 0;
+	size_t hubConnections = 0;
+	for(size_t i = 0; i < sharedUDPClientSockets.size(); ++i)
 	{
-		KNET_LOG(LogError, "Network::SendUDPConnectDatagram: socket.BeginSend failed! Cannot send UDP connection datagram!");
-		return;
+		NetworkServer *candidate = sharedUDPClientSockets[i];
+		if (candidate->udpConnections.Find(peer))
+			continue;
+		const size_t numConnections = candidate->udpConnections.Size();
+		if (!hub || numConnections < hubConnections)
+		{
+			hub = candidate;
+			hubConnections = numConnections;
+		}
 	}
-	sendData->bytesContains = connectMessageSize;
-	if (connectMessage)
+
+	if ((!hub || hubConnections > 0) && (int)sharedUDPClientSockets.size() < maxSharedUDPClientSockets)
 	{
-		///\todo Craft the proper connection attempt datagram.
-		memcpy(sendData->buffer.buf, connectMessage->data, sendData->buffer.len);
-		KNET_LOG(LogVerbose, "Network::SendUDPConnectDatagram: Sending UDP connect message of size %d.", (int)sendData->buffer.len);
+		Socket *listenSocket = OpenListenSocket(0, SocketOverUDP, false);
+		if (listenSocket)
+		{
+			NetworkServer *newHub = new NetworkServer(this, std::vector<Socket *>(1, listenSocket));
+			newHub->SetAcceptNewConnections(false);
+			sharedUDPClientSockets.push_back(newHub);
+			AssignServerToWorkerThread(newHub);
+			hub = newHub;
+		}
 	}
-	else
+
+	if (!hub)
 	{
-		///\todo Craft the proper connection attempt datagram.
-		memset(sendData->buffer.buf, 0, sendData->buffer.len);
-		KNET_LOG(LogVerbose, "Network::SendUDPConnectDatagram: Sending null UDP connect message of size %d.", (int)sendData->buffer.len);
+		KNET_LOG(LogVerbose, "Network::ConnectSharedUDPSocket: The shared UDP sockets all have a connection to %s. Opening a socket of its own.",
+			peer.ToString().c_str());
+		return 0;
 	}
-	socket.EndSend(sendData);
+	return CreateUDPSlaveSocket(hub->ListenSockets()[0], peer, peer.IPToString().c_str());
+}
+
+NetworkServer *Network::SharedUDPClientSocketOwner(Socket *socket)
+{
+	if (!socket || !socket->IsUDPSlaveSocket())
+		return 0;
+	for(size_t i = 0; i < sharedUDPClientSockets.size(); ++i)
+		if (sharedUDPClientSockets[i]->ListenSockets()[0]->GetSocketHandle() == socket->GetSocketHandle())
+			return sharedUDPClientSockets[i];
+	return 0;
 }
 
 } // ~kNet
@@ -21,7 +21,10 @@
 #include <cstdarg>
 #include <cstdio>
 #include <string>
+#include <cassert>
 #include <cstring>
+#include <vector>
+#include <algorithm>
 
 #ifdef KNET_USE_BOOST
 #include <boost/thread/thread.hpp>
@@ -32,11 +35,20 @@
 #include "kNet/NetworkLogging.h"
 #include "kNet/Lockable.h"
 #include "kNet/Clock.h"
+#include "kNet/Thread.h"
+#include "kNet/WaitFreeQueue.h"
+#include "kNet/Atomics.h"
 
 #if defined(KNET_UNIX) || defined(ANDROID)
 #define _snprintf snprintf
 #endif
 
+#ifdef _MSC_VER
+#define KNET_THREAD_LOCAL __declspec(thread)
+#else
+#define KNET_THREAD_LOCAL __thread
+#endif
+
 using namespace std;
 
 namespace kNet
@@ -51,7 +63,8 @@ ofstream kNetLogFile;
 
 Lockable<int> logWriteMutex;
 
-string Time()
+/// Returns the tick the log timestamps are measured from, which is the time of the first line logged.
+tick_t LogStartTick()
 {
 	static tick_t firstTick;
 	static bool firstCall = true;
@@ -59,9 +72,16 @@ string Time()
 	{
 		firstCall = false;
 		firstTick = Clock::Tick();
-		return "0.000";
 	}
-	double t = Clock::SecondsSinceD(firstTick);
+	return firstTick;
+}
+
+string Time(tick_t tick)
+{
+	const tick_t firstTick = LogStartTick();
+	if (tick == firstTick)
+		return "0.000";
+	double t = Clock::IsNewer(tick, firstTick) ? Clock::TicksToSecondsD(tick - firstTick) : 0.0;
 	std::stringstream ss;
 	ss << t;
 #ifdef KNET_USE_BOOST
@@ -70,6 +90,364 @@ string Time()
 	return ss.str();
 }
 
+/// Writes a formatted line to the log. [logWriteMutex locked]
+void WriteLine(tick_t tick, const char *line)
+{
+	if (kNetLogFile.is_open())
+		kNetLogFile << Time(tick) << ": " << line << std::endl;
+	else
+		std::cout << Time(tick) << ": " << line << std::endl;
+}
+
+/// The size of the arguments a queued line can have. Longer lines are written synchronously.
+const size_t cMaxLogArgBytes = 232;
+/// The number of lines each thread can have queued.
+const size_t cLogQueueSize = 1024;
+const int cMaxLogThreads = 64;
+
+/// A log line waiting to be formatted. The arguments are stored in the order of the format string, each as the type it
+/// is read from the va_list as, except that strings are stored as a u16 length followed by the characters.
+struct LogRecord
+{
+	tick_t tick;
+	const char *format;
+	u16 numArgBytes;
+	char args[cMaxLogArgBytes];
+};
+
+/// The lines of a single thread. Filled by that thread, and emptied by the holder of drainMutex.
+struct LogQueue
+{
+	LogQueue():records(cLogQueueSize) {}
+	WaitFreeQueue<LogRecord> records;
+};
+
+/// The queues are only added, and each is written in full before it is published by incrementing numLogQueues, so the
+/// queues can be scanned without locking. They are kept until process exit, since their threads can't be told apart
+/// from new threads reusing their IDs.
+LogQueue *logQueues[cMaxLogThreads];
+volatile long numLogQueues = 0;
+Lockable<int> logQueueMutex;
+
+/// Serializes the consumers of the queues: the background thread and FlushLog().
+Lockable<int> drainMutex;
+
+/// The queue of the calling thread, or 0 if the thread has not queued anything yet. Zero-initialized for each new thread.
+KNET_THREAD_LOCAL LogQueue *threadLogQueue;
+
+volatile bool asyncLoggingEnabled = false;
+volatile long numDroppedLogLines = 0;
+long numReportedDroppedLogLines = 0; // [drainMutex locked]
+
+Thread *asyncLogThread = 0;
+
+/// The parts of a single printf conversion specification.
+struct LogFormatSpec
+{
+	bool starWidth;
+	bool starPrecision;
+	/// The length modifier: 0 for none, 'h', 'H' for hh, 'l', 'q' for ll, 'z' or 'L'.
+	char length;
+	char conversion;
+};
+
+/// Parses the conversion specification that starts after the '%' at p.
+/// @return The position after the conversion character, or 0 if the specification is malformed or not supported.
+const char *ParseFormatSpec(const char *p, LogFormatSpec &spec)
+{
+	spec.starWidth = spec.starPrecision = false;
+	spec.length = 0;
+
+	while(*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0')
+		++p;
+	if (*p == '*')
+	{
+		spec.starWidth = true;
+		++p;
+	}
+	while(*p >= '0' && *p <= '9')
+		++p;
+	if (*p == '.')
+	{
+		++p;
+		if (*p == '*')
+		{
+			spec.starPrecision = true;
+			++p;
+		}
+		while(*p >= '0' && *p <= '9')
+			++p;
+	}
+	if (*p == 'h')
+	{
+		++p;
+		spec.length = (*p == 'h') ? 'H' : 'h';
+		if (*p == 'h')
+			++p;
+	}
+	else if (*p == 'l')
+	{
+		++p;
+		spec.length = (*p == 'l') ? 'q' : 'l';
+		if (*p == 'l')
+			++p;
+	}
+	else if (*p == 'z' || *p == 'L')
+		spec.length = *p++;
+
+	spec.conversion = *p;
+	if (!spec.conversion || !strchr("diouxXcfFeEgGaAps", spec.conversion))
+		return 0;
+	return p + 1;
+}
+
+template<typename T>
+bool PackArg(LogRecord &record, const T &value)
+{
+	if (record.numArgBytes + sizeof(T) > cMaxLogArgBytes)
+		return false;
+	memcpy(record.args + record.numArgBytes, &value, sizeof(T));
+	record.numArgBytes += sizeof(T);
+	return true;
+}
+
+template<typename T>
+T UnpackArg(const LogRecord &record, size_t &pos)
+{
+	T value;
+	memcpy(&value, record.args + pos, sizeof(T));
+	pos += sizeof(T);
+	return value;
+}
+
+/// Copies the arguments of the format string of the given record from the va_list to the record.
+/// @return False if the arguments did not fit, or the format string has a conversion that is not supported.
+bool PackLogArgs(LogRecord &record, va_list args)
+{
+	record.numArgBytes = 0;
+	for(const char *p = record.format; *p; ++p)
+	{
+		if (*p != '%')
+			continue;
+		if (p[1] == '%')
+		{
+			++p;
+			continue;
+		}
+
+		LogFormatSpec spec;
+		const char *next = ParseFormatSpec(p + 1, spec);
+		if (!next)
+			return false;
+		p = next - 1;
+
+		if (spec.starWidth && !PackArg(record, va_arg(args, int)))
+			return false;
+		if (spec.starPrecision && !PackArg(record, va_arg(args, int)))
+			return false;
+
+		bool ok;
+		switch(spec.conversion)
+		{
+		case 's':
+		{
+			const char *str = va_arg(args, const char *);
+			if (!str)
+				str = "(null)";
+			const size_t len = strlen(str);
+			if (len > 0xFFFF || !PackArg(record, (u16)len) || record.numArgBytes + len > cMaxLogArgBytes)
+				return false;
+			memcpy(record.args + record.numArgBytes, str, len);
+			record.numArgBytes += (u16)len;
+			ok = true;
+			break;
+		}
+		case 'p':
+			ok = PackArg(record, va_arg(args, void *));
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			ok = (spec.length == 'L') ? PackArg(record, va_arg(args, long double)) : PackArg(record, va_arg(args, double));
+			break;
+		default: // The integer conversions.
+			if (spec.length == 'l')
+				ok = PackArg(record, va_arg(args, long));
+			else if (spec.length == 'q')
+				ok = PackArg(record, va_arg(args, long long));
+			else if (spec.length == 'z')
+				ok = PackArg(record, va_arg(args, size_t));
+			else
+				ok = PackArg(record, va_arg(args, int)); // char and short are promoted to int.
+			break;
+		}
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+/// Formats a queued line the same way vsnprintf would have formatted it at the time it was logged.
+string FormatLogRecord(const LogRecord &record)
+{
+	string line;
+	size_t pos = 0;
+	char str[512];
+	for(const char *p = record.format; *p; ++p)
+	{
+		if (*p != '%')
+		{
+			line += *p;
+			continue;
+		}
+		if (p[1] == '%')
+		{
+			line += '%';
+			++p;
+			continue;
+		}
+
+		LogFormatSpec spec;
+		const char *next = ParseFormatSpec(p + 1, spec);
+		assert(next); // PackLogArgs() already accepted the format.
+
+		// Replace the '*' fields with the values that were passed in for them.
+		string specStr;
+		for(const char *s = p; s < next; ++s)
+			if (*s == '*')
+			{
+				sprintf(str, "%d", UnpackArg<int>(record, pos));
+				specStr += str;
+			}
+			else
+				specStr += *s;
+		p = next - 1;
+
+		switch(spec.conversion)
+		{
+		case 's':
+		{
+			const u16 len = UnpackArg<u16>(record, pos);
+			const string value(record.args + pos, len);
+			pos += len;
+			if (specStr == "%s")
+				line += value;
+			else
+			{
+				_snprintf(str, sizeof(str) - 1, specStr.c_str(), value.c_str());
+				str[sizeof(str) - 1] = 0;
+				line += str;
+			}
+			continue;
+		}
+		case 'p':
+			_snprintf(str, sizeof(str) - 1, specStr.c_str(), UnpackArg<void *>(record, pos));
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			if (spec.length == 'L')
+				_snprintf(str, sizeof(str) - 1, specStr.c_str(), UnpackArg<long double>(record, pos));
+			else
+				_snprintf(str, sizeof(str) - 1, specStr.c_str(), UnpackArg<double>(record, pos));
+			break;
+		default:
+			if (spec.length == 'l')
+				_snprintf(str, sizeof(str) - 1, specStr.c_str(), UnpackArg<long>(record, pos));
+			else if (spec.length == 'q')
+				_snprintf(str, sizeof(str) - 1, specStr.c_str(), UnpackArg<long long>(record, pos));
+			else if (spec.length == 'z')
+				_snprintf(str, sizeof(str) - 1, specStr.c_str(), UnpackArg<size_t>(record, pos));
+			else
+				_snprintf(str, sizeof(str) - 1, specStr.c_str(), UnpackArg<int>(record, pos));
+			break;
+		}
+		str[sizeof(str) - 1] = 0;
+		line += str;
+	}
+	return line;
+}
+
+/// Returns the queue of the calling thread, or 0 if there are too many threads.
+LogQueue *ThreadLogQueue()
+{
+	if (threadLogQueue)
+		return threadLogQueue;
+
+	Lock<int> lock = logQueueMutex.Acquire();
+	if (numLogQueues >= cMaxLogThreads)
+		return 0;
+	LogQueue *queue = new LogQueue;
+	logQueues[numLogQueues] = queue;
+	FullMemoryBarrier(); // The queue must be visible before the count that publishes it.
+	AtomicIncrement(&numLogQueues);
+	threadLogQueue = queue;
+	return queue;
+}
+
+bool RecordTickLess(const LogRecord *a, const LogRecord *b)
+{
+	return a->tick < b->tick;
+}
+
+/// Formats and writes all the queued lines. [drainMutex locked]
+void DrainLogQueues(std::vector<LogRecord> &batch)
+{
+	batch.clear();
+	const long n = numLogQueues;
+	for(long i = 0; i < n; ++i)
+	{
+		WaitFreeQueue<LogRecord> &records = logQueues[i]->records;
+		for(int numRecords = records.Size(); numRecords > 0; --numRecords)
+		{
+			batch.push_back(*records.Front());
+			records.PopFront();
+		}
+	}
+
+	const long numDropped = numDroppedLogLines;
+	if (batch.empty() && numDropped == numReportedDroppedLogLines)
+		return;
+
+	std::vector<const LogRecord *> sorted(batch.size());
+	for(size_t i = 0; i < batch.size(); ++i)
+		sorted[i] = &batch[i];
+	std::stable_sort(sorted.begin(), sorted.end(), RecordTickLess);
+
+	std::vector<string> lines(sorted.size());
+	for(size_t i = 0; i < sorted.size(); ++i)
+		lines[i] = FormatLogRecord(*sorted[i]);
+
+	Lockable<int>::LockType lock = logWriteMutex.Acquire();
+	for(size_t i = 0; i < sorted.size(); ++i)
+		WriteLine(sorted[i]->tick, lines[i].c_str());
+	if (numDropped != numReportedDroppedLogLines)
+	{
+		char str[128];
+		sprintf(str, "%d log lines were dropped, since they were logged faster than they could be written.", (int)(numDropped - numReportedDroppedLogLines));
+		WriteLine(Clock::Tick(), str);
+		numReportedDroppedLogLines = numDropped;
+	}
+}
+
+void AsyncLogThreadMain()
+{
+	std::vector<LogRecord> batch;
+	while(!asyncLogThread->ShouldQuit())
+	{
+		{
+			Lock<int> lock = drainMutex.Acquire();
+			DrainLogQueues(batch);
+		}
+		if (batch.empty())
+			Clock::Sleep(2);
+	}
+}
+
+/// Stops the background thread at process exit, which writes out the lines still queued.
+struct AsyncLogShutdown
+{
+	~AsyncLogShutdown() { SetAsyncLogging(false); }
+};
+
+AsyncLogShutdown asyncLogShutdown;
+
 } // ~unnamed namespace
 
 void TimeOutputDebugStringVariadic(LogChannel logChannel, const char * /*filename*/, int /*lineNumber*/, const char *msg, ...)
@@ -84,14 +462,53 @@ void TimeOutputDebugStringVariadic(LogChannel logChannel, const char * /*filenam
 	va_start(args, msg);
 	vsnprintf(errorStr, 1023, msg, args);
 
-	if (kNetLogFile.is_open())
-		kNetLogFile << Time() << ": " << errorStr << std::endl;
-	else
-		std::cout << Time() << ": " << errorStr << std::endl;
+	WriteLine(Clock::Tick(), errorStr);
 
 	va_end(args);
 }
 
+void TimeOutputDebugStringAsync(LogChannel logChannel, const char * /*filename*/, int /*lineNumber*/, const char *msg, ...)
+{
+	if (!IsLogChannelActive(logChannel))
+		return;
+
+	if (asyncLoggingEnabled)
+	{
+		LogQueue *queue = ThreadLogQueue();
+		if (queue)
+		{
+			LogRecord *record = queue->records.BeginInsert();
+			if (!record)
+			{
+				AtomicIncrement(&numDroppedLogLines);
+				return;
+			}
+			record->tick = Clock::Tick();
+			record->format = msg;
+			LogStartTick();
+			va_list args;
+			va_start(args, msg);
+			const bool packed = PackLogArgs(*record, args);
+			va_end(args);
+			if (packed)
+			{
+				queue->records.FinishInsert();
+				return;
+			}
+		}
+	}
+
+	Lockable<int>::LockType lock = logWriteMutex.Acquire();
+
+	char errorStr[1024];
+	va_list args;
+	va_start(args, msg);
+	vsnprintf(errorStr, 1023, msg, args);
+	va_end(args);
+
+	WriteLine(Clock::Tick(), errorStr);
+}
+
 void TimeOutputDebugString(LogChannel logChannel, const char * /*filename*/, int /*lineNumber*/, const char *msg)
 {
 	if ((logChannel & kNetActiveLogChannels) == 0)
@@ -102,10 +519,7 @@ void TimeOutputDebugString(LogChannel logChannel, const char * /*filename*/, int
 	char errorStr[1024];
 	_snprintf(errorStr, 1023, "%s", msg);
 
-	if (kNetLogFile.is_open())
-		kNetLogFile << Time() << ": " << errorStr << std::endl;
-	else
-		std::cout << Time() << ": " << errorStr << std::endl;
+	WriteLine(Clock::Tick(), errorStr);
 }
 
 void SetLogChannels(LogChannel logChannels)
@@ -125,6 +539,8 @@ bool IsLogChannelActive(LogChannel channel)
 
 void SetLogFile(const char *filename)
 {
+	FlushLog();
+
 	Lockable<int>::LockType lock = logWriteMutex.Acquire();
 
 	kNetLogFile.close();
@@ -132,6 +548,51 @@ void SetLogFile(const char *filename)
 		kNetLogFile.open(filename, ios::app);
 }
 
+void SetAsyncLogging(bool enabled)
+{
+	if (enabled == asyncLoggingEnabled)
+		return;
+
+	if (enabled)
+	{
+		asyncLogThread = new Thread;
+		asyncLoggingEnabled = true;
+		asyncLogThread->RunFunc(AsyncLogThreadMain);
+	}
+	else
+	{
+		// A thread that is just queueing a line can still finish it after this, so drain the queues once more after the
+		// background thread has stopped.
+		asyncLoggingEnabled = false;
+		asyncLogThread->Stop();
+		delete asyncLogThread;
+		asyncLogThread = 0;
+		Lock<int> lock = drainMutex.Acquire();
+		std::vector<LogRecord> batch;
+		DrainLogQueues(batch);
+	}
+}
+
+bool IsAsyncLoggingEnabled()
+{
+	return asyncLoggingEnabled;
+}
+
+void FlushLog()
+{
+	if (!asyncLoggingEnabled)
+		return;
+
+	Lock<int> lock = drainMutex.Acquire();
+	std::vector<LogRecord> batch;
+	DrainLogQueues(batch);
+}
+
+unsigned long NumDroppedLogLines()
+{
+	return (unsigned long)numDroppedLogLines;
+}
+
 void EnableMemoryLeakLoggingAtExit()
 {
 #ifdef _MSC_VER
@@ -16,33 +16,138 @@
 	@brief Represents a serializable network message. */
 
 #include <string.h>
+#include <cassert>
+#include <algorithm>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #include "kNet/DebugMemoryLeakCheck.h"
 #include "kNet/NetworkMessage.h"
+#include "kNet/MessageDataAllocator.h"
+#include "kNet/DatagramBuffer.h"
+#include "kNet/IMessageHandler.h"
+#include "kNet/MessageFrameArena.h"
+
+#ifdef _MSC_VER
+#define KNET_THREAD_LOCAL __declspec(thread)
+#else
+#define KNET_THREAD_LOCAL __thread
+#endif
 
 namespace kNet
 {
 
+namespace
+{
+/// The unused messages shared between all threads. Destroyed at process exit.
+LockFreePoolAllocator<NetworkMessage> sharedMessagePool;
+
+/// The unused messages cached by a single thread. Zero-initialized for each new thread.
+struct ThreadMessageCache
+{
+	NetworkMessage *messages[NetworkMessagePool::cThreadCacheSize];
+	int numMessages;
+	/// True once the thread has registered FlushCacheAtThreadExit() to run when it exits.
+	bool exitHookRegistered;
+};
+
+KNET_THREAD_LOCAL ThreadMessageCache threadMessageCache;
+
+/// Returns the messages of the cache of an exiting thread to the shared pool, so that the threads that exit without
+/// calling NetworkMessagePool::FlushThreadCache() do not leak them.
+#ifdef WIN32
+void WINAPI FlushCacheAtThreadExit(void *cache)
+#else
+void FlushCacheAtThreadExit(void *cache)
+#endif
+{
+	ThreadMessageCache *c = (ThreadMessageCache*)cache;
+	while(c && c->numMessages > 0)
+		sharedMessagePool.Free(c->messages[--c->numMessages]);
+}
+
+/// The thread-specific slot whose destructor flushes the cache of an exiting thread. The thread-local cache has no
+/// destructor of its own, so each thread sets the slot to its cache when it first caches a message.
+struct ThreadExitHook
+{
+#ifdef WIN32
+	ThreadExitHook() { index = FlsAlloc(FlushCacheAtThreadExit); }
+	void Register(ThreadMessageCache *cache) { if (index != FLS_OUT_OF_INDEXES) FlsSetValue(index, cache); }
+	DWORD index;
+#else
+	ThreadExitHook() { valid = (pthread_key_create(&key, FlushCacheAtThreadExit) == 0); }
+	void Register(ThreadMessageCache *cache) { if (valid) pthread_setspecific(key, cache); }
+	pthread_key_t key;
+	bool valid;
+#endif
+};
+
+/// Created before main() runs. It has nothing to destroy, so the threads that exit late still find it.
+ThreadExitHook threadExitHook;
+}
+
+const char *MessageAckResultToString(MessageAckResult result)
+{
+	switch(result)
+	{
+	case MessageDelivered: return "Delivered";
+	case MessageObsolete: return "Obsolete";
+	case MessageUnreliable: return "Unreliable";
+	case MessageConnectionClosed: return "ConnectionClosed";
+	default: return "(invalid MessageAckResult)";
+	}
+}
+
 NetworkMessage::NetworkMessage()
-:data(0),
+:data(inlineData),
 priority(0),
 id(0),
 contentID(0),
 reliable(true),
 inOrder(true),
+orderingChannel(0),
+forwardErrorCorrection(false),
+deltaEncoding(false),
 obsolete(false),
+expiryTick(0),
+ackHandler(0),
 receivedPacketID(0),
 messageNumber(0),
+queuedTick(0),
+traceID(0),
 reliableMessageNumber(0),
 sendCount(0),
+orderNumber(0),
+hasOrderNumber(false),
+inOutboundQueue(false),
 fragmentIndex(0),
-dataCapacity(0),
+dataCapacity(cInlineCapacity),
 dataSize(0),
-transfer(0)
+sharedData(0),
+transfer(0),
+deltaEncoded(false),
+deltaVersion(0),
+nextInDatagram(0),
+framePage(0)
 {
 }
 
 NetworkMessage::NetworkMessage(const NetworkMessage &rhs)
+:data(inlineData),
+ackHandler(0),
+inOutboundQueue(false),
+dataCapacity(cInlineCapacity),
+dataSize(0),
+sharedData(0),
+transfer(0),
+deltaEncoded(false),
+deltaVersion(0),
+nextInDatagram(0),
+framePage(0)
 {
 	*this = rhs;
 }
@@ -52,14 +157,23 @@ NetworkMessage &NetworkMessage::operator=(const NetworkMessage &rhs)
 	if (this == &rhs)
 		return *this;
 
-	Resize(rhs.Size());
-	memcpy(data, rhs.data, rhs.Size());
+	if (rhs.sharedData) // Shared data is immutable, so the copy can refer to the same bytes.
+		AttachSharedData(rhs.sharedData, rhs.data, rhs.Size());
+	else
+	{
+		Resize(rhs.Size());
+		memcpy(data, rhs.data, rhs.Size());
+	}
 	priority = rhs.priority;
 	id = rhs.id;
 	contentID = rhs.contentID;
 	reliable = rhs.reliable;
 	inOrder = rhs.inOrder;
+	orderingChannel = rhs.orderingChannel;
+	forwardErrorCorrection = rhs.forwardErrorCorrection;
+	deltaEncoding = rhs.deltaEncoding;
 	obsolete = rhs.obsolete;
+	expiryTick = rhs.expiryTick;
 
 	// We could also copy the remaining fields messageNumber, reliableMessageNumber, sendCount and fragmentIndex,
 	// but those don't have a specified meaning at the moment the message is being crafted, so don't.
@@ -70,24 +184,202 @@ NetworkMessage &NetworkMessage::operator=(const NetworkMessage &rhs)
 
 NetworkMessage::~NetworkMessage()
 {
-	delete[] data;
+	ReportNotDelivered();
+	FreeData();
+}
+
+void NetworkMessage::ReportNotDelivered()
+{
+	if (!ackHandler)
+		return;
+	IMessageAckHandler *handler = ackHandler;
+	ackHandler = 0;
+	MessageAckResult result = MessageConnectionClosed;
+	if (obsolete)
+		result = MessageObsolete;
+	else if (!reliable)
+		result = MessageUnreliable;
+	handler->HandleMessageAcked(id, result);
+}
+
+void NetworkMessage::ResetForReuse()
+{
+	ReportNotDelivered();
+	if (sharedData || dataCapacity > NetworkMessagePool::cMaxPooledDataCapacity)
+		FreeData();
+	priority = 0;
+	id = 0;
+	contentID = 0;
+	reliable = true;
+	inOrder = true;
+	orderingChannel = 0;
+	forwardErrorCorrection = false;
+	deltaEncoding = false;
+	obsolete = false;
+	expiryTick = 0;
+#ifdef KNET_NETWORK_PROFILING
+	profilerName.clear();
+#endif
+	receivedPacketID = 0;
+	messageNumber = 0;
+	queuedTick = 0;
+	traceID = 0;
+	reliableMessageNumber = 0;
+	sendCount = 0;
+	orderNumber = 0;
+	hasOrderNumber = false;
+	inOutboundQueue = false;
+	fragmentIndex = 0;
+	dataSize = 0;
+	transfer = 0;
+	deltaEncoded = false;
+	deltaVersion = 0;
+	nextInDatagram = 0;
+}
+
+void NetworkMessage::AttachSharedData(DatagramBuffer *buffer, const char *sharedBytes, size_t numBytes)
+{
+	assert(buffer);
+	assert(sharedBytes >= buffer->Data() && sharedBytes + numBytes <= buffer->Data() + buffer->Capacity());
+
+	buffer->AddRef(); // Take the new reference first, in case buffer is the one this message already refers to.
+	FreeData();
+
+	sharedData = buffer;
+	data = const_cast<char*>(sharedBytes);
+	dataCapacity = numBytes;
+	dataSize = numBytes;
+}
+
+void NetworkMessage::FreeData()
+{
+	if (sharedData)
+	{
+		sharedData->Release();
+		sharedData = 0;
+	}
+	else if (!IsInline())
+		MessageDataAllocator::Free(data, dataCapacity);
+	data = inlineData;
+	dataCapacity = cInlineCapacity;
+}
+
+void NetworkMessage::SwapData(NetworkMessage &rhs)
+{
+	// The inline contents stay in their messages, so they are copied over, and data is pointed to the inline storage
+	// of the message that now holds them.
+	const bool inlineLhs = IsInline();
+	const bool inlineRhs = rhs.IsInline();
+	if (inlineLhs && inlineRhs)
+	{
+		char temp[cInlineCapacity];
+		memcpy(temp, inlineData, dataSize);
+		memcpy(inlineData, rhs.inlineData, rhs.dataSize);
+		memcpy(rhs.inlineData, temp, dataSize);
+	}
+	else if (inlineLhs)
+	{
+		memcpy(rhs.inlineData, inlineData, dataSize);
+		data = rhs.data;
+		rhs.data = rhs.inlineData;
+	}
+	else if (inlineRhs)
+	{
+		memcpy(inlineData, rhs.inlineData, rhs.dataSize);
+		rhs.data = data;
+		data = inlineData;
+	}
+	else
+		std::swap(data, rhs.data);
+	std::swap(dataCapacity, rhs.dataCapacity);
+	std::swap(dataSize, rhs.dataSize);
+	std::swap(sharedData, rhs.sharedData);
+	std::swap(forwardErrorCorrection, rhs.forwardErrorCorrection);
+	std::swap(deltaEncoding, rhs.deltaEncoding);
+	std::swap(deltaEncoded, rhs.deltaEncoded);
+	std::swap(deltaVersion, rhs.deltaVersion);
+#ifdef KNET_NETWORK_PROFILING
+	profilerName.swap(rhs.profilerName);
+#endif
 }
 
 void NetworkMessage::Resize(size_t newBytes, bool discard)
 {
+	if (sharedData)
+	{
+		// The shared bytes may not be modified, so move the message to a buffer of its own.
+		size_t newCapacity = cInlineCapacity;
+		char *newData = (newBytes <= cInlineCapacity) ? inlineData : MessageDataAllocator::Allocate(newBytes, newCapacity);
+		if (!discard)
+			memcpy(newData, data, (newBytes < dataSize) ? newBytes : dataSize);
+		sharedData->Release();
+		sharedData = 0;
+		data = newData;
+		dataCapacity = newCapacity;
+		dataSize = newBytes;
+		return;
+	}
+
 	// Remember how much data is actually being used.
 	dataSize = newBytes;
 
 	if (newBytes <= dataCapacity)
 		return; // No need to reallocate, we can fit the requested amount of bytes.
 
-	char *newData = new char[newBytes];
+	size_t newCapacity;
+	char *newData = MessageDataAllocator::Allocate(newBytes, newCapacity);
 	if (!discard)
 		memcpy(newData, data, dataCapacity);
 
-	delete[] data;
+	if (!IsInline())
+		MessageDataAllocator::Free(data, dataCapacity);
 	data = newData;
-	dataCapacity = newBytes;
+	dataCapacity = newCapacity;
+}
+
+NetworkMessage *NetworkMessagePool::New()
+{
+	ThreadMessageCache &cache = threadMessageCache;
+	if (cache.numMessages > 0)
+		return cache.messages[--cache.numMessages];
+
+	return sharedMessagePool.New();
+}
+
+void NetworkMessagePool::Free(NetworkMessage *msg)
+{
+	if (!msg)
+		return;
+
+	if (msg->framePage)
+	{
+		MessageFrameArena::Free(msg);
+		return;
+	}
+
+	msg->ResetForReuse();
+
+	ThreadMessageCache &cache = threadMessageCache;
+	if (!cache.exitHookRegistered)
+	{
+		threadExitHook.Register(&cache);
+		cache.exitHookRegistered = true;
+	}
+	if (cache.numMessages == cThreadCacheSize)
+	{
+		// Return half of the cache to the shared pool, so that a thread that only frees messages passes them on to the
+		// threads that allocate them, and a thread alternating between allocating and freeing does not hit the shared pool each time.
+		while(cache.numMessages > cThreadCacheSize / 2)
+			sharedMessagePool.Free(cache.messages[--cache.numMessages]);
+	}
+	cache.messages[cache.numMessages++] = msg;
+}
+
+void NetworkMessagePool::FlushThreadCache()
+{
+	ThreadMessageCache &cache = threadMessageCache;
+	while(cache.numMessages > 0)
+		sharedMessagePool.Free(cache.messages[--cache.numMessages]);
 }
 
 } // ~kNet
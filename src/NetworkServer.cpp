@@ -21,12 +21,16 @@
 #ifdef KNET_UNIX
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <netinet/tcp.h>
+#endif
 #include "kNet/DebugMemoryLeakCheck.h"
 
 #include "kNet/Network.h"
 #include "kNet/NetworkServer.h"
 #include "kNet/TCPMessageConnection.h"
 #include "kNet/UDPMessageConnection.h"
+#include "kNet/SharedMemoryChannel.h"
 #include "kNet/Datagram.h"
 #include "kNet/NetworkWorkerThread.h"
 #include "kNet/NetworkLogging.h"
@@ -34,6 +38,7 @@
 
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 
 namespace kNet
 {
@@ -41,22 +46,36 @@ namespace kNet
 NetworkServer::NetworkServer(Network *owner_, std::vector<Socket *> listenSockets_)
 :listenSockets(listenSockets_), 
 owner(owner_), 
-workerThread(0), 
-#ifdef KNET_THREAD_CHECKING_ENABLED
-workerThreadId(Thread::NullThreadId()),
-#endif
+listenSocketWorkerThreads(listenSockets_.size(), (NetworkWorkerThread *)0),
 acceptNewConnections(true), 
+workerThreadBroadcasts(false),
+connectionCookiesRequired(true),
 networkServerListener(0),
+readyConnections(8192),
+readyListOverflowed(0),
+numMalformedDatagrams(0),
+numAcceptQueueOverflows(0),
+numAcceptBacklogs(0),
+inboundQuantum(cDefaultInboundQuantum),
+numSharedMemoryConnections(0),
 udpConnectionAttempts(64)
 {
 	assert(owner);
 	assert(!listenSockets.empty());
+	DatagramCipher::GenerateRandomBytes(connectionCookieKey, sizeof(connectionCookieKey));
+	xdpInterface = owner->XdpInterface();
 }
 
 NetworkServer::~NetworkServer()
 {
 	KNET_LOG(LogObjectAlloc, "Deleting NetworkServer %p.", this);
 	CloseSockets();
+
+	// The worker threads may add the clients to the ready list until each is removed from its thread, so release them
+	// before the members they use are destroyed.
+	ConnectionMap remainingClients;
+	remainingClients.swap(*clients.Acquire());
+	connectionSnapshot.Publish(ConnectionList());
 }
 
 void NetworkServer::RegisterServerListener(INetworkServerListener *listener)
@@ -69,12 +88,51 @@ void NetworkServer::SetAcceptNewConnections(bool acceptNewConnections_)
 	acceptNewConnections = acceptNewConnections_;
 }
 
-void NetworkServer::SetWorkerThread(NetworkWorkerThread *thread) // [main thread]
+void NetworkServer::SetListenSocketWorkerThread(int listenSocketIndex, NetworkWorkerThread *thread) // [main thread]
 {
-	workerThread = thread;
-#ifdef KNET_THREAD_CHECKING_ENABLED
-	workerThreadId = thread ? thread->ThreadObject().Id() : Thread::NullThreadId();
-#endif
+	assert(listenSocketIndex >= 0 && listenSocketIndex < (int)listenSocketWorkerThreads.size());
+	listenSocketWorkerThreads[listenSocketIndex] = thread;
+}
+
+NetworkWorkerThread *NetworkServer::ListenSocketWorkerThread(int listenSocketIndex) const
+{
+	if (listenSocketIndex < 0 || listenSocketIndex >= (int)listenSocketWorkerThreads.size())
+		return 0;
+	return listenSocketWorkerThreads[listenSocketIndex];
+}
+
+std::vector<NetworkWorkerThread *> NetworkServer::WorkerThreads() const // [main thread]
+{
+	std::vector<NetworkWorkerThread *> threads;
+	for(size_t i = 0; i < listenSocketWorkerThreads.size(); ++i)
+		if (listenSocketWorkerThreads[i] && std::find(threads.begin(), threads.end(), listenSocketWorkerThreads[i]) == threads.end())
+			threads.push_back(listenSocketWorkerThreads[i]);
+	return threads;
+}
+
+void NetworkServer::DetachWorkerThread(NetworkWorkerThread *thread) // [main thread]
+{
+	for(size_t i = 0; i < listenSocketWorkerThreads.size(); ++i)
+		if (listenSocketWorkerThreads[i] == thread)
+			listenSocketWorkerThreads[i] = 0;
+}
+
+int NetworkServer::NumUDPListenSockets(const NetworkWorkerThread *thread) const
+{
+	int numSockets = 0;
+	for(size_t i = 0; i < listenSockets.size() && i < listenSocketWorkerThreads.size(); ++i)
+		if (listenSockets[i]->TransportLayer() == SocketOverUDP && listenSocketWorkerThreads[i] == thread)
+			++numSockets;
+	return numSockets;
+}
+
+int NetworkServer::NumUDPListenSockets() const
+{
+	int numSockets = 0;
+	for(size_t i = 0; i < listenSockets.size(); ++i)
+		if (listenSockets[i]->TransportLayer() == SocketOverUDP)
+			++numSockets;
+	return numSockets;
 }
 
 void NetworkServer::CloseSockets()
@@ -89,31 +147,72 @@ void NetworkServer::CloseSockets()
 
 	// Now forget all sockets - not getting them back in any way.
 	listenSockets.clear();
+	listenSocketWorkerThreads.clear();
 }
 
-Socket *NetworkServer::AcceptConnections(Socket *listenSocket)
+void NetworkServer::AcceptConnections(Socket *listenSocket)
 {
 	if (!listenSocket || !listenSocket->Connected())
-		return 0;
+		return;
+
+	// Look at the queue before draining it, since a queue that is full now has been turning connections away.
+	CheckAcceptQueue(listenSocket);
+
+	// The connections that came in since the last call all wait in the queue, so take them all, within the budget.
+	for(int i = 0; i < cMaxConnectionsAcceptedPerProcess; ++i)
+	{
+		Socket *client = 0;
+		if (!AcceptConnection(listenSocket, client))
+			return;
+		if (client)
+			AddAcceptedConnection(client);
+	}
+	++numAcceptBacklogs;
+	KNET_LOG(LogVerbose, "NetworkServer::AcceptConnections: Accepted %d connections, leaving the rest waiting for the next call.",
+		cMaxConnectionsAcceptedPerProcess);
+}
+
+bool NetworkServer::AcceptConnection(Socket *listenSocket, Socket *&client)
+{
+	client = 0;
+	if (!listenSocket->Connected())
+		return false;
+
+	if (listenSocket->TransportLayer() == SocketOverSharedMemory)
+	{
+		client = AcceptSharedMemoryConnection(listenSocket);
+		return client != 0;
+	}
 
 	sockaddr_in remoteAddress;
 	memset(&remoteAddress, 0, sizeof(remoteAddress));
 	socklen_t remoteAddressLen = sizeof(remoteAddress);
 	SOCKET &listenSock = listenSocket->GetSocketHandle();
+#ifdef __linux__
+	// Make the socket nonblocking and close-on-exec in the same call, instead of with two more system calls per connection.
+	SOCKET acceptSocket = accept4(listenSock, (sockaddr*)&remoteAddress, &remoteAddressLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
 	SOCKET acceptSocket = accept(listenSock, (sockaddr*)&remoteAddress, &remoteAddressLen);
+#endif
 	if (acceptSocket == KNET_ACCEPT_FAILURE)
 	{
 		int error = Network::GetLastError();
 		if (error != KNET_EWOULDBLOCK)
 		{
-			KNET_LOG(LogError, "NetworkServer::AcceptConnections: accept failed: %s", Network::GetErrorString(error).c_str());
+			KNET_LOG(LogError, "NetworkServer::AcceptConnection: accept failed: %s", Network::GetErrorString(error).c_str());
 			closesocket(listenSock);
 			listenSock = INVALID_SOCKET;
 		}
-		return 0;
+		return false;
 	}
 
 	EndPoint remoteEndPoint = EndPoint::FromSockAddrIn(remoteAddress);
+	if (!sourceFilter.Admit(remoteEndPoint, Clock::LoopTick()))
+	{
+		KNET_LOG(LogVerbose, "NetworkServer::AcceptConnection: Refused a TCP connection from %s, which is banned or over its rate limit.", remoteEndPoint.ToString().c_str());
+		closesocket(acceptSocket);
+		return true;
+	}
 	std::string remoteHostName = remoteEndPoint.IPToString();
 
 	KNET_LOG(LogInfo, "Accepted incoming TCP connection from %s:%d.", remoteHostName.c_str(), (int)remoteEndPoint.port);
@@ -128,166 +227,532 @@ Socket *NetworkServer::AcceptConnections(Socket *listenSocket)
 	std::string localHostName = owner->LocalAddress();
 
 	const size_t maxTcpSendSize = 65536;
-	Socket *socket = owner->StoreSocket(Socket(acceptSocket, localEndPoint, localHostName.c_str(), remoteEndPoint, remoteHostName.c_str(), SocketOverTCP, ServerClientSocket, maxTcpSendSize));
-	socket->SetBlocking(false);
+	client = owner->StoreSocket(Socket(acceptSocket, localEndPoint, localHostName.c_str(), remoteEndPoint, remoteHostName.c_str(), SocketOverTCP, ServerClientSocket, maxTcpSendSize));
+#ifndef __linux__
+	client->SetBlocking(false);
+#endif
+
+	return true;
+}
+
+void NetworkServer::AddAcceptedConnection(Socket *client)
+{
+	if (!client->Connected())
+		KNET_LOG(LogError, "Warning: Accepted an already closed connection!");
+
+	KNET_LOG(LogInfo, "Client connected from %s.", client->ToString().c_str());
+
+	// Build a MessageConnection on top of the raw socket.
+	Ptr(MessageConnection) clientConnection = new TCPMessageConnection(owner, this, client, ConnectionOK);
+	AssignReadySlot(clientConnection, clientConnection->RemoteEndPoint());
+	assert(owner);
+	owner->AssignConnectionToWorkerThread(clientConnection);
+
+	if (networkServerListener)
+		networkServerListener->NewConnectionEstablished(clientConnection);
+
+	{
+		PolledTimer timer;
+		Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
+		(*clientsLock)[clientConnection->RemoteEndPoint()] = clientConnection;
+		PublishConnections(*clientsLock);
+		KNET_LOG(LogWaits, "NetworkServer::AddAcceptedConnection: Adding new accepted TCP connection to connection list took %f msecs.",
+			timer.MSecsElapsed());
+	}
 
-	return socket;
+	owner->NewMessageConnectionCreated(clientConnection);
 }
 
-void NetworkServer::CleanupDeadConnections()
+void NetworkServer::CheckAcceptQueue(Socket *listenSocket)
 {
-	// When we acquire the list of client connections, don't hold on to it for long, so that the worker thread can properly detach from it.
-	ConnectionMap clientsMap = *clients.Acquire();
+#ifdef __linux__
+	if (listenSocket->TransportLayer() != SocketOverTCP)
+		return;
 
-	// Clean up all disconnected/timed out connections.
-	ConnectionMap::iterator iter = clientsMap.begin();
-	while(iter != clientsMap.end())
+	// For a listen socket, the kernel reports the length of the accept queue as the unacked count, and its limit as the
+	// sacked count.
+	tcp_info info;
+	socklen_t infoLen = sizeof(info);
+	if (getsockopt(listenSocket->GetSocketHandle(), IPPROTO_TCP, TCP_INFO, &info, &infoLen) == 0 && info.tcpi_sacked > 0 &&
+		info.tcpi_unacked >= info.tcpi_sacked)
 	{
-		ConnectionMap::iterator next = iter;
-		++next;
-		if (!iter->second->Connected())
-		{
-			KNET_LOG(LogInfo, "Client %s disconnected.", iter->second->ToString().c_str());
-			if (networkServerListener)
-				networkServerListener->ClientDisconnected(iter->second);
-			if (iter->second->GetSocket() && iter->second->GetSocket()->TransportLayer() == SocketOverTCP)
-				owner->CloseConnection(iter->second);
+		++numAcceptQueueOverflows;
+		KNET_LOG(LogVerbose, "NetworkServer::CheckAcceptQueue: The accept queue of %s is full (%d connections).",
+			listenSocket->ToString().c_str(), (int)info.tcpi_unacked);
+	}
+#else
+	(void)listenSocket;
+#endif
+}
 
-			{
-				Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
-				clientsLock->erase(iter->first);
-			}
-		}
-		iter = next;
+Socket *NetworkServer::AcceptSharedMemoryConnection(Socket *listenSocket)
+{
+	SOCKET &listenSock = listenSocket->GetSocketHandle();
+	SOCKET acceptSocket = INVALID_SOCKET;
+	bool listenFailed = false;
+	SharedMemoryChannel *channel = SharedMemoryChannel::Accept(listenSock, acceptSocket, listenFailed);
+	if (listenFailed)
+	{
+		closesocket(listenSock);
+		listenSock = INVALID_SOCKET;
 	}
+	if (!channel)
+		return 0;
+
+	// The source address filter is not applied, since all the connections come from this host.
+	const u32 id = ++numSharedMemoryConnections;
+	EndPoint remoteEndPoint = EndPoint::FromIPAndPort(127, (unsigned char)(id >> 16), (unsigned char)(id >> 8), (unsigned char)id,
+		listenSocket->LocalPort());
+	std::string remoteHostName = remoteEndPoint.IPToString();
+
+	KNET_LOG(LogInfo, "Accepted incoming shared memory connection, which is known as %s.", remoteEndPoint.ToString().c_str());
+
+	Socket socket(acceptSocket, listenSocket->LocalEndPoint(), owner->LocalAddress(), remoteEndPoint, remoteHostName.c_str(),
+		SocketOverSharedMemory, ServerClientSocket, listenSocket->MaxSendSize());
+	socket.SetSharedMemoryChannel(channel);
+	return owner->StoreSocket(socket);
 }
 
-void NetworkServer::Process()
+void NetworkServer::QueueDeadConnection(MessageConnection *connection)
 {
-	CleanupDeadConnections();
+	if (connection->queuedForReclamation)
+		return;
+	connection->queuedForReclamation = true;
+	deadConnections.push_back(connection);
+}
 
-	for(size_t i = 0; i < listenSockets.size(); ++i)
+void NetworkServer::SweepDeadConnections()
+{
+	ConnectionSnapshot snapshot = AcquireConnections();
+	for(ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
+		if (!iter->connection->Connected())
+			QueueDeadConnection(iter->connection);
+}
+
+void NetworkServer::ReclaimDeadConnections()
+{
+	if (deadConnections.empty())
+		return;
+
+	const size_t numReclaimed = std::min(deadConnections.size(), (size_t)cMaxConnectionsReclaimedPerProcess);
+	std::vector<MessageConnection *> listed;
 	{
-		Socket *listen = listenSockets[i];
+		Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
+		for(size_t i = 0; i < numReclaimed; ++i)
+		{
+			// ConnectionClosed() may have removed the connection already.
+			ConnectionMap::const_iterator iter = clientsLock->find(deadConnections[i]->serverEndPoint);
+			if (iter != clientsLock->end() && iter->second == deadConnections[i])
+				listed.push_back(deadConnections[i]);
+		}
+	}
 
-		if (listen->TransportLayer() == SocketOverTCP)
+	for(size_t i = 0; i < listed.size(); ++i)
+	{
+		MessageConnection *connection = listed[i];
+		KNET_LOG(LogInfo, "Client %s disconnected.", connection->ToString().c_str());
+		if (networkServerListener)
+			networkServerListener->ClientDisconnected(connection);
+		if (connection->GetSocket() && IsStreamTransportLayer(connection->GetSocket()->TransportLayer()))
+			owner->CloseConnection(connection);
+	}
+
+	// The whole batch is taken off the client list at once, since publishing the list copies it.
+	{
+		Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
+		bool listChanged = false;
+		for(size_t i = 0; i < listed.size(); ++i)
 		{
-			// Accept the first inbound connection.
-			Socket *client = AcceptConnections(listen);
-			if (client)
-			{
-				if (!client->Connected())
-					KNET_LOG(LogError, "Warning: Accepted an already closed connection!");
+			MessageConnection *connection = listed[i];
+			ConnectionMap::iterator iter = clientsLock->find(connection->serverEndPoint);
+			if (iter == clientsLock->end() || iter->second != connection)
+				continue;
+			RemoveUDPConnection(iter->first);
+			ReleaseReadySlot(connection);
+			interestGrid.Remove(connection);
+			clientsLock->erase(iter);
+			listChanged = true;
+		}
+		if (listChanged)
+			PublishConnections(*clientsLock);
 
-				KNET_LOG(LogInfo, "Client connected from %s.", client->ToString().c_str());
+		// Delete the older versions of the list that the readers have released.
+		connectionSnapshot.ReleaseRetired();
+	}
 
-				// Build a MessageConnection on top of the raw socket.
-				assert(listen->TransportLayer() == SocketOverTCP);
-				Ptr(MessageConnection) clientConnection = new TCPMessageConnection(owner, this, client, ConnectionOK);
-				assert(owner);
-				owner->AssignConnectionToWorkerThread(clientConnection);
+	// The queue held on to the connections until they were off the list.
+	deadConnections.erase(deadConnections.begin(), deadConnections.begin() + numReclaimed);
+}
 
-				if (networkServerListener)
-					networkServerListener->NewConnectionEstablished(clientConnection);
+void NetworkServer::Process()
+{
+	ProcessBeforeConnections();
 
-				{
-					PolledTimer timer;
-					Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
-					(*clientsLock)[clientConnection->RemoteEndPoint()] = clientConnection;
-					KNET_LOG(LogWaits, "NetworkServer::Process: Adding new accepted TCP connection to connection list took %f msecs.",
-						timer.MSecsElapsed());
-				}
+	// Process the new inbound data of the connections that have received any.
+	ProcessReadyConnections();
 
-				owner->NewMessageConnectionCreated(clientConnection);
-			}
-		}
+	ProcessAfterConnections();
+}
+
+void NetworkServer::ProcessFor(int maxMicroseconds)
+{
+	assert(maxMicroseconds >= 0);
+	const tick_t deadline = Clock::Tick() + Clock::TicksPerSec() * (tick_t)maxMicroseconds / 1000000;
+
+	ProcessBeforeConnections();
+	ProcessReadyConnectionsFor(deadline);
+	ProcessAfterConnections();
+}
+
+void NetworkServer::ProcessBeforeConnections()
+{
+	// The multicast messages of this frame go out together, in a single send per datagram.
+	FlushMulticast();
+
+	// The closed connections are found by ProcessReadyConnections(). All of them are checked once in a while too, since a
+	// connection that has been closed for good no longer has a worker thread to report it.
+	if (deadConnectionSweepTimer.TriggeredOrNotRunning())
+	{
+		SweepDeadConnections();
+		deadConnectionSweepTimer.StartMSecs(1000.f);
 	}
+	ReclaimDeadConnections();
+
+	for(size_t i = 0; i < listenSockets.size(); ++i)
+	{
+		Socket *listen = listenSockets[i];
 
-	// Note that the above loop will only accept one new connection/socket/iteration, so if there are multiple
-	// pending new connections, they will only get accepted at a rate of one per each frame.
+		if (IsStreamTransportLayer(listen->TransportLayer()))
+			AcceptConnections(listen);
+	}
 
 	// Process a new UDP connection attempt.
 	ConnectionAttemptDescriptor *desc = udpConnectionAttempts.Front();
 	if (desc)
 	{
-		ProcessNewUDPConnectionAttempt(desc->listenSocket, desc->peer, (const char *)desc->data.data, desc->data.size);
+		if (desc->migration)
+			ProcessUDPConnectionMigration(desc->peer, (const char *)desc->data.data, desc->data.size);
+		else
+			ProcessNewUDPConnectionAttempt(desc->listenSocket, desc->peer, (const char *)desc->data.data, desc->data.size);
 		udpConnectionAttempts.PopFront();
 	}
+}
+
+void NetworkServer::ProcessAfterConnections()
+{
+	// The traffic statistics the balancing is based on are averaged over several seconds, so there is no point doing this often.
+	if (workerRebalanceTimer.TriggeredOrNotRunning())
+	{
+		owner->RebalanceWorkerThreads();
+		workerRebalanceTimer.StartMSecs(5000.f);
+	}
 
-	// Process all new inbound data for each connection handled by this server.
-	ConnectionMap clientMap = *clients.Acquire();
-	for(ConnectionMap::iterator iter = clientMap.begin(); iter != clientMap.end(); ++iter)
-		iter->second->Process();
+	// The connections refresh their traffic statistics once a second.
+	if (bufferTuningTimer.TriggeredOrNotRunning())
+	{
+		TuneUDPSocketBuffers();
+		bufferTuningTimer.StartMSecs(1000.f);
+	}
 }
 
-void NetworkServer::ReadUDPSocketData(Socket *listenSocket) // [worker thread]
+void NetworkServer::AssignReadySlot(MessageConnection *connection, const EndPoint &endPoint)
 {
-	using namespace std;
+	assert(connection->serverReadySlot == -1);
+	connection->serverEndPoint = endPoint;
+	if (freeReadySlots.empty())
+	{
+		connection->serverReadySlot = (int)readySlots.size();
+		readySlots.push_back(connection);
+	}
+	else
+	{
+		connection->serverReadySlot = freeReadySlots.back();
+		freeReadySlots.pop_back();
+		readySlots[connection->serverReadySlot] = connection;
+	}
+}
 
-	assert(listenSocket);
+void NetworkServer::ReleaseReadySlot(MessageConnection *connection)
+{
+	const int slot = connection->serverReadySlot;
+	if (slot < 0 || slot >= (int)readySlots.size() || readySlots[slot] != connection)
+		return;
+	// If the slot is still in readyConnections, the connection that gets the slot next is visited once for nothing.
+	readySlots[slot] = 0;
+	freeReadySlots.push_back(slot);
+	connection->serverReadySlot = -1;
+}
 
-	OverlappedTransferBuffer *recvData = listenSocket->BeginReceive();
-	if (!recvData)
-		return; // No datagram available, return.
-	if (recvData->bytesContains == 0)
+void NetworkServer::AddReadyConnection(int slot)
+{
+	if (!readyConnections.Insert(slot))
+		readyListOverflowed = 1;
+}
+
+void NetworkServer::ProcessReadyConnections()
+{
+	// Only the connections that were in the list when this started are processed now. The ones ProcessReadyConnection()
+	// puts back wait for the next call.
+	TakeReadyConnections();
+	for(size_t i = 0; i < takenConnections.size(); ++i)
+		ProcessReadyConnection(takenConnections[i]);
+}
+
+void NetworkServer::TakeReadyConnections()
+{
+	takenConnections.clear();
+	if (readyListOverflowed && CmpXChgLong(&readyListOverflowed, 0, 1))
 	{
-		listenSocket->EndReceive(recvData);
-		KNET_LOG(LogError, "Received 0 bytes of data in NetworkServer::ReadUDPSocketData!");
+		// Some connections may have been left out of the list while they were marked to be in it, so visit all of them.
+		// The connections that were in the list are visited again the next time, for nothing.
+		KNET_LOG(LogVerbose, "NetworkServer::TakeReadyConnections: The ready list overflowed. Processing all %d connections.", (int)readySlots.size());
+		for(size_t i = 0; i < readySlots.size(); ++i)
+			if (readySlots[i])
+				takenConnections.push_back(readySlots[i]);
 		return;
 	}
-	EndPoint endPoint = EndPoint::FromSockAddrIn(recvData->from); // This conversion is quite silly, perhaps it could be removed to gain performance?
-	KNET_LOG(LogData, "Received a datagram of size %d to socket %s from endPoint %s.", recvData->bytesContains, listenSocket->ToString().c_str(),
-		endPoint.ToString().c_str());
 
-	PolledTimer timer;
-	MessageConnection *receiverConnection = 0;
+	readyBatch.resize(readyConnections.Capacity());
+	const int numReady = readyConnections.PopBatch(&readyBatch[0], (int)readyBatch.size());
+	for(int i = 0; i < numReady; ++i)
+	{
+		const int slot = readyBatch[i];
+		if (slot >= 0 && slot < (int)readySlots.size() && readySlots[slot])
+			takenConnections.push_back(readySlots[slot]);
+	}
+}
 
+void NetworkServer::ProcessReadyConnectionsFor(tick_t deadline)
+{
+	TakeReadyConnections();
+
+	// Clear the marks before looking at the queues, as in ProcessReadyConnection().
+	for(size_t i = 0; i < takenConnections.size(); ++i)
+		takenConnections[i]->inServerReadyList = 0;
+	FullMemoryBarrier();
+
+	fairRound.clear();
+	for(size_t i = 0; i < takenConnections.size(); ++i)
+		if (takenConnections[i]->ProcessConnectionState())
+			fairRound.push_back(takenConnections[i]);
+
+	// Each round gives the connections that have messages left another quantum to spend. A connection that empties its
+	// queue drops out of the rounds, and forgets the quantum it did not spend, so that it can't save up for a burst.
+	size_t nextTurn = 0;
+	bool timeUp = false;
+	while(!fairRound.empty() && !timeUp)
 	{
-		Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
-		if (timer.MSecsElapsed() > 50.f)
+		size_t numLeft = 0;
+		nextTurn = 0;
+		for(size_t i = 0; i < fairRound.size(); ++i)
 		{
-			KNET_LOG(LogWaits, "NetworkServer::ReadUDPSocketData: Accessing the connection list in UDP server receive code took %f msecs.",
-			timer.MSecsElapsed());
+			MessageConnection *connection = fairRound[i];
+			if (timeUp)
+			{
+				fairRound[numLeft++] = connection;
+				continue;
+			}
+			connection->inboundDeficit += inboundQuantum;
+			if (connection->DispatchInboundBudget(connection->inboundDeficit, deadline))
+				fairRound[numLeft++] = connection;
+			else
+				connection->inboundDeficit = 0;
+			timeUp = Clock::IsNewer(Clock::Tick(), deadline);
+			nextTurn = numLeft;
 		}
+		fairRound.resize(numLeft);
+	}
 
-		ConnectionMap::iterator iter = clientsLock->find(endPoint); ///\todo HashTable for performance.
-		if (iter != clientsLock->end())
-			receiverConnection = iter->second;
+	// The connections that did not get their turn in the last round go first in the next call.
+	for(size_t i = 0; i < fairRound.size(); ++i)
+		fairRound[(nextTurn + i) % fairRound.size()]->AddToServerReadyList();
+	for(size_t i = 0; i < takenConnections.size(); ++i)
+	{
+		MessageConnection *connection = takenConnections[i];
+		connection->ResetInboundMessagesEventIfEmpty();
+		if (!connection->Connected())
+			QueueDeadConnection(connection);
+		else if (connection->HasMainThreadWork())
+			connection->AddToServerReadyList();
 	}
+}
+
+void NetworkServer::ProcessReadyConnection(MessageConnection *connection)
+{
+	// Clear the mark before looking at the queues. If a worker thread queues more after this, it adds the connection again.
+	// Pairs with the barrier in MessageConnection::SignalMainThreadWork().
+	connection->inServerReadyList = 0;
+	FullMemoryBarrier();
+
+	connection->Process();
+
+	if (!connection->Connected())
+		QueueDeadConnection(connection);
+	else if (connection->HasMainThreadWork())
+		connection->AddToServerReadyList();
+}
 
-	if (receiverConnection)
+void NetworkServer::TuneUDPSocketBuffers()
+{
+	const int numUDPSockets = NumUDPListenSockets();
+	if (numUDPSockets == 0)
+		return;
+
+	// The total bandwidth-delay product of the connections is the sum of theirs, so average their round-trip times
+	// weighted by their traffic.
+	float bytesInPerSec = 0.f;
+	float bytesOutPerSec = 0.f;
+	float weightedRTT = 0.f;
+	ConnectionSnapshot snapshot = AcquireConnections();
+	for(ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
+	{
+		MessageConnection *connection = iter->connection;
+		if (!connection->GetSocket() || !connection->GetSocket()->IsUDPSlaveSocket())
+			continue;
+		const float traffic = connection->BytesInPerSec() + connection->BytesOutPerSec();
+		bytesInPerSec += connection->BytesInPerSec();
+		bytesOutPerSec += connection->BytesOutPerSec();
+		weightedRTT += traffic * connection->RoundTripTime();
+	}
+	const float rtt = (bytesInPerSec + bytesOutPerSec > 0.f) ? weightedRTT / (bytesInPerSec + bytesOutPerSec) : 0.f;
+
+	// The SO_REUSEPORT sockets of the server share the traffic about evenly.
+	for(size_t i = 0; i < listenSockets.size(); ++i)
+		if (listenSockets[i]->TransportLayer() == SocketOverUDP)
+			listenSockets[i]->TuneBufferSizes(bytesInPerSec / numUDPSockets, bytesOutPerSec / numUDPSockets, rtt);
+}
+
+int NetworkServer::ReadUDPSocketData(Socket *listenSocket) // [worker thread]
+{
+	using namespace std;
+
+	assert(listenSocket);
+
+	// Drain a batch of datagrams per wakeup instead of a single one. The rest stay in the socket and signal it again.
+	return listenSocket->ReceiveDatagrams(this, cMaxDatagramsPerRead);
+}
+
+void NetworkServer::DatagramReceived(Socket *listenSocket, DatagramBuffer *buffer, const char *data, size_t numBytes, const EndPoint &endPoint,
+	tick_t receiveTick, u8 ecn) // [worker thread]
+{
+	packetCapture.Record(CaptureInbound, SocketOverUDP, endPoint, data, numBytes);
+
+	if (!sourceFilter.Admit(endPoint, Clock::LoopTick()))
+		return;
+
+	// Log the raw fields, so that nothing is formatted on the worker thread when the logging is asynchronous.
+	KNET_LOG(LogData, "Received a datagram of size %d to listen socket %p from endPoint %d.%d.%d.%d:%d.", (int)numBytes, listenSocket,
+		(int)endPoint.ip[0], (int)endPoint.ip[1], (int)endPoint.ip[2], (int)endPoint.ip[3], (int)endPoint.port);
+
+	UDPMessageConnection *udpConnection = udpConnections.Find(endPoint);
+	if (udpConnection)
 	{
 		// If the datagram came from a known endpoint, pass it to the connection object that handles that endpoint.
-		UDPMessageConnection *udpConnection = dynamic_cast<UDPMessageConnection *>(receiverConnection);
-		if (udpConnection)
-			udpConnection->QueueInboundDatagram(recvData->buffer.buf, recvData->bytesContains);
-		else
-			KNET_LOG(LogError, "Critical! UDP socket data received into a TCP socket!");
+		udpConnection->QueueInboundDatagram(data, numBytes, buffer, receiveTick, ecn);
+	}
+	else if (UDPMessageConnection::IsMigrationRequest(data, numBytes))
+	{
+		// A client that has moved to this address answers the connect challenge with the ID of its connection. The cookie
+		// is always checked, since it shows that the client receives the datagrams sent to the new address. The tag after
+		// the ID covers the cookie, so the cookie is kept in the request.
+		size_t requestSize = numBytes;
+		if (!CheckConnectionCookie(listenSocket, endPoint, data, requestSize))
+			return;
+		EnqueueNewUDPConnectionAttempt(listenSocket, endPoint, data, numBytes, true);
+	}
+	else if (!acceptNewConnections)
+	{
+		// The attempt would be discarded, so don't answer it with a cookie either.
+		KNET_LOG(LogData, "Dropped a datagram from an unknown endpoint, since the server does not accept new connections.");
 	}
 	else
 	{
-		// The endpoint for this datagram is not known, deserialize it as a new connection attempt packet.
-		EnqueueNewUDPConnectionAttempt(listenSocket, endPoint, recvData->buffer.buf, recvData->bytesContains);
+		// The endpoint for this datagram is not known, deserialize it as a new connection attempt packet. Nothing is stored
+		// for the attempt until the peer has shown that it receives the datagrams sent to its address.
+		if (connectionCookiesRequired && !CheckConnectionCookie(listenSocket, endPoint, data, numBytes))
+			return;
+		EnqueueNewUDPConnectionAttempt(listenSocket, endPoint, data, numBytes);
+	}
+}
+
+u32 NetworkServer::ConnectionCookieEpoch()
+{
+	return (u32)(Clock::Tick() / (Clock::TicksPerSec() * cConnectionCookieEpochSecs));
+}
+
+void NetworkServer::ComputeConnectionCookie(const EndPoint &peer, u32 epoch, u8 *cookie) const
+{
+	u8 salt[DatagramCipher::cSaltSize] = {};
+	memcpy(salt, peer.ip, 4);
+	salt[4] = (u8)peer.port;
+	salt[5] = (u8)(peer.port >> 8);
+	for(int i = 0; i < 4; ++i)
+		salt[6+i] = (u8)(epoch >> (8*i));
+
+	u8 tag[DatagramCipher::cTagSize];
+	DatagramCipher::ComputeTag(connectionCookieKey, salt, UDPMessageConnection::cConnectChallengeMagic,
+		sizeof(UDPMessageConnection::cConnectChallengeMagic), tag);
+	memcpy(cookie, tag, UDPMessageConnection::cConnectCookieSize);
+}
+
+/// Compares two cookies in constant time.
+static bool CookiesEqual(const u8 *a, const u8 *b)
+{
+	u8 difference = 0;
+	for(size_t i = 0; i < UDPMessageConnection::cConnectCookieSize; ++i)
+		difference |= a[i] ^ b[i];
+	return difference == 0;
+}
+
+bool NetworkServer::CheckConnectionCookie(Socket *listenSocket, const EndPoint &peer, const char *data, size_t &numBytes) const // [worker thread]
+{
+	const size_t cookieSize = UDPMessageConnection::cConnectCookieSize;
+	const u32 epoch = ConnectionCookieEpoch();
+	u8 cookie[UDPMessageConnection::cConnectCookieSize];
+	ComputeConnectionCookie(peer, epoch, cookie);
+
+	if (numBytes > cookieSize)
+	{
+		const u8 *receivedCookie = (const u8 *)data + numBytes - cookieSize;
+		u8 previousCookie[UDPMessageConnection::cConnectCookieSize];
+		ComputeConnectionCookie(peer, epoch - 1, previousCookie);
+		if (CookiesEqual(receivedCookie, cookie) || CookiesEqual(receivedCookie, previousCookie))
+		{
+			numBytes -= cookieSize;
+			return true;
+		}
 	}
-	listenSocket->EndReceive(recvData);
+
+	char challenge[UDPMessageConnection::cConnectChallengeSize];
+	memcpy(challenge, UDPMessageConnection::cConnectChallengeMagic, sizeof(UDPMessageConnection::cConnectChallengeMagic));
+	memcpy(challenge + sizeof(UDPMessageConnection::cConnectChallengeMagic), cookie, cookieSize);
+	listenSocket->SendTo(challenge, sizeof(challenge), peer);
+	KNET_LOG(LogData, "Sent a connect challenge to endPoint %d.%d.%d.%d:%d.", (int)peer.ip[0], (int)peer.ip[1], (int)peer.ip[2], (int)peer.ip[3], (int)peer.port);
+	return false;
 }
 
-void NetworkServer::EnqueueNewUDPConnectionAttempt(Socket *listenSocket, const EndPoint &endPoint, const char *data, size_t numBytes)
+void NetworkServer::EnqueueNewUDPConnectionAttempt(Socket *listenSocket, const EndPoint &endPoint, const char *data, size_t numBytes, bool migration)
 {
 	ConnectionAttemptDescriptor desc;
 	desc.data.size = std::min<int>(cDatagramBufferSize, numBytes);
 	memcpy(&desc.data.data[0], data, desc.data.size);
 	desc.peer = endPoint;
 	desc.listenSocket = listenSocket;
+	desc.migration = migration;
 
-	///\todo Check IP banlist.
+	// The banned and rate-limited sources have been filtered out in DatagramReceived(), and a flood from spoofed addresses
+	// does not get here while the connection cookies are required, see CheckConnectionCookie().
 	///\todo Check that the maximum number of active concurrent connections is not exceeded.
 
-	bool success = udpConnectionAttempts.Insert(desc);
+	bool success;
+	{
+		Lockable<int>::LockType lock = udpConnectionAttemptsLock.Acquire();
+		success = udpConnectionAttempts.Insert(desc);
+	}
 	if (!success)
 		KNET_LOG(LogError, "Too many connection attempts!");
 	else
-		KNET_LOG(LogInfo, "Queued new connection attempt from %s.", endPoint.ToString().c_str());
+		KNET_LOG(LogInfo, "Queued new %s from %s.", migration ? "migration request" : "connection attempt", endPoint.ToString().c_str());
 }
 
 bool NetworkServer::ProcessNewUDPConnectionAttempt(Socket *listenSocket, const EndPoint &endPoint, const char *data, size_t numBytes)
@@ -299,6 +764,55 @@ bool NetworkServer::ProcessNewUDPConnectionAttempt(Socket *listenSocket, const E
 		return false;
 	}
 
+	// An encrypted connection attempt ends in the salt of the connection and a tag that shows the client knows the key.
+	// The tag covers the early data and its nonce too. The listener only sees the connect message of the application.
+	const u8 *salt = 0;
+	if (owner->EncryptionEnabled())
+	{
+		const size_t trailerSize = DatagramCipher::cSaltSize + DatagramCipher::cTagSize;
+		u8 tag[DatagramCipher::cTagSize];
+		if (numBytes >= trailerSize)
+			DatagramCipher::ComputeTag(owner->encryptionKey, (const u8 *)data + numBytes - trailerSize, data, numBytes - DatagramCipher::cTagSize, tag);
+		if (numBytes < trailerSize || !DatagramCipher::TagsEqual(tag, (const u8 *)data + numBytes - DatagramCipher::cTagSize))
+		{
+			KNET_LOG(LogError, "Ignored a new connection attempt from %s since it was not signed with the encryption key of the server.", endPoint.ToString().c_str());
+			return false;
+		}
+		salt = (const u8 *)data + numBytes - trailerSize;
+		numBytes -= trailerSize;
+	}
+
+	// Before that is the size of the early data, and the early data with its nonce follows the connect message. The flag
+	// bit of the size tells whether the client checksums its datagrams.
+	const char *earlyData = 0;
+	size_t earlyDataSize = 0;
+	u64 earlyDataNonce = 0;
+	bool checksums = false;
+	bool malformed = numBytes < UDPMessageConnection::cConnectTrailerSize;
+	if (!malformed)
+	{
+		numBytes -= UDPMessageConnection::cConnectTrailerSize;
+		DataDeserializer trailer(data + numBytes, UDPMessageConnection::cConnectTrailerSize);
+		const u16 trailerWord = trailer.Read<u16>();
+		checksums = (trailerWord & UDPMessageConnection::cConnectChecksumsFlag) != 0;
+		earlyDataSize = trailerWord & ~UDPMessageConnection::cConnectChecksumsFlag;
+		malformed = earlyDataSize > 0 && numBytes < earlyDataSize + UDPMessageConnection::cEarlyDataNonceSize;
+	}
+	if (malformed)
+	{
+		KNET_LOG(LogError, "Ignored a new connection attempt from %s since its connect datagram was malformed.", endPoint.ToString().c_str());
+		AtomicIncrement(&numMalformedDatagrams);
+		return false;
+	}
+	if (earlyDataSize > 0)
+	{
+		numBytes -= UDPMessageConnection::cEarlyDataNonceSize;
+		DataDeserializer nonce(data + numBytes, UDPMessageConnection::cEarlyDataNonceSize);
+		earlyDataNonce = nonce.Read<u64>();
+		numBytes -= earlyDataSize;
+		earlyData = data + numBytes;
+	}
+
 	// Pass the datagram contents to a callback that decides whether this connection is allowed.
 	if (networkServerListener)
 	{
@@ -310,13 +824,28 @@ bool NetworkServer::ProcessNewUDPConnectionAttempt(Socket *listenSocket, const E
 		}
 	}
 
-	///\todo Check IP banlist.
+	// The address may have been banned while the attempt was queued.
+	if (sourceFilter.IsBanned(endPoint))
+	{
+		KNET_LOG(LogError, "Ignored a new connection attempt from %s since the address is banned.", endPoint.ToString().c_str());
+		return false;
+	}
 	///\todo Check that the maximum number of active concurrent connections is not exceeded.
 
+	// The client answers each connect challenge, so its attempt may have been queued again before the first one was taken.
+	if (udpConnections.Find(endPoint))
+	{
+		KNET_LOG(LogVerbose, "Ignored a repeated connection attempt from %s.", endPoint.ToString().c_str());
+		return false;
+	}
+
 	std::string remoteHostName = endPoint.IPToString();
 
-	// Accept the connection and create a new UDP socket that communicates to that endpoint.
-	Socket *socket = owner->CreateUDPSlaveSocket(listenSocket, endPoint, remoteHostName.c_str());
+	// Accept the connection and create a new UDP socket that communicates to that endpoint. A connected socket of its own
+	// is read directly, and the datagrams the listen socket still gets from the endpoint are queued to the connection.
+	Socket *socket = owner->connectedUDPServerSockets ? owner->CreateConnectedUDPSocket(listenSocket, endPoint, remoteHostName.c_str()) : 0;
+	if (!socket)
+		socket = owner->CreateUDPSlaveSocket(listenSocket, endPoint, remoteHostName.c_str());
 	if (!socket)
 	{
 		KNET_LOG(LogError, "Network::ConnectUDP failed! Cannot accept new UDP connection.");
@@ -324,12 +853,28 @@ bool NetworkServer::ProcessNewUDPConnectionAttempt(Socket *listenSocket, const E
 	}
 
 	UDPMessageConnection *udpConnection = new UDPMessageConnection(owner, this, socket, ConnectionOK);
+	if (salt)
+		udpConnection->EnableEncryption(owner->encryptionKey, salt, false);
+	else if (checksums)
+		udpConnection->EnableDatagramChecksums();
 	Ptr(MessageConnection) connection(udpConnection);
 	{
 		PolledTimer timer;
 		Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
 		if (clientsLock->find(endPoint) == clientsLock->end())
+		{
+			// The ID is random, so that a client can't guess the ID of another connection to take it over.
+			do
+			{
+				DatagramCipher::GenerateRandomBytes((u8 *)&udpConnection->connectionID, sizeof(udpConnection->connectionID));
+			} while(udpConnection->connectionID == 0 || udpConnectionIDs.find(udpConnection->connectionID) != udpConnectionIDs.end());
+
+			AssignReadySlot(connection, endPoint);
 			(*clientsLock)[endPoint] = connection;
+			udpConnections.Insert(endPoint, udpConnection);
+			udpConnectionIDs[udpConnection->connectionID] = udpConnection;
+			PublishConnections(*clientsLock);
+		}
 		else
 			KNET_LOG(LogError, "NetworkServer::ProcessNewUDPConnectionAttempt: Trying to overwrite an old connection with a new one! Discarding connection attempt datagram!",
 				timer.MSecsElapsed());
@@ -344,6 +889,19 @@ bool NetworkServer::ProcessNewUDPConnectionAttempt(Socket *listenSocket, const E
 		networkServerListener->NewConnectionEstablished(connection);
 
 	connection->SendPingRequestMessage(false);
+	if (udpConnection->connectionID != 0)
+		udpConnection->SendConnectionIDMessage();
+
+	// The early data is the first datagram of the connection. A replayed connect datagram opens a connection like the
+	// original did, but its early data is dropped. The client of a genuine connection resends the reliable messages of the
+	// early data if they are not acked.
+	if (earlyData)
+	{
+		if (earlyDataNonces.Insert(earlyDataNonce, ConnectionCookieEpoch()))
+			udpConnection->QueueInboundDatagram(earlyData, earlyDataSize, 0);
+		else
+			KNET_LOG(LogError, "Dropped the early data of the new connection from %s, since it had been received before.", endPoint.ToString().c_str());
+	}
 
 	owner->AssignConnectionToWorkerThread(connection);
 
@@ -353,55 +911,255 @@ bool NetworkServer::ProcessNewUDPConnectionAttempt(Socket *listenSocket, const E
 	return true;
 }
 
-void NetworkServer::BroadcastMessage(const NetworkMessage &msg, MessageConnection *exclude)
+bool NetworkServer::ProcessUDPConnectionMigration(const EndPoint &endPoint, const char *data, size_t numBytes)
 {
-	PolledTimer timer;
+	std::map<u64, UDPMessageConnection *>::iterator iter = udpConnectionIDs.end();
+	if (numBytes >= UDPMessageConnection::cMigrationRequestSize)
+	{
+		DataDeserializer reader(data + sizeof(UDPMessageConnection::cMigrationRequestMagic), 8);
+		iter = udpConnectionIDs.find(reader.Read<u64>());
+	}
+	if (iter == udpConnectionIDs.end())
+	{
+		KNET_LOG(LogVerbose, "Ignored a migration request from %s to an unknown connection.", endPoint.ToString().c_str());
+		return false;
+	}
+	UDPMessageConnection *connection = iter->second;
+	const EndPoint oldEndPoint = connection->serverEndPoint;
+	// The client answers each challenge, so the requests that were sent before the first one got through are duplicates.
+	if (udpConnections.Find(endPoint) == connection)
+		return true;
+	if (!connection->Connected() || !connection->GetSocket() || !connection->IsValidMigrationRequest(data, numBytes))
+	{
+		KNET_LOG(LogError, "Ignored a migration request from %s to connection %s, since the request was not valid for it.",
+			endPoint.ToString().c_str(), connection->ToString().c_str());
+		return false;
+	}
+	if (sourceFilter.IsBanned(endPoint))
+	{
+		KNET_LOG(LogError, "Ignored a migration request from %s since the address is banned.", endPoint.ToString().c_str());
+		return false;
+	}
+	{
+		Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
+		if (clientsLock->find(endPoint) != clientsLock->end())
+		{
+			KNET_LOG(LogError, "Ignored a migration request from %s, since another connection has that address.", endPoint.ToString().c_str());
+			return false;
+		}
+	}
+
+	// The worker thread sends to the address of the socket, so it is held while the address changes. The queues, the round
+	// trip time and the congestion state of the connection stay as they were.
+	NetworkWorkerThread *workerThread = connection->WorkerThread();
+	if (workerThread)
+		workerThread->ThreadObject().Hold();
+	connection->GetSocket()->SetUDPPeerEndPoint(endPoint);
+	connection->serverEndPoint = endPoint;
+	if (workerThread)
+		workerThread->ThreadObject().Resume();
+
+	{
+		Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
+		ConnectionMap::iterator client = clientsLock->find(oldEndPoint);
+		if (client != clientsLock->end() && client->second == connection)
+		{
+			(*clientsLock)[endPoint] = client->second;
+			clientsLock->erase(client);
+			udpConnections.Remove(oldEndPoint);
+			udpConnections.Insert(endPoint, connection);
+			PublishConnections(*clientsLock);
+		}
+	}
+	KNET_LOG(LogInfo, "Moved connection %s from %s to its new address.", connection->ToString().c_str(), oldEndPoint.ToString().c_str());
+
+	if (networkServerListener)
+		networkServerListener->ConnectionMigrated(connection, oldEndPoint);
+	return true;
+}
+
+void NetworkServer::AddResumedConnection(UDPMessageConnection *connection, const EndPoint &endPoint)
+{
+	Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
+	AssignReadySlot(connection, endPoint);
+	(*clientsLock)[endPoint] = connection;
+	udpConnections.Insert(endPoint, connection);
+	udpConnectionIDs[connection->connectionID] = connection;
+	PublishConnections(*clientsLock);
+}
+
+void NetworkServer::RemoveUDPConnection(const EndPoint &endPoint)
+{
+	UDPMessageConnection *udpConnection = udpConnections.Find(endPoint);
+	if (!udpConnection)
+		return;
+	udpConnectionIDs.erase(udpConnection->connectionID);
+	udpConnections.Remove(endPoint);
+}
+
+bool NetworkServer::AttachOutboundConnection(const EndPoint &peer, UDPMessageConnection *connection)
+{
+	// The lock serializes the writes to udpConnections with those of the connections accepted by this server.
 	Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
-	if (timer.MSecsElapsed() >= 50.f)
+	if (udpConnections.Find(peer))
+		return false;
+	udpConnections.Insert(peer, connection);
+	return true;
+}
+
+void NetworkServer::DetachOutboundConnection(const EndPoint &peer, UDPMessageConnection *connection)
+{
+	Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
+	if (udpConnections.Find(peer) == connection)
+		udpConnections.Remove(peer);
+}
+
+void NetworkServer::BroadcastMessage(const NetworkMessage &msg, MessageConnection *exclude)
+{
+	// Copy the data once. Each client gets a message that refers to the same bytes.
+	DatagramBuffer *payload = DatagramBuffer::Allocate(msg.Size());
+	memcpy(payload->Data(), msg.data, msg.Size());
+
+	WorkerBroadcast broadcast = { this, exclude, payload, msg.Size(), msg.id, msg.reliable, msg.inOrder, msg.orderingChannel,
+		msg.forwardErrorCorrection, msg.deltaEncoding, msg.priority, msg.contentID, msg.expiryTick };
+	if (!msg.obsolete && BroadcastOnWorkerThreads(broadcast))
 	{
-		KNET_LOG(LogWaits, "NetworkServer::BroadcastMessage: Accessing the connection list took %f msecs.",
-			timer.MSecsElapsed());
+		payload->Release();
+		return;
 	}
 
-	for(ConnectionMap::iterator iter = clientsLock->begin(); iter != clientsLock->end(); ++iter)
+	ConnectionSnapshot snapshot = AcquireConnections();
+	for(ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
 	{
-		MessageConnection *connection = iter->second;
-		if (connection == exclude)
+		MessageConnection *connection = iter->connection;
+		if (connection == exclude || !connection->IsWriteOpen())
 			continue;
 
-		SendMessage(msg, *connection);
+		NetworkMessage *cloned = connection->StartNewSharedMessage(msg.id, payload, payload->Data(), msg.Size());
+		cloned->reliable = msg.reliable;
+		cloned->inOrder = msg.inOrder;
+		cloned->orderingChannel = msg.orderingChannel;
+		cloned->forwardErrorCorrection = msg.forwardErrorCorrection;
+		cloned->deltaEncoding = msg.deltaEncoding;
+		cloned->priority = msg.priority;
+		cloned->contentID = msg.contentID;
+		cloned->obsolete = msg.obsolete;
+		cloned->expiryTick = msg.expiryTick;
+		connection->EndAndQueueMessage(cloned);
 	}
+
+	payload->Release();
 }
 
 void NetworkServer::BroadcastMessage(unsigned long id, bool reliable, bool inOrder, unsigned long priority, 
                                      unsigned long contentID, const char *data, size_t numBytes,
                                      MessageConnection *exclude)
 {
-	PolledTimer timer;
-	Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
-	if (timer.MSecsElapsed() >= 50.f)
+	// Copy the data once. Each client gets a message that refers to the same bytes.
+	DatagramBuffer *payload = DatagramBuffer::Allocate(numBytes);
+	memcpy(payload->Data(), data, numBytes);
+
+	WorkerBroadcast broadcast = { this, exclude, payload, numBytes, id, reliable, inOrder, 0, false, false, priority, contentID, 0 };
+	if (BroadcastOnWorkerThreads(broadcast))
 	{
-		KNET_LOG(LogWaits, "NetworkServer::BroadcastMessage: Accessing the connection list took %f msecs.",
-			timer.MSecsElapsed());
+		payload->Release();
+		return;
 	}
 
-	for(ConnectionMap::iterator iter = clientsLock->begin(); iter != clientsLock->end(); ++iter)
+	ConnectionSnapshot snapshot = AcquireConnections();
+	for(ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
 	{
-		MessageConnection *connection = iter->second;
+		MessageConnection *connection = iter->connection;
 		assert(connection);
-		if (connection == exclude || !connection->IsWriteOpen())
-			continue;
+		if (connection != exclude)
+			QueueSharedMessage(connection, payload, id, reliable, inOrder, priority, contentID, numBytes);
+	}
 
-		NetworkMessage *msg = connection->StartNewMessage(id, numBytes);
-		msg->reliable = reliable;
-		msg->inOrder = inOrder;
-		msg->priority = priority;
-		msg->contentID = contentID;
-		assert(msg->data);
-		assert(msg->Size() == numBytes);
-		memcpy(msg->data, data, numBytes);
-		connection->EndAndQueueMessage(msg);
+	payload->Release();
+}
+
+void NetworkServer::BroadcastMessageAt(float x, float y, unsigned long id, bool reliable, bool inOrder, unsigned long priority,
+                                       unsigned long contentID, const char *data, size_t numBytes, MessageConnection *exclude)
+{
+	interestedConnections.clear();
+	interestGrid.Query(x, y, interestedConnections);
+	if (interestedConnections.empty())
+		return;
+
+	DatagramBuffer *payload = DatagramBuffer::Allocate(numBytes);
+	memcpy(payload->Data(), data, numBytes);
+
+	// The grid only holds connections that are in clients, since they are taken off it when they are removed.
+	for(size_t i = 0; i < interestedConnections.size(); ++i)
+		if (interestedConnections[i] != exclude)
+			QueueSharedMessage(interestedConnections[i], payload, id, reliable, inOrder, priority, contentID, numBytes);
+
+	payload->Release();
+}
+
+void NetworkServer::BroadcastMessageTo(const std::vector<MessageConnection *> &recipients, unsigned long id, bool reliable,
+                                       bool inOrder, unsigned long priority, unsigned long contentID, const char *data, size_t numBytes)
+{
+	if (recipients.empty())
+		return;
+
+	DatagramBuffer *payload = DatagramBuffer::Allocate(numBytes);
+	memcpy(payload->Data(), data, numBytes);
+
+	for(size_t i = 0; i < recipients.size(); ++i)
+	{
+		assert(recipients[i]);
+		QueueSharedMessage(recipients[i], payload, id, reliable, inOrder, priority, contentID, numBytes);
 	}
+
+	payload->Release();
+}
+
+bool NetworkServer::BroadcastOnWorkerThreads(const WorkerBroadcast &broadcast)
+{
+	if (!workerThreadBroadcasts)
+		return false;
+
+	// A thread that is not running would queue the messages on this thread, which is not the thread of its connections.
+	const std::vector<NetworkWorkerThread *> &threads = owner->WorkerThreads();
+	for(size_t i = 0; i < threads.size(); ++i)
+		if (!threads[i]->ThreadObject().IsRunning())
+			return false;
+
+	// The connections are added to and removed from the threads through the same command queues, so each client that is
+	// in the connection list now gets the message from the thread that runs it.
+	for(size_t i = 0; i < threads.size(); ++i)
+		if (threads[i]->NumConnections() > 0)
+			threads[i]->Broadcast(broadcast);
+	return true;
+}
+
+void NetworkServer::QueueSharedMessage(MessageConnection *connection, DatagramBuffer *payload, unsigned long id, bool reliable,
+	bool inOrder, unsigned long priority, unsigned long contentID, size_t numBytes)
+{
+	if (!connection->IsWriteOpen())
+		return;
+
+	NetworkMessage *msg = connection->StartNewSharedMessage(id, payload, payload->Data(), numBytes);
+	msg->reliable = reliable;
+	msg->inOrder = inOrder;
+	msg->priority = priority;
+	msg->contentID = contentID;
+	assert(msg->data);
+	assert(msg->Size() == numBytes);
+	connection->EndAndQueueMessage(msg);
+}
+
+bool NetworkServer::EnableMulticast(const char *groupAddress, unsigned short port, int timeToLive)
+{
+	EndPoint group;
+	if (!groupAddress || !HostResolver::ResolveBlocking(groupAddress, group))
+	{
+		KNET_LOG(LogError, "NetworkServer::EnableMulticast: Could not resolve the group address %s!", groupAddress ? groupAddress : "(null)");
+		return false;
+	}
+	group.port = port;
+	return multicastChannel.OpenSender(group, timeToLive, owner->MaxDatagramSize());
 }
 
 void NetworkServer::SendMessage(const NetworkMessage &msg, MessageConnection &destination)
@@ -418,13 +1176,9 @@ void NetworkServer::DisconnectAllClients()
 {
 	SetAcceptNewConnections(false);
 
-	PolledTimer timer;
-	Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
-	KNET_LOG(LogWaits, "NetworkServer::DisconnectAllClients: Accessing the connection list took %f msecs.",
-		timer.MSecsElapsed());
-
-	for(ConnectionMap::iterator iter = clientsLock->begin(); iter != clientsLock->end(); ++iter)
-		iter->second->Disconnect(0); // Do not wait for any client.
+	ConnectionSnapshot snapshot = AcquireConnections();
+	for(ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
+		iter->connection->Disconnect(0); // Do not wait for any client.
 }
 
 void NetworkServer::Close(int disconnectWaitMilliseconds)
@@ -433,19 +1187,16 @@ void NetworkServer::Close(int disconnectWaitMilliseconds)
 
 	///\todo Re-implement this function to remove the monolithic Sleep here. Instead of this,
 	/// wait for the individual connections to finish.
-	if (GetConnections().size() > 0)
+	if (!AcquireConnections()->empty())
 	{
 		Clock::Sleep(disconnectWaitMilliseconds);
 		KNET_LOG(LogVerbose, "NetworkServer::Close: Waited a fixed period of %d msecs for all connections to disconnect.",
 			disconnectWaitMilliseconds);
 	}
 
-	PolledTimer timer;
-	Lockable<ConnectionMap>::LockType clientsLock = clients.Acquire();
-	KNET_LOG(LogWaits, "NetworkServer::Close: Accessing the connection list took %f msecs.",
-		timer.MSecsElapsed());
-	for(ConnectionMap::iterator iter = clientsLock->begin(); iter != clientsLock->end(); ++iter)
-		iter->second->Close(0); // Do not wait for any client.
+	ConnectionSnapshot snapshot = AcquireConnections();
+	for(ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
+		iter->connection->Close(0); // Do not wait for any client.
 }
 
 void NetworkServer::RunModalServer()
@@ -474,13 +1225,17 @@ void NetworkServer::ConnectionClosed(MessageConnection *connection)
 			if (networkServerListener)
 				networkServerListener->ClientDisconnected(connection);
 
-			if (connection->GetSocket() && connection->GetSocket()->TransportLayer() == SocketOverTCP)
+			if (connection->GetSocket() && IsStreamTransportLayer(connection->GetSocket()->TransportLayer()))
 			{
 				owner->DeleteSocket(connection->socket);
 				connection->socket = 0;
 			}
 
+			RemoveUDPConnection(iter->first);
+			ReleaseReadySlot(connection);
+			interestGrid.Remove(connection);
 			clientsLock->erase(iter);
+			PublishConnections(*clientsLock);
 
 			return;
 		}
@@ -493,31 +1248,61 @@ std::vector<Socket *> &NetworkServer::ListenSockets()
 	return listenSockets;
 }
 
+unsigned long NetworkServer::ReceiveQueueDrops() const
+{
+	unsigned long drops = 0;
+	for(size_t i = 0; i < listenSockets.size(); ++i)
+		if (listenSockets[i]->TransportLayer() == SocketOverUDP)
+			drops += listenSockets[i]->ReceiveQueueDrops();
+	return drops;
+}
+
 NetworkServer::ConnectionMap NetworkServer::GetConnections()
 {
-	PolledTimer timer;
-	Lockable<ConnectionMap>::LockType lock = clients.Acquire();
-	if (timer.MSecsElapsed() > 50.f)
+	ConnectionMap connections;
+	ConnectionSnapshot snapshot = AcquireConnections();
+	for(ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
+		connections[iter->endPoint] = iter->connection;
+	return connections;
+}
+
+void NetworkServer::PublishConnections(const ConnectionMap &connections)
+{
+	ConnectionList list;
+	list.reserve(connections.size());
+	for(ConnectionMap::const_iterator iter = connections.begin(); iter != connections.end(); ++iter)
 	{
-		KNET_LOG(LogWaits, "NetworkServer::GetConnections: Accessing the connection list took %f msecs.",
-			timer.MSecsElapsed());
+		ConnectionSnapshotEntry entry;
+		entry.endPoint = iter->first;
+		entry.connection = iter->second;
+		list.push_back(entry);
 	}
-	return *lock;
+	connectionSnapshot.Publish(list);
 }
 
 int NetworkServer::NumConnections() const
 {
 	int numConnections = 0;
-	Lockable<ConnectionMap>::ConstLockType lock = clients.Acquire();
-	for(ConnectionMap::const_iterator iter = lock->begin(); iter != lock->end(); ++iter)
+	ConnectionSnapshot snapshot = AcquireConnections();
+	for(ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
 	{
-		const MessageConnection *connection = iter->second.ptr();
+		const MessageConnection *connection = iter->connection.ptr();
 		if (connection && (connection->IsPending() || connection->IsReadOpen() || connection->IsWriteOpen()))
 			++numConnections;
 	}
 	return numConnections;
 }
 
+LatencyHistogram NetworkServer::AggregateLatencyHistogram(LatencyMetric metric) const
+{
+	LatencyHistogram histogram;
+	ConnectionSnapshot snapshot = AcquireConnections();
+	for(ConnectionList::const_iterator iter = snapshot->begin(); iter != snapshot->end(); ++iter)
+		if (iter->connection)
+			histogram.Merge(iter->connection->GetLatencyHistogram(metric));
+	return histogram;
+}
+
 std::string NetworkServer::ToString() const
 {
 	bool isUdp = false;
@@ -557,12 +1342,7 @@ std::string NetworkServer::ToString() const
 	}
 	ss << ": ";
 
-	int numConnections = 0;
-	{
-		Lockable<ConnectionMap>::ConstLockType lock = clients.Acquire();
-		numConnections = lock->size();
-	}
-	ss << numConnections << " connections.";
+	ss << AcquireConnections()->size() << " connections.";
 
 	if (!acceptNewConnections)
 		ss << " (not accepting new connections)";
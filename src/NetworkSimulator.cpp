@@ -12,84 +12,234 @@
    See the License for the specific language governing permissions and
    limitations under the License. */
 
+#include <cmath>
+#include <algorithm>
+
 #include "kNet/NetworkSimulator.h"
 #include "kNet/MessageConnection.h"
+#include "kNet/DatagramBuffer.h"
+#include "kNet/Clock.h"
 
 namespace kNet
 {
 
+/// Returns the current time in msecs, as a fractional count so that the bottleneck link can be simulated with
+/// sub-millisecond transfer times.
+static double NowMSecs()
+{
+	return Clock::TicksToMillisecondsD(Clock::Tick());
+}
+
+/// Sorts the expired packets by their deadline, and the packets of the same deadline by the order they were submitted in.
+struct NetworkSimulator::DeliveryOrder
+{
+	explicit DeliveryOrder(const std::vector<QueuedPacket> &packets_)
+	:packets(packets_)
+	{
+	}
+
+	bool operator()(int a, int b) const
+	{
+		if (packets[a].deadline != packets[b].deadline)
+			return packets[a].deadline < packets[b].deadline;
+		return packets[a].sequence < packets[b].sequence;
+	}
+
+	const std::vector<QueuedPacket> &packets;
+};
+
 NetworkSimulator::NetworkSimulator()
 :enabled(false),
 packetLossRate(0),
+burstLossEnterRate(0),
+burstLossExitRate(0.5f),
+burstPacketLossRate(1.f),
+bandwidthBytesPerSec(0),
+queueLimitBytes(0),
 constantPacketSendDelay(0),
 uniformRandomPacketSendDelay(0),
+jitterDistribution(JitterNormal),
+packetDelayJitter(0),
+packetReorderRate(0),
+packetReorderDelay(10.f),
 packetDuplicationRate(0.f),
 corruptionType(CorruptDatagram),
 corruptMessageId(0),
 corruptToggleBitsRate(0),
 corruptMinBits(0),
 corruptMaxBits(0),
+nextSequence(0),
+linkFreeTime(0),
+burstLossState(false),
+randomState(1),
+numLostPackets(0),
+numQueueDrops(0),
 owner(0)
 {
+	Seed(Clock::TickU32() ^ (u32)(size_t)this);
 }
 
 NetworkSimulator::~NetworkSimulator()
 {
-	if (queuedBuffers.size() > 0)
-		KNET_LOG(LogError, "NetworkSimulator: Leaked %d buffers with improper NetworkSimulator teardown!", (int)queuedBuffers.size());
+	if (wheel.NumScheduled() > 0)
+		KNET_LOG(LogError, "NetworkSimulator: Leaked %d buffers with improper NetworkSimulator teardown!", wheel.NumScheduled());
+
+	// The received datagrams are owned by the simulator, the send buffers by the socket.
+	for(size_t i = 0; i < packets.size(); ++i)
+		if (wheel.IsScheduled((int)i) && packets[i].datagram)
+			packets[i].datagram->Release();
+}
+
+void NetworkSimulator::Seed(u32 seed)
+{
+	randomState = (seed != 0) ? seed : 0x9E3779B9;
+	burstLossState = false;
 }
 
-/// Generates a float in half-open interval [0, 1[.
-static float rand01()
-{ 
-	assert(RAND_MAX >= 0x7FFF); ///\todo static assert.
-	return (float)(rand()&0x7FFF) / 0x8000;
+u32 NetworkSimulator::Random() const
+{
+	// Xorshift32. The simulators of different connections run in different worker threads, so they do not share rand().
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	return randomState;
+}
+
+float NetworkSimulator::Random01() const
+{
+	return (float)(Random() >> 8) / (float)(1 << 24);
 }
 
-/// Generates a float in closed interval [0, 1].
-static float rand01incl()
-{ 
-	assert(RAND_MAX >= 0x7FFF); ///\todo static assert.
-	return (float)(rand()&0x7FFF) / 0x7FFF;
+float NetworkSimulator::Random01Incl() const
+{
+	return (float)(Random() >> 8) / (float)((1 << 24) - 1);
+}
+
+void NetworkSimulator::Discard(const QueuedPacket &packet)
+{
+	if (packet.datagram)
+		packet.datagram->Release();
+	else if (owner && owner->GetSocket())
+		owner->GetSocket()->AbortSend(packet.buffer);
 }
 
 void NetworkSimulator::Free()
 {
-	if (!owner || !owner->GetSocket())
-		return;
+	for(size_t i = 0; i < packets.size(); ++i)
+		if (wheel.IsScheduled((int)i))
+			Discard(packets[i]);
+	packets.clear();
+	freeIds.clear();
+	wheel.Reset(0);
+	linkFreeTime = 0;
+}
+
+double NetworkSimulator::AdmitPacket(size_t numBytes, double nowMSecs)
+{
+	double departure = nowMSecs;
+	if (bandwidthBytesPerSec > 0.f)
+	{
+		const double bytesPerMSec = bandwidthBytesPerSec / 1000.0;
+		linkFreeTime = std::max(linkFreeTime, nowMSecs);
+		const double backlogBytes = (linkFreeTime - nowMSecs) * bytesPerMSec;
+		if (queueLimitBytes > 0 && backlogBytes + numBytes > (double)queueLimitBytes)
+		{
+			++numQueueDrops;
+			return -1.0;
+		}
+		linkFreeTime += numBytes / bytesPerMSec;
+		departure = linkFreeTime;
+	}
 
-	for(size_t i = 0; i < queuedBuffers.size(); ++i)
-		owner->GetSocket()->AbortSend(queuedBuffers[i].buffer);
-	queuedBuffers.clear();
+	// The packets that are lost after the bottleneck have used up their share of its bandwidth.
+	float lossRate = packetLossRate;
+	if (burstLossEnterRate > 0.f)
+	{
+		if (burstLossState)
+			burstLossState = !(Random01() < burstLossExitRate);
+		else
+			burstLossState = Random01() < burstLossEnterRate;
+		if (burstLossState)
+			lossRate = burstPacketLossRate;
+	}
+	if (lossRate > 0.f && Random01() < lossRate)
+	{
+		++numLostPackets;
+		return -1.0;
+	}
+	return departure;
+}
+
+double NetworkSimulator::PacketDelay()
+{
+	double delay = constantPacketSendDelay + Random01Incl() * uniformRandomPacketSendDelay;
+	if (packetDelayJitter > 0.f)
+	{
+		// 1 - Random01() is in the range ]0, 1], which keeps the log and the power finite.
+		if (jitterDistribution == JitterPareto)
+			delay += 2.0 * packetDelayJitter * (pow(1.0 - Random01(), -1.0 / 3.0) - 1.0);
+		else
+			delay += packetDelayJitter * sqrt(-2.0 * log(1.0 - Random01())) * cos(6.283185307179586 * Random01());
+	}
+	if (packetReorderRate > 0.f && Random01() < packetReorderRate)
+		delay += packetReorderDelay;
+	return std::max(delay, 0.0);
+}
+
+void NetworkSimulator::Enqueue(QueuedPacket packet, double deliverMSecs)
+{
+	// An empty wheel may not have been advanced in a long while. Bring it to the present, so that the new deadline
+	// does not need to be cascaded down from far away.
+	if (wheel.NumScheduled() == 0)
+		wheel.Advance((u64)NowMSecs(), expired);
+
+	packet.deadline = (u64)ceil(deliverMSecs);
+	packet.sequence = nextSequence++;
+	int id;
+	if (!freeIds.empty())
+	{
+		id = freeIds.back();
+		freeIds.pop_back();
+		packets[id] = packet;
+	}
+	else
+	{
+		id = (int)packets.size();
+		packets.push_back(packet);
+	}
+	wheel.Schedule(id, packet.deadline);
 }
 
 void NetworkSimulator::SubmitSendBuffer(kNet::OverlappedTransferBuffer *buffer, Socket *socket)
 {
-	if (rand01() < packetLossRate)
+	const double departure = AdmitPacket(buffer->bytesContains, NowMSecs());
+	if (departure < 0.0)
 	{
 		if (owner && owner->GetSocket())
 			owner->GetSocket()->AbortSend(buffer);
 		return; // Dropped this packet!
 	}
 
+	QueuedPacket p;
+	p.datagram = 0;
+
 	// Should we duplicate this packet?
-	if (rand01() < packetDuplicationRate)
+	if (Random01() < packetDuplicationRate)
 	{
-		QueuedBuffer b;
 		assert(socket);
-        b.buffer = socket->BeginSend(buffer->bytesContains);
-		if (b.buffer)
+		p.buffer = socket->BeginSend(buffer->bytesContains);
+		if (p.buffer)
 		{
-			assert(b.buffer->buffer.len >= (u32)buffer->bytesContains);
-			memcpy(b.buffer->buffer.buf, buffer->buffer.buf, buffer->bytesContains);
-			b.buffer->bytesContains = buffer->bytesContains;
+			assert(p.buffer->buffer.len >= (u32)buffer->bytesContains);
+			memcpy(p.buffer->buffer.buf, buffer->buffer.buf, buffer->bytesContains);
+			p.buffer->bytesContains = buffer->bytesContains;
 
 			// Should we corrupt the newly created copy?
 			if (corruptionType == CorruptDatagram)
-				MaybeCorruptBufferToggleBits(b.buffer->buffer.buf, b.buffer->bytesContains);
+				MaybeCorruptBufferToggleBits(p.buffer->buffer.buf, p.buffer->bytesContains);
 
-			b.timeUntilTransfer.StartMSecs(constantPacketSendDelay + rand01incl() * uniformRandomPacketSendDelay);
-			queuedBuffers.push_back(b);
+			p.size = buffer->bytesContains;
+			Enqueue(p, departure + PacketDelay());
 		}
 	}
 
@@ -97,34 +247,72 @@ void NetworkSimulator::SubmitSendBuffer(kNet::OverlappedTransferBuffer *buffer,
 	if (corruptionType == CorruptDatagram)
 		MaybeCorruptBufferToggleBits(buffer->buffer.buf, buffer->bytesContains);
 
-	QueuedBuffer b;
-	b.buffer = buffer;
-	b.timeUntilTransfer.StartMSecs(constantPacketSendDelay + rand01incl() * uniformRandomPacketSendDelay);
-	queuedBuffers.push_back(b);
+	p.buffer = buffer;
+	p.size = buffer->bytesContains;
+	Enqueue(p, departure + PacketDelay());
+}
+
+void NetworkSimulator::SubmitReceivedDatagram(const char *data, size_t numBytes)
+{
+	const double departure = AdmitPacket(numBytes, NowMSecs());
+	if (departure < 0.0)
+		return; // Dropped this packet!
+
+	QueuedPacket p;
+	p.buffer = 0;
+	p.size = numBytes;
+	const int numCopies = (Random01() < packetDuplicationRate) ? 2 : 1;
+	for(int i = 0; i < numCopies; ++i)
+	{
+		p.datagram = DatagramBuffer::Allocate(numBytes);
+		memcpy(p.datagram->Data(), data, numBytes);
+		if (corruptionType == CorruptDatagram)
+			MaybeCorruptBufferToggleBits(p.datagram->Data(), numBytes);
+		Enqueue(p, departure + PacketDelay());
+	}
 }
 
 void NetworkSimulator::Process()
 {
-	for(size_t i = 0; i < queuedBuffers.size(); ++i)
-		if (queuedBuffers[i].timeUntilTransfer.Test())
+	if (wheel.NumScheduled() == 0)
+		return;
+
+	expired.clear();
+	wheel.Advance((u64)NowMSecs(), expired);
+	std::sort(expired.begin(), expired.end(), DeliveryOrder(packets));
+	for(size_t i = 0; i < expired.size(); ++i)
+	{
+		const QueuedPacket p = packets[expired[i]];
+		freeIds.push_back(expired[i]);
+		if (p.datagram)
 		{
-			if (owner && owner->GetSocket())
-				owner->GetSocket()->EndSend(queuedBuffers[i].buffer);
-			queuedBuffers.erase(queuedBuffers.begin() + i);
-			--i;
+			if (owner)
+				owner->HandleSimulatedInboundDatagram(p.datagram->Data(), p.size);
+			p.datagram->Release();
 		}
+		else if (owner && owner->GetSocket())
+			owner->GetSocket()->EndSend(p.buffer);
+	}
+	expired.clear();
+}
+
+float NetworkSimulator::MSecsUntilNextTransfer() const
+{
+	if (wheel.NumScheduled() == 0)
+		return -1.f;
+	return (float)wheel.MSecsUntilNextExpiry((u64)NowMSecs());
 }
 
 void NetworkSimulator::MaybeCorruptBufferToggleBits(void *buffer, size_t numBytes) const
 {
 	// Should corrupt this data?
-	if (rand01() < corruptToggleBitsRate)
+	if (Random01() < corruptToggleBitsRate)
 	{
-		int numBitsToCorrupt = corruptMinBits + (int)(rand01() * (corruptMaxBits - corruptMinBits + 1));
+		int numBitsToCorrupt = corruptMinBits + (int)(Random01() * (corruptMaxBits - corruptMinBits + 1));
 		for(int i = 0; i < numBitsToCorrupt; ++i)
 		{
-			int byteIndex = (int)(rand01() * numBytes);
-			int bitIndex = rand() % 8;
+			int byteIndex = (int)(Random01() * numBytes);
+			int bitIndex = Random() % 8;
 			int bitMask = (1 << bitIndex);
 			((char*)buffer)[byteIndex] ^= bitMask;
 		}
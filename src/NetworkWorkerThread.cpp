@@ -16,6 +16,8 @@
 	@brief */
 
 #include <utility>
+#include <algorithm>
+#include <cstdio>
 
 #ifdef KNET_USE_BOOST
 #include <boost/thread/thread.hpp>
@@ -26,10 +28,12 @@
 #include "kNet/UDPMessageConnection.h"
 
 #include "kNet/NetworkWorkerThread.h"
+#include "kNet/Network.h"
 #include "kNet/NetworkLogging.h"
 #include "kNet/Event.h"
 #include "kNet/EventArray.h"
 #include "kNet/Clock.h"
+#include "kNet/PolledTimer.h"
 #include "kNet/Thread.h"
 
 using namespace std;
@@ -37,65 +41,278 @@ using namespace std;
 namespace kNet
 {
 
-NetworkWorkerThread::NetworkWorkerThread()
+WorkerProfile::WorkerProfile()
+:numWakeups(0), numEvents(0), numDatagramsIn(0), numDatagramsOut(0)
 {
+	for(int i = 0; i < NumWorkerPhases; ++i)
+		phaseTicks[i] = 0;
+}
+
+u64 WorkerProfile::TotalTicks() const
+{
+	u64 total = 0;
+	for(int i = 0; i < NumWorkerPhases; ++i)
+		total += phaseTicks[i];
+	return total;
+}
+
+const char *WorkerProfile::PhaseName(WorkerPhase phase)
+{
+	switch(phase)
+	{
+	case WorkerPhaseRebuild: return "rebuild";
+	case WorkerPhaseUpdate: return "update";
+	case WorkerPhaseRead: return "read";
+	case WorkerPhaseSend: return "send";
+	case WorkerPhaseServerRead: return "serverRead";
+	case WorkerPhaseOther: return "other";
+	case WorkerPhaseWait: return "wait";
+	default: return "unknown";
+	}
+}
+
+NetworkWorkerThread::NetworkWorkerThread(Network *owner_, int id_)
+:commands(cCommandQueueSize),
+listsChanged(false),
+busyPolling(false),
+busyPollIdleMSecs(1000.f),
+cpu(-1),
+priority(ThreadPriorityNormal),
+alignListenSockets(false),
+placementChanged(false),
+interruptEventIndex(-1)
+#ifdef KNET_USE_IO_URING
+,ioUringEventIndex(-1)
+,listenSocketsOnRing(false)
+#endif
+#ifdef KNET_USE_RIO
+,registeredIOEventIndex(-1)
+#endif
+#ifdef KNET_USE_AF_XDP
+,xdpEventIndex(-1)
+#endif
+,owner(owner_)
+,id(id_)
+,publishedProfile(WorkerProfile())
+,currentPhase(WorkerPhaseOther)
+,phaseStartTick(0)
+,profilePublishTick(0)
+#ifdef KNET_NETWORK_PROFILING
+,profileSampleTick(0)
+#endif
+,nextIdleSweepTime(0)
+,lastBusyPollEventTick(0)
+,socketsBusyPolled(false)
+,appliedCpu(-1)
+,appliedPriority(ThreadPriorityNormal)
+,listenSocketsAligned(false)
+{
+}
+
+void NetworkWorkerThread::SetPlacement(int cpu_, ThreadPriority priority_, bool alignListenSockets_)
+{
+	cpu = max(cpu_, -1);
+	priority = priority_;
+	alignListenSockets = alignListenSockets_;
+	placementChanged = true;
+	workThread.Interrupt();
+}
+
+void NetworkWorkerThread::ApplyPlacement()
+{
+	const int newCpu = cpu;
+	if (newCpu != appliedCpu)
+	{
+		std::vector<int> cpus;
+		if (newCpu >= 0)
+			cpus.push_back(newCpu);
+		if (Thread::SetCurrentThreadAffinity(cpus) && newCpu >= 0)
+			KNET_LOG(LogInfo, "NetworkWorkerThread %p: Running on processor %d.", this, newCpu);
+		appliedCpu = newCpu;
+	}
+	const ThreadPriority newPriority = priority;
+	if (newPriority != appliedPriority)
+	{
+		Thread::SetCurrentThreadPriority(newPriority);
+		appliedPriority = newPriority;
+	}
+}
+
+void NetworkWorkerThread::SetBusyPolling(bool enabled, float idleFallbackMSecs)
+{
+	busyPollIdleMSecs = max(idleFallbackMSecs, 0.f);
+	busyPolling = enabled;
+	listsChanged = true; // Sets the busy polling of the sockets on the next rebuild.
+	workThread.Interrupt();
+	KNET_LOG(LogVerbose, "NetworkWorkerThread %p: Busy polling %s (idle fallback after %.0f msecs).", this, enabled ? "enabled" : "disabled", idleFallbackMSecs);
 }
 
 void NetworkWorkerThread::AddConnection(MessageConnection *connection)
 {
-	workThread.Hold();
-	Lockable<std::vector<MessageConnection *> >::LockType lock = connections.Acquire();
-	lock->push_back(connection);
+	{
+		Lockable<std::vector<MessageConnection *> >::LockType lock = connections.Acquire();
+		lock->push_back(connection);
+	}
+	PostCommand(CommandAddConnection, connection, 0, false);
 	KNET_LOG(LogVerbose, "Added connection %p to NetworkWorkerThread.", connection);
-	workThread.Resume();
 }
 
 void NetworkWorkerThread::RemoveConnection(MessageConnection *connection)
 {
-	workThread.Hold();
-
-	Lockable<std::vector<MessageConnection *> >::LockType lock = connections.Acquire();
-
-	for(size_t i = 0; i < lock->size(); ++i)
-		if ((*lock)[i] == connection)
+	{
+		Lockable<std::vector<MessageConnection *> >::LockType lock = connections.Acquire();
+		std::vector<MessageConnection *>::iterator iter = std::find(lock->begin(), lock->end(), connection);
+		if (iter == lock->end())
 		{
-			lock->erase(lock->begin() + i);
-			KNET_LOG(LogVerbose, "NetworkWorkerThread::RemoveConnection: Connection %p removed.", connection);
-			workThread.Resume();
+			KNET_LOG(LogError, "NetworkWorkerThread::RemoveConnection called for a nonexisting connection %p!", connection);
 			return;
 		}
-	KNET_LOG(LogError, "NetworkWorkerThread::RemoveConnection called for a nonexisting connection %p!", connection);
-	workThread.Resume();
+		lock->erase(iter);
+	}
+	PostCommand(CommandRemoveConnection, connection, 0, true);
+	KNET_LOG(LogVerbose, "NetworkWorkerThread::RemoveConnection: Connection %p removed.", connection);
 }
 
 void NetworkWorkerThread::AddServer(NetworkServer *server)
 {
-	workThread.Hold();
-	Lockable<std::vector<NetworkServer *> >::LockType lock = servers.Acquire();
-	lock->push_back(server);
+	{
+		Lockable<std::vector<NetworkServer *> >::LockType lock = servers.Acquire();
+		lock->push_back(server);
+	}
+	PostCommand(CommandAddServer, 0, server, false);
 	KNET_LOG(LogVerbose, "Added server %p to NetworkWorkerThread.", server);
-	workThread.Resume();
 }
 
 void NetworkWorkerThread::RemoveServer(NetworkServer *server)
 {
-	workThread.Hold();
-
+	{
+		Lockable<std::vector<NetworkServer *> >::LockType lock = servers.Acquire();
+		std::vector<NetworkServer *>::iterator iter = std::find(lock->begin(), lock->end(), server);
+		if (iter == lock->end())
+		{
+			KNET_LOG(LogError, "NetworkWorkerThread::RemoveServer called for a nonexisting server %p!", server);
+			return;
+		}
+		lock->erase(iter);
+	}
 	PolledTimer timer;
-	Lockable<std::vector<NetworkServer *> >::LockType lock = servers.Acquire();
-	KNET_LOG(LogWaits, "NetworkWorkerThread::RemoveServer: Waited %f msecs to lock servers list.",
+	PostCommand(CommandRemoveServer, 0, server, true);
+	KNET_LOG(LogWaits, "NetworkWorkerThread::RemoveServer: Waited %f msecs for the worker thread to let go of the server.",
 		timer.MSecsElapsed());
+	KNET_LOG(LogVerbose, "NetworkWorkerThread::RemoveServer: Server %p removed.", server);
+}
+
+void NetworkWorkerThread::Broadcast(const WorkerBroadcast &broadcast)
+{
+	WorkerBroadcast *command = new WorkerBroadcast(broadcast);
+	command->payload->AddRef();
+	PostCommand(CommandBroadcast, 0, 0, false, command);
+}
+
+void NetworkWorkerThread::PostCommand(CommandType type, MessageConnection *connection, NetworkServer *server, bool wait, WorkerBroadcast *broadcast)
+{
+	volatile bool done = false;
+	Command command = { type, connection, server, wait ? &done : 0, broadcast };
+	while(!commands.Insert(command))
+	{
+		// The worker thread is busy with an earlier burst of commands. Let it catch up.
+		workThread.Interrupt();
+		Clock::Sleep(0);
+	}
+
+	// Without a running worker thread, no one else touches its lists, and the thread rebuilds its events when it starts.
+	if (!workThread.IsRunning())
+	{
+		ProcessCommands();
+		AcknowledgeCommands();
+		return;
+	}
 
-	for(size_t i = 0; i < lock->size(); ++i)
-		if ((*lock)[i] == server)
+	// Only the interrupt event wakes the thread up, so the other connections of the thread keep running as usual.
+	workThread.Interrupt();
+	while(wait && !done && workThread.IsRunning())
+		Clock::Sleep(0);
+}
+
+void NetworkWorkerThread::ProcessCommands()
+{
+	while(commands.Front())
+	{
+		const Command command = commands.TakeFront();
+		switch(command.type)
 		{
-			lock->erase(lock->begin() + i);
-			KNET_LOG(LogVerbose, "NetworkWorkerThread::RemoveServer: Server %p removed.", server);
-			workThread.Resume();
-			return;
+		case CommandAddConnection:
+			ownConnections.push_back(command.connection);
+			break;
+		case CommandRemoveConnection:
+			ownConnections.erase(std::remove(ownConnections.begin(), ownConnections.end(), command.connection), ownConnections.end());
+#ifdef KNET_USE_RIO
+			// The caller waits until the events are rebuilt, so the socket is still alive when its receive is stopped.
+			if (command.connection->GetSocket())
+				removedRegisteredSockets.push_back(command.connection->GetSocket());
+#endif
+			break;
+		case CommandAddServer:
+			ownServers.push_back(command.server);
+			break;
+		case CommandRemoveServer:
+			ownServers.erase(std::remove(ownServers.begin(), ownServers.end(), command.server), ownServers.end());
+#ifdef KNET_USE_IO_URING
+			// The caller waits until the events are rebuilt, so the sockets are still alive when their receives are stopped.
+			removedListenSockets.insert(removedListenSockets.end(), command.server->ListenSockets().begin(), command.server->ListenSockets().end());
+#endif
+#ifdef KNET_USE_RIO
+			removedRegisteredSockets.insert(removedRegisteredSockets.end(), command.server->ListenSockets().begin(), command.server->ListenSockets().end());
+#endif
+#ifdef KNET_USE_AF_XDP
+			removedXdpSockets.insert(removedXdpSockets.end(), command.server->ListenSockets().begin(), command.server->ListenSockets().end());
+#endif
+			break;
+		case CommandBroadcast:
+			// A thread that has been stopped no longer runs its connections, so the broadcast is dropped then.
+			if (workThread.IsRunning())
+				QueueBroadcast(*command.broadcast);
+			command.broadcast->payload->Release();
+			delete command.broadcast;
+			continue; // The lists stay as they are.
 		}
-	KNET_LOG(LogError, "NetworkWorkerThread::RemoveServer called for a nonexisting server %p!", server);
-	workThread.Resume();
+		if (command.done)
+			pendingCommandAcks.push_back(command.done);
+		listsChanged = true;
+	}
+}
+
+void NetworkWorkerThread::QueueBroadcast(const WorkerBroadcast &broadcast)
+{
+	for(size_t i = 0; i < ownConnections.size(); ++i)
+	{
+		MessageConnection *connection = ownConnections[i];
+		if (connection->ownerServer != broadcast.server || connection == broadcast.exclude || !connection->IsWriteOpen())
+			continue;
+
+		NetworkMessage *msg = connection->StartNewSharedMessage(broadcast.id, broadcast.payload, broadcast.payload->Data(), broadcast.numBytes);
+		if (!msg)
+			continue;
+		msg->reliable = broadcast.reliable;
+		msg->inOrder = broadcast.inOrder;
+		msg->orderingChannel = broadcast.orderingChannel;
+		msg->forwardErrorCorrection = broadcast.forwardErrorCorrection;
+		msg->deltaEncoding = broadcast.deltaEncoding;
+		msg->priority = broadcast.priority;
+		msg->contentID = broadcast.contentID;
+		msg->expiryTick = broadcast.expiryTick;
+		connection->QueueBroadcastMessage(msg);
+	}
+}
+
+void NetworkWorkerThread::AcknowledgeCommands()
+{
+	if (pendingCommandAcks.empty())
+		return;
+	FullMemoryBarrier(); // Everything this thread did with the removed objects must be done before their owners see this.
+	for(size_t i = 0; i < pendingCommandAcks.size(); ++i)
+		*pendingCommandAcks[i] = true;
+	pendingCommandAcks.clear();
 }
 
 void NetworkWorkerThread::StartThread()
@@ -106,13 +323,15 @@ void NetworkWorkerThread::StartThread()
 void NetworkWorkerThread::StopThread()
 {
 	workThread.Stop();
+	ProcessCommands();
+	AcknowledgeCommands();
 
 	{
 		Lockable<std::vector<NetworkServer *> >::LockType lock = servers.Acquire();
 		for(size_t i = 0; i < lock->size(); ++i)
 		{
 			KNET_LOG(LogError, "NetworkWorkerThread::StopThread: Warning: NetworkServer %p was not detached from workerThread %p prior to stopping the thread!.", (*lock)[i], this);
-			(*lock)[i]->SetWorkerThread(0);
+			(*lock)[i]->DetachWorkerThread(this);
 		}
 	}
 	{
@@ -135,220 +354,685 @@ int NetworkWorkerThread::NumServers() const
 	return servers.Acquire()->size();
 }
 
-void NetworkWorkerThread::MainLoop()
+std::vector<MessageConnection *> NetworkWorkerThread::Connections() const
 {
-	std::vector<MessageConnection*> writeWaitConnections;
-
-	EventArray waitEvents;
-
-	// This is an event that is always false and will never be set.
-	Event falseEvent = CreateNewEvent(EventWaitDummy);
-	assert(!falseEvent.IsNull());
-	assert(falseEvent.Test() == false);
-
-	KNET_LOG(LogInfo, "NetworkWorkerThread starting main loop.");
+	return *connections.Acquire();
+}
 
-	std::vector<MessageConnection*> connectionList;
-	std::vector<NetworkServer*> serverList;
+float NetworkWorkerThread::ConnectionLoad(const MessageConnection &connection)
+{
+	// Even an idle connection has its timers and events to process. Every datagram costs a system call, and every
+	// message some (de)serialization on top of that.
+	const float idleConnectionLoad = 1.f;
+	const float messageLoad = 0.25f;
+	return idleConnectionLoad + connection.PacketsInPerSec() + connection.PacketsOutPerSec() +
+		messageLoad * (connection.MsgsInPerSec() + connection.MsgsOutPerSec());
+}
 
-	while(!workThread.ShouldQuit())
+float NetworkWorkerThread::Load() const
+{
+	float load = 0.f;
 	{
-		workThread.CheckHold();
-		if (workThread.ShouldQuit())
-			break;
-	
-		{
-			Lockable<std::vector<MessageConnection *> >::LockType lock = connections.Acquire();
-			connectionList = *lock;
-		}
+		Lockable<std::vector<MessageConnection *> >::ConstLockType lock = connections.Acquire();
+		for(size_t i = 0; i < lock->size(); ++i)
+			load += ConnectionLoad(*(*lock)[i]);
+	}
+	{
+		Lockable<std::vector<NetworkServer *> >::ConstLockType lock = servers.Acquire();
+		for(size_t i = 0; i < lock->size(); ++i)
 		{
-			Lockable<std::vector<NetworkServer *> >::LockType serverLock = servers.Acquire();
-			serverList = *serverLock;
+			NetworkServer &server = *(*lock)[i];
+			// The worker threads of a UDP server read the datagrams of all the connections of that server. When the
+			// server has several SO_REUSEPORT sockets, the kernel spreads the clients evenly over them.
+			const int numOwnSockets = server.NumUDPListenSockets(this);
+			if (numOwnSockets == 0)
+				continue;
+			const float share = (float)numOwnSockets / server.NumUDPListenSockets();
+
+			float serverLoad = 0.f;
+			NetworkServer::ConnectionSnapshot clients = server.AcquireConnections();
+			for(NetworkServer::ConnectionList::const_iterator iter = clients->begin(); iter != clients->end(); ++iter)
+				serverLoad += iter->connection->PacketsInPerSec();
+			load += share * serverLoad;
 		}
+	}
+	return load;
+}
 
-		// Inconveniency: Cannot wait for long time periods, since this will call select() or WSAWaitForMultipleObjects,
-		// which does not support aborting from the wait if the thread is signalled to interrupt and quit/join. To fix
-		// this, should add a custom "interrupt Event" into the WaitArray to wake the thread up when it is supposed to be killed.
-		// For now, just sleep only small periods of time at once to make this issue not a problem at application exit time.
-		const int maxWaitTime = 50; // msecs. ///\todo Make this a lot larger, like, 2000msecs, once the thread interrupts are handled in Sleep and EventArray::Wait.
-		int waitTime = maxWaitTime;
+/// The maximum time the worker thread sleeps at once. The thread is woken up through its interrupt event whenever the
+/// owner needs it, and by the timer wheel when a connection needs an update, so this is only a safety net.
+static const int maxWaitTime = 5000; // msecs.
 
-		waitEvents.Clear();
-		writeWaitConnections.clear();
+/// Returns the current time in the millisecond units of the timer wheel.
+static u64 TimerWheelTime()
+{
+	return Clock::Tick() / Clock::TicksPerMillisecond();
+}
 
-		// Next, build the event array that is used for waiting on the sockets.
-		// At odd indices we will have socket read events, and at even indices the socket write events.
-		// After the events for each connection, we will have the UDP listen sockets for each UDP server connection.
-		for(size_t i = 0; i < connectionList.size(); ++i)
-		{
-			MessageConnection &connection = *connectionList[i];
+void NetworkWorkerThread::RebuildWaitEvents()
+{
+	connectionSlots.clear();
+	connectionSlots.reserve(ownConnections.size());
+	for(size_t i = 0; i < ownConnections.size(); ++i)
+		connectionSlots.push_back(WorkerConnectionSlot(ownConnections[i]));
+	serverList = ownServers;
 
-			try
-			{
-				connection.UpdateConnection();
-			} catch(const NetException &e)
-			{
-				KNET_LOG(LogError, (std::string("kNet::NetException thrown when processing UpdateConnection() for client connection: ") + e.what()).c_str());
-				if (connection.GetSocket())
-					connection.GetSocket()->Close();
-			}
+	// When connections come and go, the OS may hand out the socket descriptor numbers of closed connections to new
+	// ones, so the descriptors remembered by the wait array from the previous rounds cannot be trusted any more.
+	waitEvents.Clear();
+	waitEvents.ResetRegistrations();
 
-			if (connection.GetConnectionState() == ConnectionClosed || !connection.GetSocket() || !connection.GetSocket()->Connected()) // This does not need to be checked each iteration.
-			{
-				connectionList.erase(connectionList.begin()+i);
-				--i;
-				continue;
-			}
+	activeConnections.clear();
+	timerWheel.Reset(TimerWheelTime());
 
-			// The event that is triggered when data is received on the socket.
-			Event readEvent = connection.GetSocket()->GetOverlappedReceiveEvent();
-			if (readEvent.IsNull() || connection.GetSocket()->IsUDPSlaveSocket())
-				readEvent = falseEvent; // If this socket is not readable, add a false event to skip this event slot.
-			waitEvents.AddEvent(readEvent);
+#ifdef KNET_USE_RIO
+	// Stop reading the sockets of the removed connections and servers first, so that a new socket that happens to get
+	// the same address as a deleted one is not mistaken for it.
+	for(size_t i = 0; i < removedRegisteredSockets.size(); ++i)
+		registeredIO.StopReceive(removedRegisteredSockets[i]);
+	removedRegisteredSockets.clear();
+#endif
 
-			// Determine which event to listen to for sending out data. There are three factors:
-			// 1) Is the socket ready for sending (data buffer -wise)?
-			// 2) Are there new messages to send?
-			// 3) Does the send throttle timer allow us to send data to the socket? (UDP only)
+	// Reserve the event slots for each connection. The actual events are filled in when each connection is first updated.
+	for(size_t i = 0; i < connectionSlots.size(); ++i)
+	{
+		waitEvents.AddEvent(falseEvent);
+		waitEvents.AddEvent(falseEvent);
+		ActivateConnection((int)i, 0);
+#ifdef KNET_USE_RIO
+		// The datagrams of the UDP client sockets are read through registeredIO, which activates the connection when they arrive.
+		Socket *socket = connectionSlots[i].connection ? connectionSlots[i].connection->GetSocket() : 0;
+		if (socket && socket->TransportLayer() == SocketOverUDP && socket->Type() == ClientSocket)
+			registeredIO.StartClientReceive(socket, (int)i);
+#endif
+	}
 
-			// If true, this socket is ready to receive new data to be sent.
-			bool socketSendReady = connection.GetSocket()->IsOverlappedSendReady() || connection.GetSocket()->GetOverlappedSendEvent().Test();
-			// If true, this MessageConnection has new unsent data that needs to be sent out.
-			bool socketMessagesAvailable = connection.NumOutboundMessagesPending() > 0 || connection.NewOutboundMessagesEvent().Test();
+	// Add the UDP server listen sockets this thread is responsible for to the wait event list.
+	// For UDP servers, the listen sockets are used for receiving data from all clients.
+	// In this case, the NetworkServer object handles all data reads, but data sends
+	// are still managed by the individual MessageConnection objects.
+	// For TCP servers, this step is not needed, since each connection has its own independent socket.
+	listenSocketList.clear();
+#ifdef KNET_USE_IO_URING
+	// Stop reading the sockets of the removed servers first, so that a new socket that happens to get the same
+	// address as a deleted one is not mistaken for it.
+	for(size_t i = 0; i < removedListenSockets.size(); ++i)
+		ioUring.StopReceive(removedListenSockets[i]);
+	removedListenSockets.clear();
+	listenSocketsOnRing = false;
+#endif
+#ifdef KNET_USE_AF_XDP
+	for(size_t i = 0; i < removedXdpSockets.size(); ++i)
+		xdpSocket.StopReceive(removedXdpSockets[i]);
+	removedXdpSockets.clear();
+#endif
+	for(size_t i = 0; i < serverList.size(); ++i)
+	{
+		NetworkServer &server = *serverList[i];
+
+		std::vector<Socket *> &listenSockets = server.ListenSockets();
 
-			if (socketSendReady && socketMessagesAvailable)
+		for(size_t j = 0; j < listenSockets.size(); ++j)
+			if (listenSockets[j]->TransportLayer() == SocketOverUDP && server.ListenSocketWorkerThread((int)j) == this)
 			{
-				if (connection.GetSocket()->TransportLayer() == SocketOverUDP)
+#ifdef KNET_USE_AF_XDP
+				// The i-th UDP listen socket of a port is read from the receive queue i of the card. The datagrams that the XDP
+				// program does not pass to xdpSocket still arrive to the listen socket, so it is waited on as usual.
+				if (!server.XdpInterface().empty())
 				{
-					int msecsLeftUntilWrite = (int)connection.TimeUntilCanSendPacket();
-					waitTime = min(waitTime, msecsLeftUntilWrite);
-					writeWaitConnections.push_back(&connection);
-					waitEvents.AddEvent(falseEvent);
-					assert(falseEvent.Test() == false && !falseEvent.IsNull());
+					u32 queueId = 0;
+					for(size_t k = 0; k < j; ++k)
+						if (listenSockets[k]->TransportLayer() == SocketOverUDP && listenSockets[k]->LocalPort() == listenSockets[j]->LocalPort())
+							++queueId;
+					xdpSocket.StartReceive(listenSockets[j], &server, server.XdpInterface().c_str(), queueId);
 				}
-				else // TCP socket
-					waitEvents.AddEvent(connection.NewOutboundMessagesEvent());
-			}
-			else if (socketMessagesAvailable) // Here, socketSendReady == false
-			{
-				Event sendEvent = connection.GetSocket()->GetOverlappedSendEvent();
-				if (sendEvent.IsNull())
+#endif
+				Event listenEvent;
+#ifdef KNET_USE_IO_URING
+				// If the ring reads the socket, there is no need to wait on its descriptor. The slot is kept to keep the indices intact.
+				if (ioUring.StartReceive(listenSockets[j], &server))
+					listenSocketsOnRing = true;
+				else
+#endif
+#ifdef KNET_USE_RIO
+				// Like with io_uring, the slot of a socket read through registeredIO is kept to keep the indices intact.
+				if (!registeredIO.StartReceive(listenSockets[j], &server))
+#endif
+					listenEvent = listenSockets[j]->GetOverlappedReceiveEvent();
+				if (listenEvent.IsNull())
 					waitEvents.AddEvent(falseEvent);
 				else
-					waitEvents.AddEvent(sendEvent);
-			}
-			else // Here, socketMessagesAvailable == false
-			{
-				waitEvents.AddEvent(connection.NewOutboundMessagesEvent());
+					waitEvents.AddEvent(listenEvent);
+				listenSocketList.push_back(std::make_pair(&server, listenSockets[j]));
 			}
+	}
+
+#ifdef KNET_USE_IO_URING
+	// The kernel signals this event when the sends of this thread complete, and when the listen sockets receive data.
+	ioUringEventIndex = -1;
+	if (ioUring.IsValid())
+	{
+		ioUringEventIndex = waitEvents.Size();
+		waitEvents.AddEvent(ioUring.CompletionEvent());
+	}
+#endif
+
+#ifdef KNET_USE_RIO
+	// The kernel signals this event when the transfers of the sockets with a request queue in registeredIO complete.
+	registeredIOEventIndex = -1;
+	if (registeredIO.IsValid())
+	{
+		registeredIOEventIndex = waitEvents.Size();
+		waitEvents.AddEvent(registeredIO.CompletionEvent());
+	}
+#endif
+
+#ifdef KNET_USE_AF_XDP
+	// The AF_XDP socket is readable when frames have arrived to the ports it reads.
+	xdpEventIndex = -1;
+	if (xdpSocket.IsValid())
+	{
+		xdpEventIndex = waitEvents.Size();
+		waitEvents.AddEvent(xdpSocket.ReceiveEvent());
+	}
+#endif
+
+	// Finally, wait on the interrupt event of this thread, so that Hold() and Stop() wake us up immediately.
+	interruptEventIndex = waitEvents.Size();
+	waitEvents.AddEvent(workThread.InterruptEvent());
+
+	// New sockets may have come in, so set them all again. Sockets that were never busy-polled are left untouched.
+	if (busyPolling || socketsBusyPolled)
+		SetSocketsBusyPolled(busyPolling);
+
+	// Ask the kernel to hand the datagrams that the network card steers to our processor to the listen sockets we read.
+	const int incomingCpu = (alignListenSockets && cpu >= 0) ? (int)cpu : -1;
+	if (incomingCpu >= 0 || listenSocketsAligned)
+	{
+		for(size_t i = 0; i < listenSocketList.size(); ++i)
+			listenSocketList[i].second->SetIncomingCPU(incomingCpu);
+		listenSocketsAligned = (incomingCpu >= 0);
+	}
+	lastBusyPollEventTick = Clock::Tick();
+}
+
+void NetworkWorkerThread::SetSocketsBusyPolled(bool enabled)
+{
+	const int usecs = enabled ? cBusyPollSocketUSecs : 0;
+	// The connections of a UDP server share its listen sockets, so those are set more than once, but only on a rebuild.
+	for(size_t i = 0; i < connectionSlots.size(); ++i)
+	{
+		Socket *socket = connectionSlots[i].connection ? connectionSlots[i].connection->GetSocket() : 0;
+		if (socket)
+			socket->SetBusyPoll(usecs);
+	}
+	for(size_t i = 0; i < listenSocketList.size(); ++i)
+		listenSocketList[i].second->SetBusyPoll(usecs);
+	socketsBusyPolled = enabled;
+}
+
+void NetworkWorkerThread::ActivateConnection(int index, u8 activity)
+{
+	WorkerConnectionSlot &slot = connectionSlots[index];
+	if (!slot.connection)
+		return;
+
+	if ((slot.activity & ActivityActive) == 0)
+		activeConnections.push_back(index);
+	slot.activity |= ActivityActive | activity;
+}
+
+bool NetworkWorkerThread::UpdateConnection(int index)
+{
+	MessageConnection &connection = *connectionSlots[index].connection;
+
+	try
+	{
+		connection.UpdateConnection();
+	} catch(const NetException &e)
+	{
+		KNET_LOG(LogError, "kNet::NetException thrown when processing UpdateConnection() for client connection: %s", e.what());
+		if (connection.GetSocket())
+			connection.GetSocket()->Close();
+	}
+	connection.SignalMainThreadWork();
+
+	if (connection.GetConnectionState() == ConnectionClosed || !connection.GetSocket() || !connection.GetSocket()->Connected())
+	{
+		// Stop waiting on this connection. The main thread will remove it from our list with RemoveConnection.
+		waitEvents.SetEvent(index*2, falseEvent);
+		waitEvents.SetEvent(index*2+1, falseEvent);
+		connectionSlots[index].connection = 0;
+		return false;
+	}
+	return true;
+}
+
+void NetworkWorkerThread::UpdateConnectionWaitEvents(int index)
+{
+	MessageConnection &connection = *connectionSlots[index].connection;
+	Socket *socket = connection.GetSocket();
+	assert(socket);
+
+	// The event that is triggered when data is received on the socket.
+	Event readEvent = connection.NewInboundDataEvent();
+	if (readEvent.IsNull())
+		readEvent = falseEvent; // If this socket is not readable, add a false event to skip this event slot.
+
+	// Determine which event to listen to for sending out data. There are three factors:
+	// 1) Is the socket ready for sending (data buffer -wise)?
+	// 2) Are there new messages to send?
+	// 3) Does the send throttle timer allow us to send data to the socket? (UDP, or a rate-limited TCP connection)
+
+	// If true, this MessageConnection has new unsent data that needs to be sent out.
+	bool socketMessagesAvailable = connection.NumOutboundMessagesPending() > 0 || connection.NewOutboundMessagesEvent().Test();
+	// If true, this socket is ready to receive new data to be sent.
+	bool socketSendReady = socketMessagesAvailable && (socket->IsOverlappedSendReady() || socket->GetOverlappedSendEvent().Test());
+
+	Event writeEvent;
+	u8 &activity = connectionSlots[index].activity;
+	activity &= ~ActivityThrottled;
+	if (socketSendReady && socketMessagesAvailable)
+	{
+		if (socket->TransportLayer() == SocketOverUDP || connection.TimeUntilCanSendPacket() > 0)
+		{
+			// The send throttle timers are not read through events. Mark this connection to be polled
+			// when its throttle timer allows sending the next packet.
+			activity |= ActivityThrottled;
+			// A connection that holds its messages back to send them together still listens for new messages,
+			// which can make the batch large enough to be sent before the timer expires.
+			writeEvent = connection.HoldingOutboundMessages() ? connection.NewOutboundMessagesEvent() : falseEvent;
 		}
+		else // TCP socket
+			writeEvent = connection.NewOutboundMessagesEvent();
+	}
+	else if (socketMessagesAvailable) // Here, socketSendReady == false
+	{
+		writeEvent = socket->GetOverlappedSendEvent();
+		if (writeEvent.IsNull())
+			writeEvent = falseEvent;
+	}
+	else // Here, socketMessagesAvailable == false
+		writeEvent = connection.NewOutboundMessagesEvent();
+
+	waitEvents.SetEvent(index*2, readEvent);
+	waitEvents.SetEvent(index*2+1, writeEvent);
+}
+
+void NetworkWorkerThread::ProcessConnection(int index)
+{
+	MessageConnection *connection = connectionSlots[index].connection;
+	if (!connection)
+		return;
 
-		// Add all the UDP server listen sockets to the wait event list.
-		// For UDP servers, only a single socket is used for receiving data from all clients.
-		// In this case, the NetworkServer object handlesg all data reads, but data sends
-		// are still managed by the individual MessageConnection objects.
-		// For TCP servers, this step is not needed, since each connection has its own independent socket.
-		for(size_t i = 0; i < serverList.size(); ++i)
+	EnterPhase(WorkerPhaseUpdate);
+	if (!UpdateConnection(index))
+		return;
+
+	try
+	{
+		// A socket event was raised. We can either read or write.
+		if ((connectionSlots[index].activity & ActivityRead) != 0)
 		{
-			NetworkServer &server = *serverList[i];
+			EnterPhase(WorkerPhaseRead);
+			connection->ReadSocket();
+		}
+		EnterPhase(WorkerPhaseSend);
+		connection->SendOutPackets();
+	} catch(const NetException &e)
+	{
+		KNET_LOG(LogError, "kNet::NetException thrown when processing client connection: %s", e.what());
+		if (connection->GetSocket())
+			connection->GetSocket()->Close();
+	}
+	connection->SignalMainThreadWork();
 
-			std::vector<Socket *> &listenSockets = server.ListenSockets();
+	if (!connection->GetSocket() || !connection->GetSocket()->Connected())
+	{
+		waitEvents.SetEvent(index*2, falseEvent);
+		waitEvents.SetEvent(index*2+1, falseEvent);
+		connectionSlots[index].connection = 0;
+		return;
+	}
 
-			for(size_t j = 0; j < listenSockets.size(); ++j)
-				if (listenSockets[j]->TransportLayer() == SocketOverUDP)
-				{
-					Event listenEvent = listenSockets[j]->GetOverlappedReceiveEvent();
-					if (listenEvent.IsNull())
-						waitEvents.AddEvent(falseEvent);
-					else
-						waitEvents.AddEvent(listenEvent);
-				}
+	UpdateConnectionWaitEvents(index);
+}
+
+void NetworkWorkerThread::ScheduleConnectionUpdate(int index)
+{
+	WorkerConnectionSlot &slot = connectionSlots[index];
+	MessageConnection &connection = *slot.connection;
+
+	unsigned long msecs = connection.TimeUntilNextUpdate();
+	if ((slot.activity & ActivityThrottled) != 0)
+		msecs = min(msecs, connection.TimeUntilCanSendPacket());
+	const u64 deadline = TimerWheelTime() + msecs;
+	slot.idle = connection.IsIdle();
+	if (slot.idle && deadline >= nextIdleSweepTime)
+		timerWheel.Cancel(index);
+	else
+		timerWheel.Schedule(index, deadline);
+}
+
+void NetworkWorkerThread::SweepIdleConnections()
+{
+	// The idle flags are read from the slots, so that the connections that are not idle are not touched at all.
+	for(size_t i = 0; i < connectionSlots.size(); ++i)
+	{
+		if (!connectionSlots[i].idle)
+			continue;
+		MessageConnection *connection = connectionSlots[i].connection;
+		if (!connection)
+			continue;
+		try
+		{
+			connection->SendIdleKeepAlive();
+		} catch(const NetException &e)
+		{
+			KNET_LOG(LogError, "kNet::NetException thrown when sending the keepalive of an idle connection: %s", e.what());
+			if (connection->GetSocket())
+				connection->GetSocket()->Close();
 		}
+		ActivateConnection((int)i, 0);
+	}
+}
+
+int NetworkWorkerThread::ComputeWaitTime() const
+{
+	const u64 now = TimerWheelTime();
+	const int sweepTime = (nextIdleSweepTime > now) ? (int)(nextIdleSweepTime - now) : 0;
+	int waitTime = timerWheel.MSecsUntilNextExpiry(now);
+	if (waitTime < 0) // No timers scheduled.
+		waitTime = maxWaitTime;
+	return min(min(waitTime, sweepTime), maxWaitTime);
+}
+
+void NetworkWorkerThread::EnterPhase(WorkerPhase phase)
+{
+	const tick_t now = Clock::Tick();
+	profile.phaseTicks[currentPhase] += Clock::TicksInBetween(now, phaseStartTick);
+	phaseStartTick = now;
+	currentPhase = phase;
+}
+
+void NetworkWorkerThread::PublishProfile()
+{
+	// phaseStartTick is the time of the latest phase change, which is recent enough here.
+	const tick_t now = phaseStartTick;
+	if (Clock::TicksInBetween(now, profilePublishTick) < Clock::TicksPerMillisecond() * 10)
+		return;
+	publishedProfile.Store(profile);
+	profilePublishTick = now;
 
-		// If we did not end up adding any wait events to the queue above, the worker thread does not have 
-		// any connections to manage. Sleep for a moment, until we get some connections to handle.
-		if (waitEvents.Size() == 0)
+#ifdef KNET_NETWORK_PROFILING
+	if (!owner || Clock::TicksInBetween(now, profileSampleTick) < Clock::TicksPerSec())
+		return;
+	const float totalTicks = (float)(profile.TotalTicks() - sampledProfile.TotalTicks());
+	const u64 numWakeups = profile.numWakeups - sampledProfile.numWakeups;
+	if (totalTicks > 0.f)
+	{
+		char name[128];
+		sprintf(name, "workerThread%d.busyPercent", id);
+		ADDEVENT_DYNAMIC(name, 100.f * (profile.BusyTicks() - sampledProfile.BusyTicks()) / totalTicks, "%");
+		for(int i = 0; i < NumWorkerPhases; ++i)
 		{
-			Thread::Sleep(maxWaitTime);
-			continue;
+			sprintf(name, "workerThread%d.phasePercent.%s", id, WorkerProfile::PhaseName((WorkerPhase)i));
+			ADDEVENT_DYNAMIC(name, 100.f * (profile.phaseTicks[i] - sampledProfile.phaseTicks[i]) / totalTicks, "%");
+		}
+		sprintf(name, "workerThread%d.wakeupsPerSec", id);
+		ADDEVENT_DYNAMIC(name, numWakeups * Clock::TicksPerSec() / totalTicks, "#");
+		if (numWakeups > 0)
+		{
+			sprintf(name, "workerThread%d.eventsPerWakeup", id);
+			ADDEVENT_DYNAMIC(name, (float)(profile.numEvents - sampledProfile.numEvents) / numWakeups, "#");
+			sprintf(name, "workerThread%d.datagramsPerWakeup", id);
+			ADDEVENT_DYNAMIC(name, (float)(profile.numDatagramsIn - sampledProfile.numDatagramsIn + profile.numDatagramsOut - sampledProfile.numDatagramsOut) / numWakeups, "#");
+		}
+	}
+	sampledProfile = profile;
+	profileSampleTick = now;
+#endif
+}
+
+int NetworkWorkerThread::BusyPollWait(std::vector<int> &signalledIndices)
+{
+	for(;;)
+	{
+		const int waitTime = ComputeWaitTime();
+		// After a quiet period, sleep in the kernel like the normal mode does, until the next event wakes us up.
+		const bool quiet = Clock::MillisecondsSinceF(lastBusyPollEventTick) >= busyPollIdleMSecs;
+		const int numSignalled = waitEvents.Wait((quiet && waitTime > 0) ? waitTime : 0, signalledIndices);
+		if (numSignalled > 0)
+			lastBusyPollEventTick = Clock::Tick();
+		if (numSignalled != EventArray::WaitTimedOut || quiet || waitTime <= 0 || !busyPolling)
+			return numSignalled;
+		// On a dedicated core this returns right away, but it keeps the thread from starving the others on a shared one.
+		Thread::YieldTimeSlice();
+	}
+}
+
+void NetworkWorkerThread::MainLoop()
+{
+	// Move to our processor first, so that the memory this thread allocates comes from the NUMA node of that processor.
+	placementChanged = false;
+	ApplyPlacement();
+
+	// This is an event that is always false and will never be set.
+	falseEvent = CreateNewEvent(EventWaitDummy);
+	assert(!falseEvent.IsNull());
+	assert(falseEvent.Test() == false);
+
+	KNET_LOG(LogInfo, "NetworkWorkerThread starting main loop.");
+
+#ifdef KNET_USE_IO_URING
+	if (ioUring.Init())
+		IoUring::SetThreadRing(&ioUring);
+#endif
+#ifdef KNET_USE_RIO
+	if (registeredIO.Init())
+		RegisteredIO::SetThreadRIO(&registeredIO);
+#endif
+#ifdef KNET_USE_AF_XDP
+	// The socket is bound when the first listen socket that uses AF_XDP is added to this thread.
+	XdpSocket::SetThreadXdp(&xdpSocket);
+#endif
+
+	std::vector<int> signalledIndices;
+	std::vector<int> connectionsToProcess;
+
+	listsChanged = true;
+	nextIdleSweepTime = TimerWheelTime() + MessageConnection::cIdleKeepAliveIntervalMSecs;
+
+	// The connections take the timestamps that don't need to be precise from the tick cached at the start of each round.
+	tick_t roundStartTick = Clock::UpdateLoopTick();
+	currentPhase = WorkerPhaseOther;
+	phaseStartTick = roundStartTick;
+	while(!workThread.ShouldQuit())
+	{
+		workThread.CheckHold();
+		if (workThread.ShouldQuit())
+			break;
+
+		if (placementChanged)
+		{
+			placementChanged = false;
+			ApplyPlacement();
+			listsChanged = true; // Marks the listen sockets with the new processor.
+		}
+
+		// Apply the connections and the servers added and removed since the last round. A burst of them costs a single rebuild.
+		// The events of the connections are registered only once when the lists change. After that, each round only
+		// processes the connections that were signalled or have timed work, which keeps the cost of a wakeup proportional
+		// to the number of ready connections instead of all connections.
+		EnterPhase(WorkerPhaseRebuild);
+		ProcessCommands();
+		if (listsChanged)
+		{
+			listsChanged = false;
+			RebuildWaitEvents(); // Activates all connections.
+		}
+		AcknowledgeCommands();
+		EnterPhase(WorkerPhaseOther);
+
+		// Process the connections that were signalled or whose timers expired on the previous round.
+		connectionsToProcess.swap(activeConnections);
+		activeConnections.clear();
+		for(size_t i = 0; i < connectionsToProcess.size(); ++i)
+		{
+			const int index = connectionsToProcess[i];
+			MessageConnection *connection = connectionSlots[index].connection;
+			const u64 packetsIn = connection ? connection->PacketsInTotal() : 0;
+			const u64 packetsOut = connection ? connection->PacketsOutTotal() : 0;
+			ProcessConnection(index); // Enters the phases of the connection processing.
+			EnterPhase(WorkerPhaseOther);
+			if (connection)
+			{
+				profile.numDatagramsIn += connection->PacketsInTotal() - packetsIn;
+				profile.numDatagramsOut += connection->PacketsOutTotal() - packetsOut;
+			}
+			connectionSlots[index].activity &= ActivityThrottled;
+			// Schedule the next update of the connection for its timers and its send throttle. Connections that have
+			// nothing to do for a longer while are not touched again until their time comes or their events are signalled.
+			if (connectionSlots[index].connection)
+				ScheduleConnectionUpdate(index);
+			else
+				timerWheel.Cancel(index);
 		}
 
+#ifdef KNET_USE_IO_URING
+		// Pass all the datagrams the connections queued on this round to the kernel in one go.
+		EnterPhase(WorkerPhaseSend);
+		ioUring.Submit();
+#endif
+#ifdef KNET_USE_RIO
+		// Commit the datagrams the connections queued on this round, and prime the receives with the buffers they freed.
+		EnterPhase(WorkerPhaseSend);
+		registeredIO.Submit();
+#endif
+#ifdef KNET_USE_AF_XDP
+		// Pass the frames the connections queued on this round to the card.
+		EnterPhase(WorkerPhaseSend);
+		xdpSocket.Submit();
+#endif
+
 		// Wait until an event occurs either from the application end or in the socket.
 		// When the application wants to send out a message, it is signaled by an event here.
 		// Also, when the socket is ready for reading, writing or if it has been closed, it is signaled here.
-		int index = waitEvents.Wait(max<int>(1, waitTime));
+		roundTimes.RecordTimespan(roundStartTick, Clock::Tick());
+		PublishProfile();
+		EnterPhase(WorkerPhaseWait);
+		int numSignalled = busyPolling ? BusyPollWait(signalledIndices) : waitEvents.Wait(max<int>(1, ComputeWaitTime()), signalledIndices);
+		EnterPhase(WorkerPhaseOther);
+		roundStartTick = Clock::UpdateLoopTick();
+		++profile.numWakeups;
+		if (numSignalled > 0)
+			profile.numEvents += numSignalled;
+
+		// Activate the connections whose timers have expired.
+		expiredTimers.clear();
+		timerWheel.Advance(TimerWheelTime(), expiredTimers);
+		for(size_t i = 0; i < expiredTimers.size(); ++i)
+			ActivateConnection(expiredTimers[i], 0);
 
-		if (index >= 0 && index < waitEvents.Size()) // An event was triggered?
+		// The idle connections have no timers of their own. Send all their keepalives together.
+		if (TimerWheelTime() >= nextIdleSweepTime)
 		{
-			if ((index >> 1) < (int)connectionList.size())
-			{
-				MessageConnection *connection = connectionList[index>>1];
-				assert(connection);
+			EnterPhase(WorkerPhaseUpdate);
+			SweepIdleConnections();
+			EnterPhase(WorkerPhaseOther);
+			nextIdleSweepTime = TimerWheelTime() + MessageConnection::cIdleKeepAliveIntervalMSecs;
+		}
 
-				try
-				{
-					// A socket event was raised. We can either read or write.
-					if ((index & 1) == 0)
-					{
-						connection->ReadSocket();
-						connection->SendOutPackets();
-					}
-					else // new outbound messages were received from the application.
-						connection->SendOutPackets();
-				} catch(const NetException &e)
-				{
-					KNET_LOG(LogError, (std::string("kNet::NetException thrown when processing client connection: ") + e.what()).c_str());
-					if (connection->GetSocket())
-						connection->GetSocket()->Close();
-				}
+		if (numSignalled <= 0)
+			continue;
+
+		for(size_t i = 0; i < signalledIndices.size(); ++i)
+		{
+			const int index = signalledIndices[i];
+			if (index == interruptEventIndex)
+			{
+				// The owner wants our attention. The flags it changed are examined at the start of the next round.
+				workThread.InterruptEvent().Reset();
+			}
+#ifdef KNET_USE_IO_URING
+			else if (index == ioUringEventIndex)
+			{
+				// Reset the event before reaping, so that no completion posted after this goes unnoticed.
+				ioUring.ResetCompletionEvent();
+				EnterPhase(WorkerPhaseRead);
+				ioUring.ProcessCompletions();
+				EnterPhase(WorkerPhaseOther);
+				if (listenSocketsOnRing && !ioUring.SupportsMultishotReceive())
+					listsChanged = true; // The receives failed. Go back to waiting on the listen sockets.
+			}
+#endif
+#ifdef KNET_USE_RIO
+			else if (index == registeredIOEventIndex)
+			{
+				// Reset the event before reading the completions. Submit() asks the kernel to set it again for the next ones.
+				registeredIO.CompletionEvent().Reset();
+				EnterPhase(WorkerPhaseRead);
+				registeredIOReadyConnections.clear();
+				registeredIO.ProcessCompletions(registeredIOReadyConnections);
+				EnterPhase(WorkerPhaseOther);
+				for(size_t j = 0; j < registeredIOReadyConnections.size(); ++j)
+					if (registeredIOReadyConnections[j] >= 0 && registeredIOReadyConnections[j] < (int)connectionSlots.size())
+						ActivateConnection(registeredIOReadyConnections[j], ActivityRead);
+			}
+#endif
+#ifdef KNET_USE_AF_XDP
+			else if (index == xdpEventIndex)
+			{
+				EnterPhase(WorkerPhaseServerRead);
+				profile.numDatagramsIn += xdpSocket.ProcessReceives();
+				EnterPhase(WorkerPhaseOther);
+			}
+#endif
+			else if ((index >> 1) < (int)connectionSlots.size())
+			{
+				// Even indices are socket read events, odd indices mean the connection can (or wants to) send data.
+				ActivateConnection(index >> 1, ((index & 1) == 0) ? (u8)ActivityRead : (u8)0);
 			}
 			else // A UDP server received a message.
 			{
-				int socketIndex = index - connectionList.size() * 2;
-				if (!serverList.empty())
+				int socketIndex = index - connectionSlots.size() * 2;
+				if (socketIndex >= 0 && socketIndex < (int)listenSocketList.size())
 				{
-					NetworkServer &server = *serverList[0]; ///\bug In case of multiple servers, this is not correct!
-					std::vector<Socket *> &listenSockets = server.ListenSockets();
-					if (socketIndex < (int)listenSockets.size())
+					EnterPhase(WorkerPhaseServerRead);
+					try
 					{
-						try
-						{
-							server.ReadUDPSocketData(listenSockets[socketIndex]);
-						} catch(const NetException &e)
-						{
-							KNET_LOG(LogError, (std::string("kNet::NetException thrown when reading server socket: ") + e.what()).c_str());
-							///\todo Could Close(0) the connection here.
-						}
-					}
-					else
+						profile.numDatagramsIn += listenSocketList[socketIndex].first->ReadUDPSocketData(listenSocketList[socketIndex].second);
+					} catch(const NetException &e)
 					{
-						KNET_LOG(LogError, "NetworkWorkerThread::MainLoop: Warning: Cannot find server socket to read from: EventArray::Wait returned index %d (socketIndex %d), but "
-							"serverList.size()=%d, connectionList.size()=%d!", index, socketIndex, (int)serverList.size(), (int)connectionList.size());
+						KNET_LOG(LogError, "kNet::NetException thrown when reading server socket: %s", e.what());
+						///\todo Could Close(0) the connection here.
 					}
+					EnterPhase(WorkerPhaseOther);
 				}
 				else
 				{
-					KNET_LOG(LogError, "NetworkWorkerThread::MainLoop: Warning: EventArray::Wait returned index %d (socketIndex %d), but "
-						"serverList.size()=%d, connectionList.size()=%d!", index, socketIndex, (int)serverList.size(), (int)connectionList.size());
+					KNET_LOG(LogError, "NetworkWorkerThread::MainLoop: Warning: Cannot find server socket to read from: EventArray::Wait returned index %d (socketIndex %d), but "
+						"listenSocketList.size()=%d, connectionSlots.size()=%d!", index, socketIndex, (int)listenSocketList.size(), (int)connectionSlots.size());
 				}
 			}
 		}
-
-		// The UDP send throttle timers are not read through events. The writeWaitConnections list
-		// contains a list of UDP connections which are now, or will very soon (in less than 1msec) be ready for writing. 
-		// Poll each and try to send a message.
-		for(size_t i = 0; i < writeWaitConnections.size(); ++i)
-		{
-			try
-			{
-				writeWaitConnections[i]->SendOutPackets();
-			} catch(const NetException &e)
-			{
-				KNET_LOG(LogError, (std::string("kNet::NetException thrown when sending out a network message: ") + e.what()).c_str());
-			}
-		}
 	}
+#ifdef KNET_USE_IO_URING
+	IoUring::SetThreadRing(0);
+	ioUring.Close();
+#endif
+#ifdef KNET_USE_RIO
+	RegisteredIO::SetThreadRIO(0);
+	registeredIO.Close();
+#endif
+#ifdef KNET_USE_AF_XDP
+	XdpSocket::SetThreadXdp(0);
+	xdpSocket.Close();
+#endif
+	Clock::ClearLoopTick();
+	waitEvents.Clear();
 	falseEvent.Close();
+	NetworkMessagePool::FlushThreadCache();
 	KNET_LOG(LogInfo, "NetworkWorkerThread quit.");
 }
 
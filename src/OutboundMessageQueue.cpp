@@ -0,0 +1,208 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file OutboundMessageQueue.cpp
+	@brief */
+
+#include <algorithm>
+
+#include "kNet/OutboundMessageQueue.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+namespace
+{
+/// The initial capacity of the FIFO queue. It grows on demand.
+const size_t cInitialFIFOCapacity = 64;
+/// Empty buckets are kept around for reuse until there are this many buckets.
+const size_t cMaxBuckets = 32;
+
+/// Returns true if the message a was admitted to the queue before the message b, taking number wrap-around into account.
+bool AdmittedBefore(const NetworkMessage *a, const NetworkMessage *b)
+{
+	return a->MessageNumber() != b->MessageNumber() && (unsigned long)(b->MessageNumber() - a->MessageNumber()) < 0x80000000;
+}
+}
+
+const char *OutboundQueueTypeToString(OutboundQueueType type)
+{
+	switch(type)
+	{
+	case OutboundQueuePriorityHeap: return "PriorityHeap";
+	case OutboundQueuePriorityBuckets: return "PriorityBuckets";
+	case OutboundQueueFIFO: return "FIFO";
+	default: return "(unknown)";
+	}
+}
+
+OutboundMessageQueue::OutboundMessageQueue(OutboundQueueType type_)
+:type(type_), numMessages(0), fifo(cInitialFIFOCapacity), frontBucket(0), lastInsertBucket(0)
+{
+}
+
+OutboundMessageQueue::~OutboundMessageQueue()
+{
+	for(size_t i = 0; i < buckets.size(); ++i)
+		delete buckets[i];
+}
+
+void OutboundMessageQueue::SetType(OutboundQueueType newType)
+{
+	if (newType == type)
+		return;
+
+	// Drain the messages in their send order, so that a switch to the FIFO type keeps them priorized.
+	std::vector<NetworkMessage*> messages;
+	messages.reserve(numMessages);
+	while(numMessages > 0)
+	{
+		messages.push_back(Front());
+		PopFront();
+	}
+
+	type = newType;
+	for(size_t i = 0; i < messages.size(); ++i)
+		Insert(messages[i]);
+}
+
+void OutboundMessageQueue::Insert(NetworkMessage *msg)
+{
+	assert(msg);
+	assert(!msg->inOutboundQueue);
+	msg->inOutboundQueue = true;
+	++numMessages;
+
+	if (type == OutboundQueuePriorityHeap)
+	{
+		heap.Insert(msg);
+		return;
+	}
+	if (type == OutboundQueueFIFO)
+	{
+		fifo.InsertWithResize(msg);
+		return;
+	}
+
+	const size_t index = FindOrCreateBucket(msg->priority);
+	std::deque<NetworkMessage*> &messages = buckets[index]->messages;
+	// New messages go to the back. Messages that are put back into the queue, e.g. the ones of a lost datagram, are
+	// older than the rest, so the search for their place stays near the front of the bucket.
+	if (messages.empty() || !AdmittedBefore(msg, messages.back()))
+		messages.push_back(msg);
+	else if (AdmittedBefore(msg, messages.front()))
+		messages.push_front(msg);
+	else
+		messages.insert(std::upper_bound(messages.begin(), messages.end(), msg, AdmittedBefore), msg);
+
+	frontBucket = std::min(frontBucket, index);
+}
+
+NetworkMessage *OutboundMessageQueue::Front() const
+{
+	assert(numMessages > 0);
+	switch(type)
+	{
+	case OutboundQueuePriorityHeap: return heap.Front();
+	case OutboundQueueFIFO: return *fifo.Front();
+	default: return buckets[frontBucket]->messages.front();
+	}
+}
+
+void OutboundMessageQueue::PopFront()
+{
+	assert(numMessages > 0);
+	Front()->inOutboundQueue = false;
+	--numMessages;
+
+	if (type == OutboundQueuePriorityHeap)
+		heap.PopFront();
+	else if (type == OutboundQueueFIFO)
+		fifo.PopFront();
+	else
+	{
+		buckets[frontBucket]->messages.pop_front();
+		while(frontBucket < buckets.size() && buckets[frontBucket]->messages.empty())
+			++frontBucket;
+	}
+}
+
+void OutboundMessageQueue::Clear()
+{
+	while(numMessages > 0)
+		PopFront();
+	heap.Clear();
+	fifo.Clear();
+	for(size_t i = 0; i < buckets.size(); ++i)
+		buckets[i]->messages.clear();
+	frontBucket = buckets.size();
+	numMessages = 0;
+}
+
+size_t OutboundMessageQueue::FindOrCreateBucket(unsigned long priority)
+{
+	if (lastInsertBucket < buckets.size() && buckets[lastInsertBucket]->priority == priority)
+		return lastInsertBucket;
+
+	// Binary search for the bucket in the array sorted by decreasing priority.
+	size_t lo = 0;
+	size_t hi = buckets.size();
+	while(lo < hi)
+	{
+		const size_t mid = (lo + hi) / 2;
+		if (buckets[mid]->priority > priority)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < buckets.size() && buckets[lo]->priority == priority)
+		return lastInsertBucket = lo;
+
+	if (buckets.size() >= cMaxBuckets && PruneEmptyBuckets())
+		return FindOrCreateBucket(priority);
+
+	PriorityBucket *bucket = new PriorityBucket;
+	bucket->priority = priority;
+	buckets.insert(buckets.begin() + lo, bucket);
+	// The new bucket moved the ones at or after it one step forward. It is about to receive a message, so if it
+	// precedes the old front bucket, it is the new front.
+	if (lo <= frontBucket)
+		frontBucket = lo;
+	return lastInsertBucket = lo;
+}
+
+bool OutboundMessageQueue::PruneEmptyBuckets()
+{
+	size_t numKept = 0;
+	for(size_t i = 0; i < buckets.size(); ++i)
+		if (buckets[i]->messages.empty())
+			delete buckets[i];
+		else
+			buckets[numKept++] = buckets[i];
+
+	if (numKept == buckets.size())
+		return false; // All the buckets are in use: let the array grow.
+	buckets.resize(numKept);
+
+	frontBucket = 0;
+	while(frontBucket < buckets.size() && buckets[frontBucket]->messages.empty())
+		++frontBucket;
+	lastInsertBucket = 0;
+	return true;
+}
+
+} // ~kNet
@@ -0,0 +1,191 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file PacketCapture.cpp
+	@brief */
+
+#include <cstring>
+#include <algorithm>
+
+#include "kNet/PacketCapture.h"
+#include "kNet/Atomics.h"
+#include "kNet/DataSerializer.h"
+#include "kNet/DataDeserializer.h"
+#include "kNet/NetworkLogging.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+namespace
+{
+const char cCaptureFileMagic[8] = { 'k', 'N', 'e', 't', 'C', 'a', 'p', '1' };
+const size_t cPacketHeaderSize = 22;
+}
+
+PacketCapture::PacketCapture()
+:ring(0), capturing(false), file(0), startTick(0), numCapturedPackets(0), numDroppedPackets(0)
+{
+}
+
+PacketCapture::~PacketCapture()
+{
+	Stop();
+	delete ring;
+}
+
+bool PacketCapture::Start(const char *filename)
+{
+	Stop();
+
+	file = fopen(filename, "wb");
+	if (!file)
+	{
+		KNET_LOG(LogError, "PacketCapture::Start: Could not create the capture file \"%s\"!", filename);
+		return false;
+	}
+	fwrite(cCaptureFileMagic, 1, sizeof(cCaptureFileMagic), file);
+
+	if (!ring)
+		ring = new MPSCQueue<Slot>(cRingSize);
+	// Throw away the packets that were recorded just when the previous capture stopped.
+	FILE *captureFile = file;
+	file = 0;
+	WriteQueuedPackets();
+	file = captureFile;
+
+	startTick = Clock::Tick();
+	numCapturedPackets = 0;
+	numDroppedPackets = 0;
+	writerThread.Run(this, &PacketCapture::WriterLoop);
+	FullMemoryBarrier();
+	capturing = true;
+	KNET_LOG(LogInfo, "PacketCapture: Capturing packets to \"%s\".", filename);
+	return true;
+}
+
+void PacketCapture::Stop()
+{
+	if (!file)
+		return;
+
+	capturing = false;
+	writerThread.Stop();
+	WriteQueuedPackets();
+	fclose(file);
+	file = 0;
+	KNET_LOG(LogInfo, "PacketCapture: Stopped. Captured %d packets, dropped %d packets.", (int)numCapturedPackets, (int)numDroppedPackets);
+}
+
+void PacketCapture::RecordPacket(PacketCaptureDirection direction, SocketTransportLayer transport, const EndPoint &peer, const char *data, size_t numBytes)
+{
+	assert(ring);
+	const tick_t now = Clock::Tick();
+	const bool isStream = IsStreamTransportLayer(transport);
+	size_t offset = 0;
+	do
+	{
+		long pos;
+		Slot *slot = ring->BeginInsert(pos);
+		if (!slot)
+		{
+			AtomicIncrement(&numDroppedPackets);
+			return;
+		}
+		const size_t numCaptured = std::min(numBytes - offset, (size_t)cSnapLength);
+		slot->tick = now;
+		slot->originalBytes = (u32)(isStream ? numCaptured : numBytes);
+		slot->capturedBytes = (u16)numCaptured;
+		slot->direction = (u8)direction;
+		slot->transport = (u8)transport;
+		slot->peer = peer;
+		memcpy(slot->data, data + offset, numCaptured);
+		ring->EndInsert(pos);
+		AtomicIncrement(&numCapturedPackets);
+		offset += numCaptured;
+	} while(isStream && offset < numBytes);
+}
+
+void PacketCapture::WriterLoop()
+{
+	while(!writerThread.ShouldQuit())
+		if (WriteQueuedPackets() == 0)
+			Clock::Sleep(5);
+}
+
+int PacketCapture::WriteQueuedPackets()
+{
+	int numWritten = 0;
+	while(Slot *slot = ring->Front())
+	{
+		if (file)
+		{
+			char header[cPacketHeaderSize];
+			DataSerializer ds(header, sizeof(header));
+			ds.Add<u64>((u64)(Clock::TimespanToSecondsD(startTick, slot->tick) * 1e6));
+			ds.Add<u32>(slot->originalBytes);
+			ds.Add<u16>(slot->capturedBytes);
+			ds.Add<u8>(slot->direction);
+			ds.Add<u8>(slot->transport);
+			ds.AddArray<u8>(slot->peer.ip, 4);
+			ds.Add<u16>(slot->peer.port);
+			assert(ds.BytesFilled() == cPacketHeaderSize);
+			fwrite(header, 1, sizeof(header), file);
+			fwrite(slot->data, 1, slot->capturedBytes, file);
+		}
+		ring->PopFront();
+		++numWritten;
+	}
+	return numWritten;
+}
+
+bool PacketCapture::ReadFile(const char *filename, std::vector<CapturedPacket> &packets)
+{
+	packets.clear();
+	FILE *handle = fopen(filename, "rb");
+	if (!handle)
+		return false;
+	std::vector<char> contents;
+	char buffer[65536];
+	size_t numRead;
+	while((numRead = fread(buffer, 1, sizeof(buffer), handle)) > 0)
+		contents.insert(contents.end(), buffer, buffer + numRead);
+	fclose(handle);
+
+	if (contents.size() < sizeof(cCaptureFileMagic) || memcmp(&contents[0], cCaptureFileMagic, sizeof(cCaptureFileMagic)) != 0)
+		return false;
+
+	DataDeserializer dd(&contents[0] + sizeof(cCaptureFileMagic), contents.size() - sizeof(cCaptureFileMagic));
+	while(dd.BytesLeft() >= cPacketHeaderSize)
+	{
+		CapturedPacket packet;
+		packet.timeMicros = dd.Read<u64>();
+		packet.originalBytes = dd.Read<u32>();
+		const u16 capturedBytes = dd.Read<u16>();
+		packet.direction = (PacketCaptureDirection)dd.Read<u8>();
+		packet.transport = (SocketTransportLayer)dd.Read<u8>();
+		dd.ReadArray<u8>(packet.peer.ip, 4);
+		packet.peer.port = dd.Read<u16>();
+		if (dd.BytesLeft() < capturedBytes)
+			break; // The capture was cut short while the packet was being written.
+		packet.data.resize(capturedBytes);
+		if (capturedBytes > 0)
+			dd.ReadArray<u8>((u8 *)&packet.data[0], capturedBytes);
+		packets.push_back(packet);
+	}
+	return true;
+}
+
+} // ~kNet
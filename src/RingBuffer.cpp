@@ -0,0 +1,219 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file RingBuffer.cpp
+	@brief */
+
+#include <cstring>
+#include <cstdio>
+
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "kNet/RingBuffer.h"
+#include "kNet/Atomics.h"
+#include "kNet/NetworkLogging.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+RingBuffer::RingBuffer(int capacity_)
+:base(0), capacity(0), start(0), end(0), mirrored(false)
+{
+	Allocate(capacity_);
+}
+
+RingBuffer::~RingBuffer()
+{
+	Free();
+}
+
+void RingBuffer::Compact()
+{
+	// If already compacted, or if the bytes are contiguous anyway, do nothing.
+	if (start == 0 || mirrored)
+		return;
+
+	const int numBytes = Size();
+	memmove(base, base + start, numBytes);
+
+	start = 0;
+	end = numBytes;
+}
+
+void RingBuffer::Resize(int newSize)
+{
+	assert(newSize > 0);
+
+	if (newSize <= capacity)
+		return; // No need to resize.
+
+	if (!mirrored)
+	{
+		Compact();
+		data.resize(newSize);
+		base = &data[0];
+		capacity = newSize;
+		return;
+	}
+
+	// Move the bytes to a new mirrored buffer.
+	char *oldBase = base;
+	const int oldCapacity = capacity;
+	const int oldStart = start;
+	const int numBytes = Size();
+	mirrored = false; // Keep the old mapping until its bytes have been copied.
+	Allocate(newSize);
+	memcpy(base, oldBase + oldStart, numBytes);
+	start = 0;
+	end = numBytes;
+	UnmapMirrored(oldBase, oldCapacity);
+}
+
+void RingBuffer::Allocate(int newCapacity)
+{
+	assert(newCapacity > 0);
+	const size_t granularity = MirrorGranularity();
+	const size_t mirroredCapacity = (newCapacity + granularity - 1) / granularity * granularity;
+	char *address = 0;
+	if (mirroredCapacity <= 0x40000000 && MapMirrored(mirroredCapacity, address))
+	{
+		data.clear();
+		base = address;
+		capacity = (int)mirroredCapacity;
+		mirrored = true;
+	}
+	else
+	{
+		KNET_LOG(LogVerbose, "RingBuffer::Allocate: Could not map a mirrored ring buffer of %d bytes. Using a flat buffer.", newCapacity);
+		data.resize(newCapacity);
+		base = &data[0];
+		capacity = newCapacity;
+		mirrored = false;
+	}
+	start = end = 0;
+}
+
+void RingBuffer::Free()
+{
+	if (mirrored)
+		UnmapMirrored(base, capacity);
+	mirrored = false;
+	data.clear();
+	base = 0;
+	capacity = 0;
+	start = end = 0;
+}
+
+size_t RingBuffer::MirrorGranularity()
+{
+#ifdef WIN32
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	return systemInfo.dwAllocationGranularity;
+#else
+	const long pageSize = sysconf(_SC_PAGESIZE);
+	return (pageSize > 0) ? (size_t)pageSize : 4096;
+#endif
+}
+
+bool RingBuffer::MapMirrored(size_t numBytes, char *&address)
+{
+#ifdef WIN32
+	HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)numBytes, NULL);
+	if (!mapping)
+		return false;
+
+	// Look for a free range of address space for both views, and map them there. Another thread can take the range before
+	// the views are mapped, so retry a few times.
+	bool success = false;
+	for(int i = 0; i < 16 && !success; ++i)
+	{
+		char *range = (char*)VirtualAlloc(0, 2 * numBytes, MEM_RESERVE, PAGE_NOACCESS);
+		if (!range)
+			break;
+		VirtualFree(range, 0, MEM_RELEASE);
+		char *first = (char*)MapViewOfFileEx(mapping, FILE_MAP_WRITE, 0, 0, numBytes, range);
+		char *second = first ? (char*)MapViewOfFileEx(mapping, FILE_MAP_WRITE, 0, 0, numBytes, range + numBytes) : 0;
+		if (second)
+		{
+			address = first;
+			success = true;
+		}
+		else if (first)
+			UnmapViewOfFile(first);
+	}
+	// The views keep the memory alive.
+	CloseHandle(mapping);
+	return success;
+#else
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	int fd = memfd_create("kNet RingBuffer", MFD_CLOEXEC);
+#else
+	static volatile unsigned int counter = 0;
+	char name[64];
+	sprintf(name, "/kNet-RingBuffer-%d-%u", (int)getpid(), (unsigned int)AtomicIncrement(&counter));
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd >= 0)
+		shm_unlink(name);
+#endif
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, (off_t)numBytes) != 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	// Reserve the address space for both copies, and map the memory over each half of it.
+	char *range = (char*)mmap(0, 2 * numBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (range == (char*)MAP_FAILED)
+	{
+		close(fd);
+		return false;
+	}
+	void *first = mmap(range, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	void *second = mmap(range + numBytes, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	// The mappings keep the memory alive.
+	close(fd);
+	if (first != range || second != range + numBytes)
+	{
+		munmap(range, 2 * numBytes);
+		return false;
+	}
+	address = range;
+	return true;
+#endif
+}
+
+void RingBuffer::UnmapMirrored(char *address, size_t numBytes)
+{
+#ifdef WIN32
+	UnmapViewOfFile(address);
+	UnmapViewOfFile(address + numBytes);
+#else
+	munmap(address, 2 * numBytes);
+#endif
+}
+
+} // ~kNet
@@ -17,6 +17,7 @@
 
 #include <fstream>
 #include <sstream>
+#include <vector>
 #include <cassert>
 #include <cstring>
 
@@ -45,10 +46,26 @@ void SerializationStructCompiler::WriteFilePreamble(std::ofstream &out)
 {
 	// Write the preamble of the file.
 	out << "#pragma once" << endl
+	    << endl
+	    << "#include <cstring>" << endl
 	    << endl
 	    << "#include \"kNet/DataDeserializer.h\"" << endl
 	    << "#include \"kNet/DataSerializer.h\"" << endl
-	    << endl;
+	    << "#include \"kNet/MessageSchema.h\"" << endl;
+	if (generateViews)
+		out << "#include \"kNet/MessageView.h\"" << endl;
+	if (arenaDeserialization)
+		out << "#include \"kNet/DeserializeArena.h\"" << endl;
+	out << endl;
+}
+
+bool SerializationStructCompiler::IsArenaMember(const SerializedElementDesc &elem) const
+{
+	if (!arenaDeserialization || elem.type == SerialBit || elem.type == SerialStruct || elem.type == SerialOther)
+		return false;
+	if (elem.type == SerialString)
+		return !elem.varyingCount && elem.count == 1;
+	return elem.varyingCount;
 }
 
 void SerializationStructCompiler::WriteMemberDefinition(const SerializedElementDesc &elem, int level, std::ofstream &out)
@@ -68,7 +85,14 @@ void SerializationStructCompiler::WriteMemberDefinition(const SerializedElementD
 	if (type == "string")
 		type = "std::string"; // Make a hardcoded fix for std::string so that the user doesn't have to specify 'std::string' into the XML, which would be clumsy.
 
-	if (elem.varyingCount == true)
+	if (IsArenaMember(elem))
+	{
+		if (elem.type == SerialString)
+			out << Indent(level) << "kNet::ArenaString " << name << ";" << endl;
+		else
+			out << Indent(level) << "kNet::ArenaArray<" << type << "> " << name << ";" << endl;
+	}
+	else if (elem.varyingCount == true)
 		out << Indent(level) << "std::vector<" << type << "> " << name << ";" << endl;
 	else if (elem.count > 1)
 		out << Indent(level) << type << " " << name << "[" << elem.count << "];" << endl;
@@ -109,6 +133,18 @@ void SerializationStructCompiler::WriteStructSizeMemberFunction(const Serialized
 {
 	assert(&elem && elem.type == SerialStruct);
 
+	const size_t fixedSize = FixedSerializedSize(elem);
+	if (fixedSize > 0)
+	{
+		out << Indent(level) << "/// The number of bytes this struct always takes when serialized." << endl
+			<< Indent(level) << "static const size_t fixedSize = " << fixedSize << ";" << endl << endl
+			<< Indent(level) << "inline size_t Size() const" << endl
+			<< Indent(level) << "{" << endl
+			<< Indent(level+1) << "return fixedSize;" << endl
+			<< Indent(level) << "}" << endl << endl;
+		return;
+	}
+
 	out << Indent(level) << "inline size_t Size() const" << endl
 		<< Indent(level) << "{" << endl
 		<< Indent(level+1) << "return ";
@@ -143,7 +179,7 @@ void SerializationStructCompiler::WriteStructSizeMemberFunction(const Serialized
 		}
 		else*/ if (e.type == SerialStruct || e.type == SerialOther || e.type == SerialString)
 		{
-			std::string typeSerializer = "kNet::TypeSerializer<" + e.typeString + ">";
+			std::string typeSerializer = "kNet::TypeSerializer<" + (IsArenaMember(e) ? string("kNet::ArenaString") : e.typeString) + ">";
 			if (e.varyingCount)
 				out << "kNet::ArraySize<" << typeSerializer << " >(" << memberName << ", " << memberName << ".size())";
 			else if (e.count > 1)
@@ -178,6 +214,17 @@ void SerializationStructCompiler::WriteSerializeMemberFunction(/*const std::stri
 
 	++level;
 
+	// A struct of a fixed size is copied straight into the stream when the stream is byte-aligned.
+	if (FixedSerializedSize(elem) > 0)
+	{
+		out << Indent(level) << "char *block = dst.ReserveAlignedBytes(fixedSize);" << endl
+			<< Indent(level) << "if (block)" << endl
+			<< Indent(level) << "{" << endl;
+		WriteFixedLayoutCopies(elem, true, level+1, out);
+		out << Indent(level+1) << "return;" << endl
+			<< Indent(level) << "}" << endl;
+	}
+
 	for(size_t i = 0; i < elem.elements.size(); ++i)
 	{
 		SerializedElementDesc &e = *elem.elements[i];
@@ -237,6 +284,8 @@ void SerializationStructCompiler::WriteSerializeMemberFunction(/*const std::stri
 			else if (e.count > 1)
 				out << Indent(level) << "dst.AddArray<" << SerialTypeToCTypeString(e.type) << ">(" << memberName
 					<< ", " << e.count << ");" << endl;
+			else if (IsArenaMember(e))
+				out << Indent(level) << "kNet::TypeSerializer<kNet::ArenaString>::SerializeTo(dst, " << memberName << ");" << endl;
 			else 
 				out << Indent(level) << "dst.Add<" << SerialTypeToCTypeString(e.type) << ">(" << memberName
 					<< ");" << endl;
@@ -248,15 +297,81 @@ void SerializationStructCompiler::WriteSerializeMemberFunction(/*const std::stri
 	out << endl;
 }
 
+size_t SerializationStructCompiler::FixedSerializedSize(const SerializedElementDesc &elem)
+{
+	size_t size = 0;
+	for(size_t i = 0; i < elem.elements.size(); ++i)
+	{
+		const SerializedElementDesc &e = *elem.elements[i];
+		if (e.varyingCount || e.type == SerialBit || e.type == SerialString || e.type == SerialStruct || e.type == SerialOther)
+			return 0;
+		size += e.count * SerialTypeSize(e.type);
+	}
+	return size;
+}
+
+void SerializationStructCompiler::WriteFixedLayoutCopies(const SerializedElementDesc &elem, bool serialize, int level, std::ofstream &out)
+{
+	assert(FixedSerializedSize(elem) > 0);
+
+	size_t offset = 0;
+	for(size_t i = 0; i < elem.elements.size();)
+	{
+		// A run of members is padding-free in the struct if each member is aligned both relative to the start of the
+		// run and to at most the alignment of the first member, whose address is aligned to its size.
+		const SerializedElementDesc &first = *elem.elements[i];
+		const size_t runAlignment = SerialTypeSize(first.type);
+		size_t runSize = first.count * runAlignment;
+		string memberNames = ParseToValidCSymbolName(first.name.c_str());
+		size_t j = i + 1;
+		for(; j < elem.elements.size(); ++j)
+		{
+			const SerializedElementDesc &e = *elem.elements[j];
+			const size_t alignment = SerialTypeSize(e.type);
+			if (alignment > runAlignment || runSize % alignment != 0)
+				break;
+			runSize += e.count * alignment;
+			memberNames += ", " + ParseToValidCSymbolName(e.name.c_str());
+		}
+
+		const string firstMember = (first.count > 1 ? "" : "&") + ParseToValidCSymbolName(first.name.c_str());
+		if (serialize)
+			out << Indent(level) << "memcpy(block + " << offset << ", " << firstMember << ", " << runSize << ");";
+		else
+			out << Indent(level) << "memcpy(" << firstMember << ", block + " << offset << ", " << runSize << ");";
+		out << " // " << memberNames << endl;
+
+		offset += runSize;
+		i = j;
+	}
+}
+
 void SerializationStructCompiler::WriteDeserializeMemberFunction(/*const std::string &className, */const SerializedElementDesc &elem, int level, std::ofstream &out)
 {
 	assert(&elem && elem.type == SerialStruct);
 
-	out << Indent(level) << "inline void DeserializeFrom(kNet::DataDeserializer &src)" << endl
-		<< Indent(level) << "{" << endl;
+	if (arenaDeserialization)
+		out << Indent(level) << "inline void DeserializeFrom(kNet::DataDeserializer &src, kNet::DeserializeArena &arena)" << endl;
+	else
+		out << Indent(level) << "inline void DeserializeFrom(kNet::DataDeserializer &src)" << endl;
+	out << Indent(level) << "{" << endl;
 
 	++level;
 
+	// A struct of a fixed size is copied straight out of the stream when the read position is byte-aligned. Otherwise it is
+	// checked to fit in the stream once, and its members are then read without further checks.
+	const size_t fixedSize = FixedSerializedSize(elem);
+	if (fixedSize > 0)
+	{
+		out << Indent(level) << "const char *block = src.ConsumeAlignedBytes(fixedSize);" << endl
+			<< Indent(level) << "if (block)" << endl
+			<< Indent(level) << "{" << endl;
+		WriteFixedLayoutCopies(elem, false, level+1, out);
+		out << Indent(level+1) << "return;" << endl
+			<< Indent(level) << "}" << endl
+			<< Indent(level) << "src.RequireBytes(fixedSize);" << endl;
+	}
+
 	for(size_t i = 0; i < elem.elements.size(); ++i)
 	{
 		SerializedElementDesc &e = *elem.elements[i];
@@ -264,6 +379,16 @@ void SerializationStructCompiler::WriteDeserializeMemberFunction(/*const std::st
 
 		string memberName = ParseToValidCSymbolName(e.name.c_str());
 
+		if (IsArenaMember(e))
+		{
+			if (e.type == SerialString)
+				out << Indent(level) << memberName << " = arena.ReadString(src);" << endl;
+			else
+				out << Indent(level) << memberName << " = arena.ReadArray<" << SerialTypeToCTypeString(e.type) << ">(src, src.Read<u"
+					<< e.count << ">());" << endl;
+			continue;
+		}
+
 		if (e.varyingCount == true)
 		{
 			// What type of variable will hold the varyingCount field?
@@ -290,18 +415,28 @@ void SerializationStructCompiler::WriteDeserializeMemberFunction(/*const std::st
 		} */
 		if (e.type == SerialStruct || e.type == SerialOther)
 		{
-			std::string typeSerializer = "kNet::TypeSerializer<" + e.typeString + ">";
+			// The nested structs generated with arena deserialization take the arena as well.
+			const std::string typeSerializer = "kNet::TypeSerializer<" + e.typeString + ">";
+			const bool passArena = arenaDeserialization && e.type == SerialStruct;
 
 			if (e.varyingCount == true)
 			{
 				out << Indent(level) << "for(size_t i = 0; i < " << memberName << ".size(); ++i)" << endl;
-				out << Indent(level+1) << typeSerializer << "::DeserializeFrom(src, " << memberName << "[i]);" << endl;
+				if (passArena)
+					out << Indent(level+1) << memberName << "[i].DeserializeFrom(src, arena);" << endl;
+				else
+					out << Indent(level+1) << typeSerializer << "::DeserializeFrom(src, " << memberName << "[i]);" << endl;
 			}
 			else if (e.count > 1)
 			{
 				out << Indent(level) << "for(size_t i = 0; i < " << e.count << "; ++i)" << endl;
-				out << Indent(level+1) << typeSerializer << "::DeserializeFrom(src, " << memberName << "[i]);" << endl;
+				if (passArena)
+					out << Indent(level+1) << memberName << "[i].DeserializeFrom(src, arena);" << endl;
+				else
+					out << Indent(level+1) << typeSerializer << "::DeserializeFrom(src, " << memberName << "[i]);" << endl;
 			}
+			else if (passArena)
+				out << Indent(level) << memberName << ".DeserializeFrom(src, arena);" << endl;
 			else
 				out << Indent(level) << typeSerializer << "::DeserializeFrom(src, " << memberName << ");" << endl;
 		}
@@ -316,6 +451,8 @@ void SerializationStructCompiler::WriteDeserializeMemberFunction(/*const std::st
 			else if (e.count > 1)
 				out << Indent(level) << "src.ReadArray<" << SerialTypeToCTypeString(e.type) << ">(" << memberName
 					<< ", " << e.count << ");" << endl;
+			else if (fixedSize > 0)
+				out << Indent(level) << memberName << " = src.ReadUnchecked<" << SerialTypeToCTypeString(e.type) << ">();" << endl;
 			else 
 				out << Indent(level) << memberName << " = src.Read<" << SerialTypeToCTypeString(e.type) << ">();" << endl;
 		}
@@ -339,6 +476,7 @@ void SerializationStructCompiler::WriteStruct(const SerializedElementDesc &elem,
 
 	WriteNestedStructs(elem, level+1, out);
 	WriteStructMembers(elem, level+1, out);
+	WriteSchemaTypedef(elem, level+1, out);
 	WriteStructSizeMemberFunction(elem, level+1, out);
 	WriteSerializeMemberFunction(/*className, */elem, level+1, out);
 	WriteDeserializeMemberFunction(/*className, */elem, level+1, out);
@@ -364,11 +502,14 @@ void SerializationStructCompiler::WriteMessage(const SerializedMessageDesc &mess
 		<< Indent(2) << "InitToDefault();" << endl
 		<< Indent(1) << "}" << endl << endl;
 
-	out << Indent(1) << structName << "(const char *data, size_t numBytes)" << endl 
-		<< Indent(1) << "{" << endl
+	if (arenaDeserialization)
+		out << Indent(1) << structName << "(const char *data, size_t numBytes, kNet::DeserializeArena &arena)" << endl;
+	else
+		out << Indent(1) << structName << "(const char *data, size_t numBytes)" << endl;
+	out << Indent(1) << "{" << endl
 		<< Indent(2) << "InitToDefault();" << endl
 		<< Indent(2) << "kNet::DataDeserializer dd(data, numBytes);" << endl
-		<< Indent(2) << "DeserializeFrom(dd);" << endl
+		<< Indent(2) << (arenaDeserialization ? "DeserializeFrom(dd, arena);" : "DeserializeFrom(dd);") << endl
 		<< Indent(1) << "}" << endl << endl;
 
 	out << Indent(1) << "void InitToDefault()" << endl
@@ -391,6 +532,7 @@ void SerializationStructCompiler::WriteMessage(const SerializedMessageDesc &mess
 
 	WriteNestedStructs(*message.data, 1, out);
 	WriteStructMembers(*message.data, 1, out);
+	WriteSchemaTypedef(*message.data, 1, out);
 	WriteStructSizeMemberFunction(*message.data, 1, out);
 	WriteSerializeMemberFunction(/*structName, */*message.data, 1, out);
 	WriteDeserializeMemberFunction(/*structName, */*message.data, 1, out);
@@ -399,12 +541,146 @@ void SerializationStructCompiler::WriteMessage(const SerializedMessageDesc &mess
 
 }
 
+bool SerializationStructCompiler::HasByteAlignedFields(const SerializedElementDesc &elem)
+{
+	for(size_t i = 0; i < elem.elements.size(); ++i)
+	{
+		const SerializedElementDesc &e = *elem.elements[i];
+		if (e.type == SerialBit || e.type == SerialStruct || e.type == SerialOther || e.type == SerialInvalid)
+			return false;
+		if (e.type == SerialString && (e.varyingCount || e.count > 1))
+			return false;
+		if (e.varyingCount && e.count != 8 && e.count != 16 && e.count != 32)
+			return false;
+	}
+	return true;
+}
+
+void SerializationStructCompiler::WriteSchemaTypedef(const SerializedElementDesc &elem, int level, std::ofstream &out)
+{
+	if (!HasByteAlignedFields(elem))
+		return;
+
+	out << Indent(level) << "/// The fields of this struct as a compile-time schema, for use with kNet::SchemaSerializer and kNet::SchemaDeserializer." << endl
+		<< Indent(level) << "typedef ";
+	for(size_t i = 0; i < elem.elements.size(); ++i)
+	{
+		const SerializedElementDesc &e = *elem.elements[i];
+		const string type = SerialTypeToCTypeString(e.type);
+		out << "kNet::SchemaField<";
+		if (e.type == SerialString)
+			out << "std::string";
+		else if (e.varyingCount)
+			out << "kNet::SchemaVaryingArray<" << type << ", u" << e.count << ">";
+		else if (e.count > 1)
+			out << "kNet::SchemaArray<" << type << ", " << e.count << ">";
+		else
+			out << type;
+		out << ", ";
+	}
+	out << "kNet::SchemaEnd";
+	for(size_t i = 0; i < elem.elements.size(); ++i)
+		out << " >";
+	out << " Schema;" << endl << endl;
+}
+
+void SerializationStructCompiler::WriteMessageView(const SerializedMessageDesc &message, std::ofstream &out)
+{
+	const SerializedElementDesc &elem = *message.data;
+	const string viewName = string("Msg") + message.name + "View";
+
+	out << "/// A read-only view of a serialized Msg" << message.name << ", which decodes each field straight from the serialized" << endl
+		<< "/// bytes when it is accessed, without copying or allocating. The bytes must stay alive for the lifetime of the view." << endl
+		<< "/// Accessing a field that does not fit in the bytes throws a NetException." << endl
+		<< "class " << viewName << endl
+		<< "{" << endl
+		<< "public:" << endl
+		<< Indent(1) << viewName << "(const char *data, size_t numBytes):view(data, numBytes) {}" << endl << endl
+		<< Indent(1) << "enum { messageID = " << message.id << " };" << endl << endl;
+
+	// The offset of each field is the offset of the previous one plus its size, which is a constant for all but the arrays
+	// of varying length and the strings. sizeExprs[i] is the size of the field i, given its offset.
+	vector<string> memberNames;
+	vector<string> sizeExprs;
+	for(size_t i = 0; i < elem.elements.size(); ++i)
+	{
+		const SerializedElementDesc &e = *elem.elements[i];
+		const string memberName = ParseToValidCSymbolName(e.name.c_str());
+		const string offset = "Offset_" + memberName + "()";
+		const string type = SerialTypeToCTypeString(e.type);
+		stringstream countType;
+		countType << "u" << e.count;
+		stringstream size;
+
+		if (e.type == SerialString)
+		{
+			out << Indent(1) << "kNet::SerializedArrayView<char> " << memberName << "() const { return view.ReadString(" << offset << "); }" << endl;
+			size << "view.StringSize(" << offset << ")";
+		}
+		else if (e.varyingCount)
+		{
+			out << Indent(1) << "kNet::SerializedArrayView<" << type << "> " << memberName << "() const { return view.ReadVaryingArray<"
+				<< type << ", " << countType.str() << ">(" << offset << "); }" << endl;
+			size << "view.VaryingArraySize<" << type << ", " << countType.str() << ">(" << offset << ")";
+		}
+		else if (e.count > 1)
+		{
+			out << Indent(1) << "kNet::SerializedArrayView<" << type << "> " << memberName << "() const { return view.ReadArray<"
+				<< type << ">(" << offset << ", " << e.count << "); }" << endl;
+			size << e.count * SerialTypeSize(e.type);
+		}
+		else
+		{
+			out << Indent(1) << type << " " << memberName << "() const { return view.Read<" << type << ">(" << offset << "); }" << endl;
+			size << SerialTypeSize(e.type);
+		}
+		memberNames.push_back(memberName);
+		sizeExprs.push_back(size.str());
+	}
+
+	out << endl
+		<< Indent(1) << "/// Returns the number of bytes the serialized message takes. This checks that all of its fields are present." << endl
+		<< Indent(1) << "size_t Size() const" << endl
+		<< Indent(1) << "{" << endl
+		<< Indent(2) << "const size_t size = ";
+	if (memberNames.empty())
+		out << "0";
+	else
+		out << "Offset_" << memberNames.back() << "() + " << sizeExprs.back();
+	out << ";" << endl
+		<< Indent(2) << "view.CheckRange(0, size);" << endl
+		<< Indent(2) << "return size;" << endl
+		<< Indent(1) << "}" << endl << endl
+		<< Indent(1) << "const kNet::MessageView &View() const { return view; }" << endl << endl
+		<< "private:" << endl
+		<< Indent(1) << "kNet::MessageView view;" << endl << endl;
+
+	for(size_t i = 0; i < memberNames.size(); ++i)
+	{
+		out << Indent(1) << "size_t Offset_" << memberNames[i] << "() const { return ";
+		if (i == 0)
+			out << "0";
+		else
+			out << "Offset_" << memberNames[i-1] << "() + " << sizeExprs[i-1];
+		out << "; }" << endl;
+	}
+
+	out << "};" << endl << endl;
+}
+
 void SerializationStructCompiler::CompileMessage(const SerializedMessageDesc &message, const char *outfile)
 {
 	ofstream out(outfile);
 
 	WriteFilePreamble(out);
 	WriteMessage(message, out);
+	if (generateViews)
+	{
+		if (HasByteAlignedFields(*message.data))
+			WriteMessageView(message, out);
+		else
+			out << "// Msg" << message.name << "View was not generated, since the message has fields that do not start at a whole byte." << endl;
+	}
 }
 
 std::string SerializationStructCompiler::Indent(int level)
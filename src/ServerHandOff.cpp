@@ -0,0 +1,321 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file ServerHandOff.cpp
+	@brief */
+
+#include <cstring>
+#include <algorithm>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <sys/un.h>
+#endif
+
+#include "kNet/ServerHandOff.h"
+#include "kNet/Network.h"
+#include "kNet/NetworkLogging.h"
+#include "kNet/PolledTimer.h"
+#include "kNet/Clock.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace kNet
+{
+
+#ifndef WIN32
+
+namespace
+{
+
+const u32 cHandOffMagic = 0x664F486B; // "kHOf"
+/// The number of handles passed in one message. Linux refuses more than SCM_MAX_FD (253) at a time.
+const size_t cMaxHandlesPerMessage = 200;
+
+bool HandOffAddress(const char *path, sockaddr_un &address)
+{
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (!path || strlen(path) >= sizeof(address.sun_path))
+	{
+		KNET_LOG(LogError, "ServerHandOff: The path \"%s\" is not a valid AF_UNIX socket path!", path ? path : "(null)");
+		return false;
+	}
+	strcpy(address.sun_path, path);
+	return true;
+}
+
+int MSecsLeft(const PolledTimer &timer)
+{
+	const float msecs = timer.MSecsLeft();
+	return (msecs > 0.f) ? (int)msecs + 1 : 0;
+}
+
+/// Waits until the socket is ready for the given poll events, or the timer elapses.
+bool WaitFor(SOCKET s, short events, const PolledTimer &timer)
+{
+	pollfd pfd;
+	pfd.fd = s;
+	pfd.events = events;
+	pfd.revents = 0;
+	return poll(&pfd, 1, MSecsLeft(timer)) == 1 && (pfd.revents & events) != 0;
+}
+
+bool SendAll(SOCKET s, const char *data, size_t numBytes, const PolledTimer &timer)
+{
+	while(numBytes > 0)
+	{
+		if (!WaitFor(s, POLLOUT, timer))
+			return false;
+		const ssize_t ret = send(s, data, numBytes, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret <= 0)
+		{
+			if (ret < 0 && Network::GetLastError() == KNET_EWOULDBLOCK)
+				continue;
+			return false;
+		}
+		data += ret;
+		numBytes -= (size_t)ret;
+	}
+	return true;
+}
+
+bool ReceiveAll(SOCKET s, char *data, size_t numBytes, const PolledTimer &timer)
+{
+	while(numBytes > 0)
+	{
+		if (!WaitFor(s, POLLIN, timer))
+			return false;
+		const ssize_t ret = recv(s, data, numBytes, MSG_DONTWAIT);
+		if (ret <= 0)
+		{
+			if (ret < 0 && Network::GetLastError() == KNET_EWOULDBLOCK)
+				continue;
+			return false;
+		}
+		data += ret;
+		numBytes -= (size_t)ret;
+	}
+	return true;
+}
+
+/// Passes the given handles attached to a single byte of the stream.
+bool SendHandles(SOCKET s, const SOCKET *handles, size_t numHandles, const PolledTimer &timer)
+{
+	if (!WaitFor(s, POLLOUT, timer))
+		return false;
+	char byte = 0;
+	iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	std::vector<char> control(CMSG_SPACE(numHandles * sizeof(int)), 0);
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &control[0];
+	msg.msg_controllen = control.size();
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(numHandles * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), handles, numHandles * sizeof(int));
+	return sendmsg(s, &msg, MSG_NOSIGNAL) == 1;
+}
+
+/// Receives the handles passed by SendHandles(), and appends them to the given vector.
+bool ReceiveHandles(SOCKET s, std::vector<SOCKET> &handles, size_t numHandles, const PolledTimer &timer)
+{
+	if (!WaitFor(s, POLLIN, timer))
+		return false;
+	char byte = 0;
+	iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	std::vector<char> control(CMSG_SPACE(numHandles * sizeof(int)), 0);
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &control[0];
+	msg.msg_controllen = control.size();
+	if (recvmsg(s, &msg, MSG_DONTWAIT) != 1)
+		return false;
+
+	size_t numReceived = 0;
+	for(cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			const size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for(size_t i = 0; i < n; ++i)
+			{
+				int fd;
+				memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+				handles.push_back(fd);
+			}
+			numReceived += n;
+		}
+	return numReceived == numHandles && (msg.msg_flags & MSG_CTRUNC) == 0;
+}
+
+} // ~unnamed namespace
+
+SOCKET ServerHandOff::WaitForSuccessor(const char *path, int maxMSecsToWait)
+{
+	sockaddr_un address;
+	if (!HandOffAddress(path, address))
+		return INVALID_SOCKET;
+
+	SOCKET listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSocket == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "ServerHandOff::WaitForSuccessor: Error at socket(): %s", Network::GetLastErrorString().c_str());
+		return INVALID_SOCKET;
+	}
+	// A path left behind by an earlier handover that failed would make bind() fail.
+	unlink(path);
+	if (bind(listenSocket, (sockaddr*)&address, sizeof(address)) == KNET_SOCKET_ERROR ||
+		listen(listenSocket, 1) == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "ServerHandOff::WaitForSuccessor: Could not listen at %s: %s", path, Network::GetLastErrorString().c_str());
+		closesocket(listenSocket);
+		return INVALID_SOCKET;
+	}
+
+	PolledTimer timer((float)maxMSecsToWait);
+	SOCKET successor = WaitFor(listenSocket, POLLIN, timer) ? accept(listenSocket, 0, 0) : KNET_ACCEPT_FAILURE;
+	closesocket(listenSocket);
+	unlink(path);
+	if (successor == KNET_ACCEPT_FAILURE)
+	{
+		KNET_LOG(LogError, "ServerHandOff::WaitForSuccessor: No new process connected to %s in %d msecs.", path, maxMSecsToWait);
+		return INVALID_SOCKET;
+	}
+	return successor;
+}
+
+bool ServerHandOff::Send(SOCKET successor, const std::vector<SOCKET> &handles, const std::vector<char> &state, int maxMSecsToWait)
+{
+	PolledTimer timer((float)maxMSecsToWait);
+	const u32 header[3] = { cHandOffMagic, (u32)handles.size(), (u32)state.size() };
+	bool sent = SendAll(successor, (const char*)header, sizeof(header), timer);
+	for(size_t i = 0; sent && i < handles.size(); i += cMaxHandlesPerMessage)
+		sent = SendHandles(successor, &handles[i], std::min(cMaxHandlesPerMessage, handles.size() - i), timer);
+	if (sent && !state.empty())
+		sent = SendAll(successor, &state[0], state.size(), timer);
+
+	char answer = 0;
+	const bool tookOver = sent && ReceiveAll(successor, &answer, 1, timer) && answer == 1;
+	if (!tookOver)
+		KNET_LOG(LogError, "ServerHandOff::Send: The new process did not take over the server.");
+	closesocket(successor);
+	return tookOver;
+}
+
+SOCKET ServerHandOff::Receive(const char *path, std::vector<SOCKET> &handles, std::vector<char> &state, int maxMSecsToWait)
+{
+	handles.clear();
+	state.clear();
+	sockaddr_un address;
+	if (!HandOffAddress(path, address))
+		return INVALID_SOCKET;
+
+	// The old process starts listening only once it has been told to hand off, which may happen after this process starts.
+	PolledTimer timer((float)maxMSecsToWait);
+	SOCKET s = INVALID_SOCKET;
+	for(;;)
+	{
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s == KNET_SOCKET_ERROR)
+		{
+			KNET_LOG(LogError, "ServerHandOff::Receive: Error at socket(): %s", Network::GetLastErrorString().c_str());
+			return INVALID_SOCKET;
+		}
+		if (connect(s, (sockaddr*)&address, sizeof(address)) != KNET_SOCKET_ERROR)
+			break;
+		closesocket(s);
+		if (MSecsLeft(timer) == 0)
+		{
+			KNET_LOG(LogError, "ServerHandOff::Receive: No process handed off its server at %s in %d msecs.", path, maxMSecsToWait);
+			return INVALID_SOCKET;
+		}
+		Clock::Sleep(10);
+	}
+
+	u32 header[3];
+	bool received = ReceiveAll(s, (char*)header, sizeof(header), timer) && header[0] == cHandOffMagic;
+	for(size_t i = 0; received && i < header[1]; i += cMaxHandlesPerMessage)
+		received = ReceiveHandles(s, handles, std::min<size_t>(cMaxHandlesPerMessage, header[1] - i), timer);
+	if (received && header[2] > 0)
+	{
+		state.resize(header[2]);
+		received = ReceiveAll(s, &state[0], state.size(), timer);
+	}
+	if (!received)
+	{
+		KNET_LOG(LogError, "ServerHandOff::Receive: Could not receive the server handed off at %s.", path);
+		for(size_t i = 0; i < handles.size(); ++i)
+			closesocket(handles[i]);
+		handles.clear();
+		state.clear();
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	return s;
+}
+
+bool ServerHandOff::Acknowledge(SOCKET predecessor, bool tookOver)
+{
+	const char answer = tookOver ? 1 : 0;
+	const bool told = send(predecessor, &answer, 1, MSG_NOSIGNAL) == 1;
+	if (!told)
+		KNET_LOG(LogError, "ServerHandOff::Acknowledge: Could not answer the old process: %s", Network::GetLastErrorString().c_str());
+	closesocket(predecessor);
+	return told;
+}
+
+#else
+
+SOCKET ServerHandOff::WaitForSuccessor(const char * /*path*/, int /*maxMSecsToWait*/)
+{
+	KNET_LOG(LogError, "ServerHandOff::WaitForSuccessor: Handing off a server is not supported on this platform!");
+	return INVALID_SOCKET;
+}
+
+bool ServerHandOff::Send(SOCKET /*successor*/, const std::vector<SOCKET> & /*handles*/, const std::vector<char> & /*state*/, int /*maxMSecsToWait*/)
+{
+	return false;
+}
+
+SOCKET ServerHandOff::Receive(const char * /*path*/, std::vector<SOCKET> &handles, std::vector<char> &state, int /*maxMSecsToWait*/)
+{
+	KNET_LOG(LogError, "ServerHandOff::Receive: Handing off a server is not supported on this platform!");
+	handles.clear();
+	state.clear();
+	return INVALID_SOCKET;
+}
+
+bool ServerHandOff::Acknowledge(SOCKET /*predecessor*/, bool /*tookOver*/)
+{
+	return false;
+}
+
+#endif
+
+} // ~kNet
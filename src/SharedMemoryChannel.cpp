@@ -0,0 +1,421 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file SharedMemoryChannel.cpp
+	@brief */
+
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include "kNet/SharedMemoryChannel.h"
+#include "kNet/Atomics.h"
+#include "kNet/Network.h"
+#include "kNet/NetworkLogging.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace kNet
+{
+
+const u32 SharedMemoryChannel::cRingSize;
+
+/// The positions of a ring are free-running byte counts, so that the number of bytes in the ring is tail - head. Each of
+/// the fields is written by one side only, and gets a cache line of its own.
+struct SharedMemoryChannel::Ring
+{
+	/// The number of bytes the consumer has read. [written by the consumer]
+	volatile u32 head;
+	char padding0[60];
+	/// The number of bytes the producer has written. [written by the producer]
+	volatile u32 tail;
+	char padding1[60];
+	/// If nonzero, the consumer has found the ring empty and waits for the doorbell.
+	volatile u32 consumerWaiting;
+	char padding2[60];
+	/// If nonzero, the producer has found the ring full and waits for the doorbell.
+	volatile u32 producerWaiting;
+	char padding3[60];
+};
+
+struct SharedMemoryChannel::Segment
+{
+	u32 magic;
+	u32 ringSize;
+	char padding[56];
+	/// rings[0] carries the bytes from the client to the server, and rings[1] the bytes back. The contents of the rings
+	/// follow the header.
+	Ring rings[2];
+};
+
+#ifndef WIN32
+
+namespace
+{
+typedef SharedMemoryChannel::Segment Segment;
+
+const u32 cSegmentMagic = 0x6D68536B; // "kShm"
+const size_t cSegmentSize = sizeof(Segment) + 2 * SharedMemoryChannel::cRingSize;
+/// How long the server waits for a client that has connected to pass its segment.
+const int cSegmentPassTimeoutMSecs = 1000;
+
+socklen_t ListenAddress(unsigned short port, sockaddr_un &address)
+{
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+#ifdef __linux__
+	// The name in the abstract namespace goes away with the socket, so a server that crashes does not leave it behind.
+	const int length = sprintf(address.sun_path + 1, "kNet.shm.%d", (int)port);
+	return (socklen_t)(offsetof(sockaddr_un, sun_path) + 1 + length);
+#else
+	sprintf(address.sun_path, "/tmp/kNet.shm.%d", (int)port);
+	return (socklen_t)sizeof(address);
+#endif
+}
+
+/// Creates the file descriptor of a new, unnamed shared memory segment of the given size.
+int CreateSegmentFile(size_t size)
+{
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+	int fd = memfd_create("kNet.shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+	char name[64];
+	sprintf(name, "/kNet.shm.%d.%p", (int)getpid(), (void*)&name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd != -1)
+		shm_unlink(name);
+#endif
+	if (fd == -1)
+		return -1;
+	if (ftruncate(fd, (off_t)size) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+#if defined(__linux__) && defined(F_SEAL_SHRINK)
+	// The server maps the segment of a process it does not trust, so make sure that the segment cannot be shrunk under it.
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+	return fd;
+}
+
+/// Returns true if the segment in the given file can be mapped safely.
+bool IsValidSegmentFile(int fd)
+{
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size < cSegmentSize)
+		return false;
+#if defined(__linux__) && defined(F_SEAL_SHRINK)
+	const int seals = fcntl(fd, F_GET_SEALS);
+	if (seals == -1 || (seals & F_SEAL_SHRINK) == 0)
+		return false;
+#endif
+	return true;
+}
+
+Segment *MapSegment(int fd)
+{
+	void *memory = mmap(0, cSegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return (memory == MAP_FAILED) ? 0 : (Segment*)memory;
+}
+
+} // ~unnamed namespace
+
+SOCKET SharedMemoryChannel::OpenListenSocket(unsigned short port)
+{
+	SOCKET listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSocket == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "SharedMemoryChannel::OpenListenSocket: Error at socket(): %s", Network::GetLastErrorString().c_str());
+		return INVALID_SOCKET;
+	}
+
+	sockaddr_un address;
+	const socklen_t addressLength = ListenAddress(port, address);
+#ifndef __linux__
+	unlink(address.sun_path);
+#endif
+	if (bind(listenSocket, (sockaddr*)&address, addressLength) == KNET_SOCKET_ERROR ||
+		listen(listenSocket, SOMAXCONN) == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "SharedMemoryChannel::OpenListenSocket: Could not listen to port %d: %s", (int)port, Network::GetLastErrorString().c_str());
+		closesocket(listenSocket);
+		return INVALID_SOCKET;
+	}
+	fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL, 0) | O_NONBLOCK);
+	return listenSocket;
+}
+
+SharedMemoryChannel *SharedMemoryChannel::Connect(unsigned short port, SOCKET &connectSocket)
+{
+	connectSocket = INVALID_SOCKET;
+	SOCKET s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "SharedMemoryChannel::Connect: Error at socket(): %s", Network::GetLastErrorString().c_str());
+		return 0;
+	}
+
+	sockaddr_un address;
+	const socklen_t addressLength = ListenAddress(port, address);
+	if (connect(s, (sockaddr*)&address, addressLength) == KNET_SOCKET_ERROR)
+	{
+		KNET_LOG(LogError, "SharedMemoryChannel::Connect: Could not connect to port %d: %s", (int)port, Network::GetLastErrorString().c_str());
+		closesocket(s);
+		return 0;
+	}
+
+	const int fd = CreateSegmentFile(cSegmentSize);
+	Segment *segment = (fd != -1) ? MapSegment(fd) : 0;
+	if (!segment)
+	{
+		KNET_LOG(LogError, "SharedMemoryChannel::Connect: Could not create a shared memory segment of %d bytes: %s", (int)cSegmentSize,
+			Network::GetLastErrorString().c_str());
+		if (fd != -1)
+			close(fd);
+		closesocket(s);
+		return 0;
+	}
+	// A new segment is zero-filled, so both rings start empty. Both sides start as if they had found their ring empty, so
+	// that the first bytes written ring the doorbell.
+	segment->magic = cSegmentMagic;
+	segment->ringSize = cRingSize;
+	segment->rings[0].consumerWaiting = 1;
+	segment->rings[1].consumerWaiting = 1;
+	FullMemoryBarrier();
+
+	// Pass the segment to the server with the first byte of the stream.
+	char byte = 0;
+	iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	const ssize_t ret = sendmsg(s, &msg, MSG_NOSIGNAL);
+	close(fd); // The mapping keeps the segment alive.
+	if (ret != 1)
+	{
+		KNET_LOG(LogError, "SharedMemoryChannel::Connect: Could not pass the shared memory segment to the server: %s", Network::GetLastErrorString().c_str());
+		munmap(segment, cSegmentSize);
+		closesocket(s);
+		return 0;
+	}
+
+	connectSocket = s;
+	return new SharedMemoryChannel(segment, s, true);
+}
+
+SharedMemoryChannel *SharedMemoryChannel::Accept(SOCKET listenSocket, SOCKET &acceptSocket, bool &listenFailed)
+{
+	listenFailed = false;
+	acceptSocket = accept(listenSocket, 0, 0);
+	if (acceptSocket == KNET_ACCEPT_FAILURE)
+	{
+		acceptSocket = INVALID_SOCKET;
+		int error = Network::GetLastError();
+		if (error != KNET_EWOULDBLOCK)
+		{
+			KNET_LOG(LogError, "SharedMemoryChannel::Accept: accept failed: %s", Network::GetErrorString(error).c_str());
+			listenFailed = true;
+		}
+		return 0;
+	}
+
+	// The client sends the segment right after connecting, so it is normally here already.
+	pollfd pfd;
+	pfd.fd = acceptSocket;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	char byte = 0;
+	iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	const ssize_t ret = (poll(&pfd, 1, cSegmentPassTimeoutMSecs) == 1) ? recvmsg(acceptSocket, &msg, MSG_DONTWAIT) : -1;
+
+	int fd = -1;
+	if (ret == 1)
+		for(cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+				memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+	Segment *segment = (fd != -1 && IsValidSegmentFile(fd)) ? MapSegment(fd) : 0;
+	if (fd != -1)
+		close(fd);
+	if (!segment || segment->magic != cSegmentMagic || segment->ringSize != cRingSize)
+	{
+		KNET_LOG(LogError, "SharedMemoryChannel::Accept: The client did not pass a valid shared memory segment. Dropping the connection.");
+		if (segment)
+			munmap(segment, cSegmentSize);
+		closesocket(acceptSocket);
+		acceptSocket = INVALID_SOCKET;
+		return 0;
+	}
+
+	fcntl(acceptSocket, F_SETFL, fcntl(acceptSocket, F_GETFL, 0) | O_NONBLOCK);
+	return new SharedMemoryChannel(segment, acceptSocket, false);
+}
+
+SharedMemoryChannel::SharedMemoryChannel(Segment *segment_, SOCKET doorbell_, bool isClient)
+:segment(segment_), doorbell(doorbell_)
+{
+	char *data = (char*)segment + sizeof(Segment);
+	inbound = &segment->rings[isClient ? 1 : 0];
+	outbound = &segment->rings[isClient ? 0 : 1];
+	inboundData = data + (isClient ? cRingSize : 0);
+	outboundData = data + (isClient ? 0 : cRingSize);
+}
+
+SharedMemoryChannel::~SharedMemoryChannel()
+{
+	munmap(segment, cSegmentSize);
+}
+
+void SharedMemoryChannel::RingDoorbell()
+{
+	// If the socket buffer is full, the peer has a byte to wake up to already.
+	const char byte = 0;
+	send(doorbell, &byte, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+size_t SharedMemoryChannel::BytesAvailable() const
+{
+	// The positions are written by the other process, so they may be anything. Masking them keeps the accesses in the ring.
+	return std::min<u32>(inbound->tail - inbound->head, cRingSize);
+}
+
+size_t SharedMemoryChannel::Read(char *dst, size_t maxBytes)
+{
+	size_t numBytes = std::min(BytesAvailable(), maxBytes);
+	if (numBytes == 0)
+	{
+		// Ask for the doorbell, and look again in case the peer wrote before it saw the flag.
+		inbound->consumerWaiting = 1;
+		FullMemoryBarrier();
+		numBytes = std::min(BytesAvailable(), maxBytes);
+		if (numBytes == 0)
+			return 0;
+	}
+	FullMemoryBarrier(); // Read the bytes only after the tail that covers them.
+
+	const u32 head = inbound->head;
+	const u32 start = head & (cRingSize - 1);
+	const size_t firstPart = std::min<size_t>(numBytes, cRingSize - start);
+	memcpy(dst, inboundData + start, firstPart);
+	memcpy(dst + firstPart, inboundData, numBytes - firstPart);
+
+	FullMemoryBarrier(); // Hand the room back to the producer only after the bytes have been copied out.
+	inbound->head = head + (u32)numBytes;
+	FullMemoryBarrier();
+	if (inbound->producerWaiting && CmpXChgLong(&inbound->producerWaiting, 0, 1))
+		RingDoorbell();
+	return numBytes;
+}
+
+bool SharedMemoryChannel::HasRoomFor(size_t numBytes)
+{
+	if (cRingSize - std::min<u32>(outbound->tail - outbound->head, cRingSize) >= numBytes)
+		return true;
+	outbound->producerWaiting = 1;
+	FullMemoryBarrier();
+	return cRingSize - std::min<u32>(outbound->tail - outbound->head, cRingSize) >= numBytes;
+}
+
+size_t SharedMemoryChannel::Write(const char *data, size_t numBytes)
+{
+	const u32 tail = outbound->tail;
+	FullMemoryBarrier(); // Write over the bytes only after the head that has freed them.
+	numBytes = std::min<size_t>(numBytes, cRingSize - std::min<u32>(tail - outbound->head, cRingSize));
+	if (numBytes == 0)
+		return 0;
+
+	const u32 start = tail & (cRingSize - 1);
+	const size_t firstPart = std::min<size_t>(numBytes, cRingSize - start);
+	memcpy(outboundData + start, data, firstPart);
+	memcpy(outboundData, data + firstPart, numBytes - firstPart);
+
+	FullMemoryBarrier(); // Publish the tail only after the bytes it covers.
+	outbound->tail = tail + (u32)numBytes;
+	FullMemoryBarrier();
+	if (outbound->consumerWaiting && CmpXChgLong(&outbound->consumerWaiting, 0, 1))
+		RingDoorbell();
+	return numBytes;
+}
+
+#else
+
+SOCKET SharedMemoryChannel::OpenListenSocket(unsigned short /*port*/)
+{
+	KNET_LOG(LogError, "SharedMemoryChannel::OpenListenSocket: SocketOverSharedMemory is not supported on this platform!");
+	return INVALID_SOCKET;
+}
+
+SharedMemoryChannel *SharedMemoryChannel::Connect(unsigned short /*port*/, SOCKET &socket)
+{
+	KNET_LOG(LogError, "SharedMemoryChannel::Connect: SocketOverSharedMemory is not supported on this platform!");
+	socket = INVALID_SOCKET;
+	return 0;
+}
+
+SharedMemoryChannel *SharedMemoryChannel::Accept(SOCKET /*listenSocket*/, SOCKET &socket, bool &listenFailed)
+{
+	socket = INVALID_SOCKET;
+	listenFailed = true;
+	return 0;
+}
+
+SharedMemoryChannel::~SharedMemoryChannel()
+{
+}
+
+size_t SharedMemoryChannel::Read(char * /*dst*/, size_t /*maxBytes*/) { return 0; }
+size_t SharedMemoryChannel::Write(const char * /*data*/, size_t /*numBytes*/) { return 0; }
+size_t SharedMemoryChannel::BytesAvailable() const { return 0; }
+bool SharedMemoryChannel::HasRoomFor(size_t /*numBytes*/) { return false; }
+
+#endif
+
+} // ~kNet
@@ -19,6 +19,8 @@
 #include <cassert>
 #include <utility>
 #include <sstream>
+#include <cstring>
+#include <algorithm>
 
 #ifdef KNET_USE_BOOST
 #include <boost/thread/thread.hpp>
@@ -29,8 +31,11 @@
 #include "kNet/Network.h"
 
 #include "kNet/Socket.h"
+#include "kNet/IDatagramReceiver.h"
+#include "kNet/DatagramBuffer.h"
 #include "kNet/NetworkLogging.h"
 #include "kNet/EventArray.h"
+#include "kNet/SharedMemoryChannel.h"
 
 using namespace std;
 
@@ -39,7 +44,28 @@ using namespace std;
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#include <sys/sendfile.h>
+#endif
+#endif
+
+#ifdef WIN32
+#include <mswsock.h>
+#endif
+
+#ifdef KNET_USE_IO_URING
+#include "kNet/unix/IoUring.h"
+#endif
+
+#ifdef KNET_USE_RIO
+#include "kNet/win32/RegisteredIO.h"
+#endif
+
+#ifdef KNET_USE_AF_XDP
+#include "kNet/unix/XdpSocket.h"
 #endif
 
 #ifdef WIN32
@@ -47,6 +73,26 @@ const int numConcurrentReceiveBuffers = 4;
 const int numConcurrentSendBuffers = 4;
 #endif
 
+#ifdef __linux__
+/// The maximum number of datagrams passed to a single sendmmsg() call when sending out a batch of datagrams.
+const int cMaxDatagramsPerSendBatch = 64;
+/// The maximum number of datagrams read with a single recvmmsg() call, and the space reserved for each of them.
+/// The slots are made larger if the socket sends larger datagrams, since the peers are allowed to send them back as large.
+const int cMaxDatagramsPerReceiveBatch = 32;
+const int cReceiveBatchSlotSize = 2048;
+/// When the reads of a socket are coalesced by UDP receive offload (UDP_GRO), a single read returns up to 64KB.
+const int cMaxCoalescedReceiveBatch = 8;
+const int cCoalescedReceiveSlotSize = 65536;
+/// The limits that the kernel imposes on a single message sent with UDP segmentation offload (UDP_SEGMENT).
+const int cMaxSegmentsPerSend = 64;
+const unsigned long cMaxSegmentedSendSize = 65000;
+#endif
+
+/// The buffer sizes of a new socket, until TuneBufferSizes() has measured its traffic.
+const int cInitialBufferSize = 512 * 1024;
+/// TunedBufferSize() counts the round-trip times shorter than this as this long.
+const float cMinTunedRTTMSecs = 50.f;
+
 namespace kNet
 {
 
@@ -56,6 +102,7 @@ std::string SocketTransportLayerToString(SocketTransportLayer transport)
 	{
 	case SocketOverUDP: return "UDP";
 	case SocketOverTCP: return "TCP";
+	case SocketOverSharedMemory: return "SHM";
 	default:
 		{
 			std::stringstream ss;
@@ -73,6 +120,8 @@ SocketTransportLayer StringToSocketTransportLayer(const char *str)
 		return SocketOverTCP;
 	if (!_stricmp(str, "udp") || !_stricmp(str, "SocketOverUDP"))
 		return SocketOverUDP;
+	if (!_stricmp(str, "shm") || !_stricmp(str, "SocketOverSharedMemory"))
+		return SocketOverSharedMemory;
 	return InvalidTransportLayer;
 }
 
@@ -104,6 +153,17 @@ readOpen(false)
 ,queuedReceiveBuffers(numConcurrentReceiveBuffers)
 ,queuedSendBuffers(numConcurrentSendBuffers)
 #endif
+,batchingDatagrams(false)
+,udpOffloadEnabled(true)
+,receiveOffloadActive(false)
+,tuneSendBuffer(true)
+,tuneReceiveBuffer(true)
+,tunedSendBufferSize(0)
+,tunedReceiveBufferSize(0)
+,receiveQueueDropsEnabled(false)
+,receiveQueueDrops(0)
+,receiveTimestampsEnabled(false)
+,ecnEnabled(false)
 {
 	localEndPoint.Reset();
 	remoteEndPoint.Reset();
@@ -117,6 +177,11 @@ Socket::~Socket()
 #ifdef WIN32
 	FreeOverlappedTransferBuffers();
 #endif
+	FreeDatagramBatch();
+	FreeTransferBuffers();
+	for(size_t i = 0; i < receiveBuffers.size(); ++i)
+		if (receiveBuffers[i])
+			receiveBuffers[i]->Release();
 }
 
 Socket::Socket(SOCKET connection, const EndPoint &localEndPoint_, const char *localHostName_,
@@ -130,9 +195,50 @@ writeOpen(true), readOpen(true)
 ,queuedReceiveBuffers(numConcurrentReceiveBuffers)
 ,queuedSendBuffers(numConcurrentSendBuffers)
 #endif
+,batchingDatagrams(false)
+,udpOffloadEnabled(true)
+,receiveOffloadActive(false)
+,tuneSendBuffer(true)
+,tuneReceiveBuffer(true)
+,tunedSendBufferSize(cInitialBufferSize)
+,tunedReceiveBufferSize(cInitialBufferSize)
+,receiveQueueDropsEnabled(false)
+,receiveQueueDrops(0)
+,receiveTimestampsEnabled(false)
+,ecnEnabled(false)
 {
-	SetSendBufferSize(512 * 1024);
-	SetReceiveBufferSize(512 * 1024);
+	// A UDP slave socket shares the handle of the server socket, whose buffers are sized for all of its connections.
+	// The socket of a shared memory connection only carries the doorbell.
+	if (!IsUDPSlaveSocket() && transport != SocketOverSharedMemory)
+	{
+		SetBufferSizeOption(SO_SNDBUF, cInitialBufferSize);
+		SetBufferSizeOption(SO_RCVBUF, cInitialBufferSize);
+	}
+#if defined(__linux__) && defined(SO_RXQ_OVFL)
+	if (transport == SocketOverUDP && !IsUDPSlaveSocket() && connectSocket != INVALID_SOCKET)
+	{
+		int value = 1;
+		receiveQueueDropsEnabled = (setsockopt(connectSocket, SOL_SOCKET, SO_RXQ_OVFL, &value, sizeof(value)) == 0);
+	}
+#endif
+#if defined(__linux__) && defined(SO_TIMESTAMPNS)
+	// The arrival times of the datagrams give the RTT samples without the time the datagrams wait for the worker thread.
+	if (transport == SocketOverUDP && !IsUDPSlaveSocket() && connectSocket != INVALID_SOCKET)
+	{
+		int value = 1;
+		receiveTimestampsEnabled = (setsockopt(connectSocket, SOL_SOCKET, SO_TIMESTAMPNS, &value, sizeof(value)) == 0);
+	}
+#endif
+#if defined(__linux__) && defined(IP_RECVTOS)
+	// Marks the datagrams ECN-capable, so that a congested router on the path marks them instead of dropping them.
+	if (transport == SocketOverUDP && !IsUDPSlaveSocket() && connectSocket != INVALID_SOCKET)
+	{
+		int tos = ECNECT0;
+		int value = 1;
+		ecnEnabled = (setsockopt(connectSocket, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) == 0 &&
+			setsockopt(connectSocket, IPPROTO_IP, IP_RECVTOS, &value, sizeof(value)) == 0);
+	}
+#endif
 	udpPeerAddress = remoteEndPoint.ToSockAddrIn();
 }
 
@@ -142,6 +248,8 @@ Socket::Socket(const Socket &rhs)
 ,queuedSendBuffers(numConcurrentSendBuffers)
 #endif
 {
+	batchingDatagrams = false;
+	receiveOffloadActive = false;
 	*this = rhs;
 }
 
@@ -167,6 +275,16 @@ Socket &Socket::operator=(const Socket &rhs)
 	writeOpen = rhs.writeOpen;
 	readOpen = rhs.readOpen;
 	udpPeerAddress = rhs.udpPeerAddress;
+	udpOffloadEnabled = rhs.udpOffloadEnabled;
+	tuneSendBuffer = rhs.tuneSendBuffer;
+	tuneReceiveBuffer = rhs.tuneReceiveBuffer;
+	tunedSendBufferSize = rhs.tunedSendBufferSize;
+	tunedReceiveBufferSize = rhs.tunedReceiveBufferSize;
+	receiveQueueDropsEnabled = rhs.receiveQueueDropsEnabled;
+	receiveQueueDrops = rhs.receiveQueueDrops;
+	receiveTimestampsEnabled = rhs.receiveTimestampsEnabled;
+	ecnEnabled = rhs.ecnEnabled;
+	sharedMemoryChannel = rhs.sharedMemoryChannel;
 
 	return *this;
 }
@@ -202,6 +320,20 @@ void DeleteOverlappedTransferBuffer(OverlappedTransferBuffer *buffer)
 {
 	if (!buffer)
 		return;
+#ifdef KNET_USE_RIO
+	if (buffer->registeredIO)
+	{
+		buffer->registeredIO->FreeBuffer(buffer);
+		return;
+	}
+#endif
+#ifdef KNET_USE_AF_XDP
+	if (buffer->xdpSocket)
+	{
+		buffer->xdpSocket->FreeBuffer(buffer);
+		return;
+	}
+#endif
 	delete[] buffer->buffer.buf;
 #ifdef WIN32
 	BOOL success = WSACloseEvent(buffer->overlapped.hEvent);
@@ -212,18 +344,129 @@ void DeleteOverlappedTransferBuffer(OverlappedTransferBuffer *buffer)
 	delete buffer;
 }
 
-void Socket::SetSendBufferSize(int bytes)
+int Socket::TransferBufferSize() const
+{
+	return std::max<int>(4096, (int)maxSendSize);
+}
+
+OverlappedTransferBuffer *Socket::AllocateTransferBuffer(int bytes)
+{
+	for(size_t i = freeTransferBuffers.size(); i-- > 0;)
+	{
+		OverlappedTransferBuffer *buffer = freeTransferBuffers[i];
+		if (buffer->bytesAllocated < bytes)
+			continue;
+		freeTransferBuffers[i] = freeTransferBuffers.back();
+		freeTransferBuffers.pop_back();
+#ifdef WIN32
+		// The event of the buffer is kept, and reset by the next overlapped operation that uses the buffer.
+		WSAEVENT event = buffer->overlapped.hEvent;
+		memset(&buffer->overlapped, 0, sizeof(buffer->overlapped));
+		buffer->overlapped.hEvent = event;
+#endif
+		buffer->buffer.len = buffer->bytesAllocated;
+		buffer->bytesContains = 0;
+		buffer->receiveTick = 0;
+		buffer->ecn = ECNNotECT;
+		return buffer;
+	}
+
+	// The datagrams are at most maxSendSize bytes, so the buffers of that size serve all the later sends and receives.
+	return AllocateOverlappedTransferBuffer(std::max<int>(bytes, TransferBufferSize()));
+}
+
+void Socket::ReleaseTransferBuffer(OverlappedTransferBuffer *buffer)
+{
+	if (!buffer)
+		return;
+#ifdef KNET_USE_RIO
+	if (buffer->registeredIO)
+	{
+		DeleteOverlappedTransferBuffer(buffer);
+		return;
+	}
+#endif
+#ifdef KNET_USE_AF_XDP
+	if (buffer->xdpSocket)
+	{
+		DeleteOverlappedTransferBuffer(buffer);
+		return;
+	}
+#endif
+	if ((int)freeTransferBuffers.size() >= cMaxFreeTransferBuffers || buffer->bytesAllocated < TransferBufferSize() ||
+		connectSocket == INVALID_SOCKET)
+	{
+		DeleteOverlappedTransferBuffer(buffer);
+		return;
+	}
+	freeTransferBuffers.push_back(buffer);
+}
+
+void Socket::FreeTransferBuffers()
+{
+	for(size_t i = 0; i < freeTransferBuffers.size(); ++i)
+		DeleteOverlappedTransferBuffer(freeTransferBuffers[i]);
+	freeTransferBuffers.clear();
+}
+
+bool Socket::SetBufferSizeOption(int option, int bytes)
 {
 	socklen_t len = sizeof(bytes);
-	if (setsockopt(connectSocket, SOL_SOCKET, SO_SNDBUF, (char*)&bytes, len))
-		KNET_LOG(LogError, "Socket::SetSendBufferSize: setsockopt failed with error %s!", Network::GetLastErrorString().c_str());
+	if (setsockopt(connectSocket, SOL_SOCKET, option, (char*)&bytes, len))
+	{
+		KNET_LOG(LogError, "Socket::%s: setsockopt failed with error %s!", (option == SO_SNDBUF) ? "SetSendBufferSize" : "SetReceiveBufferSize",
+			Network::GetLastErrorString().c_str());
+		return false;
+	}
+	return true;
+}
+
+void Socket::SetSendBufferSize(int bytes)
+{
+	tuneSendBuffer = false;
+	SetBufferSizeOption(SO_SNDBUF, bytes);
 }
 
 void Socket::SetReceiveBufferSize(int bytes)
 {
-	socklen_t len = sizeof(bytes);
-	if (setsockopt(connectSocket, SOL_SOCKET, SO_RCVBUF, (char*)&bytes, len))
-		KNET_LOG(LogError, "Socket::SetReceiveBufferSize: setsockopt failed with error %s!", Network::GetLastErrorString().c_str());
+	tuneReceiveBuffer = false;
+	SetBufferSizeOption(SO_RCVBUF, bytes);
+}
+
+int Socket::TunedBufferSize(float bytesPerSec, float rttMSecs)
+{
+	const double bandwidthDelayProduct = bytesPerSec * std::max(rttMSecs, cMinTunedRTTMSecs) / 1000.0;
+	int size = cMinTunedBufferSize;
+	while(size < cMaxTunedBufferSize && size < 2.0 * bandwidthDelayProduct)
+		size *= 2;
+	return size;
+}
+
+void Socket::TuneBufferSizes(float bytesInPerSec, float bytesOutPerSec, float rttMSecs)
+{
+	if (connectSocket == INVALID_SOCKET || IsUDPSlaveSocket() || sharedMemoryChannel)
+		return;
+
+	if (tuneSendBuffer)
+	{
+		const int size = TunedBufferSize(bytesOutPerSec, rttMSecs);
+		if ((size > tunedSendBufferSize || size * 4 <= tunedSendBufferSize) && SetBufferSizeOption(SO_SNDBUF, size))
+		{
+			KNET_LOG(LogVerbose, "Socket::TuneBufferSizes: Resized the send buffer of socket %s from %d to %d bytes.", ToString().c_str(),
+				tunedSendBufferSize, size);
+			tunedSendBufferSize = size;
+		}
+	}
+	if (tuneReceiveBuffer)
+	{
+		const int size = TunedBufferSize(bytesInPerSec, rttMSecs);
+		if ((size > tunedReceiveBufferSize || size * 4 <= tunedReceiveBufferSize) && SetBufferSizeOption(SO_RCVBUF, size))
+		{
+			KNET_LOG(LogVerbose, "Socket::TuneBufferSizes: Resized the receive buffer of socket %s from %d to %d bytes.", ToString().c_str(),
+				tunedReceiveBufferSize, size);
+			tunedReceiveBufferSize = size;
+		}
+	}
 }
 
 int Socket::SendBufferSize() const
@@ -256,14 +499,14 @@ void Socket::EnqueueNewReceiveBuffer(OverlappedTransferBuffer *buffer)
 {
 	if (!readOpen || queuedReceiveBuffers.CapacityLeft() == 0 || IsUDPSlaveSocket())
 	{
-		DeleteOverlappedTransferBuffer(buffer); // buffer may be a zero pointer, but that is alright.
+		ReleaseTransferBuffer(buffer); // buffer may be a zero pointer, but that is alright.
 		return;
 	}
 
 	if (!buffer)
 	{
 		const int receiveBufferSize = 16384; // This is best to be at least 9K (the largest size of jumbo datagrams commonly supported)
-		buffer = AllocateOverlappedTransferBuffer(receiveBufferSize);
+		buffer = AllocateTransferBuffer(receiveBufferSize);
 		if (!buffer)
 		{
 			KNET_LOG(LogError, "Socket::EnqueueNewReceiveBuffer: Call to AllocateOverlappedTransferBuffer failed!");
@@ -297,7 +540,7 @@ void Socket::EnqueueNewReceiveBuffer(OverlappedTransferBuffer *buffer)
 
 			KNET_LOG(LogInfo, "Socket::EnqueueNewReceiveBuffer: Received 0 bytes from the network. Read connection closed in socket %s.", ToString().c_str());
 			readOpen = false;
-			DeleteOverlappedTransferBuffer(buffer);
+			ReleaseTransferBuffer(buffer);
 			return;
 		}
 		// Return value 0: The operation completed and we have received new data. Push it to a queue for the user to receive.
@@ -306,7 +549,7 @@ void Socket::EnqueueNewReceiveBuffer(OverlappedTransferBuffer *buffer)
 		if (!success)
 		{
 			KNET_LOG(LogError, "Socket::EnqueueNewReceiveBuffer: queuedReceiveBuffers.Insert(buffer); failed!");
-			DeleteOverlappedTransferBuffer(buffer);
+			ReleaseTransferBuffer(buffer);
 		}
 	}
 	else if (error == WSAEDISCON)
@@ -317,7 +560,7 @@ void Socket::EnqueueNewReceiveBuffer(OverlappedTransferBuffer *buffer)
 		KNET_LOG(LogError, "Socket::EnqueueNewReceivebuffer: WSAEDISCON. Connection closed in socket %s.", ToString().c_str());
 		readOpen = false;
 		///\todo Should do writeOpen = false; here as well?
-		DeleteOverlappedTransferBuffer(buffer);
+		ReleaseTransferBuffer(buffer);
 		return;
 	}
 	else
@@ -339,7 +582,7 @@ void Socket::EnqueueNewReceiveBuffer(OverlappedTransferBuffer *buffer)
 			}
 		}
 
-		DeleteOverlappedTransferBuffer(buffer); // We failed to queue the buffer, free it up immediately to avoid leaking memory.
+		ReleaseTransferBuffer(buffer); // We failed to queue the buffer, free it up immediately to avoid leaking memory.
 		return;
 	}
 }
@@ -353,7 +596,7 @@ void DumpBuffer(const char *description, const char *data, int size)
 	printf("\n");
 }
 
-size_t Socket::Receive(char *dst, size_t maxBytes, EndPoint *endPoint)
+size_t Socket::Receive(char *dst, size_t maxBytes, EndPoint *endPoint, tick_t *receiveTick, u8 *ecn)
 {
 	assert(dst);
 	assert(maxBytes > 0);
@@ -369,6 +612,20 @@ size_t Socket::Receive(char *dst, size_t maxBytes, EndPoint *endPoint)
 	if (IsUDPSlaveSocket()) // UDP slave sockets are never read directly. Instead the UDP server socket reads all client data.
 		return 0; // So, if we accidentally come here to read a UDP slave socket, act as if it never received any data.
 
+	if (sharedMemoryChannel)
+	{
+		// Clear the doorbell before reading the ring, so that the bytes written after the read ring it again. The bytes
+		// left in the ring by a peer that has closed are still read out before the read-connection is closed.
+		const bool peerOpen = ClearDoorbell();
+		const size_t numBytesRead = sharedMemoryChannel->Read(dst, maxBytes);
+		if (numBytesRead == 0 && !peerOpen)
+		{
+			KNET_LOG(LogInfo, "Socket::Receive: The peer has closed the shared memory channel. Read-connection closed to socket %s.", ToString().c_str());
+			readOpen = false;
+		}
+		return numBytesRead;
+	}
+
 	if (IsUDPServerSocket())
 	{
 		sockaddr_in from;
@@ -393,7 +650,54 @@ size_t Socket::Receive(char *dst, size_t maxBytes, EndPoint *endPoint)
 
 	// If we reach here, this socket is a tcp connection socket (server->client or client->server), or a udp client->server socket.
 
+	if (receiveTick)
+		*receiveTick = 0;
+	if (ecn)
+		*ecn = ECNNotECT;
+#if defined(__linux__) && defined(SO_RXQ_OVFL)
+	int ret;
+	if (receiveQueueDropsEnabled || receiveTimestampsEnabled || ecnEnabled)
+	{
+		// Read the datagram with its arrival time, its ECN codepoint and the drop count of the socket.
+		iovec iov;
+		iov.iov_base = dst;
+		iov.iov_len = maxBytes;
+		char control[CMSG_SPACE(sizeof(u32)) + CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(int))];
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		ret = recvmsg(connectSocket, &msg, 0);
+		if (ret > 0)
+			for(cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+			{
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+				{
+					u32 drops;
+					memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+					receiveQueueDrops = drops;
+				}
+#ifdef SCM_TIMESTAMPNS
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS && receiveTick)
+				{
+					timespec stamp;
+					memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+					*receiveTick = Clock::TickFromRealTime((unsigned long long)stamp.tv_sec, (unsigned long)stamp.tv_nsec);
+				}
+#endif
+#ifdef IP_RECVTOS
+				if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS && ecn)
+					*ecn = (u8)(*(const unsigned char*)CMSG_DATA(cmsg) & 3);
+#endif
+			}
+	}
+	else
+		ret = recv(connectSocket, dst, maxBytes, 0);
+#else
 	int ret = recv(connectSocket, dst, maxBytes, 0);
+#endif
 
 	if (ret > 0)
 	{
@@ -434,6 +738,11 @@ bool Socket::IsOverlappedReceiveReady() const
 		return false;
 
 #ifdef WIN32
+#ifdef KNET_USE_RIO
+	RegisteredIO *rio = RegisteredIO::ThreadRIO();
+	if (rio && rio->IsReceiving(this))
+		return rio->HasReceived(this);
+#endif
 	if (queuedReceiveBuffers.Size() == 0)
 		return false;
 	return Event((*queuedReceiveBuffers.Front())->overlapped.hEvent, EventWaitRead).Test();
@@ -441,9 +750,9 @@ bool Socket::IsOverlappedReceiveReady() const
 	if (!readOpen)
 		return false;
 
-	EventArray ea;
-	ea.AddEvent(Event(connectSocket, EventWaitRead));
-	return ea.Wait(0) == 0;
+	if (sharedMemoryChannel && sharedMemoryChannel->BytesAvailable() > 0)
+		return true;
+	return Event(connectSocket, EventWaitRead).Test();
 #endif
 }
 
@@ -453,6 +762,12 @@ Event Socket::GetOverlappedReceiveEvent()
 		return Event();
 
 #ifdef WIN32
+#ifdef KNET_USE_RIO
+	// The worker thread learns of the datagrams of a socket read through its RegisteredIO from the completion queue.
+	RegisteredIO *rio = RegisteredIO::ThreadRIO();
+	if (rio && rio->IsReceiving(this))
+		return Event();
+#endif
 	if (readOpen)
 	{
 		/// Prime the receive buffers to the full capacity if they weren't so yet.
@@ -469,6 +784,10 @@ Event Socket::GetOverlappedReceiveEvent()
 
 	return Event(receivedData->overlapped.hEvent, EventWaitRead);
 #else
+	// The doorbell is rung only when the ring has been found empty. If the previous read left bytes in the ring, return
+	// an event that is raised right away, the socket being writable.
+	if (sharedMemoryChannel && sharedMemoryChannel->BytesAvailable() > 0)
+		return Event(connectSocket, EventWaitWrite);
 	return Event(connectSocket, EventWaitRead);
 #endif
 }
@@ -487,6 +806,9 @@ Event Socket::GetOverlappedSendEvent()
 
 	return Event(sentData->overlapped.hEvent, EventWaitWrite);
 #else
+	// The peer rings the doorbell of a full ring when it has read from it, which raises the receive event instead.
+	if (sharedMemoryChannel)
+		return Event();
 	return Event(connectSocket, EventWaitWrite);
 #endif
 }
@@ -504,6 +826,11 @@ OverlappedTransferBuffer *Socket::BeginReceive()
 	}
 
 #ifdef WIN32
+#ifdef KNET_USE_RIO
+	RegisteredIO *rio = RegisteredIO::ThreadRIO();
+	if (rio && rio->IsReceiving(this))
+		return rio->TakeReceived(this);
+#endif
 	if (readOpen)
 	{
 		// Insert new empty receive buffers to the Overlapped Transfer receive queue until we have a full capacity queue primed.
@@ -527,7 +854,7 @@ OverlappedTransferBuffer *Socket::BeginReceive()
 		// peer has closed the write connection (but can still recv() until we also close the write connection).
 		if (receivedData->bytesContains == 0)
 		{
-			DeleteOverlappedTransferBuffer(receivedData);
+			ReleaseTransferBuffer(receivedData);
 			if (!IsUDPServerSocket())
 			{
 				if (readOpen)
@@ -546,7 +873,7 @@ OverlappedTransferBuffer *Socket::BeginReceive()
 	else if (error == WSAEDISCON)
 	{
 		queuedReceiveBuffers.PopFront();
-		DeleteOverlappedTransferBuffer(receivedData);
+		ReleaseTransferBuffer(receivedData);
 		if (readOpen || writeOpen)
 			KNET_LOG(LogError, "Socket::BeginReceive: WSAEDISCON. Bidirectionally closing connection in socket %s.", ToString().c_str());
 		if (IsUDPServerSocket())
@@ -560,7 +887,7 @@ OverlappedTransferBuffer *Socket::BeginReceive()
 		if (readOpen || writeOpen)
 			if (!(IsUDPServerSocket() && error == 10054)) // If we are running both UDP server and client on localhost, we can receive 10054 (Peer closed connection) on the server side, in which case, we ignore this error print.
 				KNET_LOG(LogError, "Socket::BeginReceive: WSAGetOverlappedResult failed with code %d when reading from an overlapped socket! Reason: %s.", error, Network::GetErrorString(error).c_str());
-		DeleteOverlappedTransferBuffer(receivedData);
+		ReleaseTransferBuffer(receivedData);
 		// Mark this socket closed, unless the read error was on a UDP server socket, in which case we must ignore
 		// the read error on this buffer (an error on a single client connection cannot shut down the whole server!)
 		if (!IsUDPServerSocket() && (readOpen || writeOpen))
@@ -574,10 +901,10 @@ OverlappedTransferBuffer *Socket::BeginReceive()
 	if (!readOpen)
 		return 0;
 
-	const int receiveBufferSize = 4096;
-	OverlappedTransferBuffer *buffer = AllocateOverlappedTransferBuffer(receiveBufferSize);
+	const int receiveBufferSize = (transport == SocketOverUDP) ? std::max<int>(4096, (int)maxSendSize) : 4096;
+	OverlappedTransferBuffer *buffer = AllocateTransferBuffer(receiveBufferSize);
 	EndPoint source;
-	buffer->bytesContains = Receive(buffer->buffer.buf, buffer->buffer.len, &source);
+	buffer->bytesContains = Receive(buffer->buffer.buf, buffer->buffer.len, &source, &buffer->receiveTick, &buffer->ecn);
 	if (buffer->bytesContains > 0)
 	{
 		buffer->fromLen = sizeof(buffer->from);
@@ -587,7 +914,7 @@ OverlappedTransferBuffer *Socket::BeginReceive()
 	else
 	{
 		// Did not get any data. Delete the buffer immediately.
-		DeleteOverlappedTransferBuffer(buffer);
+		ReleaseTransferBuffer(buffer);
 		return 0;
 	}
 #endif
@@ -595,6 +922,14 @@ OverlappedTransferBuffer *Socket::BeginReceive()
 
 void Socket::EndReceive(OverlappedTransferBuffer *buffer)
 {
+#ifdef KNET_USE_RIO
+	// A registered buffer goes back to the pool, and its RegisteredIO primes a new receive with it.
+	if (buffer && buffer->registeredIO)
+	{
+		ReleaseTransferBuffer(buffer);
+		return;
+	}
+#endif
 #ifdef WIN32
 	if (readOpen)
 	{
@@ -603,7 +938,141 @@ void Socket::EndReceive(OverlappedTransferBuffer *buffer)
 	}
 #endif
 
-	DeleteOverlappedTransferBuffer(buffer);
+	ReleaseTransferBuffer(buffer);
+}
+
+int Socket::ReceiveDatagrams(IDatagramReceiver *receiver, int maxDatagrams)
+{
+	assert(receiver);
+	assert(IsUDPServerSocket());
+	if (connectSocket == INVALID_SOCKET || !readOpen)
+		return 0;
+
+#ifdef __linux__
+	if (receiveBuffers.empty())
+	{
+		// Coalesced reads are only enabled for sockets read through here, since they need room for up to 64KB per read.
+		receiveOffloadActive = udpOffloadEnabled && SetReceiveOffload(true);
+		receiveBuffers.resize(receiveOffloadActive ? cMaxCoalescedReceiveBatch : cMaxDatagramsPerReceiveBatch, 0);
+	}
+	const int slotSize = receiveOffloadActive ? cCoalescedReceiveSlotSize : std::max<int>(cReceiveBatchSlotSize, (int)maxSendSize);
+	maxDatagrams = std::min<int>(maxDatagrams, (int)receiveBuffers.size());
+	if (maxDatagrams <= 0)
+		return 0;
+
+	mmsghdr msgs[cMaxDatagramsPerReceiveBatch];
+	iovec iovs[cMaxDatagramsPerReceiveBatch];
+	sockaddr_in sources[cMaxDatagramsPerReceiveBatch];
+	// Room for the UDP_GRO segment size, the SO_RXQ_OVFL drop count, the SO_TIMESTAMPNS arrival time and the IP_TOS byte.
+	char controls[cMaxDatagramsPerReceiveBatch][CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(u32)) + CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(int))];
+	memset(msgs, 0, sizeof(msgs[0]) * maxDatagrams);
+	for(int i = 0; i < maxDatagrams; ++i)
+	{
+		if (!receiveBuffers[i])
+			receiveBuffers[i] = DatagramBuffer::Allocate(slotSize);
+		iovs[i].iov_base = receiveBuffers[i]->Data();
+		iovs[i].iov_len = std::min<size_t>(slotSize, receiveBuffers[i]->Capacity());
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &sources[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+		if (receiveOffloadActive || receiveQueueDropsEnabled || receiveTimestampsEnabled || ecnEnabled)
+		{
+			msgs[i].msg_hdr.msg_control = controls[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+		}
+	}
+
+	int numReceived = recvmmsg(connectSocket, msgs, maxDatagrams, MSG_DONTWAIT, 0);
+	if (numReceived == KNET_SOCKET_ERROR)
+	{
+		int error = Network::GetLastError();
+		if (error != KNET_EWOULDBLOCK && error != 0)
+			KNET_LOG(LogError, "Socket::ReceiveDatagrams: recvmmsg failed: %s in socket %s", Network::GetErrorString(error).c_str(), ToString().c_str());
+		return 0;
+	}
+
+	int numDatagrams = 0;
+	for(int i = 0; i < numReceived; ++i)
+	{
+		const size_t numBytes = msgs[i].msg_len;
+		if (numBytes == 0)
+		{
+			KNET_LOG(LogVerbose, "Socket::ReceiveDatagrams: Server received a UDP datagram of 0 bytes from a client! This is a malformed kNet UDP datagram!");
+			continue;
+		}
+		if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0)
+		{
+			KNET_LOG(LogError, "Socket::ReceiveDatagrams: Discarding received over-sized datagram (%d bytes)!", (int)numBytes);
+			continue;
+		}
+		KNET_LOG(LogData, "recvmmsg (%d) in socket %s", (int)numBytes, ToString().c_str());
+
+		// A read that the kernel coalesced from several datagrams of the same source carries the size of the datagrams in it.
+		size_t segmentSize = numBytes;
+		tick_t receiveTick = 0;
+		u8 ecn = ECNNotECT;
+		if (msgs[i].msg_hdr.msg_control)
+			for(cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+			{
+				if (receiveOffloadActive && cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO)
+				{
+					int gsoSize;
+					memcpy(&gsoSize, CMSG_DATA(cmsg), sizeof(gsoSize));
+					if (gsoSize > 0)
+						segmentSize = (size_t)gsoSize;
+				}
+#ifdef SO_RXQ_OVFL
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+				{
+					u32 drops;
+					memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+					receiveQueueDrops = drops;
+				}
+#endif
+#ifdef SCM_TIMESTAMPNS
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+				{
+					timespec stamp;
+					memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+					receiveTick = Clock::TickFromRealTime((unsigned long long)stamp.tv_sec, (unsigned long)stamp.tv_nsec);
+				}
+#endif
+#ifdef IP_RECVTOS
+				if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS)
+					ecn = (u8)(*(const unsigned char*)CMSG_DATA(cmsg) & 3);
+#endif
+			}
+
+		const EndPoint source = EndPoint::FromSockAddrIn(sources[i]);
+		DatagramBuffer *buffer = receiveBuffers[i];
+		for(size_t offset = 0; offset < numBytes; offset += segmentSize, ++numDatagrams)
+			receiver->DatagramReceived(this, buffer, buffer->Data() + offset, std::min(segmentSize, numBytes - offset), source, receiveTick, ecn);
+
+		// If the receivers kept references to the datagrams, the buffer is theirs now. Read the next datagrams to a new one.
+		if (buffer->RefCount() > 1)
+		{
+			buffer->Release();
+			receiveBuffers[i] = 0;
+		}
+	}
+	return numDatagrams;
+#else
+	int numReceived = 0;
+	while(numReceived < maxDatagrams)
+	{
+		OverlappedTransferBuffer *buffer = BeginReceive();
+		if (!buffer)
+			break;
+		++numReceived;
+		if (buffer->bytesContains > 0)
+			receiver->DatagramReceived(this, 0, buffer->buffer.buf, buffer->bytesContains, EndPoint::FromSockAddrIn(buffer->from), buffer->receiveTick, buffer->ecn);
+		else
+			KNET_LOG(LogError, "Received 0 bytes of data in Socket::ReceiveDatagrams!");
+		EndReceive(buffer);
+	}
+	return numReceived;
+#endif
 }
 
 void Socket::Disconnect()
@@ -613,7 +1082,7 @@ void Socket::Disconnect()
 
 	KNET_LOG(LogVerbose, "Socket::Disconnect(), this: %p.", this);
 
-	if (transport == SocketOverTCP)
+	if (IsStreamTransportLayer(transport))
 	{
 		int result = shutdown(connectSocket, SD_SEND);
 		if (result == KNET_SOCKET_ERROR)
@@ -626,6 +1095,16 @@ void Socket::Disconnect()
 }
 
 void Socket::Close()
+{
+	CloseSocket(true);
+}
+
+void Socket::Abandon()
+{
+	CloseSocket(false);
+}
+
+void Socket::CloseSocket(bool shutdownSocket)
 {
 	if (connectSocket == INVALID_SOCKET)
 	{
@@ -641,13 +1120,18 @@ void Socket::Close()
 		// all other client sockets and the UDP server socket. For those sockets, the UDP server socket is the owner
 		// of the socket object, so the clients cannot close their sockets, as closing one would close them all.
 
-		int result = shutdown(connectSocket, SD_BOTH);
-		if (result == KNET_SOCKET_ERROR)
-			KNET_LOG(LogError, "Socket::Close(): Socket shutdown(SD_BOTH) failed: %s in socket %s.", Network::GetLastErrorString().c_str(), ToString().c_str());
-		else
-			KNET_LOG(LogInfo, "Socket::Close(): Socket shutdown(SD_BOTH) succeeded on socket %s.", ToString().c_str());
+		// The shutdown applies to the socket itself, not just to this handle of it, so it is skipped for a socket that
+		// lives on in another process.
+		if (shutdownSocket)
+		{
+			int result = shutdown(connectSocket, SD_BOTH);
+			if (result == KNET_SOCKET_ERROR)
+				KNET_LOG(LogError, "Socket::Close(): Socket shutdown(SD_BOTH) failed: %s in socket %s.", Network::GetLastErrorString().c_str(), ToString().c_str());
+			else
+				KNET_LOG(LogInfo, "Socket::Close(): Socket shutdown(SD_BOTH) succeeded on socket %s.", ToString().c_str());
+		}
 
-		result = closesocket(connectSocket);
+		int result = closesocket(connectSocket);
 		if (result == KNET_SOCKET_ERROR)
 			KNET_LOG(LogError, "Socket::Close(): closesocket() failed: %s in socket %s.", Network::GetLastErrorString().c_str(), ToString().c_str());
 	}
@@ -661,10 +1145,48 @@ void Socket::Close()
 	type = InvalidSocketType;
 	readOpen = false;
 	writeOpen = false;
+	sharedMemoryChannel = 0;
 
 #ifdef WIN32
 	FreeOverlappedTransferBuffers();
 #endif
+	FreeDatagramBatch();
+}
+
+void Socket::SetSharedMemoryChannel(SharedMemoryChannel *channel)
+{
+	assert(transport == SocketOverSharedMemory);
+	sharedMemoryChannel = channel;
+}
+
+bool Socket::WriteSharedMemoryChannel(const char *data, size_t numBytes)
+{
+	size_t bytesSent = 0;
+	while(bytesSent < numBytes)
+	{
+		bytesSent += sharedMemoryChannel->Write(data + bytesSent, numBytes - bytesSent);
+		const int socketWriteTimeout = 5000; // msecs.
+		if (bytesSent < numBytes && !WaitForSendReady(socketWriteTimeout))
+		{
+			KNET_LOG(LogError, "Socket::WriteSharedMemoryChannel: Warning! The peer did not read the ring in the timeout period, with %d bytes left to send. Closing connection.",
+				(int)(numBytes - bytesSent));
+			Close();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Socket::ClearDoorbell()
+{
+	char doorbell[64];
+	for(;;)
+	{
+		const int ret = recv(connectSocket, doorbell, sizeof(doorbell), 0);
+		if (ret > 0)
+			continue;
+		return ret < 0 && Network::GetLastError() == KNET_EWOULDBLOCK;
+	}
 }
 
 #ifdef WIN32
@@ -698,6 +1220,29 @@ void Socket::SetBlocking(bool isBlocking)
 #endif
 }
 
+void Socket::SetUDPPeerEndPoint(const EndPoint &endPoint)
+{
+	assert(transport == SocketOverUDP && type != ServerListenSocket);
+	remoteEndPoint = endPoint;
+	remoteHostName = endPoint.IPToString();
+	udpPeerAddress = remoteEndPoint.ToSockAddrIn();
+	// A connected socket sends with send(), and only receives from the address it is connected to.
+	if (type == ClientSocket && connect(connectSocket, (sockaddr*)&udpPeerAddress, sizeof(udpPeerAddress)) == KNET_SOCKET_ERROR)
+		KNET_LOG(LogError, "Socket::SetUDPPeerEndPoint: Could not connect socket %s to its new address: %s", ToString().c_str(),
+			Network::GetLastErrorString().c_str());
+}
+
+/// Returns true if a send to a socket failed only because the socket can't take the data yet. A TCP Fast Open socket that
+/// had no cookie of the server sent its SYN without the data, and reports EINPROGRESS until the handshake has finished.
+static bool SendWouldBlock(int error)
+{
+#if defined(KNET_UNIX) || defined(ANDROID)
+	if (error == EINPROGRESS)
+		return true;
+#endif
+	return error == KNET_EWOULDBLOCK;
+}
+
 /// @return True on success, false otherwise.
 bool Socket::Send(const char *data, size_t numBytes)
 {
@@ -720,6 +1265,18 @@ bool Socket::Send(const char *data, size_t numBytes)
 		return false;
 	}
 
+	if (sharedMemoryChannel)
+	{
+		// Like with TCP, a send that has started goes out in full, and one that cannot start fails.
+		const size_t bytesSent = sharedMemoryChannel->Write(data, numBytes);
+		if (bytesSent == 0)
+		{
+			sharedMemoryChannel->HasRoomFor(1);
+			return false;
+		}
+		return WriteSharedMemoryChannel(data + bytesSent, numBytes - bytesSent);
+	}
+
 	int bytesSent = 0;
 	// sendto() to a connected socket causes EISCONN on OSX, so avoid it for client UDP sockets
 	if (transport == SocketOverUDP && type != ClientSocket)
@@ -734,7 +1291,7 @@ bool Socket::Send(const char *data, size_t numBytes)
 	}
 	else if (bytesSent > 0) // Managed to send some data, but not all bytes.
 	{
-		assert(transport == SocketOverTCP); // Only TCP sockets should ever succeed 'partially'.
+		assert(IsStreamTransportLayer(transport)); // Only stream sockets should ever succeed 'partially'.
 		// Our Socket::Send tries to guarantee that either all or nothing of the data is sent. We don't want
 		// to report back to the upper layer that only part of the data was successfully sent. So, try to
 		// re-issue the remainining bytes, but now in blocking mode, so we can wait for the rest of the data to
@@ -757,7 +1314,10 @@ bool Socket::Send(const char *data, size_t numBytes)
 	{
 		int error = Network::GetLastError();
 
-		if (error != KNET_EWOULDBLOCK)
+		// With the Don't Fragment flag set, a datagram larger than the path allows is refused, but the socket stays usable.
+		if (error == KNET_EMSGSIZE && transport == SocketOverUDP)
+			KNET_LOG(LogVerbose, "Socket::Send: A datagram of %d bytes is too large to be sent to socket %s.", (int)numBytes, ToString().c_str());
+		else if (!SendWouldBlock(error))
 		{
 			KNET_LOG(LogError, "Socket::Send() failed! Error: %s.", Network::GetErrorString(error).c_str());
 			if (type == ServerClientSocket && transport == SocketOverUDP)
@@ -776,6 +1336,190 @@ bool Socket::Send(const char *data, size_t numBytes)
 	}
 }
 
+bool Socket::SendTo(const char *data, size_t numBytes, const EndPoint &destination)
+{
+	assert(IsUDPServerSocket());
+	if (connectSocket == INVALID_SOCKET)
+		return false;
+
+	sockaddr_in address = destination.ToSockAddrIn();
+	const int bytesSent = sendto(connectSocket, data, numBytes, 0, (sockaddr*)&address, sizeof(address));
+	if (bytesSent != (int)numBytes)
+	{
+		KNET_LOG(LogVerbose, "Socket::SendTo: Failed to send a datagram of %d bytes to %s: %s.", (int)numBytes,
+			destination.ToString().c_str(), Network::GetLastErrorString().c_str());
+		return false;
+	}
+	return true;
+}
+
+bool Socket::SendGather(const kNetBuffer *buffers, int numBuffers)
+{
+	assert(IsStreamTransportLayer(transport));
+	assert(numBuffers > 0 && numBuffers <= cMaxGatherBuffers);
+	if (connectSocket == INVALID_SOCKET || !writeOpen)
+	{
+		KNET_LOG(LogError, "Trying to send data to a socket that is not open for writing!");
+		return false;
+	}
+
+	if (sharedMemoryChannel)
+	{
+		// The buffers are copied to the ring one after another, which is the one copy the ring costs anyway.
+		size_t numBytes = 0;
+		for(int i = 0; i < numBuffers; ++i)
+			numBytes += buffers[i].len;
+		if (!sharedMemoryChannel->HasRoomFor(std::min<size_t>(numBytes, SharedMemoryChannel::cRingSize)))
+			return false; // Nothing was sent, so the caller can try again later.
+		for(int i = 0; i < numBuffers; ++i)
+			if (!WriteSharedMemoryChannel(buffers[i].buf, buffers[i].len))
+				return false;
+		return true;
+	}
+
+#ifdef WIN32
+	WSABUF vecs[cMaxGatherBuffers];
+#else
+	iovec vecs[cMaxGatherBuffers];
+#endif
+	int numVecs = 0;
+	size_t numBytes = 0;
+	for(int i = 0; i < numBuffers; ++i)
+		if (buffers[i].len > 0)
+		{
+#ifdef WIN32
+			vecs[numVecs] = buffers[i];
+#else
+			vecs[numVecs].iov_base = buffers[i].buf;
+			vecs[numVecs].iov_len = buffers[i].len;
+#endif
+			numBytes += buffers[i].len;
+			++numVecs;
+		}
+
+	size_t bytesLeft = numBytes;
+	int firstVec = 0;
+	while(bytesLeft > 0)
+	{
+#ifdef WIN32
+		DWORD numBytesSent = 0;
+		int bytesSent = (WSASend(connectSocket, vecs + firstVec, numVecs - firstVec, &numBytesSent, 0, 0, 0) == 0) ? (int)numBytesSent : -1;
+#else
+		int bytesSent = (int)writev(connectSocket, vecs + firstVec, numVecs - firstVec);
+#endif
+		if (bytesSent < 0)
+		{
+			int error = Network::GetLastError();
+			if (!SendWouldBlock(error))
+			{
+				KNET_LOG(LogError, "Socket::SendGather() failed! Error: %s.", Network::GetErrorString(error).c_str());
+				Close();
+				return false;
+			}
+			if (bytesLeft == numBytes)
+				return false; // Nothing was sent, so the caller can try again later.
+			bytesSent = 0;
+		}
+		bytesLeft -= bytesSent;
+		if (bytesLeft == 0)
+			break;
+
+		// Skip over the bytes that were sent.
+#ifdef WIN32
+		while((size_t)bytesSent >= vecs[firstVec].len)
+			bytesSent -= vecs[firstVec++].len;
+		vecs[firstVec].buf += bytesSent;
+		vecs[firstVec].len -= bytesSent;
+#else
+		while((size_t)bytesSent >= vecs[firstVec].iov_len)
+			bytesSent -= (int)vecs[firstVec++].iov_len;
+		vecs[firstVec].iov_base = (char*)vecs[firstVec].iov_base + bytesSent;
+		vecs[firstVec].iov_len -= bytesSent;
+#endif
+
+		// Like Send(), wait for the rest of the data to go out, so that only whole messages are ever sent.
+		const int socketWriteTimeout = 5000; // msecs.
+		if (!WaitForSendReady(socketWriteTimeout))
+		{
+			KNET_LOG(LogError, "Socket::SendGather: Warning! Managed to only partially send out %d bytes out of %d bytes, and socket did not transition to write-ready in the timeout period. Closing connection.",
+				(int)(numBytes - bytesLeft), (int)numBytes);
+			Close();
+			return false;
+		}
+	}
+	KNET_LOG(LogData, "Socket::SendGather: Sent out %d bytes from %d buffers to socket %s.", (int)numBytes, numVecs, ToString().c_str());
+	return true;
+}
+
+int Socket::SendFileData(const DatagramBuffer &file, size_t offset, size_t numBytes)
+{
+	assert(IsStreamTransportLayer(transport));
+	assert(file.IsMappedFile());
+	assert(offset + numBytes <= file.Capacity());
+	if (connectSocket == INVALID_SOCKET || !writeOpen)
+	{
+		KNET_LOG(LogError, "Trying to send file data to a socket that is not open for writing!");
+		return -1;
+	}
+
+	if (sharedMemoryChannel)
+	{
+		// As with a socket, send what fits. The ring is waited for like a full socket send buffer.
+		const size_t bytesSent = sharedMemoryChannel->Write(file.Data() + offset, numBytes);
+		if (bytesSent == 0)
+			sharedMemoryChannel->HasRoomFor(1);
+		return (int)bytesSent;
+	}
+
+#ifdef WIN32
+	// A single call sends at most 1GB, well under the 2GB limit of TransmitFile.
+	const DWORD numBytesToSend = (DWORD)std::min<size_t>(numBytes, 0x40000000);
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)((unsigned long long)offset >> 32);
+	overlapped.hEvent = WSACreateEvent();
+	BOOL success = TransmitFile(connectSocket, (HANDLE)file.FileHandle(), numBytesToSend, 0, &overlapped, NULL, 0);
+	int error = success ? 0 : Network::GetLastError();
+	DWORD bytesSent = 0;
+	if (success || error == WSA_IO_PENDING || error == ERROR_IO_PENDING)
+	{
+		// Wait for the transmission, so that the overlapped structure on the stack stays valid until it completes.
+		DWORD flags = 0;
+		success = WSAGetOverlappedResult(connectSocket, &overlapped, &bytesSent, TRUE, &flags);
+		error = success ? 0 : Network::GetLastError();
+	}
+	WSACloseEvent(overlapped.hEvent);
+	if (!success)
+	{
+		KNET_LOG(LogError, "Socket::SendFileData: TransmitFile failed! Error: %s.", Network::GetErrorString(error).c_str());
+		Close();
+		return -1;
+	}
+	return (int)bytesSent;
+#else
+	// A single call sends at most 1GB, so that the byte count fits the return value.
+	numBytes = std::min<size_t>(numBytes, 0x40000000);
+#ifdef __linux__
+	off_t fileOffset = (off_t)offset;
+	ssize_t bytesSent = sendfile(connectSocket, file.FileDescriptor(), &fileOffset, numBytes);
+#else
+	ssize_t bytesSent = send(connectSocket, file.Data() + offset, numBytes, 0);
+#endif
+	if (bytesSent >= 0)
+	{
+		KNET_LOG(LogData, "Socket::SendFileData: Sent out %d bytes of file data to socket %s.", (int)bytesSent, ToString().c_str());
+		return (int)bytesSent;
+	}
+	int error = Network::GetLastError();
+	if (SendWouldBlock(error))
+		return 0;
+	KNET_LOG(LogError, "Socket::SendFileData failed! Error: %s.", Network::GetErrorString(error).c_str());
+	Close();
+	return -1;
+#endif
+}
+
 bool Socket::WaitForSendReady(int msecs)
 {
 #ifdef WIN32
@@ -786,6 +1530,15 @@ bool Socket::WaitForSendReady(int msecs)
 	int ret = select(0, NULL, &writeSet, NULL, &tv);
 	return ret != KNET_SOCKET_ERROR && ret != 0;
 #else
+	if (sharedMemoryChannel)
+	{
+		// The peer rings the doorbell when it reads from the full ring. Any other doorbells are cleared as well, since the
+		// receive event of the socket stays raised while there are bytes in the ring.
+		while(!sharedMemoryChannel->HasRoomFor(1))
+			if (!ClearDoorbell() || (!sharedMemoryChannel->HasRoomFor(1) && !Event(connectSocket, EventWaitRead).Wait(msecs)))
+				return false;
+		return true;
+	}
 	Event waitEvent(connectSocket, EventWaitWrite);
 	return waitEvent.Wait(msecs);
 #endif
@@ -806,9 +1559,10 @@ bool Socket::IsOverlappedSendReady()
 		FALSE, &flags);
 	return ret == TRUE;
 #else
-	EventArray ea;
-	ea.AddEvent(Event(connectSocket, EventWaitWrite));
-	return ea.Wait(0) == 0;
+	// A full ring asks the peer to ring the doorbell once it has read enough to make room for a batch of messages.
+	if (sharedMemoryChannel)
+		return sharedMemoryChannel->HasRoomFor(SharedMemoryChannel::cRingSize / 16);
+	return Event(connectSocket, EventWaitWrite).Test();
 #endif
 }
 
@@ -817,6 +1571,27 @@ OverlappedTransferBuffer *Socket::BeginSend(int maxBytesToSend)
 	if (!writeOpen)
 		return 0;
 
+#ifdef KNET_USE_RIO
+	// The datagrams to a socket that has a request queue in the RegisteredIO of this thread are sent from its registered pool.
+	RegisteredIO *rio = RegisteredIO::ThreadRIO();
+	if (rio && transport == SocketOverUDP && rio->HasRequestQueue(connectSocket))
+	{
+		OverlappedTransferBuffer *buffer = rio->AllocateBuffer(maxBytesToSend);
+		if (buffer)
+			return buffer;
+	}
+#endif
+#ifdef KNET_USE_AF_XDP
+	// The datagrams to the clients that the XdpSocket of this thread knows the route to are written straight to its frames.
+	XdpSocket *xdp = XdpSocket::ThreadXdp();
+	if (xdp && transport == SocketOverUDP && type == ServerClientSocket && xdp->CanSend(udpPeerAddress))
+	{
+		OverlappedTransferBuffer *buffer = xdp->AllocateBuffer(maxBytesToSend);
+		if (buffer)
+			return buffer;
+	}
+#endif
+
 	// See if the oldest one of the previously submitted transfers has now finished,
 	// and reuse that buffer without allocating a new one, if so.
 #ifdef WIN32
@@ -834,8 +1609,8 @@ OverlappedTransferBuffer *Socket::BeginSend(int maxBytesToSend)
             // If the buffer we pulled off was too small, free it and allocate a new one which is of the desired size.
             if (sentData->bytesAllocated < maxBytesToSend)
             {
-                DeleteOverlappedTransferBuffer(sentData);
-	            return AllocateOverlappedTransferBuffer(maxBytesToSend); ///\todo In debug mode - track this pointer.
+                ReleaseTransferBuffer(sentData);
+	            return AllocateTransferBuffer(maxBytesToSend); ///\todo In debug mode - track this pointer.
             }
             else
             {
@@ -860,7 +1635,7 @@ OverlappedTransferBuffer *Socket::BeginSend(int maxBytesToSend)
 #endif
 
 	// No previous send buffer has finished from use (or not using overlapped transfers) - allocate a new buffer.
-	return AllocateOverlappedTransferBuffer(maxBytesToSend);
+	return AllocateTransferBuffer(maxBytesToSend);
 }
 
 bool Socket::EndSend(OverlappedTransferBuffer *sendBuffer)
@@ -873,6 +1648,22 @@ bool Socket::EndSend(OverlappedTransferBuffer *sendBuffer)
 	// number of bytes the user had filled into the buffer.
 	sendBuffer->buffer.len = sendBuffer->bytesContains;
 
+#ifdef KNET_USE_RIO
+	if (sendBuffer->registeredIO)
+	{
+		if (sendBuffer->registeredIO == RegisteredIO::ThreadRIO() && writeOpen && connectSocket != INVALID_SOCKET &&
+			sendBuffer->registeredIO->Send(connectSocket, sendBuffer, (type != ClientSocket) ? &udpPeerAddress : 0))
+		{
+			KNET_LOG(LogData, "Socket::EndSend: Queued %d bytes to socket %s.", (int)sendBuffer->buffer.len, ToString().c_str());
+			return true;
+		}
+		// A registered buffer has no event for an overlapped send, so send the datagram synchronously if its request queue is full.
+		bool success = writeOpen && Send(sendBuffer->buffer.buf, sendBuffer->buffer.len);
+		ReleaseTransferBuffer(sendBuffer);
+		return success;
+	}
+#endif
+
 #ifdef WIN32
 	// Clear the event flag so that the completion of WSASend can trigger this and signal us.
 	WSAResetEvent(sendBuffer->overlapped.hEvent);
@@ -889,13 +1680,13 @@ bool Socket::EndSend(OverlappedTransferBuffer *sendBuffer)
 	int error = (ret == 0) ? 0 : Network::GetLastError();
 	if (ret != 0 && error != WSA_IO_PENDING)
 	{
-		if (error != KNET_EWOULDBLOCK)
+		if (error != KNET_EWOULDBLOCK && !(error == KNET_EMSGSIZE && transport == SocketOverUDP))
 		{
 			KNET_LOG(LogError, "Socket::EndSend() failed! Error: %s.", Network::GetErrorString(error).c_str());
 			if (!IsUDPServerSocket())
 				writeOpen = false;
 		}
-		DeleteOverlappedTransferBuffer(sendBuffer);
+		ReleaseTransferBuffer(sendBuffer);
 		return false;
 	}
 
@@ -911,53 +1702,309 @@ bool Socket::EndSend(OverlappedTransferBuffer *sendBuffer)
 	return true;
 
 #elif defined(KNET_UNIX) || defined(ANDROID)
+#ifdef KNET_USE_AF_XDP
+	if (sendBuffer->xdpSocket)
+	{
+		if (sendBuffer->xdpSocket == XdpSocket::ThreadXdp() && writeOpen && sendBuffer->xdpSocket->Send(sendBuffer, udpPeerAddress, LocalPort()))
+		{
+			KNET_LOG(LogData, "Socket::EndSend: Queued %d bytes to socket %s through AF_XDP.", (int)sendBuffer->buffer.len, ToString().c_str());
+			return true;
+		}
+		// The TX ring is full. Send the datagram through the kernel instead.
+		bool success = writeOpen && Send(sendBuffer->buffer.buf, sendBuffer->buffer.len);
+		ReleaseTransferBuffer(sendBuffer);
+		return success;
+	}
+#endif
+#ifdef KNET_USE_IO_URING
+	// On a worker thread, datagrams are queued to the io_uring of the thread and all of them are submitted at once at the
+	// end of its round. TCP sends stay synchronous, since asynchronous sends to a stream could complete partially.
+	IoUring *ring = IoUring::ThreadRing();
+	if (ring && transport == SocketOverUDP && type != ServerListenSocket && writeOpen && connectSocket != INVALID_SOCKET)
+	{
+		// sendto() to a connected socket causes EISCONN on OSX, so the client sockets send without an address, like in Send().
+		if (ring->Send(connectSocket, sendBuffer, (type != ClientSocket) ? &udpPeerAddress : 0))
+		{
+			KNET_LOG(LogData, "Socket::EndSend: Queued %d bytes to socket %s.", (int)sendBuffer->buffer.len, ToString().c_str());
+			return true;
+		}
+	}
+#endif
+	if (batchingDatagrams && transport == SocketOverUDP && type != ServerListenSocket && writeOpen && connectSocket != INVALID_SOCKET)
+	{
+		datagramBatch.push_back(sendBuffer);
+		if ((int)datagramBatch.size() >= cMaxDatagramsPerSendBatch)
+			SendDatagramBatch();
+		return true;
+	}
 	bool success = Send(sendBuffer->buffer.buf, sendBuffer->buffer.len);
-	DeleteOverlappedTransferBuffer(sendBuffer);
+	ReleaseTransferBuffer(sendBuffer);
 	return success;
 #endif
 }
 
+void Socket::SetUDPOffloadEnabled(bool enabled)
+{
+	udpOffloadEnabled = enabled;
+	if (!enabled && receiveOffloadActive)
+		receiveOffloadActive = !SetReceiveOffload(false);
+}
+
+bool Socket::SetDontFragment(bool enabled)
+{
+	if (transport != SocketOverUDP || connectSocket == INVALID_SOCKET)
+		return false;
+#if defined(__linux__) && defined(IP_MTU_DISCOVER)
+	// IP_PMTUDISC_PROBE sets the flag, but ignores the path MTU the kernel has learnt from ICMP, which the probing replaces.
+#ifdef IP_PMTUDISC_PROBE
+	int value = enabled ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+#else
+	int value = enabled ? IP_PMTUDISC_DO : IP_PMTUDISC_DONT;
+#endif
+	int ret = setsockopt(connectSocket, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value));
+#elif defined(WIN32)
+	DWORD value = enabled ? TRUE : FALSE;
+	int ret = setsockopt(connectSocket, IPPROTO_IP, IP_DONTFRAGMENT, (const char *)&value, sizeof(value));
+#elif defined(IP_DONTFRAG)
+	int value = enabled ? 1 : 0;
+	int ret = setsockopt(connectSocket, IPPROTO_IP, IP_DONTFRAG, &value, sizeof(value));
+#else
+	int ret = KNET_SOCKET_ERROR;
+#endif
+	if (ret != 0)
+	{
+		KNET_LOG(LogVerbose, "Socket::SetDontFragment: Setting the Don't Fragment flag failed: %s in socket %s.", Network::GetLastErrorString().c_str(), ToString().c_str());
+		return false;
+	}
+	return true;
+}
+
+bool Socket::SetBusyPoll(int usecs)
+{
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+	if (connectSocket == INVALID_SOCKET)
+		return false;
+	int value = max(usecs, 0);
+	if (setsockopt(connectSocket, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) != 0)
+	{
+		KNET_LOG(LogVerbose, "Socket::SetBusyPoll: setsockopt(SO_BUSY_POLL, %d) failed: %s in socket %s.", value, Network::GetLastErrorString().c_str(), ToString().c_str());
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool Socket::SetIncomingCPU(int cpu)
+{
+#if defined(__linux__) && defined(SO_INCOMING_CPU)
+	if (connectSocket == INVALID_SOCKET)
+		return false;
+	if (setsockopt(connectSocket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0)
+	{
+		KNET_LOG(LogVerbose, "Socket::SetIncomingCPU: setsockopt(SO_INCOMING_CPU, %d) failed: %s in socket %s.", cpu, Network::GetLastErrorString().c_str(), ToString().c_str());
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool Socket::SetReceiveOffload(bool enabled)
+{
+#if defined(__linux__) && defined(UDP_GRO)
+	if (transport != SocketOverUDP || connectSocket == INVALID_SOCKET)
+		return false;
+	int value = enabled ? 1 : 0;
+	if (setsockopt(connectSocket, IPPROTO_UDP, UDP_GRO, &value, sizeof(value)) != 0)
+	{
+		KNET_LOG(LogVerbose, "Socket::SetReceiveOffload: setsockopt(UDP_GRO) failed: %s in socket %s.", Network::GetLastErrorString().c_str(), ToString().c_str());
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+void Socket::BeginDatagramBatch()
+{
+	batchingDatagrams = (transport == SocketOverUDP);
+}
+
+void Socket::EndDatagramBatch()
+{
+	batchingDatagrams = false;
+	SendDatagramBatch();
+}
+
+void Socket::SendDatagramBatch()
+{
+	if (datagramBatch.empty())
+		return;
+
+#ifdef __linux__
+	size_t numSent = 0;
+	while(numSent < datagramBatch.size() && writeOpen && connectSocket != INVALID_SOCKET)
+	{
+		mmsghdr msgs[cMaxDatagramsPerSendBatch];
+		iovec iovs[cMaxDatagramsPerSendBatch];
+		char controls[cMaxDatagramsPerSendBatch][CMSG_SPACE(sizeof(u16))];
+		size_t msgEnd[cMaxDatagramsPerSendBatch]; // The index one past the last datagram that each message carries.
+		int numMsgs = 0;
+		int numIovs = 0;
+		size_t next = numSent;
+		while(next < datagramBatch.size() && numIovs < cMaxDatagramsPerSendBatch)
+		{
+			// With segmentation offload, a run of equal-sized datagrams, optionally ending in a shorter one, goes to the
+			// kernel as a single message that the kernel (or the network card) cuts back to the datagrams.
+			const size_t first = next;
+			const unsigned long segmentSize = datagramBatch[next++]->buffer.len;
+			unsigned long totalSize = segmentSize;
+			if (udpOffloadEnabled)
+				while(next < datagramBatch.size() && numIovs + (int)(next - first) < cMaxDatagramsPerSendBatch && (int)(next - first) < cMaxSegmentsPerSend)
+				{
+					const unsigned long size = datagramBatch[next]->buffer.len;
+					if (size > segmentSize || totalSize + size > cMaxSegmentedSendSize)
+						break;
+					totalSize += size;
+					++next;
+					if (size < segmentSize)
+						break; // Only the last segment may be shorter.
+				}
+
+			mmsghdr &msg = msgs[numMsgs];
+			memset(&msg, 0, sizeof(msg));
+			for(size_t i = first; i < next; ++i)
+			{
+				iovs[numIovs + i - first].iov_base = datagramBatch[i]->buffer.buf;
+				iovs[numIovs + i - first].iov_len = datagramBatch[i]->buffer.len;
+			}
+			msg.msg_hdr.msg_iov = &iovs[numIovs];
+			msg.msg_hdr.msg_iovlen = next - first;
+			numIovs += (int)(next - first);
+			// sendto() to a connected socket causes EISCONN on OSX, so the client sockets send without an address, like in Send().
+			if (type != ClientSocket)
+			{
+				msg.msg_hdr.msg_name = &udpPeerAddress;
+				msg.msg_hdr.msg_namelen = sizeof(udpPeerAddress);
+			}
+			if (next - first > 1)
+			{
+				msg.msg_hdr.msg_control = controls[numMsgs];
+				msg.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(u16));
+				cmsghdr *cmsg = CMSG_FIRSTHDR(&msg.msg_hdr);
+				cmsg->cmsg_level = IPPROTO_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(u16));
+				const u16 gsoSize = (u16)segmentSize;
+				memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+			}
+			msgEnd[numMsgs++] = next;
+		}
+
+		int numMsgsSent = sendmmsg(connectSocket, msgs, numMsgs, 0);
+		if (numMsgsSent <= 0)
+		{
+			int error = Network::GetLastError();
+			if (error == KNET_EWOULDBLOCK || error == KNET_EMSGSIZE)
+			{
+				KNET_LOG(LogVerbose, "Socket::SendDatagramBatch: %s, dropping %d datagrams in socket %s.", 
+					(error == KNET_EWOULDBLOCK) ? "Send buffer full" : "Datagram too large for the path", (int)(datagramBatch.size() - numSent), ToString().c_str());
+				break;
+			}
+			if (udpOffloadEnabled && (error == EIO || error == EINVAL || error == ENOPROTOOPT || error == EOPNOTSUPP))
+			{
+				// The kernel or the network device does not support segmentation offload. Send the datagrams one by one.
+				KNET_LOG(LogInfo, "Socket::SendDatagramBatch: UDP segmentation offload failed: %s. Disabling it in socket %s.",
+					Network::GetErrorString(error).c_str(), ToString().c_str());
+				udpOffloadEnabled = false;
+				continue;
+			}
+			KNET_LOG(LogError, "Socket::SendDatagramBatch: sendmmsg failed! Error: %s.", Network::GetErrorString(error).c_str());
+			// Like in Send(), UDP slave sockets share the socket handle of the server, so they can only be soft-closed.
+			if (type == ServerClientSocket)
+			{
+				readOpen = false;
+				writeOpen = false;
+			}
+			else
+				Close();
+			break;
+		}
+		KNET_LOG(LogData, "Socket::SendDatagramBatch: Sent out %d datagrams in %d messages to socket %s.", (int)(msgEnd[numMsgsSent-1] - numSent),
+			numMsgsSent, ToString().c_str());
+		numSent = msgEnd[numMsgsSent-1];
+	}
+#else
+	for(size_t i = 0; i < datagramBatch.size() && writeOpen; ++i)
+		Send(datagramBatch[i]->buffer.buf, datagramBatch[i]->buffer.len);
+#endif
+	FreeDatagramBatch();
+}
+
+void Socket::FreeDatagramBatch()
+{
+	for(size_t i = 0; i < datagramBatch.size(); ++i)
+		ReleaseTransferBuffer(datagramBatch[i]);
+	datagramBatch.clear();
+}
+
 void Socket::AbortSend(OverlappedTransferBuffer *send)
 {
 	if (!writeOpen)
 	{
-		DeleteOverlappedTransferBuffer(send);
+		ReleaseTransferBuffer(send);
 		return;
 	}
 
+#ifdef KNET_USE_RIO
+	// Registered buffers are never queued for overlapped sends. Return it to the pool right away.
+	if (send->registeredIO)
+	{
+		ReleaseTransferBuffer(send);
+		return;
+	}
+#endif
+
 #ifdef WIN32
 	// Set the event flag so as to signal that this buffer is completed immediately.
 	if (WSASetEvent(send->overlapped.hEvent) != TRUE)
 	{
 		KNET_LOG(LogError, "Socket::AbortSend: WSASetEvent failed!");
-		DeleteOverlappedTransferBuffer(send);
+		ReleaseTransferBuffer(send);
 		return;
 	}
 	bool success = queuedSendBuffers.Insert(send);
 	if (!success)
 	{
 		KNET_LOG(LogError, "queuedSendBuffers.Insert(send); failed! AbortOverlappedSend");
-		DeleteOverlappedTransferBuffer(send);
+		ReleaseTransferBuffer(send);
 	}
 #else
-	DeleteOverlappedTransferBuffer(send);
+	ReleaseTransferBuffer(send);
 #endif
 }
 
 std::string Socket::ToString() const
 {
 	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
 	socklen_t namelen = sizeof(addr);
-	int peerRet = getpeername(connectSocket, (sockaddr*)&addr, &namelen); // Note: This works only if family==INETv4
+	// The socket of a shared memory connection is not an IP socket.
+	const bool ipSocket = (transport != SocketOverSharedMemory);
+	int peerRet = ipSocket ? getpeername(connectSocket, (sockaddr*)&addr, &namelen) : -1; // Note: This works only if family==INETv4
 	EndPoint peerName = EndPoint::FromSockAddrIn(addr);
 
-	int sockRet = getsockname(connectSocket, (sockaddr*)&addr, &namelen); // Note: This works only if family==INETv4
+	int sockRet = ipSocket ? getsockname(connectSocket, (sockaddr*)&addr, &namelen) : -1; // Note: This works only if family==INETv4
 	EndPoint sockName = EndPoint::FromSockAddrIn(addr);
 
 	char str[256];
 	sprintf(str, "%s:%d (%s, connected=%s, readOpen: %s, writeOpen: %s, maxSendSize=%d, sock: %s, peer: %s, socket: %d, this: %p)", 
 		DestinationAddress(), (int)DestinationPort(), 
-		(transport == SocketOverTCP) ? "TCP" : (IsUDPServerSocket() ? "UDP server" : (IsUDPSlaveSocket() ? "UDP Slave" : "UDP")), 
+		(transport != SocketOverUDP) ? SocketTransportLayerToString(transport).c_str() : (IsUDPServerSocket() ? "UDP server" : (IsUDPSlaveSocket() ? "UDP Slave" : "UDP")), 
 		Connected() ? "true" : "false", readOpen ? "true" : "false", writeOpen ? "true" : "false",
 		(int)maxSendSize, sockRet == 0 ? sockName.ToString().c_str() : "(-)", 
 		peerRet == 0 ? peerName.ToString().c_str() : "(-)", (int)connectSocket,
@@ -979,16 +2026,40 @@ void Socket::SetNaglesAlgorithmEnabled(bool enabled)
 		return;
 	}
 
+	// TCP_NODELAY disables Nagle's algorithm.
 #ifdef WIN32
-	BOOL nagleEnabled = enabled ? TRUE : FALSE;
-	int ret = setsockopt(connectSocket, IPPROTO_TCP, TCP_NODELAY, (const char *)&nagleEnabled, sizeof(nagleEnabled));
+	BOOL noDelay = enabled ? FALSE : TRUE;
+	int ret = setsockopt(connectSocket, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
 #else
-	int nagleEnabled = enabled ? 1 : 0;
-	int ret = setsockopt(connectSocket, IPPROTO_TCP, TCP_NODELAY, &nagleEnabled, sizeof(nagleEnabled));
+	int noDelay = enabled ? 0 : 1;
+	int ret = setsockopt(connectSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
 #endif
 	if (ret != 0)
 		KNET_LOG(LogError, "Setting TCP_NODELAY=%s for socket %d failed. Reason: %s.",
-			enabled ? "true" : "false", (int)connectSocket, Network::GetLastErrorString().c_str());
+			enabled ? "false" : "true", (int)connectSocket, Network::GetLastErrorString().c_str());
+}
+
+bool Socket::SetTCPCorked(bool corked)
+{
+	if (connectSocket == INVALID_SOCKET || transport != SocketOverTCP)
+		return false;
+
+#if defined(TCP_CORK) || defined(TCP_NOPUSH)
+	int value = corked ? 1 : 0;
+#ifdef TCP_CORK
+	int ret = setsockopt(connectSocket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#else
+	int ret = setsockopt(connectSocket, IPPROTO_TCP, TCP_NOPUSH, &value, sizeof(value));
+#endif
+	if (ret != 0)
+	{
+		KNET_LOG(LogVerbose, "Setting the cork of socket %s to %d failed. Reason: %s.", ToString().c_str(), value, Network::GetLastErrorString().c_str());
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
 }
 
 } // ~kNet
@@ -0,0 +1,156 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file SourceAddressFilter.cpp
+	@brief */
+
+#include <cstring>
+#include <algorithm>
+
+#include "kNet/SourceAddressFilter.h"
+#include "kNet/Atomics.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+SourceAddressFilter::SourceAddressFilter()
+:rate(0.f), burstSize(0.f), numBans(0), numBannedDrops(0), numRateLimitedDrops(0)
+{
+	Bucket freeBucket;
+	memset(&freeBucket, 0, sizeof(freeBucket));
+	buckets.resize(cNumSets * cNumWays, freeBucket);
+}
+
+void SourceAddressFilter::SetRateLimit(float unitsPerSec, float burstSize_)
+{
+	rate = (unitsPerSec > 0.f) ? unitsPerSec : 0.f;
+	burstSize = std::max(burstSize_, 1.f);
+	// Start everyone from a full bucket, so that the new limit applies the same way to all the sources.
+	for(size_t i = 0; i < buckets.size(); ++i)
+		buckets[i].address = 0;
+}
+
+u32 SourceAddressFilter::Address(const EndPoint &endPoint)
+{
+	u32 address;
+	memcpy(&address, endPoint.ip, sizeof(address));
+	return address;
+}
+
+void SourceAddressFilter::PublishBans(const std::vector<u32> &newBans)
+{
+	bans.Publish(newBans);
+	numBans = (long)newBans.size();
+}
+
+void SourceAddressFilter::Ban(const EndPoint &endPoint)
+{
+	const u32 address = Address(endPoint);
+	std::vector<u32> newBans = *bans.Acquire();
+	std::vector<u32>::iterator iter = std::lower_bound(newBans.begin(), newBans.end(), address);
+	if (iter != newBans.end() && *iter == address)
+		return;
+	newBans.insert(iter, address);
+	PublishBans(newBans);
+}
+
+void SourceAddressFilter::Unban(const EndPoint &endPoint)
+{
+	const u32 address = Address(endPoint);
+	std::vector<u32> newBans = *bans.Acquire();
+	std::vector<u32>::iterator iter = std::lower_bound(newBans.begin(), newBans.end(), address);
+	if (iter == newBans.end() || *iter != address)
+		return;
+	newBans.erase(iter);
+	PublishBans(newBans);
+}
+
+void SourceAddressFilter::ClearBans()
+{
+	if (numBans > 0)
+		PublishBans(std::vector<u32>());
+}
+
+bool SourceAddressFilter::IsBanned(const EndPoint &endPoint) const
+{
+	if (numBans == 0)
+		return false;
+	VersionedSnapshot<std::vector<u32> >::Ref list = bans.Acquire();
+	return std::binary_search(list->begin(), list->end(), Address(endPoint));
+}
+
+float SourceAddressFilter::TokensAt(const Bucket &bucket, u32 nowMSecs) const
+{
+	if (bucket.address == 0)
+		return burstSize;
+	const float tokens = bucket.tokens + rate * (float)(nowMSecs - bucket.lastRefillMSecs) / 1000.f;
+	return std::min(tokens, (float)burstSize);
+}
+
+bool SourceAddressFilter::Admit(const EndPoint &source, tick_t now)
+{
+	if (IsBanned(source))
+	{
+		AtomicIncrement(&numBannedDrops);
+		return false;
+	}
+	if (rate <= 0.f)
+		return true;
+
+	const u32 address = Address(source);
+	const u32 nowMSecs = (u32)(now / Clock::TicksPerMillisecond());
+	Bucket *set = &buckets[((address * 2654435761U) >> 22) % cNumSets * cNumWays];
+
+	// Find the bucket of the source, or else the bucket that has been the least active.
+	Bucket *bucket = 0;
+	Bucket *idlest = set;
+	float idlestTokens = -1.f;
+	for(int i = 0; i < cNumWays; ++i)
+	{
+		if (set[i].address == address)
+		{
+			bucket = &set[i];
+			break;
+		}
+		const float tokens = TokensAt(set[i], nowMSecs);
+		if (tokens > idlestTokens)
+		{
+			idlest = &set[i];
+			idlestTokens = tokens;
+		}
+	}
+	float tokens;
+	if (bucket)
+		tokens = TokensAt(*bucket, nowMSecs);
+	else
+	{
+		bucket = idlest;
+		bucket->address = address;
+		tokens = burstSize;
+	}
+
+	bucket->lastRefillMSecs = nowMSecs;
+	if (tokens < 1.f)
+	{
+		bucket->tokens = tokens;
+		AtomicIncrement(&numRateLimitedDrops);
+		return false;
+	}
+	bucket->tokens = tokens - 1.f;
+	return true;
+}
+
+} // ~kNet
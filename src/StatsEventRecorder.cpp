@@ -0,0 +1,220 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file StatsEventRecorder.cpp
+	@brief */
+
+#include <algorithm>
+#include <map>
+#include <cstdio>
+#include <cstring>
+
+#include "kNet/StatsEventRecorder.h"
+#include "kNet/Atomics.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+namespace
+{
+struct StatsCounterTable
+{
+	std::map<std::string, stats_counter_t> handles;
+	/// The name and the value type of each counter, at the index handle-1.
+	std::vector<std::pair<std::string, std::string> > counters;
+};
+
+/// Constructed before main() runs, so before any events can be added.
+Lockable<StatsCounterTable> counterTable;
+}
+
+stats_counter_t StatsCounterRegistry::Register(const char *name, const char *valueType)
+{
+	Lock<StatsCounterTable> table = counterTable.Acquire();
+	std::map<std::string, stats_counter_t>::iterator iter = table->handles.find(name);
+	if (iter != table->handles.end())
+		return iter->second;
+
+	table->counters.push_back(std::make_pair(std::string(name), std::string(valueType)));
+	const stats_counter_t handle = (stats_counter_t)table->counters.size();
+	table->handles[name] = handle;
+	return handle;
+}
+
+MessageStatsCounters::MessageStatsCounters(const char *prefix_)
+:prefix(prefix_)
+{
+	memset(entries, 0, sizeof(entries));
+}
+
+stats_counter_t MessageStatsCounters::Register(message_id_t id, const char *name) const
+{
+	std::string str = std::string(prefix) + ".";
+	if (name && *name)
+		str += name;
+	else
+	{
+		char idStr[16];
+		sprintf(idStr, "%u", (unsigned int)id);
+		str += idStr;
+	}
+	return StatsCounterRegistry::Register(str.c_str(), "bytes");
+}
+
+size_t StatsCounterRegistry::NumCounters()
+{
+	Lock<StatsCounterTable> table = counterTable.Acquire();
+	return table->counters.size();
+}
+
+void StatsCounterRegistry::GetCounter(stats_counter_t counter, std::string &name, std::string &valueType)
+{
+	Lock<StatsCounterTable> table = counterTable.Acquire();
+	assert(counter >= 1 && counter <= table->counters.size());
+	name = table->counters[counter-1].first;
+	valueType = table->counters[counter-1].second;
+}
+
+StatsEventRecorder::StatsEventRecorder()
+:numSlots(0), numDroppedEvents(0)
+{
+	for(int i = 0; i < cMaxThreadSlots; ++i)
+		slots[i] = 0;
+}
+
+StatsEventRecorder::~StatsEventRecorder()
+{
+	for(int i = 0; i < cMaxThreadSlots; ++i)
+		delete slots[i];
+}
+
+StatsEventRecorder::ThreadSlot *StatsEventRecorder::FindOrCreateSlot()
+{
+	const ThreadId thread = Thread::CurrentThreadId();
+	const long n = numSlots;
+	for(long i = 0; i < n; ++i)
+		if (slots[i] && slots[i]->thread == thread)
+			return slots[i];
+
+	// This is the first event of this thread. Another thread may have added its slot meanwhile, so scan again under the lock.
+	Lock<int> lock = slotMutex.Acquire();
+	for(long i = 0; i < numSlots; ++i)
+		if (slots[i]->thread == thread)
+			return slots[i];
+	if (numSlots >= cMaxThreadSlots)
+		return 0;
+
+	slots[numSlots] = new ThreadSlot(thread);
+	FullMemoryBarrier(); // The slot must be visible before the count that publishes it.
+	AtomicIncrement(&numSlots);
+	return slots[numSlots-1];
+}
+
+void StatsEventRecorder::AddEvent(stats_counter_t counter, float value)
+{
+	assert(counter != 0);
+	ThreadSlot *slot = FindOrCreateSlot();
+	if (!slot)
+	{
+		AtomicIncrement(&numDroppedEvents);
+		return;
+	}
+
+	PendingEvent e;
+	e.counter = counter;
+	e.value = value;
+	e.time = Clock::Tick();
+	if (slot->events.Insert(e))
+		return;
+
+	// The queue is full. Empty it into the hierarchy ourselves, unless someone else is already doing that.
+	StatsEventHierarchyNode *root = hierarchy.TryLockGet();
+	if (root)
+	{
+		Flush(*root);
+		hierarchy.Unlock();
+		if (slot->events.Insert(e))
+			return;
+	}
+	AtomicIncrement(&numDroppedEvents);
+}
+
+Lock<StatsEventHierarchyNode> StatsEventRecorder::AcquireHierarchy()
+{
+	Lock<StatsEventHierarchyNode> lock = hierarchy.Acquire();
+	Flush(*lock);
+	return lock;
+}
+
+bool StatsEventRecorder::EventTimeLess(const PendingEvent &a, const PendingEvent &b)
+{
+	return a.time != b.time && Clock::IsNewer(b.time, a.time);
+}
+
+void StatsEventRecorder::Flush(StatsEventHierarchyNode &root)
+{
+	flushBuffer.clear();
+	// Take only the events that were recorded before we started, so that a busy thread can't keep us here, and so that
+	// the next flush doesn't get events older than the ones of this flush from the threads we drained first.
+	const tick_t cutoffTime = Clock::Tick();
+	const long n = numSlots;
+	for(long i = 0; i < n; ++i)
+	{
+		ThreadSlot *slot = slots[i];
+		if (!slot)
+			continue;
+		for(int numEvents = slot->events.Size(); numEvents > 0; --numEvents)
+		{
+			const PendingEvent *e = slot->events.Front();
+			if (e->time != cutoffTime && Clock::IsNewer(e->time, cutoffTime))
+				break;
+			flushBuffer.push_back(*e);
+			slot->events.PopFront();
+		}
+	}
+	if (flushBuffer.empty())
+		return;
+
+	// The hierarchy keeps the events of each node in time order, so merge the events of the different threads.
+	std::stable_sort(flushBuffer.begin(), flushBuffer.end(), EventTimeLess);
+
+	const tick_t tooOldTime = Clock::Tick() - (tick_t)cEventOldAgeMSecs * Clock::TicksPerSec() / 1000;
+	counterNodes.assign(StatsCounterRegistry::NumCounters() + 1, 0);
+	std::string name;
+	std::string valueType;
+	for(size_t i = 0; i < flushBuffer.size(); ++i)
+	{
+		const PendingEvent &pending = flushBuffer[i];
+		assert(pending.counter < counterNodes.size());
+		StatsEventHierarchyNode *&node = counterNodes[pending.counter];
+		if (!node)
+		{
+			StatsCounterRegistry::GetCounter(pending.counter, name, valueType);
+			node = root.FindOrCreateChild(name.c_str(), valueType.c_str());
+			node->PruneEventsOlderThan(tooOldTime);
+		}
+		StatsEvent e;
+		e.value = pending.value;
+		e.time = pending.time;
+		// A thread that was preempted between taking the time stamp and queueing the event can still deliver it after
+		// the newer events of the other threads have been flushed. Keep the events of the node in time order.
+		if (node->events.Size() > 0 && Clock::IsNewer(node->events.Back()->time, e.time))
+			e.time = node->events.Back()->time;
+		node->AddEventToThisLevel(e);
+	}
+}
+
+} // ~kNet
@@ -16,6 +16,7 @@
 	@brief */
 
 #include <sstream>
+#include <cmath>
 
 #ifdef KNET_USE_BOOST
 #include <boost/thread/thread.hpp>
@@ -28,6 +29,7 @@
 #include "kNet/DataSerializer.h"
 #include "kNet/DataDeserializer.h"
 #include "kNet/VLEPacker.h"
+#include "kNet/DatagramBuffer.h"
 #include "kNet/NetException.h"
 #include "kNet/Network.h"
 
@@ -38,9 +40,34 @@ namespace kNet
 /// it as a protocol violation and kill the connection.
 static const u32 cMaxReceivableTCPMessageSize = 10 * 1024 * 1024; ///\todo Make this configurable for the connection.
 
+/// The file messages larger than this are passed to the socket straight from the file, instead of through a send buffer.
+static const size_t cMinFileDataSendSize = 64 * 1024;
+/// The most bytes of a file message passed to the socket in one SendOutPacket() call, so that the other connections of
+/// the worker thread get their turn during a long transfer.
+static const size_t cMaxFileDataSendSize = 1024 * 1024;
+
+/// The most messages compressed together into one CompressedData message. The receiver waits for this much room in the
+/// inbound message queue before it unpacks a CompressedData message.
+static const int cMaxCompressedBatchMessages = 256;
+
+/// The messages at least this large are sent straight from their own buffers with a gathering send, instead of being copied
+/// to the send buffer. Copying the smaller ones together costs less than handing them to the socket one by one.
+static const size_t cMinGatherSendSize = 2048;
+
+/// The socket is read straight into the receive ring buffer once it has at least this much free space. Otherwise the
+/// buffer is grown first.
+static const int cMinReceiveSize = 16384;
+
 TCPMessageConnection::TCPMessageConnection(Network *owner, NetworkServer *ownerServer, Socket *socket, ConnectionState startingState)
 :MessageConnection(owner, ownerServer, socket, startingState),
-tcpInboundSocketData(64 * 1024)
+tcpInboundSocketData(64 * 1024),
+outboundFileMessage(0),
+outboundFileBytesSent(0),
+inboundFileMessage(0),
+inboundFileBytesReceived(0),
+holdingOutboundMessages(false),
+holdStartTime(0),
+flushingHeldMessages(false)
 {
 }
 
@@ -48,6 +75,9 @@ TCPMessageConnection::~TCPMessageConnection()
 {
 	if (owner)
 		owner->CloseConnection(this);
+
+	FreeMessage(outboundFileMessage);
+	FreeMessage(inboundFileMessage);
 }
 
 MessageConnection::SocketReadResult TCPMessageConnection::ReadSocket(size_t &totalBytesRead)
@@ -84,13 +114,22 @@ MessageConnection::SocketReadResult TCPMessageConnection::ReadSocket(size_t &tot
 		assert(socket);
 
 		// If we don't have enough free space in the ring buffer (even after compacting), throttle the reading of data.
+		// The exception is a message that is larger than the whole buffer, which can only be parsed once all of it fits.
 		if (tcpInboundSocketData.ContiguousFreeBytesLeft() < 16384 && tcpInboundSocketData.Capacity() > 1048576)
 		{
 			tcpInboundSocketData.Compact();
 			if (tcpInboundSocketData.ContiguousFreeBytesLeft() < 16384)
-				return SocketReadThrottled;
+			{
+				DataDeserializer reader(tcpInboundSocketData.Begin(), tcpInboundSocketData.Size());
+				const u32 messageSize = reader.ReadVLE<VLE8_16_32>();
+				if (inboundFileMessage || messageSize == DataDeserializer::VLEReadError || messageSize > cMaxReceivableTCPMessageSize ||
+					reader.BytePos() + messageSize <= (size_t)tcpInboundSocketData.Capacity())
+					return SocketReadThrottled;
+				tcpInboundSocketData.Resize((int)(reader.BytePos() + messageSize) + 16384);
+			}
 		}
 
+#ifdef WIN32
 		OverlappedTransferBuffer *buffer = socket->BeginReceive();
 		if (!buffer)
 			break; // Nothing to receive.
@@ -117,17 +156,43 @@ MessageConnection::SocketReadResult TCPMessageConnection::ReadSocket(size_t &tot
 		/// from this buffer without copying it to a temporary working buffer. Detect if message straddles
 		/// two OverlappedTransferBuffers and only in that case memcpy that message to form a
 		/// single contiguous memory area.
+		CapturePacket(CaptureInbound, buffer->buffer.buf, buffer->bytesContains);
 		memcpy(tcpInboundSocketData.End(), buffer->buffer.buf, buffer->bytesContains);
 		tcpInboundSocketData.Inserted(buffer->bytesContains); // Mark the memory area in the ring buffer as used.
 
 		totalBytesRead += buffer->bytesContains;
 		socket->EndReceive(buffer);
+#else
+		// Receive straight into the ring buffer. If its memory is mirrored, all of its free space is contiguous, and the
+		// messages are parsed in place even when they wrap around the end of the buffer.
+		if (tcpInboundSocketData.ContiguousFreeBytesLeft() < cMinReceiveSize)
+		{
+			tcpInboundSocketData.Compact();
+			if (tcpInboundSocketData.ContiguousFreeBytesLeft() < cMinReceiveSize)
+			{
+				tcpInboundSocketData.Resize(tcpInboundSocketData.Capacity() * 2);
+				KNET_LOG(LogWaits, "TCPMessageConnection::ReadSocket: Performance warning! Resized the capacity of the receive ring buffer to %d bytes.",
+					tcpInboundSocketData.Capacity());
+			}
+		}
+
+		const size_t bytesRead = socket->Receive(tcpInboundSocketData.End(),
+			min((size_t)tcpInboundSocketData.ContiguousFreeBytesLeft(), maxBytesToRead - totalBytesRead));
+		if (bytesRead == 0)
+			break; // Nothing to receive.
+
+		KNET_LOG(LogData, "TCPMessageConnection::ReadSocket: Received %d bytes from the network from peer %s.",
+			(int)bytesRead, socket->ToString().c_str());
+		CapturePacket(CaptureInbound, tcpInboundSocketData.End(), bytesRead);
+		tcpInboundSocketData.Inserted((int)bytesRead);
+		totalBytesRead += bytesRead;
+#endif
 	}
 
 	// Update statistics about the connection.
 	if (totalBytesRead > 0)
 	{
-		lastHeardTime = Clock::Tick();
+		lastHeardTime = Clock::LoopTick();
 		ADDEVENT("tcpDataIn", (float)totalBytesRead, "bytes");
 		AddInboundStats(totalBytesRead, 1, 0);
 	}
@@ -161,7 +226,7 @@ MessageConnection::PacketSendResult TCPMessageConnection::SendOutPacket()
 {
 	AssertInWorkerThreadContext();
 
-	if (bOutboundSendsPaused || outboundQueue.Size() == 0)
+	if (bOutboundSendsPaused || (outboundQueue.Size() == 0 && !outboundFileMessage))
 		return PacketSendNoMessages;
 
 	if (!socket || !socket->IsWriteOpen())
@@ -174,6 +239,13 @@ MessageConnection::PacketSendResult TCPMessageConnection::SendOutPacket()
 		return PacketSendSocketClosed;
 	}
 
+	if (!SendRateLimitAllowsSend())
+		return PacketSendThrottled;
+
+	// The rest of a file message has to go out before anything else, since it is in the middle of the stream.
+	if (outboundFileMessage)
+		return SendOutFileData();
+
     // 'serializedMessages' is a temporary data structure used only by this member function.
     // It caches a list of all the messages we are pushing out during this call.
 	serializedMessages.clear();
@@ -183,20 +255,26 @@ MessageConnection::PacketSendResult TCPMessageConnection::SendOutPacket()
 	// in the sense that if we encounter a single message that is larger than this limit, then we try
 	// to send that through in one send() call.
 //	const size_t maxSendSize = socket->MaxSendSize();
+	// Under a send rate limit, coalesce at most one burst worth of data, so that the sends are spread out evenly.
+	const size_t maxRateLimitedSendSize = SendRateLimitBurstBytes();
 
 	// Push out all the pending data to the socket.
 	OverlappedTransferBuffer *overlappedTransfer = 0;
 
 	int numMessagesPacked = 0;
+	const bool compress = CompressionNegotiated();
 	DataSerializer writer;
+	// The bytes of the messages in this send, including the contents of the gathered messages that are not in the send buffer.
+	size_t batchSize = 0;
+	// The send goes out as the send buffer ranges and gathered message contents in sendGatherBuffers, if there are any.
+	// scratchStart is where the send buffer range that is not in the list yet starts.
+	sendGatherBuffers.clear();
+	size_t scratchStart = 0;
 //	assert(ContainerUniqueAndNoNullElements(outboundQueue)); // This precondition should always hold (but very heavy to test, uncomment to debug)
+	const tick_t now = Clock::Tick();
 	while(outboundQueue.Size() > 0)
 	{
-#ifdef KNET_NO_MAXHEAP
-		NetworkMessage *msg = *outboundQueue.Front();
-#else
 		NetworkMessage *msg = outboundQueue.Front();
-#endif
 
 		if (msg->obsolete)
 		{
@@ -206,14 +284,28 @@ MessageConnection::PacketSendResult TCPMessageConnection::SendOutPacket()
 			continue;
 		}
 
-		const int encodedMsgIdLength = VLE8_16_32::GetEncodedBitLength(msg->id) / 8;
-		const size_t messageContentSize = msg->dataSize + encodedMsgIdLength; // 1 byte: Message ID. X bytes: Content.
+		if (msg->IsExpiredAt(now))
+		{
+			outboundQueue.PopFront();
+			FreeExpiredMessage(msg);
+			continue;
+		}
+
+		const int encodedMsgIdLength = (int)EncodedMessageIDSize(msg->id);
+		const size_t messageContentSize = msg->dataSize + encodedMsgIdLength; // 1-4 bytes: Message ID. X bytes: Content.
 		const int encodedMsgSizeLength = VLE8_16_32::GetEncodedBitLength(messageContentSize) / 8;
 		const size_t totalMessageSize = messageContentSize + encodedMsgSizeLength; // 2 bytes: Content length. X bytes: Content.
 
+		// A large message read from a file ends the send after its header. The content follows straight from the file.
+		const bool sendFromFile = msg->sharedData && msg->sharedData->IsMappedFile() && msg->dataSize >= cMinFileDataSendSize;
+		// Compression needs the whole batch in the send buffer, so only the uncompressed sends gather.
+		const bool gatherContent = !sendFromFile && !compress && msg->dataSize >= cMinGatherSendSize;
+		const size_t bufferedMessageSize = (sendFromFile || gatherContent) ? totalMessageSize - msg->dataSize : totalMessageSize;
+		const size_t batchedMessageSize = sendFromFile ? bufferedMessageSize : totalMessageSize;
+
         if (!overlappedTransfer)
         {
-            overlappedTransfer = socket->BeginSend(std::max<size_t>(socket->MaxSendSize(), totalMessageSize));
+            overlappedTransfer = socket->BeginSend(std::max<size_t>(socket->MaxSendSize(), bufferedMessageSize));
 	        if (!overlappedTransfer)
 	        {
 		        KNET_LOG(LogError, "TCPMessageConnection::SendOutPacket: Starting an overlapped send failed!");
@@ -224,39 +316,110 @@ MessageConnection::PacketSendResult TCPMessageConnection::SendOutPacket()
         }
 
 		// If this message won't fit into the buffer, send out all previously gathered messages.
-        if (writer.BytesLeft() < totalMessageSize)
+        if (writer.BytesLeft() < bufferedMessageSize)
+			break;
+		if (batchSize > 0 && batchSize + batchedMessageSize > overlappedTransfer->buffer.len)
+			break;
+		if (maxRateLimitedSendSize > 0 && batchSize > 0 && batchSize + batchedMessageSize > maxRateLimitedSendSize)
+			break;
+		if (compress && numMessagesPacked >= cMaxCompressedBatchMessages)
+			break;
+		// Leave room for a send buffer range before the content, and for the one after it.
+		if (gatherContent && (int)sendGatherBuffers.size() + 3 > Socket::cMaxGatherBuffers)
 			break;
 
 		writer.AddVLE<VLE8_16_32>(messageContentSize);
-		writer.AddVLE<VLE8_16_32>(msg->id);
-		if (msg->dataSize > 0)
+		AddMessageID(writer, msg->id);
+
+		if (sendFromFile)
+		{
+			outboundFileMessage = msg;
+			outboundFileBytesSent = 0;
+			outboundQueue.PopFront();
+			batchSize += batchedMessageSize;
+			break;
+		}
+
+		if (gatherContent)
+		{
+			kNetBuffer scratch;
+			scratch.buf = overlappedTransfer->buffer.buf + scratchStart;
+			scratch.len = (unsigned long)(writer.BytesFilled() - scratchStart);
+			sendGatherBuffers.push_back(scratch);
+			kNetBuffer content;
+			content.buf = msg->data;
+			content.len = (unsigned long)msg->dataSize;
+			sendGatherBuffers.push_back(content);
+			scratchStart = writer.BytesFilled();
+		}
+		else if (msg->dataSize > 0)
 			writer.AddAlignedByteArray(msg->data, msg->dataSize);
+		batchSize += totalMessageSize;
 		++numMessagesPacked;
 
 		serializedMessages.push_back(msg);
-#ifdef KNET_NO_MAXHEAP
-		assert(*outboundQueue.Front() == msg);
-#else
 		assert(outboundQueue.Front() == msg);
-#endif
 		outboundQueue.PopFront();
+		MessageTracer::Record(msg->traceID, msg->id, TraceSerialized);
 	}
 //	assert(ContainerUniqueAndNoNullElements(serializedMessages)); // This precondition should always hold (but very heavy to test, uncomment to debug)
 
-	if (writer.BytesFilled() == 0 && outboundQueue.Size() > 0)
+	// All the messages left in the queue were obsolete or expired, and were dropped without starting a send.
+	if (!overlappedTransfer)
+		return PacketSendNoMessages;
+
+	if (batchSize == 0 && outboundQueue.Size() > 0 && !outboundFileMessage)
 		KNET_LOG(LogError, "Failed to send any messages to socket %s! (Probably next message was too big to fit in the buffer).", socket->ToString().c_str());
 
-	overlappedTransfer->bytesContains = writer.BytesFilled();
-	bool success = socket->EndSend(overlappedTransfer);
+	// Replace the batch with a single CompressedData message, if that makes it smaller. A batch that ends in the header
+	// of a file message is sent as is, since the content of the message follows it in the stream.
+	size_t bytesFilled = writer.BytesFilled();
+	if (compress && !outboundFileMessage && bytesFilled >= compressionThreshold)
+	{
+		const size_t idSize = EncodedMessageIDSize(MsgIdCompressedData);
+		const size_t maxContentSize = bytesFilled - idSize - 4 - 1; // The message ID, content length and at least a byte of savings.
+		const size_t contentSize = CompressMessageData(overlappedTransfer->buffer.buf, bytesFilled, maxContentSize);
+		if (contentSize > 0)
+		{
+			DataSerializer compressedWriter(overlappedTransfer->buffer.buf, bytesFilled);
+			compressedWriter.AddVLE<VLE8_16_32>(contentSize + idSize);
+			AddMessageID(compressedWriter, MsgIdCompressedData);
+			compressedWriter.AddAlignedByteArray(&compressionBuffer[0], contentSize);
+			ADDEVENT("compressionSavedBytes", (float)(bytesFilled - compressedWriter.BytesFilled()), "bytes");
+			bytesFilled = compressedWriter.BytesFilled();
+		}
+	}
+
+	bool success;
+	if (sendGatherBuffers.empty())
+	{
+		overlappedTransfer->bytesContains = bytesFilled;
+		CapturePacket(CaptureOutbound, overlappedTransfer->buffer.buf, bytesFilled);
+		success = socket->EndSend(overlappedTransfer);
+	}
+	else
+	{
+		kNetBuffer scratch;
+		scratch.buf = overlappedTransfer->buffer.buf + scratchStart;
+		scratch.len = (unsigned long)(bytesFilled - scratchStart);
+		sendGatherBuffers.push_back(scratch);
+		success = socket->SendGather(&sendGatherBuffers[0], (int)sendGatherBuffers.size());
+		if (success)
+			for(size_t i = 0; i < sendGatherBuffers.size(); ++i)
+				CapturePacket(CaptureOutbound, sendGatherBuffers[i].buf, sendGatherBuffers[i].len);
+		socket->AbortSend(overlappedTransfer);
+		bytesFilled = batchSize;
+	}
 
 	if (!success) // If we failed to send, put all the messages back into the outbound queue to wait for the next send round.
 	{
 		for(size_t i = 0; i < serializedMessages.size(); ++i)
-#ifdef KNET_NO_MAXHEAP
-			outboundQueue.InsertWithResize(serializedMessages[i]);
-#else
 			outboundQueue.Insert(serializedMessages[i]);
-#endif
+		if (outboundFileMessage)
+		{
+			outboundQueue.Insert(outboundFileMessage);
+			outboundFileMessage = 0;
+		}
 //		assert(ContainerUniqueAndNoNullElements(outboundQueue));
 
 		KNET_LOG(LogError, "TCPMessageConnection::SendOutPacket() failed: Could not initiate overlapped transfer!");
@@ -264,22 +427,30 @@ MessageConnection::PacketSendResult TCPMessageConnection::SendOutPacket()
 		return PacketSendSocketFull;
 	}
 
-	KNET_LOG(LogData, "TCPMessageConnection::SendOutPacket: Sent %d bytes (%d messages) to peer %s.", (int)writer.BytesFilled(), (int)serializedMessages.size(), socket->ToString().c_str());
-	AddOutboundStats(writer.BytesFilled(), 1, numMessagesPacked);
-	ADDEVENT("tcpDataOut", (float)writer.BytesFilled(), "bytes");
+	KNET_LOG(LogData, "TCPMessageConnection::SendOutPacket: Sent %d bytes (%d messages) to peer %s.", (int)bytesFilled, (int)serializedMessages.size(), socket->ToString().c_str());
+	AddOutboundStats(bytesFilled, 1, numMessagesPacked);
+	ConsumeSendRateLimit(bytesFilled, 0); // The datagram rate limit does not apply to TCP.
+	ADDEVENT("tcpDataOut", (float)bytesFilled, "bytes");
 
 	// The messages in serializedMessages array are now in the TCP driver to handle. It will guarantee
 	// delivery if possible, so we can free the messages already.
+	const tick_t sentTick = Clock::Tick();
 	for(size_t i = 0; i < serializedMessages.size(); ++i)
 	{
+		if (serializedMessages[i]->queuedTick != 0)
+			samples->latencyHistograms[LatencyQueueTime].RecordTimespan(serializedMessages[i]->queuedTick, sentTick);
+		MessageTracer::Record(serializedMessages[i]->traceID, serializedMessages[i]->id, TraceSent);
 #ifdef KNET_NETWORK_PROFILING
-		std::stringstream ss;
-		if (!serializedMessages[i]->profilerName.empty())
-			ss << "messageOut." << serializedMessages[i]->profilerName;
-		else
-			ss << "messageOut." << serializedMessages[i]->id;
-		ADDEVENT(ss.str().c_str(), (float)serializedMessages[i]->Size(), "bytes");
+		if (owner)
+			owner->AddStatsEvent(samples->outboundMessageCounters.Get(serializedMessages[i]->id, serializedMessages[i]->transfer != 0,
+				serializedMessages[i]->profilerName.c_str()), (float)serializedMessages[i]->Size());
 #endif
+		if (serializedMessages[i]->ackHandler)
+		{
+			IMessageAckHandler *handler = serializedMessages[i]->ackHandler;
+			serializedMessages[i]->ackHandler = 0;
+			handler->HandleMessageAcked(serializedMessages[i]->id, MessageDelivered);
+		}
 		ClearOutboundMessageWithContentID(serializedMessages[i]);
 		FreeMessage(serializedMessages[i]);
 	}
@@ -287,11 +458,71 @@ MessageConnection::PacketSendResult TCPMessageConnection::SendOutPacket()
 	return PacketSendOK;
 }
 
+MessageConnection::PacketSendResult TCPMessageConnection::SendOutFileData()
+{
+	AssertInWorkerThreadContext();
+	assert(outboundFileMessage && outboundFileMessage->sharedData);
+
+	size_t numBytes = std::min(outboundFileMessage->dataSize - outboundFileBytesSent, cMaxFileDataSendSize);
+	const size_t maxRateLimitedSendSize = SendRateLimitBurstBytes();
+	if (maxRateLimitedSendSize > 0)
+		numBytes = std::min(numBytes, maxRateLimitedSendSize);
+
+	const DatagramBuffer &file = *outboundFileMessage->sharedData;
+	const size_t fileOffset = (outboundFileMessage->data - file.Data()) + outboundFileBytesSent;
+	const int bytesSent = socket->SendFileData(file, fileOffset, numBytes);
+	if (bytesSent < 0)
+		return PacketSendSocketClosed;
+	if (bytesSent == 0)
+		return PacketSendSocketFull;
+	CapturePacket(CaptureOutbound, file.Data() + fileOffset, bytesSent);
+
+	outboundFileBytesSent += bytesSent;
+	const bool finished = (outboundFileBytesSent == outboundFileMessage->dataSize);
+	KNET_LOG(LogData, "TCPMessageConnection::SendOutFileData: Sent %d bytes of a file message (%d/%d) to peer %s.", bytesSent,
+		(int)outboundFileBytesSent, (int)outboundFileMessage->dataSize, socket->ToString().c_str());
+	AddOutboundStats(bytesSent, 1, finished ? 1 : 0);
+	ConsumeSendRateLimit(bytesSent, 0);
+	ADDEVENT("tcpDataOut", (float)bytesSent, "bytes");
+
+	if (finished)
+	{
+		ClearOutboundMessageWithContentID(outboundFileMessage);
+		FreeMessage(outboundFileMessage);
+		outboundFileMessage = 0;
+	}
+	return PacketSendOK;
+}
+
 void TCPMessageConnection::DoUpdateConnection() // [worker thread]
 {
 	ExtractMessages();
 }
 
+unsigned long TCPMessageConnection::TimeUntilNextUpdate() const
+{
+	// If the inbound message queue of the application is full, the received data is left unextracted until the
+	// application catches up. Retry this at short intervals, since no socket event is raised for it.
+	if (tcpInboundSocketData.Size() > 0)
+		return 10;
+	return MessageConnection::TimeUntilNextUpdate();
+}
+
+bool TCPMessageConnection::HoldOutboundMessages()
+{
+	const int maxDelay = sendCoalescingDelay;
+	if (maxDelay <= 0 || bOutboundSendsPaused || outboundFileMessage || outboundQueue.Size() == 0 || flushingHeldMessages ||
+		queuedOutboundPriority >= sendCoalescingUrgentPriority)
+		return false;
+
+	if (!holdingOutboundMessages)
+	{
+		holdingOutboundMessages = true;
+		holdStartTime = Clock::Tick();
+	}
+	return acceptedOutboundBytes < sendCoalescingBytes && Clock::MillisecondsSinceD(holdStartTime) * 1000.0 < maxDelay;
+}
+
 void TCPMessageConnection::SendOutPackets()
 {
 	AssertInWorkerThreadContext();
@@ -299,15 +530,33 @@ void TCPMessageConnection::SendOutPackets()
 	if (!socket || !socket->IsWriteOpen() || !socket->IsOverlappedSendReady())
 		return;
 
+	if (HoldOutboundMessages())
+	{
+		// The worker thread keeps waiting on the event while the messages are held, so that the messages queued meanwhile
+		// can fill up the batch early. Only ones that are not accepted yet need to raise it.
+		eventMsgsOutAvailable.Reset();
+		if (outboundAcceptQueue.Size() > 0)
+			eventMsgsOutAvailable.Set();
+		return;
+	}
+
+	// Cork the socket for the duration of the send calls, so that the held messages go out in full segments.
+	const bool corked = (holdingOutboundMessages || flushingHeldMessages) && socket->SetTCPCorked(true);
+	holdingOutboundMessages = false;
+
 	PacketSendResult result = PacketSendOK;
 	int maxSends = 500; // Place an arbitrary limit to how many packets we will send at a time.
 	while(result == PacketSendOK && maxSends-- > 0)
 		result = SendOutPacket();
 
+	if (corked)
+		socket->SetTCPCorked(false);
+	flushingHeldMessages = (sendCoalescingDelay > 0 && outboundQueue.Size() > 0);
+
 	// Thread-safely clear the eventMsgsOutAvailable event if we don't have any messages to process.
-	if (NumOutboundMessagesPending() == 0)
+	if (NumOutboundMessagesPending() == 0 && !outboundFileMessage)
 		eventMsgsOutAvailable.Reset();
-	if (NumOutboundMessagesPending() > 0)
+	if (NumOutboundMessagesPending() > 0 || outboundFileMessage)
 		eventMsgsOutAvailable.Set();
 }
 
@@ -326,21 +575,77 @@ void TCPMessageConnection::ExtractMessages()
 			if (inboundMessageQueue.CapacityLeft() == 0) // If the application can't take in any new messages, abort.
 				break;
 
+			if (inboundFileMessage)
+			{
+				// Move the received part of the content to the file, and deliver the message once all of it is there.
+				const size_t numBytes = std::min((size_t)tcpInboundSocketData.Size(), inboundFileMessage->Size() - inboundFileBytesReceived);
+				memcpy(inboundFileMessage->data + inboundFileBytesReceived, tcpInboundSocketData.Begin(), numBytes);
+				tcpInboundSocketData.Consumed((int)numBytes);
+				inboundFileBytesReceived += numBytes;
+				if (inboundFileBytesReceived < inboundFileMessage->Size())
+					break;
+
+				NetworkMessage *msg = inboundFileMessage;
+				inboundFileMessage = 0;
+				HandleInboundMessage(0, msg);
+				++numMessagesReceived;
+				continue;
+			}
+
 			DataDeserializer reader(tcpInboundSocketData.Begin(), tcpInboundSocketData.Size());
 			u32 messageSize = reader.ReadVLE<VLE8_16_32>();
 			if (messageSize == DataDeserializer::VLEReadError)
 				break; // The packet hasn't yet been streamed in.
 
-			if (messageSize == 0 || messageSize > cMaxReceivableTCPMessageSize)
+			if (messageSize == 0)
 			{
 				KNET_LOG(LogError, "Received an invalid message size %d!", (int)messageSize);
 				throw NetException("Malformed TCP data! Received an invalid message size!");
 			}
 
-			if (reader.BytesLeft() < messageSize)
+			if (reader.BytesLeft() < messageSize || messageSize > cMaxReceivableTCPMessageSize)
+			{
+				// A message that the application receives to a file is streamed to the file as it comes in, so it does not need
+				// to fit in tcpInboundSocketData, or under the size limit.
+				const size_t messageIDPos = reader.BytePos();
+				const u32 messageID = ReadMessageID(reader);
+				if (messageID == DataDeserializer::VLEReadError)
+					break; // The message ID hasn't yet been streamed in.
+				if (reader.BytePos() - messageIDPos > messageSize)
+					throw NetException("Malformed TCP data! Received a message shorter than its ID!");
+				const size_t contentSize = messageSize - (reader.BytePos() - messageIDPos);
+				DatagramBuffer *file = fragmentedReceives.MapFileDestination(messageID, contentSize);
+				if (file)
+				{
+					inboundFileMessage = AllocateNewMessage();
+					inboundFileMessage->AttachSharedData(file, file->Data(), contentSize);
+					file->Release();
+					inboundFileMessage->id = messageID;
+					inboundFileBytesReceived = 0;
+					tcpInboundSocketData.Consumed(reader.BytePos());
+					continue;
+				}
+
+				if (messageSize > cMaxReceivableTCPMessageSize)
+				{
+					KNET_LOG(LogError, "Received an invalid message size %d!", (int)messageSize);
+					throw NetException("Malformed TCP data! Received an invalid message size!");
+				}
 				break; // We haven't yet received the whole message, have to abort parsing for now and wait for the whole message.
+			}
 
-			HandleInboundMessage(0, reader.CurrentData(), messageSize);
+			DataDeserializer messageReader(reader.CurrentData(), messageSize);
+			if (ReadMessageID(messageReader) == MsgIdCompressedData)
+			{
+				if (inboundMessageQueue.CapacityLeft() < cMaxCompressedBatchMessages)
+					break; // Wait for the application to make room for all the messages of the batch.
+				numMessagesReceived += ExtractCompressedMessages(messageReader.CurrentData(), messageReader.BytesLeft());
+			}
+			else
+			{
+				HandleInboundMessage(0, reader.CurrentData(), messageSize);
+				++numMessagesReceived;
+			}
 			reader.SkipBytes(messageSize);
 
 			assert(reader.BitPos() == 0);
@@ -348,8 +653,6 @@ void TCPMessageConnection::ExtractMessages()
 
 			// Erase the bytes we just processed from the ring buffer.
 			tcpInboundSocketData.Consumed(bytesConsumed);
-
-			++numMessagesReceived;
 		}
 		AddInboundStats(0, 0, numMessagesReceived);
 	} catch(const NetException &e)
@@ -361,6 +664,34 @@ void TCPMessageConnection::ExtractMessages()
 	}
 }
 
+size_t TCPMessageConnection::ExtractCompressedMessages(const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	const int batchSize = DecompressMessageData(data, numBytes, cMaxReceivableTCPMessageSize, decompressionBuffer, 0);
+	if (batchSize < 0)
+		throw NetException("Malformed TCP data! Decompressing a CompressedData message failed!");
+
+	DataDeserializer reader(&decompressionBuffer[0], batchSize);
+	size_t numMessages = 0;
+	while(reader.BytesLeft() > 0)
+	{
+		const u32 messageSize = reader.ReadVLE<VLE8_16_32>();
+		if (messageSize == DataDeserializer::VLEReadError || messageSize == 0 || messageSize > reader.BytesLeft())
+			throw NetException("Malformed TCP data! A CompressedData message contained a truncated message!");
+		if (++numMessages > (size_t)cMaxCompressedBatchMessages)
+			throw NetException("Malformed TCP data! A CompressedData message contained too many messages!");
+
+		DataDeserializer messageReader(reader.CurrentData(), messageSize);
+		if (ReadMessageID(messageReader) == MsgIdCompressedData)
+			throw NetException("Malformed TCP data! A CompressedData message contained another one!");
+
+		HandleInboundMessage(0, reader.CurrentData(), messageSize);
+		reader.SkipBytes(messageSize);
+	}
+	return numMessages;
+}
+
 void TCPMessageConnection::PerformDisconnection()
 {
 	AssertInMainThreadContext();
@@ -389,9 +720,15 @@ void TCPMessageConnection::DumpConnectionStatus() const
 
 unsigned long TCPMessageConnection::TimeUntilCanSendPacket() const
 {
-	// For TCPMessageConnection, this throttling logic is not used. Perhaps will not be used ever, as the
-	// TCP driver does all send throttling already.
-	return 0;
+	// The TCP driver does all the congestion control, so only the application-set send rate limit applies here.
+	unsigned long msecs = TimeUntilSendRateLimitAllowsSend();
+	if (holdingOutboundMessages)
+	{
+		// Until SendOutPackets() has sent the held messages, keep the connection polled, even if their delay is up already.
+		const double msecsLeft = sendCoalescingDelay / 1000.0 - Clock::MillisecondsSinceD(holdStartTime);
+		msecs = std::max(msecs, (msecsLeft > 1.0) ? (unsigned long)ceil(msecsLeft) : 1UL);
+	}
+	return msecs;
 }
 
 } // ~kNet
@@ -20,6 +20,17 @@
 #endif
 
 #include <sstream>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <cstring>
+#include <cerrno>
+#endif
 
 #include "kNet/DebugMemoryLeakCheck.h"
 #include "kNet/Event.h" ///\todo Investigate the inclusion chain of these two files. Is this #include necessary?
@@ -48,6 +59,7 @@ void Thread::Hold()
 	threadHoldEventAcked.Reset();
 
 	threadHoldEvent.Set();
+	Interrupt(); // Wake the thread up so that it comes to CheckHold() as soon as possible.
 
 	PolledTimer timer;
 	while(IsRunning())
@@ -62,9 +74,19 @@ void Thread::Hold()
 /// Resumes the thread that is being held.
 void Thread::Resume()
 {
-	threadResumeEvent.Set();
 	threadHoldEvent.Reset();
-	threadHoldEventAcked.Reset();
+	threadResumeEvent.Set();
+
+	// Wait until the thread has left CheckHold(). Otherwise a Hold() right after this could reset threadResumeEvent before
+	// the thread sees it, and both threads would sleep until the waits in Hold() and CheckHold() time out.
+	while(IsRunning() && threadHoldEventAcked.Test())
+		Clock::Sleep(0);
+}
+
+void Thread::Interrupt()
+{
+	if (threadInterruptEvent.IsValid())
+		threadInterruptEvent.Set();
 }
 
 void Thread::CheckHold()
@@ -123,6 +145,86 @@ void SetThreadName(DWORD dwThreadID, const char *threadName)
 }
 #endif
 
+bool Thread::SetCurrentThreadAffinity(const std::vector<int> &cpus)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	const int numCpus = std::min<int>(NumHardwareThreads(), CPU_SETSIZE);
+	for(size_t i = 0; i < cpus.size(); ++i)
+		if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+			CPU_SET(cpus[i], &set);
+	if (cpus.empty())
+		for(int i = 0; i < numCpus; ++i)
+			CPU_SET(i, &set);
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret != 0)
+	{
+		KNET_LOG(LogError, "Thread::SetCurrentThreadAffinity: pthread_setaffinity_np failed: %s(%d).", strerror(ret), ret);
+		return false;
+	}
+	return true;
+#elif defined(WIN32)
+	DWORD_PTR mask = 0;
+	for(size_t i = 0; i < cpus.size(); ++i)
+		if (cpus[i] >= 0 && cpus[i] < (int)sizeof(DWORD_PTR) * 8)
+			mask |= (DWORD_PTR)1 << cpus[i];
+	if (cpus.empty())
+	{
+		DWORD_PTR systemMask = 0;
+		GetProcessAffinityMask(GetCurrentProcess(), &mask, &systemMask);
+	}
+	if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+	{
+		KNET_LOG(LogError, "Thread::SetCurrentThreadAffinity: SetThreadAffinityMask failed with error %d.", (int)GetLastError());
+		return false;
+	}
+	return true;
+#else
+	KNET_LOG(LogError, "Thread::SetCurrentThreadAffinity: Not supported on this platform.");
+	return false;
+#endif
+}
+
+bool Thread::SetCurrentThreadPriority(ThreadPriority priority)
+{
+#ifdef __linux__
+	sched_param param;
+	memset(&param, 0, sizeof(param));
+	int policy = SCHED_OTHER;
+	if (priority == ThreadPriorityRealtime)
+	{
+		policy = SCHED_FIFO;
+		param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+	}
+	int ret = pthread_setschedparam(pthread_self(), policy, &param);
+	if (ret != 0)
+	{
+		KNET_LOG(LogError, "Thread::SetCurrentThreadPriority: pthread_setschedparam failed: %s(%d).", strerror(ret), ret);
+		return false;
+	}
+	// The normal threads are ordered by their nice value, which Linux keeps per thread.
+	const int nice = (priority == ThreadPriorityLow) ? 10 : ((priority == ThreadPriorityHigh) ? -10 : 0);
+	if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) != 0)
+	{
+		KNET_LOG(LogError, "Thread::SetCurrentThreadPriority: setpriority(%d) failed: %s(%d).", nice, strerror(errno), (int)errno);
+		return false;
+	}
+	return true;
+#elif defined(WIN32)
+	const int priorities[] = { THREAD_PRIORITY_BELOW_NORMAL, THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_HIGHEST, THREAD_PRIORITY_TIME_CRITICAL };
+	if (!SetThreadPriority(GetCurrentThread(), priorities[priority]))
+	{
+		KNET_LOG(LogError, "Thread::SetCurrentThreadPriority: SetThreadPriority failed with error %d.", (int)GetLastError());
+		return false;
+	}
+	return true;
+#else
+	KNET_LOG(LogError, "Thread::SetCurrentThreadPriority: Not supported on this platform.");
+	return false;
+#endif
+}
+
 void Thread::SetName(const char *name)
 {
 // The thread name can only be set when it is ensured that Thread::Id() returns the proper Win32 thread ID
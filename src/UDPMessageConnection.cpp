@@ -36,6 +36,7 @@
 #include "kNet/NetException.h"
 #include "kNet/Network.h"
 #include "kNet/Sort.h"
+#include "kNet/Atomics.h"
 
 using namespace std;
 
@@ -46,40 +47,239 @@ static const int initialDatagramRatePerSecond = 30;
 /// The maximum time to wait before acking a packet. If there are enough packets to ack for a full ack message,
 /// acking will be performed earlier. (milliseconds)
 static const float maxAckDelay = 33.f; // (1/30th of a second)
+static const float minRTOTimeoutValue = 1000.f;
+static const float maxRTOTimeoutValue = 5000.f;
+/// A reliable datagram is declared lost when this many datagrams sent after it have been acked (kPacketThreshold of RFC 9002).
+static const u32 cPacketReorderThreshold = 3;
+/// A reliable datagram is also declared lost when a datagram sent after it has been acked, and it is older than this many
+/// round trip times (kTimeThreshold of RFC 9002), or cMinReorderWindowMSecs.
+static const float cReorderWindowRtts = 9.f / 8.f;
+static const float cMinReorderWindowMSecs = 1.f;
+/// The probe timeout does not back off beyond 2^cMaxLossProbeBackoff times its initial value.
+static const int cMaxLossProbeBackoff = 6;
 /// The time counter after which an unacked reliable message will be resent. (UDP only)
 static const float timeOutMilliseconds = 2000.f;//750.f;
 /// The maximum number of datagrams to read in from the socket at one go - after this reads will be throttled
 /// to give time for data sending as well.
 static const int cMaxDatagramsToReadInOneFrame = 2048;
 
-static const u32 cMaxUDPMessageFragmentSize = 470;
+/// The datagram size that every path is assumed to carry. Each connection starts from this and probes its way up (BASE_PLPMTU of RFC 8899).
+static const size_t cBaseDatagramSize = 1200;
+/// The smallest datagram size limit that is accepted, from the application or from the peer.
+static const size_t cMinDatagramSize = 512;
+/// The number of probes of the same size that are sent before the path is considered not to carry datagrams of that size.
+/// This many losses of large datagrams in a row with no large datagram acked in between also makes the connection fall back to cBaseDatagramSize.
+static const int cMaxPathMTUProbes = 3;
+/// The time after which an unacked probe is considered lost.
+static const float cPathMTUProbeTimeoutMSecs = 500.f;
+/// The search stops when the largest size known to pass and the smallest size known to fail are closer than this.
+static const size_t cPathMTUSearchGranularity = 32;
+/// The interval at which a search that has stopped below the limits of the connection is started again, in case the path has changed.
+static const float cPathMTURaiseIntervalMSecs = 60.f * 1000.f;
+
+/// The largest number of PacketID ranges sent in one PacketAckRanges message.
+static const int cMaxPacketAckRanges = 64;
+/// The largest distance from the first to the last PacketID that one PacketAckRanges message covers. This keeps the
+/// range lengths and gaps in two bytes each.
+static const u32 cMaxPacketAckSpan = 8192;
+/// The size of a PacketAckRanges message with cMaxPacketAckRanges ranges: the first PacketID, the count of Congestion
+/// Experienced marks, then two bytes of range length for each range and two bytes of gap for each range after the first.
+static const size_t cMaxPacketAckRangesMessageSize = 3 + 4 + 2 * (2 * cMaxPacketAckRanges - 1);
+/// Set in the high u16 of the first PacketID of a PacketAckRanges message, above the 22 bits of the PacketID, when the
+/// count of Congestion Experienced marks follows it. Acks without marks to report leave it out.
+static const u16 cPacketAckCEFlag = 0x8000;
+
+const char UDPMessageConnection::cConnectChallengeMagic[4] = { 'k', 'N', 'C', 'k' };
+const char UDPMessageConnection::cMigrationRequestMagic[4] = { 'k', 'N', 'M', 'g' };
+
+/// A datagram is only taken in if the inbound message queue has room for at least this many messages, see ExtractMessages().
+static const int cInboundQueueDatagramReserve = 64;
+/// The receive credits are advertised to the peer as soon as this many new ones have been granted since the last advertisement,
+/// see UpdateReceiveCredits(). Smaller grants wait for cReceiveCreditMinIntervalMSecs.
+static const u32 cReceiveCreditAdvertiseThreshold = 1024;
+static const float cReceiveCreditMinIntervalMSecs = 50.f;
+/// The credits are advertised at least this often even if they have not changed, so that a lost advertisement does not stall the peer.
+static const float cReceiveCreditRefreshIntervalMSecs = 1000.f;
+
+/// The gain of the moving average of the datagram loss rate. Each acked or lost datagram moves it this much towards 0 or 1.
+static const float cPacketLossRateGain = 1.f / 64.f;
+
+/// The bounds of the number of datagrams one forward error correction parity datagram covers.
+static const int cMinFECGroupSize = 2;
+static const int cMaxFECGroupSize = 16;
+/// The adaptive group size is chosen so that the expected number of losses in a group, parity included, is about this much.
+/// A group rebuilds only a single loss, so this keeps the chance of two losses in a group small.
+static const float cFECTargetLossesPerGroup = 0.1f;
+/// The longest time a partial group waits for more datagrams before its parity is sent out.
+static const float cFECMaxGroupDelayMSecs = 40.f;
+/// The room the parity of a group takes up on top of the longest datagram in it: the datagram and message headers, the
+/// message ID and its extension code, and the first PacketID, the group size, the PacketID deltas and the length of the FECParity message.
+static const size_t cFECParityOverhead = 3 + 2 + 2 + 3 + 1 + 2 * (cMaxFECGroupSize - 1) + 2;
+/// The largest datagram that is protected. The parity has to fit in the 11-bit content length of a single message.
+static const size_t cMaxFECDatagramSize = (1 << 11) - 1 - (cFECParityOverhead - 3 - 2);
+/// The number of received datagrams kept for rebuilding lost ones. Must be a power of two.
+static const size_t cFECReceiveHistorySize = 64;
+/// The largest block of messages a CompressedData message may decompress to. No datagram is larger than this.
+static const size_t cMaxDecompressedDatagramSize = 65536;
+
+/// Returns an upper bound for the room that a PacketAckRanges message of the given number of pending acks takes up in a
+/// datagram, including the message header and ID.
+static inline size_t PacketAckRangesMessagePackedSize(size_t numPendingAcks)
+{
+	const size_t numRanges = (numPendingAcks < (size_t)cMaxPacketAckRanges) ? numPendingAcks : (size_t)cMaxPacketAckRanges;
+	return 3 + 3 + 2 * (2 * numRanges - 1);
+}
+
+/// Returns the number of PacketIDs from the given PacketID forward to the newer one.
+static inline u32 PacketIDDistance(packet_id_t id, packet_id_t newerID)
+{
+	return (u32)((newerID - id) & ((1 << 22) - 1));
+}
+
+/// The order numbers of the in-order messages are sent modulo this + 1. The receiver takes an order number to be ahead of
+/// the next one it expects if it is less than half of the range ahead.
+static const u32 cOrderNumberMask = 0x7FFF;
+
+/// Frees the messages left in the reorder rings of the ordering channels.
+struct FreePendingInOrderMessage
+{
+	explicit FreePendingInOrderMessage(MessageConnection *connection_):connection(connection_) {}
+	MessageConnection *connection;
+
+	template<typename T>
+	void operator()(T &pending) const { connection->FreeMessage(pending.message); }
+};
+
+/// The bytes UDPMessageConnection::SerializeSession() writes for a message, besides its contents.
+static const size_t cSessionMessageOverhead = 32;
+
+/// Adds the bytes the messages held in the reorder rings take in a serialized session to the given count.
+struct AddHeldMessageSize
+{
+	explicit AddHeldMessageSize(size_t &numBytes_):numBytes(numBytes_) {}
+	size_t &numBytes;
+
+	template<typename T>
+	void operator()(u32 /*orderNumber*/, const T &pending) const { numBytes += cSessionMessageOverhead + (pending.message ? pending.message->Size() : 0); }
+};
+
+/// Writes the messages held in the reorder rings to a serialized session.
+struct SerializeHeldMessage
+{
+	explicit SerializeHeldMessage(DataSerializer &dst_):dst(dst_) {}
+	DataSerializer &dst;
+
+	template<typename T>
+	void operator()(u32 orderNumber, const T &pending) const
+	{
+		dst.Add<u32>(orderNumber);
+		dst.Add<u32>((u32)pending.packetID);
+		dst.Add<u8>(pending.serialized ? 1 : 0);
+		dst.Add<u8>(pending.message ? 1 : 0);
+		if (pending.message)
+		{
+			dst.Add<u32>((u32)pending.message->id);
+			dst.Add<u32>((u32)pending.message->Size());
+			dst.AddAlignedByteArray(pending.message->data, (u32)pending.message->Size());
+		}
+	}
+};
+
+/// The contents of a MsgIdPathMTU message start with one of these.
+enum PathMTUMessageType
+{
+	PathMTUAdvertisement = 0, ///< u16: The largest datagram the sender wants to receive. Sent reliably.
+	PathMTUProbe = 1, ///< u32 probe ID, u16 probe size. Sent unreliably, in a datagram padded to the probe size.
+	PathMTUProbeAck = 2, ///< u32 probe ID, u16 probe size. The reply to a received probe.
+	PathMTUPadding = 3 ///< The rest of the message is padding that fills a probe datagram.
+};
 
 UDPMessageConnection::UDPMessageConnection(Network *owner, NetworkServer *ownerServer, Socket *socket, ConnectionState startingState)
 :MessageConnection(owner, ownerServer, socket, startingState),
-lastReceivedInOrderPacketID(0), 
-lastSentInOrderPacketID(0), 
+connectDatagramDeferred(false),
+sentEarlyData(false),
+connectionID(0),
+inboundDatagramMalformed(false),
+numMalformedDatagrams(0),
+inboundECN(ECNNotECT),
+numCEMarksReceived(0),
+peerCEMarks(0),
+malformedDatagramLimit(owner ? owner->MalformedDatagramLimit() : 0),
 datagramPacketIDCounter(1),
-retransmissionTimeout(3.f), 
-numAcksLastFrame(0), 
-numLossesLastFrame(0), 
-datagramSendRate(70),
-lowestDatagramSendRateOnPacketLoss(70.f),
+retransmissionTimeout(3000.f), 
+congestionControl(0),
+congestionControlAlgorithm(CongestionControlCubic),
+datagramSendRate(0),
+congestionWindow(0),
+availableBandwidth(0.f),
+queuingDelay(0.f),
+bandwidthEstimateHandler(0),
+bandwidthReportThreshold(0.1f),
+reportedBandwidth(0.f),
+reportedQueuingDelay(0.f),
+bytesInFlight(0),
+sendWindowFull(false),
+holdingOutboundMessages(false),
+holdStartTime(0),
+flushingHeldMessages(false),
+bytesDelivered(0),
+largestAckedPacketID(0),
+largestAckedSentTick(0),
+haveAckedDatagrams(false),
+latestRtt(0.f),
+lossProbeTick(0),
+numLossProbes(0),
+lossProbePending(false),
 rttCleared(true), // Set RTT initial values as per RFC 2988.
 smoothedRTT(3.f), 
 rttVariation(0.f), 
 packetLossRate(0.f), 
 packetLossCount(0.f), 
-outboundPacketAckTrack(1024),
-queuedInboundDatagrams(128),
+maxDatagramSize(socket ? min(cBaseDatagramSize, socket->MaxSendSize()) : cBaseDatagramSize),
+maxDatagramSizeLimit(socket ? socket->MaxSendSize() : cBaseDatagramSize),
+advertisedDatagramSizeLimit(0),
+peerDatagramSizeLimit(0),
+pathMTUProbeSize(0),
+smallestFailedProbeSize(0),
+numPathMTUProbesSent(0),
+pathMTUProbeID(0),
+numLargeDatagramsLost(0),
+fecRequestedGroupSize(0),
+fecGroupSize(cMaxFECGroupSize),
+fecMinPriority(NetworkMessage::cPriorityDontSend),
+messageAggregation(true),
+fecParityLength(0),
+fecGroupStartTick(0),
+numReliableMessagesReceived(0),
+advertisedReceiveCreditLimit(0),
+receiveCreditAdvertiseTick(0),
+numNewReliableMessagesSent(0),
+peerReceiveCreditLimit(0),
+peerGrantsReceiveCredits(false),
+outboundPacketAckTrack(64),
+freeSentDeltaState(-1),
+queuedInboundDatagrams(128, 8, &memoryBudget),
 datagramOutRatePerSecond(initialDatagramRatePerSecond), 
 datagramInRatePerSecond(initialDatagramRatePerSecond),
-receivedPacketIDs(64 * 1024), 
-previousReceivedPacketID(0)
+previousReceivedPacketID(0),
+datagramChecksums(false)
 {
 	KNET_LOG(LogObjectAlloc, "Allocated UDPMessageConnection %p.", this);
 
-	lastFrameTime = Clock::Tick();
-	lastDatagramSendTime = Clock::Tick();
+	memset(connectSalt, 0, sizeof(connectSalt));
+
+	if (owner)
+		messageIDCodes.SetCodeRange(owner->FirstMessageIDCode(), owner->NumMessageIDCodes());
+
+	// The server reads the datagrams of slave sockets for us, and signals this event when it does so.
+	if (socket && socket->IsUDPSlaveSocket())
+		eventDatagramsQueued = CreateNewEvent(EventWaitSignal);
+
+	nextDatagramSendTime = Clock::Tick();
+	lastDeliveredTick = Clock::Tick();
+	lastLargeDatagramAckTime = Clock::Tick();
+
+	UpdateCongestionControl();
 }
 
 UDPMessageConnection::~UDPMessageConnection()
@@ -94,45 +294,122 @@ UDPMessageConnection::~UDPMessageConnection()
 	assert(!workerThread);
 
 	while(outboundPacketAckTrack.Size() > 0)
-		FreeOutboundPacketAckTrack(outboundPacketAckTrack.Front()->packetID);
+		FreeOutboundPacketAckTrack(*outboundPacketAckTrack.Oldest());
+
+	for(size_t i = 0; i < inboundOrderingChannels.size(); ++i)
+		inboundOrderingChannels[i].pendingMessages.Clear(FreePendingInOrderMessage(this));
 
 	outboundPacketAckTrack.Clear();
+
+	while(queuedInboundDatagrams.Size() > 0)
+	{
+		queuedInboundDatagrams.Front()->buffer->Release();
+		queuedInboundDatagrams.PopFront();
+	}
+
+	if (eventDatagramsQueued.IsValid())
+		eventDatagramsQueued.Close();
+
+	delete congestionControl;
 }
 
-void UDPMessageConnection::QueueInboundDatagram(const char *data, size_t numBytes)
+void UDPMessageConnection::QueueInboundDatagram(const char *data, size_t numBytes, DatagramBuffer *buffer, tick_t receiveTick, u8 ecn)
 {
 	if (!data || numBytes == 0)
 	{
 		KNET_LOG(LogError, "UDPMessageConnection::QueueInboundDatagram: Ignoring received zero-sized datagram!");
 		return;
 	}
-	if (numBytes > cDatagramBufferSize)
+	if (numBytes > cMaxDatagramSize)
 	{
 		KNET_LOG(LogError, "UDPMessageConnection::QueueInboundDatagram: Discarding received over-sized datagram (%d bytes)!", (int)numBytes);
 		return;
 	}
 
-	Datagram d;
-	memcpy(d.data, data, numBytes);
+	QueuedDatagram d;
+	if (buffer)
+	{
+		// Parse the datagram in place in the buffer the server received it to.
+		buffer->AddRef();
+		d.buffer = buffer;
+		d.data = data;
+	}
+	else
+	{
+		d.buffer = DatagramBuffer::Allocate(numBytes);
+		memcpy(d.buffer->Data(), data, numBytes);
+		d.data = d.buffer->Data();
+	}
 	d.size = numBytes;
+	d.receiveTick = receiveTick;
+	d.ecn = ecn;
 	bool success = queuedInboundDatagrams.Insert(d);
 	if (!success)
 	{
+		d.buffer->Release();
 		KNET_LOG(LogError, "UDPMessageConnection::QueueInboundDatagram: Dropping received datagram, since the client receive buffer is full!");
 		return;
 	}
+
+	// Only the first datagram in the queue needs to wake up the worker thread, it will consume the rest as well.
+	if (queuedInboundDatagrams.Size() == 1 && eventDatagramsQueued.IsValid())
+		eventDatagramsQueued.Set();
+}
+
+Event UDPMessageConnection::NewInboundDataEvent()
+{
+	if (eventDatagramsQueued.IsValid())
+		return eventDatagramsQueued;
+	return MessageConnection::NewInboundDataEvent();
+}
+
+unsigned long UDPMessageConnection::TimeUntilNextUpdate() const
+{
+	unsigned long msecs = MessageConnection::TimeUntilNextUpdate();
+
+	// Flow control, acks and the retransmission timeouts of the packets in flight are processed on udpUpdateTimer.
+	if (NumOutboundMessagesPending() > 0 || outboundPacketAckTrack.Size() > 0 || receivedPacketIDs.NumPendingAcks() > 0)
+		msecs = min(msecs, TimerMSecsLeft(udpUpdateTimer));
+	// The path MTU search advertises and probes on udpUpdateTimer as well, and restarts on pathMTURaiseTimer.
+	if (pathMTUProbeSize != 0 || (connectionState == ConnectionOK && advertisedDatagramSizeLimit != maxDatagramSizeLimit))
+		msecs = min(msecs, max(TimerMSecsLeft(udpUpdateTimer), TimerMSecsLeft(pathMTUProbeTimer)));
+	if (pathMTURaiseTimer.Enabled())
+		msecs = min(msecs, max(TimerMSecsLeft(udpUpdateTimer), TimerMSecsLeft(pathMTURaiseTimer)));
+	if (queuedInboundDatagrams.Size() > 0)
+		msecs = 0;
+	return msecs;
 }
 
-void UDPMessageConnection::ProcessQueuedDatagrams()
+size_t UDPMessageConnection::ProcessQueuedDatagrams()
 {
 	AssertInWorkerThreadContext();
 
+	size_t totalBytes = 0;
 	while(queuedInboundDatagrams.Size() > 0)
 	{
-		Datagram *d = queuedInboundDatagrams.Front();
-		ExtractMessages((const char*)d->data, d->size);
+		QueuedDatagram *d = queuedInboundDatagrams.Front();
+		// A client connection on a shared socket gets the connect challenges of its server through the queue too.
+		if (ownerServer || !HandleConnectChallenge(d->data, d->size))
+		{
+			// No other connection parses this range of the buffer, so it can be decrypted in place.
+			HandleInboundDatagram(const_cast<char *>(d->data), d->size, d->receiveTick, d->ecn);
+			totalBytes += d->size;
+		}
+		DatagramBuffer *buffer = d->buffer;
 		queuedInboundDatagrams.PopFront();
+		buffer->Release();
+	}
+
+	// A client connection on a shared socket learns here that its server has answered, see ReadSocket().
+	if (totalBytes > 0 && connectionState == ConnectionPending)
+	{
+		connectionState = ConnectionOK;
+		establishedSignalPending = true;
+		std::vector<char>().swap(connectDatagram);
+		KNET_LOG(LogUser, "UDPMessageConnection::ProcessQueuedDatagrams: Received data from socket %s. Transitioned from ConnectionPending to ConnectionOK state.",
+			(socket ? socket->ToString().c_str() : "(null)"));
 	}
+	return totalBytes;
 }
 
 UDPMessageConnection::SocketReadResult UDPMessageConnection::ReadSocket(size_t &bytesRead)
@@ -147,6 +424,8 @@ UDPMessageConnection::SocketReadResult UDPMessageConnection::ReadSocket(size_t &
 	if (bytesRead > 0 && connectionState == ConnectionPending)
 	{
 		connectionState = ConnectionOK;
+		establishedSignalPending = true;
+		std::vector<char>().swap(connectDatagram);
 		KNET_LOG(LogUser, "UDPMessageConnection::ReadSocket: Received data from socket %s. Transitioned from ConnectionPending to ConnectionOK state.", 
 			(socket ? socket->ToString().c_str() : "(null)"));
 	}
@@ -163,11 +442,11 @@ void UDPMessageConnection::PerformPacketAckSends()
 {
 	AssertInWorkerThreadContext();
 
-	tick_t now = Clock::Tick();
-	while(!inboundPacketAckTrack.empty())
+	tick_t now = Clock::LoopTick();
+	while(receivedPacketIDs.NumPendingAcks() > 0)
 	{
-		if (Clock::TimespanToMillisecondsF(inboundPacketAckTrack.begin()->second.sentTick, now) < maxAckDelay &&
-			inboundPacketAckTrack.size() < 33)
+		if (Clock::TimespanToMillisecondsF(receivedPacketIDs.FirstPendingAckTick(), now) < maxAckDelay &&
+			receivedPacketIDs.NumPendingAcks() < 33)
 			break;
 
 		SendPacketAckMessage();
@@ -183,6 +462,15 @@ UDPMessageConnection::SocketReadResult UDPMessageConnection::UDPReadSocket(size_
 
 	totalBytesRead = 0;
 
+	// Slave sockets are not read directly, the server has queued the datagrams for us.
+	// Reset the event before consuming the queue, so that no datagram queued after this will go unnoticed.
+	if (eventDatagramsQueued.IsValid())
+	{
+		eventDatagramsQueued.Reset();
+		totalBytesRead = ProcessQueuedDatagrams();
+		return SocketReadOK;
+	}
+
 	// Read in all the bytes that are available in the socket.
 
 	// Cap the number of datagrams to read in a single loop to perform throttling.
@@ -194,10 +482,18 @@ UDPMessageConnection::SocketReadResult UDPMessageConnection::UDPReadSocket(size_
 		if (!data || data->bytesContains == 0)
 			break;
 
+		// A connect challenge does not open the connection, so it is not counted as received data. A server connection on
+		// a connected socket of its own gets no challenges.
+		if (!ownerServer && HandleConnectChallenge(data->buffer.buf, data->bytesContains))
+		{
+			socket->EndReceive(data);
+			continue;
+		}
+
 		totalBytesRead += data->bytesContains;
 
 		KNET_LOG(LogData, "UDPReadSocket: Received %d bytes from Begin/EndReceive.", data->bytesContains);
-		ExtractMessages(data->buffer.buf, data->bytesContains);
+		HandleInboundDatagram(data->buffer.buf, data->bytesContains, data->receiveTick, data->ecn);
 
 		// Done with the received data buffer. Free it up for a future socket read.
 		socket->EndReceive(data);
@@ -212,6 +508,442 @@ UDPMessageConnection::SocketReadResult UDPMessageConnection::UDPReadSocket(size_
 		return SocketReadOK;
 }
 
+bool UDPMessageConnection::HandleConnectChallenge(const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	if ((connectDatagram.empty() && connectionID == 0) || numBytes != cConnectChallengeSize ||
+		memcmp(data, cConnectChallengeMagic, sizeof(cConnectChallengeMagic)) != 0)
+		return false;
+
+	// The connection is open, so the server got a datagram of it from an address it does not know. Show the server that
+	// the datagrams from the new address belong to this connection.
+	if (connectDatagram.empty())
+	{
+		SendMigrationRequest((const u8 *)data + sizeof(cConnectChallengeMagic));
+		return true;
+	}
+
+	const size_t size = connectDatagram.size() + cConnectCookieSize;
+	OverlappedTransferBuffer *sendData = socket->BeginSend((int)size);
+	if (!sendData)
+	{
+		KNET_LOG(LogError, "UDPMessageConnection::HandleConnectChallenge: socket->BeginSend failed! Cannot answer the connect challenge of the server.");
+		return true;
+	}
+	memcpy(sendData->buffer.buf, &connectDatagram[0], connectDatagram.size());
+	memcpy(sendData->buffer.buf + connectDatagram.size(), data + sizeof(cConnectChallengeMagic), cConnectCookieSize);
+	sendData->bytesContains = size;
+	socket->EndSend(sendData);
+	KNET_LOG(LogVerbose, "UDPMessageConnection::HandleConnectChallenge: Sent the connect datagram again with the cookie to %s.", socket->ToString().c_str());
+	return true;
+}
+
+void UDPMessageConnection::SendConnectDatagram()
+{
+	connectDatagramDeferred = false;
+	OverlappedTransferBuffer *sendData = socket->BeginSend((int)ConnectDatagramOverhead());
+	if (!sendData)
+	{
+		KNET_LOG(LogError, "UDPMessageConnection::SendConnectDatagram: socket->BeginSend failed! Cannot send UDP connection datagram!");
+		return;
+	}
+	sendData->bytesContains = (int)WriteConnectDatagram(sendData->buffer.buf, 0);
+	socket->EndSend(sendData);
+	KNET_LOG(LogVerbose, "UDPMessageConnection::SendConnectDatagram: Sent a connect message of size %d to %s.", (int)connectMessage.size(), socket->ToString().c_str());
+	std::vector<char>().swap(connectMessage);
+}
+
+size_t UDPMessageConnection::WriteConnectDatagram(char *dst, size_t earlyDataSize)
+{
+	const size_t messageSize = connectMessage.size();
+	if (earlyDataSize > 0)
+		memmove(dst + messageSize, dst, earlyDataSize);
+	if (messageSize > 0)
+		memcpy(dst, &connectMessage[0], messageSize);
+
+	DataSerializer writer(dst + messageSize + earlyDataSize, cEarlyDataNonceSize + cConnectTrailerSize + DatagramCipher::cSaltSize);
+	if (earlyDataSize > 0)
+	{
+		u64 nonce;
+		DatagramCipher::GenerateRandomBytes((u8 *)&nonce, sizeof(nonce));
+		writer.Add<u64>(nonce);
+	}
+	writer.Add<u16>((u16)earlyDataSize | (datagramChecksums ? cConnectChecksumsFlag : 0));
+	if (cipher.HasKey())
+		writer.AddAlignedByteArray(connectSalt, sizeof(connectSalt));
+	size_t size = messageSize + earlyDataSize + writer.BytesFilled();
+
+	// The tag covers the whole datagram, so the server can tell that the client knows the key, and that nobody has
+	// changed the nonce of the early data.
+	if (cipher.HasKey())
+	{
+		cipher.ComputeTag(dst, size, (u8 *)dst + size);
+		size += DatagramCipher::cTagSize;
+	}
+	connectDatagram.assign(dst, dst + size);
+	return size;
+}
+
+size_t UDPMessageConnection::ConnectDatagramOverhead() const
+{
+	return connectMessage.size() + cEarlyDataNonceSize + cConnectTrailerSize + cConnectCookieSize +
+		(cipher.HasKey() ? DatagramCipher::cSaltSize + DatagramCipher::cTagSize : 0);
+}
+
+void UDPMessageConnection::SendMigrationRequest(const u8 *cookie)
+{
+	AssertInWorkerThreadContext();
+
+	const size_t tagSize = cipher.HasKey() ? DatagramCipher::cTagSize : 0;
+	const size_t size = cMigrationRequestSize + tagSize;
+	OverlappedTransferBuffer *sendData = socket->BeginSend((int)size);
+	if (!sendData)
+	{
+		KNET_LOG(LogError, "UDPMessageConnection::SendMigrationRequest: socket->BeginSend failed! Cannot answer the connect challenge of the server.");
+		return;
+	}
+	DataSerializer writer(sendData->buffer.buf, size);
+	writer.AddAlignedByteArray(cMigrationRequestMagic, sizeof(cMigrationRequestMagic));
+	writer.Add<u64>(connectionID);
+	if (tagSize > 0)
+	{
+		u8 tag[DatagramCipher::cTagSize];
+		ComputeMigrationRequestTag(sendData->buffer.buf, cookie, tag);
+		writer.AddAlignedByteArray(tag, sizeof(tag));
+	}
+	writer.AddAlignedByteArray(cookie, cConnectCookieSize);
+	sendData->bytesContains = writer.BytesFilled();
+	socket->EndSend(sendData);
+	KNET_LOG(LogVerbose, "UDPMessageConnection::SendMigrationRequest: Answered a connect challenge from %s with a migration request.", socket->ToString().c_str());
+}
+
+bool UDPMessageConnection::IsMigrationRequest(const char *data, size_t numBytes)
+{
+	return (numBytes == cMigrationRequestSize || numBytes == cMigrationRequestSize + DatagramCipher::cTagSize) &&
+		memcmp(data, cMigrationRequestMagic, sizeof(cMigrationRequestMagic)) == 0;
+}
+
+void UDPMessageConnection::ComputeMigrationRequestTag(const char *request, const u8 *cookie, u8 *tag) const
+{
+	// The tag covers the cookie, so that a request seen on the way can't be replayed from another address. The same cookie
+	// always comes with the same request, so it can pick the one-time key of the tag.
+	char message[4 + 8 + cConnectCookieSize];
+	memcpy(message, request, 4 + 8);
+	memcpy(message + 4 + 8, cookie, cConnectCookieSize);
+	u64 number = 0;
+	for(size_t i = 0; i < cConnectCookieSize; ++i)
+		number |= (u64)cookie[i] << (8*i);
+	cipher.ComputeConnectionTag(number, message, sizeof(message), tag);
+}
+
+bool UDPMessageConnection::IsValidMigrationRequest(const char *data, size_t numBytes) const
+{
+	const size_t tagSize = cipher.HasKey() ? DatagramCipher::cTagSize : 0;
+	if (connectionID == 0 || !IsMigrationRequest(data, numBytes) || numBytes != cMigrationRequestSize + tagSize)
+		return false;
+	DataDeserializer reader(data + sizeof(cMigrationRequestMagic), 8);
+	if (reader.Read<u64>() != connectionID)
+		return false;
+	if (tagSize == 0)
+		return true;
+	u8 tag[DatagramCipher::cTagSize];
+	ComputeMigrationRequestTag(data, (const u8 *)data + 4 + 8 + tagSize, tag);
+	return DatagramCipher::TagsEqual(tag, (const u8 *)data + 4 + 8);
+}
+
+void UDPMessageConnection::SendConnectionIDMessage()
+{
+	NetworkMessage *msg = StartNewMessage(MsgIdConnectionID, 8);
+	DataSerializer mb(msg->data, 8);
+	mb.Add<u64>(connectionID);
+	msg->priority = NetworkMessage::cMaxPriority - 1;
+	msg->reliable = true;
+#ifdef KNET_NETWORK_PROFILING
+	msg->profilerName = "ConnectionID (5:8)";
+#endif
+	EndAndQueueMessage(msg, mb.BytesFilled());
+}
+
+void UDPMessageConnection::HandleConnectionIDMessage(const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	if (numBytes != 8)
+	{
+		KNET_LOG(LogError, "Malformed ConnectionID message received! Size was %d bytes, expected 8!", (int)numBytes);
+		MalformedMessageReceived();
+		return;
+	}
+	// Only the server picks the IDs. Its own must stay the one it is known by.
+	if (ownerServer)
+		return;
+	DataDeserializer mr(data, numBytes);
+	connectionID = mr.Read<u64>();
+	KNET_LOG(LogVerbose, "UDPMessageConnection::HandleConnectionIDMessage: Received the connection ID of connection %s.", ToString().c_str());
+}
+
+void UDPMessageConnection::SerializeOutboundMessage(DataSerializer &dst, const NetworkMessage *msg)
+{
+	dst.Add<u32>((u32)msg->id);
+	dst.Add<u32>((u32)msg->priority);
+	dst.Add<u32>((u32)msg->contentID);
+	dst.Add<u8>((u8)((msg->reliable ? 1 : 0) | (msg->inOrder ? 2 : 0) | (msg->hasOrderNumber ? 4 : 0) | (msg->forwardErrorCorrection ? 8 : 0)));
+	dst.Add<u8>(msg->orderingChannel);
+	dst.Add<u32>((u32)msg->reliableMessageNumber);
+	dst.Add<u32>(msg->orderNumber);
+	dst.Add<u32>((u32)msg->sendCount);
+	dst.Add<u32>((u32)msg->Size());
+	dst.AddAlignedByteArray(msg->data, (u32)msg->Size());
+}
+
+bool UDPMessageConnection::CanHandOffSession() const
+{
+	assert(!workerThread);
+	return connectionState == ConnectionOK && socket && socket->IsWriteOpen() && fragmentedReceives.transfers.empty() &&
+		fragmentedSends.Acquire()->transfers.empty() && outboundDeltaStates.empty();
+}
+
+void UDPMessageConnection::SerializeSession(std::vector<char> &dst)
+{
+	assert(!workerThread);
+	AssertInWorkerThreadContext();
+
+	// Take the messages the application has queued, and the ones waiting in the queues, so that they can be written. They
+	// are put back in the same order afterwards.
+	while(outboundAcceptQueue.Size() > 0)
+		AcceptOutboundMessages();
+	std::vector<NetworkMessage*> outboundMessages;
+	while(outboundQueue.Size() > 0)
+	{
+		outboundMessages.push_back(outboundQueue.Front());
+		outboundQueue.PopFront();
+	}
+	std::vector<NetworkMessage*> inboundMessages;
+	while(inboundMessageQueue.Size() > 0)
+		inboundMessages.push_back(inboundMessageQueue.TakeFront());
+	std::vector<QueuedDatagram> datagrams;
+	while(queuedInboundDatagrams.Size() > 0)
+		datagrams.push_back(queuedInboundDatagrams.TakeFront());
+
+	// The messages of the datagrams in flight are resent in new datagrams by the new process, like after a loss.
+	std::vector<NetworkMessage*> unackedMessages;
+	for(PacketAckTrack *track = outboundPacketAckTrack.Oldest(); track; track = outboundPacketAckTrack.Next(track))
+		for(NetworkMessage *msg = track->messages; msg; msg = msg->nextInDatagram)
+			unackedMessages.push_back(msg);
+
+	size_t maxBytes = 512 + sizeof(cipher) + sizeof(receivedReliableMessages) + sizeof(receivedPacketIDs) + messageIDCodes.SerializedSize() +
+		outboundOrderNumbers.size() * 4 + inboundOrderingChannels.size() * 8;
+	for(size_t i = 0; i < inboundOrderingChannels.size(); ++i)
+		inboundOrderingChannels[i].pendingMessages.ForEach(AddHeldMessageSize(maxBytes));
+	for(size_t i = 0; i < unackedMessages.size(); ++i)
+		maxBytes += unackedMessages[i]->Size() + cSessionMessageOverhead;
+	for(size_t i = 0; i < outboundMessages.size(); ++i)
+		maxBytes += outboundMessages[i]->Size() + cSessionMessageOverhead;
+	for(size_t i = 0; i < inboundMessages.size(); ++i)
+		maxBytes += inboundMessages[i]->Size() + cSessionMessageOverhead;
+	for(size_t i = 0; i < datagrams.size(); ++i)
+		maxBytes += datagrams[i].size + 4;
+
+	DataSerializer ds(dst, maxBytes);
+	ds.Add<u64>(connectionID);
+	ds.Add<u8>(datagramChecksums ? 1 : 0);
+	// The windows and the cipher hold no pointers, and the two processes run the same build, so they are copied as is.
+	ds.AddAlignedByteArray(&cipher, sizeof(cipher));
+	ds.AddAlignedByteArray(&receivedReliableMessages, sizeof(receivedReliableMessages));
+	ds.AddAlignedByteArray(&receivedPacketIDs, sizeof(receivedPacketIDs));
+	ds.Add<u32>((u32)previousReceivedPacketID);
+	ds.Add<u32>((u32)datagramPacketIDCounter);
+	ds.Add<u32>((u32)outboundMessageNumberCounter);
+	ds.Add<u32>((u32)outboundReliableMessageNumberCounter);
+
+	ds.Add<u32>((u32)outboundOrderNumbers.size());
+	for(size_t i = 0; i < outboundOrderNumbers.size(); ++i)
+		ds.Add<u32>(outboundOrderNumbers[i]);
+	ds.Add<u32>((u32)inboundOrderingChannels.size());
+	for(size_t i = 0; i < inboundOrderingChannels.size(); ++i)
+	{
+		const ReorderRing<PendingInOrderMessage> &pendingMessages = inboundOrderingChannels[i].pendingMessages;
+		ds.Add<u32>(pendingMessages.Next());
+		ds.Add<u32>((u32)pendingMessages.Size());
+		pendingMessages.ForEach(SerializeHeldMessage(ds));
+	}
+
+	ds.Add<u8>(rttCleared ? 1 : 0);
+	ds.Add<float>(smoothedRTT);
+	ds.Add<float>(rttVariation);
+	ds.Add<float>(retransmissionTimeout);
+	ds.Add<float>(latestRtt);
+	ds.Add<float>(packetLossRate);
+	ds.Add<u32>((u32)numCEMarksReceived);
+	ds.Add<u32>((u32)peerCEMarks);
+	ds.Add<u8>((u8)congestionControlAlgorithm);
+	ds.Add<u32>((u32)congestionWindow);
+	ds.Add<u32>((u32)maxDatagramSize);
+	ds.Add<u32>((u32)maxDatagramSizeLimit);
+	ds.Add<u32>((u32)advertisedDatagramSizeLimit);
+	ds.Add<u32>((u32)peerDatagramSizeLimit);
+	ds.Add<u32>((u32)smallestFailedProbeSize);
+
+	ds.Add<u32>(numReliableMessagesReceived);
+	ds.Add<u32>(advertisedReceiveCreditLimit);
+	ds.Add<u32>((u32)numNewReliableMessagesSent);
+	ds.Add<u32>((u32)peerReceiveCreditLimit);
+	ds.Add<u8>(peerGrantsReceiveCredits ? 1 : 0);
+	ds.Add<u8>(compressionOfferSent ? 1 : 0);
+	ds.Add<u8>(peerCompressionCodecs);
+	ds.Add<u32>(peerCompressionDictionaryID);
+	messageIDCodes.SerializeTo(ds);
+
+	ds.Add<u32>((u32)(unackedMessages.size() + outboundMessages.size()));
+	for(size_t i = 0; i < unackedMessages.size(); ++i)
+		SerializeOutboundMessage(ds, unackedMessages[i]);
+	for(size_t i = 0; i < outboundMessages.size(); ++i)
+		SerializeOutboundMessage(ds, outboundMessages[i]);
+	ds.Add<u32>((u32)inboundMessages.size());
+	for(size_t i = 0; i < inboundMessages.size(); ++i)
+	{
+		ds.Add<u32>((u32)inboundMessages[i]->id);
+		ds.Add<u32>((u32)inboundMessages[i]->receivedPacketID);
+		ds.Add<u32>((u32)inboundMessages[i]->Size());
+		ds.AddAlignedByteArray(inboundMessages[i]->data, (u32)inboundMessages[i]->Size());
+	}
+	ds.Add<u32>((u32)datagrams.size());
+	for(size_t i = 0; i < datagrams.size(); ++i)
+	{
+		ds.Add<u32>((u32)datagrams[i].size);
+		ds.AddAlignedByteArray(datagrams[i].data, (u32)datagrams[i].size);
+	}
+	dst.resize(ds.BytesFilled());
+
+	for(size_t i = 0; i < outboundMessages.size(); ++i)
+		outboundQueue.Insert(outboundMessages[i]);
+	for(size_t i = 0; i < inboundMessages.size(); ++i)
+		inboundMessageQueue.Insert(inboundMessages[i]);
+	for(size_t i = 0; i < datagrams.size(); ++i)
+		queuedInboundDatagrams.Insert(datagrams[i]);
+}
+
+void UDPMessageConnection::DeserializeSession(DataDeserializer &src)
+{
+	assert(!workerThread);
+	AssertInWorkerThreadContext();
+
+	connectionID = src.Read<u64>();
+	datagramChecksums = (src.Read<u8>() != 0);
+	src.ReadArray<u8>((u8*)&cipher, sizeof(cipher));
+	src.ReadArray<u8>((u8*)&receivedReliableMessages, sizeof(receivedReliableMessages));
+	src.ReadArray<u8>((u8*)&receivedPacketIDs, sizeof(receivedPacketIDs));
+	previousReceivedPacketID = src.Read<u32>();
+	datagramPacketIDCounter = src.Read<u32>();
+	outboundMessageNumberCounter = (long)src.Read<u32>();
+	outboundReliableMessageNumberCounter = (long)src.Read<u32>();
+
+	outboundOrderNumbers.resize(src.Read<u32>());
+	for(size_t i = 0; i < outboundOrderNumbers.size(); ++i)
+		outboundOrderNumbers[i] = src.Read<u32>();
+	inboundOrderingChannels.resize(src.Read<u32>());
+	for(size_t i = 0; i < inboundOrderingChannels.size(); ++i)
+	{
+		ReorderRing<PendingInOrderMessage> &pendingMessages = inboundOrderingChannels[i].pendingMessages;
+		pendingMessages.SetNext(src.Read<u32>());
+		const u32 numHeld = src.Read<u32>();
+		for(u32 j = 0; j < numHeld; ++j)
+		{
+			const u32 orderNumber = src.Read<u32>();
+			PendingInOrderMessage &pending = pendingMessages.Hold(orderNumber);
+			pending.packetID = src.Read<u32>();
+			pending.serialized = (src.Read<u8>() != 0);
+			pending.message = 0;
+			if (src.Read<u8>() != 0)
+			{
+				pending.message = AllocateNewMessage();
+				pending.message->id = src.Read<u32>();
+				pending.message->Resize(src.Read<u32>());
+				src.ReadArray<u8>((u8*)pending.message->data, pending.message->Size());
+			}
+		}
+	}
+
+	rttCleared = (src.Read<u8>() != 0);
+	smoothedRTT = src.Read<float>();
+	rttVariation = src.Read<float>();
+	retransmissionTimeout = src.Read<float>();
+	latestRtt = src.Read<float>();
+	packetLossRate = src.Read<float>();
+	numCEMarksReceived = src.Read<u32>();
+	peerCEMarks = src.Read<u32>();
+	congestionControlAlgorithm = (CongestionControlAlgorithm)src.Read<u8>();
+	const size_t window = src.Read<u32>();
+	maxDatagramSize = src.Read<u32>();
+	maxDatagramSizeLimit = src.Read<u32>();
+	advertisedDatagramSizeLimit = src.Read<u32>();
+	peerDatagramSizeLimit = src.Read<u32>();
+	smallestFailedProbeSize = src.Read<u32>();
+	// The controller starts from the window of the old process, and from its round trip time, so that the connection goes
+	// on at the rate it had.
+	UpdateCongestionControl();
+	congestionControl->ResumeWindow(window);
+	if (!rttCleared)
+		congestionControl->OnRttSample(Clock::Tick(), smoothedRTT);
+	UpdateCongestionControl();
+
+	numReliableMessagesReceived = src.Read<u32>();
+	advertisedReceiveCreditLimit = src.Read<u32>();
+	numNewReliableMessagesSent = src.Read<u32>();
+	peerReceiveCreditLimit = src.Read<u32>();
+	peerGrantsReceiveCredits = (src.Read<u8>() != 0);
+	compressionOfferSent = (src.Read<u8>() != 0);
+	peerCompressionCodecs = src.Read<u8>();
+	peerCompressionDictionaryID = src.Read<u32>();
+	messageIDCodes.DeserializeFrom(src);
+
+	// The messages keep their reliable and order numbers, so the peer sees the resends of the ones it has received as
+	// duplicates, and the in-order ones in their places.
+	const u32 numOutboundMessages = src.Read<u32>();
+	for(u32 i = 0; i < numOutboundMessages; ++i)
+	{
+		NetworkMessage *msg = AllocateNewMessage();
+		msg->id = src.Read<u32>();
+		msg->priority = src.Read<u32>();
+		msg->contentID = src.Read<u32>();
+		const u8 flags = src.Read<u8>();
+		msg->reliable = (flags & 1) != 0;
+		msg->inOrder = (flags & 2) != 0;
+		msg->hasOrderNumber = (flags & 4) != 0;
+		msg->forwardErrorCorrection = (flags & 8) != 0;
+		msg->orderingChannel = src.Read<u8>();
+		msg->reliableMessageNumber = src.Read<u32>();
+		msg->orderNumber = src.Read<u32>();
+		msg->sendCount = src.Read<u32>();
+		msg->Resize(src.Read<u32>());
+		src.ReadArray<u8>((u8*)msg->data, msg->Size());
+		msg->messageNumber = NextMessageNumber();
+		outboundQueue.Insert(msg);
+	}
+	const u32 numInboundMessages = src.Read<u32>();
+	for(u32 i = 0; i < numInboundMessages; ++i)
+	{
+		NetworkMessage *msg = AllocateNewMessage();
+		msg->id = src.Read<u32>();
+		msg->receivedPacketID = src.Read<u32>();
+		msg->Resize(src.Read<u32>());
+		src.ReadArray<u8>((u8*)msg->data, msg->Size());
+		QueueInboundMessage(msg);
+	}
+	const u32 numDatagrams = src.Read<u32>();
+	std::vector<char> datagram;
+	for(u32 i = 0; i < numDatagrams; ++i)
+	{
+		datagram.resize(src.Read<u32>());
+		if (!datagram.empty())
+		{
+			src.ReadArray<u8>((u8*)&datagram[0], datagram.size());
+			QueueInboundDatagram(&datagram[0], datagram.size());
+		}
+	}
+}
+
 /// Checks whether any reliably sent packets have timed out.
 void UDPMessageConnection::ProcessPacketTimeouts() // [worker thread]
 {
@@ -224,82 +956,137 @@ void UDPMessageConnection::ProcessPacketTimeouts() // [worker thread]
 
 	const tick_t now = Clock::Tick();
 
-	int numPacketsTimedOut = 0;
+	// The reordering window of the datagrams that were sent before the newest acked one may have passed in the meanwhile.
+	DetectLostDatagrams();
+
+	// If the peer has not acked anything for a while, assume the newest datagram was lost and resend its messages. The ack
+	// of the probe then lets DetectLostDatagrams find the other datagrams that were lost before it.
+	if (outboundPacketAckTrack.Size() > 0 && Clock::IsNewer(now, lossProbeTick))
+	{
+		KNET_LOG(LogVerbose, "No acks received for %d datagrams in flight. Resending packet with ID %d as a loss probe.", 
+			(int)outboundPacketAckTrack.Size(), (int)outboundPacketAckTrack.Newest()->packetID);
+		ADDEVENT("lossProbesSent", 1, "");
+		RequeueLostDatagram(outboundPacketAckTrack.Newest(), now, true);
+		lossProbePending = true;
+		numLossProbes = std::min(numLossProbes + 1, cMaxLossProbeBackoff);
+		ArmLossProbeTimer(now);
+	}
 
 	// Check whether any reliable packets have timed out and not acked.
-	while(outboundPacketAckTrack.Size() > 0)
+	bool timedOut = false;
+	for(;;)
 	{
-		PacketAckTrack *track = outboundPacketAckTrack.Front();
+		// The datagrams time out in the order they were sent, so that a datagram sent after the RTO has dropped does not time
+		// out while an older one is still waiting for its ack, which would back off the timer for nothing. This way only the
+		// datagrams that time out are visited.
+		PacketAckTrack *track = outboundPacketAckTrack.Oldest();
 		if (!track || Clock::IsNewer(track->timeoutTick, now))
-			return; // Note here: for optimization purposes, the packets will time out in the order they were sent.
+			break;
 
-		++numPacketsTimedOut;
-			
 		KNET_LOG(LogVerbose, "A packet with ID %d timed out. Age: %.2fms. Contains %d messages.", 
-			(int)track->packetID, (float)Clock::TimespanToMillisecondsD(track->sentTick, now), (int)track->messages.size());
-		ADDEVENT("datagramsLost", 1, "");
+			(int)track->packetID, (float)Clock::TimespanToMillisecondsD(track->sentTick, now), track->numMessages);
+		ADDEVENT("datagramsTimedOut", 1, "");
 
-		// Store a new suggestion for a lowered datagram send rate.
-		lowestDatagramSendRateOnPacketLoss = min(lowestDatagramSendRateOnPacketLoss, track->datagramSendRate);
+		timedOut = true;
+		RequeueLostDatagram(track, now, false);
+	}
 
-		// Adjust the flow control values on this event.
+	// Back off the retransmission timer once for all the datagrams that timed out together. The losses detected from the acks
+	// don't do this, since the acks show that the path still works.
+	if (timedOut)
 		UpdateRTOCounterOnPacketLoss();
+}
 
-		// Put all messages back into the outbound queue for send repriorisation.
-		for(size_t i = 0; i < track->messages.size(); ++i)
-#ifdef KNET_NO_MAXHEAP
-			outboundQueue.InsertWithResize(track->messages[i]);
-#else
-			outboundQueue.Insert(track->messages[i]);
-#endif
+void UDPMessageConnection::ArmLossProbeTimer(tick_t now)
+{
+	AssertInWorkerThreadContext();
 
-		// We are not going to resend the old timed out packet as-is with the old packet ID. Instead, just forget about it.
-		// The messages will go to a brand new packet with new packet ID.
-		outboundPacketAckTrack.PopFront();
-	}
+	using namespace std;
+
+	// PTO = smoothed_rtt + max(4*rttvar, granularity) + max_ack_delay, doubled for each probe that did not get acked.
+	const float probeTimeout = rttCleared ? retransmissionTimeout : (smoothedRTT + max(4.f * rttVariation, cMinReorderWindowMSecs) + maxAckDelay);
+	const float backedOffTimeout = min(maxRTOTimeoutValue, probeTimeout * (float)(1 << numLossProbes));
+	lossProbeTick = now + (tick_t)((double)backedOffTimeout * Clock::TicksPerMillisecond());
 }
 
-void UDPMessageConnection::HandleFlowControl()
+void UDPMessageConnection::DetectLostDatagrams()
 {
 	AssertInWorkerThreadContext();
 
-	const tick_t frameLength = Clock::TicksPerSec() / 100; // in ticks
-	// Additively increase the outbound send rate.
-	unsigned long numFrames = (unsigned long)(Clock::TicksInBetween(Clock::Tick(), lastFrameTime) / frameLength);
-	if (/*numAcksLastFrame > 0 &&*/ numFrames > 0)
+	if (!haveAckedDatagrams)
+		return;
+
+	using namespace std;
+
+	const tick_t now = Clock::Tick();
+	const float reorderWindow = max(cMinReorderWindowMSecs, cReorderWindowRtts * max(latestRtt, rttCleared ? 0.f : smoothedRTT));
+
+	// The datagrams are tracked in the order they were sent, so only the ones at the front can have been sent before the newest acked one.
+	for(PacketAckTrack *track = outboundPacketAckTrack.Oldest(); track;)
 	{
-		if (numFrames >= 100)
-			numFrames = 100;
+		if (!Clock::IsNewer(largestAckedSentTick, track->sentTick))
+			break;
+
+		PacketAckTrack *next = outboundPacketAckTrack.Next(track);
 
-		if (numLossesLastFrame > 5) // Do not respond to a random single packet losses.
+		if (PacketIDDistance(track->packetID, largestAckedPacketID) >= cPacketReorderThreshold ||
+			Clock::TimespanToMillisecondsF(track->sentTick, now) >= reorderWindow)
 		{
-			float oldRate = datagramSendRate;
-			datagramSendRate = min(datagramSendRate, max(1.f, lowestDatagramSendRateOnPacketLoss * 0.9f)); // Multiplicative decreases.
-//			datagramSendRate = max(1.f, datagramSendRate * 0.9f); // Multiplicative decreases.
-			KNET_LOG(LogVerbose, "Received %d losses. datagramSendRate backed to %.2f from %.2f", (int)numLossesLastFrame, datagramSendRate, oldRate);
+			KNET_LOG(LogVerbose, "A packet with ID %d was lost. Packet with ID %d sent after it was acked already.", 
+				(int)track->packetID, (int)largestAckedPacketID);
+			ADDEVENT("datagramsFastRetransmitted", 1, "");
+			RequeueLostDatagram(track, now, false);
 		}
-		else // Additive increases.
-		{
-			// In packets/second.
-			const float totalEstimatedBandwidth = 50; ///\todo Make this estimation dynamic as in UDT or similar.
-			const float additiveIncreaseAggressiveness = 5e-2f;
+		track = next;
+	}
+}
 
-			float increment = min((float)numFrames * additiveIncreaseAggressiveness * (totalEstimatedBandwidth - datagramSendRate), 1.f);
-			datagramSendRate += increment;
-			datagramSendRate = min(datagramSendRate, totalEstimatedBandwidth);
-			lowestDatagramSendRateOnPacketLoss = datagramSendRate;
-//			KNET_LOG(LogVerbose, "Incremented sendRate by %.2f to %.2f", increment, datagramSendRate);
-		}
-		numAcksLastFrame = 0;
-		numLossesLastFrame = 0;
-		if (numFrames < 100)
-			lastFrameTime += numFrames * frameLength;
-		else
-			lastFrameTime = Clock::Tick();
+void UDPMessageConnection::RequeueLostDatagram(PacketAckTrack *track, tick_t now, bool lossProbe)
+{
+	AssertInWorkerThreadContext();
+
+	// The datagram is no longer in flight. Let the congestion controller respond to the loss.
+	bytesInFlight -= std::min((size_t)bytesInFlight, track->datagramSize);
+	sendWindowFull = false;
+	if (!lossProbe)
+	{
+		packetLossRate += cPacketLossRateGain * (1.f - packetLossRate);
+		ADDEVENT("datagramsLost", 1, "");
+		congestionControl->OnDatagramLost(now, track->ToSentDatagramInfo(), bytesInFlight);
+		PathMTUDatagramLost(track->datagramSize, track->sentTick);
 	}
 
-	// Do a fixed flow control for testing.
-	datagramSendRate = 1000; ///\todo Remove.
+	// Put all messages back into the outbound queue for send repriorisation. They have waited long enough already, so
+	// they are not held back to be coalesced with others.
+	for(NetworkMessage *msg = track->messages; msg;)
+	{
+		NetworkMessage *next = msg->nextInDatagram;
+		msg->nextInDatagram = 0;
+		outboundQueue.Insert(msg);
+		msg = next;
+	}
+	queuedOutboundPriority = NetworkMessage::cMaxPriority;
+	FreeSentDeltaStates(track->deltaStates);
+
+	// We are not going to resend the old lost packet as-is with the old packet ID. Instead, just forget about it.
+	// The messages will go to a brand new packet with new packet ID.
+	outboundPacketAckTrack.Erase(track);
+}
+
+void UDPMessageConnection::UpdateCongestionControl()
+{
+	if (!congestionControl || congestionControl->Algorithm() != congestionControlAlgorithm)
+	{
+		// The new controller starts from its initial state. The datagrams already in flight count in its window.
+		delete congestionControl;
+		congestionControl = CongestionControl::Create(congestionControlAlgorithm, maxDatagramSize);
+		KNET_LOG(LogVerbose, "UDPMessageConnection::UpdateCongestionControl: Using %s congestion control in connection %p.", 
+			CongestionControlAlgorithmToString(congestionControl->Algorithm()), this);
+	}
+
+	congestionControl->SetMaxDatagramSize(maxDatagramSize);
+	congestionWindow = congestionControl->CongestionWindow();
+	datagramSendRate = (float)(congestionControl->PacingRate() / maxDatagramSize);
 }
 
 void UDPMessageConnection::SendOutPackets()
@@ -309,10 +1096,71 @@ void UDPMessageConnection::SendOutPackets()
 	if (!socket || !socket->IsWriteOpen())
 		return;
 
+	if (HoldOutboundMessages())
+	{
+		// The worker thread keeps waiting on the event while the messages are held, so that the messages queued meanwhile
+		// can fill up the datagram early. Only ones that are not accepted yet need to raise it.
+		eventMsgsOutAvailable.Reset();
+		if (outboundAcceptQueue.Size() > 0)
+			eventMsgsOutAvailable.Set();
+		return;
+	}
+	if (holdingOutboundMessages)
+		ADDEVENT("coalescedDatagramBytes", (float)acceptedOutboundBytes, "bytes");
+	holdingOutboundMessages = false;
+
+	RefillFragmentedTransferWindows();
+
 	PacketSendResult result = PacketSendOK;
 	int maxSends = 50;
+	// Collect the datagrams of this pass and send them out to the socket with as few system calls as possible.
+	socket->BeginDatagramBatch();
 	while(result == PacketSendOK && TimeUntilCanSendPacket() == 0 && maxSends-- > 0)
 		result = SendOutPacket();
+	socket->EndDatagramBatch();
+	flushingHeldMessages = (sendCoalescingDelay > 0 && outboundQueue.Size() > 0);
+
+	// Thread-safely clear the eventMsgsOutAvailable event if we don't have any messages to process.
+	if (NumOutboundMessagesPending() == 0)
+		eventMsgsOutAvailable.Reset();
+	if (NumOutboundMessagesPending() > 0)
+		eventMsgsOutAvailable.Set();
+}
+
+bool UDPMessageConnection::HoldOutboundMessages()
+{
+	// The connection handshake and the resends are not held back, and neither is anything while a transfer is going on,
+	// since it queues its fragments as the window allows.
+	const int maxDelay = sendCoalescingDelay;
+	if (maxDelay <= 0 || bOutboundSendsPaused || connectionState != ConnectionOK || connectDatagramDeferred ||
+		outboundQueue.Size() == 0 || flushingHeldMessages || queuedOutboundPriority >= sendCoalescingUrgentPriority ||
+		!fragmentedSends.Acquire()->transfers.empty())
+		return false;
+
+	if (!holdingOutboundMessages)
+	{
+		holdingOutboundMessages = true;
+		holdStartTime = Clock::Tick();
+	}
+	// Holding the messages any longer would not make the datagram fuller.
+	const size_t datagramBytes = maxDatagramSize - DatagramSealOverhead() - 7;
+	return acceptedOutboundBytes < std::min((size_t)sendCoalescingBytes, datagramBytes) &&
+		Clock::MillisecondsSinceD(holdStartTime) * 1000.0 < maxDelay;
+}
+
+void UDPMessageConnection::RefillFragmentedTransferWindows()
+{
+	AssertInWorkerThreadContext();
+
+	// Keep enough of each transfer in flight to fill the congestion window, but no more, so that the other messages of
+	// the same priority don't queue up behind a large message.
+	const size_t minWindow = FragmentedSendManager::cMinSendWindowBytes;
+	const size_t window = std::max(minWindow, 2 * congestionControl->CongestionWindow());
+
+	Lock<FragmentedSendManager> sends = fragmentedSends.Acquire();
+	for(FragmentedSendManager::TransferList::iterator iter = sends->transfers.begin(); iter != sends->transfers.end(); ++iter)
+		if (iter->source && iter->bytesOutstanding < window)
+			QueueNextFragments(&*iter, window, true);
 }
 
 /// Returns the 'earlier' of the two message numbers, taking number wrap-around into account.
@@ -337,6 +1185,23 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 	if (bOutboundSendsPaused)
 		return PacketSendNoMessages;
 
+	const size_t sealOverhead = DatagramSealOverhead();
+
+	// The connect datagram of a connection opened with early data goes out once the application resumes the sends. It
+	// carries the first datagram of the connection if the first message fits in, and otherwise goes out on its own.
+	if (connectDatagramDeferred)
+	{
+		// Take in the messages that the application sent before it resumed the sends, so that they make the early data.
+		AcceptOutboundMessages();
+		if (outboundQueue.Size() == 0 || 7 + outboundQueue.Front()->GetTotalDatagramPackedSize() + ConnectDatagramOverhead() +
+			sealOverhead > maxDatagramSize)
+			SendConnectDatagram();
+	}
+
+	// The server does not know the address of the client until the connect datagram has got through.
+	if (connectionState == ConnectionPending && sentEarlyData)
+		return PacketSendNoMessages;
+
 	if (outboundQueue.Size() == 0)
 		return PacketSendNoMessages;
 
@@ -344,13 +1209,13 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 	if (!CanSendOutNewDatagram())
 		return PacketSendThrottled;
 
-    OverlappedTransferBuffer *data = socket->BeginSend(socket->MaxSendSize());
+	// The datagram size limits count the bytes that go on the wire, so leave room for the nonce and tag of the encryption
+	// or the checksum, and for the rest of the connect datagram if this datagram is sent as its early data.
+	const size_t maxSendSize = maxDatagramSize - sealOverhead - (connectDatagramDeferred ? ConnectDatagramOverhead() : 0);
+	OverlappedTransferBuffer *data = socket->BeginSend((int)maxDatagramSize);
 	if (!data)
 		return PacketSendThrottled;
 
-//	const size_t minSendSize = 1;
-	const size_t maxSendSize = socket->MaxSendSize();
-
 	// Push out all the pending data to the socket.
 	datagramSerializedMessages.clear();
 
@@ -364,17 +1229,50 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 
 	unsigned long smallestReliableMessageNumber = 0xFFFFFFFF;
 
+	// If true, the packet is protected by forward error correction, and leaves room for the parity datagram overhead.
+	bool fecProtected = false;
+
 	skippedMessages.clear();
 
+	// If the congestion window is full, only unreliable messages (e.g. PacketAcks) may go out until the peer acks
+	// some of the datagrams in flight. A loss probe is let through, since otherwise nothing would elicit the acks.
+	const bool congestionWindowFull = bytesInFlight >= congestionControl->CongestionWindow() && !lossProbePending;
+	u32 receiveCreditsLeft = peerGrantsReceiveCredits ? (u32)std::max(0, ReceiveCreditsLeft()) : 0;
+
+	// When the next message does not fit in the rest of the datagram, the few messages after it are looked at for ones
+	// that do. The messages passed over go back to the queue after the loop. A FIFO queue keeps its order as queued.
+	int lookaheadLeft = (outboundQueue.Type() != OutboundQueueFIFO) ? cPackingLookahead : 0;
+	// The ordering channels of the in-order messages passed over. A later in-order message of the same channel may not
+	// overtake them, since the messages take their place in the channel as they are serialized.
+	u32 passedOverChannels[256 / 32] = { 0 };
+	bool passedOver = false;
+
 	// Fill up the rest of the packet from messages from the outbound queue.
+	const tick_t now = Clock::Tick();
 	while(outboundQueue.Size() > 0)
 	{
-#ifdef KNET_NO_MAXHEAP
-		NetworkMessage *msg = *outboundQueue.Front();
-#else
 		NetworkMessage *msg = outboundQueue.Front();
-#endif
-		if (msg->obsolete)
+		// A stale unreliable message is dropped before anything is spent on it.
+		if (msg->IsExpiredAt(now) && !msg->transfer)
+		{
+			outboundQueue.PopFront();
+			FreeExpiredMessage(msg);
+			continue;
+		}
+
+		// Once a message has been passed over, only the messages that may be delivered ahead of it are taken.
+		if (passedOver && (msg->transfer || (msg->inOrder && (passedOverChannels[msg->orderingChannel / 32] & (1U << (msg->orderingChannel % 32))) != 0)))
+		{
+			if (lookaheadLeft-- <= 0)
+				break;
+			outboundQueue.PopFront();
+			skippedMessages.push_back(msg);
+			continue;
+		}
+
+		// A message that has been given its place in an ordering channel has to go out, or the channel would stall at the gap.
+		// The FragmentedTransferAbort message of an aborted transfer tells the peer to skip its position instead.
+		if (msg->obsolete && (msg->transfer ? (!msg->transfer->hasOrderNumber || msg->transfer->abortPending) : !msg->hasOrderNumber))
 		{
 			outboundQueue.PopFront();
 			ClearOutboundMessageWithContentID(msg);
@@ -382,7 +1280,19 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 			continue;
 		}
 
-		// If we're sending a fragmented message, allocate a new transferID for that message,
+		// The messages are in priority order, so all the urgent unreliable messages have been taken by now.
+		if (msg->reliable && congestionWindowFull)
+			break;
+
+		// New reliable messages only go out while the peer has credits left to buffer them. The resends were already counted.
+		if (msg->reliable && msg->sendCount == 0 && peerGrantsReceiveCredits)
+		{
+			if (receiveCreditsLeft == 0)
+				break;
+			--receiveCreditsLeft;
+		}
+
+		// If we're sending a fragmented message, allocate a new transferID for that message,
 		// or skip it if there are no transferIDs free.
 		if (msg->transfer)
 		{
@@ -402,22 +1312,43 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 			}
 		}
 
+		// The message takes its version when it first goes out, so that the delta refers to the latest acked baseline.
+		if (msg->deltaEncoding && !msg->deltaEncoded && !msg->reliable && msg->contentID != 0 && !msg->transfer)
+			EncodeDeltaState(msg);
+
 		// We need to add extra 2 bytes for the VLE-encoded InOrder PacketID delta counter.
 		// Estimate the size the per-message header consumes at most.
 		// This computation is not exact, but as it only needs to be an upper bound, keeping it simple is good. \todo Can be more precise here.
 		int totalMessageSize = msg->GetTotalDatagramPackedSize();// + ((msg->inOrder && !inOrder) ? cBytesForInOrderDeltaCounter : 0);
 
-		// If this message won't fit into the buffer, send out all the previously gathered messages (there must at least be one previously submitted message).		
-		if (!datagramSerializedMessages.empty() && (size_t)packetSizeInBytes + totalMessageSize >= maxSendSize)
-			break;
+		const bool fecMessage = IsForwardErrorCorrected(*msg);
+		const size_t sendSizeLimit = (fecProtected || fecMessage) ? min(maxSendSize - cFECParityOverhead, cMaxFECDatagramSize) : maxSendSize;
+
+		// If this message won't fit into the buffer, look further for one that does, and then send out all the previously
+		// gathered messages (there must at least be one previously submitted message).
+		if (!datagramSerializedMessages.empty() && (size_t)packetSizeInBytes + totalMessageSize >= sendSizeLimit)
+		{
+			if (lookaheadLeft-- <= 0 || (size_t)packetSizeInBytes + cMinPackingSpace > sendSizeLimit)
+				break;
+			outboundQueue.PopFront();
+			skippedMessages.push_back(msg);
+			if (msg->inOrder)
+				passedOverChannels[msg->orderingChannel / 32] |= 1U << (msg->orderingChannel % 32);
+			passedOver = true;
+			continue;
+		}
 
 		if (totalMessageSize > (int)maxSendSize)
-			KNET_LOG(LogError, "Warning: Sending out a message of ID %d and size %d bytes, but UDP socket max send size is only %d bytes!", (int)msg->id, totalMessageSize, (int)maxSendSize);
+			KNET_LOG(LogError, "Warning: Sending out a message of ID %d and size %d bytes, but the max datagram size of the connection is only %d bytes!", (int)msg->id, totalMessageSize, (int)maxSendSize);
 
 		datagramSerializedMessages.push_back(msg);
 		outboundQueue.PopFront();
+		MessageTracer::Record(msg->traceID, msg->id, TraceSerialized);
+		if (passedOver)
+			ADDEVENT("messagesPackedAhead", 1, "");
 
 		packetSizeInBytes += totalMessageSize;
+		fecProtected = fecProtected || fecMessage;
 
 		if (msg->reliable)
 		{
@@ -447,23 +1378,51 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 	// If we had skipped any messages from the outbound queue while looking for good messages to send, put all the messages
 	// we skipped back to the outbound queue to wait to be processed during subsequent frames.
 	for(size_t i = 0; i < skippedMessages.size(); ++i)
-#ifdef KNET_NO_MAXHEAP
-		outboundQueue.InsertWithResize(skippedMessages[i]);
-#else
 		outboundQueue.Insert(skippedMessages[i]);
-#endif
+
+	if (datagramSerializedMessages.empty())
+	{
+		// Everything left in the queue must wait for the congestion window to open up.
+		socket->AbortSend(data);
+		sendWindowFull = true;
+		return PacketSendThrottled;
+	}
+
+	// Piggyback the pending acks on this datagram if they fit, so that traffic in both directions doesn't need datagrams
+	// of their own for the acks. Otherwise PerformPacketAckSends() sends them out once they are due.
+	const size_t ackSizeLimit = fecProtected ? min(maxSendSize - cFECParityOverhead, cMaxFECDatagramSize) : maxSendSize;
+	if (receivedPacketIDs.NumPendingAcks() > 0 &&
+		packetSizeInBytes + PacketAckRangesMessagePackedSize(receivedPacketIDs.NumPendingAcks()) < ackSizeLimit)
+	{
+		NetworkMessage *ack = CreatePacketAckMessage();
+		ack->messageNumber = NextMessageNumber();
+		ack->reliableMessageNumber = 0;
+		ack->sendCount = 0;
+		datagramSerializedMessages.push_back(ack);
+		packetSizeInBytes += ack->GetTotalDatagramPackedSize();
+		ADDEVENT("piggybackedAck", (float)ack->dataSize, "bytes");
+	}
+
+	// A datagram that carries delta-encoded messages is acked like a reliable one, so that the later deltas of their
+	// contents can refer to them, but its unreliable messages are not resent if it is lost.
+	bool ackRequested = reliable;
+	for(size_t i = 0; i < datagramSerializedMessages.size() && !ackRequested; ++i)
+		ackRequested = datagramSerializedMessages[i]->deltaEncoded;
 
 	// Finally proceed to crafting the actual UDP packet.
 	DataSerializer writer(data->buffer.buf, data->buffer.len);
 
 	const packet_id_t packetID = datagramPacketIDCounter;
-	writer.Add<u8>((u8)((packetID & 63) | ((reliable ? 1 : 0) << 6)  | ((inOrder ? 1 : 0) << 7)));
+	writer.Add<u8>((u8)((packetID & 63) | ((ackRequested ? 1 : 0) << 6)  | ((inOrder ? 1 : 0) << 7)));
 	writer.Add<u16>((u16)(packetID >> 6));
-	if (reliable)
+	if (ackRequested)
 	{
+		if (!reliable)
+			smallestReliableMessageNumber = 0;
 		assert((smallestReliableMessageNumber & 0x80000000) == 0);
 		writer.AddVLE<VLE16_32>(smallestReliableMessageNumber);
 	}
+	const size_t datagramHeaderSize = writer.BytesFilled();
 
 	bool sentDisconnectMessage = false;
 	bool sentDisconnectAckMessage = false;
@@ -474,7 +1433,57 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 		NetworkMessage *msg = datagramSerializedMessages[i];
 		assert(!msg->transfer || msg->transfer->id != -1);
 
-		const int encodedMsgIdLength = (msg->transfer == 0 || msg->fragmentIndex == 0) ? VLE8_16_32::GetEncodedBitLength(msg->id)/8 : 0;
+		// A run of messages with the same ID and flags goes out as one Aggregate record: the usual message header, reliable
+		// and order numbers of the first message and the Aggregate ID, then the message ID, the number of messages and
+		// the length-prefixed content of each.
+		size_t aggregateContentSize = 0;
+		const size_t runLength = AggregatableRunLength(i, aggregateContentSize);
+		if (runLength > 1)
+		{
+			const u16 orderingChannel = (msg->inOrder && msg->reliable && msg->orderingChannel != 0 ? 1 : 0) << 11;
+			const u16 reliable = (msg->reliable ? 1 : 0) << 12;
+			const u16 inOrder = (msg->inOrder ? 1 : 0) << 13;
+			writer.Add<u16>((u16)aggregateContentSize | orderingChannel | reliable | inOrder);
+			if (msg->reliable)
+				writer.AddVLE<VLE8_16>((u32)(msg->reliableMessageNumber - smallestReliableMessageNumber));
+			if (msg->reliable && msg->inOrder)
+			{
+				if (orderingChannel != 0)
+					writer.Add<u8>(msg->orderingChannel);
+				writer.AddVLE<VLE8_16>(msg->orderNumber & cOrderNumberMask);
+			}
+			AddMessageID(writer, MsgIdAggregate);
+			writer.AddVLE<VLE8_16_32>(msg->id);
+			writer.AddVLE<VLE8_16>((u32)runLength);
+			for(size_t j = i; j < i + runLength; ++j)
+			{
+				NetworkMessage *m = datagramSerializedMessages[j];
+				writer.AddVLE<VLE8_16>((u32)m->dataSize);
+				if (m->dataSize > 0)
+				{
+					if (networkSendSimulator.enabled && 
+						(networkSendSimulator.corruptionType == NetworkSimulator::CorruptPayload ||
+						(networkSendSimulator.corruptionType == NetworkSimulator::CorruptMessageType &&
+						 m->id == networkSendSimulator.corruptMessageId)))
+						 networkSendSimulator.MaybeCorruptBufferToggleBits(m->data, m->dataSize);
+					writer.AddAlignedByteArray(m->data, m->dataSize);
+				}
+			}
+			ADDEVENT("messagesAggregated", (float)runLength, "");
+			i += runLength - 1;
+			continue;
+		}
+
+		message_id_t wireMessageID = msg->deltaEncoded ? MsgIdDeltaState : msg->id;
+		// The frequent long IDs of unfragmented messages go out as the 1-byte codes the peer has accepted for them.
+		if (messageIDCodes.Enabled() && !msg->transfer && !msg->deltaEncoded && msg->id < MsgIdDisconnectAck)
+		{
+			message_id_t code;
+			if (messageIDCodes.CountSent(msg->id, code))
+				SendMessageIDCodeMessage(MessageIDCodeOffer, code, msg->id);
+			wireMessageID = messageIDCodes.Encode(msg->id);
+		}
+		const int encodedMsgIdLength = (msg->transfer == 0 || msg->fragmentIndex == 0) ? (int)EncodedMessageIDSize(wireMessageID) : 0;
 		const size_t messageContentSize = msg->dataSize + encodedMsgIdLength; // 1/2/4 bytes: Message ID. X bytes: Content.
 		assert(messageContentSize < (1 << 11));
 
@@ -483,15 +1492,27 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 		else if (msg->id == MsgIdDisconnectAck)
 			sentDisconnectAckMessage = true;
 
+		// Only the reliable messages are ordered, since the unreliable ones might never arrive to fill in a gap.
+		const bool ordered = msg->reliable && msg->inOrder;
+
+		const u16 orderingChannel = (ordered && msg->orderingChannel != 0 ? 1 : 0) << 11;
 		const u16 reliable = (msg->reliable ? 1 : 0) << 12;
 		const u16 inOrder = (msg->inOrder ? 1 : 0) << 13;
 		const u16 fragmentedTransfer = (msg->transfer != 0 ? 1 : 0) << 14;
 		const u16 firstFragment = (msg->transfer != 0 && msg->fragmentIndex == 0 ? 1 : 0) << 15;
-		writer.Add<u16>((u16)messageContentSize | reliable | inOrder | fragmentedTransfer | firstFragment);
+		writer.Add<u16>((u16)messageContentSize | orderingChannel | reliable | inOrder | fragmentedTransfer | firstFragment);
 
 		if (msg->reliable)
 			writer.AddVLE<VLE8_16>((u32)(msg->reliableMessageNumber - smallestReliableMessageNumber));
 
+		if (ordered)
+		{
+			const u32 orderNumber = TakeOrderNumber(msg);
+			if (orderingChannel != 0)
+				writer.Add<u8>(msg->orderingChannel);
+			writer.AddVLE<VLE8_16>(orderNumber & cOrderNumberMask);
+		}
+
 		///\todo Add the InOrder index here to track which datagram/message we depended on.
 
 		assert((!firstFragment && !fragmentedTransfer) || msg->transfer);
@@ -499,11 +1520,11 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 		if (firstFragment != 0)
 			writer.AddVLE<VLE8_16_32>(msg->transfer->totalNumFragments);
 		if (fragmentedTransfer != 0)
-			writer.Add<u8>((u8)msg->transfer->id);
+			writer.AddVLE<VLE8_16>(msg->transfer->id);
 		if (firstFragment == 0 && fragmentedTransfer != 0)
 			writer.AddVLE<VLE8_16_32>(msg->fragmentIndex); // The message fragment number.
 		if (msg->transfer == 0 || msg->fragmentIndex == 0)
-			writer.AddVLE<VLE8_16_32>(msg->id); // Add the message ID number.
+			AddMessageID(writer, wireMessageID); // Add the message ID number.
 		if (msg->dataSize > 0) // Add the actual message payload data.
 		{
 			if (networkSendSimulator.enabled && 
@@ -515,8 +1536,45 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 		}
 	}
 
+	// Replace the message blocks with a single CompressedData message, if that makes the datagram smaller. Its content
+	// length field has 11 bits, and it takes two bytes of message header and the bytes of the message ID.
+	size_t datagramSize = writer.BytesFilled();
+	const size_t messageBlocksSize = datagramSize - datagramHeaderSize;
+	if (CompressionNegotiated() && messageBlocksSize >= compressionThreshold)
+	{
+		const size_t idSize = EncodedMessageIDSize(MsgIdCompressedData);
+		const size_t maxContentSize = min(messageBlocksSize - 2 - idSize - 1, (size_t)(1 << 11) - 1 - idSize);
+		const size_t contentSize = CompressMessageData(data->buffer.buf + datagramHeaderSize, messageBlocksSize, maxContentSize);
+		if (contentSize > 0)
+		{
+			DataSerializer compressedWriter(data->buffer.buf + datagramHeaderSize, messageBlocksSize);
+			compressedWriter.Add<u16>((u16)(contentSize + idSize));
+			AddMessageID(compressedWriter, MsgIdCompressedData);
+			compressedWriter.AddAlignedByteArray(&compressionBuffer[0], contentSize);
+			datagramSize = datagramHeaderSize + compressedWriter.BytesFilled();
+			ADDEVENT("compressionSavedBytes", (float)(messageBlocksSize - compressedWriter.BytesFilled()), "bytes");
+		}
+	}
+
+	// Take the datagram into the parity before the buffer is encrypted and handed over to the socket. The receiver
+	// rebuilds the plaintext of a lost datagram.
+	fecProtected = fecProtected && datagramSize <= cMaxFECDatagramSize;
+	if (fecProtected)
+		XorDatagramToFECGroup(packetID, data->buffer.buf, datagramSize);
+
+	datagramSize = SealDatagram(data->buffer.buf, datagramSize);
+
+	const bool earlyData = connectDatagramDeferred;
+	if (earlyData)
+	{
+		datagramSize = WriteConnectDatagram(data->buffer.buf, datagramSize);
+		connectDatagramDeferred = false;
+		sentEarlyData = true;
+	}
+
 	// Send the crafted packet out to the socket.
-	data->bytesContains = writer.BytesFilled();
+	data->bytesContains = datagramSize;
+	CapturePacket(CaptureOutbound, data->buffer.buf, datagramSize);
 	bool success;
 
 	if (!networkSendSimulator.enabled)
@@ -535,22 +1593,43 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 		for(size_t i = 0; i < datagramSerializedMessages.size(); ++i)
 			outboundQueue.Insert(datagramSerializedMessages[i]);
 
+		// The next datagram reuses the PacketID, and the failed one can't be taken back out of the parity since EndSend
+		// has freed its buffer. Start the group over.
+		if (fecProtected)
+		{
+			fecGroupPacketIDs.clear();
+			fecParity.clear();
+			fecParityLength = 0;
+		}
+
+		// The connect datagram is written again with the next datagram.
+		if (earlyData)
+		{
+			connectDatagramDeferred = true;
+			sentEarlyData = false;
+		}
+
 		KNET_LOG(LogError, "UDPMessageConnection::SendOutPacket: Socket::EndSend failed to socket %s!", socket->ToString().c_str());
 		return PacketSendSocketFull;
 	}
 
 	// Sending the datagram succeeded - increment the send count of each message by one, to remember the retry timeout count.
+	const tick_t sentTick = Clock::Tick();
 	for(size_t i = 0; i < datagramSerializedMessages.size(); ++i)
 	{
-		++datagramSerializedMessages[i]->sendCount;
+		NetworkMessage *msg = datagramSerializedMessages[i];
+		if (++msg->sendCount == 1)
+		{
+			if (msg->queuedTick != 0)
+				samples->latencyHistograms[LatencyQueueTime].RecordTimespan(msg->queuedTick, sentTick);
+			if (msg->reliable)
+				++numNewReliableMessagesSent;
+		}
+		MessageTracer::Record(msg->traceID, msg->id, TraceSent);
 
 #ifdef KNET_NETWORK_PROFILING
-		std::stringstream ss;
-		if (!datagramSerializedMessages[i]->profilerName.empty())
-			ss << "messageOut." << datagramSerializedMessages[i]->profilerName;
-		else
-			ss << "messageOut." << datagramSerializedMessages[i]->id;
-		ADDEVENT(ss.str().c_str(), (float)datagramSerializedMessages[i]->Size(), "bytes");
+		if (owner)
+			owner->AddStatsEvent(samples->outboundMessageCounters.Get(msg->id, msg->transfer != 0, msg->profilerName.c_str()), (float)msg->Size());
 		if (datagramSerializedMessages[i]->transfer)
 		{
 			if (datagramSerializedMessages[i]->fragmentIndex > 0)
@@ -562,17 +1641,19 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 
 	assert(socket->TransportLayer() == SocketOverUDP);
 
-	// Now we have to wait 1/datagramSendRate seconds again until we can send the next datagram.
-	NewDatagramSent();
+	// Pace the next datagram according to the size of this one.
+	NewDatagramSent(datagramSize);
 
 	// The send was successful, we can increment our next free PacketID counter to use for the next packet.
-	lastSentInOrderPacketID = datagramPacketIDCounter;
 	datagramPacketIDCounter = AddPacketID(datagramPacketIDCounter, 1);
 
-	AddOutboundStats(writer.BytesFilled(), 1, datagramSerializedMessages.size());
-	ADDEVENT("datagramOut", (float)writer.BytesFilled(), "bytes");
+	AddOutboundStats(datagramSize, 1, datagramSerializedMessages.size());
+	ADDEVENT("datagramOut", (float)datagramSize, "bytes");
 
-	if (reliable)
+	if (fecProtected && fecGroupPacketIDs.size() >= (size_t)fecGroupSize)
+		SendFECParityDatagram();
+
+	if (ackRequested)
 	{
 		// Now that we have sent a reliable datagram, remember all messages that were
 		// serialized into this datagram so that we can properly resend the messages in the datagram if it times out.
@@ -581,21 +1662,55 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 		const tick_t now = Clock::Tick();
 		ack.sendCount = 1;
 		ack.sentTick = now;
-		retransmissionTimeout = 5000.f; ///\todo Remove this.
 		ack.timeoutTick = now + (tick_t)((double)retransmissionTimeout * Clock::TicksPerMillisecond());
-		ack.datagramSendRate = datagramSendRate;
-
-		for(size_t i = 0; i < datagramSerializedMessages.size(); ++i)
+		ack.datagramSize = datagramSize;
+
+		// Take the delivery rate snapshot for the congestion controller. A datagram sent into an empty
+		// pipe starts a fresh rate sample.
+		if (bytesInFlight == 0)
+			lastDeliveredTick = now;
+		ack.delivered = bytesDelivered;
+		ack.deliveredTick = lastDeliveredTick;
+		ack.appLimited = outboundQueue.Size() == 0;
+		bytesInFlight += ack.datagramSize;
+
+		// Link the messages and the delta states in reverse, so that the lists come out in the order of the datagram.
+		for(size_t i = datagramSerializedMessages.size(); i-- > 0;)
 		{
+			if (datagramSerializedMessages[i]->deltaEncoded)
+			{
+				int index = freeSentDeltaState;
+				if (index != -1)
+					freeSentDeltaState = sentDeltaStates[index].next;
+				else
+				{
+					index = (int)sentDeltaStates.size();
+					sentDeltaStates.push_back(SentDeltaState());
+				}
+				SentDeltaState &sent = sentDeltaStates[index];
+				sent.messageID = datagramSerializedMessages[i]->id;
+				sent.contentID = datagramSerializedMessages[i]->contentID;
+				sent.version = datagramSerializedMessages[i]->deltaVersion;
+				sent.next = ack.deltaStates;
+				ack.deltaStates = index;
+			}
+
 			if (datagramSerializedMessages[i]->reliable)
-				ack.messages.push_back(datagramSerializedMessages[i]); // The ownership of these messages is transferred into this struct.
+			{
+				// The ownership of these messages is transferred into this struct.
+				datagramSerializedMessages[i]->nextInDatagram = ack.messages;
+				ack.messages = datagramSerializedMessages[i];
+				++ack.numMessages;
+			}
 			else
 			{
 				ClearOutboundMessageWithContentID(datagramSerializedMessages[i]);
 				FreeMessage(datagramSerializedMessages[i]);
 			}
 		}
-		outboundPacketAckTrack.InsertWithResize(ack);
+		outboundPacketAckTrack.Insert(ack);
+		lossProbePending = false;
+		ArmLossProbeTimer(now);
 	}
 	else // We sent an unreliable datagram.
 	{
@@ -631,10 +1746,73 @@ MessageConnection::PacketSendResult UDPMessageConnection::SendOutPacket()
 		KNET_LOG(LogInfo, "UDPMessageConnection::SendOutPacket: Send DisconnectAck from connection %s.", ToString().c_str());
 	}
 
-	KNET_LOG(LogVerbose, "UDPMessageConnection::SendOutPacket: Socket::EndSend succeeded with %d bytes.", (int)writer.BytesFilled());
+	KNET_LOG(LogVerbose, "UDPMessageConnection::SendOutPacket: Socket::EndSend succeeded with %d bytes.", (int)datagramSize);
 	return PacketSendOK;
 }
 
+u32 UDPMessageConnection::TakeOrderNumber(NetworkMessage *msg)
+{
+	u32 &orderNumber = msg->transfer ? msg->transfer->orderNumber : msg->orderNumber;
+	bool &hasOrderNumber = msg->transfer ? msg->transfer->hasOrderNumber : msg->hasOrderNumber;
+	if (!hasOrderNumber)
+	{
+		if (outboundOrderNumbers.size() <= msg->orderingChannel)
+			outboundOrderNumbers.resize(msg->orderingChannel + 1, 0);
+		orderNumber = outboundOrderNumbers[msg->orderingChannel]++;
+		hasOrderNumber = true;
+	}
+	return orderNumber;
+}
+
+size_t UDPMessageConnection::AggregatableRunLength(size_t first, size_t &contentSize)
+{
+	NetworkMessage *msg = datagramSerializedMessages[first];
+	if (!messageAggregation || msg->transfer || msg->deltaEncoded || msg->id <= MsgIdExtension || msg->id >= MsgIdDisconnectAck)
+		return 1;
+
+	const bool ordered = msg->reliable && msg->inOrder;
+	const size_t idSize = VLE8_16_32::GetEncodedBitLength(msg->id)/8;
+	// The least number of bytes each message after the first one takes for its header, ID and reliable and order numbers
+	// when it is written on its own. The record replaces them with a length prefix.
+	const size_t messageOverhead = 2 + idSize + (msg->reliable ? 1 : 0) + (ordered ? 1 + (msg->orderingChannel != 0 ? 1 : 0) : 0);
+
+	// The content of the record starts with its own ID, the message ID and the number of messages, which takes at most
+	// two bytes.
+	const size_t aggregateIdSize = EncodedMessageIDSize(MsgIdAggregate);
+	size_t numMessages = 1;
+	size_t lengthPrefixesSize = VLE8_16::GetEncodedBitLength((u32)msg->dataSize)/8;
+	size_t size = aggregateIdSize + idSize + 2 + lengthPrefixesSize + msg->dataSize;
+	for(size_t i = first + 1; i < datagramSerializedMessages.size(); ++i)
+	{
+		NetworkMessage *prev = datagramSerializedMessages[i-1];
+		NetworkMessage *next = datagramSerializedMessages[i];
+		if (next->id != msg->id || next->reliable != msg->reliable || next->inOrder != msg->inOrder ||
+			next->orderingChannel != msg->orderingChannel || next->transfer || next->deltaEncoded)
+			break;
+		// The receiver numbers the messages of the record on from the first one.
+		if (next->reliable && (u32)next->reliableMessageNumber != (u32)prev->reliableMessageNumber + 1)
+			break;
+		if (ordered)
+		{
+			const u32 prevOrderNumber = TakeOrderNumber(prev);
+			if (TakeOrderNumber(next) != prevOrderNumber + 1)
+				break;
+		}
+		const size_t lengthPrefixSize = VLE8_16::GetEncodedBitLength((u32)next->dataSize)/8;
+		if (size + lengthPrefixSize + next->dataSize >= (1 << 11))
+			break;
+		size += lengthPrefixSize + next->dataSize;
+		lengthPrefixesSize += lengthPrefixSize;
+		++numMessages;
+	}
+
+	const size_t countSize = VLE8_16::GetEncodedBitLength((u32)numMessages)/8;
+	if (numMessages < 2 || (numMessages - 1) * messageOverhead <= aggregateIdSize + countSize + lengthPrefixesSize)
+		return 1;
+	contentSize = size - 2 + countSize;
+	return numMessages;
+}
+
 void UDPMessageConnection::DoUpdateConnection()
 {
 	AssertInWorkerThreadContext();
@@ -645,14 +1823,21 @@ void UDPMessageConnection::DoUpdateConnection()
 	{
 		// We can send out data now. Perform connection management before sending out any messages.
 		ProcessPacketTimeouts();
-		HandleFlowControl();
+		UpdateCongestionControl();
 
 		// Generate an Ack message if we've accumulated enough reliable messages to make it
 		// worthwhile or if some of them are timing out.
 		PerformPacketAckSends();
 
+		UpdatePathMTUDiscovery();
+		UpdateForwardErrorCorrection();
+		UpdateReceiveCredits();
+
+		ADDEVENT("maxDatagramSize", (float)MaxDatagramSize(), "bytes");
 		ADDEVENT("retransmissionTimeout", RetransmissionTimeout(), "msecs");
 		ADDEVENT("datagramSendRate", DatagramSendRate(), "msgs");
+		ADDEVENT("congestionWindow", (float)CongestionWindow(), "bytes");
+		ADDEVENT("bytesInFlight", (float)BytesInFlight(), "bytes");
 		ADDEVENT("smoothedRtt", SmoothedRtt(), "msecs");
 		ADDEVENT("rttVariation", RttVariation(), "");
 		ADDEVENT("numOutboundUnackedDatagrams", (float)NumOutboundUnackedDatagrams(), "");
@@ -662,59 +1847,131 @@ void UDPMessageConnection::DoUpdateConnection()
 
 		udpUpdateTimer.StartMSecs(10.f);
 	}
-
-/*
-	if (statsUpdateTimer.TriggeredOrNotRunning())
-	{
-		///\todo Put this behind a timer - update only once every 1 sec or so.
-		ComputePacketLoss();
-		statsUpdateTimer.StartMSecs(1000.f);
-	}
-*/
 }
 
 unsigned long UDPMessageConnection::TimeUntilCanSendPacket() const
 {
-	const tick_t now = Clock::Tick();
+	using namespace std;
+
+	// With a full congestion window, nothing goes out before an ack arrives or the next connection update
+	// runs the retransmission timers. Avoid busy-looping the worker thread until then.
+	if (sendWindowFull)
+		return max(1UL, (unsigned long)udpUpdateTimer.MSecsLeft());
+
+	// The datagrams after the early data wait for the reply of the server, which is polled for on the update timer.
+	if (connectionState == ConnectionPending && sentEarlyData)
+		return max(1UL, (unsigned long)udpUpdateTimer.MSecsLeft());
 
-	// The interval at which we send out datagrams.
-	const tick_t datagramSendTickDelay = (tick_t)(Clock::TicksPerSec() / datagramSendRate);
+	// Until SendOutPackets() has sent the held messages, keep the connection polled, even if their delay is up already.
+	if (holdingOutboundMessages)
+	{
+		const double msecsLeft = sendCoalescingDelay / 1000.0 - Clock::MillisecondsSinceD(holdStartTime);
+		return (msecsLeft > 1.0) ? (unsigned long)ceil(msecsLeft) : 1UL;
+	}
 
-	const tick_t nextDatagramSendTime = lastDatagramSendTime + datagramSendTickDelay;
+	// Both the pacing of the congestion controller and the application-set send rate limit must allow the send.
+	const unsigned long rateLimitMSecs = TimeUntilSendRateLimitAllowsSend();
 
+	const tick_t now = Clock::Tick();
 	if (Clock::IsNewer(now, nextDatagramSendTime))
-		return 0; // We are already due to send out the next datagram?
+		return rateLimitMSecs; // We are already due to send out the next datagram?
 
-	return (unsigned long)Clock::TimespanToMillisecondsF(now, nextDatagramSendTime);
+	return max(rateLimitMSecs, (unsigned long)Clock::TimespanToMillisecondsF(now, nextDatagramSendTime));
 }
 
 bool UDPMessageConnection::HaveReceivedPacketID(packet_id_t packetID) const
 {
-	return receivedPacketIDs.Exists(packetID);
+	return receivedPacketIDs.HasReceived(packetID);
 }
 
 void UDPMessageConnection::AddReceivedPacketIDStats(packet_id_t packetID)
 {
 	AssertInWorkerThreadContext();
 
-	/* \todo add back to enable packet loss computations.
-	ConnectionStatistics &cs = statistics.Lock();
+	// Remember this packet ID for duplicacy detection purposes.
+	receivedPacketIDs.MarkReceived(packetID);
+
+	previousReceivedPacketID = packetID;
+}
+
+void UDPMessageConnection::HandleInboundDatagram(char *data, size_t numBytes, tick_t receiveTick, u8 ecn)
+{
+	AssertInWorkerThreadContext();
+
+	// The simulated datagrams arrive when the simulator delivers them, so their kernel timestamps don't apply.
+	if (networkReceiveSimulator.enabled)
+	{
+		networkReceiveSimulator.SubmitReceivedDatagram(data, numBytes);
+		return;
+	}
+
+	if (receiveTick != 0)
+		samples->latencyHistograms[LatencyReceiveDelay].RecordTimespan(receiveTick, Clock::Tick());
+	inboundReceiveTick = receiveTick;
+	inboundECN = ecn;
+	DecryptAndExtractMessages(data, numBytes);
+	inboundReceiveTick = 0;
+	inboundECN = ECNNotECT;
+}
 
-	// Simple method to prevent computation errors caused by wraparound - we start from scratch when packet with ID 0 is received.
-//	if (packetID == 0)
-//		cs.recvPacketIDs.clear();
+void UDPMessageConnection::HandleSimulatedInboundDatagram(char *data, size_t numBytes)
+{
+	DecryptAndExtractMessages(data, numBytes);
+}
 
-	cs.recvPacketIDs.push_back(ConnectionStatistics::DatagramIDTrack());
-	ConnectionStatistics::DatagramIDTrack &t = cs.recvPacketIDs.back();
-	t.tick = Clock::Tick();
-	t.packetID = packetID;
-//	KNET_LOG(LogVerbose, "Marked packet with ID %d received.", (int)packetID);
-	statistics.Unlock();
-*/
-	// Remember this packet ID for duplicacy detection and pruning purposes.
-	receivedPacketIDs.Add(packetID);
+void UDPMessageConnection::DecryptAndExtractMessages(char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
 
-	previousReceivedPacketID = packetID;
+	if (cipher.HasKey())
+	{
+		const int plaintextSize = cipher.Decrypt(data, numBytes, data);
+		if (plaintextSize <= 0)
+		{
+			ADDEVENT("inputNotAuthentic", (float)numBytes, "bytes");
+			KNET_LOG(LogVerbose, "UDPMessageConnection::DecryptAndExtractMessages: Dropped a datagram of %d bytes that failed the authentication in connection %s.", (int)numBytes, ToString().c_str());
+			return;
+		}
+		numBytes = (size_t)plaintextSize;
+	}
+	else if (datagramChecksums)
+	{
+		// A corrupted datagram is dropped here like a lost one, before any of its bytes are parsed.
+		bool valid = numBytes > cChecksumSize;
+		if (valid)
+		{
+			numBytes -= cChecksumSize;
+			DataDeserializer reader(data + numBytes, cChecksumSize);
+			valid = CRC32C(data, numBytes) == reader.Read<u32>();
+		}
+		if (!valid)
+		{
+			ADDEVENT("inputChecksumFailed", (float)numBytes, "bytes");
+			KNET_LOG(LogVerbose, "UDPMessageConnection::DecryptAndExtractMessages: Dropped a datagram of %d bytes that failed the checksum in connection %s.", (int)numBytes, ToString().c_str());
+			return;
+		}
+	}
+	ExtractMessages(data, numBytes);
+}
+
+void UDPMessageConnection::CountMalformedDatagram(size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	ADDEVENT("inputMalformed", (float)numBytes, "bytes");
+	numMalformedDatagrams = numMalformedDatagrams + 1;
+	if (serverMalformedDatagrams)
+		AtomicIncrement(serverMalformedDatagrams);
+
+	if (malformedDatagramLimit == 0 || numMalformedDatagrams < malformedDatagramLimit || connectionState == ConnectionClosed)
+		return;
+	KNET_LOG(LogError, "UDPMessageConnection::CountMalformedDatagram: Closing connection %s after %d malformed datagrams.", ToString().c_str(), (int)numMalformedDatagrams);
+	if (socket)
+	{
+		socket->MarkReadClosed();
+		socket->MarkWriteClosed();
+	}
+	connectionState = ConnectionClosed;
 }
 
 void UDPMessageConnection::ExtractMessages(const char *data, size_t numBytes)
@@ -729,40 +1986,74 @@ void UDPMessageConnection::ExtractMessages(const char *data, size_t numBytes)
 	// Immediately discard this datagram if it might contain more messages than we can handle. Otherwise
 	// we might end up in a situation where we have already applied some of the messages in the datagram
 	// and realize we don't have space to take in the rest, which would require a "partial ack" of sorts.
-	if (inboundMessageQueue.CapacityLeft() < 64)
+	if (inboundMessageQueue.CapacityLeft() < cInboundQueueDatagramReserve)
 	{
 		ADDEVENT("inputDiscarded", (float)numBytes, "bytes");
 		return;
 	}
 
-	lastHeardTime = Clock::Tick();
+	lastHeardTime = Clock::LoopTick();
 
 	if (numBytes < 3)
 	{
 		KNET_LOG(LogError, "Malformed UDP packet when reading packet header! Size = %d bytes, no space for packet header, which is at least 3 bytes.", (int)numBytes);
-		throw NetException("Malformed UDP packet received! No packed header present.");
+		CountMalformedDatagram(numBytes);
+		return;
 	}
 
-	DataDeserializer reader(data, numBytes);
+	// If the message blocks were compressed into a CompressedData message, decompress them and parse them in its place.
+	// This is done before the datagram is acked, so that a datagram that can't be decompressed is resent.
+	const char *receivedData = data;
+	size_t datagramSize = numBytes;
+	{
+		DataDeserializer headerReader(data, numBytes);
+		const bool reliable = (headerReader.Read<u8>() & (1 << 6)) != 0;
+		headerReader.Read<u16>();
+		if (reliable)
+			headerReader.ReadVLE<VLE16_32>();
+		if (headerReader.BytesLeft() > 3)
+		{
+			DataDeserializer compressedReader(headerReader.CurrentData(), headerReader.BytesLeft());
+			const u16 messageHeader = compressedReader.Read<u16>();
+			if ((messageHeader >> 11) == 0 && ReadMessageID(compressedReader) == MsgIdCompressedData)
+			{
+				if ((size_t)messageHeader + 2 != headerReader.BytesLeft())
+				{
+					KNET_LOG(LogError, "Malformed UDP packet! A CompressedData message of %d bytes did not span the %d bytes left in the datagram!", (int)messageHeader, (int)headerReader.BytesLeft());
+					CountMalformedDatagram(numBytes);
+					return;
+				}
+				const size_t headerSize = headerReader.BytePos();
+				decompressionBuffer.assign(data, data + headerSize);
+				if (DecompressMessageData(compressedReader.CurrentData(), compressedReader.BytesLeft(), cMaxDecompressedDatagramSize, decompressionBuffer, headerSize) < 0)
+				{
+					ADDEVENT("inputDiscarded", (float)numBytes, "bytes");
+					return;
+				}
+				data = &decompressionBuffer[0];
+				datagramSize = decompressionBuffer.size();
+			}
+		}
+	}
+
+	DataDeserializer reader(data, datagramSize);
 
 	// Start by reading the packet header (flags, packetID).
 	u8 flags = reader.Read<u8>();
-	bool inOrder = (flags & (1 << 7)) != 0;
 	bool packetReliable = (flags & (1 << 6)) != 0;
 	packet_id_t packetID = (reader.Read<u16>() << 6) | (flags & 63);
 
-	unsigned long reliableMessageIndexBase = (packetReliable ? reader.ReadVLE<VLE16_32>() : 0); ///\todo sanitize input length.
+	unsigned long reliableMessageIndexBase = (packetReliable ? reader.ReadVLE<VLE16_32>() : 0);
+	if (reliableMessageIndexBase == DataDeserializer::VLEReadError)
+	{
+		KNET_LOG(LogError, "Malformed UDP packet! Parsing the reliable message number base of a datagram of %d bytes failed!", (int)numBytes);
+		CountMalformedDatagram(numBytes);
+		return;
+	}
 
 	// If the 'reliable'-flag is set, remember this PacketID, we need to Ack it later on.
 	if (packetReliable)
-	{
-		PacketAckTrack &t = inboundPacketAckTrack[packetID];
-		t.packetID = packetID;
-		// The following are not used right now.
-		///\todo If we want to queue up a few acks before sending an ack message, we should possibly save here
-		// the time when we received the packet.
-		t.sentTick = Clock::Tick();
-	}
+		receivedPacketIDs.AddPendingAck(packetID, Clock::LoopTick());
 
 	// Note that this check must be after the ack check (above), since we still need to ack the new packet as well (our
 	// previous ack might not have reached the sender or was delayed, which is why the peer is resending it).
@@ -772,38 +2063,48 @@ void UDPMessageConnection::ExtractMessages(const char *data, size_t numBytes)
 		KNET_LOG(LogVerbose, "Duplicate datagram with packet ID %d received!", (int)packetID);
 		return;
 	}
+	// Count the marks of the datagrams that got this far, so a spoofed or resent datagram can't inflate the count.
+	if (inboundECN == ECNCongestionExperienced)
+	{
+		ADDEVENT("congestionMarkReceived", 1, "");
+		numCEMarksReceived = numCEMarksReceived + 1;
+	}
 	if (packetID != previousReceivedPacketID + 1)
 		ADDEVENT("outOfOrderReceived", fabs((float)(packetID - (previousReceivedPacketID + 1))), "");
 
-	// If the 'inOrder'-flag is set, there's an extra 'Order delta counter' field present,
-	// that specifies the processing ordering of this packet.
-	packet_id_t inOrderID = 0;
-	if (inOrder)
+	// Keep a copy of the datagram in case the peer protects it with forward error correction, and one of its group is lost.
+	if (!fecReceiveHistory.empty() && numBytes <= cMaxFECDatagramSize)
 	{
-//		inOrderID = reader.ReadVLE<VLE8_16>();
-		if (inOrderID == DataDeserializer::VLEReadError)
-		{
-			KNET_LOG(LogError, "Malformed UDP packet! Size = %d bytes, no space for packet header field 'inOrder'!", (int)numBytes);
-			throw NetException("Malformed UDP packet received! The inOrder field was invalid.");
-		}
+		FECReceivedDatagram &received = fecReceiveHistory[packetID & (cFECReceiveHistorySize - 1)];
+		received.packetID = packetID;
+		received.valid = true;
+		received.data.assign(receivedData, receivedData + numBytes);
 	}
 
 	size_t numMessagesReceived = 0;
+	// Set if a reliable message of this datagram is too far ahead of the ones received to be recorded. The datagram is then
+	// not acked, so that the peer resends its reliable messages later on.
+	bool refuseAck = false;
+	// The parsing stops at the first malformed message, and the rest of the datagram is dropped. The message handlers
+	// report the malformed messages through MalformedMessageReceived().
+	inboundDatagramMalformed = false;
 	while(reader.BytesLeft() > 0)
 	{
 		if (reader.BytesLeft() < 2)
 		{
 			KNET_LOG(LogError, "Malformed UDP packet! Parsed %d messages ok, but after that there's not enough space for UDP message header! BytePos %d, total size %d",
-				(int)reader.BytePos(), (int)numBytes);
-			throw NetException("Malformed UDP packet received! Message header was not present.");
+				(int)numMessagesReceived, (int)reader.BytePos(), (int)numBytes);
+			inboundDatagramMalformed = true;
+			break;
 		}
 
 		// Read the message header (2 bytes at least).
-		u16 contentLength = reader.Read<u16>();
+		u16 contentLength = reader.ReadUnchecked<u16>();
 		bool fragmentStart = (contentLength & (1 << 15)) != 0;
 		bool fragment = (contentLength & (1 << 14)) != 0 || fragmentStart; // If fragmentStart is set, then fragment is set.
 		bool inOrder = (contentLength & (1 << 13)) != 0;
 		bool messageReliable = (contentLength & (1 << 12)) != 0;
+		bool hasOrderingChannel = (contentLength & (1 << 11)) != 0;
 		contentLength &= (1 << 11) - 1;
 
 		// If true, this message is a duplicate one we've received, and will be discarded. We need to parse it fully though,
@@ -816,45 +2117,86 @@ void UDPMessageConnection::ExtractMessages(const char *data, size_t numBytes)
 			if (!packetReliable)
 				KNET_LOG(LogError, "Received reliable message on a packet that is not reliable!");
 
-			reliableMessageNumber = reliableMessageIndexBase + reader.ReadVLE<VLE8_16>();
+			const u32 reliableMessageDelta = reader.ReadVLE<VLE8_16>();
+			if (reliableMessageDelta == DataDeserializer::VLEReadError)
+			{
+				KNET_LOG(LogError, "Malformed UDP packet! Parsing the reliable message number of a message failed!");
+				inboundDatagramMalformed = true;
+				break;
+			}
+			reliableMessageNumber = reliableMessageIndexBase + reliableMessageDelta;
+			duplicateMessage = IsDuplicateReliableMessage((u32)reliableMessageNumber, packetID, refuseAck);
+		}
 
-			if (receivedReliableMessages.find(reliableMessageNumber) != receivedReliableMessages.end())
-				duplicateMessage = true;
-			else 
-				receivedReliableMessages.insert(reliableMessageNumber);
+		const bool ordered = messageReliable && inOrder;
+		const bool channelMissing = ordered && hasOrderingChannel && reader.BytesLeft() == 0;
+		const u8 orderingChannel = (ordered && hasOrderingChannel && !channelMissing) ? reader.ReadUnchecked<u8>() : 0;
+		const u32 orderNumber = ordered ? reader.ReadVLE<VLE8_16>() : 0;
+		if (channelMissing || orderNumber == DataDeserializer::VLEReadError)
+		{
+			KNET_LOG(LogError, "Malformed UDP packet! Parsing the order number of an in-order message failed!");
+			inboundDatagramMalformed = true;
+			break;
 		}
 
 		if (contentLength == 0)
 		{
 			KNET_LOG(LogError, "Malformed UDP packet! Byteofs %d, Packet length %d. Message had zero length (Length must be at least one byte)!", (int)reader.BytePos(), (int)numBytes);
-			throw NetException("Malformed UDP packet received! Messages with zero content length are not valid.");
+			inboundDatagramMalformed = true;
+			break;
 		}
 
 		u32 numTotalFragments = (fragmentStart ? reader.ReadVLE<VLE8_16_32>() : 0);
-		u8 fragmentTransferID = (fragment ? reader.Read<u8>() : 0);
+		u32 fragmentTransferID = (fragment ? reader.ReadVLE<VLE8_16>() : 0);
+		if (fragmentTransferID == DataDeserializer::VLEReadError)
+		{
+			KNET_LOG(LogError, "Malformed UDP packet! This packet has fragment flag on, but parsing the transfer ID failed!");
+			inboundDatagramMalformed = true;
+			break;
+		}
 		u32 fragmentNumber = (fragment && !fragmentStart ? reader.ReadVLE<VLE8_16_32>() : 0);
 
 		if (reader.BytesLeft() < contentLength)
 		{
 			KNET_LOG(LogError, "Malformed UDP packet! Byteofs %d, Packet length %d. Expected %d bytes of message content, but only %d bytes left!",
 				(int)reader.BytePos(), (int)numBytes, (int)contentLength, (int)reader.BytesLeft());
-			throw NetException("Malformed UDP packet received! Message payload missing.");
+			inboundDatagramMalformed = true;
+			break;
+		}
+
+		// An Aggregate record holds a run of messages, each of which is checked for a duplicate on its own.
+		if (!fragment)
+		{
+			DataDeserializer idReader(&data[reader.BytePos()], contentLength);
+			if (ReadMessageID(idReader) == MsgIdAggregate)
+			{
+				numMessagesReceived += ExtractAggregatedMessages(packetID, &data[reader.BytePos() + idReader.BytePos()], contentLength - idReader.BytePos(),
+					messageReliable, (u32)reliableMessageNumber, duplicateMessage, ordered, orderingChannel, orderNumber, refuseAck);
+				if (inboundDatagramMalformed)
+					break;
+				reader.SkipBytes(contentLength);
+				continue;
+			}
 		}
 
 		if (!duplicateMessage)
 		{
+			bool fragmentReady = false;
+
 			// If we received the start of a new fragment, start tracking a new fragmented transfer.
 			if (fragmentStart)
 			{
 				if (numTotalFragments == DataDeserializer::VLEReadError || numTotalFragments <= 1)
 				{
 					KNET_LOG(LogError, "Malformed UDP packet! This packet had fragmentStart bit on, but parsing numTotalFragments VLE failed!");
-					throw NetException("Malformed UDP packet received! This packet had fragmentStart bit on, but parsing numTotalFragments VLE failed!");
+					inboundDatagramMalformed = true;
+					break;
 				}
 
-				fragmentedReceives.NewFragmentStartReceived(fragmentTransferID, numTotalFragments, &data[reader.BytePos()], contentLength);
 				ADDEVENT("FragmentStartReceived", 1, "");
 
+				// The other fragments of the transfer may have been received before the fragmentStart.
+				fragmentReady = fragmentedReceives.NewFragmentStartReceived(fragmentTransferID, numTotalFragments, &data[reader.BytePos()], contentLength);
 			}
 			// If we received a fragment that is a part of an old fragmented transfer, pass it to the fragmented transfer manager
 			// so that it can reconstruct the final stream when the transfer finishes.
@@ -863,24 +2205,18 @@ void UDPMessageConnection::ExtractMessages(const char *data, size_t numBytes)
 				if (fragmentNumber == DataDeserializer::VLEReadError)
 				{
 					KNET_LOG(LogError, "Malformed UDP packet! This packet has fragment flag on, but parsing the fragment number failed!");
-					throw NetException("Malformed UDP packet received! This packet has fragment flag on, but parsing the fragment number failed!");
+					inboundDatagramMalformed = true;
+					break;
 				}
 
 				ADDEVENT("FragmentReceived", 1, "");
 
-				bool messageReady = fragmentedReceives.NewFragmentReceived(fragmentTransferID, fragmentNumber, &data[reader.BytePos()], contentLength);
-				if (messageReady)
-				{
-					// This was the last fragment of the whole message - reconstruct the message from the fragments and pass it on to
-					// the client to handle.
-					assembledData.clear();
-					fragmentedReceives.AssembleMessage(fragmentTransferID, assembledData);
-					assert(!assembledData.empty());
-					///\todo InOrder.
-					HandleInboundMessage(packetID, &assembledData[0], assembledData.size());
-					++numMessagesReceived;
-					fragmentedReceives.FreeMessage(fragmentTransferID);
-				}
+				fragmentReady = fragmentedReceives.NewFragmentReceived(fragmentTransferID, fragmentNumber, &data[reader.BytePos()], contentLength);
+			}
+			else if (ordered)
+			{
+				HandleInOrderMessage(orderingChannel, orderNumber, packetID, &data[reader.BytePos()], contentLength);
+				++numMessagesReceived;
 			}
 			else
 			{
@@ -888,6 +2224,22 @@ void UDPMessageConnection::ExtractMessages(const char *data, size_t numBytes)
 				HandleInboundMessage(packetID, &data[reader.BytePos()], contentLength);
 				++numMessagesReceived;
 			}
+
+			if (fragmentReady)
+			{
+				// This was the last fragment of the whole message - reconstruct the message from the fragments and pass it on to
+				// the client to handle.
+				// The fragments were written in place, so the message can be passed on as is.
+				NetworkMessage *assembled = fragmentedReceives.DetachMessage(fragmentTransferID);
+				assert(assembled);
+				if (ordered)
+					HandleInOrderMessage(orderingChannel, orderNumber, packetID, 0, 0, assembled);
+				else
+					HandleInboundMessage(packetID, assembled);
+				++numMessagesReceived;
+			}
+			if (inboundDatagramMalformed)
+				break;
 		}
 		else // this is a duplicate reliable message, ignore it.
 		{
@@ -898,10 +2250,176 @@ void UDPMessageConnection::ExtractMessages(const char *data, size_t numBytes)
 		reader.SkipBytes(contentLength);
 	}
 
-	// Store the packetID for inbound packet loss statistics purposes.
-	AddReceivedPacketIDStats(packetID);
+	if (inboundDatagramMalformed)
+	{
+		// The messages before the malformed one have been handled already. The datagram is not acked, so that the peer resends
+		// the reliable messages of it, and the ones handled already are then dropped as duplicates.
+		inboundDatagramMalformed = false;
+		receivedPacketIDs.ClearPendingAck(packetID);
+		AddInboundStats(numBytes, 1, numMessagesReceived);
+		CountMalformedDatagram(numBytes);
+		return;
+	}
+
+	// Store the packetID for inbound packet loss statistics purposes. A refused datagram is not marked received either,
+	// which would ack it along with the ranges of PacketIDs around it.
+	if (refuseAck)
+		receivedPacketIDs.ClearPendingAck(packetID);
+	else
+		AddReceivedPacketIDStats(packetID);
 	// Save general statistics (bytes, packets, messages rate).
 	AddInboundStats(numBytes, 1, numMessagesReceived);
+
+	// If a FECParity message in this datagram rebuilt a lost datagram, process it as if it had just been received.
+	if (!fecRecoveredDatagram.empty())
+	{
+		std::vector<char> recovered;
+		recovered.swap(fecRecoveredDatagram);
+		ADDEVENT("fecRecovered", (float)recovered.size(), "bytes");
+		ExtractMessages(&recovered[0], recovered.size());
+		if (fecRecoveredDatagram.empty()) // Keep the buffer for the next time.
+		{
+			recovered.clear();
+			fecRecoveredDatagram.swap(recovered);
+		}
+	}
+}
+
+bool UDPMessageConnection::IsDuplicateReliableMessage(u32 reliableMessageNumber, packet_id_t packetID, bool &refuseAck)
+{
+	switch(receivedReliableMessages.Insert(reliableMessageNumber))
+	{
+	case MessageNumberWindow::NewNumber:
+		++numReliableMessagesReceived;
+		return false;
+	case MessageNumberWindow::DuplicateNumber:
+		return true;
+	case MessageNumberWindow::NumberAheadOfWindow:
+	default:
+		KNET_LOG(LogVerbose, "Reliable message number %d is too far ahead of the lowest one not received (%d). Not acking packet with ID %d.",
+			(int)reliableMessageNumber, (int)receivedReliableMessages.LowWatermark(), (int)packetID);
+		refuseAck = true;
+		return true;
+	}
+}
+
+size_t UDPMessageConnection::ExtractAggregatedMessages(packet_id_t packetID, const char *data, size_t numBytes, bool reliable, u32 firstReliableMessageNumber,
+	bool firstDuplicate, bool ordered, u8 orderingChannel, u32 firstOrderNumber, bool &refuseAck)
+{
+	DataDeserializer reader(data, numBytes);
+	const u32 messageID = reader.ReadVLE<VLE8_16_32>();
+	const u32 numMessages = reader.ReadVLE<VLE8_16>();
+	if (messageID == DataDeserializer::VLEReadError || numMessages == DataDeserializer::VLEReadError || numMessages < 2)
+	{
+		KNET_LOG(LogError, "Malformed UDP packet! Parsing the header of an Aggregate record of %d bytes failed!", (int)numBytes);
+		inboundDatagramMalformed = true;
+		return 0;
+	}
+
+	// The messages are passed on with the message ID in front, like the ones that come in message blocks of their own.
+	char message[4 + (1 << 11)];
+	size_t numMessagesReceived = 0;
+	for(u32 i = 0; i < numMessages; ++i)
+	{
+		const u32 contentLength = (reader.BytesLeft() > 0) ? reader.ReadVLE<VLE8_16>() : DataDeserializer::VLEReadError;
+		if (contentLength == DataDeserializer::VLEReadError || reader.BytesLeft() < contentLength)
+		{
+			KNET_LOG(LogError, "Malformed UDP packet! Message %d of the %d in an Aggregate record of %d bytes did not fit in the record!", (int)i, (int)numMessages, (int)numBytes);
+			inboundDatagramMalformed = true;
+			return numMessagesReceived;
+		}
+		const char *content = reader.CurrentData();
+		reader.SkipBytes(contentLength);
+
+		const bool duplicate = (i == 0) ? firstDuplicate : (reliable && IsDuplicateReliableMessage(firstReliableMessageNumber + i, packetID, refuseAck));
+		if (duplicate)
+			continue;
+
+		DataSerializer writer(message, sizeof(message));
+		writer.AddVLE<VLE8_16_32>(messageID);
+		if (contentLength > 0)
+			writer.AddAlignedByteArray(content, contentLength);
+		if (ordered)
+			HandleInOrderMessage(orderingChannel, (firstOrderNumber + i) & cOrderNumberMask, packetID, message, writer.BytesFilled());
+		else
+			HandleInboundMessage(packetID, message, writer.BytesFilled());
+		++numMessagesReceived;
+		if (inboundDatagramMalformed)
+			return numMessagesReceived;
+	}
+	if (reader.BytesLeft() != 0)
+	{
+		KNET_LOG(LogError, "Malformed UDP packet! %d bytes were left over after the %d messages of an Aggregate record!", (int)reader.BytesLeft(), (int)numMessages);
+		inboundDatagramMalformed = true;
+	}
+	return numMessagesReceived;
+}
+
+void UDPMessageConnection::HandleInOrderMessage(u8 channel, u32 orderNumberBits, packet_id_t packetID, const char *data, size_t numBytes, NetworkMessage *message)
+{
+	AssertInWorkerThreadContext();
+
+	if (inboundOrderingChannels.size() <= channel)
+		inboundOrderingChannels.resize(channel + 1);
+	ReorderRing<PendingInOrderMessage> &pendingMessages = inboundOrderingChannels[channel].pendingMessages;
+
+	// Extend the order number to 32 bits around the one expected next.
+	const u32 numAhead = (orderNumberBits - pendingMessages.Next()) & cOrderNumberMask;
+	if (numAhead > cOrderNumberMask / 2)
+	{
+		if (!data && !message)
+			return; // The message was delivered before its transfer was aborted.
+		// Behind the channel already. Only a peer that does not keep the order numbers of its resends sends these.
+		KNET_LOG(LogError, "Received an in-order message on channel %d that is %d messages behind the channel! Delivering it right away.",
+			(int)channel, (int)(cOrderNumberMask + 1 - numAhead));
+		if (message)
+			HandleInboundMessage(packetID, message);
+		else
+			HandleInboundMessage(packetID, data, numBytes);
+		return;
+	}
+	const u32 orderNumber = pendingMessages.Next() + numAhead;
+
+	if (orderNumber != pendingMessages.Next())
+	{
+		// The messages before this one on the channel are still on their way. Only this channel waits for them. The data
+		// is copied to a pooled message, so that holding it does not allocate.
+		if (data)
+		{
+			message = AllocateNewMessage();
+			message->Resize(numBytes);
+			memcpy(message->data, data, numBytes);
+		}
+		PendingInOrderMessage &pending = pendingMessages.Hold(orderNumber);
+		if (pending.message) // A duplicate. Keep the newer one.
+			FreeMessage(pending.message);
+		pending.packetID = packetID;
+		pending.message = message;
+		pending.serialized = (data != 0);
+		ADDEVENT("inOrderMessageBuffered", (float)pendingMessages.Size(), "");
+		return;
+	}
+
+	if (message)
+		HandleInboundMessage(packetID, message);
+	else if (data)
+		HandleInboundMessage(packetID, data, numBytes);
+	pendingMessages.SkipNext();
+
+	// Deliver the run of messages that were waiting for this one.
+	PendingInOrderMessage pending;
+	while(pendingMessages.PopNext(pending))
+	{
+		if (!pending.message)
+			continue;
+		if (pending.serialized)
+		{
+			HandleInboundMessage(pending.packetID, pending.message->data, pending.message->Size());
+			FreeMessage(pending.message);
+		}
+		else
+			HandleInboundMessage(pending.packetID, pending.message);
+	}
 }
 
 void UDPMessageConnection::PerformDisconnection()
@@ -913,22 +2431,24 @@ void UDPMessageConnection::PerformDisconnection()
 
 bool UDPMessageConnection::CanSendOutNewDatagram() const
 {
-	const tick_t now = Clock::Tick();
-
-	const tick_t datagramSendTickDelay = (tick_t)(Clock::TicksPerSec() / datagramSendRate);
-
-	return Clock::TicksInBetween(now, lastDatagramSendTime) >= datagramSendTickDelay;
+	return Clock::IsNewer(Clock::Tick(), nextDatagramSendTime) && SendRateLimitAllowsSend();
 }
 
-void UDPMessageConnection::NewDatagramSent()
+void UDPMessageConnection::NewDatagramSent(size_t numBytes)
 {
-	const tick_t datagramSendTickDelay = (tick_t)(Clock::TicksPerSec() / datagramSendRate);
+	const double pacingRate = congestionControl->PacingRate();
+	const tick_t datagramSendTickDelay = (tick_t)(numBytes * (double)Clock::TicksPerSec() / pacingRate);
 	const tick_t now = Clock::Tick();
 
-	if (Clock::TicksInBetween(now, lastDatagramSendTime) / datagramSendTickDelay < 20)
-		lastDatagramSendTime += datagramSendTickDelay;
+	// Let the sender catch up on a small burst if it fell behind the pacing schedule, but don't
+	// accumulate credit for arbitrarily long idle periods.
+	const tick_t maxBurstTicks = (tick_t)(20 * maxDatagramSize * (double)Clock::TicksPerSec() / pacingRate);
+	if (Clock::IsNewer(nextDatagramSendTime, now) || Clock::TicksInBetween(now, nextDatagramSendTime) < maxBurstTicks)
+		nextDatagramSendTime += datagramSendTickDelay;
 	else
-		lastDatagramSendTime = now;
+		nextDatagramSendTime = now + datagramSendTickDelay;
+
+	ConsumeSendRateLimit(numBytes, 1);
 }
 
 void UDPMessageConnection::SendDisconnectMessage(bool isInternal)
@@ -961,105 +2481,219 @@ void UDPMessageConnection::SendDisconnectAckMessage()
 	KNET_LOG(LogInfo, "UDPMessageConnection::SendDisconnectAckMessage: Sent DisconnectAck.");
 }
 
-void UDPMessageConnection::HandleFlowControlRequestMessage(const char *UNUSED(data), size_t UNUSED(numBytes))
+void UDPMessageConnection::HandleFlowControlRequestMessage(const char *data, size_t numBytes)
 {
 	AssertInWorkerThreadContext();
-	/*
-	if (numBytes != 2)
-	{
-		KNET_LOG(LogError, "Malformed FlowControlRequest message received! Size was %d bytes, expected 2 bytes!", (int)numBytes);
-		return;
-	}
 
-	const u16 minOutboundRate = 5;
-	const u16 maxOutboundRate = 10 * 1024;
-	u16 newOutboundRate = *reinterpret_cast<const u16*>(data);
-	if (newOutboundRate < minOutboundRate || newOutboundRate > maxOutboundRate)
+	if (numBytes != 4)
 	{
-		KNET_LOG(LogError, "Invalid FlowControlRequest rate %d packets/sec received! Ignored. Valid range (%d, %d)", (int)newOutboundRate,
-			(int)minOutboundRate, (int)maxOutboundRate);
+		KNET_LOG(LogError, "Malformed FlowControlRequest message received! Size was %d bytes, expected 4 bytes!", (int)numBytes);
 		return;
 	}
 
-//	KNET_LOG(LogVerbose, "Received FlowControl message. Adjusting OutRate from %d to %d msgs/sec.", (int)datagramOutRatePerSecond, (int)newOutboundRate);
+	DataDeserializer mr(data, numBytes);
+	const u32 limit = mr.Read<u32>();
+	// The limit only grows, so an older advertisement that arrives late is ignored.
+	if (peerGrantsReceiveCredits && (s32)(limit - peerReceiveCreditLimit) <= 0)
+		return;
 
-	datagramOutRatePerSecond = newOutboundRate;*/
+	peerReceiveCreditLimit = limit;
+	peerGrantsReceiveCredits = true;
+	sendWindowFull = false;
 }
 
-int UDPMessageConnection::BiasedBinarySearchFindPacketIndex(PacketAckTrackQueue &queue, packet_id_t packetID)
+int UDPMessageConnection::ReceiveCreditsLeft() const
 {
-	///\bug Make this all packetID wrap-around -aware.
-
-	int headIdx = 0;
-	PacketAckTrack *headItem = queue.ItemAt(headIdx);
-	if (headItem->packetID == packetID)
-		return headIdx;
-	int tailIdx = queue.Size()-1;
-	PacketAckTrack *tailItem = queue.ItemAt(tailIdx);
-	if (tailItem->packetID == packetID)
-		return tailIdx;
-	assert(headItem->packetID < tailItem->packetID);
-	if (headItem->packetID > packetID || tailItem->packetID < packetID)
+	if (!peerGrantsReceiveCredits)
 		return -1;
-	while(headIdx < tailIdx)
-	{
-		int newIdx = (tailIdx - headIdx) * (packetID - headItem->packetID) / (tailItem->packetID - headItem->packetID);
-		newIdx = max(headIdx+1, min(tailIdx-1, newIdx));
-		PacketAckTrack *newItem = queue.ItemAt(newIdx);
-		if (newItem->packetID == packetID)
-			return newIdx;
-		else if (newItem->packetID < packetID)
-		{
-			headIdx = newIdx;
-			headItem = newItem;
-		}
-		else
-		{
-			tailIdx = newIdx;
-			tailItem = newItem;
-		}
-	}
-	return -1;
+	const s32 creditsLeft = (s32)(peerReceiveCreditLimit - numNewReliableMessagesSent);
+	return (creditsLeft > 0) ? (int)creditsLeft : 0;
 }
 
-void UDPMessageConnection::FreeOutboundPacketAckTrack(packet_id_t packetID)
+void UDPMessageConnection::UpdateReceiveCredits()
 {
 	AssertInWorkerThreadContext();
 
-	int itemIndex = 0;
-	for(; itemIndex < outboundPacketAckTrack.Size(); ++itemIndex)
-		if (outboundPacketAckTrack.ItemAt(itemIndex)->packetID == packetID)
-			break;
-	if (itemIndex >= outboundPacketAckTrack.Size())
+	if (connectionState != ConnectionOK || !socket || !socket->IsWriteOpen())
+		return;
+
+	// The peer may send as many new reliable messages as there is room for in the inbound queue, on top of the ones
+	// received so far. The limit never shrinks, so if the unreliable messages take up the room, the grant waits.
+	const int freeSlots = std::max(0, (int)inboundMessageQueue.CapacityLeft() - cInboundQueueDatagramReserve);
+	u32 limit = numReliableMessagesReceived + (u32)freeSlots;
+	if ((s32)(limit - advertisedReceiveCreditLimit) < 0)
+		limit = advertisedReceiveCreditLimit;
+
+	const u32 newCredits = limit - advertisedReceiveCreditLimit;
+	const tick_t now = Clock::LoopTick();
+	const float msecsSinceAdvertised = Clock::TimespanToMillisecondsF(receiveCreditAdvertiseTick, now);
+	const bool firstAdvertisement = receiveCreditAdvertiseTick == 0;
+	if (!firstAdvertisement && newCredits < cReceiveCreditAdvertiseThreshold
+		&& (newCredits == 0 || msecsSinceAdvertised < cReceiveCreditMinIntervalMSecs)
+		&& msecsSinceAdvertised < cReceiveCreditRefreshIntervalMSecs)
 		return;
 
+	SendReceiveCreditAdvertisement(limit);
+	advertisedReceiveCreditLimit = limit;
+	receiveCreditAdvertiseTick = now;
+}
+
+void UDPMessageConnection::SendReceiveCreditAdvertisement(u32 limit)
+{
+	AssertInWorkerThreadContext();
+
+	// The advertisement is unreliable, since the next one replaces it anyway. A reliable one would use up the credits of the peer.
+	NetworkMessage *msg = StartNewMessage(MsgIdFlowControlRequest, 4);
+	DataSerializer mb(msg->data, 4);
+	mb.Add<u32>(limit);
+	msg->priority = NetworkMessage::cMaxPriority - 1;
+	msg->reliable = false;
+#ifdef KNET_NETWORK_PROFILING
+	msg->profilerName = "FlowControlRequest (3)";
+#endif
+	EndAndQueueMessage(msg, mb.BytesFilled(), true);
+}
+
+void UDPMessageConnection::FreeOutboundPacketAckTrack(packet_id_t packetID)
+{
+	AssertInWorkerThreadContext();
+
+	PacketAckTrack *track = outboundPacketAckTrack.Find(packetID);
+	if (track)
+		FreeOutboundPacketAckTrack(*track);
+}
+
+void UDPMessageConnection::FreeOutboundPacketAckTrackRange(packet_id_t firstPacketID, packet_id_t lastPacketID)
+{
+	AssertInWorkerThreadContext();
+
+	const u32 rangeLength = PacketIDDistance(firstPacketID, lastPacketID);
+	for(u32 i = 0; i <= rangeLength && outboundPacketAckTrack.Size() > 0; ++i)
+		FreeOutboundPacketAckTrack(AddPacketID(firstPacketID, (int)i));
+}
+
+void UDPMessageConnection::FreeSentDeltaStates(int first)
+{
+	AssertInWorkerThreadContext();
+
+	while(first != -1)
+	{
+		const int next = sentDeltaStates[first].next;
+		sentDeltaStates[first].next = freeSentDeltaState;
+		freeSentDeltaState = first;
+		first = next;
+	}
+}
+
+void UDPMessageConnection::FreeOutboundPacketAckTrack(PacketAckTrack &track)
+{
+	AssertInWorkerThreadContext();
+
 	// Free up all the messages in the acked packet. We don't need to keep track of those any more (to be sent to peer).
-	PacketAckTrack &track = *outboundPacketAckTrack.ItemAt(itemIndex);
-	for(size_t i = 0; i < track.messages.size(); ++i)
+	for(NetworkMessage *msg = track.messages; msg;)
 	{
-		// If the message was part of a fragmented transfer, remove the message from that data structure.
-		if (track.messages[i]->transfer)
+		NetworkMessage *next = msg->nextInDatagram;
+		MessageTracer::Record(msg->traceID, msg->id, TraceAcked);
+		if (msg->transfer && !msg->obsolete)
 		{
 			Lock<FragmentedSendManager> sends = fragmentedSends.Acquire();
-			sends->RemoveMessage(track.messages[i]->transfer, track.messages[i]);
+			ReportOutboundTransferProgress(*msg->transfer, msg->Size());
+		}
+
+		// Once the peer has dropped the fragments of an aborted transfer, its transfer ID can be reused.
+		if (msg->id == MsgIdFragmentedTransferAbort)
+		{
+			DataDeserializer dd(msg->data, msg->Size());
+			Lock<FragmentedSendManager> sends = fragmentedSends.Acquire();
+			sends->AbortAcknowledged((int)dd.ReadVLE<VLE8_16>());
+		}
+
+		if (msg->ackHandler)
+		{
+			IMessageAckHandler *handler = msg->ackHandler;
+			msg->ackHandler = 0;
+			handler->HandleMessageAcked(msg->id, MessageDelivered);
 		}
 
 		// Free up the message, the peer acked this message and we're now free from having to resend it (again).
-		ClearOutboundMessageWithContentID(track.messages[i]);
-		FreeMessage(track.messages[i]);
+		msg->nextInDatagram = 0;
+		ClearOutboundMessageWithContentID(msg);
+		FreeMessage(msg); // If the message was a fragment, this also removes it from its transfer.
+		msg = next;
+	}
+	for(int i = track.deltaStates; i != -1; i = sentDeltaStates[i].next)
+		DeltaStateAcked(sentDeltaStates[i].messageID, sentDeltaStates[i].contentID, sentDeltaStates[i].version);
+	FreeSentDeltaStates(track.deltaStates);
+
+	const tick_t now = Clock::Tick();
+	bytesInFlight -= std::min((size_t)bytesInFlight, track.datagramSize);
+	bytesDelivered += track.datagramSize;
+	lastDeliveredTick = now;
+	sendWindowFull = false;
+
+	// The peer is responding. Start timing the next loss probe from this ack.
+	numLossProbes = 0;
+	ArmLossProbeTimer(now);
+
+	if (!haveAckedDatagrams || Clock::IsNewer(track.sentTick, largestAckedSentTick))
+	{
+		largestAckedPacketID = track.packetID;
+		largestAckedSentTick = track.sentTick;
+		haveAckedDatagrams = true;
 	}
 
+	packetLossRate -= cPacketLossRateGain * packetLossRate;
+
+	// Only datagrams that were sent once give an unambiguous RTT sample (Karn's algorithm). The sample ends when the ack
+	// arrived at the socket, not when the worker thread got to it.
 	if (track.sendCount <= 1)
 	{
-		UpdateRTOCounterOnPacketAck((float)Clock::TimespanToSecondsD(track.sentTick, Clock::Tick()));
-		++numAcksLastFrame;
+		const tick_t ackTick = InboundReceiveTick(track.sentTick);
+		const float rtt = (float)Clock::TimespanToMillisecondsD(track.sentTick, ackTick);
+		latestRtt = rtt;
+		UpdateRTOCounterOnPacketAck(rtt);
+		congestionControl->OnRttSample(now, rtt);
+		bandwidthEstimator.OnRttSample(now, rtt);
+		samples->latencyHistograms[LatencyAckRTT].RecordTimespan(track.sentTick, ackTick);
+	}
+	congestionControl->OnDatagramAcked(now, track.ToSentDatagramInfo(), bytesDelivered, bytesInFlight);
+	bandwidthEstimator.OnDatagramAcked(now, track.ToSentDatagramInfo(), bytesDelivered);
+	UpdateBandwidthEstimate();
+
+	// The path still carries large datagrams.
+	if (track.datagramSize > cBaseDatagramSize)
+	{
+		numLargeDatagramsLost = 0;
+		lastLargeDatagramAckTime = now;
 	}
 
-	outboundPacketAckTrack.EraseItemAt(itemIndex);
+	outboundPacketAckTrack.Erase(&track);
 }
 
-static const float minRTOTimeoutValue = 1000.f;
-static const float maxRTOTimeoutValue = 5000.f;
+void UDPMessageConnection::SetBandwidthEstimateHandler(IBandwidthEstimateHandler *handler, float relativeChange)
+{
+	bandwidthReportThreshold = relativeChange;
+	bandwidthEstimateHandler = handler;
+}
+
+void UDPMessageConnection::UpdateBandwidthEstimate()
+{
+	AssertInWorkerThreadContext();
+
+	availableBandwidth = (float)bandwidthEstimator.Bandwidth();
+	queuingDelay = (float)bandwidthEstimator.QueuingDelay();
+
+	IBandwidthEstimateHandler *handler = bandwidthEstimateHandler;
+	if (!handler)
+		return;
+	const float delayThreshold = std::max(1.f, bandwidthReportThreshold * (float)bandwidthEstimator.MinRtt());
+	if (fabs(availableBandwidth - reportedBandwidth) <= bandwidthReportThreshold * reportedBandwidth &&
+		fabs(queuingDelay - reportedQueuingDelay) <= delayThreshold)
+		return;
+	reportedBandwidth = availableBandwidth;
+	reportedQueuingDelay = queuingDelay;
+	handler->BandwidthEstimateChanged(this, availableBandwidth, queuingDelay);
+}
 
 /// Adjusts the retransmission timer values as per RFC 2988.
 /// @param rtt The round trip time that was measured on the packet that was just acked.
@@ -1090,15 +2724,6 @@ void UDPMessageConnection::UpdateRTOCounterOnPacketAck(float rtt)
 
 //	retransmissionTimeout = min(maxRTOTimeoutValue, max(minRTOTimeoutValue, safetyThresholdAdd + safetyThresholdMul * (smoothedRTT + rttVariation)));
 	retransmissionTimeout = min(maxRTOTimeoutValue, max(minRTOTimeoutValue, safetyThresholdAdd + safetyThresholdMul * (smoothedRTT + rttVariation)));
-
-///	const float maxDatagramSendRate = 3000.f;
-	// Update data send rate.
-//	++datagramOutRatePerSecond; // Additive increases.
-//	datagramSendRate = datagramSendRate + 1.f; // Increase by one datagram/successfully sent packet.
-//	datagramSendRate = min(datagramSendRate + 1.f, maxDatagramSendRate); // Increase by one datagram/successfully sent packet.
-
-//	KNET_LOG(LogVerbose, "Packet ack event: RTO: %.3f sec., srtt: %.3f sec., rttvar: %.3f sec. datagramSendRate: %.2f", 
-//		retransmissionTimeout, smoothedRTT, rttVariation, datagramSendRate);
 }
 
 void UDPMessageConnection::UpdateRTOCounterOnPacketLoss()
@@ -1107,52 +2732,76 @@ void UDPMessageConnection::UpdateRTOCounterOnPacketLoss()
 
 	using namespace std;
 
-	retransmissionTimeout = smoothedRTT = min(maxRTOTimeoutValue, max(minRTOTimeoutValue, smoothedRTT * 2.f));
-	// The variation just gives bogus values, so clear it altogether.
-	rttVariation = 0.f;
-
-	// Multiplicative decreases.
-//	datagramOutRatePerSecond = max(1, datagramOutRatePerSecond / 2);
-//	datagramSendRate = max(1.f, datagramSendRate * 0.9f); // At least send one packet/second.
+	// Only the timer is backed off (RFC 6298, section 5.5). The RTT estimates are still valid for the next acks.
+	retransmissionTimeout = min(maxRTOTimeoutValue, max(minRTOTimeoutValue, retransmissionTimeout * 2.f));
+}
 
-	++numLossesLastFrame;
+void UDPMessageConnection::SendPacketAckMessage()
+{
+	AssertInWorkerThreadContext();
 
-//	KNET_LOG(LogVerbose, "Packet loss event: RTO: %.3f sec. datagramSendRate: %.2f", retransmissionTimeout, datagramSendRate);
+	while(receivedPacketIDs.NumPendingAcks() > 0)
+	{
+		NetworkMessage *msg = CreatePacketAckMessage();
+		EndAndQueueMessage(msg, msg->dataSize, true);
+	}
 }
 
-void UDPMessageConnection::SendPacketAckMessage()
+NetworkMessage *UDPMessageConnection::CreatePacketAckMessage()
 {
 	AssertInWorkerThreadContext();
+	assert(receivedPacketIDs.NumPendingAcks() > 0);
+
+	// Describe the received PacketIDs from the oldest unacked one on as a list of ranges. The IDs in between the
+	// unacked ones that were received earlier are acked again, which joins the ranges and makes up for lost acks.
+	const packet_id_t firstPacketID = receivedPacketIDs.FirstPendingAck();
+	receivedPacketIDs.ClearPendingAck(firstPacketID);
+	packet_id_t rangeStart = firstPacketID;
+	packet_id_t rangeEnd = firstPacketID;
+	int numRanges = 1;
+
+	NetworkMessage *msg = StartNewMessage(MsgIdPacketAckRanges, cMaxPacketAckRangesMessageSize);
+	DataSerializer mb(msg->data, cMaxPacketAckRangesMessageSize);
+	mb.Add<u8>((u8)(firstPacketID & 0xFF));
+	if (numCEMarksReceived > 0)
+	{
+		mb.Add<u16>((u16)((firstPacketID >> 8) | cPacketAckCEFlag));
+		mb.AddVLE<VLE8_16_32>(numCEMarksReceived);
+	}
+	else
+		mb.Add<u16>((u16)(firstPacketID >> 8));
 
-	while(!inboundPacketAckTrack.empty())
+	packet_id_t packetID;
+	while(receivedPacketIDs.NextPendingAck(AddPacketID(rangeEnd, 1), packetID))
 	{
-		packet_id_t packetID = inboundPacketAckTrack.begin()->first;
-		u32 sequence = 0;
+		// The rest are left for the next message.
+		if (PacketIDDistance(firstPacketID, packetID) > cMaxPacketAckSpan)
+			break;
+
+		while(AddPacketID(rangeEnd, 1) != packetID && HaveReceivedPacketID(AddPacketID(rangeEnd, 1)))
+			rangeEnd = AddPacketID(rangeEnd, 1);
 
-		inboundPacketAckTrack.erase(packetID);
-		for(int i = 0; i < 32; ++i)
+		if (AddPacketID(rangeEnd, 1) != packetID)
 		{
-			packet_id_t id = AddPacketID(packetID, i + 1);
-			
-			PacketAckTrackMap::iterator iter = inboundPacketAckTrack.find(id);
-			if (iter != inboundPacketAckTrack.end())
-			{
-				sequence |= 1 << i;
-				inboundPacketAckTrack.erase(id);
-			}
+			if (numRanges >= cMaxPacketAckRanges)
+				break;
+			// Close the current range (length - 1), and skip the gap to the next one (gap - 1).
+			mb.AddVLE<VLE8_16>(PacketIDDistance(rangeStart, rangeEnd));
+			mb.AddVLE<VLE8_16>(PacketIDDistance(rangeEnd, packetID) - 2);
+			rangeStart = packetID;
+			++numRanges;
 		}
+		rangeEnd = packetID;
+		receivedPacketIDs.ClearPendingAck(packetID);
+	}
+	mb.AddVLE<VLE8_16>(PacketIDDistance(rangeStart, rangeEnd));
 
-		NetworkMessage *msg = StartNewMessage(MsgIdPacketAck, 7);
-		DataSerializer mb(msg->data, 7);
-		mb.Add<u8>((u8)(packetID & 0xFF));
-		mb.Add<u16>((u16)(packetID >> 8));
-		mb.Add<u32>(sequence);
-		msg->priority = NetworkMessage::cMaxPriority - 1;
+	msg->dataSize = mb.BytesFilled();
+	msg->priority = NetworkMessage::cMaxPriority - 1;
 #ifdef KNET_NETWORK_PROFILING
-		msg->profilerName = "PacketAck (4)";
+	msg->profilerName = "PacketAckRanges (5:2)";
 #endif
-		EndAndQueueMessage(msg, mb.BytesFilled(), true);
-	}
+	return msg;
 }
 
 void UDPMessageConnection::HandlePacketAckMessage(const char *data, size_t numBytes)
@@ -1162,7 +2811,8 @@ void UDPMessageConnection::HandlePacketAckMessage(const char *data, size_t numBy
 	if (numBytes != 7)
 	{
 		KNET_LOG(LogError, "Malformed PacketAck message received! Size was %d bytes, expected 7 bytes!", (int)numBytes);
-		throw NetException("Received a PacketAck message of wrong size! (expected 7 bytes)");
+		MalformedMessageReceived();
+		return;
 	}
 
 	DataDeserializer mr(data, numBytes);
@@ -1178,6 +2828,81 @@ void UDPMessageConnection::HandlePacketAckMessage(const char *data, size_t numBy
 			packet_id_t id = AddPacketID(packetID, 1 + i);
 			FreeOutboundPacketAckTrack(id);
 		}
+
+	DetectLostDatagrams();
+}
+
+void UDPMessageConnection::HandlePacketAckRangesMessage(const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	if (numBytes < 4)
+	{
+		KNET_LOG(LogError, "Malformed PacketAckRanges message received! Size was %d bytes, expected at least 4 bytes!", (int)numBytes);
+		MalformedMessageReceived();
+		return;
+	}
+
+	DataDeserializer mr(data, numBytes);
+	packet_id_t packetIDLow = (packet_id_t)mr.Read<u8>();
+	packet_id_t packetIDHigh = (packet_id_t)mr.Read<u16>();
+	const bool haveCEMarks = (packetIDHigh & cPacketAckCEFlag) != 0;
+	packet_id_t rangeStart = packetIDLow | ((packetIDHigh & ~(packet_id_t)cPacketAckCEFlag) << 8);
+	if (rangeStart >= (1 << 22))
+	{
+		KNET_LOG(LogError, "Malformed PacketAckRanges message received! PacketID %d is out of range!", (int)rangeStart);
+		MalformedMessageReceived();
+		return;
+	}
+	u32 ceMarks = 0;
+	if (haveCEMarks)
+	{
+		ceMarks = mr.ReadVLE<VLE8_16_32>();
+		if (ceMarks == DataDeserializer::VLEReadError || mr.BytesLeft() == 0)
+		{
+			KNET_LOG(LogError, "Malformed PacketAckRanges message received! Invalid count of congestion marks.");
+			MalformedMessageReceived();
+			return;
+		}
+	}
+
+	u32 span = 0;
+	for(;;)
+	{
+		const u32 rangeLength = mr.ReadVLE<VLE8_16>();
+		if (rangeLength == DataDeserializer::VLEReadError || (span += rangeLength) > cMaxPacketAckSpan)
+		{
+			KNET_LOG(LogError, "Malformed PacketAckRanges message received! Invalid range length.");
+			MalformedMessageReceived();
+			return;
+		}
+		const packet_id_t rangeEnd = AddPacketID(rangeStart, rangeLength);
+		FreeOutboundPacketAckTrackRange(rangeStart, rangeEnd);
+
+		if (mr.BytesLeft() == 0)
+			break;
+
+		const u32 gap = mr.ReadVLE<VLE8_16>();
+		if (gap == DataDeserializer::VLEReadError || (span += gap + 2) > cMaxPacketAckSpan || mr.BytesLeft() == 0)
+		{
+			KNET_LOG(LogError, "Malformed PacketAckRanges message received! Invalid range gap.");
+			MalformedMessageReceived();
+			return;
+		}
+		rangeStart = AddPacketID(rangeEnd, gap + 2);
+	}
+
+	// The count only grows, so a reordered ack carries an older count and is ignored. The marked datagrams were sent
+	// no later than the newest one acked, which lets the controller cut once for all the marks of one round trip.
+	if (haveCEMarks && (s32)(ceMarks - peerCEMarks) > 0)
+	{
+		ADDEVENT("congestionMarked", (float)(ceMarks - peerCEMarks), "");
+		peerCEMarks = ceMarks;
+		if (haveAckedDatagrams)
+			congestionControl->OnCongestionMarked(Clock::Tick(), largestAckedSentTick, bytesInFlight);
+	}
+
+	DetectLostDatagrams();
 }
 
 void UDPMessageConnection::HandleDisconnectMessage()
@@ -1241,85 +2966,477 @@ void UDPMessageConnection::PerformFlowControl()
 	*/
 }
 
-void UDPMessageConnection::ComputePacketLoss()
+void AppendU16ToVector(std::vector<char> &data, unsigned long value)
 {
-	AssertInWorkerThreadContext();
+	data.insert(data.end(), (const char *)&value, (const char *)&value + 2);
+}
 
-	Lockable<ConnectionStatistics>::LockType cs = statistics.Acquire();
+void UDPMessageConnection::SetDatagramInFlowRatePerSecond(int newDatagramReceiveRate, bool internalCall)
+{/*
+	if (newDatagramReceiveRate == datagramInRatePerSecond) // No need to set it multiple times.
+		return;
 
-	if (cs->recvPacketIDs.size() <= 1)
+	if (newDatagramReceiveRate < 5 || newDatagramReceiveRate > 10 * 1024)
 	{
-		packetLossRate = packetLossCount = 0.f;
+		KNET_LOG(LogError, "Tried to set invalid UDP receive rate %d packets/sec! Ignored.", newDatagramReceiveRate);
+		return;
+	}
+	
+	datagramInRatePerSecond = newDatagramReceiveRate;
+
+	NetworkMessage *msg = StartNewMessage(MsgIdFlowControlRequest);
+	AppendU16ToVector(msg->data, newDatagramReceiveRate);
+	msg->priority = NetworkMessage::cMaxPriority - 1;
+#ifdef KNET_NETWORK_PROFILING
+	msg->profilerName = "FlowControlRequest (3)";
+#endif
+	EndAndQueueMessage(msg, 2, internalCall);*/
+}
+
+void UDPMessageConnection::SetMaxDatagramSizeLimit(size_t bytes)
+{
+	AssertInMainThreadContext();
+
+	const size_t socketLimit = socket ? socket->MaxSendSize() : cBaseDatagramSize;
+	maxDatagramSizeLimit = min(max(bytes, (size_t)cMinDatagramSize), socketLimit);
+	// The worker thread advertises the new limit to the peer and restarts the search.
+}
+
+void UDPMessageConnection::UpdatePathMTUDiscovery()
+{
+	AssertInWorkerThreadContext();
+
+	if (connectionState != ConnectionOK || !socket || !socket->IsWriteOpen())
 		return;
+
+	const size_t limit = maxDatagramSizeLimit;
+	if (limit != advertisedDatagramSizeLimit)
+	{
+		SendPathMTUAdvertisement(limit);
+		advertisedDatagramSizeLimit = limit;
+		smallestFailedProbeSize = 0;
+		pathMTURaiseTimer.Stop();
 	}
 
-	const tick_t maxEntryAge = Clock::TicksPerSec() * 5;
-	const tick_t timeNow = Clock::Tick();
-	const tick_t maxTickAge = timeNow - maxEntryAge;
+	const size_t ceiling = (peerDatagramSizeLimit != 0) ? min(limit, peerDatagramSizeLimit) : min(limit, cBaseDatagramSize);
+	if (maxDatagramSize > ceiling)
+		maxDatagramSize = ceiling;
+	if (peerDatagramSizeLimit == 0)
+		return; // Probing starts when the peer has told how large datagrams it takes.
 
-	// Remove old entries.
-	for(size_t i = 0; i < cs->recvPacketIDs.size(); ++i)
-		if (Clock::IsNewer(cs->recvPacketIDs[i].tick, maxTickAge))
+	if (pathMTUProbeSize != 0)
+	{
+		if (pathMTUProbeTimer.Enabled() && !pathMTUProbeTimer.Test())
+			return; // Wait for the ack of the probe in flight.
+		if (numPathMTUProbesSent >= cMaxPathMTUProbes)
 		{
-			cs->recvPacketIDs.erase(cs->recvPacketIDs.begin(), cs->recvPacketIDs.begin() + i);
-			break;
+			// The path does not carry datagrams this large. Continue the search below this size.
+			KNET_LOG(LogVerbose, "UDPMessageConnection::UpdatePathMTUDiscovery: Probes of %d bytes were lost in connection %s.", (int)pathMTUProbeSize, ToString().c_str());
+			smallestFailedProbeSize = pathMTUProbeSize;
+			pathMTUProbeSize = 0;
 		}
+	}
 
-	if (cs->recvPacketIDs.size() <= 1)
+	if (pathMTUProbeSize == 0)
 	{
-		packetLossRate = packetLossCount = 0.f;
-		return;
+		if (pathMTURaiseTimer.Enabled())
+		{
+			if (!pathMTURaiseTimer.Test())
+				return;
+			smallestFailedProbeSize = 0; // Try the largest size again, in case the path has changed.
+		}
+
+		// Try the limit first, and if the path does not carry that, binary search for the size between it and the current size.
+		size_t probeSize = ceiling;
+		if (smallestFailedProbeSize != 0 && smallestFailedProbeSize <= ceiling)
+		{
+			if (smallestFailedProbeSize <= maxDatagramSize + cPathMTUSearchGranularity)
+				probeSize = 0;
+			else
+				probeSize = (maxDatagramSize + smallestFailedProbeSize) / 2;
+		}
+		if (probeSize <= maxDatagramSize)
+		{
+			// The search is done. If it stopped below the limits, try again later.
+			if (smallestFailedProbeSize != 0)
+				pathMTURaiseTimer.StartMSecs(cPathMTURaiseIntervalMSecs);
+			return;
+		}
+		pathMTUProbeSize = probeSize;
+		numPathMTUProbesSent = 0;
 	}
 
-	// Find the oldest packet (in terms of messageID)
-	int oldestIndex = 0;
-	for(size_t i = 1; i < cs->recvPacketIDs.size(); ++i)
-		if (PacketIDIsNewerThan(cs->recvPacketIDs[oldestIndex].packetID, cs->recvPacketIDs[i].packetID))
-			oldestIndex = i;
+	SendPathMTUProbe();
+}
+
+void UDPMessageConnection::SendPathMTUAdvertisement(size_t limit)
+{
+	AssertInWorkerThreadContext();
+
+	NetworkMessage *msg = StartNewMessage(MsgIdPathMTU, 3);
+	DataSerializer mb(msg->data, 3);
+	mb.Add<u8>(PathMTUAdvertisement);
+	mb.Add<u16>((u16)limit);
+	msg->priority = NetworkMessage::cMaxPriority - 1;
+	msg->reliable = true;
+#ifdef KNET_NETWORK_PROFILING
+	msg->profilerName = "PathMTU (5:1)";
+#endif
+	EndAndQueueMessage(msg, mb.BytesFilled(), true);
+}
+
+void UDPMessageConnection::SendPathMTUProbe()
+{
+	AssertInWorkerThreadContext();
+
+	// The probes are paced like the other datagrams.
+	if (!CanSendOutNewDatagram())
+		return;
+
+	static const char zeroPadding[1 << 11] = {};
 
-	std::vector<packet_id_t> relIDs;
-	relIDs.reserve(cs->recvPacketIDs.size());
-	for(size_t i = 0; i < cs->recvPacketIDs.size(); ++i)
-		relIDs.push_back(SubPacketID(cs->recvPacketIDs[i].packetID, cs->recvPacketIDs[oldestIndex].packetID));
+	// The probed size is the size on the wire, which includes the nonce and tag of the encryption or the checksum.
+	const size_t probeSize = pathMTUProbeSize;
+	const size_t probePlaintextSize = probeSize - DatagramSealOverhead();
+	pathMTUProbeData.resize(probeSize);
+	DataSerializer writer(&pathMTUProbeData[0], probePlaintextSize);
 
-	sort::CocktailSort(&relIDs[0], relIDs.size());
+	// An unreliable datagram with the probe message first, and padding messages that fill it up to the probed size.
+	const packet_id_t packetID = datagramPacketIDCounter;
+	writer.Add<u8>((u8)(packetID & 63));
+	writer.Add<u16>((u16)(packetID >> 6));
 
-	int numMissedPackets = 0;
-	for(size_t i = 0; i+1 < cs->recvPacketIDs.size(); ++i)
+	++pathMTUProbeID;
+	const size_t probeContentSize = 9; // Message ID, type, probe ID and size.
+	writer.Add<u16>((u16)probeContentSize);
+	AddMessageID(writer, MsgIdPathMTU);
+	writer.Add<u8>(PathMTUProbe);
+	writer.Add<u32>(pathMTUProbeID);
+	writer.Add<u16>((u16)probeSize);
+
+	const size_t messageHeaderSize = 2;
+	const size_t minPaddingContentSize = 3; // Message ID and type.
+	while(writer.BytesLeft() >= messageHeaderSize + minPaddingContentSize)
 	{
-		assert(relIDs[i+1] > relIDs[i]);
-		numMissedPackets += relIDs[i+1] - relIDs[i] - 1;
+		size_t contentSize = min(writer.BytesLeft() - messageHeaderSize, (size_t)(1 << 11) - 1);
+		// Leave either nothing or room for a whole padding message after this one.
+		const size_t bytesLeftAfter = writer.BytesLeft() - messageHeaderSize - contentSize;
+		if (bytesLeftAfter > 0 && bytesLeftAfter < messageHeaderSize + minPaddingContentSize)
+			contentSize -= messageHeaderSize + minPaddingContentSize;
+		writer.Add<u16>((u16)contentSize);
+		AddMessageID(writer, MsgIdPathMTU);
+		writer.Add<u8>(PathMTUPadding);
+		writer.AddAlignedByteArray(zeroPadding, (u32)(contentSize - minPaddingContentSize));
 	}
+	assert(writer.BytesFilled() == probePlaintextSize);
+	SealDatagram(&pathMTUProbeData[0], probePlaintextSize);
+
+	// The probe goes straight to the socket and not to a datagram batch, so that a size the local interface refuses fails right away.
+	CapturePacket(CaptureOutbound, &pathMTUProbeData[0], probeSize);
+	bool success = socket->Send(&pathMTUProbeData[0], probeSize);
+	const bool tooLarge = !success && Network::GetLastError() == KNET_EMSGSIZE;
+	++numPathMTUProbesSent;
+	if (tooLarge)
+		numPathMTUProbesSent = cMaxPathMTUProbes;
+	else
+		pathMTUProbeTimer.StartMSecs(cPathMTUProbeTimeoutMSecs);
 
-	packetLossRate = (float)numMissedPackets / (cs->recvPacketIDs.size() + numMissedPackets);
-	packetLossCount = (float)numMissedPackets * 1000.f / (float)Clock::TimespanToMillisecondsD(maxTickAge, timeNow);
+	NewDatagramSent(probeSize);
+	datagramPacketIDCounter = AddPacketID(datagramPacketIDCounter, 1);
+	if (success)
+	{
+		AddOutboundStats(probeSize, 1, 1);
+		ADDEVENT("pathMTUProbeOut", (float)probeSize, "bytes");
+	}
+	KNET_LOG(LogVerbose, "UDPMessageConnection::SendPathMTUProbe: Sent a probe of %d bytes to connection %s.", (int)probeSize, ToString().c_str());
 }
 
-void AppendU16ToVector(std::vector<char> &data, unsigned long value)
+void UDPMessageConnection::HandlePathMTUMessage(const char *data, size_t numBytes)
 {
-	data.insert(data.end(), (const char *)&value, (const char *)&value + 2);
-}
+	AssertInWorkerThreadContext();
 
-void UDPMessageConnection::SetDatagramInFlowRatePerSecond(int newDatagramReceiveRate, bool internalCall)
-{/*
-	if (newDatagramReceiveRate == datagramInRatePerSecond) // No need to set it multiple times.
+	if (numBytes < 1)
+	{
+		KNET_LOG(LogError, "Malformed PathMTU message received! The message was empty!");
+		MalformedMessageReceived();
 		return;
+	}
 
-	if (newDatagramReceiveRate < 5 || newDatagramReceiveRate > 10 * 1024)
+	DataDeserializer mr(data, numBytes);
+	const u8 type = mr.Read<u8>();
+	if (type == PathMTUPadding)
+		return;
+
+	const size_t expectedSize = (type == PathMTUAdvertisement) ? 3 : 7;
+	if (type > PathMTUPadding || numBytes != expectedSize)
 	{
-		KNET_LOG(LogError, "Tried to set invalid UDP receive rate %d packets/sec! Ignored.", newDatagramReceiveRate);
+		KNET_LOG(LogError, "Malformed PathMTU message received! Type was %d and size %d bytes!", (int)type, (int)numBytes);
+		MalformedMessageReceived();
 		return;
 	}
-	
-	datagramInRatePerSecond = newDatagramReceiveRate;
 
-	NetworkMessage *msg = StartNewMessage(MsgIdFlowControlRequest);
-	AppendU16ToVector(msg->data, newDatagramReceiveRate);
-	msg->priority = NetworkMessage::cMaxPriority - 1;
+	if (type == PathMTUAdvertisement)
+	{
+		peerDatagramSizeLimit = max((size_t)mr.Read<u16>(), (size_t)cMinDatagramSize);
+		smallestFailedProbeSize = 0;
+		pathMTURaiseTimer.Stop();
+		KNET_LOG(LogVerbose, "UDPMessageConnection::HandlePathMTUMessage: The peer takes datagrams of up to %d bytes in connection %s.", (int)peerDatagramSizeLimit, ToString().c_str());
+		return;
+	}
+
+	const u32 probeID = mr.Read<u32>();
+	const size_t probeSize = mr.Read<u16>();
+	if (type == PathMTUProbe)
+	{
+		NetworkMessage *msg = StartNewMessage(MsgIdPathMTU, 7);
+		DataSerializer mb(msg->data, 7);
+		mb.Add<u8>(PathMTUProbeAck);
+		mb.Add<u32>(probeID);
+		mb.Add<u16>((u16)probeSize);
+		msg->priority = NetworkMessage::cMaxPriority - 1;
 #ifdef KNET_NETWORK_PROFILING
-	msg->profilerName = "FlowControlRequest (3)";
+		msg->profilerName = "PathMTU (5:1)";
 #endif
-	EndAndQueueMessage(msg, 2, internalCall);*/
+		EndAndQueueMessage(msg, mb.BytesFilled(), true);
+	}
+	else if (probeID == pathMTUProbeID && probeSize == pathMTUProbeSize)
+	{
+		// The path carries datagrams of this size. The next update continues the search above it.
+		maxDatagramSize = probeSize;
+		pathMTUProbeSize = 0;
+		pathMTUProbeTimer.Stop();
+		numLargeDatagramsLost = 0;
+		lastLargeDatagramAckTime = Clock::LoopTick();
+		KNET_LOG(LogInfo, "UDPMessageConnection::HandlePathMTUMessage: Raised the datagram size to %d bytes in connection %s.", (int)probeSize, ToString().c_str());
+	}
+}
+
+void UDPMessageConnection::PathMTUDatagramLost(size_t datagramSize, tick_t sentTick)
+{
+	AssertInWorkerThreadContext();
+
+	// Only the losses of datagrams sent after the last large datagram got through count, since datagrams lost in a burst of
+	// congestion time out together long after the datagrams sent after them have been acked.
+	if (datagramSize <= cBaseDatagramSize || maxDatagramSize <= cBaseDatagramSize || !Clock::IsNewer(sentTick, lastLargeDatagramAckTime))
+		return;
+	if (++numLargeDatagramsLost < cMaxPathMTUProbes)
+		return;
+
+	// The path has stopped carrying large datagrams (a black hole). Fall back to the base size and search again from there.
+	KNET_LOG(LogInfo, "UDPMessageConnection::PathMTUDatagramLost: %d datagrams of up to %d bytes were lost in a row. Falling back to %d bytes in connection %s.",
+		numLargeDatagramsLost, (int)maxDatagramSize, (int)cBaseDatagramSize, ToString().c_str());
+	smallestFailedProbeSize = maxDatagramSize;
+	maxDatagramSize = min(cBaseDatagramSize, (size_t)maxDatagramSize);
+	pathMTUProbeSize = 0;
+	pathMTUProbeTimer.Stop();
+	pathMTURaiseTimer.Stop();
+	numLargeDatagramsLost = 0;
+}
+
+void UDPMessageConnection::SetForwardErrorCorrectionGroupSize(int numDatagrams)
+{
+	AssertInMainThreadContext();
+
+	fecRequestedGroupSize = (numDatagrams <= 0) ? 0 : min(max(numDatagrams, 1), cMaxFECGroupSize);
+	// The worker thread takes the new size into use when the current group is finished.
+}
+
+bool UDPMessageConnection::IsForwardErrorCorrected(const NetworkMessage &msg) const
+{
+	// The reliable messages are resent anyway, so only the unreliable ones are protected.
+	return !msg.reliable && (msg.forwardErrorCorrection || msg.priority >= fecMinPriority);
+}
+
+void UDPMessageConnection::XorDatagramToFECGroup(packet_id_t packetID, const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+	assert(numBytes <= cMaxFECDatagramSize);
+
+	if (fecGroupPacketIDs.empty())
+		fecGroupStartTick = Clock::LoopTick();
+	fecGroupPacketIDs.push_back(packetID);
+
+	if (fecParity.size() < numBytes)
+		fecParity.resize(numBytes, 0);
+	for(size_t i = 0; i < numBytes; ++i)
+		fecParity[i] ^= data[i];
+	fecParityLength ^= (u16)numBytes;
+}
+
+void UDPMessageConnection::SendFECParityDatagram()
+{
+	AssertInWorkerThreadContext();
+
+	if (fecGroupPacketIDs.empty())
+		return;
+
+	const size_t contentSize = 2 + 3 + 1 + 2 * (fecGroupPacketIDs.size() - 1) + 2 + fecParity.size(); // Message ID, header and parity.
+	assert(contentSize < (1 << 11));
+	// The parity goes out right away, since it is only useful if it arrives before the receiver would need a retransmission.
+	// It is sent through the same path as the datagrams it covers, so that it does not overtake them.
+	OverlappedTransferBuffer *data = socket->BeginSend((int)(3 + 2 + contentSize + DatagramSealOverhead()));
+	if (data)
+	{
+		DataSerializer writer(data->buffer.buf, data->buffer.len);
+
+		// An unreliable datagram that carries only the FECParity message. It is not protected itself.
+		const packet_id_t packetID = datagramPacketIDCounter;
+		writer.Add<u8>((u8)(packetID & 63));
+		writer.Add<u16>((u16)(packetID >> 6));
+		const size_t contentLengthPos = writer.BytesFilled();
+		writer.Add<u16>(0); // The content length is filled in once the PacketID deltas have been encoded.
+		AddMessageID(writer, MsgIdFECParity);
+		const packet_id_t firstPacketID = fecGroupPacketIDs[0];
+		writer.Add<u8>((u8)(firstPacketID & 0xFF));
+		writer.Add<u16>((u16)(firstPacketID >> 8));
+		writer.Add<u8>((u8)fecGroupPacketIDs.size());
+		for(size_t i = 1; i < fecGroupPacketIDs.size(); ++i)
+			writer.AddVLE<VLE8_16>(PacketIDDistance(fecGroupPacketIDs[i-1], fecGroupPacketIDs[i]) - 1);
+		writer.Add<u16>(fecParityLength);
+		if (!fecParity.empty())
+			writer.AddAlignedByteArray(&fecParity[0], (u32)fecParity.size());
+
+		size_t datagramSize = writer.BytesFilled();
+		const u16 messageContentSize = (u16)(datagramSize - contentLengthPos - 2);
+		memcpy(data->buffer.buf + contentLengthPos, &messageContentSize, sizeof(messageContentSize));
+		datagramSize = SealDatagram(data->buffer.buf, datagramSize);
+		data->bytesContains = datagramSize;
+		CapturePacket(CaptureOutbound, data->buffer.buf, datagramSize);
+
+		bool success;
+		if (!networkSendSimulator.enabled)
+			success = socket->EndSend(data);
+		else
+		{
+			networkSendSimulator.SubmitSendBuffer(data, socket);
+			success = true;
+		}
+
+		if (success)
+		{
+			NewDatagramSent(datagramSize);
+			datagramPacketIDCounter = AddPacketID(datagramPacketIDCounter, 1);
+			AddOutboundStats(datagramSize, 1, 1);
+			ADDEVENT("fecParityOut", (float)datagramSize, "bytes");
+		}
+	}
+
+	fecGroupPacketIDs.clear();
+	fecParity.clear();
+	fecParityLength = 0;
+}
+
+void UDPMessageConnection::UpdateForwardErrorCorrection()
+{
+	AssertInWorkerThreadContext();
+
+	// A partial group would hold its datagrams unprotected until the stream resumes, so cover them with what there is.
+	if (!fecGroupPacketIDs.empty() && Clock::TimespanToMillisecondsF(fecGroupStartTick, Clock::LoopTick()) >= cFECMaxGroupDelayMSecs)
+		SendFECParityDatagram();
+
+	if (fecRequestedGroupSize > 0)
+		fecGroupSize = fecRequestedGroupSize;
+	else
+	{
+		// Size the groups so that two losses in the same group, which the parity can't rebuild, stay rare.
+		const float lossRate = PacketLossRate();
+		const int groupSize = (lossRate > 0.f) ? (int)(cFECTargetLossesPerGroup / lossRate) - 1 : cMaxFECGroupSize;
+		fecGroupSize = min(max(groupSize, cMinFECGroupSize), cMaxFECGroupSize);
+	}
+}
+
+void UDPMessageConnection::HandleFECParityMessage(const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	if (numBytes < 6)
+	{
+		KNET_LOG(LogError, "Malformed FECParity message received! Size was %d bytes, expected at least 6 bytes!", (int)numBytes);
+		MalformedMessageReceived();
+		return;
+	}
+
+	// Start keeping copies of the received datagrams, now that the peer protects them.
+	if (fecReceiveHistory.empty())
+		fecReceiveHistory.resize(cFECReceiveHistorySize);
+
+	DataDeserializer mr(data, numBytes);
+	packet_id_t packetIDLow = (packet_id_t)mr.Read<u8>();
+	packet_id_t packetIDHigh = (packet_id_t)mr.Read<u16>();
+	packet_id_t packetID = packetIDLow | (packetIDHigh << 8);
+	const int groupSize = mr.Read<u8>();
+	if (packetID >= (1 << 22) || groupSize == 0 || groupSize > cMaxFECGroupSize)
+	{
+		KNET_LOG(LogError, "Malformed FECParity message received! PacketID %d, group size %d.", (int)packetID, groupSize);
+		MalformedMessageReceived();
+		return;
+	}
+
+	// Find the datagram of the group that has not been received. The parity can rebuild only one.
+	packet_id_t groupPacketIDs[cMaxFECGroupSize];
+	int lostIndex = -1;
+	int numLost = 0;
+	for(int i = 0; i < groupSize; ++i)
+	{
+		if (i > 0)
+		{
+			const u32 delta = mr.ReadVLE<VLE8_16>();
+			if (delta == DataDeserializer::VLEReadError)
+			{
+				KNET_LOG(LogError, "Malformed FECParity message received! The packet ID of datagram %d of the group was truncated.", i);
+				MalformedMessageReceived();
+				return;
+			}
+			packetID = AddPacketID(packetID, delta + 1);
+		}
+		groupPacketIDs[i] = packetID;
+		if (!HaveReceivedPacketID(packetID))
+		{
+			lostIndex = i;
+			++numLost;
+		}
+	}
+	if (mr.BytesLeft() < 2)
+	{
+		KNET_LOG(LogError, "Malformed FECParity message received! The datagram length was missing.");
+		MalformedMessageReceived();
+		return;
+	}
+	u16 length = mr.Read<u16>();
+
+	if (numLost != 1)
+	{
+		if (numLost > 1)
+			ADDEVENT("fecUnrecoverable", (float)numLost, "");
+		return;
+	}
+
+	// XOR the other datagrams of the group out of the parity, which leaves the lost one.
+	fecRecoveredDatagram.assign(data + mr.BytePos(), data + numBytes);
+	for(int i = 0; i < groupSize; ++i)
+	{
+		if (i == lostIndex)
+			continue;
+		const FECReceivedDatagram &received = fecReceiveHistory[groupPacketIDs[i] & (cFECReceiveHistorySize - 1)];
+		if (!received.valid || received.packetID != groupPacketIDs[i] || received.data.size() > fecRecoveredDatagram.size())
+		{
+			// The datagram was received before the history was started, or has been pushed out of it already.
+			fecRecoveredDatagram.clear();
+			return;
+		}
+		for(size_t j = 0; j < received.data.size(); ++j)
+			fecRecoveredDatagram[j] ^= received.data[j];
+		length ^= (u16)received.data.size();
+	}
+
+	if (length < 3 || length > fecRecoveredDatagram.size())
+	{
+		KNET_LOG(LogError, "Rebuilt a datagram of invalid size %d bytes from a FECParity message! Discarding it.", (int)length);
+		fecRecoveredDatagram.clear();
+		return;
+	}
+	fecRecoveredDatagram.resize(length);
+	KNET_LOG(LogVerbose, "Rebuilt the lost datagram with packet ID %d from a FECParity message.", (int)groupPacketIDs[lostIndex]);
 }
 
 bool UDPMessageConnection::HandleMessage(packet_id_t packetID, message_id_t messageID, const char *data, size_t numBytes)
@@ -1330,6 +3447,7 @@ bool UDPMessageConnection::HandleMessage(packet_id_t packetID, message_id_t mess
 	{
 	case MsgIdPingRequest:
 	case MsgIdPingReply:
+	case MsgIdDeltaState: // The base class reconstructs the message and passes it back here.
 		return false; // We don't do anything with these messages, the MessageConnection base class handles these.
 
 	case MsgIdFlowControlRequest:
@@ -1344,6 +3462,21 @@ bool UDPMessageConnection::HandleMessage(packet_id_t packetID, message_id_t mess
 	case MsgIdDisconnectAck:
 		HandleDisconnectAckMessage();
 		return true;
+	case MsgIdPathMTU:
+		HandlePathMTUMessage(data, numBytes);
+		return true;
+	case MsgIdPacketAckRanges:
+		HandlePacketAckRangesMessage(data, numBytes);
+		return true;
+	case MsgIdFECParity:
+		HandleFECParityMessage(data, numBytes);
+		return true;
+	case MsgIdFragmentedTransferAbort:
+		HandleFragmentedTransferAbortMessage(data, numBytes);
+		return true;
+	case MsgIdConnectionID:
+		HandleConnectionIDMessage(data, numBytes);
+		return true;
 	default:
 		// For each application-level message received, ask the application to extract the Content ID of the message from the
 		// message to us, so that we can track obsolete data receivals and discard such messages.
@@ -1362,12 +3495,170 @@ bool UDPMessageConnection::HandleMessage(packet_id_t packetID, message_id_t mess
 	}
 }
 
+void UDPMessageConnection::EncodeDeltaState(NetworkMessage *msg)
+{
+	AssertInWorkerThreadContext();
+	assert(msg->contentID != 0 && !msg->transfer);
+
+	// The DeltaState message adds the message ID, content ID and version fields to the contents, and it has to fit in
+	// the 11-bit content length field of a message block.
+	const size_t cMaxHeaderSize = 1 + 4 + 4 + 1 + 1;
+	if (msg->dataSize + cMaxHeaderSize >= (1 << 11))
+		return;
+
+	OutboundDeltaState &state = outboundDeltaStates[std::make_pair((u32)msg->id, (u32)msg->contentID)];
+	const u32 version = state.nextVersion++;
+
+	// The peer keeps the cNumVersions latest versions it has received, and it has received none newer than this one. So it
+	// still keeps the acked version if that is fewer than cNumVersions versions behind.
+	const std::vector<char> *baseline = 0;
+	if (state.hasAckedVersion && version - state.ackedVersion < (u32)DeltaBaselineHistory::cNumVersions)
+		baseline = state.history.Find((u8)state.ackedVersion);
+
+	deltaStateEncodeBuffer.resize(cMaxHeaderSize);
+	DataSerializer writer(&deltaStateEncodeBuffer[0], deltaStateEncodeBuffer.size());
+	writer.AddVLE<VLE8_16_32>(msg->id);
+	writer.Add<u32>((u32)msg->contentID);
+	writer.Add<u8>((u8)version);
+	writer.Add<u8>(baseline ? (u8)(version - state.ackedVersion) : 0);
+	const size_t headerSize = writer.BytesFilled();
+	deltaStateEncodeBuffer.resize(headerSize);
+
+	if (baseline)
+	{
+		EncodeDelta(baseline->empty() ? 0 : &(*baseline)[0], baseline->size(), msg->data, msg->dataSize, deltaStateEncodeBuffer);
+		// Send the full contents instead, if the delta does not make them smaller.
+		if (deltaStateEncodeBuffer.size() - headerSize >= msg->dataSize)
+		{
+			deltaStateEncodeBuffer.resize(headerSize);
+			deltaStateEncodeBuffer[headerSize - 1] = 0;
+			baseline = 0;
+		}
+	}
+	if (!baseline)
+		deltaStateEncodeBuffer.insert(deltaStateEncodeBuffer.end(), msg->data, msg->data + msg->dataSize);
+	else
+		ADDEVENT("deltaStateSavedBytes", (float)(msg->dataSize + headerSize) - (float)deltaStateEncodeBuffer.size(), "bytes");
+
+	state.history.Store((u8)version, msg->data, msg->dataSize);
+	msg->Resize(deltaStateEncodeBuffer.size());
+	memcpy(msg->data, &deltaStateEncodeBuffer[0], deltaStateEncodeBuffer.size());
+	msg->deltaEncoded = true;
+	msg->deltaVersion = version;
+}
+
+void UDPMessageConnection::DeltaStateAcked(u32 messageID, u32 contentID, u32 version)
+{
+	AssertInWorkerThreadContext();
+
+	std::map<MsgContentIDPair, OutboundDeltaState>::iterator iter = outboundDeltaStates.find(std::make_pair(messageID, contentID));
+	if (iter == outboundDeltaStates.end())
+		return;
+	OutboundDeltaState &state = iter->second;
+	// The acks can arrive out of order. Only a newer acked version makes a better baseline.
+	if (!state.hasAckedVersion || (version != state.ackedVersion && version - state.ackedVersion < 0x80000000))
+	{
+		state.ackedVersion = version;
+		state.hasAckedVersion = true;
+	}
+}
+
+void UDPMessageConnection::SendFragmentedTransferAbortMessage(const FragmentedSendManager::FragmentedTransfer &transfer)
+{
+	AssertInWorkerThreadContext();
+
+	const size_t maxMessageSize = 6;
+	NetworkMessage *msg = StartNewMessage(MsgIdFragmentedTransferAbort, maxMessageSize);
+	if (!msg)
+		return;
+
+	DataSerializer mb(msg->data, maxMessageSize);
+	mb.AddVLE<VLE8_16>(transfer.id);
+	mb.Add<u8>(transfer.hasOrderNumber ? 1 : 0);
+	if (transfer.hasOrderNumber)
+	{
+		mb.Add<u8>(transfer.orderingChannel);
+		mb.AddVLE<VLE8_16>(transfer.orderNumber & cOrderNumberMask);
+	}
+
+	// The abort is not ordered, so that it doesn't wait behind the messages it unblocks.
+	msg->reliable = true;
+	msg->inOrder = false;
+	msg->priority = NetworkMessage::cMaxPriority - 1;
+#ifdef KNET_NETWORK_PROFILING
+	msg->profilerName = "FragmentedTransferAbort (5:4)";
+#endif
+	EndAndQueueMessage(msg, mb.BytesFilled(), true);
+}
+
+void UDPMessageConnection::HandleFragmentedTransferAbortMessage(const char *data, size_t numBytes)
+{
+	AssertInWorkerThreadContext();
+
+	DataDeserializer dd(data, numBytes);
+	const u32 transferID = dd.ReadVLE<VLE8_16>();
+	if (transferID == DataDeserializer::VLEReadError || dd.BytesLeft() < 1)
+	{
+		KNET_LOG(LogError, "Malformed FragmentedTransferAbort message received! Size was %d bytes.", (int)numBytes);
+		return;
+	}
+	const u8 flags = dd.Read<u8>();
+
+	// Drop the fragments that have been received so far. The message never completes.
+	fragmentedReceives.FreeMessage(transferID);
+	ADDEVENT("fragmentedTransferAborted", 1, "");
+
+	if ((flags & 1) != 0)
+	{
+		if (dd.BytesLeft() < 2)
+		{
+			KNET_LOG(LogError, "Malformed FragmentedTransferAbort message received! The order number is missing.");
+			return;
+		}
+		const u8 channel = dd.Read<u8>();
+		const u32 orderNumber = dd.ReadVLE<VLE8_16>();
+		if (orderNumber == DataDeserializer::VLEReadError)
+		{
+			KNET_LOG(LogError, "Malformed FragmentedTransferAbort message received! Failed to read the order number.");
+			return;
+		}
+		// The aborted message leaves a gap in its ordering channel. Skip over it, so that the channel does not stall.
+		HandleInOrderMessage(channel, orderNumber, 0, 0, 0);
+	}
+}
+
+void UDPMessageConnection::EnableEncryption(const u8 *sharedKey, const u8 *salt, bool isClient)
+{
+	cipher.SetKey(sharedKey, salt, isClient);
+}
+
+size_t UDPMessageConnection::DatagramSealOverhead() const
+{
+	if (cipher.HasKey())
+		return DatagramCipher::cOverhead;
+	return datagramChecksums ? cChecksumSize : 0;
+}
+
+size_t UDPMessageConnection::SealDatagram(char *data, size_t numBytes)
+{
+	if (cipher.HasKey())
+		return cipher.Encrypt(data, numBytes);
+	if (!datagramChecksums)
+		return numBytes;
+	DataSerializer writer(data + numBytes, cChecksumSize);
+	writer.Add<u32>(CRC32C(data, numBytes));
+	return numBytes + cChecksumSize;
+}
+
 void UDPMessageConnection::DumpConnectionStatus() const
 {
 	char str[2048];
 	sprintf(str,
 		"\tRetransmission timeout: %.2fms.\n"
 		"\tDatagram send rate: %.2f/sec.\n"
+		"\tCongestion control: %s, window: %d bytes, in flight: %d bytes.\n"
+		"\tAvailable bandwidth: %.2f KB/sec, queuing delay: %.2fms.\n"
+		"\tMax datagram size: %d bytes (limit: %d bytes, peer limit: %d bytes).\n"
 		"\tSmoothed RTT: %.2fms.\n"
 		"\tRTT variation: %.2f.\n"
 		"\tOutbound reliable datagrams in flight: %d.\n"
@@ -1378,10 +3669,18 @@ void UDPMessageConnection::DumpConnectionStatus() const
 		"\tDatagrams out: %.2f/sec.\n",
 	retransmissionTimeout,
 	datagramSendRate,
+	CongestionControlAlgorithmToString(congestionControlAlgorithm),
+	(int)congestionWindow,
+	(int)bytesInFlight,
+	availableBandwidth / 1024.f,
+	queuingDelay,
+	(int)maxDatagramSize,
+	(int)maxDatagramSizeLimit,
+	(int)peerDatagramSizeLimit,
 	smoothedRTT,
 	rttVariation,
 	(int)outboundPacketAckTrack.Size(), ///\todo Accessing this variable is not thread-safe.
-	(int)inboundPacketAckTrack.size(), ///\todo Accessing this variable is not thread-safe.
+	receivedPacketIDs.NumPendingAcks(), ///\todo Accessing this variable is not thread-safe.
 	packetLossCount,
 	packetLossRate,
 	PacketsInPerSec(), 
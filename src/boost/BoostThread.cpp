@@ -60,6 +60,7 @@ void Thread::Stop()
 	PolledTimer timer;
 
 	thread.interrupt();
+	Interrupt();
 	thread.join();
 
 	LOG(LogWaits, "Thread::Stop: Took %f msecs.", timer.MSecsElapsed());
@@ -70,6 +71,7 @@ void Thread::Stop()
 	threadHoldEvent.Close();
 	threadHoldEventAcked.Close();
 	threadResumeEvent.Close();
+	threadInterruptEvent.Close();
 }
 
 void Thread::StartThread()
@@ -80,6 +82,7 @@ void Thread::StartThread()
 	threadHoldEvent = CreateNewEvent(EventWaitSignal);
 	threadHoldEventAcked = CreateNewEvent(EventWaitSignal);
 	threadResumeEvent = CreateNewEvent(EventWaitSignal);
+	threadInterruptEvent = CreateNewEvent(EventWaitSignal);
 
 	thread = boost::thread(boost::ref(*invoker));
 
@@ -91,6 +94,17 @@ void Thread::Sleep(int msecs)
 	boost::this_thread::sleep(boost::posix_time::millisec(msecs));
 }
 
+void Thread::YieldTimeSlice()
+{
+	boost::this_thread::yield();
+}
+
+int Thread::NumHardwareThreads()
+{
+	unsigned int numThreads = boost::thread::hardware_concurrency();
+	return (numThreads > 0) ? (int)numThreads : 1;
+}
+
 ThreadId Thread::Id()
 {
 #if defined(WIN32) && !defined(KNET_ENABLE_WINXP_SUPPORT)
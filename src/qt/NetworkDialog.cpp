@@ -19,6 +19,7 @@
 #include <QVBoxLayout>
 #include <QLabel>
 #include <QTreeWidget>
+#include <QStringList>
 
 #ifdef KNET_USE_BOOST
 #include <boost/thread/thread.hpp>
@@ -123,7 +124,27 @@ void NetworkDialog::Update()
 		return;
 
 	machineIp->setText(network->LocalAddress());
-	numRunningThreads->setText(QString::number(network->NumWorkerThreads()));
+	// Show the share of the time each worker thread has been busy since the previous update. The detailed split over the
+	// phases of the worker loop is in the statistics tree under workerThread<id>.
+	QString threadsText = QString::number(network->NumWorkerThreads());
+	const std::vector<NetworkWorkerThread *> &workerThreads = network->WorkerThreads();
+	std::map<NetworkWorkerThread *, WorkerProfile> profiles;
+	QStringList busyTexts;
+	for(size_t i = 0; i < workerThreads.size(); ++i)
+	{
+		const WorkerProfile profile = workerThreads[i]->Profile();
+		const WorkerProfile &previous = workerProfiles[workerThreads[i]];
+		const u64 totalTicks = profile.TotalTicks() - previous.TotalTicks();
+		if (totalTicks > 0)
+			busyTexts.append(QString::number(100.0 * (profile.BusyTicks() - previous.BusyTicks()) / totalTicks, 'f', 0) + "%");
+		else
+			busyTexts.append("-");
+		profiles[workerThreads[i]] = profile;
+	}
+	workerProfiles.swap(profiles);
+	if (!busyTexts.isEmpty())
+		threadsText += " (busy " + busyTexts.join(", ") + ")";
+	numRunningThreads->setText(threadsText);
 
 	QList<QTreeWidgetItem *> items;
 	GetItems(connectionsTree->invisibleRootItem(), items);
@@ -0,0 +1,599 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file IoUring.cpp
+	@brief Implements the IoUring class. Only compiled in when KNET_USE_IO_URING is defined. */
+
+#ifdef KNET_USE_IO_URING
+
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "kNet/unix/IoUring.h"
+#include "kNet/IDatagramReceiver.h"
+#include "kNet/Socket.h"
+#include "kNet/EndPoint.h"
+#include "kNet/PolledTimer.h"
+#include "kNet/Clock.h"
+#include "kNet/NetworkLogging.h"
+
+namespace kNet
+{
+
+void DeleteOverlappedTransferBuffer(OverlappedTransferBuffer *buffer); // Implemented in Socket.cpp.
+
+/// The number of operations that can be queued up before they need to be submitted to the kernel.
+static const u32 cSubmissionQueueSize = 1024;
+/// The number of completions the kernel can post before we reap them. The kernel buffers any overflow internally.
+static const u32 cCompletionQueueSize = 4096;
+/// The number of buffers in the receive pool. Must be a power of two.
+static const u32 cNumReceiveBuffers = 256;
+/// The size of each receive buffer. Holds the io_uring_recvmsg_out header and the source address before the datagram.
+static const u32 cReceiveBufferSize = 2048;
+/// The id of the receive buffer pool.
+static const u16 cReceiveBufferGroup = 0;
+/// The lowest bit of user_data tells the completions of receives apart from the completions of sends. The send
+/// completions carry the OverlappedTransferBuffer pointer, and the receive completions the Receive pointer.
+static const u64 cReceiveTag = 1;
+/// The user_data of the cancel requests, whose completions need no processing.
+static const u64 cCancelUserData = 0;
+
+static __thread IoUring *threadRing = 0;
+
+static int UringSetup(u32 entries, io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int UringEnter(int ringFd, u32 toSubmit, u32 minComplete, u32 flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int UringRegister(int ringFd, u32 opcode, void *arg, u32 numArgs)
+{
+	return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, numArgs);
+}
+
+IoUring::IoUring()
+:ringFd(-1),
+sqRing(0), sqRingSize(0), sqHead(0), sqTail(0), sqMask(0), sqArray(0), sqes(0), sqesSize(0),
+cqRing(0), cqRingSize(0), cqHead(0), cqTail(0), cqMask(0), cqes(0),
+numPending(0),
+numInFlight(0),
+bufferRing(0),
+receiveBuffers(0),
+bufferRingTail(0),
+receivesFailed(false)
+{
+}
+
+IoUring::~IoUring()
+{
+	Close();
+}
+
+IoUring *IoUring::ThreadRing()
+{
+	return threadRing;
+}
+
+void IoUring::SetThreadRing(IoUring *ring)
+{
+	threadRing = ring;
+}
+
+bool IoUring::Init()
+{
+	if (IsValid())
+		return true;
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = cCompletionQueueSize;
+	ringFd = UringSetup(cSubmissionQueueSize, &params);
+	if (ringFd < 0)
+	{
+		KNET_LOG(LogInfo, "IoUring::Init: io_uring_setup failed: %s(%d). Using synchronous socket transfers.", strerror(errno), (int)errno);
+		ringFd = -1;
+		return false;
+	}
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(u32);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	const bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMmap)
+		sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+	void *mem = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if (mem == MAP_FAILED)
+	{
+		KNET_LOG(LogError, "IoUring::Init: Mapping the submission queue failed: %s(%d)!", strerror(errno), (int)errno);
+		Close();
+		return false;
+	}
+	sqRing = mem;
+
+	if (singleMmap)
+		cqRing = sqRing;
+	else
+	{
+		mem = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		if (mem == MAP_FAILED)
+		{
+			KNET_LOG(LogError, "IoUring::Init: Mapping the completion queue failed: %s(%d)!", strerror(errno), (int)errno);
+			Close();
+			return false;
+		}
+		cqRing = mem;
+	}
+
+	sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	mem = mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if (mem == MAP_FAILED)
+	{
+		KNET_LOG(LogError, "IoUring::Init: Mapping the submission queue entries failed: %s(%d)!", strerror(errno), (int)errno);
+		Close();
+		return false;
+	}
+	sqes = (io_uring_sqe*)mem;
+
+	char *sq = (char*)sqRing;
+	sqHead = (u32*)(sq + params.sq_off.head);
+	sqTail = (u32*)(sq + params.sq_off.tail);
+	sqMask = *(u32*)(sq + params.sq_off.ring_mask);
+	sqArray = (u32*)(sq + params.sq_off.array);
+
+	char *cq = (char*)cqRing;
+	cqHead = (u32*)(cq + params.cq_off.head);
+	cqTail = (u32*)(cq + params.cq_off.tail);
+	cqMask = *(u32*)(cq + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	// Have the kernel signal an eventfd whenever it posts completions, so that the worker thread can wait on it
+	// together with all its other events.
+	// The kernel only increments the counter of the eventfd, so it cannot back a signal Event, whose descriptor is written
+	// and read in step with the flag of the Event.
+	int eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eventFd == -1)
+	{
+		KNET_LOG(LogError, "IoUring::Init: eventfd failed: %s(%d)!", strerror(errno), (int)errno);
+		Close();
+		return false;
+	}
+	completionEvent = Event(eventFd, EventWaitRead);
+	if (UringRegister(ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) != 0)
+	{
+		KNET_LOG(LogError, "IoUring::Init: Registering the completion eventfd failed: %s(%d)!", strerror(errno), (int)errno);
+		Close();
+		return false;
+	}
+
+	if (!SetupBufferRing(params.features))
+		KNET_LOG(LogInfo, "IoUring::Init: Multishot receives are not supported. Reading UDP listen sockets synchronously.");
+
+	KNET_LOG(LogInfo, "IoUring::Init: Created an io_uring with %d submission and %d completion queue entries.",
+		(int)params.sq_entries, (int)params.cq_entries);
+	return true;
+}
+
+bool IoUring::SetupBufferRing(u32 features)
+{
+#ifdef IORING_FEAT_REG_REG_RING
+	// There is no feature flag for multishot receives (Linux 6.0), so require a kernel that reports a later feature (Linux 6.3).
+	if ((features & IORING_FEAT_REG_REG_RING) == 0)
+		return false;
+
+	const size_t ringSize = cNumReceiveBuffers * sizeof(io_uring_buf);
+	void *ringMemory = 0;
+	if (posix_memalign(&ringMemory, (size_t)sysconf(_SC_PAGESIZE), ringSize) != 0)
+		return false;
+	memset(ringMemory, 0, ringSize);
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (u64)(uintptr_t)ringMemory;
+	reg.ring_entries = cNumReceiveBuffers;
+	reg.bgid = cReceiveBufferGroup;
+	if (UringRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+	{
+		KNET_LOG(LogInfo, "IoUring::SetupBufferRing: Registering the receive buffers failed: %s(%d).", strerror(errno), (int)errno);
+		free(ringMemory);
+		return false;
+	}
+
+	bufferRing = (io_uring_buf_ring*)ringMemory;
+	receiveBuffers = new char[cNumReceiveBuffers * cReceiveBufferSize];
+	bufferRingTail = 0;
+	for(u32 i = 0; i < cNumReceiveBuffers; ++i)
+		RecycleBuffer((u16)i);
+	return true;
+#else
+	MARK_UNUSED(features);
+	return false;
+#endif
+}
+
+void IoUring::Close()
+{
+	if (ringFd != -1 && sqRing && cqRing && sqes)
+	{
+		// Stop all the receives, and give the operations in progress a moment to finish, since the kernel accesses
+		// their buffers until they do.
+		for(size_t i = 0; i < receives.size(); ++i)
+			if (!receives[i]->stopped)
+				StopReceive(receives[i]->socket);
+		Submit();
+
+		PolledTimer timer;
+		const float maxDrainTime = 1000.f; // msecs.
+		while(numInFlight > 0 && timer.MSecsElapsed() < maxDrainTime)
+		{
+			if (ProcessCompletions() == 0)
+				Clock::Sleep(1);
+		}
+		if (numInFlight > 0)
+			KNET_LOG(LogError, "IoUring::Close: %d operations did not finish in %.0f msecs. Leaking their buffers.", numInFlight, maxDrainTime);
+	}
+
+	if (sqes)
+		munmap(sqes, sqesSize);
+	if (cqRing && cqRing != sqRing)
+		munmap(cqRing, cqRingSize);
+	if (sqRing)
+		munmap(sqRing, sqRingSize);
+	sqes = 0;
+	cqRing = 0;
+	sqRing = 0;
+
+	if (ringFd != -1)
+	{
+		close(ringFd);
+		ringFd = -1;
+	}
+
+	// If some operations never finished, the kernel may still write to their memory, so it is safer to leak it.
+	if (numInFlight == 0)
+	{
+		free(bufferRing);
+		delete[] receiveBuffers;
+		for(size_t i = 0; i < receives.size(); ++i)
+			delete receives[i];
+	}
+	bufferRing = 0;
+	receiveBuffers = 0;
+	receives.clear();
+	numPending = 0;
+	numInFlight = 0;
+
+	if (completionEvent.IsValid())
+	{
+		close(completionEvent.fd[0]);
+		completionEvent = Event();
+	}
+}
+
+void IoUring::ResetCompletionEvent()
+{
+	if (!completionEvent.IsValid())
+		return;
+	// Reading an eventfd returns its counter value and resets the counter to zero.
+	eventfd_t val = 0;
+	if (eventfd_read(completionEvent.fd[0], &val) == -1 && errno != EAGAIN)
+		KNET_LOG(LogError, "IoUring::ResetCompletionEvent: eventfd_read failed: %s(%d)!", strerror(errno), (int)errno);
+}
+
+io_uring_sqe *IoUring::GetSqe()
+{
+	if (!IsValid())
+		return 0;
+
+	u32 head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+	if (*sqTail + numPending - head > sqMask)
+	{
+		// The queue is full. Pass the queued entries to the kernel to make room.
+		Submit();
+		head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+		if (*sqTail + numPending - head > sqMask)
+			return 0;
+	}
+
+	const u32 index = (*sqTail + numPending) & sqMask;
+	sqArray[index] = index;
+	io_uring_sqe *sqe = &sqes[index];
+	memset(sqe, 0, sizeof(io_uring_sqe));
+	return sqe;
+}
+
+void IoUring::Submit()
+{
+	if (!IsValid())
+		return;
+
+	if (numPending > 0)
+	{
+		__atomic_store_n(sqTail, *sqTail + numPending, __ATOMIC_RELEASE);
+		numPending = 0;
+	}
+
+	// Also pass the entries the kernel did not take on the previous call, if it failed.
+	const u32 toSubmit = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+	if (toSubmit == 0)
+		return;
+
+	int ret = UringEnter(ringFd, toSubmit, 0, 0);
+	if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		KNET_LOG(LogError, "IoUring::Submit: io_uring_enter failed: %s(%d)!", strerror(errno), (int)errno);
+}
+
+bool IoUring::Send(int fd, OverlappedTransferBuffer *buffer, const sockaddr_in *peer)
+{
+	assert(buffer);
+	assert(((uintptr_t)buffer & cReceiveTag) == 0);
+
+	io_uring_sqe *sqe = GetSqe();
+	if (!sqe)
+		return false;
+
+	buffer->iov.iov_base = buffer->buffer.buf;
+	buffer->iov.iov_len = buffer->buffer.len;
+	memset(&buffer->msg, 0, sizeof(buffer->msg));
+	buffer->msg.msg_iov = &buffer->iov;
+	buffer->msg.msg_iovlen = 1;
+	if (peer)
+	{
+		buffer->to = *peer;
+		buffer->msg.msg_name = &buffer->to;
+		buffer->msg.msg_namelen = sizeof(buffer->to);
+	}
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (u64)(uintptr_t)&buffer->msg;
+	sqe->len = 1;
+	sqe->user_data = (u64)(uintptr_t)buffer;
+	++numPending;
+	++numInFlight;
+	return true;
+}
+
+bool IoUring::StartReceive(Socket *socket, IDatagramReceiver *receiver)
+{
+	assert(socket);
+	assert(receiver);
+	if (!SupportsMultishotReceive())
+		return false;
+	if (IsReceiving(socket))
+		return true;
+
+	Receive *receive = new Receive;
+	receive->socket = socket;
+	receive->fd = socket->GetSocketHandle();
+	receive->receiver = receiver;
+	receive->stopped = false;
+	memset(&receive->msg, 0, sizeof(receive->msg));
+	receive->msg.msg_namelen = sizeof(sockaddr_in);
+	// Leave room for the drop count of the socket (SO_RXQ_OVFL), which the kernel passes along when it has dropped datagrams,
+	// for the arrival time of the datagram (SO_TIMESTAMPNS) and for its TOS byte (IP_RECVTOS).
+	receive->msg.msg_controllen = CMSG_SPACE(sizeof(u32)) + CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(int));
+
+	if (!ArmReceive(receive))
+	{
+		delete receive;
+		return false;
+	}
+	receives.push_back(receive);
+	return true;
+}
+
+bool IoUring::ArmReceive(Receive *receive)
+{
+	assert(((uintptr_t)receive & cReceiveTag) == 0);
+
+	io_uring_sqe *sqe = GetSqe();
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = receive->fd;
+	sqe->addr = (u64)(uintptr_t)&receive->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_TRUNC;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = cReceiveBufferGroup;
+	sqe->user_data = (u64)(uintptr_t)receive | cReceiveTag;
+	++numPending;
+	++numInFlight;
+	return true;
+}
+
+void IoUring::StopReceive(Socket *socket)
+{
+	for(size_t i = 0; i < receives.size(); ++i)
+	{
+		Receive *receive = receives[i];
+		if (receive->socket != socket || receive->stopped)
+			continue;
+
+		receive->stopped = true;
+		io_uring_sqe *sqe = GetSqe();
+		if (!sqe)
+		{
+			KNET_LOG(LogError, "IoUring::StopReceive: The submission queue is full! Cannot cancel the receive of socket %p.", socket);
+			continue;
+		}
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (u64)(uintptr_t)receive | cReceiveTag;
+		sqe->user_data = cCancelUserData;
+		++numPending;
+		++numInFlight;
+	}
+}
+
+bool IoUring::IsReceiving(const Socket *socket) const
+{
+	for(size_t i = 0; i < receives.size(); ++i)
+		if (receives[i]->socket == socket && !receives[i]->stopped)
+			return true;
+	return false;
+}
+
+void IoUring::RecycleBuffer(u16 bufferId)
+{
+	io_uring_buf *buf = &bufferRing->bufs[bufferRingTail & (cNumReceiveBuffers - 1)];
+	buf->addr = (u64)(uintptr_t)(receiveBuffers + (u32)bufferId * cReceiveBufferSize);
+	buf->len = cReceiveBufferSize;
+	buf->bid = bufferId;
+	++bufferRingTail;
+	__atomic_store_n(&bufferRing->tail, bufferRingTail, __ATOMIC_RELEASE);
+}
+
+int IoUring::ProcessCompletions()
+{
+	if (!IsValid())
+		return 0;
+
+	int numProcessed = 0;
+	for(;;)
+	{
+		u32 head = *cqHead;
+		const u32 tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		for(; head != tail; ++head)
+		{
+			const io_uring_cqe cqe = cqes[head & cqMask];
+			++numProcessed;
+
+			if (cqe.user_data == cCancelUserData)
+				--numInFlight;
+			else if ((cqe.user_data & cReceiveTag) != 0)
+				ReceiveCompleted((Receive*)(uintptr_t)(cqe.user_data & ~cReceiveTag), cqe);
+			else
+			{
+				if (cqe.res < 0)
+				{
+					if (cqe.res == -EAGAIN)
+						KNET_LOG(LogVerbose, "IoUring::ProcessCompletions: The socket send buffer is full. Dropped a datagram.");
+					else
+						KNET_LOG(LogError, "IoUring::ProcessCompletions: Sending a datagram failed: %s(%d)!", strerror(-cqe.res), (int)-cqe.res);
+				}
+				DeleteOverlappedTransferBuffer((OverlappedTransferBuffer*)(uintptr_t)cqe.user_data);
+				--numInFlight;
+			}
+		}
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	// Rearming the receives that ran out of buffers queued new entries.
+	if (numPending > 0)
+		Submit();
+	return numProcessed;
+}
+
+void IoUring::ReceiveCompleted(Receive *receive, const io_uring_cqe &cqe)
+{
+	if ((cqe.flags & IORING_CQE_F_BUFFER) != 0)
+	{
+		const u16 bufferId = (u16)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		const char *buf = receiveBuffers + (u32)bufferId * cReceiveBufferSize;
+		const io_uring_recvmsg_out *out = (const io_uring_recvmsg_out*)buf;
+		const size_t headerSize = sizeof(io_uring_recvmsg_out) + receive->msg.msg_namelen + receive->msg.msg_controllen;
+
+		if (cqe.res > 0 && !receive->stopped && (size_t)cqe.res >= headerSize)
+		{
+			if ((out->flags & MSG_TRUNC) != 0 || out->payloadlen > (u32)cqe.res - headerSize)
+				KNET_LOG(LogError, "IoUring::ReceiveCompleted: Discarding an over-sized datagram (%d bytes)!", (int)out->payloadlen);
+			else if (out->namelen >= sizeof(sockaddr_in) && out->payloadlen > 0)
+			{
+				sockaddr_in from;
+				memcpy(&from, buf + sizeof(io_uring_recvmsg_out), sizeof(from));
+				tick_t receiveTick = 0;
+				u8 ecn = ECNNotECT;
+#ifdef SO_RXQ_OVFL
+				// The control messages follow the source address. Walk them through a msghdr that points to them.
+				msghdr control;
+				memset(&control, 0, sizeof(control));
+				control.msg_control = (void*)(buf + sizeof(io_uring_recvmsg_out) + receive->msg.msg_namelen);
+				control.msg_controllen = std::min<size_t>(out->controllen, receive->msg.msg_controllen);
+				for(cmsghdr *cmsg = CMSG_FIRSTHDR(&control); cmsg; cmsg = CMSG_NXTHDR(&control, cmsg))
+				{
+					if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+					{
+						u32 drops;
+						memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+						receive->socket->SetReceiveQueueDrops(drops);
+					}
+#ifdef SCM_TIMESTAMPNS
+					if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+					{
+						timespec stamp;
+						memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+						receiveTick = Clock::TickFromRealTime((unsigned long long)stamp.tv_sec, (unsigned long)stamp.tv_nsec);
+					}
+#endif
+#ifdef IP_RECVTOS
+					if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS)
+						ecn = (u8)(*(const unsigned char*)CMSG_DATA(cmsg) & 3);
+#endif
+				}
+#endif
+				receive->receiver->DatagramReceived(receive->socket, 0, buf + headerSize, out->payloadlen, EndPoint::FromSockAddrIn(from), receiveTick, ecn);
+			}
+		}
+		RecycleBuffer(bufferId);
+	}
+
+	if ((cqe.flags & IORING_CQE_F_MORE) != 0)
+		return; // The receive keeps going.
+
+	// This was the final completion of the receive.
+	--numInFlight;
+	if (!receive->stopped)
+	{
+		if (cqe.res == -ENOBUFS)
+		{
+			// The datagrams came in faster than we processed them, and the pool ran dry. The buffers were handed back above.
+			KNET_LOG(LogVerbose, "IoUring::ReceiveCompleted: Out of receive buffers on socket %p. Restarting the receive.", receive->socket);
+			if (ArmReceive(receive))
+				return;
+		}
+		else
+		{
+			KNET_LOG(LogError, "IoUring::ReceiveCompleted: The receive on socket %p ended with %s(%d)! Falling back to synchronous receives.",
+				receive->socket, strerror(-cqe.res), (int)-cqe.res);
+			receivesFailed = true;
+		}
+	}
+
+	receives.erase(std::find(receives.begin(), receives.end(), receive));
+	delete receive;
+}
+
+} // ~kNet
+
+#endif
@@ -0,0 +1,438 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file UnixEpollEventArray.cpp
+	@brief Implements EventArray using epoll. Used instead of UnixEventArray.cpp when KNET_USE_EPOLL is defined. */
+
+#ifdef KNET_USE_EPOLL
+
+#include <cassert>
+#include <utility>
+
+#include <sys/epoll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "kNet/EventArray.h"
+#include "kNet/Thread.h"
+#include "kNet/NetworkLogging.h"
+
+using namespace std;
+
+namespace kNet
+{
+
+/// Specifies the maximum number of ready descriptors a single epoll_wait call reports back to us.
+static const int cMaxReadyEventsPerWait = 256;
+
+/// Returns true if the given event is backed by a descriptor that is waited on for read-availability.
+static bool IsReadEvent(const Event &e)
+{
+	return e.Type() == EventWaitRead || e.Type() == EventWaitSignal;
+}
+
+/// Returns true if the given event needs to be registered to epoll, i.e. is not a dummy or a null event.
+static bool IsDescriptorEvent(const Event &e)
+{
+	return IsReadEvent(e) || e.Type() == EventWaitWrite;
+}
+
+EventArray::EventArray()
+:numAdded(0),
+epollFd(-1),
+edgeTriggered(false),
+numDescriptorEvents(0),
+readyEvents(cMaxReadyEventsPerWait)
+{
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd == -1)
+		KNET_LOG(LogError, "EventArray::EventArray: epoll_create1 failed: %s(%d)!", strerror(errno), (int)errno);
+}
+
+EventArray::~EventArray()
+{
+	CloseEpoll();
+}
+
+void EventArray::CloseEpoll()
+{
+	if (epollFd != -1)
+	{
+		close(epollFd);
+		epollFd = -1;
+	}
+}
+
+int EventArray::Size() const
+{
+	return numAdded;
+}
+
+void EventArray::Clear()
+{
+	// The registrations to the epoll set are kept: the next Wait() will only update the descriptors
+	// that differ from the previous set of added events.
+	for(size_t i = 0; i < cachedEvents.size(); ++i)
+		if (IsDescriptorEvent(cachedEvents[i]))
+		{
+			DescriptorSlot &slot = Descriptor(cachedEvents[i].fd[0]);
+			slot.readIndex = slot.writeIndex = -1;
+			slot.numReadRefs = slot.numWriteRefs = 0;
+			if (!slot.dirty)
+			{
+				slot.dirty = true;
+				dirtyDescriptors.push_back(cachedEvents[i].fd[0]);
+			}
+		}
+	cachedEvents.clear();
+	numAdded = 0;
+	numDescriptorEvents = 0;
+}
+
+void EventArray::SetEdgeTriggered(bool edgeTriggered_)
+{
+	if (edgeTriggered == edgeTriggered_)
+		return;
+	edgeTriggered = edgeTriggered_;
+	ResetRegistrations(); // The trigger mode is specified per-descriptor, so all registrations need to be redone.
+}
+
+void EventArray::ResetRegistrations()
+{
+	CloseEpoll();
+	pendingDescriptors.clear();
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd == -1)
+		KNET_LOG(LogError, "EventArray::ResetRegistrations: epoll_create1 failed: %s(%d)!", strerror(errno), (int)errno);
+
+	// Nothing is registered to the new epoll set, so mark everything in use for registration at the next wait.
+	for(size_t fd = 0; fd < descriptors.size(); ++fd)
+	{
+		DescriptorSlot &slot = descriptors[fd];
+		slot.registeredEvents = 0;
+		if (!slot.dirty && (slot.numReadRefs > 0 || slot.numWriteRefs > 0))
+		{
+			slot.dirty = true;
+			dirtyDescriptors.push_back((int)fd);
+		}
+	}
+}
+
+EventArray::DescriptorSlot &EventArray::Descriptor(int fd)
+{
+	assert(fd >= 0);
+	if ((size_t)fd >= descriptors.size())
+	{
+		DescriptorSlot emptySlot = { -1, -1, 0, 0, 0, false };
+		descriptors.resize(max<size_t>(fd+1, descriptors.size()*2), emptySlot);
+	}
+	return descriptors[fd];
+}
+
+void EventArray::AddEventReference(const Event &e, int index)
+{
+	if (!IsDescriptorEvent(e))
+		return; // No need to register dummy events to epoll, but they are kept in the cached list to keep the indices matching.
+
+	DescriptorSlot &slot = Descriptor(e.fd[0]);
+	// If the same descriptor is added several times, only the smallest index gets reported.
+	if (IsReadEvent(e))
+	{
+		++slot.numReadRefs;
+		if (slot.readIndex == -1 || index < slot.readIndex)
+			slot.readIndex = index;
+	}
+	else
+	{
+		++slot.numWriteRefs;
+		if (slot.writeIndex == -1 || index < slot.writeIndex)
+			slot.writeIndex = index;
+	}
+	if (!slot.dirty)
+	{
+		slot.dirty = true;
+		dirtyDescriptors.push_back(e.fd[0]);
+	}
+	++numDescriptorEvents;
+}
+
+void EventArray::RemoveEventReference(const Event &e, int index)
+{
+	if (!IsDescriptorEvent(e))
+		return;
+
+	const int fd = e.fd[0];
+	DescriptorSlot &slot = Descriptor(fd);
+	const bool isRead = IsReadEvent(e);
+	int &numRefs = isRead ? slot.numReadRefs : slot.numWriteRefs;
+	int &slotIndex = isRead ? slot.readIndex : slot.writeIndex;
+	assert(numRefs > 0);
+	--numRefs;
+	if (slotIndex == index)
+	{
+		slotIndex = -1;
+		// Rare: the same descriptor is waited by some other index as well. Find the next smallest one.
+		if (numRefs > 0)
+			for(size_t i = 0; i < cachedEvents.size(); ++i)
+				if ((int)i != index && IsDescriptorEvent(cachedEvents[i]) && cachedEvents[i].fd[0] == fd && IsReadEvent(cachedEvents[i]) == isRead)
+				{
+					slotIndex = (int)i;
+					break;
+				}
+	}
+	if (!slot.dirty)
+	{
+		slot.dirty = true;
+		dirtyDescriptors.push_back(fd);
+	}
+	--numDescriptorEvents;
+}
+
+void EventArray::AddEvent(const Event &e)
+{
+	if (e.IsNull())
+	{
+		KNET_LOG(LogError, "Error: Tried to add a null event to event array at index %d!", numAdded);
+		return;
+	}
+	if (e.Type() == EventWaitInvalid)
+	{
+		KNET_LOG(LogError, "Error: Tried to add an invalid event to a wait event array!");
+		return;
+	}
+
+	cachedEvents.push_back(e);
+	AddEventReference(e, numAdded);
+	++numAdded;
+}
+
+void EventArray::SetEvent(int index, const Event &e)
+{
+	assert(index >= 0 && index < numAdded);
+	if (index < 0 || index >= numAdded)
+	{
+		KNET_LOG(LogError, "EventArray::SetEvent: Index %d out of bounds! (%d events in the array)", index, numAdded);
+		return;
+	}
+	if (e.IsNull() || e.Type() == EventWaitInvalid)
+	{
+		KNET_LOG(LogError, "EventArray::SetEvent: Tried to set a null or an invalid event to index %d!", index);
+		return;
+	}
+
+	Event &old = cachedEvents[index];
+	if (old.Type() == e.Type() && old.fd[0] == e.fd[0])
+		return; // The same event is already waited on at this index.
+
+	RemoveEventReference(old, index);
+	old = e;
+	AddEventReference(e, index);
+}
+
+void EventArray::SyncRegistrations()
+{
+	const u32 triggerMode = edgeTriggered ? (u32)EPOLLET : 0;
+
+	for(size_t i = 0; i < dirtyDescriptors.size(); ++i)
+	{
+		const int fd = dirtyDescriptors[i];
+		DescriptorSlot &slot = descriptors[fd];
+		slot.dirty = false;
+
+		u32 wantedEvents = (slot.readIndex != -1 ? (u32)EPOLLIN : 0) | (slot.writeIndex != -1 ? (u32)EPOLLOUT : 0);
+		if (wantedEvents != 0)
+			wantedEvents |= triggerMode;
+		if (slot.registeredEvents == wantedEvents)
+			continue;
+
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev)); // A non-null pointer is required for EPOLL_CTL_DEL by kernels older than 2.6.9.
+		ev.events = wantedEvents;
+		ev.data.fd = fd;
+
+		if (wantedEvents == 0) // This descriptor is not waited on any more.
+		{
+			if (epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, &ev) == -1 && errno != ENOENT && errno != EBADF)
+				KNET_LOG(LogError, "EventArray::SyncRegistrations: epoll_ctl(EPOLL_CTL_DEL) failed for descriptor %d: %s(%d)!", fd, strerror(errno), (int)errno);
+			slot.registeredEvents = 0;
+			continue;
+		}
+
+		int ret = epoll_ctl(epollFd, slot.registeredEvents == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+		// Our bookkeeping can disagree with the kernel if a descriptor was closed (which implicitly unregisters it) and its
+		// number got reused. Retry with the other operation in that case.
+		if (ret == -1 && errno == EEXIST)
+			ret = epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+		else if (ret == -1 && errno == ENOENT)
+			ret = epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+
+		if (ret == -1)
+		{
+			KNET_LOG(LogError, "EventArray::SyncRegistrations: epoll_ctl failed for descriptor %d: %s(%d)!", fd, strerror(errno), (int)errno);
+			slot.registeredEvents = 0;
+		}
+		else
+			slot.registeredEvents = wantedEvents;
+	}
+	dirtyDescriptors.clear();
+}
+
+int EventArray::EventIndexForDescriptor(int fd, u32 events) const
+{
+	if (fd < 0 || (size_t)fd >= descriptors.size())
+		return -1;
+	const DescriptorSlot &slot = descriptors[fd];
+
+	// Like select(), treat errors and hangups as both read- and write-readiness, so that the owner gets to observe the condition.
+	const u32 errorEvents = (u32)(EPOLLERR | EPOLLHUP);
+	int index = -1;
+	if ((events & ((u32)EPOLLIN | errorEvents)) != 0 && slot.readIndex != -1)
+		index = slot.readIndex;
+	if ((events & ((u32)EPOLLOUT | errorEvents)) != 0 && slot.writeIndex != -1 && (index == -1 || slot.writeIndex < index))
+		index = slot.writeIndex;
+	return index;
+}
+
+int EventArray::EpollWait(int msecs)
+{
+	if (numAdded == 0)
+	{
+		KNET_LOG(LogError, "EventArray::Wait failed! Tried to wait for an empty array of events! (EventArray=0x%p)", this);
+		return -1;
+	}
+
+	if (epollFd == -1)
+	{
+		KNET_LOG(LogError, "EventArray::Wait failed! The epoll set of this EventArray (0x%p) is not initialized!", this);
+		return -1;
+	}
+
+	SyncRegistrations();
+
+	// If we are waiting on a set of dummy events only, which are always false, sleep for a small arbitrary
+	// duration and return a timeout. Note that it's a bad idea to wait for the full msecs delay, since
+	// it can be very large, and would effectively stall this thread.
+	if (numDescriptorEvents == 0)
+	{
+		if (msecs > 0)
+			Thread::Sleep(min(msecs, 10)); // Arbitrary max sleep 10 msecs.
+		return 0;
+	}
+
+	// In edge-triggered mode, the events reported earlier but not yet returned need to be served first, so
+	// just poll for new readiness without blocking.
+	const int timeout = (edgeTriggered && !pendingDescriptors.empty()) ? 0 : max(msecs, 0);
+	int ret = epoll_wait(epollFd, &readyEvents[0], (int)readyEvents.size(), timeout); // http://linux.die.net/man/2/epoll_wait
+	if (ret == -1)
+	{
+		if (errno == EINTR)
+			return 0; // Interrupted by a signal, treat as a timeout.
+		KNET_LOG(LogError, "EventArray::Wait: epoll_wait() failed on an array of %d events: %s(%d)",
+			numAdded, strerror(errno), (int)errno);
+		return -1;
+	}
+
+	if (edgeTriggered)
+	{
+		// The kernel will not report these again until their state changes, so store them all.
+		pendingDescriptors.insert(pendingDescriptors.end(), &readyEvents[0], &readyEvents[0] + ret);
+	}
+	return ret;
+}
+
+int EventArray::Wait(int msecs)
+{
+	int ret = EpollWait(msecs);
+	if (ret < 0)
+		return WaitFailed;
+
+	if (!edgeTriggered)
+	{
+		// Return the ready event with the smallest index, like the select()-based implementation does.
+		int bestIndex = -1;
+		for(int i = 0; i < ret; ++i)
+		{
+			int index = EventIndexForDescriptor(readyEvents[i].data.fd, readyEvents[i].events);
+			if (index != -1 && (bestIndex == -1 || index < bestIndex))
+				bestIndex = index;
+		}
+		return (bestIndex != -1) ? bestIndex : WaitTimedOut;
+	}
+
+	int bestIndex = -1;
+	size_t bestPending = 0;
+	for(size_t i = 0; i < pendingDescriptors.size(); ++i)
+	{
+		int index = EventIndexForDescriptor(pendingDescriptors[i].data.fd, pendingDescriptors[i].events);
+		if (index == -1) // This descriptor is not waited on any more, or the interest in it was already served.
+		{
+			pendingDescriptors.erase(pendingDescriptors.begin() + i);
+			--i;
+			continue;
+		}
+		if (bestIndex == -1 || index < bestIndex)
+		{
+			bestIndex = index;
+			bestPending = i;
+		}
+	}
+	if (bestIndex == -1)
+		return WaitTimedOut;
+
+	// Consume the part of the readiness we are reporting now, and leave the rest in the pending list.
+	epoll_event &served = pendingDescriptors[bestPending];
+	const DescriptorSlot &slot = descriptors[served.data.fd];
+	if (bestIndex == slot.readIndex)
+		served.events &= ~(u32)EPOLLIN;
+	else
+		served.events &= ~(u32)EPOLLOUT;
+	if ((served.events & (EPOLLIN | EPOLLOUT)) == 0 || (slot.readIndex == -1 || slot.writeIndex == -1))
+		pendingDescriptors.erase(pendingDescriptors.begin() + bestPending);
+
+	return bestIndex;
+}
+
+int EventArray::Wait(int msecs, std::vector<int> &signalledIndices)
+{
+	signalledIndices.clear();
+
+	int ret = EpollWait(msecs);
+	if (ret < 0)
+		return WaitFailed;
+
+	const epoll_event *ready = edgeTriggered ? (pendingDescriptors.empty() ? 0 : &pendingDescriptors[0]) : &readyEvents[0];
+	const size_t numReady = edgeTriggered ? pendingDescriptors.size() : (size_t)ret;
+	const u32 errorEvents = (u32)(EPOLLERR | EPOLLHUP);
+	for(size_t i = 0; i < numReady; ++i)
+	{
+		const int fd = ready[i].data.fd;
+		if (fd < 0 || (size_t)fd >= descriptors.size())
+			continue;
+		const DescriptorSlot &slot = descriptors[fd];
+		if ((ready[i].events & ((u32)EPOLLIN | errorEvents)) != 0 && slot.readIndex != -1)
+			signalledIndices.push_back(slot.readIndex);
+		if ((ready[i].events & ((u32)EPOLLOUT | errorEvents)) != 0 && slot.writeIndex != -1)
+			signalledIndices.push_back(slot.writeIndex);
+	}
+	// All the pending readiness was now reported to the caller.
+	pendingDescriptors.clear();
+
+	return signalledIndices.empty() ? WaitTimedOut : (int)signalledIndices.size();
+}
+
+} // ~kNet
+
+#endif // ~KNET_USE_EPOLL
@@ -19,13 +19,22 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+/// On Linux, signal events are implemented using an eventfd instead of a pipe. It only takes a single descriptor, and both
+/// Set() and Reset() are a single system call. The eventfd is in semaphore mode, so each read takes back exactly one write.
+#define KNET_USE_EVENTFD
+#endif
+
 #include "kNet/Event.h"
 #include "kNet/Types.h"
+#include "kNet/Atomics.h"
 #include "kNet/NetworkLogging.h"
 
 namespace kNet
@@ -35,11 +44,12 @@ Event::Event()
 {
 	fd[0] = -1;
 	fd[1] = -1;
+	state = 0;
 	type = EventWaitInvalid;
 }
 
 Event::Event(int /*SOCKET*/ fd_, EventWaitType eventType)
-:type(eventType)
+:type(eventType), state(0)
 {
 	fd[0] = fd_;
 	fd[1] = -1; // When creating an Event off a SOCKET, this Event is never Set manually, so leave the write descriptor null.
@@ -57,10 +67,19 @@ Event CreateNewEvent(EventWaitType type)
 void Event::Create(EventWaitType type_)
 {
 	type = type_;
+	state = 0;
 	assert(type != EventWaitInvalid);
 
 	if (type == EventWaitSignal) // For signal events, we need to create a pipe.
 	{
+#ifdef KNET_USE_EVENTFD
+		fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC | EFD_SEMAPHORE); // Both reading and writing use the same descriptor.
+		if (fd[0] == -1)
+		{
+			KNET_LOG(LogError, "Error in Event::Create: eventfd failed: %s(%d)!", strerror(errno), errno);
+			return;
+		}
+#else
 		if (pipe(fd) == -1)
 		{
 			KNET_LOG(LogError, "Error in Event::Create: %s(%d)!", strerror(errno), errno);
@@ -79,6 +98,9 @@ void Event::Create(EventWaitType type_)
 			KNET_LOG(LogError, "Event::Create: fcntl failed to set fd[1] in nonblocking mode: %s(%d)", strerror(errno), errno);
 			return;
 		}
+#endif
+		state = new long;
+		*state = 0;
 	}
 
 	///\todo Return success or failure.
@@ -93,9 +115,13 @@ void Event::Close()
 	}
 	if (type == EventWaitSignal && fd[1] != -1)
 	{
+#ifndef KNET_USE_EVENTFD
 		close(fd[1]);
+#endif
 		fd[1] = -1;
 	}
+	delete state;
+	state = 0;
 	type = EventWaitInvalid;
 }
 
@@ -117,16 +143,43 @@ void Event::Reset()
 
 	if (type == EventWaitSignal)
 	{
-		// Exhaust the pipe: read bytes off of it until there is nothing to read. This will cause select()ing on the
-		// pipe to not trigger on read-availability. (The code in this class should maintain that the pipe never contains
-		// more than one unread byte, but still better to loop here to be sure)
-		u8 val = 0;
-		int ret = 0;
-		while(ret != -1)
+		if (!state)
+			return;
+		// Only the Reset() that clears the flag takes the write of the matching Set() back off the descriptor. A raise
+		// that is in progress belongs to its Set(), which either finishes it after its write, or takes it back if the
+		// write fails. Wait for that, which takes as long as the write itself. The descriptor turns readable as soon as
+		// the write is done, so the poll returns right away then.
+		for(;;)
 		{
-			ret = read(fd[0], &val, sizeof(val));
-			if (ret == -1 && errno != EAGAIN)
-				KNET_LOG(LogError, "Event::Reset() read() failed: %s(%d)!", strerror(errno), (int)errno);
+			const long s = *state;
+			if (s == EventCleared)
+				return;
+			if (s == EventRaised && CmpXChgLong(state, EventCleared, EventRaised))
+				break;
+			if (s == EventRaising)
+			{
+				pollfd pfd;
+				pfd.fd = fd[0];
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				poll(&pfd, 1, 1);
+			}
+		}
+		for(;;)
+		{
+#ifdef KNET_USE_EVENTFD
+			eventfd_t val = 0;
+			int ret = eventfd_read(fd[0], &val);
+#else
+			u8 val = 0;
+			int ret = read(fd[0], &val, sizeof(val));
+#endif
+			if (ret != -1 || errno != EINTR)
+			{
+				if (ret == -1)
+					KNET_LOG(LogError, "Event::Reset() read() failed: %s(%d)!", strerror(errno), (int)errno);
+				break;
+			}
 		}
 	}
 	else
@@ -145,25 +198,39 @@ void Event::Set()
 		KNET_LOG(LogError, "Event::Set() failed! Tried to set an event that is of type %d (should have been of type EventWaitSignal)", (int)type);
 		return;
 	}
-	if (fd[1] == -1)
+	if (fd[1] == -1 || !state)
 	{
 		KNET_LOG(LogError, "Event::Set() failed! Tried to set a read-only Event! (This event is probably a Socket read descriptor");
 		return;
 	}
 
-	// Read one byte off from the pipe. This will fail or succeed and we don't really care, the important thing 
-	// is that Event::Set() will not increase the number of bytes in the pipe.
-	u8 val = 1;
-	read(fd[0], &val, sizeof(val));
+	// Setting an event that is already set is only a memory operation. The compare-and-swap is also a full barrier, so
+	// the data the setter published before this is visible to the thread that sees the flag, or clears it in Reset().
+	if (!CmpXChgLong(state, EventRaising, EventCleared))
+		return;
+
+	// This Set() raised the flag, so it writes the descriptor, which makes it readable for the threads that block on it.
+	// The write is taken back off by the Reset() that clears the flag, which waits until this Set() has finished the raise.
+	int ret;
+	do
+	{
+#ifdef KNET_USE_EVENTFD
+		ret = eventfd_write(fd[1], 1);
+#else
+		u8 val = 1; // It doesn't really matter what value we write here, but by convention we always write (and expect to read back) a single '1'.
+		ret = write(fd[1], &val, sizeof(val));
+#endif
+	} while(ret == -1 && errno == EINTR);
 
-	// Now that we removed one byte off the pipe (if there was one), we are allowed to add one in.
-	val = 1; // It doesn't really matter what value we write here, but by convention we always write (and expect to read back) a single '1'.
-	int ret = write(fd[1], &val, sizeof(val));
 	if (ret == -1)
 	{
 		KNET_LOG(LogError, "Event::Set() write() failed: %s(%d)!", strerror(errno), (int)errno);
+		// Nothing was written, so take the raise back. No other Set() or Reset() changes the flag while it is raising, so
+		// the exchanges below always succeed. They are used for their barrier.
+		CmpXChgLong(state, EventCleared, EventRaising);
 		return;
 	}
+	CmpXChgLong(state, EventRaised, EventRaising);
 }
 
 bool Event::Test() const
@@ -171,6 +238,9 @@ bool Event::Test() const
 	if (IsNull() || type == EventWaitDummy)
 		return false;
 
+	if (type == EventWaitSignal && state)
+		return *state != 0;
+
 	return Wait(0);
 }
 
@@ -180,31 +250,34 @@ bool Event::Wait(unsigned long msecs) const
 	if (IsNull() || type == EventWaitDummy)
 		return false;
 
-	fd_set fds;
-	timeval tv;
-	tv.tv_sec = msecs / 1000;
-	tv.tv_usec = (msecs - tv.tv_sec * 1000) * 1000;
+	if (type == EventWaitSignal && state && (*state != 0 || msecs == 0))
+		return *state != 0;
 
-	FD_ZERO(&fds);
-	FD_SET(fd[0], &fds);
+	// poll() is used instead of select(), since a process with many sockets has descriptors above FD_SETSIZE, and FD_SET()
+	// on those would write past the end of the fd_set.
+	pollfd pfd;
+	pfd.fd = fd[0];
+	pfd.revents = 0;
 	if (type == EventWaitSignal || type == EventWaitRead) // These both use fd[0] and descriptor read-ready as signal, so are processed using the same codepath.
 	{
 		// Wait on a read state.
 		// "The file descriptor is readable if the counter has a value greater than 0."
-		int ret = select(fd[0]+1, &fds, NULL, NULL, &tv); // http://linux.die.net/man/2/select
+		pfd.events = POLLIN;
+		int ret = poll(&pfd, 1, (int)msecs); // http://linux.die.net/man/2/poll
 		if (ret == -1)
 		{
-			KNET_LOG(LogError, "Event::Wait: select() failed on a pipe: %s(%d)!", strerror(errno), (int)errno);
+			KNET_LOG(LogError, "Event::Wait: poll() failed on a pipe: %s(%d)!", strerror(errno), (int)errno);
 			return false;
 		}
 		return ret != 0;
 	}
 	else if (type == EventWaitWrite)
 	{
-		int ret = select(fd[0]+1, NULL, &fds, NULL, &tv);
+		pfd.events = POLLOUT;
+		int ret = poll(&pfd, 1, (int)msecs);
 		if (ret == -1)
 		{
-			KNET_LOG(LogError, "Event::Wait: select() failed for Event of type EventWaitWrite: %s(%d)!", strerror(errno), (int)errno);
+			KNET_LOG(LogError, "Event::Wait: poll() failed for Event of type EventWaitWrite: %s(%d)!", strerror(errno), (int)errno);
 			return false;
 		}
 		return ret != 0;
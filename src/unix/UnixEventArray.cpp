@@ -13,7 +13,9 @@
    limitations under the License. */
 
 /** @file UnixEventArray.cpp
-	@brief */
+	@brief Implements EventArray using select(). When KNET_USE_EPOLL is defined, UnixEpollEventArray.cpp is used instead. */
+
+#ifndef KNET_USE_EPOLL
 
 #include <cassert>
 #include <utility>
@@ -38,6 +40,20 @@ EventArray::EventArray()
 	Clear();
 }
 
+EventArray::~EventArray()
+{
+}
+
+void EventArray::SetEdgeTriggered(bool /*edgeTriggered*/)
+{
+	// select() is always level-triggered.
+}
+
+void EventArray::ResetRegistrations()
+{
+	// The fd_sets are rebuilt at each Clear(), so there is nothing to reset.
+}
+
 int EventArray::Size() const
 {
 	return cachedEvents.size();
@@ -50,22 +66,13 @@ void EventArray::Clear()
 	nfds = -1;
 	numAdded = 0;
 	cachedEvents.clear();
+	fdSetsDirty = false;
 }
 
-void EventArray::AddEvent(const Event &e)
+void EventArray::AddToFdSets(const Event &e)
 {
-	if (e.IsNull())
-	{
-		KNET_LOG(LogError, "Error: Tried to add a null event to event array at index %d!", numAdded);
-		return;
-	}
-	assert(numAdded < maxEvents);
-
 	switch(e.Type())
 	{
-	case EventWaitInvalid:
-		KNET_LOG(LogError, "Error: Tried to add an invalid event to a wait event array!");
-		return;
 	case EventWaitRead:
 	case EventWaitSignal:
 		FD_SET(e.fd[0], &readfds);
@@ -79,14 +86,45 @@ void EventArray::AddEvent(const Event &e)
 	default:
 		break;
 	}
+}
+
+void EventArray::AddEvent(const Event &e)
+{
+	if (e.IsNull())
+	{
+		KNET_LOG(LogError, "Error: Tried to add a null event to event array at index %d!", numAdded);
+		return;
+	}
+	assert(numAdded < maxEvents);
+
+	if (e.Type() == EventWaitInvalid)
+	{
+		KNET_LOG(LogError, "Error: Tried to add an invalid event to a wait event array!");
+		return;
+	}
 
 	// No need to add dummy events to select(), but need to add them to the cached events list to keep
 	// the indices matching.
+	AddToFdSets(e);
 	cachedEvents.push_back(e);
 	++numAdded;
 }
 
-int EventArray::Wait(int msecs)
+void EventArray::SetEvent(int index, const Event &e)
+{
+	assert(index >= 0 && index < numAdded);
+	if (index < 0 || index >= numAdded || e.IsNull() || e.Type() == EventWaitInvalid)
+	{
+		KNET_LOG(LogError, "EventArray::SetEvent: Invalid index %d or event! (%d events in the array)", index, numAdded);
+		return;
+	}
+
+	cachedEvents[index] = e;
+	// The same descriptor may be referenced at other indices as well, so the fd_sets can't be updated in place.
+	fdSetsDirty = true;
+}
+
+int EventArray::Select(int msecs, fd_set &readResult, fd_set &writeResult)
 {
 	if (numAdded == 0)
 	{
@@ -94,6 +132,16 @@ int EventArray::Wait(int msecs)
 		return WaitFailed;
 	}
 
+	if (fdSetsDirty)
+	{
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		nfds = -1;
+		for(size_t i = 0; i < cachedEvents.size(); ++i)
+			AddToFdSets(cachedEvents[i]);
+		fdSetsDirty = false;
+	}
+
 	// If we have added some number of events to the event array, but nfds == -1, it means we are waiting on a set
 	// of dummy events, which are always false. In that case, sleep for a small arbitrary duration and return a timeout.
 	// Note that it's a bad idea to wait for the full msecs delay, since it can be very large, and would effectively 
@@ -108,7 +156,10 @@ int EventArray::Wait(int msecs)
 	tv.tv_sec = msecs / 1000;
 	tv.tv_usec = (msecs - tv.tv_sec * 1000) * 1000;
 
-	int ret = select(nfds, &readfds, &writefds, NULL, &tv); // http://linux.die.net/man/2/select
+	// select() overwrites the sets it is passed, so work on copies to keep the added events for the next wait.
+	readResult = readfds;
+	writeResult = writefds;
+	int ret = select(nfds, &readResult, &writeResult, NULL, &tv); // http://linux.die.net/man/2/select
 	if (ret == -1)
 	{
 		KNET_LOG(LogError, "EventArray::Wait(%d, %p, %p, NULL, {%d, %d}: select() failed on an array of %d events: %s(%d)", 
@@ -127,24 +178,61 @@ int EventArray::Wait(int msecs)
 		KNET_LOG(LogError, "EventArray::Wait: select() returned a negative value, which it shouldn't!");
 		return WaitFailed;
 	}
+	return ret;
+}
+
+bool EventArray::IsSignalled(const Event &e, const fd_set &readResult, const fd_set &writeResult) const
+{
+	switch(e.Type())
+	{
+	case EventWaitRead:
+	case EventWaitSignal:
+		return FD_ISSET(e.fd[0], &readResult) != 0;
+	case EventWaitWrite:
+		return FD_ISSET(e.fd[0], &writeResult) != 0;
+	default:
+		return false; // The dummy events are skipped over.
+	}
+}
 
-	for(int i = 0; i < cachedEvents.size(); ++i)
-		switch(cachedEvents[i].Type())
-		{
-		case EventWaitRead:
-		case EventWaitSignal:
-			if (FD_ISSET(cachedEvents[i].fd[0], &readfds))
-				return i;
-			break;
-		case EventWaitWrite:
-			if (FD_ISSET(cachedEvents[i].fd[0], &writefds))
-				return i;
-		default:
-			break; // The dummy events are skipped over.
-		}
+int EventArray::Wait(int msecs)
+{
+	fd_set readResult;
+	fd_set writeResult;
+	int ret = Select(msecs, readResult, writeResult);
+	if (ret <= 0)
+		return ret;
+
+	for(int i = 0; i < (int)cachedEvents.size(); ++i)
+		if (IsSignalled(cachedEvents[i], readResult, writeResult))
+			return i;
 
 	KNET_LOG(LogError, "EventArray::Wait error! No events were set, but select() returned a positive value!");
 	return WaitFailed;
 }
 
+int EventArray::Wait(int msecs, std::vector<int> &signalledIndices)
+{
+	signalledIndices.clear();
+
+	fd_set readResult;
+	fd_set writeResult;
+	int ret = Select(msecs, readResult, writeResult);
+	if (ret <= 0)
+		return ret;
+
+	for(int i = 0; i < (int)cachedEvents.size(); ++i)
+		if (IsSignalled(cachedEvents[i], readResult, writeResult))
+			signalledIndices.push_back(i);
+
+	if (signalledIndices.empty())
+	{
+		KNET_LOG(LogError, "EventArray::Wait error! No events were set, but select() returned a positive value!");
+		return WaitFailed;
+	}
+	return (int)signalledIndices.size();
+}
+
 } // ~kNet
+
+#endif // ~KNET_USE_EPOLL
@@ -20,6 +20,9 @@
 #include <cassert>
 #include <exception>
 
+#include <unistd.h>
+#include <sched.h>
+
 #include "kNet/Thread.h"
 #include "kNet/NetworkLogging.h"
 #include "kNet/Clock.h"
@@ -61,13 +64,14 @@ void Thread::Stop()
 		threadHoldEvent.Close();
 		threadHoldEventAcked.Close();
 		threadResumeEvent.Close();
+	threadInterruptEvent.Close();
 
 		delete invoker;
 		invoker = 0;
 		return;
 	}
 
-	kNet::Clock::Sleep(10);
+	Interrupt();
 	assert(thread);
 
 	/// \todo Do not block indefinitely while waiting for the thread to terminate
@@ -82,6 +86,7 @@ void Thread::Stop()
 	threadHoldEvent.Close();
 	threadHoldEventAcked.Close();
 	threadResumeEvent.Close();
+	threadInterruptEvent.Close();
 }
 
 void* ThreadEntryPoint(void* data)
@@ -130,6 +135,7 @@ void Thread::StartThread()
 	threadHoldEvent = CreateNewEvent(EventWaitSignal);
 	threadHoldEventAcked = CreateNewEvent(EventWaitSignal);
 	threadResumeEvent = CreateNewEvent(EventWaitSignal);
+	threadInterruptEvent = CreateNewEvent(EventWaitSignal);
 
 	threadEnabled = true;
 	pthread_attr_t type;
@@ -149,6 +155,17 @@ void Thread::Sleep(int msecs)
 	Clock::Sleep(msecs);
 }
 
+void Thread::YieldTimeSlice()
+{
+	sched_yield();
+}
+
+int Thread::NumHardwareThreads()
+{
+	long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	return (numThreads > 0) ? (int)numThreads : 1;
+}
+
 ThreadId Thread::Id()
 {
 	return thread;
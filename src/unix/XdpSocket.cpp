@@ -0,0 +1,822 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file XdpSocket.cpp
+	@brief Implements the AF_XDP datagram transfers of a worker thread, and the XDP program that steers the datagrams to them. */
+
+#ifdef KNET_USE_AF_XDP
+
+#include <cassert>
+#include <cstring>
+#include <string>
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "kNet/unix/XdpSocket.h"
+#include "kNet/IDatagramReceiver.h"
+#include "kNet/Socket.h"
+#include "kNet/EndPoint.h"
+#include "kNet/Lockable.h"
+#include "kNet/NetworkLogging.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+namespace kNet
+{
+
+/// The size of each frame of the UMEM. Must be a power of two, so that the frame of an address can be found by masking.
+static const u32 cFrameSize = 2048;
+/// The number of frames that are kept in the fill ring for receiving. This is also the size of the fill and RX rings.
+static const u32 cNumReceiveFrames = 2048;
+/// The number of frames used for sending. This is also the size of the TX and completion rings.
+static const u32 cNumSendFrames = 2048;
+static const u32 cNumFrames = cNumReceiveFrames + cNumSendFrames;
+/// The size of the Ethernet, IPv4 and UDP headers in front of each datagram.
+static const u32 cHeaderBytes = 14 + 20 + 8;
+/// The number of entries in the XSKMAP, which limits the receive queues that can be read.
+static const u32 cMaxQueues = 256;
+/// The number of (queue, port) pairs the XDP program can redirect.
+static const u32 cMaxRedirectedPorts = 1024;
+
+static __thread XdpSocket *threadXdp = 0;
+
+static int Bpf(int cmd, bpf_attr *attr)
+{
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(bpf_attr));
+}
+
+/// The XDP program and the maps attached to a single network interface, shared by the XdpSockets of all the threads that
+/// read a queue of it.
+struct XdpDevice
+{
+	std::string name;
+	int ifindex;
+	u8 mac[6];
+	/// The AF_XDP socket of each receive queue.
+	int xsksMapFd;
+	/// The (queue << 16 | port) pairs whose datagrams are redirected to the socket of the queue.
+	int portsMapFd;
+	int programFd;
+	/// The attachment of the program to the interface. Closing it detaches the program.
+	int linkFd;
+	int refCount;
+
+	/// The addresses learnt from the frames of each client by all the threads, by the IPv4 address of the client.
+	Lockable<std::map<u32, XdpSocket::Neighbor> > neighbors;
+
+	static XdpDevice *Acquire(const char *interfaceName);
+	static void Release(XdpDevice *device);
+
+	bool Attach();
+	void Detach();
+};
+
+/// The devices in use in the process.
+static Lockable<std::vector<XdpDevice*> > devices;
+
+static bpf_insn BpfInsn(u8 code, u8 dst, u8 src, s16 off, s32 imm)
+{
+	bpf_insn insn;
+	memset(&insn, 0, sizeof(insn));
+	insn.code = code;
+	insn.dst_reg = dst;
+	insn.src_reg = src;
+	insn.off = off;
+	insn.imm = imm;
+	return insn;
+}
+
+static int CreateMap(u32 type, u32 maxEntries)
+{
+	bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = sizeof(u32);
+	attr.value_size = sizeof(u32);
+	attr.max_entries = maxEntries;
+	return Bpf(BPF_MAP_CREATE, &attr);
+}
+
+/// Builds the XDP program. It passes an IPv4 UDP datagram to the AF_XDP socket of the queue it arrived on if the (queue, port)
+/// pair of the datagram is in the ports map, and everything else to the network stack. The header checks only let the
+/// datagrams without IP options or fragmentation through, so the frames that reach the sockets have a fixed layout.
+static std::vector<bpf_insn> BuildProgram(int portsMapFd, int xsksMapFd)
+{
+	std::vector<bpf_insn> prog;
+	std::vector<size_t> jumpsToPass;
+
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0)); // r6 = ctx
+	prog.push_back(BpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, 0, 0)); // r2 = ctx->data
+	prog.push_back(BpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, 4, 0)); // r3 = ctx->data_end
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, cHeaderBytes));
+	jumpsToPass.push_back(prog.size());
+	prog.push_back(BpfInsn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0)); // The frame is too short for the headers.
+
+	// The values in the frame are in network byte order, so compare them against constants converted the same way.
+	prog.push_back(BpfInsn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0)); // EtherType
+	jumpsToPass.push_back(prog.size());
+	prog.push_back(BpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, htons(0x0800)));
+	prog.push_back(BpfInsn(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 14, 0)); // IP version and header length
+	jumpsToPass.push_back(prog.size());
+	prog.push_back(BpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0x45));
+	prog.push_back(BpfInsn(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 14 + 9, 0)); // IP protocol
+	jumpsToPass.push_back(prog.size());
+	prog.push_back(BpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, IPPROTO_UDP));
+	prog.push_back(BpfInsn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 14 + 6, 0)); // More fragments flag and fragment offset
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3FFF)));
+	jumpsToPass.push_back(prog.size());
+	prog.push_back(BpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0));
+
+	// key = rx_queue_index << 16 | destination port
+	prog.push_back(BpfInsn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 14 + 20 + 2, 0));
+	prog.push_back(BpfInsn(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16));
+	prog.push_back(BpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_6, 16, 0)); // r7 = ctx->rx_queue_index
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8, BPF_REG_7, 0, 0));
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_8, 0, 0, 16));
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_OR | BPF_X, BPF_REG_8, BPF_REG_5, 0, 0));
+	prog.push_back(BpfInsn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_8, -4, 0));
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0));
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4));
+	prog.push_back(BpfInsn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, portsMapFd));
+	prog.push_back(BpfInsn(0, 0, 0, 0, 0));
+	prog.push_back(BpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+	jumpsToPass.push_back(prog.size());
+	prog.push_back(BpfInsn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0));
+
+	// Redirect to the socket of the queue. If the queue has no socket, the flags make the helper return XDP_PASS.
+	prog.push_back(BpfInsn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xsksMapFd));
+	prog.push_back(BpfInsn(0, 0, 0, 0, 0));
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_7, 0, 0));
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS));
+	prog.push_back(BpfInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+	prog.push_back(BpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+	const size_t pass = prog.size();
+	prog.push_back(BpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS));
+	prog.push_back(BpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+	for(size_t i = 0; i < jumpsToPass.size(); ++i)
+		prog[jumpsToPass[i]].off = (s16)(pass - jumpsToPass[i] - 1);
+	return prog;
+}
+
+XdpDevice *XdpDevice::Acquire(const char *interfaceName)
+{
+	Lockable<std::vector<XdpDevice*> >::LockType lock = devices.Acquire();
+	for(size_t i = 0; i < lock->size(); ++i)
+		if ((*lock)[i]->name == interfaceName)
+		{
+			++(*lock)[i]->refCount;
+			return (*lock)[i];
+		}
+
+	XdpDevice *device = new XdpDevice;
+	device->name = interfaceName;
+	device->ifindex = (int)if_nametoindex(interfaceName);
+	memset(device->mac, 0, sizeof(device->mac));
+	device->xsksMapFd = device->portsMapFd = device->programFd = device->linkFd = -1;
+	device->refCount = 1;
+	if (device->ifindex == 0)
+	{
+		KNET_LOG(LogError, "XdpDevice::Acquire: Unknown network interface \"%s\"!", interfaceName);
+		delete device;
+		return 0;
+	}
+	if (!device->Attach())
+	{
+		device->Detach();
+		delete device;
+		return 0;
+	}
+	lock->push_back(device);
+	return device;
+}
+
+void XdpDevice::Release(XdpDevice *device)
+{
+	Lockable<std::vector<XdpDevice*> >::LockType lock = devices.Acquire();
+	if (--device->refCount > 0)
+		return;
+	for(size_t i = 0; i < lock->size(); ++i)
+		if ((*lock)[i] == device)
+		{
+			lock->erase(lock->begin() + i);
+			break;
+		}
+	device->Detach();
+	delete device;
+}
+
+bool XdpDevice::Attach()
+{
+	// The source address of the frames sent is the address of the interface.
+	int s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
+	if (s == -1 || ioctl(s, SIOCGIFHWADDR, &ifr) != 0)
+	{
+		KNET_LOG(LogError, "XdpDevice::Attach: Could not read the hardware address of %s: %s(%d)!", name.c_str(), strerror(errno), (int)errno);
+		if (s != -1)
+			close(s);
+		return false;
+	}
+	close(s);
+	memcpy(mac, ifr.ifr_hwaddr.sa_data, sizeof(mac));
+
+	xsksMapFd = CreateMap(BPF_MAP_TYPE_XSKMAP, cMaxQueues);
+	portsMapFd = CreateMap(BPF_MAP_TYPE_HASH, cMaxRedirectedPorts);
+	if (xsksMapFd < 0 || portsMapFd < 0)
+	{
+		KNET_LOG(LogError, "XdpDevice::Attach: Creating the maps of the XDP program failed: %s(%d)!", strerror(errno), (int)errno);
+		return false;
+	}
+
+	std::vector<bpf_insn> prog = BuildProgram(portsMapFd, xsksMapFd);
+	static const char license[] = "Apache-2.0";
+	static char verifierLog[4096];
+	bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (u64)(uintptr_t)&prog[0];
+	attr.insn_cnt = (u32)prog.size();
+	attr.license = (u64)(uintptr_t)license;
+	programFd = Bpf(BPF_PROG_LOAD, &attr);
+	if (programFd < 0)
+	{
+		// Load it again with the verifier log to tell why it was rejected.
+		const int error = errno;
+		attr.log_buf = (u64)(uintptr_t)verifierLog;
+		attr.log_size = sizeof(verifierLog);
+		attr.log_level = 1;
+		verifierLog[0] = 0;
+		Bpf(BPF_PROG_LOAD, &attr);
+		KNET_LOG(LogError, "XdpDevice::Attach: Loading the XDP program failed: %s(%d)! %s", strerror(error), error, verifierLog);
+		return false;
+	}
+
+	// Attach the program in the driver if it supports XDP, and otherwise to the generic hook after the driver.
+	const u32 modes[] = { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE };
+	for(size_t i = 0; i < sizeof(modes)/sizeof(modes[0]) && linkFd < 0; ++i)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.link_create.prog_fd = (u32)programFd;
+		attr.link_create.target_ifindex = (u32)ifindex;
+		attr.link_create.attach_type = BPF_XDP;
+		attr.link_create.flags = modes[i];
+		linkFd = Bpf(BPF_LINK_CREATE, &attr);
+	}
+	if (linkFd < 0)
+	{
+		KNET_LOG(LogError, "XdpDevice::Attach: Attaching the XDP program to %s failed: %s(%d)!", name.c_str(), strerror(errno), (int)errno);
+		return false;
+	}
+	KNET_LOG(LogInfo, "XdpDevice::Attach: Attached the XDP program to %s.", name.c_str());
+	return true;
+}
+
+void XdpDevice::Detach()
+{
+	if (linkFd >= 0)
+		close(linkFd);
+	if (programFd >= 0)
+		close(programFd);
+	if (portsMapFd >= 0)
+		close(portsMapFd);
+	if (xsksMapFd >= 0)
+		close(xsksMapFd);
+	linkFd = programFd = portsMapFd = xsksMapFd = -1;
+}
+
+static void MapUpdate(int mapFd, u32 key, u32 value)
+{
+	bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (u32)mapFd;
+	attr.key = (u64)(uintptr_t)&key;
+	attr.value = (u64)(uintptr_t)&value;
+	attr.flags = BPF_ANY;
+	if (Bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0)
+		KNET_LOG(LogError, "XdpSocket: Updating a map of the XDP program failed: %s(%d)!", strerror(errno), (int)errno);
+}
+
+static void MapDelete(int mapFd, u32 key)
+{
+	bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (u32)mapFd;
+	attr.key = (u64)(uintptr_t)&key;
+	if (Bpf(BPF_MAP_DELETE_ELEM, &attr) != 0 && errno != ENOENT)
+		KNET_LOG(LogError, "XdpSocket: Deleting from a map of the XDP program failed: %s(%d)!", strerror(errno), (int)errno);
+}
+
+/// Computes the checksum of an IPv4 header.
+static u16 IPv4HeaderChecksum(const u8 *header)
+{
+	u32 sum = 0;
+	for(int i = 0; i < 20; i += 2)
+		sum += ((u32)header[i] << 8) | header[i+1];
+	while(sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return (u16)~sum;
+}
+
+XdpSocket::XdpSocket()
+:fd(-1),
+queueId(0),
+device(0),
+openFailed(false),
+useNeedWakeup(false),
+umem(0),
+frameBuffers(0),
+numTxQueued(0),
+numTxInFlight(0),
+nextIpId(0),
+numFramesDropped(0)
+{
+	memset(&fillRing, 0, sizeof(fillRing));
+	memset(&completionRing, 0, sizeof(completionRing));
+	memset(&rxRing, 0, sizeof(rxRing));
+	memset(&txRing, 0, sizeof(txRing));
+}
+
+XdpSocket::~XdpSocket()
+{
+	Close();
+}
+
+XdpSocket *XdpSocket::ThreadXdp()
+{
+	return threadXdp;
+}
+
+void XdpSocket::SetThreadXdp(XdpSocket *xdp)
+{
+	threadXdp = xdp;
+}
+
+bool XdpSocket::MapRing(Ring &ring, const xdp_ring_offset &offsets, size_t descSize, u32 numDescs, off_t pageOffset)
+{
+	ring.mapSize = offsets.desc + numDescs * descSize;
+	void *mem = mmap(0, ring.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pageOffset);
+	if (mem == MAP_FAILED)
+	{
+		KNET_LOG(LogError, "XdpSocket::MapRing: mmap failed: %s(%d)!", strerror(errno), (int)errno);
+		ring.map = 0;
+		return false;
+	}
+	ring.map = mem;
+	ring.producer = (u32*)((char*)mem + offsets.producer);
+	ring.consumer = (u32*)((char*)mem + offsets.consumer);
+	ring.flags = (u32*)((char*)mem + offsets.flags);
+	ring.descs = (char*)mem + offsets.desc;
+	ring.mask = numDescs - 1;
+	return true;
+}
+
+void XdpSocket::UnmapRing(Ring &ring)
+{
+	if (ring.map)
+		munmap(ring.map, ring.mapSize);
+	memset(&ring, 0, sizeof(ring));
+}
+
+bool XdpSocket::Open(const char *interfaceName, u32 queueId_)
+{
+	if (queueId_ >= cMaxQueues)
+	{
+		KNET_LOG(LogError, "XdpSocket::Open: Queue %d of %s is past the %d queues that can be read!", (int)queueId_, interfaceName, (int)cMaxQueues);
+		return false;
+	}
+	device = XdpDevice::Acquire(interfaceName);
+	if (!device)
+		return false;
+	queueId = queueId_;
+
+	fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		KNET_LOG(LogError, "XdpSocket::Open: Creating an AF_XDP socket failed: %s(%d)!", strerror(errno), (int)errno);
+		Close();
+		return false;
+	}
+
+	void *mem = mmap(0, (size_t)cNumFrames * cFrameSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		KNET_LOG(LogError, "XdpSocket::Open: Allocating the UMEM failed: %s(%d)!", strerror(errno), (int)errno);
+		Close();
+		return false;
+	}
+	umem = (char*)mem;
+
+	xdp_umem_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (u64)(uintptr_t)umem;
+	reg.len = (u64)cNumFrames * cFrameSize;
+	reg.chunk_size = cFrameSize;
+	reg.headroom = 0;
+	const u32 numReceiveFrames = cNumReceiveFrames;
+	const u32 numSendFrames = cNumSendFrames;
+	if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0 ||
+		setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &numReceiveFrames, sizeof(numReceiveFrames)) != 0 ||
+		setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &numSendFrames, sizeof(numSendFrames)) != 0 ||
+		setsockopt(fd, SOL_XDP, XDP_RX_RING, &numReceiveFrames, sizeof(numReceiveFrames)) != 0 ||
+		setsockopt(fd, SOL_XDP, XDP_TX_RING, &numSendFrames, sizeof(numSendFrames)) != 0)
+	{
+		KNET_LOG(LogError, "XdpSocket::Open: Setting up the UMEM and the rings failed: %s(%d)!", strerror(errno), (int)errno);
+		Close();
+		return false;
+	}
+
+	xdp_mmap_offsets offsets;
+	socklen_t offsetsLen = sizeof(offsets);
+	if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsetsLen) != 0 ||
+		!MapRing(fillRing, offsets.fr, sizeof(u64), cNumReceiveFrames, XDP_UMEM_PGOFF_FILL_RING) ||
+		!MapRing(completionRing, offsets.cr, sizeof(u64), cNumSendFrames, XDP_UMEM_PGOFF_COMPLETION_RING) ||
+		!MapRing(rxRing, offsets.rx, sizeof(xdp_desc), cNumReceiveFrames, XDP_PGOFF_RX_RING) ||
+		!MapRing(txRing, offsets.tx, sizeof(xdp_desc), cNumSendFrames, XDP_PGOFF_TX_RING))
+	{
+		KNET_LOG(LogError, "XdpSocket::Open: Mapping the rings failed!");
+		Close();
+		return false;
+	}
+
+	// Give all the receive frames to the kernel before binding, so that the first datagrams have somewhere to go.
+	u64 *fill = (u64*)fillRing.descs;
+	for(u32 i = 0; i < cNumReceiveFrames; ++i)
+		fill[i] = (u64)i * cFrameSize;
+	__atomic_store_n(fillRing.producer, cNumReceiveFrames, __ATOMIC_RELEASE);
+
+	// Prefer zero-copy, where the card reads and writes the UMEM directly. Drivers without AF_XDP support copy the frames.
+	const u16 bindFlags[] = { XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP, XDP_COPY | XDP_USE_NEED_WAKEUP, XDP_COPY };
+	int ret = -1;
+	for(size_t i = 0; i < sizeof(bindFlags)/sizeof(bindFlags[0]) && ret != 0; ++i)
+	{
+		sockaddr_xdp addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sxdp_family = AF_XDP;
+		addr.sxdp_flags = bindFlags[i];
+		addr.sxdp_ifindex = (u32)device->ifindex;
+		addr.sxdp_queue_id = queueId;
+		ret = bind(fd, (sockaddr*)&addr, sizeof(addr));
+		useNeedWakeup = (bindFlags[i] & XDP_USE_NEED_WAKEUP) != 0;
+		if (ret == 0)
+			KNET_LOG(LogInfo, "XdpSocket::Open: Reading queue %d of %s in %s mode.", (int)queueId, interfaceName,
+				(bindFlags[i] & XDP_ZEROCOPY) ? "zero-copy" : "copy");
+	}
+	if (ret != 0)
+	{
+		KNET_LOG(LogError, "XdpSocket::Open: Binding to queue %d of %s failed: %s(%d)!", (int)queueId, interfaceName, strerror(errno), (int)errno);
+		Close();
+		return false;
+	}
+
+	frameBuffers = new OverlappedTransferBuffer[cNumFrames];
+	memset(frameBuffers, 0, sizeof(OverlappedTransferBuffer) * cNumFrames);
+	freeFrames.reserve(cNumSendFrames);
+	for(u32 i = cNumFrames; i > cNumReceiveFrames; --i)
+		freeFrames.push_back((u64)(i - 1) * cFrameSize);
+
+	MapUpdate(device->xsksMapFd, queueId, (u32)fd);
+	return true;
+}
+
+void XdpSocket::Close()
+{
+	if (device && fd != -1)
+	{
+		for(size_t i = 0; i < receives.size(); ++i)
+			MapDelete(device->portsMapFd, (queueId << 16) | receives[i].port);
+		MapDelete(device->xsksMapFd, queueId);
+	}
+	receives.clear();
+	neighbors.clear();
+
+	// Closing the socket stops the kernel from touching the rings and the UMEM.
+	if (fd != -1)
+		close(fd);
+	fd = -1;
+	UnmapRing(fillRing);
+	UnmapRing(completionRing);
+	UnmapRing(rxRing);
+	UnmapRing(txRing);
+	if (umem)
+		munmap(umem, (size_t)cNumFrames * cFrameSize);
+	umem = 0;
+	delete[] frameBuffers;
+	frameBuffers = 0;
+	freeFrames.clear();
+	numTxQueued = 0;
+	numTxInFlight = 0;
+
+	if (device)
+		XdpDevice::Release(device);
+	device = 0;
+}
+
+bool XdpSocket::StartReceive(Socket *socket, IDatagramReceiver *receiver, const char *interfaceName, u32 queueId_)
+{
+	assert(socket);
+	assert(receiver);
+	if (socket->TransportLayer() != SocketOverUDP || openFailed)
+		return false;
+	if (!IsValid())
+	{
+		if (!Open(interfaceName, queueId_))
+		{
+			openFailed = true;
+			KNET_LOG(LogError, "XdpSocket::StartReceive: Could not read %s through AF_XDP. Reading the listen sockets through the kernel.", interfaceName);
+			return false;
+		}
+	}
+	else if (device->name != interfaceName)
+		return false;
+	if (IsReceiving(socket))
+		return true;
+
+	Receive receive;
+	receive.socket = socket;
+	receive.receiver = receiver;
+	receive.port = socket->LocalPort();
+	receives.push_back(receive);
+	SetPortRedirected(receive.port, true);
+	return true;
+}
+
+void XdpSocket::StopReceive(Socket *socket)
+{
+	for(size_t i = 0; i < receives.size(); ++i)
+		if (receives[i].socket == socket)
+		{
+			const u16 port = receives[i].port;
+			receives.erase(receives.begin() + i);
+			bool portInUse = false;
+			for(size_t j = 0; j < receives.size(); ++j)
+				if (receives[j].port == port)
+					portInUse = true;
+			if (!portInUse)
+				SetPortRedirected(port, false);
+			return;
+		}
+}
+
+bool XdpSocket::IsReceiving(const Socket *socket) const
+{
+	for(size_t i = 0; i < receives.size(); ++i)
+		if (receives[i].socket == socket)
+			return true;
+	return false;
+}
+
+void XdpSocket::SetPortRedirected(u16 port, bool redirected)
+{
+	if (!device)
+		return;
+	if (redirected)
+		MapUpdate(device->portsMapFd, (queueId << 16) | port, 1);
+	else
+		MapDelete(device->portsMapFd, (queueId << 16) | port);
+}
+
+const XdpSocket::Neighbor *XdpSocket::FindNeighbor(u32 address)
+{
+	std::map<u32, Neighbor>::const_iterator iter = neighbors.find(address);
+	if (iter != neighbors.end())
+		return &iter->second;
+	if (!device)
+		return 0;
+
+	// The client may have sent its datagrams through another queue. Take what the other threads have learnt.
+	Neighbor neighbor;
+	{
+		Lockable<std::map<u32, Neighbor> >::LockType lock = device->neighbors.Acquire();
+		iter = lock->find(address);
+		if (iter == lock->end())
+			return 0;
+		neighbor = iter->second;
+	}
+	return &(neighbors[address] = neighbor);
+}
+
+bool XdpSocket::CanSend(const sockaddr_in &peer)
+{
+	return IsValid() && FindNeighbor(peer.sin_addr.s_addr) != 0;
+}
+
+OverlappedTransferBuffer *XdpSocket::AllocateBuffer(int bytes)
+{
+	if (!IsValid() || freeFrames.empty() || bytes < 0 || (u32)bytes > cFrameSize - cHeaderBytes)
+		return 0;
+
+	const u64 frame = freeFrames.back();
+	freeFrames.pop_back();
+	OverlappedTransferBuffer *buffer = &frameBuffers[frame / cFrameSize];
+	buffer->buffer.buf = umem + frame + cHeaderBytes;
+	buffer->buffer.len = bytes;
+	buffer->bytesContains = 0;
+	buffer->bytesAllocated = bytes;
+	buffer->xdpSocket = this;
+	buffer->xdpFrame = frame;
+	return buffer;
+}
+
+void XdpSocket::FreeBuffer(OverlappedTransferBuffer *buffer)
+{
+	assert(buffer && buffer->xdpSocket == this);
+	freeFrames.push_back(buffer->xdpFrame);
+}
+
+bool XdpSocket::Send(OverlappedTransferBuffer *buffer, const sockaddr_in &peer, u16 localPort)
+{
+	assert(buffer && buffer->xdpSocket == this);
+	const Neighbor *neighbor = FindNeighbor(peer.sin_addr.s_addr);
+	if (!neighbor || numTxInFlight >= cNumSendFrames)
+		return false;
+
+	const u32 payloadBytes = buffer->buffer.len;
+	u8 *frame = (u8*)umem + buffer->xdpFrame;
+
+	memcpy(frame, neighbor->mac, 6);
+	memcpy(frame + 6, device->mac, 6);
+	frame[12] = 0x08;
+	frame[13] = 0x00;
+
+	u8 *ip = frame + 14;
+	const u16 ipBytes = (u16)(20 + 8 + payloadBytes);
+	const u16 ipId = nextIpId++;
+	ip[0] = 0x45;
+	ip[1] = ECNECT0; // The same TOS byte as the datagrams sent through the socket, see Socket::ECNEnabled().
+	ip[2] = (u8)(ipBytes >> 8);
+	ip[3] = (u8)ipBytes;
+	ip[4] = (u8)(ipId >> 8);
+	ip[5] = (u8)ipId;
+	ip[6] = 0x40; // Don't fragment. The connections do their own path MTU discovery.
+	ip[7] = 0;
+	ip[8] = 64;
+	ip[9] = IPPROTO_UDP;
+	ip[10] = ip[11] = 0;
+	memcpy(ip + 12, &neighbor->localAddress, 4);
+	memcpy(ip + 16, &peer.sin_addr.s_addr, 4);
+	const u16 checksum = IPv4HeaderChecksum(ip);
+	ip[10] = (u8)(checksum >> 8);
+	ip[11] = (u8)checksum;
+
+	// The UDP checksum is optional over IPv4. It is left out, since computing it would mean another pass over the payload.
+	u8 *udp = ip + 20;
+	const u16 udpBytes = (u16)(8 + payloadBytes);
+	udp[0] = (u8)(localPort >> 8);
+	udp[1] = (u8)localPort;
+	memcpy(udp + 2, &peer.sin_port, 2);
+	udp[4] = (u8)(udpBytes >> 8);
+	udp[5] = (u8)udpBytes;
+	udp[6] = udp[7] = 0;
+
+	xdp_desc *desc = &((xdp_desc*)txRing.descs)[(*txRing.producer + numTxQueued) & txRing.mask];
+	desc->addr = buffer->xdpFrame;
+	desc->len = cHeaderBytes + payloadBytes;
+	desc->options = 0;
+	++numTxQueued;
+	++numTxInFlight;
+	return true;
+}
+
+void XdpSocket::Submit()
+{
+	if (!IsValid())
+		return;
+
+	if (numTxQueued > 0)
+	{
+		__atomic_store_n(txRing.producer, *txRing.producer + numTxQueued, __ATOMIC_RELEASE);
+		numTxQueued = 0;
+	}
+	// In copy mode, the kernel only sends the frames when kicked. In zero-copy mode, the driver asks for it when it has gone idle.
+	if (numTxInFlight > 0 && (!useNeedWakeup || (__atomic_load_n(txRing.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) != 0))
+	{
+		if (sendto(fd, 0, 0, MSG_DONTWAIT, 0, 0) < 0 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN)
+			KNET_LOG(LogError, "XdpSocket::Submit: Waking up the TX ring failed: %s(%d)!", strerror(errno), (int)errno);
+	}
+	ReapCompletions();
+}
+
+void XdpSocket::ReapCompletions()
+{
+	u32 head = *completionRing.consumer;
+	const u32 tail = __atomic_load_n(completionRing.producer, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return;
+
+	const u64 *addresses = (const u64*)completionRing.descs;
+	for(; head != tail; ++head)
+	{
+		freeFrames.push_back(addresses[head & completionRing.mask] & ~(u64)(cFrameSize - 1));
+		--numTxInFlight;
+	}
+	__atomic_store_n(completionRing.consumer, head, __ATOMIC_RELEASE);
+}
+
+int XdpSocket::ProcessReceives()
+{
+	if (!IsValid())
+		return 0;
+
+	int numReceived = 0;
+	u32 head = *rxRing.consumer;
+	u32 fillTail = *fillRing.producer;
+	const u32 tail = __atomic_load_n(rxRing.producer, __ATOMIC_ACQUIRE);
+	const xdp_desc *descs = (const xdp_desc*)rxRing.descs;
+	u64 *fill = (u64*)fillRing.descs;
+	for(; head != tail; ++head)
+	{
+		const xdp_desc &desc = descs[head & rxRing.mask];
+		if (FrameReceived((const u8*)umem + desc.addr, desc.len))
+			++numReceived;
+		else
+			++numFramesDropped;
+		// Hand the frame straight back to the kernel. The fill ring has room for all the receive frames.
+		fill[fillTail++ & fillRing.mask] = desc.addr & ~(u64)(cFrameSize - 1);
+	}
+	__atomic_store_n(rxRing.consumer, head, __ATOMIC_RELEASE);
+	__atomic_store_n(fillRing.producer, fillTail, __ATOMIC_RELEASE);
+
+	if (useNeedWakeup && (__atomic_load_n(fillRing.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) != 0)
+		recvfrom(fd, 0, 0, MSG_DONTWAIT, 0, 0);
+	return numReceived;
+}
+
+bool XdpSocket::FrameReceived(const u8 *frame, u32 length)
+{
+	// The XDP program has checked that this is an IPv4 UDP datagram without options or fragmentation.
+	if (length < cHeaderBytes)
+		return false;
+	const u8 *ip = frame + 14;
+	const u8 *udp = ip + 20;
+	const u32 ipBytes = ((u32)ip[2] << 8) | ip[3];
+	const u32 udpBytes = ((u32)udp[4] << 8) | udp[5];
+	if (ipBytes > length - 14 || udpBytes < 8 || udpBytes > ipBytes - 20)
+		return false;
+
+	const u16 port = (u16)(((u32)udp[2] << 8) | udp[3]);
+	const Receive *receive = 0;
+	for(size_t i = 0; i < receives.size(); ++i)
+		if (receives[i].port == port)
+		{
+			receive = &receives[i];
+			break;
+		}
+	if (!receive)
+		return false;
+
+	sockaddr_in from;
+	memset(&from, 0, sizeof(from));
+	from.sin_family = AF_INET;
+	memcpy(&from.sin_addr.s_addr, ip + 12, 4);
+	memcpy(&from.sin_port, udp, 2);
+
+	// Remember the addresses to reply with. The source of the frame is the client, or the router in front of it.
+	Neighbor &neighbor = neighbors[from.sin_addr.s_addr];
+	u32 localAddress;
+	memcpy(&localAddress, ip + 16, 4);
+	if (memcmp(neighbor.mac, frame + 6, 6) != 0 || neighbor.localAddress != localAddress)
+	{
+		memcpy(neighbor.mac, frame + 6, 6);
+		neighbor.localAddress = localAddress;
+		Lockable<std::map<u32, Neighbor> >::LockType lock = device->neighbors.Acquire();
+		(*lock)[from.sin_addr.s_addr] = neighbor;
+	}
+
+	receive->receiver->DatagramReceived(receive->socket, 0, (const char*)udp + 8, udpBytes - 8, EndPoint::FromSockAddrIn(from), 0, (u8)(ip[1] & 3));
+	return true;
+}
+
+} // ~kNet
+
+#endif
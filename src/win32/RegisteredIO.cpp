@@ -0,0 +1,555 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file RegisteredIO.cpp
+	@brief Implements the RegisteredIO class. Only compiled in when KNET_USE_RIO is defined. */
+
+#ifdef KNET_USE_RIO
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+#include "kNet/win32/RegisteredIO.h"
+#include "kNet/IDatagramReceiver.h"
+#include "kNet/Socket.h"
+#include "kNet/EndPoint.h"
+#include "kNet/Network.h"
+#include "kNet/Datagram.h"
+#include "kNet/PolledTimer.h"
+#include "kNet/Clock.h"
+#include "kNet/NetworkLogging.h"
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace kNet
+{
+
+/// The number of completions the request queues of one thread can have in flight in total.
+static const u32 cCompletionQueueSize = 8192;
+/// The number of buffers in the registered pool, and the size of each. A buffer holds the largest datagram kNet accepts.
+static const u32 cNumBuffers = 1024;
+static const u32 cBufferSize = 9216;
+/// The number of receives kept primed on each listen socket and each client socket, and the number of sends each socket
+/// can have in progress.
+static const int cListenReceiveDepth = 256;
+static const int cClientReceiveDepth = 32;
+static const int cSendDepth = 256;
+/// The sends leave this many buffers of the pool for the receives, so that a burst of sends cannot stall the receives.
+static const u32 cReceiveReserve = cNumBuffers / 8;
+/// The number of completions read with a single RIODequeueCompletion call.
+static const ULONG cMaxResultsPerDequeue = 256;
+/// The lowest bit of the request context tells the completions of receives apart from the completions of sends.
+static const uintptr_t cReceiveTag = 1;
+
+static __declspec(thread) RegisteredIO *threadRIO = 0;
+
+RegisteredIO::RegisteredIO()
+:completionQueue(RIO_INVALID_CQ),
+completionQueueReserved(0),
+poolMemory(0),
+poolId(RIO_INVALID_BUFFERID),
+poolBuffers(0),
+notifyArmed(false)
+{
+	memset(&rio, 0, sizeof(rio));
+}
+
+RegisteredIO::~RegisteredIO()
+{
+	Close();
+}
+
+RegisteredIO *RegisteredIO::ThreadRIO()
+{
+	return threadRIO;
+}
+
+void RegisteredIO::SetThreadRIO(RegisteredIO *rio)
+{
+	threadRIO = rio;
+}
+
+bool RegisteredIO::Init()
+{
+	if (IsValid())
+		return true;
+
+	// The function table is queried through a socket. Any socket created for RIO will do.
+	SOCKET s = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_REGISTERED_IO);
+	if (s == INVALID_SOCKET)
+	{
+		KNET_LOG(LogInfo, "RegisteredIO::Init: Creating a socket for RIO failed: %s. Using overlapped socket transfers.", Network::GetLastErrorString().c_str());
+		return false;
+	}
+	GUID functionTableId = WSAID_MULTIPLE_RIO;
+	DWORD bytes = 0;
+	memset(&rio, 0, sizeof(rio));
+	rio.cbSize = sizeof(rio);
+	int ret = WSAIoctl(s, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, &functionTableId, sizeof(functionTableId), &rio, sizeof(rio), &bytes, NULL, NULL);
+	const int error = (ret == 0) ? 0 : Network::GetLastError();
+	closesocket(s);
+	if (ret != 0)
+	{
+		KNET_LOG(LogInfo, "RegisteredIO::Init: The RIO functions are not available: %s. Using overlapped socket transfers.", Network::GetErrorString(error).c_str());
+		return false;
+	}
+
+	completionEvent = CreateNewEvent(EventWaitSignal);
+	RIO_NOTIFICATION_COMPLETION notification;
+	memset(&notification, 0, sizeof(notification));
+	notification.Type = RIO_EVENT_COMPLETION;
+	notification.Event.EventHandle = completionEvent.wsaEvent;
+	notification.Event.NotifyReset = FALSE; // The worker thread resets the event before it reads the completions.
+	completionQueue = rio.RIOCreateCompletionQueue(cCompletionQueueSize, &notification);
+	if (completionQueue == RIO_INVALID_CQ)
+	{
+		KNET_LOG(LogError, "RegisteredIO::Init: RIOCreateCompletionQueue failed: %s. Using overlapped socket transfers.", Network::GetLastErrorString().c_str());
+		completionEvent.Close();
+		return false;
+	}
+
+	// The pool holds the datagrams, followed by the address of each datagram.
+	const DWORD poolSize = cNumBuffers * (cBufferSize + sizeof(SOCKADDR_INET));
+	poolMemory = (char*)VirtualAlloc(0, poolSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (poolMemory)
+		poolId = rio.RIORegisterBuffer(poolMemory, poolSize);
+	if (poolId == RIO_INVALID_BUFFERID)
+	{
+		KNET_LOG(LogError, "RegisteredIO::Init: Registering a buffer pool of %d bytes failed: %s. Using overlapped socket transfers.",
+			(int)poolSize, Network::GetLastErrorString().c_str());
+		Close();
+		return false;
+	}
+
+	assert(cBufferSize >= cMaxDatagramSize);
+	poolBuffers = new OverlappedTransferBuffer[cNumBuffers];
+	memset(poolBuffers, 0, sizeof(OverlappedTransferBuffer) * cNumBuffers);
+	freeBuffers.reserve(cNumBuffers);
+	for(u32 i = cNumBuffers; i-- > 0;)
+	{
+		OverlappedTransferBuffer &buffer = poolBuffers[i];
+		buffer.buffer.buf = poolMemory + i * cBufferSize;
+		buffer.buffer.len = cBufferSize;
+		buffer.bytesAllocated = cBufferSize;
+		buffer.overlapped.hEvent = WSA_INVALID_EVENT;
+		buffer.registeredIO = this;
+		buffer.registeredSlot = i;
+		freeBuffers.push_back(i);
+	}
+
+	Submit(); // Asks for the first completion notification.
+	KNET_LOG(LogInfo, "RegisteredIO::Init: Using Registered I/O with a pool of %d buffers.", (int)cNumBuffers);
+	return true;
+}
+
+void RegisteredIO::Close()
+{
+	int numInProgress = 0;
+	if (IsValid())
+	{
+		// StopReceive frees the queues that have nothing in progress, so go through a copy of the list.
+		std::vector<RequestQueue*> activeQueues = queues;
+		for(size_t i = 0; i < activeQueues.size(); ++i)
+			if (!activeQueues[i]->stopped)
+				StopReceive(activeQueues[i]->socket);
+
+		// Give the sends in progress a moment to finish, since the kernel reads their buffers until they do. The receives
+		// in progress on the sockets that are still open never finish.
+		std::vector<int> readyConnections;
+		PolledTimer timer;
+		const float maxDrainTime = 1000.f; // msecs.
+		for(;;)
+		{
+			int numSends = 0;
+			for(size_t i = 0; i < queues.size(); ++i)
+				numSends += queues[i]->numSendsPosted;
+			if (numSends == 0 || timer.MSecsElapsed() >= maxDrainTime)
+				break;
+			if (ProcessCompletions(readyConnections) == 0)
+				Clock::Sleep(1);
+		}
+
+		for(size_t i = 0; i < queues.size(); ++i)
+			numInProgress += queues[i]->numReceivesPosted + queues[i]->numSendsPosted;
+		if (numInProgress > 0)
+			KNET_LOG(LogInfo, "RegisteredIO::Close: %d operations are still in progress on sockets that are open. Leaking their buffers.", numInProgress);
+	}
+
+	// If some operations never finished, the kernel may still write to their memory and signal the event, so it is safer to leak them.
+	if (numInProgress == 0)
+	{
+		if (poolId != RIO_INVALID_BUFFERID)
+			rio.RIODeregisterBuffer(poolId);
+		if (completionQueue != RIO_INVALID_CQ)
+			rio.RIOCloseCompletionQueue(completionQueue);
+		if (poolMemory)
+			VirtualFree(poolMemory, 0, MEM_RELEASE);
+		delete[] poolBuffers;
+		for(size_t i = 0; i < queues.size(); ++i)
+			delete queues[i];
+		if (completionEvent.IsValid())
+			completionEvent.Close();
+	}
+	poolId = RIO_INVALID_BUFFERID;
+	completionQueue = RIO_INVALID_CQ;
+	completionQueueReserved = 0;
+	poolMemory = 0;
+	poolBuffers = 0;
+	freeBuffers.clear();
+	queues.clear();
+	notifyArmed = false;
+	completionEvent = Event();
+}
+
+OverlappedTransferBuffer *RegisteredIO::AllocateBuffer(int bytes)
+{
+	if (!IsValid() || bytes < 0 || (u32)bytes > cBufferSize || freeBuffers.size() <= cReceiveReserve)
+		return 0;
+
+	OverlappedTransferBuffer *buffer = &poolBuffers[freeBuffers.back()];
+	freeBuffers.pop_back();
+	buffer->buffer.len = cBufferSize;
+	buffer->bytesContains = 0;
+	buffer->receiveTick = 0;
+	buffer->ecn = ECNNotECT;
+	return buffer;
+}
+
+void RegisteredIO::FreeBuffer(OverlappedTransferBuffer *buffer)
+{
+	assert(buffer);
+	assert(buffer->registeredIO == this);
+	assert(buffer == &poolBuffers[buffer->registeredSlot]);
+	freeBuffers.push_back(buffer->registeredSlot);
+}
+
+RIO_BUF RegisteredIO::AddressBuffer(const OverlappedTransferBuffer *buffer) const
+{
+	RIO_BUF address;
+	address.BufferId = poolId;
+	address.Offset = cNumBuffers * cBufferSize + buffer->registeredSlot * sizeof(SOCKADDR_INET);
+	address.Length = sizeof(SOCKADDR_INET);
+	return address;
+}
+
+bool RegisteredIO::HasRequestQueue(SOCKET s) const
+{
+	for(size_t i = 0; i < queues.size(); ++i)
+		if (queues[i]->s == s && !queues[i]->stopped)
+			return true;
+	return false;
+}
+
+bool RegisteredIO::Send(SOCKET s, OverlappedTransferBuffer *buffer, const sockaddr_in *peer)
+{
+	assert(buffer);
+	assert(buffer->registeredIO == this);
+
+	// The server side connections of a UDP server send through the request queue of the listen socket.
+	RequestQueue *queue = 0;
+	for(size_t i = 0; i < queues.size() && !queue; ++i)
+		if (queues[i]->s == s && !queues[i]->stopped)
+			queue = queues[i];
+	if (!queue || queue->numSendsPosted >= queue->sendDepth)
+		return false;
+
+	RIO_BUF data;
+	data.BufferId = poolId;
+	data.Offset = buffer->registeredSlot * cBufferSize;
+	data.Length = buffer->buffer.len;
+
+	RIO_BUF address;
+	if (peer)
+	{
+		address = AddressBuffer(buffer);
+		SOCKADDR_INET *to = (SOCKADDR_INET*)(poolMemory + address.Offset);
+		memset(to, 0, sizeof(SOCKADDR_INET));
+		to->Ipv4 = *peer;
+	}
+
+	// The sends are committed to the kernel all at once in Submit().
+	if (!rio.RIOSendEx(queue->queue, &data, 1, NULL, peer ? &address : NULL, NULL, NULL, RIO_MSG_DEFER, (PVOID)buffer))
+	{
+		KNET_LOG(LogVerbose, "RegisteredIO::Send: RIOSendEx failed: %s. Sending the datagram synchronously.", Network::GetLastErrorString().c_str());
+		return false;
+	}
+	++queue->numSendsPosted;
+	queue->sendsDeferred = true;
+	return true;
+}
+
+RegisteredIO::RequestQueue *RegisteredIO::CreateRequestQueue(Socket *socket, int receiveDepth, int sendDepth)
+{
+	assert(socket);
+	if (!IsValid() || socket->TransportLayer() != SocketOverUDP || socket->GetSocketHandle() == INVALID_SOCKET)
+		return 0;
+
+	// Every operation of the request queue may post its completion to the completion queue at the same time.
+	const u32 numEntries = (u32)(receiveDepth + sendDepth);
+	if (completionQueueReserved + numEntries > cCompletionQueueSize)
+	{
+		KNET_LOG(LogVerbose, "RegisteredIO::CreateRequestQueue: The completion queue is full. Socket %p uses overlapped transfers.", socket);
+		return 0;
+	}
+
+	RequestQueue *queue = new RequestQueue;
+	queue->socket = socket;
+	queue->s = socket->GetSocketHandle();
+	queue->receiver = 0;
+	queue->connectionIndex = -1;
+	queue->numReceivesPosted = 0;
+	queue->numSendsPosted = 0;
+	queue->receiveDepth = receiveDepth;
+	queue->sendDepth = sendDepth;
+	queue->sendsDeferred = false;
+	queue->stopped = false;
+	queue->queue = rio.RIOCreateRequestQueue(queue->s, receiveDepth, 1, sendDepth, 1, completionQueue, completionQueue, queue);
+	if (queue->queue == RIO_INVALID_RQ)
+	{
+		// This is expected if the socket was not created for RIO, or has a request queue on another thread already.
+		KNET_LOG(LogVerbose, "RegisteredIO::CreateRequestQueue: RIOCreateRequestQueue failed for socket %p: %s. Using overlapped transfers.",
+			socket, Network::GetLastErrorString().c_str());
+		delete queue;
+		return 0;
+	}
+	completionQueueReserved += numEntries;
+	queues.push_back(queue);
+	return queue;
+}
+
+RegisteredIO::RequestQueue *RegisteredIO::FindQueue(const Socket *socket) const
+{
+	for(size_t i = 0; i < queues.size(); ++i)
+		if (queues[i]->socket == socket && !queues[i]->stopped)
+			return queues[i];
+	return 0;
+}
+
+bool RegisteredIO::StartReceive(Socket *socket, IDatagramReceiver *receiver)
+{
+	assert(receiver);
+	if (FindQueue(socket))
+		return true;
+
+	RequestQueue *queue = CreateRequestQueue(socket, cListenReceiveDepth, cSendDepth);
+	if (!queue)
+		return false;
+	queue->receiver = receiver;
+	PrimeReceives(queue);
+	return true;
+}
+
+bool RegisteredIO::StartClientReceive(Socket *socket, int connectionIndex)
+{
+	RequestQueue *queue = FindQueue(socket);
+	if (!queue)
+	{
+		queue = CreateRequestQueue(socket, cClientReceiveDepth, cSendDepth);
+		if (!queue)
+			return false;
+		PrimeReceives(queue);
+	}
+	queue->connectionIndex = connectionIndex;
+	return true;
+}
+
+void RegisteredIO::StopReceive(Socket *socket)
+{
+	RequestQueue *queue = FindQueue(socket);
+	if (!queue)
+		return;
+
+	queue->stopped = true;
+	while(!queue->received.empty())
+	{
+		FreeBuffer(queue->received.front());
+		queue->received.pop_front();
+	}
+	ReleaseQueueIfDone(queue);
+}
+
+bool RegisteredIO::IsReceiving(const Socket *socket) const
+{
+	return FindQueue(socket) != 0;
+}
+
+bool RegisteredIO::HasReceived(const Socket *socket) const
+{
+	RequestQueue *queue = FindQueue(socket);
+	return queue && !queue->received.empty();
+}
+
+OverlappedTransferBuffer *RegisteredIO::TakeReceived(Socket *socket)
+{
+	RequestQueue *queue = FindQueue(socket);
+	if (!queue || queue->received.empty())
+		return 0;
+
+	OverlappedTransferBuffer *buffer = queue->received.front();
+	queue->received.pop_front();
+	return buffer;
+}
+
+void RegisteredIO::ReleaseQueueIfDone(RequestQueue *queue)
+{
+	if (!queue->stopped || queue->numReceivesPosted > 0 || queue->numSendsPosted > 0)
+		return;
+
+	// The kernel frees the request queue itself when the socket is closed.
+	completionQueueReserved -= (u32)(queue->receiveDepth + queue->sendDepth);
+	queues.erase(std::find(queues.begin(), queues.end(), queue));
+	delete queue;
+}
+
+void RegisteredIO::PrimeReceives(RequestQueue *queue)
+{
+	if (queue->stopped)
+		return;
+
+	// The datagrams held for the connection count towards the depth, so that a connection that does not read its socket
+	// cannot take over the whole pool.
+	int numPosted = 0;
+	while(queue->numReceivesPosted + (int)queue->received.size() < queue->receiveDepth && !freeBuffers.empty())
+	{
+		OverlappedTransferBuffer *buffer = &poolBuffers[freeBuffers.back()];
+		RIO_BUF data;
+		data.BufferId = poolId;
+		data.Offset = buffer->registeredSlot * cBufferSize;
+		data.Length = cBufferSize;
+		RIO_BUF address = AddressBuffer(buffer);
+		if (!rio.RIOReceiveEx(queue->queue, &data, 1, NULL, &address, NULL, NULL, RIO_MSG_DEFER, (PVOID)((uintptr_t)buffer | cReceiveTag)))
+		{
+			KNET_LOG(LogVerbose, "RegisteredIO::PrimeReceives: RIOReceiveEx failed for socket %p: %s.", queue->socket, Network::GetLastErrorString().c_str());
+			break;
+		}
+		freeBuffers.pop_back();
+		++queue->numReceivesPosted;
+		++numPosted;
+	}
+
+	if (numPosted > 0 && !rio.RIOReceive(queue->queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL))
+		KNET_LOG(LogError, "RegisteredIO::PrimeReceives: Committing the receives of socket %p failed: %s!", queue->socket, Network::GetLastErrorString().c_str());
+}
+
+void RegisteredIO::Submit()
+{
+	if (!IsValid())
+		return;
+
+	for(size_t i = 0; i < queues.size(); ++i)
+	{
+		RequestQueue *queue = queues[i];
+		PrimeReceives(queue);
+		if (queue->sendsDeferred)
+		{
+			queue->sendsDeferred = false;
+			if (!rio.RIOSendEx(queue->queue, NULL, 0, NULL, NULL, NULL, NULL, RIO_MSG_COMMIT_ONLY, NULL))
+				KNET_LOG(LogError, "RegisteredIO::Submit: Committing the sends of socket %p failed: %s!", queue->socket, Network::GetLastErrorString().c_str());
+		}
+	}
+
+	// The notification fires once, when the next completion arrives, or right away if there already are completions.
+	if (!notifyArmed)
+	{
+		const int ret = rio.RIONotify(completionQueue);
+		if (ret == ERROR_SUCCESS || ret == WSAEALREADY)
+			notifyArmed = true;
+		else
+			KNET_LOG(LogError, "RegisteredIO::Submit: RIONotify failed: %s!", Network::GetErrorString(ret).c_str());
+	}
+}
+
+int RegisteredIO::ProcessCompletions(std::vector<int> &readyConnections)
+{
+	if (!IsValid())
+		return 0;
+
+	// Called after the notification fired. Submit() below asks for the next one.
+	notifyArmed = false;
+
+	RIORESULT results[cMaxResultsPerDequeue];
+	int numProcessed = 0;
+	for(;;)
+	{
+		const ULONG numResults = rio.RIODequeueCompletion(completionQueue, results, cMaxResultsPerDequeue);
+		if (numResults == RIO_CORRUPT_CQ)
+		{
+			KNET_LOG(LogError, "RegisteredIO::ProcessCompletions: The completion queue is corrupt!");
+			break;
+		}
+		if (numResults == 0)
+			break;
+
+		for(ULONG i = 0; i < numResults; ++i)
+		{
+			const RIORESULT &result = results[i];
+			RequestQueue *queue = (RequestQueue*)(uintptr_t)result.SocketContext;
+			const uintptr_t context = (uintptr_t)result.RequestContext;
+			OverlappedTransferBuffer *buffer = (OverlappedTransferBuffer*)(context & ~cReceiveTag);
+			if ((context & cReceiveTag) != 0)
+				ReceiveCompleted(queue, buffer, result, readyConnections);
+			else
+			{
+				if (result.Status != 0 && result.Status != WSAEMSGSIZE)
+					KNET_LOG(LogError, "RegisteredIO::ProcessCompletions: Sending a datagram failed: %s!", Network::GetErrorString(result.Status).c_str());
+				FreeBuffer(buffer);
+				--queue->numSendsPosted;
+				ReleaseQueueIfDone(queue);
+			}
+		}
+		numProcessed += (int)numResults;
+	}
+
+	// Hand the buffers that were freed back to the receives.
+	Submit();
+	return numProcessed;
+}
+
+void RegisteredIO::ReceiveCompleted(RequestQueue *queue, OverlappedTransferBuffer *buffer, const RIORESULT &result, std::vector<int> &readyConnections)
+{
+	--queue->numReceivesPosted;
+	if (queue->stopped || result.Status != 0 || result.BytesTransferred == 0)
+	{
+		// Like with the overlapped receives, an ICMP Port Unreachable (WSAECONNRESET) from a single peer is not an error of the socket.
+		// The receives in progress are aborted when the socket is closed.
+		if (!queue->stopped && result.Status != 0 && result.Status != WSAECONNRESET && result.Status != WSA_OPERATION_ABORTED)
+			KNET_LOG(LogError, "RegisteredIO::ReceiveCompleted: A receive on socket %p failed: %s!", queue->socket, Network::GetErrorString(result.Status).c_str());
+		FreeBuffer(buffer);
+		ReleaseQueueIfDone(queue);
+		return;
+	}
+
+	const SOCKADDR_INET *from = (const SOCKADDR_INET*)(poolMemory + AddressBuffer(buffer).Offset);
+	if (queue->receiver)
+	{
+		queue->receiver->DatagramReceived(queue->socket, 0, buffer->buffer.buf, result.BytesTransferred, EndPoint::FromSockAddrIn(from->Ipv4), 0, ECNNotECT);
+		FreeBuffer(buffer);
+	}
+	else
+	{
+		buffer->buffer.len = cBufferSize;
+		buffer->bytesContains = (int)result.BytesTransferred;
+		buffer->from = from->Ipv4;
+		buffer->fromLen = sizeof(buffer->from);
+		buffer->receiveTick = 0;
+		buffer->ecn = ECNNotECT;
+		queue->received.push_back(buffer);
+		readyConnections.push_back(queue->connectionIndex);
+	}
+}
+
+} // ~kNet
+
+#endif
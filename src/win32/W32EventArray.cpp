@@ -13,7 +13,9 @@
    limitations under the License. */
 
 /** @file W32EventArray.cpp
-	@brief */
+	@brief Implements EventArray using WSAWaitForMultipleEvents. When KNET_USE_IOCP is defined, W32IocpEventArray.cpp is used instead. */
+
+#ifndef KNET_USE_IOCP
 
 #include <cassert>
 
@@ -30,6 +32,19 @@ EventArray::EventArray()
 {
 }
 
+EventArray::~EventArray()
+{
+}
+
+void EventArray::SetEdgeTriggered(bool /*edgeTriggered*/)
+{
+	// WSAWaitForMultipleEvents waits on the state of each event object, there is no edge-triggered mode.
+}
+
+void EventArray::ResetRegistrations()
+{
+}
+
 void EventArray::Clear()
 {
 	numAdded = 0;
@@ -56,6 +71,33 @@ void EventArray::AddEvent(const Event &e)
 	events[numAdded++] = e.wsaEvent;
 }
 
+void EventArray::SetEvent(int index, const Event &e)
+{
+	assert(index >= 0 && index < numAdded);
+	if (index < 0 || index >= numAdded || e.IsNull())
+	{
+		KNET_LOG(LogError, "EventArray::SetEvent: Error! Invalid index %d or event! (%d events in the array)", index, numAdded);
+		return;
+	}
+	events[index] = e.wsaEvent;
+}
+
+int EventArray::Wait(int msecs, std::vector<int> &signalledIndices)
+{
+	signalledIndices.clear();
+
+	int index = Wait(msecs);
+	if (index < 0)
+		return index;
+
+	// WSAWaitForMultipleEvents only reports the first signalled event. Poll the rest of the array for others.
+	signalledIndices.push_back(index);
+	for(int i = index+1; i < numAdded; ++i)
+		if (WSAWaitForMultipleEvents(1, events+i, FALSE, 0, FALSE) == WSA_WAIT_EVENT_0)
+			signalledIndices.push_back(i);
+	return (int)signalledIndices.size();
+}
+
 int EventArray::Wait(int msecs)
 {
 	if (numAdded == 0)
@@ -78,3 +120,5 @@ int EventArray::Wait(int msecs)
 }
 
 } // ~kNet
+
+#endif // ~KNET_USE_IOCP
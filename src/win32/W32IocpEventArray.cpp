@@ -0,0 +1,307 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file W32IocpEventArray.cpp
+	@brief Implements EventArray on top of an I/O completion port. Used instead of W32EventArray.cpp when KNET_USE_IOCP is defined.
+
+	Each event that is waited on is associated with the completion port through a wait completion packet, which queues
+	a completion to the port when the event is set. A wait is then a single GetQueuedCompletionStatusEx call, which
+	returns the indices of the set events directly, however many events the array holds. The association is one-shot,
+	so an event that was reported is associated again at the next Wait(). Since the events stay set until they are reset,
+	this keeps the same level-triggered behavior as WSAWaitForMultipleEvents.
+
+	Wait completion packets are available from Windows 8 on. On older systems, a thread pool wait posts the completion instead. */
+
+#ifdef KNET_USE_IOCP
+
+#include <cassert>
+
+#include "kNet/DebugMemoryLeakCheck.h"
+
+#include "kNet/EventArray.h"
+#include "kNet/NetworkLogging.h"
+
+namespace kNet
+{
+
+/// Specifies the maximum number of completions a single GetQueuedCompletionStatusEx call reports back to us.
+static const ULONG cMaxCompletionsPerWait = 256;
+
+typedef LONG (NTAPI *NtCreateWaitCompletionPacketFunc)(PHANDLE waitCompletionPacketHandle, ACCESS_MASK desiredAccess, PVOID objectAttributes);
+typedef LONG (NTAPI *NtAssociateWaitCompletionPacketFunc)(HANDLE waitCompletionPacketHandle, HANDLE ioCompletionHandle, HANDLE targetObjectHandle,
+	PVOID keyContext, PVOID apcContext, LONG ioStatus, ULONG_PTR ioStatusInformation, PBOOLEAN alreadySignaled);
+typedef LONG (NTAPI *NtCancelWaitCompletionPacketFunc)(HANDLE waitCompletionPacketHandle, BOOLEAN removeSignaledPacket);
+
+/// The wait completion packet functions of ntdll.dll, or null if the system does not have them.
+static NtCreateWaitCompletionPacketFunc NtCreateWaitCompletionPacket = 0;
+static NtAssociateWaitCompletionPacketFunc NtAssociateWaitCompletionPacket = 0;
+static NtCancelWaitCompletionPacketFunc NtCancelWaitCompletionPacket = 0;
+static volatile LONG waitPacketFunctionsLoaded = 0;
+
+static bool HasWaitCompletionPackets()
+{
+	// Loading the same addresses twice on a race is harmless.
+	if (!waitPacketFunctionsLoaded)
+	{
+		HMODULE ntdll = GetModuleHandleA("ntdll.dll");
+		if (ntdll)
+		{
+			NtCreateWaitCompletionPacket = (NtCreateWaitCompletionPacketFunc)GetProcAddress(ntdll, "NtCreateWaitCompletionPacket");
+			NtAssociateWaitCompletionPacket = (NtAssociateWaitCompletionPacketFunc)GetProcAddress(ntdll, "NtAssociateWaitCompletionPacket");
+			NtCancelWaitCompletionPacket = (NtCancelWaitCompletionPacketFunc)GetProcAddress(ntdll, "NtCancelWaitCompletionPacket");
+		}
+		InterlockedExchange(&waitPacketFunctionsLoaded, 1);
+	}
+	return NtCreateWaitCompletionPacket && NtAssociateWaitCompletionPacket && NtCancelWaitCompletionPacket;
+}
+
+EventArray::EventArray()
+:numAdded(0),
+completionPort(NULL),
+completions(cMaxCompletionsPerWait)
+{
+	completionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (completionPort == NULL)
+		KNET_LOG(LogError, "EventArray::EventArray: CreateIoCompletionPort failed with error %d!", (int)GetLastError());
+}
+
+EventArray::~EventArray()
+{
+	for(size_t i = 0; i < slots.size(); ++i)
+	{
+		DisarmSlot(*slots[i]);
+		if (slots[i]->waitPacket)
+			CloseHandle(slots[i]->waitPacket);
+		delete slots[i];
+	}
+	slots.clear();
+	if (completionPort)
+		CloseHandle(completionPort);
+}
+
+void EventArray::SetEdgeTriggered(bool /*edgeTriggered*/)
+{
+	// The events are waited on by their state, there is no edge-triggered mode.
+}
+
+void EventArray::ResetRegistrations()
+{
+	// An event handle may have been closed and reused by the OS for a new event, so forget all the events. The events
+	// added after this are waited on anew.
+	for(size_t i = 0; i < slots.size(); ++i)
+	{
+		DisarmSlot(*slots[i]);
+		slots[i]->event = NULL;
+	}
+}
+
+void EventArray::Clear()
+{
+	// The slots are kept: the events added again to the same indices keep their waits.
+	numAdded = 0;
+}
+
+int EventArray::Size() const
+{
+	return numAdded;
+}
+
+void EventArray::MarkDirty(WaitSlot &slot)
+{
+	if (!slot.dirty)
+	{
+		slot.dirty = true;
+		dirtySlots.push_back(slot.index);
+	}
+}
+
+void EventArray::AddEvent(const Event &e)
+{
+	if (e.IsNull())
+	{
+		KNET_LOG(LogError, "EventArray::AddEvent: Error! Tried to add a null event to event array at index %d!", numAdded);
+		return;
+	}
+	if (numAdded == (int)slots.size())
+	{
+		WaitSlot *slot = new WaitSlot;
+		slot->owner = this;
+		slot->index = numAdded;
+		slot->event = NULL;
+		slot->waitPacket = NULL;
+		slot->registeredWait = NULL;
+		slot->generation = 0;
+		slot->armed = false;
+		slot->dirty = false;
+		slots.push_back(slot);
+	}
+	AssignSlot(numAdded++, e);
+}
+
+void EventArray::SetEvent(int index, const Event &e)
+{
+	assert(index >= 0 && index < numAdded);
+	if (index < 0 || index >= numAdded || e.IsNull())
+	{
+		KNET_LOG(LogError, "EventArray::SetEvent: Error! Invalid index %d or event! (%d events in the array)", index, numAdded);
+		return;
+	}
+	AssignSlot(index, e);
+}
+
+void EventArray::AssignSlot(int index, const Event &e)
+{
+	WaitSlot &slot = *slots[index];
+	// The dummy events are never set, so there is no need to wait on them.
+	WSAEVENT event = (e.Type() == EventWaitDummy) ? NULL : e.wsaEvent;
+	if (slot.event == event)
+		return;
+
+	DisarmSlot(slot);
+	slot.event = event;
+	if (event)
+		MarkDirty(slot);
+}
+
+void EventArray::ArmSlot(WaitSlot &slot)
+{
+	assert(!slot.armed);
+	if (!slot.event || !completionPort)
+		return;
+
+	++slot.generation;
+	if (HasWaitCompletionPackets())
+	{
+		if (!slot.waitPacket && NtCreateWaitCompletionPacket(&slot.waitPacket, GENERIC_ALL, NULL) < 0)
+		{
+			KNET_LOG(LogError, "EventArray::ArmSlot: NtCreateWaitCompletionPacket failed for the event at index %d!", slot.index);
+			slot.waitPacket = NULL;
+			return;
+		}
+		// The completion carries the index of the event as its key, and the generation of the wait in place of an OVERLAPPED.
+		LONG status = NtAssociateWaitCompletionPacket(slot.waitPacket, completionPort, slot.event, (PVOID)(ULONG_PTR)slot.index,
+			(PVOID)(ULONG_PTR)slot.generation, 0, 0, NULL);
+		if (status < 0)
+		{
+			KNET_LOG(LogError, "EventArray::ArmSlot: NtAssociateWaitCompletionPacket failed with status 0x%08X for the event at index %d!",
+				(unsigned int)status, slot.index);
+			return;
+		}
+	}
+	else if (!RegisterWaitForSingleObject(&slot.registeredWait, slot.event, &EventArray::RegisteredWaitCallback, &slot, INFINITE,
+		WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD))
+	{
+		KNET_LOG(LogError, "EventArray::ArmSlot: RegisterWaitForSingleObject failed with error %d for the event at index %d!",
+			(int)GetLastError(), slot.index);
+		slot.registeredWait = NULL;
+		return;
+	}
+	slot.armed = true;
+}
+
+void EventArray::DisarmSlot(WaitSlot &slot)
+{
+	if (slot.registeredWait)
+	{
+		// Waits until a callback in progress has returned, so the slot is not touched after this.
+		UnregisterWaitEx(slot.registeredWait, INVALID_HANDLE_VALUE);
+		slot.registeredWait = NULL;
+	}
+	if (slot.armed && slot.waitPacket)
+		NtCancelWaitCompletionPacket(slot.waitPacket, TRUE); // Also removes the completion from the port if it was already queued.
+	// If the completion of this wait was queued anyway, it is recognized as stale by its generation.
+	++slot.generation;
+	slot.armed = false;
+}
+
+VOID CALLBACK EventArray::RegisteredWaitCallback(PVOID context, BOOLEAN /*timedOut*/)
+{
+	WaitSlot *slot = (WaitSlot*)context;
+	PostQueuedCompletionStatus(slot->owner->completionPort, 0, (ULONG_PTR)slot->index, (LPOVERLAPPED)(ULONG_PTR)slot->generation);
+}
+
+int EventArray::Wait(int msecs, std::vector<int> &signalledIndices)
+{
+	signalledIndices.clear();
+	if (numAdded == 0 || !completionPort)
+		return WaitFailed;
+
+	// Stop waiting on the slots that were left over when the array shrunk.
+	for(size_t i = numAdded; i < slots.size(); ++i)
+		if (slots[i]->event)
+		{
+			DisarmSlot(*slots[i]);
+			slots[i]->event = NULL;
+		}
+
+	for(size_t i = 0; i < dirtySlots.size(); ++i)
+	{
+		WaitSlot &slot = *slots[dirtySlots[i]];
+		slot.dirty = false;
+		if (slot.index < numAdded && !slot.armed)
+			ArmSlot(slot);
+	}
+	dirtySlots.clear();
+
+	ULONG numRemoved = 0;
+	if (!GetQueuedCompletionStatusEx(completionPort, &completions[0], cMaxCompletionsPerWait, &numRemoved, (DWORD)msecs, TRUE))
+	{
+		DWORD error = GetLastError();
+		if (error == WAIT_TIMEOUT || error == WAIT_IO_COMPLETION)
+			return WaitTimedOut;
+		KNET_LOG(LogError, "EventArray::Wait: GetQueuedCompletionStatusEx failed with error %d!", (int)error);
+		return WaitFailed;
+	}
+
+	for(ULONG i = 0; i < numRemoved; ++i)
+	{
+		const int index = (int)completions[i].lpCompletionKey;
+		if (index < 0 || index >= (int)slots.size())
+			continue;
+		WaitSlot &slot = *slots[index];
+		if ((u32)(ULONG_PTR)completions[i].lpOverlapped != slot.generation || !slot.armed)
+			continue; // A completion of a wait that was cancelled.
+
+		// The wait has fired and ended. Wait on the event again at the next call, by when it has been reset if it was consumed.
+		slot.armed = false;
+		if (slot.registeredWait)
+		{
+			UnregisterWait(slot.registeredWait);
+			slot.registeredWait = NULL;
+		}
+		MarkDirty(slot);
+		if (index < numAdded)
+			signalledIndices.push_back(index);
+	}
+	return signalledIndices.empty() ? WaitTimedOut : (int)signalledIndices.size();
+}
+
+int EventArray::Wait(int msecs)
+{
+	std::vector<int> signalledIndices;
+	int ret = Wait(msecs, signalledIndices);
+	if (ret <= 0)
+		return ret;
+
+	// Report the smallest index. The events of the others stay set, so they are reported again at the next wait.
+	int index = signalledIndices[0];
+	for(size_t i = 1; i < signalledIndices.size(); ++i)
+		if (signalledIndices[i] < index)
+			index = signalledIndices[i];
+	return index;
+}
+
+} // ~kNet
+
+#endif // ~KNET_USE_IOCP
@@ -72,12 +72,14 @@ void Thread::Stop()
 		threadHoldEvent.Close();
 		threadHoldEventAcked.Close();
 		threadResumeEvent.Close();
+	threadInterruptEvent.Close();
 
 		delete invoker;
 		invoker = 0;
 		return;
 	}
 
+	Interrupt();
 	kNet::Clock::Sleep(10);
 	assert(threadHandle != 0);
 
@@ -119,6 +121,7 @@ void Thread::Stop()
 	threadHoldEvent.Close();
 	threadHoldEventAcked.Close();
 	threadResumeEvent.Close();
+	threadInterruptEvent.Close();
 }
 
 DWORD WINAPI ThreadEntryPoint(LPVOID lpParameter)
@@ -167,6 +170,7 @@ void Thread::StartThread()
 	threadHoldEvent = CreateNewEvent(EventWaitSignal);
 	threadHoldEventAcked = CreateNewEvent(EventWaitSignal);
 	threadResumeEvent = CreateNewEvent(EventWaitSignal);
+	threadInterruptEvent = CreateNewEvent(EventWaitSignal);
 
 	threadEnabled = true;
 	threadHandle = CreateThread(NULL, 0, ThreadEntryPoint, this, 0, &threadId);
@@ -184,6 +188,18 @@ void Thread::Sleep(int msecs)
 	Clock::Sleep(msecs);
 }
 
+void Thread::YieldTimeSlice()
+{
+	SwitchToThread();
+}
+
+int Thread::NumHardwareThreads()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (info.dwNumberOfProcessors > 0) ? (int)info.dwNumberOfProcessors : 1;
+}
+
 ThreadId Thread::Id()
 {
 	return threadId;
@@ -0,0 +1,68 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file CRC32CTest.cpp
+	@brief */
+
+#include <cstring>
+#include <vector>
+
+#include "kNet/CRC32C.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+void CRC32CTest()
+{
+	TEST("CRC32C")
+	// The check value of the CRC-32C parameters, and the test vectors of RFC 3720, appendix B.4.
+	assert(CRC32C("123456789", 9) == 0xE3069283);
+	assert(CRC32CPortable("123456789", 9) == 0xE3069283);
+	u8 block[32];
+	memset(block, 0, sizeof(block));
+	assert(CRC32C(block, sizeof(block)) == 0x8A9136AA);
+	memset(block, 0xFF, sizeof(block));
+	assert(CRC32C(block, sizeof(block)) == 0x62A8AB43);
+	for(int i = 0; i < 32; ++i)
+		block[i] = (u8)i;
+	assert(CRC32C(block, sizeof(block)) == 0x46DD794E);
+	for(int i = 0; i < 32; ++i)
+		block[i] = (u8)(31 - i);
+	assert(CRC32C(block, sizeof(block)) == 0x113FDB5C);
+	assert(CRC32C(0, 0) == 0);
+
+	// The accelerated and the portable checksums agree at every length and alignment, and can be computed in parts.
+	std::vector<u8> data(1500 + 8);
+	for(size_t i = 0; i < data.size(); ++i)
+		data[i] = (u8)(i * 131 + (i >> 3));
+	for(size_t offset = 0; offset < 8; ++offset)
+		for(size_t size = 0; size + offset <= data.size(); size += (size < 64 ? 1 : 37))
+		{
+			const u32 crc = CRC32C(&data[offset], size);
+			assert(crc == CRC32CPortable(&data[offset], size));
+			const size_t half = size / 3;
+			assert(CRC32C(&data[offset + half], size - half, CRC32C(&data[offset], half)) == crc);
+		}
+
+	// A flipped bit changes the checksum.
+	const u32 crc = CRC32C(&data[0], 1400);
+	for(int bit = 0; bit < 1400 * 8; bit += 97)
+	{
+		data[bit / 8] ^= (u8)(1 << (bit & 7));
+		assert(CRC32C(&data[0], 1400) != crc);
+		data[bit / 8] ^= (u8)(1 << (bit & 7));
+	}
+	ENDTEST()
+}
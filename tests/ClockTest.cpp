@@ -0,0 +1,99 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file ClockTest.cpp
+	@brief Tests the clock source and the cached loop tick of Clock. */
+
+#include <time.h>
+
+#include "kNet/Clock.h"
+#include "kNet/Thread.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+volatile bool otherThreadSawCachedTick = true;
+volatile bool otherThreadDone = false;
+tick_t mainThreadLoopTick = 0;
+
+void ReadLoopTickOnOtherThread()
+{
+	// The loop tick is cached per thread, so this thread reads the current tick.
+	otherThreadSawCachedTick = (Clock::LoopTick() == mainThreadLoopTick);
+	otherThreadDone = true;
+}
+
+}
+
+void ClockTest()
+{
+	TEST("Clock")
+
+	// The ticks never decrease.
+	tick_t prevTick = Clock::Tick();
+	for(int i = 0; i < 100000; ++i)
+	{
+		const tick_t tick = Clock::Tick();
+		assert(tick >= prevTick);
+		prevTick = tick;
+	}
+
+	// The tick rate agrees with the system clock. Sleeping can only take longer than asked for.
+	assert(Clock::TicksPerSec() >= 1000);
+	const tick_t sleepStart = Clock::Tick();
+	Clock::Sleep(20);
+	const double sleepSecs = Clock::SecondsSinceD(sleepStart);
+	assert(sleepSecs >= 0.019 && sleepSecs < 1.0);
+
+	// Without a cached loop tick, the loop tick is the current tick.
+	Clock::ClearLoopTick();
+	const tick_t before = Clock::Tick();
+	const tick_t loopTick = Clock::LoopTick();
+	assert(loopTick >= before && loopTick <= Clock::Tick());
+
+	mainThreadLoopTick = Clock::UpdateLoopTick();
+	Clock::Sleep(2);
+	assert(Clock::LoopTick() == mainThreadLoopTick);
+	assert(Clock::IsNewer(Clock::Tick(), mainThreadLoopTick) && Clock::Tick() != mainThreadLoopTick);
+
+	Thread thread;
+	thread.RunFunc(ReadLoopTickOnOtherThread);
+	while(!otherThreadDone)
+		Clock::Sleep(1);
+	thread.Stop();
+	assert(!otherThreadSawCachedTick);
+
+	assert(Clock::UpdateLoopTick() != mainThreadLoopTick);
+	Clock::ClearLoopTick();
+	assert(Clock::LoopTick() != mainThreadLoopTick);
+
+#ifdef __linux__
+	// A wall clock time converts to a tick that is as far in the past, and the times out of range to the current tick.
+	timespec realNow;
+	clock_gettime(CLOCK_REALTIME, &realNow);
+	const tick_t convertStart = Clock::Tick();
+	const tick_t tenMSecsAgo = Clock::TickFromRealTime(realNow.tv_sec - (realNow.tv_nsec < 10000000 ? 1 : 0),
+		(realNow.tv_nsec + 1000000000 - 10000000) % 1000000000);
+	const double ageMSecs = Clock::TimespanToMillisecondsD(tenMSecsAgo, convertStart);
+	assert(Clock::IsNewer(convertStart, tenMSecsAgo));
+	assert(ageMSecs > 5.0 && ageMSecs <= 10.5);
+	assert(Clock::IsNewer(Clock::TickFromRealTime(realNow.tv_sec + 10, 0), convertStart));
+	assert(Clock::IsNewer(Clock::TickFromRealTime(realNow.tv_sec - 10, 0), convertStart));
+#endif
+
+	ENDTEST()
+}
@@ -0,0 +1,217 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file CongestionControlTest.cpp
+	@brief Tests the window and pacing decisions of the congestion controllers against a simulated bottleneck link. */
+
+#include <deque>
+#include <algorithm>
+
+#include "kNet/CongestionControl.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+const size_t datagramSize = 1000;
+
+SentDatagramInfo MakeDatagram(tick_t sentTick, bool appLimited = false)
+{
+	SentDatagramInfo info;
+	info.sentTick = sentTick;
+	info.numBytes = datagramSize;
+	info.delivered = 0;
+	info.deliveredTick = sentTick;
+	info.appLimited = appLimited;
+	return info;
+}
+
+struct InFlightDatagram
+{
+	SentDatagramInfo info;
+	tick_t ackTick;
+};
+
+/// Sends datagrams as fast as the controller allows over a link of the given bandwidth and round trip time,
+/// and feeds the acks back to the controller.
+void SimulateLink(CongestionControl &cc, tick_t startTick, double bytesPerSec, double rttMSecs, double durationMSecs)
+{
+	const tick_t step = (tick_t)(Clock::TicksPerMillisecond() / 10.0);
+	const tick_t endTick = startTick + (tick_t)(durationMSecs * Clock::TicksPerMillisecond());
+	const tick_t serializationTicks = (tick_t)(datagramSize * (double)Clock::TicksPerSec() / bytesPerSec);
+	const tick_t propagationTicks = (tick_t)(rttMSecs * Clock::TicksPerMillisecond());
+
+	std::deque<InFlightDatagram> inFlight;
+	size_t bytesInFlight = 0;
+	u64 delivered = 0;
+	tick_t lastDeliveredTick = startTick;
+	tick_t linkFreeTick = startTick;
+	tick_t nextSendTick = startTick;
+
+	for(tick_t now = startTick; now < endTick; now += step)
+	{
+		while(!inFlight.empty() && inFlight.front().ackTick <= now)
+		{
+			const SentDatagramInfo info = inFlight.front().info;
+			inFlight.pop_front();
+			bytesInFlight -= info.numBytes;
+			delivered += info.numBytes;
+			lastDeliveredTick = now;
+			cc.OnRttSample(now, (float)Clock::TimespanToMillisecondsD(info.sentTick, now));
+			cc.OnDatagramAcked(now, info, delivered, bytesInFlight);
+		}
+
+		while(nextSendTick <= now && bytesInFlight < cc.CongestionWindow())
+		{
+			if (bytesInFlight == 0)
+				lastDeliveredTick = now;
+			InFlightDatagram d;
+			d.info = MakeDatagram(now);
+			d.info.delivered = delivered;
+			d.info.deliveredTick = lastDeliveredTick;
+			linkFreeTick = std::max(linkFreeTick, now) + serializationTicks;
+			d.ackTick = linkFreeTick + propagationTicks;
+			inFlight.push_back(d);
+			bytesInFlight += datagramSize;
+			nextSendTick += (tick_t)(datagramSize * (double)Clock::TicksPerSec() / cc.PacingRate());
+			nextSendTick = std::max(nextSendTick, now - step);
+		}
+	}
+}
+}
+
+void CongestionControlTest()
+{
+	TEST("CongestionControl")
+	const tick_t start = Clock::Tick() + 1;
+	const tick_t msec = (tick_t)Clock::TicksPerMillisecond();
+
+	{
+		CubicCongestionControl cubic(datagramSize);
+		const size_t initialWindow = cubic.CongestionWindow();
+		assert(initialWindow == 10 * datagramSize);
+		assert(cubic.InSlowStart());
+
+		// Slow start grows the window by each acked datagram, but app-limited acks don't grow it.
+		cubic.OnRttSample(start + 10 * msec, 10.f);
+		cubic.OnDatagramAcked(start + 10 * msec, MakeDatagram(start), datagramSize, 0);
+		assert(cubic.CongestionWindow() == initialWindow + datagramSize);
+		cubic.OnDatagramAcked(start + 10 * msec, MakeDatagram(start, true), 2 * datagramSize, 0);
+		assert(cubic.CongestionWindow() == initialWindow + datagramSize);
+
+		// A loss cuts the window to 70%, and further losses from the same window don't cut it again.
+		const size_t windowBeforeLoss = cubic.CongestionWindow();
+		cubic.OnDatagramLost(start + 20 * msec, MakeDatagram(start + 1 * msec), 0);
+		const size_t windowAfterLoss = cubic.CongestionWindow();
+		assert(windowAfterLoss == (size_t)(windowBeforeLoss * 0.7));
+		assert(!cubic.InSlowStart());
+		cubic.OnDatagramLost(start + 21 * msec, MakeDatagram(start + 2 * msec), 0);
+		assert(cubic.CongestionWindow() == windowAfterLoss);
+		// Acks of datagrams sent before the cut don't grow the window either.
+		cubic.OnDatagramAcked(start + 22 * msec, MakeDatagram(start + 3 * msec), 3 * datagramSize, 0);
+		assert(cubic.CongestionWindow() == windowAfterLoss);
+
+		// The window grows back in congestion avoidance, slower than in slow start.
+		for(int i = 0; i < 100; ++i)
+			cubic.OnDatagramAcked(start + (30 + i) * msec, MakeDatagram(start + (25 + i) * msec), (4 + i) * datagramSize, 0);
+		assert(cubic.CongestionWindow() > windowAfterLoss);
+		assert(cubic.CongestionWindow() < windowAfterLoss + 100 * datagramSize);
+
+		// A loss of a datagram sent after the recovery started cuts the window again.
+		const size_t windowBeforeSecondLoss = cubic.CongestionWindow();
+		cubic.OnDatagramLost(start + 200 * msec, MakeDatagram(start + 150 * msec), 0);
+		assert(cubic.CongestionWindow() < windowBeforeSecondLoss);
+	}
+
+	{
+		// A 1 MB/sec link with a 20 msec round trip, which BBR should measure and leave Startup for.
+		const double bandwidth = 1000000.0;
+		BBRCongestionControl bbr(datagramSize);
+		assert(bbr.CurrentMode() == BBRCongestionControl::Startup);
+		SimulateLink(bbr, start, bandwidth, 20.0, 2000.0);
+		assert(bbr.CurrentMode() != BBRCongestionControl::Startup);
+		assert(bbr.BottleneckBandwidth() > 0.8 * bandwidth && bbr.BottleneckBandwidth() < 1.2 * bandwidth);
+		assert(bbr.MinRtt() >= 20.0 && bbr.MinRtt() < 25.0);
+		// In the steady state, the window stays near two bandwidth-delay products.
+		assert(bbr.CongestionWindow() < (size_t)(3.0 * bandwidth * bbr.MinRtt() / 1000.0));
+	}
+
+	{
+		// Datagrams sent every msec and acked 20 msecs later deliver 1 MB/sec.
+		BandwidthEstimator estimator;
+		assert(estimator.Bandwidth() == 0);
+		for(int i = 0; i < 200; ++i)
+		{
+			SentDatagramInfo info = MakeDatagram(start + i * msec);
+			info.delivered = (u64)std::max(0, i - 19) * datagramSize;
+			info.deliveredTick = start + (i < 20 ? 0 : i) * msec;
+			const tick_t now = start + (i + 20) * msec;
+			estimator.OnRttSample(now, 20.f);
+			estimator.OnDatagramAcked(now, info, (u64)(i + 1) * datagramSize);
+		}
+		assert(estimator.Bandwidth() > 0.95e6 && estimator.Bandwidth() < 1.05e6);
+		assert(estimator.MinRtt() == 20.0);
+		assert(estimator.QueuingDelay() == 0);
+
+		// When the round trip grows to 30 msecs, the datagrams wait 10 msecs in a queue.
+		for(int i = 0; i < 100; ++i)
+			estimator.OnRttSample(start + (300 + i) * msec, 30.f);
+		assert(estimator.MinRtt() == 20.0);
+		assert(estimator.QueuingDelay() > 9.5 && estimator.QueuingDelay() <= 10.0);
+
+		// The min round trip time expires after ten seconds, so a longer path is not taken for a queue for good.
+		estimator.OnRttSample(start + 11000 * msec, 30.f);
+		assert(estimator.MinRtt() == 30.0);
+	}
+
+	{
+		// CUBIC fills the same link, too.
+		CubicCongestionControl cubic(datagramSize);
+		SimulateLink(cubic, start, 1000000.0, 20.0, 500.0);
+		assert(cubic.CongestionWindow() > 20 * datagramSize);
+	}
+
+	{
+		// A Congestion Experienced mark cuts the CUBIC window only to 80%, and once per window like a loss.
+		CubicCongestionControl cubic(datagramSize);
+		cubic.OnRttSample(start + 10 * msec, 10.f);
+		const size_t windowBeforeMark = cubic.CongestionWindow();
+		cubic.OnCongestionMarked(start + 20 * msec, start + 1 * msec, 0);
+		const size_t windowAfterMark = cubic.CongestionWindow();
+		assert(windowAfterMark == (size_t)(windowBeforeMark * 0.8));
+		assert(!cubic.InSlowStart());
+		cubic.OnCongestionMarked(start + 21 * msec, start + 2 * msec, 0);
+		cubic.OnDatagramLost(start + 22 * msec, MakeDatagram(start + 3 * msec), 0);
+		assert(cubic.CongestionWindow() == windowAfterMark);
+
+		// A mark ends BBR Startup before the bandwidth estimate has stopped growing.
+		BBRCongestionControl bbr(datagramSize);
+		SimulateLink(bbr, start, 1000000.0, 20.0, 60.0);
+		assert(bbr.CurrentMode() == BBRCongestionControl::Startup);
+		bbr.OnCongestionMarked(start + 60 * msec, start + 50 * msec, bbr.CongestionWindow());
+		assert(bbr.CurrentMode() == BBRCongestionControl::Drain);
+	}
+
+	{
+		CongestionControl *cc = CongestionControl::Create(CongestionControlBBR, datagramSize);
+		assert(cc->Algorithm() == CongestionControlBBR);
+		assert(cc->PacingRate() > 0);
+		delete cc;
+		cc = CongestionControl::Create(CongestionControlCubic, datagramSize);
+		assert(cc->Algorithm() == CongestionControlCubic);
+		delete cc;
+	}
+	ENDTEST()
+}
@@ -0,0 +1,139 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file ConnectedUDPServerSocketTest.cpp
+	@brief Tests that a UDP server gives its clients connected sockets of their own, and still serves them. */
+
+#include <vector>
+
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPort = 47293;
+
+const message_id_t cMsgPing = 100;
+const message_id_t cMsgPong = 101;
+
+/// Answers each ping with a pong, and keeps the connections it has accepted.
+class EchoServer : public INetworkServerListener, public IMessageHandler
+{
+public:
+	EchoServer():numPings(0) {}
+
+	int numPings;
+	std::vector<MessageConnection *> clients;
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		clients.push_back(connection);
+		connection->RegisterInboundMessageHandler(this);
+	}
+
+	void HandleMessage(MessageConnection *source, packet_id_t, message_id_t messageId, const char *, size_t)
+	{
+		if (messageId != cMsgPing)
+			return;
+		++numPings;
+		NetworkMessage *msg = source->StartNewMessage(cMsgPong, 0);
+		msg->reliable = true;
+		source->EndAndQueueMessage(msg);
+	}
+};
+
+class PongCounter : public IMessageHandler
+{
+public:
+	PongCounter():numPongs(0) {}
+
+	int numPongs;
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t messageId, const char *, size_t)
+	{
+		if (messageId == cMsgPong)
+			++numPongs;
+	}
+};
+
+} // ~unnamed namespace
+
+void ConnectedUDPServerSocketTest()
+{
+	TEST("ConnectedUDPServerSocket")
+
+	EchoServer listener;
+	Network serverNetwork;
+	serverNetwork.SetConnectedUDPServerSockets(true);
+	NetworkServer *server = serverNetwork.StartServer(cServerPort, SocketOverUDP, &listener, true);
+	assert(server);
+
+	Network clientNetwork;
+	PongCounter pongs;
+	const int cNumConnections = 3;
+	Ptr(MessageConnection) connections[cNumConnections];
+	for(int i = 0; i < cNumConnections; ++i)
+	{
+		connections[i] = clientNetwork.Connect("127.0.0.1", cServerPort, SocketOverUDP, &pongs);
+		assert(connections[i]);
+	}
+
+	const int cNumPings = 5;
+	for(int i = 0; i < cNumConnections; ++i)
+		for(int j = 0; j < cNumPings; ++j)
+		{
+			NetworkMessage *msg = connections[i]->StartNewMessage(cMsgPing, 0);
+			msg->reliable = true;
+			connections[i]->EndAndQueueMessage(msg);
+		}
+
+	PolledTimer timer(5000.f);
+	while(!timer.Test() && pongs.numPongs < cNumConnections * cNumPings)
+	{
+		server->Process();
+		for(int i = 0; i < cNumConnections; ++i)
+			connections[i]->Process();
+		Clock::Sleep(1);
+	}
+	assert(listener.numPings == cNumConnections * cNumPings);
+	assert(pongs.numPongs == cNumConnections * cNumPings);
+
+	// Each client has a socket of its own, which is read directly instead of through the listen socket.
+	assert((int)listener.clients.size() == cNumConnections);
+	for(size_t i = 0; i < listener.clients.size(); ++i)
+	{
+		Socket *socket = listener.clients[i]->GetSocket();
+		assert(socket);
+		assert(!socket->IsUDPSlaveSocket());
+		assert(socket->LocalPort() == cServerPort);
+		for(size_t j = 0; j < i; ++j)
+			assert(listener.clients[j]->GetSocket()->GetSocketHandle() != socket->GetSocketHandle());
+	}
+
+	for(int i = 0; i < cNumConnections; ++i)
+	{
+		connections[i]->Close(0);
+		connections[i] = 0;
+	}
+	serverNetwork.StopServer();
+
+	ENDTEST()
+}
@@ -0,0 +1,73 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file ContentIDHashTableTest.cpp
+	@brief */
+
+#include <vector>
+
+#include "kNet/ContentIDHashTable.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+void ContentIDHashTableTest()
+{
+	using namespace kNet;
+
+	TEST("ContentIDHashTable")
+	const int numEntities = 20000;
+	std::vector<int> values(numEntities);
+	ContentIDHashTable<int> table;
+	assert(table.Find(10, 1) == 0);
+
+	// A moving entity sends updates of its position and of its health under the same content ID.
+	for(int i = 0; i < numEntities; ++i)
+	{
+		table.Insert(10, (u32)i + 1, &values[i]);
+		table.Insert(11, (u32)i + 1, &values[numEntities - 1 - i]);
+	}
+	assert(table.Size() == (size_t)numEntities * 2);
+	for(int i = 0; i < numEntities; ++i)
+	{
+		assert(table.Find(10, (u32)i + 1) == &values[i]);
+		assert(table.Find(11, (u32)i + 1) == &values[numEntities - 1 - i]);
+	}
+	assert(table.Find(12, 1) == 0);
+
+	// Replacing a mapping keeps the size.
+	table.Insert(10, 4, &values[0]);
+	assert(table.Find(10, 4) == &values[0]);
+	assert(table.Size() == (size_t)numEntities * 2);
+
+	for(int i = 0; i < numEntities; ++i)
+		table.Remove(11, (u32)i + 1);
+	assert(table.Size() == (size_t)numEntities);
+	assert(table.Find(11, 1) == 0);
+	assert(table.Find(10, 1) == &values[0]);
+
+	// Churn through short-lived content IDs, which leaves tombstones behind for the table to clean up.
+	for(int round = 0; round < 10; ++round)
+		for(int i = 0; i < numEntities; ++i)
+		{
+			table.Insert(12, (u32)(i + numEntities * round) + 1, &values[i]);
+			table.Remove(12, (u32)(i + numEntities * round) + 1);
+		}
+	assert(table.Size() == (size_t)numEntities);
+	assert(table.Find(10, numEntities) == &values[numEntities - 1]);
+
+	table.Clear();
+	assert(table.Size() == 0);
+	assert(table.Find(10, 1) == 0);
+	ENDTEST()
+}
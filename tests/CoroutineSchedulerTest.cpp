@@ -0,0 +1,168 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file CoroutineSchedulerTest.cpp
+	@brief Tests that CoroutineScheduler completes the connects, receives and acks of a connection to a local UDP server. */
+
+#include "kNet/CoroutineScheduler.h"
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPort = 47281;
+
+const message_id_t cMsgRequest = 100;
+const message_id_t cMsgReply = 200;
+const message_id_t cMsgNotice = 201;
+
+/// Answers each request with a notice followed by a reply.
+class ReplyingServer : public INetworkServerListener, public IMessageHandler
+{
+public:
+	ReplyingServer():client(0) {}
+
+	MessageConnection *client;
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		client = connection;
+		connection->RegisterInboundMessageHandler(this);
+	}
+
+	void HandleMessage(MessageConnection *source, packet_id_t, message_id_t messageId, const char *, size_t)
+	{
+		if (messageId != cMsgRequest)
+			return;
+		const message_id_t ids[] = { cMsgNotice, cMsgReply };
+		for(int i = 0; i < 2; ++i)
+		{
+			NetworkMessage *msg = source->StartNewMessage(ids[i], 0);
+			msg->reliable = true;
+			source->EndAndQueueMessage(msg);
+		}
+	}
+};
+
+class TestOperation : public CoroutineScheduler::Operation
+{
+public:
+	explicit TestOperation(CoroutineScheduler::OperationType type):Operation(type), done(false) {}
+
+	bool done;
+
+	void Completed() { done = true; }
+};
+
+/// Polls the scheduler and processes the server until the given operations are done, or a few seconds have passed.
+bool PollUntilDone(CoroutineScheduler &scheduler, NetworkServer *server, TestOperation **operations, int numOperations)
+{
+	PolledTimer timer(5000.f);
+	while(!timer.Test())
+	{
+		server->Process();
+		scheduler.Poll(5);
+		bool allDone = true;
+		for(int i = 0; i < numOperations; ++i)
+			allDone = allDone && operations[i]->done;
+		if (allDone)
+			return true;
+	}
+	return false;
+}
+
+} // ~unnamed namespace
+
+void CoroutineSchedulerTest()
+{
+	TEST("CoroutineScheduler")
+
+	ReplyingServer listener;
+	Network serverNetwork;
+	NetworkServer *server = serverNetwork.StartServer(cServerPort, SocketOverUDP, &listener, true);
+	assert(server);
+
+	Network clientNetwork;
+	CoroutineScheduler scheduler;
+
+	// A connect completes once the server has answered.
+	TestOperation connect(CoroutineScheduler::OperationConnect);
+	connect.network = &clientNetwork;
+	connect.address = "127.0.0.1";
+	connect.port = cServerPort;
+	connect.transport = SocketOverUDP;
+	scheduler.Start(&connect);
+	TestOperation *connectOps[] = { &connect };
+	assert(PollUntilDone(scheduler, server, connectOps, 1));
+	assert(connect.connection);
+	assert(connect.connection->GetConnectionState() == ConnectionOK);
+	Ptr(MessageConnection) connection = connect.connection;
+
+	// The receive of the reply gets it even though the notice arrives first, and the notice goes to the receive of any message.
+	TestOperation reply(CoroutineScheduler::OperationReceive);
+	reply.connection = connection;
+	reply.anyMessageId = false;
+	reply.messageId = cMsgReply;
+	scheduler.Start(&reply);
+	TestOperation any(CoroutineScheduler::OperationReceive);
+	any.connection = connection;
+	scheduler.Start(&any);
+
+	TestOperation ack(CoroutineScheduler::OperationAck);
+	ack.connection = connection;
+	ack.message = connection->StartNewMessage(cMsgRequest, 0);
+	scheduler.Start(&ack);
+
+	TestOperation *exchangeOps[] = { &reply, &any, &ack };
+	assert(PollUntilDone(scheduler, server, exchangeOps, 3));
+	assert(ack.succeeded && ack.ackResult == MessageDelivered);
+	assert(reply.message && reply.message->id == cMsgReply);
+	assert(any.message && any.message->id == cMsgNotice);
+	connection->FreeMessage(reply.message);
+	connection->FreeMessage(any.message);
+	assert(scheduler.NumPendingOperations() == 0);
+
+	// A receive completes without a message once the connection has closed.
+	TestOperation closed(CoroutineScheduler::OperationReceive);
+	closed.connection = connection;
+	scheduler.Start(&closed);
+	connection->Close(0);
+	TestOperation *closedOps[] = { &closed };
+	assert(PollUntilDone(scheduler, server, closedOps, 1));
+	assert(closed.message == 0);
+
+	// A message sent on a closed connection is reported as not delivered.
+	TestOperation dropped(CoroutineScheduler::OperationAck);
+	dropped.connection = connection;
+	dropped.message = connection->StartNewMessage(cMsgRequest, 0);
+	scheduler.Start(&dropped);
+	TestOperation *droppedOps[] = { &dropped };
+	assert(PollUntilDone(scheduler, server, droppedOps, 1));
+	assert(!dropped.succeeded && dropped.ackResult == MessageConnectionClosed);
+	assert(scheduler.NumPendingOperations() == 0);
+
+	connection = 0;
+	connect.connection = 0;
+	reply.connection = any.connection = ack.connection = closed.connection = dropped.connection = 0;
+	serverNetwork.StopServer();
+
+	ENDTEST()
+}
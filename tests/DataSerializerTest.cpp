@@ -23,6 +23,7 @@
 
 #include "kNet/DebugMemoryLeakCheck.h"
 #include "kNet/BitOps.h"
+#include "kNet/Clock.h"
 #include "kNet/DataSerializer.h"
 #include "kNet/DataDeserializer.h"
 
@@ -391,6 +392,488 @@ void ManualDataSerializerTest()
 	cout << "vle2: " << dd.ReadVLE<VLE8_16>() << endl;
 }
 
+/// The byte-at-a-time bit writer DataSerializer used to have. DataSerializer must still produce the very same bytes.
+class ReferenceSerializer
+{
+public:
+	explicit ReferenceSerializer(size_t maxBytes):data(maxBytes + 1, 0), elemOfs(0), bitOfs(0) {}
+
+	void AppendByte(u8 byte)
+	{
+		if (bitOfs == 0)
+			data[elemOfs++] = byte;
+		else
+		{
+			data[elemOfs] = (data[elemOfs] & LSB(bitOfs)) | ((byte & LSB(8-bitOfs)) << bitOfs);
+			data[++elemOfs] = byte >> (8-bitOfs);
+		}
+	}
+
+	void AppendBits(u32 value, int amount)
+	{
+		const u8 *bytes = reinterpret_cast<const u8*>(&value);
+		while(amount >= 8)
+		{
+			AppendByte(*bytes);
+			++bytes;
+			amount -= 8;
+		}
+		u8 remainder = *bytes & LSB(amount);
+		data[elemOfs] = (data[elemOfs] & LSB(bitOfs)) | ((remainder & LSB(8-bitOfs)) << bitOfs);
+		if (bitOfs + amount >= 8)
+			data[++elemOfs] = remainder >> (8-bitOfs);
+		bitOfs = (bitOfs + amount) & 7;
+	}
+
+	template<typename T>
+	void Add(const T &value)
+	{
+		const u8 *bytes = reinterpret_cast<const u8*>(&value);
+		for(size_t i = 0; i < sizeof(value); ++i)
+			AppendByte(bytes[i]);
+	}
+
+	size_t BytesFilled() const { return elemOfs + ((bitOfs != 0) ? 1 : 0); }
+
+	std::vector<char> data;
+	size_t elemOfs;
+	int bitOfs;
+};
+
+/// A field of a random stream: the kind of write, and the value and bit count it uses.
+struct RandomField
+{
+	int kind;
+	u32 value;
+	int amount;
+};
+
+std::vector<RandomField> GenerateRandomFields(unsigned int seed, int numFields)
+{
+	srand(seed);
+	std::vector<RandomField> fields(numFields);
+	for(int i = 0; i < numFields; ++i)
+	{
+		fields[i].kind = rand() % 7;
+		fields[i].value = randu32();
+		fields[i].amount = 1 + rand() % 32;
+	}
+	return fields;
+}
+
+/// Writes the given stream of fields, so that both writers can be fed the same one.
+template<typename Writer>
+void WriteFields(Writer &dst, const std::vector<RandomField> &fields)
+{
+	for(size_t i = 0; i < fields.size(); ++i)
+	{
+		const u32 value = fields[i].value;
+		switch(fields[i].kind)
+		{
+		case 0: dst.AppendBits(value, 1); break;
+		case 1: dst.AppendBits(value, fields[i].amount); break;
+		case 2: dst.template Add<u8>((u8)value); break;
+		case 3: dst.template Add<u16>((u16)value); break;
+		case 4: dst.template Add<u32>(value); break;
+		case 5: dst.template Add<u64>(((u64)value << 32) | ~value); break;
+		case 6: dst.template Add<float>((float)value); break;
+		}
+	}
+}
+
+void DataSerializerMatchesReferenceTest()
+{
+	const int numFields = 2000;
+	for(unsigned int seed = 1; seed <= 50; ++seed)
+	{
+		DataSerializer ds(numFields * 8);
+		ReferenceSerializer ref(numFields * 8);
+		const std::vector<RandomField> fields = GenerateRandomFields(seed, numFields);
+		WriteFields(ds, fields);
+		WriteFields(ref, fields);
+		assert(ds.BytesFilled() == ref.BytesFilled());
+		assert(memcmp(ds.GetData(), &ref.data[0], ds.BytesFilled()) == 0);
+	}
+
+	// The array writes, which copy byte-aligned arrays as a block, and go a word at a time otherwise.
+	for(int bitOffset = 0; bitOffset < 8; ++bitOffset)
+	{
+		u16 values[33];
+		for(int i = 0; i < 33; ++i)
+			values[i] = (u16)randu32();
+		DataSerializer ds(128);
+		ReferenceSerializer ref(128);
+		ds.AppendBits(0x5A, bitOffset);
+		ref.AppendBits(0x5A, bitOffset);
+		ds.AddArray<u16>(values, 33);
+		for(int i = 0; i < 33; ++i)
+			ref.Add<u16>(values[i]);
+		ds.AddString("abc");
+		ref.Add<u8>(3);
+		ref.Add<u8>('a');
+		ref.Add<u8>('b');
+		ref.Add<u8>('c');
+		assert(ds.BytesFilled() == ref.BytesFilled());
+		assert(memcmp(ds.GetData(), &ref.data[0], ds.BytesFilled()) == 0);
+	}
+
+	// A write past the end of the buffer throws instead of overwriting memory.
+	DataSerializer ds(4);
+	ds.AppendBits(1, 3);
+	ds.Add<u16>(0xFFFF);
+	bool threw = false;
+	try
+	{
+		ds.Add<u16>(0xFFFF);
+	} catch(const NetException &)
+	{
+		threw = true;
+	}
+	assert(threw);
+	assert(ds.BitsFilled() == 19);
+}
+
+template<typename Writer>
+double TimeFields(Writer &dst, const std::vector<RandomField> &fields)
+{
+	tick_t start = Clock::Tick();
+	WriteFields(dst, fields);
+	return Clock::MillisecondsSinceD(start);
+}
+
+/// Compares the speed of the word-at-a-time writer to the byte-at-a-time one it replaced.
+void DataSerializerBenchmark()
+{
+	const int numFields = 200000;
+	const std::vector<RandomField> fields = GenerateRandomFields(1, numFields);
+	DataSerializer ds(numFields * 8);
+	ReferenceSerializer ref(numFields * 8);
+	const double dsMSecs = TimeFields(ds, fields);
+	const double refMSecs = TimeFields(ref, fields);
+	cout << "DataSerializer wrote " << numFields << " random fields in " << dsMSecs << " msecs, the byte-at-a-time writer in "
+		<< refMSecs << " msecs." << endl;
+
+	// The same for byte-aligned blocks of u32 values, without the random numbers.
+	std::vector<u32> values(4096);
+	for(size_t i = 0; i < values.size(); ++i)
+		values[i] = randu32();
+	const int numRounds = 200;
+	DataSerializer blocks(values.size() * 4 + 1);
+	ReferenceSerializer refBlocks(values.size() * 4 + 1);
+	tick_t start = Clock::Tick();
+	for(int round = 0; round < numRounds; ++round)
+	{
+		blocks.ResetFill();
+		blocks.AddArray<u32>(&values[0], (u32)values.size());
+	}
+	const double blockMSecs = Clock::MillisecondsSinceD(start);
+	start = Clock::Tick();
+	for(int round = 0; round < numRounds; ++round)
+	{
+		refBlocks.elemOfs = 0;
+		for(size_t i = 0; i < values.size(); ++i)
+			refBlocks.Add<u32>(values[i]);
+	}
+	const double refBlockMSecs = Clock::MillisecondsSinceD(start);
+	assert(memcmp(blocks.GetData(), &refBlocks.data[0], values.size() * 4) == 0);
+	cout << "DataSerializer wrote " << numRounds << " arrays of " << values.size() << " u32s in " << blockMSecs
+		<< " msecs, the byte-at-a-time writer in " << refBlockMSecs << " msecs." << endl;
+}
+
+/// Reads back a stream of fields written by WriteFields(), and returns how many of them had the wrong value.
+template<bool unchecked>
+int ReadFields(DataDeserializer &src, const std::vector<RandomField> &fields)
+{
+	int numErrors = 0;
+	for(size_t i = 0; i < fields.size(); ++i)
+	{
+		const u32 value = fields[i].value;
+		const int amount = fields[i].amount;
+		switch(fields[i].kind)
+		{
+		case 0: numErrors += ((unchecked ? src.ReadBitsUnchecked(1) : src.ReadBits(1)) != (value & 1)) ? 1 : 0; break;
+		case 1: numErrors += ((unchecked ? src.ReadBitsUnchecked(amount) : src.ReadBits(amount)) != (value & (u32)LSB(amount))) ? 1 : 0; break;
+		case 2: numErrors += ((unchecked ? src.ReadUnchecked<u8>() : src.Read<u8>()) != (u8)value) ? 1 : 0; break;
+		case 3: numErrors += ((unchecked ? src.ReadUnchecked<u16>() : src.Read<u16>()) != (u16)value) ? 1 : 0; break;
+		case 4: numErrors += ((unchecked ? src.ReadUnchecked<u32>() : src.Read<u32>()) != value) ? 1 : 0; break;
+		case 5: numErrors += ((unchecked ? src.ReadUnchecked<u64>() : src.Read<u64>()) != (((u64)value << 32) | ~value)) ? 1 : 0; break;
+		case 6: numErrors += ((unchecked ? src.ReadUnchecked<float>() : src.Read<float>()) != (float)value) ? 1 : 0; break;
+		}
+	}
+	return numErrors;
+}
+
+/// The byte-at-a-time bit reader DataDeserializer used to have, for comparing the speed of the two.
+u32 ReferenceReadBits(const char *data, size_t &elemOfs, int &bitOfs, int count)
+{
+	u32 var = 0;
+	int bitsFilled = 0;
+	while(count > 0)
+	{
+		int bitsToRead = std::min(std::min(8, count), 8 - bitOfs);
+		u32 readMask = ((1 << bitsToRead) - 1) << bitOfs;
+		var |= (((u32)data[elemOfs] & readMask) >> bitOfs) << bitsFilled;
+		bitsFilled += bitsToRead;
+		bitOfs += bitsToRead;
+		elemOfs += (bitOfs >> 3);
+		bitOfs &= 7;
+		count -= bitsToRead;
+	}
+	return var;
+}
+
+void DataDeserializerReadsTest()
+{
+	const int numFields = 2000;
+	for(unsigned int seed = 1; seed <= 50; ++seed)
+	{
+		const std::vector<RandomField> fields = GenerateRandomFields(seed, numFields);
+		DataSerializer ds(numFields * 8);
+		WriteFields(ds, fields);
+
+		DataDeserializer checked(ds.GetData(), ds.BytesFilled());
+		assert(ReadFields<false>(checked, fields) == 0);
+		assert(checked.BitsReadTotal() == ds.BitsFilled());
+
+		DataDeserializer unchecked(ds.GetData(), ds.BytesFilled());
+		unchecked.RequireBits(ds.BitsFilled());
+		assert(ReadFields<true>(unchecked, fields) == 0);
+		assert(unchecked.BitsReadTotal() == ds.BitsFilled());
+	}
+
+	// Arrays, both byte-aligned and not.
+	for(int bitOffset = 0; bitOffset < 8; ++bitOffset)
+	{
+		u32 values[17];
+		for(int i = 0; i < 17; ++i)
+			values[i] = randu32();
+		DataSerializer ds(128);
+		ds.AppendBits(0, bitOffset);
+		ds.AddArray<u32>(values, 17);
+		DataDeserializer dd(ds.GetData(), ds.BytesFilled());
+		dd.SkipBits(bitOffset);
+		u32 readValues[17];
+		dd.ReadArray<u32>(readValues, 17);
+		assert(memcmp(values, readValues, sizeof(values)) == 0);
+		assert(dd.BitsLeft() < 8);
+	}
+
+	// A stream that is too short throws, and does not move the read position.
+	const char shortStream[3] = { 1, 2, 3 };
+	DataDeserializer dd(shortStream, 3);
+	dd.ReadBits(3);
+	bool threw = false;
+	try
+	{
+		dd.RequireBits(22);
+	} catch(const NetException &)
+	{
+		threw = true;
+	}
+	assert(threw);
+	dd.RequireBits(21);
+	threw = false;
+	try
+	{
+		dd.Read<u32>();
+	} catch(const NetException &)
+	{
+		threw = true;
+	}
+	assert(threw);
+	assert(dd.BitsReadTotal() == 3);
+	assert(dd.ReadUnchecked<u16>() == ((0x030201 >> 3) & 0xFFFF));
+}
+
+/// Compares the speed of checked and unchecked reads to the byte-at-a-time reader they replaced.
+void DataDeserializerBenchmark()
+{
+	const int numFields = 200000;
+	std::vector<RandomField> fields = GenerateRandomFields(2, numFields);
+	for(size_t i = 0; i < fields.size(); ++i)
+		fields[i].kind = 1; // Bit fields of random lengths only.
+	DataSerializer ds(numFields * 8);
+	WriteFields(ds, fields);
+
+	tick_t start = Clock::Tick();
+	DataDeserializer checked(ds.GetData(), ds.BytesFilled());
+	int numErrors = ReadFields<false>(checked, fields);
+	const double checkedMSecs = Clock::MillisecondsSinceD(start);
+
+	start = Clock::Tick();
+	DataDeserializer unchecked(ds.GetData(), ds.BytesFilled());
+	unchecked.RequireBits(ds.BitsFilled());
+	numErrors += ReadFields<true>(unchecked, fields);
+	const double uncheckedMSecs = Clock::MillisecondsSinceD(start);
+
+	start = Clock::Tick();
+	size_t elemOfs = 0;
+	int bitOfs = 0;
+	for(size_t i = 0; i < fields.size(); ++i)
+		numErrors += (ReferenceReadBits(ds.GetData(), elemOfs, bitOfs, fields[i].amount) != (fields[i].value & (u32)LSB(fields[i].amount))) ? 1 : 0;
+	const double refMSecs = Clock::MillisecondsSinceD(start);
+
+	assert(numErrors == 0);
+	cout << "DataDeserializer read " << numFields << " random bit fields in " << checkedMSecs << " msecs, unchecked in "
+		<< uncheckedMSecs << " msecs, the byte-at-a-time reader in " << refMSecs << " msecs." << endl;
+}
+
+float randfloat(float minValue, float maxValue)
+{
+	return minValue + (float)rand() * (maxValue - minValue) / (float)RAND_MAX;
+}
+
+/// Writes the given values with the scalar and the array variant of each quantizing function, and checks that the two
+/// streams are identical, and that both read functions give back identical floats.
+void QuantizedArraysMatchScalarTest(const std::vector<float> &values, int bitOffset)
+{
+	const size_t count = values.size();
+	const size_t numVectors = count / 3;
+	DataSerializer scalar(count * 32 + 16);
+	DataSerializer array(count * 32 + 16);
+	scalar.AppendBits(0x3A, bitOffset);
+	array.AppendBits(0x3A, bitOffset);
+	for(int numBits = 1; numBits <= 30; numBits += 7)
+	{
+		for(size_t i = 0; i < count; ++i)
+			scalar.AddQuantizedFloat(-50.f, 75.f, numBits, values[i]);
+		array.AddQuantizedFloatArray(-50.f, 75.f, numBits, &values[0], count);
+	}
+	for(size_t i = 0; i < count; ++i)
+		scalar.AddUnsignedFixedPoint(6, 10, values[i]);
+	array.AddUnsignedFixedPointArray(6, 10, &values[0], count);
+	for(size_t i = 0; i < count; ++i)
+		scalar.AddSignedFixedPoint(8, 12, values[i]);
+	array.AddSignedFixedPointArray(8, 12, &values[0], count);
+	std::vector<float> xyz(numVectors * 3);
+	for(size_t i = 0; i < numVectors; ++i)
+	{
+		float x = values[i*3], y = values[i*3+1], z = values[i*3+2];
+		const float length = sqrt(x*x + y*y + z*z);
+		xyz[i*3] = (length > 0.f) ? x / length : 1.f;
+		xyz[i*3+1] = (length > 0.f) ? y / length : 0.f;
+		xyz[i*3+2] = (length > 0.f) ? z / length : 0.f;
+		scalar.AddNormalizedVector3D(xyz[i*3], xyz[i*3+1], xyz[i*3+2], 11, 10);
+	}
+	if (numVectors > 0)
+		array.AddNormalizedVector3DArray(&xyz[0], numVectors, 11, 10);
+
+	assert(scalar.BitsFilled() == array.BitsFilled());
+	assert(memcmp(scalar.GetData(), array.GetData(), scalar.BytesFilled()) == 0);
+
+	DataDeserializer scalarReader(scalar.GetData(), scalar.BytesFilled());
+	DataDeserializer arrayReader(array.GetData(), array.BytesFilled());
+	scalarReader.SkipBits(bitOffset);
+	arrayReader.SkipBits(bitOffset);
+	std::vector<float> scalarValues(count + 1);
+	std::vector<float> arrayValues(count + 1);
+	for(int numBits = 1; numBits <= 30; numBits += 7)
+	{
+		for(size_t i = 0; i < count; ++i)
+			scalarValues[i] = scalarReader.ReadQuantizedFloat(-50.f, 75.f, numBits);
+		arrayReader.ReadQuantizedFloatArray(-50.f, 75.f, numBits, &arrayValues[0], count);
+		assert(memcmp(&scalarValues[0], &arrayValues[0], count * sizeof(float)) == 0);
+	}
+	for(size_t i = 0; i < count; ++i)
+		scalarValues[i] = scalarReader.ReadUnsignedFixedPoint(6, 10);
+	arrayReader.ReadUnsignedFixedPointArray(6, 10, &arrayValues[0], count);
+	assert(memcmp(&scalarValues[0], &arrayValues[0], count * sizeof(float)) == 0);
+	for(size_t i = 0; i < count; ++i)
+		scalarValues[i] = scalarReader.ReadSignedFixedPoint(8, 12);
+	arrayReader.ReadSignedFixedPointArray(8, 12, &arrayValues[0], count);
+	assert(memcmp(&scalarValues[0], &arrayValues[0], count * sizeof(float)) == 0);
+	for(size_t i = 0; i < numVectors; ++i)
+		scalarReader.ReadNormalizedVector3D(11, 10, scalarValues[i*3], scalarValues[i*3+1], scalarValues[i*3+2]);
+	if (numVectors > 0)
+		arrayReader.ReadNormalizedVector3DArray(11, 10, &arrayValues[0], numVectors);
+	assert(memcmp(&scalarValues[0], &arrayValues[0], numVectors * 3 * sizeof(float)) == 0);
+	assert(scalarReader.BitsLeft() == arrayReader.BitsLeft());
+	assert(arrayReader.BitsLeft() < 8);
+}
+
+void QuantizedArrayTest()
+{
+	for(int round = 0; round < 20; ++round)
+	{
+		// Sizes that leave a remainder for the scalar tail of the SIMD loops, and span several batches.
+		std::vector<float> values(rand() % 1100);
+		for(size_t i = 0; i < values.size(); ++i)
+			values[i] = randfloat(-200.f, 200.f);
+		// The edges of the ranges, and values that are clamped.
+		const float edges[] = { -50.f, 75.f, 0.f, -0.f, 64.f, -128.f, 128.f, 1e30f, -1e30f, 63.99999f };
+		for(size_t i = 0; i < sizeof(edges)/sizeof(edges[0]) && i < values.size(); ++i)
+			values[rand() % values.size()] = edges[i];
+		QuantizedArraysMatchScalarTest(values, round % 8);
+	}
+
+	// Reading past the end of the stream throws.
+	DataSerializer ds(16);
+	const float values[4] = { 1.f, 2.f, 3.f, 4.f };
+	ds.AddQuantizedFloatArray(0.f, 10.f, 10, values, 4);
+	DataDeserializer dd(ds.GetData(), ds.BytesFilled());
+	float readValues[5];
+	bool threw = false;
+	try
+	{
+		dd.ReadQuantizedFloatArray(0.f, 10.f, 10, readValues, 5);
+	} catch(const NetException &)
+	{
+		threw = true;
+	}
+	assert(threw);
+	assert(dd.BitsReadTotal() == 0);
+}
+
+/// Compares the speed of the array variants to calling the scalar functions in a loop.
+void QuantizedArrayBenchmark()
+{
+	const size_t numVectors = 4096;
+	const int numRounds = 50;
+	std::vector<float> positions(numVectors * 3);
+	for(size_t i = 0; i < positions.size(); ++i)
+		positions[i] = randfloat(-1000.f, 1000.f);
+	DataSerializer ds(numVectors * 12);
+
+	tick_t start = Clock::Tick();
+	for(int round = 0; round < numRounds; ++round)
+	{
+		ds.ResetFill();
+		for(size_t i = 0; i < positions.size(); ++i)
+			ds.AddQuantizedFloat(-1000.f, 1000.f, 20, positions[i]);
+	}
+	const double scalarMSecs = Clock::MillisecondsSinceD(start);
+
+	start = Clock::Tick();
+	for(int round = 0; round < numRounds; ++round)
+	{
+		ds.ResetFill();
+		ds.AddQuantizedFloatArray(-1000.f, 1000.f, 20, &positions[0], positions.size());
+	}
+	const double arrayMSecs = Clock::MillisecondsSinceD(start);
+
+	std::vector<float> readPositions(positions.size());
+	start = Clock::Tick();
+	for(int round = 0; round < numRounds; ++round)
+	{
+		DataDeserializer dd(ds.GetData(), ds.BytesFilled());
+		for(size_t i = 0; i < readPositions.size(); ++i)
+			readPositions[i] = dd.ReadQuantizedFloat(-1000.f, 1000.f, 20);
+	}
+	const double scalarReadMSecs = Clock::MillisecondsSinceD(start);
+
+	start = Clock::Tick();
+	for(int round = 0; round < numRounds; ++round)
+	{
+		DataDeserializer dd(ds.GetData(), ds.BytesFilled());
+		dd.ReadQuantizedFloatArray(-1000.f, 1000.f, 20, &readPositions[0], readPositions.size());
+	}
+	const double arrayReadMSecs = Clock::MillisecondsSinceD(start);
+
+	cout << "Quantizing " << numRounds << "x" << numVectors << " positions took " << scalarMSecs << " msecs with AddQuantizedFloat, "
+		<< arrayMSecs << " msecs with AddQuantizedFloatArray. Reading them back took " << scalarReadMSecs << " msecs with ReadQuantizedFloat, "
+		<< arrayReadMSecs << " msecs with ReadQuantizedFloatArray." << endl;
+}
+
 void DataSerializerTest()
 {
 	std::cout << "Running randomized DataSerializerTest." << std::endl;
@@ -398,4 +881,13 @@ void DataSerializerTest()
 		RandomizedDataSerializerTest();
 	std::cout << "Running manually written DataSerializerTest." << std::endl;
 	ManualDataSerializerTest();
+	std::cout << "Comparing DataSerializer to the byte-at-a-time writer." << std::endl;
+	DataSerializerMatchesReferenceTest();
+	DataSerializerBenchmark();
+	std::cout << "Testing the checked and unchecked reads of DataDeserializer." << std::endl;
+	DataDeserializerReadsTest();
+	DataDeserializerBenchmark();
+	std::cout << "Testing the quantizing array functions against their scalar counterparts." << std::endl;
+	QuantizedArrayTest();
+	QuantizedArrayBenchmark();
 }
@@ -0,0 +1,114 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file DatagramBufferTest.cpp
+	@brief */
+
+#include <cstdio>
+
+#include "kNet/DatagramBuffer.h"
+#include "kNet/IMessageHandler.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace
+{
+
+class RecordingReleaseHandler : public kNet::IBufferReleaseHandler
+{
+public:
+	RecordingReleaseHandler():numCalls(0), data(0), numBytes(0) {}
+
+	int numCalls;
+	const char *data;
+	size_t numBytes;
+
+	void ReleaseBuffer(const char *data_, size_t numBytes_)
+	{
+		++numCalls;
+		data = data_;
+		numBytes = numBytes_;
+	}
+};
+
+}
+
+void DatagramBufferTest()
+{
+	using namespace kNet;
+
+	TEST("DatagramBuffer")
+	DatagramBuffer::ClearPool();
+	DatagramBuffer *buffer = DatagramBuffer::Allocate(1400);
+	assert(buffer->RefCount() == 1);
+	assert(buffer->Capacity() >= 1400);
+
+	// The buffer stays alive until the last reference is released, after which the pool hands it out again.
+	buffer->AddRef();
+	assert(buffer->RefCount() == 2);
+	buffer->Release();
+	assert(buffer->RefCount() == 1);
+	buffer->Release();
+	DatagramBuffer *reused = DatagramBuffer::Allocate(100);
+	assert(reused == buffer);
+	assert(reused->RefCount() == 1);
+
+	// Buffers for coalesced reads come from their own size class.
+	DatagramBuffer *large = DatagramBuffer::Allocate(65536);
+	assert(large != reused);
+	assert(large->Capacity() >= 65536);
+	large->Release();
+	reused->Release();
+	DatagramBuffer::ClearPool();
+	ENDTEST()
+
+	TEST("DatagramBuffer file mapping")
+	const char *filename = "DatagramBufferTest.tmp";
+	DatagramBuffer *output = DatagramBuffer::MapFileForWriting(filename, 4096);
+	assert(output);
+	assert(output->IsMappedFile());
+	assert(output->Capacity() == 4096);
+	for(int i = 0; i < 4096; ++i)
+		output->Data()[i] = (char)(i * 7);
+	// The file is truncated to its final size when the mapping is released.
+	output->SetFileSize(1000);
+	output->Release();
+
+	DatagramBuffer *input = DatagramBuffer::MapFileForReading(filename);
+	assert(input);
+	assert(input->Capacity() == 1000);
+	for(int i = 0; i < 1000; ++i)
+		assert(input->Data()[i] == (char)(i * 7));
+	input->Release();
+	remove(filename);
+
+	assert(DatagramBuffer::MapFileForReading(filename) == 0);
+	ENDTEST()
+
+	TEST("DatagramBuffer external bytes")
+	// The bytes of the application are referred to in place, and handed back once the last reference is released.
+	static const char bytes[] = "External payload";
+	RecordingReleaseHandler handler;
+	DatagramBuffer *external = DatagramBuffer::WrapExternal(bytes, sizeof(bytes), &handler);
+	assert(external->Data() == bytes);
+	assert(external->Capacity() == sizeof(bytes));
+	assert(!external->IsMappedFile());
+	external->AddRef();
+	external->Release();
+	assert(handler.numCalls == 0);
+	external->Release();
+	assert(handler.numCalls == 1);
+	assert(handler.data == bytes && handler.numBytes == sizeof(bytes));
+	ENDTEST()
+}
@@ -0,0 +1,118 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file DatagramCipherTest.cpp
+	@brief */
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "kNet/DatagramCipher.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+void DatagramCipherTest()
+{
+	TEST("DatagramCipher")
+	u8 key[DatagramCipher::cKeySize];
+	u8 salt[DatagramCipher::cSaltSize];
+	for(size_t i = 0; i < sizeof(key); ++i)
+		key[i] = (u8)(i * 13 + 1);
+	DatagramCipher::GenerateRandomBytes(salt, sizeof(salt));
+
+	DatagramCipher client;
+	DatagramCipher server;
+	assert(!client.HasKey());
+	client.SetKey(key, salt, true);
+	server.SetKey(key, salt, false);
+	assert(client.HasKey() && server.HasKey());
+
+	std::vector<char> plaintext(300);
+	for(size_t i = 0; i < plaintext.size(); ++i)
+		plaintext[i] = (char)(i * 7);
+
+	// A datagram decrypts at the other end, in place or to another buffer, and the ciphertext differs from the plaintext.
+	std::vector<char> datagram(plaintext.size() + DatagramCipher::cOverhead);
+	std::copy(plaintext.begin(), plaintext.end(), datagram.begin());
+	const size_t size = client.Encrypt(&datagram[0], plaintext.size());
+	assert(size == datagram.size());
+	assert(!std::equal(plaintext.begin(), plaintext.end(), datagram.begin()));
+	std::vector<char> decrypted(plaintext.size());
+	assert(server.Decrypt(&datagram[0], size, &decrypted[0]) == (int)plaintext.size());
+	assert(decrypted == plaintext);
+
+	// The sender can't decrypt its own datagrams, since the two directions use different nonces.
+	assert(client.Decrypt(&datagram[0], size, &decrypted[0]) == -1);
+
+	// Encrypting the same datagram again uses a new nonce.
+	std::vector<char> second(datagram.size());
+	std::copy(plaintext.begin(), plaintext.end(), second.begin());
+	client.Encrypt(&second[0], plaintext.size());
+	assert(!std::equal(datagram.begin(), datagram.begin() + plaintext.size(), second.begin()));
+	assert(server.Decrypt(&second[0], size, &second[0]) == (int)plaintext.size());
+	assert(std::equal(plaintext.begin(), plaintext.end(), second.begin()));
+
+	// Any modified or truncated datagram is rejected.
+	const size_t modifiedBytes[] = { 0, plaintext.size() / 2, plaintext.size(), size - 1 };
+	for(size_t i = 0; i < sizeof(modifiedBytes) / sizeof(modifiedBytes[0]); ++i)
+	{
+		std::vector<char> modified = datagram;
+		modified[modifiedBytes[i]] ^= 0x10;
+		assert(server.Decrypt(&modified[0], size, &decrypted[0]) == -1);
+	}
+	assert(server.Decrypt(&datagram[0], size - 1, &decrypted[0]) == -1);
+	assert(server.Decrypt(&datagram[0], DatagramCipher::cOverhead - 1, &decrypted[0]) == -1);
+
+	// The two ends only agree if they share both the key and the salt.
+	u8 otherSalt[DatagramCipher::cSaltSize];
+	memcpy(otherSalt, salt, sizeof(salt));
+	otherSalt[0] ^= 1;
+	DatagramCipher otherServer;
+	otherServer.SetKey(key, otherSalt, false);
+	assert(otherServer.Decrypt(&datagram[0], size, &decrypted[0]) == -1);
+
+	// The tag of a connection attempt depends on the key, the salt and the message.
+	u8 tag[DatagramCipher::cTagSize];
+	u8 tag2[DatagramCipher::cTagSize];
+	DatagramCipher::ComputeTag(key, salt, &plaintext[0], 20, tag);
+	DatagramCipher::ComputeTag(key, salt, &plaintext[0], 20, tag2);
+	assert(DatagramCipher::TagsEqual(tag, tag2));
+	DatagramCipher::ComputeTag(key, otherSalt, &plaintext[0], 20, tag2);
+	assert(!DatagramCipher::TagsEqual(tag, tag2));
+	DatagramCipher::ComputeTag(key, salt, &plaintext[0], 21, tag2);
+	assert(!DatagramCipher::TagsEqual(tag, tag2));
+	// Either end of the connection computes the same tag from the key of the connection.
+	client.ComputeTag(&plaintext[0], 20, tag2);
+	assert(DatagramCipher::TagsEqual(tag, tag2));
+	server.ComputeTag(&plaintext[0], 20, tag2);
+	assert(DatagramCipher::TagsEqual(tag, tag2));
+	key[5] ^= 1;
+	DatagramCipher::ComputeTag(key, salt, &plaintext[0], 20, tag2);
+	assert(!DatagramCipher::TagsEqual(tag, tag2));
+
+	// The two ends of a connection compute the same connection tags, which depend on the number, the message and the key.
+	client.ComputeConnectionTag(12345, &plaintext[0], 20, tag);
+	server.ComputeConnectionTag(12345, &plaintext[0], 20, tag2);
+	assert(DatagramCipher::TagsEqual(tag, tag2));
+	server.ComputeConnectionTag(12346, &plaintext[0], 20, tag2);
+	assert(!DatagramCipher::TagsEqual(tag, tag2));
+	server.ComputeConnectionTag(12345, &plaintext[0], 21, tag2);
+	assert(!DatagramCipher::TagsEqual(tag, tag2));
+	otherServer.ComputeConnectionTag(12345, &plaintext[0], 20, tag2);
+	assert(!DatagramCipher::TagsEqual(tag, tag2));
+	ENDTEST()
+}
@@ -0,0 +1,88 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file DeltaEncodingTest.cpp
+	@brief */
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "kNet/DeltaEncoding.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+/// Encodes and decodes the given contents against the given baseline, and returns the encoded size.
+size_t RoundTrip(const std::vector<char> &baseline, const std::vector<char> &data)
+{
+	std::vector<char> delta;
+	EncodeDelta(baseline.empty() ? 0 : &baseline[0], baseline.size(), data.empty() ? 0 : &data[0], data.size(), delta);
+	assert(!delta.empty());
+
+	std::vector<char> decoded(1, 'p');
+	assert(DecodeDelta(baseline.empty() ? 0 : &baseline[0], baseline.size(), &delta[0], delta.size(), decoded));
+	assert(decoded.size() == data.size() + 1 && std::equal(data.begin(), data.end(), decoded.begin() + 1));
+	return delta.size();
+}
+}
+
+void DeltaEncodingTest()
+{
+	TEST("DeltaEncoding")
+	std::vector<char> baseline(200);
+	for(size_t i = 0; i < baseline.size(); ++i)
+		baseline[i] = (char)(i * 7);
+
+	// An unchanged state encodes to a few bytes, and a few changed fields to little more than the changed bytes.
+	assert(RoundTrip(baseline, baseline) <= 5);
+	std::vector<char> data = baseline;
+	data[10] ^= 1;
+	data[11] ^= 1;
+	data[100] ^= 1;
+	data[102] ^= 1;
+	assert(RoundTrip(baseline, data) < 16);
+
+	// The contents can grow and shrink, and the baseline can be empty.
+	data.resize(250, 'x');
+	assert(RoundTrip(baseline, data) < 70);
+	data.resize(50);
+	assert(RoundTrip(baseline, data) < 10);
+	RoundTrip(std::vector<char>(), data);
+	RoundTrip(baseline, std::vector<char>());
+
+	// A delta is rejected against a baseline it doesn't fit, and when truncated.
+	std::vector<char> delta;
+	EncodeDelta(&baseline[0], baseline.size(), &baseline[0], baseline.size(), delta);
+	std::vector<char> decoded;
+	assert(!DecodeDelta(&baseline[0], 100, &delta[0], delta.size(), decoded));
+	assert(!DecodeDelta(&baseline[0], baseline.size(), &delta[0], delta.size() - 1, decoded));
+	const char emptyRuns[] = { 0x05, 0x00, 0x00 };
+	assert(!DecodeDelta(&baseline[0], baseline.size(), emptyRuns, sizeof(emptyRuns), decoded));
+
+	// The history keeps each version until the one that is cNumVersions newer replaces it, also over the wrap-around.
+	DeltaBaselineHistory history;
+	assert(history.Find(0) == 0);
+	for(int version = 250; version < 262; ++version)
+		history.Store((u8)version, &baseline[0], (size_t)version - 240);
+	assert(history.Find(253) == 0);
+	assert(history.Find(254) && history.Find(254)->size() == 14);
+	assert(history.Find(5) && history.Find(5)->size() == 21);
+	history.Store(252, &baseline[0], 1); // Older than version 4 in its place.
+	assert(history.Find(252) == 0 && history.Find(4)->size() == 20);
+	ENDTEST()
+}
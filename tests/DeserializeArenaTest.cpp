@@ -0,0 +1,121 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file DeserializeArenaTest.cpp
+	@brief Tests that DeserializeArena reads the arrays and strings written by DataSerializer, and stops allocating once it
+	has grown to fit them. */
+
+#include <cstring>
+#include <string>
+
+#include "kNet/DataSerializer.h"
+#include "kNet/DataDeserializer.h"
+#include "kNet/DeserializeArena.h"
+#include "kNet/NetException.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+/// Returns true if reading an array of the given count from the given bytes throws a NetException.
+bool ArrayThrows(DeserializeArena &arena, const char *data, size_t numBytes, size_t count)
+{
+	DataDeserializer dd(data, numBytes);
+	try
+	{
+		arena.ReadArray<u32>(dd, count);
+	} catch(const NetException &)
+	{
+		return true;
+	}
+	return false;
+}
+
+}
+
+void DeserializeArenaTest()
+{
+	TEST("DeserializeArena")
+
+	// Serialize a u8, a string, a u16-counted u32 array and a string with a control character.
+	char buffer[256];
+	DataSerializer ds(buffer, sizeof(buffer));
+	const u32 ids[5] = { 1, 70000, 3, 0xFFFFFFFF, 42 };
+	ds.Add<u8>(7);
+	ds.AddString("hello");
+	ds.Add<u16>(5);
+	ds.AddArray<u32>(ids, 5);
+	ds.AddString("a\x01z");
+
+	DeserializeArena arena(16);
+	assert(arena.NumBlocks() == 0);
+	for(int round = 0; round < 3; ++round)
+	{
+		DataDeserializer dd(buffer, ds.BytesFilled());
+		assert(dd.Read<u8>() == 7);
+		ArenaString text = arena.ReadString(dd);
+		assert(text.length() == 5);
+		assert(!strcmp(text.c_str(), "hello"));
+		assert(text.ToString() == "hello");
+
+		ArenaArray<u32> idArray = arena.ReadArray<u32>(dd, dd.Read<u16>());
+		assert(idArray.size() == 5);
+		for(size_t i = 0; i < idArray.size(); ++i)
+			assert(idArray[i] == ids[i]);
+		assert(((size_t)idArray.begin() & (sizeof(u32) - 1)) == 0);
+
+		ArenaString sanitized = arena.ReadString(dd);
+		assert(!strcmp(sanitized.c_str(), "a z"));
+		assert(dd.BytesLeft() == 0);
+		assert(arena.BytesUsed() >= 6 + 5 * sizeof(u32) + 4);
+
+		// The first round outgrows the 16 bytes, and the blocks are merged into one when it is reset.
+		assert(arena.NumBlocks() == (round == 0 ? 2 : 1));
+		arena.Reset();
+		assert(arena.NumBlocks() == 1);
+		assert(arena.BytesUsed() == 0);
+	}
+
+	// A count larger than what is left in the stream throws before the arena grows.
+	const size_t capacity = arena.Capacity();
+	assert(ArrayThrows(arena, (const char *)ids, sizeof(ids), 6));
+	assert(ArrayThrows(arena, (const char *)ids, sizeof(ids), (size_t)-1 / 2));
+	assert(!ArrayThrows(arena, (const char *)ids, sizeof(ids), 5));
+	assert(arena.Capacity() == capacity);
+
+	// A string whose length does not fit in the stream throws.
+	DataDeserializer truncated(buffer + 1, 4);
+	bool threw = false;
+	try
+	{
+		arena.ReadString(truncated);
+	} catch(const NetException &)
+	{
+		threw = true;
+	}
+	assert(threw);
+
+	// An ArenaString serializes the same way as a std::string.
+	char copy[64];
+	DataSerializer copyDs(copy, sizeof(copy));
+	const ArenaString hello("hello", 5);
+	TypeSerializer<ArenaString>::SerializeTo(copyDs, hello);
+	assert(copyDs.BytesFilled() == TypeSerializer<ArenaString>::Size(hello));
+	assert(copyDs.BytesFilled() == 6 && !memcmp(copy, buffer + 1, 6));
+
+	ENDTEST()
+}
@@ -0,0 +1,119 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file ECNTest.cpp
+	@brief Tests that the Congestion Experienced marks a UDP server receives are echoed back to the client in the acks. */
+
+#include <vector>
+
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/UDPMessageConnection.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPort = 47301;
+
+const message_id_t cMsgData = 100;
+
+class DataServer : public INetworkServerListener, public IMessageHandler
+{
+public:
+	DataServer():numMessages(0) {}
+
+	std::vector<MessageConnection *> clients;
+	int numMessages;
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		clients.push_back(connection);
+		connection->RegisterInboundMessageHandler(this);
+	}
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t messageId, const char *, size_t)
+	{
+		if (messageId == cMsgData)
+			++numMessages;
+	}
+};
+
+} // ~unnamed namespace
+
+void ECNTest()
+{
+	TEST("ECN")
+
+#ifdef __linux__
+	DataServer listener;
+	Network serverNetwork;
+	NetworkServer *server = serverNetwork.StartServer(cServerPort, SocketOverUDP, &listener, true);
+	assert(server);
+
+	Network clientNetwork;
+	Ptr(MessageConnection) connection = clientNetwork.Connect("127.0.0.1", cServerPort, SocketOverUDP, 0);
+	assert(connection);
+	UDPMessageConnection *udpConnection = static_cast<UDPMessageConnection *>(connection.ptr());
+	assert(connection->GetSocket()->ECNEnabled());
+
+	PolledTimer timer(5000.f);
+	while(!timer.Test() && listener.clients.empty())
+	{
+		server->Process();
+		connection->Process();
+		Clock::Sleep(1);
+	}
+	assert(listener.clients.size() == 1);
+	UDPMessageConnection *serverConnection = static_cast<UDPMessageConnection *>(listener.clients[0]);
+	assert(serverConnection->NumCongestionMarksReceived() == 0);
+
+	// Mark the datagrams of the client the way a congested router would.
+	int tos = ECNCongestionExperienced;
+	assert(setsockopt(connection->GetSocket()->GetSocketHandle(), IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) == 0);
+
+	const int cNumMessages = 50;
+	for(int i = 0; i < cNumMessages; ++i)
+	{
+		NetworkMessage *msg = connection->StartNewMessage(cMsgData, 0);
+		msg->reliable = true;
+		connection->EndAndQueueMessage(msg);
+	}
+	timer.StartMSecs(5000.f);
+	while(!timer.Test() && (listener.numMessages < cNumMessages || udpConnection->NumCongestionMarksReported() == 0))
+	{
+		server->Process();
+		connection->Process();
+		Clock::Sleep(1);
+	}
+	assert(listener.numMessages == cNumMessages);
+	assert(serverConnection->NumCongestionMarksReceived() > 0);
+	assert(udpConnection->NumCongestionMarksReported() > 0);
+	assert(udpConnection->NumCongestionMarksReported() <= serverConnection->NumCongestionMarksReceived());
+	// The datagrams of the server were not marked.
+	assert(udpConnection->NumCongestionMarksReceived() == 0);
+	assert(connection->GetConnectionState() == ConnectionOK);
+
+	connection->Close(0);
+	connection = 0;
+	serverNetwork.StopServer();
+#endif
+
+	ENDTEST()
+}
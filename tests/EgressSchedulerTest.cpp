@@ -0,0 +1,101 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file EgressSchedulerTest.cpp
+	@brief */
+
+#include "kNet/EgressScheduler.h"
+#include "kNet/NetworkMessage.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+void EgressSchedulerTest()
+{
+	using namespace kNet;
+
+	const tick_t msec = Clock::TicksPerMillisecond();
+	const int datagramBytes = 1000;
+
+	TEST("EgressScheduler unlimited")
+	EgressScheduler scheduler;
+	EgressScheduler::Flow flow;
+	assert(!scheduler.IsLimited());
+	assert(scheduler.MSecsUntilSend(flow, 0, Clock::Tick()) == 0);
+	scheduler.Consume(flow, 100000, Clock::Tick());
+	assert(scheduler.MSecsUntilSend(flow, 0, Clock::Tick()) == 0);
+	assert(scheduler.BytesSent() == 0);
+	ENDTEST()
+
+	TEST("EgressScheduler weighted shares")
+	// Three saturating connections with the weights 1, 1 and 2 share 1 MB/sec for two seconds.
+	EgressScheduler scheduler;
+	const tick_t start = Clock::Tick();
+	scheduler.SetRate(1000000, start);
+	EgressScheduler::Flow flows[3];
+	flows[2].weight = 2;
+	int bytes[3] = { 0, 0, 0 };
+	for(int ms = 0; ms < 2000; ++ms)
+	{
+		const tick_t now = start + ms * msec;
+		for(int f = 0; f < 3; ++f)
+			while(scheduler.MSecsUntilSend(flows[f], 100, now) == 0)
+			{
+				scheduler.Consume(flows[f], datagramBytes, now);
+				bytes[f] += datagramBytes;
+			}
+	}
+	const int total = bytes[0] + bytes[1] + bytes[2];
+	assert(total >= 1900000 && total <= 2100000);
+	assert(bytes[0] > total / 4 - total / 20 && bytes[0] < total / 4 + total / 20);
+	assert(bytes[1] > total / 4 - total / 20 && bytes[1] < total / 4 + total / 20);
+	assert(bytes[2] > total / 2 - total / 20 && bytes[2] < total / 2 + total / 20);
+	assert(scheduler.BytesSent() == (u64)total);
+	ENDTEST()
+
+	TEST("EgressScheduler critical datagrams go first")
+	// A bulk connection saturates the rate. A connection sends a critical datagram every 10 msecs, and one is never held
+	// back for long.
+	EgressScheduler scheduler;
+	const tick_t start = Clock::Tick();
+	scheduler.SetRate(200000, start);
+	scheduler.SetCriticalPriority(1000);
+	EgressScheduler::Flow bulk, critical;
+	int criticalSent = 0;
+	int maxWaitMSecs = 0;
+	int waitStart = -1;
+	for(int ms = 0; ms < 1000; ++ms)
+	{
+		const tick_t now = start + ms * msec;
+		while(scheduler.MSecsUntilSend(bulk, 10, now) == 0)
+			scheduler.Consume(bulk, datagramBytes, now);
+		if (ms % 10 == 0 && waitStart < 0)
+			waitStart = ms;
+		if (waitStart >= 0 && scheduler.MSecsUntilSend(critical, 1000, now) == 0)
+		{
+			scheduler.Consume(critical, 200, now);
+			++criticalSent;
+			maxWaitMSecs = (ms - waitStart > maxWaitMSecs) ? ms - waitStart : maxWaitMSecs;
+			waitStart = -1;
+		}
+	}
+	assert(criticalSent >= 99);
+	assert(maxWaitMSecs <= 1);
+	// The bulk connection got the rest.
+	assert(scheduler.BytesSent() >= 190000 && scheduler.BytesSent() <= 210000);
+
+	// Removing the limit lets everything through.
+	scheduler.SetRate(0, start + 1000 * msec);
+	assert(scheduler.MSecsUntilSend(bulk, 10, start + 1000 * msec) == 0);
+	ENDTEST()
+}
@@ -0,0 +1,88 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file EndPointHashTableTest.cpp
+	@brief */
+
+#include <vector>
+
+#include "kNet/EndPointHashTable.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace
+{
+kNet::EndPoint TestEndPoint(int i)
+{
+	kNet::EndPoint endPoint;
+	endPoint.ip[0] = 10;
+	endPoint.ip[1] = (unsigned char)(i >> 16);
+	endPoint.ip[2] = (unsigned char)(i >> 8);
+	endPoint.ip[3] = (unsigned char)i;
+	endPoint.port = (unsigned short)(1024 + (i % 7));
+	return endPoint;
+}
+}
+
+void EndPointHashTableTest()
+{
+	using namespace kNet;
+
+	TEST("EndPointHashTable")
+	const int numEndPoints = 20000;
+	std::vector<int> values(numEndPoints);
+	EndPointHashTable<int> table;
+	assert(table.Find(TestEndPoint(0)) == 0);
+
+	for(int i = 0; i < numEndPoints; ++i)
+		table.Insert(TestEndPoint(i), &values[i]);
+	assert(table.Size() == (size_t)numEndPoints);
+	for(int i = 0; i < numEndPoints; ++i)
+		assert(table.Find(TestEndPoint(i)) == &values[i]);
+
+	// Endpoints that only differ by the port are distinct keys.
+	EndPoint otherPort = TestEndPoint(5);
+	otherPort.port = 80;
+	assert(table.Find(otherPort) == 0);
+
+	// Replacing a mapping keeps the size.
+	table.Insert(TestEndPoint(3), &values[4]);
+	assert(table.Find(TestEndPoint(3)) == &values[4]);
+	assert(table.Size() == (size_t)numEndPoints);
+	table.Insert(TestEndPoint(3), &values[3]);
+
+	for(int i = 0; i < numEndPoints; i += 2)
+		table.Remove(TestEndPoint(i));
+	assert(table.Size() == (size_t)numEndPoints / 2);
+	for(int i = 1; i < numEndPoints; i += 2)
+		assert(table.Find(TestEndPoint(i)) == &values[i]);
+	for(int i = 0; i < numEndPoints; i += 2)
+		assert(table.Find(TestEndPoint(i)) == 0);
+
+	// Churn through connects and disconnects, which leaves tombstones behind for the table to clean up.
+	for(int round = 0; round < 10; ++round)
+		for(int i = 0; i < numEndPoints; i += 2)
+		{
+			table.Insert(TestEndPoint(i + numEndPoints * (round + 1)), &values[i]);
+			table.Remove(TestEndPoint(i + numEndPoints * (round + 1)));
+		}
+	assert(table.Size() == (size_t)numEndPoints / 2);
+	for(int i = 1; i < numEndPoints; i += 2)
+		assert(table.Find(TestEndPoint(i)) == &values[i]);
+
+	table.Clear();
+	assert(table.Size() == 0);
+	assert(table.Find(TestEndPoint(1)) == 0);
+	ENDTEST()
+}
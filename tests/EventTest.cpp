@@ -15,10 +15,40 @@
 /** @file EventTest.cpp
 	@brief */
 
+#include <vector>
+#if defined(KNET_UNIX) || defined(ANDROID)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "kNet/Event.h"
+#include "kNet/EventArray.h"
+#include "kNet/Thread.h"
+#include "kNet/Clock.h"
+#include "kNet/Atomics.h"
 #include "tassert.h"
 #include "kNet/DebugMemoryLeakCheck.h"
 
+namespace
+{
+
+const long cNumSignals = 20000;
+
+kNet::Event *sharedEvent = 0;
+volatile long numPublished = 0;
+
+/// Publishes a counter value and sets the event after each, like a thread that queues messages for a worker.
+void SetRepeatedly()
+{
+	for(long i = 0; i < cNumSignals; ++i)
+	{
+		AtomicIncrement(&numPublished);
+		sharedEvent->Set();
+	}
+}
+
+}
+
 void EventTest()
 {
 	using namespace kNet;
@@ -62,5 +92,138 @@ void EventTest()
 		assert(!e.Test());
 		assert(!e.Test());
 	}
+
+	// A copy shares the state of the event.
+	Event copy = e;
+	copy.Set();
+	assert(e.Test());
+	assert(e.Wait(10));
+	e.Reset();
+	assert(!copy.Test());
+	assert(!copy.Wait(10));
+
+#if defined(KNET_UNIX) || defined(ANDROID)
+	// A Set() whose write fails takes its raise back, so the event does not look set with nothing to wake up the waiters,
+	// and a Reset() does not wait for the write. The copy writes to a read-only descriptor.
+	{
+		Event failing = e;
+		failing.fd[1] = open("/dev/null", O_RDONLY);
+		assert(failing.fd[1] != -1);
+		failing.Set();
+		close(failing.fd[1]);
+		assert(!e.Test());
+		const tick_t resetStart = Clock::Tick();
+		e.Reset();
+		assert(Clock::MillisecondsSinceD(resetStart) < 100.0);
+		e.Set();
+		assert(e.Wait(10));
+		e.Reset();
+		assert(!e.Wait(10));
+	}
+#endif
+
+	// Another thread sets the event while this one waits on it and resets it. No value is published without a wakeup,
+	// and once the event is cleared, its descriptor is not left readable.
+	sharedEvent = &e;
+	numPublished = 0;
+	Thread setter;
+	setter.RunFunc(SetRepeatedly);
+	long numSeen = 0;
+	const tick_t startTick = Clock::Tick();
+	while(numSeen < cNumSignals && Clock::SecondsSinceD(startTick) < 60.0)
+		if (e.Wait(1000))
+		{
+			e.Reset();
+			numSeen = numPublished;
+		}
+	setter.Stop();
+	assert(numSeen == cNumSignals);
+	e.Reset();
+	assert(!e.Test());
+	assert(!e.Wait(10));
+	sharedEvent = 0;
+
+	e.Close();
+	ENDTEST()
+}
+
+void EventArrayTest()
+{
+	using namespace kNet;
+
+	TEST("EventArray")
+
+#ifdef KNET_USE_EPOLL
+	const int numEvents = 300; // More than what fits into a WSAWaitForMultipleEvents array.
+#else
+	const int numEvents = 32;
+#endif
+	std::vector<Event> events;
+	for(int i = 0; i < numEvents; ++i)
+		events.push_back(CreateNewEvent(EventWaitSignal));
+	Event dummy = CreateNewEvent(EventWaitDummy);
+
+	for(int edgeTriggered = 0; edgeTriggered < 2; ++edgeTriggered)
+	{
+		EventArray ea;
+		ea.SetEdgeTriggered(edgeTriggered != 0);
+
+		ea.AddEvent(dummy);
+		assert(ea.Wait(0) == EventArray::WaitTimedOut);
+
+		for(int round = 0; round < 4; ++round)
+		{
+			ea.Clear();
+			ea.AddEvent(dummy);
+			for(int i = 0; i < numEvents; ++i)
+				ea.AddEvent(events[i]);
+			assert(ea.Size() == numEvents + 1);
+			assert(ea.Wait(0) == EventArray::WaitTimedOut);
+
+			// When several events are set, the one with the smallest index is returned.
+			events[numEvents-1].Set();
+			events[numEvents/2].Set();
+			assert(ea.Wait(10) == numEvents/2 + 1);
+			events[numEvents/2].Reset();
+			assert(ea.Wait(10) == numEvents);
+			events[numEvents-1].Reset();
+			assert(ea.Wait(0) == EventArray::WaitTimedOut);
+
+			// Events that are no longer part of the array are not reported.
+			ea.Clear();
+			ea.AddEvent(events[0]);
+			ea.AddEvent(events[1]);
+			events[2].Set();
+			assert(ea.Wait(0) == EventArray::WaitTimedOut);
+			events[1].Set();
+			assert(ea.Wait(10) == 1);
+			events[1].Reset();
+			events[2].Reset();
+
+			// Replacing the events in place.
+			ea.SetEvent(0, dummy);
+			ea.SetEvent(1, events[2]);
+			events[0].Set();
+			assert(ea.Wait(0) == EventArray::WaitTimedOut);
+			events[2].Set();
+			assert(ea.Wait(10) == 1);
+			ea.SetEvent(0, events[0]);
+			// Re-trigger events[2], since in edge-triggered mode its readiness was already reported above.
+			events[2].Reset();
+			events[2].Set();
+			std::vector<int> signalled;
+			assert(ea.Wait(10, signalled) == 2);
+			assert(signalled.size() == 2);
+			assert((signalled[0] == 0 && signalled[1] == 1) || (signalled[0] == 1 && signalled[1] == 0));
+			events[0].Reset();
+			events[2].Reset();
+			assert(ea.Wait(0, signalled) == EventArray::WaitTimedOut);
+			assert(signalled.empty());
+		}
+	}
+
+	for(int i = 0; i < numEvents; ++i)
+		events[i].Close();
+	dummy.Close();
 	ENDTEST()
 }
@@ -0,0 +1,152 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file FairProcessTest.cpp
+	@brief Tests that NetworkServer::ProcessFor() keeps to its time budget, and that a connection flooding the server with
+	large messages does not hold up the messages of the other connections. */
+
+#include <vector>
+
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPort = 47302;
+
+const message_id_t cMsgLarge = 100;
+const message_id_t cMsgSmall = 101;
+const int cLargeMessageSize = 1000;
+const int cNumLargeMessages = 100;
+const int cNumSmallMessages = 10;
+
+/// Counts the messages of each kind, and takes a while with each large one.
+class SlowServer : public INetworkServerListener, public IMessageHandler
+{
+public:
+	SlowServer():numLarge(0), numSmall(0) {}
+
+	std::vector<MessageConnection *> clients;
+	int numLarge;
+	int numSmall;
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		clients.push_back(connection);
+		connection->RegisterInboundMessageHandler(this);
+	}
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t messageId, const char *, size_t)
+	{
+		if (messageId == cMsgSmall)
+			++numSmall;
+		else if (messageId == cMsgLarge)
+		{
+			++numLarge;
+			const tick_t start = Clock::Tick();
+			while(Clock::TimespanToMillisecondsD(start, Clock::Tick()) < 0.2)
+				;
+		}
+	}
+};
+
+void SendMessages(MessageConnection *connection, message_id_t id, int count, int size)
+{
+	for(int i = 0; i < count; ++i)
+	{
+		NetworkMessage *msg = connection->StartNewMessage(id, size);
+		msg->reliable = true;
+		msg->inOrder = true;
+		connection->EndAndQueueMessage(msg);
+	}
+}
+
+int NumPending(const SlowServer &listener)
+{
+	int numPending = 0;
+	for(size_t i = 0; i < listener.clients.size(); ++i)
+		numPending += (int)listener.clients[i]->NumInboundMessagesPending();
+	return numPending;
+}
+
+} // ~unnamed namespace
+
+void FairProcessTest()
+{
+	TEST("FairProcess")
+
+	SlowServer listener;
+	Network serverNetwork;
+	NetworkServer *server = serverNetwork.StartServer(cServerPort, SocketOverUDP, &listener, true);
+	assert(server);
+	server->SetInboundQuantum(2 * cLargeMessageSize);
+	assert(server->InboundQuantum() == 2 * cLargeMessageSize);
+
+	Network clientNetwork;
+	Ptr(MessageConnection) flooder = clientNetwork.Connect("127.0.0.1", cServerPort, SocketOverUDP, 0);
+	Ptr(MessageConnection) other = clientNetwork.Connect("127.0.0.1", cServerPort, SocketOverUDP, 0);
+	assert(flooder && other);
+	PolledTimer timer(5000.f);
+	while(!timer.Test() && listener.clients.size() < 2)
+	{
+		server->Process();
+		flooder->Process();
+		other->Process();
+		Clock::Sleep(1);
+	}
+	assert(listener.clients.size() == 2);
+
+	// Let all the messages queue up at the server before any of them is handled.
+	SendMessages(flooder, cMsgLarge, cNumLargeMessages, cLargeMessageSize);
+	SendMessages(other, cMsgSmall, cNumSmallMessages, 4);
+	timer.StartMSecs(5000.f);
+	while(!timer.Test() && NumPending(listener) < cNumLargeMessages + cNumSmallMessages)
+	{
+		flooder->Process();
+		other->Process();
+		Clock::Sleep(1);
+	}
+	assert(NumPending(listener) == cNumLargeMessages + cNumSmallMessages);
+
+	// The large messages take 20 msecs to handle. A 2 msec budget handles some of them, and all the small ones, which fit
+	// in a single turn.
+	const tick_t start = Clock::Tick();
+	server->ProcessFor(2000);
+	const double elapsedMSecs = Clock::TimespanToMillisecondsD(start, Clock::Tick());
+	assert(elapsedMSecs < 10.0);
+	assert(listener.numSmall == cNumSmallMessages);
+	assert(listener.numLarge > 0 && listener.numLarge < cNumLargeMessages / 2);
+
+	// The flooder goes on from where it was left in the next calls.
+	timer.StartMSecs(5000.f);
+	while(!timer.Test() && listener.numLarge < cNumLargeMessages)
+		server->ProcessFor(2000);
+	assert(listener.numLarge == cNumLargeMessages);
+	assert(NumPending(listener) == 0);
+
+	flooder->Close(0);
+	other->Close(0);
+	flooder = 0;
+	other = 0;
+	serverNetwork.StopServer();
+
+	ENDTEST()
+}
@@ -0,0 +1,132 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file FragmentedTransferManagerTest.cpp
+	@brief */
+
+#include <vector>
+#include <cstring>
+
+#include "kNet/FragmentedTransferManager.h"
+#include "kNet/NetworkMessage.h"
+#include "kNet/DataSerializer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+void FragmentedTransferManagerTest()
+{
+	using namespace kNet;
+
+	TEST("FragmentedSendManager")
+	FragmentedSendManager sends;
+
+	// There are more transfer IDs than fit in a byte.
+	const int numTransfers = 1000;
+	std::vector<FragmentedSendManager::FragmentedTransfer*> transfers;
+	std::vector<NetworkMessage*> fragments;
+	for(int i = 0; i < numTransfers; ++i)
+	{
+		FragmentedSendManager::FragmentedTransfer *transfer = sends.AllocateNewFragmentedTransfer();
+		transfer->totalNumFragments = 2;
+		bool success = sends.AllocateFragmentedTransferID(*transfer);
+		assert(success);
+		assert(transfer->id == i + 1);
+
+		NetworkMessage *fragment = NetworkMessagePool::New();
+		fragment->Resize(100);
+		transfer->AddMessage(fragment);
+		assert(transfer->bytesOutstanding == 100);
+		transfers.push_back(transfer);
+		fragments.push_back(fragment);
+	}
+
+	// A transfer that has all of its fragments created is freed with its last fragment, and its ID is reused first.
+	sends.RemoveMessage(transfers[9], fragments[9]);
+	assert(transfers[0]->fragments.size() == 1);
+	assert(sends.transfers.size() == (size_t)numTransfers - 1);
+	FragmentedSendManager::FragmentedTransfer *transfer = sends.AllocateNewFragmentedTransfer();
+	bool success = sends.AllocateFragmentedTransferID(*transfer);
+	assert(success);
+	assert(transfer->id == 10);
+	NetworkMessagePool::Free(fragments[9]);
+
+	// A transfer that still has fragments to cut from its source stays, even if none of its fragments exist right now.
+	transfers[20]->source = NetworkMessagePool::New();
+	sends.RemoveMessage(transfers[20], fragments[20]);
+	assert(sends.transfers.size() == (size_t)numTransfers);
+	NetworkMessagePool::Free(fragments[20]);
+
+	// An aborted transfer keeps its ID until the peer acks the abort.
+	bool notifyPeer = sends.AbortTransfer(transfers[20]);
+	assert(notifyPeer);
+	assert(transfers[20]->source == 0);
+	sends.AbortAcknowledged(21);
+	assert(sends.transfers.size() == (size_t)numTransfers - 1);
+
+	sends.FreeAllTransfers();
+	for(int i = 0; i < numTransfers; ++i)
+		if (i != 9 && i != 20)
+			NetworkMessagePool::Free(fragments[i]);
+	assert(sends.transfers.empty());
+	ENDTEST()
+
+	TEST("FragmentedReceiveManager")
+	FragmentedReceiveManager receives;
+	const int fragmentSize = 100;
+	const int numFragments = 50;
+	const int messageSize = (numFragments - 1) * fragmentSize + 37;
+	std::vector<char> message(messageSize);
+	for(int i = 0; i < messageSize; ++i)
+		message[i] = (char)(i * 7 + 3);
+
+	// The first fragment carries the ID of the message before its data.
+	char fragmentStart[fragmentSize + 4];
+	DataSerializer ds(fragmentStart, sizeof(fragmentStart));
+	ds.AddVLE<VLE8_16_32>(1000);
+	ds.AddAlignedByteArray(&message[0], fragmentSize);
+
+	// Some of the fragments overtake the fragmentStart. Fragment 5 arrives twice.
+	bool finished = receives.NewFragmentReceived(3, 5, &message[5 * fragmentSize], fragmentSize);
+	assert(!finished);
+	finished = receives.NewFragmentReceived(3, 5, &message[5 * fragmentSize], fragmentSize);
+	assert(!finished);
+	finished = receives.NewFragmentReceived(3, numFragments - 1, &message[(numFragments - 1) * fragmentSize], 37);
+	assert(!finished);
+	finished = receives.NewFragmentStartReceived(3, numFragments, fragmentStart, ds.BytesFilled());
+	assert(!finished);
+
+	// A fragment of the wrong size doesn't fit its place, and is discarded.
+	finished = receives.NewFragmentReceived(3, 7, &message[7 * fragmentSize], fragmentSize - 1);
+	assert(!finished);
+
+	for(int i = numFragments - 2; i > 0; --i)
+	{
+		finished = receives.NewFragmentReceived(3, i, &message[i * fragmentSize], fragmentSize);
+		assert(finished == (i == 1));
+	}
+
+	NetworkMessage *assembled = receives.DetachMessage(3);
+	assert(assembled);
+	assert(assembled->id == 1000);
+	assert(assembled->Size() == (size_t)messageSize);
+	assert(memcmp(assembled->data, &message[0], messageSize) == 0);
+	assert(receives.transfers.empty());
+	NetworkMessagePool::Free(assembled);
+
+	// A peer may not make the receiver reserve an arbitrary amount of memory.
+	finished = receives.NewFragmentStartReceived(4, 0x7FFFFFFF, fragmentStart, ds.BytesFilled());
+	assert(!finished);
+	assert(receives.transfers.empty());
+	ENDTEST()
+}
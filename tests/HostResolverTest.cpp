@@ -0,0 +1,66 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file HostResolverTest.cpp
+	@brief Tests that HostResolver resolves the names in the background and caches them. */
+
+#include "kNet/HostResolver.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+/// Calls Resolve() until the name is no longer being resolved, or the time runs out.
+static HostResolver::Status WaitResolve(HostResolver &resolver, const char *hostName, EndPoint &address)
+{
+	PolledTimer timer(5000.f);
+	HostResolver::Status status = resolver.Resolve(hostName, address);
+	while(status == HostResolver::Resolving && !timer.Test())
+	{
+		Clock::Sleep(1);
+		status = resolver.Resolve(hostName, address);
+	}
+	return status;
+}
+
+void HostResolverTest()
+{
+	TEST("HostResolver")
+	HostResolver resolver;
+	EndPoint address;
+
+	// A numeric address resolves at once, and so does not start the threads.
+	assert(resolver.Resolve("127.0.0.1", address) == HostResolver::Resolved);
+	assert(address.ip[0] == 127 && address.ip[1] == 0 && address.ip[2] == 0 && address.ip[3] == 1 && address.port == 0);
+	assert(resolver.Resolve("", address) == HostResolver::ResolveFailed);
+
+	// A name goes through the threads, and is answered from the cache after that.
+	EndPoint blocking;
+	if (HostResolver::ResolveBlocking("localhost", blocking))
+	{
+		assert(WaitResolve(resolver, "localhost", address) == HostResolver::Resolved);
+		assert(address.ToString() == blocking.ToString());
+		assert(resolver.Resolve("localhost", address) == HostResolver::Resolved);
+
+		// With a time to live of zero, the cached address has expired on the next call.
+		resolver.SetTimeToLive(0.f);
+		resolver.ClearCache();
+		assert(WaitResolve(resolver, "localhost", address) == HostResolver::Resolved);
+		Clock::Sleep(2);
+		assert(resolver.Resolve("localhost", address) == HostResolver::Resolving);
+		assert(WaitResolve(resolver, "localhost", address) == HostResolver::Resolved);
+	}
+	ENDTEST()
+}
@@ -0,0 +1,137 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file InterestGridTest.cpp
+	@brief */
+
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#include "kNet/InterestGrid.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace
+{
+struct Item
+{
+	float x, y, radius;
+};
+
+bool Found(const std::vector<Item *> &found, Item *item)
+{
+	return std::find(found.begin(), found.end(), item) != found.end();
+}
+}
+
+void InterestGridTest()
+{
+	using namespace kNet;
+
+	TEST("InterestGrid")
+	InterestGrid<Item> grid(10.f);
+	Item a, b, c;
+	grid.Set(&a, 5.f, 5.f, 3.f);
+	grid.Set(&b, 25.f, 5.f, 12.f);
+	grid.Set(&c, -15.f, -15.f, 1.f);
+	assert(grid.Size() == 3);
+
+	std::vector<Item *> found;
+	grid.Query(6.f, 6.f, found);
+	assert(found.size() == 1 && found[0] == &a);
+
+	// The point is in the cell of a, but out of its radius. It is in the radius of b, which spans several cells.
+	found.clear();
+	grid.Query(14.f, 5.f, found);
+	assert(found.size() == 1 && found[0] == &b);
+
+	found.clear();
+	grid.Query(-15.5f, -14.5f, found);
+	assert(found.size() == 1 && found[0] == &c);
+
+	// Moving within the same cells, and to other cells.
+	grid.Set(&a, 4.f, 4.f, 3.f);
+	grid.Set(&c, 100.f, 100.f, 1.f);
+	found.clear();
+	grid.Query(-15.f, -15.f, found);
+	assert(found.empty());
+	found.clear();
+	grid.Query(100.f, 100.f, found);
+	assert(found.size() == 1 && found[0] == &c);
+
+	grid.Remove(&b);
+	assert(!grid.Contains(&b));
+	assert(grid.Size() == 2);
+	found.clear();
+	grid.Query(25.f, 5.f, found);
+	assert(found.empty());
+	grid.Remove(&b); // Not in the grid any more.
+
+	// An item whose circle covers too many cells is checked by every query.
+	Item big;
+	grid.Set(&big, 0.f, 0.f, 1e6f);
+	found.clear();
+	grid.Query(5000.f, -5000.f, found);
+	assert(found.size() == 1 && found[0] == &big);
+	grid.Set(&big, 0.f, 0.f, 1.f);
+	found.clear();
+	grid.Query(5000.f, -5000.f, found);
+	assert(found.empty());
+	grid.Clear();
+	assert(grid.Size() == 0);
+	ENDTEST()
+
+	TEST("InterestGrid matches a linear scan")
+	srand(7);
+	const int numItems = 500;
+	std::vector<Item> items(numItems);
+	InterestGrid<Item> grid(32.f);
+	for(int i = 0; i < numItems; ++i)
+	{
+		items[i].x = (float)(rand() % 2000) - 1000.f;
+		items[i].y = (float)(rand() % 2000) - 1000.f;
+		items[i].radius = (float)(rand() % 100);
+		grid.Set(&items[i], items[i].x, items[i].y, items[i].radius);
+	}
+	for(int round = 0; round < 3; ++round)
+	{
+		for(int q = 0; q < 200; ++q)
+		{
+			const float x = (float)(rand() % 2000) - 1000.f;
+			const float y = (float)(rand() % 2000) - 1000.f;
+			std::vector<Item *> found;
+			grid.Query(x, y, found);
+			size_t numExpected = 0;
+			for(int i = 0; i < numItems; ++i)
+			{
+				const float dx = x - items[i].x, dy = y - items[i].y;
+				const bool inRange = dx * dx + dy * dy <= items[i].radius * items[i].radius;
+				assert(inRange == Found(found, &items[i]));
+				if (inRange)
+					++numExpected;
+			}
+			assert(found.size() == numExpected);
+		}
+		// Move some of the items, then check again with a different cell size.
+		for(int i = 0; i < numItems; i += 3)
+		{
+			items[i].x += (float)(rand() % 64) - 32.f;
+			items[i].y += (float)(rand() % 64) - 32.f;
+			grid.Set(&items[i], items[i].x, items[i].y, items[i].radius);
+		}
+		grid.SetCellSize(grid.CellSize() * 2.f);
+	}
+	ENDTEST()
+}
@@ -0,0 +1,112 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file LZ4CodecTest.cpp
+	@brief */
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "kNet/LZ4Codec.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+/// Compresses and decompresses the given block, and returns the compressed size.
+size_t RoundTrip(LZ4Codec &codec, const std::vector<char> &block, bool useDictionary)
+{
+	std::vector<char> compressed(LZ4Codec::MaxCompressedSize(block.size()));
+	const size_t compressedSize = codec.Compress(block.empty() ? 0 : &block[0], block.size(), &compressed[0], compressed.size(), useDictionary);
+	assert(compressedSize > 0);
+
+	std::vector<char> decompressed(block.size() + 1);
+	const int decompressedSize = codec.Decompress(&compressed[0], compressedSize, &decompressed[0], decompressed.size(), useDictionary);
+	assert(decompressedSize == (int)block.size());
+	assert(block.empty() || memcmp(&block[0], &decompressed[0], block.size()) == 0);
+	return compressedSize;
+}
+
+/// Returns a block of game-like messages: a few repeating fields with slowly changing values.
+std::vector<char> MessageBlock(int numMessages, int seed)
+{
+	std::vector<char> block;
+	for(int i = 0; i < numMessages; ++i)
+	{
+		char text[64];
+		sprintf(text, "entity=%d;pos=(%d,%d,0);state=walking;", seed + i, (seed * 31 + i) % 500, i % 7);
+		block.insert(block.end(), text, text + strlen(text));
+	}
+	return block;
+}
+}
+
+void LZ4CodecTest()
+{
+	TEST("LZ4Codec")
+	LZ4Codec codec;
+	assert(codec.DictionaryID() == 0);
+
+	// Repetitive data compresses well, empty and very short blocks are stored as literals.
+	std::vector<char> block = MessageBlock(200, 0);
+	assert(RoundTrip(codec, block, false) * 3 < block.size());
+	assert(RoundTrip(codec, std::vector<char>(), false) == 1);
+	assert(RoundTrip(codec, std::vector<char>(5, 'x'), false) == 6);
+	assert(RoundTrip(codec, std::vector<char>(100000, 'x'), false) < 1000);
+
+	// Random data doesn't compress, but still fits in MaxCompressedSize().
+	std::vector<char> noise(5000);
+	u32 state = 1;
+	for(size_t i = 0; i < noise.size(); ++i)
+	{
+		state = state * 1664525u + 1013904223u;
+		noise[i] = (char)(state >> 24);
+	}
+	assert(RoundTrip(codec, noise, false) >= noise.size());
+	std::vector<char> compressed(noise.size());
+	assert(codec.Compress(&noise[0], noise.size(), &compressed[0], compressed.size(), false) == 0);
+
+	// A short message that doesn't compress by itself shares most of its bytes with the dictionary.
+	std::vector<char> dictionary = MessageBlock(20, 1000);
+	codec.SetDictionary(&dictionary[0], dictionary.size());
+	assert(codec.DictionaryID() != 0);
+	std::vector<char> message = MessageBlock(1, 1005);
+	const size_t withoutDictionary = RoundTrip(codec, message, false);
+	const size_t withDictionary = RoundTrip(codec, message, true);
+	assert(withDictionary < withoutDictionary);
+	assert(withDictionary * 2 < message.size());
+	RoundTrip(codec, block, true);
+
+	// The decompressor needs the same dictionary.
+	LZ4Codec other;
+	other.SetDictionary(&dictionary[0], dictionary.size());
+	assert(other.DictionaryID() == codec.DictionaryID());
+	compressed.resize(LZ4Codec::MaxCompressedSize(message.size()));
+	const size_t compressedSize = codec.Compress(&message[0], message.size(), &compressed[0], compressed.size(), true);
+	std::vector<char> decompressed(message.size());
+	assert(other.Decompress(&compressed[0], compressedSize, &decompressed[0], decompressed.size(), true) == (int)message.size());
+	assert(memcmp(&message[0], &decompressed[0], message.size()) == 0);
+	assert(LZ4Codec().Decompress(&compressed[0], compressedSize, &decompressed[0], decompressed.size(), true) == -1);
+
+	// Malformed and truncated input, and too small output space, are rejected.
+	assert(codec.Decompress(&compressed[0], compressedSize, &decompressed[0], decompressed.size(), false) == -1);
+	assert(codec.Decompress(&compressed[0], compressedSize - 1, &decompressed[0], decompressed.size(), true) == -1);
+	assert(codec.Decompress(&compressed[0], compressedSize, &decompressed[0], decompressed.size() - 1, true) == -1);
+	const char badOffset[] = { 0x10, 'a', 0x05, 0x00, 0x00 };
+	assert(codec.Decompress(badOffset, sizeof(badOffset), &decompressed[0], decompressed.size(), false) == -1);
+	ENDTEST()
+}
@@ -0,0 +1,104 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file LatencyHistogramTest.cpp
+	@brief Tests the bucketing and the percentile queries of LatencyHistogram. */
+
+#include <cmath>
+
+#include "kNet/LatencyHistogram.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+/// Returns true if the estimate is at or above the exact value, and within the precision of the buckets.
+bool WithinBucket(float estimateMSecs, float exactMSecs)
+{
+	return estimateMSecs >= exactMSecs - 1e-4f && estimateMSecs <= exactMSecs * (1.f + 1.f / LatencyHistogram::cSubBuckets) + 1e-3f;
+}
+
+}
+
+void LatencyHistogramTest()
+{
+	TEST("LatencyHistogram")
+
+	// The buckets cover all the values without gaps, and each value is counted in the bucket whose range contains it.
+	int prevIndex = 0;
+	for(u32 value = 0; value < 100000; ++value)
+	{
+		const int index = LatencyHistogram::BucketIndex(value);
+		assert(index == prevIndex || index == prevIndex + 1);
+		assert(value <= LatencyHistogram::BucketUpperBound(index));
+		assert(index == 0 || value > LatencyHistogram::BucketUpperBound(index - 1));
+		prevIndex = index;
+	}
+	assert(LatencyHistogram::BucketIndex(0xFFFFFFFF) == LatencyHistogram::cNumBuckets - 1);
+	assert(LatencyHistogram::BucketUpperBound(LatencyHistogram::cNumBuckets - 1) == 0xFFFFFFFF);
+	for(int shift = 0; shift < 32; ++shift)
+	{
+		const u32 value = (u32)1 << shift;
+		const u32 upper = LatencyHistogram::BucketUpperBound(LatencyHistogram::BucketIndex(value));
+		assert(upper >= value && (upper - value) <= value / LatencyHistogram::cSubBuckets);
+	}
+
+	LatencyHistogram h;
+	assert(h.Count() == 0);
+	assert(h.PercentileMSecs(99.f) == 0.f);
+	assert(h.MeanMSecs() == 0.f);
+
+	// 1, 2, ..., 1000 milliseconds.
+	for(u32 i = 1; i <= 1000; ++i)
+		h.Record(i * 1000);
+	assert(h.Count() == 1000);
+	assert(WithinBucket(h.PercentileMSecs(50.f), 500.f));
+	assert(WithinBucket(h.PercentileMSecs(99.f), 990.f));
+	assert(WithinBucket(h.PercentileMSecs(99.9f), 999.f));
+	assert(h.PercentileMSecs(100.f) == 1000.f);
+	assert(WithinBucket(h.PercentileMSecs(0.f), 1.f));
+	assert(h.MaxMSecs() == 1000.f);
+	assert(fabs(h.MeanMSecs() - 500.5f) < 1e-3f);
+
+	// A rare outlier shows up in the tail, but not in the median.
+	LatencyHistogram tail;
+	for(int i = 0; i < 9990; ++i)
+		tail.Record(2000);
+	for(int i = 0; i < 10; ++i)
+		tail.Record(250000);
+	assert(WithinBucket(tail.MedianMSecs(), 2.f));
+	assert(WithinBucket(tail.PercentileMSecs(99.f), 2.f));
+	assert(tail.PercentileMSecs(99.95f) == 250.f);
+
+	// Merging sums up the samples.
+	LatencyHistogram merged;
+	merged.Merge(h);
+	merged.Merge(tail);
+	assert(merged.Count() == h.Count() + tail.Count());
+	assert(merged.MaxMSecs() == 1000.f);
+	assert(WithinBucket(merged.MedianMSecs(), 2.f));
+
+	// Time spans are recorded in microseconds.
+	LatencyHistogram spans;
+	const tick_t start = Clock::Tick();
+	spans.RecordTimespan(start, start + Clock::TicksPerSec() / 100);
+	assert(WithinBucket(spans.MaxMSecs(), 10.f));
+
+	h.Clear();
+	assert(h.Count() == 0 && h.MaxMSecs() == 0.f && h.PercentileMSecs(50.f) == 0.f);
+
+	ENDTEST()
+}
@@ -22,6 +22,8 @@
 #include "kNet/DebugMemoryLeakCheck.h"
 
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 using namespace kNet;
@@ -67,6 +69,17 @@ void PoolThreadMain(Thread *me, int threadIndex)
     }
 }
 
+std::vector<NetworkMessage*> exitingThreadMessages;
+volatile bool exitingThreadDone = false;
+
+/// Frees messages into the cache of this thread, and exits without flushing it.
+void FreeMessagesAndExit()
+{
+	for(size_t i = 0; i < exitingThreadMessages.size(); ++i)
+		NetworkMessagePool::Free(exitingThreadMessages[i]);
+	exitingThreadDone = true;
+}
+
 template<typename T>
 bool VectorsIntersect(const std::vector<T> &a, const std::vector<T> &b)
 {
@@ -127,4 +140,72 @@ void LockFreePoolAllocatorTest()
 		pool.UnsafeClearAll();
 	}
 	ENDTEST()
+
+	TEST("NetworkMessagePool")
+	NetworkMessage *msg = NetworkMessagePool::New();
+	msg->Resize(100);
+	msg->id = 1000;
+	msg->priority = 5;
+	msg->reliable = false;
+	char *data = msg->data;
+	NetworkMessagePool::Free(msg);
+
+	// The message is reused from the thread cache with its data buffer, but with the other fields reset.
+	NetworkMessage *reused = NetworkMessagePool::New();
+	assert(reused == msg);
+	assert(reused->data == data);
+	assert(reused->Capacity() >= 100);
+	assert(reused->Size() == 0);
+	assert(reused->id == 0);
+	assert(reused->priority == 0);
+	assert(reused->reliable);
+	reused->Resize(50);
+	assert(reused->data == data);
+
+	// Large buffers are not kept in the pool, which leaves the message with its inline storage.
+	reused->Resize(NetworkMessagePool::cMaxPooledDataCapacity + 1);
+	NetworkMessagePool::Free(reused);
+	reused = NetworkMessagePool::New();
+	assert(reused->Capacity() == NetworkMessage::cInlineCapacity);
+
+	// Overflowing the thread cache passes the messages on to the shared pool.
+	std::vector<NetworkMessage*> msgs;
+	for(int i = 0; i < NetworkMessagePool::cThreadCacheSize * 3; ++i)
+		msgs.push_back(NetworkMessagePool::New());
+	for(size_t i = 0; i < msgs.size(); ++i)
+		NetworkMessagePool::Free(msgs[i]);
+	NetworkMessagePool::FlushThreadCache();
+	std::vector<NetworkMessage*> msgs2;
+	for(size_t i = 0; i < msgs.size(); ++i)
+		msgs2.push_back(NetworkMessagePool::New());
+	std::sort(msgs.begin(), msgs.end());
+	std::sort(msgs2.begin(), msgs2.end());
+	assert(msgs == msgs2);
+	for(size_t i = 0; i < msgs2.size(); ++i)
+		NetworkMessagePool::Free(msgs2[i]);
+	NetworkMessagePool::Free(reused);
+	NetworkMessagePool::FlushThreadCache();
+
+	// A thread that exits returns the messages of its cache to the shared pool.
+	for(int i = 0; i < NetworkMessagePool::cThreadCacheSize / 2; ++i)
+		exitingThreadMessages.push_back(NetworkMessagePool::New());
+	NetworkMessagePool::FlushThreadCache();
+	{
+		Thread exitingThread;
+		exitingThread.RunFunc(FreeMessagesAndExit);
+		while(!exitingThreadDone)
+			Thread::Sleep(1);
+		exitingThread.Stop();
+	}
+	std::vector<NetworkMessage*> returned;
+	for(size_t i = 0; i < exitingThreadMessages.size(); ++i)
+		returned.push_back(NetworkMessagePool::New());
+	std::sort(exitingThreadMessages.begin(), exitingThreadMessages.end());
+	std::sort(returned.begin(), returned.end());
+	assert(returned == exitingThreadMessages);
+	for(size_t i = 0; i < returned.size(); ++i)
+		NetworkMessagePool::Free(returned[i]);
+	exitingThreadMessages.clear();
+	NetworkMessagePool::FlushThreadCache();
+	ENDTEST()
 }
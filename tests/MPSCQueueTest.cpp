@@ -0,0 +1,149 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file MPSCQueueTest.cpp
+	@brief Tests that MPSCQueue passes every item of several producer threads to the consumer, in per-producer order. */
+
+#include <vector>
+
+#include "kNet/MPSCQueue.h"
+#include "kNet/Thread.h"
+#include "kNet/Clock.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const int cNumProducers = 4;
+const int cNumItemsPerProducer = 50000;
+
+MPSCQueue<u32> *sharedQueue = 0;
+volatile long nextProducerIndex = 0;
+volatile long numFullInserts = 0;
+
+/// Inserts the items 0, 1, 2, ... of a producer, tagged with the index of the producer in the high bits. The odd
+/// producers insert in batches.
+void Produce()
+{
+	const u32 producer = (u32)AtomicIncrement(&nextProducerIndex) - 1;
+	if (producer % 2 == 0)
+	{
+		for(int i = 0; i < cNumItemsPerProducer; ++i)
+			while(!sharedQueue->Insert((producer << 24) | (u32)i))
+				AtomicIncrement(&numFullInserts);
+		return;
+	}
+
+	u32 batch[20];
+	for(int i = 0; i < cNumItemsPerProducer; )
+	{
+		const int batchSize = (i % 19) + 1 < cNumItemsPerProducer - i ? (i % 19) + 1 : cNumItemsPerProducer - i;
+		for(int j = 0; j < batchSize; ++j)
+			batch[j] = (producer << 24) | (u32)(i + j);
+		int numInserted = 0;
+		while(numInserted < batchSize)
+			numInserted += sharedQueue->InsertBatch(batch + numInserted, batchSize - numInserted);
+		i += batchSize;
+	}
+}
+
+}
+
+void MPSCQueueTest()
+{
+	TEST("MPSCQueue")
+
+	MPSCQueue<u32> queue(4);
+	assert(queue.Capacity() == 4);
+	assert(queue.Size() == 0 && queue.Front() == 0);
+	for(u32 i = 0; i < 4; ++i)
+		assert(queue.Insert(i));
+	assert(!queue.Insert(100));
+	assert(queue.Size() == 4 && queue.CapacityLeft() == 0);
+
+	assert(queue.TakeFront() == 0);
+	assert(queue.Insert(4)); // Wraps around to the slot that was just freed.
+	u32 items[8];
+	assert(queue.PopBatch(items, 2) == 2);
+	assert(items[0] == 1 && items[1] == 2);
+	assert(queue.PopBatch(items, 8) == 2);
+	assert(items[0] == 3 && items[1] == 4);
+	assert(queue.PopBatch(items, 8) == 0);
+	assert(queue.Size() == 0 && queue.Front() == 0);
+
+	// A batch is cut to the room left.
+	const u32 values[6] = { 10, 11, 12, 13, 14, 15 };
+	assert(queue.Insert(9));
+	assert(queue.InsertBatch(values, 6) == 3);
+	assert(queue.InsertBatch(values, 6) == 0);
+	assert(queue.PopBatch(items, 8) == 4);
+	assert(items[0] == 9 && items[1] == 10 && items[3] == 12);
+	assert(queue.InsertBatch(values + 3, 3) == 3);
+	assert(queue.PopBatch(items, 8) == 3);
+	assert(items[0] == 13 && items[2] == 15);
+
+	// A slot filled in place holds up the items after it until it is published.
+	long pos;
+	u32 *item = queue.BeginInsert(pos);
+	assert(item);
+	assert(queue.Insert(17));
+	assert(queue.Front() == 0);
+	*item = 16;
+	queue.EndInsert(pos);
+	assert(queue.PopBatch(items, 8) == 2);
+	assert(items[0] == 16 && items[1] == 17);
+	for(u32 i = 0; i < 4; ++i)
+		assert(queue.Insert(i));
+	assert(queue.BeginInsert(pos) == 0);
+	assert(queue.PopBatch(items, 8) == 4);
+
+	// Several producers stream through a small queue. Every item arrives once, and the items of each producer stay in order.
+	MPSCQueue<u32> stream(256);
+	sharedQueue = &stream;
+	std::vector<Thread*> producers;
+	for(int i = 0; i < cNumProducers; ++i)
+	{
+		producers.push_back(new Thread);
+		producers.back()->RunFunc(Produce);
+	}
+
+	int nextItem[cNumProducers] = {};
+	int numReceived = 0;
+	const tick_t startTick = Clock::Tick();
+	while(numReceived < cNumProducers * cNumItemsPerProducer && Clock::SecondsSinceD(startTick) < 60.0)
+	{
+		u32 batch[16];
+		const int numItems = (numReceived & 1) ? stream.PopBatch(batch, 16) : (stream.Front() ? (batch[0] = stream.TakeFront(), 1) : 0);
+		for(int i = 0; i < numItems; ++i)
+		{
+			const u32 producer = batch[i] >> 24;
+			assert(producer < (u32)cNumProducers);
+			assert((batch[i] & 0xFFFFFF) == (u32)nextItem[producer]);
+			++nextItem[producer];
+		}
+		numReceived += numItems;
+	}
+	for(int i = 0; i < cNumProducers; ++i)
+	{
+		producers[i]->Stop();
+		delete producers[i];
+		assert(nextItem[i] == cNumItemsPerProducer);
+	}
+	assert(stream.Size() == 0);
+	sharedQueue = 0;
+
+	ENDTEST()
+}
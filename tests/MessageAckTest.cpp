@@ -0,0 +1,94 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file MessageAckTest.cpp
+	@brief Tests that the ack handler of a message dropped before it was delivered is told why, exactly once. */
+
+#include <cstring>
+
+#include "kNet/NetworkMessage.h"
+#include "kNet/IMessageHandler.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+class RecordingAckHandler : public IMessageAckHandler
+{
+public:
+	RecordingAckHandler():numCalls(0), messageId(0), result(MessageDelivered) {}
+
+	int numCalls;
+	message_id_t messageId;
+	MessageAckResult result;
+
+	void HandleMessageAcked(message_id_t messageId_, MessageAckResult result_)
+	{
+		++numCalls;
+		messageId = messageId_;
+		result = result_;
+	}
+};
+
+/// Frees a message with the given flags before it was sent, and returns what its ack handler was told.
+MessageAckResult FreeAndGetResult(bool reliable, bool obsolete)
+{
+	RecordingAckHandler handler;
+	NetworkMessage *msg = NetworkMessagePool::New();
+	msg->id = 123;
+	msg->reliable = reliable;
+	msg->obsolete = obsolete;
+	msg->ackHandler = &handler;
+	NetworkMessagePool::Free(msg);
+	assert(handler.numCalls == 1);
+	assert(handler.messageId == 123);
+	return handler.result;
+}
+
+}
+
+void MessageAckTest()
+{
+	TEST("MessageAck")
+
+	assert(FreeAndGetResult(true, false) == MessageConnectionClosed);
+	assert(FreeAndGetResult(true, true) == MessageObsolete);
+	assert(FreeAndGetResult(false, true) == MessageObsolete);
+	assert(FreeAndGetResult(false, false) == MessageUnreliable);
+
+	// The handler is cleared once told, so that the pooled message does not report to it again.
+	RecordingAckHandler handler;
+	NetworkMessage *msg = NetworkMessagePool::New();
+	msg->ackHandler = &handler;
+	NetworkMessagePool::Free(msg);
+	NetworkMessage *reused = NetworkMessagePool::New();
+	assert(reused->ackHandler == 0);
+	NetworkMessagePool::Free(reused);
+	assert(handler.numCalls == 1);
+
+	// A message deleted outright, like the ones left in the queues of a connection that is torn down, also reports.
+	RecordingAckHandler deletedHandler;
+	NetworkMessage *deleted = new NetworkMessage();
+	deleted->ackHandler = &deletedHandler;
+	delete deleted;
+	assert(deletedHandler.numCalls == 1);
+	assert(deletedHandler.result == MessageConnectionClosed);
+
+	assert(strcmp(MessageAckResultToString(MessageDelivered), "Delivered") == 0);
+	assert(strcmp(MessageAckResultToString(MessageObsolete), "Obsolete") == 0);
+
+	ENDTEST()
+}
@@ -0,0 +1,83 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MessageDataAllocatorTest.cpp
+	@brief */
+
+#include <vector>
+#include <string.h>
+
+#include "kNet/MessageDataAllocator.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+void MessageDataAllocatorTest()
+{
+	using namespace kNet;
+
+	TEST("MessageDataAllocator")
+	MessageDataStatistics before = MessageDataAllocator::Statistics();
+
+	// Sizes are rounded up to the power-of-two size classes.
+	size_t capacity = 0;
+	char *small = MessageDataAllocator::Allocate(1, capacity);
+	assert(small);
+	assert(capacity == MessageDataAllocator::cMinBlockSize);
+	size_t capacity2 = 0;
+	char *medium = MessageDataAllocator::Allocate(1000, capacity2);
+	assert(capacity2 == 1024);
+	memset(small, 0xAB, capacity);
+	memset(medium, 0xCD, capacity2);
+
+	MessageDataStatistics during = MessageDataAllocator::Statistics();
+	assert(during.blocksInUse == before.blocksInUse + 2);
+	assert(during.blockBytesInUse == before.blockBytesInUse + capacity + capacity2);
+	assert(during.slabBytes >= during.blockBytesInUse);
+
+	// A freed block is handed out again for the same size class.
+	MessageDataAllocator::Free(medium, capacity2);
+	char *reused = MessageDataAllocator::Allocate(600, capacity2);
+	assert(reused == medium);
+	MessageDataAllocator::Free(reused, capacity2);
+	MessageDataAllocator::Free(small, capacity);
+
+	// The blocks carved out of two whole slabs do not overlap.
+	std::vector<char*> blocks;
+	const size_t numBlocks = MessageDataAllocator::cSlabSize / MessageDataAllocator::cMaxBlockSize * 2;
+	for(size_t i = 0; i < numBlocks; ++i)
+	{
+		blocks.push_back(MessageDataAllocator::Allocate(MessageDataAllocator::cMaxBlockSize, capacity));
+		assert(capacity == MessageDataAllocator::cMaxBlockSize);
+		memset(blocks.back(), (int)i, capacity);
+	}
+	for(size_t i = 0; i < numBlocks; ++i)
+		assert(blocks[i][0] == (char)i && blocks[i][capacity-1] == (char)i);
+	for(size_t i = 0; i < numBlocks; ++i)
+		MessageDataAllocator::Free(blocks[i], capacity);
+
+	// Large buffers bypass the slabs.
+	char *large = MessageDataAllocator::Allocate(MessageDataAllocator::cMaxBlockSize + 1, capacity);
+	assert(capacity >= MessageDataAllocator::cMaxBlockSize + 1);
+	during = MessageDataAllocator::Statistics();
+	assert(during.largeBuffersInUse == before.largeBuffersInUse + 1);
+	MessageDataAllocator::Free(large, capacity);
+	MessageDataAllocator::Free(0, 0);
+
+	MessageDataStatistics after = MessageDataAllocator::Statistics();
+	assert(after.blocksInUse == before.blocksInUse);
+	assert(after.blockBytesInUse == before.blockBytesInUse);
+	assert(after.largeBuffersInUse == before.largeBuffersInUse);
+	assert(after.numLargeAllocations == before.numLargeAllocations + 1);
+	ENDTEST()
+}
@@ -0,0 +1,146 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MessageFrameArenaTest.cpp
+	@brief Tests that MessageFrameArena recycles its pages once their messages are freed, also by the worker thread. */
+
+#include <string.h>
+
+#include "kNet/MessageFrameArena.h"
+#include "kNet/NetworkMessage.h"
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPort = 47298;
+
+const message_id_t cMsgTick = 100;
+
+class CountingServer : public INetworkServerListener, public IMessageHandler
+{
+public:
+	CountingServer():numTicks(0) {}
+
+	int numTicks;
+
+	void NewConnectionEstablished(MessageConnection *connection) { connection->RegisterInboundMessageHandler(this); }
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t messageId, const char *data, size_t numBytes)
+	{
+		if (messageId == cMsgTick && numBytes == 4 && memcmp(data, "tick", 4) == 0)
+			++numTicks;
+	}
+};
+
+} // ~unnamed namespace
+
+void MessageFrameArenaTest()
+{
+	TEST("MessageFrameArena")
+
+	// Outside a frame, the messages come from the message pool.
+	MessageFrameArena arena(4);
+	assert(arena.New() == 0);
+
+	arena.BeginFrame();
+	NetworkMessage *msgs[10];
+	for(int i = 0; i < 10; ++i)
+	{
+		msgs[i] = arena.New();
+		assert(msgs[i]);
+		assert(msgs[i]->Size() == 0 && msgs[i]->ackHandler == 0);
+	}
+	arena.EndFrame();
+	assert(arena.NumPages() == 3);
+	assert(arena.New() == 0);
+
+	// The first two pages are recycled once all their messages are gone. The third still has one alive.
+	for(int i = 0; i < 9; ++i)
+		NetworkMessagePool::Free(msgs[i]);
+	arena.BeginFrame();
+	assert(arena.NumFreePages() == 2);
+	NetworkMessage *reused = arena.New();
+	assert(reused == msgs[4] || reused == msgs[0]);
+	NetworkMessagePool::Free(reused);
+	arena.EndFrame();
+
+	// A large payload gets a data buffer of its own, which is freed with the message.
+	arena.BeginFrame();
+	NetworkMessage *large = arena.New();
+	large->Resize(NetworkMessage::cInlineCapacity * 4);
+	memset(large->data, 0xAB, large->Size());
+	NetworkMessagePool::Free(large);
+	arena.EndFrame();
+
+	// A page that outlives its arena is freed with its last message.
+	MessageFrameArena *shortLived = new MessageFrameArena(4);
+	shortLived->BeginFrame();
+	NetworkMessage *orphan = shortLived->New();
+	shortLived->EndFrame();
+	delete shortLived;
+	orphan->Resize(8);
+	NetworkMessagePool::Free(orphan);
+	NetworkMessagePool::Free(msgs[9]);
+
+	// The messages sent through a connection are freed by the worker thread once acked, after which their pages are reused.
+	CountingServer listener;
+	Network serverNetwork;
+	NetworkServer *server = serverNetwork.StartServer(cServerPort, SocketOverUDP, &listener, true);
+	assert(server);
+	Network clientNetwork;
+	Ptr(MessageConnection) connection = clientNetwork.Connect("127.0.0.1", cServerPort, SocketOverUDP, 0);
+	assert(connection);
+
+	const int cNumTicks = 200;
+	MessageFrameArena sendArena(64);
+	sendArena.BeginFrame();
+	for(int i = 0; i < cNumTicks; ++i)
+	{
+		NetworkMessage *msg = connection->StartNewMessage(cMsgTick, 4, &sendArena);
+		msg->reliable = true;
+		memcpy(msg->data, "tick", 4);
+		connection->EndAndQueueMessage(msg);
+	}
+	sendArena.EndFrame();
+	const int numPages = sendArena.NumPages();
+	assert(numPages == (cNumTicks + 63) / 64);
+
+	PolledTimer timer(5000.f);
+	bool recycled = false;
+	while(!timer.Test() && !recycled)
+	{
+		server->Process();
+		connection->Process();
+		sendArena.BeginFrame();
+		recycled = (listener.numTicks == cNumTicks && sendArena.NumFreePages() == numPages);
+		sendArena.EndFrame();
+		Clock::Sleep(1);
+	}
+	assert(listener.numTicks == cNumTicks);
+	assert(recycled);
+
+	connection->Close(0);
+	connection = 0;
+	serverNetwork.StopServer();
+
+	ENDTEST()
+}
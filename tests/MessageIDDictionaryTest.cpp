@@ -0,0 +1,80 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MessageIDDictionaryTest.cpp
+	@brief Tests the counting, the offer and accept, and the encoding and decoding of MessageIDDictionary. */
+
+#include "kNet/MessageIDDictionary.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+void MessageIDDictionaryTest()
+{
+	using namespace kNet;
+
+	TEST("MessageIDDictionary")
+	MessageIDDictionary sender;
+	MessageIDDictionary receiver;
+	message_id_t code = 0;
+
+	// Disabled until a code range is set.
+	assert(!sender.Enabled());
+	for(u32 i = 0; i < MessageIDDictionary::cHotThreshold * 2; ++i)
+		assert(!sender.CountSent(1000, code));
+	assert(sender.Encode(1000) == 1000);
+
+	// The range is clamped to the IDs above the protocol ones and below 128.
+	sender.SetCodeRange(10, 200);
+	assert(sender.Enabled());
+	assert(sender.Offered(14, 1000) == false && sender.Offered(127, 1000) == true);
+	sender.SetCodeRange(100, 2);
+	receiver.SetCodeRange(100, 2);
+
+	// The 1-byte IDs never get a code.
+	for(u32 i = 0; i < MessageIDDictionary::cHotThreshold * 2; ++i)
+		assert(!sender.CountSent(50, code));
+
+	// A long ID gets a code once it has been sent cHotThreshold times, and uses it only once the peer accepts it.
+	for(u32 i = 1; i < MessageIDDictionary::cHotThreshold; ++i)
+		assert(!sender.CountSent(1000, code));
+	assert(sender.CountSent(1000, code));
+	assert(code == 100);
+	assert(!sender.CountSent(1000, code));
+	assert(sender.Encode(1000) == 1000);
+	assert(receiver.Decode(100) == 100);
+	assert(receiver.Offered(code, 1000));
+	assert(!sender.Accepted(code, 1001));
+	assert(sender.Accepted(code, 1000));
+	assert(sender.Encode(1000) == 100);
+	assert(receiver.Decode(sender.Encode(1000)) == 1000);
+	assert(receiver.Decode(1001) == 1001);
+
+	// A code already mapped to another ID is rejected, and a repeated offer of the same mapping accepted.
+	assert(!receiver.Offered(100, 2000));
+	assert(receiver.Offered(100, 1000));
+	assert(!receiver.Offered(99, 2000));
+
+	// Once all codes have been offered, the other IDs are sent as they are.
+	for(u32 i = 0; i < MessageIDDictionary::cHotThreshold; ++i)
+		sender.CountSent(70000, code);
+	assert(code == 101);
+	for(u32 i = 0; i < MessageIDDictionary::cHotThreshold * 2; ++i)
+		assert(!sender.CountSent(3000, code));
+	assert(sender.Encode(3000) == 3000);
+
+	// Resetting the range forgets the mappings.
+	receiver.SetCodeRange(100, 2);
+	assert(receiver.Decode(100) == 100);
+	ENDTEST()
+}
@@ -0,0 +1,119 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file MessageListBinaryTest.cpp
+	@brief Tests that SerializedMessageList loads back the binary schema it saves, and rejects malformed ones. */
+
+#include <cstdio>
+#include <vector>
+
+#include "kNet/MessageListParser.h"
+#include "kNet/NetException.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const char messagesXml[] =
+	"<messages>\n"
+	"<message id=\"100\" name=\"EntityPos\" reliable=\"false\" inOrder=\"true\" priority=\"50\">\n"
+	"  <u32 name=\"entityId\" />\n"
+	"  <float name=\"pos\" count=\"3\" />\n"
+	"  <bit name=\"flags\" count=\"5\" />\n"
+	"  <struct name=\"parts\" dynamicCount=\"8\">\n"
+	"    <u16 name=\"partId\" />\n"
+	"    <string name=\"label\" />\n"
+	"  </struct>\n"
+	"</message>\n"
+	"<message id=\"101\" name=\"Chat\" reliable=\"true\" inOrder=\"true\" priority=\"100\">\n"
+	"  <string name=\"text\" />\n"
+	"</message>\n"
+	"</messages>\n";
+
+bool ElementsEqual(const SerializedElementDesc &a, const SerializedElementDesc &b)
+{
+	if (a.type != b.type || a.typeString != b.typeString || a.varyingCount != b.varyingCount || a.count != b.count
+		|| a.name != b.name || a.elements.size() != b.elements.size() || (a.parent == 0) != (b.parent == 0))
+		return false;
+	for(size_t i = 0; i < a.elements.size(); ++i)
+		if (a.elements[i]->parent != &a || b.elements[i]->parent != &b || !ElementsEqual(*a.elements[i], *b.elements[i]))
+			return false;
+	return true;
+}
+
+bool LoadThrows(const std::vector<char> &data, size_t numBytes)
+{
+	SerializedMessageList list;
+	try
+	{
+		list.LoadBinary(&data[0], numBytes);
+	} catch(const NetException &)
+	{
+		return list.GetMessages().empty() && list.GetElements().empty();
+	}
+	return false;
+}
+
+}
+
+void MessageListBinaryTest()
+{
+	TEST("MessageListBinary")
+
+	const char filename[] = "MessageListBinaryTest.xml";
+	FILE *handle = fopen(filename, "wb");
+	assert(handle);
+	fwrite(messagesXml, 1, sizeof(messagesXml) - 1, handle);
+	fclose(handle);
+
+	SerializedMessageList xmlList;
+	xmlList.LoadMessagesFromFile(filename);
+	remove(filename);
+	assert(xmlList.GetMessages().size() == 2);
+
+	std::vector<char> binary;
+	xmlList.SaveBinary(binary);
+
+	SerializedMessageList binaryList;
+	binaryList.LoadBinary(&binary[0], binary.size());
+	assert(binaryList.GetElements().size() == xmlList.GetElements().size());
+	assert(binaryList.GetMessages().size() == xmlList.GetMessages().size());
+	for(std::list<SerializedMessageDesc>::const_iterator iter = xmlList.GetMessages().begin(); iter != xmlList.GetMessages().end(); ++iter)
+	{
+		const SerializedMessageDesc *loaded = binaryList.FindMessageByID(iter->id);
+		assert(loaded);
+		assert(loaded->name == iter->name);
+		assert(loaded->reliable == iter->reliable && loaded->inOrder == iter->inOrder && loaded->priority == iter->priority);
+		assert(ElementsEqual(*loaded->data, *iter->data));
+	}
+
+	// Saving the loaded list again gives the same bytes.
+	std::vector<char> binary2;
+	binaryList.SaveBinary(binary2);
+	assert(binary2 == binary);
+
+	// Each truncated schema and each corrupted header is rejected, and leaves the list empty.
+	for(size_t i = 1; i < binary.size(); ++i)
+		assert(LoadThrows(binary, i));
+	std::vector<char> corrupt = binary;
+	corrupt[0] ^= 1;
+	assert(LoadThrows(corrupt, corrupt.size()));
+	corrupt = binary;
+	corrupt[4] = 99;
+	assert(LoadThrows(corrupt, corrupt.size()));
+
+	ENDTEST()
+}
@@ -0,0 +1,67 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MessageNumberWindowTest.cpp
+	@brief Tests that MessageNumberWindow detects the duplicates and moves its low watermark past the numbers received. */
+
+#include "kNet/MessageNumberWindow.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+void MessageNumberWindowTest()
+{
+	TEST("MessageNumberWindow")
+	MessageNumberWindow window;
+	const u32 windowSize = MessageNumberWindow::cWindowSize;
+	assert(window.LowWatermark() == 0 && !window.Contains(0));
+
+	// Receive the odd numbers first, then the even ones. The watermark stays at the first gap.
+	for(u32 i = 1; i < 200; i += 2)
+		assert(window.Insert(i) == MessageNumberWindow::NewNumber);
+	assert(window.Insert(7) == MessageNumberWindow::DuplicateNumber);
+	assert(window.LowWatermark() == 0);
+	for(u32 i = 0; i <= 100; i += 2)
+		assert(window.Insert(i) == MessageNumberWindow::NewNumber);
+	assert(window.LowWatermark() == 102);
+	assert(window.Contains(50) && window.Contains(103) && !window.Contains(102));
+	assert(window.Insert(50) == MessageNumberWindow::DuplicateNumber);
+
+	// The window ends cWindowSize numbers after the watermark.
+	assert(window.Insert(102 + windowSize) == MessageNumberWindow::NumberAheadOfWindow);
+	assert(!window.Contains(102 + windowSize));
+	assert(window.Insert(101 + windowSize) == MessageNumberWindow::NewNumber);
+	for(u32 i = 102; i < 200; i += 2)
+		assert(window.Insert(i) == MessageNumberWindow::NewNumber);
+	assert(window.LowWatermark() == 200);
+
+	// Fill whole words in order. The freed bits are clear for the numbers that enter the window.
+	for(u32 i = 200; i < 101 + windowSize; ++i)
+		assert(window.Insert(i) == MessageNumberWindow::NewNumber);
+	assert(window.LowWatermark() == 102 + windowSize);
+	assert(!window.Contains(102 + windowSize) && !window.Contains(200 + windowSize));
+	assert(window.Insert(102 + windowSize) == MessageNumberWindow::NewNumber);
+
+	// Over the 32-bit wraparound.
+	window.Clear(0xFFFFFF00);
+	assert(window.Insert(0x10) == MessageNumberWindow::NewNumber);
+	assert(window.Insert(0xFFFFFEFF) == MessageNumberWindow::DuplicateNumber);
+	assert(window.Insert(0xFFFFFF00 + windowSize) == MessageNumberWindow::NumberAheadOfWindow);
+	for(u32 i = 0xFFFFFF00; i != 0x10; ++i)
+		assert(window.Insert(i) == MessageNumberWindow::NewNumber);
+	assert(window.LowWatermark() == 0x11);
+	assert(window.Contains(0xFFFFFFFF) && window.Contains(0x10) && !window.Contains(0x11));
+	ENDTEST()
+}
@@ -0,0 +1,127 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file MessageSchemaTest.cpp
+	@brief Tests that SchemaSerializer and SchemaDeserializer produce the same bytes as DataSerializer and DataDeserializer. */
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "kNet/MessageSchema.h"
+#include "kNet/NetException.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+typedef SchemaField<u32, SchemaField<SchemaArray<float, 3>, SchemaField<std::string,
+	SchemaField<SchemaVaryingArray<u16, u8>, SchemaField<s8> > > > > EntitySchema;
+
+SerializedElementDesc *NewElement(SerializedElementDesc &parent, BasicSerializedDataType type, int count, bool varyingCount)
+{
+	SerializedElementDesc *e = new SerializedElementDesc;
+	e->type = type;
+	e->count = count;
+	e->varyingCount = varyingCount;
+	e->parent = &parent;
+	parent.elements.push_back(e);
+	return e;
+}
+
+}
+
+void MessageSchemaTest()
+{
+	TEST("MessageSchema")
+
+	const u32 entityId = 0xCAFE1234;
+	const float pos[3] = { 1.f, -2.5f, 1e-3f };
+	const std::string name = "crate";
+	const u16 parts[4] = { 1, 2, 300, 65535 };
+	const s8 delta = -7;
+
+	char schemaBytes[128];
+	DataSerializer schemaWriter(schemaBytes, sizeof(schemaBytes));
+	SchemaSerializer<EntitySchema>(schemaWriter).Add(entityId).AddArray(pos).AddString(name).AddVaryingArray<u8>(parts, 4).Add(delta).End();
+
+	char plainBytes[128];
+	DataSerializer plainWriter(plainBytes, sizeof(plainBytes));
+	plainWriter.Add<u32>(entityId);
+	plainWriter.AddArray<float>(pos, 3);
+	plainWriter.AddString(name);
+	plainWriter.Add<u8>(4);
+	plainWriter.AddArray<u16>(parts, 4);
+	plainWriter.Add<s8>(delta);
+
+	assert(schemaWriter.BytesFilled() == plainWriter.BytesFilled());
+	assert(memcmp(schemaBytes, plainBytes, plainWriter.BytesFilled()) == 0);
+
+	u32 readId = 0;
+	float readPos[3] = {};
+	std::string readName;
+	std::vector<u16> readParts;
+	s8 readDelta = 0;
+	DataDeserializer reader(schemaBytes, schemaWriter.BytesFilled());
+	SchemaDeserializer<EntitySchema>(reader).Read(readId).ReadArray(readPos).ReadString(readName).ReadVaryingArray<u8>(readParts).Read(readDelta).End();
+	assert(readId == entityId);
+	assert(memcmp(readPos, pos, sizeof(pos)) == 0);
+	assert(readName == name);
+	assert(readParts.size() == 4 && readParts[2] == 300 && readParts[3] == 65535);
+	assert(readDelta == delta);
+	assert(reader.BytesLeft() == 0);
+
+	// Reading past the end of the data throws, like with a plain DataDeserializer.
+	DataDeserializer truncated(schemaBytes, schemaWriter.BytesFilled() - 1);
+	bool threw = false;
+	try
+	{
+		SchemaDeserializer<EntitySchema>(truncated).Read(readId).ReadArray(readPos).ReadString(readName).ReadVaryingArray<u8>(readParts).Read(readDelta).End();
+	} catch(const NetException &)
+	{
+		threw = true;
+	}
+	assert(threw);
+
+	// A schema matches the message description that has the same fields in the same order.
+	SerializedElementDesc root;
+	root.type = SerialStruct;
+	root.count = 1;
+	root.varyingCount = false;
+	root.parent = 0;
+	NewElement(root, SerialU32, 1, false);
+	NewElement(root, SerialFloat, 3, false);
+	NewElement(root, SerialString, 1, false);
+	NewElement(root, SerialU16, 8, true);
+	SerializedMessageDesc message;
+	message.data = &root;
+	assert(!SchemaMatchesMessage<EntitySchema>(message));
+	SerializedElementDesc *last = NewElement(root, SerialS8, 1, false);
+	assert(SchemaMatchesMessage<EntitySchema>(message));
+	last->type = SerialU8;
+	assert(!SchemaMatchesMessage<EntitySchema>(message));
+	last->type = SerialS8;
+	root.elements[3]->count = 16;
+	assert(!SchemaMatchesMessage<EntitySchema>(message));
+	root.elements[3]->count = 8;
+	NewElement(root, SerialU8, 1, false);
+	assert(!SchemaMatchesMessage<EntitySchema>(message));
+
+	for(size_t i = 0; i < root.elements.size(); ++i)
+		delete root.elements[i];
+
+	ENDTEST()
+}
@@ -0,0 +1,130 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file MessageTracerTest.cpp
+	@brief Tests the sampling, the per-thread rings and the Chrome trace output of MessageTracer. */
+
+#include <string>
+#include <vector>
+
+#include "kNet/MessageTracer.h"
+#include "kNet/Thread.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+volatile u32 otherThreadTraceID = 0;
+volatile bool otherThreadDone = false;
+
+void RecordOnOtherThread()
+{
+	otherThreadTraceID = MessageTracer::SampleMessage();
+	MessageTracer::Record(otherThreadTraceID, 77, TraceReceived);
+	MessageTracer::Record(otherThreadTraceID, 77, TraceDelivered);
+	otherThreadDone = true;
+}
+
+bool Contains(const std::string &str, const char *substr)
+{
+	return str.find(substr) != std::string::npos;
+}
+
+}
+
+void MessageTracerTest()
+{
+	TEST("MessageTracer")
+
+	// Tracing is off by default.
+	assert(MessageTracer::SamplingInterval() == 0);
+	assert(MessageTracer::SampleMessage() == 0);
+	MessageTracer::Clear();
+	MessageTracer::Record(0, 100, TraceStarted);
+	std::vector<MessageTraceEvent> events;
+	MessageTracer::Collect(events);
+	assert(events.empty());
+
+	// Every fourth message is sampled.
+	MessageTracer::SetSamplingInterval(4);
+	int numSampled = 0;
+	for(int i = 0; i < 400; ++i)
+		if (MessageTracer::SampleMessage() != 0)
+			++numSampled;
+	assert(numSampled == 100);
+
+	// The stages of a message are collected in time order.
+	MessageTracer::SetSamplingInterval(1);
+	const u32 traceID = MessageTracer::SampleMessage();
+	assert(traceID != 0);
+	assert(MessageTracer::SampleMessage() != traceID);
+	for(int stage = TraceStarted; stage <= TraceAcked; ++stage)
+		MessageTracer::Record(traceID, 100, (MessageTraceStage)stage);
+	MessageTracer::Collect(events);
+	assert(events.size() == TraceAcked + 1);
+	for(size_t i = 0; i < events.size(); ++i)
+	{
+		assert(events[i].traceID == traceID);
+		assert(events[i].messageID == 100);
+		assert(events[i].stage == i);
+		assert(i == 0 || Clock::IsNewer(events[i].tick, events[i-1].tick));
+	}
+
+	// Another thread records to a ring of its own.
+	Thread thread;
+	thread.RunFunc(RecordOnOtherThread);
+	while(!otherThreadDone)
+		Clock::Sleep(1);
+	thread.Stop();
+	MessageTracer::Collect(events);
+	assert(events.size() == TraceAcked + 3);
+	int numOtherThread = 0;
+	for(size_t i = 0; i < events.size(); ++i)
+		if (events[i].traceID == otherThreadTraceID)
+		{
+			assert(events[i].thread != events[0].thread);
+			++numOtherThread;
+		}
+	assert(numOtherThread == 2);
+
+	// Each message is an async slice, with a slice for each stage it waited in.
+	const std::string trace = MessageTracer::ToChromeTrace(events);
+	assert(trace.find("{\"traceEvents\":[") == 0);
+	assert(Contains(trace, "\"name\":\"Message 100 (out)\",\"cat\":\"kNet\",\"ph\":\"b\""));
+	assert(Contains(trace, "\"name\":\"Message 77 (in)\""));
+	assert(Contains(trace, "\"name\":\"OutboundQueue\""));
+	assert(Contains(trace, "\"name\":\"InboundQueue\""));
+	assert(Contains(trace, "\"name\":\"Acked\",\"cat\":\"kNet\",\"ph\":\"n\""));
+	assert(MessageTracer::ToChromeTrace(std::vector<MessageTraceEvent>()) == "{\"traceEvents\":[]}\n");
+
+	// The ring keeps the latest events.
+	MessageTracer::Clear();
+	Clock::Sleep(1);
+	for(int i = 0; i < MessageTracer::cRingSize + 100; ++i)
+		MessageTracer::Record(traceID, (u32)i, TraceSent);
+	MessageTracer::Collect(events);
+	assert(events.size() == (size_t)MessageTracer::cRingSize);
+	assert(events.front().messageID == 100);
+	assert(events.back().messageID == (u32)MessageTracer::cRingSize + 99);
+
+	MessageTracer::SetSamplingInterval(0);
+	MessageTracer::Clear();
+	Clock::Sleep(1);
+	MessageTracer::Collect(events);
+	assert(events.empty());
+
+	ENDTEST()
+}
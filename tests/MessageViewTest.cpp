@@ -0,0 +1,109 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file MessageViewTest.cpp
+	@brief Tests that MessageView reads the fields written by DataSerializer straight from the serialized bytes. */
+
+#include <cstring>
+#include <string>
+
+#include "kNet/DataSerializer.h"
+#include "kNet/MessageView.h"
+#include "kNet/NetException.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+/// Returns true if accessing the field at the given offset of the given view throws a NetException.
+bool StringThrows(const MessageView &view, size_t offset)
+{
+	try
+	{
+		view.ReadString(offset);
+	} catch(const NetException &)
+	{
+		return true;
+	}
+	return false;
+}
+
+bool FloatArrayThrows(const MessageView &view, size_t offset, size_t count)
+{
+	try
+	{
+		view.ReadArray<float>(offset, count);
+	} catch(const NetException &)
+	{
+		return true;
+	}
+	return false;
+}
+
+}
+
+void MessageViewTest()
+{
+	TEST("MessageView")
+
+	// Serialize a u8, a string, a u16-counted u32 array and a fixed array of three floats.
+	char buffer[256];
+	DataSerializer ds(buffer, sizeof(buffer));
+	const u32 ids[5] = { 1, 70000, 3, 0xFFFFFFFF, 42 };
+	const float position[3] = { 1.5f, -2.f, 1e6f };
+	ds.Add<u8>(7);
+	ds.AddString("hello");
+	ds.Add<u16>(5);
+	ds.AddArray<u32>(ids, 5);
+	ds.AddArray<float>(position, 3);
+
+	MessageView view(buffer, ds.BytesFilled());
+	assert(view.Read<u8>(0) == 7);
+
+	const size_t stringOffset = 1;
+	SerializedArrayView<char> text = view.ReadString(stringOffset);
+	assert(text.size() == 5);
+	assert(std::string(text.Data(), text.size()) == "hello");
+	assert(text[4] == 'o');
+
+	const size_t idsOffset = stringOffset + view.StringSize(stringOffset);
+	SerializedArrayView<u32> idView = view.ReadVaryingArray<u32, u16>(idsOffset);
+	assert(idView.size() == 5);
+	size_t i = 0;
+	for(SerializedArrayView<u32>::const_iterator iter = idView.begin(); iter != idView.end(); ++iter, ++i)
+		assert(*iter == ids[i]);
+	assert(i == 5);
+
+	const size_t positionOffset = idsOffset + view.VaryingArraySize<u32, u16>(idsOffset);
+	SerializedArrayView<float> positionView = view.ReadArray<float>(positionOffset, 3);
+	for(i = 0; i < 3; ++i)
+		assert(positionView[i] == position[i]);
+	assert(positionOffset + positionView.NumBytes() == ds.BytesFilled());
+
+	// The fields that do not fit in a truncated message throw, and the ones before them can still be read.
+	MessageView truncated(buffer, ds.BytesFilled() - 1);
+	assert((truncated.ReadVaryingArray<u32, u16>(idsOffset).size() == 5));
+	assert(FloatArrayThrows(truncated, positionOffset, 3));
+	assert(!FloatArrayThrows(truncated, positionOffset, 2));
+	assert(FloatArrayThrows(truncated, (size_t)-1, 1));
+	assert(FloatArrayThrows(view, positionOffset, (size_t)-1 / 2));
+
+	MessageView shortString(buffer, 4);
+	assert(StringThrows(shortString, stringOffset));
+	assert(!StringThrows(view, stringOffset));
+
+	ENDTEST()
+}
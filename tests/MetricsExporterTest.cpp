@@ -0,0 +1,81 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file MetricsExporterTest.cpp
+	@brief Tests the Prometheus text that MetricsExporter formats. */
+
+#include <cstdio>
+#include <string>
+
+#include "kNet/MetricsExporter.h"
+#include "kNet/Network.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+bool Contains(const std::string &str, const char *substr)
+{
+	return str.find(substr) != std::string::npos;
+}
+
+}
+
+void MetricsExporterTest()
+{
+	TEST("MetricsExporter")
+
+	Network network;
+	const std::string metrics = MetricsExporter::FormatMetrics(network);
+
+	// Each metric family has its type declared, even when there are no connections to report.
+	assert(Contains(metrics, "# TYPE knet_connection_received_bytes_total counter\n"));
+	assert(Contains(metrics, "# TYPE knet_connection_rtt_milliseconds gauge\n"));
+	assert(Contains(metrics, "# TYPE knet_connection_ping_rtt_milliseconds summary\n"));
+	assert(Contains(metrics, "# TYPE knet_worker_round_milliseconds summary\n"));
+	assert(Contains(metrics, "knet_stats_dropped_events_total 0\n"));
+	assert(!Contains(metrics, "knet_server_connections"));
+
+	// Every line is either a comment or a sample that ends in a value.
+	size_t lineStart = 0;
+	while(lineStart < metrics.size())
+	{
+		size_t lineEnd = metrics.find('\n', lineStart);
+		assert(lineEnd != std::string::npos);
+		const std::string line = metrics.substr(lineStart, lineEnd - lineStart);
+		assert(!line.empty());
+		assert(line[0] == '#' || line.find(' ') != std::string::npos);
+		lineStart = lineEnd + 1;
+	}
+
+	// The file is replaced as a whole.
+	MetricsExporter exporter(&network);
+	assert(!exporter.IsRunning());
+	const char *filename = "MetricsExporterTest.prom";
+	assert(exporter.WriteToFile(filename));
+	FILE *handle = fopen(filename, "rb");
+	assert(handle);
+	std::string contents;
+	char buffer[1024];
+	size_t numRead;
+	while((numRead = fread(buffer, 1, sizeof(buffer), handle)) > 0)
+		contents.append(buffer, numRead);
+	fclose(handle);
+	remove(filename);
+	assert(contents == metrics);
+
+	ENDTEST()
+}
@@ -0,0 +1,121 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file MulticastChannelTest.cpp
+	@brief Tests that MulticastChannel packs the messages into datagrams and receives them from the group. */
+
+#include <cstring>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "kNet/MulticastChannel.h"
+#include "kNet/Network.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+/// Waits for the next datagram of the group, for at most a second.
+static bool WaitDatagram(MulticastChannel &receiver)
+{
+	PolledTimer timer(1000.f);
+	while(!timer.Test())
+	{
+		if (receiver.ReceiveDatagram())
+			return true;
+		Clock::Sleep(1);
+	}
+	return false;
+}
+
+/// Sends the given bytes to the group as a raw datagram.
+static void SendRaw(const EndPoint &group, const char *data, size_t numBytes)
+{
+	SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	sockaddr_in address = group.ToSockAddrIn();
+	sendto(s, data, (int)numBytes, 0, (const sockaddr *)&address, sizeof(address));
+	closesocket(s);
+}
+
+void MulticastChannelTest()
+{
+	TEST("MulticastChannel")
+	Network network; // Initializes the sockets.
+	const EndPoint group = EndPoint::FromIPAndPort(239, 255, 77, 1, 23977);
+	assert(MulticastChannel::IsMulticastAddress(group));
+	assert(!MulticastChannel::IsMulticastAddress(EndPoint::FromIPAndPort(127, 0, 0, 1, 23977)));
+
+	MulticastChannel sender;
+	assert(!sender.OpenSender(EndPoint::FromIPAndPort(10, 0, 0, 1, 23977), 1, 1400));
+	assert(!sender.QueueMessage(1, "x", 1));
+	assert(sender.OpenSender(group, 1, 256));
+	assert(sender.IsSender());
+
+	// A host without a multicast route cannot join, so there is nothing more to test there.
+	MulticastChannel receiver;
+	if (receiver.Join(group, EndPoint()))
+	{
+		// The messages queued go out together in one datagram.
+		assert(sender.QueueMessage(10, "hello", 5));
+		assert(sender.QueueMessage(300, 0, 0));
+		assert(sender.QueueMessage(70000, "abc", 3));
+		sender.Flush();
+		sender.Flush();
+		assert(sender.NumDatagramsSent() == 1);
+		assert(WaitDatagram(receiver));
+		const std::vector<MulticastChannel::ReceivedMessage> &messages = receiver.ReceivedMessages();
+		assert(messages.size() == 3);
+		assert(messages[0].id == 10 && messages[0].numBytes == 5 && memcmp(messages[0].data, "hello", 5) == 0);
+		assert(messages[1].id == 300 && messages[1].numBytes == 0);
+		assert(messages[2].id == 70000 && messages[2].numBytes == 3 && memcmp(messages[2].data, "abc", 3) == 0);
+		assert(!receiver.ReceiveDatagram());
+
+		// A message that does not fit in a datagram is refused, and the ones that do not fit in the current datagram
+		// start a new one.
+		char data[200] = {};
+		assert(!sender.QueueMessage(1, data, 250));
+		assert(sender.QueueMessage(1, data, 200));
+		assert(sender.QueueMessage(2, data, 200));
+		sender.Flush();
+		assert(sender.NumDatagramsSent() == 3);
+		assert(WaitDatagram(receiver) && receiver.ReceivedMessages().size() == 1 && receiver.ReceivedMessages()[0].id == 1);
+		assert(WaitDatagram(receiver) && receiver.ReceivedMessages().size() == 1 && receiver.ReceivedMessages()[0].id == 2);
+		assert(receiver.NumDatagramsReceived() == 3 && receiver.NumDatagramsLost() == 0);
+
+		// A datagram with an old sequence number and a malformed one are dropped, and a gap is counted lost.
+		const char late[] = { 'k', 'N', 'M', 'c', 1, 0, 0, 0, 5, 0 };
+		SendRaw(group, late, sizeof(late));
+		const char truncated[] = { 'k', 'N', 'M', 'c', 9, 0, 0, 0, 5, 10, 'a' };
+		SendRaw(group, truncated, sizeof(truncated));
+		const char ahead[] = { 'k', 'N', 'M', 'c', 5, 0, 0, 0, 7, 1, 'z' };
+		SendRaw(group, ahead, sizeof(ahead));
+		assert(WaitDatagram(receiver));
+		assert(receiver.ReceivedMessages().size() == 1 && receiver.ReceivedMessages()[0].id == 7);
+		assert(receiver.NumDatagramsReceived() == 4 && receiver.NumDatagramsLost() == 2);
+
+		// A receiver that only accepts another sender drops the datagrams that a receiver of any sender gets.
+		MulticastChannel filtered;
+		assert(filtered.Join(group, EndPoint::FromIPAndPort(10, 1, 2, 3, 0)));
+		MulticastChannel unfiltered;
+		assert(unfiltered.Join(group, EndPoint()));
+		assert(sender.QueueMessage(3, "y", 1));
+		sender.Flush();
+		assert(WaitDatagram(unfiltered));
+		assert(!filtered.ReceiveDatagram());
+	}
+	ENDTEST()
+}
@@ -0,0 +1,131 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file NetworkLoggingTest.cpp
+	@brief Tests that the asynchronous logging backend formats the queued lines like printf does. */
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "kNet/Clock.h"
+#include "kNet/NetworkLogging.h"
+#include "kNet/Thread.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const char cLogFileName[] = "NetworkLoggingTest.log";
+
+volatile bool otherThreadDone = false;
+
+void LogOnOtherThread()
+{
+	for(int i = 0; i < 10; ++i)
+		KNET_LOG(LogVerbose, "other thread line %d", i);
+	otherThreadDone = true;
+}
+
+/// Returns the lines of the log file with the timestamps removed.
+std::vector<std::string> ReadLogLines()
+{
+	std::vector<std::string> lines;
+	std::ifstream file(cLogFileName);
+	std::string line;
+	while(std::getline(file, line))
+	{
+		size_t colon = line.find(": ");
+		lines.push_back(colon == std::string::npos ? line : line.substr(colon + 2));
+	}
+	return lines;
+}
+
+bool ContainsLine(const std::vector<std::string> &lines, const char *line)
+{
+	for(size_t i = 0; i < lines.size(); ++i)
+		if (lines[i] == line)
+			return true;
+	return false;
+}
+
+}
+
+void NetworkLoggingTest()
+{
+	TEST("NetworkLogging")
+
+	const LogChannel oldChannels = GetLogChannels();
+	remove(cLogFileName);
+	SetLogFile(cLogFileName);
+	SetLogChannels(LogUser | LogVerbose);
+
+	assert(!IsAsyncLoggingEnabled());
+	SetAsyncLogging(true);
+	assert(IsAsyncLoggingEnabled());
+
+	const char *str = "abc";
+	KNET_LOG(LogVerbose, "int %d, unsigned %u, hex %x", -5, 7u, 255);
+	KNET_LOG(LogVerbose, "string %s, padded [%5s], char %c", str, "de", 'f');
+	KNET_LOG(LogVerbose, "double %.2f, width [%*d], long long %lld, 100%%", 3.14159, 4, 12, 1234567890123LL);
+	KNET_LOG(LogVerbose, "null %s", (const char *)0);
+	KNET_LOG(LogInfo, "muted %d", 1);
+	const std::string longString(300, 'x');
+	KNET_LOG(LogVerbose, "long %s", longString.c_str());
+
+	Thread thread;
+	thread.RunFunc(LogOnOtherThread);
+	while(!otherThreadDone)
+		Clock::Sleep(1);
+	thread.Stop();
+
+	FlushLog();
+	std::vector<std::string> lines = ReadLogLines();
+	assert(ContainsLine(lines, "int -5, unsigned 7, hex ff"));
+	assert(ContainsLine(lines, "string abc, padded [   de], char f"));
+	assert(ContainsLine(lines, "double 3.14, width [  12], long long 1234567890123, 100%"));
+	assert(ContainsLine(lines, "null (null)"));
+	assert(!ContainsLine(lines, "muted 1"));
+	assert(ContainsLine(lines, ("long " + longString).c_str()));
+
+	// The lines of a single thread keep their order.
+	int nextLine = 0;
+	for(size_t i = 0; i < lines.size(); ++i)
+	{
+		char expected[64];
+		sprintf(expected, "other thread line %d", nextLine);
+		if (lines[i] == expected)
+			++nextLine;
+	}
+	assert(nextLine == 10);
+	assert(NumDroppedLogLines() == 0);
+
+	// Disabling writes out the lines that are still queued.
+	KNET_LOG(LogVerbose, "last async line");
+	SetAsyncLogging(false);
+	assert(!IsAsyncLoggingEnabled());
+	KNET_LOG(LogVerbose, "sync line %d", 2);
+	lines = ReadLogLines();
+	assert(ContainsLine(lines, "last async line"));
+	assert(ContainsLine(lines, "sync line 2"));
+
+	SetLogFile(0);
+	SetLogChannels(oldChannels);
+	remove(cLogFileName);
+
+	ENDTEST()
+}
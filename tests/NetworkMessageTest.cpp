@@ -0,0 +1,64 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file NetworkMessageTest.cpp
+	@brief Tests that small message payloads are stored inline, and large ones in data buffers of their own. */
+
+#include <string.h>
+
+#include "kNet/NetworkMessage.h"
+#include "kNet/MessageDataAllocator.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+/// Returns true if the data of the message is stored within the message structure itself.
+bool IsInline(const NetworkMessage *msg)
+{
+	return msg->data >= (const char *)msg && msg->data < (const char *)(msg + 1);
+}
+
+} // ~unnamed namespace
+
+void NetworkMessageTest()
+{
+	TEST("NetworkMessage")
+	const MessageDataStatistics before = MessageDataAllocator::Statistics();
+
+	// A small payload does not allocate a data buffer.
+	NetworkMessage *msg = NetworkMessagePool::New();
+	msg->Resize(NetworkMessage::cInlineCapacity);
+	assert(IsInline(msg));
+	assert(msg->Capacity() == NetworkMessage::cInlineCapacity);
+	memset(msg->data, 0x5A, msg->Size());
+	assert(MessageDataAllocator::Statistics().numBlockAllocations == before.numBlockAllocations);
+
+	// A copy of it is inline in the copy.
+	NetworkMessage copy(*msg);
+	assert(IsInline(&copy) && copy.data != msg->data);
+	assert(copy.Size() == msg->Size() && memcmp(copy.data, msg->data, msg->Size()) == 0);
+
+	// Growing past the inline storage moves the contents to a buffer of their own.
+	msg->Resize(1000, false);
+	assert(!IsInline(msg));
+	assert(msg->Capacity() >= 1000);
+	assert(msg->data[0] == 0x5A && msg->data[NetworkMessage::cInlineCapacity - 1] == 0x5A);
+	assert(MessageDataAllocator::Statistics().blocksInUse == before.blocksInUse + 1);
+	NetworkMessagePool::Free(msg);
+	ENDTEST()
+}
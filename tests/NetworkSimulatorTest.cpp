@@ -0,0 +1,97 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file NetworkSimulatorTest.cpp
+	@brief Tests the delay, loss and bottleneck link stages of NetworkSimulator on received datagrams. */
+
+#include "kNet/NetworkSimulator.h"
+#include "kNet/Clock.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+void NetworkSimulatorTest()
+{
+	const char datagram[100] = {};
+
+	TEST("NetworkSimulatorDelay")
+	NetworkSimulator simulator;
+	assert(simulator.MSecsUntilNextTransfer() == -1.f);
+	simulator.constantPacketSendDelay = 20.f;
+	for(int i = 0; i < 3; ++i)
+		simulator.SubmitReceivedDatagram(datagram, sizeof(datagram));
+	assert(simulator.NumQueuedPackets() == 3);
+	const float msecs = simulator.MSecsUntilNextTransfer();
+	assert(msecs >= 15.f && msecs <= 21.f);
+	simulator.Process();
+	assert(simulator.NumQueuedPackets() == 3);
+	Clock::Sleep(30);
+	simulator.Process();
+	assert(simulator.NumQueuedPackets() == 0);
+	assert(simulator.MSecsUntilNextTransfer() == -1.f);
+	ENDTEST()
+
+	TEST("NetworkSimulatorLoss")
+	NetworkSimulator simulator;
+	simulator.Seed(1);
+	simulator.packetLossRate = 0.25f;
+	for(int i = 0; i < 10000; ++i)
+		simulator.SubmitReceivedDatagram(datagram, sizeof(datagram));
+	assert(simulator.NumLostPackets() > 2200 && simulator.NumLostPackets() < 2800);
+	assert(simulator.NumQueuedPackets() == 10000 - (int)simulator.NumLostPackets());
+	simulator.Free();
+	assert(simulator.NumQueuedPackets() == 0);
+	ENDTEST()
+
+	TEST("NetworkSimulatorBurstLoss")
+	NetworkSimulator simulator;
+	simulator.Seed(2);
+	simulator.burstLossEnterRate = 0.01f;
+	simulator.burstLossExitRate = 0.25f;
+	// The losses come in bursts of four packets on average, and make up 0.01 / (0.01 + 0.25) of all the packets.
+	int numBursts = 0;
+	bool lost = false;
+	for(int i = 0; i < 20000; ++i)
+	{
+		const u64 numLost = simulator.NumLostPackets();
+		simulator.SubmitReceivedDatagram(datagram, sizeof(datagram));
+		const bool lostNow = simulator.NumLostPackets() != numLost;
+		if (lostNow && !lost)
+			++numBursts;
+		lost = lostNow;
+	}
+	simulator.Free();
+	const u64 numLost = simulator.NumLostPackets();
+	assert(numLost > 500 && numLost < 1100);
+	assert(numBursts > 0 && numLost > (u64)numBursts * 3 && numLost < (u64)numBursts * 5);
+	ENDTEST()
+
+	TEST("NetworkSimulatorBandwidth")
+	NetworkSimulator simulator;
+	simulator.bandwidthBytesPerSec = 1000.f;
+	simulator.queueLimitBytes = 1000;
+	// The link takes 100 msecs to send each datagram, and the queue holds ten of them.
+	for(int i = 0; i < 20; ++i)
+		simulator.SubmitReceivedDatagram(datagram, sizeof(datagram));
+	assert(simulator.NumQueuedPackets() == 10);
+	assert(simulator.NumQueueDrops() == 10);
+	// The simulator may ask to be processed earlier than the first packet is due, when it moves the later packets on its
+	// timer wheel.
+	assert(simulator.MSecsUntilNextTransfer() <= 101.f);
+	simulator.Process();
+	assert(simulator.NumQueuedPackets() == 10);
+	simulator.Free();
+	ENDTEST()
+}
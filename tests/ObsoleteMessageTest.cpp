@@ -0,0 +1,112 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file ObsoleteMessageTest.cpp
+	@brief Tests that a TCP connection whose outbound queue holds nothing but obsolete messages drops them without sending,
+	and goes on to send the messages queued after them. */
+
+#include <vector>
+
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPort = 47304;
+
+const message_id_t cMsgObsolete = 100;
+const message_id_t cMsgData = 101;
+
+class CountingServer : public INetworkServerListener, public IMessageHandler
+{
+public:
+	CountingServer():numObsolete(0), numData(0) {}
+
+	std::vector<MessageConnection *> clients;
+	int numObsolete;
+	int numData;
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		clients.push_back(connection);
+		connection->RegisterInboundMessageHandler(this);
+	}
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t messageId, const char *, size_t)
+	{
+		if (messageId == cMsgObsolete)
+			++numObsolete;
+		else if (messageId == cMsgData)
+			++numData;
+	}
+};
+
+} // ~unnamed namespace
+
+void ObsoleteMessageTest()
+{
+	TEST("ObsoleteMessage")
+
+	CountingServer listener;
+	Network serverNetwork;
+	NetworkServer *server = serverNetwork.StartServer(cServerPort, SocketOverTCP, &listener, true);
+	assert(server);
+
+	Network clientNetwork;
+	Ptr(MessageConnection) connection = clientNetwork.Connect("127.0.0.1", cServerPort, SocketOverTCP, 0);
+	assert(connection);
+	PolledTimer timer(5000.f);
+	while(!timer.Test() && (listener.clients.empty() || connection->GetConnectionState() != ConnectionOK))
+	{
+		server->Process();
+		connection->Process();
+		Clock::Sleep(1);
+	}
+	assert(listener.clients.size() == 1);
+
+	// Queue a message while the sends are paused, and mark it obsolete before the worker thread gets to send it. The
+	// first send after resuming then finds nothing but the obsolete message in the queue.
+	connection->PauseOutboundSends();
+	NetworkMessage *msg = connection->StartNewMessage(cMsgObsolete, 8);
+	connection->EndAndQueueMessage(msg);
+	msg->obsolete = true;
+	connection->ResumeOutboundSends();
+	Clock::Sleep(50);
+
+	// The connection keeps working, and the obsolete message never arrives.
+	connection->EndAndQueueMessage(connection->StartNewMessage(cMsgData, 8));
+	timer.StartMSecs(5000.f);
+	while(!timer.Test() && listener.numData == 0)
+	{
+		server->Process();
+		connection->Process();
+		Clock::Sleep(1);
+	}
+	assert(listener.numData == 1);
+	assert(listener.numObsolete == 0);
+	assert(connection->GetConnectionState() == ConnectionOK);
+
+	connection->Close(0);
+	connection = 0;
+	serverNetwork.StopServer();
+
+	ENDTEST()
+}
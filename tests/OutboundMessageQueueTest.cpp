@@ -0,0 +1,160 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file OutboundMessageQueueTest.cpp
+	@brief Tests that every OutboundMessageQueue type sends the messages out in the right order. */
+
+#include <vector>
+
+#include "kNet/OutboundMessageQueue.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+/// Fills the queue with messages of a few priorities, so that the equal priorities are interleaved.
+void InsertTestMessages(OutboundMessageQueue &queue, std::vector<NetworkMessage*> &messages, int numMessages)
+{
+	const unsigned long priorities[] = { 5, 100, 5, 0, 100, 7, 5 };
+	for(int i = 0; i < numMessages; ++i)
+	{
+		NetworkMessage *msg = new NetworkMessage;
+		msg->priority = priorities[i % (sizeof(priorities) / sizeof(priorities[0]))];
+		messages.push_back(msg);
+		queue.Insert(msg);
+	}
+}
+
+/// Pops all the messages and asserts they come out in decreasing priority. If fifoWithinPriority is set, also asserts
+/// that the messages of equal priority come out in the order they were inserted.
+void CheckPriorityOrder(OutboundMessageQueue &queue, const std::vector<NetworkMessage*> &messages, bool fifoWithinPriority)
+{
+	size_t numPopped = 0;
+	NetworkMessage *prev = 0;
+	while(queue.Size() > 0)
+	{
+		NetworkMessage *msg = queue.Front();
+		queue.PopFront();
+		++numPopped;
+		if (prev)
+		{
+			assert(msg->priority <= prev->priority);
+			if (fifoWithinPriority && msg->priority == prev->priority)
+			{
+				size_t prevIndex = 0, index = 0;
+				for(size_t i = 0; i < messages.size(); ++i)
+				{
+					if (messages[i] == prev) prevIndex = i;
+					if (messages[i] == msg) index = i;
+				}
+				assert(prevIndex < index);
+			}
+		}
+		prev = msg;
+	}
+	assert(numPopped == messages.size());
+}
+
+void DeleteMessages(std::vector<NetworkMessage*> &messages)
+{
+	for(size_t i = 0; i < messages.size(); ++i)
+		delete messages[i];
+	messages.clear();
+}
+}
+
+void OutboundMessageQueueTest()
+{
+	TEST("OutboundMessageQueue")
+	std::vector<NetworkMessage*> messages;
+
+	// The heap sorts by priority. The test messages all have the same MessageNumber, so the order of the equal ones is free.
+	OutboundMessageQueue heap;
+	assert(heap.Type() == OutboundQueuePriorityHeap);
+	InsertTestMessages(heap, messages, 50);
+	assert(heap.Size() == 50);
+	CheckPriorityOrder(heap, messages, false);
+	DeleteMessages(messages);
+
+	// The buckets keep the equal priorities in their insertion order.
+	OutboundMessageQueue buckets(OutboundQueuePriorityBuckets);
+	InsertTestMessages(buckets, messages, 50);
+	CheckPriorityOrder(buckets, messages, true);
+	DeleteMessages(messages);
+
+	// Interleaved inserts and pops, with more distinct priorities than the buckets are kept around for.
+	for(int i = 0; i < 200; ++i)
+	{
+		NetworkMessage *msg = new NetworkMessage;
+		msg->priority = (unsigned long)((i * 37) % 101);
+		messages.push_back(msg);
+		buckets.Insert(msg);
+		if (i % 3 == 2)
+		{
+			NetworkMessage *front = buckets.Front();
+			for(size_t j = 0; j < messages.size(); ++j)
+				assert(messages[j]->priority <= front->priority || messages[j]->obsolete);
+			front->obsolete = true; // Used here to mark the messages that have been popped.
+			buckets.PopFront();
+		}
+	}
+	assert(buckets.Size() == 200 - 200 / 3);
+	buckets.Clear();
+	assert(buckets.Size() == 0);
+	DeleteMessages(messages);
+
+	// The FIFO sends in the insertion order.
+	OutboundMessageQueue fifo(OutboundQueueFIFO);
+	InsertTestMessages(fifo, messages, 20);
+	for(size_t i = 0; i < messages.size(); ++i)
+	{
+		assert(fifo.Front() == messages[i]);
+		fifo.PopFront();
+	}
+	DeleteMessages(messages);
+
+	// Switching types keeps the queued messages in their send order.
+	OutboundMessageQueue queue(OutboundQueueFIFO);
+	InsertTestMessages(queue, messages, 30);
+	queue.SetType(OutboundQueuePriorityBuckets);
+	assert(queue.Type() == OutboundQueuePriorityBuckets);
+	assert(queue.Size() == 30);
+	queue.SetType(OutboundQueuePriorityHeap);
+	queue.SetType(OutboundQueueFIFO);
+	CheckPriorityOrder(queue, messages, false);
+	DeleteMessages(messages);
+	ENDTEST()
+
+	TEST("NetworkMessage expiry")
+	NetworkMessage msg;
+	const tick_t now = Clock::Tick();
+	assert(!msg.IsExpiredAt(now));
+	msg.reliable = false;
+	msg.SetExpiry(50);
+	assert(!msg.IsExpiredAt(now));
+	assert(msg.IsExpiredAt(now + Clock::TicksPerMillisecond() * 100));
+
+	// Reliable messages are always delivered.
+	msg.reliable = true;
+	assert(!msg.IsExpiredAt(now + Clock::TicksPerMillisecond() * 100));
+
+	// A copy keeps the expiry, and zero clears it.
+	msg.reliable = false;
+	NetworkMessage copy(msg);
+	assert(copy.IsExpiredAt(now + Clock::TicksPerMillisecond() * 100));
+	copy.SetExpiry(0);
+	assert(!copy.IsExpiredAt(now + Clock::TicksPerMillisecond() * 100));
+	ENDTEST()
+}
@@ -0,0 +1,80 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file PacketCaptureTest.cpp
+	@brief Tests that PacketCapture writes the recorded packets to a file that ReadFile() reads back. */
+
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+#include "kNet/PacketCapture.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+void PacketCaptureTest()
+{
+	TEST("PacketCapture")
+	const char *filename = "PacketCaptureTest.kcap";
+	const EndPoint peer = EndPoint::FromIPAndPort(10, 1, 2, 3, 4567);
+	std::vector<char> data(PacketCapture::cSnapLength * 2 + 100);
+	for(size_t i = 0; i < data.size(); ++i)
+		data[i] = (char)(i * 13);
+
+	PacketCapture capture;
+	assert(!capture.IsCapturing());
+	capture.Record(CaptureInbound, SocketOverUDP, peer, &data[0], 10); // Not capturing, so not recorded.
+
+	assert(capture.Start(filename));
+	assert(capture.IsCapturing());
+	capture.Record(CaptureInbound, SocketOverUDP, peer, &data[0], 100);
+	capture.Record(CaptureOutbound, SocketOverUDP, peer, &data[0], data.size());
+	capture.Record(CaptureInbound, SocketOverTCP, peer, &data[0], data.size());
+	capture.Stop();
+	assert(!capture.IsCapturing());
+	// A datagram is cut short, and a stream block is split to three packets.
+	assert(capture.NumCapturedPackets() == 5);
+	assert(capture.NumDroppedPackets() == 0);
+
+	std::vector<CapturedPacket> packets;
+	assert(PacketCapture::ReadFile(filename, packets));
+	assert(packets.size() == 5);
+	assert(packets[0].direction == CaptureInbound && packets[0].transport == SocketOverUDP);
+	assert(memcmp(&packets[0].peer, &peer, sizeof(peer)) == 0);
+	assert(packets[0].originalBytes == 100 && packets[0].data.size() == 100);
+	assert(memcmp(&packets[0].data[0], &data[0], 100) == 0);
+	assert(packets[1].direction == CaptureOutbound);
+	assert(packets[1].originalBytes == data.size() && packets[1].data.size() == (size_t)PacketCapture::cSnapLength);
+	std::vector<char> stream;
+	for(size_t i = 2; i < packets.size(); ++i)
+	{
+		assert(packets[i].transport == SocketOverTCP);
+		assert(packets[i].originalBytes == packets[i].data.size());
+		assert(packets[i].timeMicros >= packets[i-1].timeMicros);
+		stream.insert(stream.end(), packets[i].data.begin(), packets[i].data.end());
+	}
+	assert(stream == data);
+
+	// A new capture starts a new file.
+	assert(capture.Start(filename));
+	capture.Record(CaptureInbound, SocketOverUDP, peer, &data[0], 1);
+	capture.Stop();
+	assert(PacketCapture::ReadFile(filename, packets));
+	assert(packets.size() == 1 && packets[0].data.size() == 1);
+	remove(filename);
+	assert(!PacketCapture::ReadFile(filename, packets));
+	ENDTEST()
+}
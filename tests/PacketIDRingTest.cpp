@@ -0,0 +1,81 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file PacketIDRingTest.cpp
+	@brief Tests the lookup, the insertion order and the growth of PacketIDRing. */
+
+#include "kNet/PacketIDRing.h"
+#include "kNet/NetworkMessage.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace
+{
+struct TestItem
+{
+	TestItem():packetID(0), value(0) {}
+	kNet::packet_id_t packetID;
+	int value;
+};
+}
+
+void PacketIDRingTest()
+{
+	using namespace kNet;
+
+	TEST("PacketIDRing")
+	PacketIDRing<TestItem> ring(4);
+	assert(ring.Size() == 0 && !ring.Oldest() && !ring.Newest());
+
+	// Insert over the PacketID wraparound, skipping an ID.
+	const packet_id_t first = SubPacketID(0, 2);
+	const int offsets[4] = { 0, 1, 3, 4 };
+	for(int i = 0; i < 4; ++i)
+	{
+		TestItem item;
+		item.packetID = AddPacketID(first, offsets[i]);
+		item.value = i;
+		assert(ring.Insert(item)->value == i);
+	}
+	assert(ring.Size() == 4);
+	// PacketID first+4 took the slot of first, so the ring grew.
+	assert(ring.Capacity() == 8);
+	assert(!ring.Find(AddPacketID(first, 2)) && !ring.Find(AddPacketID(first, 12)));
+	for(int i = 0; i < 4; ++i)
+		assert(ring.Find(AddPacketID(first, offsets[i]))->value == i);
+
+	int numVisited = 0;
+	for(TestItem *item = ring.Oldest(); item; item = ring.Next(item))
+		assert(item->value == numVisited++);
+	assert(numVisited == 4);
+	assert(ring.Newest()->value == 3);
+
+	// Erasing from the middle and both ends keeps the list linked.
+	ring.Erase(ring.Find(AddPacketID(first, 1)));
+	assert(ring.Next(ring.Oldest())->value == 2);
+	ring.Erase(ring.Oldest());
+	assert(ring.Oldest()->value == 2);
+	ring.Erase(ring.Newest());
+	assert(ring.Oldest() == ring.Newest() && !ring.Next(ring.Newest()));
+	ring.Erase(ring.Oldest());
+	assert(ring.Size() == 0 && !ring.Oldest() && !ring.Newest());
+
+	TestItem item;
+	item.packetID = AddPacketID(first, 5);
+	ring.Insert(item);
+	assert(ring.Oldest() == ring.Find(item.packetID));
+	ring.Clear();
+	assert(ring.Size() == 0 && !ring.Find(item.packetID) && !ring.Oldest());
+	ENDTEST()
+}
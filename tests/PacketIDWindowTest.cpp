@@ -0,0 +1,90 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file PacketIDWindowTest.cpp
+	@brief Tests the duplicate detection and the pending ack bookkeeping of PacketIDWindow, across the PacketID wraparound. */
+
+#include "kNet/PacketIDWindow.h"
+#include "kNet/NetworkMessage.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+void PacketIDWindowTest()
+{
+	using namespace kNet;
+
+	TEST("PacketIDWindow")
+	PacketIDWindow window;
+	const u32 windowSize = PacketIDWindow::cWindowSize;
+	assert(!window.HasReceived(0));
+
+	// Start just before the wraparound, and receive every other PacketID over it.
+	const packet_id_t first = SubPacketID(0, 100);
+	for(int i = 0; i < 200; i += 2)
+	{
+		window.AddPendingAck(AddPacketID(first, i), 1000 + i);
+		window.MarkReceived(AddPacketID(first, i));
+	}
+	assert(window.NumPendingAcks() == 100);
+	assert(window.FirstPendingAckTick() == 1000);
+	for(int i = 0; i < 200; ++i)
+		assert(window.HasReceived(AddPacketID(first, i)) == (i % 2 == 0));
+	assert(!window.HasReceived(AddPacketID(first, 200)));
+
+	// The pending acks are found in PacketID order, from either side of the wraparound.
+	assert(window.FirstPendingAck() == first);
+	packet_id_t id;
+	assert(window.NextPendingAck(AddPacketID(first, 1), id) && id == AddPacketID(first, 2));
+	assert(window.NextPendingAck(0, id) && id == 0);
+	assert(!window.NextPendingAck(AddPacketID(first, 199), id));
+	window.ClearPendingAck(first);
+	window.ClearPendingAck(first);
+	assert(window.NumPendingAcks() == 99);
+	assert(window.FirstPendingAck() == AddPacketID(first, 2));
+	int numFound = 0;
+	for(packet_id_t from = first; window.NextPendingAck(from, id); from = AddPacketID(id, 1))
+	{
+		window.ClearPendingAck(id);
+		++numFound;
+	}
+	assert(numFound == 99);
+	assert(window.NumPendingAcks() == 0);
+
+	// A late datagram inside the window is not a duplicate. Sliding the window forward forgets the old PacketIDs, which
+	// are then reported received, and drops their pending acks.
+	const packet_id_t newest = AddPacketID(first, 198);
+	window.AddPendingAck(AddPacketID(first, 1), 5000);
+	window.MarkReceived(AddPacketID(first, 1));
+	assert(window.HasReceived(AddPacketID(first, 1)));
+	window.AddPendingAck(AddPacketID(newest, 100), 6000);
+	assert(window.NumPendingAcks() == 2);
+	assert(!window.HasReceived(AddPacketID(newest, 100)));
+	window.MarkReceived(AddPacketID(newest, windowSize - 1));
+	assert(window.HasReceived(AddPacketID(first, 3)));
+	assert(!window.HasReceived(AddPacketID(newest, 100)));
+	assert(window.NumPendingAcks() == 1);
+	assert(window.FirstPendingAck() == AddPacketID(newest, 100));
+	window.AddPendingAck(first, 7000);
+	assert(window.NumPendingAcks() == 1);
+
+	// A jump over the whole window clears it.
+	window.MarkReceived(AddPacketID(newest, windowSize * 3));
+	assert(window.NumPendingAcks() == 0);
+	assert(!window.HasReceived(AddPacketID(newest, windowSize * 3 - 1)));
+	assert(window.HasReceived(AddPacketID(newest, windowSize * 3)));
+
+	window.Clear();
+	assert(!window.HasReceived(AddPacketID(newest, windowSize * 3)));
+	ENDTEST()
+}
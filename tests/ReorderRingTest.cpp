@@ -0,0 +1,87 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file ReorderRingTest.cpp
+	@brief Tests the holding, the in-order release and the growth of ReorderRing. */
+
+#include "kNet/ReorderRing.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+namespace
+{
+struct CountItems
+{
+	explicit CountItems(int *count_):count(count_) {}
+	int *count;
+	void operator()(int &) const { ++*count; }
+};
+}
+
+void ReorderRingTest()
+{
+	using namespace kNet;
+
+	TEST("ReorderRing")
+	ReorderRing<int> ring(4);
+	assert(ring.Size() == 0 && ring.Capacity() == 0 && ring.Next() == 0);
+	int item = 0;
+	assert(!ring.PopNext(item));
+
+	// Nothing is released while the gap at the front is open.
+	ring.Hold(2) = 2;
+	ring.Hold(3) = 3;
+	ring.Hold(1) = 1;
+	assert(ring.Size() == 3 && ring.Capacity() == 4);
+	assert(ring.Contains(1) && ring.Contains(3) && !ring.Contains(0) && !ring.Contains(4));
+	assert(!ring.PopNext(item));
+
+	// Filling the gap releases the whole run.
+	ring.SkipNext();
+	for(int i = 1; i <= 3; ++i)
+	{
+		assert(ring.PopNext(item));
+		assert(item == i);
+	}
+	assert(!ring.PopNext(item));
+	assert(ring.Size() == 0 && ring.Next() == 4);
+
+	// A duplicate gets the slot it already has.
+	ring.Hold(6) = 6;
+	assert(ring.Hold(6) == 6 && ring.Size() == 1);
+
+	// An item a capacity or more ahead grows the ring, and keeps the items held in their order.
+	ring.Hold(13) = 13;
+	assert(ring.Capacity() == 16 && ring.Size() == 2);
+	assert(ring.Contains(6) && ring.Contains(13) && !ring.Contains(5));
+	for(u32 i = 5; i <= 12; ++i)
+		if (i != 6)
+			ring.Hold(i) = (int)i;
+	ring.SkipNext();
+	for(int i = 5; i <= 13; ++i)
+	{
+		assert(ring.PopNext(item));
+		assert(item == i);
+	}
+	assert(ring.Next() == 14 && ring.Capacity() == 16);
+
+	// Clear() hands out the items left behind a gap.
+	ring.Hold(16) = 16;
+	ring.Hold(18) = 18;
+	int numCleared = 0;
+	ring.Clear(CountItems(&numCleared));
+	assert(numCleared == 2 && ring.Size() == 0 && !ring.Contains(16) && ring.Next() == 14);
+
+	ENDTEST()
+}
@@ -0,0 +1,70 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file RingBufferTest.cpp
+	@brief */
+
+#include <cstring>
+
+#include "kNet/RingBuffer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+void RingBufferTest()
+{
+	TEST("RingBuffer")
+	RingBuffer buffer(1000);
+	assert(buffer.Capacity() >= 1000);
+	assert(buffer.Size() == 0);
+	const int capacity = buffer.Capacity();
+
+	// Stream bytes through the buffer in chunks that don't divide its capacity, so that they wrap around its end. The
+	// filled bytes are always contiguous, compacted or not.
+	const int chunkSize = capacity / 3 + 7;
+	unsigned char nextWritten = 0;
+	unsigned char nextRead = 0;
+	for(int i = 0; i < 20; ++i)
+	{
+		if (buffer.ContiguousFreeBytesLeft() < chunkSize)
+			buffer.Compact();
+		assert(buffer.ContiguousFreeBytesLeft() >= chunkSize);
+		for(int j = 0; j < chunkSize; ++j)
+			buffer.End()[j] = (char)nextWritten++;
+		buffer.Inserted(chunkSize);
+
+		const int numBytes = buffer.Size() - chunkSize / 2;
+		for(int j = 0; j < numBytes; ++j)
+			assert((unsigned char)buffer.Begin()[j] == nextRead++);
+		buffer.Consumed(numBytes);
+	}
+	if (buffer.IsMirrored())
+	{
+		assert(buffer.ContiguousFreeBytesLeft() == buffer.TotalFreeBytesLeft());
+		assert(buffer.Capacity() == capacity);
+	}
+
+	// Growing keeps the bytes in order.
+	const int numBytes = buffer.Size();
+	buffer.Resize(capacity * 3);
+	assert(buffer.Capacity() >= capacity * 3);
+	assert(buffer.Size() == numBytes);
+	for(int j = 0; j < numBytes; ++j)
+		assert((unsigned char)buffer.Begin()[j] == (unsigned char)(nextRead + j));
+
+	buffer.Consumed(numBytes);
+	assert(buffer.Size() == 0 && buffer.StartIndex() == 0);
+	ENDTEST()
+}
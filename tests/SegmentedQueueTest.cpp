@@ -0,0 +1,205 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file SegmentedQueueTest.cpp
+	@brief Tests the limits of MemoryBudget, and that SegmentedQueue grows and shrinks within its budget and passes
+	every item of several producer threads to the consumer, in per-producer order. */
+
+#include <vector>
+
+#include "kNet/SegmentedQueue.h"
+#include "kNet/Thread.h"
+#include "kNet/Clock.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const int cNumProducers = 4;
+const int cNumItemsPerProducer = 50000;
+
+SegmentedQueue<u32> *sharedQueue = 0;
+volatile long nextProducerIndex = 0;
+
+/// Inserts the items 0, 1, 2, ... of a producer, tagged with the index of the producer in the high bits. The odd
+/// producers insert in batches.
+void Produce()
+{
+	const u32 producer = (u32)AtomicIncrement(&nextProducerIndex) - 1;
+	if (producer % 2 == 0)
+	{
+		for(int i = 0; i < cNumItemsPerProducer; ++i)
+			while(!sharedQueue->Insert((producer << 24) | (u32)i))
+				;
+		return;
+	}
+
+	u32 batch[20];
+	for(int i = 0; i < cNumItemsPerProducer; )
+	{
+		const int batchSize = (i % 19) + 1 < cNumItemsPerProducer - i ? (i % 19) + 1 : cNumItemsPerProducer - i;
+		for(int j = 0; j < batchSize; ++j)
+			batch[j] = (producer << 24) | (u32)(i + j);
+		int numInserted = 0;
+		while(numInserted < batchSize)
+			numInserted += sharedQueue->InsertBatch(batch + numInserted, batchSize - numInserted);
+		i += batchSize;
+	}
+}
+
+}
+
+void SegmentedQueueTest()
+{
+	TEST("MemoryBudget")
+
+	// A reservation fails as a whole if either the budget or its parent would go over its limit.
+	MemoryBudget total(0, 1000);
+	MemoryBudget a(&total, 600);
+	MemoryBudget b(&total);
+	assert(a.IsLimited() && b.IsLimited() && !MemoryBudget().IsLimited());
+	assert(a.TryReserve(500));
+	assert(!a.TryReserve(200));
+	assert(a.BytesUsed() == 500 && total.BytesUsed() == 500 && a.BytesLeft() == 100);
+	assert(b.BytesLeft() == 500);
+	assert(b.TryReserve(400));
+	assert(!b.TryReserve(200));
+	assert(b.BytesUsed() == 400 && total.BytesUsed() == 900);
+	assert(a.NumRefusals() == 1 && b.NumRefusals() == 1 && total.NumRefusals() == 1);
+	a.Reserve(300); // Goes over the limits.
+	assert(a.BytesUsed() == 800 && total.BytesUsed() == 1200 && a.BytesLeft() == 0);
+	a.Release(800);
+	b.Release(400);
+	assert(a.BytesUsed() == 0 && total.BytesUsed() == 0);
+	assert(a.PeakBytesUsed() == 800 && total.PeakBytesUsed() == 1200);
+
+	ENDTEST()
+
+	TEST("SegmentedQueue")
+
+	MemoryBudget budget;
+	{
+		SegmentedQueue<u32> queue(1000, 4, &budget);
+		assert(queue.Capacity() == 1000);
+		assert(queue.Size() == 0 && queue.Front() == 0);
+		const size_t idleUsage = queue.MemoryUsage();
+		assert(idleUsage > 0 && budget.BytesUsed() == idleUsage);
+
+		// The storage grows with the items queued, and the items come out in order across the segments.
+		for(u32 i = 0; i < 1000; ++i)
+			assert(queue.Insert(i));
+		assert(!queue.Insert(1000));
+		assert(queue.Size() == 1000 && queue.CapacityLeft() == 0);
+		const size_t fullUsage = queue.MemoryUsage();
+		assert(fullUsage > 100 * idleUsage);
+		assert(budget.BytesUsed() == fullUsage);
+		u32 items[64];
+		u32 next = 0;
+		while(queue.Size() > 0)
+		{
+			const int numItems = (next & 1) ? queue.PopBatch(items, 64) : (items[0] = queue.TakeFront(), 1);
+			for(int i = 0; i < numItems; ++i)
+				assert(items[i] == next++);
+		}
+		assert(next == 1000 && queue.Front() == 0);
+
+		// A trickle through the drained queue fills up the last large segment, then continues in small ones, reusing the
+		// spare one without allocating.
+		for(u32 i = 0; i < 2100; ++i)
+		{
+			assert(queue.Insert(i));
+			assert(queue.TakeFront() == i);
+		}
+		const size_t trickleUsage = queue.MemoryUsage();
+		assert(trickleUsage <= 3 * idleUsage);
+		for(u32 i = 0; i < 100; ++i)
+		{
+			assert(queue.Insert(i));
+			assert(queue.TakeFront() == i);
+		}
+		assert(queue.MemoryUsage() == trickleUsage);
+
+		// A batch is cut to the room left.
+		const u32 values[6] = { 10, 11, 12, 13, 14, 15 };
+		for(u32 i = 0; i < 997; ++i)
+			assert(queue.Insert(i));
+		assert(queue.InsertBatch(values, 6) == 3);
+		assert(queue.PopBatch(items, 64) == 64);
+		assert(items[0] == 0 && items[63] == 63);
+		assert(queue.InsertBatch(values, 6) == 6);
+		while(queue.Size() > 0)
+			queue.PopFront();
+	}
+	assert(budget.BytesUsed() == 0);
+
+	// A limited budget stops the growth, but a queue can always take a segment's worth of items.
+	{
+		MemoryBudget limited(0, 1);
+		SegmentedQueue<u32> queue(1000, 4, &limited);
+		int numInserted = 0;
+		while(numInserted < 1000 && queue.Insert((u32)numInserted))
+			++numInserted;
+		assert(numInserted >= 4 && numInserted < 16);
+		assert(limited.NumRefusals() > 0);
+		assert(queue.CapacityLeft() == 0);
+		for(int i = 0; i < numInserted; ++i)
+			assert(queue.TakeFront() == (u32)i);
+		assert(queue.CapacityLeft() >= 4);
+		for(u32 i = 0; i < 100; ++i)
+		{
+			assert(queue.Insert(i));
+			assert(queue.TakeFront() == i);
+		}
+	}
+
+	// Several producers stream through the queue. Every item arrives once, and the items of each producer stay in order.
+	SegmentedQueue<u32> stream(256, 8, &budget);
+	sharedQueue = &stream;
+	nextProducerIndex = 0;
+	std::vector<Thread*> producers;
+	for(int i = 0; i < cNumProducers; ++i)
+	{
+		producers.push_back(new Thread);
+		producers.back()->RunFunc(Produce);
+	}
+
+	int nextItem[cNumProducers] = {};
+	int numReceived = 0;
+	const tick_t startTick = Clock::Tick();
+	while(numReceived < cNumProducers * cNumItemsPerProducer && Clock::SecondsSinceD(startTick) < 60.0)
+	{
+		u32 batch[16];
+		const int numItems = (numReceived & 1) ? stream.PopBatch(batch, 16) : (stream.Front() ? (batch[0] = stream.TakeFront(), 1) : 0);
+		for(int i = 0; i < numItems; ++i)
+		{
+			const u32 producer = batch[i] >> 24;
+			assert(producer < (u32)cNumProducers);
+			assert((batch[i] & 0xFFFFFF) == (u32)nextItem[producer]);
+			++nextItem[producer];
+		}
+		numReceived += numItems;
+	}
+	for(int i = 0; i < cNumProducers; ++i)
+	{
+		producers[i]->Stop();
+		delete producers[i];
+		assert(nextItem[i] == cNumItemsPerProducer);
+	}
+	assert(stream.Size() == 0);
+	sharedQueue = 0;
+
+	ENDTEST()
+}
@@ -0,0 +1,144 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file SendCoalescingTest.cpp
+	@brief Tests that a UDP connection holds trickled messages back to send them in fewer datagrams, and that urgent
+	messages and a full datagram are not held back. */
+
+#include <vector>
+
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPort = 47303;
+
+const message_id_t cMsgData = 100;
+const int cNumMessages = 10;
+
+class CountingServer : public INetworkServerListener, public IMessageHandler
+{
+public:
+	CountingServer():numMessages(0) {}
+
+	std::vector<MessageConnection *> clients;
+	int numMessages;
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		clients.push_back(connection);
+		connection->RegisterInboundMessageHandler(this);
+	}
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t messageId, const char *, size_t)
+	{
+		if (messageId == cMsgData)
+			++numMessages;
+	}
+};
+
+void SendMessage(MessageConnection *connection, int size, unsigned long priority)
+{
+	NetworkMessage *msg = connection->StartNewMessage(cMsgData, size);
+	msg->priority = priority;
+	connection->EndAndQueueMessage(msg);
+}
+
+/// Processes the server until it has received the given number of messages in total, and returns the msecs it took.
+double WaitForMessages(NetworkServer *server, MessageConnection *connection, CountingServer &listener, int numMessages)
+{
+	const tick_t start = Clock::Tick();
+	PolledTimer timer(5000.f);
+	while(!timer.Test() && listener.numMessages < numMessages)
+	{
+		server->Process();
+		connection->Process();
+		Clock::Sleep(1);
+	}
+	assert(listener.numMessages == numMessages);
+	return Clock::TimespanToMillisecondsD(start, Clock::Tick());
+}
+
+/// Trickles unreliable messages to the server 2 msecs apart, and returns the number of datagrams they took.
+u64 TrickleMessages(NetworkServer *server, MessageConnection *connection, CountingServer &listener)
+{
+	const u64 packetsOut = connection->PacketsOutTotal();
+	const int numReceived = listener.numMessages;
+	for(int i = 0; i < cNumMessages; ++i)
+	{
+		SendMessage(connection, 8, 0);
+		Clock::Sleep(2);
+	}
+	WaitForMessages(server, connection, listener, numReceived + cNumMessages);
+	return connection->PacketsOutTotal() - packetsOut;
+}
+
+} // ~unnamed namespace
+
+void SendCoalescingTest()
+{
+	TEST("SendCoalescing")
+
+	CountingServer listener;
+	Network serverNetwork;
+	NetworkServer *server = serverNetwork.StartServer(cServerPort, SocketOverUDP, &listener, true);
+	assert(server);
+
+	Network clientNetwork;
+	Ptr(MessageConnection) connection = clientNetwork.Connect("127.0.0.1", cServerPort, SocketOverUDP, 0);
+	assert(connection);
+	PolledTimer timer(5000.f);
+	while(!timer.Test() && (listener.clients.empty() || connection->GetConnectionState() != ConnectionOK))
+	{
+		server->Process();
+		connection->Process();
+		Clock::Sleep(1);
+	}
+	assert(listener.clients.size() == 1);
+
+	// Each trickled message goes out in a datagram of its own by default. Held back for 100 msecs, they share a few.
+	const u64 uncoalesced = TrickleMessages(server, connection, listener);
+	connection->SetSendCoalescing(100000);
+	assert(connection->SendCoalescingDelay() == 100000);
+	const u64 coalesced = TrickleMessages(server, connection, listener);
+	assert(uncoalesced >= cNumMessages / 2);
+	assert(coalesced <= 3);
+
+	// An urgent message is not held back, and takes the messages held before it along.
+	connection->SetSendCoalescing(1000000, 1400, 100);
+	SendMessage(connection, 8, 0);
+	Clock::Sleep(10);
+	SendMessage(connection, 8, 100);
+	assert(WaitForMessages(server, connection, listener, listener.numMessages + 2) < 500.0);
+
+	// Neither are the messages that fill up a datagram.
+	connection->SetSendCoalescing(1000000, 100);
+	for(int i = 0; i < cNumMessages; ++i)
+		SendMessage(connection, 20, 0);
+	assert(WaitForMessages(server, connection, listener, listener.numMessages + cNumMessages) < 500.0);
+
+	connection->Close(0);
+	connection = 0;
+	serverNetwork.StopServer();
+
+	ENDTEST()
+}
@@ -0,0 +1,188 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file ServerHandOffTest.cpp
+	@brief Tests that a UDP server handed off to another Network keeps its client connected, and loses no messages. */
+
+#include <vector>
+
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/UDPMessageConnection.h"
+#include "kNet/DataSerializer.h"
+#include "kNet/DataDeserializer.h"
+#include "kNet/PolledTimer.h"
+#include "kNet/Thread.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPort = 47300;
+const char cHandOffPath[] = "/tmp/kNet.ServerHandOffTest";
+
+const message_id_t cMsgNumber = 100;
+const message_id_t cMsgReply = 101;
+
+/// Records the numbers the clients send, in the order they arrive, and answers each with a reply.
+class NumberServer : public INetworkServerListener, public IMessageHandler
+{
+public:
+	NumberServer():numResumed(0) {}
+
+	std::vector<u32> numbers;
+	std::vector<MessageConnection *> clients;
+	int numResumed;
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		clients.push_back(connection);
+		connection->RegisterInboundMessageHandler(this);
+	}
+
+	void ConnectionResumed(MessageConnection *connection)
+	{
+		++numResumed;
+		NewConnectionEstablished(connection);
+	}
+
+	void HandleMessage(MessageConnection *source, packet_id_t, message_id_t messageId, const char *data, size_t numBytes)
+	{
+		if (messageId != cMsgNumber || numBytes != 4)
+			return;
+		DataDeserializer dd(data, numBytes);
+		numbers.push_back(dd.Read<u32>());
+		NetworkMessage *msg = source->StartNewMessage(cMsgReply, 0);
+		msg->reliable = true;
+		source->EndAndQueueMessage(msg);
+	}
+};
+
+class ReplyCounter : public IMessageHandler
+{
+public:
+	ReplyCounter():numReplies(0) {}
+
+	int numReplies;
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t messageId, const char *, size_t)
+	{
+		if (messageId == cMsgReply)
+			++numReplies;
+	}
+};
+
+/// Hands off the server of a Network on a thread of its own, while the main thread takes it over.
+class HandOff
+{
+public:
+	explicit HandOff(Network *network_):network(network_), succeeded(false) {}
+
+	Network *network;
+	bool succeeded;
+
+	void HandOffServer() { succeeded = network->HandOffServer(cHandOffPath, 5000); }
+};
+
+void SendNumbers(MessageConnection *connection, u32 first, u32 count)
+{
+	for(u32 i = first; i < first + count; ++i)
+	{
+		NetworkMessage *msg = connection->StartNewMessage(cMsgNumber, 4);
+		msg->reliable = true;
+		msg->inOrder = true;
+		DataSerializer ds(msg->data, 4);
+		ds.Add<u32>(i);
+		connection->EndAndQueueMessage(msg);
+	}
+}
+
+} // ~unnamed namespace
+
+void ServerHandOffTest()
+{
+	TEST("ServerHandOff")
+
+	NumberServer oldListener;
+	Network oldNetwork;
+	NetworkServer *oldServer = oldNetwork.StartServer(cServerPort, SocketOverUDP, &oldListener, true);
+	assert(oldServer);
+
+	Network clientNetwork;
+	ReplyCounter replies;
+	Ptr(MessageConnection) connection = clientNetwork.Connect("127.0.0.1", cServerPort, SocketOverUDP, &replies);
+	assert(connection);
+	UDPMessageConnection *udpConnection = static_cast<UDPMessageConnection *>(connection.ptr());
+
+	// Hand off while the client still has numbers on the way, and the old server has replies to send.
+	const u32 cNumNumbers = 200;
+	SendNumbers(connection, 0, cNumNumbers / 2);
+	PolledTimer timer(5000.f);
+	while(!timer.Test() && oldListener.numbers.size() < 10)
+	{
+		oldServer->Process();
+		connection->Process();
+		Clock::Sleep(1);
+	}
+	assert(oldListener.clients.size() == 1);
+	assert(!oldListener.numbers.empty());
+	const u64 connectionID = udpConnection->ConnectionID();
+	assert(connectionID != 0);
+
+	NumberServer newListener;
+	Network newNetwork;
+	HandOff handOff(&oldNetwork);
+	Thread handOffThread;
+	handOffThread.Run(&handOff, &HandOff::HandOffServer);
+	NetworkServer *newServer = newNetwork.ResumeServer(cHandOffPath, &newListener, 5000);
+	handOffThread.Stop();
+	assert(handOff.succeeded);
+	assert(newServer);
+	assert(!oldNetwork.GetServer());
+	assert(newListener.numResumed == 1);
+	assert(newListener.clients.size() == 1);
+	assert(static_cast<UDPMessageConnection *>(newListener.clients[0])->ConnectionID() == connectionID);
+
+	SendNumbers(connection, cNumNumbers / 2, cNumNumbers / 2);
+	timer.StartMSecs(10000.f);
+	while(!timer.Test() && (oldListener.numbers.size() + newListener.numbers.size() < cNumNumbers || replies.numReplies < (int)cNumNumbers))
+	{
+		newServer->Process();
+		connection->Process();
+		Clock::Sleep(1);
+	}
+
+	// Each number arrived once and in order, at the old server or the new one, and each reply once.
+	std::vector<u32> numbers = oldListener.numbers;
+	numbers.insert(numbers.end(), newListener.numbers.begin(), newListener.numbers.end());
+	assert(numbers.size() == cNumNumbers);
+	for(u32 i = 0; i < numbers.size(); ++i)
+		assert(numbers[i] == i);
+	assert(!newListener.numbers.empty());
+	assert(replies.numReplies == (int)cNumNumbers);
+
+	// The client did not notice the handoff.
+	assert(connection->GetConnectionState() == ConnectionOK);
+	assert(udpConnection->ConnectionID() == connectionID);
+
+	connection->Close(0);
+	connection = 0;
+	newNetwork.StopServer();
+
+	ENDTEST()
+}
@@ -0,0 +1,131 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file SharedMemoryChannelTest.cpp
+	@brief Tests that SharedMemoryChannel carries a byte stream both ways, and rings the doorbell only for a waiting side. */
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "kNet/SharedMemoryChannel.h"
+#include "kNet/Event.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+#ifndef WIN32
+namespace
+{
+/// Reads all the doorbell bytes out of the socket, and returns how many there were.
+int ClearDoorbell(SOCKET s)
+{
+	int numBytes = 0;
+	char doorbell[64];
+	int ret;
+	while((ret = (int)recv(s, doorbell, sizeof(doorbell), MSG_DONTWAIT)) > 0)
+		numBytes += ret;
+	return numBytes;
+}
+}
+#endif
+
+void SharedMemoryChannelTest()
+{
+	TEST("SharedMemoryChannel")
+#ifndef WIN32
+	const unsigned short port = 2371;
+	SOCKET listenSocket = SharedMemoryChannel::OpenListenSocket(port);
+	assert(listenSocket != INVALID_SOCKET);
+	// The port is taken until the listen socket is closed.
+	assert(SharedMemoryChannel::OpenListenSocket(port) == INVALID_SOCKET);
+
+	// Nothing to accept yet.
+	SOCKET serverSocket;
+	bool listenFailed;
+	assert(SharedMemoryChannel::Accept(listenSocket, serverSocket, listenFailed) == 0);
+	assert(serverSocket == INVALID_SOCKET && !listenFailed);
+
+	SOCKET clientSocket;
+	Ptr(SharedMemoryChannel) client = SharedMemoryChannel::Connect(port, clientSocket);
+	assert(client && clientSocket != INVALID_SOCKET);
+	Ptr(SharedMemoryChannel) server = SharedMemoryChannel::Accept(listenSocket, serverSocket, listenFailed);
+	assert(server && serverSocket != INVALID_SOCKET);
+	SOCKET otherSocket;
+	assert(SharedMemoryChannel::Connect(port + 1, otherSocket) == 0 && otherSocket == INVALID_SOCKET);
+
+	// The first bytes ring the doorbell, since the reader has not looked at the ring yet.
+	char buffer[1024];
+	assert(client->Write("hello", 5) == 5);
+	assert(Event(serverSocket, EventWaitRead).Wait(1000));
+	assert(ClearDoorbell(serverSocket) == 1);
+	assert(server->BytesAvailable() == 5);
+	assert(server->Read(buffer, sizeof(buffer)) == 5);
+	assert(memcmp(buffer, "hello", 5) == 0);
+
+	// While the reader has not found the ring empty, the writes do not ring the doorbell.
+	assert(server->Write("abc", 3) == 3);
+	assert(ClearDoorbell(clientSocket) == 1);
+	assert(server->Write("def", 3) == 3);
+	assert(ClearDoorbell(clientSocket) == 0);
+	assert(client->Read(buffer, 4) == 4);
+	assert(client->Read(buffer + 4, sizeof(buffer)) == 2);
+	assert(memcmp(buffer, "abcdef", 6) == 0);
+	// Having found the ring empty, the reader is woken up by the next write.
+	assert(client->Read(buffer, sizeof(buffer)) == 0);
+	assert(server->Write("g", 1) == 1);
+	assert(ClearDoorbell(clientSocket) == 1);
+	assert(client->Read(buffer, sizeof(buffer)) == 1 && buffer[0] == 'g');
+
+	// Fill the ring in uneven chunks, so that the stream wraps around the end of the ring.
+	std::vector<char> data(SharedMemoryChannel::cRingSize * 3 + 123);
+	for(size_t i = 0; i < data.size(); ++i)
+		data[i] = (char)(i * 7 + (i >> 11));
+	std::vector<char> received;
+	size_t sent = 0;
+	while(received.size() < data.size())
+	{
+		sent += client->Write(&data[sent], std::min<size_t>(data.size() - sent, 200000));
+		if (!client->HasRoomFor(1))
+		{
+			// The writer waits for the doorbell, which the reader rings once it has read.
+			assert(client->Write(&data[sent], 1) == 0);
+			ClearDoorbell(clientSocket);
+			const size_t numBytes = server->Read(buffer, sizeof(buffer));
+			assert(numBytes == sizeof(buffer));
+			assert(ClearDoorbell(clientSocket) == 1);
+			received.insert(received.end(), buffer, buffer + numBytes);
+		}
+		char chunk[77777];
+		const size_t numBytes = server->Read(chunk, sizeof(chunk));
+		received.insert(received.end(), chunk, chunk + numBytes);
+	}
+	assert(sent == data.size());
+	assert(received == data);
+
+	// A peer that closes its socket ends the stream.
+	closesocket(clientSocket);
+	assert(Event(serverSocket, EventWaitRead).Wait(1000));
+	ClearDoorbell(serverSocket);
+	assert(recv(serverSocket, buffer, sizeof(buffer), MSG_DONTWAIT) == 0);
+
+	closesocket(serverSocket);
+	closesocket(listenSocket);
+#endif
+	ENDTEST()
+}
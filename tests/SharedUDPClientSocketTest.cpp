@@ -0,0 +1,138 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file SharedUDPClientSocketTest.cpp
+	@brief Tests that UDP client connections to different servers share a local socket, and one to the same server does not. */
+
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPorts[] = { 47291, 47292 };
+
+const message_id_t cMsgPing = 100;
+const message_id_t cMsgPong = 101;
+
+/// Answers each ping with a pong.
+class EchoServer : public INetworkServerListener, public IMessageHandler
+{
+public:
+	EchoServer():numPings(0) {}
+
+	int numPings;
+
+	void NewConnectionEstablished(MessageConnection *connection)
+	{
+		connection->RegisterInboundMessageHandler(this);
+	}
+
+	void HandleMessage(MessageConnection *source, packet_id_t, message_id_t messageId, const char *, size_t)
+	{
+		if (messageId != cMsgPing)
+			return;
+		++numPings;
+		NetworkMessage *msg = source->StartNewMessage(cMsgPong, 0);
+		msg->reliable = true;
+		source->EndAndQueueMessage(msg);
+	}
+};
+
+class PongCounter : public IMessageHandler
+{
+public:
+	PongCounter():numPongs(0) {}
+
+	int numPongs;
+
+	void HandleMessage(MessageConnection *, packet_id_t, message_id_t messageId, const char *, size_t)
+	{
+		if (messageId == cMsgPong)
+			++numPongs;
+	}
+};
+
+} // ~unnamed namespace
+
+void SharedUDPClientSocketTest()
+{
+	TEST("SharedUDPClientSocket")
+
+	EchoServer listeners[2];
+	Network serverNetworks[2];
+	NetworkServer *servers[2];
+	for(int i = 0; i < 2; ++i)
+	{
+		servers[i] = serverNetworks[i].StartServer(cServerPorts[i], SocketOverUDP, &listeners[i], true);
+		assert(servers[i]);
+	}
+
+	Network clientNetwork;
+	clientNetwork.SetSharedUDPClientSockets(1);
+	PongCounter pongs;
+	const int cNumConnections = 3;
+	Ptr(MessageConnection) connections[cNumConnections];
+	connections[0] = clientNetwork.Connect("127.0.0.1", cServerPorts[0], SocketOverUDP, &pongs);
+	connections[1] = clientNetwork.Connect("127.0.0.1", cServerPorts[1], SocketOverUDP, &pongs);
+	// The shared socket already talks to the first server, so this connection gets a socket of its own.
+	connections[2] = clientNetwork.Connect("127.0.0.1", cServerPorts[0], SocketOverUDP, &pongs);
+	for(int i = 0; i < cNumConnections; ++i)
+		assert(connections[i] && connections[i]->GetSocket());
+	assert(connections[0]->GetSocket()->IsUDPSlaveSocket());
+	assert(connections[1]->GetSocket()->IsUDPSlaveSocket());
+	assert(connections[0]->GetSocket()->GetSocketHandle() == connections[1]->GetSocket()->GetSocketHandle());
+	assert(connections[0]->GetSocket()->LocalEndPoint().port != 0);
+	assert(!connections[2]->GetSocket()->IsUDPSlaveSocket());
+
+	const int cNumPings = 5;
+	for(int i = 0; i < cNumConnections; ++i)
+		for(int j = 0; j < cNumPings; ++j)
+		{
+			NetworkMessage *msg = connections[i]->StartNewMessage(cMsgPing, 0);
+			msg->reliable = true;
+			connections[i]->EndAndQueueMessage(msg);
+		}
+
+	PolledTimer timer(5000.f);
+	while(!timer.Test() && pongs.numPongs < cNumConnections * cNumPings)
+	{
+		for(int i = 0; i < 2; ++i)
+			servers[i]->Process();
+		for(int i = 0; i < cNumConnections; ++i)
+			connections[i]->Process();
+		Clock::Sleep(1);
+	}
+	for(int i = 0; i < cNumConnections; ++i)
+		assert(connections[i]->GetConnectionState() == ConnectionOK);
+	assert(listeners[0].numPings == 2 * cNumPings);
+	assert(listeners[1].numPings == cNumPings);
+	assert(pongs.numPongs == cNumConnections * cNumPings);
+
+	for(int i = 0; i < cNumConnections; ++i)
+	{
+		connections[i]->Close(0);
+		connections[i] = 0;
+	}
+	for(int i = 0; i < 2; ++i)
+		serverNetworks[i].StopServer();
+
+	ENDTEST()
+}
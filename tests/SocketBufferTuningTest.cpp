@@ -0,0 +1,54 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file SocketBufferTuningTest.cpp
+	@brief Tests that Socket::TunedBufferSize sizes the socket buffers to the bandwidth-delay product of the traffic. */
+
+#include "kNet/Socket.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+void SocketBufferTuningTest()
+{
+	TEST("SocketBufferTuning")
+
+	// An idle socket gets the smallest buffer.
+	assert(Socket::TunedBufferSize(0.f, 0.f) == Socket::cMinTunedBufferSize);
+	assert(Socket::TunedBufferSize(0.f, 500.f) == Socket::cMinTunedBufferSize);
+
+	// 1MB/sec over 100 msecs is 100KB in flight, and twice that rounds up to 256KB.
+	assert(Socket::TunedBufferSize(1024.f * 1024.f, 100.f) == 256 * 1024);
+
+	// The round-trip times shorter than 50 msecs count as 50 msecs.
+	assert(Socket::TunedBufferSize(1024.f * 1024.f, 1.f) == Socket::TunedBufferSize(1024.f * 1024.f, 50.f));
+	assert(Socket::TunedBufferSize(1024.f * 1024.f, 50.f) == 128 * 1024);
+
+	// The sizes are powers of two, and grow with the bandwidth and the delay.
+	int previous = 0;
+	for(float bytesPerSec = 1000.f; bytesPerSec < 1e9f; bytesPerSec *= 1.5f)
+	{
+		const int size = Socket::TunedBufferSize(bytesPerSec, 80.f);
+		assert((size & (size - 1)) == 0);
+		assert(size >= previous);
+		assert(size >= Socket::cMinTunedBufferSize && size <= Socket::cMaxTunedBufferSize);
+		assert(size == Socket::cMaxTunedBufferSize || size >= 2.0 * bytesPerSec * 0.08);
+		previous = size;
+	}
+	assert(Socket::TunedBufferSize(1024.f * 1024.f, 400.f) > Socket::TunedBufferSize(1024.f * 1024.f, 100.f));
+
+	// A fast long-haul link is capped.
+	assert(Socket::TunedBufferSize(1e9f, 300.f) == Socket::cMaxTunedBufferSize);
+	ENDTEST()
+}
@@ -0,0 +1,93 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file SourceAddressFilterTest.cpp
+	@brief Tests that SourceAddressFilter drops the banned sources, and limits each source to its rate independently of the others. */
+
+#include "kNet/SourceAddressFilter.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+EndPoint Address(u32 n, unsigned short port = 1234)
+{
+	EndPoint endPoint;
+	endPoint.ip[0] = (u8)(n >> 24);
+	endPoint.ip[1] = (u8)(n >> 16);
+	endPoint.ip[2] = (u8)(n >> 8);
+	endPoint.ip[3] = (u8)n;
+	endPoint.port = port;
+	return endPoint;
+}
+
+}
+
+void SourceAddressFilterTest()
+{
+	TEST("SourceAddressFilter")
+	const tick_t start = Clock::Tick();
+	const tick_t sec = Clock::TicksPerSec();
+	SourceAddressFilter filter;
+
+	// A fresh filter lets everything in.
+	for(int i = 0; i < 1000; ++i)
+		assert(filter.Admit(Address(0x0A000001), start));
+	assert(filter.NumBannedDrops() == 0 && filter.NumRateLimitedDrops() == 0);
+
+	// A ban covers all the ports of the address, and can be lifted.
+	filter.Ban(Address(0x0A000002));
+	filter.Ban(Address(0x0A000002));
+	assert(filter.IsBanned(Address(0x0A000002, 999)));
+	assert(!filter.IsBanned(Address(0x0A000003)));
+	assert(!filter.Admit(Address(0x0A000002, 5), start));
+	assert(filter.NumBannedDrops() == 1);
+	filter.Unban(Address(0x0A000002));
+	assert(!filter.IsBanned(Address(0x0A000002)));
+	assert(filter.Admit(Address(0x0A000002), start));
+	filter.Ban(Address(0x0A000004));
+	filter.ClearBans();
+	assert(!filter.IsBanned(Address(0x0A000004)));
+
+	// 100 units/sec with bursts of 10. A source gets its burst, then drops.
+	filter.SetRateLimit(100.f, 10.f);
+	int numAdmitted = 0;
+	for(int i = 0; i < 50; ++i)
+		if (filter.Admit(Address(0x0A000001), start))
+			++numAdmitted;
+	assert(numAdmitted == 10);
+	assert(filter.NumRateLimitedDrops() == 40);
+
+	// The other sources are not limited by it, even when there are more of them than the table has buckets.
+	for(u32 n = 0; n < (u32)(SourceAddressFilter::cNumSets * SourceAddressFilter::cNumWays * 2); ++n)
+		assert(filter.Admit(Address(0xC0A80000 + n), start + sec / 1000));
+
+	// An abusive source keeps its bucket in the flood, since the idle buckets are replaced first.
+	assert(!filter.Admit(Address(0x0A000001), start + sec / 1000));
+
+	// The bucket refills at the rate: 100 msecs gives 10 more units.
+	numAdmitted = 0;
+	for(int i = 0; i < 50; ++i)
+		if (filter.Admit(Address(0x0A000001), start + sec / 10 + sec / 1000))
+			++numAdmitted;
+	assert(numAdmitted >= 9 && numAdmitted <= 11);
+
+	// Lifting the limit lets everything through again.
+	filter.SetRateLimit(0.f, 0.f);
+	for(int i = 0; i < 100; ++i)
+		assert(filter.Admit(Address(0x0A000001), start + sec));
+	ENDTEST()
+}
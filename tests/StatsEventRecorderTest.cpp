@@ -0,0 +1,138 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file StatsEventRecorderTest.cpp
+	@brief Tests that the events StatsEventRecorder collects from several threads all end up in the hierarchy in time order. */
+
+#include <cstdio>
+
+#include "kNet/StatsEventRecorder.h"
+#include "kNet/Thread.h"
+#include "kNet/Atomics.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const int cNumThreads = 4;
+const int cEventsPerThread = 3000;
+
+StatsEventRecorder *recorder = 0;
+stats_counter_t allCounter = 0;
+stats_counter_t threadCounters[cNumThreads];
+volatile long numThreadsFinished = 0;
+
+void RecorderThreadMain(int threadIndex)
+{
+	for(int i = 0; i < cEventsPerThread; ++i)
+	{
+		recorder->AddEvent(threadCounters[threadIndex], (float)threadIndex);
+		recorder->AddEvent(allCounter, 1.f);
+	}
+	AtomicIncrement(&numThreadsFinished);
+}
+
+bool InTimeOrder(StatsEventHierarchyNode &node)
+{
+	for(int i = 1; i < node.events.Size(); ++i)
+		if (node.events.ItemAt(i-1)->time != node.events.ItemAt(i)->time
+			&& Clock::IsNewer(node.events.ItemAt(i-1)->time, node.events.ItemAt(i)->time))
+			return false;
+	return true;
+}
+
+}
+
+void StatsEventRecorderTest()
+{
+	TEST("StatsEventRecorder")
+
+	// A name is interned once, whatever value type the later registrations pass.
+	const stats_counter_t first = StatsCounterRegistry::Register("recorderTest.single", "bytes");
+	assert(first != 0);
+	assert(StatsCounterRegistry::Register("recorderTest.single", "msecs") == first);
+	std::string name, valueType;
+	StatsCounterRegistry::GetCounter(first, name, valueType);
+	assert(name == "recorderTest.single" && valueType == "bytes");
+
+	// The message counters register the name of each message ID once, and give it the same handle on the later lookups,
+	// also after another message ID has evicted it from the cache.
+	MessageStatsCounters messageCounters("recorderTest.msg");
+	const stats_counter_t ping = messageCounters.Get(1, false, "PingRequest (1)");
+	assert(ping == StatsCounterRegistry::Register("recorderTest.msg.PingRequest (1)", ""));
+	const stats_counter_t numbered = messageCounters.Get(100, false, "");
+	assert(numbered == StatsCounterRegistry::Register("recorderTest.msg.100", ""));
+	const stats_counter_t fragment = messageCounters.Get(100, true, "Big_Fragment");
+	assert(fragment == StatsCounterRegistry::Register("recorderTest.msg.Big_Fragment", ""));
+	for(message_id_t id = 200; id < 400; ++id)
+		messageCounters.Get(id, false, 0);
+	assert(messageCounters.Get(1, false, "PingRequest (1)") == ping);
+	assert(messageCounters.Get(100, false, "") == numbered);
+	assert(messageCounters.Get(100, true, "Big_Fragment") == fragment);
+
+	allCounter = StatsCounterRegistry::Register("recorderTest.threads.all", "");
+	for(int i = 0; i < cNumThreads; ++i)
+	{
+		char str[64];
+		sprintf(str, "recorderTest.threads.t%d", i);
+		threadCounters[i] = StatsCounterRegistry::Register(str, "");
+	}
+
+	StatsEventRecorder rec;
+	recorder = &rec;
+	rec.AddEvent(first, 5.f);
+	rec.AddEvent(first, 7.f);
+	{
+		Lock<StatsEventHierarchyNode> root = rec.AcquireHierarchy();
+		StatsEventHierarchyNode *node = root->FindChild("recorderTest.single");
+		assert(node);
+		assert(node->valueType == "bytes");
+		assert(node->AccumulateTotalCountThisLevel() == 2);
+		assert(node->AccumulateTotalValueThisLevel() == 12.f);
+		assert(node->LatestValue() == 7.f);
+	}
+
+	// Several threads add events at once while the main thread keeps reading the hierarchy.
+	{
+		Thread threads[cNumThreads];
+		for(int i = 0; i < cNumThreads; ++i)
+			threads[i].RunFunc(RecorderThreadMain, i);
+		while(numThreadsFinished < cNumThreads)
+			rec.AcquireHierarchy();
+		for(int i = 0; i < cNumThreads; ++i)
+			threads[i].Stop();
+	}
+
+	Lock<StatsEventHierarchyNode> root = rec.AcquireHierarchy();
+	StatsEventHierarchyNode *all = root->FindChild("recorderTest.threads.all");
+	assert(all);
+	assert(InTimeOrder(*all));
+	int total = 0;
+	for(int i = 0; i < cNumThreads; ++i)
+	{
+		char str[64];
+		sprintf(str, "recorderTest.threads.t%d", i);
+		StatsEventHierarchyNode *node = root->FindChild(str);
+		assert(node);
+		assert(node->AccumulateTotalValueThisLevel() == (float)(i * node->AccumulateTotalCountThisLevel()));
+		total += node->AccumulateTotalCountThisLevel();
+	}
+	total += all->AccumulateTotalCountThisLevel();
+	assert(total + (int)rec.NumDroppedEvents() == 2 * cNumThreads * cEventsPerThread);
+	recorder = 0;
+
+	ENDTEST()
+}
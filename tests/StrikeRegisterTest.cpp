@@ -0,0 +1,51 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file StrikeRegisterTest.cpp
+	@brief Tests that StrikeRegister refuses the nonces seen in the current and the previous epoch. */
+
+#include "kNet/StrikeRegister.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+void StrikeRegisterTest()
+{
+	TEST("StrikeRegister")
+	StrikeRegister strikes(4);
+	assert(strikes.Insert(1, 10));
+	assert(strikes.Insert(2, 10));
+	assert(!strikes.Insert(1, 10));
+
+	// The nonces of the previous epoch are still refused, the ones from before it are not.
+	assert(!strikes.Insert(2, 11));
+	assert(strikes.Insert(3, 11));
+	assert(strikes.Size() == 3);
+	assert(strikes.Insert(1, 12));
+	assert(!strikes.Insert(3, 12));
+
+	// After a gap of more than one epoch, everything seen before is forgotten.
+	assert(strikes.Insert(3, 20));
+	assert(strikes.Size() == 1);
+
+	// A full epoch refuses the new nonces too.
+	assert(strikes.Insert(4, 20) && strikes.Insert(5, 20) && strikes.Insert(6, 20));
+	assert(!strikes.Insert(7, 20));
+	assert(strikes.Insert(7, 21));
+
+	strikes.Clear();
+	assert(strikes.Size() == 0 && strikes.Insert(7, 21));
+	ENDTEST()
+}
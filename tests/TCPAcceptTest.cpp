@@ -0,0 +1,83 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file TCPAcceptTest.cpp
+	@brief Tests that NetworkServer::Process() accepts all the TCP connections waiting in the accept queue at once. */
+
+#include <vector>
+
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPort = 47299;
+
+class ClientCollector : public INetworkServerListener
+{
+public:
+	std::vector<MessageConnection *> clients;
+
+	void NewConnectionEstablished(MessageConnection *connection) { clients.push_back(connection); }
+};
+
+} // ~unnamed namespace
+
+void TCPAcceptTest()
+{
+	TEST("TCPAccept")
+
+	ClientCollector listener;
+	Network serverNetwork;
+	NetworkServer *server = serverNetwork.StartServer(cServerPort, SocketOverTCP, &listener, true);
+	assert(server);
+
+	// The OS completes the handshakes, so the connections all wait in the accept queue of the server.
+	Network clientNetwork;
+	const int cNumConnections = 20;
+	Ptr(MessageConnection) connections[cNumConnections];
+	for(int i = 0; i < cNumConnections; ++i)
+	{
+		connections[i] = clientNetwork.Connect("127.0.0.1", cServerPort, SocketOverTCP, 0);
+		assert(connections[i]);
+	}
+
+	// The first Process() that sees them takes them all, instead of one per call.
+	PolledTimer timer(5000.f);
+	while(!timer.Test() && listener.clients.empty())
+	{
+		server->Process();
+		Clock::Sleep(1);
+	}
+	assert((int)listener.clients.size() == cNumConnections);
+	assert(server->NumConnections() == cNumConnections);
+	assert(server->NumAcceptBacklogs() == 0);
+	assert(server->NumAcceptQueueOverflows() == 0);
+
+	for(int i = 0; i < cNumConnections; ++i)
+	{
+		connections[i]->Close(0);
+		connections[i] = 0;
+	}
+	serverNetwork.StopServer();
+
+	ENDTEST()
+}
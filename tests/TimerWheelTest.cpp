@@ -0,0 +1,123 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file TimerWheelTest.cpp
+	@brief */
+
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#include "kNet/TimerWheel.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+void TimerWheelTest()
+{
+	using namespace kNet;
+
+	TEST("LSBIndex64")
+	assert(LSBIndex64(0) == -1);
+	for(int i = 0; i < 64; ++i)
+	{
+		assert(LSBIndex64((u64)1 << i) == i);
+		assert(LSBIndex64(((u64)-1) << i) == i);
+	}
+	ENDTEST()
+
+	TEST("TimerWheel")
+	TimerWheel wheel;
+	const u64 startTime = 123456789;
+	wheel.Reset(startTime);
+	assert(wheel.NumScheduled() == 0);
+	assert(wheel.MSecsUntilNextExpiry(startTime) == -1);
+
+	std::vector<int> expired;
+	wheel.Schedule(0, startTime + 10);
+	wheel.Schedule(1, startTime + 300);
+	wheel.Schedule(2, startTime + 20000);
+	assert(wheel.NumScheduled() == 3);
+	assert(wheel.MSecsUntilNextExpiry(startTime) == 10);
+	wheel.Advance(startTime + 9, expired);
+	assert(expired.empty());
+	wheel.Advance(startTime + 10, expired);
+	assert(expired.size() == 1 && expired[0] == 0);
+	assert(!wheel.IsScheduled(0));
+
+	// Rescheduling and canceling.
+	wheel.Schedule(1, startTime + 15);
+	wheel.Cancel(2);
+	assert(wheel.NumScheduled() == 1);
+	expired.clear();
+	wheel.Advance(startTime + 50000, expired);
+	assert(expired.size() == 1 && expired[0] == 1);
+	assert(wheel.NumScheduled() == 0);
+
+	// Compare against a brute force list of deadlines with a random sequence of operations.
+	const int numTimers = 200;
+	const u64 unscheduled = (u64)-1;
+	std::vector<u64> deadlines(numTimers, unscheduled);
+	u64 now = wheel.CurrentTime();
+	srand(42);
+	for(int round = 0; round < 20000; ++round)
+	{
+		const int id = rand() % numTimers;
+		const int op = rand() % 10;
+		if (op < 6)
+		{
+			// Mostly short timeouts, but also ones that land on the coarser levels and beyond the span of the wheel.
+			static const u64 ranges[] = { 20, 300, 20000, 1200000, 3000000 };
+			u64 deadline = now + (u64)rand() % ranges[rand() % 5];
+			wheel.Schedule(id, deadline);
+			deadlines[id] = std::max(deadline, now + 1);
+		}
+		else if (op < 7)
+		{
+			wheel.Cancel(id);
+			deadlines[id] = unscheduled;
+		}
+
+		u64 earliest = unscheduled;
+		for(int i = 0; i < numTimers; ++i)
+			earliest = std::min(earliest, deadlines[i]);
+
+		const int msecsToExpiry = wheel.MSecsUntilNextExpiry(now);
+		assert((msecsToExpiry == -1) == (earliest == unscheduled));
+		assert(msecsToExpiry == -1 || now + msecsToExpiry <= earliest);
+
+		// Advance either a little, to the next expiry, or a long way.
+		const int step = rand() % 4;
+		if (step == 0 && msecsToExpiry != -1)
+			now += msecsToExpiry;
+		else if (step == 1)
+			now += (u64)rand() % 100000;
+		else
+			now += (u64)rand() % 10;
+
+		expired.clear();
+		wheel.Advance(now, expired);
+		std::vector<int> expected;
+		for(int i = 0; i < numTimers; ++i)
+			if (deadlines[i] <= now)
+			{
+				expected.push_back(i);
+				deadlines[i] = unscheduled;
+			}
+		std::sort(expired.begin(), expired.end());
+		assert(expired == expected);
+		for(int i = 0; i < numTimers; ++i)
+			assert(wheel.IsScheduled(i) == (deadlines[i] != unscheduled));
+	}
+	ENDTEST()
+}
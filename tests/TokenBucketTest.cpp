@@ -0,0 +1,70 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file TokenBucketTest.cpp
+	@brief Tests that TokenBucket paces the consumed tokens to its rate and limits the bursts to its size. */
+
+#include "kNet/TokenBucket.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+void TokenBucketTest()
+{
+	TEST("TokenBucket")
+	const tick_t start = Clock::Tick();
+	const tick_t sec = Clock::TicksPerSec();
+
+	// An unlimited bucket never makes anyone wait.
+	TokenBucket bucket;
+	assert(!bucket.IsLimited());
+	bucket.Consume(1e9, start);
+	assert(bucket.TicksUntilAvailable(start) == 0);
+	assert(bucket.MSecsUntilAvailable(start) == 0);
+
+	// 1000 tokens/sec with room for 100. A fresh bucket allows the first send right away.
+	bucket.SetRate(1000.0, 100.0, start);
+	assert(bucket.IsLimited());
+	assert(bucket.TicksUntilAvailable(start) == 0);
+
+	// A send of 500 tokens puts the bucket in debt for half a second.
+	bucket.Consume(500.0, start);
+	assert(bucket.MSecsUntilAvailable(start) == 500);
+	assert(bucket.MSecsUntilAvailable(start + sec / 4) == 250);
+	assert(bucket.TicksUntilAvailable(start + sec / 2) == 0);
+	// The wait is rounded up, so that a sleeping sender never wakes up too early.
+	assert(bucket.MSecsUntilAvailable(start + sec / 2 - 1) == 1);
+
+	// Idle time only builds up a burst of the bucket size.
+	assert(bucket.TokensAt(start + 10 * sec) == 100.0);
+	bucket.Consume(150.0, start + 10 * sec);
+	assert(bucket.MSecsUntilAvailable(start + 10 * sec) == 50);
+
+	// Sending as fast as the bucket allows averages out to its rate.
+	tick_t now = start + 20 * sec;
+	int numSends = 0;
+	for(tick_t t = now; t < now + sec; t += sec / 10000)
+		if (bucket.TicksUntilAvailable(t) == 0)
+		{
+			bucket.Consume(10.0, t);
+			++numSends;
+		}
+	assert(numSends >= 100 && numSends <= 111);
+
+	// Lifting the limit lets everything through again.
+	bucket.SetRate(0, 0, now);
+	assert(!bucket.IsLimited());
+	assert(bucket.TicksUntilAvailable(now) == 0);
+	ENDTEST()
+}
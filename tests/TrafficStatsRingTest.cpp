@@ -0,0 +1,125 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file TrafficStatsRingTest.cpp
+	@brief Tests the traffic rates TrafficStatsRing computes, and that SeqLock readers always see a consistent value. */
+
+#include <cmath>
+
+#include "kNet/TrafficStatsRing.h"
+#include "kNet/SeqLock.h"
+#include "kNet/Thread.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+bool Near(float a, float b)
+{
+	return fabs(a - b) <= 1e-3f * (fabs(a) + fabs(b) + 1.f);
+}
+
+tick_t MSecs(int msecs)
+{
+	return (tick_t)msecs * Clock::TicksPerSec() / 1000;
+}
+
+struct Pair
+{
+	u32 a;
+	u32 b; ///< Always a * 3.
+};
+
+SeqLock<Pair> sharedPair;
+volatile bool writerDone = false;
+
+void SeqLockWriterMain()
+{
+	for(u32 i = 1; i <= 200000; ++i)
+	{
+		Pair p;
+		p.a = i;
+		p.b = i * 3;
+		sharedPair.Store(p);
+	}
+	writerDone = true;
+}
+
+}
+
+void TrafficStatsRingTest()
+{
+	TEST("TrafficStatsRing")
+
+	TrafficStatsRing ring;
+	const tick_t start = MSecs(1000 * 1000);
+
+	// A single event gives no rate.
+	ring.AddInbound(start, 500, 1, 2);
+	ConnectionTrafficRates rates = ring.ComputeRates(start, 5000);
+	assert(rates.bytesInPerSec == 0.f);
+
+	// 2000 bytes over two seconds, in 100 msec steps.
+	for(int i = 1; i < 20; ++i)
+		ring.AddInbound(start + MSecs(i * 100), 500, 1, 2);
+	ring.AddOutbound(start + MSecs(1950), 1000, 4, 8);
+	rates = ring.ComputeRates(start + MSecs(1950), 5000);
+	assert(Near(rates.bytesInPerSec, 20 * 500 / 2.f));
+	assert(Near(rates.packetsInPerSec, 20 / 2.f));
+	assert(Near(rates.msgsInPerSec, 40 / 2.f));
+	assert(Near(rates.bytesOutPerSec, 1000 / 2.f));
+	assert(Near(rates.packetsOutPerSec, 4 / 2.f));
+	assert(Near(rates.msgsOutPerSec, 8 / 2.f));
+
+	// A short burst is averaged over at least a second.
+	TrafficStatsRing burst;
+	burst.AddOutbound(start, 100, 1, 1);
+	burst.AddOutbound(start + MSecs(10), 100, 1, 1);
+	rates = burst.ComputeRates(start + MSecs(10), 5000);
+	assert(Near(rates.bytesOutPerSec, 200.f));
+
+	// The traffic older than the window is not counted, even after the ring has wrapped around.
+	rates = ring.ComputeRates(start + MSecs(8000), 5000);
+	assert(rates.bytesInPerSec == 0.f && rates.bytesOutPerSec == 0.f);
+	const tick_t later = start + MSecs(TrafficStatsRing::cNumBuckets * TrafficStatsRing::cBucketMSecs * 3);
+	ring.AddInbound(later, 100, 1, 1);
+	ring.AddInbound(later + MSecs(100), 100, 1, 1);
+	rates = ring.ComputeRates(later + MSecs(100), 5000);
+	assert(Near(rates.bytesInPerSec, 200.f));
+	assert(rates.bytesOutPerSec == 0.f);
+
+	ring.Clear();
+	rates = ring.ComputeRates(later + MSecs(100), 5000);
+	assert(rates.bytesInPerSec == 0.f);
+
+	// The readers of a SeqLock never see a half-written value.
+	Thread writer;
+	writer.RunFunc(SeqLockWriterMain);
+	u32 latest = 0;
+	int numReads = 0;
+	while(!writerDone || numReads == 0)
+	{
+		const Pair p = sharedPair.Load();
+		assert(p.b == p.a * 3);
+		assert(p.a >= latest);
+		latest = p.a;
+		++numReads;
+	}
+	writer.Stop();
+	assert(sharedPair.Load().a == 200000);
+
+	ENDTEST()
+}
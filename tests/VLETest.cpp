@@ -16,8 +16,11 @@
 	@brief */
 
 #include <string>
+#include <vector>
+#include <iostream>
 
 #include "kNet/DebugMemoryLeakCheck.h"
+#include "kNet/Clock.h"
 #include "kNet/DataSerializer.h"
 #include "kNet/DataDeserializer.h"
 
@@ -45,10 +48,125 @@ void TestVLE(unsigned long step1 = 1, unsigned long step2 = 1, unsigned long ste
 	}
 }
 
+unsigned long randu32();
+
+/// Returns random values of which roughly a third fall in each of the encoded lengths of the given VLE type.
+template<typename VLEType>
+std::vector<u32> RandomVLEValues(size_t count)
+{
+	std::vector<u32> values(count);
+	for(size_t i = 0; i < count; ++i)
+	{
+		const u32 value = (u32)randu32();
+		switch(rand() % 3)
+		{
+		case 0: values[i] = value % (VLEType::maxValue1 + 1); break;
+		case 1: values[i] = value % (VLEType::maxValue / 2 + 1); break;
+		default: values[i] = VLEType::maxValue - value % (VLEType::maxValue / 4 + 1); break;
+		}
+	}
+	return values;
+}
+
+/// Checks that AddVLEArray writes the same bytes as AddVLE does, and that ReadVLEArray reads them back.
+template<typename VLEType>
+void TestVLEArray()
+{
+	for(int round = 0; round < 100; ++round)
+	{
+		const std::vector<u32> values = RandomVLEValues<VLEType>(1 + rand() % 500);
+		const int bitOffset = round % 8;
+		DataSerializer scalar(values.size() * 4 + 1);
+		DataSerializer array(values.size() * 4 + 1);
+		scalar.AppendBits(0x55, bitOffset);
+		array.AppendBits(0x55, bitOffset);
+		for(size_t i = 0; i < values.size(); ++i)
+			scalar.AddVLE<VLEType>(values[i]);
+		array.AddVLEArray<VLEType>(&values[0], values.size());
+		assert(scalar.BitsFilled() == array.BitsFilled());
+		assert(memcmp(scalar.GetData(), array.GetData(), scalar.BytesFilled()) == 0);
+
+		DataDeserializer dd(array.GetData(), array.BytesFilled());
+		dd.SkipBits(bitOffset);
+		std::vector<u32> readValues(values.size());
+		dd.ReadVLEArray<VLEType>(&readValues[0], readValues.size());
+		assert(readValues == values);
+		assert(dd.BitsLeft() < 8);
+
+		// And one more value than there is in the stream.
+		DataDeserializer tooShort(array.GetData(), array.BytesFilled());
+		tooShort.SkipBits(bitOffset);
+		readValues.push_back(0);
+		bool threw = false;
+		try
+		{
+			tooShort.ReadVLEArray<VLEType>(&readValues[0], readValues.size());
+		} catch(const NetException &)
+		{
+			threw = true;
+		}
+		assert(threw);
+	}
+
+	const u32 tooLarge = VLEType::maxValue + 1;
+	DataSerializer ds(16);
+	bool threw = false;
+	try
+	{
+		ds.AddVLEArray<VLEType>(&tooLarge, 1);
+	} catch(const NetException &)
+	{
+		threw = true;
+	}
+	assert(threw);
+}
+
+/// Compares the speed of the array functions to the scalar ones.
+template<typename VLEType>
+void VLEArrayBenchmark(const char *typeName)
+{
+	const std::vector<u32> values = RandomVLEValues<VLEType>(100000);
+	DataSerializer ds(values.size() * 4);
+
+	tick_t start = Clock::Tick();
+	for(size_t i = 0; i < values.size(); ++i)
+		ds.AddVLE<VLEType>(values[i]);
+	const double scalarMSecs = Clock::MillisecondsSinceD(start);
+
+	ds.ResetFill();
+	start = Clock::Tick();
+	ds.AddVLEArray<VLEType>(&values[0], values.size());
+	const double arrayMSecs = Clock::MillisecondsSinceD(start);
+
+	std::vector<u32> readValues(values.size());
+	start = Clock::Tick();
+	DataDeserializer scalarReader(ds.GetData(), ds.BytesFilled());
+	for(size_t i = 0; i < readValues.size(); ++i)
+		readValues[i] = scalarReader.ReadVLE<VLEType>();
+	const double scalarReadMSecs = Clock::MillisecondsSinceD(start);
+
+	start = Clock::Tick();
+	DataDeserializer arrayReader(ds.GetData(), ds.BytesFilled());
+	arrayReader.ReadVLEArray<VLEType>(&readValues[0], readValues.size());
+	const double arrayReadMSecs = Clock::MillisecondsSinceD(start);
+	assert(readValues == values);
+
+	std::cout << typeName << ": encoding " << values.size() << " values took " << scalarMSecs << " msecs with AddVLE, "
+		<< arrayMSecs << " msecs with AddVLEArray. Decoding took " << scalarReadMSecs << " msecs with ReadVLE, "
+		<< arrayReadMSecs << " msecs with ReadVLEArray." << std::endl;
+}
+
 void VLETest()
 {
 //	TestVLE<VLE8_16_32>(1, 100, 100000);
 	TestVLE<VLE8_16>();
+
+	TestVLEArray<VLE8_16>();
+	TestVLEArray<VLE8_16_32>();
+	TestVLEArray<VLE8_32>();
+	TestVLEArray<VLE16_32>();
+	VLEArrayBenchmark<VLE8_16>("VLE8_16");
+	VLEArrayBenchmark<VLE8_16_32>("VLE8_16_32");
 //	TestVLE<VLE8_32>(1,1000);
 //	TestVLE<VLE16_32>(1,1000);
 }
@@ -0,0 +1,92 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file VersionedSnapshotTest.cpp
+	@brief Tests that readers of VersionedSnapshot see consistent versions while a writer publishes new ones. */
+
+#include <vector>
+
+#include "kNet/VersionedSnapshot.h"
+#include "kNet/Thread.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+typedef VersionedSnapshot<std::vector<int> > IntSnapshot;
+
+IntSnapshot *snapshot = 0;
+const int numReaderThreads = 4;
+volatile bool readerFailed = false;
+
+/// Each published version of the vector holds its own version number as many times as the number itself.
+void SnapshotReaderMain(Thread *me)
+{
+	u32 lastNumber = 0;
+	while(!me->ShouldQuit())
+	{
+		IntSnapshot::Ref ref = snapshot->Acquire();
+		if (ref.Number() < lastNumber || ref->size() != ref.Number())
+			readerFailed = true;
+		for(size_t i = 0; i < ref->size(); ++i)
+			if ((*ref)[i] != (int)ref.Number())
+				readerFailed = true;
+		lastNumber = ref.Number();
+	}
+}
+}
+
+void VersionedSnapshotTest()
+{
+	TEST("VersionedSnapshot")
+	snapshot = new IntSnapshot();
+	assert(snapshot->Acquire()->empty());
+	assert(snapshot->Acquire().Number() == 0);
+
+	// A reference keeps its version unchanged and alive while newer versions are published.
+	std::vector<int> value(1, 1);
+	snapshot->Publish(value);
+	IntSnapshot::Ref old = snapshot->Acquire();
+	value.assign(2, 2);
+	snapshot->Publish(value);
+	assert(old.Number() == 1 && old->size() == 1);
+	assert(snapshot->Acquire().Number() == 2);
+	assert(snapshot->NumRetired() == 1);
+	old.Reset();
+	snapshot->ReleaseRetired();
+	assert(snapshot->NumRetired() == 0);
+
+	Thread readers[numReaderThreads];
+	readerFailed = false;
+	for(int i = 0; i < numReaderThreads; ++i)
+		readers[i].RunFunc(SnapshotReaderMain, &readers[i]);
+
+	for(int n = 3; n < 2000; ++n)
+	{
+		value.assign(n, n);
+		snapshot->Publish(value);
+	}
+
+	for(int i = 0; i < numReaderThreads; ++i)
+		readers[i].Stop();
+	assert(!readerFailed);
+
+	snapshot->ReleaseRetired();
+	assert(snapshot->NumRetired() == 0);
+	delete snapshot;
+	snapshot = 0;
+	ENDTEST()
+}
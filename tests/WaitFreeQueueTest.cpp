@@ -0,0 +1,145 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+/** @file WaitFreeQueueTest.cpp
+	@brief Tests the single and batch operations of WaitFreeQueue, alone and between two threads. */
+
+#include "kNet/WaitFreeQueue.h"
+#include "kNet/Thread.h"
+#include "kNet/Clock.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const int cNumStreamedItems = 200000;
+
+WaitFreeQueue<int> *streamQueue = 0;
+
+/// Inserts the numbers 0, 1, 2, ... into streamQueue in batches of varying sizes.
+void ProduceStream()
+{
+	int batch[37];
+	int next = 0;
+	int batchSize = 1;
+	while(next < cNumStreamedItems)
+	{
+		int numValues = 0;
+		while(numValues < batchSize && next + numValues < cNumStreamedItems)
+		{
+			batch[numValues] = next + numValues;
+			++numValues;
+		}
+		int numInserted = 0;
+		while(numInserted < numValues)
+		{
+			if (next % 3 == 0 && numValues - numInserted == 1)
+				numInserted += streamQueue->Insert(batch[numInserted]) ? 1 : 0;
+			else
+				numInserted += streamQueue->InsertBatch(batch + numInserted, numValues - numInserted);
+		}
+		next += numValues;
+		batchSize = batchSize % 37 + 1;
+	}
+}
+
+}
+
+void WaitFreeQueueTest()
+{
+	TEST("WaitFreeQueue")
+
+	// The queue holds one item less than its size.
+	WaitFreeQueue<int> queue(8);
+	assert(queue.Capacity() == 7);
+	assert(queue.Front() == 0);
+	int values[10] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+	assert(queue.InsertBatch(values, 10) == 7);
+	assert(queue.Size() == 7);
+	assert(!queue.Insert(100));
+	assert(queue.BeginInsert() == 0);
+
+	int popped[10];
+	assert(queue.PopBatch(popped, 3) == 3);
+	assert(popped[0] == 0 && popped[1] == 1 && popped[2] == 2);
+	assert(*queue.Front() == 3);
+
+	// The next batch wraps around the end of the ring, and is cut to the free space.
+	assert(queue.InsertBatch(values + 7, 3) == 3);
+	assert(queue.InsertBatch(values, 1) == 0);
+	assert(queue.Size() == 7);
+	assert(queue.PopBatch(popped, 10) == 7);
+	for(int i = 0; i < 7; ++i)
+		assert(popped[i] == i + 3);
+	assert(queue.Size() == 0);
+	assert(queue.PopBatch(popped, 10) == 0);
+	assert(queue.Front() == 0);
+
+	// The single-item operations see the items of the batch operations.
+	assert(queue.InsertBatch(values, 2) == 2);
+	assert(queue.Insert(42));
+	assert(queue.TakeFront() == 0);
+	assert(queue.PopBatch(popped, 1) == 1 && popped[0] == 1);
+	assert(*queue.Front() == 42);
+	queue.PopFront();
+	assert(queue.Size() == 0);
+
+	// Resizing and erasing keep the items and the room left.
+	assert(queue.InsertBatch(values, 6) == 6);
+	queue.Resize(16);
+	assert(queue.Capacity() == 15 && queue.Size() == 6);
+	queue.EraseItemAt(4);
+	assert(queue.InsertBatch(values + 6, 4) == 4);
+	assert(queue.PopBatch(popped, 10) == 9);
+	assert(popped[3] == 3 && popped[4] == 5 && popped[8] == 9);
+	queue.Insert(7);
+	queue.Clear();
+	assert(queue.Front() == 0 && queue.Size() == 0);
+
+	// A producer and a consumer thread stream items through a small queue. Every item arrives, in order.
+	WaitFreeQueue<int> stream(64);
+	streamQueue = &stream;
+	Thread producer;
+	producer.RunFunc(ProduceStream);
+	int expected = 0;
+	int batchSize = 1;
+	const tick_t startTick = Clock::Tick();
+	while(expected < cNumStreamedItems && Clock::SecondsSinceD(startTick) < 30.0)
+	{
+		if (batchSize == 5)
+		{
+			if (stream.Front())
+			{
+				assert(stream.TakeFront() == expected);
+				++expected;
+			}
+		}
+		else
+		{
+			const int numPopped = stream.PopBatch(popped, batchSize);
+			for(int i = 0; i < numPopped; ++i)
+				assert(popped[i] == expected + i);
+			expected += numPopped;
+		}
+		batchSize = batchSize % 10 + 1;
+	}
+	producer.Stop();
+	assert(expected == cNumStreamedItems);
+	assert(stream.Size() == 0);
+	streamQueue = 0;
+
+	ENDTEST()
+}
@@ -0,0 +1,139 @@
+/* Copyright The kNet Project.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/** @file WorkerThreadBroadcastTest.cpp
+	@brief Tests that the broadcasts handed over to the worker threads reach each client of the server once. */
+
+#include <map>
+#include <vector>
+#include <cstring>
+
+#include "kNet/Network.h"
+#include "kNet/NetworkServer.h"
+#include "kNet/INetworkServerListener.h"
+#include "kNet/PolledTimer.h"
+#include "tassert.h"
+#include "kNet/DebugMemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace
+{
+
+const unsigned short cServerPort = 47297;
+
+const message_id_t cMsgNews = 100;
+
+class ClientCollector : public INetworkServerListener
+{
+public:
+	std::vector<MessageConnection *> clients;
+
+	void NewConnectionEstablished(MessageConnection *connection) { clients.push_back(connection); }
+};
+
+/// Counts the intact news messages each connection receives.
+class NewsCounter : public IMessageHandler
+{
+public:
+	std::map<MessageConnection *, int> numNews;
+
+	void HandleMessage(MessageConnection *source, packet_id_t, message_id_t messageId, const char *data, size_t numBytes)
+	{
+		if (messageId == cMsgNews && numBytes == 5 && memcmp(data, "news!", 5) == 0)
+			++numNews[source];
+	}
+};
+
+} // ~unnamed namespace
+
+void WorkerThreadBroadcastTest()
+{
+	TEST("WorkerThreadBroadcast")
+
+	ClientCollector listener;
+	Network serverNetwork;
+	serverNetwork.SetMaxWorkerThreads(3);
+	NetworkServer *server = serverNetwork.StartServer(cServerPort, SocketOverUDP, &listener, true);
+	assert(server);
+	server->SetWorkerThreadBroadcasts(true);
+	assert(server->WorkerThreadBroadcasts());
+
+	Network clientNetwork;
+	NewsCounter news;
+	const int cNumConnections = 6;
+	Ptr(MessageConnection) connections[cNumConnections];
+	for(int i = 0; i < cNumConnections; ++i)
+	{
+		connections[i] = clientNetwork.Connect("127.0.0.1", cServerPort, SocketOverUDP, &news);
+		assert(connections[i]);
+	}
+	PolledTimer connectTimer(5000.f);
+	while(!connectTimer.Test() && (int)listener.clients.size() < cNumConnections)
+	{
+		server->Process();
+		Clock::Sleep(1);
+	}
+	assert((int)listener.clients.size() == cNumConnections);
+	// The clients are spread over several worker threads, each of which queues the broadcasts to its own.
+	assert(serverNetwork.NumWorkerThreads() > 1);
+
+	// The excluded client gets none of the broadcasts, the others get each of them once.
+	const int cNumBroadcasts = 10;
+	MessageConnection *excluded = listener.clients[0];
+	for(int i = 0; i < cNumBroadcasts; ++i)
+		server->BroadcastMessage(cMsgNews, true, true, 0, 0, "news!", 5, excluded);
+
+	PolledTimer timer(5000.f);
+	int numReceived = 0;
+	while(!timer.Test() && numReceived < (cNumConnections - 1) * cNumBroadcasts)
+	{
+		server->Process();
+		numReceived = 0;
+		for(int i = 0; i < cNumConnections; ++i)
+		{
+			connections[i]->Process();
+			numReceived += news.numNews[connections[i].ptr()];
+		}
+		Clock::Sleep(1);
+	}
+	// Give the excluded client time to receive anything sent to it by mistake.
+	PolledTimer settleTimer(100.f);
+	while(!settleTimer.Test())
+	{
+		for(int i = 0; i < cNumConnections; ++i)
+			connections[i]->Process();
+		Clock::Sleep(1);
+	}
+
+	int numExcluded = 0;
+	for(int i = 0; i < cNumConnections; ++i)
+	{
+		const int n = news.numNews[connections[i].ptr()];
+		if (n == 0)
+			++numExcluded;
+		else
+			assert(n == cNumBroadcasts);
+	}
+	assert(numExcluded == 1);
+
+	for(int i = 0; i < cNumConnections; ++i)
+	{
+		connections[i]->Close(0);
+		connections[i] = 0;
+	}
+	serverNetwork.StopServer();
+
+	ENDTEST()
+}
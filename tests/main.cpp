@@ -21,7 +21,65 @@ void VLETest();
 void DataSerializerTest();
 void MaxHeapTest();
 void EventTest();
+void EventArrayTest();
 void LockFreePoolAllocatorTest();
+void TimerWheelTest();
+void PacketIDWindowTest();
+void PacketIDRingTest();
+void ReorderRingTest();
+void MessageIDDictionaryTest();
+void MessageNumberWindowTest();
+void StrikeRegisterTest();
+void HostResolverTest();
+void DatagramBufferTest();
+void EndPointHashTableTest();
+void InterestGridTest();
+void MessageDataAllocatorTest();
+void NetworkMessageTest();
+void VersionedSnapshotTest();
+void CongestionControlTest();
+void TokenBucketTest();
+void EgressSchedulerTest();
+void OutboundMessageQueueTest();
+void ObsoleteMessageTest();
+void ContentIDHashTableTest();
+void FragmentedTransferManagerTest();
+void LZ4CodecTest();
+void DeltaEncodingTest();
+void DatagramCipherTest();
+void CRC32CTest();
+void RingBufferTest();
+void SocketBufferTuningTest();
+void MessageViewTest();
+void MessageSchemaTest();
+void MessageListBinaryTest();
+void StatsEventRecorderTest();
+void TrafficStatsRingTest();
+void LatencyHistogramTest();
+void MetricsExporterTest();
+void MessageTracerTest();
+void NetworkLoggingTest();
+void ClockTest();
+void WaitFreeQueueTest();
+void MPSCQueueTest();
+void SegmentedQueueTest();
+void SourceAddressFilterTest();
+void SharedMemoryChannelTest();
+void MulticastChannelTest();
+void NetworkSimulatorTest();
+void PacketCaptureTest();
+void CoroutineSchedulerTest();
+void MessageAckTest();
+void SharedUDPClientSocketTest();
+void ConnectedUDPServerSocketTest();
+void WorkerThreadBroadcastTest();
+void MessageFrameArenaTest();
+void TCPAcceptTest();
+void ServerHandOffTest();
+void ECNTest();
+void FairProcessTest();
+void DeserializeArenaTest();
+void SendCoalescingTest();
 
 BottomMemoryAllocator bma;
 
@@ -33,5 +91,63 @@ int main()
 	MaxHeapTest();
 	VLETest();
 	EventTest();
+	EventArrayTest();
 	LockFreePoolAllocatorTest();
+	TimerWheelTest();
+	PacketIDWindowTest();
+	PacketIDRingTest();
+	ReorderRingTest();
+	MessageIDDictionaryTest();
+	MessageNumberWindowTest();
+	StrikeRegisterTest();
+	HostResolverTest();
+	DatagramBufferTest();
+	EndPointHashTableTest();
+	InterestGridTest();
+	MessageDataAllocatorTest();
+	NetworkMessageTest();
+	VersionedSnapshotTest();
+	CongestionControlTest();
+	TokenBucketTest();
+	EgressSchedulerTest();
+	OutboundMessageQueueTest();
+	ObsoleteMessageTest();
+	ContentIDHashTableTest();
+	FragmentedTransferManagerTest();
+	LZ4CodecTest();
+	DeltaEncodingTest();
+	DatagramCipherTest();
+	CRC32CTest();
+	RingBufferTest();
+	SocketBufferTuningTest();
+	MessageViewTest();
+	MessageSchemaTest();
+	MessageListBinaryTest();
+	StatsEventRecorderTest();
+	TrafficStatsRingTest();
+	LatencyHistogramTest();
+	MetricsExporterTest();
+	MessageTracerTest();
+	NetworkLoggingTest();
+	ClockTest();
+	WaitFreeQueueTest();
+	MPSCQueueTest();
+	SegmentedQueueTest();
+	SourceAddressFilterTest();
+	SharedMemoryChannelTest();
+	MulticastChannelTest();
+	NetworkSimulatorTest();
+	PacketCaptureTest();
+	CoroutineSchedulerTest();
+	MessageAckTest();
+	SharedUDPClientSocketTest();
+	ConnectedUDPServerSocketTest();
+	WorkerThreadBroadcastTest();
+	MessageFrameArenaTest();
+	TCPAcceptTest();
+	ServerHandOffTest();
+	ECNTest();
+	FairProcessTest();
+	DeserializeArenaTest();
+	SendCoalescingTest();
 }